@@ -0,0 +1,70 @@
+--
+-- A stored procedure to allocate an IP address in a single round trip.
+--
+-- It does the work of allocate_find and allocate_update in one call,
+-- and returns the allocated address, so there is no transaction held
+-- open between the server and the database.
+--
+-- To use it, load this file, and set in ippool/mysql/queries.conf:
+--
+--	allocate_single = "\
+--		CALL fr_allocate_framedipaddress( \
+--			'%{control:Pool-Name}', \
+--			'%{User-Name}', \
+--			'%{Calling-Station-Id}', \
+--			'%{NAS-IP-Address}', \
+--			'${pool_key}', \
+--			${lease_duration})"
+--
+-- Requires MySQL 8.0 or later for SKIP LOCKED.
+--
+DELIMITER $$
+
+DROP PROCEDURE IF EXISTS fr_allocate_framedipaddress;
+CREATE PROCEDURE fr_allocate_framedipaddress (
+	IN v_pool_name VARCHAR(30),
+	IN v_username VARCHAR(64),
+	IN v_callingstationid VARCHAR(30),
+	IN v_nasipaddress VARCHAR(15),
+	IN v_pool_key VARCHAR(30),
+	IN v_lease_duration INT
+)
+SQL SECURITY INVOKER
+proc:BEGIN
+	DECLARE r_address VARCHAR(15);
+
+	START TRANSACTION;
+
+	-- Prefer the address the user had last time, then any free one.
+	-- SKIP LOCKED means concurrent allocations don't queue on the same row.
+	SELECT framedipaddress INTO r_address
+	FROM radippool
+	WHERE pool_name = v_pool_name
+		AND (expiry_time < NOW() OR expiry_time IS NULL)
+	ORDER BY
+		(username <> v_username),
+		(callingstationid <> v_callingstationid),
+		expiry_time
+	LIMIT 1
+	FOR UPDATE SKIP LOCKED;
+
+	IF r_address IS NULL THEN
+		COMMIT;
+		LEAVE proc;
+	END IF;
+
+	UPDATE radippool
+	SET
+		nasipaddress = v_nasipaddress,
+		pool_key = v_pool_key,
+		callingstationid = v_callingstationid,
+		username = v_username,
+		expiry_time = NOW() + INTERVAL v_lease_duration SECOND
+	WHERE framedipaddress = r_address;
+
+	COMMIT;
+
+	SELECT r_address;
+END$$
+
+DELIMITER ;
@@ -23,6 +23,8 @@ HEADERS	= \
 	event.h \
 	hash.h \
 	heap.h \
+	atomic_queue.h \
+	thread_channel.h \
 	libradius.h \
 	md4.h \
 	md5.h \
@@ -36,10 +38,15 @@ HEADERS	= \
 	realms.h \
 	sha1.h \
 	stats.h \
+	trace.h \
+	profile.h \
+	fiber.h \
+	probes.h \
 	sysutmp.h \
 	token.h \
 	udpfromto.h \
 	base64.h \
+	str.h \
 	map.h \
 	udp.h \
 	tcp.h \
@@ -0,0 +1,65 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_ATOMIC_QUEUE_H
+#define _FR_ATOMIC_QUEUE_H
+/**
+ * $Id$
+ *
+ * @file include/atomic_queue.h
+ * @brief Structures and prototypes for thread-safe bounded queues.
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+RCSIDH(atomic_queue_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef HAVE_STDATOMIC_H
+typedef struct fr_atomic_queue_t fr_atomic_queue_t;
+
+fr_atomic_queue_t	*fr_atomic_queue_create(TALLOC_CTX *ctx, size_t size);
+bool			fr_atomic_queue_push(fr_atomic_queue_t *aq, void *data);
+bool			fr_atomic_queue_pop(fr_atomic_queue_t *aq, void **p_data);
+size_t			fr_atomic_queue_size(fr_atomic_queue_t *aq);
+size_t			fr_atomic_queue_num_elements(fr_atomic_queue_t *aq);
+
+typedef struct fr_spsc_queue_t fr_spsc_queue_t;
+
+fr_spsc_queue_t		*fr_spsc_queue_create(TALLOC_CTX *ctx, size_t size);
+bool			fr_spsc_queue_push(fr_spsc_queue_t *sq, void *data);
+size_t			fr_spsc_queue_push_batch(fr_spsc_queue_t *sq, void * const *data, size_t num);
+bool			fr_spsc_queue_pop(fr_spsc_queue_t *sq, void **p_data);
+size_t			fr_spsc_queue_pop_batch(fr_spsc_queue_t *sq, void **out, size_t max);
+size_t			fr_spsc_queue_size(fr_spsc_queue_t *sq);
+size_t			fr_spsc_queue_num_elements(fr_spsc_queue_t *sq);
+
+typedef struct fr_mpsc_queue_t fr_mpsc_queue_t;
+
+fr_mpsc_queue_t		*fr_mpsc_queue_create(TALLOC_CTX *ctx, size_t size);
+bool			fr_mpsc_queue_push(fr_mpsc_queue_t *mq, void *data);
+size_t			fr_mpsc_queue_push_batch(fr_mpsc_queue_t *mq, void * const *data, size_t num);
+bool			fr_mpsc_queue_pop(fr_mpsc_queue_t *mq, void **p_data);
+size_t			fr_mpsc_queue_pop_batch(fr_mpsc_queue_t *mq, void **out, size_t max);
+size_t			fr_mpsc_queue_size(fr_mpsc_queue_t *mq);
+size_t			fr_mpsc_queue_num_elements(fr_mpsc_queue_t *mq);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FR_ATOMIC_QUEUE_H */
@@ -49,9 +49,35 @@ typedef enum fr_channel_result_t {
 typedef enum fr_channel_notify_t {
 	FR_NOTIFY_NONE = 0,
 	FR_NOTIFY_BUFFERED,
-	FR_NOTIFY_UNBUFFERED
+	FR_NOTIFY_UNBUFFERED,
+	FR_NOTIFY_STATS				//!< Counters, sent after "stats subscribe".
 } fr_channel_notify_t;
 
+/*
+ *	FR_NOTIFY_STATS payloads are, in network byte order:
+ *
+ *	uint32	FR_NOTIFY_STATS
+ *	uint8	flags
+ *	uint8	reserved, zero
+ *	uint16	number of counters which follow
+ *	uint32	interval, in seconds
+ *	uint64	when the counters were read, in microseconds since the epoch
+ *
+ *	then for each counter:
+ *
+ *	uint8	group, fr_stats_global_t
+ *	uint8	counter, fr_stats_counter_t
+ *	uint64	value
+ *
+ *	The first message after subscribing has FR_NOTIFY_STATS_ABSOLUTE
+ *	set, and holds the totals.  Later messages hold how much each
+ *	counter has increased since the previous message.  Counters
+ *	which are zero are left out.
+ */
+#define FR_NOTIFY_STATS_ABSOLUTE	(0x01)
+#define FR_NOTIFY_STATS_HDR_LEN		(20)
+#define FR_NOTIFY_STATS_ENTRY_LEN	(10)
+
 
 ssize_t fr_channel_drain(int fd, fr_channel_type_t *pchannel, void *inbuf, size_t buflen, uint8_t **outbuf, size_t have_read);
 ssize_t fr_channel_read(int fd, fr_channel_type_t *pchannel, void *buffer, size_t buflen);
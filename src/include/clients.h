@@ -29,6 +29,10 @@ RCSIDH(clients_h, "$Id$")
 #ifdef __cplusplus
 extern "C" {
 #endif
+#ifdef WITH_DYNAMIC_CLIENTS
+typedef struct client_lookup client_lookup_t;
+#endif
+
 /** Describes a host allowed to send packets to the server
  *
  */
@@ -68,6 +72,12 @@ typedef struct radclient {
 
 	struct timeval		response_window;	//!< How long the client has to respond.
 
+	bool			low_priority;		//!< Shed requests from this client first when
+							//!< the server is overloaded.
+	uint32_t		queue_weight;		//!< How many requests the "fair" queue takes from
+							//!< this client in each turn.
+	fr_token_bucket_t	pps_limit;		//!< Packets from this client, before decoding.
+
 	int			proto;			//!< Protocol number.
 #ifdef WITH_TCP
 	fr_socket_limit_t	limit;			//!< Connections per client (TCP clients only).
@@ -89,6 +99,12 @@ typedef struct radclient {
 							//!< clients.
 
 	bool			rate_limit;		//!< Where addition of clients should be rate limited.
+
+	uint32_t		negative_lifetime;	//!< How long to ignore sources for which no client
+							//!< was found.
+	fr_token_bucket_t	lookup_limit;		//!< Lookups through client_server, per second.
+	bool			lookup_async;		//!< Run client_server in a separate thread.
+	client_lookup_t		*lookup;		//!< Negative cache, and lookups in progress.
 #endif
 
 #ifdef WITH_COA
@@ -148,6 +164,10 @@ bool		client_add(RADCLIENT_LIST *clients, RADCLIENT *client);
 #ifdef WITH_DYNAMIC_CLIENTS
 void		client_delete(RADCLIENT_LIST *clients, RADCLIENT *client);
 
+bool		client_lookup_start(RADCLIENT *network, fr_ipaddr_t const *ipaddr);
+
+void		client_lookup_done(RADCLIENT *network, fr_ipaddr_t const *ipaddr, bool found);
+
 RADCLIENT	*client_afrom_request(RADCLIENT_LIST *clients, REQUEST *request);
 #endif
 
@@ -163,6 +183,8 @@ RADCLIENT	*client_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr,
 
 RADCLIENT	*client_findbynumber(RADCLIENT_LIST const *clients, int number);
 
+int		client_list_walk(RADCLIENT_LIST const *clients, rb_walker_t callback, void *ctx);
+
 RADCLIENT	*client_find_old(fr_ipaddr_t const *ipaddr);
 
 bool		client_add_dynamic(RADCLIENT_LIST *clients, RADCLIENT *master, RADCLIENT *c);
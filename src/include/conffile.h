@@ -314,6 +314,7 @@ CONF_SECTION	*cf_section_sub_find(CONF_SECTION const *, char const *name);
 CONF_SECTION	*cf_section_sub_find_name2(CONF_SECTION const *, char const *name1, char const *name2);
 char const 	*cf_section_value_find(CONF_SECTION const *, char const *attr);
 CONF_SECTION	*cf_top_section(CONF_SECTION *cs);
+bool		cf_section_equal(CONF_SECTION const *a, CONF_SECTION const *b);
 
 void *cf_data_find(CONF_SECTION const *, char const *);
 int cf_data_add(CONF_SECTION *, char const *, void *, void (*)(void *));
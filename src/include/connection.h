@@ -55,6 +55,10 @@ typedef struct fr_connection_pool_state {
 	uint32_t       	num;			//!< Number of connections in the pool.
 	uint32_t	active;	 		//!< Number of currently reserved connections.
 
+	uint64_t	waited;			//!< Number of reservations which waited for a connection
+						//!< to be opened in the background.
+	uint64_t	wait_usec;		//!< Total time spent waiting, in microseconds.
+
 	bool		reconnecting;		//!< We are currently reconnecting the pool.
 } fr_connection_pool_state_t;
 
@@ -104,7 +108,9 @@ typedef void *(*fr_connection_create_t)(TALLOC_CTX *ctx, void *opaque, struct ti
  *
  * @note NULL may be passed to fr_connection_pool_init, if there is no way to check
  * the state of a connection handle.
- * @note Not currently use by connection pool manager.
+ * @note Called by the pool's manager thread on idle connections, if the pool's
+ *	"health_check_interval" is set.  Must not block for longer than the
+ *	connection's timeouts allow.
  * @param[in] opaque pointer passed to fr_connection_pool_init.
  * @param[in] connection handle returned by fr_connection_create_t.
  * @return
@@ -113,6 +119,22 @@ typedef void *(*fr_connection_create_t)(TALLOC_CTX *ctx, void *opaque, struct ti
  */
 typedef int (*fr_connection_alive_t)(void *opaque, void *connection);
 
+/** Abort an operation which is blocked on a connection handle
+ *
+ * Called by the main thread when a request times out whilst its worker
+ * thread is blocked on the connection.  The worker is still using the
+ * handle, so this must not block, and must be safe to call at the same
+ * time as whatever the worker is doing, e.g. shutting down the socket.
+ *
+ * The connection is closed once the worker releases it.
+ *
+ * @note NULL may be passed to fr_connection_pool_cancel_func, if operations
+ *	on the connection can't be aborted.
+ * @param[in] opaque pointer passed to fr_connection_pool_init.
+ * @param[in] connection handle returned by fr_connection_create_t.
+ */
+typedef void (*fr_connection_cancel_t)(void *opaque, void *connection);
+
 /*
  *	Pool allocation/initialisation
  */
@@ -142,6 +164,8 @@ fr_connection_pool_state_t const *fr_connection_pool_state(fr_connection_pool_t
 
 void	fr_connection_pool_reconnect_func(fr_connection_pool_t *pool, fr_connection_pool_reconnect_t reconnect);
 
+void	fr_connection_pool_cancel_func(fr_connection_pool_t *pool, fr_connection_cancel_t cancel);
+
 /*
  *	Pool management
  */
@@ -160,6 +184,9 @@ void	*fr_connection_reconnect(fr_connection_pool_t *pool, void *conn);
 
 int	fr_connection_close(fr_connection_pool_t *pool, void *conn);
 
+struct rad_request;
+void	fr_connection_cancel_watch(fr_connection_pool_t *pool, struct rad_request *request, void *conn);
+
 #ifdef __cplusplus
 }
 #endif
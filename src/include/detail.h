@@ -52,6 +52,62 @@ typedef enum detail_state_t {
 #  endif
 #endif
 
+/** Header of a binary detail record
+ *
+ * Written by rlm_detail with "binary = yes".  It's followed by the
+ * RADIUS packet, with any encrypted attributes hidden using
+ * DETAIL_BINARY_SECRET and the packet's own authentication vector.
+ * Multi-byte fields are in network byte order.
+ */
+typedef struct detail_binary_t {
+	uint8_t		magic[4];		//!< DETAIL_BINARY_MAGIC.
+	uint8_t		done;			//!< Set to 1 once replayed, with "track = yes".
+	uint8_t		af;			//!< 4 or 6, or 0 if the addresses are unknown.
+	uint8_t		length[2];		//!< Of the RADIUS packet which follows.
+	uint8_t		timestamp[4];		//!< When the record was written.
+	uint8_t		src_port[2];
+	uint8_t		dst_port[2];
+	uint8_t		src_ipaddr[16];
+	uint8_t		dst_ipaddr[16];
+} detail_binary_t;
+
+/*
+ *	Starts with a NUL, so it can't be mistaken for the header
+ *	line of a text record.
+ */
+#define DETAIL_BINARY_MAGIC	"\0FRd"
+#define DETAIL_BINARY_SECRET	"detail"
+
+/*
+ *	A binary record written by an accounting listener with a
+ *	"journal".  The packet is as it was received, so any encrypted
+ *	attributes use the secret of the client which sent it.
+ */
+#define DETAIL_JOURNAL_MAGIC	"\0FRj"
+
+#ifdef WITH_DETAIL_THREAD
+/** A record being replayed, when more than one may be outstanding
+ *
+ */
+typedef struct detail_entry_t {
+	uint32_t	counter;		//!< Identifies the packet last sent for this record.
+	uint32_t	generation;		//!< Which detail.work file it came from.
+	VALUE_PAIR	*vps;			//!< The record, as read from the file.
+	char const	*session_id;		//!< Acct-Session-Id.  Records with the same one are
+						//!< replayed in file order.
+	fr_ipaddr_t	client_ip;
+	time_t		timestamp;
+	off_t		start;			//!< Offset of the record in the file.
+	off_t		timestamp_offset;	//!< Offset of its "Timestamp" line, for "track".
+	bool		binary;			//!< Whether it's a binary record.
+	int		tries;
+	time_t		running;		//!< When it was last sent.
+	detail_state_t	state;			//!< STATE_UNOPENED if the entry is free,
+						//!< STATE_QUEUED if it's waiting for an earlier
+						//!< record in the same session.
+} detail_entry_t;
+#endif
+
 typedef struct listen_detail_t {
 	fr_event_t	*ev;	/* has to be first entry (ugh) */
 	char const 	*name;			//!< Identifier used in log messages
@@ -65,9 +121,22 @@ typedef struct listen_detail_t {
 	int		master_pipe[2];
 	int		child_pipe[2];
 	pthread_t	pthread_id;
+
+	uint32_t	max_outstanding;	//!< How many records we replay at once.
+	detail_entry_t	*entries;		//!< max_outstanding records being replayed.
+	uint32_t	generation;		//!< Incremented each time detail.work is opened.
+	char const	*filename_checkpoint;	//!< Where we save how far through detail.work we are.
+	int		checkpoint_fd;
+	ino_t		checkpoint_inode;	//!< Of the detail.work file the checkpoint is for.
+	off_t		checkpoint;		//!< Every record before this offset has been replied to.
 #endif
 
 	FILE		*fp;
+#ifdef HAVE_SYS_MMAN_H
+	char		*map;			//!< detail.work, mapped into memory.
+	size_t		map_len;		//!< How much of it is mapped.
+	size_t		map_pos;		//!< Where we're reading from.
+#endif
 	off_t		offset;
 	detail_state_t 	state;
 	time_t		timestamp;
@@ -75,7 +144,9 @@ typedef struct listen_detail_t {
 	fr_ipaddr_t	client_ip;
 
 	off_t		last_offset;
+	off_t		header_offset;		//!< Where the current record started.
 	off_t		timestamp_offset;
+	bool		binary;			//!< Whether the current record is binary.
 	bool		done_entry;		//!< Are we done reading this entry?
 	bool		track;			//!< Do we track progress through the file?
 
@@ -58,6 +58,14 @@ ssize_t		fr_dhcp_decode_option(TALLOC_CTX *ctx, vp_cursor_t *cursor,
 
 int		fr_dhcp_decode(RADIUS_PACKET *packet);
 
+int		fr_dhcp_decode_pending(RADIUS_PACKET *packet, fr_dict_attr_t const *da);
+
+uint8_t const	*fr_dhcp_option_find(RADIUS_PACKET const *packet, unsigned int option);
+
+int		fr_dhcp_option_append(RADIUS_PACKET *packet, uint8_t const *option);
+
+int		fr_dhcp_option_remove(RADIUS_PACKET *packet, unsigned int option);
+
 #ifdef HAVE_LINUX_IF_PACKET_H
 #include <linux/if_packet.h>
 int		fr_socket_packet(int iface_index, struct sockaddr_ll *p_ll);
@@ -65,6 +73,47 @@ int		fr_socket_packet(int iface_index, struct sockaddr_ll *p_ll);
 int		fr_dhcp_send_raw_packet(int sockfd, struct sockaddr_ll *p_ll, RADIUS_PACKET *packet);
 
 RADIUS_PACKET	*fr_dhcp_recv_raw_packet(int sockfd, struct sockaddr_ll *p_ll, RADIUS_PACKET *request);
+
+#  ifdef TPACKET3_HDRLEN
+#    define HAVE_DHCP_RING (1)
+
+/** PACKET_MMAP rings shared with the kernel, for reading and writing DHCP frames without a system call each
+ *
+ * The RX ring is TPACKET_V3, where the kernel hands over whole blocks of frames.  The TX ring
+ * is TPACKET_V2, as TPACKET_V3 TX rings need a much newer kernel.
+ */
+typedef struct fr_dhcp_ring {
+	int			fd;		//!< PF_PACKET socket with the RX ring.
+	int			tx_fd;		//!< PF_PACKET socket with the TX ring.
+	int			bound_fd;	//!< Socket which keeps the UDP port bound.  Closed with the ring.
+	int			if_index;	//!< Interface the rings are bound to.
+	uint8_t			ether_addr[6];	//!< MAC address of the interface.
+	struct sockaddr_ll	link_layer;	//!< Where frames from the TX ring are sent.
+
+	uint8_t			*rx_map;	//!< Mapped RX ring.
+	struct tpacket_req3	rx_req;		//!< Geometry of the RX ring.
+	uint32_t		rx_block;	//!< Block we're reading frames from.
+	uint8_t			*rx_frame;	//!< Next frame in rx_block, or NULL if we haven't started it.
+	uint32_t		rx_left;	//!< Frames left in rx_block.
+
+	uint8_t			*tx_map;	//!< Mapped TX ring.
+	struct tpacket_req	tx_req;		//!< Geometry of the TX ring.
+	uint32_t		tx_frame;	//!< Next TX slot to fill.
+	uint32_t		tx_pending;	//!< Frames queued since the last flush.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;		//!< Serialises senders.
+#endif
+} fr_dhcp_ring_t;
+
+fr_dhcp_ring_t	*fr_dhcp_ring_alloc(TALLOC_CTX *ctx, char const *interface, uint16_t port, size_t size);
+
+int		fr_dhcp_ring_recv(RADIUS_PACKET **out, fr_dhcp_ring_t *ring);
+
+int		fr_dhcp_ring_send(fr_dhcp_ring_t *ring, uint8_t const *dst_ether_addr, RADIUS_PACKET *packet,
+				  bool flush);
+
+int		fr_dhcp_ring_flush(fr_dhcp_ring_t *ring, bool wait);
+#  endif
 #endif
 
 /*
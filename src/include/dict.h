@@ -54,6 +54,10 @@ typedef struct attr_flags {
 
 	unsigned int		compare : 1;			//!< has a paircompare registered
 
+	unsigned int		intern : 1;			//!< Values are shared, see #fr_dict_intern.
+	unsigned int		is_cached : 1;			//!< Unknown attribute shared by many VALUE_PAIRs.
+								//!< See #fr_dict_unknown_afrom_fields_cached.
+
 	enum {
 		FLAG_ENCRYPT_NONE = 0,				//!< Don't encrypt the attribute.
 		FLAG_ENCRYPT_USER_PASSWORD,			//!< Encrypt attribute RFC 2865 style.
@@ -144,6 +148,8 @@ int			fr_dict_init(TALLOC_CTX *ctx, fr_dict_t **out,
 
 int			fr_dict_read(fr_dict_t *dict, char const *dir, char const *filename);
 
+size_t			fr_dict_hugepage_advise(fr_dict_t *dict);
+
 int			fr_dict_parse_str(fr_dict_t *dict, char *buf,
 					  fr_dict_attr_t const *parent, unsigned int vendor);
 
@@ -168,6 +174,9 @@ int			fr_dict_unknown_from_fields(fr_dict_attr_t *da, fr_dict_attr_t const *pare
 fr_dict_attr_t		*fr_dict_unknown_afrom_fields(TALLOC_CTX *ctx, fr_dict_attr_t const *parent,
 						      unsigned int vendor, unsigned int attr) CC_HINT(nonnull);
 
+fr_dict_attr_t const	*fr_dict_unknown_afrom_fields_cached(TALLOC_CTX *ctx, fr_dict_attr_t const *parent,
+							     unsigned int vendor, unsigned int attr);
+
 int			fr_dict_unknown_from_oid(fr_dict_t *dict, fr_dict_attr_t *vendor_da, fr_dict_attr_t *da,
 						 fr_dict_attr_t const *parent, char const *name);
 
@@ -215,6 +224,8 @@ char const		*fr_dict_enum_name_by_da(fr_dict_t *dict, fr_dict_attr_t const *da,
 
 fr_dict_enum_t		*fr_dict_enum_by_name(fr_dict_t *dict, fr_dict_attr_t const *da, char const *val);
 
+char const		*fr_dict_intern(fr_dict_t *dict, char const *in, size_t inlen);
+
 /*
  *	Validation
  */
@@ -35,10 +35,27 @@ extern "C" {
  */
 typedef struct exfile_t exfile_t;
 
+/** Configuration for writing from a background thread
+ *
+ */
+typedef struct exfile_async_t {
+	bool		enable;		//!< Queue records for a writer thread.
+	struct timeval	flush_interval;	//!< How often the writer thread writes.
+	uint32_t	flush_size;	//!< Write early when this many bytes are queued.
+	uint32_t	queue_size;	//!< Maximum number of queued records.
+	bool		fsync;		//!< fsync() each file after writing to it.
+	bool		io_uring;	//!< Submit the writes with io_uring, where available.
+} exfile_async_t;
+
+extern CONF_PARSER const exfile_async_config[];
+
 exfile_t *exfile_init(TALLOC_CTX *ctx, uint32_t entries, uint32_t idle, bool locking);
+int exfile_async(exfile_t *ef, exfile_async_t const *async);
 int exfile_open(exfile_t *lf, char const *filename, mode_t permissions, bool append);
 int exfile_close(exfile_t *lf, int fd);
 int exfile_unlock(exfile_t *lf, int fd);
+int exfile_write(exfile_t *ef, char const *filename, mode_t permissions, gid_t group,
+		 struct iovec *vector, int iovcnt);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,110 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_FIBER_H
+#define _FR_FIBER_H
+/**
+ * $Id$
+ *
+ * @file include/fiber.h
+ * @brief Run requests on their own stacks, so a worker can process others while one waits for I/O.
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+RCSIDH(fiber_h, "$Id$")
+
+#include <poll.h>
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+/*
+ *	Fibers switch stacks with swapcontext(), and are woken
+ *	from other threads with an atomic flag.
+ */
+#if defined(HAVE_UCONTEXT_H) && defined(HAVE_PTHREAD_H) && defined(HAVE_STDATOMIC_H)
+#  define WITH_FIBERS 1
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef WITH_FIBERS
+typedef struct fr_fiber fr_fiber_t;
+typedef struct fr_fiber_sched fr_fiber_sched_t;
+
+/** Function run on a fiber's stack
+ *
+ * @param[in] uctx passed to fr_fiber_start().
+ */
+typedef void (*fr_fiber_func_t)(void *uctx);
+
+typedef struct fr_fiber_cond_waiter fr_fiber_cond_waiter_t;
+
+/** A condition which fibers can wait on without blocking their worker
+ *
+ * Fibers queue themselves on the condition, and are woken with
+ * fr_fiber_wake() when it's signalled.  Threads which aren't running
+ * fibers wait on the pthread condition as usual.  Must only be
+ * signalled while holding the mutex which the waiters use.
+ */
+typedef struct fr_fiber_cond {
+	pthread_cond_t		cond;		//!< For waiters which aren't on a fiber.
+	fr_fiber_cond_waiter_t	*head;		//!< Fibers waiting, oldest first.
+	fr_fiber_cond_waiter_t	*tail;
+} fr_fiber_cond_t;
+
+fr_fiber_sched_t	*fr_fiber_sched_alloc(TALLOC_CTX *ctx, uint32_t max_fibers, size_t stack_size);
+int			fr_fiber_start(fr_fiber_sched_t *sched, fr_fiber_func_t func, void *uctx);
+uint32_t		fr_fiber_sched_num(fr_fiber_sched_t const *sched);
+int			fr_fiber_sched_run(fr_fiber_sched_t *sched, int fd, int timeout);
+
+fr_fiber_t		*fr_fiber_current(void);
+int			fr_fiber_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+void			fr_fiber_suspend(void);
+void			fr_fiber_wake(fr_fiber_t *fiber);
+
+int			fr_fiber_cond_init(fr_fiber_cond_t *cond);
+void			fr_fiber_cond_destroy(fr_fiber_cond_t *cond);
+void			fr_fiber_cond_signal(fr_fiber_cond_t *cond);
+void			fr_fiber_cond_broadcast(fr_fiber_cond_t *cond);
+int			fr_fiber_cond_timedwait(fr_fiber_cond_t *cond, pthread_mutex_t *mutex,
+						struct timespec const *abstime);
+
+void			fr_fiber_yield_disable(void);
+void			fr_fiber_yield_enable(void);
+#else
+#  define fr_fiber_current()			(NULL)
+#  define fr_fiber_poll(_fds, _nfds, _timeout)	poll(_fds, _nfds, _timeout)
+#  define fr_fiber_yield_disable()
+#  define fr_fiber_yield_enable()
+
+#  ifdef HAVE_PTHREAD_H
+typedef pthread_cond_t fr_fiber_cond_t;
+
+#    define fr_fiber_cond_init(_cond)		pthread_cond_init(_cond, NULL)
+#    define fr_fiber_cond_destroy(_cond)	pthread_cond_destroy(_cond)
+#    define fr_fiber_cond_signal(_cond)		pthread_cond_signal(_cond)
+#    define fr_fiber_cond_broadcast(_cond)	pthread_cond_broadcast(_cond)
+#    define fr_fiber_cond_timedwait(_cond, _mutex, _abstime) \
+	((_abstime) ? pthread_cond_timedwait(_cond, _mutex, _abstime) : pthread_cond_wait(_cond, _mutex))
+#  endif
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FR_FIBER_H */
@@ -36,6 +36,7 @@ extern "C" {
 uint32_t fr_hash(void const *, size_t);
 uint32_t fr_hash_update(void const *data, size_t size, uint32_t hash);
 uint32_t fr_hash_string(char const *p);
+uint32_t fr_hash_case_string(char const *p);
 
 typedef struct fr_hash_table_t fr_hash_table_t;
 typedef void (*fr_hash_table_free_t)(void *);
@@ -58,6 +59,49 @@ int		fr_hash_table_walk(fr_hash_table_t *ht,
 				     fr_hash_table_walk_t callback,
 				     void *ctx);
 
+/*
+ *	Open addressing hash table, with the same API as above.
+ *	Faster for lookups, especially when the table is large.
+ */
+typedef struct fr_hash_oa_t fr_hash_oa_t;
+
+fr_hash_oa_t	*fr_hash_oa_create(TALLOC_CTX *ctx,
+				   fr_hash_table_hash_t hashNode,
+				   fr_hash_table_cmp_t cmpNode,
+				   fr_hash_table_free_t freeNode);
+void		fr_hash_oa_free(fr_hash_oa_t *ht);
+int		fr_hash_oa_insert(fr_hash_oa_t *ht, void const *data);
+int		fr_hash_oa_delete(fr_hash_oa_t *ht, void const *data);
+void		*fr_hash_oa_yank(fr_hash_oa_t *ht, void const *data);
+int		fr_hash_oa_replace(fr_hash_oa_t *ht, void const *data);
+void		*fr_hash_oa_finddata(fr_hash_oa_t *ht, void const *data);
+int		fr_hash_oa_num_elements(fr_hash_oa_t *ht);
+int		fr_hash_oa_walk(fr_hash_oa_t *ht,
+				fr_hash_table_walk_t callback,
+				void *ctx);
+
+/*
+ *	Thread-safe hash table, with the same API as above.
+ *	Lookups don't lock, for tables which are read on every
+ *	request, and rarely written.
+ */
+typedef struct fr_hash_rcu_t fr_hash_rcu_t;
+
+fr_hash_rcu_t	*fr_hash_rcu_create(TALLOC_CTX *ctx,
+				    fr_hash_table_hash_t hashNode,
+				    fr_hash_table_cmp_t cmpNode,
+				    fr_hash_table_free_t freeNode);
+void		fr_hash_rcu_free(fr_hash_rcu_t *ht);
+int		fr_hash_rcu_insert(fr_hash_rcu_t *ht, void const *data);
+int		fr_hash_rcu_delete(fr_hash_rcu_t *ht, void const *data);
+void		*fr_hash_rcu_yank(fr_hash_rcu_t *ht, void const *data);
+int		fr_hash_rcu_replace(fr_hash_rcu_t *ht, void const *data);
+void		*fr_hash_rcu_finddata(fr_hash_rcu_t *ht, void const *data);
+int		fr_hash_rcu_num_elements(fr_hash_rcu_t *ht);
+int		fr_hash_rcu_walk(fr_hash_rcu_t *ht,
+				 fr_hash_table_walk_t callback,
+				 void *ctx);
+
 #ifdef __cplusplus
 }
 #endif
@@ -62,6 +62,34 @@ struct modcallable {
 	int			actions[RLM_MODULE_NUMCODES];
 };
 
+/** A node of a compiled section, lowered into a flat instruction array
+ *
+ * Instructions are laid out depth first, so the body of a block
+ * immediately follows the instruction which opens it, and straight
+ * line code is contiguous.  All jump targets are resolved when the
+ * section is lowered.
+ */
+typedef struct modcall_insn modcall_insn_t;
+struct modcall_insn {
+	mod_type_t		type;		//!< Copied from the node.
+	int			actions[RLM_MODULE_NUMCODES];	//!< Copied from the node.
+	modcall_insn_t		*next;		//!< Next instruction in this block, or NULL.
+	modcall_insn_t		*child;		//!< First instruction of the body, or NULL.
+	modcall_insn_t		*skip;		//!< #MOD_IF, #MOD_ELSIF.  First instruction after
+						//!< the if / elsif / else chain, or NULL.
+	modcallable		*c;		//!< Node the instruction was lowered from.
+};
+
+/** A static case value of a #MOD_SWITCH, as stored in its case table
+ *
+ */
+typedef struct {
+	PW_TYPE			type;		//!< Of the switch attribute.
+	value_data_t const	*data;		//!< Case value, owned by the case's template.
+	unsigned int		order;		//!< Position of the case in the switch.
+	modcall_insn_t const	*insn;		//!< #MOD_CASE instruction to jump to.
+} modcall_case_t;
+
 
 typedef enum {
 	GROUPTYPE_SIMPLE = 0,
@@ -82,6 +110,13 @@ typedef struct {
 
 	map_proc_inst_t		*proc_inst;	//!< Instantiation data for #MOD_MAP.
 	bool			done_pass2;
+
+	modcall_insn_t		*insn;		//!< Lowered form of the section, set on the root
+						//!< group by modcall_lower().
+	fr_hash_oa_t		*cases;		//!< #MOD_SWITCH.  #modcall_case_t, keyed by value.
+						//!< Only built if every case is a static value.
+	bool			foreach_inplace; //!< #MOD_FOREACH.  Nothing in the body can modify
+						//!< the list being iterated over, so it isn't copied.
 } modgroup;
 
 typedef struct {
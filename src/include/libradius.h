@@ -102,6 +102,7 @@ RCSIDH(libradius_h, "$Id$")
  */
 #include <freeradius-devel/sha1.h>
 #include <freeradius-devel/md4.h>
+#include <freeradius-devel/md5.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -148,6 +149,8 @@ typedef void (*sig_t)(int);
  *
  *	data,data_len:	Used between fr_radius_recv and fr_radius_decode.
  */
+typedef struct fr_radius_pending fr_radius_pending_t;
+
 typedef struct radius_packet {
 	int			sockfd;			//!< Socket this packet was read from.
 	int			if_index;		//!< Index of receiving interface.
@@ -169,6 +172,18 @@ typedef struct radius_packet {
 
 	uint32_t       		rounds;			//!< for State[0]
 
+	bool			zero_copy;		//!< Decoded string and octets values reference
+							//!< data instead of being copied.
+	bool			lazy;			//!< fr_radius_decode only indexes the attributes,
+							//!< see fr_radius_decode_pending.
+	fr_radius_pending_t	*pending;		//!< Attributes which haven't been decoded yet.
+	void			*proto_index;		//!< Where the options are in data, for protocols
+							//!< other than RADIUS, e.g. see fr_dhcp_packet_ok.
+
+	char const		*verified;		//!< Secret the Request Authenticator has already
+							//!< been checked with, so fr_radius_verify doesn't
+							//!< have to do it again.
+
 #ifdef WITH_TCP
 	size_t			partial;
 	int			proto;
@@ -237,10 +252,21 @@ do { \
 #define	FR_TUNNEL_PW_ENC_LENGTH(_x) (2 + 1 + _x + PAD(_x + 1, 16))
 extern FR_NAME_NUMBER const fr_request_types[];
 
+typedef struct fr_radius_secret_ctx {
+	char			*secret;		//!< Copy of the secret the states were computed for.
+	size_t			secret_len;		//!< Length of the secret.
+	FR_MD5_CTX		md5;			//!< MD5 state after absorbing the secret.
+	fr_hmac_md5_ctx_t	hmac;			//!< HMAC-MD5 pad states keyed with the secret.
+} fr_radius_secret_ctx_t;
+
+fr_radius_secret_ctx_t const *fr_radius_secret_ctx(char const *secret);
+
 void		fr_radius_make_secret(uint8_t *digest, uint8_t const *vector, char const *secret, uint8_t const *value);
 
 void		fr_radius_print_hex(RADIUS_PACKET *packet);
 
+int		fr_radius_send_prepare(RADIUS_PACKET *packet, RADIUS_PACKET const *original, char const *secret);
+
 int		fr_radius_send(RADIUS_PACKET *, RADIUS_PACKET const *, char const *secret);
 
 ssize_t		fr_radius_len(uint8_t const *data, size_t data_len);
@@ -249,6 +275,14 @@ bool		fr_radius_ok(RADIUS_PACKET *packet, int flags, decode_fail_t *reason);
 
 RADIUS_PACKET	*fr_radius_recv(TALLOC_CTX *ctx, int fd, int flags);
 
+RADIUS_PACKET	*fr_radius_recv_data(TALLOC_CTX *ctx, int fd, uint8_t const *data, size_t data_len, size_t packet_len,
+				     fr_ipaddr_t const *src_ipaddr, uint16_t src_port,
+				     fr_ipaddr_t const *dst_ipaddr, uint16_t dst_port,
+				     int if_index, struct timeval const *when, int flags);
+
+ssize_t		fr_radius_recv_header_data(uint8_t const *data, size_t data_len, fr_ipaddr_t const *src_ipaddr,
+					   unsigned int *code);
+
 ssize_t		fr_radius_recv_header(int sockfd, fr_ipaddr_t *src_ipaddr, uint16_t *src_port, unsigned int *code);
 
 void		fr_radius_recv_discard(int sockfd);
@@ -257,8 +291,13 @@ int		fr_radius_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const
 
 int		fr_radius_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret);
 
+int		fr_radius_decode_pending(RADIUS_PACKET *packet, RADIUS_PACKET const *original, char const *secret,
+					 fr_dict_attr_t const *da);
+
 int		fr_radius_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original, char const *secret);
 
+int		fr_radius_encode_verbatim(RADIUS_PACKET *packet, RADIUS_PACKET const *received, char const *secret);
+
 int		fr_radius_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original, char const *secret);
 
 int		fr_radius_digest_cmp(uint8_t const *a, uint8_t const *b, size_t length);
@@ -272,6 +311,8 @@ typedef struct fr_radius_ctx {
 	RADIUS_PACKET const	*packet;
 	RADIUS_PACKET const	*original;
 	char const		*secret;
+	char			*values;		//!< Copy of packet->data which string values
+							//!< reference, when decoding with zero_copy.
 } fr_radius_ctx_t;
 
 /*
@@ -407,6 +448,11 @@ void		fr_timespec_subtract(struct timespec *out, struct timespec const *end, str
 int		fr_timeval_from_str(struct timeval *out, char const *in);
 int8_t		fr_pointer_cmp(void const *a, void const *b);
 void		fr_quick_sort(void const *to_sort[], int min_idx, int max_idx, fr_cmp_t cmp);
+
+extern bool	fr_hugepages;
+size_t		fr_hugepage_advise(void const *ptr, size_t len);
+size_t		fr_hugepage_advised(void);
+int		fr_hugepage_resident(size_t *out);
 /*
  *	Define TALLOC_DEBUG to check overflows with talloc.
  *	we can't use valgrind, because the memory used by
@@ -441,7 +487,9 @@ typedef struct fr_randctx {
 void		fr_isaac(fr_randctx *ctx);
 void		fr_randinit(fr_randctx *ctx, int flag);
 uint32_t	fr_rand(void);	/* like rand(), but better. */
+void		fr_rand_fill(void *out, size_t outlen);
 void		fr_rand_seed(void const *, size_t ); /* seed the random pool */
+uint32_t	fr_fast_rand(void);	/* NOT for anything security related */
 
 
 /* crypt wrapper from crypt.c */
@@ -545,11 +593,26 @@ typedef enum {
 #define RBTREE_FLAG_REPLACE (1 << 0)
 #define RBTREE_FLAG_LOCK    (1 << 1)
 
+/** A node in a tree
+ *
+ * Only public so that it can be embedded in the data, for trees created
+ * with #rbtree_create_intrusive.  The fields are private to rbtree.c.
+ */
+struct rbnode_t {
+	rbnode_t	*left;		//!< Left child
+	rbnode_t	*right;		//!< Right child
+	rbnode_t	*parent;	//!< Parent
+	int		colour;		//!< Node colour (BLACK, RED)
+	void		*data;		//!< data stored in node
+};
+
 typedef int (*rb_comparator_t)(void const *ctx, void const *data);
 typedef int (*rb_walker_t)(void *ctx, void *data);
 typedef void (*rb_free_t)(void *data);
 
 rbtree_t	*rbtree_create(TALLOC_CTX *ctx, rb_comparator_t compare, rb_free_t node_free, int flags);
+rbtree_t	*rbtree_create_intrusive(TALLOC_CTX *ctx, rb_comparator_t compare, rb_free_t node_free,
+					 size_t offset, int flags);
 void		rbtree_free(rbtree_t *tree);
 bool		rbtree_insert(rbtree_t *tree, void *data);
 rbnode_t	*rbtree_insert_node(rbtree_t *tree, void *data);
@@ -599,6 +662,7 @@ int		fr_socket_client_tcp(fr_ipaddr_t *src_ipaddr, fr_ipaddr_t *dst_ipaddr, uint
 int		fr_socket_wait_for_connect(int sockfd, struct timeval const *timeout);
 int		fr_socket_server_base(int proto, fr_ipaddr_t *ipaddr, int *port, char const *port_name, bool async);
 int		fr_socket_server_bind(int sockfd, fr_ipaddr_t *ipaddr, int *port, char const *interface);
+int		fr_socket_filter_sources(int sockfd, fr_ipaddr_t const *sources, size_t num);
 
 #ifdef __cplusplus
 }
@@ -45,6 +45,7 @@ typedef enum RAD_LISTEN_TYPE {
 	RAD_LISTEN_DHCP,
 	RAD_LISTEN_COMMAND,
 	RAD_LISTEN_COA,
+	RAD_LISTEN_METRICS,
 	RAD_LISTEN_MAX
 } RAD_LISTEN_TYPE;
 
@@ -57,6 +58,7 @@ typedef enum RAD_LISTEN_STATUS {
 } RAD_LISTEN_STATUS;
 
 typedef struct rad_listen rad_listen_t;
+typedef struct isolated_pool_t isolated_pool_t;
 typedef struct fr_protocol_t fr_protocol_t;
 
 typedef int (*rad_listen_recv_t)(rad_listen_t *);
@@ -65,6 +67,7 @@ typedef int (*rad_listen_print_t)(rad_listen_t const *, char *, size_t);
 typedef void (*rad_listen_debug_t)(REQUEST *, RADIUS_PACKET *, bool received);
 typedef int (*rad_listen_encode_t)(rad_listen_t *, REQUEST *);
 typedef int (*rad_listen_decode_t)(rad_listen_t *, REQUEST *);
+typedef int (*rad_listen_decode_pending_t)(rad_listen_t *, REQUEST *, fr_dict_attr_t const *);
 
 struct rad_listen {
 	rad_listen_t		*next; /* should be rbtree stuff */
@@ -87,6 +90,18 @@ struct rad_listen {
 	bool			nodup;
 	bool			synchronous;
 	uint32_t		workers;
+	bool			reuse_port;	//!< Give each worker its own SO_REUSEPORT socket.
+	rad_listen_t		*clones;	//!< The SO_REUSEPORT copies of this listener,
+						//!< one for each of the other workers.
+	rad_listen_t		*next_clone;	//!< The next copy of the listener we were cloned from.
+	uint32_t		recv_batch;	//!< Read up to this many packets with each recvmmsg().
+	uint32_t		send_batch;	//!< Send up to this many replies with each sendmmsg().
+	bool			zero_copy;	//!< Decoded values reference the packet data.
+	bool			lazy_decode;	//!< Decode attributes when they're first used.
+	uint32_t		pool_size;	//!< High-water mark of requests received on this listener.
+	char const		*cpu_affinity;	//!< CPUs to bind the workers to, one each.
+	int32_t			numa_node;	//!< Or the NUMA node to bind them to, -1 for any.
+	isolated_pool_t		*thread_pool;	//!< To process requests in, or NULL for the main pool.
 
 #ifdef WITH_TLS
 	fr_tls_server_conf_t	*tls;
@@ -96,6 +111,8 @@ struct rad_listen {
 	rad_listen_send_t	send;
 	rad_listen_encode_t	encode;
 	rad_listen_decode_t	decode;
+	rad_listen_decode_pending_t decode_pending;	//!< Decode attributes skipped by a lazy decode,
+							//!< for protocols other than RADIUS.
 	rad_listen_debug_t	debug;
 	rad_listen_print_t	print;
 
@@ -134,6 +151,9 @@ typedef struct listen_socket_t {
 	uint32_t		rate_pps_old;
 	uint32_t		rate_pps_now;
 	uint32_t		max_rate;
+	bool			filter_clients;	//!< Drop packets from unknown clients in the kernel.
+	fr_token_bucket_t	pps_limit;	//!< max_pps for UDP auth and acct sockets, checked
+						//!< before the packet is decoded.
 
 	/* for outgoing sockets */
 	home_server_t		*home;
@@ -147,6 +167,20 @@ typedef struct listen_socket_t {
 						//!< configuration of SO_RCVBUF, as SO_SNDBUF
 						//!< controls the maximum datagram size.
 
+	struct udp_batch_t	*batch;		//!< Buffers for reading multiple packets at once.
+	struct udp_send_batch_t	*send_pending;	//!< Replies waiting to be sent with sendmmsg().
+	bool			batching;	//!< Queue replies in send_pending, instead of sending them.
+	uint8_t			*verify_buf;	//!< Scratch space for checking a batch of Request Authenticators.
+
+#ifdef WITH_ACCOUNTING
+	char const		*journal_file;	//!< Accounting-Requests are written here, and acknowledged
+						//!< at once.  A "detail" listener processes them.
+	uint32_t		journal_perm;	//!< Permissions to use for new journal files.
+	bool			journal_fsync;	//!< Sync the journal before acknowledging its records.
+	struct exfile_t		*journal;
+	struct listen_journal_t	*journal_pending; //!< Records waiting to be written, with "recv_batch".
+#endif
+
 #ifdef WITH_TCP
 	/* for a proxy connecting to home servers */
 	time_t			last_packet;
@@ -156,8 +190,11 @@ typedef struct listen_socket_t {
 	fr_socket_limit_t	limit;
 	struct listen_socket_t	*parent;
 	RADCLIENT		*client;
+	bool			active;		//!< Counted in the home server's num_active.
 
 	RADIUS_PACKET  	 	*packet; /* for reading partial packets */
+	struct fr_tcp_buffer_t	*recv_buf;	//!< Data read from the connection, which may hold
+						//!< several packets.
 #endif
 
 #ifdef WITH_TLS
@@ -179,6 +216,9 @@ void listen_free(rad_listen_t **head);
 int listen_init(rad_listen_t **head, bool spawn_flag);
 rad_listen_t *proxy_new_listener(TALLOC_CTX *ctx, home_server_t *home, uint16_t src_port);
 RADCLIENT *client_listener_find(rad_listen_t *listener, fr_ipaddr_t const *ipaddr, uint16_t src_port);
+TALLOC_CTX *listen_pool_alloc(rad_listen_t const *listener);
+void listen_pool_free(REQUEST *request, TALLOC_CTX *pool);
+void listen_filter_clients_update(void);
 
 #ifdef __cplusplus
 }
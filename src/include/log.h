@@ -89,6 +89,12 @@ extern fr_log_t default_log;
 
 int	radlog_init(fr_log_t *log, bool daemonize);
 
+int	radlog_async_start(uint32_t size);
+
+void	radlog_async_stop(void);
+
+uint64_t radlog_async_dropped(void);
+
 int	vradlog(log_type_t lvl, char const *fmt, va_list ap)
 	CC_HINT(format (printf, 2, 0)) CC_HINT(nonnull);
 int	radlog(log_type_t lvl, char const *fmt, ...)
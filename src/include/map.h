@@ -95,6 +95,9 @@ int		map_to_vp(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *request,
 int		map_to_request(REQUEST *request, vp_map_t const *map,
 			       radius_map_getvalue_t func, void *ctx);
 
+int		map_list_to_request(REQUEST *request, vp_map_t const *head,
+				    radius_map_getvalue_t func, void *ctx);
+
 bool		map_dst_valid(REQUEST *request, vp_map_t const *map);
 
 size_t		map_snprint(char *out, size_t outlen, vp_map_t const *map);
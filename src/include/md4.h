@@ -81,7 +81,14 @@ USES_APPLE_DEPRECATED_API
 #endif
 
 /* md4.c */
+
+/*
+ *	Longest buffer which fits in one MD4 block, with its padding.
+ */
+#define MD4_MULTI_MAX_LENGTH	55
+
 void fr_md4_calc(uint8_t out[MD4_DIGEST_LENGTH], uint8_t const *in, size_t inlen);
+void fr_md4_calc_multi(uint8_t (*out)[MD4_DIGEST_LENGTH], uint8_t const * const *in, size_t const *inlen, size_t num);
 
 #ifdef __cplusplus
 }
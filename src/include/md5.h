@@ -78,7 +78,20 @@ USES_APPLE_DEPRECATED_API
 #  define fr_md5_copy(_out, _in)	memcpy(_out, _in, sizeof(*_out))
 #endif
 
+#ifndef MD5_BLOCK_LENGTH
+#  define MD5_BLOCK_LENGTH 64
+#endif
+
 /* hmac.c */
+typedef struct fr_hmac_md5_ctx {
+	FR_MD5_CTX	inner;			//!< State after absorbing the key XOR ipad.
+	FR_MD5_CTX	outer;			//!< State after absorbing the key XOR opad.
+} fr_hmac_md5_ctx_t;
+
+void	fr_hmac_md5_init(fr_hmac_md5_ctx_t *ctx, uint8_t const *key, size_t key_len);
+void	fr_hmac_md5_calc(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
+			 fr_hmac_md5_ctx_t const *ctx)
+	CC_BOUNDED(__minbytes__, 1, MD5_DIGEST_LENGTH);
 void	fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
 		    uint8_t const *key, size_t key_len)
 	CC_BOUNDED(__minbytes__, 1, MD5_DIGEST_LENGTH);
@@ -86,6 +99,12 @@ void	fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t
 /* md5.c */
 void	fr_md5_calc(uint8_t *out, uint8_t const *in, size_t inlen);
 
+/*
+ *	Number of buffers fr_md5_calc_multi hashes in parallel.
+ */
+#define FR_MD5_LANES	8
+void	fr_md5_calc_multi(uint8_t *out[], uint8_t const *in[], size_t const inlen[], unsigned int num);
+
 #ifdef __cplusplus
 }
 #endif
@@ -60,6 +60,9 @@ void modcall_append(modcallable *parent, modcallable *this);
 
 void modcall_debug(modcallable *mc, int depth);
 
+/* Lower a compiled section into the flat instruction array used by modcall() */
+int modcall_lower(modcallable *root);
+
 #ifdef __cplusplus
 }
 #endif
@@ -72,9 +72,17 @@ typedef struct module_instance_t {
 	CONF_SECTION		*cs;
 	time_t			last_hup;
 	bool			instantiated;
+	bool			instantiating;		//!< Instantiation is in progress.
+#ifdef HAVE_PTHREAD_H
+	void			*instantiator;		//!< Worker thread instantiating the module.
+#endif
 	bool			force;
 	rlm_rcode_t		code;
 	fr_module_hup_t	       	*mh;
+#ifdef WITH_STATS
+	fr_stats_latency_t	*latency[MOD_COUNT];	//!< How long each method takes.
+	fr_stats_alloc_t	alloc;			//!< Memory the methods left in requests.
+#endif
 } module_instance_t;
 
 module_instance_t	*module_instantiate(CONF_SECTION *modules, char const *askedname);
@@ -83,6 +91,11 @@ module_instance_t	*module_find(CONF_SECTION *modules, char const *askedname);
 int			module_sibling_section_find(CONF_SECTION **out, CONF_SECTION *module, char const *name);
 int			module_hup_module(CONF_SECTION *cs, module_instance_t *node, time_t when);
 
+#ifdef HAVE_PTHREAD_H
+void			modules_instantiate_yield(void);
+void			modules_instantiate_resume(void);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
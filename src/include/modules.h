@@ -186,6 +186,24 @@ rlm_rcode_t indexed_modcall(rlm_components_t comp, int idx, REQUEST *request);
 
 int virtual_servers_bootstrap(CONF_SECTION *config);
 int virtual_servers_init(CONF_SECTION *config);
+int virtual_servers_hup(CONF_SECTION *config);
+
+#ifdef WITH_STATS
+void virtual_servers_latency_walk(fr_stats_latency_walk_t walk, void *ctx);
+void modules_latency_walk(fr_stats_latency_walk_t walk, void *ctx);
+void virtual_servers_alloc_walk(fr_stats_alloc_walk_t walk, void *ctx);
+void modules_alloc_walk(fr_stats_alloc_walk_t walk, void *ctx);
+
+/** Called for each connection pool by #modules_connection_pool_walk
+ *
+ * @param[in] ctx passed to the walk function.
+ * @param[in] name of the module instance using the pool.
+ * @param[in] state of the pool.
+ */
+typedef void (*module_connection_pool_walk_t)(void *ctx, char const *name, fr_connection_pool_state_t const *state);
+
+void modules_connection_pool_walk(module_connection_pool_walk_t walk, void *ctx);
+#endif
 
 #ifdef __cplusplus
 }
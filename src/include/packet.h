@@ -30,6 +30,7 @@ extern "C" {
 #endif
 
 int fr_packet_cmp(RADIUS_PACKET const *a, RADIUS_PACKET const *b);
+uint32_t fr_packet_hash(RADIUS_PACKET const *packet);
 int fr_is_inaddr_any(fr_ipaddr_t *ipaddr);
 void fr_request_from_reply(RADIUS_PACKET *request,
 			     RADIUS_PACKET const *reply);
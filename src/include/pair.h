@@ -131,6 +131,17 @@ typedef struct value_pair {
 
 	value_type_t		type;				//!< Type of pointer in value union.
 	value_data_t		data;
+
+	void const		*shared;			//!< If data.ptr is equal to this, the value
+								//!< points into a buffer the VALUE_PAIR does
+								//!< not own (usually packet->data), and must
+								//!< not be freed or written to.
+	bool			shared_ref;			//!< The shared buffer is a talloc chunk, which
+								//!< other VALUE_PAIRs may also reference.
+								//!< See #fr_pair_copy_ref.
+	bool			interned;			//!< The shared buffer is an interned value,
+								//!< which lives as long as the dictionary.
+								//!< See #fr_pair_value_intern.
 } VALUE_PAIR;
 
 /** Abstraction to allow iterating over different configurations of VALUE_PAIRs
@@ -181,6 +192,15 @@ typedef struct value_pair_raw {
 
 #define vp_length	data.length
 
+/** Check if the value of a VALUE_PAIR references memory it doesn't own
+ *
+ * @see fr_pair_value_memref
+ * @see fr_pair_copy_ref
+ * @see fr_pair_value_intern
+ * @see fr_pair_value_unshare
+ */
+#define fr_pair_value_shared(_vp)	((_vp)->shared && ((_vp)->data.ptr == (_vp)->shared))
+
 #  define debug_pair(vp)	do { if (fr_debug_lvl && fr_log_fp) { \
 					fr_pair_fprint(fr_log_fp, vp); \
 				     } \
@@ -207,6 +227,7 @@ typedef struct value_pair_raw {
 VALUE_PAIR	*fr_pair_afrom_da(TALLOC_CTX *ctx, fr_dict_attr_t const *da);
 VALUE_PAIR	*fr_pair_afrom_num(TALLOC_CTX *ctx, unsigned int vendor, unsigned int attr);
 VALUE_PAIR	*fr_pair_copy(TALLOC_CTX *ctx, VALUE_PAIR const *vp);
+VALUE_PAIR	*fr_pair_copy_ref(TALLOC_CTX *ctx, VALUE_PAIR *vp);
 void		fr_pair_steal(TALLOC_CTX *ctx, VALUE_PAIR *vp);
 VALUE_PAIR	*fr_pair_make(TALLOC_CTX *ctx, VALUE_PAIR **vps, char const *attribute, char const *value, FR_TOKEN op);
 void		fr_pair_list_free(VALUE_PAIR **);
@@ -248,6 +269,7 @@ bool 		fr_pair_validate_relaxed(VALUE_PAIR const *failed[2], VALUE_PAIR *filter,
 FR_TOKEN	fr_pair_list_afrom_str(TALLOC_CTX *ctx, char const *buffer, VALUE_PAIR **head);
 int		fr_pair_list_afrom_file(TALLOC_CTX *ctx, VALUE_PAIR **out, FILE *fp, bool *pfiledone);
 VALUE_PAIR	*fr_pair_list_copy(TALLOC_CTX *ctx, VALUE_PAIR *from);
+VALUE_PAIR	*fr_pair_list_copy_ref(TALLOC_CTX *ctx, VALUE_PAIR *from);
 VALUE_PAIR	*fr_pair_list_copy_by_num(TALLOC_CTX *ctx, VALUE_PAIR *from,
 				     unsigned int vendor, unsigned int attr, int8_t tag);
 void		fr_pair_list_move(TALLOC_CTX *ctx, VALUE_PAIR **to, VALUE_PAIR **from);
@@ -265,6 +287,10 @@ void		fr_pair_value_strnsteal(VALUE_PAIR *vp, char *src, size_t len);
 void		fr_pair_value_strcpy(VALUE_PAIR *vp, char const *src);
 void		fr_pair_value_bstrncpy(VALUE_PAIR *vp, void const *src, size_t len);
 void		fr_pair_value_snprintf(VALUE_PAIR *vp, char const *fmt, ...) CC_HINT(format (printf, 2, 3));
+void		fr_pair_value_memref(VALUE_PAIR *vp, uint8_t const *src, size_t len);
+void		fr_pair_value_strref(VALUE_PAIR *vp, char const *src, size_t len);
+int		fr_pair_value_unshare(VALUE_PAIR *vp);
+int		fr_pair_value_intern(VALUE_PAIR *vp, char const *src, size_t len);
 
 /* Printing functions */
 size_t   	fr_pair_value_snprint(char *out, size_t outlen, VALUE_PAIR const *vp, char quote);
@@ -81,6 +81,8 @@ struct fr_cond_t {
 	fr_cond_pass2_t		pass2_fixup;
 
 	fr_dict_attr_t const	*cast;
+	bool			precast;	//!< RHS is data which can be compared with
+						//!< the LHS attribute without casting.
 
 	fr_cond_op_t		next_op;
 	fr_cond_t		*next;
@@ -98,6 +100,7 @@ struct fr_cond_t {
 
 ssize_t fr_condition_tokenize(TALLOC_CTX *ctx, CONF_ITEM *ci, char const *start, fr_cond_t **head, char const **error, int flag);
 size_t fr_cond_snprint(char *buffer, size_t bufsize, fr_cond_t const *c);
+void fr_cond_precast(fr_cond_t *c);
 
 bool fr_condition_walk(fr_cond_t *head, bool (*callback)(void *, fr_cond_t *), void *ctx);
 
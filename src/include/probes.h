@@ -0,0 +1,73 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_PROBES_H
+#define _FR_PROBES_H
+/**
+ * $Id$
+ *
+ * @file include/probes.h
+ * @brief Static tracepoints, for DTrace, SystemTap and bpftrace.
+ *
+ * The probes are in the "freeradius" provider.  Where <sys/sdt.h> is
+ * available, each one is a single no-op instruction, plus a note in the
+ * binary which tells the tracer where it is.  A tracer which attaches to
+ * a probe replaces the no-op.  Otherwise, the probes compile to nothing.
+ *
+ * The arguments are always evaluated, so they must be cheap, and must
+ * not dereference anything which may be NULL.
+ *
+ * | Probe                 | Arguments                                         |
+ * |-----------------------|---------------------------------------------------|
+ * | request_receive       | number, packet code, client shortname             |
+ * | request_enqueue       | number, packet code                               |
+ * | request_dequeue       | number, packet code                               |
+ * | module_start          | number, module name, section                      |
+ * | module_done           | number, module name, section, rcode               |
+ * | request_proxy         | number, packet code, home server name             |
+ * | request_proxy_reply   | number, packet code, home server name             |
+ * | request_finish        | number, packet code, reply code                   |
+ * | pool_get_start        | pool log prefix                                   |
+ * | pool_get_done         | pool log prefix, connection handle, or NULL       |
+ * | pool_release          | pool log prefix, connection handle                |
+ *
+ * e.g. the time requests spend waiting for a thread:
+ * @verbatim
+   bpftrace -e 'usdt:/usr/sbin/radiusd:freeradius:request_enqueue { @q[arg0] = nsecs; }
+                usdt:/usr/sbin/radiusd:freeradius:request_dequeue /@q[arg0]/ {
+                    @usecs = hist((nsecs - @q[arg0]) / 1000); delete(@q[arg0]); }'
+   @endverbatim
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+RCSIDH(probes_h, "$Id$")
+
+#ifdef WITH_PROBES
+#  include <sys/sdt.h>
+
+#  define FR_PROBE(_name)				DTRACE_PROBE(freeradius, _name)
+#  define FR_PROBE1(_name, _a)				DTRACE_PROBE1(freeradius, _name, _a)
+#  define FR_PROBE2(_name, _a, _b)			DTRACE_PROBE2(freeradius, _name, _a, _b)
+#  define FR_PROBE3(_name, _a, _b, _c)			DTRACE_PROBE3(freeradius, _name, _a, _b, _c)
+#  define FR_PROBE4(_name, _a, _b, _c, _d)		DTRACE_PROBE4(freeradius, _name, _a, _b, _c, _d)
+#else
+#  define FR_PROBE(_name)
+#  define FR_PROBE1(_name, _a)
+#  define FR_PROBE2(_name, _a, _b)
+#  define FR_PROBE3(_name, _a, _b, _c)
+#  define FR_PROBE4(_name, _a, _b, _c, _d)
+#endif
+
+#endif /* _FR_PROBES_H */
@@ -67,6 +67,27 @@ int request_receive(TALLOC_CTX *ctx, rad_listen_t *listener, RADIUS_PACKET *pack
 int request_proxy_reply(RADIUS_PACKET *packet);
 #endif
 
+#ifdef WITH_COA
+/*
+ *	In coa.c
+ */
+typedef struct coa_bulk_stats_t {
+	uint64_t	queued;			//!< Packets added to the queue.
+	uint64_t	dropped;		//!< Packets not added because the queue was full.
+	uint64_t	sent;			//!< Packets sent for the first time.
+	uint64_t	retransmits;
+	uint64_t	acks;
+	uint64_t	naks;
+	uint64_t	timeouts;		//!< Packets which received no reply.
+	uint32_t	pending;		//!< Packets in the queue now.
+	uint32_t	outstanding;		//!< Packets waiting for a reply now.
+} coa_bulk_stats_t;
+
+int coa_bulk_enqueue(home_server_t *home, PW_CODE code, VALUE_PAIR *vps);
+int coa_bulk_stats(coa_bulk_stats_t *stats, home_server_t *home);
+void coa_bulk_wake(void);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
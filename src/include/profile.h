@@ -0,0 +1,86 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_PROFILE_H
+#define _FR_PROFILE_H
+/**
+ * $Id$
+ *
+ * @file include/profile.h
+ * @brief Sampled timing of what requests spend their time on.
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+RCSIDH(profile_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** What was timed
+ */
+typedef enum fr_profile_type_t {
+	FR_PROFILE_SECTION = 0,			//!< name is "server.section".
+	FR_PROFILE_MODULE,			//!< name is "module.method".
+	FR_PROFILE_XLAT,			//!< name is the expansion.
+	FR_PROFILE_QUERY,			//!< name is the module, and the query with its values removed.
+	FR_PROFILE_MAX
+} fr_profile_type_t;
+
+#ifdef WITH_STATS
+/** Called for each profile entry by fr_profile_walk()
+ *
+ * @param[in] ctx passed to fr_profile_walk().
+ * @param[in] name of the section, module, expansion or query.
+ * @param[in] lat times, in microseconds.
+ */
+typedef void (*fr_profile_walk_t)(void *ctx, char const *name, fr_stats_latency_t *lat);
+
+int	fr_profile_start(uint32_t seconds, uint32_t percent);
+void	fr_profile_stop(void);
+bool	fr_profile_running(time_t *until, uint32_t *percent);
+bool	fr_profile_sample(void);
+
+void	fr_profile_event(REQUEST *request, fr_profile_type_t type, char const *name, char const *sub,
+			 struct timeval const *start, struct timeval const *end);
+void	fr_profile_sql(REQUEST *request, char const *module, char const *query, struct timeval const *start);
+void	fr_profile_ldap(REQUEST *request, char const *module, char const *filter, struct timeval const *start);
+
+void	fr_profile_walk(fr_profile_type_t type, fr_profile_walk_t walk, void *ctx);
+
+/** Time something, if the request is being profiled
+ *
+ * @param _request being processed.
+ * @param _type fr_profile_type_t.
+ * @param _name of the section, module, etc.
+ * @param _sub section or method, or NULL.
+ * @param _start when the thing being timed started.
+ * @param _end when it finished, or NULL for now.
+ */
+#define FR_PROFILE(_request, _type, _name, _sub, _start, _end) \
+	do { \
+		if ((_request)->profile) fr_profile_event(_request, _type, _name, _sub, _start, _end); \
+	} while (0)
+#else
+#define fr_profile_sample()		(false)
+#define fr_profile_sql(_request, _module, _query, _start)
+#define fr_profile_ldap(_request, _module, _filter, _start)
+#define FR_PROFILE(_request, _type, _name, _sub, _start, _end)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FR_PROFILE_H */
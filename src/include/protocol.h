@@ -55,6 +55,7 @@ typedef struct fr_protocol_t {
 	rad_listen_debug_t	debug;
 	rad_listen_encode_t	encode;
 	rad_listen_decode_t	decode;
+	rad_listen_decode_pending_t decode_pending;
 } fr_protocol_t;
 
 #define TRANSPORT_TCP (1 << IPPROTO_TCP)
@@ -88,6 +88,25 @@ struct rc_request {
 	char const	*name;		//!< Test name (as specified in the request).
 };
 
+/** Open loop load generation, see radclient_load.c
+ *
+ */
+typedef struct rc_load {
+	uint32_t	rate;		//!< Packets per second, across all threads.
+	uint32_t	duration;	//!< How long to send for, in seconds.
+	uint32_t	threads;	//!< Number of sending threads.
+	uint32_t	outstanding;	//!< Most packets each thread may have outstanding.
+	float		timeout;	//!< How long to wait for a reply.  There are no retries.
+
+	fr_ipaddr_t	client_ipaddr;	//!< To bind the sockets to.
+	char const	*secret;
+
+	bool		quiet;		//!< Don't print anything.
+	bool		histogram;	//!< Print the latency histogram after the summary.
+} rc_load_t;
+
+int rc_load_run(rc_load_t const *config, rc_request_t *requests);
+
 #ifdef __cplusplus
 }
 #endif
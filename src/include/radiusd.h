@@ -33,6 +33,20 @@ RCSIDH(radiusd_h, "$Id$")
 
 typedef struct rad_request REQUEST;
 
+/** Abort a backend call a request is blocked in
+ *
+ * Called by the main thread, when a request runs past max_request_time
+ * whilst its worker thread is blocked in a backend call.  Runs at the
+ * same time as that call, so must not block, and must only do things
+ * which are safe to do at the same time, such as shutting down the
+ * socket the call is waiting on.
+ *
+ * @param[in] request which timed out.
+ * @param[in] uctx passed to request_cancel_set().
+ * @param[in] handle passed to request_cancel_set().
+ */
+typedef void (*fr_request_cancel_t)(REQUEST *request, void *uctx, void *handle);
+
 #include <freeradius-devel/log.h>
 
 #ifdef HAVE_PTHREAD_H
@@ -41,6 +55,14 @@ typedef struct rad_request REQUEST;
 #  include <sys/wait.h>
 #endif
 
+/*
+ *	Binding threads to CPUs needs pthread_setaffinity_np()
+ *	and the CPU_SET macros.
+ */
+#if defined(HAVE_PTHREAD_H) && defined(__linux__)
+#  define WITH_THREAD_AFFINITY 1
+#endif
+
 #ifndef NDEBUG
 #  define REQUEST_MAGIC (0xdeadbeef)
 #endif
@@ -57,6 +79,10 @@ typedef struct rad_request REQUEST;
 #endif
 
 #include <freeradius-devel/stats.h>
+#include <freeradius-devel/trace.h>
+#include <freeradius-devel/profile.h>
+#include <freeradius-devel/fiber.h>
+#include <freeradius-devel/probes.h>
 #include <freeradius-devel/realms.h>
 #include <freeradius-devel/xlat.h>
 #include <freeradius-devel/tmpl.h>
@@ -120,6 +146,8 @@ typedef struct main_config {
 
 	bool		daemonize;			//!< Should the server daemonize on startup.
 	bool		spawn_workers;			//!< Should the server spawn threads.
+	uint32_t	num_processes;			//!< Worker processes to fork, 0 to run as one process.
+	uint32_t	process_index;			//!< Which of the worker processes this is.
 	char const      *pid_file;			//!< Path to write out PID file.
 
 #ifdef WITH_PROXY
@@ -138,6 +166,8 @@ typedef struct main_config {
 	uint32_t	debug_level;
 	char const	*log_file;
 	int		syslog_facility;
+	bool		log_async;			//!< Write log messages from a separate thread.
+	uint32_t	log_async_queue_size;		//!< How many messages each thread can queue.
 
 	char const	*dictionary_dir;		//!< Where to load dictionaries from.
 
@@ -152,12 +182,14 @@ typedef struct main_config {
 
 	struct timeval	init_delay;			//!< Initial request processing delay.
 
-	uint32_t       	talloc_pool_size;		//!< Size of pool to allocate to hold each #REQUEST.
+	uint32_t       	talloc_pool_size;		//!< Minimum size of pool to allocate to hold each #REQUEST.
 	bool		debug_memory;			//!< Cleanup the server properly on exit, freeing
 							//!< up any memory we allocated.
 	bool		memory_report;			//!< Print a memory report on what's left unfreed.
 							//!< Can only be used when the server is running in single
 							//!< threaded mode.
+	bool		memory_accounting;		//!< Count the memory which each module and virtual
+							//!< server leaves in requests.  Set from radmin.
 
 	bool		allow_core_dumps;		//!< Whether the server is allowed to drop a core when
 							//!< receiving a fatal signal.
@@ -205,6 +237,25 @@ typedef enum {
 } rad_child_state_t;
 #define REQUEST_CHILD_NUM_STATES (REQUEST_DONE + 1)
 
+#define REQUEST_MAX_SECTIONS	(10)		//!< At least MOD_COUNT.
+
+/** When things happened to a request
+ *
+ * When the request was received is request->packet->timestamp.  Anything
+ * which hasn't happened is zero.
+ */
+typedef struct request_times_t {
+	struct timeval		queued;		//!< Last put in the thread pool queue.
+	struct timeval		dequeued;	//!< Last taken off the queue by a thread.
+
+	struct timeval		section_start[REQUEST_MAX_SECTIONS];	//!< First entered, by rlm_components_t.
+	struct timeval		section_end[REQUEST_MAX_SECTIONS];	//!< Last left, by rlm_components_t.
+
+	struct timeval		proxy_sent;	//!< The proxied packet was first sent.
+	struct timeval		proxy_reply;	//!< The reply to the proxied packet was received.
+	struct timeval		reply_sent;	//!< The reply was sent to the client.
+} request_times_t;
+
 struct rad_request {
 #ifndef NDEBUG
 	uint32_t		magic; 		//!< Magic number used to detect memory corruption,
@@ -301,6 +352,20 @@ struct rad_request {
 		fr_log_t	*output;	//!< Output log destination.  Over-rides the global one.
 	} log;
 
+	bool			trace;		//!< Record trace events for this request.
+	bool			profile;	//!< Add timings for this request to the profile.
+
+	struct {
+		fr_request_cancel_t func;	//!< Aborts the backend call the worker thread is
+						//!< blocked in.  Only set whilst the call is running.
+		void		*uctx;		//!< Passed to func.
+		void		*handle;	//!< Passed to func.
+		bool		cancelled;	//!< func was called, so the last call failed because
+						//!< the request timed out.
+	} cancel;
+
+	request_times_t		times;		//!< When things happened to the request.
+
 	uint32_t		options;	//!< mainly for proxying EAP-MSCHAPv2.
 
 #ifdef WITH_COA
@@ -366,7 +431,8 @@ typedef enum {
 	RADIUS_SIGNAL_SELF_EXIT		= (1 << 2),
 	RADIUS_SIGNAL_SELF_DETAIL	= (1 << 3),
 	RADIUS_SIGNAL_SELF_NEW_FD	= (1 << 4),
-	RADIUS_SIGNAL_SELF_MAX		= (1 << 5)
+	RADIUS_SIGNAL_SELF_COA		= (1 << 5),
+	RADIUS_SIGNAL_SELF_MAX		= (1 << 6)
 } radius_signal_t;
 /*
  *	Function prototypes.
@@ -405,8 +471,14 @@ void		*rad_malloc(size_t size); /* calls exit(1) on error! */
 void		rad_const_free(void const *ptr);
 char		*rad_ajoin(TALLOC_CTX *ctx, char const **argv, int argc, char c);
 REQUEST		*request_alloc(TALLOC_CTX *ctx);
+TALLOC_CTX	*request_state_ctx(REQUEST *request);
 REQUEST		*request_alloc_fake(REQUEST *oldreq);
 REQUEST		*request_alloc_coa(REQUEST *request);
+void		request_cancel_set(REQUEST *request, fr_request_cancel_t func, void *uctx, void *handle);
+void		request_cancel_clear(REQUEST *request);
+bool		request_cancel(REQUEST *request);
+bool		request_cancelled(REQUEST *request);
+int		request_decode_pending(REQUEST *request, fr_dict_attr_t const *da);
 int		request_data_add(REQUEST *request, void *unique_ptr, int unique_int, void *opaque,
 				 bool free_on_replace, bool free_on_parent, bool persist);
 void		*request_data_get(REQUEST *request, void *unique_ptr, int unique_int);
@@ -423,6 +495,7 @@ int		rad_copy_string(char *dst, char const *src);
 int		rad_copy_string_bare(char *dst, char const *src);
 int		rad_copy_variable(char *dst, char const *from);
 uint32_t	rad_pps(uint32_t *past, uint32_t *present, time_t *then, struct timeval *now);
+bool		rad_token_bucket_take(fr_token_bucket_t *tb, struct timeval const *now);
 int		rad_expand_xlat(REQUEST *request, char const *cmd,
 				int max_argc, char const *argv[], bool can_fail,
 				size_t argv_buflen, char *argv_buf);
@@ -468,6 +541,13 @@ void	regex_sub_to_request(REQUEST *request, regex_t **preg, char const *value,
 
 int	regex_request_to_sub(TALLOC_CTX *ctx, char **out, REQUEST *request, uint32_t num);
 
+typedef struct regex_set regex_set_t;
+
+int	regex_set_compile(TALLOC_CTX *ctx, regex_set_t **out, char const **patterns, size_t count,
+			  bool ignore_case, bool multiline);
+
+int	regex_set_exec(TALLOC_CTX *ctx, regex_set_t const *set, char const *subject, size_t len);
+
 /*
  *	Named capture groups only supported by PCRE.
  */
@@ -508,6 +588,12 @@ int radius_readfrom_program(int fd, pid_t pid, int timeout,
 int radius_exec_program(TALLOC_CTX *ctx, char *out, size_t outlen, VALUE_PAIR **output_pairs,
 			REQUEST *request, char const *cmd, VALUE_PAIR *input_pairs,
 			bool exec_wait, bool shell_escape, int timeout) CC_HINT(nonnull (5, 6));
+
+typedef struct exec_helper_pool exec_helper_pool_t;
+exec_helper_pool_t *exec_helper_pool_alloc(TALLOC_CTX *ctx, char const *cmd, uint32_t num,
+					   char const *terminator, int timeout) CC_HINT(nonnull (2));
+ssize_t exec_helper_request(exec_helper_pool_t *pool, REQUEST *request, char *out, size_t outlen,
+			    char const *in, size_t inlen) CC_HINT(nonnull (1, 3, 5));
 void trigger_exec_init(CONF_SECTION *cs);
 int trigger_exec(REQUEST *request, CONF_SECTION *cs, char const *name, bool quench, VALUE_PAIR *args)
 		  CC_HINT(nonnull (3));
@@ -551,6 +637,22 @@ int radius_copy_vp(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *request, char con
 #define pair_make_config(_a, _b, _c) fr_pair_make(request, &request->config, _a, _b, _c)
 
 /* threads.c */
+typedef int (*thread_pool_offload_t)(void *uctx);
+
+/** Why a request was dropped instead of being queued
+ *
+ */
+typedef enum {
+	QUEUE_SHED_FULL = 0,			//!< The queue had max_queue_size entries.
+	QUEUE_SHED_ACCT_LIMIT,			//!< auto_limit_acct threw away an accounting request.
+	QUEUE_SHED_DELAY_ACCT,			//!< Queue delay was over target, so accounting was shed.
+	QUEUE_SHED_DELAY_CLIENT,		//!< Queue delay was still over target, so low_priority
+						//!< clients were shed.
+	QUEUE_SHED_MAX
+} queue_shed_t;
+
+extern FR_NAME_NUMBER const queue_shed_table[];
+
 int	thread_pool_bootstrap(CONF_SECTION *cs, bool *spawn_workers);
 int	thread_pool_init(void);
 void	thread_pool_stop(void);
@@ -561,11 +663,26 @@ int	total_active_threads(void);
 void	thread_pool_lock(void);
 void	thread_pool_unlock(void);
 void	thread_pool_queue_stats(int array[RAD_LISTEN_MAX], int pps[2]);
+void	thread_pool_shed_stats(uint64_t shed[QUEUE_SHED_MAX]);
 uint32_t thread_pool_max_threads(void);
+int	thread_pool_offload(REQUEST *request, thread_pool_offload_t func, void *uctx, int *rcode);
+void	thread_pool_offload_stats(uint32_t *queued, uint64_t *completed, uint64_t *rejected,
+				  uint64_t *wait_usec, uint64_t *run_usec);
+
+isolated_pool_t	*thread_pool_find(char const *name);
+int	thread_pool_isolated_stats(unsigned int i, char const **name, uint32_t *queued, uint32_t *active,
+				   uint64_t *completed, uint64_t *rejected, uint64_t *wait_usec, uint64_t *run_usec);
+
+#ifdef WITH_THREAD_AFFINITY
+int	thread_affinity_check(char const *cpus, int32_t numa_node);
+int	thread_affinity_set(char const *cpus, int32_t numa_node);
+int	thread_affinity_attr(pthread_attr_t *attr, char const *cpus, int32_t numa_node, int index);
+#endif
 
 #ifndef HAVE_PTHREAD_H
 #  define rad_fork(n) fork()
 #  define rad_waitpid(a,b) waitpid(a,b, 0)
+#  define thread_pool_offload(_request, _func, _uctx, _rcode) ((*(_rcode) = (_func)(_uctx)), 0)
 #endif
 
 /* main_config.c */
@@ -627,6 +744,11 @@ int proxy_tls_send(rad_listen_t *listener, REQUEST *request);
  */
 #define PW_RADMIN_PORT 18120
 
+/*
+ *	For the Prometheus metrics listener.
+ */
+#define PW_METRICS_PORT 9812
+
 #ifdef __cplusplus
 }
 #endif
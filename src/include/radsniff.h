@@ -37,6 +37,10 @@ RCSIDH(radsniff_h, "$Id$")
 #  include <collectd/client.h>
 #endif
 
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
 #define RS_DEFAULT_PREFIX	"radsniff"	//!< Default instance
 #define RS_DEFAULT_SECRET	"testing123"	//!< Default secret
 #define RS_DEFAULT_TIMEOUT	5200		//!< Standard timeout of 5s + 300ms to cover network latency
@@ -216,8 +220,40 @@ typedef struct rs_event {
 	fr_pcap_t		*out;			//!< Where to write output.
 
 	rs_stats_t		*stats;			//!< Where to write stats.
+
+	TALLOC_CTX		*ctx;			//!< Where to allocate packets and requests.
 } rs_event_t;
 
+#ifdef HAVE_PTHREAD_H
+/** A thread capturing a share of the packets from each interface
+ *
+ * Each worker has its own capture handles, request and link trees, event
+ * list and stats.  The kernel decides which worker sees a packet, see
+ * fr_pcap_fanout().  The main thread merges the workers' stats at the end
+ * of each interval.
+ */
+typedef struct rs_worker {
+	unsigned int		num;			//!< Of this worker, from 0.
+	pthread_t		pthread_id;
+
+	pthread_mutex_t		mutex;			//!< Held while the worker is processing packets,
+							//!< and while its stats are being merged.
+
+	TALLOC_CTX		*ctx;			//!< Requests and packets.  Freed by the worker
+							//!< as it exits.
+	fr_event_list_t		*events;		//!< The worker's event list.
+	rbtree_t		*request_tree;		//!< Requests we're waiting for responses to.
+	rbtree_t		*link_tree;		//!< Requests linked by attribute, for -L.
+
+	fr_pcap_t		**in;			//!< Capture handles, one per interface.
+	int			num_in;
+
+	int			pipe[2];		//!< Written to tell the worker to exit.
+
+	rs_stats_t		*stats;			//!< Stats for the current interval.
+} rs_worker_t;
+#endif
+
 typedef struct rs_update rs_update_t;
 
 /** Callback for printing stats header.
@@ -285,6 +321,7 @@ struct rs {
 	rs_packet_logger_t	logger;			//!< Packet logger
 
 	int			buffer_pkts;		//!< Size of the ring buffer to setup for live capture.
+	int			workers;		//!< Threads to share live capture between.
 	uint64_t		limit;			//!< Maximum number of packets to capture
 
 	struct {
@@ -56,15 +56,34 @@ typedef enum {
 	HOME_STATE_UNKNOWN
 } home_state_t;
 
+#define HOME_LATENCY_BUCKETS	27	//!< Powers of two microseconds, up to 64s.
+
 typedef struct fr_socket_limit_t {
 	uint32_t	max_connections;
+	uint32_t	min_connections;
 	uint32_t	num_connections;
 	uint32_t	max_requests;
 	uint32_t	num_requests;
 	uint32_t	lifetime;
 	uint32_t	idle_timeout;
+	uint32_t	spare_ids;
 } fr_socket_limit_t;
 
+/** Limits packets per second, see rad_token_bucket_take()
+ *
+ * The state is one "theoretical arrival time", so the bucket can be
+ * updated by several threads without a lock.
+ */
+typedef struct fr_token_bucket_t {
+	uint32_t	rate;		//!< Packets per second.  0 means no limit.
+	uint32_t	burst;		//!< How many packets may arrive at once.  0 means "rate".
+	uint64_t	tat;		//!< When the bucket will be full again, in nanoseconds.
+} fr_token_bucket_t;
+
+#ifdef WITH_COA
+typedef struct coa_bulk_t coa_bulk_t;
+#endif
+
 typedef struct home_server {
 	char const		*log_name;		//!< The name used for log messages.
 
@@ -98,10 +117,19 @@ typedef struct home_server {
 	struct timeval		when;
 
 	struct timeval		response_window;
+	bool			adaptive_window;	//!< Derive the response window from the
+							//!< observed response times.
+	struct timeval		adaptive_response_window; //!< Response window derived from latency_hist.
+							//!< Unset until there are enough samples.
 	uint32_t		response_timeouts;
 	uint32_t		max_response_timeouts;
 	uint32_t		max_outstanding;	//!< Maximum outstanding requests.
 	uint32_t		currently_outstanding;
+	uint32_t		num_active;		//!< TCP connections which are accepting new requests.
+	uint32_t		latency;		//!< Moving average of the response time,
+							//!< in microseconds.  0 if not yet measured.
+	uint32_t		latency_hist[HOME_LATENCY_BUCKETS]; //!< Response times, by power of two.
+	uint32_t		latency_samples;	//!< Sum of latency_hist.
 
 	time_t			last_packet_sent;
 	time_t			last_packet_recv;
@@ -110,6 +138,9 @@ typedef struct home_server {
 	struct timeval		zombie_period_start;
 	uint32_t		zombie_period;		//!< Unresponsive for T, mark it dead.
 
+	bool			verbatim;		//!< Copy unmodified attributes from the received
+							//!< packet instead of encoding them.
+
 	int			state;
 
 	char const		*ping_check_str;
@@ -132,6 +163,10 @@ typedef struct home_server {
 	uint32_t		coa_mrc;
 	uint32_t		coa_mrt;
 	uint32_t		coa_mrd;
+
+	fr_token_bucket_t	coa_bulk_limit;		//!< Rate of packets sent by coa_bulk_enqueue().
+	uint32_t		coa_bulk_queue;		//!< Maximum number of packets waiting to be sent.
+	coa_bulk_t		*coa_bulk;		//!< Packets from coa_bulk_enqueue().
 #endif
 #ifdef WITH_TLS
 	fr_tls_server_conf_t	*tls;
@@ -153,7 +188,9 @@ typedef enum home_pool_type_t {
 	HOME_POOL_FAIL_OVER,
 	HOME_POOL_CLIENT_BALANCE,
 	HOME_POOL_CLIENT_PORT_BALANCE,
-	HOME_POOL_KEYED_BALANCE
+	HOME_POOL_KEYED_BALANCE,
+	HOME_POOL_LATENCY_BALANCE,
+	HOME_POOL_CONSISTENT_BALANCE
 } home_pool_type_t;
 
 
@@ -201,6 +238,8 @@ bool		realm_home_server_add(home_server_t *home);
 int		realm_realm_add( REALM *r, CONF_SECTION *cs);
 
 void		home_server_update_request(home_server_t *home, REQUEST *request);
+void		home_server_update_latency(home_server_t *home, struct timeval const *sent,
+					   struct timeval const *received);
 home_server_t	*home_server_ldb(char const *realmname, home_pool_t *pool, REQUEST *request);
 home_server_t	*home_server_find(fr_ipaddr_t *ipaddr, uint16_t port, int proto);
 
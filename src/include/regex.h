@@ -50,6 +50,7 @@ typedef struct regmatch {
 
 typedef struct regex {
 	bool		precompiled;	//!< Whether this regex was precompiled, or compiled for one of evaluation.
+	bool		cached;		//!< Whether this regex is owned by the runtime regex cache.
 	pcre		*compiled;	//!< Compiled regular expression.
 	pcre_extra	*extra;		//!< Result of studying a regular expression.
 } regex_t;
@@ -67,9 +68,22 @@ typedef struct regex {
 #      define REG_NOSUB (0)
 #    endif
 #  endif
+/*
+ *  Maximum number of runtime expressions cached per thread.
+ */
+#  ifndef REGEX_CACHE_SIZE
+#    define REGEX_CACHE_SIZE	256
+#  endif
+
 ssize_t regex_compile(TALLOC_CTX *ctx, regex_t **out, char const *pattern, size_t len,
 		      bool ignore_case, bool multiline, bool subcaptures, bool runtime);
+ssize_t regex_compile_cached(regex_t **out, char const *pattern, size_t len,
+			     bool ignore_case, bool multiline, bool subcaptures);
 int	regex_exec(regex_t *preg, char const *string, size_t len, regmatch_t pmatch[], size_t *nmatch);
+void	regex_cache_stats(uint64_t *hits, uint64_t *misses, uint64_t *evictions);
+#  ifdef HAVE_PCRE
+regex_t	*regex_dup(TALLOC_CTX *ctx, regex_t const *preg);
+#  endif
 #  ifdef __cplusplus
 }
 #  endif
@@ -6,6 +6,8 @@
  * @file include/sha1.h
  * @brief Local implementation of the SHA1 hashing scheme.
  */
+#include <stdbool.h>
+
 #ifdef WITH_OPENSSL_SHA1
 #  include <openssl/sha.h>
 #endif
@@ -36,6 +38,8 @@ void fr_sha1_final(uint8_t digest[20], fr_sha1_ctx *context);
  */
 void fr_sha1_final_no_len(uint8_t digest[20], fr_sha1_ctx* context);
 
+char const *fr_sha1_select(bool hw);
+
 #else  /* WITH_OPENSSL_SHA1 */
 USES_APPLE_DEPRECATED_API
 #  define fr_sha1_ctx	SHA_CTX
@@ -35,6 +35,9 @@ extern fr_state_tree_t *global_state;
 
 fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint32_t timeout);
 
+int fr_state_replication_init(fr_state_tree_t *state, CONF_SECTION *cs);
+bool fr_state_replication_stats(fr_state_tree_t *state, uint64_t *sent, uint64_t *received, uint64_t *dropped);
+
 void fr_state_discard(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *original);
 
 void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *packet);
@@ -46,6 +49,12 @@ bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 uint64_t fr_state_entries_created(fr_state_tree_t *state);
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state);
 uint32_t fr_state_entries_tracked(fr_state_tree_t *state);
+void fr_state_memory(fr_state_tree_t *state, size_t *bytes, size_t *blocks);
+
+uint32_t fr_state_entries_shards(fr_state_tree_t *state);
+uint64_t fr_state_entries_shard_created(fr_state_tree_t *state, uint32_t shard);
+uint64_t fr_state_entries_shard_timeout(fr_state_tree_t *state, uint32_t shard);
+uint32_t fr_state_entries_shard_tracked(fr_state_tree_t *state, uint32_t shard);
 
 #ifdef __cplusplus
 }
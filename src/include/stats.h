@@ -47,6 +47,7 @@ typedef struct fr_stats_t {
 	fr_uint_t	total_malformed_requests;
 	fr_uint_t	total_bad_authenticators;
 	fr_uint_t	total_packets_dropped;
+	fr_uint_t	total_rate_limited;	//!< Dropped before decoding, by max_pps.
 	fr_uint_t	total_no_records;
 	fr_uint_t	total_unknown_types;
 	fr_uint_t	total_timeouts;
@@ -61,24 +62,51 @@ typedef struct fr_stats_ema_t {
 	uint32_t	ema1, ema10;
 } fr_stats_ema_t;
 
-extern fr_stats_t	radius_auth_stats;
-#ifdef WITH_ACCOUNTING
-extern fr_stats_t	radius_acct_stats;
-#endif
-#ifdef WITH_COA
-extern fr_stats_t	radius_coa_stats;
-extern fr_stats_t	radius_dsc_stats;
-#endif
-#ifdef WITH_PROXY
-extern fr_stats_t	proxy_auth_stats;
-#ifdef WITH_ACCOUNTING
-extern fr_stats_t	proxy_acct_stats;
-#endif
-#ifdef WITH_COA
-extern fr_stats_t	proxy_coa_stats;
-extern fr_stats_t	proxy_dsc_stats;
-#endif
-#endif
+/** The server wide statistics
+ *
+ * Each thread counts into its own copy of these, which are added
+ * together when they're read.  The values are also sent in
+ * FR_NOTIFY_STATS messages, so new ones must be added at the end.
+ */
+typedef enum fr_stats_global_t {
+	FR_STATS_AUTH = 0,
+	FR_STATS_ACCT,
+	FR_STATS_COA,
+	FR_STATS_DSC,
+	FR_STATS_PROXY_AUTH,
+	FR_STATS_PROXY_ACCT,
+	FR_STATS_PROXY_COA,
+	FR_STATS_PROXY_DSC,
+	FR_STATS_GLOBAL_MAX
+} fr_stats_global_t;
+
+/** Counters in fr_stats_t, as numbered in FR_NOTIFY_STATS messages
+ *
+ * The values are sent to collectors, so new counters must be added
+ * at the end.
+ */
+typedef enum fr_stats_counter_t {
+	FR_STATS_COUNTER_REQUESTS = 0,
+	FR_STATS_COUNTER_INVALID_REQUESTS,
+	FR_STATS_COUNTER_DUP_REQUESTS,
+	FR_STATS_COUNTER_RESPONSES,
+	FR_STATS_COUNTER_ACCESS_ACCEPTS,
+	FR_STATS_COUNTER_ACCESS_REJECTS,
+	FR_STATS_COUNTER_ACCESS_CHALLENGES,
+	FR_STATS_COUNTER_MALFORMED_REQUESTS,
+	FR_STATS_COUNTER_BAD_AUTHENTICATORS,
+	FR_STATS_COUNTER_PACKETS_DROPPED,
+	FR_STATS_COUNTER_RATE_LIMITED,
+	FR_STATS_COUNTER_NO_RECORDS,
+	FR_STATS_COUNTER_UNKNOWN_TYPES,
+	FR_STATS_COUNTER_TIMEOUTS,
+	FR_STATS_COUNTER_MAX
+} fr_stats_counter_t;
+
+fr_stats_t *radius_stats_local(fr_stats_global_t which);
+void radius_stats_global(fr_stats_t *out, fr_stats_global_t which);
+int radius_stats_shared_init(uint32_t num);
+void radius_stats_shared_attach(uint32_t index);
 
 void radius_stats_init(int flag);
 void request_stats_final(REQUEST *request);
@@ -86,15 +114,93 @@ void request_stats_reply(REQUEST *request);
 void radius_stats_ema(fr_stats_ema_t *ema,
 		      struct timeval *start, struct timeval *end);
 
-#define FR_STATS_INC(_x, _y) radius_ ## _x ## _stats._y++;if (listener) listener->stats._y++;if (client) client->_x._y++;
-#define FR_STATS_TYPE_INC(_x) _x++
+typedef struct fr_stats_latency_t fr_stats_latency_t;
+
+fr_stats_latency_t *fr_stats_latency_alloc(TALLOC_CTX *ctx);
+void fr_stats_latency_add(fr_stats_latency_t *lat, struct timeval const *start, struct timeval const *end);
+uint64_t fr_stats_latency_percentiles(fr_stats_latency_t *lat, uint64_t *out, double const *pct, size_t num);
+uint64_t fr_stats_latency_sum(fr_stats_latency_t *lat);
+
+/** Called for each latency histogram by a walk function
+ *
+ * @param[in] ctx passed to the walk function.
+ * @param[in] name of the virtual server or module.
+ * @param[in] section or method the histogram is for.
+ * @param[in] lat the histogram.
+ */
+typedef void (*fr_stats_latency_walk_t)(void *ctx, char const *name, char const *section, fr_stats_latency_t *lat);
+
+/** Memory which a module or virtual server left in requests
+ *
+ * Only counted while main_config.memory_accounting is set.
+ */
+typedef struct fr_stats_alloc_t {
+	uint64_t	calls;			//!< Calls which were measured.
+	uint64_t	bytes;			//!< Bytes added to the request.
+	uint64_t	blocks;			//!< talloc chunks added to the request.
+} fr_stats_alloc_t;
+
+/** The size of a request before a call, see fr_stats_alloc_start()
+ */
+typedef struct fr_stats_alloc_mark_t {
+	void const	*ctx;			//!< NULL if memory accounting is off.
+	size_t		bytes;
+	size_t		blocks;
+} fr_stats_alloc_mark_t;
+
+void fr_stats_alloc_start(fr_stats_alloc_mark_t *mark, void const *ctx);
+void fr_stats_alloc_end(fr_stats_alloc_t *alloc, fr_stats_alloc_mark_t const *mark);
+
+/** Called for each module or virtual server by a memory walk function
+ *
+ * @param[in] ctx passed to the walk function.
+ * @param[in] name of the virtual server or module.
+ * @param[in] alloc memory left in requests.
+ * @param[in] bytes held by the module instance or virtual server.
+ * @param[in] blocks held by the module instance or virtual server.
+ */
+typedef void (*fr_stats_alloc_walk_t)(void *ctx, char const *name, fr_stats_alloc_t const *alloc,
+				      size_t bytes, size_t blocks);
+
+/** Server wide latency histograms, for the phases of a request
+ */
+typedef enum fr_stats_request_latency_t {
+	FR_STATS_LATENCY_QUEUE = 0,		//!< Waiting in the thread pool queue.
+	FR_STATS_LATENCY_PROXY,			//!< Waiting for a home server to reply.
+	FR_STATS_LATENCY_TOTAL,			//!< From receiving the request to sending the reply.
+	FR_STATS_LATENCY_MAX
+} fr_stats_request_latency_t;
+
+void request_stats_latency(fr_stats_request_latency_t which, struct timeval const *start, struct timeval const *end);
+void request_latency_walk(fr_stats_latency_walk_t walk, void *ctx);
+
+/*
+ *	For FR_STATS_INC, which is passed the name of the client's counters.
+ */
+#define FR_STATS_GLOBAL_auth	FR_STATS_AUTH
+#define FR_STATS_GLOBAL_acct	FR_STATS_ACCT
+#define FR_STATS_GLOBAL_coa	FR_STATS_COA
+#define FR_STATS_GLOBAL_dsc	FR_STATS_DSC
+
+/*
+ *	The counters for clients, listeners and home servers are shared
+ *	by all threads, so they're updated atomically.  The server wide
+ *	counters are local to the thread, and are just incremented.
+ */
+#define FR_STATS_INC(_x, _y) FR_STATS_LOCAL_INC(FR_STATS_GLOBAL_ ## _x, _y);if (listener) FR_STATS_TYPE_INC(listener->stats._y);if (client) FR_STATS_TYPE_INC(client->_x._y);
+#define FR_STATS_TYPE_INC(_x) FR_STATS_TYPE_ADD(_x, 1)
+#define FR_STATS_TYPE_ADD(_x, _n) (void) __atomic_fetch_add(&(_x), _n, __ATOMIC_RELAXED)
+#define FR_STATS_LOCAL_INC(_w, _y) radius_stats_local(_w)->_y++
 
 #else  /* WITH_STATS */
 #define request_stats_init(_x)
 #define request_stats_final(_x)
+#define request_stats_latency(_w, _s, _e)
 
 #define FR_STATS_INC(_x, _y)
 #define FR_STATS_TYPE_INC(_x)
+#define FR_STATS_TYPE_ADD(_x, _n)
+#define FR_STATS_LOCAL_INC(_w, _y)
 
 #endif
 
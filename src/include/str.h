@@ -0,0 +1,75 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_STR_H
+#define _FR_STR_H
+/**
+ * $Id$
+ *
+ * @file include/str.h
+ * @brief Vectorised string kernels for escaping, validation and case folding.
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+RCSIDH(str_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ *	Most extra characters a set may list.
+ */
+#define FR_STR_SET_CHARS	16
+
+/** A set of bytes, usually the ones an escape function has to deal with
+ *
+ * Sets are either a range and some extra characters, which are searched
+ * 16 bytes at a time, or an arbitrary table, which is searched a byte
+ * at a time.
+ */
+typedef struct fr_str_set {
+	uint8_t		lo;		//!< Bytes below lo are in the set.
+	uint8_t		hi;		//!< Bytes above hi are in the set.
+	char const	*chars;		//!< As are these, up to #FR_STR_SET_CHARS of them.
+					//!< '\\0' can't be listed, use lo instead.
+	uint8_t const	*table;		//!< If not NULL, the set is every byte for which
+					//!< table[byte] is non-zero, and the other fields
+					//!< are ignored.
+} fr_str_set_t;
+
+/** Initialise a set of bytes outside of [_lo, _hi], plus _chars
+ */
+#define FR_STR_SET(_lo, _hi, _chars) { .lo = (_lo), .hi = (_hi), .chars = (_chars) }
+
+int	fr_str_set_table(TALLOC_CTX *ctx, fr_str_set_t *set, char const *allowed);
+
+size_t	fr_str_span(fr_str_set_t const *set, uint8_t const *in, size_t inlen);
+
+size_t	fr_str_utf8_valid(uint8_t const *in, size_t inlen);
+
+void	fr_str_tolower(char *out, char const *in, size_t inlen);
+
+void	fr_str_hex_encode(char *out, uint8_t const *in, size_t inlen);
+
+size_t	fr_str_hex_decode(uint8_t *out, char const *in, size_t outlen);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FR_STR_H */
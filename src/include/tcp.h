@@ -27,4 +27,10 @@ RCSIDH(tcp_h, "$Id$")
 
 int fr_tcp_read_packet(RADIUS_PACKET *packet, int flags);
 RADIUS_PACKET *fr_tcp_recv(int sockfd, int flags);
+
+typedef struct fr_tcp_buffer_t fr_tcp_buffer_t;
+
+fr_tcp_buffer_t *fr_tcp_buffer_alloc(TALLOC_CTX *ctx, size_t size);
+ssize_t fr_tcp_buffer_recv(int sockfd, fr_tcp_buffer_t *buf);
+int fr_tcp_buffer_packet(fr_tcp_buffer_t *buf, RADIUS_PACKET *packet, int flags);
 #endif /* _FR_TCP_H */
@@ -0,0 +1,71 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_THREAD_CHANNEL_H
+#define _FR_THREAD_CHANNEL_H
+/**
+ * $Id$
+ *
+ * @file include/thread_channel.h
+ * @brief Structures and prototypes for passing messages between two threads.
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+RCSIDH(thread_channel_h, "$Id$")
+
+#include <freeradius-devel/event.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef HAVE_STDATOMIC_H
+typedef struct fr_thread_channel_t fr_thread_channel_t;
+
+/** Which end of the channel a thread is using
+ *
+ * Each end sends to, and receives from, the other end.
+ */
+typedef enum fr_thread_channel_side_t {
+	FR_THREAD_CHANNEL_MASTER = 0,		//!< The thread which reads packets from the network.
+	FR_THREAD_CHANNEL_WORKER		//!< The thread which processes them.
+} fr_thread_channel_side_t;
+
+/** Called when there are messages waiting for a side of the channel
+ *
+ * Should call #fr_thread_channel_recv until it returns 0.
+ */
+typedef void (*fr_thread_channel_recv_t)(fr_thread_channel_t *ch, fr_thread_channel_side_t side, void *ctx);
+
+fr_thread_channel_t	*fr_thread_channel_create(TALLOC_CTX *ctx, size_t size);
+size_t			fr_thread_channel_send(fr_thread_channel_t *ch, fr_thread_channel_side_t side,
+					       void * const *data, size_t num);
+size_t			fr_thread_channel_recv(fr_thread_channel_t *ch, fr_thread_channel_side_t side,
+					       void **out, size_t max);
+int			fr_thread_channel_wait(fr_thread_channel_t *ch, fr_thread_channel_side_t side);
+void			fr_thread_channel_signal(fr_thread_channel_t *ch, fr_thread_channel_side_t side);
+int			fr_thread_channel_fd(fr_thread_channel_t *ch, fr_thread_channel_side_t side);
+int			fr_thread_channel_event_insert(fr_event_list_t *el, fr_thread_channel_t *ch,
+						       fr_thread_channel_side_t side,
+						       fr_thread_channel_recv_t callback, void *ctx);
+int			fr_thread_channel_event_delete(fr_event_list_t *el, fr_thread_channel_t *ch,
+						       fr_thread_channel_side_t side);
+size_t			fr_thread_channel_num_elements(fr_thread_channel_t *ch, fr_thread_channel_side_t side);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FR_THREAD_CHANNEL_H */
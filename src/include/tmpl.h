@@ -64,8 +64,12 @@
  * user to determine whether they want the module to sanitise the value using presentation
  * format specific #xlat_escape_t function, or to operate on the raw value.
  *
+ * Where the caller wants the value itself, e.g. an integer or an IP address, rather than
+ * its string form, #tmpl_expand_value returns it without printing or allocating.
+ *
  * @see tmpl_expand
  * @see tmpl_aexpand
+ * @see tmpl_expand_value
  *
  * @copyright 2014-2015 The FreeRADIUS server project
  */
@@ -402,6 +406,10 @@ ssize_t			tmpl_expand(char const **out, char *buff, size_t outlen, REQUEST *requ
 ssize_t			tmpl_aexpand(TALLOC_CTX *ctx, char **out, REQUEST *request, vp_tmpl_t const *vpt,
 				     xlat_escape_t escape, void *escape_ctx);
 
+ssize_t			tmpl_expand_value(value_data_t *out, PW_TYPE *type, char *buff, size_t bufflen,
+					  REQUEST *request, vp_tmpl_t const *vpt,
+					  xlat_escape_t escape, void *escape_ctx);
+
 VALUE_PAIR		*tmpl_cursor_init(int *err, vp_cursor_t *cursor, REQUEST *request,
 					  vp_tmpl_t const *vpt);
 
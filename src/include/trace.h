@@ -0,0 +1,104 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_TRACE_H
+#define _FR_TRACE_H
+/**
+ * $Id$
+ *
+ * @file include/trace.h
+ * @brief Binary tracing of requests.
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+RCSIDH(trace_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** What happened to the request
+ *
+ * The values are written to trace files, so new types must be added
+ * at the end.
+ */
+typedef enum fr_trace_type_t {
+	FR_TRACE_INVALID = 0,
+	FR_TRACE_REQUEST_START,			//!< code is the packet code.
+	FR_TRACE_REQUEST_DONE,			//!< code is the reply code.  duration is from the request.
+	FR_TRACE_SECTION_ENTER,			//!< name is the virtual server.  code is the section.
+	FR_TRACE_SECTION_EXIT,			//!< As above, with rcode and duration.
+	FR_TRACE_MODULE_CALL,			//!< name is the module.  code is the method.
+	FR_TRACE_XLAT,				//!< name is the expansion.  code is 1 if it failed.
+	FR_TRACE_PROXY_SEND,			//!< name is the home server.  code is the packet code.
+	FR_TRACE_PROXY_REPLY,			//!< As above, with the reply code and duration.
+	FR_TRACE_PROXY_TIMEOUT,			//!< As above, with the duration.
+	FR_TRACE_MAX
+} fr_trace_type_t;
+
+#define FR_TRACE_NAME_LEN	(40)
+
+/** One event
+ *
+ * Fixed size, so recording an event is a copy, and not a printf.
+ * Names longer than FR_TRACE_NAME_LEN - 1 are truncated.
+ */
+typedef struct fr_trace_event_t {
+	uint64_t	when;			//!< Microseconds since the epoch.
+	uint32_t	number;			//!< Of the request.
+	uint32_t	duration;		//!< Microseconds, where the event has one.
+	uint16_t	type;			//!< fr_trace_type_t.
+	uint16_t	code;			//!< Packet code, or section.  See fr_trace_type_t.
+	uint8_t		rcode;			//!< rlm_rcode_t, where the event has one.
+	uint8_t		pad[3];
+	char		name[FR_TRACE_NAME_LEN];
+} fr_trace_event_t;
+
+/*
+ *	Trace files are a header, followed by "count" events, all in
+ *	the byte order of the server which wrote them.
+ */
+#define FR_TRACE_MAGIC		"FRTRACE"
+#define FR_TRACE_VERSION	(1)
+
+typedef struct fr_trace_header_t {
+	char		magic[8];		//!< FR_TRACE_MAGIC, and a trailing zero.
+	uint32_t	version;		//!< FR_TRACE_VERSION.
+	uint32_t	event_size;		//!< sizeof(fr_trace_event_t).
+	uint64_t	count;			//!< Number of events which follow.
+} fr_trace_header_t;
+
+void	fr_trace_event(REQUEST *request, fr_trace_type_t type, char const *name,
+		       unsigned int code, unsigned int rcode, struct timeval const *start);
+int	fr_trace_dump(FILE *fp, uint64_t *count);
+
+/** Record an event, if the request is being traced
+ *
+ * @param _request being processed.
+ * @param _type fr_trace_type_t.
+ * @param _name of the section, module, etc.  May be NULL.
+ * @param _code packet code, or section.
+ * @param _rcode returned, or 0.
+ * @param _start when the thing being traced started, or NULL.
+ */
+#define FR_TRACE(_request, _type, _name, _code, _rcode, _start) \
+	do { \
+		if ((_request)->trace) fr_trace_event(_request, _type, _name, _code, _rcode, _start); \
+	} while (0)
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FR_TRACE_H */
@@ -52,6 +52,47 @@ ssize_t udp_recv(int sockfd, void *data, size_t data_len, int flags,
 		 fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port, int *if_index,
 		 struct timeval *when);
 
+/** A datagram read by udp_batch_recv()
+ *
+ */
+typedef struct udp_batch_entry_t {
+	uint8_t			*data;		//!< Datagram data.  Owned by the batch.
+	size_t			data_len;	//!< Number of bytes received.  0 if the entry is invalid.
+
+	fr_ipaddr_t		src_ipaddr;
+	uint16_t		src_port;
+	fr_ipaddr_t		dst_ipaddr;
+	uint16_t		dst_port;
+	int			if_index;
+
+	struct timeval		timestamp;	//!< When the datagram was received.
+
+	char const		*verified;	//!< Secret the Request Authenticator has already
+						//!< been checked with.  See RADIUS_PACKET.
+} udp_batch_entry_t;
+
+typedef struct udp_batch_t udp_batch_t;
+
+#ifdef HAVE_RECVMMSG
+udp_batch_t *udp_batch_alloc(TALLOC_CTX *ctx, unsigned int num, size_t data_len);
+
+int udp_batch_recv(int sockfd, udp_batch_t *batch, udp_batch_entry_t **entries);
+#endif
+
+typedef struct udp_send_batch_t udp_send_batch_t;
+
+#ifdef HAVE_SENDMMSG
+udp_send_batch_t *udp_send_batch_alloc(TALLOC_CTX *ctx, unsigned int num, size_t data_len);
+
+ssize_t udp_send_batch_add(int sockfd, udp_send_batch_t *batch, void *data, size_t data_len,
+			   fr_ipaddr_t *src_ipaddr, uint16_t src_port, int if_index,
+			   fr_ipaddr_t *dst_ipaddr, uint16_t dst_port);
+
+unsigned int udp_send_batch_pending(udp_send_batch_t *batch);
+
+int udp_send_batch_flush(udp_send_batch_t *batch);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -37,10 +37,13 @@ int recvfromto(int s, void *buf, size_t len, int flags,
 	       struct sockaddr *from, socklen_t *fromlen,
 	       struct sockaddr *to, socklen_t *tolen,
 	       int *if_index, struct timeval *when);
+void recvfromto_cmsg(struct msghdr *msgh, struct sockaddr *to, socklen_t *tolen,
+		     int *if_index, struct timeval *when);
 int sendfromto(int s, void *buf, size_t len, int flags,
 	       struct sockaddr *from, socklen_t fromlen,
 	       struct sockaddr *to, socklen_t tolen,
 	       int if_index);
+void sendfromto_cmsg(struct msghdr *msgh, void *cbuf, struct sockaddr *from, int if_index);
 #endif
 
 #ifdef __cplusplus
@@ -82,8 +82,14 @@ ssize_t radius_axlat_struct(char **out, REQUEST *request, xlat_exp_t const *xlat
 			    void *ctx)
 	CC_HINT(nonnull (1, 2, 3));
 
+int xlat_eval_value(TALLOC_CTX *ctx, value_data_t *out, PW_TYPE type, fr_dict_attr_t const *enumv,
+		    REQUEST *request, xlat_exp_t const *xlat)
+	CC_HINT(nonnull (2, 5, 6));
+
 ssize_t xlat_tokenize(TALLOC_CTX *ctx, char *fmt, xlat_exp_t **head, char const **error);
 
+ssize_t xlat_compile(TALLOC_CTX *ctx, xlat_exp_t **head, char const *fmt, char const **error);
+
 size_t xlat_snprint(char *buffer, size_t bufsize, xlat_exp_t const *node);
 
 #define XLAT_DEFAULT_BUF_LEN	2048
@@ -93,6 +99,11 @@ int		xlat_register(void *mod_inst, char const *name,
 			      xlat_instantiate_t instantiate, size_t inst_size,
 			      size_t buf_len);
 
+int		xlat_register_pure(void *mod_inst, char const *name,
+				   xlat_func_t func, xlat_escape_t escape,
+				   xlat_instantiate_t instantiate, size_t inst_size,
+				   size_t buf_len);
+
 void		xlat_unregister(void *mod_inst, char const *name, xlat_func_t func);
 void		xlat_unregister_module(void *instance);
 bool		xlat_register_redundant(CONF_SECTION *cs);
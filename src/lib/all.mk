@@ -11,6 +11,8 @@ SOURCES		:= cbuff.c \
 		   dict.c \
 		   filters.c \
 		   hash.c \
+		   hash_oa.c \
+		   hash_rcu.c \
 		   hmacmd5.c \
 		   hmacsha1.c \
 		   inet.c \
@@ -32,6 +34,7 @@ SOURCES		:= cbuff.c \
 		   regex.c \
 		   sha1.c \
 		   snprintf.c \
+		   str.c \
 		   strlcat.c \
 		   strlcpy.c \
 		   socket.c \
@@ -43,6 +46,8 @@ SOURCES		:= cbuff.c \
 		   event.c \
 		   getaddrinfo.c \
 		   heap.c \
+		   atomic_queue.c \
+		   thread_channel.c \
 		   tcp.c \
 		   udp.c \
 		   base64.c \
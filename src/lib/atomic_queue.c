@@ -0,0 +1,629 @@
+/*
+ * atomic_queue.c	Thread-safe bounded queues, which don't use locks.
+ *
+ * Version:	$Id$
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ *  Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/atomic_queue.h>
+
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+
+/*
+ *	Put the head and tail on separate cache lines, so that
+ *	producers and consumers don't fight over the same line.
+ */
+#define CACHE_LINE_SIZE	(64)
+
+/*
+ *	Each entry has a sequence number, which says whether the entry
+ *	is ready to be written to, or read from.  This is the bounded
+ *	multi-producer / multi-consumer queue described by Dmitry
+ *	Vyukov.
+ *
+ *	A producer may write to an entry when seq == head.  Once it has
+ *	written the data, it sets seq = head + 1.
+ *
+ *	A consumer may read from an entry when seq == tail + 1.  Once
+ *	it has read the data, it sets seq = tail + size, which is the
+ *	value of "head" the next time a producer wraps around to it.
+ */
+typedef struct fr_atomic_queue_entry_t {
+	atomic_int_fast64_t	seq;
+	void			*data;
+} fr_atomic_queue_entry_t;
+
+struct fr_atomic_queue_t {
+	atomic_int_fast64_t	head;		//!< Where the producers write.
+	uint8_t			pad_head[CACHE_LINE_SIZE - sizeof(atomic_int_fast64_t)];
+
+	atomic_int_fast64_t	tail;		//!< Where the consumers read.
+	uint8_t			pad_tail[CACHE_LINE_SIZE - sizeof(atomic_int_fast64_t)];
+
+	size_t			size;
+
+	fr_atomic_queue_entry_t	entry[1];
+};
+
+/** Create a bounded queue, which may be used by multiple producers and consumers
+ *
+ * @param[in] ctx to allocate the queue in.
+ * @param[in] size of the queue.  Must be at least 2.
+ * @return
+ *	- The new queue.
+ *	- NULL on error.
+ */
+fr_atomic_queue_t *fr_atomic_queue_create(TALLOC_CTX *ctx, size_t size)
+{
+	size_t i;
+	fr_atomic_queue_t *aq;
+
+	if (size < 2) return NULL;
+
+	aq = talloc_zero_size(ctx, sizeof(*aq) + (sizeof(aq->entry[0]) * (size - 1)));
+	if (!aq) return NULL;
+	talloc_set_type(aq, fr_atomic_queue_t);
+
+	for (i = 0; i < size; i++) {
+		atomic_init(&aq->entry[i].seq, i);
+		aq->entry[i].data = NULL;
+	}
+
+	atomic_init(&aq->head, 0);
+	atomic_init(&aq->tail, 0);
+	aq->size = size;
+
+	/*
+	 *	Ensure that the initialised entries are visible
+	 *	to other threads.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	return aq;
+}
+
+/** Push a pointer onto the queue
+ *
+ * @param[in] aq to push onto.
+ * @param[in] data to push.
+ * @return
+ *	- true on success.
+ *	- false if the queue is full.
+ */
+bool fr_atomic_queue_push(fr_atomic_queue_t *aq, void *data)
+{
+	int64_t head;
+	fr_atomic_queue_entry_t *entry;
+
+	if (!data) return false;
+
+	head = atomic_load_explicit(&aq->head, memory_order_relaxed);
+
+	/*
+	 *	Try to find an entry we can write to.
+	 */
+	while (true) {
+		int64_t seq, diff;
+
+		entry = &aq->entry[head % aq->size];
+		seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+		diff = seq - head;
+
+		/*
+		 *	The consumers haven't yet read this entry, so
+		 *	the queue is full.
+		 */
+		if (diff < 0) return false;
+
+		/*
+		 *	Another producer has already written to this
+		 *	entry.  Reload "head", and try again.
+		 */
+		if (diff > 0) {
+			head = atomic_load_explicit(&aq->head, memory_order_relaxed);
+			continue;
+		}
+
+		/*
+		 *	Claim the entry.  On failure, "head" is updated
+		 *	to the current value, and we try again.
+		 */
+		if (atomic_compare_exchange_weak_explicit(&aq->head, &head, head + 1,
+							  memory_order_relaxed, memory_order_relaxed)) break;
+	}
+
+	entry->data = data;
+	atomic_store_explicit(&entry->seq, head + 1, memory_order_release);
+
+	return true;
+}
+
+/** Pop a pointer from the queue
+ *
+ * @param[in] aq to pop from.
+ * @param[out] p_data where to write the pointer.
+ * @return
+ *	- true on success.
+ *	- false if the queue is empty.
+ */
+bool fr_atomic_queue_pop(fr_atomic_queue_t *aq, void **p_data)
+{
+	int64_t tail;
+	fr_atomic_queue_entry_t *entry;
+
+	if (!p_data) return false;
+
+	tail = atomic_load_explicit(&aq->tail, memory_order_relaxed);
+
+	while (true) {
+		int64_t seq, diff;
+
+		entry = &aq->entry[tail % aq->size];
+		seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+		diff = seq - (tail + 1);
+
+		/*
+		 *	No producer has written to this entry yet, so
+		 *	the queue is empty.
+		 */
+		if (diff < 0) return false;
+
+		/*
+		 *	Another consumer has already read this entry.
+		 */
+		if (diff > 0) {
+			tail = atomic_load_explicit(&aq->tail, memory_order_relaxed);
+			continue;
+		}
+
+		if (atomic_compare_exchange_weak_explicit(&aq->tail, &tail, tail + 1,
+							  memory_order_relaxed, memory_order_relaxed)) break;
+	}
+
+	*p_data = entry->data;
+	entry->data = NULL;
+	atomic_store_explicit(&entry->seq, tail + aq->size, memory_order_release);
+
+	return true;
+}
+
+/** Return the maximum number of entries in the queue
+ *
+ */
+size_t fr_atomic_queue_size(fr_atomic_queue_t *aq)
+{
+	return aq->size;
+}
+
+/** Return the approximate number of entries in the queue
+ *
+ * The value may be out of date by the time the caller looks at it.
+ */
+size_t fr_atomic_queue_num_elements(fr_atomic_queue_t *aq)
+{
+	int64_t head, tail;
+
+	tail = atomic_load_explicit(&aq->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&aq->head, memory_order_relaxed);
+
+	if (head <= tail) return 0;
+
+	if ((size_t) (head - tail) > aq->size) return aq->size;
+
+	return head - tail;
+}
+
+/** Round a queue size up to a power of 2, so that entries can be found with a mask
+ *
+ */
+static size_t queue_size_round(size_t size)
+{
+	size_t rounded = 2;
+
+	while (rounded < size) {
+		if (rounded > (SIZE_MAX >> 1)) return 0;
+		rounded <<= 1;
+	}
+
+	return rounded;
+}
+
+/*
+ *	A ring with exactly one producer and one consumer.
+ *
+ *	Each side only ever writes its own index, so no atomic
+ *	read-modify-write operations are needed.  Each side also
+ *	keeps a copy of the other side's index, and only reloads it
+ *	when the copy says the ring is full (or empty).  So the
+ *	cache line holding the other index is only pulled across
+ *	when it's needed.
+ */
+struct fr_spsc_queue_t {
+	atomic_int_fast64_t	head;		//!< Where the producer writes.
+	int64_t			tail_cache;	//!< Producer's copy of "tail".
+	uint8_t			pad_head[CACHE_LINE_SIZE - sizeof(atomic_int_fast64_t) - sizeof(int64_t)];
+
+	atomic_int_fast64_t	tail;		//!< Where the consumer reads.
+	int64_t			head_cache;	//!< Consumer's copy of "head".
+	uint8_t			pad_tail[CACHE_LINE_SIZE - sizeof(atomic_int_fast64_t) - sizeof(int64_t)];
+
+	size_t			size;
+	size_t			mask;
+
+	void			*entry[1];
+};
+
+/** Create a bounded queue, which may be used by one producer and one consumer
+ *
+ * @param[in] ctx to allocate the queue in.
+ * @param[in] size of the queue.  Rounded up to a power of 2.
+ * @return
+ *	- The new queue.
+ *	- NULL on error.
+ */
+fr_spsc_queue_t *fr_spsc_queue_create(TALLOC_CTX *ctx, size_t size)
+{
+	fr_spsc_queue_t *sq;
+
+	size = queue_size_round(size);
+	if (!size) return NULL;
+
+	sq = talloc_zero_size(ctx, sizeof(*sq) + (sizeof(sq->entry[0]) * (size - 1)));
+	if (!sq) return NULL;
+	talloc_set_type(sq, fr_spsc_queue_t);
+
+	atomic_init(&sq->head, 0);
+	atomic_init(&sq->tail, 0);
+	sq->size = size;
+	sq->mask = size - 1;
+
+	atomic_thread_fence(memory_order_seq_cst);
+
+	return sq;
+}
+
+/** Push multiple pointers onto the queue
+ *
+ * May only be called by the producer.
+ *
+ * @param[in] sq to push onto.
+ * @param[in] data array of pointers to push.
+ * @param[in] num of pointers in the array.
+ * @return the number of pointers pushed, which is less than num if the queue filled up.
+ */
+size_t fr_spsc_queue_push_batch(fr_spsc_queue_t *sq, void * const *data, size_t num)
+{
+	int64_t head;
+	size_t i, room;
+
+	head = atomic_load_explicit(&sq->head, memory_order_relaxed);
+
+	room = sq->size - (size_t) (head - sq->tail_cache);
+	if (room < num) {
+		sq->tail_cache = atomic_load_explicit(&sq->tail, memory_order_acquire);
+		room = sq->size - (size_t) (head - sq->tail_cache);
+	}
+	if (num > room) num = room;
+
+	for (i = 0; i < num; i++) sq->entry[(head + i) & sq->mask] = data[i];
+
+	/*
+	 *	Publish all of the entries at once.
+	 */
+	if (num) atomic_store_explicit(&sq->head, head + num, memory_order_release);
+
+	return num;
+}
+
+/** Push a pointer onto the queue
+ *
+ * May only be called by the producer.
+ *
+ * @param[in] sq to push onto.
+ * @param[in] data to push.
+ * @return
+ *	- true on success.
+ *	- false if the queue is full.
+ */
+bool fr_spsc_queue_push(fr_spsc_queue_t *sq, void *data)
+{
+	if (!data) return false;
+
+	return (fr_spsc_queue_push_batch(sq, &data, 1) == 1);
+}
+
+/** Pop multiple pointers from the queue
+ *
+ * May only be called by the consumer.
+ *
+ * @param[in] sq to pop from.
+ * @param[out] out array to write the pointers to.
+ * @param[in] max number of pointers to pop.
+ * @return the number of pointers popped.
+ */
+size_t fr_spsc_queue_pop_batch(fr_spsc_queue_t *sq, void **out, size_t max)
+{
+	int64_t tail;
+	size_t i, avail;
+
+	tail = atomic_load_explicit(&sq->tail, memory_order_relaxed);
+
+	avail = (size_t) (sq->head_cache - tail);
+	if (avail < max) {
+		sq->head_cache = atomic_load_explicit(&sq->head, memory_order_acquire);
+		avail = (size_t) (sq->head_cache - tail);
+	}
+	if (max > avail) max = avail;
+
+	for (i = 0; i < max; i++) out[i] = sq->entry[(tail + i) & sq->mask];
+
+	/*
+	 *	Give all of the entries back to the producer at once.
+	 */
+	if (max) atomic_store_explicit(&sq->tail, tail + max, memory_order_release);
+
+	return max;
+}
+
+/** Pop a pointer from the queue
+ *
+ * May only be called by the consumer.
+ *
+ * @param[in] sq to pop from.
+ * @param[out] p_data where to write the pointer.
+ * @return
+ *	- true on success.
+ *	- false if the queue is empty.
+ */
+bool fr_spsc_queue_pop(fr_spsc_queue_t *sq, void **p_data)
+{
+	if (!p_data) return false;
+
+	return (fr_spsc_queue_pop_batch(sq, p_data, 1) == 1);
+}
+
+/** Return the maximum number of entries in the queue
+ *
+ */
+size_t fr_spsc_queue_size(fr_spsc_queue_t *sq)
+{
+	return sq->size;
+}
+
+/** Return the approximate number of entries in the queue
+ *
+ * The value may be out of date by the time the caller looks at it.
+ */
+size_t fr_spsc_queue_num_elements(fr_spsc_queue_t *sq)
+{
+	int64_t head, tail;
+
+	tail = atomic_load_explicit(&sq->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&sq->head, memory_order_relaxed);
+
+	if (head <= tail) return 0;
+
+	if ((size_t) (head - tail) > sq->size) return sq->size;
+
+	return head - tail;
+}
+
+/*
+ *	A ring with many producers, and one consumer.
+ *
+ *	Producers claim a run of entries by moving "head" forward,
+ *	then fill them in, and mark each one as ready by setting its
+ *	sequence number to its position + 1.  As entries may be
+ *	filled in out of order, the consumer checks the sequence
+ *	number of each entry before reading it.
+ *
+ *	There's only one consumer, so it updates "tail" without any
+ *	atomic read-modify-write operations.  Producers read "tail"
+ *	to find out how much room there is.
+ */
+typedef struct fr_mpsc_queue_entry_t {
+	atomic_int_fast64_t	seq;
+	void			*data;
+} fr_mpsc_queue_entry_t;
+
+struct fr_mpsc_queue_t {
+	atomic_int_fast64_t	head;		//!< Where the producers write.
+	uint8_t			pad_head[CACHE_LINE_SIZE - sizeof(atomic_int_fast64_t)];
+
+	atomic_int_fast64_t	tail;		//!< Where the consumer reads.
+	uint8_t			pad_tail[CACHE_LINE_SIZE - sizeof(atomic_int_fast64_t)];
+
+	size_t			size;
+	size_t			mask;
+
+	fr_mpsc_queue_entry_t	entry[1];
+};
+
+/** Create a bounded queue, which may be used by multiple producers and one consumer
+ *
+ * @param[in] ctx to allocate the queue in.
+ * @param[in] size of the queue.  Rounded up to a power of 2.
+ * @return
+ *	- The new queue.
+ *	- NULL on error.
+ */
+fr_mpsc_queue_t *fr_mpsc_queue_create(TALLOC_CTX *ctx, size_t size)
+{
+	size_t i;
+	fr_mpsc_queue_t *mq;
+
+	size = queue_size_round(size);
+	if (!size) return NULL;
+
+	mq = talloc_zero_size(ctx, sizeof(*mq) + (sizeof(mq->entry[0]) * (size - 1)));
+	if (!mq) return NULL;
+	talloc_set_type(mq, fr_mpsc_queue_t);
+
+	for (i = 0; i < size; i++) {
+		atomic_init(&mq->entry[i].seq, 0);
+		mq->entry[i].data = NULL;
+	}
+
+	atomic_init(&mq->head, 0);
+	atomic_init(&mq->tail, 0);
+	mq->size = size;
+	mq->mask = size - 1;
+
+	atomic_thread_fence(memory_order_seq_cst);
+
+	return mq;
+}
+
+/** Push multiple pointers onto the queue
+ *
+ * The pointers are pushed as one contiguous run, so they won't
+ * be interleaved with pointers from other producers.
+ *
+ * @param[in] mq to push onto.
+ * @param[in] data array of pointers to push.
+ * @param[in] num of pointers in the array.
+ * @return the number of pointers pushed, which is less than num if the queue filled up.
+ */
+size_t fr_mpsc_queue_push_batch(fr_mpsc_queue_t *mq, void * const *data, size_t num)
+{
+	int64_t head, tail;
+	size_t i, room;
+
+	if (!num) return 0;
+
+	head = atomic_load_explicit(&mq->head, memory_order_relaxed);
+
+	/*
+	 *	Claim as many entries as we can.  On failure, "head"
+	 *	is updated to the current value, and we try again.
+	 */
+	do {
+		tail = atomic_load_explicit(&mq->tail, memory_order_acquire);
+
+		room = mq->size - (size_t) (head - tail);
+		if (room == 0) return 0;
+		if (num > room) num = room;
+	} while (!atomic_compare_exchange_weak_explicit(&mq->head, &head, head + num,
+							memory_order_relaxed, memory_order_relaxed));
+
+	for (i = 0; i < num; i++) {
+		fr_mpsc_queue_entry_t *entry = &mq->entry[(head + i) & mq->mask];
+
+		entry->data = data[i];
+		atomic_store_explicit(&entry->seq, head + i + 1, memory_order_release);
+	}
+
+	return num;
+}
+
+/** Push a pointer onto the queue
+ *
+ * @param[in] mq to push onto.
+ * @param[in] data to push.
+ * @return
+ *	- true on success.
+ *	- false if the queue is full.
+ */
+bool fr_mpsc_queue_push(fr_mpsc_queue_t *mq, void *data)
+{
+	if (!data) return false;
+
+	return (fr_mpsc_queue_push_batch(mq, &data, 1) == 1);
+}
+
+/** Pop multiple pointers from the queue
+ *
+ * May only be called by the consumer.  Stops at the first entry
+ * which a producer has claimed, but not yet filled in.
+ *
+ * @param[in] mq to pop from.
+ * @param[out] out array to write the pointers to.
+ * @param[in] max number of pointers to pop.
+ * @return the number of pointers popped.
+ */
+size_t fr_mpsc_queue_pop_batch(fr_mpsc_queue_t *mq, void **out, size_t max)
+{
+	int64_t tail;
+	size_t i;
+
+	tail = atomic_load_explicit(&mq->tail, memory_order_relaxed);
+
+	for (i = 0; i < max; i++) {
+		fr_mpsc_queue_entry_t *entry = &mq->entry[(tail + i) & mq->mask];
+
+		if (atomic_load_explicit(&entry->seq, memory_order_acquire) != (tail + (int64_t) i + 1)) break;
+
+		out[i] = entry->data;
+		entry->data = NULL;
+	}
+
+	/*
+	 *	Give all of the entries back to the producers at once.
+	 */
+	if (i) atomic_store_explicit(&mq->tail, tail + i, memory_order_release);
+
+	return i;
+}
+
+/** Pop a pointer from the queue
+ *
+ * May only be called by the consumer.
+ *
+ * @param[in] mq to pop from.
+ * @param[out] p_data where to write the pointer.
+ * @return
+ *	- true on success.
+ *	- false if the queue is empty.
+ */
+bool fr_mpsc_queue_pop(fr_mpsc_queue_t *mq, void **p_data)
+{
+	if (!p_data) return false;
+
+	return (fr_mpsc_queue_pop_batch(mq, p_data, 1) == 1);
+}
+
+/** Return the maximum number of entries in the queue
+ *
+ */
+size_t fr_mpsc_queue_size(fr_mpsc_queue_t *mq)
+{
+	return mq->size;
+}
+
+/** Return the approximate number of entries in the queue
+ *
+ * The value may be out of date by the time the caller looks at it.
+ */
+size_t fr_mpsc_queue_num_elements(fr_mpsc_queue_t *mq)
+{
+	int64_t head, tail;
+
+	tail = atomic_load_explicit(&mq->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&mq->head, memory_order_relaxed);
+
+	if (head <= tail) return 0;
+
+	if ((size_t) (head - tail) > mq->size) return mq->size;
+
+	return head - tail;
+}
+#endif	/* HAVE_STDATOMIC_H */
@@ -29,6 +29,127 @@ RCSID("$Id$")
 
 #define us(x) (uint8_t) x
 
+/*
+ *	Vector implementations.  AVX2 is picked at run time, as it's
+ *	optional on x86.  NEON is always there on AArch64.
+ *
+ *	Both only handle whole blocks of input, and only blocks which
+ *	are entirely in the alphabet.  Everything else, including the
+ *	padding, is left to the scalar code, so the results are the
+ *	same as they'd be without them.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define WITH_BASE64_AVX2
+#  include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+#  define WITH_BASE64_NEON
+#  include <arm_neon.h>
+#endif
+
+static char const b64str[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#ifdef WITH_BASE64_AVX2
+static bool base64_avx2_usable(void)
+{
+	static int usable = -1;
+
+	if (usable < 0) {
+		__builtin_cpu_init();
+		usable = __builtin_cpu_supports("avx2") ? 1 : 0;
+	}
+
+	return usable == 1;
+}
+
+/** Encode 24 bytes at a time
+ *
+ * Each 128 bit lane takes 12 bytes, spreads each group of 3 over a 32 bit
+ * word, pulls the four 6 bit indices out with multiplies, then maps the
+ * indices to characters by adding an offset picked with a byte shuffle.
+ *
+ * @return the number of bytes consumed.  Four characters are written for
+ *	every three bytes consumed.
+ */
+static size_t CC_HINT(target("avx2")) base64_encode_avx2(char *out, uint8_t const *in, size_t inlen)
+{
+	size_t		i;
+	__m256i const	shuf = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+						1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	__m256i const	offsets = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+						   '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+						   '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+						   'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+						   '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+						   '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+	/*
+	 *	The second lane loads 16 bytes from offset 12.
+	 */
+	for (i = 0; (i + 28) <= inlen; i += 24) {
+		__m256i v, t0, t1, idx, cls;
+
+		v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i const *)(in + i))),
+					    _mm_loadu_si128((__m128i const *)(in + i + 12)), 1);
+		v = _mm256_shuffle_epi8(v, shuf);
+
+		t0 = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)),
+					_mm256_set1_epi32(0x04000040));
+		t1 = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)),
+					_mm256_set1_epi32(0x01000010));
+		idx = _mm256_or_si256(t0, t1);
+
+		/*
+		 *	0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+		 */
+		cls = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+		cls = _mm256_or_si256(cls, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx),
+							    _mm256_set1_epi8(13)));
+
+		_mm256_storeu_si256((__m256i *)(out + ((i / 3) * 4)),
+				    _mm256_add_epi8(idx, _mm256_shuffle_epi8(offsets, cls)));
+	}
+
+	return i;
+}
+#endif
+
+#ifdef WITH_BASE64_NEON
+/** Encode 48 bytes at a time
+ *
+ * @return the number of bytes consumed.
+ */
+static size_t base64_encode_neon(char *out, uint8_t const *in, size_t inlen)
+{
+	size_t		i;
+	uint8x16x4_t	alphabet;
+	uint8x16_t const mask = vdupq_n_u8(0x3f);
+
+	alphabet.val[0] = vld1q_u8((uint8_t const *) b64str);
+	alphabet.val[1] = vld1q_u8((uint8_t const *) b64str + 16);
+	alphabet.val[2] = vld1q_u8((uint8_t const *) b64str + 32);
+	alphabet.val[3] = vld1q_u8((uint8_t const *) b64str + 48);
+
+	for (i = 0; (i + 48) <= inlen; i += 48) {
+		uint8x16x3_t	v = vld3q_u8(in + i);
+		uint8x16x4_t	c;
+
+		c.val[0] = vshrq_n_u8(v.val[0], 2);
+		c.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(v.val[0], 4), vshrq_n_u8(v.val[1], 4)), mask);
+		c.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(v.val[1], 2), vshrq_n_u8(v.val[2], 6)), mask);
+		c.val[3] = vandq_u8(v.val[2], mask);
+
+		c.val[0] = vqtbl4q_u8(alphabet, c.val[0]);
+		c.val[1] = vqtbl4q_u8(alphabet, c.val[1]);
+		c.val[2] = vqtbl4q_u8(alphabet, c.val[2]);
+		c.val[3] = vqtbl4q_u8(alphabet, c.val[3]);
+
+		vst4q_u8((uint8_t *) out + ((i / 3) * 4), c);
+	}
+
+	return i;
+}
+#endif
+
 /** Base 64 encode binary data
  *
  * Base64 encode IN array of size INLEN into OUT array of size OUTLEN.
@@ -43,14 +164,23 @@ RCSID("$Id$")
  */
 size_t fr_base64_encode(char *out, size_t outlen, uint8_t const *in, size_t inlen)
 {
-	static char const b64str[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
 	char *p = out;
+	size_t done = 0;
+
 	if (outlen < (FR_BASE64_ENC_LENGTH(inlen) + 1)) {
 		*out = '\0';
 		return -1;
 	}
 
+#ifdef WITH_BASE64_AVX2
+	if (base64_avx2_usable()) done = base64_encode_avx2(p, in, inlen);
+#elif defined(WITH_BASE64_NEON)
+	done = base64_encode_neon(p, in, inlen);
+#endif
+	p += (done / 3) * 4;
+	in += done;
+	inlen -= done;
+
 	while (inlen) {
 		*p++ = b64str[(in[0] >> 2) & 0x3f];
 		*p++ = b64str[((in[0] << 4) + (--inlen ? in[1] >> 4 : 0)) & 0x3f];
@@ -225,6 +355,113 @@ bool fr_is_base64(char c)
 	return b64[us(c)] >= 0;
 }
 
+#ifdef WITH_BASE64_AVX2
+/** Decode 32 characters at a time
+ *
+ * Characters are classified by their high and low nibbles, with a pair of
+ * byte shuffles.  Any which aren't in the alphabet, including '=', end the
+ * loop.  The others are mapped to their 6 bit values by adding an offset
+ * picked by the high nibble, then packed together with multiply-adds.
+ *
+ * @return the number of characters consumed.  Three bytes are written for
+ *	every four characters consumed.
+ */
+static size_t CC_HINT(target("avx2")) base64_decode_avx2(uint8_t *out, char const *in, size_t inlen)
+{
+	size_t		i;
+	__m256i const	lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+						  0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+						  0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+						  0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	__m256i const	lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+						  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+						  0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+						  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	__m256i const	lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+						    0, 0, 0, 0, 0, 0, 0, 0,
+						    0, 16, 19, 4, -65, -65, -71, -71,
+						    0, 0, 0, 0, 0, 0, 0, 0);
+	__m256i const	mask_2f = _mm256_set1_epi8(0x2f);
+	__m256i const	pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+						2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	__m256i const	store = _mm256_setr_epi32(-1, -1, -1, -1, -1, -1, 0, 0);
+
+	for (i = 0; (i + 32) <= inlen; i += 32) {
+		__m256i v, hi_nibbles, roll;
+
+		v = _mm256_loadu_si256((__m256i const *)(in + i));
+		hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(v, 4), mask_2f);
+
+		if (!_mm256_testz_si256(_mm256_shuffle_epi8(lut_lo, _mm256_and_si256(v, mask_2f)),
+					_mm256_shuffle_epi8(lut_hi, hi_nibbles))) break;
+
+		/*
+		 *	'/' shares its high nibble with '+', so it
+		 *	gets the next offset along.
+		 */
+		roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(v, mask_2f), hi_nibbles));
+		v = _mm256_add_epi8(v, roll);
+
+		v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+		v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+		v = _mm256_shuffle_epi8(v, pack);
+		v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 0, 0));
+
+		_mm256_maskstore_epi32((int *)(out + ((i / 4) * 3)), store, v);
+	}
+
+	return i;
+}
+#endif
+
+#ifdef WITH_BASE64_NEON
+/** Decode 64 characters at a time
+ *
+ * @return the number of characters consumed.
+ */
+static size_t base64_decode_neon(uint8_t *out, char const *in, size_t inlen)
+{
+	size_t		i, j;
+	uint8_t		values[128];
+	uint8x16x4_t	lo, hi;
+
+	/*
+	 *	Each character's value plus one, so that zero means
+	 *	it's not in the alphabet.  The table lookups also give
+	 *	zero for out of range indices.
+	 */
+	for (j = 0; j < sizeof(values); j++) values[j] = b64[j] + 1;
+
+	for (j = 0; j < 4; j++) {
+		lo.val[j] = vld1q_u8(values + (j * 16));
+		hi.val[j] = vld1q_u8(values + 64 + (j * 16));
+	}
+
+	for (i = 0; (i + 64) <= inlen; i += 64) {
+		uint8x16x4_t	c = vld4q_u8((uint8_t const *) in + i);
+		uint8x16x3_t	o;
+		uint8x16_t	invalid = vdupq_n_u8(0);
+
+		for (j = 0; j < 4; j++) {
+			uint8x16_t v = vorrq_u8(vqtbl4q_u8(lo, c.val[j]),
+						vqtbl4q_u8(hi, vsubq_u8(c.val[j], vdupq_n_u8(64))));
+
+			invalid = vorrq_u8(invalid, vceqq_u8(v, vdupq_n_u8(0)));
+			c.val[j] = vsubq_u8(v, vdupq_n_u8(1));
+		}
+		if (vmaxvq_u8(invalid)) break;
+
+		o.val[0] = vorrq_u8(vshlq_n_u8(c.val[0], 2), vshrq_n_u8(c.val[1], 4));
+		o.val[1] = vorrq_u8(vshlq_n_u8(c.val[1], 4), vshrq_n_u8(c.val[2], 2));
+		o.val[2] = vorrq_u8(vshlq_n_u8(c.val[2], 6), c.val[3]);
+
+		vst3q_u8(out + ((i / 4) * 3), o);
+	}
+
+	return i;
+}
+#endif
+
 /* Decode base64 encoded input array.
  *
  * Decode base64 encoded input array IN of length INLEN to output array OUT that
@@ -251,11 +488,21 @@ bool fr_is_base64(char c)
 ssize_t fr_base64_decode(uint8_t *out, size_t outlen, char const *in, size_t inlen)
 {
 	uint8_t *p = out;
+	size_t done = 0;
 
 	if (outlen <  FR_BASE64_DEC_LENGTH(inlen)) {
 		return -1;
 	}
 
+#ifdef WITH_BASE64_AVX2
+	if (base64_avx2_usable()) done = base64_decode_avx2(p, in, inlen);
+#elif defined(WITH_BASE64_NEON)
+	done = base64_decode_neon(p, in, inlen);
+#endif
+	p += (done / 4) * 3;
+	in += done;
+	inlen -= done;
+
 	while (inlen >= 2) {
 		if (!fr_is_base64(in[0]) || !fr_is_base64(in[1])) {
 			break;
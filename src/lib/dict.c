@@ -35,6 +35,20 @@ RCSID("$Id$")
 
 #define MAX_ARGV (16)
 
+/*
+ *	Most distinct values we'll intern, across all attributes
+ *	with the 'intern' flag.  Beyond this values are copied as
+ *	usual, so a peer sending random values can't grow the table
+ *	without bound.
+ */
+#define DICT_INTERN_MAX (65536)
+
+/*
+ *	Most unknown attributes we'll keep definitions for.  As
+ *	above, beyond this they're allocated per VALUE_PAIR.
+ */
+#define DICT_UNKNOWN_CACHE_MAX (4096)
+
 /*
  *	For faster HUP's, we cache the stat information for
  *	files we've $INCLUDEd
@@ -44,6 +58,25 @@ typedef struct dict_stat_t {
 	struct stat stat_buf;
 } dict_stat_t;
 
+/*
+ *	An interned value.  The string follows the structure.
+ */
+typedef struct dict_intern_t {
+	char const		*str;
+	size_t			len;
+} dict_intern_t;
+
+/*
+ *	A cached unknown attribute, and the arguments it was
+ *	created from.
+ */
+typedef struct dict_unknown_t {
+	fr_dict_attr_t const	*parent;
+	unsigned int		vendor;
+	unsigned int		attr;
+	fr_dict_attr_t const	*da;
+} dict_unknown_t;
+
 typedef struct dict_enum_fixup_t {
 	char			attrstr[FR_DICT_ATTR_MAX_NAME_LEN];
 	fr_dict_enum_t		*dval;
@@ -64,15 +97,18 @@ struct fr_dict {
 	dict_stat_t		*stat_head;
 	dict_stat_t		*stat_tail;
 
-	fr_hash_table_t		*vendors_by_name;	//!< Lookup vendor by name.
-	fr_hash_table_t		*vendors_by_num;	//!< Lookup vendor by PEN.
+	fr_hash_oa_t		*vendors_by_name;	//!< Lookup vendor by name.
+	fr_hash_oa_t		*vendors_by_num;	//!< Lookup vendor by PEN.
+
+	fr_hash_oa_t		*attributes_by_name;	//!< Allow attribute lookup by unique name.
 
-	fr_hash_table_t		*attributes_by_name;	//!< Allow attribute lookup by unique name.
+	fr_hash_oa_t		*attributes_combo;	//!< Lookup variants of polymorphic attributes.
 
-	fr_hash_table_t		*attributes_combo;	//!< Lookup variants of polymorphic attributes.
+	fr_hash_oa_t		*values_by_da;		//!< Lookup an attribute enum value by integer value.
+	fr_hash_oa_t		*values_by_name;	//!< Lookup an attribute enum value by name.
 
-	fr_hash_table_t		*values_by_da;		//!< Lookup an attribute enum value by integer value.
-	fr_hash_table_t		*values_by_name;	//!< Lookup an attribute enum value by name.
+	fr_hash_rcu_t		*interned;		//!< Values of attributes with the 'intern' flag.
+	fr_hash_rcu_t		*unknown_cache;		//!< Unknown attributes seen in packets.
 
 	fr_dict_attr_t		*root;			//!< Root attribute of this dictionary.
 	TALLOC_CTX		*pool;			//!< Talloc memory pool to reduce mallocs.
@@ -80,6 +116,8 @@ struct fr_dict {
 
 fr_dict_t *fr_dict_internal = NULL;	//!< Internal server dictionary.
 
+#define DICT_POOL_SIZE (1024 * 1024 * 5)
+
 /** Map data types to names representing those types
  */
 const FR_NAME_NUMBER dict_attr_types[] = {
@@ -197,9 +235,14 @@ static uint32_t dict_hash_name(char const *name)
 	uint32_t hash = FNV_MAGIC_INIT;
 	char const *p;
 
+	/*
+	 *	Names are compared with strcasecmp(), which only folds
+	 *	ASCII letters in the C locale.  Do the same here,
+	 *	without calling the ctype functions for every character.
+	 */
 	for (p = name; *p != '\0'; p++) {
 		int c = *(unsigned char const *)p;
-		if (isalpha(c)) c = tolower(c);
+		if ((c >= 'A') && (c <= 'Z')) c += 'a' - 'A';
 
 		hash *= FNV_MAGIC_PRIME;
 		hash ^= (uint32_t)(c & 0xff);
@@ -317,6 +360,50 @@ static int dict_enum_value_cmp(void const *one, void const *two)
 	return a->value - b->value;
 }
 
+static uint32_t dict_intern_hash(void const *data)
+{
+	dict_intern_t const *in = data;
+
+	return fr_hash(in->str, in->len);
+}
+
+static int dict_intern_cmp(void const *one, void const *two)
+{
+	dict_intern_t const *a = one;
+	dict_intern_t const *b = two;
+
+	if (a->len != b->len) return (a->len < b->len) ? -1 : +1;
+
+	return memcmp(a->str, b->str, a->len);
+}
+
+static void dict_intern_free(void *data)
+{
+	talloc_free(data);
+}
+
+static uint32_t dict_unknown_hash(void const *data)
+{
+	uint32_t hash;
+	dict_unknown_t const *u = data;
+
+	hash = fr_hash(&u->parent, sizeof(u->parent));
+	hash = fr_hash_update(&u->vendor, sizeof(u->vendor), hash);
+	return fr_hash_update(&u->attr, sizeof(u->attr), hash);
+}
+
+static int dict_unknown_cmp(void const *one, void const *two)
+{
+	dict_unknown_t const *a = one;
+	dict_unknown_t const *b = two;
+
+	if (a->parent != b->parent) return (a->parent < b->parent) ? -1 : +1;
+	if (a->vendor != b->vendor) return (a->vendor < b->vendor) ? -1 : +1;
+	if (a->attr != b->attr) return (a->attr < b->attr) ? -1 : +1;
+
+	return 0;
+}
+
 /** Add an entry to the list of stat buffers.
  */
 static void dict_stat_add(fr_dict_t *dict, struct stat const *stat_buf)
@@ -419,10 +506,10 @@ int fr_dict_vendor_add(fr_dict_t *dict, char const *name, unsigned int num)
 	dv->vendorpec = num;
 	dv->type = dv->length = 1; /* defaults */
 
-	if (!fr_hash_table_insert(dict->vendors_by_name, dv)) {
+	if (!fr_hash_oa_insert(dict->vendors_by_name, dv)) {
 		fr_dict_vendor_t *old_dv;
 
-		old_dv = fr_hash_table_finddata(dict->vendors_by_name, dv);
+		old_dv = fr_hash_oa_finddata(dict->vendors_by_name, dv);
 		if (!old_dv) {
 			fr_strerror_printf("fr_dict_vendor_add: Failed inserting vendor name %s", name);
 			return -1;
@@ -448,7 +535,7 @@ int fr_dict_vendor_add(fr_dict_t *dict, char const *name, unsigned int num)
 	 *	files, but when we're printing them, (and looking up
 	 *	by value) we want to use the NEW name.
 	 */
-	if (!fr_hash_table_replace(dict->vendors_by_num, dv)) {
+	if (!fr_hash_oa_replace(dict->vendors_by_num, dv)) {
 		fr_strerror_printf("fr_dict_vendor_add: Failed inserting vendor %s", name);
 		return -1;
 	}
@@ -814,6 +901,30 @@ int fr_dict_attr_add(fr_dict_t *dict, fr_dict_attr_t const *parent,
 		}
 	}
 
+	/*
+	 *	Interned values are shared by every request, so
+	 *	they can't be secrets.
+	 */
+	if (flags.intern) {
+		if (type != PW_TYPE_STRING) {
+			fr_strerror_printf("The 'intern' flag can only be used with attributes of type 'string'");
+			goto error;
+		}
+
+		if (flags.encrypt || flags.virtual) {
+			fr_strerror_printf("The 'intern' flag cannot be used with 'encrypt' or 'virtual'");
+			goto error;
+		}
+
+		if (!dict->interned) {
+			dict->interned = fr_hash_rcu_create(dict, dict_intern_hash, dict_intern_cmp, dict_intern_free);
+			if (!dict->interned) {
+				fr_strerror_printf("Failed creating table of interned values");
+				goto error;
+			}
+		}
+	}
+
 	/*
 	 *	'has_value' should only be set internally.  If the
 	 *	caller sets it, we still sanity check it.
@@ -1080,14 +1191,14 @@ int fr_dict_attr_add(fr_dict_t *dict, fr_dict_attr_t const *parent,
 	/*
 	 *	Insert the attribute, only if it's not a duplicate.
 	 */
-	if (!fr_hash_table_insert(dict->attributes_by_name, n)) {
+	if (!fr_hash_oa_insert(dict->attributes_by_name, n)) {
 		fr_dict_attr_t *a;
 
 		/*
 		 *	If the attribute has identical number, then
 		 *	ignore the duplicate.
 		 */
-		a = fr_hash_table_finddata(dict->attributes_by_name, n);
+		a = fr_hash_oa_finddata(dict->attributes_by_name, n);
 		if (a && (strcasecmp(a->name, n->name) == 0)) {
 			if (a->attr != n->attr) {
 				fr_strerror_printf("Duplicate attribute name");
@@ -1096,7 +1207,7 @@ int fr_dict_attr_add(fr_dict_t *dict, fr_dict_attr_t const *parent,
 			}
 		}
 
-		if (!fr_hash_table_replace(dict->attributes_by_name, n)) {
+		if (!fr_hash_oa_replace(dict->attributes_by_name, n)) {
 			fr_strerror_printf("Internal error storing attribute");
 			talloc_free(n);
 			goto error;
@@ -1122,12 +1233,12 @@ int fr_dict_attr_add(fr_dict_t *dict, fr_dict_attr_t const *parent,
 
 		memcpy(v6, n, sizeof(*v6) + namelen);
 		v6->type = PW_TYPE_IPV6_ADDR;
-		if (!fr_hash_table_replace(dict->attributes_combo, v4)) {
+		if (!fr_hash_oa_replace(dict->attributes_combo, v4)) {
 			fr_strerror_printf("Failed inserting IPv4 version of combo attribute");
 			goto error;
 		}
 
-		if (!fr_hash_table_replace(dict->attributes_combo, v6)) {
+		if (!fr_hash_oa_replace(dict->attributes_combo, v6)) {
 			fr_strerror_printf("Failed inserting IPv6 version of combo attribute");
 			goto error;
 		}
@@ -1260,7 +1371,7 @@ int fr_dict_enum_add(fr_dict_t *dict, char const *attr, char const *alias, int v
 		fr_dict_attr_t *tmp;
 		memcpy(&tmp, &dval, sizeof(tmp));
 
-		if (!fr_hash_table_insert(dict->values_by_name, tmp)) {
+		if (!fr_hash_oa_insert(dict->values_by_name, tmp)) {
 			if (da) {
 				fr_dict_enum_t *old;
 
@@ -1287,7 +1398,7 @@ int fr_dict_enum_add(fr_dict_t *dict, char const *attr, char const *alias, int v
 	 *	There are multiple VALUE's, keyed by attribute, so we
 	 *	take care of that here.
 	 */
-	if (!fr_hash_table_replace(dict->values_by_da, dval)) {
+	if (!fr_hash_oa_replace(dict->values_by_da, dval)) {
 		fr_strerror_printf("fr_dict_enum_add: Failed inserting value %s",
 				   alias);
 		return -1;
@@ -1514,6 +1625,13 @@ static int dict_read_process_attribute(fr_dict_t *dict, fr_dict_attr_t const *pa
 			} else if (strncmp(key, "virtual", 8) == 0) {
 				flags.virtual = 1;
 
+			/*
+			 *	Values repeat across many packets, so
+			 *	share one copy of each.
+			 */
+			} else if (strncmp(key, "intern", 7) == 0) {
+				flags.intern = 1;
+
 			/*
 			 *	The only thing is the vendor name,
 			 *	and it's a known name: allow it.
@@ -2151,7 +2269,8 @@ int fr_dict_init(TALLOC_CTX *ctx, fr_dict_t **out, char const *dir, char const *
 	if (!*out) {
 		/* Pre-Allocate 5MB of pool memory for rapid startup */
 		dict = talloc_zero(ctx, fr_dict_t);
-		dict->pool = talloc_pool(dict, (1024 * 1024 * 5));
+		dict->pool = talloc_pool(dict, DICT_POOL_SIZE);
+		fr_dict_hugepage_advise(dict);
 	} else {
 		dict = *out;
 		if (dict_stat_check(dict, dir, fn)) return 0;
@@ -2174,7 +2293,7 @@ int fr_dict_init(TALLOC_CTX *ctx, fr_dict_t **out, char const *dir, char const *
 	 *
 	 *	Each vendor is malloc'd, so the free function is free.
 	 */
-	dict->vendors_by_name = fr_hash_table_create(dict, dict_vendor_name_hash, dict_vendor_name_cmp, hash_pool_free);
+	dict->vendors_by_name = fr_hash_oa_create(dict, dict_vendor_name_hash, dict_vendor_name_cmp, hash_pool_free);
 	if (!dict->vendors_by_name) {
 	error:
 		talloc_free(dict);
@@ -2186,7 +2305,7 @@ int fr_dict_init(TALLOC_CTX *ctx, fr_dict_t **out, char const *dir, char const *
 	 *	be vendors of the same value.  If there are, we
 	 *	pick the latest one.
 	 */
-	dict->vendors_by_num = fr_hash_table_create(dict, dict_vendor_value_hash, dict_vendor_value_cmp, NULL);
+	dict->vendors_by_num = fr_hash_oa_create(dict, dict_vendor_value_hash, dict_vendor_value_cmp, NULL);
 	if (!dict->vendors_by_num) goto error;
 
 	/*
@@ -2195,21 +2314,24 @@ int fr_dict_init(TALLOC_CTX *ctx, fr_dict_t **out, char const *dir, char const *
 	 *
 	 *	Each attribute is malloc'd, so the free function is free.
 	 */
-	dict->attributes_by_name = fr_hash_table_create(dict, dict_attr_name_hash, dict_attr_name_cmp, hash_pool_free);
+	dict->attributes_by_name = fr_hash_oa_create(dict, dict_attr_name_hash, dict_attr_name_cmp, hash_pool_free);
 	if (!dict->attributes_by_name) goto error;
 
 	/*
 	 *	Horrible hacks for combo-IP.
 	 */
-	dict->attributes_combo = fr_hash_table_create(dict, dict_attr_combo_hash, dict_attr_combo_cmp, hash_pool_free);
+	dict->attributes_combo = fr_hash_oa_create(dict, dict_attr_combo_hash, dict_attr_combo_cmp, hash_pool_free);
 	if (!dict->attributes_combo) goto error;
 
-	dict->values_by_name = fr_hash_table_create(dict, dict_enum_name_hash, dict_enum_name_cmp, hash_pool_free);
+	dict->values_by_name = fr_hash_oa_create(dict, dict_enum_name_hash, dict_enum_name_cmp, hash_pool_free);
 	if (!dict->values_by_name) goto error;
 
-	dict->values_by_da = fr_hash_table_create(dict, dict_enum_value_hash, dict_enum_value_cmp, hash_pool_free);
+	dict->values_by_da = fr_hash_oa_create(dict, dict_enum_value_hash, dict_enum_value_cmp, hash_pool_free);
 	if (!dict->values_by_da) goto error;
 
+	dict->unknown_cache = fr_hash_rcu_create(dict, dict_unknown_hash, dict_unknown_cmp, dict_intern_free);
+	if (!dict->unknown_cache) goto error;
+
 	/*
 	 *	Magic dictionary root attribute
 	 */
@@ -2244,7 +2366,7 @@ int fr_dict_init(TALLOC_CTX *ctx, fr_dict_t **out, char const *dir, char const *
 			/*
 			 *	Add the value into the dictionary.
 			 */
-			if (!fr_hash_table_replace(dict->values_by_name, this->dval)) {
+			if (!fr_hash_oa_replace(dict->values_by_name, this->dval)) {
 				fr_strerror_printf("fr_dict_enum_add: Duplicate value name %s for attribute %s",
 						   this->dval->name, a->name);
 				goto error;
@@ -2257,8 +2379,8 @@ int fr_dict_init(TALLOC_CTX *ctx, fr_dict_t **out, char const *dir, char const *
 			 */
 			if (a->parent->flags.is_root || ((a->parent->type == PW_TYPE_VENDOR) &&
 			    (a->parent->parent->type == PW_TYPE_VSA))) {
-				if (!fr_hash_table_finddata(dict->values_by_da, this->dval)) {
-					fr_hash_table_replace(dict->values_by_da, this->dval);
+				if (!fr_hash_oa_finddata(dict->values_by_da, this->dval)) {
+					fr_hash_oa_replace(dict->values_by_da, this->dval);
 				}
 			}
 			talloc_free(this);
@@ -2276,11 +2398,11 @@ int fr_dict_init(TALLOC_CTX *ctx, fr_dict_t **out, char const *dir, char const *
 	 *	lookups, and we don't want multi-threaded re-ordering
 	 *	of the table entries.  That would be bad.
 	 */
-	fr_hash_table_walk(dict->vendors_by_name, hash_null_callback, NULL);
-	fr_hash_table_walk(dict->vendors_by_num, hash_null_callback, NULL);
+	fr_hash_oa_walk(dict->vendors_by_name, hash_null_callback, NULL);
+	fr_hash_oa_walk(dict->vendors_by_num, hash_null_callback, NULL);
 
-	fr_hash_table_walk(dict->values_by_da, hash_null_callback, NULL);
-	fr_hash_table_walk(dict->values_by_name, hash_null_callback, NULL);
+	fr_hash_oa_walk(dict->values_by_da, hash_null_callback, NULL);
+	fr_hash_oa_walk(dict->values_by_name, hash_null_callback, NULL);
 
 	if (out) *out = dict;
 
@@ -2330,6 +2452,20 @@ int fr_dict_parse_str(fr_dict_t *dict, char *buf, fr_dict_attr_t const *parent,
 	return -1;
 }
 
+/** Back the memory pool of a dictionary with huge pages
+ *
+ * The attributes and values are looked up at random for every packet,
+ * and live as long as the dictionary does.  Does nothing unless
+ * #fr_hugepages is set.
+ *
+ * @param dict to advise the pool of.
+ * @return the number of bytes advised.
+ */
+size_t fr_dict_hugepage_advise(fr_dict_t *dict)
+{
+	return fr_hugepage_advise(dict->pool, DICT_POOL_SIZE);
+}
+
 /** Return the root attribute of a dictionary
  *
  * @param dict to return root for.
@@ -2358,6 +2494,7 @@ static fr_dict_attr_t *fr_dict_unknown_acopy(TALLOC_CTX *ctx, fr_dict_attr_t con
 
 	new = fr_dict_attr_alloc(ctx, da->name, da->vendor, da->attr, da->type, da->flags);
 	new->flags.is_unknown = 1;
+	new->flags.is_cached = 0;
 	new->parent = parent;
 	new->depth = da->depth;
 
@@ -2402,6 +2539,7 @@ fr_dict_attr_t const *fr_dict_unknown_add(fr_dict_t *dict, fr_dict_attr_t const
 
 	memcpy(&flags, &old->flags, sizeof(flags));
 	flags.is_unknown = false;
+	flags.is_cached = false;
 
 	/*
 	 *	Ensure the vendor is present in the
@@ -2428,8 +2566,8 @@ void fr_dict_unknown_free(fr_dict_attr_t const **da)
 
 	if (!da || !*da) return;
 
-	/* Don't free real DAs */
-	if (!(*da)->flags.is_unknown) {
+	/* Don't free real DAs, or shared unknown ones */
+	if (!(*da)->flags.is_unknown || (*da)->flags.is_cached) {
 		return;
 	}
 
@@ -2674,6 +2812,80 @@ fr_dict_attr_t *fr_dict_unknown_afrom_fields(TALLOC_CTX *ctx, fr_dict_attr_t con
 	return da;
 }
 
+/** Return a shared unknown attribute, or allocate one
+ *
+ * As #fr_dict_unknown_afrom_fields, but unknown attributes with known parents
+ * are only allocated the first time they're seen.  They're then kept until the
+ * internal dictionary is freed, and returned for every later call with the same
+ * arguments, without allocating or locking.  They have the ``is_cached`` flag,
+ * and must not be modified.  #fr_dict_unknown_free and #fr_pair_steal leave
+ * them alone.
+ *
+ * Unknown attributes with unknown parents, or any seen once the cache is full,
+ * are allocated in ctx as before.
+ *
+ * @param[in] ctx to allocate DA in, if it can't be shared.
+ * @param[in] parent of the unknown attribute (may also be unknown).
+ * @param[in] vendor number.
+ * @param[in] attr number.
+ * @return
+ *	- The unknown attribute.  Free with #fr_dict_unknown_free.
+ *	- NULL on error.
+ */
+fr_dict_attr_t const *fr_dict_unknown_afrom_fields_cached(TALLOC_CTX *ctx, fr_dict_attr_t const *parent,
+							  unsigned int vendor, unsigned int attr)
+{
+	fr_dict_t		*dict = fr_dict_internal;
+	dict_unknown_t		find, *found;
+	fr_dict_attr_t		*da, *p;
+
+	if (parent->flags.is_unknown || !dict || !dict->unknown_cache) goto alloc;
+
+	find.parent = parent;
+	find.vendor = vendor;
+	find.attr = attr;
+	find.da = NULL;
+
+	found = fr_hash_rcu_finddata(dict->unknown_cache, &find);
+	if (found) return found->da;
+
+	if (fr_hash_rcu_num_elements(dict->unknown_cache) >= DICT_UNKNOWN_CACHE_MAX) goto alloc;
+
+	found = talloc(NULL, dict_unknown_t);
+	if (!found) goto alloc;
+	*found = find;
+
+	da = fr_dict_unknown_afrom_fields(found, parent, vendor, attr);
+	if (!da) {
+		talloc_free(found);
+		return NULL;
+	}
+
+	/*
+	 *	Including any unknown vendor created for it.
+	 */
+	p = da;
+	while (p && p->flags.is_unknown) {
+		p->flags.is_cached = 1;
+		memcpy(&p, &p->parent, sizeof(p));
+	}
+	found->da = da;
+
+	/*
+	 *	Another thread got there first.  Use its copy.
+	 */
+	if (!fr_hash_rcu_insert(dict->unknown_cache, found)) {
+		talloc_free(found);
+		found = fr_hash_rcu_finddata(dict->unknown_cache, &find);
+		if (!found) goto alloc;
+	}
+
+	return found->da;
+
+alloc:
+	return fr_dict_unknown_afrom_fields(ctx, parent, vendor, attr);
+}
+
 /** Initialise a fr_dict_attr_t from an ASCII attribute and value
  *
  * Where the attribute name is in the form:
@@ -3089,6 +3301,7 @@ do { \
 	FLAG_SET(is_pointer);
 	FLAG_SET(virtual);
 	FLAG_SET(compare);
+	FLAG_SET(intern);
 
 	if (flags.encrypt) {
 		p += snprintf(p, end - p, "encrypt=%i,", flags.encrypt);
@@ -3393,7 +3606,7 @@ int fr_dict_vendor_by_name(fr_dict_t *dict, char const *name)
 	dv = (fr_dict_vendor_t *)buffer;
 	strlcpy(dv->name, name, FR_DICT_VENDOR_MAX_NAME_LEN + 1);
 
-	dv = fr_hash_table_finddata(dict->vendors_by_name, dv);
+	dv = fr_hash_oa_finddata(dict->vendors_by_name, dv);
 	if (!dv) return 0;
 
 	return dv->vendorpec;
@@ -3416,7 +3629,7 @@ fr_dict_vendor_t const *fr_dict_vendor_by_num(fr_dict_t *dict, int vendorpec)
 
 	dv.vendorpec = vendorpec;
 
-	return fr_hash_table_finddata(dict->vendors_by_num, &dv);
+	return fr_hash_oa_finddata(dict->vendors_by_num, &dv);
 }
 
 /** Look up a dictionary attribute by a name embedded in another string
@@ -3468,7 +3681,7 @@ fr_dict_attr_t const *fr_dict_attr_by_name_substr(fr_dict_t *dict, char const **
 	}
 	strlcpy(find->name, *name, len + 1);
 
-	da = fr_hash_table_finddata(dict->attributes_by_name, find);
+	da = fr_hash_oa_finddata(dict->attributes_by_name, find);
 	if (!da) {
 		fr_strerror_printf("Unknown attribute '%s'", find->name);
 		return NULL;
@@ -3500,7 +3713,7 @@ fr_dict_attr_t const *fr_dict_attr_by_name(fr_dict_t *dict, char const *name)
 	da = (fr_dict_attr_t *)buffer;
 	strlcpy(da->name, name, FR_DICT_ATTR_MAX_NAME_LEN + 1);
 
-	return fr_hash_table_finddata(dict->attributes_by_name, da);
+	return fr_hash_oa_finddata(dict->attributes_by_name, da);
 }
 
 /** Lookup a #fr_dict_attr_t by its vendor and attribute numbers
@@ -3555,7 +3768,7 @@ fr_dict_attr_t const *fr_dict_attr_by_type(fr_dict_t *dict, unsigned int vendor,
 	da.vendor = vendor;
 	da.type = type;
 
-	return fr_hash_table_finddata(dict->attributes_combo, &da);
+	return fr_hash_oa_finddata(dict->attributes_combo, &da);
 }
 
 /** Check if a child attribute exists in a parent using a pointer (da)
@@ -3584,11 +3797,10 @@ inline fr_dict_attr_t const *fr_dict_attr_child_by_da(fr_dict_attr_t const *pare
 	}
 
 	/*
-	 *	Child arrays may be trimmed back to save memory.
-	 *	Check that so we don't SEGV.
+	 *	Child arrays always have UINT8_MAX + 1 bins (see
+	 *	fr_dict_attr_child_add), so the bin index can't be
+	 *	out of bounds.
 	 */
-	if ((child->attr & 0xff) > talloc_array_length(parent->children)) return NULL;
-
 	bin = parent->children[child->attr & 0xff];
 	for (;;) {
 		if (!bin) return NULL;
@@ -3625,11 +3837,10 @@ inline fr_dict_attr_t const *fr_dict_attr_child_by_num(fr_dict_attr_t const *par
 	}
 
 	/*
-	 *	Child arrays may be trimmed back to save memory.
-	 *	Check that so we don't SEGV.
+	 *	Child arrays always have UINT8_MAX + 1 bins (see
+	 *	fr_dict_attr_child_add), so the bin index can't be
+	 *	out of bounds.
 	 */
-	if ((attr & 0xff) > talloc_array_length(parent->children)) return NULL;
-
 	bin = parent->children[attr & 0xff];
 	for (;;) {
 		if (!bin) return NULL;
@@ -3666,12 +3877,12 @@ fr_dict_enum_t *fr_dict_enum_by_da(fr_dict_t *dict, fr_dict_attr_t const *da, in
 	 *	Look up the attribute alias target, and use
 	 *	the correct attribute number if found.
 	 */
-	dv = fr_hash_table_finddata(dict->values_by_name, &dval);
+	dv = fr_hash_oa_finddata(dict->values_by_name, &dval);
 	if (dv) dval.da = dv->da;
 
 	dval.value = value;
 
-	return fr_hash_table_finddata(dict->values_by_da, &dval);
+	return fr_hash_oa_finddata(dict->values_by_da, &dval);
 }
 
 /** Lookup the name of an enum value in a #fr_dict_attr_t
@@ -3715,12 +3926,64 @@ fr_dict_enum_t *fr_dict_enum_by_name(fr_dict_t *dict, fr_dict_attr_t const *da,
 	 *	Look up the attribute alias target, and use
 	 *	the correct attribute number if found.
 	 */
-	dv = fr_hash_table_finddata(dict->values_by_name, my_dv);
+	dv = fr_hash_oa_finddata(dict->values_by_name, my_dv);
 	if (dv) my_dv->da = dv->da;
 
 	strlcpy(my_dv->name, name, FR_DICT_ENUM_MAX_NAME_LEN + 1);
 
-	return fr_hash_table_finddata(dict->values_by_name, my_dv);
+	return fr_hash_oa_finddata(dict->values_by_name, my_dv);
+}
+
+/** Return the shared copy of a value of an attribute with the 'intern' flag
+ *
+ * Values are added the first time they're seen, and are never removed, so
+ * the pointer returned stays valid for as long as the dictionary does.
+ * Equal values are always at the same address.  Lookups don't lock.
+ *
+ * @param[in] dict	the attribute is in.  If NULL the internal dictionary will be used.
+ * @param[in] in	value to intern.  Needn't be '\0' terminated.
+ * @param[in] inlen	length of the value.
+ * @return
+ *	- The interned, '\0' terminated, copy of the value.
+ *	- NULL if no attributes have the 'intern' flag, or the table is full.
+ */
+char const *fr_dict_intern(fr_dict_t *dict, char const *in, size_t inlen)
+{
+	dict_intern_t	find, *found;
+	char		*p;
+
+	INTERNAL_IF_NULL(dict);
+
+	if (!dict->interned) return NULL;
+
+	find.str = in;
+	find.len = inlen;
+
+	found = fr_hash_rcu_finddata(dict->interned, &find);
+	if (found) return found->str;
+
+	if (fr_hash_rcu_num_elements(dict->interned) >= DICT_INTERN_MAX) return NULL;
+
+	found = (dict_intern_t *)talloc_size(NULL, sizeof(*found) + inlen + 1);
+	if (!found) return NULL;
+	talloc_set_name_const(found, "dict_intern_t");
+
+	p = (char *)(found + 1);
+	memcpy(p, in, inlen);
+	p[inlen] = '\0';
+	found->str = p;
+	found->len = inlen;
+
+	/*
+	 *	Another thread got there first.  Use its copy.
+	 */
+	if (!fr_hash_rcu_insert(dict->interned, found)) {
+		talloc_free(found);
+		found = fr_hash_rcu_finddata(dict->interned, &find);
+		if (!found) return NULL;
+	}
+
+	return found->str;
 }
 
 /*
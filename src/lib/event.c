@@ -37,19 +37,62 @@ RCSID("$Id$")
 #endif
 #endif	/* HAVE_KQUEUE */
 
+/*
+ *	Prefer kqueue where we have it, then epoll, then select().
+ */
+#if !defined(HAVE_KQUEUE) && defined(HAVE_EPOLL_CREATE) && defined(HAVE_SYS_EPOLL_H)
+#  define HAVE_EPOLL
+#  include <sys/epoll.h>
+#endif
+
+#if defined(HAVE_KQUEUE) || defined(HAVE_EPOLL)
+#  define FR_EV_KERNEL_QUEUE
+#endif
+
 typedef struct fr_event_fd_t {
 	int			fd;
 	fr_event_fd_handler_t	handler;
 	void			*ctx;
 } fr_event_fd_t;
 
-#define FR_EV_MAX_FDS (256)
+#ifdef HAVE_EPOLL
+/*
+ *	epoll only returns the FDs which are ready, so the cost of a
+ *	wakeup doesn't depend on how many FDs we're watching.  We can
+ *	therefore afford a much larger table of readers.
+ *
+ *	This MUST be a power of 2.
+ */
+#  define FR_EV_MAX_FDS (4096)
+#  define FR_EV_MAX_EVENTS (256)
+#else
+#  define FR_EV_MAX_FDS (256)
+#endif
 
 #undef USEC
 #define USEC (1000000)
 
+/*
+ *	Most timers are a few seconds out, and many are deleted before
+ *	they fire.  They go into a hierarchical timer wheel keyed on
+ *	millisecond ticks, where insert and delete are O(1).  Level 0
+ *	has one slot per tick, and each level above has slots which
+ *	are as long as the whole of the level below.  Only timers too
+ *	far out for the top level go into the heap.
+ */
+#define FR_EV_WHEEL_BITS	(8)
+#define FR_EV_WHEEL_SLOTS	(1 << FR_EV_WHEEL_BITS)
+#define FR_EV_WHEEL_MASK	(FR_EV_WHEEL_SLOTS - 1)
+#define FR_EV_WHEEL_LEVELS	(3)	/* 256ms, ~65s, ~4.6h */
+#define FR_EV_HEAP		(-1)	/* fr_event_t.level for events in the heap */
+
 struct fr_event_list_t {
-	fr_heap_t	*times;
+	fr_heap_t	*times;		//!< Events too far out for the wheel.
+
+	uint64_t	tick;		//!< Wheel slot we're running.  Milliseconds.
+	fr_event_t	*wheel[FR_EV_WHEEL_LEVELS][FR_EV_WHEEL_SLOTS];
+	uint32_t	wheel_count[FR_EV_WHEEL_LEVELS];
+	uint32_t	num_events;
 
 	int		exit;
 
@@ -59,14 +102,18 @@ struct fr_event_list_t {
 	bool		dispatch;
 
 	int		num_readers;
-#ifndef HAVE_KQUEUE
-	int		max_readers;
+#if defined(HAVE_KQUEUE)
+	int		kq;
+	struct kevent	events[FR_EV_MAX_FDS]; /* so it doesn't go on the stack every time */
 
-	bool		changed;
+#elif defined(HAVE_EPOLL)
+	int		epoll_fd;
+	struct epoll_event events[FR_EV_MAX_EVENTS]; /* so it doesn't go on the stack every time */
 
 #else
-	int		kq;
-	struct kevent	events[FR_EV_MAX_FDS]; /* so it doesn't go on the stack every time */
+	int		max_readers;
+
+	bool		changed;
 #endif
 	fr_event_fd_t	readers[FR_EV_MAX_FDS];
 };
@@ -80,6 +127,11 @@ struct fr_event_t {
 	struct timeval		when;
 	fr_event_t		**parent;
 	int			heap;
+
+	int			level;		//!< Wheel level, or FR_EV_HEAP.
+	uint64_t		tick;		//!< When, rounded up to the next millisecond.
+	fr_event_t		*next;		//!< In the wheel slot.
+	fr_event_t		**prev_next;
 };
 
 
@@ -98,19 +150,215 @@ static int fr_event_list_time_cmp(void const *one, void const *two)
 }
 
 
+static inline uint64_t fr_event_timeval_to_usec(struct timeval const *tv)
+{
+	return ((uint64_t) tv->tv_sec * USEC) + tv->tv_usec;
+}
+
+/*
+ *	Put an event into the wheel, or into the heap if it's too far
+ *	out.  Events which are already due go into the slot we're
+ *	running.
+ */
+static int fr_event_schedule(fr_event_list_t *el, fr_event_t *ev)
+{
+	uint64_t	diff;
+	int		level;
+	fr_event_t	**head;
+
+	ev->tick = (fr_event_timeval_to_usec(&ev->when) + 999) / 1000;
+	diff = (ev->tick > el->tick) ? ev->tick - el->tick : 0;
+
+	for (level = 0; level < FR_EV_WHEEL_LEVELS; level++) {
+		if (diff >= ((uint64_t) 1 << (FR_EV_WHEEL_BITS * (level + 1)))) continue;
+
+		if (diff == 0) {
+			head = &el->wheel[0][el->tick & FR_EV_WHEEL_MASK];
+		} else {
+			head = &el->wheel[level][(ev->tick >> (FR_EV_WHEEL_BITS * level)) & FR_EV_WHEEL_MASK];
+		}
+
+		ev->next = *head;
+		if (ev->next) ev->next->prev_next = &ev->next;
+		ev->prev_next = head;
+		*head = ev;
+
+		ev->level = level;
+		el->wheel_count[level]++;
+		return 1;
+	}
+
+	ev->level = FR_EV_HEAP;
+	return fr_heap_insert(el->times, ev);
+}
+
+static int fr_event_unschedule(fr_event_list_t *el, fr_event_t *ev)
+{
+	if (ev->level == FR_EV_HEAP) return fr_heap_extract(el->times, ev);
+
+	if (!ev->prev_next) return 0;
+
+	*ev->prev_next = ev->next;
+	if (ev->next) ev->next->prev_next = ev->prev_next;
+	ev->next = NULL;
+	ev->prev_next = NULL;
+
+	el->wheel_count[ev->level]--;
+	return 1;
+}
+
+/*
+ *	Take every event out of a wheel slot, and schedule it again
+ *	relative to the current tick.  This moves it to a lower level.
+ */
+static void fr_event_cascade(fr_event_list_t *el, int level, unsigned int slot)
+{
+	fr_event_t *list, *ev;
+
+	list = el->wheel[level][slot];
+	el->wheel[level][slot] = NULL;
+
+	while ((ev = list) != NULL) {
+		list = ev->next;
+
+		ev->next = NULL;
+		ev->prev_next = NULL;
+		el->wheel_count[level]--;
+
+		(void) fr_event_schedule(el, ev);
+	}
+}
+
+/*
+ *	Move on to the next tick.  When a level wraps, the slot of
+ *	the level above which starts now is cascaded down.
+ */
+static void fr_event_wheel_advance(fr_event_list_t *el)
+{
+	int level;
+
+	el->tick++;
+
+	for (level = FR_EV_WHEEL_LEVELS - 1; level > 0; level--) {
+		if ((el->tick & (((uint64_t) 1 << (FR_EV_WHEEL_BITS * level)) - 1)) != 0) continue;
+
+		fr_event_cascade(el, level, (el->tick >> (FR_EV_WHEEL_BITS * level)) & FR_EV_WHEEL_MASK);
+	}
+}
+
+/*
+ *	Find an event which is due, moving the wheel on to "now".
+ */
+static fr_event_t *fr_event_due(fr_event_list_t *el, struct timeval const *now)
+{
+	uint64_t	now_tick = fr_event_timeval_to_usec(now) / 1000;
+	fr_event_t	*ev;
+	int		level;
+	unsigned int	slot;
+
+	/*
+	 *	After a long stall, or if the clock jumps, schedule
+	 *	everything again instead of stepping through each tick.
+	 */
+	if ((now_tick > el->tick) && ((now_tick - el->tick) > (FR_EV_WHEEL_SLOTS * FR_EV_WHEEL_SLOTS))) {
+		el->tick = now_tick;
+
+		for (level = 0; level < FR_EV_WHEEL_LEVELS; level++) {
+			for (slot = 0; slot < FR_EV_WHEEL_SLOTS; slot++) {
+				if (el->wheel[level][slot]) fr_event_cascade(el, level, slot);
+			}
+		}
+	}
+
+	while (el->tick <= now_tick) {
+		ev = el->wheel[0][el->tick & FR_EV_WHEEL_MASK];
+		if (ev) return ev;
+
+		if (el->tick == now_tick) break;
+
+		/*
+		 *	Nothing to cascade, skip straight to now.
+		 */
+		if (el->num_events == (uint32_t) fr_heap_num_elements(el->times)) {
+			el->tick = now_tick;
+			break;
+		}
+
+		fr_event_wheel_advance(el);
+	}
+
+	ev = fr_heap_peek(el->times);
+	if (ev && !timercmp(now, &ev->when, <)) return ev;
+
+	return NULL;
+}
+
+/*
+ *	When the next event is due.  For events in the upper levels
+ *	of the wheel, that's when they're cascaded down.
+ */
+static bool fr_event_next(fr_event_list_t *el, struct timeval *when)
+{
+	uint64_t	best = UINT64_MAX, base, usec;
+	fr_event_t	*ev;
+	int		level;
+	unsigned int	i;
+
+	ev = fr_heap_peek(el->times);
+	if (ev) best = fr_event_timeval_to_usec(&ev->when);
+
+	/*
+	 *	Events in a lower level are always due before those
+	 *	in a higher one.
+	 */
+	for (level = 0; level < FR_EV_WHEEL_LEVELS; level++) {
+		if (!el->wheel_count[level]) continue;
+
+		base = el->tick >> (FR_EV_WHEEL_BITS * level);
+
+		for (i = (level == 0) ? 0 : 1; i <= FR_EV_WHEEL_SLOTS; i++) {
+			if (!el->wheel[level][(base + i) & FR_EV_WHEEL_MASK]) continue;
+
+			usec = ((base + i) << (FR_EV_WHEEL_BITS * level)) * 1000;
+			if (usec < best) best = usec;
+			break;
+		}
+		break;
+	}
+
+	if (best == UINT64_MAX) return false;
+
+	when->tv_sec = best / USEC;
+	when->tv_usec = best % USEC;
+	return true;
+}
+
+
 static int _event_list_free(fr_event_list_t *list)
 {
 	fr_event_list_t *el = list;
 	fr_event_t *ev;
+	int level;
+	unsigned int slot;
 
 	while ((ev = fr_heap_peek(el->times)) != NULL) {
 		fr_event_delete(el, &ev);
 	}
 
+	for (level = 0; level < FR_EV_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < FR_EV_WHEEL_SLOTS; slot++) {
+			while ((ev = el->wheel[level][slot]) != NULL) {
+				fr_event_delete(el, &ev);
+			}
+		}
+	}
+
 	fr_heap_delete(el->times);
 
-#ifdef HAVE_KQUEUE
+#if defined(HAVE_KQUEUE)
 	close(el->kq);
+#elif defined(HAVE_EPOLL)
+	close(el->epoll_fd);
 #endif
 
 	return 0;
@@ -134,19 +382,37 @@ fr_event_list_t *fr_event_list_create(TALLOC_CTX *ctx, fr_event_status_t status)
 		return NULL;
 	}
 
+	gettimeofday(&el->now, NULL);
+	el->tick = fr_event_timeval_to_usec(&el->now) / 1000;
+
 	for (i = 0; i < FR_EV_MAX_FDS; i++) {
 		el->readers[i].fd = -1;
 	}
 
-#ifndef HAVE_KQUEUE
-	el->changed = true;	/* force re-set of fds's */
-
-#else
+#if defined(HAVE_KQUEUE)
 	el->kq = kqueue();
 	if (el->kq < 0) {
 		talloc_free(el);
 		return NULL;
 	}
+
+#elif defined(HAVE_EPOLL)
+	el->epoll_fd = epoll_create(FR_EV_MAX_FDS);
+	if (el->epoll_fd < 0) {
+		talloc_free(el);
+		return NULL;
+	}
+
+	/*
+	 *	Unlike kqueues, epoll FDs are inherited across
+	 *	fork(), so don't leak them into programs we exec.
+	 */
+#ifdef FD_CLOEXEC
+	(void) fcntl(el->epoll_fd, F_SETFD, FD_CLOEXEC);
+#endif
+
+#else
+	el->changed = true;	/* force re-set of fds's */
 #endif
 
 	el->status = status;
@@ -165,7 +431,7 @@ int fr_event_list_num_elements(fr_event_list_t *el)
 {
 	if (!el) return 0;
 
-	return fr_heap_num_elements(el->times);
+	return el->num_events;
 }
 
 
@@ -193,8 +459,9 @@ int fr_event_delete(fr_event_list_t *el, fr_event_t **parent)
 	}
 	*parent = NULL;
 
-	ret = fr_heap_extract(el->times, ev);
-	(void)fr_cond_assert(ret == 1);	/* events MUST be in the heap */
+	ret = fr_event_unschedule(el, ev);
+	(void)fr_cond_assert(ret == 1);	/* events MUST be in the wheel or the heap */
+	el->num_events--;
 	talloc_free(ev);
 
 	return ret;
@@ -239,13 +506,14 @@ int fr_event_insert(fr_event_list_t *el, fr_event_callback_t callback, void *ctx
 		ev = *parent;
 #endif
 
-		ret = fr_heap_extract(el->times, ev);
-		if (!fr_cond_assert(ret == 1)) return 0;	/* events MUST be in the heap */
+		ret = fr_event_unschedule(el, ev);
+		if (!fr_cond_assert(ret == 1)) return 0;	/* events MUST be in the wheel or the heap */
 
 		memset(ev, 0, sizeof(*ev));
 	} else {
 		ev = talloc_zero(el, fr_event_t);
 		if (!ev) return 0;
+		el->num_events++;
 	}
 
 	ev->callback = callback;
@@ -253,7 +521,9 @@ int fr_event_insert(fr_event_list_t *el, fr_event_callback_t callback, void *ctx
 	ev->when = *when;
 	ev->parent = parent;
 
-	if (!fr_heap_insert(el->times, ev)) {
+	if (!fr_event_schedule(el, ev)) {
+		*parent = NULL;
+		el->num_events--;
 		talloc_free(ev);
 		return 0;
 	}
@@ -271,26 +541,21 @@ int fr_event_run(fr_event_list_t *el, struct timeval *when)
 
 	if (!el) return 0;
 
-	if (fr_heap_num_elements(el->times) == 0) {
-		when->tv_sec = 0;
-		when->tv_usec = 0;
-		return 0;
-	}
-
-	ev = fr_heap_peek(el->times);
-	if (!ev) {
+	if (el->num_events == 0) {
 		when->tv_sec = 0;
 		when->tv_usec = 0;
 		return 0;
 	}
 
 	/*
-	 *	See if it's time to do this one.
+	 *	See if it's time to do one.
 	 */
-	if ((ev->when.tv_sec > when->tv_sec) ||
-	    ((ev->when.tv_sec == when->tv_sec) &&
-	     (ev->when.tv_usec > when->tv_usec))) {
-		*when = ev->when;
+	ev = fr_event_due(el, when);
+	if (!ev) {
+		if (!fr_event_next(el, when)) {
+			when->tv_sec = 0;
+			when->tv_usec = 0;
+		}
 		return 0;
 	}
 
@@ -396,6 +661,54 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 		break;
 	}
 
+#elif defined(HAVE_EPOLL)
+	/*
+	 *	epoll lets us store a pointer with the event, but as
+	 *	with kqueue, we keep the handlers in an array so that
+	 *	we don't leak them when the socket is closed underneath
+	 *	us.  Searching from "FD" offset makes the lookups
+	 *	mostly O(1).
+	 */
+	for (i = 0; i < FR_EV_MAX_FDS; i++) {
+		int j;
+		struct epoll_event evset;
+
+		j = (i + fd) & (FR_EV_MAX_FDS - 1);
+
+		/*
+		 *	Be fail-safe on multiple inserts.
+		 */
+		if (el->readers[j].fd == fd) {
+			if ((el->readers[j].handler != handler) ||
+			    (el->readers[j].ctx != ctx)) {
+				fr_strerror_printf("Multiple handlers for same FD");
+				return 0;
+			}
+
+			/*
+			 *	No change.
+			 */
+			return 1;
+		}
+
+		if (el->readers[j].fd >= 0) continue;
+
+		/*
+		 *	We want to read from the FD.
+		 */
+		memset(&evset, 0, sizeof(evset));
+		evset.events = EPOLLIN;
+		evset.data.ptr = &el->readers[j];
+		if (epoll_ctl(el->epoll_fd, EPOLL_CTL_ADD, fd, &evset) < 0) {
+			fr_strerror_printf("Failed inserting event for FD %i: %s", fd, fr_syserror(errno));
+			return 0;
+		}
+
+		ef = &el->readers[j];
+		el->num_readers++;
+		break;
+	}
+
 #else  /* HAVE_KQUEUE */
 
 	for (i = 0; i <= el->max_readers; i++) {
@@ -434,7 +747,7 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 	ef->handler = handler;
 	ef->ctx = ctx;
 
-#ifndef HAVE_KQUEUE
+#ifndef FR_EV_KERNEL_QUEUE
 	el->changed = true;
 #endif
 
@@ -474,6 +787,32 @@ int fr_event_fd_delete(fr_event_list_t *el, int type, int fd)
 		return 1;
 	}
 
+#elif defined(HAVE_EPOLL)
+	for (i = 0; i < FR_EV_MAX_FDS; i++) {
+		int j;
+		struct epoll_event evset;
+
+		j = (i + fd) & (FR_EV_MAX_FDS - 1);
+
+		if (el->readers[j].fd != fd) continue;
+
+		/*
+		 *	The caller MAY have closed it, in which case
+		 *	the kernel has removed it from the set.  So we
+		 *	ignore the return code from epoll_ctl().
+		 *
+		 *	Kernels before 2.6.9 require a non-NULL event
+		 *	even for EPOLL_CTL_DEL.
+		 */
+		memset(&evset, 0, sizeof(evset));
+		(void) epoll_ctl(el->epoll_fd, EPOLL_CTL_DEL, fd, &evset);
+
+		el->readers[j].fd = -1;
+		el->num_readers--;
+
+		return 1;
+	}
+
 #else
 
 	for (i = 0; i < el->max_readers; i++) {
@@ -508,8 +847,10 @@ int fr_event_loop(fr_event_list_t *el)
 {
 	int i, rcode;
 	struct timeval when, *wake;
-#ifdef HAVE_KQUEUE
+#if defined(HAVE_KQUEUE)
 	struct timespec ts_when, *ts_wake;
+#elif defined(HAVE_EPOLL)
+	int ms_wake;
 #else
 	int maxfd = 0;
 	fd_set read_fds, master_fds;
@@ -521,7 +862,7 @@ int fr_event_loop(fr_event_list_t *el)
 	el->dispatch = true;
 
 	while (!el->exit) {
-#ifndef HAVE_KQUEUE
+#ifndef FR_EV_KERNEL_QUEUE
 		/*
 		 *	Cache the list of FD's to watch.
 		 */
@@ -542,7 +883,7 @@ int fr_event_loop(fr_event_list_t *el)
 
 			el->changed = false;
 		}
-#endif	/* HAVE_KQUEUE */
+#endif	/* FR_EV_KERNEL_QUEUE */
 
 		/*
 		 *	Find the first event.  If there's none, we wait
@@ -551,18 +892,17 @@ int fr_event_loop(fr_event_list_t *el)
 		when.tv_sec = 0;
 		when.tv_usec = 0;
 
-		if (fr_heap_num_elements(el->times) > 0) {
-			fr_event_t *ev;
+		if (el->num_events > 0) {
+			struct timeval next;
 
-			ev = fr_heap_peek(el->times);
-			if (!ev) {
+			if (!fr_event_next(el, &next)) {
 				fr_exit_now(42);
 			}
 
 			gettimeofday(&el->now, NULL);
 
-			if (timercmp(&el->now, &ev->when, <)) {
-				when = ev->when;
+			if (timercmp(&el->now, &next, <)) {
+				when = next;
 				when.tv_sec -= el->now.tv_sec;
 
 				if (when.tv_sec > 0) {
@@ -591,7 +931,25 @@ int fr_event_loop(fr_event_list_t *el)
 		 */
 		if (el->status) el->status(wake);
 
-#ifndef HAVE_KQUEUE
+#if defined(HAVE_EPOLL)
+		if (wake) {
+			/*
+			 *	Round up, so that we don't spin waking
+			 *	up just before the next event is due.
+			 */
+			ms_wake = (when.tv_sec * 1000) + ((when.tv_usec + 999) / 1000);
+		} else {
+			ms_wake = -1;
+		}
+
+		rcode = epoll_wait(el->epoll_fd, el->events, FR_EV_MAX_EVENTS, ms_wake);
+		if ((rcode < 0) && (errno != EINTR)) {
+			fr_strerror_printf("Failed in epoll_wait: %s", fr_syserror(errno));
+			el->dispatch = false;
+			return -1;
+		}
+
+#elif !defined(HAVE_KQUEUE)
 		read_fds = master_fds;
 		rcode = select(maxfd + 1, &read_fds, NULL, NULL, wake);
 		if ((rcode < 0) && (errno != EINTR)) {
@@ -613,7 +971,7 @@ int fr_event_loop(fr_event_list_t *el)
 		rcode = kevent(el->kq, NULL, 0, el->events, FR_EV_MAX_FDS, ts_wake);
 #endif	/* HAVE_KQUEUE */
 
-		if (fr_heap_num_elements(el->times) > 0) {
+		if (el->num_events > 0) {
 			do {
 				gettimeofday(&el->now, NULL);
 				when = el->now;
@@ -622,7 +980,29 @@ int fr_event_loop(fr_event_list_t *el)
 
 		if (rcode <= 0) continue;
 
-#ifndef HAVE_KQUEUE
+#if defined(HAVE_EPOLL)
+		/*
+		 *	Loop over the ready events, servicing them.
+		 */
+		for (i = 0; i < rcode; i++) {
+			fr_event_fd_t *ef = el->events[i].data.ptr;
+
+			/*
+			 *	A previous handler may have deleted
+			 *	this FD.
+			 */
+			if (ef->fd < 0) continue;
+
+			/*
+			 *	EPOLLHUP and EPOLLERR are always
+			 *	reported.  As with kqueue's EV_EOF,
+			 *	call the handler, which SHOULD delete
+			 *	the connection.
+			 */
+			ef->handler(el, ef->fd, ef->ctx);
+		}
+
+#elif !defined(HAVE_KQUEUE)
 		/*
 		 *	Loop over all of the sockets to see if there's
 		 *	an event for that socket.
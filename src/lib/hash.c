@@ -34,6 +34,8 @@ RCSID("$Id$")
 
 #include <freeradius-devel/libradius.h>
 
+#include <ctype.h>
+
 /*
  *	A reasonable number of buckets to start off with.
  *	Should be a power of two.
@@ -627,7 +629,7 @@ int fr_hash_table_walk(fr_hash_table_t *ht,
 
 			next = node->next;
 
-			memcpy(&arg, node->data, sizeof(arg));
+			memcpy(&arg, &node->data, sizeof(arg));
 			rcode = callback(context, arg);
 
 			if (rcode != 0) return rcode;
@@ -787,6 +789,22 @@ uint32_t fr_hash_string(char const *p)
 	return hash;
 }
 
+/*
+ *	Hash a C string, ignoring case.  For tables where the
+ *	comparison function uses strcasecmp().
+ */
+uint32_t fr_hash_case_string(char const *p)
+{
+	uint32_t      hash = FNV_MAGIC_INIT;
+
+	while (*p) {
+		hash *= FNV_MAGIC_PRIME;
+		hash ^= (uint32_t) tolower((uint8_t) *p++);
+	}
+
+	return hash;
+}
+
 
 #ifdef TESTING
 /*
@@ -0,0 +1,642 @@
+/*
+ * hash_oa.c	Non-thread-safe open addressing hash table.
+ *
+ *  The entries are kept in one array of slots, with a parallel array
+ *  of control bytes, in the style of SwissTable.  Each control byte is
+ *  either EMPTY, DELETED, or the low 7 bits of the hash of the entry in
+ *  that slot.  Slots are probed a group of 16 at a time, and all of the
+ *  control bytes in a group are compared against the hash at once,
+ *  using SSE2 where we have it.  Only the entries with a matching
+ *  control byte are compared.  There are no chains to follow, so a
+ *  lookup is usually one cache line of control bytes, and one entry.
+ *
+ *  When the table grows, the entries are moved into the new array a
+ *  few groups at a time by the following inserts and deletes, so no one
+ *  insert has to move all of them.  Until they have all been moved,
+ *  lookups check both arrays.  Walking the table moves any which are
+ *  left.
+ *
+ *  The API is the same as fr_hash_table_t, and uses the same callbacks.
+ *
+ * Version:	$Id$
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ *  Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+/*
+ *	Slots in a group, i.e. control bytes compared at once.
+ */
+#define FR_HASH_OA_GROUP	(16)
+
+/*
+ *	Groups to start off with.  Should be a power of two.
+ */
+#define FR_HASH_OA_NUM_GROUPS	(4)
+
+/*
+ *	Groups of the old array moved into the new one by each
+ *	operation, while the table is being resized.
+ */
+#define FR_HASH_OA_MIGRATE	(2)
+
+#define CTRL_EMPTY		((uint8_t) 0x80)
+#define CTRL_DELETED		((uint8_t) 0xfe)
+#define CTRL_IS_FULL(_c)	(((_c) & 0x80) == 0)
+
+/*
+ *	The high bits pick the group, the low 7 bits go into the
+ *	control byte.  fr_hash() mixes well enough that neither
+ *	needs any more work.
+ */
+#define HASH_GROUP(_hash)	((_hash) >> 7)
+#define HASH_CTRL(_hash)	((uint8_t) ((_hash) & 0x7f))
+
+typedef struct fr_hash_oa_array_t {
+	uint8_t		*ctrl_mem;	//!< Allocation holding ctrl.
+	uint8_t		*ctrl;		//!< One control byte per slot, aligned to a group.
+	uint32_t	*hash;		//!< Full hash of each entry, so resizing doesn't call the hash function.
+	void const	**data;
+	uint32_t	num_groups;	//!< Power of 2.
+	uint32_t	used;		//!< Slots which aren't EMPTY, i.e. full or DELETED.
+	uint32_t	num_elements;
+} fr_hash_oa_array_t;
+
+struct fr_hash_oa_t {
+	fr_hash_oa_array_t	array;		//!< Where new entries go.
+	fr_hash_oa_array_t	old;		//!< Being moved into array, if old.ctrl is set.
+	uint32_t		migrate;	//!< Next group of old to move.
+	int			walking;	//!< Don't move entries while the table is being walked.
+
+	fr_hash_table_free_t	free;
+	fr_hash_table_hash_t	hash;
+	fr_hash_table_cmp_t	cmp;
+};
+
+/*
+ *	Bitmask of the slots in the group whose control byte is "c".
+ */
+static inline uint32_t group_match(uint8_t const *ctrl, uint8_t c)
+{
+#ifdef __SSE2__
+	__m128i group = _mm_load_si128((__m128i const *) ctrl);
+
+	return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char) c)));
+#else
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 0; i < FR_HASH_OA_GROUP; i++) if (ctrl[i] == c) mask |= (1 << i);
+
+	return mask;
+#endif
+}
+
+/*
+ *	Bitmask of the slots in the group which are EMPTY or DELETED.
+ */
+static inline uint32_t group_match_free(uint8_t const *ctrl)
+{
+#ifdef __SSE2__
+	return (uint32_t) _mm_movemask_epi8(_mm_load_si128((__m128i const *) ctrl));
+#else
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 0; i < FR_HASH_OA_GROUP; i++) if (!CTRL_IS_FULL(ctrl[i])) mask |= (1 << i);
+
+	return mask;
+#endif
+}
+
+/*
+ *	Index of the lowest set bit.  mask must not be zero.
+ */
+static inline int group_first(uint32_t mask)
+{
+#ifdef __GNUC__
+	return __builtin_ctz(mask);
+#else
+	int i = 0;
+
+	while (!(mask & 1)) {
+		mask >>= 1;
+		i++;
+	}
+
+	return i;
+#endif
+}
+
+static int fr_hash_oa_array_alloc(fr_hash_oa_t *ht, fr_hash_oa_array_t *a, uint32_t num_groups)
+{
+	uint32_t num_slots = num_groups * FR_HASH_OA_GROUP;
+
+	memset(a, 0, sizeof(*a));
+
+	/*
+	 *	The control bytes are loaded a group at a time, so
+	 *	they have to be aligned for SSE2.
+	 */
+	a->ctrl_mem = talloc_size(ht, num_slots + FR_HASH_OA_GROUP - 1);
+	a->hash = talloc_array(ht, uint32_t, num_slots);
+	a->data = talloc_array(ht, void const *, num_slots);
+	if (!a->ctrl_mem || !a->hash || !a->data) {
+		talloc_free(a->ctrl_mem);
+		talloc_free(a->hash);
+		talloc_free(a->data);
+		memset(a, 0, sizeof(*a));
+		return -1;
+	}
+	talloc_set_name_const(a->ctrl_mem, "fr_hash_oa_ctrl");
+
+	a->ctrl = (uint8_t *) (((uintptr_t) a->ctrl_mem + (FR_HASH_OA_GROUP - 1)) &
+			       ~((uintptr_t) FR_HASH_OA_GROUP - 1));
+	memset(a->ctrl, CTRL_EMPTY, num_slots);
+	a->num_groups = num_groups;
+
+	/*
+	 *	Big tables are probed at random, so each lookup is
+	 *	likely to be a TLB miss with small pages.
+	 */
+	fr_hugepage_advise(a->hash, num_slots * sizeof(a->hash[0]));
+	fr_hugepage_advise(a->data, num_slots * sizeof(a->data[0]));
+
+	return 0;
+}
+
+static void fr_hash_oa_array_free(fr_hash_oa_array_t *a)
+{
+	talloc_free(a->ctrl_mem);
+	talloc_free(a->hash);
+	talloc_free(a->data);
+	memset(a, 0, sizeof(*a));
+}
+
+static inline uint8_t *group_ctrl(fr_hash_oa_array_t const *a, uint32_t group)
+{
+	return a->ctrl + (group * FR_HASH_OA_GROUP);
+}
+
+static inline uint8_t *slot_ctrl(fr_hash_oa_array_t const *a, uint32_t slot)
+{
+	return a->ctrl + slot;
+}
+
+/*
+ *	Find the slot holding an entry which matches "data".
+ *
+ *	Groups are probed in triangular order, which visits every
+ *	group when the number of groups is a power of 2.  The search
+ *	stops at the first group with an EMPTY slot, as an insert
+ *	would have used that slot.
+ */
+static int fr_hash_oa_array_find(fr_hash_oa_t const *ht, fr_hash_oa_array_t const *a,
+				 uint32_t hash, void const *data)
+{
+	uint32_t	mask = a->num_groups - 1;
+	uint32_t	group = HASH_GROUP(hash) & mask;
+	uint32_t	i;
+
+	if (!a->num_elements) return -1;
+
+	for (i = 0; i < a->num_groups; i++) {
+		uint8_t const	*ctrl = group_ctrl(a, group);
+		uint32_t	match = group_match(ctrl, HASH_CTRL(hash));
+
+		while (match) {
+			uint32_t slot = (group * FR_HASH_OA_GROUP) + group_first(match);
+
+			match &= match - 1;
+
+			if (a->hash[slot] != hash) continue;
+			if (ht->cmp && (ht->cmp(data, a->data[slot]) != 0)) continue;
+
+			return slot;
+		}
+
+		if (group_match(ctrl, CTRL_EMPTY)) return -1;
+
+		group = (group + i + 1) & mask;
+	}
+
+	return -1;
+}
+
+/*
+ *	Find the first EMPTY or DELETED slot on the probe sequence.
+ *	The caller ensures there is one.
+ */
+static uint32_t fr_hash_oa_array_free_slot(fr_hash_oa_array_t const *a, uint32_t hash)
+{
+	uint32_t	mask = a->num_groups - 1;
+	uint32_t	group = HASH_GROUP(hash) & mask;
+	uint32_t	i;
+
+	for (i = 0; i < a->num_groups; i++) {
+		uint32_t match = group_match_free(group_ctrl(a, group));
+
+		if (match) return (group * FR_HASH_OA_GROUP) + group_first(match);
+
+		group = (group + i + 1) & mask;
+	}
+
+	(void)fr_cond_assert(0);
+	return 0;
+}
+
+static void fr_hash_oa_array_set(fr_hash_oa_array_t *a, uint32_t slot, uint32_t hash, void const *data)
+{
+	uint8_t *ctrl = slot_ctrl(a, slot);
+
+	if (*ctrl == CTRL_EMPTY) a->used++;
+
+	*ctrl = HASH_CTRL(hash);
+	a->hash[slot] = hash;
+	a->data[slot] = data;
+	a->num_elements++;
+}
+
+/*
+ *	If the group already has an EMPTY slot, every probe sequence
+ *	through it stops here, so the slot can go back to being
+ *	EMPTY.  Otherwise it has to be left as DELETED, so that probes
+ *	carry on past it.
+ */
+static void fr_hash_oa_array_clear(fr_hash_oa_array_t *a, uint32_t slot)
+{
+	uint8_t *ctrl = slot_ctrl(a, slot);
+
+	if (group_match(group_ctrl(a, slot / FR_HASH_OA_GROUP), CTRL_EMPTY)) {
+		*ctrl = CTRL_EMPTY;
+		a->used--;
+	} else {
+		*ctrl = CTRL_DELETED;
+	}
+
+	a->num_elements--;
+}
+
+/*
+ *	Move some groups from the old array into the new one.
+ */
+static void fr_hash_oa_migrate(fr_hash_oa_t *ht, uint32_t num_groups)
+{
+	fr_hash_oa_array_t *old = &ht->old;
+
+	if (!old->ctrl || ht->walking) return;
+
+	while (num_groups-- && (ht->migrate < old->num_groups)) {
+		uint8_t	*ctrl = group_ctrl(old, ht->migrate);
+		int	i;
+
+		for (i = 0; i < FR_HASH_OA_GROUP; i++) {
+			uint32_t slot;
+
+			if (!CTRL_IS_FULL(ctrl[i])) continue;
+
+			slot = (ht->migrate * FR_HASH_OA_GROUP) + i;
+
+			fr_hash_oa_array_set(&ht->array,
+					     fr_hash_oa_array_free_slot(&ht->array, old->hash[slot]),
+					     old->hash[slot], old->data[slot]);
+
+			/*
+			 *	Lookups for entries which haven't been
+			 *	moved yet may still probe through this
+			 *	group, so it can't become EMPTY.
+			 */
+			ctrl[i] = CTRL_DELETED;
+			old->num_elements--;
+		}
+
+		ht->migrate++;
+	}
+
+	if (ht->migrate < old->num_groups) return;
+
+	(void)fr_cond_assert(old->num_elements == 0);
+	fr_hash_oa_array_free(old);
+}
+
+/*
+ *	Called before an insert, with the new entry going into
+ *	"array".  Start moving the entries into a new array if
+ *	there's less than 1/8 of the slots left EMPTY.
+ */
+static int fr_hash_oa_grow(fr_hash_oa_t *ht)
+{
+	fr_hash_oa_array_t	*a = &ht->array;
+	uint32_t		num_slots = a->num_groups * FR_HASH_OA_GROUP;
+	uint32_t		num_groups = a->num_groups;
+
+	if ((a->used + 1) <= (num_slots - (num_slots >> 3))) return 0;
+
+	/*
+	 *	Still moving the entries from the last resize.  Finish
+	 *	that off, unless we're in the middle of a walk.  Then
+	 *	there's nowhere to put a third array, so just fill up
+	 *	this one.
+	 */
+	if (ht->old.ctrl) {
+		if (ht->walking) return (a->used < num_slots) ? 0 : -1;
+
+		fr_hash_oa_migrate(ht, ht->old.num_groups);
+	}
+
+	/*
+	 *	Lots of DELETED slots and not so many entries.
+	 *	Rebuild at the same size, to get rid of the DELETED
+	 *	slots.
+	 */
+	if ((a->num_elements + 1) > (num_slots >> 1)) num_groups <<= 1;
+
+	ht->old = *a;
+	ht->migrate = 0;
+
+	if (fr_hash_oa_array_alloc(ht, a, num_groups) < 0) {
+		*a = ht->old;
+		memset(&ht->old, 0, sizeof(ht->old));
+		return (a->used < num_slots) ? 0 : -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Find an entry in either array.  Returns the array and slot.
+ */
+static fr_hash_oa_array_t *fr_hash_oa_find(int *slot, fr_hash_oa_t *ht, uint32_t hash, void const *data)
+{
+	*slot = fr_hash_oa_array_find(ht, &ht->array, hash, data);
+	if (*slot >= 0) return &ht->array;
+
+	if (!ht->old.ctrl) return NULL;
+
+	*slot = fr_hash_oa_array_find(ht, &ht->old, hash, data);
+	if (*slot >= 0) return &ht->old;
+
+	return NULL;
+}
+
+static int _fr_hash_oa_free(fr_hash_oa_t *ht)
+{
+	fr_hash_oa_array_free(&ht->array);
+	fr_hash_oa_array_free(&ht->old);
+
+	return 0;
+}
+
+/*
+ *	Create the table.
+ *
+ *	Memory usage in bytes is about 13 * number of slots, and there
+ *	are between 8/7 and 16/7 slots per entry.
+ */
+fr_hash_oa_t *fr_hash_oa_create(TALLOC_CTX *ctx,
+				fr_hash_table_hash_t hashNode,
+				fr_hash_table_cmp_t cmpNode,
+				fr_hash_table_free_t freeNode)
+{
+	fr_hash_oa_t *ht;
+
+	if (!hashNode) return NULL;
+
+	ht = talloc_zero(NULL, fr_hash_oa_t);
+	if (!ht) return NULL;
+	talloc_set_destructor(ht, _fr_hash_oa_free);
+	fr_talloc_link_ctx(ctx, ht);
+
+	ht->free = freeNode;
+	ht->hash = hashNode;
+	ht->cmp = cmpNode;
+
+	if (fr_hash_oa_array_alloc(ht, &ht->array, FR_HASH_OA_NUM_GROUPS) < 0) {
+		talloc_free(ht);
+		return NULL;
+	}
+
+	return ht;
+}
+
+/*
+ *	Insert data.  Returns 0 if the data is already in the table.
+ */
+int fr_hash_oa_insert(fr_hash_oa_t *ht, void const *data)
+{
+	uint32_t	hash;
+	int		slot;
+
+	if (!ht || !data) return 0;
+
+	fr_hash_oa_migrate(ht, FR_HASH_OA_MIGRATE);
+
+	hash = ht->hash(data);
+	if (fr_hash_oa_find(&slot, ht, hash, data)) return 0;
+
+	if (fr_hash_oa_grow(ht) < 0) return 0;
+
+	fr_hash_oa_array_set(&ht->array, fr_hash_oa_array_free_slot(&ht->array, hash), hash, data);
+
+	return 1;
+}
+
+/*
+ *	Find data from a template
+ *
+ *	Unlike the other operations, this doesn't move any entries, so
+ *	a table which is no longer being changed can be searched from
+ *	multiple threads at once.
+ */
+void *fr_hash_oa_finddata(fr_hash_oa_t *ht, void const *data)
+{
+	fr_hash_oa_array_t	*a;
+	int			slot;
+	void			*out;
+
+	if (!ht) return NULL;
+
+	a = fr_hash_oa_find(&slot, ht, ht->hash(data), data);
+	if (!a) return NULL;
+
+	memcpy(&out, &a->data[slot], sizeof(out));
+
+	return out;
+}
+
+/*
+ *	Replace old data with new data, OR insert if there is no old.
+ */
+int fr_hash_oa_replace(fr_hash_oa_t *ht, void const *data)
+{
+	fr_hash_oa_array_t	*a;
+	uint32_t		hash;
+	int			slot;
+
+	if (!ht || !data) return 0;
+
+	fr_hash_oa_migrate(ht, FR_HASH_OA_MIGRATE);
+
+	hash = ht->hash(data);
+	a = fr_hash_oa_find(&slot, ht, hash, data);
+	if (!a) {
+		if (fr_hash_oa_grow(ht) < 0) return 0;
+
+		fr_hash_oa_array_set(&ht->array, fr_hash_oa_array_free_slot(&ht->array, hash), hash, data);
+		return 1;
+	}
+
+	if (ht->free) {
+		void *tofree;
+
+		memcpy(&tofree, &a->data[slot], sizeof(tofree));
+		ht->free(tofree);
+	}
+	a->data[slot] = data;
+
+	return 1;
+}
+
+/*
+ *	Yank an entry from the hash table, without freeing the data.
+ */
+void *fr_hash_oa_yank(fr_hash_oa_t *ht, void const *data)
+{
+	fr_hash_oa_array_t	*a;
+	int			slot;
+	void			*old;
+
+	if (!ht) return NULL;
+
+	fr_hash_oa_migrate(ht, FR_HASH_OA_MIGRATE);
+
+	a = fr_hash_oa_find(&slot, ht, ht->hash(data), data);
+	if (!a) return NULL;
+
+	memcpy(&old, &a->data[slot], sizeof(old));
+	fr_hash_oa_array_clear(a, slot);
+
+	return old;
+}
+
+/*
+ *	Delete a piece of data from the hash table.
+ */
+int fr_hash_oa_delete(fr_hash_oa_t *ht, void const *data)
+{
+	void *old;
+
+	old = fr_hash_oa_yank(ht, data);
+	if (!old) return 0;
+
+	if (ht->free) ht->free(old);
+
+	return 1;
+}
+
+/*
+ *	Free a hash table
+ */
+void fr_hash_oa_free(fr_hash_oa_t *ht)
+{
+	if (!ht) return;
+
+	if (ht->free) {
+		fr_hash_oa_array_t	*arrays[] = { &ht->array, &ht->old };
+		size_t			i;
+
+		for (i = 0; i < (sizeof(arrays) / sizeof(*arrays)); i++) {
+			fr_hash_oa_array_t	*a = arrays[i];
+			uint32_t		slot;
+
+			if (!a->ctrl) continue;
+
+			for (slot = 0; slot < (a->num_groups * FR_HASH_OA_GROUP); slot++) {
+				void *tofree;
+
+				if (!CTRL_IS_FULL(*slot_ctrl(a, slot))) continue;
+
+				memcpy(&tofree, &a->data[slot], sizeof(tofree));
+				ht->free(tofree);
+			}
+		}
+	}
+
+	/*
+	 *	Also frees the arrays.
+	 */
+	talloc_free(ht);
+}
+
+/*
+ *	Count number of elements
+ */
+int fr_hash_oa_num_elements(fr_hash_oa_t *ht)
+{
+	if (!ht) return 0;
+
+	return ht->array.num_elements + ht->old.num_elements;
+}
+
+/*
+ *	Walk over the entries, allowing deletes & inserts to happen.
+ *
+ *	Any resize is finished first, and no entries are moved during
+ *	the walk, so every entry which was in the table when the walk
+ *	started is visited exactly once, unless it's deleted first.
+ *	Entries inserted during the walk may or may not be visited.
+ */
+int fr_hash_oa_walk(fr_hash_oa_t *ht,
+		    fr_hash_table_walk_t callback,
+		    void *context)
+{
+	fr_hash_oa_array_t	a;
+	int			slot, rcode = 0;
+
+	if (!ht || !callback) return 0;
+
+	if (ht->old.ctrl) fr_hash_oa_migrate(ht, ht->old.num_groups);
+
+	/*
+	 *	A copy, as an insert may start a resize, which moves
+	 *	this array to ht->old.  The arrays themselves stay
+	 *	where they are until the walk ends.
+	 */
+	a = ht->array;
+	ht->walking++;
+
+	for (slot = (a.num_groups * FR_HASH_OA_GROUP) - 1; slot >= 0; slot--) {
+		void *arg;
+
+		if (!CTRL_IS_FULL(*slot_ctrl(&a, slot))) continue;
+
+		memcpy(&arg, &a.data[slot], sizeof(arg));
+		rcode = callback(context, arg);
+		if (rcode != 0) break;
+	}
+
+	ht->walking--;
+
+	return rcode;
+}
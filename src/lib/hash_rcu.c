@@ -0,0 +1,877 @@
+/*
+ * hash_rcu.c	Thread-safe hash table, for read mostly data.
+ *
+ *  Lookups walk the bucket chains using atomic loads only, and never
+ *  take a lock, so tables which are read on every request can be
+ *  read from any number of threads.  Writers are serialised by one
+ *  of a set of mutexes, picked by the hash of the entry, so writers
+ *  touching different buckets don't wait for each other.  New entries
+ *  are published with a single atomic store, and old entries are
+ *  unlinked without modifying them.
+ *
+ *  Unlinked entries can't be freed straight away, as readers may
+ *  still be looking at them.  Memory is reclaimed using epochs, in
+ *  the same way as rlm_cache_rcu.  A reader publishes the global
+ *  epoch in its thread's slot for the duration of the lookup.  An
+ *  entry is freed once no slot holds an epoch less than or equal to
+ *  the one it was unlinked in.  The free callback for deleted data
+ *  is only called then, too.
+ *
+ *  Growing the table copies the entries into a new bucket array, which
+ *  is then published.  The old array and its entries are reclaimed as
+ *  above.
+ *
+ *  The API is the same as fr_hash_table_t, and uses the same callbacks.
+ *  The data returned by a lookup isn't protected once the lookup
+ *  returns.  Callers must ensure data isn't deleted while other
+ *  threads may still be using it, as before.
+ *
+ *  Without C11 atomics, all operations other than walks are
+ *  serialised by a single mutex.
+ *
+ * Version:	$Id$
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ *  Copyright 2017  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#  define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#  define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#  define PTHREAD_MUTEX_LOCK(_x)
+#  define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#  define WITH_HASH_RCU
+
+/*
+ *	Writer mutexes.  Must be a power of 2, and no more than
+ *	FR_HASH_RCU_NUM_BUCKETS, so that an entry keeps its mutex
+ *	when the table grows.
+ */
+#  define FR_HASH_RCU_LOCKS		(16)
+
+#  define ATOMIC(_t)			_Atomic(_t)
+#  define LOAD(_p, _o)			atomic_load_explicit(_p, memory_order_ ## _o)
+#  define STORE(_p, _v, _o)		atomic_store_explicit(_p, _v, memory_order_ ## _o)
+#  define FETCH_ADD(_p, _v)		atomic_fetch_add(_p, _v)
+#  define FETCH_SUB(_p, _v)		atomic_fetch_sub(_p, _v)
+#  define FENCE()			atomic_thread_fence(memory_order_seq_cst)
+#else
+#  define FR_HASH_RCU_LOCKS		(1)
+
+#  define ATOMIC(_t)			_t
+#  define LOAD(_p, _o)			(*(_p))
+#  define STORE(_p, _v, _o)		(*(_p) = (_v))
+#  define FETCH_ADD(_p, _v)		((*(_p) += (_v)) - (_v))
+#  define FETCH_SUB(_p, _v)		((*(_p) -= (_v)) + (_v))
+#  define FENCE()
+#endif
+
+/*
+ *	A reasonable number of buckets to start off with.
+ *	Should be a power of two.
+ */
+#define FR_HASH_RCU_NUM_BUCKETS	(64)
+
+/*
+ *	Number of threads which can perform lookups without
+ *	touching any shared cache lines.  Slots are released
+ *	when a thread exits, so this limits concurrent threads,
+ *	not the number ever created.  Any others count themselves
+ *	in "unslotted", and while any of those are in the table,
+ *	nothing is reclaimed.
+ */
+#define FR_HASH_RCU_SLOTS	(128)
+
+#define CACHE_LINE_SIZE		(64)
+
+#define LOCK_INDEX(_hash)	((_hash) & (FR_HASH_RCU_LOCKS - 1))
+
+typedef struct fr_hash_rcu_node_t fr_hash_rcu_node_t;
+
+struct fr_hash_rcu_node_t {
+	ATOMIC(fr_hash_rcu_node_t *)	next;
+	uint32_t			hash;
+	void const			*data;
+
+	bool				free_data;	//!< Call the free callback when the node is reclaimed.
+	fr_hash_rcu_node_t		*retired_next;	//!< Next node waiting to be freed.
+	uint_fast64_t			retired_epoch;	//!< Epoch the node was unlinked in.
+};
+
+typedef struct fr_hash_rcu_buckets_t fr_hash_rcu_buckets_t;
+
+struct fr_hash_rcu_buckets_t {
+	uint32_t			num_buckets;	//!< Power of 2.
+
+	fr_hash_rcu_buckets_t		*retired_next;	//!< Next array waiting to be freed.
+	uint_fast64_t			retired_epoch;	//!< Epoch the array was replaced in.
+
+	ATOMIC(fr_hash_rcu_node_t *)	bucket[];	//!< Heads of the bucket chains.
+};
+
+/** Epoch published by a single thread
+ *
+ * Padded to a cache line, as each slot is written by a different thread.
+ */
+typedef struct fr_hash_rcu_slot_t {
+	ATOMIC(uint_fast64_t)		epoch;		//!< Epoch the thread entered in, or 0
+							//!< if it isn't in the table.
+	uint8_t				pad[CACHE_LINE_SIZE - sizeof(uint_fast64_t)];
+} fr_hash_rcu_slot_t;
+
+struct fr_hash_rcu_t {
+	ATOMIC(fr_hash_rcu_buckets_t *)	buckets;
+	ATOMIC(uint32_t)		num_elements;
+
+	ATOMIC(uint_fast64_t)		epoch;		//!< Global epoch, advanced whenever
+							//!< anything is retired.
+	fr_hash_rcu_slot_t		*slots;		//!< Per thread epochs.
+	ATOMIC(uint32_t)		unslotted;	//!< Readers without a slot.
+
+	fr_hash_rcu_node_t		*retired;	//!< Nodes waiting to be freed.
+	fr_hash_rcu_buckets_t		*retired_buckets;	//!< Arrays waiting to be freed.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t			mutex[FR_HASH_RCU_LOCKS];	//!< Serialise writers.
+	pthread_mutex_t			retire_mutex;	//!< Protects the retired lists.
+#endif
+
+	fr_hash_table_free_t		free;
+	fr_hash_table_hash_t		hash;
+	fr_hash_table_cmp_t		cmp;
+};
+
+#ifdef WITH_HASH_RCU
+/*
+ *	Thread IDs are shared by all tables.  0 means the thread
+ *	hasn't asked for one yet, and -1 that there was no free
+ *	slot when it did.
+ */
+static atomic_bool hash_rcu_slot_used[FR_HASH_RCU_SLOTS];
+fr_thread_local_setup(int, hash_rcu_thread_id)	/* macro */
+
+#ifdef HAVE_PTHREAD_H
+static pthread_key_t hash_rcu_slot_key;
+static pthread_once_t hash_rcu_slot_once = PTHREAD_ONCE_INIT;
+
+/** Release a thread's slot when it exits
+ *
+ * The thread can't be in any table, so its slot holds epoch 0 in
+ * all of them, and the next thread to claim it can use it as is.
+ */
+static void _hash_rcu_slot_release(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+
+	atomic_store_explicit(&hash_rcu_slot_used[id - 1], false, memory_order_release);
+}
+
+static void hash_rcu_slot_key_init(void)
+{
+	(void) pthread_key_create(&hash_rcu_slot_key, _hash_rcu_slot_release);
+}
+#endif
+
+/** Claim a free slot for the calling thread
+ *
+ * @return the thread's ID (slot + 1), or -1 if all the slots are in use.
+ */
+static int hash_rcu_slot_claim(void)
+{
+	int i;
+
+#ifdef HAVE_PTHREAD_H
+	(void) pthread_once(&hash_rcu_slot_once, hash_rcu_slot_key_init);
+#endif
+
+	for (i = 0; i < FR_HASH_RCU_SLOTS; i++) {
+		bool used = false;
+
+		if (atomic_load_explicit(&hash_rcu_slot_used[i], memory_order_relaxed)) continue;
+		if (!atomic_compare_exchange_strong_explicit(&hash_rcu_slot_used[i], &used, true,
+							     memory_order_acquire, memory_order_relaxed)) continue;
+
+#ifdef HAVE_PTHREAD_H
+		/*
+		 *	The value is only there so that the key's
+		 *	destructor is called, with the ID.
+		 */
+		if (pthread_setspecific(hash_rcu_slot_key, (void *)(intptr_t)(i + 1)) != 0) {
+			atomic_store_explicit(&hash_rcu_slot_used[i], false, memory_order_release);
+			return -1;
+		}
+#endif
+		return i + 1;
+	}
+
+	return -1;
+}
+
+/** Enter the table for reading
+ *
+ * Nested calls, e.g. a lookup from a walk callback, leave the
+ * epoch of the outermost call in place.
+ *
+ * @return what to pass to #hash_rcu_exit.
+ */
+static void *hash_rcu_enter(fr_hash_rcu_t *ht)
+{
+	fr_hash_rcu_slot_t	*slot;
+	int			id;
+
+	id = fr_thread_local_get(hash_rcu_thread_id);
+	if (id == 0) {
+		id = hash_rcu_slot_claim();
+		(void) fr_thread_local_set(hash_rcu_thread_id, id);
+	}
+
+	if (id < 0) {
+		FETCH_ADD(&ht->unslotted, 1);
+		FENCE();
+		return ht;
+	}
+
+	slot = &ht->slots[id - 1];
+	if (LOAD(&slot->epoch, relaxed) != 0) return NULL;
+
+	STORE(&slot->epoch, LOAD(&ht->epoch, relaxed), relaxed);
+	FENCE();
+
+	return slot;
+}
+
+static void hash_rcu_exit(fr_hash_rcu_t *ht, void *entered)
+{
+	if (!entered) return;
+
+	if (entered == ht) {
+		atomic_fetch_sub_explicit(&ht->unslotted, 1, memory_order_release);
+		return;
+	}
+
+	atomic_store_explicit(&((fr_hash_rcu_slot_t *) entered)->epoch, 0, memory_order_release);
+}
+#endif
+
+/** Free nodes and arrays which no reader can still reference
+ *
+ */
+static void hash_rcu_reclaim(fr_hash_rcu_t *ht)
+{
+	fr_hash_rcu_node_t	**p, *node;
+	fr_hash_rcu_buckets_t	**pb, *b;
+	uint_fast64_t		min = UINT_FAST64_MAX;
+
+	PTHREAD_MUTEX_LOCK(&ht->retire_mutex);
+	if (!ht->retired && !ht->retired_buckets) {
+		PTHREAD_MUTEX_UNLOCK(&ht->retire_mutex);
+		return;
+	}
+
+#ifdef WITH_HASH_RCU
+	{
+		int i;
+
+		/*
+		 *	Pairs with the fence in hash_rcu_enter.
+		 *	Either we see the reader's epoch, or the
+		 *	reader sees the nodes we unlinked as gone.
+		 */
+		FENCE();
+
+		if (LOAD(&ht->unslotted, relaxed) != 0) {
+			PTHREAD_MUTEX_UNLOCK(&ht->retire_mutex);
+			return;
+		}
+
+		for (i = 0; i < FR_HASH_RCU_SLOTS; i++) {
+			uint_fast64_t epoch;
+
+			epoch = LOAD(&ht->slots[i].epoch, relaxed);
+			if (epoch && (epoch < min)) min = epoch;
+		}
+	}
+#endif
+
+	p = &ht->retired;
+	while ((node = *p)) {
+		if (node->retired_epoch < min) {
+			*p = node->retired_next;
+			if (node->free_data && ht->free) {
+				void *tofree;
+
+				memcpy(&tofree, &node->data, sizeof(tofree));
+				ht->free(tofree);
+			}
+			talloc_free(node);
+			continue;
+		}
+		p = &node->retired_next;
+	}
+
+	pb = &ht->retired_buckets;
+	while ((b = *pb)) {
+		if (b->retired_epoch < min) {
+			*pb = b->retired_next;
+			talloc_free(b);
+			continue;
+		}
+		pb = &b->retired_next;
+	}
+
+	PTHREAD_MUTEX_UNLOCK(&ht->retire_mutex);
+}
+
+/** Queue an unlinked node to be freed
+ *
+ */
+static void hash_rcu_retire(fr_hash_rcu_t *ht, fr_hash_rcu_node_t *node, bool free_data)
+{
+	node->free_data = free_data;
+
+	PTHREAD_MUTEX_LOCK(&ht->retire_mutex);
+	node->retired_epoch = FETCH_ADD(&ht->epoch, 1);
+	node->retired_next = ht->retired;
+	ht->retired = node;
+	PTHREAD_MUTEX_UNLOCK(&ht->retire_mutex);
+}
+
+static fr_hash_rcu_buckets_t *hash_rcu_buckets_alloc(uint32_t num_buckets)
+{
+	fr_hash_rcu_buckets_t	*b;
+	uint32_t		i;
+
+	b = talloc_zero_size(NULL, sizeof(*b) + (sizeof(b->bucket[0]) * num_buckets));
+	if (!b) return NULL;
+	talloc_set_name_const(b, "fr_hash_rcu_buckets_t");
+
+	b->num_buckets = num_buckets;
+	for (i = 0; i < num_buckets; i++) STORE(&b->bucket[i], NULL, relaxed);
+
+	return b;
+}
+
+/** Find the pointer to the node matching data
+ *
+ * @note Must be called with the mutex for the hash held.
+ */
+static ATOMIC(fr_hash_rcu_node_t *) *hash_rcu_find_locked(fr_hash_rcu_t *ht, fr_hash_rcu_buckets_t *b,
+							   uint32_t hash, void const *data)
+{
+	ATOMIC(fr_hash_rcu_node_t *)	*p;
+	fr_hash_rcu_node_t		*node;
+
+	for (p = &b->bucket[hash & (b->num_buckets - 1)];
+	     (node = LOAD(p, relaxed)) != NULL;
+	     p = &node->next) {
+		if (node->hash != hash) continue;
+		if (ht->cmp && (ht->cmp(data, node->data) != 0)) continue;
+
+		return p;
+	}
+
+	return NULL;
+}
+
+/** Double the number of buckets
+ *
+ * The entries are copied, as readers may be walking the old chains.
+ */
+static void hash_rcu_grow(fr_hash_rcu_t *ht)
+{
+	fr_hash_rcu_buckets_t	*old, *b;
+	uint32_t		i;
+
+#ifdef HAVE_PTHREAD_H
+	for (i = 0; i < FR_HASH_RCU_LOCKS; i++) pthread_mutex_lock(&ht->mutex[i]);
+#endif
+
+	old = LOAD(&ht->buckets, relaxed);
+
+	/*
+	 *	Another writer got here first.
+	 */
+	if (LOAD(&ht->num_elements, relaxed) <= (old->num_buckets << 1)) goto done;
+
+	b = hash_rcu_buckets_alloc(old->num_buckets << 1);
+	if (!b) goto done;
+
+	for (i = 0; i < old->num_buckets; i++) {
+		fr_hash_rcu_node_t *node, *copy;
+
+		for (node = LOAD(&old->bucket[i], relaxed); node; node = LOAD(&node->next, relaxed)) {
+			ATOMIC(fr_hash_rcu_node_t *) *head;
+
+			copy = talloc_zero(NULL, fr_hash_rcu_node_t);
+			if (!copy) {
+				uint32_t j;
+
+				for (j = 0; j < b->num_buckets; j++) {
+					fr_hash_rcu_node_t *next;
+
+					for (node = LOAD(&b->bucket[j], relaxed); node; node = next) {
+						next = LOAD(&node->next, relaxed);
+						talloc_free(node);
+					}
+				}
+				talloc_free(b);
+				goto done;
+			}
+
+			copy->hash = node->hash;
+			copy->data = node->data;
+
+			head = &b->bucket[copy->hash & (b->num_buckets - 1)];
+			STORE(&copy->next, LOAD(head, relaxed), relaxed);
+			STORE(head, copy, relaxed);
+		}
+	}
+
+	STORE(&ht->buckets, b, release);
+
+	/*
+	 *	The old nodes, and the array, go once nobody can be
+	 *	looking at them.
+	 */
+	for (i = 0; i < old->num_buckets; i++) {
+		fr_hash_rcu_node_t *node;
+
+		for (node = LOAD(&old->bucket[i], relaxed); node; node = LOAD(&node->next, relaxed)) {
+			hash_rcu_retire(ht, node, false);
+		}
+	}
+
+	PTHREAD_MUTEX_LOCK(&ht->retire_mutex);
+	old->retired_epoch = FETCH_ADD(&ht->epoch, 1);
+	old->retired_next = ht->retired_buckets;
+	ht->retired_buckets = old;
+	PTHREAD_MUTEX_UNLOCK(&ht->retire_mutex);
+
+done:
+#ifdef HAVE_PTHREAD_H
+	for (i = 0; i < FR_HASH_RCU_LOCKS; i++) pthread_mutex_unlock(&ht->mutex[i]);
+#endif
+
+	hash_rcu_reclaim(ht);
+}
+
+/*
+ *	Nothing else can be using the table.
+ */
+static int _fr_hash_rcu_free(fr_hash_rcu_t *ht)
+{
+	fr_hash_rcu_buckets_t	*b, *next_b;
+	fr_hash_rcu_node_t	*node, *next;
+	uint32_t		i;
+
+	b = LOAD(&ht->buckets, relaxed);
+	if (b) for (i = 0; i < b->num_buckets; i++) {
+		for (node = LOAD(&b->bucket[i], relaxed); node; node = next) {
+			next = LOAD(&node->next, relaxed);
+			talloc_free(node);
+		}
+	}
+	talloc_free(b);
+
+	/*
+	 *	The data in these has already been deleted.
+	 */
+	for (node = ht->retired; node; node = next) {
+		next = node->retired_next;
+		if (node->free_data && ht->free) {
+			void *tofree;
+
+			memcpy(&tofree, &node->data, sizeof(tofree));
+			ht->free(tofree);
+		}
+		talloc_free(node);
+	}
+
+	for (b = ht->retired_buckets; b; b = next_b) {
+		next_b = b->retired_next;
+		talloc_free(b);
+	}
+
+#ifdef HAVE_PTHREAD_H
+	for (i = 0; i < FR_HASH_RCU_LOCKS; i++) pthread_mutex_destroy(&ht->mutex[i]);
+	pthread_mutex_destroy(&ht->retire_mutex);
+#endif
+
+	return 0;
+}
+
+/*
+ *	Create the table.
+ */
+fr_hash_rcu_t *fr_hash_rcu_create(TALLOC_CTX *ctx,
+				  fr_hash_table_hash_t hashNode,
+				  fr_hash_table_cmp_t cmpNode,
+				  fr_hash_table_free_t freeNode)
+{
+	fr_hash_rcu_t		*ht;
+	fr_hash_rcu_buckets_t	*b;
+
+	if (!hashNode) return NULL;
+
+	ht = talloc_zero(NULL, fr_hash_rcu_t);
+	if (!ht) return NULL;
+
+	ht->free = freeNode;
+	ht->hash = hashNode;
+	ht->cmp = cmpNode;
+
+	b = hash_rcu_buckets_alloc(FR_HASH_RCU_NUM_BUCKETS);
+	if (!b) {
+		talloc_free(ht);
+		return NULL;
+	}
+	STORE(&ht->buckets, b, relaxed);
+	STORE(&ht->num_elements, 0, relaxed);
+	STORE(&ht->unslotted, 0, relaxed);
+
+	/*
+	 *	Epoch 0 marks a slot as inactive.
+	 */
+	STORE(&ht->epoch, 1, relaxed);
+
+#ifdef WITH_HASH_RCU
+	{
+		int i;
+
+		ht->slots = talloc_array(ht, fr_hash_rcu_slot_t, FR_HASH_RCU_SLOTS);
+		if (!ht->slots) {
+			talloc_free(b);
+			talloc_free(ht);
+			return NULL;
+		}
+		for (i = 0; i < FR_HASH_RCU_SLOTS; i++) atomic_init(&ht->slots[i].epoch, 0);
+	}
+#endif
+
+#ifdef HAVE_PTHREAD_H
+	{
+		int i;
+
+		for (i = 0; i < FR_HASH_RCU_LOCKS; i++) pthread_mutex_init(&ht->mutex[i], NULL);
+		pthread_mutex_init(&ht->retire_mutex, NULL);
+	}
+#endif
+
+	talloc_set_destructor(ht, _fr_hash_rcu_free);
+	fr_talloc_link_ctx(ctx, ht);
+
+	return ht;
+}
+
+/*
+ *	Insert data.  Returns 0 if the data is already in the table.
+ */
+int fr_hash_rcu_insert(fr_hash_rcu_t *ht, void const *data)
+{
+	fr_hash_rcu_buckets_t		*b;
+	fr_hash_rcu_node_t		*node;
+	ATOMIC(fr_hash_rcu_node_t *)	*head;
+	uint32_t			hash, num_buckets, num_elements;
+
+	if (!ht || !data) return 0;
+
+	hash = ht->hash(data);
+
+	PTHREAD_MUTEX_LOCK(&ht->mutex[LOCK_INDEX(hash)]);
+
+	/*
+	 *	Stable, as replacing it needs all of the mutexes.
+	 */
+	b = LOAD(&ht->buckets, relaxed);
+	if (hash_rcu_find_locked(ht, b, hash, data)) {
+		PTHREAD_MUTEX_UNLOCK(&ht->mutex[LOCK_INDEX(hash)]);
+		return 0;
+	}
+
+	node = talloc_zero(NULL, fr_hash_rcu_node_t);
+	if (!node) {
+		PTHREAD_MUTEX_UNLOCK(&ht->mutex[LOCK_INDEX(hash)]);
+		return 0;
+	}
+	node->hash = hash;
+	node->data = data;
+
+	head = &b->bucket[hash & (b->num_buckets - 1)];
+	STORE(&node->next, LOAD(head, relaxed), relaxed);
+	STORE(head, node, release);
+
+	num_elements = FETCH_ADD(&ht->num_elements, 1) + 1;
+	num_buckets = b->num_buckets;
+
+	PTHREAD_MUTEX_UNLOCK(&ht->mutex[LOCK_INDEX(hash)]);
+
+	/*
+	 *	Same load factor as fr_hash_table_t.
+	 */
+	if (num_elements > ((num_buckets << 1) + (num_buckets >> 1))) hash_rcu_grow(ht);
+
+	return 1;
+}
+
+/*
+ *	Find data from a template.  Doesn't lock.
+ */
+void *fr_hash_rcu_finddata(fr_hash_rcu_t *ht, void const *data)
+{
+	fr_hash_rcu_buckets_t	*b;
+	fr_hash_rcu_node_t	*node;
+	uint32_t		hash;
+	void			*out = NULL;
+#ifdef WITH_HASH_RCU
+	void			*entered;
+#endif
+
+	if (!ht) return NULL;
+
+	hash = ht->hash(data);
+
+#ifdef WITH_HASH_RCU
+	entered = hash_rcu_enter(ht);
+#else
+	PTHREAD_MUTEX_LOCK(&ht->mutex[LOCK_INDEX(hash)]);
+#endif
+
+	b = LOAD(&ht->buckets, acquire);
+	for (node = LOAD(&b->bucket[hash & (b->num_buckets - 1)], acquire);
+	     node;
+	     node = LOAD(&node->next, acquire)) {
+		if (node->hash != hash) continue;
+		if (ht->cmp && (ht->cmp(data, node->data) != 0)) continue;
+
+		memcpy(&out, &node->data, sizeof(out));
+		break;
+	}
+
+#ifdef WITH_HASH_RCU
+	hash_rcu_exit(ht, entered);
+#else
+	PTHREAD_MUTEX_UNLOCK(&ht->mutex[LOCK_INDEX(hash)]);
+#endif
+
+	return out;
+}
+
+/*
+ *	Replace old data with new data, OR insert if there is no old.
+ *
+ *	The new entry is published before the old one is unlinked,
+ *	so readers always find one of them.
+ */
+int fr_hash_rcu_replace(fr_hash_rcu_t *ht, void const *data)
+{
+	fr_hash_rcu_buckets_t		*b;
+	fr_hash_rcu_node_t		*node, *old = NULL;
+	ATOMIC(fr_hash_rcu_node_t *)	*head, *p;
+	uint32_t			hash;
+
+	if (!ht || !data) return 0;
+
+	hash = ht->hash(data);
+
+	PTHREAD_MUTEX_LOCK(&ht->mutex[LOCK_INDEX(hash)]);
+
+	b = LOAD(&ht->buckets, relaxed);
+	p = hash_rcu_find_locked(ht, b, hash, data);
+	if (!p) {
+		PTHREAD_MUTEX_UNLOCK(&ht->mutex[LOCK_INDEX(hash)]);
+		return fr_hash_rcu_insert(ht, data);
+	}
+	old = LOAD(p, relaxed);
+
+	node = talloc_zero(NULL, fr_hash_rcu_node_t);
+	if (!node) {
+		PTHREAD_MUTEX_UNLOCK(&ht->mutex[LOCK_INDEX(hash)]);
+		return 0;
+	}
+	node->hash = hash;
+	node->data = data;
+
+	head = &b->bucket[hash & (b->num_buckets - 1)];
+	STORE(&node->next, LOAD(head, relaxed), relaxed);
+	STORE(head, node, release);
+
+	/*
+	 *	If old was the head, it's now after node.
+	 */
+	if (p == head) p = &node->next;
+	STORE(p, LOAD(&old->next, relaxed), release);
+
+	hash_rcu_retire(ht, old, (old->data != data));
+
+	PTHREAD_MUTEX_UNLOCK(&ht->mutex[LOCK_INDEX(hash)]);
+
+	hash_rcu_reclaim(ht);
+
+	return 1;
+}
+
+/*
+ *	Unlink an entry, and retire it.
+ */
+static void *hash_rcu_remove(fr_hash_rcu_t *ht, void const *data, bool free_data)
+{
+	fr_hash_rcu_node_t		*node;
+	ATOMIC(fr_hash_rcu_node_t *)	*p;
+	uint32_t			hash;
+	void				*old;
+
+	if (!ht) return NULL;
+
+	hash = ht->hash(data);
+
+	PTHREAD_MUTEX_LOCK(&ht->mutex[LOCK_INDEX(hash)]);
+
+	p = hash_rcu_find_locked(ht, LOAD(&ht->buckets, relaxed), hash, data);
+	if (!p) {
+		PTHREAD_MUTEX_UNLOCK(&ht->mutex[LOCK_INDEX(hash)]);
+		return NULL;
+	}
+
+	/*
+	 *	Readers currently looking at the node can
+	 *	continue to follow its next pointer, which is
+	 *	left unchanged.
+	 */
+	node = LOAD(p, relaxed);
+	STORE(p, LOAD(&node->next, relaxed), release);
+	FETCH_SUB(&ht->num_elements, 1);
+
+	memcpy(&old, &node->data, sizeof(old));
+	hash_rcu_retire(ht, node, free_data);
+
+	PTHREAD_MUTEX_UNLOCK(&ht->mutex[LOCK_INDEX(hash)]);
+
+	hash_rcu_reclaim(ht);
+
+	return old;
+}
+
+/*
+ *	Yank an entry from the hash table, without freeing the data.
+ */
+void *fr_hash_rcu_yank(fr_hash_rcu_t *ht, void const *data)
+{
+	return hash_rcu_remove(ht, data, false);
+}
+
+/*
+ *	Delete a piece of data from the hash table.  The data is
+ *	freed once no lookups can be looking at it.
+ */
+int fr_hash_rcu_delete(fr_hash_rcu_t *ht, void const *data)
+{
+	return (hash_rcu_remove(ht, data, true) != NULL);
+}
+
+/*
+ *	Free a hash table
+ */
+void fr_hash_rcu_free(fr_hash_rcu_t *ht)
+{
+	fr_hash_rcu_buckets_t	*b;
+	uint32_t		i;
+
+	if (!ht) return;
+
+	b = LOAD(&ht->buckets, relaxed);
+	if (ht->free) for (i = 0; i < b->num_buckets; i++) {
+		fr_hash_rcu_node_t *node;
+
+		for (node = LOAD(&b->bucket[i], relaxed); node; node = LOAD(&node->next, relaxed)) {
+			void *tofree;
+
+			memcpy(&tofree, &node->data, sizeof(tofree));
+			ht->free(tofree);
+		}
+	}
+
+	/*
+	 *	Also frees nodes and buckets
+	 */
+	talloc_free(ht);
+}
+
+/*
+ *	Count number of elements
+ */
+int fr_hash_rcu_num_elements(fr_hash_rcu_t *ht)
+{
+	if (!ht) return 0;
+
+	return LOAD(&ht->num_elements, relaxed);
+}
+
+/*
+ *	Walk over the nodes, allowing deletes & inserts to happen.
+ *
+ *	The walk is a reader, so it doesn't stop other threads changing
+ *	the table.  Entries inserted or deleted while walking may or may
+ *	not be visited.  Without C11 atomics, walks must not run at the
+ *	same time as writers in other threads.
+ */
+int fr_hash_rcu_walk(fr_hash_rcu_t *ht,
+		     fr_hash_table_walk_t callback,
+		     void *context)
+{
+	fr_hash_rcu_buckets_t	*b;
+	int			i, rcode = 0;
+#ifdef WITH_HASH_RCU
+	void			*entered;
+#endif
+
+	if (!ht || !callback) return 0;
+
+#ifdef WITH_HASH_RCU
+	entered = hash_rcu_enter(ht);
+#endif
+
+	b = LOAD(&ht->buckets, acquire);
+	for (i = b->num_buckets - 1; i >= 0; i--) {
+		fr_hash_rcu_node_t *node, *next;
+
+		for (node = LOAD(&b->bucket[i], acquire); node; node = next) {
+			void *arg;
+
+			next = LOAD(&node->next, acquire);
+
+			memcpy(&arg, &node->data, sizeof(arg));
+			rcode = callback(context, arg);
+			if (rcode != 0) goto done;
+		}
+	}
+
+done:
+#ifdef WITH_HASH_RCU
+	hash_rcu_exit(ht, entered);
+#endif
+
+	return rcode;
+}
@@ -333,6 +333,53 @@ static int ip_prefix_addr_from_str(struct in_addr *out, char const *str)
 	return p - str;
 }
 
+/** Parse a strict dotted quad
+ *
+ * Accepts exactly four octets of one to three digits, with no leading
+ * zeros, separated by dots, and nothing after the last octet.  That's what
+ * nearly every address we're given looks like, and checking for it here
+ * means we don't have to go through inet_pton(), or getaddrinfo() when
+ * hostname lookups are enabled.
+ *
+ * @param[out] out Where to write parsed address.
+ * @param[in] str to parse.
+ * @return
+ *	- true if str was a dotted quad.
+ *	- false if it wasn't, in which case it should be passed to a
+ *	  more general parser.
+ */
+static bool ip_dotted_quad_from_str(struct in_addr *out, char const *str)
+{
+	uint32_t addr = 0;
+	uint32_t octet;
+	char const *p = str;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if ((*p < '0') || (*p > '9')) return false;
+		octet = *p++ - '0';
+
+		if ((*p >= '0') && (*p <= '9')) {
+			if (octet == 0) return false;	/* Leading zeros may mean octal */
+			octet = (octet * 10) + (*p++ - '0');
+
+			if ((*p >= '0') && (*p <= '9')) {
+				octet = (octet * 10) + (*p++ - '0');
+				if (octet > 255) return false;
+			}
+		}
+
+		addr = (addr << 8) | octet;
+
+		if ((i < 3) && (*p++ != '.')) return false;
+	}
+
+	if (*p != '\0') return false;
+
+	out->s_addr = htonl(addr);
+	return true;
+}
+
 /** Parse an IPv4 address or IPv4 prefix in presentation format (and others)
  *
  * @param out Where to write the ip address value.
@@ -382,6 +429,13 @@ int fr_inet_pton4(fr_ipaddr_t *out, char const *value, ssize_t inlen, bool resol
 		if ((value[0] == '*') && (value[1] == '\0')) {
 			out->ipaddr.ip4addr.s_addr = htonl(INADDR_ANY);
 
+		/*
+		 *	The common case.  Anything which isn't a strict
+		 *	dotted quad falls through to the checks below.
+		 */
+		} else if (ip_dotted_quad_from_str(&out->ipaddr.ip4addr, value)) {
+			out->zone_id = 0;
+
 		/*
 		 *	Convert things which are obviously integers to IP addresses
 		 *
@@ -34,6 +34,90 @@ void fr_md5_calc(uint8_t *out, uint8_t const *in, size_t inlen)
 	fr_md5_final(out, &ctx);
 }
 
+/* The four core functions - F1 is optimized somewhat */
+#define F1(x, y, z) (z ^ (x & (y ^ z)))
+#define F2(x, y, z) F1(z, x, y)
+#define F3(x, y, z) (x ^ y ^ z)
+#define F4(x, y, z) (y ^ (x | ~z))
+
+/* This is the central step in the MD5 algorithm. */
+#define MD5STEP(f, w, x, y, z, data, s) (w += f(x, y, z) + data, w = w << s | w >> (32 - s),  w += x)
+
+/*
+ *	All 64 steps of the MD5 transform.  The variables may be scalars
+ *	or vectors, so this is shared by fr_md5_transform() and
+ *	fr_md5_calc_multi().
+ */
+#define MD5_ROUNDS(a, b, c, d, in) do { \
+	MD5STEP(F1, a, b, c, d, in[ 0] + 0xd76aa478,  7); \
+	MD5STEP(F1, d, a, b, c, in[ 1] + 0xe8c7b756, 12); \
+	MD5STEP(F1, c, d, a, b, in[ 2] + 0x242070db, 17); \
+	MD5STEP(F1, b, c, d, a, in[ 3] + 0xc1bdceee, 22); \
+	MD5STEP(F1, a, b, c, d, in[ 4] + 0xf57c0faf,  7); \
+	MD5STEP(F1, d, a, b, c, in[ 5] + 0x4787c62a, 12); \
+	MD5STEP(F1, c, d, a, b, in[ 6] + 0xa8304613, 17); \
+	MD5STEP(F1, b, c, d, a, in[ 7] + 0xfd469501, 22); \
+	MD5STEP(F1, a, b, c, d, in[ 8] + 0x698098d8,  7); \
+	MD5STEP(F1, d, a, b, c, in[ 9] + 0x8b44f7af, 12); \
+	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17); \
+	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22); \
+	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122,  7); \
+	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12); \
+	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17); \
+	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22); \
+\
+	MD5STEP(F2, a, b, c, d, in[ 1] + 0xf61e2562,  5); \
+	MD5STEP(F2, d, a, b, c, in[ 6] + 0xc040b340,  9); \
+	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14); \
+	MD5STEP(F2, b, c, d, a, in[ 0] + 0xe9b6c7aa, 20); \
+	MD5STEP(F2, a, b, c, d, in[ 5] + 0xd62f105d,  5); \
+	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453,  9); \
+	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14); \
+	MD5STEP(F2, b, c, d, a, in[ 4] + 0xe7d3fbc8, 20); \
+	MD5STEP(F2, a, b, c, d, in[ 9] + 0x21e1cde6,  5); \
+	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6,  9); \
+	MD5STEP(F2, c, d, a, b, in[ 3] + 0xf4d50d87, 14); \
+	MD5STEP(F2, b, c, d, a, in[ 8] + 0x455a14ed, 20); \
+	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905,  5); \
+	MD5STEP(F2, d, a, b, c, in[ 2] + 0xfcefa3f8,  9); \
+	MD5STEP(F2, c, d, a, b, in[ 7] + 0x676f02d9, 14); \
+	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20); \
+\
+	MD5STEP(F3, a, b, c, d, in[ 5] + 0xfffa3942,  4); \
+	MD5STEP(F3, d, a, b, c, in[ 8] + 0x8771f681, 11); \
+	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16); \
+	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23); \
+	MD5STEP(F3, a, b, c, d, in[ 1] + 0xa4beea44,  4); \
+	MD5STEP(F3, d, a, b, c, in[ 4] + 0x4bdecfa9, 11); \
+	MD5STEP(F3, c, d, a, b, in[ 7] + 0xf6bb4b60, 16); \
+	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23); \
+	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6,  4); \
+	MD5STEP(F3, d, a, b, c, in[ 0] + 0xeaa127fa, 11); \
+	MD5STEP(F3, c, d, a, b, in[ 3] + 0xd4ef3085, 16); \
+	MD5STEP(F3, b, c, d, a, in[ 6] + 0x04881d05, 23); \
+	MD5STEP(F3, a, b, c, d, in[ 9] + 0xd9d4d039,  4); \
+	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11); \
+	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16); \
+	MD5STEP(F3, b, c, d, a, in[2 ] + 0xc4ac5665, 23); \
+\
+	MD5STEP(F4, a, b, c, d, in[ 0] + 0xf4292244,  6); \
+	MD5STEP(F4, d, a, b, c, in[7 ] + 0x432aff97, 10); \
+	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15); \
+	MD5STEP(F4, b, c, d, a, in[5 ] + 0xfc93a039, 21); \
+	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3,  6); \
+	MD5STEP(F4, d, a, b, c, in[3 ] + 0x8f0ccc92, 10); \
+	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15); \
+	MD5STEP(F4, b, c, d, a, in[1 ] + 0x85845dd1, 21); \
+	MD5STEP(F4, a, b, c, d, in[8 ] + 0x6fa87e4f,  6); \
+	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10); \
+	MD5STEP(F4, c, d, a, b, in[6 ] + 0xa3014314, 15); \
+	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21); \
+	MD5STEP(F4, a, b, c, d, in[4 ] + 0xf7537e82,  6); \
+	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10); \
+	MD5STEP(F4, c, d, a, b, in[2 ] + 0x2ad7d2bb, 15); \
+	MD5STEP(F4, b, c, d, a, in[9 ] + 0xeb86d391, 21); \
+} while (0)
+
 #ifndef HAVE_OPENSSL_EVP_H
 /*
  * This code implements the MD5 message-digest algorithm.
@@ -166,15 +250,6 @@ void fr_md5_final(uint8_t out[MD5_DIGEST_LENGTH], FR_MD5_CTX *ctx)
 	memset(ctx, 0, sizeof(*ctx));	/* in case it's sensitive */
 }
 
-/* The four core functions - F1 is optimized somewhat */
-#define F1(x, y, z) (z ^ (x & (y ^ z)))
-#define F2(x, y, z) F1(z, x, y)
-#define F3(x, y, z) (x ^ y ^ z)
-#define F4(x, y, z) (y ^ (x | ~z))
-
-/* This is the central step in the MD5 algorithm. */
-#define MD5STEP(f, w, x, y, z, data, s) (w += f(x, y, z) + data, w = w << s | w >> (32 - s),  w += x)
-
 /** The core of the MD5 algorithm
  *
  * This alters an existing MD5 hash to reflect the addition of 16
@@ -201,73 +276,7 @@ void fr_md5_transform(uint32_t state[4], uint8_t const block[MD5_BLOCK_LENGTH])
 	c = state[2];
 	d = state[3];
 
-	MD5STEP(F1, a, b, c, d, in[ 0] + 0xd76aa478,  7);
-	MD5STEP(F1, d, a, b, c, in[ 1] + 0xe8c7b756, 12);
-	MD5STEP(F1, c, d, a, b, in[ 2] + 0x242070db, 17);
-	MD5STEP(F1, b, c, d, a, in[ 3] + 0xc1bdceee, 22);
-	MD5STEP(F1, a, b, c, d, in[ 4] + 0xf57c0faf,  7);
-	MD5STEP(F1, d, a, b, c, in[ 5] + 0x4787c62a, 12);
-	MD5STEP(F1, c, d, a, b, in[ 6] + 0xa8304613, 17);
-	MD5STEP(F1, b, c, d, a, in[ 7] + 0xfd469501, 22);
-	MD5STEP(F1, a, b, c, d, in[ 8] + 0x698098d8,  7);
-	MD5STEP(F1, d, a, b, c, in[ 9] + 0x8b44f7af, 12);
-	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
-	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
-	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122,  7);
-	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
-	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
-	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
-
-	MD5STEP(F2, a, b, c, d, in[ 1] + 0xf61e2562,  5);
-	MD5STEP(F2, d, a, b, c, in[ 6] + 0xc040b340,  9);
-	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
-	MD5STEP(F2, b, c, d, a, in[ 0] + 0xe9b6c7aa, 20);
-	MD5STEP(F2, a, b, c, d, in[ 5] + 0xd62f105d,  5);
-	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453,  9);
-	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
-	MD5STEP(F2, b, c, d, a, in[ 4] + 0xe7d3fbc8, 20);
-	MD5STEP(F2, a, b, c, d, in[ 9] + 0x21e1cde6,  5);
-	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6,  9);
-	MD5STEP(F2, c, d, a, b, in[ 3] + 0xf4d50d87, 14);
-	MD5STEP(F2, b, c, d, a, in[ 8] + 0x455a14ed, 20);
-	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905,  5);
-	MD5STEP(F2, d, a, b, c, in[ 2] + 0xfcefa3f8,  9);
-	MD5STEP(F2, c, d, a, b, in[ 7] + 0x676f02d9, 14);
-	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
-
-	MD5STEP(F3, a, b, c, d, in[ 5] + 0xfffa3942,  4);
-	MD5STEP(F3, d, a, b, c, in[ 8] + 0x8771f681, 11);
-	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
-	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
-	MD5STEP(F3, a, b, c, d, in[ 1] + 0xa4beea44,  4);
-	MD5STEP(F3, d, a, b, c, in[ 4] + 0x4bdecfa9, 11);
-	MD5STEP(F3, c, d, a, b, in[ 7] + 0xf6bb4b60, 16);
-	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
-	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6,  4);
-	MD5STEP(F3, d, a, b, c, in[ 0] + 0xeaa127fa, 11);
-	MD5STEP(F3, c, d, a, b, in[ 3] + 0xd4ef3085, 16);
-	MD5STEP(F3, b, c, d, a, in[ 6] + 0x04881d05, 23);
-	MD5STEP(F3, a, b, c, d, in[ 9] + 0xd9d4d039,  4);
-	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
-	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
-	MD5STEP(F3, b, c, d, a, in[2 ] + 0xc4ac5665, 23);
-
-	MD5STEP(F4, a, b, c, d, in[ 0] + 0xf4292244,  6);
-	MD5STEP(F4, d, a, b, c, in[7 ] + 0x432aff97, 10);
-	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
-	MD5STEP(F4, b, c, d, a, in[5 ] + 0xfc93a039, 21);
-	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3,  6);
-	MD5STEP(F4, d, a, b, c, in[3 ] + 0x8f0ccc92, 10);
-	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
-	MD5STEP(F4, b, c, d, a, in[1 ] + 0x85845dd1, 21);
-	MD5STEP(F4, a, b, c, d, in[8 ] + 0x6fa87e4f,  6);
-	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
-	MD5STEP(F4, c, d, a, b, in[6 ] + 0xa3014314, 15);
-	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
-	MD5STEP(F4, a, b, c, d, in[4 ] + 0xf7537e82,  6);
-	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
-	MD5STEP(F4, c, d, a, b, in[2 ] + 0x2ad7d2bb, 15);
-	MD5STEP(F4, b, c, d, a, in[9 ] + 0xeb86d391, 21);
+	MD5_ROUNDS(a, b, c, d, in);
 
 	state[0] += a;
 	state[1] += b;
@@ -275,3 +284,136 @@ void fr_md5_transform(uint32_t state[4], uint8_t const block[MD5_BLOCK_LENGTH])
 	state[3] += d;
 }
 #endif
+
+/*
+ *	Use the compiler's vector extensions where they're available.
+ *	The compiler picks the instructions (SSE2, AVX2, NEON...) for
+ *	the target, and falls back to scalar code when there are none.
+ */
+#if defined(__clang__) || (defined(__GNUC__) && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 8))))
+typedef uint32_t md5_vec_t __attribute__ ((vector_size (FR_MD5_LANES * sizeof(uint32_t))));
+
+/** Calculate the MD5 hashes of multiple buffers in parallel
+ *
+ * The buffers are hashed in groups of #FR_MD5_LANES, with each buffer in
+ * its own SIMD lane.  Buffers may be of different lengths, lanes which
+ * have finished are masked out until the longest buffer is done.
+ *
+ * @param[out] out Where to write the MD5 digests.  Each must be a minimum
+ *	of MD5_DIGEST_LENGTH.
+ * @param[in] in Data to hash.
+ * @param[in] inlen Length of the data.
+ * @param[in] num Number of buffers to hash.
+ */
+void fr_md5_calc_multi(uint8_t *out[], uint8_t const *in[], size_t const inlen[], unsigned int num)
+{
+	static uint8_t const	zero[MD5_BLOCK_LENGTH];
+	uint8_t			tail[FR_MD5_LANES][MD5_BLOCK_LENGTH * 2];
+	size_t			full[FR_MD5_LANES], blocks[FR_MD5_LANES];
+	unsigned int		i, j, k, lane, lanes;
+
+	for (i = 0; i < num; i += lanes) {
+		md5_vec_t	state[4];
+		size_t		blk, max_blocks = 0;
+
+		lanes = num - i;
+		if (lanes > FR_MD5_LANES) lanes = FR_MD5_LANES;
+
+		/*
+		 *	Pad the last partial block of each buffer,
+		 *	appending the length in bits.
+		 */
+		for (lane = 0; lane < FR_MD5_LANES; lane++) {
+			size_t		len, rem, tail_blocks;
+			uint64_t	bits;
+			uint8_t		*p;
+
+			if (lane >= lanes) {
+				full[lane] = blocks[lane] = 0;
+				continue;
+			}
+
+			len = inlen[i + lane];
+			full[lane] = len / MD5_BLOCK_LENGTH;
+			rem = len % MD5_BLOCK_LENGTH;
+			tail_blocks = (rem < (MD5_BLOCK_LENGTH - 8)) ? 1 : 2;
+
+			p = tail[lane];
+			memcpy(p, in[i + lane] + (full[lane] * MD5_BLOCK_LENGTH), rem);
+			p[rem] = 0x80;
+			memset(p + rem + 1, 0, (tail_blocks * MD5_BLOCK_LENGTH) - rem - 1 - 8);
+
+			bits = ((uint64_t) len) << 3;
+			p += (tail_blocks * MD5_BLOCK_LENGTH) - 8;
+			for (j = 0; j < 8; j++) p[j] = (bits >> (j * 8)) & 0xff;
+
+			blocks[lane] = full[lane] + tail_blocks;
+			if (blocks[lane] > max_blocks) max_blocks = blocks[lane];
+		}
+
+		for (k = 0; k < FR_MD5_LANES; k++) {
+			state[0][k] = 0x67452301;
+			state[1][k] = 0xefcdab89;
+			state[2][k] = 0x98badcfe;
+			state[3][k] = 0x10325476;
+		}
+
+		for (blk = 0; blk < max_blocks; blk++) {
+			md5_vec_t a, b, c, d, mask, w[MD5_BLOCK_LENGTH / 4];
+
+			/*
+			 *	Transpose the next block of each lane
+			 *	into the message words.
+			 */
+			for (lane = 0; lane < FR_MD5_LANES; lane++) {
+				uint8_t const *p;
+
+				if (blk < full[lane]) {
+					p = in[i + lane] + (blk * MD5_BLOCK_LENGTH);
+				} else if (blk < blocks[lane]) {
+					p = tail[lane] + ((blk - full[lane]) * MD5_BLOCK_LENGTH);
+				} else {
+					p = zero;
+				}
+
+				mask[lane] = (blk < blocks[lane]) ? 0xffffffff : 0;
+
+				for (j = 0; j < MD5_BLOCK_LENGTH / 4; j++, p += 4) {
+					w[j][lane] = (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+						     ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+				}
+			}
+
+			a = state[0];
+			b = state[1];
+			c = state[2];
+			d = state[3];
+
+			MD5_ROUNDS(a, b, c, d, w);
+
+			state[0] += a & mask;
+			state[1] += b & mask;
+			state[2] += c & mask;
+			state[3] += d & mask;
+		}
+
+		for (lane = 0; lane < lanes; lane++) {
+			uint8_t *p = out[i + lane];
+
+			for (k = 0; k < 4; k++, p += 4) {
+				p[0] = state[k][lane] & 0xff;
+				p[1] = (state[k][lane] >> 8) & 0xff;
+				p[2] = (state[k][lane] >> 16) & 0xff;
+				p[3] = (state[k][lane] >> 24) & 0xff;
+			}
+		}
+	}
+}
+#else
+void fr_md5_calc_multi(uint8_t *out[], uint8_t const *in[], size_t const inlen[], unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++) fr_md5_calc(out[i], in[i], inlen[i]);
+}
+#endif
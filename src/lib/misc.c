@@ -23,6 +23,7 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/libradius.h>
+#include <freeradius-devel/str.h>
 
 #include <ctype.h>
 #include <sys/file.h>
@@ -31,6 +32,14 @@ RCSID("$Id$")
 #include <pwd.h>
 #include <sys/uio.h>
 
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#endif
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#endif
+
 #define FR_PUT_LE16(a, val)\
 	do {\
 		a[1] = ((uint16_t) (val)) >> 8;\
@@ -207,8 +216,6 @@ int rad_unlockfd(int fd, int lock_len)
 #endif
 }
 
-static char const hextab[] = "0123456789abcdef";
-
 /** Convert hex strings to binary data
  *
  * @param bin Buffer to write output to.
@@ -219,9 +226,7 @@ static char const hextab[] = "0123456789abcdef";
  */
 size_t fr_hex2bin(uint8_t *bin, size_t outlen, char const *hex, size_t inlen)
 {
-	size_t i;
 	size_t len;
-	char *c1, *c2;
 
 	/*
 	 *	Smartly truncate output, caller should check number of bytes
@@ -230,14 +235,7 @@ size_t fr_hex2bin(uint8_t *bin, size_t outlen, char const *hex, size_t inlen)
 	len = inlen >> 1;
 	if (len > outlen) len = outlen;
 
-	for (i = 0; i < len; i++) {
-		if(!(c1 = memchr(hextab, tolower((int) hex[i << 1]), sizeof(hextab))) ||
-		   !(c2 = memchr(hextab, tolower((int) hex[(i << 1) + 1]), sizeof(hextab))))
-			break;
-		bin[i] = ((c1-hextab)<<4) + (c2-hextab);
-	}
-
-	return i;
+	return fr_str_hex_decode(bin, hex, len);
 }
 
 /** Convert binary data to a hex string
@@ -253,16 +251,9 @@ size_t fr_hex2bin(uint8_t *bin, size_t outlen, char const *hex, size_t inlen)
  */
 size_t fr_bin2hex(char *hex, uint8_t const *bin, size_t inlen)
 {
-	size_t i;
+	fr_str_hex_encode(hex, bin, inlen);
+	hex[inlen * 2] = '\0';
 
-	for (i = 0; i < inlen; i++) {
-		hex[0] = hextab[((*bin) >> 4) & 0x0f];
-		hex[1] = hextab[*bin & 0x0f];
-		hex += 2;
-		bin++;
-	}
-
-	*hex = '\0';
 	return inlen * 2;
 }
 
@@ -1005,6 +996,104 @@ void fr_quick_sort(void const *to_sort[], int min_idx, int max_idx, fr_cmp_t cmp
 	fr_quick_sort(to_sort, part + 1, max_idx, cmp);
 }
 
+/*
+ *	Size of a transparent huge page on x86_64, and of the smallest
+ *	one on aarch64.
+ */
+#define HUGEPAGE_SIZE	(2 * 1024 * 1024)
+
+bool fr_hugepages = false;
+
+#ifdef HAVE_STDATOMIC_H
+static atomic_size_t hugepage_advised;
+#else
+static size_t hugepage_advised;
+#endif
+
+/** Ask the kernel to back part of a large, long-lived allocation with huge pages
+ *
+ * Only the huge pages which fit entirely inside the allocation are
+ * affected.  Nothing is done unless #fr_hugepages is set, and the
+ * allocation spans at least one huge page.
+ *
+ * Talloc has no way of using another allocator, but its pools, and
+ * any allocation large enough for malloc to use mmap(), are
+ * contiguous, so they can be advised after the fact.
+ *
+ * @param[in] ptr	start of the allocation.
+ * @param[in] len	of the allocation.
+ * @return the number of bytes advised.
+ */
+size_t fr_hugepage_advise(void const *ptr, size_t len)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_HUGEPAGE)
+	uintptr_t start, end;
+
+	if (!fr_hugepages || !ptr) return 0;
+
+	start = ((uintptr_t) ptr + (HUGEPAGE_SIZE - 1)) & ~((uintptr_t) HUGEPAGE_SIZE - 1);
+	end = ((uintptr_t) ptr + len) & ~((uintptr_t) HUGEPAGE_SIZE - 1);
+	if (end <= start) return 0;
+
+	if (madvise((void *) start, end - start, MADV_HUGEPAGE) < 0) return 0;
+
+	hugepage_advised += end - start;
+
+	return end - start;
+#else
+	return 0;
+#endif
+}
+
+/** Return the number of bytes which have been advised with #fr_hugepage_advise
+ *
+ */
+size_t fr_hugepage_advised(void)
+{
+	return hugepage_advised;
+}
+
+/** Return the number of bytes of this process' memory which are in huge pages
+ *
+ * This is what the kernel has actually backed with transparent huge
+ * pages, which may be less than what's been advised.
+ *
+ * @param[out] out	bytes in huge pages.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the information isn't available.
+ */
+int fr_hugepage_resident(size_t *out)
+{
+	FILE		*fp;
+	char		buffer[256];
+	unsigned long	kb;
+	size_t		total = 0;
+	bool		found = false;
+
+	/*
+	 *	smaps_rollup has one line for the whole process.
+	 *	Older kernels only have smaps, with a line for each
+	 *	mapping.
+	 */
+	fp = fopen("/proc/self/smaps_rollup", "r");
+	if (!fp) fp = fopen("/proc/self/smaps", "r");
+	if (!fp) return -1;
+
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		if (sscanf(buffer, "AnonHugePages: %lu kB", &kb) != 1) continue;
+
+		total += (size_t) kb * 1024;
+		found = true;
+	}
+	fclose(fp);
+
+	if (!found) return -1;
+
+	*out = total;
+	return 0;
+}
+
 #ifdef TALLOC_DEBUG
 void fr_talloc_verify_cb(UNUSED const void *ptr, UNUSED int depth,
 			 UNUSED int max_depth, UNUSED int is_ref,
@@ -80,6 +80,49 @@ int fr_packet_cmp(RADIUS_PACKET const *a, RADIUS_PACKET const *b)
 	return rcode;
 }
 
+static uint32_t packet_ipaddr_hash(fr_ipaddr_t const *ipaddr, uint32_t hash)
+{
+	hash = fr_hash_update(&ipaddr->af, sizeof(ipaddr->af), hash);
+	hash = fr_hash_update(&ipaddr->prefix, sizeof(ipaddr->prefix), hash);
+
+	switch (ipaddr->af) {
+	case AF_INET:
+		return fr_hash_update(&ipaddr->ipaddr.ip4addr, sizeof(ipaddr->ipaddr.ip4addr), hash);
+
+#ifdef HAVE_STRUCT_SOCKADDR_IN6
+	case AF_INET6:
+		hash = fr_hash_update(&ipaddr->zone_id, sizeof(ipaddr->zone_id), hash);
+		return fr_hash_update(&ipaddr->ipaddr.ip6addr, sizeof(ipaddr->ipaddr.ip6addr), hash);
+#endif
+
+	default:
+		break;
+	}
+
+	return hash;
+}
+
+/** Hash the fields of a packet which fr_packet_cmp() compares
+ *
+ * Packets for which fr_packet_cmp() returns 0 always have the same hash,
+ * so the two can be used together for a hash table of packets.
+ *
+ * @param packet to hash.
+ * @return the hash.
+ */
+uint32_t fr_packet_hash(RADIUS_PACKET const *packet)
+{
+	uint32_t hash;
+
+	hash = fr_hash(&packet->id, sizeof(packet->id));
+	hash = fr_hash_update(&packet->sockfd, sizeof(packet->sockfd), hash);
+	hash = fr_hash_update(&packet->src_port, sizeof(packet->src_port), hash);
+	hash = packet_ipaddr_hash(&packet->src_ipaddr, hash);
+	hash = packet_ipaddr_hash(&packet->dst_ipaddr, hash);
+
+	return fr_hash_update(&packet->dst_port, sizeof(packet->dst_port), hash);
+}
+
 /** Determine if an address is the INADDR_ANY address for its address family
  *
  * @param ipaddr to check.
@@ -258,7 +301,10 @@ typedef struct fr_packet_socket_t {
 	int		proto;
 #endif
 
-	uint8_t		id[32];
+	uint8_t		id[32];		//!< Bitmap of the IDs in use.
+
+	uint8_t		free_id[256];	//!< Ring of free IDs, least recently freed first.
+	uint8_t		free_head;	//!< Position of the next ID to allocate in free_id.
 } fr_packet_socket_t;
 
 
@@ -432,6 +478,17 @@ bool fr_packet_list_socket_add(fr_packet_list_t *pl, int sockfd, int proto,
 	ps->dst_any = fr_is_inaddr_any(&ps->dst_ipaddr);
 	if (ps->dst_any < 0) return false;
 
+	/*
+	 *	Fill the ring of free IDs in random order, so that
+	 *	the IDs we send are hard to predict.
+	 */
+	for (i = 0; i < 256; i++) {
+		int j = fr_rand() % (i + 1);
+
+		ps->free_id[i] = ps->free_id[j];
+		ps->free_id[j] = i;
+	}
+
 	/*
 	 *	As the last step before returning.
 	 */
@@ -611,9 +668,9 @@ uint32_t fr_packet_list_num_elements(fr_packet_list_t *pl)
 bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 			    RADIUS_PACKET **request_p, void **pctx)
 {
-	int i, j, k, fd, id, start_i, start_j, start_k;
+	int i, fd, id, start_i;
 	int src_any = 0;
-	fr_packet_socket_t *ps= NULL;
+	fr_packet_socket_t *ps= NULL, *best = NULL;
 	RADIUS_PACKET *request = *request_p;
 
 	if ((request->dst_ipaddr.af == AF_UNSPEC) ||
@@ -652,27 +709,12 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 	}
 
 	/*
-	 *	FIXME: Go to an LRU system.  This prevents ID re-use
-	 *	for as long as possible.  The main problem with that
-	 *	approach is that it requires us to populate the
-	 *	LRU/FIFO when we add a new socket, or a new destination,
-	 *	which can be expensive.
-	 *
-	 *	The LRU can be avoided if the caller takes care to free
-	 *	Id's only when all responses have been received, OR after
-	 *	a timeout.
-	 *
-	 *	Right now, the random approach is almost OK... it's
-	 *	brute-force over all of the available ID's, BUT using
-	 *	random numbers for everything spreads the load a bit.
-	 *
-	 *	The old method had a hash lookup on allocation AND
-	 *	on free.  The new method has brute-force on allocation,
-	 *	and near-zero cost on free.
+	 *	IDs are handed out from a per-socket ring, and freed
+	 *	IDs go to the back of it.  So allocation is O(1), and
+	 *	an ID is re-used as late as possible.
 	 */
-
 	id = fd = -1;
-	start_i = fr_rand() & SOCKOFFSET_MASK;
+	start_i = fr_fast_rand() & SOCKOFFSET_MASK;
 
 #define ID_i ((i + start_i) & SOCKOFFSET_MASK)
 	for (i = 0; i < MAX_SOCKETS; i++) {
@@ -754,33 +796,24 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 		/*
 		 *	Otherwise, this socket is OK to use.
 		 */
+		if (!best || (ps->num_outgoing < best->num_outgoing)) {
+			best = ps;
+			fd = ID_i;
+		}
 
+#ifdef WITH_TCP
 		/*
-		 *	Look for a free Id, starting from a random number.
+		 *	TCP connections to a home server are
+		 *	interchangeable, so spread the requests over
+		 *	them by using the one with the fewest
+		 *	outstanding.  UDP sockets are used in random
+		 *	order, as before.
 		 */
-		start_j = fr_rand() & 0x1f;
-#define ID_j ((j + start_j) & 0x1f)
-		for (j = 0; j < 32; j++) {
-			if (ps->id[ID_j] == 0xff) continue;
-
-
-			start_k = fr_rand() & 0x07;
-#define ID_k ((k + start_k) & 0x07)
-			for (k = 0; k < 8; k++) {
-				if ((ps->id[ID_j] & (1 << ID_k)) != 0) continue;
-
-				ps->id[ID_j] |= (1 << ID_k);
-				id = (ID_j * 8) + ID_k;
-				fd = i;
-				break;
-			}
-			if (fd >= 0) break;
-		}
-#undef ID_i
-#undef ID_j
-#undef ID_k
+		if ((proto == IPPROTO_TCP) && (best->num_outgoing > 0)) continue;
+#endif
 		break;
 	}
+#undef ID_i
 
 	/*
 	 *	Ask the caller to allocate a new ID.
@@ -790,6 +823,10 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 		return false;
 	}
 
+	ps = best;
+	id = ps->free_id[ps->free_head++];
+	ps->id[id >> 3] |= (1 << (id & 0x07));
+
 	/*
 	 *	Set the ID, source IP, and source port.
 	 */
@@ -810,10 +847,11 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 	}
 
 	/*
-	 *	Mark the ID as free.  This is the one line from
-	 *	id_free() that we care about here.
+	 *	Mark the ID as free, and put it back at the front
+	 *	of the ring.
 	 */
 	ps->id[(request->id >> 3) & 0x1f] &= ~(1 << (request->id & 0x07));
+	ps->free_head--;
 
 	request->id = -1;
 	request->sockfd = -1;
@@ -839,13 +877,20 @@ bool fr_packet_list_id_free(fr_packet_list_t *pl,
 	ps = fr_socket_find(pl, request->sockfd);
 	if (!ps) return false;
 
-#if 0
-	if (!ps->id[(request->id >> 3) & 0x1f] & (1 << (request->id & 0x07))) {
-		fr_exit(1);
-	}
-#endif
+	/*
+	 *	Not allocated, or already freed.  Don't add it to
+	 *	the ring a second time.
+	 */
+	if ((request->id < 0) || (request->id > 255) ||
+	    !(ps->id[request->id >> 3] & (1 << (request->id & 0x07)))) return false;
 
-	ps->id[(request->id >> 3) & 0x1f] &= ~(1 << (request->id & 0x07));
+	ps->id[request->id >> 3] &= ~(1 << (request->id & 0x07));
+
+	/*
+	 *	The back of the ring is num_free = (256 - num_outgoing)
+	 *	entries after the front.
+	 */
+	ps->free_id[(uint8_t) (ps->free_head - ps->num_outgoing)] = request->id;
 
 	ps->num_outgoing--;
 	pl->num_outgoing--;
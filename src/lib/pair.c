@@ -139,6 +139,9 @@ VALUE_PAIR *fr_pair_copy(TALLOC_CTX *ctx, VALUE_PAIR const *vp)
 	if (!n) return NULL;
 
 	memcpy(n, vp, sizeof(*n));
+	n->shared = NULL;
+	n->shared_ref = false;
+	n->interned = false;
 
 	/*
 	 *	If the DA is unknown, steal "n" to "ctx".  This does
@@ -166,6 +169,15 @@ VALUE_PAIR *fr_pair_copy(TALLOC_CTX *ctx, VALUE_PAIR const *vp)
 		break;
 
 	case PW_TYPE_STRING:
+		/*
+		 *	Interned values live as long as the dictionary,
+		 *	so the copy can point at them too.
+		 */
+		if (vp->interned && fr_pair_value_shared(vp)) {
+			n->shared = n->vp_strvalue;
+			n->interned = true;
+			break;
+		}
 		n->vp_strvalue = NULL;	/* else pairstrnpy will free vp's value */
 		fr_pair_value_bstrncpy(n, vp->vp_strvalue, n->vp_length);
 		break;
@@ -177,6 +189,55 @@ VALUE_PAIR *fr_pair_copy(TALLOC_CTX *ctx, VALUE_PAIR const *vp)
 	return n;
 }
 
+/** Copy a single valuepair, sharing its value buffer
+ *
+ * As #fr_pair_copy, but "string" and "octets" values aren't duplicated.  Both
+ * VALUE_PAIRs reference the same buffer, and each one copies it before it's
+ * modified.  The buffer is freed with the last VALUE_PAIR which references it.
+ *
+ * Values which point into a buffer the VALUE_PAIR doesn't own (see
+ * #fr_pair_value_memref) are duplicated as usual.
+ *
+ * @note talloc references aren't thread safe.  vp and its copies must only be
+ *	used by one thread, e.g. when they're all in lists of the same request.
+ *
+ * @param[in] ctx for talloc
+ * @param[in] vp to copy.  Its value is marked as shared.
+ * @return
+ *	- A copy of the input VP.
+ *	- NULL on error.
+ */
+VALUE_PAIR *fr_pair_copy_ref(TALLOC_CTX *ctx, VALUE_PAIR *vp)
+{
+	VALUE_PAIR *n;
+
+	if (!vp) return NULL;
+
+	VERIFY_VP(vp);
+
+	if ((vp->type != VT_DATA) || !vp->data.ptr ||
+	    ((vp->da->type != PW_TYPE_STRING) && (vp->da->type != PW_TYPE_OCTETS)) ||
+	    (fr_pair_value_shared(vp) && !vp->shared_ref)) return fr_pair_copy(ctx, vp);
+
+	n = fr_pair_afrom_da(ctx, vp->da);
+	if (!n) return NULL;
+
+	memcpy(n, vp, sizeof(*n));
+	n->next = NULL;
+
+	if (!talloc_reference(n, n->data.ptr)) {
+		talloc_free(n);
+		return NULL;
+	}
+
+	vp->shared = n->shared = vp->data.ptr;
+	vp->shared_ref = n->shared_ref = true;
+
+	if (n->da->flags.is_unknown) fr_pair_steal(ctx, n);
+
+	return n;
+}
+
 /** Steal one VP
  *
  * @param[in] ctx to move VALUE_PAIR into
@@ -184,6 +245,13 @@ VALUE_PAIR *fr_pair_copy(TALLOC_CTX *ctx, VALUE_PAIR const *vp)
  */
 void fr_pair_steal(TALLOC_CTX *ctx, VALUE_PAIR *vp)
 {
+	/*
+	 *	The buffer the value points into may not live as
+	 *	long as the new context.  Referenced buffers move
+	 *	with the VALUE_PAIR, and interned values outlive it.
+	 */
+	if (fr_pair_value_shared(vp) && !vp->shared_ref && !vp->interned) (void) fr_pair_value_unshare(vp);
+
 	(void) talloc_steal(ctx, vp);
 
 	/*
@@ -194,9 +262,10 @@ void fr_pair_steal(TALLOC_CTX *ctx, VALUE_PAIR *vp)
 	 *
 	 *	Since we have no introspection into OTHER VPs using
 	 *	the same DA, we can't have multiple VPs use the same
-	 *	DA.  So we might as well tie it to this VP.
+	 *	DA.  So we might as well tie it to this VP.  The
+	 *	exception is cached DAs, which outlive every VP.
 	 */
-	if (vp->da->flags.is_unknown) {
+	if (vp->da->flags.is_unknown && !vp->da->flags.is_cached) {
 		fr_dict_attr_t *da;
 		char *p;
 		size_t size;
@@ -624,12 +693,20 @@ int fr_pair_mark_xlat(VALUE_PAIR *vp, char const *value)
  */
 VALUE_PAIR *fr_pair_find_by_da(VALUE_PAIR *head, fr_dict_attr_t const *da, int8_t tag)
 {
-	vp_cursor_t 	cursor;
+	VALUE_PAIR	*vp;
 
 	if(!fr_cond_assert(da)) return NULL;
 
-	(void) fr_cursor_init(&cursor, &head);
-	return fr_cursor_next_by_da(&cursor, da, tag);
+	/*
+	 *	This is called a lot, on long lists, so walk the
+	 *	list directly instead of setting up a cursor.
+	 */
+	for (vp = head; vp != NULL; vp = vp->next) {
+		VERIFY_VP(vp);
+		if ((vp->da == da) && (!da->flags.has_tag || TAG_EQ(tag, vp->tag))) return vp;
+	}
+
+	return NULL;
 }
 
 
@@ -639,15 +716,19 @@ VALUE_PAIR *fr_pair_find_by_da(VALUE_PAIR *head, fr_dict_attr_t const *da, int8_
  */
 VALUE_PAIR *fr_pair_find_by_num(VALUE_PAIR *head, unsigned int vendor, unsigned int attr, int8_t tag)
 {
-	vp_cursor_t 	cursor;
+	VALUE_PAIR	*vp;
 
 	/* List head may be NULL if it contains no VPs */
 	if (!head) return NULL;
 
 	VERIFY_LIST(head);
 
-	(void) fr_cursor_init(&cursor, &head);
-	return fr_cursor_next_by_num(&cursor, vendor, attr, tag);
+	for (vp = head; vp != NULL; vp = vp->next) {
+		if ((vp->da->attr == attr) && (vp->da->vendor == vendor) &&
+		    (!vp->da->flags.has_tag || TAG_EQ(tag, vp->tag))) return vp;
+	}
+
+	return NULL;
 }
 
 /** Add a VP to the end of the list.
@@ -880,23 +961,19 @@ int fr_pair_cmp(VALUE_PAIR *a, VALUE_PAIR *b)
 
 			if (!fr_cond_assert(a->da->type == PW_TYPE_STRING)) return -1;
 
-			slen = regex_compile(NULL, &preg, a->vp_strvalue, a->vp_length, false, false, false, true);
+			slen = regex_compile_cached(&preg, a->vp_strvalue, a->vp_length, false, false, false);
 			if (slen <= 0) {
 				fr_strerror_printf("Error at offset %zu compiling regex for %s: %s",
 						   -slen, a->da->name, fr_strerror());
 				return -1;
 			}
 			value = fr_pair_asprint(NULL, b, '\0');
-			if (!value) {
-				talloc_free(preg);
-				return -1;
-			}
+			if (!value) return -1;
 
 			/*
 			 *	Don't care about substring matches, oh well...
 			 */
 			slen = regex_exec(preg, value, talloc_array_length(value) - 1, NULL, NULL);
-			talloc_free(preg);
 			talloc_free(value);
 
 			if (slen < 0) return -1;
@@ -1414,6 +1491,36 @@ VALUE_PAIR *fr_pair_list_copy(TALLOC_CTX *ctx, VALUE_PAIR *from)
 	return out;
 }
 
+/** Copy a pairlist, sharing the value buffers
+ *
+ * As #fr_pair_list_copy, but the copies are made with #fr_pair_copy_ref.
+ *
+ * @param[in] ctx for new #VALUE_PAIR (s) to be allocated in.
+ * @param[in] from whence to copy #VALUE_PAIR (s).
+ * @return the head of the new #VALUE_PAIR list or NULL on error.
+ */
+VALUE_PAIR *fr_pair_list_copy_ref(TALLOC_CTX *ctx, VALUE_PAIR *from)
+{
+	vp_cursor_t src, dst;
+
+	VALUE_PAIR *out = NULL, *vp;
+
+	fr_cursor_init(&dst, &out);
+	for (vp = fr_cursor_init(&src, &from);
+	     vp;
+	     vp = fr_cursor_next(&src)) {
+		VERIFY_VP(vp);
+		vp = fr_pair_copy_ref(ctx, vp);
+		if (!vp) {
+			fr_pair_list_free(&out);
+			return NULL;
+		}
+		fr_cursor_insert(&dst, vp);
+	}
+
+	return out;
+}
+
 /** Copy matching pairs
  *
  * Copy pairs of a matching attribute number, vendor number and tag from the
@@ -1870,6 +1977,11 @@ int fr_pair_value_from_str(VALUE_PAIR *vp, char const *value, size_t inlen)
 	}
 	vp->type = VT_DATA;
 
+	/*
+	 *	Swap the parsed copy for the shared one.
+	 */
+	if (vp->da->flags.intern) (void) fr_pair_value_intern(vp, vp->vp_strvalue, vp->vp_length);
+
 	VERIFY_VP(vp);
 
 	return 0;
@@ -1897,6 +2009,32 @@ inline static void fr_pair_value_set_type(VALUE_PAIR *vp)
 	}
 }
 
+/** Free the value buffer of a VALUE_PAIR
+ *
+ * Values referencing a buffer the VALUE_PAIR doesn't own are just forgotten.
+ * Buffers shared with other VALUE_PAIRs are unlinked, and freed only if no
+ * other VALUE_PAIR references them.
+ *
+ * @param vp to free the value buffer of.
+ */
+static inline void fr_pair_value_free(VALUE_PAIR *vp)
+{
+	uint8_t *q;
+
+	if (fr_pair_value_shared(vp)) {
+		if (vp->shared_ref) (void) talloc_unlink(vp, vp->data.ptr);
+		vp->shared = NULL;
+		vp->shared_ref = false;
+		vp->interned = false;
+		vp->data.ptr = NULL;
+		return;
+	}
+
+	memcpy(&q, &vp->vp_octets, sizeof(q));
+	TALLOC_FREE(q);
+	vp->data.ptr = NULL;
+}
+
 /** Copy data into an "octets" data type.
  *
  * @param[in,out] vp to update
@@ -1905,7 +2043,7 @@ inline static void fr_pair_value_set_type(VALUE_PAIR *vp)
  */
 void fr_pair_value_memcpy(VALUE_PAIR *vp, uint8_t const *src, size_t size)
 {
-	uint8_t *p = NULL, *q;
+	uint8_t *p = NULL;
 
 	VERIFY_VP(vp);
 
@@ -1915,8 +2053,7 @@ void fr_pair_value_memcpy(VALUE_PAIR *vp, uint8_t const *src, size_t size)
 		talloc_set_type(p, uint8_t);
 	}
 
-	memcpy(&q, &vp->vp_octets, sizeof(q));
-	TALLOC_FREE(q);
+	fr_pair_value_free(vp);
 
 	vp->vp_octets = p;
 	vp->vp_length = size;
@@ -1933,12 +2070,9 @@ void fr_pair_value_memcpy(VALUE_PAIR *vp, uint8_t const *src, size_t size)
  */
 void fr_pair_value_memsteal(VALUE_PAIR *vp, uint8_t const *src)
 {
-	uint8_t *q;
-
 	VERIFY_VP(vp);
 
-	memcpy(&q, &vp->vp_octets, sizeof(q));
-	talloc_free(q);
+	fr_pair_value_free(vp);
 
 	vp->vp_octets = talloc_steal(vp, src);
 	vp->type = VT_DATA;
@@ -1955,12 +2089,9 @@ void fr_pair_value_memsteal(VALUE_PAIR *vp, uint8_t const *src)
  */
 void fr_pair_value_strsteal(VALUE_PAIR *vp, char const *src)
 {
-	uint8_t *q;
-
 	VERIFY_VP(vp);
 
-	memcpy(&q, &vp->vp_octets, sizeof(q));
-	talloc_free(q);
+	fr_pair_value_free(vp);
 
 	vp->vp_strvalue = talloc_steal(vp, src);
 	vp->type = VT_DATA;
@@ -1980,14 +2111,12 @@ void fr_pair_value_strsteal(VALUE_PAIR *vp, char const *src)
  */
 void fr_pair_value_strnsteal(VALUE_PAIR *vp, char *src, size_t len)
 {
-	uint8_t	*q;
 	char	*p;
 	size_t	buf_len;
 
 	VERIFY_VP(vp);
 
-	memcpy(&q, &vp->vp_octets, sizeof(q));
-	talloc_free(q);
+	fr_pair_value_free(vp);
 
 	buf_len = talloc_array_length(src);
 	if (buf_len > (len + 1)) {
@@ -2013,7 +2142,7 @@ void fr_pair_value_strnsteal(VALUE_PAIR *vp, char *src, size_t len)
  */
 void fr_pair_value_strcpy(VALUE_PAIR *vp, char const *src)
 {
-	char *p, *q;
+	char *p;
 
 	VERIFY_VP(vp);
 
@@ -2021,8 +2150,7 @@ void fr_pair_value_strcpy(VALUE_PAIR *vp, char const *src)
 
 	if (!p) return;
 
-	memcpy(&q, &vp->vp_strvalue, sizeof(q));
-	talloc_free(q);
+	fr_pair_value_free(vp);
 
 	vp->vp_strvalue = p;
 	vp->type = VT_DATA;
@@ -2043,7 +2171,7 @@ void fr_pair_value_strcpy(VALUE_PAIR *vp, char const *src)
  */
 void fr_pair_value_bstrncpy(VALUE_PAIR *vp, void const *src, size_t len)
 {
-	char *p, *q;
+	char *p;
 
 	VERIFY_VP(vp);
 
@@ -2053,8 +2181,7 @@ void fr_pair_value_bstrncpy(VALUE_PAIR *vp, void const *src, size_t len)
 	memcpy(p, src, len);	/* embdedded \0 safe */
 	p[len] = '\0';
 
-	memcpy(&q, &vp->vp_strvalue, sizeof(q));
-	talloc_free(q);
+	fr_pair_value_free(vp);
 
 	vp->vp_strvalue = p;
 	vp->type = VT_DATA;
@@ -2072,7 +2199,7 @@ void fr_pair_value_bstrncpy(VALUE_PAIR *vp, void const *src, size_t len)
 void fr_pair_value_snprintf(VALUE_PAIR *vp, char const *fmt, ...)
 {
 	va_list ap;
-	char *p, *q;
+	char *p;
 
 	VERIFY_VP(vp);
 
@@ -2082,8 +2209,7 @@ void fr_pair_value_snprintf(VALUE_PAIR *vp, char const *fmt, ...)
 
 	if (!p) return;
 
-	memcpy(&q, &vp->vp_strvalue, sizeof(q));
-	talloc_free(q);
+	fr_pair_value_free(vp);
 
 	vp->vp_strvalue = p;
 	vp->type = VT_DATA;
@@ -2094,6 +2220,135 @@ void fr_pair_value_snprintf(VALUE_PAIR *vp, char const *fmt, ...)
 	VERIFY_VP(vp);
 }
 
+/** Point an "octets" data type at a buffer owned by something else
+ *
+ * No copy is made.  The buffer must outlive the VALUE_PAIR, or the VALUE_PAIR must
+ * be moved with #fr_pair_steal, which will copy the value first.  The value is copied
+ * when it's next modified with any of the fr_pair_value_* functions.
+ *
+ * @param[in,out] vp to update.
+ * @param[in] src buffer to reference.
+ * @param[in] len of the data in the buffer.
+ */
+void fr_pair_value_memref(VALUE_PAIR *vp, uint8_t const *src, size_t len)
+{
+	VERIFY_VP(vp);
+
+	fr_pair_value_free(vp);
+
+	vp->vp_octets = src;
+	vp->shared = src;
+	vp->type = VT_DATA;
+	vp->vp_length = len;
+
+	VERIFY_VP(vp);
+}
+
+/** Point a "string" data type at a buffer owned by something else
+ *
+ * As #fr_pair_value_memref, but src[len] must be a '\0'.
+ *
+ * @param[in,out] vp to update.
+ * @param[in] src buffer to reference.
+ * @param[in] len of the string in the buffer, excluding the terminating '\0'.
+ */
+void fr_pair_value_strref(VALUE_PAIR *vp, char const *src, size_t len)
+{
+	VERIFY_VP(vp);
+
+	if (!fr_cond_assert(src[len] == '\0')) return;
+
+	fr_pair_value_free(vp);
+
+	vp->vp_strvalue = src;
+	vp->shared = src;
+	vp->type = VT_DATA;
+	vp->vp_length = len;
+
+	VERIFY_VP(vp);
+}
+
+/** Give a VALUE_PAIR its own copy of a value set by #fr_pair_value_memref or #fr_pair_copy_ref
+ *
+ * Must be called before writing to the value buffer directly.
+ *
+ * @param[in,out] vp to update.
+ * @return
+ *	- 0 on success, or if the value wasn't shared.
+ *	- -1 on failure.
+ */
+int fr_pair_value_unshare(VALUE_PAIR *vp)
+{
+	void *p;
+
+	if (!fr_pair_value_shared(vp)) return 0;
+
+	/*
+	 *	The other VALUE_PAIRs have let go of it, so it's ours.
+	 */
+	if (vp->shared_ref && (talloc_parent(vp->data.ptr) == vp) && (talloc_reference_count(vp->data.ptr) == 0)) {
+		vp->shared = NULL;
+		vp->shared_ref = false;
+		return 0;
+	}
+
+	switch (vp->da->type) {
+	case PW_TYPE_STRING:
+		p = talloc_bstrndup(vp, vp->vp_strvalue, vp->vp_length);
+		break;
+
+	default:
+		p = talloc_memdup(vp, vp->vp_octets, vp->vp_length);
+		if (p) talloc_set_type(p, uint8_t);
+		break;
+	}
+	if (!p) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	if (vp->shared_ref) (void) talloc_unlink(vp, vp->data.ptr);
+
+	vp->data.ptr = p;
+	vp->shared = NULL;
+	vp->shared_ref = false;
+	vp->interned = false;
+
+	return 0;
+}
+
+/** Point a "string" data type at the interned copy of a value
+ *
+ * Only useful for attributes with the 'intern' flag.  The value is
+ * shared with every other VALUE_PAIR of the same value, as with
+ * #fr_pair_value_strref, but isn't copied when the VALUE_PAIR is copied
+ * or moved.
+ *
+ * @param[in,out] vp to update.
+ * @param[in] src value to intern.  Needn't be '\0' terminated.
+ * @param[in] len of the value.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the value couldn't be interned.  The VALUE_PAIR is unchanged,
+ *	  and the caller should set the value another way.
+ */
+int fr_pair_value_intern(VALUE_PAIR *vp, char const *src, size_t len)
+{
+	char const *p;
+
+	VERIFY_VP(vp);
+
+	if (!vp->da->flags.intern) return -1;
+
+	p = fr_dict_intern(NULL, src, len);
+	if (!p) return -1;
+
+	fr_pair_value_strref(vp, p, len);
+	vp->interned = true;
+
+	return 0;
+}
+
 /** Print the value of an attribute to a string
  *
  * @param[out] out Where to write the string.
@@ -2519,7 +2774,7 @@ inline void fr_pair_verify(char const *file, int line, VALUE_PAIR const *vp)
 
 	fr_dict_verify(file, line, vp->da);
 
-	if (vp->data.ptr) switch (vp->da->type) {
+	if (vp->data.ptr && !fr_pair_value_shared(vp)) switch (vp->da->type) {
 	case PW_TYPE_OCTETS:
 	{
 		size_t len;
@@ -33,6 +33,10 @@
   #include <net/if.h>
 #endif
 
+#ifdef HAVE_LINUX_IF_PACKET_H
+#  include <linux/if_packet.h>
+#endif
+
 #include <freeradius-devel/pcap.h>
 #include <freeradius-devel/net.h>
 #include <freeradius-devel/rad_assert.h>
@@ -404,6 +408,43 @@ int fr_pcap_apply_filter(fr_pcap_t *pcap, char const *expression)
 	return 0;
 }
 
+/** Share the packets arriving on an interface between several capture handles
+ *
+ * Every handle opened on the interface which joins the same group gets
+ * a share of its packets.  The kernel picks the handle from a hash of
+ * the addresses and ports, which current kernels make symmetric, so a
+ * request and its response always go to the same handle.  Fragments
+ * are reassembled before they're hashed.
+ *
+ * @param pcap	opened with fr_pcap_open().
+ * @param group	the same for every handle on the interface, and different
+ *		for each interface.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, or if the platform doesn't support fanout.
+ */
+int fr_pcap_fanout(fr_pcap_t *pcap, uint16_t group)
+{
+#ifdef PACKET_FANOUT
+	int arg = group | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+
+	if (pcap->type != PCAP_INTERFACE_IN) {
+		fr_strerror_printf("Fanout is only possible when capturing from interfaces");
+		return -1;
+	}
+
+	if (setsockopt(pcap->fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+		fr_strerror_printf("Failed joining fanout group on %s: %s", pcap->name, fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+#else
+	fr_strerror_printf("Fanout is not supported on this platform, it requires Linux PACKET_FANOUT");
+	return -1;
+#endif
+}
+
 /** Retrieve list of interface names that will be used for capture.
  * Only used for debugging.
  *
@@ -23,6 +23,7 @@
 RCSID("$Id$")
 
 #include	<freeradius-devel/libradius.h>
+#include	<freeradius-devel/str.h>
 
 #include	<ctype.h>
 
@@ -182,6 +183,8 @@ size_t fr_snprint(char *out, size_t outlen, char const *in, ssize_t inlen, char
 	size_t		utf8;
 	size_t		used;
 	size_t		freespace;
+	char		escaped[3];
+	fr_str_set_t	set;
 
 	/* No input, so no output... */
 	if (!in) {
@@ -220,6 +223,15 @@ size_t fr_snprint(char *out, size_t outlen, char const *in, ssize_t inlen, char
 
 	used = 0;
 
+	/*
+	 *	Printable ASCII, other than the quotation character and
+	 *	backslash, is always copied as-is.
+	 */
+	escaped[0] = quote;
+	escaped[1] = '\\';
+	escaped[2] = '\0';
+	set = (fr_str_set_t) FR_STR_SET(0x20, 0x7e, escaped);
+
 	while (inlen > 0) {
 		int sp = 0;
 
@@ -233,6 +245,25 @@ size_t fr_snprint(char *out, size_t outlen, char const *in, ssize_t inlen, char
 			break;
 		}
 
+		utf8 = fr_str_span(&set, p, inlen);
+		if (utf8 > 0) {
+			if (freespace > utf8) {	/* room for chars AND trailing zero */
+				memcpy(out + used, p, utf8);
+				freespace -= utf8;
+
+			} else if (freespace > 0) {
+				memcpy(out + used, p, freespace - 1);
+				out[used + freespace - 1] = '\0';
+				out = NULL;
+				freespace = 0;
+			}
+
+			used += utf8;
+			p += utf8;
+			inlen -= utf8;
+			continue;
+		}
+
 		/*
 		 *	Always escape the quotation character.
 		 */
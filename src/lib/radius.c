@@ -98,6 +98,9 @@ static void print_hex_data(uint8_t const *ptr, int attrlen, int depth)
 static _fr_thread_local fr_randctx fr_rand_pool;		//!< A pool of pre-generated random integers
 static _fr_thread_local bool fr_rand_initialized = false;
 
+static _fr_thread_local uint32_t fr_fast_rand_state[4];	//!< xoshiro128** state, seeded from fr_rand_pool
+static _fr_thread_local bool fr_fast_rand_initialized = false;
+
 char const *fr_packet_codes[FR_MAX_PACKET_CODE] = {
 	"",					//!< 0
 	"Access-Request",
@@ -262,6 +265,72 @@ void fr_radius_print_hex(RADIUS_PACKET *packet)
 }
 
 
+/*
+ *	Number of shared secrets each thread keeps precomputed state for.
+ */
+#define SECRET_CACHE_SIZE	16
+
+fr_thread_local_setup(fr_radius_secret_ctx_t *, fr_radius_secret_cache)
+
+static void _fr_radius_secret_cache_free(void *arg)
+{
+	fr_radius_secret_ctx_t	*cache = arg;
+	int			i;
+
+	for (i = 0; i < SECRET_CACHE_SIZE; i++) free(cache[i].secret);
+	free(cache);
+}
+
+/** Return the precomputed MD5 and HMAC-MD5 states for a shared secret
+ *
+ * Secrets belong to clients and home servers, and are the same for
+ * every packet exchanged with them.  The states are kept per thread,
+ * indexed by the address of the secret, and checked against a copy of
+ * the secret on every lookup, so a secret which is freed or changed
+ * is simply recomputed.
+ *
+ * @note The returned state is only valid until the next call from the
+ *	same thread.
+ *
+ * @param[in] secret shared with the other end.
+ * @return the state for secret, or NULL if no memory was available.
+ */
+fr_radius_secret_ctx_t const *fr_radius_secret_ctx(char const *secret)
+{
+	fr_radius_secret_ctx_t	*cache, *entry;
+	size_t			len;
+	char			*copy;
+
+	cache = fr_thread_local_init(fr_radius_secret_cache, _fr_radius_secret_cache_free);
+	if (!cache) {
+		cache = calloc(SECRET_CACHE_SIZE, sizeof(*cache));
+		if (!cache) return NULL;
+
+		if (fr_thread_local_set(fr_radius_secret_cache, cache) != 0) {
+			free(cache);
+			return NULL;
+		}
+	}
+
+	entry = &cache[(((uintptr_t) secret) >> 4) % SECRET_CACHE_SIZE];
+	len = strlen(secret);
+	if (entry->secret && (entry->secret_len == len) && (memcmp(entry->secret, secret, len) == 0)) return entry;
+
+	copy = malloc(len + 1);
+	if (!copy) return NULL;
+	memcpy(copy, secret, len + 1);
+
+	free(entry->secret);
+	entry->secret = copy;
+	entry->secret_len = len;
+
+	fr_md5_init(&entry->md5);
+	fr_md5_update(&entry->md5, (uint8_t const *) secret, len);
+	fr_hmac_md5_init(&entry->hmac, (uint8_t const *) secret, len);
+
+	return entry;
+}
+
 /** Build an encrypted secret value to return in a reply packet
  *
  * The secret is hidden by xoring with a MD5 digest created from
@@ -282,30 +351,23 @@ void fr_radius_make_secret(uint8_t *digest, uint8_t const *vector, char const *s
 	for (i = 0; i < AUTH_VECTOR_LEN; i++ ) digest[i] ^= value[i];
 }
 
-/** Basic validation of RADIUS packet header
+/** Basic validation of a RADIUS packet header which has already been read
  *
  * @note fr_strerror errors are only available if fr_debug_lvl > 0. This is to reduce CPU time
  *	consumed when discarding malformed packet.
  *
- * @param[in] sockfd we're reading from.
- * @param[out] src_ipaddr of the packet.
- * @param[out] src_port of the packet.
+ * @param[in] data the start of the packet.
+ * @param[in] data_len how much data was read.
+ * @param[in] src_ipaddr of the packet.  Used for error messages.
  * @param[out] code Pointer to where to write the packet code.
  * @return
- *	- -1 on failure.
- *	- 1 on decode error.
+ *	- 0 on decode error.
  *	- >= RADIUS_HDR_LEN on success. This is the packet length as specified in the header.
  */
-ssize_t fr_radius_recv_header(int sockfd, fr_ipaddr_t *src_ipaddr, uint16_t *src_port, unsigned int *code)
+ssize_t fr_radius_recv_header_data(uint8_t const *data, size_t data_len, fr_ipaddr_t const *src_ipaddr,
+				   unsigned int *code)
 {
-	ssize_t			data_len, packet_len;
-	uint8_t			header[4];
-
-	data_len = udp_recv_peek(sockfd, header, sizeof(header), UDP_FLAGS_PEEK, src_ipaddr, src_port);
-	if (data_len < 0) {
-		if ((errno == EAGAIN) || (errno == EINTR)) return 0;
-		return -1;
-	}
+	size_t			packet_len;
 
 	/*
 	 *	Too little data is available, discard the packet.
@@ -318,15 +380,13 @@ invalid:
 		FR_DEBUG_STRERROR_PRINTF("Invalid data from %s: %s",
 					 inet_ntop(src_ipaddr->af, &src_ipaddr->ipaddr, buffer, sizeof(buffer)),
 					 fr_strerror());
-		udp_recv_discard(sockfd);
-
 		return 0;
 	}
 
 	/*
 	 *	See how long the packet says it is.
 	 */
-	packet_len = (header[2] * 256) + header[3];
+	packet_len = (data[2] * 256) + data[3];
 
 	/*
 	 *	The length in the packet says it's less than
@@ -348,7 +408,7 @@ invalid:
 		goto invalid;
 	}
 
-	*code = header[0];
+	*code = data[0];
 
 	/*
 	 *	The packet says it's this long, but the actual UDP
@@ -357,6 +417,37 @@ invalid:
 	return packet_len;
 }
 
+/** Basic validation of RADIUS packet header
+ *
+ * @note fr_strerror errors are only available if fr_debug_lvl > 0. This is to reduce CPU time
+ *	consumed when discarding malformed packet.
+ *
+ * @param[in] sockfd we're reading from.
+ * @param[out] src_ipaddr of the packet.
+ * @param[out] src_port of the packet.
+ * @param[out] code Pointer to where to write the packet code.
+ * @return
+ *	- -1 on failure.
+ *	- 1 on decode error.
+ *	- >= RADIUS_HDR_LEN on success. This is the packet length as specified in the header.
+ */
+ssize_t fr_radius_recv_header(int sockfd, fr_ipaddr_t *src_ipaddr, uint16_t *src_port, unsigned int *code)
+{
+	ssize_t			data_len, packet_len;
+	uint8_t			header[4];
+
+	data_len = udp_recv_peek(sockfd, header, sizeof(header), UDP_FLAGS_PEEK, src_ipaddr, src_port);
+	if (data_len < 0) {
+		if ((errno == EAGAIN) || (errno == EINTR)) return 0;
+		return -1;
+	}
+
+	packet_len = fr_radius_recv_header_data(header, data_len, src_ipaddr, code);
+	if (packet_len == 0) udp_recv_discard(sockfd);
+
+	return packet_len;
+}
+
 /** Wrapper for recvfrom, which handles recvfromto, IPv6, and all possible combinations
  *
  */
@@ -411,6 +502,7 @@ int fr_radius_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 	 */
 	if (packet->offset > 0) {
 		uint8_t calc_auth_vector[AUTH_VECTOR_LEN];
+		fr_radius_secret_ctx_t const *secret_ctx;
 
 		switch (packet->code) {
 		case PW_CODE_ACCOUNTING_RESPONSE:
@@ -450,8 +542,13 @@ int fr_radius_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 		 *	into the Message-Authenticator
 		 *	attribute.
 		 */
-		fr_hmac_md5(calc_auth_vector, packet->data, packet->data_len,
-			    (uint8_t const *) secret, strlen(secret));
+		secret_ctx = fr_radius_secret_ctx(secret);
+		if (secret_ctx) {
+			fr_hmac_md5_calc(calc_auth_vector, packet->data, packet->data_len, &secret_ctx->hmac);
+		} else {
+			fr_hmac_md5(calc_auth_vector, packet->data, packet->data_len,
+				    (uint8_t const *) secret, strlen(secret));
+		}
 		memcpy(packet->data + packet->offset + 2,
 		       calc_auth_vector, AUTH_VECTOR_LEN);
 
@@ -499,12 +596,18 @@ int fr_radius_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 	return 0;
 }
 
-/** Reply to the request
+/** Encode and sign a packet, so that it's ready to be sent
  *
- * Also attach reply attribute value pairs and any user message provided.
+ * @param[in] packet to encode.  Nothing is done if it has already been encoded.
+ * @param[in] original request, if packet is a reply.
+ * @param[in] secret shared with the other end.
+ * @return
+ *	- 1 if the packet is ready to be sent.
+ *	- 0 if the packet is fake, and should not be sent.
+ *	- -1 on error.
  */
-int fr_radius_send(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
-		   char const *secret)
+int fr_radius_send_prepare(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+			   char const *secret)
 {
 	/*
 	 *	Maybe it's a fake packet.  Don't send it.
@@ -542,6 +645,21 @@ int fr_radius_send(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 	if ((fr_debug_lvl > 3) && fr_log_fp) fr_radius_print_hex(packet);
 #endif
 
+	return 1;
+}
+
+/** Reply to the request
+ *
+ * Also attach reply attribute value pairs and any user message provided.
+ */
+int fr_radius_send(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+		   char const *secret)
+{
+	int ret;
+
+	ret = fr_radius_send_prepare(packet, original, secret);
+	if (ret <= 0) return ret;
+
 #ifdef WITH_TCP
 	/*
 	 *	If the socket is TCP, call write().  Calling sendto()
@@ -605,6 +723,11 @@ static int calc_acctdigest(RADIUS_PACKET *packet, char const *secret)
 	 */
 	memset(packet->data + 4, 0, AUTH_VECTOR_LEN);
 
+	/*
+	 *	Already checked, with this secret.
+	 */
+	if (packet->verified && (packet->verified == secret)) return 0;
+
 	/*
 	 *  MD5(packet + secret);
 	 */
@@ -1044,6 +1167,76 @@ bool fr_radius_ok(RADIUS_PACKET *packet, int flags, decode_fail_t *reason)
 	return (failure == DECODE_FAIL_NONE);
 }
 
+/** Fill in the basics of a RADIUS_PACKET structure from a datagram which has already been read
+ *
+ * This is used when multiple datagrams are read with one system call.  The data is copied,
+ * and the length is trimmed to the length given in the RADIUS header.
+ *
+ * @param[in] ctx to allocate the packet in.
+ * @param[in] fd the datagram was read from.
+ * @param[in] data of the datagram.
+ * @param[in] data_len of the datagram.
+ * @param[in] packet_len as returned by fr_radius_recv_header_data().
+ * @param[in] src_ipaddr of the datagram.
+ * @param[in] src_port of the datagram.
+ * @param[in] dst_ipaddr of the datagram.
+ * @param[in] dst_port of the datagram.
+ * @param[in] if_index of the interface that received the datagram.
+ * @param[in] when the datagram was received.
+ * @param[in] flags as for fr_radius_ok().
+ * @return
+ *	- The new packet.
+ *	- NULL if the packet is invalid, or on error.
+ */
+RADIUS_PACKET *fr_radius_recv_data(TALLOC_CTX *ctx, int fd, uint8_t const *data, size_t data_len, size_t packet_len,
+				   fr_ipaddr_t const *src_ipaddr, uint16_t src_port,
+				   fr_ipaddr_t const *dst_ipaddr, uint16_t dst_port,
+				   int if_index, struct timeval const *when, int flags)
+{
+	RADIUS_PACKET		*packet;
+
+	if (data_len > packet_len) data_len = packet_len;
+	if (data_len == 0) {
+		FR_DEBUG_STRERROR_PRINTF("Empty packet");
+		return NULL;
+	}
+
+	packet = fr_radius_alloc(ctx, false);
+	if (!packet) {
+		fr_strerror_printf("out of memory");
+		return NULL;
+	}
+
+	packet->data = talloc_memdup(packet, data, data_len);
+	if (!packet->data) {
+		fr_strerror_printf("out of memory");
+		fr_radius_free(&packet);
+		return NULL;
+	}
+	packet->data_len = data_len;
+
+	packet->src_ipaddr = *src_ipaddr;
+	packet->src_port = src_port;
+	packet->dst_ipaddr = *dst_ipaddr;
+	packet->dst_port = dst_port;
+	packet->if_index = if_index;
+	packet->timestamp = *when;
+
+	if (!fr_radius_ok(packet, flags, NULL)) {
+		fr_radius_free(&packet);
+		return NULL;
+	}
+
+	packet->sockfd = fd;
+	packet->vps = NULL;
+
+#ifndef NDEBUG
+	if ((fr_debug_lvl > 3) && fr_log_fp) fr_radius_print_hex(packet);
+#endif
+
+	return packet;
+}
+
 /** Receive UDP client requests, and fill in the basics of a RADIUS_PACKET structure
  *
  */
@@ -1160,6 +1353,7 @@ int fr_radius_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const
 	while (length > 0) {
 		uint8_t	msg_auth_vector[AUTH_VECTOR_LEN];
 		uint8_t calc_auth_vector[AUTH_VECTOR_LEN];
+		fr_radius_secret_ctx_t const *secret_ctx;
 
 		attrlen = ptr[1];
 
@@ -1208,8 +1402,14 @@ int fr_radius_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const
 				break;
 			}
 
-			fr_hmac_md5(calc_auth_vector, packet->data, packet->data_len,
-				    (uint8_t const *) secret, strlen(secret));
+			secret_ctx = fr_radius_secret_ctx(secret);
+			if (secret_ctx) {
+				fr_hmac_md5_calc(calc_auth_vector, packet->data, packet->data_len,
+						 &secret_ctx->hmac);
+			} else {
+				fr_hmac_md5(calc_auth_vector, packet->data, packet->data_len,
+					    (uint8_t const *) secret, strlen(secret));
+			}
 			if (fr_radius_digest_cmp(calc_auth_vector, msg_auth_vector,
 						 sizeof(calc_auth_vector)) != 0) {
 				fr_strerror_printf("Received packet from %s with invalid Message-Authenticator!  "
@@ -1476,6 +1676,350 @@ int fr_radius_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 	return 0;
 }
 
+/** Check whether a received attribute is an exact encoding of a VALUE_PAIR
+ *
+ * Only plain RFC attributes, and VSAs carrying a single attribute of a vendor
+ * with the standard format, are checked.  Tagged, encrypted and concatenated
+ * attributes are never matched, as their encoding depends on more than the value.
+ */
+static bool verbatim_match(VALUE_PAIR const *vp, uint8_t const *attr)
+{
+	fr_dict_attr_t const	*da = vp->da;
+	uint8_t const		*value;
+	uint8_t const		*out;
+	ssize_t			len;
+
+	if (da->flags.has_tag || da->flags.encrypt || da->flags.concat) return false;
+	if (attr[1] <= 2) return false;
+
+	if (!da->parent) return false;
+
+	if (!da->parent->parent) {
+		if (attr[0] != da->attr) return false;
+
+		value = attr + 2;
+
+	} else if ((da->parent->type == PW_TYPE_VENDOR) && (da->parent->parent->type == PW_TYPE_VSA) &&
+		   da->parent->parent->parent && !da->parent->parent->parent->parent) {
+		fr_dict_vendor_t const	*dv;
+		uint32_t		vendor;
+
+		if ((attr[0] != PW_VENDOR_SPECIFIC) || (attr[1] < 9)) return false;
+
+		dv = fr_dict_vendor_by_num(NULL, da->vendor);
+		if (!dv || (dv->type != 1) || (dv->length != 1) || dv->flags) return false;
+
+		memcpy(&vendor, attr + 2, 4);
+		if (ntohl(vendor) != da->vendor) return false;
+
+		if ((attr[6] != da->attr) || ((attr[7] + 6) != attr[1])) return false;
+
+		value = attr + 8;
+
+	} else {
+		return false;
+	}
+
+	len = fr_radius_encode_value_hton(&out, vp);
+	if ((len < 0) || ((size_t) len != (size_t) ((attr + attr[1]) - value))) return false;
+
+	return (memcmp(out, value, len) == 0);
+}
+
+/** Encode a packet, re-using the attributes of a packet that was received
+ *
+ * For proxying.  Each attribute of packet->vps which exactly matches an
+ * attribute of the received packet is copied from the received packet, instead
+ * of being encoded again.  The other attributes, including anything encrypted
+ * (e.g. User-Password, which has to be re-encrypted with the new secret and
+ * authentication vector) and the Message-Authenticator, are encoded as normal.
+ *
+ * The result is the same packet fr_radius_encode() would produce, except that
+ * received attributes keep their original encoding.
+ *
+ * @param[in] packet to encode.
+ * @param[in] received packet whose data the attributes may be copied from.
+ * @param[in] secret to encrypt attributes with.
+ * @return
+ *	- 1 on success.
+ *	- 0 if the packet should be encoded with fr_radius_encode() instead.
+ *	- -1 on error.
+ */
+int fr_radius_encode_verbatim(RADIUS_PACKET *packet, RADIUS_PACKET const *received, char const *secret)
+{
+	radius_packet_t		*hdr;
+	uint8_t			*ptr, *end;
+	uint8_t const		*next, *attr, *attr_end;
+	uint16_t		total_length;
+	ssize_t			len;
+	VALUE_PAIR const	*vp;
+	vp_cursor_t		cursor;
+	fr_radius_ctx_t		encoder_ctx = { .packet = packet, .secret = secret };
+	uint8_t			used[MAX_PACKET_LEN];	/* indexed by offset */
+	uint64_t		data[MAX_PACKET_LEN / sizeof(uint64_t)];
+
+	if (!received->data || (received->data_len <= RADIUS_HDR_LEN) ||
+	    (received->data_len > sizeof(data))) return 0;
+
+	switch (packet->code) {
+	case PW_CODE_ACCESS_REQUEST:
+	case PW_CODE_STATUS_SERVER:
+		break;
+
+	case PW_CODE_ACCOUNTING_REQUEST:
+	case PW_CODE_DISCONNECT_REQUEST:
+	case PW_CODE_COA_REQUEST:
+		memset(packet->vector, 0, sizeof(packet->vector));
+		break;
+
+	default:
+		return 0;
+	}
+
+	hdr = (radius_packet_t *) data;
+	hdr->code = packet->code;
+	hdr->id = packet->id;
+	memcpy(hdr->vector, packet->vector, sizeof(hdr->vector));
+
+	ptr = hdr->data;
+	end = ((uint8_t *) data) + sizeof(data);
+	packet->offset = 0;
+
+	memset(used, 0, received->data_len);
+	next = received->data + RADIUS_HDR_LEN;
+	attr_end = received->data + received->data_len;
+
+	fr_cursor_init(&cursor, &packet->vps);
+	while ((vp = fr_cursor_current(&cursor))) {
+		VERIFY_VP(vp);
+
+		if (vp->da->flags.internal || ((vp->da->vendor == 0) && (vp->da->attr >= 256))) {
+			fr_cursor_next(&cursor);
+			continue;
+		}
+
+		if (!vp->da->vendor && (vp->da->attr == PW_MESSAGE_AUTHENTICATOR)) {
+			packet->offset = ptr - (uint8_t *) data;
+			goto encode;
+		}
+
+		/*
+		 *	Unmodified lists have the received attributes
+		 *	in the same order, so check the next one first.
+		 */
+		attr = NULL;
+		if ((next < attr_end) && !used[next - received->data] && verbatim_match(vp, next)) {
+			attr = next;
+		} else {
+			uint8_t const *p;
+
+			for (p = received->data + RADIUS_HDR_LEN; (p + 2) <= attr_end; p += p[1]) {
+				if (p[1] < 2) break;
+
+				if (!used[p - received->data] && verbatim_match(vp, p)) {
+					attr = p;
+					break;
+				}
+			}
+		}
+
+		if (attr) {
+			if ((ptr + attr[1]) > end) return 0;
+
+			memcpy(ptr, attr, attr[1]);
+			used[attr - received->data] = 1;
+			next = attr + attr[1];
+
+			ptr += attr[1];
+			fr_cursor_next(&cursor);
+			continue;
+		}
+
+	encode:
+		len = fr_radius_encode_pair(ptr, end - ptr, &cursor, &encoder_ctx);
+		if (len < 0) return -1;
+
+		/*
+		 *	Out of space, or nothing encoded.  Let
+		 *	fr_radius_encode() deal with it.
+		 */
+		if (len == 0) return 0;
+
+		ptr += len;
+	}
+
+	total_length = ptr - (uint8_t *) data;
+	packet->data_len = total_length;
+	packet->data = talloc_array(packet, uint8_t, packet->data_len);
+	if (!packet->data) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	memcpy(packet->data, hdr, packet->data_len);
+	hdr = (radius_packet_t *) packet->data;
+
+	total_length = htons(total_length);
+	memcpy(hdr->length, &total_length, sizeof(total_length));
+	return 1;
+}
+
+/** Attributes found by a lazy decode, which haven't been turned into VALUE_PAIRs
+ *
+ */
+struct fr_radius_pending {
+	char		*values;		//!< Copy of the packet for zero_copy string values.
+	uint32_t	num;			//!< Number of attributes in the packet.
+	uint32_t	left;			//!< Number which haven't been decoded.
+	uint16_t	offset[];		//!< Of each attribute in packet->data, 0 once decoded.
+};
+
+/** Allocate the buffer zero_copy string values reference
+ *
+ * One allocation for all of the string values.  Octets values reference
+ * packet->data directly.
+ */
+static char *decode_values_alloc(RADIUS_PACKET *packet)
+{
+	char *values;
+
+	values = talloc_array(packet, char, packet->data_len + 1);
+	if (!values) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	memcpy(values, packet->data, packet->data_len);
+	values[packet->data_len] = '\0';
+
+	return values;
+}
+
+/** Record where the attributes are, without decoding them
+ *
+ * The packet must have passed fr_radius_ok(), which checks the attribute
+ * lengths and fr_max_attributes.
+ */
+static int decode_index(RADIUS_PACKET *packet)
+{
+	fr_radius_pending_t	*pending;
+	uint8_t const		*p, *end;
+	uint32_t		num = 0;
+
+	end = packet->data + packet->data_len;
+	for (p = packet->data + RADIUS_HDR_LEN; (p + 2) <= end; p += p[1]) {
+		if (p[1] < 2) break;
+		num++;
+	}
+
+	pending = talloc_size(packet, sizeof(*pending) + (num * sizeof(pending->offset[0])));
+	if (!pending) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+	talloc_set_name_const(pending, "fr_radius_pending_t");
+
+	pending->values = NULL;
+	if (packet->zero_copy) {
+		pending->values = decode_values_alloc(packet);
+		if (!pending->values) {
+			talloc_free(pending);
+			return -1;
+		}
+	}
+
+	pending->num = pending->left = num;
+	num = 0;
+	for (p = packet->data + RADIUS_HDR_LEN; num < pending->num; p += p[1]) {
+		pending->offset[num++] = p - packet->data;
+	}
+	packet->pending = pending;
+
+	fr_rand_seed(packet->data, RADIUS_HDR_LEN);
+
+	return 0;
+}
+
+/** Decode attributes skipped by a lazy fr_radius_decode
+ *
+ * Decoded attributes are added to the end of packet->vps, in the order they
+ * appear in the packet.  Each attribute is only decoded once.
+ *
+ * @param[in] packet which was decoded with packet->lazy set.
+ * @param[in] original packet, if packet is a reply.
+ * @param[in] secret the packet was signed with.
+ * @param[in] da to decode.  All instances of the top level attribute
+ *	containing da are decoded, e.g. every Vendor-Specific for a VSA.
+ *	If NULL, all of the remaining attributes are decoded.
+ * @return
+ *	- 0 on success (including if there was nothing to decode).
+ *	- -1 on decoding error.
+ */
+int fr_radius_decode_pending(RADIUS_PACKET *packet, RADIUS_PACKET const *original, char const *secret,
+			     fr_dict_attr_t const *da)
+{
+	fr_radius_pending_t	*pending = packet->pending;
+	unsigned int		attr = 0;
+	uint32_t		i, j;
+	VALUE_PAIR		*head = NULL;
+	vp_cursor_t		cursor, out;
+	fr_radius_ctx_t		decoder_ctx = {
+					.original = original,
+					.packet = packet,
+					.secret = secret
+				};
+
+	if (!pending || !pending->left) return 0;
+
+	if (da) {
+		while (da->parent && da->parent->parent) da = da->parent;
+
+		/*
+		 *	Internal attributes are never in the packet.
+		 */
+		if (da->attr > 255) return 0;
+		attr = da->attr;
+	}
+	decoder_ctx.values = pending->values;
+
+	fr_cursor_init(&cursor, &head);
+
+	for (i = 0; (i < pending->num) && (pending->left > 0); i++) {
+		uint8_t const	*p;
+		uint16_t	start;
+		ssize_t		my_len;
+
+		start = pending->offset[i];
+		if (!start) continue;
+
+		p = packet->data + start;
+		if (attr && (p[0] != attr)) continue;
+
+		my_len = fr_radius_decode_pair(packet, &cursor, fr_dict_root(fr_dict_internal), p,
+					       packet->data_len - start, &decoder_ctx);
+		if (my_len < 0) {
+			fr_pair_list_free(&head);
+			return -1;
+		}
+
+		/*
+		 *	Concatenated and fragmented attributes use
+		 *	more than one entry.
+		 */
+		for (j = i; (j < pending->num) && (pending->offset[j] < (start + my_len)); j++) {
+			if (!pending->offset[j]) continue;
+
+			pending->offset[j] = 0;
+			pending->left--;
+		}
+	}
+
+	fr_cursor_init(&out, &packet->vps);
+	fr_cursor_last(&out);		/* Move insertion point to the end of the list */
+	fr_cursor_merge(&out, head);
+
+	return 0;
+}
+
 /** Calculate/check digest, and decode radius attributes
  *
  * @return
@@ -1498,6 +2042,13 @@ int fr_radius_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const
 	/*
 	 *	Extract attribute-value pairs
 	 */
+	if (packet->lazy) return decode_index(packet);
+
+	if (packet->zero_copy) {
+		decoder_ctx.values = decode_values_alloc(packet);
+		if (!decoder_ctx.values) return -1;
+	}
+
 	hdr = (radius_packet_t *)packet->data;
 	ptr = hdr->data;
 	packet_length = packet->data_len - RADIUS_HDR_LEN;
@@ -1638,6 +2189,101 @@ uint32_t fr_rand(void)
 	return num;
 }
 
+/** Fill a buffer with random data
+ *
+ * Copies whole runs of the pool at a time, so filling e.g. the
+ * Request Authenticators for a batch of packets costs one call,
+ * and at most one refill of the pool per 1K of output.
+ *
+ * @param[out] out where to write the random data.
+ * @param[in] outlen how many bytes to write.
+ */
+void fr_rand_fill(void *out, size_t outlen)
+{
+	uint8_t *p = out;
+
+	if (!fr_rand_initialized) {
+		fr_rand_seed(NULL, 0);
+	}
+
+	while (outlen > 0) {
+		size_t len;
+		uint32_t cnt;
+
+		/*
+		 *	Read the index exactly once, and clamp it, so
+		 *	the copy can never run off the end of randrsl
+		 *	and into the generator's internal state.  This
+		 *	matters when there's no TLS, and the pool is
+		 *	shared between threads.
+		 */
+		cnt = fr_rand_pool.randcnt;
+		if (cnt >= 256) {
+			fr_rand_pool.randcnt = 0;
+			fr_isaac(&fr_rand_pool);
+			continue;
+		}
+
+		len = (256 - cnt) * sizeof(fr_rand_pool.randrsl[0]);
+		if (len > outlen) len = outlen;
+
+		memcpy(p, &fr_rand_pool.randrsl[cnt], len);
+		p += len;
+		outlen -= len;
+
+		/*
+		 *	Partially used words are used up.
+		 */
+		cnt += (len + sizeof(fr_rand_pool.randrsl[0]) - 1) / sizeof(fr_rand_pool.randrsl[0]);
+		if (cnt >= 256) {
+			fr_rand_pool.randcnt = 0;
+			fr_isaac(&fr_rand_pool);
+		} else {
+			fr_rand_pool.randcnt = cnt;
+		}
+	}
+}
+
+static inline uint32_t fast_rand_rotl(uint32_t x, int k)
+{
+	return (x << k) | (x >> (32 - k));
+}
+
+/** Return a 32-bit random number, which is cheap, but predictable
+ *
+ * This is xoshiro128**, with per-thread state seeded from #fr_rand.
+ * It's for jitter, load-balancing, and other places where nothing
+ * bad happens if someone can guess the next number.  Use #fr_rand
+ * for IDs, authenticators, challenges, State, etc.
+ */
+uint32_t fr_fast_rand(void)
+{
+	uint32_t *s = fr_fast_rand_state;
+	uint32_t result, t;
+
+	if (!fr_fast_rand_initialized) {
+		/*
+		 *	The state must not be all zeros.
+		 */
+		do {
+			fr_rand_fill(fr_fast_rand_state, sizeof(fr_fast_rand_state));
+		} while (!(s[0] | s[1] | s[2] | s[3]));
+		fr_fast_rand_initialized = true;
+	}
+
+	result = fast_rand_rotl(s[1] * 5, 7) * 9;
+	t = s[1] << 9;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = fast_rand_rotl(s[3], 11);
+
+	return result;
+}
+
 
 /** Allocate a new RADIUS_PACKET
  *
@@ -1661,17 +2307,17 @@ RADIUS_PACKET *fr_radius_alloc(TALLOC_CTX *ctx, bool new_vector)
 	rp->offset = -1;
 
 	if (new_vector) {
-		int i;
-		uint32_t hash, base;
+		size_t i;
+		uint32_t hash, rnd[1 + (AUTH_VECTOR_LEN / sizeof(uint32_t))];
 
 		/*
 		 *	Don't expose the actual contents of the random
 		 *	pool.
 		 */
-		base = fr_rand();
-		for (i = 0; i < AUTH_VECTOR_LEN; i += sizeof(uint32_t)) {
-			hash = fr_rand() ^ base;
-			memcpy(rp->vector + i, &hash, sizeof(hash));
+		fr_rand_fill(rnd, sizeof(rnd));
+		for (i = 1; i < (sizeof(rnd) / sizeof(rnd[0])); i++) {
+			hash = rnd[i] ^ rnd[0];
+			memcpy(rp->vector + ((i - 1) * sizeof(hash)), &hash, sizeof(hash));
 		}
 	}
 	fr_rand();		/* stir the pool again */
@@ -36,6 +36,7 @@ static uint8_t nullvector[AUTH_VECTOR_LEN] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen, char const *secret, uint8_t const *vector)
 {
 	FR_MD5_CTX	context, old;
+	fr_radius_secret_ctx_t const *secret_ctx;
 	uint8_t		digest[AUTH_VECTOR_LEN];
 	int		secretlen;
 	size_t		i, n, encrypted_len, embedded_len;
@@ -71,10 +72,15 @@ ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen, char co
 	/*
 	 *	Use the secret to setup the decryption digest
 	 */
-	secretlen = strlen(secret);
+	secret_ctx = fr_radius_secret_ctx(secret);
+	if (secret_ctx) {
+		fr_md5_copy(&context, &secret_ctx->md5);
+	} else {
+		secretlen = strlen(secret);
 
-	fr_md5_init(&context);
-	fr_md5_update(&context, (uint8_t const *) secret, secretlen);
+		fr_md5_init(&context);
+		fr_md5_update(&context, (uint8_t const *) secret, secretlen);
+	}
 	fr_md5_copy(&old, &context); /* save intermediate work */
 
 	/*
@@ -142,6 +148,7 @@ ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen, char co
 ssize_t fr_radius_decode_password(char *passwd, size_t pwlen, char const *secret, uint8_t const *vector)
 {
 	FR_MD5_CTX	context, old;
+	fr_radius_secret_ctx_t const *secret_ctx;
 	uint8_t		digest[AUTH_VECTOR_LEN];
 	int		i;
 	size_t		n, secretlen;
@@ -161,10 +168,15 @@ ssize_t fr_radius_decode_password(char *passwd, size_t pwlen, char const *secret
 	/*
 	 *	Use the secret to setup the decryption digest
 	 */
-	secretlen = strlen(secret);
+	secret_ctx = fr_radius_secret_ctx(secret);
+	if (secret_ctx) {
+		fr_md5_copy(&context, &secret_ctx->md5);
+	} else {
+		secretlen = strlen(secret);
 
-	fr_md5_init(&context);
-	fr_md5_update(&context, (uint8_t const *) secret, secretlen);
+		fr_md5_init(&context);
+		fr_md5_update(&context, (uint8_t const *) secret, secretlen);
+	}
 	fr_md5_copy(&old, &context);	/* save intermediate work */
 
 	/*
@@ -288,6 +300,19 @@ int fr_radius_decode_tlv_ok(uint8_t const *data, size_t length, size_t dv_type,
 	return 0;
 }
 
+/** Check whether a value can reference the packet instead of being copied
+ *
+ * Only values which are still in the original packet buffer qualify.  Values
+ * which were decrypted, had a tag removed, or were reassembled from multiple
+ * attributes live in temporary buffers, and must be copied.
+ */
+static inline bool decode_by_ref(fr_radius_ctx_t const *this, uint8_t const *p, size_t len)
+{
+	if (!this || !this->values || !len) return false;
+
+	return ((p >= this->packet->data) && ((p + len) <= (this->packet->data + this->packet->data_len)));
+}
+
 /** Convert a "concatenated" attribute to one long VP
  *
  */
@@ -370,14 +395,14 @@ ssize_t fr_radius_decode_tlv(TALLOC_CTX *ctx, vp_cursor_t *cursor,
 
 		child = fr_dict_attr_child_by_num(parent, p[0]);
 		if (!child) {
-			fr_dict_attr_t *unknown_child;
+			fr_dict_attr_t const *unknown_child;
 
 			FR_PROTO_TRACE("Failed to find child %u of TLV %s", p[0], parent->name);
 
 			/*
 			 *	Build an unknown attr
 			 */
-			unknown_child = fr_dict_unknown_afrom_fields(ctx, parent, parent->vendor, p[0]);
+			unknown_child = fr_dict_unknown_afrom_fields_cached(ctx, parent, parent->vendor, p[0]);
 			if (!unknown_child) {
 			error:
 				fr_pair_list_free(&head);
@@ -471,7 +496,7 @@ static ssize_t decode_vsa_internal(TALLOC_CTX *ctx, vp_cursor_t *cursor,
 	 *	See if the VSA is known.
 	 */
 	da = fr_dict_attr_child_by_num(parent, attribute);
-	if (!da) da = fr_dict_unknown_afrom_fields(ctx, parent, dv->vendorpec, attribute);
+	if (!da) da = fr_dict_unknown_afrom_fields_cached(ctx, parent, dv->vendorpec, attribute);
 	if (!da) return -1;
 	FR_PROTO_TRACE("decode context changed %s -> %s", da->parent->name, da->name);
 
@@ -589,7 +614,7 @@ static ssize_t decode_wimax(TALLOC_CTX *ctx, vp_cursor_t *cursor,
 	if (((size_t) (data[5] + 4)) != attr_len) return -1;
 
 	da = fr_dict_attr_child_by_num(parent, data[4]);
-	if (!da) da = fr_dict_unknown_afrom_fields(ctx, parent, vendor, data[4]);
+	if (!da) da = fr_dict_unknown_afrom_fields_cached(ctx, parent, vendor, data[4]);
 	if (!da) return -1;
 	FR_PROTO_TRACE("decode context changed %s -> %s", da->parent->name, da->name);
 
@@ -1072,11 +1097,11 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, vp_cursor_t *cursor, fr_dic
 
 		child = fr_dict_attr_child_by_num(parent, p[0]);
 		if (!child) {
-			fr_dict_attr_t *new;
+			fr_dict_attr_t const *new;
 
 			if ((p[0] != PW_VENDOR_SPECIFIC) || (datalen < (3 + 4 + 1))) {
 				/* da->attr < 255, da->vendor == 0 */
-				new = fr_dict_unknown_afrom_fields(ctx, parent, 0, p[0]);
+				new = fr_dict_unknown_afrom_fields_cached(ctx, parent, 0, p[0]);
 			} else {
 				/*
 				 *	Try to find the VSA.
@@ -1086,7 +1111,7 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, vp_cursor_t *cursor, fr_dic
 
 				if (vendor == 0) goto raw;
 
-				new = fr_dict_unknown_afrom_fields(ctx, parent, vendor, p[7]);
+				new = fr_dict_unknown_afrom_fields_cached(ctx, parent, vendor, p[7]);
 			}
 			child = new;
 
@@ -1141,7 +1166,7 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, vp_cursor_t *cursor, fr_dic
 			 *	This can be used later by the encoder to rebuild
 			 *	the attribute header.
 			 */
-			parent = fr_dict_unknown_afrom_fields(ctx, parent, vendor, p[4]);
+			parent = fr_dict_unknown_afrom_fields_cached(ctx, parent, vendor, p[4]);
 			p += 5;
 			datalen -= 5;
 			break;
@@ -1154,7 +1179,7 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, vp_cursor_t *cursor, fr_dic
 			 *	fr_dict_unknown_afrom_fields will do the right thing
 			 *	and only create the unknown attr.
 			 */
-			parent = fr_dict_unknown_afrom_fields(ctx, parent, vendor, p[4]);
+			parent = fr_dict_unknown_afrom_fields_cached(ctx, parent, vendor, p[4]);
 			p += 5;
 			datalen -= 5;
 			break;
@@ -1196,7 +1221,7 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, vp_cursor_t *cursor, fr_dic
 		 *	therefore of type "octets", and will be
 		 *	handled below.
 		 */
-		parent = fr_dict_unknown_afrom_fields(ctx, parent->parent, parent->vendor, parent->attr);
+		parent = fr_dict_unknown_afrom_fields_cached(ctx, parent->parent, parent->vendor, parent->attr);
 		if (!parent) {
 			fr_strerror_printf("%s: Internal sanity check %d", __FUNCTION__, __LINE__);
 			return -1;
@@ -1227,10 +1252,30 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, vp_cursor_t *cursor, fr_dic
 
 	switch (parent->type) {
 	case PW_TYPE_STRING:
+		if (parent->flags.intern && (fr_pair_value_intern(vp, (char const *)p, datalen) == 0)) break;
+
+		/*
+		 *	Strings need a trailing '\0', which the
+		 *	packet doesn't have.  They reference the copy
+		 *	of the packet instead, where the first byte
+		 *	after the value is overwritten.  That byte is
+		 *	never part of another value.
+		 */
+		if (decode_by_ref(this, p, datalen)) {
+			char *q = this->values + (p - this->packet->data);
+
+			q[datalen] = '\0';
+			fr_pair_value_strref(vp, q, datalen);
+			break;
+		}
 		fr_pair_value_bstrncpy(vp, p, datalen);
 		break;
 
 	case PW_TYPE_OCTETS:
+		if (decode_by_ref(this, p, datalen)) {
+			fr_pair_value_memref(vp, p, datalen);
+			break;
+		}
 		fr_pair_value_memcpy(vp, p, datalen);
 		break;
 
@@ -1350,7 +1395,7 @@ ssize_t fr_radius_decode_pair(TALLOC_CTX *ctx, vp_cursor_t *cursor, fr_dict_attr
 	da = fr_dict_attr_child_by_num(parent, data[0]);
 	if (!da) {
 		FR_PROTO_TRACE("Unknown attribute %u", data[0]);
-		da = fr_dict_unknown_afrom_fields(ctx, parent, 0, data[0]);
+		da = fr_dict_unknown_afrom_fields_cached(ctx, parent, 0, data[0]);
 	}
 	if (!da) return -1;
 	FR_PROTO_TRACE("decode context changed %s -> %s",da->parent->name, da->name);
@@ -187,6 +187,7 @@ int fr_radius_encode_tunnel_password(char *passwd, size_t *pwlen, char const *se
 int fr_radius_encode_password(char *passwd, size_t *pwlen, char const *secret, uint8_t const *vector)
 {
 	FR_MD5_CTX	context, old;
+	fr_radius_secret_ctx_t const *secret_ctx;
 	uint8_t		digest[AUTH_VECTOR_LEN];
 	int		i, n, secretlen;
 	int		len;
@@ -215,10 +216,15 @@ int fr_radius_encode_password(char *passwd, size_t *pwlen, char const *secret, u
 	/*
 	 *	Use the secret to setup the decryption digest
 	 */
-	secretlen = strlen(secret);
+	secret_ctx = fr_radius_secret_ctx(secret);
+	if (secret_ctx) {
+		fr_md5_copy(&context, &secret_ctx->md5);
+	} else {
+		secretlen = strlen(secret);
 
-	fr_md5_init(&context);
-	fr_md5_update(&context, (uint8_t const *) secret, secretlen);
+		fr_md5_init(&context);
+		fr_md5_update(&context, (uint8_t const *) secret, secretlen);
+	}
 	fr_md5_copy(&old, &context); /* save intermediate work */
 
 	/*
@@ -245,6 +251,7 @@ static void encode_password(uint8_t *out, ssize_t *outlen, uint8_t const *input,
 			    char const *secret, uint8_t const *vector)
 {
 	FR_MD5_CTX	context, old;
+	fr_radius_secret_ctx_t const *secret_ctx;
 	uint8_t		digest[AUTH_VECTOR_LEN];
 	uint8_t		passwd[MAX_PASS_LEN];
 	size_t		i, n;
@@ -267,8 +274,13 @@ static void encode_password(uint8_t *out, ssize_t *outlen, uint8_t const *input,
 	}
 	*outlen = len;
 
-	fr_md5_init(&context);
-	fr_md5_update(&context, (uint8_t const *) secret, strlen(secret));
+	secret_ctx = fr_radius_secret_ctx(secret);
+	if (secret_ctx) {
+		fr_md5_copy(&context, &secret_ctx->md5);
+	} else {
+		fr_md5_init(&context);
+		fr_md5_update(&context, (uint8_t const *) secret, strlen(secret));
+	}
 	fr_md5_copy(&old, &context);
 
 	/*
@@ -295,6 +307,7 @@ static void encode_tunnel_password(uint8_t *out, ssize_t *outlen,
 				   char const *secret, uint8_t const *vector)
 {
 	FR_MD5_CTX	context, old;
+	fr_radius_secret_ctx_t const *secret_ctx;
 	uint8_t		digest[AUTH_VECTOR_LEN];
 	size_t		i, n;
 	size_t		encrypted_len;
@@ -353,8 +366,13 @@ static void encode_tunnel_password(uint8_t *out, ssize_t *outlen,
 	out[1] = fr_rand();
 	out[2] = inlen;	/* length of the password string */
 
-	fr_md5_init(&context);
-	fr_md5_update(&context, (uint8_t const *) secret, strlen(secret));
+	secret_ctx = fr_radius_secret_ctx(secret);
+	if (secret_ctx) {
+		fr_md5_copy(&context, &secret_ctx->md5);
+	} else {
+		fr_md5_init(&context);
+		fr_md5_update(&context, (uint8_t const *) secret, strlen(secret));
+	}
 	fr_md5_copy(&old, &context);
 
 	fr_md5_update(&context, vector, AUTH_VECTOR_LEN);
@@ -644,6 +662,68 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 		break;
 	}
 
+	/*
+	 *	Fixed size values which aren't tagged or encrypted
+	 *	are written directly to the output buffer.  This skips
+	 *	the copy via a temporary buffer, and the encryption
+	 *	and tag handling below.
+	 */
+	if (!da->flags.encrypt && !da->flags.has_tag) switch (da->type) {
+	case PW_TYPE_BYTE:
+		if (outlen < 1) break;
+		out[0] = vp->vp_byte;
+		len = 1;
+		goto next;
+
+	case PW_TYPE_SHORT:
+		if (outlen < 2) break;
+		out[0] = (vp->vp_short >> 8) & 0xff;
+		out[1] = vp->vp_short & 0xff;
+		len = 2;
+		goto next;
+
+	case PW_TYPE_INTEGER:
+		if (outlen < 4) break;
+		lvalue = htonl(vp->vp_integer);
+		memcpy(out, &lvalue, sizeof(lvalue));
+		len = 4;
+		goto next;
+
+	case PW_TYPE_DATE:
+		if (outlen < 4) break;
+		lvalue = htonl(vp->vp_date);
+		memcpy(out, &lvalue, sizeof(lvalue));
+		len = 4;
+		goto next;
+
+	case PW_TYPE_SIGNED:
+	{
+		int32_t slvalue;
+
+		if (outlen < 4) break;
+		slvalue = htonl(vp->vp_signed);
+		memcpy(out, &slvalue, sizeof(slvalue));
+		len = 4;
+		goto next;
+	}
+
+	case PW_TYPE_INTEGER64:
+		if (outlen < 8) break;
+		lvalue64 = htonll(vp->vp_integer64);
+		memcpy(out, &lvalue64, sizeof(lvalue64));
+		len = 8;
+		goto next;
+
+	case PW_TYPE_IPV4_ADDR:
+		if (outlen < 4) break;
+		memcpy(out, &vp->vp_ipaddr, 4);
+		len = 4;
+		goto next;
+
+	default:
+		break;
+	}
+
 	/*
 	 *	Set up the default sources for the data.
 	 */
@@ -818,6 +898,7 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 		break;
 	} /* switch over encryption flags */
 
+next:
 	/*
 	 *	Rebuilds the TLV stack for encoding the next attribute
 	 */
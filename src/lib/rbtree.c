@@ -40,14 +40,6 @@ typedef enum {
 	RED
 } node_colour_t;
 
-struct rbnode_t {
-    rbnode_t		*left;		//!< Left child
-    rbnode_t		*right;		//!< Right child
-    rbnode_t		*parent;	//!< Parent
-    node_colour_t	colour;		//!< Node colour (BLACK, RED)
-    void		*data;		//!< data stored in node
-};
-
 #define NIL &sentinel	   /* all leafs are sentinels */
 static rbnode_t sentinel = { NIL, NIL, NULL, BLACK, NULL};
 
@@ -60,6 +52,8 @@ struct rbtree_t {
 	rb_comparator_t		compare;
 	rb_free_t		free;
 	bool			replace;
+	bool			intrusive;	//!< Nodes are embedded in the data, at "offset".
+	size_t			offset;		//!< Offset of the rbnode_t in the data.
 #ifdef HAVE_PTHREAD_H
 	bool			lock;
 	pthread_mutex_t		mutex;
@@ -72,13 +66,16 @@ struct rbtree_t {
  */
 static void free_walker(rbtree_t *tree, rbnode_t *x)
 {
-	(void) talloc_get_type_abort(x, rbnode_t);
+	if (!tree->intrusive) (void) talloc_get_type_abort(x, rbnode_t);
 
 	if (x->left != NIL) free_walker(tree, x->left);
 	if (x->right != NIL) free_walker(tree, x->right);
 
+	/*
+	 *	For intrusive trees, this also frees the node.
+	 */
 	if (tree->free) tree->free(x->data);
-	talloc_free(x);
+	if (!tree->intrusive) talloc_free(x);
 }
 
 void rbtree_free(rbtree_t *tree)
@@ -135,6 +132,36 @@ rbtree_t *rbtree_create(TALLOC_CTX *ctx, rb_comparator_t compare, rb_free_t node
 	return tree;
 }
 
+/** Create a new RED-BLACK tree, where the nodes are part of the data
+ *
+ * The data must contain an #rbnode_t at offset, which the tree uses
+ * instead of allocating a node on every insert.  Data can only be in
+ * one intrusive tree per #rbnode_t, and must not be freed while it's
+ * in the tree.
+ *
+ * @param[in] ctx to allocate the tree in.
+ * @param[in] compare function for the data.
+ * @param[in] node_free called for data deleted from the tree.  May be NULL.
+ * @param[in] offset of the #rbnode_t in the data, i.e. offsetof(my_struct_t, node).
+ * @param[in] flags RBTREE_FLAG_* values.
+ * @return
+ *	- A new tree.
+ *	- NULL on error.
+ */
+rbtree_t *rbtree_create_intrusive(TALLOC_CTX *ctx, rb_comparator_t compare, rb_free_t node_free,
+				  size_t offset, int flags)
+{
+	rbtree_t *tree;
+
+	tree = rbtree_create(ctx, compare, node_free, flags);
+	if (!tree) return NULL;
+
+	tree->intrusive = true;
+	tree->offset = offset;
+
+	return tree;
+}
+
 /** Rotate Node x to left
  *
  */
@@ -283,6 +310,32 @@ rbnode_t *rbtree_insert_node(rbtree_t *tree, void *data)
 			/*
 			 *	Do replace the entry.
 			 */
+			if (tree->intrusive) {
+				void *old = current->data;
+
+				/*
+				 *	The new node takes the place
+				 *	of the old one.
+				 */
+				x = (rbnode_t *)(((uint8_t *) data) + tree->offset);
+				memcpy(x, current, sizeof(*x));
+				x->data = data;
+
+				if (!x->parent) {
+					tree->root = x;
+				} else if (x->parent->left == current) {
+					x->parent->left = x;
+				} else {
+					x->parent->right = x;
+				}
+				if (x->left != NIL) x->left->parent = x;
+				if (x->right != NIL) x->right->parent = x;
+
+				if (tree->free) tree->free(old);
+				PTHREAD_MUTEX_UNLOCK(tree);
+				return x;
+			}
+
 			if (tree->free) tree->free(current->data);
 			current->data = data;
 			PTHREAD_MUTEX_UNLOCK(tree);
@@ -294,11 +347,15 @@ rbnode_t *rbtree_insert_node(rbtree_t *tree, void *data)
 	}
 
 	/* setup new node */
-	x = talloc_zero(tree, rbnode_t);
-	if (!x) {
-		fr_strerror_printf("No memory for new rbtree node");
-		PTHREAD_MUTEX_UNLOCK(tree);
-		return NULL;
+	if (tree->intrusive) {
+		x = (rbnode_t *)(((uint8_t *) data) + tree->offset);
+	} else {
+		x = talloc_zero(tree, rbnode_t);
+		if (!x) {
+			fr_strerror_printf("No memory for new rbtree node");
+			PTHREAD_MUTEX_UNLOCK(tree);
+			return NULL;
+		}
 	}
 
 	x->data = data;
@@ -405,9 +462,16 @@ static void rbtree_delete_internal(rbtree_t *tree, rbnode_t *z, bool skiplock)
 {
 	rbnode_t *x, *y;
 	rbnode_t *parent;
+	void *data;
 
 	if (!z || z == NIL) return;
 
+	/*
+	 *	Freed last, as for intrusive trees, z is part of the
+	 *	data.
+	 */
+	data = z->data;
+
 	if (!skiplock) {
 		PTHREAD_MUTEX_LOCK(tree);
 	}
@@ -443,7 +507,6 @@ static void rbtree_delete_internal(rbtree_t *tree, rbnode_t *z, bool skiplock)
 	}
 
 	if (y != z) {
-		if (tree->free) tree->free(z->data);
 		z->data = y->data;
 		y->data = NULL;
 
@@ -469,17 +532,17 @@ static void rbtree_delete_internal(rbtree_t *tree, rbnode_t *z, bool skiplock)
 		if (y->left->parent == z) y->left->parent = y;
 		if (y->right->parent == z) y->right->parent = y;
 
-		talloc_free(z);
+		if (!tree->intrusive) talloc_free(z);
 
 	} else {
-		if (tree->free) tree->free(y->data);
-
 		if (y->colour == BLACK)
 			delete_fixup(tree, x, parent);
 
-		talloc_free(y);
+		if (!tree->intrusive) talloc_free(y);
 	}
 
+	if (tree->free) tree->free(data);
+
 	tree->num_elements--;
 	if (!skiplock) {
 		PTHREAD_MUTEX_UNLOCK(tree);
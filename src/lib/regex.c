@@ -25,6 +25,14 @@
 #ifdef HAVE_REGEX
 #include <freeradius-devel/libradius.h>
 #include <freeradius-devel/regex.h>
+#include <freeradius-devel/threads.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+typedef atomic_uint_fast64_t regex_counter_t;
+#else
+typedef uint64_t regex_counter_t;
+#endif
 
 /*
  *	Wrapper functions for libpcre. Much more powerful, and guaranteed
@@ -136,6 +144,39 @@ ssize_t regex_compile(TALLOC_CTX *ctx, regex_t **out, char const *pattern, size_
 	return len;
 }
 
+/** Copy the compiled form of an expression
+ *
+ * Used to give subcapture data its own copy of a cached expression, which may
+ * be evicted from the cache before the subcaptures are used.
+ *
+ * @note The copy is not studied, so is only suitable for extracting subcaptures.
+ *
+ * @param ctx to allocate the copy in.
+ * @param preg to copy.
+ * @return
+ *	- A new #regex_t.
+ *	- NULL on error.
+ */
+regex_t *regex_dup(TALLOC_CTX *ctx, regex_t const *preg)
+{
+	regex_t *copy;
+	size_t	size;
+
+	if (pcre_fullinfo(preg->compiled, NULL, PCRE_INFO_SIZE, &size) != 0) return NULL;
+
+	copy = talloc_zero(ctx, regex_t);
+	if (!copy) return NULL;
+	talloc_set_destructor(copy, _regex_free);
+
+	copy->compiled = talloc_memdup(copy, preg->compiled, size);
+	if (!copy->compiled) {
+		talloc_free(copy);
+		return NULL;
+	}
+
+	return copy;
+}
+
 static const FR_NAME_NUMBER regex_pcre_error_str[] = {
 	{ "PCRE_ERROR_NOMATCH",		PCRE_ERROR_NOMATCH },
 	{ "PCRE_ERROR_NULL",		PCRE_ERROR_NULL },
@@ -387,4 +428,226 @@ int regex_exec(regex_t *preg, char const *subject, size_t len, regmatch_t pmatch
 	return 1;
 }
 #  endif
+
+/*
+ *	Cache of expressions compiled at runtime (i.e. from expanded
+ *	strings), so the same pattern isn't recompiled for every request.
+ *
+ *	There's one cache per thread, so lookups don't need locking, and
+ *	compiled expressions are never shared between threads.
+ */
+#define REGEX_CACHE_ICASE	0x01
+#define REGEX_CACHE_MULTILINE	0x02
+#define REGEX_CACHE_SUBCAPTURE	0x04
+
+typedef struct regex_cache_entry regex_cache_entry_t;
+
+struct regex_cache_entry {
+	char const		*pattern;	//!< Uncompiled pattern.
+	size_t			len;		//!< Length of the pattern.
+	uint8_t			flags;		//!< Flags the pattern was compiled with.
+
+	regex_t			*preg;		//!< Compiled pattern.
+
+	regex_cache_entry_t	*prev;		//!< More recently used entry.
+	regex_cache_entry_t	*next;		//!< Less recently used entry.
+};
+
+typedef struct regex_cache {
+	fr_hash_table_t		*ht;		//!< Entries, by pattern and flags.
+	regex_cache_entry_t	*head;		//!< Most recently used entry.
+	regex_cache_entry_t	*tail;		//!< Least recently used entry.
+} regex_cache_t;
+
+fr_thread_local_setup(regex_cache_t *, regex_cache)	/* macro */
+
+static regex_counter_t regex_cache_hits;
+static regex_counter_t regex_cache_misses;
+static regex_counter_t regex_cache_evictions;
+
+static uint32_t regex_cache_entry_hash(void const *data)
+{
+	regex_cache_entry_t const *entry = data;
+
+	return fr_hash_update(&entry->flags, sizeof(entry->flags), fr_hash(entry->pattern, entry->len));
+}
+
+static int regex_cache_entry_cmp(void const *one, void const *two)
+{
+	regex_cache_entry_t const *a = one, *b = two;
+
+	if (a->flags != b->flags) return a->flags - b->flags;
+	if (a->len != b->len) return (a->len < b->len) ? -1 : 1;
+
+	return memcmp(a->pattern, b->pattern, a->len);
+}
+
+/*
+ *	Free the regex cache when the thread exits.
+ */
+static void _regex_cache_free(void *arg)
+{
+	regex_cache_t *cache = arg;
+
+	talloc_free(cache->ht);
+	free(cache);
+}
+
+static inline void regex_cache_unlink(regex_cache_t *cache, regex_cache_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+
+	entry->prev = entry->next = NULL;
+}
+
+static inline void regex_cache_push(regex_cache_t *cache, regex_cache_entry_t *entry)
+{
+	entry->prev = NULL;
+	entry->next = cache->head;
+
+	if (cache->head) cache->head->prev = entry;
+	cache->head = entry;
+
+	if (!cache->tail) cache->tail = entry;
+}
+
+/** Compile an expression at runtime, re-using a previous compilation of the same pattern
+ *
+ * Expressions are compiled with JIT (where available), and kept in a per-thread
+ * LRU cache of #REGEX_CACHE_SIZE entries.
+ *
+ * @note The compiled expression is owned by the cache, and must NOT be freed by
+ *	the caller.  It remains valid until the next call to this function.
+ *
+ * @param out Where to write out a pointer to the compiled expression.
+ * @param pattern to compile.
+ * @param len of pattern.
+ * @param ignore_case whether to do case insensitive matching.
+ * @param multiline If true $ matches newlines.
+ * @param subcaptures Whether to compile the regular expression to store subcapture
+ *	data.
+ * @return
+ *	- >= 1 on success.
+ *	- <= 0 on error. Negative value is offset of parse error.
+ */
+ssize_t regex_compile_cached(regex_t **out, char const *pattern, size_t len,
+			     bool ignore_case, bool multiline, bool subcaptures)
+{
+	regex_cache_t		*cache;
+	regex_cache_entry_t	my_entry, *entry;
+	regex_t			*preg;
+	ssize_t			slen;
+
+	*out = NULL;
+
+	cache = fr_thread_local_init(regex_cache, _regex_cache_free);
+	if (!cache) {
+		/*
+		 *	malloc is thread safe, talloc is not
+		 */
+		cache = calloc(1, sizeof(*cache));
+		if (!cache) goto uncached;
+
+		cache->ht = fr_hash_table_create(NULL, regex_cache_entry_hash, regex_cache_entry_cmp, NULL);
+		if (!cache->ht) {
+			free(cache);
+			goto uncached;
+		}
+
+		if (fr_thread_local_set(regex_cache, cache) != 0) {
+			_regex_cache_free(cache);
+			goto uncached;
+		}
+	}
+
+	my_entry.pattern = pattern;
+	my_entry.len = len;
+	my_entry.flags = (ignore_case ? REGEX_CACHE_ICASE : 0) |
+			 (multiline ? REGEX_CACHE_MULTILINE : 0) |
+			 (subcaptures ? REGEX_CACHE_SUBCAPTURE : 0);
+
+	entry = fr_hash_table_finddata(cache->ht, &my_entry);
+	if (entry) {
+		regex_cache_hits++;
+
+		if (cache->head != entry) {
+			regex_cache_unlink(cache, entry);
+			regex_cache_push(cache, entry);
+		}
+
+		*out = entry->preg;
+		return len;
+	}
+
+	regex_cache_misses++;
+
+	/*
+	 *	Make room for the new entry.
+	 */
+	if (fr_hash_table_num_elements(cache->ht) >= REGEX_CACHE_SIZE) {
+		regex_cache_entry_t *lru = cache->tail;
+
+		regex_cache_unlink(cache, lru);
+		fr_hash_table_delete(cache->ht, lru);
+		talloc_free(lru);
+
+		regex_cache_evictions++;
+	}
+
+	entry = talloc_zero(cache->ht, regex_cache_entry_t);
+	if (!entry) goto uncached;
+
+	slen = regex_compile(entry, &preg, pattern, len, ignore_case, multiline, subcaptures, false);
+	if (slen <= 0) {
+		talloc_free(entry);
+		return slen;
+	}
+#  ifdef HAVE_PCRE
+	preg->cached = true;
+#  endif
+
+	entry->pattern = talloc_memdup(entry, pattern, len);
+	entry->len = len;
+	entry->flags = my_entry.flags;
+	entry->preg = preg;
+
+	if (!fr_hash_table_insert(cache->ht, entry)) {
+		talloc_free(entry);
+		goto uncached;
+	}
+	regex_cache_push(cache, entry);
+
+	*out = preg;
+	return slen;
+
+	/*
+	 *	Should only happen if we're out of memory.
+	 */
+uncached:
+	fr_strerror_printf("Failed allocating regex cache entry");
+	return 0;
+}
+
+/** Return statistics for the runtime regex cache
+ *
+ * @param[out] hits Number of compilations avoided.
+ * @param[out] misses Number of patterns compiled.
+ * @param[out] evictions Number of compiled patterns discarded to make room for new ones.
+ */
+void regex_cache_stats(uint64_t *hits, uint64_t *misses, uint64_t *evictions)
+{
+	if (hits) *hits = regex_cache_hits;
+	if (misses) *misses = regex_cache_misses;
+	if (evictions) *evictions = regex_cache_evictions;
+}
 #endif
@@ -13,6 +13,27 @@ RCSID("$Id$")
 #include "../include/sha1.h"
 
 #ifndef WITH_OPENSSL_SHA1
+/*
+ *	Hardware implementations.  Picked at run time on x86, where
+ *	the SHA extensions are optional, and at compile time on ARMv8,
+ *	where -march says whether we can use the crypto extensions
+ *	anywhere in the binary.
+ */
+#  if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#    define WITH_SHA1_X86
+#    include <immintrin.h>
+#    include <cpuid.h>
+#  elif defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#    define WITH_SHA1_ARMV8
+#    include <arm_neon.h>
+#  endif
+
+/** Hash one or more consecutive 512-bit blocks
+ */
+typedef void (*sha1_blocks_t)(uint32_t state[5], uint8_t const *data, size_t blocks);
+
+static sha1_blocks_t sha1_blocks;
+
 #  define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
 
 /* blk0() and blk() perform the initial expand. */
@@ -33,7 +54,7 @@ RCSID("$Id$")
 
 /* Hash a single 512-bit block. This is the core of the algorithm. */
 
-void fr_sha1_transform(uint32_t state[5], uint8_t const buffer[64])
+static void sha1_transform_generic(uint32_t state[5], uint8_t const buffer[64])
 {
 	uint32_t a, b, c, d, e;
 	typedef union {
@@ -88,11 +109,216 @@ void fr_sha1_transform(uint32_t state[5], uint8_t const buffer[64])
 #  endif
 }
 
+static void sha1_blocks_generic(uint32_t state[5], uint8_t const *data, size_t blocks)
+{
+	while (blocks--) {
+		sha1_transform_generic(state, data);
+		data += 64;
+	}
+}
+
+#  ifdef WITH_SHA1_X86
+/*
+ *	One group of four rounds using the SHA extensions, for rounds 4
+ *	to 79.  The message schedule for later groups is computed as
+ *	we go, four rounds ahead of where it's needed.
+ */
+#    define SHA1_NI_ROUNDS(_k, _e_in, _e_out, _m, _m_next, _m_prev, _m_prev2) \
+do { \
+	_e_in = _mm_sha1nexte_epu32(_e_in, _m); \
+	_e_out = abcd; \
+	if (((_k) >= 3) && ((_k) <= 18)) _m_next = _mm_sha1msg2_epu32(_m_next, _m); \
+	abcd = _mm_sha1rnds4_epu32(abcd, _e_in, (_k) / 5); \
+	if ((_k) <= 16) _m_prev = _mm_sha1msg1_epu32(_m_prev, _m); \
+	if (((_k) >= 2) && ((_k) <= 17)) _m_prev2 = _mm_xor_si128(_m_prev2, _m); \
+} while (0)
+
+static void CC_HINT(target("sha,ssse3,sse4.1")) sha1_blocks_x86(uint32_t state[5], uint8_t const *data, size_t blocks)
+{
+	__m128i		abcd, abcd_save, e0, e0_save, e1;
+	__m128i		m0, m1, m2, m3;
+	__m128i const	bswap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((__m128i const *)state), 0x1b);
+	e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+
+	while (blocks--) {
+		abcd_save = abcd;
+		e0_save = e0;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data + 0)), bswap);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data + 16)), bswap);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data + 32)), bswap);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(data + 48)), bswap);
+
+		/* Rounds 0-3, E is added rather than rotated in */
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		SHA1_NI_ROUNDS( 1, e1, e0, m1, m2, m0, m3);
+		SHA1_NI_ROUNDS( 2, e0, e1, m2, m3, m1, m0);
+		SHA1_NI_ROUNDS( 3, e1, e0, m3, m0, m2, m1);
+		SHA1_NI_ROUNDS( 4, e0, e1, m0, m1, m3, m2);
+		SHA1_NI_ROUNDS( 5, e1, e0, m1, m2, m0, m3);
+		SHA1_NI_ROUNDS( 6, e0, e1, m2, m3, m1, m0);
+		SHA1_NI_ROUNDS( 7, e1, e0, m3, m0, m2, m1);
+		SHA1_NI_ROUNDS( 8, e0, e1, m0, m1, m3, m2);
+		SHA1_NI_ROUNDS( 9, e1, e0, m1, m2, m0, m3);
+		SHA1_NI_ROUNDS(10, e0, e1, m2, m3, m1, m0);
+		SHA1_NI_ROUNDS(11, e1, e0, m3, m0, m2, m1);
+		SHA1_NI_ROUNDS(12, e0, e1, m0, m1, m3, m2);
+		SHA1_NI_ROUNDS(13, e1, e0, m1, m2, m0, m3);
+		SHA1_NI_ROUNDS(14, e0, e1, m2, m3, m1, m0);
+		SHA1_NI_ROUNDS(15, e1, e0, m3, m0, m2, m1);
+		SHA1_NI_ROUNDS(16, e0, e1, m0, m1, m3, m2);
+		SHA1_NI_ROUNDS(17, e1, e0, m1, m2, m0, m3);
+		SHA1_NI_ROUNDS(18, e0, e1, m2, m3, m1, m0);
+		SHA1_NI_ROUNDS(19, e1, e0, m3, m0, m2, m1);
+
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+
+		data += 64;
+	}
+
+	_mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+	state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+/*
+ *	SHA extensions are CPUID.(EAX=7,ECX=0):EBX[29].  The byte
+ *	shuffles need SSSE3, and the extract needs SSE4.1.
+ */
+static bool sha1_x86_usable(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid_max(0, NULL) < 7) return false;
+
+	__cpuid(1, eax, ebx, ecx, edx);
+	if (!(ecx & (1 << 9)) || !(ecx & (1 << 19))) return false;
+
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return (ebx & (1 << 29)) != 0;
+}
+#  endif
+
+#  ifdef WITH_SHA1_ARMV8
+/*
+ *	One group of four rounds using the ARMv8 crypto extensions.  The
+ *	round constant for the group after next is added as we go, and
+ *	the message schedule is computed three groups ahead.
+ */
+#    define SHA1_ARMV8_ROUNDS(_k, _op, _e_in, _e_out, _tmp, _m, _m1, _m2, _m3) \
+do { \
+	_e_out = vsha1h_u32(vgetq_lane_u32(abcd, 0)); \
+	abcd = _op(abcd, _e_in, _tmp); \
+	if ((_k) <= 17) _tmp = vaddq_u32(_m2, vdupq_n_u32(sha1_k[((_k) + 2) / 5])); \
+	if (((_k) >= 1) && ((_k) <= 16)) _m3 = vsha1su1q_u32(_m3, _m2); \
+	if ((_k) <= 15) _m = vsha1su0q_u32(_m, _m1, _m2); \
+} while (0)
+
+static void sha1_blocks_armv8(uint32_t state[5], uint8_t const *data, size_t blocks)
+{
+	static uint32_t const	sha1_k[4] = { 0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6 };
+	uint32x4_t		abcd, abcd_save, tmp0, tmp1;
+	uint32x4_t		m0, m1, m2, m3;
+	uint32_t		e0, e0_save, e1;
+
+	abcd = vld1q_u32(state);
+	e0 = state[4];
+
+	while (blocks--) {
+		abcd_save = abcd;
+		e0_save = e0;
+
+		m0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 0)));
+		m1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16)));
+		m2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 32)));
+		m3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 48)));
+
+		tmp0 = vaddq_u32(m0, vdupq_n_u32(sha1_k[0]));
+		tmp1 = vaddq_u32(m1, vdupq_n_u32(sha1_k[0]));
+
+		SHA1_ARMV8_ROUNDS( 0, vsha1cq_u32, e0, e1, tmp0, m0, m1, m2, m3);
+		SHA1_ARMV8_ROUNDS( 1, vsha1cq_u32, e1, e0, tmp1, m1, m2, m3, m0);
+		SHA1_ARMV8_ROUNDS( 2, vsha1cq_u32, e0, e1, tmp0, m2, m3, m0, m1);
+		SHA1_ARMV8_ROUNDS( 3, vsha1cq_u32, e1, e0, tmp1, m3, m0, m1, m2);
+		SHA1_ARMV8_ROUNDS( 4, vsha1cq_u32, e0, e1, tmp0, m0, m1, m2, m3);
+		SHA1_ARMV8_ROUNDS( 5, vsha1pq_u32, e1, e0, tmp1, m1, m2, m3, m0);
+		SHA1_ARMV8_ROUNDS( 6, vsha1pq_u32, e0, e1, tmp0, m2, m3, m0, m1);
+		SHA1_ARMV8_ROUNDS( 7, vsha1pq_u32, e1, e0, tmp1, m3, m0, m1, m2);
+		SHA1_ARMV8_ROUNDS( 8, vsha1pq_u32, e0, e1, tmp0, m0, m1, m2, m3);
+		SHA1_ARMV8_ROUNDS( 9, vsha1pq_u32, e1, e0, tmp1, m1, m2, m3, m0);
+		SHA1_ARMV8_ROUNDS(10, vsha1mq_u32, e0, e1, tmp0, m2, m3, m0, m1);
+		SHA1_ARMV8_ROUNDS(11, vsha1mq_u32, e1, e0, tmp1, m3, m0, m1, m2);
+		SHA1_ARMV8_ROUNDS(12, vsha1mq_u32, e0, e1, tmp0, m0, m1, m2, m3);
+		SHA1_ARMV8_ROUNDS(13, vsha1mq_u32, e1, e0, tmp1, m1, m2, m3, m0);
+		SHA1_ARMV8_ROUNDS(14, vsha1mq_u32, e0, e1, tmp0, m2, m3, m0, m1);
+		SHA1_ARMV8_ROUNDS(15, vsha1pq_u32, e1, e0, tmp1, m3, m0, m1, m2);
+		SHA1_ARMV8_ROUNDS(16, vsha1pq_u32, e0, e1, tmp0, m0, m1, m2, m3);
+		SHA1_ARMV8_ROUNDS(17, vsha1pq_u32, e1, e0, tmp1, m1, m2, m3, m0);
+		SHA1_ARMV8_ROUNDS(18, vsha1pq_u32, e0, e1, tmp0, m2, m3, m0, m1);
+		SHA1_ARMV8_ROUNDS(19, vsha1pq_u32, e1, e0, tmp1, m3, m0, m1, m2);
+
+		e0 += e0_save;
+		abcd = vaddq_u32(abcd, abcd_save);
+
+		data += 64;
+	}
+
+	vst1q_u32(state, abcd);
+	state[4] = e0;
+}
+#  endif
+
+/** Choose the SHA1 implementation
+ *
+ * Called automatically the first time a digest is calculated.  Can be
+ * called again, e.g. by benchmarks, to compare implementations.
+ *
+ * @param[in] hw	Use the CPU's SHA instructions if it has them.
+ * @return the name of the implementation now in use.
+ */
+char const *fr_sha1_select(bool hw)
+{
+#  ifdef WITH_SHA1_X86
+	static int x86_usable = -1;
+
+	if (x86_usable < 0) x86_usable = sha1_x86_usable();
+
+	if (hw && x86_usable) {
+		sha1_blocks = sha1_blocks_x86;
+		return "sha-ni";
+	}
+#  endif
+
+#  ifdef WITH_SHA1_ARMV8
+	if (hw) {
+		sha1_blocks = sha1_blocks_armv8;
+		return "armv8-crypto";
+	}
+#  endif
+
+	sha1_blocks = sha1_blocks_generic;
+	return "generic";
+}
+
+void fr_sha1_transform(uint32_t state[5], uint8_t const buffer[64])
+{
+	if (!sha1_blocks) fr_sha1_select(true);
+
+	sha1_blocks(state, buffer, 1);
+}
+
 
 /* fr_sha1_init - Initialize new context */
 
 void fr_sha1_init(fr_sha1_ctx* context)
 {
+	if (!sha1_blocks) fr_sha1_select(true);
+
 	/* SHA1 initialization constants */
 	context->state[0] = 0x67452301;
 	context->state[1] = 0xEFCDAB89;
@@ -105,7 +331,7 @@ void fr_sha1_init(fr_sha1_ctx* context)
 /* Run your data through this. */
 void fr_sha1_update(fr_sha1_ctx *context,uint8_t const *data, size_t len)
 {
-	unsigned int i, j;
+	size_t i, j, blocks;
 
 	j = (context->count[0] >> 3) & 63;
 	if ((context->count[0] += len << 3) < (len << 3)) {
@@ -115,9 +341,16 @@ void fr_sha1_update(fr_sha1_ctx *context,uint8_t const *data, size_t len)
 	context->count[1] += (len >> 29);
 	if ((j + len) > 63) {
 		memcpy(&context->buffer[j], data, (i = 64-j));
-		fr_sha1_transform(context->state, context->buffer);
-		for ( ; i + 63 < len; i += 64) {
-			fr_sha1_transform(context->state, &data[i]);
+		sha1_blocks(context->state, context->buffer, 1);
+
+		/*
+		 *	All the whole blocks at once, so the
+		 *	state can stay in registers.
+		 */
+		blocks = (len - i) / 64;
+		if (blocks) {
+			sha1_blocks(context->state, &data[i], blocks);
+			i += blocks * 64;
 		}
 		j = 0;
 	} else {
@@ -133,16 +366,18 @@ void fr_sha1_final(uint8_t digest[20], fr_sha1_ctx *context)
 {
 	uint32_t i, j;
 	uint8_t finalcount[8];
+	static uint8_t const padding[64] = { 0x80 };
 
 	for (i = 0; i < 8; i++) {
 		finalcount[i] = (uint8_t)((context->count[(i >= 4 ? 0 : 1)] >> ((3-(i & 3)) * 8) ) & 255);  /* Endian independent */
 	}
 
-	fr_sha1_update(context, (unsigned char const *) "\200", 1);
+	/*
+	 *	0x80, then zeros up to 56 bytes into a block.
+	 */
+	j = (context->count[0] >> 3) & 63;
+	fr_sha1_update(context, padding, (j < 56) ? (56 - j) : (120 - j));
 
-	while ((context->count[0] & 504) != 448) {
-		fr_sha1_update(context, (unsigned char const *) "\0", 1);
-	}
 	fr_sha1_update(context, finalcount, 8);  /* Should cause a fr_sha1_transform() */
 	for (i = 0; i < 20; i++) {
 		digest[i] = (uint8_t)((context->state[i>>2] >> ((3-(i & 3)) * 8) ) & 255);
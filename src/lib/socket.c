@@ -30,6 +30,10 @@
 
 #include <fcntl.h>
 
+#ifdef HAVE_LINUX_FILTER_H
+#  include <linux/filter.h>
+#endif
+
 #ifdef HAVE_SYS_UN_H
 #  include <sys/un.h>
 #  ifndef SUN_LEN
@@ -703,3 +707,168 @@ int fr_socket_server_bind(int sockfd, fr_ipaddr_t *ipaddr, int *port, char const
 
 	return 0;
 }
+
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_FILTER)
+/*
+ *	A classic BPF program which accepts packets from a set of
+ *	source networks, and drops everything else in the kernel.
+ *	This means that floods from unknown, or spoofed, addresses
+ *	never wake up the reader.
+ *
+ *	The program looks at the IP header, so it works for IPv4
+ *	packets received on a dual-stack IPv6 socket, too.  Each
+ *	source is compared as (source & netmask) == network.
+ */
+#define FILTER_ACCEPT		(0xffffffff)
+#define FILTER_MAX_INSNS	(4096)	/* BPF_MAXINSNS */
+
+typedef struct {
+	struct sock_filter	insn[FILTER_MAX_INSNS];
+	int			num;
+	bool			full;
+} fr_socket_filter_t;
+
+static void filter_add(fr_socket_filter_t *sf, uint16_t code, uint8_t jt, uint8_t jf, uint32_t k)
+{
+	if (sf->num >= FILTER_MAX_INSNS) {
+		sf->full = true;
+		return;
+	}
+
+	sf->insn[sf->num].code = code;
+	sf->insn[sf->num].jt = jt;
+	sf->insn[sf->num].jf = jf;
+	sf->insn[sf->num].k = k;
+	sf->num++;
+}
+
+static uint32_t filter_mask(int prefix)
+{
+	if (prefix <= 0) return 0;
+	if (prefix >= 32) return 0xffffffff;
+
+	return ~((1U << (32 - prefix)) - 1);
+}
+
+static void filter_add_source(fr_socket_filter_t *sf, fr_ipaddr_t const *source)
+{
+	uint32_t word, mask;
+	int i, words, prefix;
+
+	if (source->af == AF_INET) {
+		/*
+		 *	The source address is in X.
+		 */
+		mask = filter_mask(source->prefix);
+		word = ntohl(source->ipaddr.ip4addr.s_addr) & mask;
+
+		filter_add(sf, BPF_MISC | BPF_TXA, 0, 0, 0);
+		if (mask != 0xffffffff) filter_add(sf, BPF_ALU | BPF_AND | BPF_K, 0, 0, mask);
+		filter_add(sf, BPF_JMP | BPF_JEQ | BPF_K, 0, 1, word);
+		filter_add(sf, BPF_RET | BPF_K, 0, 0, FILTER_ACCEPT);
+		return;
+	}
+
+	/*
+	 *	Compare each 32-bit word of the source address which
+	 *	is covered by the prefix.  A mismatch jumps over the
+	 *	rest of this source.
+	 */
+	prefix = source->prefix;
+	words = (prefix + 31) / 32;
+
+	for (i = 0; i < words; i++) {
+		int left = (words - i - 1) * 3;		/* ld, and, jeq for the following words */
+
+		mask = filter_mask(prefix - (i * 32));
+		memcpy(&word, &source->ipaddr.ip6addr.s6_addr[i * 4], sizeof(word));
+		word = ntohl(word) & mask;
+
+		filter_add(sf, BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + 8 + (i * 4));
+		filter_add(sf, BPF_ALU | BPF_AND | BPF_K, 0, 0, mask);
+		filter_add(sf, BPF_JMP | BPF_JEQ | BPF_K, 0, left + 1, word);
+	}
+	filter_add(sf, BPF_RET | BPF_K, 0, 0, FILTER_ACCEPT);
+}
+
+/** Only accept packets on a socket from a set of source networks
+ *
+ * Attaching a new filter atomically replaces the old one, so this
+ * can be called again whenever the set of sources changes.
+ *
+ * @param[in] sockfd to attach the filter to.
+ * @param[in] sources networks to accept packets from.  The prefix of each is honoured.
+ * @param[in] num number of sources.
+ * @return
+ *	- 1 if the sources didn't fit in a filter.  Any existing filter is
+ *	  removed, so all packets are accepted.
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_socket_filter_sources(int sockfd, fr_ipaddr_t const *sources, size_t num)
+{
+	fr_socket_filter_t	*sf;
+	struct sock_fprog	prog;
+	size_t			i;
+	int			jump;
+
+	sf = talloc_zero(NULL, fr_socket_filter_t);
+	if (!sf) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	/*
+	 *	A = IP version.  IPv6 packets jump to the IPv6 section.
+	 */
+	filter_add(sf, BPF_LD | BPF_B | BPF_ABS, 0, 0, SKF_NET_OFF);
+	filter_add(sf, BPF_ALU | BPF_RSH | BPF_K, 0, 0, 4);
+	filter_add(sf, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, 4);
+	jump = sf->num;
+	filter_add(sf, BPF_JMP | BPF_JA, 0, 0, 0);	/* fixed up below */
+
+	/*
+	 *	X = IPv4 source address.
+	 */
+	filter_add(sf, BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + 12);
+	filter_add(sf, BPF_MISC | BPF_TAX, 0, 0, 0);
+
+	for (i = 0; i < num; i++) if (sources[i].af == AF_INET) filter_add_source(sf, &sources[i]);
+	filter_add(sf, BPF_RET | BPF_K, 0, 0, 0);
+
+	sf->insn[jump].k = sf->num - (jump + 1);
+
+	for (i = 0; i < num; i++) if (sources[i].af == AF_INET6) filter_add_source(sf, &sources[i]);
+	filter_add(sf, BPF_RET | BPF_K, 0, 0, 0);
+
+	if (sf->full) {
+		int dummy = 0;
+
+		/*
+		 *	The kernel ignores the value, but rejects
+		 *	anything shorter than an int.
+		 */
+		talloc_free(sf);
+		(void) setsockopt(sockfd, SOL_SOCKET, SO_DETACH_FILTER, &dummy, sizeof(dummy));
+		return 1;
+	}
+
+	prog.len = sf->num;
+	prog.filter = sf->insn;
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		fr_strerror_printf("Failed attaching filter: %s", fr_syserror(errno));
+		talloc_free(sf);
+		return -1;
+	}
+	talloc_free(sf);
+
+	return 0;
+}
+#else
+int fr_socket_filter_sources(UNUSED int sockfd, UNUSED fr_ipaddr_t const *sources, UNUSED size_t num)
+{
+	fr_strerror_printf("Socket filters are not supported on this system");
+	return -1;
+}
+#endif
@@ -0,0 +1,326 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/str.c
+ * @brief Vectorised string kernels for escaping, validation and case folding.
+ *
+ * Escape functions spend most of their time copying bytes which don't need
+ * escaping.  These functions find, or transform, runs of such bytes 16 at a
+ * time where the CPU allows it, so that callers only drop to their byte at a
+ * time code for the bytes which need it.
+ *
+ * Every kernel has a scalar version, which handles the tail of the input, and
+ * all of it on platforms without SSE2.
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/str.h>
+
+/*
+ *	SSE2 is part of the x86_64 baseline, so there's no need to
+ *	check for it at run time.
+ */
+#if defined(__GNUC__) && defined(__SSE2__)
+#  define WITH_STR_SSE2
+#  include <emmintrin.h>
+#endif
+
+static char const hextab[] = "0123456789abcdef";
+
+/** Build a set of every byte which isn't printable ASCII, or isn't in allowed
+ *
+ * Used for "safe characters" style configuration items, where the list of
+ * characters is arbitrary.  The table is allocated in ctx.
+ *
+ * @param[in] ctx	to allocate the table in.
+ * @param[out] set	to initialise.
+ * @param[in] allowed	printable characters which aren't in the set.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_str_set_table(TALLOC_CTX *ctx, fr_str_set_t *set, char const *allowed)
+{
+	uint8_t		*table;
+	uint8_t const	*p;
+
+	table = talloc_array(ctx, uint8_t, 256);
+	if (!table) return -1;
+
+	memset(table, 1, 256);
+	for (p = (uint8_t const *) allowed; *p; p++) {
+		if ((*p >= 0x20) && (*p <= 0x7e)) table[*p] = 0;
+	}
+
+	memset(set, 0, sizeof(*set));
+	set->table = table;
+
+	return 0;
+}
+
+static inline bool str_set_member(fr_str_set_t const *set, uint8_t c)
+{
+	if ((c < set->lo) || (c > set->hi)) return true;
+
+	return (c != '\0') && (strchr(set->chars, c) != NULL);
+}
+
+/** Return the number of bytes at the start of in which aren't in set
+ *
+ * @param[in] set	of bytes to stop at.
+ * @param[in] in	data to search.
+ * @param[in] inlen	length of in.
+ * @return the offset of the first byte in set, or inlen if there isn't one.
+ */
+size_t fr_str_span(fr_str_set_t const *set, uint8_t const *in, size_t inlen)
+{
+	size_t i = 0;
+
+	if (set->table) {
+		uint8_t const *table = set->table;
+
+		while ((i + 4) <= inlen) {
+			if (table[in[i]]) return i;
+			if (table[in[i + 1]]) return i + 1;
+			if (table[in[i + 2]]) return i + 2;
+			if (table[in[i + 3]]) return i + 3;
+			i += 4;
+		}
+
+		while ((i < inlen) && !table[in[i]]) i++;
+
+		return i;
+	}
+
+#ifdef WITH_STR_SSE2
+	if (inlen >= 16) {
+		__m128i	lo = _mm_set1_epi8((char) set->lo);
+		__m128i	hi = _mm_set1_epi8((char) set->hi);
+		__m128i	chars[FR_STR_SET_CHARS];
+		int	num, j;
+
+		for (num = 0; (num < FR_STR_SET_CHARS) && set->chars[num]; num++) {
+			chars[num] = _mm_set1_epi8(set->chars[num]);
+		}
+
+		for (; (i + 16) <= inlen; i += 16) {
+			__m128i	v = _mm_loadu_si128((__m128i const *)(in + i));
+			__m128i	ok;
+			int	mask;
+
+			/*
+			 *	max(v, lo) == v where v >= lo, and
+			 *	min(v, hi) == v where v <= hi.  There
+			 *	are no unsigned byte compares in SSE2.
+			 */
+			ok = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, lo), v),
+					   _mm_cmpeq_epi8(_mm_min_epu8(v, hi), v));
+			for (j = 0; j < num; j++) ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, chars[j]), ok);
+
+			mask = _mm_movemask_epi8(ok) ^ 0xffff;
+			if (mask) return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+
+	while ((i < inlen) && !str_set_member(set, in[i])) i++;
+
+	return i;
+}
+
+/** Return the length of the valid UTF-8 at the start of in
+ *
+ * Valid means the same as it does for #fr_utf8_char, so control characters
+ * and DEL aren't.  Runs of printable ASCII are skipped 16 bytes at a time.
+ *
+ * @param[in] in	data to check.
+ * @param[in] inlen	length of in.
+ * @return the offset of the first invalid character, or inlen if there isn't one.
+ */
+size_t fr_str_utf8_valid(uint8_t const *in, size_t inlen)
+{
+	static fr_str_set_t const	ascii = FR_STR_SET(0x20, 0x7e, "");
+	size_t				i = 0;
+	int				clen;
+
+	while (i < inlen) {
+		i += fr_str_span(&ascii, in + i, inlen - i);
+		if (i == inlen) break;
+
+		clen = fr_utf8_char(in + i, inlen - i);
+		if (clen == 0) break;
+
+		i += clen;
+	}
+
+	return i;
+}
+
+/** Fold ASCII letters to lower case, as strcasecmp() does in the C locale
+ *
+ * @param[out] out	where to write the folded string.  May be the same as in.
+ * @param[in] in	string to fold.
+ * @param[in] inlen	length of in.  No '\\0' is written.
+ */
+void fr_str_tolower(char *out, char const *in, size_t inlen)
+{
+	size_t i = 0;
+
+#ifdef WITH_STR_SSE2
+	__m128i	before_a = _mm_set1_epi8('A' - 1);
+	__m128i	after_z = _mm_set1_epi8('Z' + 1);
+	__m128i	lower = _mm_set1_epi8('a' - 'A');
+
+	/*
+	 *	The compares are signed, so bytes >= 0x80 look
+	 *	negative, and are left alone.
+	 */
+	for (; (i + 16) <= inlen; i += 16) {
+		__m128i v = _mm_loadu_si128((__m128i const *)(in + i));
+		__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, before_a), _mm_cmplt_epi8(v, after_z));
+
+		_mm_storeu_si128((__m128i *)(out + i), _mm_add_epi8(v, _mm_and_si128(upper, lower)));
+	}
+#endif
+
+	for (; i < inlen; i++) {
+		char c = in[i];
+
+		if ((c >= 'A') && (c <= 'Z')) c += 'a' - 'A';
+		out[i] = c;
+	}
+}
+
+/** Convert binary data to lower case hex
+ *
+ * @param[out] out	where to write the hex.  Must be at least inlen * 2 bytes.
+ *			No '\\0' is written.
+ * @param[in] in	data to convert.
+ * @param[in] inlen	length of in.
+ */
+void fr_str_hex_encode(char *out, uint8_t const *in, size_t inlen)
+{
+	size_t i = 0;
+
+#ifdef WITH_STR_SSE2
+	__m128i	nibble = _mm_set1_epi8(0x0f);
+	__m128i	nine = _mm_set1_epi8(9);
+	__m128i	zero = _mm_set1_epi8('0');
+	__m128i	alpha = _mm_set1_epi8('a' - '0' - 10);
+
+#  define HEX_DIGITS(_x) _mm_add_epi8(_mm_add_epi8(_x, zero), _mm_and_si128(_mm_cmpgt_epi8(_x, nine), alpha))
+
+	for (; (i + 16) <= inlen; i += 16) {
+		__m128i v = _mm_loadu_si128((__m128i const *)(in + i));
+		__m128i h = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+		__m128i l = _mm_and_si128(v, nibble);
+
+		_mm_storeu_si128((__m128i *)(out + (i * 2)), HEX_DIGITS(_mm_unpacklo_epi8(h, l)));
+		_mm_storeu_si128((__m128i *)(out + (i * 2) + 16), HEX_DIGITS(_mm_unpackhi_epi8(h, l)));
+	}
+#  undef HEX_DIGITS
+#endif
+
+	for (; i < inlen; i++) {
+		out[i * 2] = hextab[in[i] >> 4];
+		out[(i * 2) + 1] = hextab[in[i] & 0x0f];
+	}
+}
+
+/*
+ *	Value of a hex digit, or -1 if it isn't one.
+ */
+static inline int hex_nibble(char c)
+{
+	if ((c >= '0') && (c <= '9')) return c - '0';
+	if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+	if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+
+	return -1;
+}
+
+#ifdef WITH_STR_SSE2
+/*
+ *	Values of 16 hex digits, and a mask of which bytes were hex digits.
+ */
+static inline __m128i hex_nibbles(__m128i v, __m128i *valid)
+{
+	__m128i	digit = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+	__m128i	alpha = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	__m128i	is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+	__m128i	is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+
+	*valid = _mm_or_si128(is_digit, is_alpha);
+
+	return _mm_or_si128(_mm_and_si128(is_digit, digit),
+			    _mm_and_si128(is_alpha, _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+}
+#endif
+
+/** Convert hex to binary data
+ *
+ * Stops at the first pair of characters which aren't both hex digits.
+ *
+ * @param[out] out	where to write the data.
+ * @param[in] in	hex to convert.  Must be at least outlen * 2 bytes.
+ * @param[in] outlen	number of bytes to write.
+ * @return the number of bytes written.
+ */
+size_t fr_str_hex_decode(uint8_t *out, char const *in, size_t outlen)
+{
+	size_t i = 0;
+
+#ifdef WITH_STR_SSE2
+	__m128i low_byte = _mm_set1_epi16(0x00ff);
+
+	for (; (i + 16) <= outlen; i += 16) {
+		__m128i	valid0, valid1;
+		__m128i	n0 = hex_nibbles(_mm_loadu_si128((__m128i const *)(in + (i * 2))), &valid0);
+		__m128i	n1 = hex_nibbles(_mm_loadu_si128((__m128i const *)(in + (i * 2) + 16)), &valid1);
+
+		if (_mm_movemask_epi8(_mm_and_si128(valid0, valid1)) != 0xffff) break;
+
+		/*
+		 *	Each 16 bit lane holds the high nibble in its
+		 *	low byte, and the low nibble in its high byte.
+		 */
+		n0 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n0, low_byte), 4), _mm_srli_epi16(n0, 8));
+		n1 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n1, low_byte), 4), _mm_srli_epi16(n1, 8));
+
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(n0, n1));
+	}
+#endif
+
+	for (; i < outlen; i++) {
+		int h = hex_nibble(in[i * 2]);
+		int l;
+
+		if (h < 0) break;
+
+		l = hex_nibble(in[(i * 2) + 1]);
+		if (l < 0) break;
+
+		out[i] = (h << 4) | l;
+	}
+
+	return i;
+}
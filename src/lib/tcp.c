@@ -173,4 +173,135 @@ int fr_tcp_read_packet(RADIUS_PACKET *packet, int flags)
 	return 1;		/* done reading the packet */
 }
 
+struct fr_tcp_buffer_t {
+	uint8_t		*data;		//!< Bytes read from the socket.
+	size_t		size;		//!< Size of data.
+	size_t		start;		//!< Start of the first packet which hasn't been returned.
+	size_t		end;		//!< End of the bytes read.
+};
+
+/** Allocate a buffer for reading multiple packets from a TCP socket at once
+ *
+ * @param[in] ctx to allocate the buffer in.
+ * @param[in] size of the buffer.  Must be at least #MAX_PACKET_LEN.
+ * @return
+ *	- The new buffer.
+ *	- NULL on error.
+ */
+fr_tcp_buffer_t *fr_tcp_buffer_alloc(TALLOC_CTX *ctx, size_t size)
+{
+	fr_tcp_buffer_t *buf;
+
+	if (size < MAX_PACKET_LEN) size = MAX_PACKET_LEN;
+
+	buf = talloc_zero(ctx, fr_tcp_buffer_t);
+	if (!buf) return NULL;
+
+	buf->data = talloc_array(buf, uint8_t, size);
+	if (!buf->data) {
+		talloc_free(buf);
+		return NULL;
+	}
+	buf->size = size;
+
+	return buf;
+}
+
+/** Read as much data as is available, and as will fit in the buffer
+ *
+ * Any partial packet left over from the previous read is moved to the
+ * start of the buffer first, so there's always room for at least one
+ * complete packet.
+ *
+ * @param[in] sockfd to read from.  Should be non-blocking.
+ * @param[in] buf allocated with fr_tcp_buffer_alloc().
+ * @return
+ *	- > 0 the number of bytes read.
+ *	- 0 if no data was available.
+ *	- -1 on error.
+ *	- -2 if the connection was closed.
+ */
+ssize_t fr_tcp_buffer_recv(int sockfd, fr_tcp_buffer_t *buf)
+{
+	ssize_t len;
+
+	if (buf->start > 0) {
+		if (buf->end > buf->start) memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+		buf->end -= buf->start;
+		buf->start = 0;
+	}
+
+	len = recv(sockfd, buf->data + buf->end, buf->size - buf->end, 0);
+	if (len == 0) return -2; /* clean close */
+
+	if (len < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+#ifdef ECONNRESET
+		if (errno == ECONNRESET) return -2; /* forced */
+#endif
+
+		fr_strerror_printf("Error receiving packet: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	buf->end += len;
+
+	return len;
+}
+
+/** Return the next complete packet in the buffer
+ *
+ * The packet data is copied, so the packet remains valid after the
+ * next call to fr_tcp_buffer_recv().
+ *
+ * @param[in] buf to take the packet from.
+ * @param[in] packet to fill in.  Must not already have any data.
+ * @param[in] flags to pass to fr_radius_ok().
+ * @return
+ *	- 1 if a packet was returned.
+ *	- 0 if there isn't a complete packet in the buffer.
+ *	- -1 if the packet was invalid.  The connection should be closed,
+ *	  as we no longer know where the next packet starts.
+ */
+int fr_tcp_buffer_packet(fr_tcp_buffer_t *buf, RADIUS_PACKET *packet, int flags)
+{
+	uint8_t const	*p = buf->data + buf->start;
+	size_t		avail = buf->end - buf->start;
+	size_t		packet_len;
+
+	if (avail < 4) return 0;
+
+	packet_len = (p[2] << 8) | p[3];
+
+	if (packet_len < RADIUS_HDR_LEN) {
+		fr_strerror_printf("Discarding packet: Smaller than RFC minimum of 20 bytes");
+		return -1;
+	}
+
+	if (packet_len > MAX_PACKET_LEN) {
+		fr_strerror_printf("Discarding packet: Larger than RFC limitation of 4096 bytes");
+		return -1;
+	}
+
+	if (avail < packet_len) return 0;
+
+	packet->data = talloc_memdup(packet, p, packet_len);
+	if (!packet->data) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+	packet->data_len = packet_len;
+	packet->partial = packet_len;
+
+	buf->start += packet_len;
+
+	if (!fr_radius_ok(packet, flags, NULL)) return -1;
+
+	packet->vps = NULL;
+	gettimeofday(&packet->timestamp, NULL);
+
+	return 1;
+}
+
 #endif /* WITH_TCP */
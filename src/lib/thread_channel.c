@@ -0,0 +1,396 @@
+/*
+ * thread_channel.c	Pass messages between two threads, without locks.
+ *
+ * Version:	$Id$
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ *  Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/atomic_queue.h>
+#include <freeradius-devel/thread_channel.h>
+
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#include <poll.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#  include <sys/eventfd.h>
+#endif
+
+#define CACHE_LINE_SIZE	(64)
+
+/*
+ *	A channel is a pair of SPSC rings, one in each direction.
+ *	Each side also has a file descriptor, which becomes readable
+ *	when the other side has sent it messages.  That's an eventfd
+ *	where we have one, and a pipe otherwise.
+ *
+ *	The descriptor is only written to when the receiving side
+ *	has said that it's going to sleep, by setting "waiting".
+ *	So a busy receiver costs the sender no system calls, and a
+ *	batch of messages costs at most one.
+ */
+typedef struct fr_thread_channel_end_t {
+	fr_thread_channel_t		*ch;		//!< The channel this end belongs to.
+	fr_thread_channel_side_t	side;		//!< Which side this is.
+
+	fr_spsc_queue_t			*queue;		//!< Messages for this side.
+	int				fd[2];		//!< Read from fd[0], written to fd[1].  The
+							//!< same descriptor for an eventfd.
+
+	fr_thread_channel_recv_t	callback;	//!< Called from the event loop.
+	void				*uctx;		//!< Passed to the callback.
+
+	atomic_bool			waiting;	//!< This side wants to be signalled.
+	atomic_bool			signalled;	//!< Woken by #fr_thread_channel_signal.
+	uint8_t				pad[CACHE_LINE_SIZE];
+} fr_thread_channel_end_t;
+
+struct fr_thread_channel_t {
+	fr_thread_channel_end_t		end[2];
+};
+
+#define PEER(_side) (((_side) == FR_THREAD_CHANNEL_MASTER) ? FR_THREAD_CHANNEL_WORKER : FR_THREAD_CHANNEL_MASTER)
+
+static int channel_signal_init(fr_thread_channel_end_t *end)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	end->fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (end->fd[0] < 0) {
+		fr_strerror_printf("Failed creating eventfd: %s", fr_syserror(errno));
+		return -1;
+	}
+	end->fd[1] = end->fd[0];
+#else
+	if (pipe(end->fd) < 0) {
+		fr_strerror_printf("Failed creating pipe: %s", fr_syserror(errno));
+		end->fd[0] = end->fd[1] = -1;
+		return -1;
+	}
+
+	if ((fr_nonblock(end->fd[0]) < 0) || (fr_nonblock(end->fd[1]) < 0)) return -1;
+#endif
+
+	return 0;
+}
+
+static void channel_signal_write(fr_thread_channel_end_t *end)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t one = 1;
+#else
+	uint8_t one = 1;
+#endif
+
+	/*
+	 *	EAGAIN means the descriptor is already readable, so
+	 *	the other side will wake up anyway.
+	 */
+	if ((write(end->fd[1], &one, sizeof(one)) < 0) && (errno != EAGAIN)) {
+		fr_strerror_printf("Failed signalling channel: %s", fr_syserror(errno));
+	}
+}
+
+static void channel_signal_drain(fr_thread_channel_end_t *end)
+{
+	uint8_t buff[64];
+
+	while (read(end->fd[0], buff, sizeof(buff)) > 0);
+}
+
+static int _thread_channel_free(fr_thread_channel_t *ch)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		fr_thread_channel_end_t *end = &ch->end[i];
+
+		if ((end->fd[1] >= 0) && (end->fd[1] != end->fd[0])) close(end->fd[1]);
+		if (end->fd[0] >= 0) close(end->fd[0]);
+	}
+
+	return 0;
+}
+
+/** Create a channel between two threads
+ *
+ * @param[in] ctx to allocate the channel in.
+ * @param[in] size of the queue in each direction.  Rounded up to a power of 2.
+ * @return
+ *	- The new channel.
+ *	- NULL on error.
+ */
+fr_thread_channel_t *fr_thread_channel_create(TALLOC_CTX *ctx, size_t size)
+{
+	int i;
+	fr_thread_channel_t *ch;
+
+	ch = talloc_zero(ctx, fr_thread_channel_t);
+	if (!ch) return NULL;
+
+	for (i = 0; i < 2; i++) {
+		ch->end[i].fd[0] = ch->end[i].fd[1] = -1;
+	}
+	talloc_set_destructor(ch, _thread_channel_free);
+
+	for (i = 0; i < 2; i++) {
+		fr_thread_channel_end_t *end = &ch->end[i];
+
+		end->ch = ch;
+		end->side = i;
+		atomic_init(&end->waiting, false);
+		atomic_init(&end->signalled, false);
+
+		end->queue = fr_spsc_queue_create(ch, size);
+		if (!end->queue) {
+			fr_strerror_printf("Failed creating channel queue");
+		error:
+			talloc_free(ch);
+			return NULL;
+		}
+
+		if (channel_signal_init(end) < 0) goto error;
+	}
+
+	atomic_thread_fence(memory_order_seq_cst);
+
+	return ch;
+}
+
+/** Send messages to the other side of the channel
+ *
+ * The other side is signalled at most once per call, and only if
+ * it's waiting for messages.
+ *
+ * When the other side isn't keeping up, fewer than num messages are
+ * sent.  The caller decides whether to drop the rest, or to send
+ * them somewhere else.
+ *
+ * @param[in] ch to send on.
+ * @param[in] side which is sending.
+ * @param[in] data array of messages to send.
+ * @param[in] num of messages in the array.
+ * @return the number of messages sent.
+ */
+size_t fr_thread_channel_send(fr_thread_channel_t *ch, fr_thread_channel_side_t side,
+			      void * const *data, size_t num)
+{
+	fr_thread_channel_end_t *peer = &ch->end[PEER(side)];
+	size_t sent;
+
+	sent = fr_spsc_queue_push_batch(peer->queue, data, num);
+	if (!sent) return 0;
+
+	/*
+	 *	Pairs with the fence in channel_sleep().  Either we
+	 *	see that the other side is waiting, or it sees the
+	 *	messages we just pushed.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_load_explicit(&peer->waiting, memory_order_relaxed) &&
+	    atomic_exchange_explicit(&peer->waiting, false, memory_order_relaxed)) {
+		channel_signal_write(peer);
+	}
+
+	return sent;
+}
+
+/** Say that a side is going to sleep, unless there are messages waiting for it
+ *
+ * @return
+ *	- true if the side should sleep.
+ *	- false if there are messages waiting.
+ */
+static bool channel_sleep(fr_thread_channel_end_t *end)
+{
+	atomic_store_explicit(&end->waiting, true, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (fr_spsc_queue_num_elements(end->queue) == 0) return true;
+
+	atomic_store_explicit(&end->waiting, false, memory_order_relaxed);
+	return false;
+}
+
+/** Receive messages sent by the other side of the channel
+ *
+ * When there are no messages, the side is marked as waiting, and
+ * the other side will signal its descriptor when it next sends
+ * something.  So a thread driven by an event loop should call this
+ * function until it returns 0, before going back to the loop.
+ *
+ * @param[in] ch to receive from.
+ * @param[in] side which is receiving.
+ * @param[out] out array to write the messages to.
+ * @param[in] max number of messages to receive.
+ * @return the number of messages received.
+ */
+size_t fr_thread_channel_recv(fr_thread_channel_t *ch, fr_thread_channel_side_t side,
+			      void **out, size_t max)
+{
+	fr_thread_channel_end_t *end = &ch->end[side];
+	size_t got;
+
+	got = fr_spsc_queue_pop_batch(end->queue, out, max);
+	if (got || !max) return got;
+
+	if (channel_sleep(end)) return 0;
+
+	return fr_spsc_queue_pop_batch(end->queue, out, max);
+}
+
+/** Block until there are messages for a side, or it's signalled
+ *
+ * For threads which don't have an event loop.
+ *
+ * @param[in] ch to wait on.
+ * @param[in] side which is waiting.
+ * @return
+ *	- 1 if there are messages waiting.
+ *	- 0 if the side was signalled with #fr_thread_channel_signal.
+ *	- -1 on error, with errno set.  errno may be EINTR.
+ */
+int fr_thread_channel_wait(fr_thread_channel_t *ch, fr_thread_channel_side_t side)
+{
+	fr_thread_channel_end_t *end = &ch->end[side];
+	struct pollfd pfd;
+
+	if (fr_spsc_queue_num_elements(end->queue) > 0) return 1;
+
+	/*
+	 *	The descriptor may still be readable from a send whose
+	 *	messages were received without waiting.  So waking up
+	 *	to no messages, and no call to fr_thread_channel_signal,
+	 *	means going back to sleep.
+	 *
+	 *	The flag is checked before sleeping, as the write that
+	 *	went with it may have been drained by an earlier wake up.
+	 */
+	for (;;) {
+		if (!channel_sleep(end)) return 1;
+
+		if (atomic_exchange_explicit(&end->signalled, false, memory_order_seq_cst)) {
+			atomic_store_explicit(&end->waiting, false, memory_order_relaxed);
+			return 0;
+		}
+
+		pfd.fd = end->fd[0];
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, -1) < 0) {
+			int err = errno;
+
+			atomic_store_explicit(&end->waiting, false, memory_order_relaxed);
+			fr_strerror_printf("Failed waiting on channel: %s", fr_syserror(err));
+			errno = err;
+			return -1;
+		}
+
+		channel_signal_drain(end);
+		atomic_store_explicit(&end->waiting, false, memory_order_relaxed);
+
+		if (fr_spsc_queue_num_elements(end->queue) > 0) return 1;
+	}
+}
+
+/** Wake up a side, even if there are no messages for it
+ *
+ * Used to tell a thread to look at something other than the
+ * channel, e.g. that it should exit.
+ *
+ * @param[in] ch to signal.
+ * @param[in] side to wake up.
+ */
+void fr_thread_channel_signal(fr_thread_channel_t *ch, fr_thread_channel_side_t side)
+{
+	atomic_store_explicit(&ch->end[side].signalled, true, memory_order_seq_cst);
+	channel_signal_write(&ch->end[side]);
+}
+
+/** Return the descriptor which becomes readable when a side has messages
+ *
+ */
+int fr_thread_channel_fd(fr_thread_channel_t *ch, fr_thread_channel_side_t side)
+{
+	return ch->end[side].fd[0];
+}
+
+static void _thread_channel_event_read(UNUSED fr_event_list_t *el, UNUSED int fd, void *ctx)
+{
+	fr_thread_channel_end_t *end = ctx;
+
+	/*
+	 *	Drain first, so that messages sent after this are
+	 *	signalled again.
+	 */
+	channel_signal_drain(end);
+
+	end->callback(end->ch, end->side, end->uctx);
+}
+
+/** Call a function from an event loop, when there are messages for a side
+ *
+ * @param[in] el to add the channel's descriptor to.
+ * @param[in] ch to receive from.
+ * @param[in] side which is receiving.
+ * @param[in] callback to call.  It should call #fr_thread_channel_recv until it returns 0.
+ * @param[in] ctx to pass to the callback.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_thread_channel_event_insert(fr_event_list_t *el, fr_thread_channel_t *ch, fr_thread_channel_side_t side,
+				   fr_thread_channel_recv_t callback, void *ctx)
+{
+	fr_thread_channel_end_t *end = &ch->end[side];
+
+	end->callback = callback;
+	end->uctx = ctx;
+
+	if (!fr_event_fd_insert(el, 0, end->fd[0], _thread_channel_event_read, end)) return -1;
+
+	/*
+	 *	Messages may have been sent before we were listening.
+	 */
+	channel_signal_write(end);
+
+	return 0;
+}
+
+/** Stop calling a function from an event loop
+ *
+ */
+int fr_thread_channel_event_delete(fr_event_list_t *el, fr_thread_channel_t *ch, fr_thread_channel_side_t side)
+{
+	if (!fr_event_fd_delete(el, 0, ch->end[side].fd[0])) return -1;
+
+	return 0;
+}
+
+/** Return the approximate number of messages waiting for a side
+ *
+ */
+size_t fr_thread_channel_num_elements(fr_thread_channel_t *ch, fr_thread_channel_side_t side)
+{
+	return fr_spsc_queue_num_elements(ch->end[side].queue);
+}
+#endif	/* HAVE_STDATOMIC_H */
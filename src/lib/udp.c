@@ -239,3 +239,337 @@ ssize_t udp_recv(int sockfd, void *data, size_t data_len, int flags,
 
 	return received;
 }
+
+/*
+ *	Enough room for IP_PKTINFO / IPV6_PKTINFO and SO_TIMESTAMP.
+ */
+#define UDP_BATCH_CBUF_SIZE	(256)
+
+#ifdef HAVE_RECVMMSG
+struct udp_batch_t {
+	unsigned int		num;		//!< Maximum number of datagrams per read.
+	size_t			data_len;	//!< Size of each datagram buffer.
+
+	int			sockfd;		//!< The socket "local" was retrieved for.
+	struct sockaddr_storage	local;		//!< The address the socket is bound to.
+	socklen_t		sizeof_local;
+
+	udp_batch_entry_t	*entry;
+	struct mmsghdr		*msgs;
+	struct iovec		*iov;
+	struct sockaddr_storage	*src;
+	uint8_t			*cbuf;
+	uint8_t			*data;
+};
+
+/** Allocate buffers for reading multiple datagrams with one system call
+ *
+ * @param[in] ctx to allocate the batch in.
+ * @param[in] num maximum number of datagrams to read at once.
+ * @param[in] data_len maximum length of each datagram.
+ * @return
+ *	- The new batch.
+ *	- NULL on error.
+ */
+udp_batch_t *udp_batch_alloc(TALLOC_CTX *ctx, unsigned int num, size_t data_len)
+{
+	unsigned int	i;
+	udp_batch_t	*batch;
+
+	if (!num || !data_len) return NULL;
+
+	batch = talloc_zero(ctx, udp_batch_t);
+	if (!batch) return NULL;
+
+	batch->num = num;
+	batch->data_len = data_len;
+	batch->sockfd = -1;
+
+	batch->entry = talloc_zero_array(batch, udp_batch_entry_t, num);
+	batch->msgs = talloc_zero_array(batch, struct mmsghdr, num);
+	batch->iov = talloc_zero_array(batch, struct iovec, num);
+	batch->src = talloc_zero_array(batch, struct sockaddr_storage, num);
+	batch->cbuf = talloc_zero_array(batch, uint8_t, num * UDP_BATCH_CBUF_SIZE);
+	batch->data = talloc_array(batch, uint8_t, num * data_len);
+	if (!batch->entry || !batch->msgs || !batch->iov || !batch->src || !batch->cbuf || !batch->data) {
+		talloc_free(batch);
+		return NULL;
+	}
+
+	for (i = 0; i < num; i++) {
+		batch->entry[i].data = batch->data + (i * data_len);
+
+		batch->iov[i].iov_base = batch->entry[i].data;
+		batch->iov[i].iov_len = data_len;
+
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	return batch;
+}
+
+/** Read as many datagrams as are available, up to the size of the batch
+ *
+ * Blocks until at least one datagram is available, unless the socket is
+ * non-blocking.  The entries are only valid until the next call.
+ *
+ * @param[in] sockfd we're reading from.
+ * @param[in] batch allocated with udp_batch_alloc().
+ * @param[out] entries where to write a pointer to the first entry.
+ * @return
+ *	- > 0 the number of entries read.
+ *	- 0 if no datagrams were available.
+ *	- < 0 on failure.
+ */
+int udp_batch_recv(int sockfd, udp_batch_t *batch, udp_batch_entry_t **entries)
+{
+	int			i, received;
+	struct timeval		now;
+
+	*entries = NULL;
+
+	/*
+	 *	recvmsg doesn't provide the destination port, so we
+	 *	have to retrieve it using getsockname().  The socket
+	 *	is bound, so we only need to do that once.
+	 */
+	if (batch->sockfd != sockfd) {
+		batch->sizeof_local = sizeof(batch->local);
+		if (getsockname(sockfd, (struct sockaddr *) &batch->local, &batch->sizeof_local) < 0) return -1;
+		batch->sockfd = sockfd;
+	}
+
+	for (i = 0; i < (int) batch->num; i++) {
+		struct msghdr *msgh = &batch->msgs[i].msg_hdr;
+
+		msgh->msg_name = &batch->src[i];
+		msgh->msg_namelen = sizeof(batch->src[i]);
+#ifdef WITH_UDPFROMTO
+		msgh->msg_control = batch->cbuf + (i * UDP_BATCH_CBUF_SIZE);
+		msgh->msg_controllen = UDP_BATCH_CBUF_SIZE;
+#endif
+		msgh->msg_flags = 0;
+		batch->msgs[i].msg_len = 0;
+	}
+
+	received = recvmmsg(sockfd, batch->msgs, batch->num, MSG_WAITFORONE, NULL);
+	if (received < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+		return -1;
+	}
+
+	gettimeofday(&now, NULL);
+
+	for (i = 0; i < received; i++) {
+		udp_batch_entry_t	*entry = &batch->entry[i];
+		struct msghdr		*msgh = &batch->msgs[i].msg_hdr;
+		struct sockaddr_storage	dst;
+		socklen_t		sizeof_dst = batch->sizeof_local;
+
+		entry->data_len = batch->msgs[i].msg_len;
+		if (entry->data_len > batch->data_len) entry->data_len = batch->data_len;
+		entry->verified = NULL;
+
+		if (!fr_ipaddr_from_sockaddr(&batch->src[i], msgh->msg_namelen,
+					     &entry->src_ipaddr, &entry->src_port)) {
+			entry->data_len = 0;
+			continue;
+		}
+
+		memcpy(&dst, &batch->local, sizeof(dst));
+		entry->if_index = 0;
+		entry->timestamp = now;
+
+#ifdef WITH_UDPFROMTO
+		recvfromto_cmsg(msgh, (struct sockaddr *) &dst, &sizeof_dst, &entry->if_index, &entry->timestamp);
+#endif
+		fr_ipaddr_from_sockaddr(&dst, sizeof_dst, &entry->dst_ipaddr, &entry->dst_port);
+	}
+
+	*entries = batch->entry;
+
+	return received;
+}
+#endif	/* HAVE_RECVMMSG */
+
+#ifdef HAVE_SENDMMSG
+struct udp_send_batch_t {
+	unsigned int		num;		//!< Maximum number of datagrams per write.
+	unsigned int		used;		//!< Number of datagrams waiting to be sent.
+	size_t			data_len;	//!< Size of each datagram buffer.
+
+	int			sockfd;		//!< The socket the queued datagrams are for.
+
+	struct mmsghdr		*msgs;
+	struct iovec		*iov;
+	struct sockaddr_storage	*dst;
+	uint8_t			*cbuf;
+	uint8_t			*data;
+};
+
+/** Allocate buffers for sending multiple datagrams with one system call
+ *
+ * @param[in] ctx to allocate the batch in.
+ * @param[in] num maximum number of datagrams to send at once.
+ * @param[in] data_len maximum length of each datagram.
+ * @return
+ *	- The new batch.
+ *	- NULL on error.
+ */
+udp_send_batch_t *udp_send_batch_alloc(TALLOC_CTX *ctx, unsigned int num, size_t data_len)
+{
+	unsigned int		i;
+	udp_send_batch_t	*batch;
+
+	if (!num || !data_len) return NULL;
+
+	batch = talloc_zero(ctx, udp_send_batch_t);
+	if (!batch) return NULL;
+
+	batch->num = num;
+	batch->data_len = data_len;
+	batch->sockfd = -1;
+
+	batch->msgs = talloc_zero_array(batch, struct mmsghdr, num);
+	batch->iov = talloc_zero_array(batch, struct iovec, num);
+	batch->dst = talloc_zero_array(batch, struct sockaddr_storage, num);
+	batch->cbuf = talloc_zero_array(batch, uint8_t, num * UDP_BATCH_CBUF_SIZE);
+	batch->data = talloc_array(batch, uint8_t, num * data_len);
+	if (!batch->msgs || !batch->iov || !batch->dst || !batch->cbuf || !batch->data) {
+		talloc_free(batch);
+		return NULL;
+	}
+
+	for (i = 0; i < num; i++) {
+		batch->iov[i].iov_base = batch->data + (i * data_len);
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+		batch->msgs[i].msg_hdr.msg_name = &batch->dst[i];
+	}
+
+	return batch;
+}
+
+/** Return the number of datagrams waiting to be sent
+ *
+ */
+unsigned int udp_send_batch_pending(udp_send_batch_t *batch)
+{
+	return batch->used;
+}
+
+/** Send all of the queued datagrams
+ *
+ * Datagrams which the kernel refuses are discarded, as they would have been
+ * if they were sent with udp_send().
+ *
+ * @param[in] batch to flush.
+ * @return
+ *	- >= 0 the number of datagrams sent.
+ *	- < 0 if none of the datagrams could be sent.
+ */
+int udp_send_batch_flush(udp_send_batch_t *batch)
+{
+	unsigned int	offset = 0;
+	int		sent = 0;
+	int		rcode;
+
+	while (offset < batch->used) {
+		rcode = sendmmsg(batch->sockfd, batch->msgs + offset, batch->used - offset, 0);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+
+			fr_strerror_printf("udp_sendmmsg failed: %s", fr_syserror(errno));
+
+			/*
+			 *	Skip the datagram which failed, and
+			 *	try the rest.
+			 */
+			offset++;
+			continue;
+		}
+
+		offset += rcode;
+		sent += rcode;
+	}
+
+	batch->used = 0;
+
+	if (!sent && offset) return -1;
+
+	return sent;
+}
+
+/** Queue a datagram to be sent with udp_send_batch_flush()
+ *
+ * The data is copied, so the caller may free it immediately.  If the batch is
+ * full, or the datagram is for a different socket, the queued datagrams are
+ * sent first.
+ *
+ * @param[in] sockfd to send the datagram on.
+ * @param[in] batch to add the datagram to.
+ * @param[in] data to send.
+ * @param[in] data_len of data.
+ * @param[in] src_ipaddr of the datagram.  Used with udpfromto.
+ * @param[in] src_port of the datagram.
+ * @param[in] if_index to send the datagram on.  Used with udpfromto.
+ * @param[in] dst_ipaddr of the datagram.
+ * @param[in] dst_port of the datagram.
+ * @return
+ *	- data_len on success.
+ *	- < 0 on failure.
+ */
+ssize_t udp_send_batch_add(int sockfd, udp_send_batch_t *batch, void *data, size_t data_len,
+			   UDP_UNUSED fr_ipaddr_t *src_ipaddr, UDP_UNUSED uint16_t src_port, UDP_UNUSED int if_index,
+			   fr_ipaddr_t *dst_ipaddr, uint16_t dst_port)
+{
+	struct mmsghdr	*msg;
+	socklen_t	sizeof_dst;
+
+	/*
+	 *	Too big for the buffers.  Send it now.
+	 */
+	if (data_len > batch->data_len) {
+		return udp_send(sockfd, data, data_len, 0, src_ipaddr, src_port, if_index, dst_ipaddr, dst_port);
+	}
+
+	if (batch->used && ((batch->used == batch->num) || (batch->sockfd != sockfd))) {
+		(void) udp_send_batch_flush(batch);
+	}
+
+	msg = &batch->msgs[batch->used];
+	if (!fr_ipaddr_to_sockaddr(dst_ipaddr, dst_port, &batch->dst[batch->used], &sizeof_dst)) return -1;
+
+	memcpy(batch->iov[batch->used].iov_base, data, data_len);
+	batch->iov[batch->used].iov_len = data_len;
+
+	msg->msg_hdr.msg_namelen = sizeof_dst;
+	msg->msg_hdr.msg_control = NULL;
+	msg->msg_hdr.msg_controllen = 0;
+	msg->msg_hdr.msg_flags = 0;
+	msg->msg_len = 0;
+
+#ifdef WITH_UDPFROMTO
+	/*
+	 *	Same rules as for udp_send().
+	 */
+	if ((src_ipaddr->af != AF_UNSPEC) && (dst_ipaddr->af != AF_UNSPEC) &&
+	    !fr_is_inaddr_any(src_ipaddr)) {
+		struct sockaddr_storage	src;
+		socklen_t		sizeof_src;
+		uint8_t			*cbuf = batch->cbuf + (batch->used * UDP_BATCH_CBUF_SIZE);
+
+		if (fr_ipaddr_to_sockaddr(src_ipaddr, src_port, &src, &sizeof_src)) {
+			memset(cbuf, 0, UDP_BATCH_CBUF_SIZE);
+			sendfromto_cmsg(&msg->msg_hdr, cbuf, (struct sockaddr *) &src, if_index);
+		}
+	}
+#endif
+
+	batch->sockfd = sockfd;
+	batch->used++;
+
+	return data_len;
+}
+#endif	/* HAVE_SENDMMSG */
@@ -58,6 +58,11 @@ int value_data_cmp(PW_TYPE a_type, value_data_t const *a,
 	{
 		size_t length;
 
+		/*
+		 *	Always true for equal interned values.
+		 */
+		if ((a->octets == b->octets) && (a->length == b->length)) break;
+
 		if (a->length > b->length) {
 			length = a->length;
 		} else {
@@ -438,6 +443,156 @@ int value_data_cmp_op(FR_TOKEN op,
 
 static char const hextab[] = "0123456789abcdef";
 
+/*
+ *	Pairs of decimal digits, so integers can be printed two digits at a time.
+ */
+static char const digit_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/** Print an unsigned integer in decimal, as snprintf's "%" PRIu64 would
+ *
+ * @param[out] out	Where to write the digits.  Must have room for 21 bytes.
+ * @param[in] num	to print.
+ * @return the number of digits written, not including the '\0'.
+ */
+static size_t value_uint_to_str(char *out, uint64_t num)
+{
+	char	tmp[20];
+	char	*p = tmp + sizeof(tmp);
+	size_t	len;
+
+	while (num >= 100) {
+		unsigned int pair = (num % 100) * 2;
+
+		num /= 100;
+		*--p = digit_pairs[pair + 1];
+		*--p = digit_pairs[pair];
+	}
+
+	if (num >= 10) {
+		*--p = digit_pairs[(num * 2) + 1];
+		*--p = digit_pairs[num * 2];
+	} else {
+		*--p = '0' + num;
+	}
+
+	len = (tmp + sizeof(tmp)) - p;
+	memcpy(out, p, len);
+	out[len] = '\0';
+
+	return len;
+}
+
+/** Print an IPv4 address, as inet_ntop() would
+ *
+ * @param[out] out	Where to write the address.  Must have room for INET_ADDRSTRLEN bytes.
+ * @param[in] addr	in network byte order.
+ * @return the length of the address string.
+ */
+static size_t value_ipv4_to_str(char *out, uint8_t const addr[4])
+{
+	char *p = out;
+
+	p += value_uint_to_str(p, addr[0]);
+	*p++ = '.';
+	p += value_uint_to_str(p, addr[1]);
+	*p++ = '.';
+	p += value_uint_to_str(p, addr[2]);
+	*p++ = '.';
+	p += value_uint_to_str(p, addr[3]);
+
+	return p - out;
+}
+
+#ifndef WORDS_BIGENDIAN
+/** Convert eight ASCII digits to an integer, without a loop
+ *
+ * The first digit is in the lowest byte of a little endian load, so
+ * adjacent digits are combined into pairs, then the pairs into fours,
+ * then the fours into the result.
+ *
+ * @param[out] out	The value of the digits.
+ * @param[in] in	Eight bytes to convert.
+ * @return false if any of the bytes weren't digits.
+ */
+static inline bool value_digits8_from_str(uint64_t *out, char const *in)
+{
+	uint64_t v;
+
+	memcpy(&v, in, sizeof(v));
+
+	/*
+	 *	Every byte must be 0x3?, and still be 0x3? after
+	 *	adding 6, i.e. be between '0' and '9'.
+	 */
+	if (((v & 0xf0f0f0f0f0f0f0f0ULL) |
+	     (((v + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) >> 4)) != 0x3333333333333333ULL) return false;
+
+	v -= 0x3030303030303030ULL;
+	v = (v * 10) + (v >> 8);
+	v = (((v & 0x000000ff000000ffULL) * (100 + (1000000ULL << 32))) +
+	     (((v >> 16) & 0x000000ff000000ffULL) * (1 + (10000ULL << 32)))) >> 32;
+
+	*out = v;
+	return true;
+}
+#endif
+
+/** Parse a string which is nothing but decimal digits
+ *
+ * This is the form nearly every integer we parse takes.  Anything else,
+ * leading whitespace, hex, enumerated values, or values larger than max,
+ * returns false, and should be passed to the general parser which deals
+ * with those, and produces the appropriate errors.
+ *
+ * @param[out] out	The parsed value.
+ * @param[in] in	'\0' terminated string to parse.
+ * @param[in] max	Largest value to accept.
+ * @return true if the string was parsed.
+ */
+static bool value_uint_from_str(uint64_t *out, char const *in, uint64_t max)
+{
+	uint64_t	num = 0;
+	size_t		len, i = 0;
+
+	/*
+	 *	Anything with more than 19 digits may not fit in 64 bits.
+	 */
+	len = strlen(in);
+	if ((len == 0) || (len > 19)) return false;
+
+#ifndef WORDS_BIGENDIAN
+	while ((i + 8) <= len) {
+		uint64_t digits;
+
+		if (!value_digits8_from_str(&digits, in + i)) return false;
+
+		num = (num * 100000000) + digits;
+		i += 8;
+	}
+#endif
+
+	for (; i < len; i++) {
+		if ((in[i] < '0') || (in[i] > '9')) return false;
+
+		num = (num * 10) + (in[i] - '0');
+	}
+
+	if (num > max) return false;
+
+	*out = num;
+	return true;
+}
+
 /** Convert string value to a value_data_t type
  *
  * @param[in] ctx to alloc strings in.
@@ -784,6 +939,12 @@ int value_data_from_str(TALLOC_CTX *ctx, value_data_t *dst,
 	{
 		char *p;
 		unsigned int i;
+		uint64_t num;
+
+		if (value_uint_from_str(&num, src, UINT8_MAX)) {
+			dst->byte = num;
+			break;
+		}
 
 		/*
 		 *	Note that ALL integers are unsigned!
@@ -817,6 +978,12 @@ int value_data_from_str(TALLOC_CTX *ctx, value_data_t *dst,
 	{
 		char *p;
 		unsigned int i;
+		uint64_t num;
+
+		if (value_uint_from_str(&num, src, UINT16_MAX)) {
+			dst->ushort = num;
+			break;
+		}
 
 		/*
 		 *	Note that ALL integers are unsigned!
@@ -850,6 +1017,12 @@ int value_data_from_str(TALLOC_CTX *ctx, value_data_t *dst,
 	{
 		char *p;
 		unsigned int i;
+		uint64_t num;
+
+		if (value_uint_from_str(&num, src, UINT32_MAX)) {
+			dst->integer = num;
+			break;
+		}
 
 		/*
 		 *	Note that ALL integers are unsigned!
@@ -881,6 +1054,11 @@ int value_data_from_str(TALLOC_CTX *ctx, value_data_t *dst,
 	{
 		uint64_t i;
 
+		if (value_uint_from_str(&i, src, UINT64_MAX)) {
+			dst->integer64 = i;
+			break;
+		}
+
 		/*
 		 *	Note that ALL integers are unsigned!
 		 */
@@ -989,8 +1167,22 @@ int value_data_from_str(TALLOC_CTX *ctx, value_data_t *dst,
 		break;
 
 	case PW_TYPE_SIGNED:
+	{
+		uint64_t num;
+
 		/* Damned code for 1 WiMAX attribute */
+		if (src[0] == '-') {
+			if (value_uint_from_str(&num, src + 1, (uint64_t)INT32_MAX + 1)) {
+				dst->sinteger = (int32_t)(0 - num);
+				break;
+			}
+		} else if (value_uint_from_str(&num, src, INT32_MAX)) {
+			dst->sinteger = num;
+			break;
+		}
+
 		dst->sinteger = (int32_t)strtol(src, NULL, 10);
+	}
 		break;
 
 	case PW_TYPE_BOOLEAN:
@@ -1589,17 +1781,35 @@ char *value_data_asprint(TALLOC_CTX *ctx,
 		if (enumv && (dv = fr_dict_enum_by_da(NULL, enumv, i))) {
 			p = talloc_typed_strdup(ctx, dv->name);
 		} else {
-			p = talloc_typed_asprintf(ctx, "%u", i);
+			char buf[21];
+
+			value_uint_to_str(buf, i);
+			p = talloc_typed_strdup(ctx, buf);
 		}
 	}
 		break;
 
 	case PW_TYPE_SIGNED:
-		p = talloc_typed_asprintf(ctx, "%d", data->sinteger);
+	{
+		char buf[22];
+
+		if (data->sinteger < 0) {
+			buf[0] = '-';
+			value_uint_to_str(buf + 1, 0 - (int64_t)data->sinteger);
+		} else {
+			value_uint_to_str(buf, data->sinteger);
+		}
+		p = talloc_typed_strdup(ctx, buf);
+	}
 		break;
 
 	case PW_TYPE_INTEGER64:
-		p = talloc_typed_asprintf(ctx, "%" PRIu64 , data->integer64);
+	{
+		char buf[21];
+
+		value_uint_to_str(buf, data->integer64);
+		p = talloc_typed_strdup(ctx, buf);
+	}
 		break;
 
 	case PW_TYPE_ETHERNET:
@@ -1794,13 +2004,15 @@ print_int:
 			len = strlen(a);
 		} else {
 			/* should never be truncated */
-			len = snprintf(buf, sizeof(buf), "%u", i);
+			len = value_uint_to_str(buf, i);
 			a = buf;
 		}
 		break;
 
 	case PW_TYPE_INTEGER64:
-		return snprintf(out, outlen, "%" PRIu64, data->integer64);
+		len = value_uint_to_str(buf, data->integer64);
+		a = buf;
+		break;
 
 	case PW_TYPE_DATE:
 		t = data->date;
@@ -1816,13 +2028,18 @@ print_int:
 		break;
 
 	case PW_TYPE_SIGNED: /* Damned code for 1 WiMAX attribute */
-		len = snprintf(buf, sizeof(buf), "%d", data->sinteger);
+		if (data->sinteger < 0) {
+			buf[0] = '-';
+			len = value_uint_to_str(buf + 1, 0 - (int64_t)data->sinteger) + 1;
+		} else {
+			len = value_uint_to_str(buf, data->sinteger);
+		}
 		a = buf;
 		break;
 
 	case PW_TYPE_IPV4_ADDR:
-		a = inet_ntop(AF_INET, &(data->ipaddr), buf, sizeof(buf));
-		len = strlen(buf);
+		len = value_ipv4_to_str(buf, (uint8_t const *) &data->ipaddr.s_addr);
+		a = buf;
 		break;
 
 	case PW_TYPE_ABINARY:
@@ -1897,23 +2114,10 @@ print_int:
 		break;
 
 	case PW_TYPE_IPV4_PREFIX:
-	{
-		struct in_addr addr;
-
-		/*
-		 *	Alignment issues.
-		 */
-		memcpy(&addr, &(data->ipv4prefix[2]), sizeof(addr));
-
-		a = inet_ntop(AF_INET, &addr, buf, sizeof(buf));
-		if (a) {
-			p = buf;
-
-			len = strlen(buf);
-			p += len;
-			len += snprintf(p, sizeof(buf) - len, "/%u", (unsigned int) (data->ipv4prefix[1] & 0x3f));
-		}
-	}
+		len = value_ipv4_to_str(buf, &data->ipv4prefix[2]);
+		buf[len++] = '/';
+		len += value_uint_to_str(buf + len, data->ipv4prefix[1] & 0x3f);
+		a = buf;
 		break;
 
 	case PW_TYPE_ETHERNET:
@@ -1,3 +1,3 @@
-SUBMAKEFILES := radclient.mk radiusd.mk radsniff.mk radmin.mk radattr.mk \
-	radwho.mk radsnmp.mk radlast.mk radtest.mk radzap.mk checkrad.mk \
+SUBMAKEFILES := radclient.mk radiusd.mk radsniff.mk radmin.mk radattr.mk radbench.mk \
+	radwho.mk radsnmp.mk radlast.mk radtest.mk radzap.mk checkrad.mk radtrace.mk \
 	libfreeradius-server.mk unittest.mk
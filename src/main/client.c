@@ -38,16 +38,63 @@ RCSID("$Id$")
 #ifdef HAVE_DIRENT_H
 #include <dirent.h>
 #endif
+
+#ifdef HAVE_PTHREAD_H
+#  define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#  define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#  define PTHREAD_MUTEX_LOCK(_x)
+#  define PTHREAD_MUTEX_UNLOCK(_x)
 #endif
 
+/** A source address which is being looked up, or for which no client was found
+ *
+ */
+typedef struct client_lookup_entry client_lookup_entry_t;
+struct client_lookup_entry {
+	fr_ipaddr_t		ipaddr;
+	time_t			expires;	//!< When to look the source up again.  0 while
+						//!< the lookup is in progress.
+	client_lookup_entry_t	*next;		//!< Next negative entry to expire.
+};
+
+/** Lookups through the dynamic_clients virtual server of a network
+ *
+ * Negative entries all have the same lifetime, so the list of them is
+ * in order of expiry.
+ */
+struct client_lookup {
+	fr_hash_table_t		*ht;		//!< client_lookup_entry_t by source address.
+	client_lookup_entry_t	*head;		//!< Oldest negative entry.
+	client_lookup_entry_t	*tail;		//!< Newest negative entry.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+#endif
+};
+#endif
+
+/** A node in the client prefix trie
+ *
+ * The trie is path compressed.  Each node holds the first "prefix" bits of
+ * the address, and only exists if clients are defined for that prefix, or
+ * if two subtrees diverge after it.
+ */
+typedef struct client_trie_node {
+	struct client_trie_node	*child[2];	//!< Next node, by the value of the bit after the prefix.
+	uint8_t			key[16];	//!< Address bits, in network order.
+	uint8_t			prefix;		//!< Number of significant bits in key.
+	RADCLIENT		**clients;	//!< Clients for exactly this prefix, one per protocol.
+} client_trie_node_t;
+
 struct radclient_list {
-	rbtree_t	*trees[129]; /* for 0..128, inclusive. */
-	uint32_t       	min_prefix;
+	rbtree_t		*trees[129];	/* for 0..128, inclusive. */
+	client_trie_node_t	*trie_v4;	//!< Longest prefix match index over the IPv4 clients.
+	client_trie_node_t	*trie_v6;	//!< Longest prefix match index over the IPv6 clients.
 };
 
 
 #ifdef WITH_STATS
-static rbtree_t		*tree_num = NULL;     /* client numbers 0..N */
+static fr_hash_rcu_t	*tree_num = NULL;     /* client numbers 0..N */
 static int		tree_num_max = 0;
 #endif
 static RADCLIENT_LIST	*root_clients = NULL;
@@ -132,8 +179,198 @@ static int client_num_cmp(void const *one, void const *two)
 
 	return (a->number - b->number);
 }
+
+static uint32_t client_num_hash(void const *data)
+{
+	RADCLIENT const *client = data;
+
+	return fr_hash(&client->number, sizeof(client->number));
+}
 #endif
 
+#define TRIE_BIT(_key, _bit) (((_key)[(_bit) >> 3] >> (7 - ((_bit) & 0x07))) & 0x01)
+
+/*
+ *	Return the address bits of an IP, which are the trie key.
+ */
+static uint8_t const *client_trie_key(fr_ipaddr_t const *ipaddr)
+{
+	switch (ipaddr->af) {
+	case AF_INET:
+		return (uint8_t const *) &ipaddr->ipaddr.ip4addr;
+
+	case AF_INET6:
+		return (uint8_t const *) &ipaddr->ipaddr.ip6addr;
+
+	default:
+		return NULL;
+	}
+}
+
+/*
+ *	Number of leading bits, up to max, that two keys have in common.
+ */
+static int client_trie_common(uint8_t const *a, uint8_t const *b, int max)
+{
+	int i;
+
+	for (i = 0; i < max; i += 8) {
+		uint8_t diff = a[i >> 3] ^ b[i >> 3];
+
+		if (diff) {
+			while (!(diff & 0x80)) {
+				diff <<= 1;
+				i++;
+			}
+			return (i < max) ? i : max;
+		}
+	}
+
+	return max;
+}
+
+static client_trie_node_t *client_trie_node_alloc(RADCLIENT_LIST *clients, uint8_t const *key, int prefix)
+{
+	client_trie_node_t *node;
+
+	node = talloc_zero(clients, client_trie_node_t);
+	if (!node) return NULL;
+
+	memcpy(node->key, key, (prefix + 7) >> 3);
+	node->prefix = prefix;
+
+	return node;
+}
+
+/*
+ *	Add a client to the trie, creating or splitting nodes as needed.
+ */
+static bool client_trie_insert(RADCLIENT_LIST *clients, RADCLIENT *client)
+{
+	client_trie_node_t	**pp, *node;
+	uint8_t const		*key;
+	int			prefix = client->ipaddr.prefix;
+	size_t			num;
+
+	key = client_trie_key(&client->ipaddr);
+	if (!key) return false;
+
+	pp = (client->ipaddr.af == AF_INET) ? &clients->trie_v4 : &clients->trie_v6;
+
+	while ((node = *pp) != NULL) {
+		int common;
+
+		common = client_trie_common(node->key, key, (node->prefix < prefix) ? node->prefix : prefix);
+		if (common < node->prefix) {
+			client_trie_node_t *split;
+
+			/*
+			 *	The new prefix diverges from, or is
+			 *	shorter than, this node.  Put a node
+			 *	for the common part above it.
+			 */
+			split = client_trie_node_alloc(clients, key, common);
+			if (!split) return false;
+
+			split->child[TRIE_BIT(node->key, common)] = node;
+			*pp = node = split;
+		}
+
+		if (node->prefix == prefix) goto add;
+
+		pp = &node->child[TRIE_BIT(key, node->prefix)];
+	}
+
+	node = client_trie_node_alloc(clients, key, prefix);
+	if (!node) return false;
+	*pp = node;
+
+add:
+	num = talloc_array_length(node->clients);
+	node->clients = talloc_realloc(node, node->clients, RADCLIENT *, num + 1);
+	if (!node->clients) return false;
+	node->clients[num] = client;
+
+	return true;
+}
+
+/*
+ *	Remove a client from the trie.  Empty nodes are left in place,
+ *	and skipped by lookups.
+ */
+#ifdef WITH_DYNAMIC_CLIENTS
+static void client_trie_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
+{
+	client_trie_node_t	*node;
+	uint8_t const		*key;
+	size_t			i, num;
+
+	key = client_trie_key(&client->ipaddr);
+	if (!key) return;
+
+	node = (client->ipaddr.af == AF_INET) ? clients->trie_v4 : clients->trie_v6;
+	while (node && (node->prefix < client->ipaddr.prefix)) node = node->child[TRIE_BIT(key, node->prefix)];
+	if (!node || (node->prefix != client->ipaddr.prefix)) return;
+
+	num = talloc_array_length(node->clients);
+	for (i = 0; i < num; i++) {
+		if (node->clients[i] != client) continue;
+
+		memmove(&node->clients[i], &node->clients[i + 1], sizeof(node->clients[0]) * (num - i - 1));
+		if (num == 1) {
+			TALLOC_FREE(node->clients);
+		} else {
+			node->clients = talloc_realloc(node, node->clients, RADCLIENT *, num - 1);
+		}
+		return;
+	}
+}
+#endif
+
+/*
+ *	Find the client with the longest prefix matching ipaddr.
+ */
+static RADCLIENT *client_trie_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr, int proto)
+{
+	client_trie_node_t	*node;
+	uint8_t const		*key;
+	RADCLIENT		*found = NULL;
+	int			max_prefix;
+
+	key = client_trie_key(ipaddr);
+	if (!key) return NULL;
+
+	if (ipaddr->af == AF_INET) {
+		node = clients->trie_v4;
+		max_prefix = 32;
+	} else {
+		node = clients->trie_v6;
+		max_prefix = 128;
+	}
+
+	for (; node; node = node->child[TRIE_BIT(key, node->prefix)]) {
+		size_t i, num;
+
+		if (client_trie_common(node->key, key, node->prefix) < node->prefix) break;
+
+		num = talloc_array_length(node->clients);
+		for (i = 0; i < num; i++) {
+			RADCLIENT *client = node->clients[i];
+
+			if ((ipaddr->af == AF_INET6) && (client->ipaddr.zone_id != ipaddr->zone_id)) continue;
+#ifdef WITH_TCP
+			if ((client->proto != IPPROTO_IP) && (proto != IPPROTO_IP) && (client->proto != proto)) continue;
+#endif
+			found = client;
+			break;
+		}
+
+		if (node->prefix >= max_prefix) break;
+	}
+
+	return found;
+}
+
 /*
  *	Free a RADCLIENT list.
  */
@@ -148,10 +385,12 @@ void client_list_free(RADCLIENT_LIST *clients)
 		if (clients->trees[i]) rbtree_free(clients->trees[i]);
 		clients->trees[i] = NULL;
 	}
+	clients->trie_v4 = NULL;
+	clients->trie_v6 = NULL;
 
 	if (clients == root_clients) {
 #ifdef WITH_STATS
-		if (tree_num) rbtree_free(tree_num);
+		if (tree_num) fr_hash_rcu_free(tree_num);
 		tree_num = NULL;
 		tree_num_max = 0;
 #endif
@@ -176,8 +415,6 @@ RADCLIENT_LIST *client_list_init(CONF_SECTION *cs)
 
 	if (!clients) return NULL;
 
-	clients->min_prefix = 128;
-
 	return clients;
 }
 
@@ -332,9 +569,14 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 		return false;
 	}
 
+	if (!client_trie_insert(clients, client)) {
+		rbtree_deletebydata(clients->trees[client->ipaddr.prefix], client);
+		return false;
+	}
+
 #ifdef WITH_STATS
 	if (!tree_num) {
-		tree_num = rbtree_create(clients, client_num_cmp, NULL, 0);
+		tree_num = fr_hash_rcu_create(clients, client_num_hash, client_num_cmp, NULL);
 	}
 
 #ifdef WITH_DYNAMIC_CLIENTS
@@ -361,13 +603,9 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 
 	client->number = tree_num_max;
 	tree_num_max++;
-	if (tree_num) rbtree_insert(tree_num, client);
+	if (tree_num) fr_hash_rcu_insert(tree_num, client);
 #endif
 
-	if (client->ipaddr.prefix < clients->min_prefix) {
-		clients->min_prefix = client->ipaddr.prefix;
-	}
-
 	(void) talloc_steal(clients, client); /* reparent it */
 
 	return true;
@@ -388,9 +626,166 @@ void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 	client->dynamic = 2;	/* signal to client_free */
 
 #ifdef WITH_STATS
-	rbtree_deletebydata(tree_num, client);
+	fr_hash_rcu_delete(tree_num, client);
 #endif
 	rbtree_deletebydata(clients->trees[client->ipaddr.prefix], client);
+	client_trie_delete(clients, client);
+}
+#endif
+
+#ifdef WITH_DYNAMIC_CLIENTS
+static uint32_t client_lookup_hash(void const *data)
+{
+	client_lookup_entry_t const *entry = data;
+
+	if (entry->ipaddr.af == AF_INET) {
+		return fr_hash(&entry->ipaddr.ipaddr.ip4addr, sizeof(entry->ipaddr.ipaddr.ip4addr));
+	}
+
+	return fr_hash(&entry->ipaddr.ipaddr.ip6addr, sizeof(entry->ipaddr.ipaddr.ip6addr));
+}
+
+static int client_lookup_cmp(void const *one, void const *two)
+{
+	client_lookup_entry_t const *a = one, *b = two;
+
+	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+}
+
+static void _client_lookup_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+static int _client_lookup_free(client_lookup_t *lookup)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&lookup->mutex);
+#endif
+	return 0;
+}
+
+static client_lookup_t *client_lookup_alloc(TALLOC_CTX *ctx)
+{
+	client_lookup_t *lookup;
+
+	lookup = talloc_zero(ctx, client_lookup_t);
+	if (!lookup) return NULL;
+
+	lookup->ht = fr_hash_table_create(lookup, client_lookup_hash, client_lookup_cmp, _client_lookup_entry_free);
+	if (!lookup->ht) {
+		talloc_free(lookup);
+		return NULL;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&lookup->mutex, NULL);
+#endif
+	talloc_set_destructor(lookup, _client_lookup_free);
+
+	return lookup;
+}
+
+/*
+ *	Forget negative entries which have expired.
+ */
+static void client_lookup_expire(client_lookup_t *lookup, time_t now)
+{
+	client_lookup_entry_t *entry;
+
+	while ((entry = lookup->head) && (entry->expires <= now)) {
+		lookup->head = entry->next;
+		if (!lookup->head) lookup->tail = NULL;
+
+		fr_hash_table_delete(lookup->ht, entry);
+	}
+}
+
+/** See if a source should be looked up through the dynamic_clients virtual server
+ *
+ * Sources for which no client was found recently, or which are already
+ * being looked up, are ignored.  So are sources over the network's
+ * max_lookups rate.  If this function returns true, the caller must
+ * call client_lookup_done() when the lookup has finished.
+ *
+ * @param[in] network	the enclosing network, with a dynamic_clients virtual server.
+ * @param[in] ipaddr	of the source.
+ * @return
+ *	- true if the source should be looked up.
+ *	- false if it should be ignored.
+ */
+bool client_lookup_start(RADCLIENT *network, fr_ipaddr_t const *ipaddr)
+{
+	client_lookup_t		*lookup = network->lookup;
+	client_lookup_entry_t	find, *entry;
+	struct timeval		now;
+	bool			rcode = false;
+
+	if (!lookup) return true;
+
+	gettimeofday(&now, NULL);
+
+	PTHREAD_MUTEX_LOCK(&lookup->mutex);
+
+	client_lookup_expire(lookup, now.tv_sec);
+
+	find.ipaddr = *ipaddr;
+	if (fr_hash_table_finddata(lookup->ht, &find)) goto done;
+
+	if (!rad_token_bucket_take(&network->lookup_limit, &now)) goto done;
+
+	entry = talloc_zero(NULL, client_lookup_entry_t);
+	if (!entry) goto done;
+	entry->ipaddr = *ipaddr;
+
+	if (!fr_hash_table_insert(lookup->ht, entry)) {
+		talloc_free(entry);
+		goto done;
+	}
+
+	rcode = true;
+
+done:
+	PTHREAD_MUTEX_UNLOCK(&lookup->mutex);
+
+	return rcode;
+}
+
+/** Finish looking up a source through the dynamic_clients virtual server
+ *
+ * @param[in] network	the enclosing network, as passed to client_lookup_start().
+ * @param[in] ipaddr	of the source.
+ * @param[in] found	whether a client was created for the source.  If not,
+ *			packets from it are ignored for negative_lifetime seconds.
+ */
+void client_lookup_done(RADCLIENT *network, fr_ipaddr_t const *ipaddr, bool found)
+{
+	client_lookup_t		*lookup = network->lookup;
+	client_lookup_entry_t	find, *entry;
+
+	if (!lookup) return;
+
+	PTHREAD_MUTEX_LOCK(&lookup->mutex);
+
+	find.ipaddr = *ipaddr;
+	entry = fr_hash_table_finddata(lookup->ht, &find);
+	if (!entry || entry->expires) goto done;
+
+	if (found || !network->negative_lifetime) {
+		fr_hash_table_delete(lookup->ht, entry);
+		goto done;
+	}
+
+	entry->expires = time(NULL) + network->negative_lifetime;
+	if (lookup->tail) {
+		lookup->tail->next = entry;
+	} else {
+		lookup->head = entry;
+	}
+	lookup->tail = entry;
+
+done:
+	PTHREAD_MUTEX_UNLOCK(&lookup->mutex);
 }
 #endif
 
@@ -412,7 +807,7 @@ RADCLIENT *client_findbynumber(RADCLIENT_LIST const *clients, int number)
 
 		myclient.number = number;
 
-		return rbtree_finddata(tree_num, &myclient);
+		return fr_hash_rcu_finddata(tree_num, &myclient);
 	}
 
 	return NULL;
@@ -425,45 +820,41 @@ RADCLIENT *client_findbynumber(UNUSED const RADCLIENT_LIST *clients, UNUSED int
 #endif
 
 
-/*
- *	Find a client in the RADCLIENTS list.
+/** Call a function for every client in a list
+ *
+ * @param clients	to walk.  NULL means the global clients.
+ * @param callback	called with ctx, and each RADCLIENT.  Stops the walk
+ *			by returning non-zero.
+ * @param ctx		to pass to the callback.
+ * @return 0, or whatever the callback returned to stop the walk.
  */
-RADCLIENT *client_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr, int proto)
+int client_list_walk(RADCLIENT_LIST const *clients, rb_walker_t callback, void *ctx)
 {
-	int32_t i, max_prefix;
-	RADCLIENT myclient;
+	int i, rcode;
 
 	if (!clients) clients = root_clients;
+	if (!clients) return 0;
 
-	if (!clients || !ipaddr) return NULL;
-
-	switch (ipaddr->af) {
-	case AF_INET:
-		max_prefix = 32;
-		break;
-
-	case AF_INET6:
-		max_prefix = 128;
-		break;
+	for (i = 0; i <= 128; i++) {
+		if (!clients->trees[i]) continue;
 
-	default :
-		return NULL;
+		rcode = rbtree_walk(clients->trees[i], RBTREE_IN_ORDER, callback, ctx);
+		if (rcode != 0) return rcode;
 	}
 
-	for (i = max_prefix; i >= (int32_t) clients->min_prefix; i--) {
-		void *data;
-
-		if (!clients->trees[i]) continue;
+	return 0;
+}
 
-		myclient.ipaddr = *ipaddr;
-		myclient.proto = proto;
-		fr_ipaddr_mask(&myclient.ipaddr, i);
+/*
+ *	Find a client in the RADCLIENTS list.
+ */
+RADCLIENT *client_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr, int proto)
+{
+	if (!clients) clients = root_clients;
 
-		data = rbtree_finddata(clients->trees[i], &myclient);
-		if (data) return data;
-	}
+	if (!clients || !ipaddr) return NULL;
 
-	return NULL;
+	return client_trie_find(clients, ipaddr, proto);
 }
 
 /*
@@ -509,6 +900,10 @@ static const CONF_PARSER client_config[] = {
 	{ FR_CONF_OFFSET("password", PW_TYPE_STRING, RADCLIENT, password) },
 	{ FR_CONF_OFFSET("virtual_server", PW_TYPE_STRING, RADCLIENT, server) },
 	{ FR_CONF_OFFSET("response_window", PW_TYPE_TIMEVAL, RADCLIENT, response_window) },
+	{ FR_CONF_OFFSET("low_priority", PW_TYPE_BOOLEAN, RADCLIENT, low_priority), .dflt = "no" },
+	{ FR_CONF_OFFSET("queue_weight", PW_TYPE_INTEGER, RADCLIENT, queue_weight), .dflt = "1" },
+	{ FR_CONF_OFFSET("max_pps", PW_TYPE_INTEGER, RADCLIENT, pps_limit.rate), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_pps_burst", PW_TYPE_INTEGER, RADCLIENT, pps_limit.burst), .dflt = "0" },
 
 #ifdef WITH_TCP
 	{ FR_CONF_POINTER("proto", PW_TYPE_STRING, &hs_proto) },
@@ -519,6 +914,10 @@ static const CONF_PARSER client_config[] = {
 	{ FR_CONF_OFFSET("dynamic_clients", PW_TYPE_STRING, RADCLIENT, client_server) },
 	{ FR_CONF_OFFSET("lifetime", PW_TYPE_INTEGER, RADCLIENT, lifetime) },
 	{ FR_CONF_OFFSET("rate_limit", PW_TYPE_BOOLEAN, RADCLIENT, rate_limit) },
+	{ FR_CONF_OFFSET("negative_lifetime", PW_TYPE_INTEGER, RADCLIENT, negative_lifetime), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_lookups", PW_TYPE_INTEGER, RADCLIENT, lookup_limit.rate), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_lookups_burst", PW_TYPE_INTEGER, RADCLIENT, lookup_limit.burst), .dflt = "0" },
+	{ FR_CONF_OFFSET("asynchronous", PW_TYPE_BOOLEAN, RADCLIENT, lookup_async), .dflt = "no" },
 #endif
 	CONF_PARSER_TERMINATOR
 };
@@ -994,6 +1393,14 @@ RADCLIENT *client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, bool in_server, bo
 		FR_TIMEVAL_BOUND_CHECK("response_window", &c->response_window, <=, main_config.max_request_time, 0);
 	}
 
+	FR_INTEGER_BOUND_CHECK("queue_weight", c->queue_weight, >=, 1);
+	FR_INTEGER_BOUND_CHECK("queue_weight", c->queue_weight, <=, 1000);
+
+	if (c->pps_limit.rate) {
+		FR_INTEGER_BOUND_CHECK("max_pps", c->pps_limit.rate, <=, 1000000);
+		if (c->pps_limit.burst) FR_INTEGER_BOUND_CHECK("max_pps_burst", c->pps_limit.burst, <=, 1000000);
+	}
+
 #ifdef WITH_DYNAMIC_CLIENTS
 	if (c->client_server) {
 		c->secret = talloc_typed_strdup(c, "testing123");
@@ -1004,6 +1411,24 @@ RADCLIENT *client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, bool in_server, bo
 			goto error;
 		}
 
+		FR_INTEGER_BOUND_CHECK("negative_lifetime", c->negative_lifetime, <=, 86400);
+		if (c->lookup_limit.rate) {
+			FR_INTEGER_BOUND_CHECK("max_lookups", c->lookup_limit.rate, <=, 1000000);
+			if (c->lookup_limit.burst) {
+				FR_INTEGER_BOUND_CHECK("max_lookups_burst", c->lookup_limit.burst, <=, 1000000);
+			}
+		}
+
+#ifndef HAVE_PTHREAD_H
+		if (c->lookup_async) {
+			WARN("Setting 'asynchronous' requires threads.  Disabling 'asynchronous'");
+			c->lookup_async = false;
+		}
+#endif
+
+		c->lookup = client_lookup_alloc(c);
+		if (!c->lookup) goto error;
+
 		return c;
 	}
 #endif
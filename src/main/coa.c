@@ -0,0 +1,647 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file coa.c
+ * @brief Send large numbers of CoA and Disconnect requests.
+ *
+ * CoA requests originated by a request each get a child request, a proxy
+ * ID, and their own retransmit timer.  That's fine for one or two packets,
+ * but not for the tens of thousands of Disconnect-Requests which follow a
+ * policy change.
+ *
+ * Packets queued here are sent by the main thread.  Each home server has
+ * a queue, a socket, and one timer, which paces new packets to the home
+ * server's "bulk_rate" and retransmits the ones which haven't been
+ * answered.  Packets are sent in batches where the system allows it.
+ * Replies are counted, but no policies are run for them.
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/process.h>
+#include <freeradius-devel/udp.h>
+#include <freeradius-devel/rad_assert.h>
+
+#ifdef WITH_COA
+
+#ifdef HAVE_PTHREAD_H
+#  define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#  define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#  define PTHREAD_MUTEX_LOCK(_x)
+#  define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+/*
+ *	How often to look at the queue, in microseconds, when it's
+ *	waiting for the rate limit or for free IDs.
+ */
+#define COA_BULK_TICK		(10 * 1000)
+
+/*
+ *	Each home server gets one socket, so this many packets can
+ *	be outstanding.
+ */
+#define COA_BULK_IDS		(256)
+
+/*
+ *	Packets which are sent together with sendmmsg().
+ */
+#define COA_BULK_BATCH		(64)
+
+#define MAX_PACKET_LEN		(4096)
+
+#undef USEC
+#define USEC			(1000000)
+
+/** A packet in the queue, or waiting for a reply
+ *
+ */
+typedef struct coa_bulk_entry_t {
+	RADIUS_PACKET		*packet;
+	struct timeval		first;		//!< When the packet was first sent.
+	struct timeval		next;		//!< When to retransmit it.
+	uint32_t		rt;		//!< Current retransmission interval, in microseconds.
+	uint32_t		tries;		//!< Number of times the packet has been sent.
+} coa_bulk_entry_t;
+
+/** The queue and outstanding packets for one home server
+ *
+ * The queue is shared with the threads which add packets.  Everything
+ * else is only used by the main thread.
+ */
+struct coa_bulk_t {
+	home_server_t		*home;
+	int			sockfd;
+	bool			registered;	//!< sockfd has been added to the event loop.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;		//!< Protects queue, scheduled and stats.
+#endif
+	fr_fifo_t		*queue;		//!< Packets which haven't been sent yet.
+	bool			scheduled;	//!< The main thread will look at the queue.
+	struct coa_bulk_t	*next;		//!< In the list of queues to wake up.
+
+	fr_event_t		*ev;
+	coa_bulk_entry_t	*outstanding[COA_BULK_IDS];
+	uint32_t		num_outstanding;
+	uint32_t		next_id;
+
+#ifdef HAVE_SENDMMSG
+	udp_send_batch_t	*batch;
+#endif
+
+	coa_bulk_stats_t	stats;
+};
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	coa_bulk_mutex = PTHREAD_MUTEX_INITIALIZER;	//!< Protects coa_bulk_wake_list,
+									//!< and home->coa_bulk.
+#endif
+static coa_bulk_t	*coa_bulk_wake_list = NULL;
+
+static void coa_bulk_run(void *ctx, struct timeval *now);
+
+static void tv_add(struct timeval *tv, int usec_delay)
+{
+	if (usec_delay >= USEC) {
+		tv->tv_sec += usec_delay / USEC;
+		usec_delay %= USEC;
+	}
+	tv->tv_usec += usec_delay;
+
+	if (tv->tv_usec >= USEC) {
+		tv->tv_sec += tv->tv_usec / USEC;
+		tv->tv_usec %= USEC;
+	}
+}
+
+static void _coa_bulk_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+static int _coa_bulk_free(coa_bulk_t *bulk)
+{
+	if (bulk->sockfd >= 0) close(bulk->sockfd);
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&bulk->mutex);
+#endif
+
+	return 0;
+}
+
+/** Get the queue for a home server, creating it if necessary
+ *
+ */
+static coa_bulk_t *coa_bulk_get(home_server_t *home)
+{
+	coa_bulk_t *bulk;
+
+	PTHREAD_MUTEX_LOCK(&coa_bulk_mutex);
+	bulk = home->coa_bulk;
+	if (bulk) goto done;
+
+	bulk = talloc_zero(home, coa_bulk_t);
+	if (!bulk) goto done;
+
+	bulk->home = home;
+	bulk->sockfd = -1;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&bulk->mutex, NULL);
+#endif
+	talloc_set_destructor(bulk, _coa_bulk_free);
+
+	bulk->queue = fr_fifo_create(bulk, home->coa_bulk_queue, _coa_bulk_entry_free);
+	if (!bulk->queue) {
+	error:
+		talloc_free(bulk);
+		bulk = NULL;
+		goto done;
+	}
+
+	bulk->sockfd = fr_socket(&home->src_ipaddr, 0);
+	if (bulk->sockfd < 0) {
+		ERROR("Failed opening socket for CoA requests to home server %s: %s",
+		      home->log_name, fr_strerror());
+		goto error;
+	}
+
+#ifdef HAVE_SENDMMSG
+	/*
+	 *	If this fails, we send one packet at a time.
+	 */
+	bulk->batch = udp_send_batch_alloc(bulk, COA_BULK_BATCH, MAX_PACKET_LEN);
+#endif
+
+	home->coa_bulk = bulk;
+
+done:
+	PTHREAD_MUTEX_UNLOCK(&coa_bulk_mutex);
+
+	return bulk;
+}
+
+/** Queue a CoA or Disconnect request to be sent to a home server
+ *
+ * May be called from any thread.  The attributes are copied.
+ *
+ * @param[in] home to send the packet to.  Must be a CoA home server
+ *	using UDP.
+ * @param[in] code PW_CODE_COA_REQUEST or PW_CODE_DISCONNECT_REQUEST.
+ * @param[in] vps to put in the packet.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, including if the queue is full.
+ */
+int coa_bulk_enqueue(home_server_t *home, PW_CODE code, VALUE_PAIR *vps)
+{
+	coa_bulk_t		*bulk;
+	coa_bulk_entry_t	*entry;
+	bool			wake = false;
+
+	if ((code != PW_CODE_COA_REQUEST) && (code != PW_CODE_DISCONNECT_REQUEST)) {
+		fr_strerror_printf("Invalid packet code %u", code);
+		return -1;
+	}
+
+	if (home->server || (home->type != HOME_TYPE_COA)
+#ifdef WITH_TCP
+	    || (home->proto != IPPROTO_UDP)
+#endif
+	    ) {
+		fr_strerror_printf("Home server %s is not a UDP CoA home server", home->log_name);
+		return -1;
+	}
+
+	bulk = coa_bulk_get(home);
+	if (!bulk) {
+		fr_strerror_printf("Failed creating queue for home server %s", home->log_name);
+		return -1;
+	}
+
+	entry = talloc_zero(NULL, coa_bulk_entry_t);
+	if (!entry) {
+	oom:
+		talloc_free(entry);
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	entry->packet = fr_radius_alloc(entry, true);
+	if (!entry->packet) goto oom;
+
+	entry->packet->code = code;
+	entry->packet->sockfd = bulk->sockfd;
+	entry->packet->dst_ipaddr = home->ipaddr;
+	entry->packet->dst_port = home->port;
+	entry->packet->src_ipaddr = home->src_ipaddr;
+
+	if (vps) {
+		entry->packet->vps = fr_pair_list_copy(entry->packet, vps);
+		if (!entry->packet->vps) goto oom;
+	}
+
+	PTHREAD_MUTEX_LOCK(&bulk->mutex);
+	if (!fr_fifo_push(bulk->queue, entry)) {
+		bulk->stats.dropped++;
+		PTHREAD_MUTEX_UNLOCK(&bulk->mutex);
+
+		talloc_free(entry);
+		fr_strerror_printf("Queue for home server %s is full (%u packets)", home->log_name,
+				   home->coa_bulk_queue);
+		return -1;
+	}
+	bulk->stats.queued++;
+
+	if (!bulk->scheduled) {
+		bulk->scheduled = true;
+		wake = true;
+	}
+	PTHREAD_MUTEX_UNLOCK(&bulk->mutex);
+
+	if (!wake) return 0;
+
+	/*
+	 *	Only the main thread can add timers, so ask it to
+	 *	start sending.
+	 */
+	PTHREAD_MUTEX_LOCK(&coa_bulk_mutex);
+	bulk->next = coa_bulk_wake_list;
+	coa_bulk_wake_list = bulk;
+	PTHREAD_MUTEX_UNLOCK(&coa_bulk_mutex);
+
+	radius_signal_self(RADIUS_SIGNAL_SELF_COA);
+
+	return 0;
+}
+
+/** Get the statistics for a home server's queue
+ *
+ * @param[out] stats where to write the statistics.
+ * @param[in] home to get the statistics for.
+ * @return
+ *	- 0 on success.
+ *	- -1 if nothing has been queued for the home server.
+ */
+int coa_bulk_stats(coa_bulk_stats_t *stats, home_server_t *home)
+{
+	coa_bulk_t *bulk;
+
+	PTHREAD_MUTEX_LOCK(&coa_bulk_mutex);
+	bulk = home->coa_bulk;
+	PTHREAD_MUTEX_UNLOCK(&coa_bulk_mutex);
+
+	if (!bulk) return -1;
+
+	PTHREAD_MUTEX_LOCK(&bulk->mutex);
+	*stats = bulk->stats;
+	stats->pending = fr_fifo_num_elements(bulk->queue);
+	PTHREAD_MUTEX_UNLOCK(&bulk->mutex);
+
+	return 0;
+}
+
+/*
+ *	Send (or queue for sending) one packet.
+ */
+static void coa_bulk_send(coa_bulk_t *bulk, RADIUS_PACKET *packet)
+{
+#ifdef HAVE_SENDMMSG
+	if (bulk->batch) {
+		if (udp_send_batch_add(bulk->sockfd, bulk->batch, packet->data, packet->data_len,
+				       &packet->src_ipaddr, 0, 0,
+				       &packet->dst_ipaddr, packet->dst_port) < 0) {
+			RATE_LIMIT(ERROR("Failed sending CoA request to home server %s: %s",
+					 bulk->home->log_name, fr_strerror()));
+		}
+		return;
+	}
+#endif
+
+	if (udp_send(bulk->sockfd, packet->data, packet->data_len, UDP_FLAGS_NONE,
+		     &packet->src_ipaddr, 0, 0, &packet->dst_ipaddr, packet->dst_port) < 0) {
+		RATE_LIMIT(ERROR("Failed sending CoA request to home server %s: %s",
+				 bulk->home->log_name, fr_syserror(errno)));
+	}
+}
+
+/*
+ *	Send the packets queued by coa_bulk_send().
+ */
+static void coa_bulk_flush(coa_bulk_t *bulk)
+{
+#ifdef HAVE_SENDMMSG
+	if (bulk->batch && udp_send_batch_pending(bulk->batch) &&
+	    (udp_send_batch_flush(bulk->batch) < 0)) {
+		RATE_LIMIT(ERROR("Failed sending CoA requests to home server %s: %s",
+				 bulk->home->log_name, fr_strerror()));
+	}
+#else
+	(void) bulk;
+#endif
+}
+
+/*
+ *	Release an outstanding packet's ID.
+ */
+static void coa_bulk_done(coa_bulk_t *bulk, int id)
+{
+	talloc_free(bulk->outstanding[id]);
+	bulk->outstanding[id] = NULL;
+	bulk->num_outstanding--;
+}
+
+/*
+ *	Read replies.  They're matched to the outstanding packets by
+ *	ID, and then counted.
+ */
+static void coa_bulk_recv(UNUSED fr_event_list_t *el, int fd, void *ctx)
+{
+	coa_bulk_t		*bulk = talloc_get_type_abort(ctx, coa_bulk_t);
+	coa_bulk_entry_t	*entry;
+	RADIUS_PACKET		*reply;
+	bool			ack;
+
+	reply = fr_radius_recv(NULL, fd, 0);
+	if (!reply) return;
+
+	entry = bulk->outstanding[reply->id];
+	if (!entry ||
+	    (fr_ipaddr_cmp(&reply->src_ipaddr, &bulk->home->ipaddr) != 0) ||
+	    (reply->src_port != bulk->home->port)) {
+		RATE_LIMIT(WARN("Ignoring unexpected reply from home server %s - ID: %d",
+				bulk->home->log_name, reply->id));
+		goto done;
+	}
+
+	switch (reply->code) {
+	case PW_CODE_COA_ACK:
+	case PW_CODE_DISCONNECT_ACK:
+		ack = true;
+		break;
+
+	case PW_CODE_COA_NAK:
+	case PW_CODE_DISCONNECT_NAK:
+		ack = false;
+		break;
+
+	default:
+		RATE_LIMIT(WARN("Ignoring reply with invalid code %d from home server %s",
+				reply->code, bulk->home->log_name));
+		goto done;
+	}
+
+	if (fr_radius_verify(reply, entry->packet, bulk->home->secret) < 0) {
+		RATE_LIMIT(WARN("Ignoring reply from home server %s: %s", bulk->home->log_name, fr_strerror()));
+		goto done;
+	}
+
+	coa_bulk_done(bulk, reply->id);
+
+	PTHREAD_MUTEX_LOCK(&bulk->mutex);
+	if (ack) {
+		bulk->stats.acks++;
+	} else {
+		bulk->stats.naks++;
+	}
+	bulk->stats.outstanding = bulk->num_outstanding;
+	PTHREAD_MUTEX_UNLOCK(&bulk->mutex);
+
+done:
+	fr_radius_free(&reply);
+}
+
+/*
+ *	Retransmit the outstanding packets which are due, and time
+ *	out the ones which have been sent too often, or for too long.
+ *	RFC 5080 Section 2.2.1, without the jitter.  The packets were
+ *	sent in batches, so they're already spread out.
+ */
+static void coa_bulk_retransmit(coa_bulk_t *bulk, struct timeval *now, struct timeval *when)
+{
+	int		id;
+	home_server_t	*home = bulk->home;
+	uint32_t	timeouts = 0, retransmits = 0;
+
+	for (id = 0; id < COA_BULK_IDS; id++) {
+		coa_bulk_entry_t	*entry = bulk->outstanding[id];
+		struct timeval		mrd;
+
+		if (!entry) continue;
+
+		if (timercmp(&entry->next, now, >)) {
+			if (!timerisset(when) || timercmp(&entry->next, when, <)) *when = entry->next;
+			continue;
+		}
+
+		mrd = entry->first;
+		mrd.tv_sec += home->coa_mrd;
+
+		if ((home->coa_mrc && (entry->tries >= home->coa_mrc)) || !timercmp(now, &mrd, <)) {
+			coa_bulk_done(bulk, id);
+			timeouts++;
+			continue;
+		}
+
+		entry->rt *= 2;
+		if (home->coa_mrt && (entry->rt > (home->coa_mrt * USEC))) entry->rt = home->coa_mrt * USEC;
+
+		entry->next = *now;
+		tv_add(&entry->next, entry->rt);
+		if (timercmp(&mrd, &entry->next, <)) entry->next = mrd;
+		if (!timerisset(when) || timercmp(&entry->next, when, <)) *when = entry->next;
+
+		entry->tries++;
+		retransmits++;
+		coa_bulk_send(bulk, entry->packet);
+	}
+
+	if (timeouts) {
+		RATE_LIMIT(WARN("%u CoA requests to home server %s received no reply", timeouts, home->log_name));
+	}
+
+	PTHREAD_MUTEX_LOCK(&bulk->mutex);
+	bulk->stats.timeouts += timeouts;
+	bulk->stats.retransmits += retransmits;
+	PTHREAD_MUTEX_UNLOCK(&bulk->mutex);
+}
+
+/*
+ *	Find a free ID.  There must be one.
+ */
+static int coa_bulk_id_alloc(coa_bulk_t *bulk)
+{
+	int i;
+
+	for (i = 0; i < COA_BULK_IDS; i++) {
+		int id = (bulk->next_id + i) & (COA_BULK_IDS - 1);
+
+		if (bulk->outstanding[id]) continue;
+
+		/*
+		 *	Re-use IDs as late as possible.
+		 */
+		bulk->next_id = id + 1;
+		return id;
+	}
+
+	rad_assert(0 == 1);
+	return -1;
+}
+
+/*
+ *	Send new packets, as far as the rate limit and the free IDs
+ *	allow.
+ *
+ *	Returns true if there are still packets in the queue.
+ */
+static bool coa_bulk_send_new(coa_bulk_t *bulk, struct timeval *now, struct timeval *when)
+{
+	home_server_t		*home = bulk->home;
+	coa_bulk_entry_t	*entry;
+	uint32_t		sent = 0;
+	bool			more;
+
+	while (bulk->num_outstanding < COA_BULK_IDS) {
+		int id;
+
+		if (!rad_token_bucket_take(&home->coa_bulk_limit, now)) break;
+
+		PTHREAD_MUTEX_LOCK(&bulk->mutex);
+		entry = fr_fifo_pop(bulk->queue);
+		PTHREAD_MUTEX_UNLOCK(&bulk->mutex);
+		if (!entry) break;
+
+		id = coa_bulk_id_alloc(bulk);
+		entry->packet->id = id;
+
+		if ((fr_radius_encode(entry->packet, NULL, home->secret) < 0) ||
+		    (fr_radius_sign(entry->packet, NULL, home->secret) < 0)) {
+			RATE_LIMIT(ERROR("Failed encoding CoA request for home server %s: %s",
+					 home->log_name, fr_strerror()));
+			talloc_free(entry);
+			continue;
+		}
+
+		entry->first = *now;
+		entry->rt = home->coa_irt * USEC;
+		entry->next = *now;
+		tv_add(&entry->next, entry->rt);
+		if (!timerisset(when) || timercmp(&entry->next, when, <)) *when = entry->next;
+		entry->tries = 1;
+
+		bulk->outstanding[id] = entry;
+		bulk->num_outstanding++;
+		sent++;
+
+		coa_bulk_send(bulk, entry->packet);
+	}
+
+	PTHREAD_MUTEX_LOCK(&bulk->mutex);
+	bulk->stats.sent += sent;
+	bulk->stats.outstanding = bulk->num_outstanding;
+	more = (fr_fifo_num_elements(bulk->queue) > 0);
+
+	/*
+	 *	Nothing left to do.  The next packet to be queued
+	 *	will wake us up again.
+	 */
+	if (!more && !bulk->num_outstanding) bulk->scheduled = false;
+	PTHREAD_MUTEX_UNLOCK(&bulk->mutex);
+
+	return more;
+}
+
+/*
+ *	The timer for a home server's queue.
+ */
+static void coa_bulk_run(void *ctx, struct timeval *now)
+{
+	coa_bulk_t	*bulk = talloc_get_type_abort(ctx, coa_bulk_t);
+	fr_event_list_t	*el = radius_event_list_corral(EVENT_CORRAL_MAIN);
+	struct timeval	when;
+	bool		more;
+
+	fr_event_now(el, now);
+
+	timerclear(&when);
+	coa_bulk_retransmit(bulk, now, &when);
+	more = coa_bulk_send_new(bulk, now, &when);
+	coa_bulk_flush(bulk);
+
+	/*
+	 *	Packets are waiting for the rate limit, or for free
+	 *	IDs.  Look at them again soon.  Otherwise, wake up
+	 *	for the next retransmission.
+	 */
+	if (more) {
+		when = *now;
+		tv_add(&when, COA_BULK_TICK);
+
+	} else if (!bulk->num_outstanding) {
+		return;
+	}
+
+	if (!fr_event_insert(el, coa_bulk_run, bulk, &when, &bulk->ev)) {
+		ERROR("Failed inserting CoA queue timer for home server %s", bulk->home->log_name);
+	}
+}
+
+/** Start sending packets from the queues which have new packets
+ *
+ * Called by the main thread, after coa_bulk_enqueue() has signalled it.
+ */
+void coa_bulk_wake(void)
+{
+	coa_bulk_t	*bulk, *next;
+	fr_event_list_t	*el = radius_event_list_corral(EVENT_CORRAL_MAIN);
+	struct timeval	now;
+
+	PTHREAD_MUTEX_LOCK(&coa_bulk_mutex);
+	bulk = coa_bulk_wake_list;
+	coa_bulk_wake_list = NULL;
+	PTHREAD_MUTEX_UNLOCK(&coa_bulk_mutex);
+
+	for (; bulk != NULL; bulk = next) {
+		next = bulk->next;
+		bulk->next = NULL;
+
+		if (!bulk->registered) {
+			if (!fr_event_fd_insert(el, 0, bulk->sockfd, coa_bulk_recv, bulk)) {
+				ERROR("Failed adding CoA socket for home server %s to the event loop: %s",
+				      bulk->home->log_name, fr_strerror());
+				continue;
+			}
+			bulk->registered = true;
+		}
+
+		/*
+		 *	Already running.  It'll pick up the new
+		 *	packets on the next tick.
+		 */
+		if (bulk->ev) continue;
+
+		fr_event_now(el, &now);
+		coa_bulk_run(bulk, &now);
+	}
+}
+#endif	/* WITH_COA */
@@ -44,6 +44,7 @@
 #include <sys/stat.h>
 #endif
 
+#include <poll.h>
 #include <pwd.h>
 #include <grp.h>
 
@@ -103,6 +104,16 @@ typedef struct fr_command_socket_t {
 	RADCLIENT	*inject_client;
 
 	fr_cs_buffer_t  co;
+
+#ifdef WITH_STATS
+	/*
+	 *	For "stats subscribe".
+	 */
+	fr_event_t	*stats_ev;
+	uint32_t	stats_interval;
+	bool		stats_sent;	//!< Whether the totals have been sent.
+	fr_stats_t	stats_last[FR_STATS_GLOBAL_MAX];	//!< As of the last message.
+#endif
 } fr_command_socket_t;
 
 static const CONF_PARSER command_config[] = {
@@ -124,6 +135,7 @@ static FR_NAME_NUMBER mode_names[] = {
 
 static char debug_log_file_buffer[1024];
 extern fr_cond_t *debug_condition;
+extern fr_cond_t *trace_condition;
 extern fr_log_t debug_log;
 
 #if !defined(HAVE_GETPEEREID) && defined(SO_PEERCRED)
@@ -1292,6 +1304,29 @@ static int command_show_version(rad_listen_t *listener, UNUSED int argc, UNUSED
 	return CMD_OK;
 }
 
+#ifdef WITH_STATS
+static int command_debug_memory_accounting(rad_listen_t *listener, int argc, char *argv[])
+{
+	if (argc == 0) {
+		cprintf(listener, "%s\n", main_config.memory_accounting ? "on" : "off");
+		return CMD_OK;
+	}
+
+	if (strcmp(argv[0], "on") == 0) {
+		main_config.memory_accounting = true;
+
+	} else if (strcmp(argv[0], "off") == 0) {
+		main_config.memory_accounting = false;
+
+	} else {
+		cprintf_error(listener, "Syntax error: got '%s', expected [on|off]\n", argv[0]);
+		return CMD_FAIL;
+	}
+
+	return CMD_OK;
+}
+#endif
+
 static int command_debug_level(rad_listen_t *listener, int argc, char *argv[])
 {
 	int number;
@@ -1408,7 +1443,10 @@ static int command_debug_file(rad_listen_t *listener, int argc, char *argv[])
 	return CMD_OK;
 }
 
-static int command_debug_condition(rad_listen_t *listener, int argc, char *argv[])
+/*
+ *	Parse a condition given as arguments to a command.
+ */
+static int command_condition_parse(rad_listen_t *listener, int argc, char *argv[], fr_cond_t **out)
 {
 	int i;
 	char const *error;
@@ -1416,15 +1454,6 @@ static int command_debug_condition(rad_listen_t *listener, int argc, char *argv[
 	fr_cond_t *new_condition = NULL;
 	char *p, buffer[1024];
 
-	/*
-	 *	Disable it.
-	 */
-	if (argc == 0) {
-		TALLOC_FREE(debug_condition);
-		debug_condition = NULL;
-		return CMD_OK;
-	}
-
 	if (!((argc == 1) &&
 	      ((argv[0][0] == '"') || (argv[0][0] == '\'')))) {
 		p = buffer;
@@ -1501,6 +1530,26 @@ static int command_debug_condition(rad_listen_t *listener, int argc, char *argv[
 		return CMD_FAIL;
 	}
 
+	*out = new_condition;
+
+	return CMD_OK;
+}
+
+static int command_debug_condition(rad_listen_t *listener, int argc, char *argv[])
+{
+	fr_cond_t *new_condition = NULL;
+
+	/*
+	 *	Disable it.
+	 */
+	if (argc == 0) {
+		TALLOC_FREE(debug_condition);
+		debug_condition = NULL;
+		return CMD_OK;
+	}
+
+	if (command_condition_parse(listener, argc, argv, &new_condition) != CMD_OK) return CMD_FAIL;
+
 	/*
 	 *	Delete old condition.
 	 *
@@ -1513,6 +1562,245 @@ static int command_debug_condition(rad_listen_t *listener, int argc, char *argv[
 	return CMD_OK;
 }
 
+static int command_trace_condition(rad_listen_t *listener, int argc, char *argv[])
+{
+	fr_cond_t *new_condition = NULL;
+
+	if (argc == 0) {
+		TALLOC_FREE(trace_condition);
+		trace_condition = NULL;
+		return CMD_OK;
+	}
+
+	if (command_condition_parse(listener, argc, argv, &new_condition) != CMD_OK) return CMD_FAIL;
+
+	/*
+	 *	Thread-safe for the same reason as the debug condition.
+	 */
+	TALLOC_FREE(trace_condition);
+	trace_condition = new_condition;
+
+	return CMD_OK;
+}
+
+static int command_trace_dump(rad_listen_t *listener, int argc, char *argv[])
+{
+	char buffer[1024];
+	FILE *fp;
+	uint64_t count;
+
+	if (argc == 0) {
+		cprintf_error(listener, "Must specify <filename>\n");
+		return CMD_FAIL;
+	}
+
+	if (strchr(argv[0], FR_DIR_SEP) != NULL) {
+		cprintf_error(listener, "Cannot write trace to absolute path.\n");
+		return CMD_FAIL;
+	}
+
+	/*
+	 *	Traces always go to the logging directory.
+	 */
+	snprintf(buffer, sizeof(buffer), "%s/%s", radlog_dir, argv[0]);
+
+	fp = fopen(buffer, "w");
+	if (!fp) {
+		cprintf_error(listener, "Failed opening %s: %s\n", buffer, fr_syserror(errno));
+		return CMD_FAIL;
+	}
+
+	if (fr_trace_dump(fp, &count) < 0) {
+		cprintf_error(listener, "%s\n", fr_strerror());
+		fclose(fp);
+		return CMD_FAIL;
+	}
+	fclose(fp);
+
+	cprintf(listener, "Wrote %" PRIu64 " events to %s\n", count, buffer);
+
+	return CMD_OK;
+}
+
+#ifdef WITH_STATS
+static int command_profile_start(rad_listen_t *listener, int argc, char *argv[])
+{
+	unsigned long seconds, percent = 100;
+	char *end;
+
+	if (argc == 0) {
+		cprintf_error(listener, "Must specify <seconds>\n");
+		return CMD_FAIL;
+	}
+
+	seconds = strtoul(argv[0], &end, 10);
+	if (*end || (seconds == 0) || (seconds > 86400)) {
+		cprintf_error(listener, "Invalid <seconds> \"%s\".  Expected 1 to 86400\n", argv[0]);
+		return CMD_FAIL;
+	}
+
+	if (argc > 1) {
+		percent = strtoul(argv[1], &end, 10);
+		if (*end || (percent == 0) || (percent > 100)) {
+			cprintf_error(listener, "Invalid <percent> \"%s\".  Expected 1 to 100\n", argv[1]);
+			return CMD_FAIL;
+		}
+	}
+
+	if (fr_profile_start(seconds, percent) < 0) {
+		cprintf_error(listener, "%s\n", fr_strerror());
+		return CMD_FAIL;
+	}
+
+	cprintf(listener, "Profiling %lu%% of requests for %lu seconds\n", percent, seconds);
+
+	return CMD_OK;
+}
+
+static int command_profile_stop(UNUSED rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	fr_profile_stop();
+
+	return CMD_OK;
+}
+
+typedef struct command_profile_entry_t {
+	char const	*name;
+	uint64_t	count;
+	uint64_t	total;			//!< Microseconds.
+	uint64_t	usec[2];		//!< p50 and p99.
+} command_profile_entry_t;
+
+typedef struct command_profile_ctx_t {
+	command_profile_entry_t	*entries;
+	size_t			num;
+	size_t			alloced;
+} command_profile_ctx_t;
+
+static void command_profile_collect(void *ctx, char const *name, fr_stats_latency_t *lat)
+{
+	command_profile_ctx_t *p = ctx;
+	static double const pct[] = { 50, 99 };
+	command_profile_entry_t *entry;
+
+	if (p->num == p->alloced) {
+		command_profile_entry_t *entries;
+
+		entries = talloc_realloc(p, p->entries, command_profile_entry_t, p->alloced ? p->alloced * 2 : 64);
+		if (!entries) return;
+
+		p->entries = entries;
+		p->alloced = talloc_array_length(entries);
+	}
+
+	entry = &p->entries[p->num];
+	entry->count = fr_stats_latency_percentiles(lat, entry->usec, pct, 2);
+	if (!entry->count) return;
+
+	entry->name = name;
+	entry->total = fr_stats_latency_sum(lat);
+	p->num++;
+}
+
+static int command_profile_cmp_total(void const *one, void const *two)
+{
+	command_profile_entry_t const *a = one, *b = two;
+
+	if (a->total != b->total) return (a->total < b->total) ? +1 : -1;
+
+	return 0;
+}
+
+static int command_profile_cmp_p99(void const *one, void const *two)
+{
+	command_profile_entry_t const *a = one, *b = two;
+
+	if (a->usec[1] != b->usec[1]) return (a->usec[1] < b->usec[1]) ? +1 : -1;
+
+	return command_profile_cmp_total(one, two);
+}
+
+static int command_show_profile(rad_listen_t *listener, int argc, char *argv[])
+{
+	static char const *names[FR_PROFILE_MAX] = { "section", "module", "xlat", "query" };
+	static char const *headers[FR_PROFILE_MAX] = {
+		"server.section", "module.method", "xlat", "module: query"
+	};
+	bool show[FR_PROFILE_MAX] = { true, true, true, true };
+	bool by_p99 = false;
+	unsigned long limit = 10;
+	time_t until;
+	uint32_t percent;
+	int i, type;
+
+	for (i = 0; i < argc; i++) {
+		char *end;
+
+		for (type = 0; type < FR_PROFILE_MAX; type++) {
+			if (strcmp(argv[i], names[type]) == 0) break;
+		}
+
+		if (type < FR_PROFILE_MAX) {
+			memset(show, 0, sizeof(show));
+			show[type] = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "total") == 0) {
+			by_p99 = false;
+			continue;
+		}
+
+		if (strcmp(argv[i], "p99") == 0) {
+			by_p99 = true;
+			continue;
+		}
+
+		limit = strtoul(argv[i], &end, 10);
+		if (*end || (limit == 0)) {
+			cprintf_error(listener, "Unknown argument \"%s\".  Expected \"section\", \"module\", "
+				      "\"xlat\", \"query\", \"total\", \"p99\" or a count\n", argv[i]);
+			return CMD_FAIL;
+		}
+	}
+
+	if (fr_profile_running(&until, &percent)) {
+		cprintf(listener, "# Profiling %u%% of requests for another %ld seconds\n",
+			percent, (long) (until - time(NULL)));
+	} else {
+		cprintf(listener, "# Profiling is stopped\n");
+	}
+
+	for (type = 0; type < FR_PROFILE_MAX; type++) {
+		command_profile_ctx_t *p;
+		size_t j;
+
+		if (!show[type]) continue;
+
+		p = talloc_zero(NULL, command_profile_ctx_t);
+		if (!p) return CMD_FAIL;
+
+		fr_profile_walk(type, command_profile_collect, p);
+		if (p->num) {
+			qsort(p->entries, p->num, sizeof(*p->entries),
+			      by_p99 ? command_profile_cmp_p99 : command_profile_cmp_total);
+		}
+
+		cprintf(listener, "# %s\tusec\n", headers[type]);
+		for (j = 0; (j < p->num) && (j < limit); j++) {
+			command_profile_entry_t *entry = &p->entries[j];
+
+			cprintf(listener, "%s\tcount %" PRIu64 "\ttotal %" PRIu64 "\tp50 %" PRIu64 "\tp99 %" PRIu64 "\n",
+				entry->name, entry->count, entry->total, entry->usec[0], entry->usec[1]);
+		}
+
+		talloc_free(p);
+	}
+
+	return CMD_OK;
+}
+#endif
+
 #ifdef HAVE_GPERFTOOLS_PROFILER_H
 static char profiler_log_buffer[1024];
 /** Start the gperftools profiler
@@ -1665,6 +1953,22 @@ static int command_show_debug_condition(rad_listen_t *listener,
 }
 
 
+static int command_show_trace_condition(rad_listen_t *listener,
+					UNUSED int argc, UNUSED char *argv[])
+{
+	char buffer[1024];
+
+	if (!trace_condition) {
+		cprintf(listener, "\n");
+		return CMD_OK;
+	}
+
+	fr_cond_snprint(buffer, sizeof(buffer), trace_condition);
+
+	cprintf(listener, "%s\n", buffer);
+	return CMD_OK;
+}
+
 static int command_show_debug_file(rad_listen_t *listener,
 					UNUSED int argc, UNUSED char *argv[])
 {
@@ -2163,6 +2467,108 @@ static int command_inject_file(rad_listen_t *listener, int argc, char *argv[])
 }
 
 
+#if defined(WITH_PROXY) && defined(WITH_COA)
+/*
+ *	Get a home server which can take packets from coa_bulk_enqueue().
+ */
+static home_server_t *get_coa_home_server(rad_listen_t *listener, int argc, char *argv[], int *last)
+{
+	home_server_t *home;
+
+	home = get_home_server(listener, argc, argv, last);
+	if (!home) return NULL;
+
+	if ((home->type != HOME_TYPE_COA) || home->server
+#ifdef WITH_TCP
+	    || (home->proto != IPPROTO_UDP)
+#endif
+	    ) {
+		cprintf_error(listener, "Home server must be a UDP CoA home server\n");
+		return NULL;
+	}
+
+	return home;
+}
+
+static int command_coa_file(rad_listen_t *listener, int argc, char *argv[])
+{
+	int		last;
+	bool		filedone = false;
+	home_server_t	*home;
+	PW_CODE		code = PW_CODE_COA_REQUEST;
+	VALUE_PAIR	*vps;
+	FILE		*fp;
+	uint32_t	queued = 0, failed = 0;
+
+	if (argc < 3) {
+		cprintf_error(listener, "Must specify <ipaddr> <port> [udp] <input-file> [coa|disconnect]\n");
+		return 0;
+	}
+
+	home = get_coa_home_server(listener, argc, argv, &last);
+	if (!home) return 0;
+
+	if (last >= argc) {
+		cprintf_error(listener, "Must specify <input-file>\n");
+		return 0;
+	}
+
+	if ((last + 1) < argc) {
+		if (strcmp(argv[last + 1], "disconnect") == 0) {
+			code = PW_CODE_DISCONNECT_REQUEST;
+
+		} else if (strcmp(argv[last + 1], "coa") != 0) {
+			cprintf_error(listener, "Unknown packet type \"%s\"\n", argv[last + 1]);
+			return 0;
+		}
+	}
+
+	fp = fopen(argv[last], "r");
+	if (!fp) {
+		cprintf_error(listener, "Failed opening %s: %s\n", argv[last], fr_syserror(errno));
+		return 0;
+	}
+
+	/*
+	 *	One packet per block of attributes.  Blocks are
+	 *	separated by blank lines.
+	 */
+	while (!filedone) {
+		vps = NULL;
+		if (fr_pair_list_afrom_file(NULL, &vps, fp, &filedone) < 0) {
+			cprintf_error(listener, "Failed reading attributes from %s: %s\n", argv[last], fr_strerror());
+			break;
+		}
+		if (!vps) continue;
+
+		if (coa_bulk_enqueue(home, code, vps) < 0) {
+			failed++;
+		} else {
+			queued++;
+		}
+		fr_pair_list_free(&vps);
+	}
+	fclose(fp);
+
+	cprintf(listener, "queued\t%u\n", queued);
+	if (failed) {
+		cprintf_error(listener, "Failed queueing %u packets: %s\n", failed, fr_strerror());
+		return 0;
+	}
+
+	return CMD_OK;
+}
+
+static fr_command_table_t command_table_coa[] = {
+	{ "file", FR_WRITE,
+	  "coa file <ipaddr> <port> [udp] <input-file> [coa|disconnect] - Send a CoA or Disconnect request to the home server for each packet in <input-file>",
+	  command_coa_file, NULL },
+
+	{ NULL, 0, NULL, NULL, NULL }
+};
+#endif
+
+
 static fr_command_table_t command_table_inject[] = {
 	{ "to", FR_WRITE,
 	  "inject to <ipaddr> <port> - Inject packets to the destination IP and port.",
@@ -2188,6 +2594,12 @@ static fr_command_table_t command_table_debug[] = {
 	  "debug level <number> - Set debug level to <number>.  Higher is more debugging.",
 	  command_debug_level, NULL },
 
+#ifdef WITH_STATS
+	{ "memory_accounting", FR_WRITE,
+	  "debug memory_accounting [on|off] - Count the memory each module and virtual server leaves in requests.  This makes every module call slower.",
+	  command_debug_memory_accounting, NULL },
+#endif
+
 	{ "file", FR_WRITE,
 	  "debug file [filename] - Send all debugging output to [filename]",
 	  command_debug_file, NULL },
@@ -2201,6 +2613,18 @@ static fr_command_table_t command_table_debug[] = {
 	{ NULL, 0, NULL, NULL, NULL }
 };
 
+static fr_command_table_t command_table_trace[] = {
+	{ "condition", FR_WRITE,
+	  "trace condition [condition] - Record trace events for requests matching [condition]",
+	  command_trace_condition, NULL },
+
+	{ "dump", FR_WRITE,
+	  "trace dump <filename> - Write the recent trace events to <filename>, for radtrace",
+	  command_trace_dump, NULL },
+
+	{ NULL, 0, NULL, NULL, NULL }
+};
+
 #ifdef HAVE_GPERFTOOLS_PROFILER_H
 /** Commands to control the gperftools profiler
  *
@@ -2313,6 +2737,28 @@ static fr_command_table_t command_table_show_profiler[] = {
 };
 #endif
 
+static fr_command_table_t command_table_show_trace[] = {
+	{ "condition", FR_READ,
+	  "show trace condition - Shows current tracing condition.",
+	  command_show_trace_condition, NULL },
+
+	{ NULL, 0, NULL, NULL, NULL }
+};
+
+#ifdef WITH_STATS
+static fr_command_table_t command_table_profile[] = {
+	{ "start", FR_WRITE,
+	  "profile start <seconds> [<percent>] - time the sections, modules, expansions and queries of [<percent>] of requests, for <seconds>",
+	  command_profile_start, NULL },
+
+	{ "stop", FR_WRITE,
+	  "profile stop - stop profiling.  The results are kept until profiling is next started",
+	  command_profile_stop, NULL },
+
+	{ NULL, 0, NULL, NULL, NULL }
+};
+#endif
+
 static fr_command_table_t command_table_show[] = {
 	{ "client", FR_READ,
 	  "show client <command> - do sub-command of client",
@@ -2323,6 +2769,9 @@ static fr_command_table_t command_table_show[] = {
 	{ "debug", FR_READ,
 	  "show debug <command> - show debug properties",
 	  NULL, command_table_show_debug },
+	{ "trace", FR_READ,
+	  "show trace <command> - show trace properties",
+	  NULL, command_table_show_trace },
 #ifdef WITH_PROXY
 	{ "home_server", FR_READ,
 	  "show home_server <command> - do sub-command of home_server",
@@ -2331,6 +2780,11 @@ static fr_command_table_t command_table_show[] = {
 	{ "module", FR_READ,
 	  "show module <command> - do sub-command of module",
 	  NULL, command_table_show_module },
+#ifdef WITH_STATS
+	{ "profile", FR_READ,
+	  "show profile [section|module|xlat|query] [total|p99] [<count>] - show what profiled requests spent the most time on",
+	  command_show_profile, NULL },
+#endif
 
 #ifdef HAVE_GPERFTOOLS_PROFILER_H
 	{ "profiler", FR_READ,
@@ -2519,6 +2973,7 @@ static int command_print_stats(rad_listen_t *listener, fr_stats_t *stats,
 	cprintf(listener, "malformed\t" PU "\n", stats->total_malformed_requests);
 	cprintf(listener, "bad_authenticator\t" PU "\n", stats->total_bad_authenticators);
 	cprintf(listener, "dropped\t\t" PU "\n", stats->total_packets_dropped);
+	cprintf(listener, "rate_limited\t" PU "\n", stats->total_rate_limited);
 	cprintf(listener, "unknown_types\t" PU "\n", stats->total_unknown_types);
 
 	if (server) {
@@ -2536,19 +2991,324 @@ static int command_print_stats(rad_listen_t *listener, fr_stats_t *stats,
 
 static int command_stats_state(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
 {
+	uint32_t i;
+	uint64_t sent, received, dropped;
+
 	cprintf(listener, "states_created\t\t%" PRIu64 "\n", fr_state_entries_created(global_state));
 	cprintf(listener, "states_timeout\t\t%" PRIu64 "\n", fr_state_entries_timeout(global_state));
 	cprintf(listener, "states_tracked\t\t%" PRIu32 "\n", fr_state_entries_tracked(global_state));
 
+	if (fr_state_replication_stats(global_state, &sent, &received, &dropped)) {
+		cprintf(listener, "states_replicated\t%" PRIu64 "\n", sent);
+		cprintf(listener, "states_received\t\t%" PRIu64 "\n", received);
+		cprintf(listener, "states_repl_dropped\t%" PRIu64 "\n", dropped);
+	}
+
+	for (i = 0; i < fr_state_entries_shards(global_state); i++) {
+		cprintf(listener, "states_created.%u\t%" PRIu64 "\n", i,
+			fr_state_entries_shard_created(global_state, i));
+		cprintf(listener, "states_timeout.%u\t%" PRIu64 "\n", i,
+			fr_state_entries_shard_timeout(global_state, i));
+		cprintf(listener, "states_tracked.%u\t%" PRIu32 "\n", i,
+			fr_state_entries_shard_tracked(global_state, i));
+	}
+
+	return CMD_OK;
+}
+
+static int command_stats_hugepages(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	size_t resident;
+
+	cprintf(listener, "hugepages_enabled\t%s\n", fr_hugepages ? "yes" : "no");
+	cprintf(listener, "hugepages_advised\t%zu\n", fr_hugepage_advised());
+	if (fr_hugepage_resident(&resident) == 0) {
+		cprintf(listener, "hugepages_resident\t%zu\n", resident);
+	}
+
+	return CMD_OK;
+}
+
+static void command_stats_allocations_print(void *ctx, char const *name, fr_stats_alloc_t const *alloc,
+					    size_t bytes, size_t blocks)
+{
+	rad_listen_t *listener = ctx;
+
+	cprintf(listener, "%s\tcalls %" PRIu64 "\tbytes %" PRIu64 "\tblocks %" PRIu64 "\theld_bytes %zu\theld_blocks %zu\n",
+		name, alloc->calls, alloc->bytes, alloc->blocks, bytes, blocks);
+}
+
+static int command_stats_allocations(rad_listen_t *listener, int argc, char *argv[])
+{
+	bool modules = true, servers = true, state = true;
+
+	if (!main_config.memory_accounting) {
+		cprintf_error(listener, "Memory accounting is off.  Use 'debug memory_accounting on'\n");
+		return CMD_FAIL;
+	}
+
+	if (argc > 0) {
+		if (strcmp(argv[0], "module") == 0) {
+			servers = state = false;
+		} else if (strcmp(argv[0], "server") == 0) {
+			modules = state = false;
+		} else if (strcmp(argv[0], "state") == 0) {
+			modules = servers = false;
+		} else {
+			cprintf_error(listener, "Unknown argument \"%s\".  Expected \"module\", \"server\" or \"state\"\n",
+				      argv[0]);
+			return CMD_FAIL;
+		}
+	}
+
+	if (modules) {
+		cprintf(listener, "# module\n");
+		modules_alloc_walk(command_stats_allocations_print, listener);
+	}
+
+	if (servers) {
+		cprintf(listener, "# server\n");
+		virtual_servers_alloc_walk(command_stats_allocations_print, listener);
+	}
+
+	if (state && global_state) {
+		size_t bytes, blocks;
+
+		fr_state_memory(global_state, &bytes, &blocks);
+		cprintf(listener, "# state\n");
+		cprintf(listener, "state\theld_bytes %zu\theld_blocks %zu\n", bytes, blocks);
+	}
+
+	return CMD_OK;
+}
+
+/*
+ *	The counters sent by "stats subscribe", by fr_stats_counter_t.
+ */
+static size_t const command_stats_counters[FR_STATS_COUNTER_MAX] = {
+	[FR_STATS_COUNTER_REQUESTS]		= offsetof(fr_stats_t, total_requests),
+	[FR_STATS_COUNTER_INVALID_REQUESTS]	= offsetof(fr_stats_t, total_invalid_requests),
+	[FR_STATS_COUNTER_DUP_REQUESTS]		= offsetof(fr_stats_t, total_dup_requests),
+	[FR_STATS_COUNTER_RESPONSES]		= offsetof(fr_stats_t, total_responses),
+	[FR_STATS_COUNTER_ACCESS_ACCEPTS]	= offsetof(fr_stats_t, total_access_accepts),
+	[FR_STATS_COUNTER_ACCESS_REJECTS]	= offsetof(fr_stats_t, total_access_rejects),
+	[FR_STATS_COUNTER_ACCESS_CHALLENGES]	= offsetof(fr_stats_t, total_access_challenges),
+	[FR_STATS_COUNTER_MALFORMED_REQUESTS]	= offsetof(fr_stats_t, total_malformed_requests),
+	[FR_STATS_COUNTER_BAD_AUTHENTICATORS]	= offsetof(fr_stats_t, total_bad_authenticators),
+	[FR_STATS_COUNTER_PACKETS_DROPPED]	= offsetof(fr_stats_t, total_packets_dropped),
+	[FR_STATS_COUNTER_RATE_LIMITED]		= offsetof(fr_stats_t, total_rate_limited),
+	[FR_STATS_COUNTER_NO_RECORDS]		= offsetof(fr_stats_t, total_no_records),
+	[FR_STATS_COUNTER_UNKNOWN_TYPES]	= offsetof(fr_stats_t, total_unknown_types),
+	[FR_STATS_COUNTER_TIMEOUTS]		= offsetof(fr_stats_t, total_timeouts),
+};
+
+#define STATS_COUNTER(_stats, _i) (*(fr_uint_t const *) (((uint8_t const *) (_stats)) + command_stats_counters[_i]))
+
+/*
+ *	Push the counters to a subscribed control socket.  Runs from
+ *	the main event loop, every stats_interval seconds.
+ */
+static void command_stats_notify(void *ctx, struct timeval *now)
+{
+	rad_listen_t		*listener = ctx;
+	fr_command_socket_t	*sock = listener->data;
+	fr_stats_t		stats[FR_STATS_GLOBAL_MAX];
+	uint8_t			buffer[FR_NOTIFY_STATS_HDR_LEN +
+				       (FR_STATS_GLOBAL_MAX * FR_STATS_COUNTER_MAX * FR_NOTIFY_STATS_ENTRY_LEN)];
+	uint8_t			*p;
+	uint16_t		count = 0;
+	uint32_t		u32;
+	uint64_t		u64;
+	struct timeval		when;
+	struct pollfd		pfd;
+	int			i, j;
+
+	if (listener->status == RAD_LISTEN_STATUS_EOL) return;
+
+	when = *now;
+	when.tv_sec += sock->stats_interval;
+	if (!fr_event_insert(radius_event_list_corral(EVENT_CORRAL_MAIN), command_stats_notify, listener,
+			     &when, &sock->stats_ev)) {
+		ERROR("Failed scheduling stats for control socket: %s", fr_strerror());
+	}
+
+	/*
+	 *	Don't block the main thread on a collector which isn't
+	 *	reading.  Nothing is lost, the counters are sent as part
+	 *	of the next delta.
+	 */
+	pfd.fd = listener->fd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	if ((poll(&pfd, 1, 0) <= 0) || !(pfd.revents & POLLOUT)) return;
+
+	p = buffer + FR_NOTIFY_STATS_HDR_LEN;
+	for (i = 0; i < FR_STATS_GLOBAL_MAX; i++) {
+		radius_stats_global(&stats[i], i);
+
+		for (j = 0; j < FR_STATS_COUNTER_MAX; j++) {
+			fr_uint_t value;
+
+			value = STATS_COUNTER(&stats[i], j);
+			if (sock->stats_sent) value -= STATS_COUNTER(&sock->stats_last[i], j);
+			if (!value) continue;
+
+			*p++ = i;
+			*p++ = j;
+			u64 = htonll((uint64_t) value);
+			memcpy(p, &u64, sizeof(u64));
+			p += sizeof(u64);
+			count++;
+		}
+	}
+
+	u32 = htonl(FR_NOTIFY_STATS);
+	memcpy(buffer, &u32, sizeof(u32));
+	buffer[4] = sock->stats_sent ? 0 : FR_NOTIFY_STATS_ABSOLUTE;
+	buffer[5] = 0;
+	buffer[6] = (count >> 8) & 0xff;
+	buffer[7] = count & 0xff;
+	u32 = htonl(sock->stats_interval);
+	memcpy(buffer + 8, &u32, sizeof(u32));
+	u64 = ((uint64_t) now->tv_sec * 1000000) + now->tv_usec;
+	u64 = htonll(u64);
+	memcpy(buffer + 12, &u64, sizeof(u64));
+
+	if (fr_channel_write(listener->fd, FR_CHANNEL_NOTIFY, buffer, p - buffer) <= 0) {
+		fr_event_delete(radius_event_list_corral(EVENT_CORRAL_MAIN), &sock->stats_ev);
+		command_close_socket(listener);
+		return;
+	}
+
+	memcpy(sock->stats_last, stats, sizeof(sock->stats_last));
+	sock->stats_sent = true;
+}
+
+static int command_stats_subscribe(rad_listen_t *listener, int argc, char *argv[])
+{
+	fr_command_socket_t *sock = listener->data;
+	unsigned long interval;
+	struct timeval when;
+	char *end;
+
+	if (sock->magic != COMMAND_SOCKET_MAGIC) {
+		cprintf_error(listener, "Subscriptions are only supported on unix domain control sockets\n");
+		return CMD_FAIL;
+	}
+
+	if (argc == 0) {
+		cprintf_error(listener, "Must specify <seconds>\n");
+		return CMD_FAIL;
+	}
+
+	interval = strtoul(argv[0], &end, 10);
+	if (*end || (interval == 0) || (interval > 3600)) {
+		cprintf_error(listener, "Invalid <seconds> \"%s\".  Expected 1 to 3600\n", argv[0]);
+		return CMD_FAIL;
+	}
+
+	/*
+	 *	Subscribing again starts over, with the totals.
+	 */
+	fr_event_delete(radius_event_list_corral(EVENT_CORRAL_MAIN), &sock->stats_ev);
+	sock->stats_interval = interval;
+	sock->stats_sent = false;
+
+	gettimeofday(&when, NULL);
+	if (!fr_event_insert(radius_event_list_corral(EVENT_CORRAL_MAIN), command_stats_notify, listener,
+			     &when, &sock->stats_ev)) {
+		cprintf_error(listener, "Failed scheduling stats: %s\n", fr_strerror());
+		return CMD_FAIL;
+	}
+
+	return CMD_OK;
+}
+
+static int command_stats_unsubscribe(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	fr_command_socket_t *sock = listener->data;
+
+	if (sock->magic != COMMAND_SOCKET_MAGIC) return CMD_OK;
+
+	fr_event_delete(radius_event_list_corral(EVENT_CORRAL_MAIN), &sock->stats_ev);
+
+	return CMD_OK;
+}
+
+static void command_stats_latency_print(void *ctx, char const *name, char const *section, fr_stats_latency_t *lat)
+{
+	rad_listen_t *listener = ctx;
+	static double const pct[] = { 50, 99, 99.9 };
+	uint64_t usec[3];
+	uint64_t count;
+
+	count = fr_stats_latency_percentiles(lat, usec, pct, 3);
+	if (!count) return;
+
+	cprintf(listener, "%s.%s\tcount %" PRIu64 "\tp50 %" PRIu64 "\tp99 %" PRIu64 "\tp999 %" PRIu64 "\n",
+		name, section, count, usec[0], usec[1], usec[2]);
+}
+
+static int command_stats_latency(rad_listen_t *listener, int argc, char *argv[])
+{
+	bool requests = true, servers = true, modules = true;
+
+	if (argc > 0) {
+		if (strcmp(argv[0], "request") == 0) {
+			servers = modules = false;
+		} else if (strcmp(argv[0], "server") == 0) {
+			requests = modules = false;
+		} else if (strcmp(argv[0], "module") == 0) {
+			requests = servers = false;
+		} else {
+			cprintf_error(listener, "Unknown argument \"%s\".  Expected \"request\", \"server\" or \"module\"\n",
+				      argv[0]);
+			return CMD_FAIL;
+		}
+	}
+
+	if (requests) {
+		cprintf(listener, "# request.phase\tusec\n");
+		request_latency_walk(command_stats_latency_print, listener);
+	}
+
+	if (servers) {
+		cprintf(listener, "# server.section\tusec\n");
+		virtual_servers_latency_walk(command_stats_latency_print, listener);
+	}
+
+	if (modules) {
+		cprintf(listener, "# module.method\tusec\n");
+		modules_latency_walk(command_stats_latency_print, listener);
+	}
+
+	return CMD_OK;
+}
+
+#ifdef HAVE_REGEX
+static int command_stats_regex(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	uint64_t hits, misses, evictions;
+
+	regex_cache_stats(&hits, &misses, &evictions);
+
+	cprintf(listener, "regex_cache_hits\t\t%" PRIu64 "\n", hits);
+	cprintf(listener, "regex_cache_misses\t%" PRIu64 "\n", misses);
+	cprintf(listener, "regex_cache_evictions\t%" PRIu64 "\n", evictions);
+
 	return CMD_OK;
 }
+#endif
 
 #ifdef HAVE_PTHREAD_H
 static int command_stats_queue(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
 {
 	int array[RAD_LISTEN_MAX], pps[2];
+	uint64_t shed[QUEUE_SHED_MAX];
+	int i;
 
 	thread_pool_queue_stats(array, pps);
+	thread_pool_shed_stats(shed);
 
 	cprintf(listener, "queue_len_internal\t" PU "\n", array[0]);
 	cprintf(listener, "queue_len_proxy\t\t" PU "\n", array[1]);
@@ -2559,6 +3319,47 @@ static int command_stats_queue(rad_listen_t *listener, UNUSED int argc, UNUSED c
 	cprintf(listener, "queue_pps_in\t\t" PU "\n", pps[0]);
 	cprintf(listener, "queue_pps_out\t\t" PU "\n", pps[1]);
 
+	for (i = 0; i < QUEUE_SHED_MAX; i++) {
+		cprintf(listener, "queue_shed_%s\t%" PRIu64 "\n", fr_int2str(queue_shed_table, i, "?"), shed[i]);
+	}
+
+	return CMD_OK;
+}
+
+static int command_stats_offload(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	uint32_t queued;
+	uint64_t completed, rejected, wait_usec, run_usec;
+
+	thread_pool_offload_stats(&queued, &completed, &rejected, &wait_usec, &run_usec);
+
+	cprintf(listener, "offload_queue_len\t" PU "\n", queued);
+	cprintf(listener, "offload_completed\t%" PRIu64 "\n", completed);
+	cprintf(listener, "offload_rejected\t%" PRIu64 "\n", rejected);
+	cprintf(listener, "offload_avg_wait_usec\t%" PRIu64 "\n", completed ? wait_usec / completed : 0);
+	cprintf(listener, "offload_avg_run_usec\t%" PRIu64 "\n", completed ? run_usec / completed : 0);
+
+	return CMD_OK;
+}
+
+static int command_stats_pools(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	unsigned int i;
+	char const *name;
+	uint32_t queued, active;
+	uint64_t completed, rejected, wait_usec, run_usec;
+
+	for (i = 0;
+	     thread_pool_isolated_stats(i, &name, &queued, &active, &completed, &rejected, &wait_usec, &run_usec) == 0;
+	     i++) {
+		cprintf(listener, "%s.queue_len\t" PU "\n", name, queued);
+		cprintf(listener, "%s.active\t" PU "\n", name, active);
+		cprintf(listener, "%s.completed\t%" PRIu64 "\n", name, completed);
+		cprintf(listener, "%s.rejected\t%" PRIu64 "\n", name, rejected);
+		cprintf(listener, "%s.avg_wait_usec\t%" PRIu64 "\n", name, completed ? wait_usec / completed : 0);
+		cprintf(listener, "%s.avg_run_usec\t%" PRIu64 "\n", name, completed ? run_usec / completed : 0);
+	}
+
 	return CMD_OK;
 }
 #endif
@@ -2676,29 +3477,31 @@ static int command_stats_home_server(rad_listen_t *listener, int argc, char *arg
 	}
 
 	if (argc == 1) {
+		fr_stats_t stats;
+
 		if (strcmp(argv[0], "auth") == 0) {
-			return command_print_stats(listener,
-						   &proxy_auth_stats, 1, 1);
+			radius_stats_global(&stats, FR_STATS_PROXY_AUTH);
+			return command_print_stats(listener, &stats, 1, 1);
 		}
 
 #ifdef WITH_ACCOUNTING
 		if (strcmp(argv[0], "acct") == 0) {
-			return command_print_stats(listener,
-						   &proxy_acct_stats, 0, 1);
+			radius_stats_global(&stats, FR_STATS_PROXY_ACCT);
+			return command_print_stats(listener, &stats, 0, 1);
 		}
 #endif
 
 #ifdef WITH_ACCOUNTING
 		if (strcmp(argv[0], "coa") == 0) {
-			return command_print_stats(listener,
-						   &proxy_coa_stats, 0, 1);
+			radius_stats_global(&stats, FR_STATS_PROXY_COA);
+			return command_print_stats(listener, &stats, 0, 1);
 		}
 #endif
 
 #ifdef WITH_ACCOUNTING
 		if (strcmp(argv[0], "disconnect") == 0) {
-			return command_print_stats(listener,
-						   &proxy_dsc_stats, 0, 1);
+			radius_stats_global(&stats, FR_STATS_PROXY_DSC);
+			return command_print_stats(listener, &stats, 0, 1);
 		}
 #endif
 
@@ -2716,6 +3519,31 @@ static int command_stats_home_server(rad_listen_t *listener, int argc, char *arg
 }
 #endif
 
+#if defined(WITH_PROXY) && defined(WITH_COA)
+static int command_stats_coa(rad_listen_t *listener, int argc, char *argv[])
+{
+	home_server_t		*home;
+	coa_bulk_stats_t	stats;
+
+	home = get_coa_home_server(listener, argc, argv, NULL);
+	if (!home) return 0;
+
+	if (coa_bulk_stats(&stats, home) < 0) memset(&stats, 0, sizeof(stats));
+
+	cprintf(listener, "queued\t\t%" PRIu64 "\n", stats.queued);
+	cprintf(listener, "dropped\t\t%" PRIu64 "\n", stats.dropped);
+	cprintf(listener, "sent\t\t%" PRIu64 "\n", stats.sent);
+	cprintf(listener, "retransmits\t%" PRIu64 "\n", stats.retransmits);
+	cprintf(listener, "acks\t\t%" PRIu64 "\n", stats.acks);
+	cprintf(listener, "naks\t\t%" PRIu64 "\n", stats.naks);
+	cprintf(listener, "timeouts\t%" PRIu64 "\n", stats.timeouts);
+	cprintf(listener, "pending\t\t%u\n", stats.pending);
+	cprintf(listener, "outstanding\t%u\n", stats.outstanding);
+
+	return CMD_OK;
+}
+#endif
+
 static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 {
 	bool auth = true;
@@ -2731,13 +3559,13 @@ static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 		/*
 		 *	Global statistics.
 		 */
-		fake.auth = radius_auth_stats;
+		radius_stats_global(&fake.auth, FR_STATS_AUTH);
 #ifdef WITH_ACCOUNTING
-		fake.acct = radius_acct_stats;
+		radius_stats_global(&fake.acct, FR_STATS_ACCT);
 #endif
 #ifdef WITH_COA
-		fake.coa = radius_coa_stats;
-		fake.dsc = radius_dsc_stats;
+		radius_stats_global(&fake.coa, FR_STATS_COA);
+		radius_stats_global(&fake.dsc, FR_STATS_DSC);
 #endif
 		client = &fake;
 
@@ -2791,11 +3619,10 @@ static int command_stats_client(rad_listen_t *listener, int argc, char *argv[])
 	if (argc == 1) {
 #ifdef WITH_ACCOUNTING
 		if (!auth) {
-			return command_print_stats(listener,
-						   &radius_acct_stats, auth, 0);
+			return command_print_stats(listener, &fake.acct, auth, 0);
 		}
 #endif
-		return command_print_stats(listener, &radius_auth_stats, auth, 0);
+		return command_print_stats(listener, &fake.auth, auth, 0);
 	}
 
 	return command_print_stats(listener, stats, auth, 0);
@@ -2842,6 +3669,8 @@ static int command_add_client_file(rad_listen_t *listener, int argc, char *argv[
 		return 0;
 	}
 
+	listen_filter_clients_update();
+
 	return CMD_OK;
 }
 
@@ -2952,6 +3781,12 @@ static fr_command_table_t command_table_stats[] = {
 	  "- show statistics for given client, or for all clients (auth or acct)",
 	  command_stats_client, NULL },
 
+#if defined(WITH_PROXY) && defined(WITH_COA)
+	{ "coa", FR_READ,
+	  "stats coa <ipaddr> <port> [udp] - show statistics for CoA requests queued by \"coa file\" and rlm_coa",
+	  command_stats_coa, NULL },
+#endif
+
 #ifdef WITH_DETAIL
 	{ "detail", FR_READ,
 	  "stats detail <filename> - show statistics for the given detail file",
@@ -2968,12 +3803,46 @@ static fr_command_table_t command_table_stats[] = {
 	{ "queue", FR_READ,
 	  "stats queue - show statistics for packet queues",
 	  command_stats_queue, NULL },
+
+	{ "offload", FR_READ,
+	  "stats offload - show statistics for the offload queue",
+	  command_stats_offload, NULL },
+
+	{ "pools", FR_READ,
+	  "stats pools - show statistics for the named thread pools",
+	  command_stats_pools, NULL },
+#endif
+
+#ifdef HAVE_REGEX
+	{ "regex", FR_READ,
+	  "stats regex - show statistics for the runtime regular expression cache",
+	  command_stats_regex, NULL },
 #endif
 
 	{ "state", FR_READ,
 	  "stats state - show statistics for states",
 	  command_stats_state, NULL },
 
+	{ "hugepages", FR_READ,
+	  "stats hugepages - show how much memory was advised to use huge pages, and how much of the server's memory is in them",
+	  command_stats_hugepages, NULL },
+
+	{ "allocations", FR_READ,
+	  "stats allocations [module|server|state] - show the memory each module and virtual server left in requests, and the memory each one holds.  Needs 'debug memory_accounting on'",
+	  command_stats_allocations, NULL },
+
+	{ "latency", FR_READ,
+	  "stats latency [request|server|module] - show p50, p99 and p99.9 latency in microseconds, for each phase of a request, virtual server section and module method",
+	  command_stats_latency, NULL },
+
+	{ "subscribe", FR_READ,
+	  "stats subscribe <seconds> - push the server counters to this socket every <seconds>, as binary FR_NOTIFY_STATS messages.  The first has the totals, later ones the increase",
+	  command_stats_subscribe, NULL },
+
+	{ "unsubscribe", FR_READ,
+	  "stats unsubscribe - stop pushing the server counters to this socket",
+	  command_stats_unsubscribe, NULL },
+
 	{ "socket", FR_READ,
 	  "stats socket <ipaddr> <port> [udp|tcp] "
 	  "- show statistics for given socket",
@@ -2992,6 +3861,11 @@ static fr_command_table_t command_table_stats[] = {
 static fr_command_table_t command_table[] = {
 #ifdef WITH_DYNAMIC_CLIENTS
 	{ "add", FR_WRITE, NULL, NULL, command_table_add },
+#endif
+#if defined(WITH_PROXY) && defined(WITH_COA)
+	{ "coa", FR_WRITE,
+	  "coa <command> - commands to send many CoA and Disconnect requests",
+	  NULL, command_table_coa },
 #endif
 	{ "debug", FR_WRITE,
 	  "debug <command> - debugging commands",
@@ -3010,6 +3884,11 @@ static fr_command_table_t command_table[] = {
 	{ "profiler", FR_WRITE,
 	  "profiler <command> - commands to alter the state of the gperftools profiler",
 	  NULL, command_table_profiler },
+#endif
+#ifdef WITH_STATS
+	{ "profile", FR_WRITE,
+	  "profile <command> - commands to time what requests spend their time on",
+	  NULL, command_table_profile },
 #endif
 	{ "reconnect", FR_READ,
 	  "reconnect - reconnect to a running server",
@@ -3022,6 +3901,9 @@ static fr_command_table_t command_table[] = {
 #ifdef WITH_STATS
 	{ "stats",  FR_READ, NULL, NULL, command_table_stats },
 #endif
+	{ "trace", FR_WRITE,
+	  "trace <command> - commands to record request trace events",
+	  NULL, command_table_trace },
 
 	{ NULL, 0, NULL, NULL, NULL }
 };
@@ -3034,6 +3916,10 @@ static int _command_socket_free(fr_command_socket_t *cmd)
 	 */
 	if (cmd->magic != COMMAND_SOCKET_MAGIC) return 0;
 
+#ifdef WITH_STATS
+	if (cmd->stats_ev) fr_event_delete(radius_event_list_corral(EVENT_CORRAL_MAIN), &cmd->stats_ev);
+#endif
+
 	if (!cmd->copy) return 0;
 	unlink(cmd->copy);
 
@@ -3624,6 +4510,7 @@ static int command_domain_accept(rad_listen_t *listener)
 	sock->path = ((fr_command_socket_t *) listener->data)->path;
 	sock->co.offset = 0;
 	sock->co.mode = ((fr_command_socket_t *) listener->data)->co.mode;
+	talloc_set_destructor(sock, _command_socket_free);
 
 	this->fd = newfd;
 	this->recv = command_domain_recv;
@@ -118,6 +118,8 @@ struct conf_part {
 	CONF_ITEM	*children;
 	CONF_ITEM	*tail;		//!< For speed.
 	CONF_SECTION	*template;
+	CONF_SECTION	*shadowing;	//!< Section this one will be merged into, when files
+					//!< from an included directory are parsed in parallel.
 
 	rbtree_t	*pair_tree;	//!< and a partridge..
 	rbtree_t	*section_tree;	//!< no jokes here.
@@ -156,6 +158,26 @@ typedef struct cf_file_t {
 	struct stat	buf;
 } cf_file_t;
 
+#ifdef HAVE_PTHREAD_H
+#  define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#  define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+
+/** Maximum number of threads used to parse the files in an included directory
+ *
+ */
+#  define CF_INCLUDE_THREADS	(8)
+
+/*
+ *	Protects the tree of files the configuration was read from,
+ *	as files from an included directory may be parsed in parallel.
+ */
+static pthread_mutex_t	cf_file_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool		cf_include_parallel = false;	//!< Whether a directory is being parsed in parallel.
+#else
+#  define PTHREAD_MUTEX_LOCK(_x)
+#  define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
 
 static int		cf_data_add_internal(CONF_SECTION *cs, char const *name, void *data,
 					     void (*data_free)(void *), int flag);
@@ -352,14 +374,16 @@ static FILE *cf_file_open(CONF_SECTION *cs, char const *filename)
 
 	fd = fileno(fp);
 
+	PTHREAD_MUTEX_LOCK(&cf_file_mutex);
 	file = talloc(tree, cf_file_t);
 	if (!file) {
+		PTHREAD_MUTEX_UNLOCK(&cf_file_mutex);
 		fclose(fp);
 		return NULL;
 	}
 
 	file->filename = filename;
-	file->cs = cs;
+	file->cs = cs->shadowing ? cs->shadowing : cs;
 	file->input = true;
 
 	if (fstat(fd, &file->buf) == 0) {
@@ -368,8 +392,9 @@ static FILE *cf_file_open(CONF_SECTION *cs, char const *filename)
 			ERROR("Configuration file %s is globally writable.  "
 			      "Refusing to start due to insecure configuration.", filename);
 
-			fclose(fp);
 			talloc_free(file);
+			PTHREAD_MUTEX_UNLOCK(&cf_file_mutex);
+			fclose(fp);
 			return NULL;
 		}
 #endif
@@ -384,6 +409,7 @@ static FILE *cf_file_open(CONF_SECTION *cs, char const *filename)
 	if (!rbtree_insert(tree, file)) {
 		talloc_free(file);
 	}
+	PTHREAD_MUTEX_UNLOCK(&cf_file_mutex);
 
 	return fp;
 }
@@ -405,8 +431,12 @@ static bool cf_file_input(CONF_SECTION *cs, char const *filename)
 
 	tree = cd->data;
 
+	PTHREAD_MUTEX_LOCK(&cf_file_mutex);
 	file = talloc(tree, cf_file_t);
-	if (!file) return false;
+	if (!file) {
+		PTHREAD_MUTEX_UNLOCK(&cf_file_mutex);
+		return false;
+	}
 
 	file->filename = filename;
 	file->cs = cs;
@@ -415,7 +445,9 @@ static bool cf_file_input(CONF_SECTION *cs, char const *filename)
 	if (stat(filename, &file->buf) < 0) {
 		rad_file_error(errno);	/* Write error and euid/egid to error buff */
 		ERROR("Unable to open file \"%s\": %s", filename, fr_strerror());
+	error:
 		talloc_free(file);
+		PTHREAD_MUTEX_UNLOCK(&cf_file_mutex);
 		return false;
 	}
 
@@ -423,8 +455,7 @@ static bool cf_file_input(CONF_SECTION *cs, char const *filename)
 	if ((file->buf.st_mode & S_IWOTH) != 0) {
 		ERROR("Configuration file %s is globally writable.  "
 		      "Refusing to start due to insecure configuration.", filename);
-		talloc_free(file);
-		return false;
+		goto error;
 	}
 #endif
 
@@ -434,6 +465,7 @@ static bool cf_file_input(CONF_SECTION *cs, char const *filename)
 	if (!rbtree_insert(tree, file)) {
 		talloc_free(file);
 	}
+	PTHREAD_MUTEX_UNLOCK(&cf_file_mutex);
 
 	return true;
 
@@ -1000,6 +1032,7 @@ CONF_ITEM *cf_reference_item(CONF_SECTION const *parentcs,
 		} else {
 			*q = '\0';
 			next = cf_section_sub_find(cs, p);
+			if (!next && cs->shadowing) next = cf_section_sub_find(cs->shadowing, p);
 			*q = '.';
 		}
 
@@ -1025,6 +1058,15 @@ CONF_ITEM *cf_reference_item(CONF_SECTION const *parentcs,
 	next = cf_section_sub_find(cs, p);
 	if (next) return &(next->item);
 
+	/*
+	 *	Items defined before a directory was included
+	 *	are in the section we're shadowing.
+	 */
+	if (cs->shadowing) {
+		cs = cs->shadowing;
+		goto retry;
+	}
+
 	/*
 	 *	"foo" is "in the current section, OR in main".
 	 */
@@ -1042,7 +1084,14 @@ CONF_SECTION *cf_top_section(CONF_SECTION *cs)
 {
 	if (!cs) return NULL;
 
-	while (cs->item.parent != NULL) {
+	for (;;) {
+		/*
+		 *	Shadow sections have the same parent as the
+		 *	section they shadow, but may be at the top.
+		 */
+		if (cs->shadowing) cs = cs->shadowing;
+		if (!cs->item.parent) break;
+
 		cs = cs->item.parent;
 	}
 
@@ -1515,12 +1564,42 @@ int cf_section_parse_pass2(CONF_SECTION *cs, void *base, CONF_PARSER const varia
 				cf_log_err(&cp->item, "Unknown attribute '%s'", vpt->tmpl_unknown_name);
 				return -1;
 
+			/*
+			 *	All xlats are defined by now, so
+			 *	tokenize the expansion once, instead
+			 *	of every time it's expanded.
+			 */
+			case TMPL_TYPE_XLAT:
+			{
+				char const	*error;
+				xlat_exp_t	*xlat;
+
+				slen = xlat_compile(vpt, &xlat, vpt->name, &error);
+				if (slen < 0) {
+					char *spaces, *text;
+
+					fr_canonicalize_error(cs, &spaces, &text, slen, vpt->name);
+
+					cf_log_err_cp(cp, "Failed parsing expanded string:");
+					cf_log_err_cp(cp, "%s", text);
+					cf_log_err_cp(cp, "%s^ %s", spaces, error);
+
+					talloc_free(spaces);
+					talloc_free(text);
+					talloc_free(vpt);
+					return -1;
+				}
+
+				vpt->type = TMPL_TYPE_XLAT_STRUCT;
+				vpt->tmpl_xlat = xlat;
+			}
+				break;
+
 			case TMPL_TYPE_UNPARSED:
 			case TMPL_TYPE_ATTR:
 			case TMPL_TYPE_LIST:
 			case TMPL_TYPE_DATA:
 			case TMPL_TYPE_EXEC:
-			case TMPL_TYPE_XLAT:
 			case TMPL_TYPE_XLAT_STRUCT:
 				break;
 
@@ -2494,6 +2573,196 @@ static void cf_include_add(CONF_SECTION *cs, char const *filename, CONF_INCLUDE_
 /*
  *	Read a part of the config file.
  */
+/** Allocate the temporary buffers used when reading configuration files
+ *
+ * Allocated on the heap so we don't use *all* the stack space.
+ */
+static char **cf_buff_alloc(TALLOC_CTX *ctx)
+{
+	int i;
+	char **buff;
+
+	buff = talloc_array(ctx, char *, 7);
+	if (!buff) return NULL;
+
+	for (i = 0; i < 7; i++) {
+		buff[i] = talloc_array(buff, char, 8192);
+	}
+
+	return buff;
+}
+
+static int cf_filename_cmp(void const *one, void const *two)
+{
+	char const * const *a = one;
+	char const * const *b = two;
+
+	return strcmp(*a, *b);
+}
+
+#ifdef HAVE_PTHREAD_H
+/** A file from an included directory, and the section it's parsed into
+ *
+ */
+typedef struct cf_include_work {
+	char const	*filename;
+	CONF_SECTION	*cs;			//!< Shadow of the section the file was included in.
+	int		ret;
+} cf_include_work_t;
+
+typedef struct cf_include_queue {
+	pthread_mutex_t		mutex;
+	cf_include_work_t	*work;
+	size_t			num;
+	size_t			next;		//!< Next file to parse.
+} cf_include_queue_t;
+
+/** Allocate a section for a file to be parsed into, separate from the one it was included in
+ *
+ * Lookups which fail in the shadow section are retried in the section it
+ * shadows, so references to items defined before the $INCLUDE still work.
+ * As the parent section isn't modified until all the files have been parsed,
+ * it's safe to read from multiple threads.
+ */
+static CONF_SECTION *cf_section_shadow_alloc(CONF_SECTION *cs)
+{
+	CONF_SECTION *shadow;
+
+	shadow = cf_section_alloc(NULL, cs->name1, NULL);
+	if (!shadow) return NULL;
+
+	if (cs->name2) shadow->name2 = talloc_typed_strdup(shadow, cs->name2);
+	shadow->name2_type = cs->name2_type;
+	shadow->item.parent = cs->item.parent;
+	shadow->item.filename = cs->item.filename;
+	shadow->item.lineno = cs->item.lineno;
+	shadow->depth = cs->depth;
+	shadow->template = cs->template;
+	shadow->shadowing = cs;
+
+	return shadow;
+}
+
+/** Move everything parsed into a shadow section into the section it shadows
+ *
+ */
+static void cf_section_shadow_merge(CONF_SECTION *cs, CONF_SECTION *shadow)
+{
+	CONF_ITEM *ci, *next;
+
+	for (ci = shadow->children; ci; ci = next) {
+		next = ci->next;
+
+		ci->next = NULL;
+		ci->parent = cs;
+		(void) talloc_steal(cs, ci);
+		cf_item_add(cs, ci);
+	}
+	shadow->children = shadow->tail = NULL;
+
+	if (shadow->template != cs->template) cs->template = shadow->template;
+}
+
+static void *cf_file_include_thread(void *arg)
+{
+	cf_include_queue_t	*queue = arg;
+	char			**buff;
+
+	buff = cf_buff_alloc(NULL);
+
+	for (;;) {
+		cf_include_work_t *work;
+
+		pthread_mutex_lock(&queue->mutex);
+		if (queue->next == queue->num) {
+			pthread_mutex_unlock(&queue->mutex);
+			break;
+		}
+		work = &queue->work[queue->next++];
+		pthread_mutex_unlock(&queue->mutex);
+
+		work->ret = buff ? cf_file_include(work->cs, work->filename, CONF_INCLUDE_FROMDIR, buff) : -1;
+	}
+
+	talloc_free(buff);
+
+	return NULL;
+}
+
+/** Parse the files from an included directory in parallel
+ *
+ * Each file is parsed into its own shadow of cs, and the shadows are merged
+ * into cs in the order the files were passed in, so the result is the same as
+ * reading the files serially.  A file can't reference items defined by another
+ * file from the same directory.
+ *
+ * @param[in] cs	the directory was included in.
+ * @param[in] files	to parse.
+ * @param[in] num	of files.
+ * @return
+ *	- 0 on success.
+ *	- -1 if any of the files couldn't be parsed.
+ */
+static int cf_file_include_parallel(CONF_SECTION *cs, char const **files, size_t num)
+{
+	cf_include_queue_t	queue;
+	pthread_t		threads[CF_INCLUDE_THREADS];
+	size_t			i, num_threads = 0;
+	int			ret = 0;
+
+	memset(&queue, 0, sizeof(queue));
+	queue.num = num;
+	queue.work = talloc_zero_array(NULL, cf_include_work_t, num);
+	if (!queue.work) return -1;
+
+	for (i = 0; i < num; i++) {
+		queue.work[i].filename = files[i];
+		queue.work[i].cs = cf_section_shadow_alloc(cs);
+		if (!queue.work[i].cs) {
+			ret = -1;
+			goto finish;
+		}
+	}
+
+	pthread_mutex_init(&queue.mutex, NULL);
+
+	/*
+	 *	Files in directories included by these files are
+	 *	parsed serially.
+	 */
+	cf_include_parallel = true;
+	for (i = 0; (i < CF_INCLUDE_THREADS) && (i < num); i++) {
+		if (pthread_create(&threads[num_threads], NULL, cf_file_include_thread, &queue) != 0) break;
+		num_threads++;
+	}
+
+	/*
+	 *	Couldn't create any threads, do the work ourselves.
+	 */
+	if (num_threads == 0) cf_file_include_thread(&queue);
+
+	for (i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+	cf_include_parallel = false;
+
+	pthread_mutex_destroy(&queue.mutex);
+
+	for (i = 0; i < num; i++) {
+		if (queue.work[i].ret < 0) ret = -1;
+	}
+	if (ret < 0) goto finish;
+
+	if (!cs->item.filename) cs->item.filename = talloc_typed_strdup(cs, files[0]);
+
+	for (i = 0; i < num; i++) cf_section_shadow_merge(cs, queue.work[i].cs);
+
+finish:
+	for (i = 0; i < num; i++) talloc_free(queue.work[i].cs);
+	talloc_free(queue.work);
+
+	return ret;
+}
+#endif
+
 static int cf_section_read(char const *filename, int *lineno, FILE *fp,
 			   CONF_SECTION *current, char *buff[7])
 
@@ -2722,6 +2991,8 @@ static int cf_section_read(char const *filename, int *lineno, FILE *fp,
 				struct dirent	*dp;
 				struct stat stat_buf;
 				char *my_directory;
+				char const **files;
+				size_t num_files;
 
 				my_directory = talloc_strdup(this, value);
 
@@ -2767,6 +3038,7 @@ static int cf_section_read(char const *filename, int *lineno, FILE *fp,
 				/*
 				 *	Read the directory, ignoring "." files.
 				 */
+				files = talloc_array(my_directory, char const *, 0);
 				while ((dp = readdir(dir)) != NULL) {
 					char const *p;
 
@@ -2791,16 +3063,38 @@ static int cf_section_read(char const *filename, int *lineno, FILE *fp,
 					if ((stat(buff[2], &stat_buf) != 0) ||
 					    S_ISDIR(stat_buf.st_mode)) continue;
 
-					/*
-					 *	Read the file into the current
-					 *	configuration section.
-					 */
-					if (cf_file_include(this, buff[2], CONF_INCLUDE_FROMDIR, buff) < 0) {
-						closedir(dir);
+					num_files = talloc_array_length(files);
+					files = talloc_realloc(my_directory, files, char const *, num_files + 1);
+					files[num_files] = talloc_typed_strdup(files, buff[2]);
+				}
+				closedir(dir);
+
+				/*
+				 *	Read the files into the current
+				 *	configuration section, in a
+				 *	predictable order.
+				 */
+				num_files = talloc_array_length(files);
+				qsort(files, num_files, sizeof(*files), cf_filename_cmp);
+
+#ifdef HAVE_PTHREAD_H
+				if ((num_files > 1) && !cf_include_parallel) {
+					if (cf_file_include_parallel(this, files, num_files) < 0) {
+						talloc_free(my_directory);
 						goto error;
 					}
+				} else
+#endif
+				{
+					size_t i;
+
+					for (i = 0; i < num_files; i++) {
+						if (cf_file_include(this, files[i], CONF_INCLUDE_FROMDIR, buff) < 0) {
+							talloc_free(my_directory);
+							goto error;
+						}
+					}
 				}
-				closedir(dir);
 				talloc_free(my_directory);
 
 			}  else
@@ -3413,7 +3707,6 @@ static int cf_section_pass2(CONF_SECTION *cs)
  */
 int cf_file_read(CONF_SECTION *cs, char const *filename)
 {
-	int i;
 	char *p;
 	CONF_PAIR *cp;
 	rbtree_t *tree;
@@ -3434,13 +3727,8 @@ int cf_file_read(CONF_SECTION *cs, char const *filename)
 
 	cf_data_add_internal(cs, "filename", tree, NULL, 0);
 
-	/*
-	 *	Allocate temporary buffers on the heap (so we don't use *all* the stack space)
-	 */
-	buff = talloc_array(cs, char *, 7);
-	for (i = 0; i < 7; i++) {
-		buff[i] = talloc_array(buff, char, 8192);
-	}
+	buff = cf_buff_alloc(cs);
+	if (!buff) return -1;
 
 	if (cf_file_include(cs, filename, CONF_INCLUDE_FILE, buff) < 0) {
 		talloc_free(buff);
@@ -3893,6 +4181,69 @@ CONF_SECTION *cf_item_parent(CONF_ITEM const *ci)
 	return ci->parent;
 }
 
+/** Skip items which weren't read from a configuration file
+ *
+ * Defaults added by #cf_section_parse, data, comments, etc.
+ */
+static CONF_ITEM const *cf_item_next_parsed(CONF_ITEM const *ci)
+{
+	while (ci) {
+		if (((ci->type == CONF_ITEM_PAIR) || (ci->type == CONF_ITEM_SECTION)) &&
+		    ci->filename && (strcmp(ci->filename, "<internal>") != 0)) break;
+
+		ci = ci->next;
+	}
+
+	return ci;
+}
+
+/** Check whether two sections contain the same configuration
+ *
+ * Compares names, pairs and subsections recursively, in order.  Items
+ * which weren't read from a file (such as defaults filled in when a module
+ * parsed its configuration) are ignored, so a running section can be compared
+ * with a freshly read one.
+ *
+ * @param[in] a	first section.
+ * @param[in] b	second section.
+ * @return true if the sections are equivalent, else false.
+ */
+bool cf_section_equal(CONF_SECTION const *a, CONF_SECTION const *b)
+{
+	CONF_ITEM const *ci_a, *ci_b;
+	int i;
+
+	if (strcmp(a->name1, b->name1) != 0) return false;
+	if (!a->name2 != !b->name2) return false;
+	if (a->name2 && (strcmp(a->name2, b->name2) != 0)) return false;
+
+	if (a->argc != b->argc) return false;
+	for (i = 0; i < a->argc; i++) {
+		if (strcmp(a->argv[i], b->argv[i]) != 0) return false;
+	}
+
+	for (ci_a = cf_item_next_parsed(a->children), ci_b = cf_item_next_parsed(b->children);
+	     ci_a && ci_b;
+	     ci_a = cf_item_next_parsed(ci_a->next), ci_b = cf_item_next_parsed(ci_b->next)) {
+		if (ci_a->type != ci_b->type) return false;
+
+		if (ci_a->type == CONF_ITEM_PAIR) {
+			CONF_PAIR const *cp_a = cf_item_to_pair(ci_a);
+			CONF_PAIR const *cp_b = cf_item_to_pair(ci_b);
+
+			if ((cp_a->op != cp_b->op) || (cp_a->rhs_type != cp_b->rhs_type)) return false;
+			if (strcmp(cp_a->attr, cp_b->attr) != 0) return false;
+			if (!cp_a->value != !cp_b->value) return false;
+			if (cp_a->value && (strcmp(cp_a->value, cp_b->value) != 0)) return false;
+			continue;
+		}
+
+		if (!cf_section_equal(cf_item_to_section(ci_a), cf_item_to_section(ci_b))) return false;
+	}
+
+	return (ci_a == ci_b);	/* Both NULL */
+}
+
 int cf_section_lineno(CONF_SECTION const *section)
 {
 	return section->item.lineno;
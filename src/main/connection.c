@@ -32,6 +32,30 @@ RCSID("$Id$")
 
 typedef struct fr_connection fr_connection_t;
 
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_STDATOMIC_H)
+#  include <stdatomic.h>
+#  define WITH_CONNECTION_AFFINITY
+
+/** Number of threads which can have connections cached for them
+ *
+ * Any threads after this always use the shared pool.
+ */
+#  define FR_CONNECTION_CACHE_SLOTS	(128)
+
+/** Connections cached for a single thread
+ *
+ * Padded to a cache line, as each slot is mostly written by a different thread.
+ */
+typedef struct fr_connection_cache {
+	_Atomic(fr_connection_t *) parked;	//!< Released connection kept for this thread.
+						//!< Any thread taking it must atomically swap
+						//!< it out.
+	fr_connection_t		*reserved;	//!< Connection most recently reserved by this thread.
+						//!< Only used by the thread owning the slot.
+	uint8_t			pad[64 - (2 * sizeof(void *))];
+} fr_connection_cache_t;
+#endif
+
 static int fr_connection_pool_check(fr_connection_pool_t *pool);
 
 #ifndef NDEBUG
@@ -68,6 +92,8 @@ struct fr_connection {
 
 	bool		needs_reconnecting;	//!< Reconnect this connection before use.
 
+	time_t		health_checked;		//!< Last time the connection was health checked.
+
 #ifdef PTHREAD_DEBUG
 	pthread_t	pthread_id;		//!< When 'in_use == true'.
 #endif
@@ -108,6 +134,23 @@ struct fr_connection_pool_t {
 	bool		spread;			//!< If true we spread requests over the connections,
 						//!< using the connection released longest ago, first.
 
+	bool		affinity;		//!< If true, released connections are kept for the
+						//!< thread which released them.
+
+	bool		background;		//!< If true, connections are opened by a manager thread,
+						//!< instead of by the thread which needs one.
+	uint32_t	waiting;		//!< Number of threads waiting for a connection.
+	uint32_t	demand;			//!< Number of reservations which found no free connection,
+						//!< since the manager thread last checked.
+	uint32_t	ramp;			//!< Extra spare connections the manager thread keeps open,
+						//!< based on recent demand.
+	uint32_t	health_check_interval;	//!< How often the manager thread checks idle connections
+						//!< with the alive callback (0 is never).
+	uint64_t	failures;		//!< Number of failed attempts to open a connection.
+#ifdef WITH_CONNECTION_AFFINITY
+	fr_connection_cache_t *cache;		//!< Per-thread connection caches.
+#endif
+
 	fr_heap_t	*heap;			//!< For the next connection heap
 
 	fr_connection_t	*head;			//!< Start of the connection list.
@@ -120,6 +163,13 @@ struct fr_connection_pool_t {
 						//!< should block on this condition if pending != 0.
 	pthread_cond_t	done_reconnecting;	//!< Before calling the create callback, threads should
 						//!< block on this condition if reconnecting == true.
+	fr_fiber_cond_t	available;		//!< Signalled when a connection is opened or released,
+						//!< or when opening one fails.
+
+	pthread_t	manager;		//!< Opens and health checks connections in the background.
+	bool		manager_running;	//!< Whether the manager thread was started.
+	bool		manager_stop;		//!< Tell the manager thread to exit.
+	pthread_cond_t	manage;			//!< Wakes the manager thread.
 #endif
 
 	CONF_SECTION	*cs;			//!< Configuration section holding the section of parsed
@@ -136,6 +186,8 @@ struct fr_connection_pool_t {
 	fr_connection_create_t	create;		//!< Function used to create new connections.
 	fr_connection_alive_t	alive;		//!< Function used to check status of connections.
 	fr_connection_pool_reconnect_t reconnect;	//!< Called during connection pool reconnect.
+	fr_connection_cancel_t	cancel;		//!< Aborts operations on connections whose
+						//!< request has timed out.
 
 	fr_connection_pool_state_t state;	//!< Stats and state of the connection pool.
 };
@@ -144,10 +196,16 @@ struct fr_connection_pool_t {
 #  define PTHREAD_MUTEX_LOCK pthread_mutex_lock
 #  define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
 #  define PTHREAD_COND_BROADCAST pthread_cond_broadcast
+#  define PTHREAD_COND_SIGNAL pthread_cond_signal
+#  define FIBER_COND_BROADCAST fr_fiber_cond_broadcast
+#  define FIBER_COND_SIGNAL fr_fiber_cond_signal
 #else
 #  define PTHREAD_MUTEX_LOCK(_x)
 #  define PTHREAD_MUTEX_UNLOCK(_x)
 #  define PTHREAD_COND_BROADCAST(_x)
+#  define PTHREAD_COND_SIGNAL(_x)
+#  define FIBER_COND_BROADCAST(_x)
+#  define FIBER_COND_SIGNAL(_x)
 #endif
 
 static const CONF_PARSER connection_config[] = {
@@ -163,6 +221,9 @@ static const CONF_PARSER connection_config[] = {
 	{ FR_CONF_OFFSET("connect_timeout", PW_TYPE_TIMEVAL, fr_connection_pool_t, connect_timeout), .dflt = "3.0" },
 	{ FR_CONF_OFFSET("retry_delay", PW_TYPE_INTEGER, fr_connection_pool_t, retry_delay), .dflt = "1" },
 	{ FR_CONF_OFFSET("spread", PW_TYPE_BOOLEAN, fr_connection_pool_t, spread), .dflt = "no" },
+	{ FR_CONF_OFFSET("affinity", PW_TYPE_BOOLEAN, fr_connection_pool_t, affinity), .dflt = "no" },
+	{ FR_CONF_OFFSET("background", PW_TYPE_BOOLEAN, fr_connection_pool_t, background), .dflt = "no" },
+	{ FR_CONF_OFFSET("health_check_interval", PW_TYPE_INTEGER, fr_connection_pool_t, health_check_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -272,6 +333,119 @@ static inline void fr_connection_trigger_exec(fr_connection_pool_t *pool, char c
 	trigger_exec(NULL, pool->cs, name, true, NULL);
 }
 
+#ifdef WITH_CONNECTION_AFFINITY
+static atomic_int fr_connection_thread_ids;
+fr_thread_local_setup(int, fr_connection_thread_id)	/* macro */
+
+/** Find the connection cache for the current thread
+ *
+ * @param[in] pool to find the cache in.
+ * @return
+ *	- The cache slot for this thread.
+ *	- NULL if the pool doesn't use affinity, or there are too many threads.
+ */
+static inline fr_connection_cache_t *fr_connection_cache_slot(fr_connection_pool_t *pool)
+{
+	int id;
+
+	if (!pool->cache) return NULL;
+
+	id = fr_thread_local_get(fr_connection_thread_id);
+	if (id == 0) {
+		id = atomic_fetch_add(&fr_connection_thread_ids, 1) + 1;
+		(void) fr_thread_local_set(fr_connection_thread_id, id);
+	}
+	if (id > FR_CONNECTION_CACHE_SLOTS) return NULL;
+
+	return &pool->cache[id - 1];
+}
+
+/** Return a connection a thread had cached to the shared pool
+ *
+ * Cached connections are counted as active, as they're not in the heap.
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @param[in] pool to return the connection to.
+ * @param[in] this connection to return.
+ */
+static void fr_connection_unpark(fr_connection_pool_t *pool, fr_connection_t *this)
+{
+	this->in_use = false;
+
+	rad_assert(pool->state.active != 0);
+	pool->state.active--;
+
+	fr_heap_insert(pool->heap, this);
+}
+
+/** Take a cached connection from any thread
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @param[in] pool to take the connection from.
+ * @return
+ *	- A connection, which the caller now owns.
+ *	- NULL if no threads have cached connections.
+ */
+static fr_connection_t *fr_connection_cache_steal(fr_connection_pool_t *pool)
+{
+	int i;
+
+	if (!pool->cache) return NULL;
+
+	for (i = 0; i < FR_CONNECTION_CACHE_SLOTS; i++) {
+		fr_connection_t *this;
+
+		if (!atomic_load(&pool->cache[i].parked)) continue;
+
+		this = atomic_exchange(&pool->cache[i].parked, NULL);
+		if (this) return this;
+	}
+
+	return NULL;
+}
+
+/** Return cached connections to the shared pool
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @param[in] pool to flush.
+ * @param[in] now current time.
+ * @param[in] all if true, return all cached connections, otherwise only those
+ *	which have been idle for longer than idle_timeout.
+ */
+static void fr_connection_cache_flush(fr_connection_pool_t *pool, time_t now, bool all)
+{
+	int i;
+
+	if (!pool->cache) return;
+
+	for (i = 0; i < FR_CONNECTION_CACHE_SLOTS; i++) {
+		fr_connection_t *this, *expected = NULL;
+
+		if (!atomic_load(&pool->cache[i].parked)) continue;
+
+		this = atomic_exchange(&pool->cache[i].parked, NULL);
+		if (!this) continue;
+
+		if (all ||
+		    ((pool->idle_timeout > 0) && ((this->last_released.tv_sec + pool->idle_timeout) < now))) {
+			fr_connection_unpark(pool, this);
+			continue;
+		}
+
+		/*
+		 *	Still fresh, give it back, unless the thread
+		 *	has parked another one in the meantime.
+		 */
+		if (!atomic_compare_exchange_strong(&pool->cache[i].parked, &expected, this)) {
+			fr_connection_unpark(pool, this);
+		}
+	}
+}
+#endif
+
 /** Find a connection handle in the connection list
  *
  * Walks over the list of connections searching for a specified connection
@@ -447,8 +621,10 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool, time_t n
 		PTHREAD_MUTEX_LOCK(&pool->mutex);
 		pool->max_pending = 1;
 		pool->state.pending--;
+		pool->failures++;
 
 		PTHREAD_COND_BROADCAST(&pool->done_spawn);
+		FIBER_COND_BROADCAST(&pool->available);
 		PTHREAD_MUTEX_UNLOCK(&pool->mutex);
 
 		talloc_free(ctx);
@@ -517,11 +693,86 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool, time_t n
 	fr_connection_trigger_exec(pool, "open");
 
 	PTHREAD_COND_BROADCAST(&pool->done_spawn);
+	if (!in_use) FIBER_COND_BROADCAST(&pool->available);
 	PTHREAD_MUTEX_UNLOCK(&pool->mutex);
 
 	return this;
 }
 
+#ifdef HAVE_PTHREAD_H
+/** Open a connection in a separate thread
+ *
+ */
+static void *fr_connection_spawn_thread(void *arg)
+{
+	fr_connection_pool_t *pool = arg;
+
+	return fr_connection_spawn(pool, time(NULL), false);
+}
+#endif
+
+/** Open the 'start' connections for a new pool
+ *
+ * If the server is threaded, the connections are opened in parallel, so the
+ * time taken is that of the slowest connection instead of the sum of all of them.
+ *
+ * @param[in] pool to open connections for.
+ * @param[in] now current time.
+ * @return
+ *	- 0 if all connections were opened.
+ *	- -1 if any failed.
+ */
+static int fr_connection_spawn_start(fr_connection_pool_t *pool, time_t now)
+{
+	uint32_t	i;
+
+#ifdef HAVE_PTHREAD_H
+	if (main_config.spawn_workers && (pool->start > 1)) {
+		pthread_t	*threads;
+		uint32_t	num = 0;
+		int		ret = 0;
+
+		threads = talloc_array(NULL, pthread_t, pool->start);
+		if (!threads) return -1;
+
+		for (i = 0; i < pool->start; i++) {
+			if (pthread_create(&threads[num], NULL, fr_connection_spawn_thread, pool) == 0) {
+				num++;
+				continue;
+			}
+
+			/*
+			 *	Couldn't create the thread, open the
+			 *	connection ourselves.
+			 */
+			if (!fr_connection_spawn(pool, now, false)) ret = -1;
+		}
+
+		/*
+		 *	Let other modules instantiate whilst we wait.
+		 */
+		modules_instantiate_yield();
+		for (i = 0; i < num; i++) {
+			void *this;
+
+			pthread_join(threads[i], &this);
+			if (!this) ret = -1;
+		}
+		modules_instantiate_resume();
+
+		talloc_free(threads);
+
+		return ret;
+	}
+#endif
+
+	for (i = 0; i < pool->start; i++) {
+		if (!fr_connection_spawn(pool, now, false)) return -1;
+	}
+
+	return 0;
+}
+
 /** Close an existing connection.
  *
  * Removes the connection from the list, calls the delete callback to close
@@ -535,6 +786,13 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool, time_t n
  */
 static void fr_connection_close_internal(fr_connection_pool_t *pool, fr_connection_t *this)
 {
+#ifdef WITH_CONNECTION_AFFINITY
+	fr_connection_cache_t *slot;
+
+	slot = fr_connection_cache_slot(pool);
+	if (slot && (slot->reserved == this)) slot->reserved = NULL;
+#endif
+
 	/*
 	 *	If it's in use, release it.
 	 */
@@ -653,6 +911,14 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool)
 		return 1;
 	}
 
+#ifdef WITH_CONNECTION_AFFINITY
+	/*
+	 *	Connections cached by threads which have gone
+	 *	idle are returned to the pool, so they can expire.
+	 */
+	fr_connection_cache_flush(pool, now, false);
+#endif
+
 	/*
 	 *	Some idle connections are OK, if they're within the
 	 *	configured "spare" range.  Any extra connections
@@ -739,11 +1005,21 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool)
 	 *	a connection. Avoids spurious log messages.
 	 */
 	if (spawn) {
-		INFO("%s: Need %i more connections to reach %i spares",
-		     pool->log_prefix, spawn, pool->spare);
-		PTHREAD_MUTEX_UNLOCK(&pool->mutex);
-		fr_connection_spawn(pool, now, false); /* ignore return code */
-		PTHREAD_MUTEX_LOCK(&pool->mutex);
+#ifdef HAVE_PTHREAD_H
+		/*
+		 *	Let the manager thread open them.
+		 */
+		if (pool->background && pool->manager_running) {
+			PTHREAD_COND_SIGNAL(&pool->manage);
+		} else
+#endif
+		{
+			INFO("%s: Need %i more connections to reach %i spares",
+			     pool->log_prefix, spawn, pool->spare);
+			PTHREAD_MUTEX_UNLOCK(&pool->mutex);
+			fr_connection_spawn(pool, now, false); /* ignore return code */
+			PTHREAD_MUTEX_LOCK(&pool->mutex);
+		}
 	}
 
 	/*
@@ -792,6 +1068,240 @@ done:
 	return 1;
 }
 
+#ifdef HAVE_PTHREAD_H
+/** Work out how many connections the manager thread should open
+ *
+ * Enough to reach "min", and to keep "spare" idle connections, plus one for
+ * each recent reservation which had to wait, and one for each thread which
+ * is waiting now.  Never more than "max".
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @param[in] pool to check.
+ * @return the number of connections to open.
+ */
+static uint32_t fr_connection_manager_need(fr_connection_pool_t *pool)
+{
+	uint32_t have, idle, target, want = 0;
+
+	have = pool->state.num + pool->state.pending;
+	if (have >= pool->max) return 0;
+
+	if (have < pool->min) want = pool->min - have;
+
+	idle = (pool->state.num - pool->state.active) + pool->state.pending;
+	target = pool->spare + pool->ramp + pool->waiting;
+	if ((idle < target) && ((target - idle) > want)) want = target - idle;
+
+	if ((have + want) > pool->max) want = pool->max - have;
+
+	return want;
+}
+
+/** Check idle connections with the module's alive callback
+ *
+ * Each connection which has been idle, and unchecked, for "health_check_interval"
+ * seconds is reserved while it's checked, so no request can pick it up.  Dead
+ * connections are closed, so requests never have to discover them.
+ *
+ * @note Must be called with the mutex held.  Returns with the mutex held.
+ *
+ * @param[in] pool to check.
+ * @param[in] now current time.
+ */
+static void fr_connection_health_check(fr_connection_pool_t *pool, time_t now)
+{
+	fr_connection_t *this;
+
+	if (!pool->alive || !pool->health_check_interval) return;
+
+	while (!pool->manager_stop) {
+		int ret;
+
+		for (this = pool->head; this != NULL; this = this->next) {
+			if (this->in_use) continue;
+			if ((this->last_released.tv_sec + (time_t) pool->health_check_interval) > now) continue;
+			if ((this->health_checked + (time_t) pool->health_check_interval) > now) continue;
+			break;
+		}
+		if (!this) break;
+
+		fr_heap_extract(pool->heap, this);
+		this->in_use = true;
+		this->health_checked = now;
+		pool->state.active++;
+#ifdef PTHREAD_DEBUG
+		this->pthread_id = pthread_self();
+#endif
+		PTHREAD_MUTEX_UNLOCK(&pool->mutex);
+
+		ret = pool->alive(pool->opaque, this->connection);
+
+		PTHREAD_MUTEX_LOCK(&pool->mutex);
+		if (ret < 0) {
+			INFO("%s: Closing connection (%" PRIu64 "): Failed health check", pool->log_prefix,
+			     this->number);
+			fr_connection_close_internal(pool, this);
+			continue;
+		}
+
+		this->in_use = false;
+		pool->state.active--;
+		fr_heap_insert(pool->heap, this);
+
+		if (pool->waiting) FIBER_COND_SIGNAL(&pool->available);
+	}
+}
+
+/** Open and health check connections in the background
+ *
+ * If "background" is set, keeps connections open ahead of demand, so that
+ * requests don't have to wait for a connection to be opened.  Demand is the
+ * number of reservations which found no free connection.  It's sampled once
+ * a second, and the extra connections it causes to be opened decay by half
+ * each second.  After a failure, the next attempt is made "retry_delay"
+ * seconds later.
+ *
+ * If "health_check_interval" is set, idle connections are checked with
+ * fr_connection_health_check().
+ *
+ * @param[in] arg the connection pool.
+ * @return NULL.
+ */
+static void *fr_connection_manager(void *arg)
+{
+	fr_connection_pool_t	*pool = arg;
+	time_t			last_sampled = 0;
+
+	PTHREAD_MUTEX_LOCK(&pool->mutex);
+	while (!pool->manager_stop) {
+		struct timespec	ts;
+		time_t		now = time(NULL);
+
+		if (now != last_sampled) {
+			pool->ramp >>= 1;
+			if (pool->demand > pool->ramp) pool->ramp = pool->demand;
+			pool->demand = 0;
+			last_sampled = now;
+		}
+
+		if (pool->background && fr_connection_manager_need(pool) &&
+		    (!pool->state.last_failed || ((pool->state.last_failed + pool->retry_delay) <= now))) {
+			fr_connection_t *this;
+
+			PTHREAD_MUTEX_UNLOCK(&pool->mutex);
+			this = fr_connection_spawn(pool, now, false);
+			PTHREAD_MUTEX_LOCK(&pool->mutex);
+
+			if (this) continue;
+		}
+
+		fr_connection_health_check(pool, now);
+
+		ts.tv_sec = now + 1;
+		ts.tv_nsec = 0;
+		pthread_cond_timedwait(&pool->manage, &pool->mutex, &ts);
+	}
+	PTHREAD_MUTEX_UNLOCK(&pool->mutex);
+
+	return NULL;
+}
+
+/** Wait for the manager thread to open a connection, or for one to be released
+ *
+ * @note Must be called with the mutex held.  Returns with the mutex held.
+ *
+ * @param[in] pool to reserve the connection from.
+ * @param[in] now current time.
+ * @return
+ *	- A connection, which has been removed from the heap.
+ *	- NULL if no connection became free within "connect_timeout", or
+ *	  the manager thread failed to open one.
+ */
+static fr_connection_t *fr_connection_wait(fr_connection_pool_t *pool, time_t now)
+{
+	fr_connection_t	*this = NULL;
+	struct timeval	start, end, waited;
+	struct timespec	ts;
+	uint64_t	failures = pool->failures;
+	bool		timed_out = false;
+
+	/*
+	 *	The last attempt failed, and the manager thread
+	 *	won't try again yet.
+	 */
+	if (pool->state.last_failed && ((pool->state.last_failed + pool->retry_delay) > now)) {
+		bool complain = false;
+
+		if (pool->state.last_throttled != now) {
+			complain = true;
+
+			pool->state.last_throttled = now;
+		}
+
+		if (!RATE_LIMIT_ENABLED || complain) {
+			ERROR("%s: Last connection attempt failed, waiting %d seconds before retrying",
+			      pool->log_prefix, pool->retry_delay);
+		}
+
+		return NULL;
+	}
+
+	DEBUG2("%s: %i of %u connections in use.  Waiting for a connection.  You may need to increase \"spare\"",
+	       pool->log_prefix, pool->state.active, pool->state.num);
+
+	gettimeofday(&start, NULL);
+	timeradd(&start, &pool->connect_timeout, &end);
+	ts.tv_sec = end.tv_sec;
+	ts.tv_nsec = end.tv_usec * 1000;
+
+	pool->demand++;
+	pool->waiting++;
+	PTHREAD_COND_SIGNAL(&pool->manage);
+
+	while (true) {
+		do {
+			this = fr_heap_peek(pool->heap);
+			if (!this) break;
+		} while (!fr_connection_manage(pool, this, now));
+
+#ifdef WITH_CONNECTION_AFFINITY
+		if (!this) {
+			this = fr_connection_cache_steal(pool);
+			if (this) {
+				fr_connection_unpark(pool, this);
+				continue;
+			}
+		}
+#endif
+
+		if (this) {
+			fr_heap_extract(pool->heap, this);
+			break;
+		}
+
+		if (timed_out || pool->manager_stop || (pool->failures != failures)) break;
+
+		/*
+		 *	On a fiber, the connection may be released by
+		 *	another fiber on this thread, so let it run.
+		 */
+		if (fr_fiber_cond_timedwait(&pool->available, &pool->mutex, &ts) == ETIMEDOUT) timed_out = true;
+	}
+
+	pool->waiting--;
+
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &waited);
+	pool->state.waited++;
+	pool->state.wait_usec += (waited.tv_sec * (uint64_t) 1000000) + waited.tv_usec;
+
+	if (!this) RATE_LIMIT(ERROR("%s: No connection became available", pool->log_prefix));
+
+	return this;
+}
+#endif
+
 /** Get a connection from the connection pool
  *
  * @note Must be called with the mutex free.
@@ -806,9 +1316,45 @@ static void *fr_connection_get_internal(fr_connection_pool_t *pool, bool spawn)
 {
 	time_t now;
 	fr_connection_t *this;
+#ifdef WITH_CONNECTION_AFFINITY
+	fr_connection_cache_t *slot;
+#endif
 
 	if (!pool) return NULL;
 
+#ifdef WITH_CONNECTION_AFFINITY
+	/*
+	 *	Re-use the connection this thread released last,
+	 *	without touching the mutex.
+	 */
+	slot = fr_connection_cache_slot(pool);
+	if (slot && (this = atomic_exchange(&slot->parked, NULL))) {
+		now = time(NULL);
+
+		if (!this->needs_reconnecting &&
+		    ((pool->max_uses == 0) || (this->num_uses < pool->max_uses)) &&
+		    ((pool->lifetime == 0) || ((this->created + pool->lifetime) >= now))) {
+			this->num_uses++;
+			gettimeofday(&this->last_reserved, NULL);
+#ifdef PTHREAD_DEBUG
+			this->pthread_id = pthread_self();
+#endif
+			slot->reserved = this;
+
+			DEBUG2("%s: Reserved cached connection (%" PRIu64 ")", pool->log_prefix, this->number);
+
+			return this->connection;
+		}
+
+		/*
+		 *	Let the pool close it.
+		 */
+		PTHREAD_MUTEX_LOCK(&pool->mutex);
+		fr_connection_unpark(pool, this);
+		PTHREAD_MUTEX_UNLOCK(&pool->mutex);
+	}
+#endif
+
 	PTHREAD_MUTEX_LOCK(&pool->mutex);
 
 	now = time(NULL);
@@ -818,11 +1364,28 @@ static void *fr_connection_get_internal(fr_connection_pool_t *pool, bool spawn)
 	 *	for limits.  If "connection manage" says the link is
 	 *	no longer usable, go grab another one.
 	 */
+#ifdef WITH_CONNECTION_AFFINITY
+retry:
+#endif
 	do {
 		this = fr_heap_peek(pool->heap);
 		if (!this) break;
 	} while (!fr_connection_manage(pool, this, now));
 
+#ifdef WITH_CONNECTION_AFFINITY
+	/*
+	 *	Use a connection another thread has cached
+	 *	before opening a new one.
+	 */
+	if (!this) {
+		this = fr_connection_cache_steal(pool);
+		if (this) {
+			fr_connection_unpark(pool, this);
+			goto retry;
+		}
+	}
+#endif
+
 	/*
 	 *	We have a working connection.  Extract it from the
 	 *	heap and use it.
@@ -856,6 +1419,20 @@ static void *fr_connection_get_internal(fr_connection_pool_t *pool, bool spawn)
 		return NULL;
 	}
 
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	Let the manager thread open a connection, and use
+	 *	whichever connection becomes free first.
+	 */
+	if (spawn && pool->background && pool->manager_running) {
+		this = fr_connection_wait(pool, now);
+		if (this) goto do_return;
+
+		PTHREAD_MUTEX_UNLOCK(&pool->mutex);
+		return NULL;
+	}
+#endif
+
 	PTHREAD_MUTEX_UNLOCK(&pool->mutex);
 
 	if (!spawn) return NULL;
@@ -877,6 +1454,10 @@ do_return:
 #endif
 	PTHREAD_MUTEX_UNLOCK(&pool->mutex);
 
+#ifdef WITH_CONNECTION_AFFINITY
+	if (slot) slot->reserved = this;
+#endif
+
 	DEBUG2("%s: Reserved connection (%" PRIu64 ")", pool->log_prefix, this->number);
 
 	return this->connection;
@@ -943,9 +1524,7 @@ fr_connection_pool_t *fr_connection_pool_init(TALLOC_CTX *ctx,
 					      fr_connection_alive_t a,
 					      char const *log_prefix)
 {
-	uint32_t i;
 	fr_connection_pool_t *pool;
-	fr_connection_t *this;
 	time_t now;
 
 	if (!cs || !opaque || !c) return NULL;
@@ -1029,6 +1608,8 @@ fr_connection_pool_t *fr_connection_pool_init(TALLOC_CTX *ctx,
 	pthread_mutex_init(&pool->mutex, NULL);
 	pthread_cond_init(&pool->done_spawn, NULL);
 	pthread_cond_init(&pool->done_reconnecting, NULL);
+	fr_fiber_cond_init(&pool->available);
+	pthread_cond_init(&pool->manage, NULL);
 #endif
 
 	DEBUG2("%s: Initialising connection pool", pool->log_prefix);
@@ -1044,6 +1625,16 @@ fr_connection_pool_t *fr_connection_pool_init(TALLOC_CTX *ctx,
 	}
 	pool->max_pending = pool->max; /* can open all connections now */
 
+	if (pool->affinity) {
+#ifdef WITH_CONNECTION_AFFINITY
+		pool->cache = talloc_zero_array(pool, fr_connection_cache_t, FR_CONNECTION_CACHE_SLOTS);
+		if (!pool->cache) goto error;
+#else
+		WARN("%s: Ignoring \"affinity\", server was built without support for atomic operations",
+		     log_prefix);
+#endif
+	}
+
 	if (pool->min > pool->max) {
 		cf_log_err_cs(cs, "Cannot set 'min' to more than 'max'");
 		goto error;
@@ -1082,13 +1673,37 @@ fr_connection_pool_t *fr_connection_pool_init(TALLOC_CTX *ctx,
 	 *	Create all of the connections, unless the admin says
 	 *	not to.
 	 */
-	for (i = 0; i < pool->start; i++) {
-		this = fr_connection_spawn(pool, now, false);
-		if (!this) {
-		error:
-			fr_connection_pool_free(pool);
-			return NULL;
+	if (fr_connection_spawn_start(pool, now) < 0) {
+	error:
+		fr_connection_pool_free(pool);
+		return NULL;
+	}
+
+	if (pool->health_check_interval && !pool->alive) {
+		WARN("%s: Ignoring \"health_check_interval\", module does not support health checks",
+		     pool->log_prefix);
+		pool->health_check_interval = 0;
+	}
+
+	/*
+	 *	From now on, open and check connections in the background.
+	 */
+	if (pool->background || pool->health_check_interval) {
+#ifdef HAVE_PTHREAD_H
+		if (!main_config.spawn_workers) {
+			WARN("%s: Ignoring \"background\" and \"health_check_interval\", server is not using threads",
+			     pool->log_prefix);
+			pool->background = false;
+		} else if (pthread_create(&pool->manager, NULL, fr_connection_manager, pool) != 0) {
+			ERROR("%s: Failed starting manager thread: %s", pool->log_prefix, fr_syserror(errno));
+			goto error;
+		} else {
+			pool->manager_running = true;
 		}
+#else
+		WARN("%s: Ignoring \"background\" and \"health_check_interval\", server was built without "
+		     "thread support", pool->log_prefix);
+#endif
 	}
 
 	fr_connection_trigger_exec(pool, "start");
@@ -1114,6 +1729,7 @@ fr_connection_pool_t *fr_connection_pool_copy(TALLOC_CTX *ctx, fr_connection_poo
 
 	if (pool->trigger_prefix) fr_connection_pool_enable_triggers(copy, pool->trigger_prefix);
 	if (pool->trigger_args) fr_connection_pool_trigger_args(copy, pool->trigger_args);
+	copy->cancel = pool->cancel;
 
 	return copy;
 }
@@ -1169,6 +1785,16 @@ void fr_connection_pool_reconnect_func(fr_connection_pool_t *pool, fr_connection
 	pool->reconnect = reconnect;
 }
 
+/** Set a callback to abort operations on connections whose request has timed out
+ *
+ * @param[in] pool to set cancel callback for.
+ * @param[in] cancel callback, see #fr_connection_cancel_t.
+ */
+void fr_connection_pool_cancel_func(fr_connection_pool_t *pool, fr_connection_cancel_t cancel)
+{
+	pool->cancel = cancel;
+}
+
 /** Mark connections for reconnection, and spawn at least 'start' connections
  *
  * @note This call may block whilst waiting for pending connection attempts to complete.
@@ -1206,6 +1832,13 @@ int fr_connection_pool_reconnect(fr_connection_pool_t *pool)
 	while (pool->state.pending) pthread_cond_wait(&pool->done_spawn, &pool->mutex);
 #endif
 
+#ifdef WITH_CONNECTION_AFFINITY
+	/*
+	 *	Cached connections need reconnecting too.
+	 */
+	fr_connection_cache_flush(pool, time(NULL), true);
+#endif
+
 	/*
 	 *	We want to ensure at least 'start' connections
 	 *	have been reconnected. We can't call reconnect
@@ -1290,6 +1923,19 @@ void fr_connection_pool_free(fr_connection_pool_t *pool)
 
 	DEBUG2("%s: Removing connection pool", pool->log_prefix);
 
+#ifdef HAVE_PTHREAD_H
+	if (pool->manager_running) {
+		PTHREAD_MUTEX_LOCK(&pool->mutex);
+		pool->manager_stop = true;
+		pthread_cond_signal(&pool->manage);
+		fr_fiber_cond_broadcast(&pool->available);
+		PTHREAD_MUTEX_UNLOCK(&pool->mutex);
+
+		pthread_join(pool->manager, NULL);
+		pool->manager_running = false;
+	}
+#endif
+
 	PTHREAD_MUTEX_LOCK(&pool->mutex);
 
 	/*
@@ -1314,6 +1960,8 @@ void fr_connection_pool_free(fr_connection_pool_t *pool)
 	pthread_mutex_destroy(&pool->mutex);
 	pthread_cond_destroy(&pool->done_spawn);
 	pthread_cond_destroy(&pool->done_reconnecting);
+	fr_fiber_cond_destroy(&pool->available);
+	pthread_cond_destroy(&pool->manage);
 #endif
 
 	talloc_free(pool);
@@ -1340,7 +1988,15 @@ void fr_connection_pool_free(fr_connection_pool_t *pool)
  */
 void *fr_connection_get(fr_connection_pool_t *pool)
 {
-	return fr_connection_get_internal(pool, true);
+	void *conn;
+
+	if (!pool) return NULL;
+
+	FR_PROBE1(pool_get_start, pool->log_prefix);
+	conn = fr_connection_get_internal(pool, true);
+	FR_PROBE2(pool_get_done, pool->log_prefix, conn);
+
+	return conn;
 }
 
 /** Release a connection
@@ -1355,9 +2011,43 @@ void *fr_connection_get(fr_connection_pool_t *pool)
 void fr_connection_release(fr_connection_pool_t *pool, void *conn)
 {
 	fr_connection_t *this;
+#ifdef WITH_CONNECTION_AFFINITY
+	fr_connection_cache_t *slot;
+#endif
 
-	this = fr_connection_find(pool, conn);
-	if (!this) return;
+	if (!pool) return;
+
+	FR_PROBE2(pool_release, pool->log_prefix, conn);
+
+#ifdef WITH_CONNECTION_AFFINITY
+	/*
+	 *	Keep the connection for this thread, without
+	 *	touching the mutex.
+	 */
+	slot = fr_connection_cache_slot(pool);
+	if (slot && slot->reserved && (slot->reserved->connection == conn)) {
+		fr_connection_t *expected = NULL;
+
+		this = slot->reserved;
+		slot->reserved = NULL;
+
+		if (!this->needs_reconnecting) {
+			gettimeofday(&this->last_released, NULL);
+
+			if (atomic_compare_exchange_strong(&slot->parked, &expected, this)) {
+				DEBUG2("%s: Released connection (%" PRIu64 ") to thread cache",
+				       pool->log_prefix, this->number);
+				return;
+			}
+		}
+
+		PTHREAD_MUTEX_LOCK(&pool->mutex);
+	} else
+#endif
+	{
+		this = fr_connection_find(pool, conn);
+		if (!this) return;
+	}
 
 	this->in_use = false;
 
@@ -1380,6 +2070,11 @@ void fr_connection_release(fr_connection_pool_t *pool, void *conn)
 	rad_assert(pool->state.active != 0);
 	pool->state.active--;
 
+	/*
+	 *	Hand it to a thread waiting for a connection.
+	 */
+	if (pool->waiting) FIBER_COND_SIGNAL(&pool->available);
+
 	DEBUG2("%s: Released connection (%" PRIu64 ")", pool->log_prefix, this->number);
 
 	/*
@@ -1468,3 +2163,49 @@ int fr_connection_close(fr_connection_pool_t *pool, void *conn)
 	fr_connection_pool_check(pool);
 	return 1;
 }
+
+/** Cancel the operation a request is blocked in on a connection
+ *
+ * The connection is looked up here, rather than when the watch is set,
+ * as requests very rarely time out.
+ */
+static void _connection_cancel(UNUSED REQUEST *request, void *uctx, void *handle)
+{
+	fr_connection_pool_t	*pool = uctx;
+	fr_connection_t		*this;
+
+	PTHREAD_MUTEX_LOCK(&pool->mutex);
+	for (this = pool->head; this != NULL; this = this->next) {
+		if (this->connection != handle) continue;
+
+		ERROR("%s: Cancelling operation on connection (%" PRIu64 ")", pool->log_prefix, this->number);
+
+		/*
+		 *	We've no idea what state the connection
+		 *	is in now, so close it when it's released.
+		 */
+		this->needs_reconnecting = true;
+		pool->cancel(pool->opaque, this->connection);
+		break;
+	}
+	PTHREAD_MUTEX_UNLOCK(&pool->mutex);
+}
+
+/** Allow an operation on a connection to be cancelled if the request times out
+ *
+ * Should be called just before a blocking call on the connection, with
+ * request_cancel_clear() being called as soon as it returns, and before
+ * the connection is released or reconnected.
+ *
+ * Does nothing if the pool has no cancel callback.
+ *
+ * @param[in] pool the connection belongs to.
+ * @param[in] request the operation is for.
+ * @param[in] conn about to be used.
+ */
+void fr_connection_cancel_watch(fr_connection_pool_t *pool, REQUEST *request, void *conn)
+{
+	if (!pool || !pool->cancel || !request) return;
+
+	request_cancel_set(request, _connection_cancel, pool, conn);
+}
@@ -26,7 +26,20 @@ RCSID("$Id$")
 #include <crypt.h>
 #endif
 
-#ifdef HAVE_PTHREAD_H
+#ifdef HAVE_CRYPT_R
+/*
+ *	crypt_r() keeps its state in a struct crypt_data, which can be
+ *	large (128K with libxcrypt), so each thread gets its own on the
+ *	heap rather than the stack.  No lock is needed, so expensive
+ *	hashes e.g. SHA-512 with many rounds are checked in parallel.
+ */
+fr_thread_local_setup(struct crypt_data *, fr_crypt_data)
+
+static void _fr_crypt_data_free(void *arg)
+{
+	free(arg);
+}
+#elif defined(HAVE_PTHREAD_H)
 #include <pthread.h>
 
 /*
@@ -57,6 +70,27 @@ int fr_crypt_check(char const *key, char const *crypted)
 	char *passwd;
 	int cmp = 0;
 
+#ifdef HAVE_CRYPT_R
+	struct crypt_data *data;
+
+	data = fr_thread_local_init(fr_crypt_data, _fr_crypt_data_free);
+	if (!data) {
+		/*
+		 *	Zeroed, which is how crypt_r() wants it
+		 *	on first use.
+		 */
+		data = calloc(1, sizeof(*data));
+		if (!data) return -1;
+
+		if (fr_thread_local_set(fr_crypt_data, data) != 0) {
+			free(data);
+			return -1;
+		}
+	}
+
+	passwd = crypt_r(key, crypted, data);
+	if (passwd) cmp = strcmp(crypted, passwd);
+#else
 #ifdef HAVE_PTHREAD_H
 	/*
 	 *	Ensure we're thread-safe, as crypt() isn't.
@@ -81,6 +115,7 @@ int fr_crypt_check(char const *key, char const *crypted)
 	}
 
 	PTHREAD_MUTEX_UNLOCK(&fr_crypt_mutex);
+#endif
 
 	/*
 	 *	Error.
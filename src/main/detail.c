@@ -26,6 +26,7 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/detail.h>
+#include <freeradius-devel/net.h>
 #include <freeradius-devel/process.h>
 #include <freeradius-devel/rad_assert.h>
 
@@ -39,6 +40,10 @@ RCSID("$Id$")
 
 #include <fcntl.h>
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 #ifdef WITH_DETAIL
 
 #define USEC (1000000)
@@ -56,6 +61,283 @@ static FR_NAME_NUMBER state_names[] = {
 	{ NULL, 0 }
 };
 
+/*
+ *	Read detail.work a line at a time, either from memory, or
+ *	with stdio if we can't map it.
+ *
+ *	When it's mapped, lines are found with memchr(), and copied
+ *	once into the caller's buffer.  The pair parser needs them
+ *	NUL terminated.
+ */
+#ifdef HAVE_SYS_MMAN_H
+static void detail_unmap(listen_detail_t *data)
+{
+	if (data->map) munmap(data->map, data->map_len);
+	data->map = NULL;
+	data->map_len = data->map_pos = 0;
+}
+
+/*
+ *	(Re-)map the whole file.  It normally doesn't change, but
+ *	a writer which hasn't noticed the rename may still append
+ *	to it.
+ */
+static int detail_map(listen_detail_t *data)
+{
+	struct stat	buf;
+	size_t		pos = data->map_pos;
+	void		*map;
+
+	if (fstat(data->work_fd, &buf) < 0) return -1;
+
+	if ((size_t) buf.st_size == data->map_len) return 0;
+
+	detail_unmap(data);
+	if (buf.st_size == 0) return 0;
+
+	map = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, data->work_fd, 0);
+	if (map == MAP_FAILED) return -1;
+
+	data->map = map;
+	data->map_len = buf.st_size;
+	data->map_pos = pos;
+
+	return 0;
+}
+#endif
+
+static char *detail_gets(listen_detail_t *data, char *buffer, size_t size)
+{
+#ifdef HAVE_SYS_MMAN_H
+	char const	*p, *nl;
+	size_t		len;
+
+	if (data->map_pos >= data->map_len) return NULL;
+
+	p = data->map + data->map_pos;
+	len = data->map_len - data->map_pos;
+
+	nl = memchr(p, '\n', len);
+	if (nl) len = (nl - p) + 1;
+	if (len > (size - 1)) len = size - 1;
+
+	memcpy(buffer, p, len);
+	buffer[len] = '\0';
+	data->map_pos += len;
+
+	return buffer;
+#else
+	return fgets(buffer, size, data->fp);
+#endif
+}
+
+static size_t detail_read(listen_detail_t *data, void *buffer, size_t size)
+{
+#ifdef HAVE_SYS_MMAN_H
+	if (size > (data->map_len - data->map_pos)) size = data->map_len - data->map_pos;
+
+	memcpy(buffer, data->map + data->map_pos, size);
+	data->map_pos += size;
+
+	return size;
+#else
+	return fread(buffer, 1, size, data->fp);
+#endif
+}
+
+/*
+ *	The next character, without consuming it.
+ */
+static int detail_peek(listen_detail_t *data)
+{
+#ifdef HAVE_SYS_MMAN_H
+	if (data->map_pos >= data->map_len) return EOF;
+
+	return (uint8_t) data->map[data->map_pos];
+#else
+	int c;
+
+	c = getc(data->fp);
+	if (c != EOF) ungetc(c, data->fp);
+
+	return c;
+#endif
+}
+
+static off_t detail_tell(listen_detail_t *data)
+{
+#ifdef HAVE_SYS_MMAN_H
+	return data->map_pos;
+#else
+	return ftell(data->fp);
+#endif
+}
+
+static int detail_seek(listen_detail_t *data, off_t offset)
+{
+#ifdef HAVE_SYS_MMAN_H
+	if ((size_t) offset > data->map_len) {
+		errno = EINVAL;
+		return -1;
+	}
+	data->map_pos = offset;
+	return 0;
+#else
+	return fseek(data->fp, offset, SEEK_SET);
+#endif
+}
+
+/*
+ *	Whether we've read everything in the current detail.work.
+ */
+static bool detail_eof(listen_detail_t *data)
+{
+	struct stat buf;
+
+	if (!data->fp) return false;
+
+#ifdef HAVE_SYS_MMAN_H
+	if (data->map_pos < data->map_len) return false;
+
+	/*
+	 *	Pick up anything which was appended.
+	 */
+	if (detail_map(data) < 0) {
+		ERROR("detail (%s): Failed mapping detail file: %s", data->name, fr_syserror(errno));
+		return true;
+	}
+
+	return (data->map_pos >= data->map_len);
+#else
+	if (feof(data->fp)) return true;
+#endif
+
+	if (fstat(data->work_fd, &buf) < 0) {
+		ERROR("detail (%s): Failed to stat detail file: %s", data->name, fr_syserror(errno));
+		return true;
+	}
+
+	return (((off_t) ftell(data->fp)) == buf.st_size);
+}
+
+/*
+ *	Mark a record as done, for "track = yes".  Write to the fd, so
+ *	that we don't move the read position.
+ */
+static void detail_mark_done(listen_detail_t *data, off_t offset, bool binary)
+{
+	static uint8_t const done = 1;
+	ssize_t rcode;
+
+	if (binary) {
+		rcode = pwrite(data->work_fd, &done, 1, offset) - 1;
+	} else {
+		rcode = pwrite(data->work_fd, "\tDone", 5, offset) - 5;
+	}
+
+	if (rcode < 0) {
+		WARN("detail (%s): Failed marking request as done: %s",
+		     data->name, fr_syserror(errno));
+	}
+}
+
+#ifdef WITH_DETAIL_THREAD
+/*
+ *	What the workers tell the reader thread, when more than one
+ *	record may be outstanding.
+ */
+typedef struct detail_ack_t {
+	uint32_t	counter;		//!< Of the packet which finished.
+	uint32_t	replied;		//!< Whether it got a reply.
+} detail_ack_t;
+
+/*
+ *	Recover the counter which detail_packet_alloc() used to
+ *	generate the packet ID, ports, and IP.
+ */
+static uint32_t detail_packet_counter(RADIUS_PACKET const *packet)
+{
+	return (packet->id & 0xff) |
+		(((packet->src_port - 1024) & 0xff) << 8) |
+		(((packet->dst_port - 1024) & 0xff) << 16) |
+		((ntohl(packet->dst_ipaddr.ipaddr.ip4addr.s_addr) & 0xff) << 24);
+}
+
+static void detail_ack(listen_detail_t *data, RADIUS_PACKET const *packet, bool replied)
+{
+	detail_ack_t ack;
+
+	ack.counter = detail_packet_counter(packet);
+	ack.replied = replied;
+
+	if (write(data->child_pipe[1], &ack, sizeof(ack)) < 0) {
+		ERROR("detail (%s): Failed writing ack to reader thread: %s", data->name, fr_syserror(errno));
+	}
+}
+
+/*
+ *	Skip the records in detail.work which were replayed before
+ *	we were last stopped.
+ */
+static void detail_checkpoint_load(listen_detail_t *data)
+{
+	char		buffer[64];
+	ssize_t		len;
+	uint64_t	inode, offset;
+	struct stat	st;
+
+	data->checkpoint = 0;
+
+	if (fstat(data->work_fd, &st) < 0) return;
+	data->checkpoint_inode = st.st_ino;
+
+	data->checkpoint_fd = open(data->filename_checkpoint, O_RDWR | O_CREAT, 0600);
+	if (data->checkpoint_fd < 0) {
+		WARN("detail (%s): Failed opening checkpoint file %s: %s",
+		     data->name, data->filename_checkpoint, fr_syserror(errno));
+		return;
+	}
+
+	len = read(data->checkpoint_fd, buffer, sizeof(buffer) - 1);
+	if (len <= 0) return;
+	buffer[len] = '\0';
+
+	if ((sscanf(buffer, "%" SCNu64 " %" SCNu64, &inode, &offset) != 2) ||
+	    (inode != (uint64_t) st.st_ino) || (offset > (uint64_t) st.st_size)) {
+		WARN("detail (%s): Ignoring checkpoint file %s, it is for a different detail file",
+		     data->name, data->filename_checkpoint);
+		return;
+	}
+
+	if (detail_seek(data, offset) < 0) {
+		WARN("detail (%s): Failed seeking to checkpoint: %s", data->name, fr_syserror(errno));
+		return;
+	}
+
+	DEBUG("detail (%s): Resuming %s at offset %" PRIu64, data->name, data->filename_work, offset);
+	data->checkpoint = offset;
+}
+
+static void detail_checkpoint_save(listen_detail_t *data, off_t offset)
+{
+	char	buffer[64];
+	int	len;
+
+	if ((data->checkpoint_fd < 0) || (offset <= data->checkpoint)) return;
+
+	data->checkpoint = offset;
+
+	/*
+	 *	Fixed width, so that we never have to truncate.
+	 */
+	len = snprintf(buffer, sizeof(buffer), "%020" PRIu64 " %020" PRIu64 "\n",
+		       (uint64_t) data->checkpoint_inode, (uint64_t) offset);
+	if (pwrite(data->checkpoint_fd, buffer, len, 0) < 0) {
+		WARN("detail (%s): Failed writing checkpoint file %s: %s",
+		     data->name, data->filename_checkpoint, fr_syserror(errno));
+	}
+}
+#endif
 
 /*
  *	If we're limiting outstanding packets, then mark the response
@@ -71,6 +353,21 @@ int detail_send(rad_listen_t *listener, REQUEST *request)
 	rad_assert(request->listener == listener);
 	rad_assert(listener->send == detail_send);
 
+#ifdef WITH_DETAIL_THREAD
+	/*
+	 *	The reader thread tracks each record itself.
+	 */
+	if (data->max_outstanding > 1) {
+		if (request->reply->code == 0) {
+			RDEBUG("detail (%s): No response to request.  Will retry in %d seconds",
+			       data->name, data->retry_interval);
+		}
+
+		detail_ack(data, request->packet, (request->reply->code != 0));
+		return 0;
+	}
+#endif
+
 	/*
 	 *	This request timed out.  Remember that, and tell the
 	 *	caller it's OK to read more "detail" file stuff.
@@ -290,6 +587,9 @@ static int detail_open(rad_listen_t *this)
 	data->packets = 0;
 	data->tries = 0;
 	data->done_entry = false;
+#ifdef WITH_DETAIL_THREAD
+	data->generation++;
+#endif
 
 	return 1;
 }
@@ -407,11 +707,23 @@ int detail_recv(rad_listen_t *listener)
 		break;
 
 	default:
+		if (data->max_outstanding > 1) {
+			detail_ack(data, packet, true);
+			fr_radius_free(&packet);
+			return 0;
+		}
+
 		data->state = STATE_REPLIED;
 		goto signal_thread;
 	}
 
 	if (!request_receive(NULL, listener, packet, &data->detail_client, fun)) {
+		if (data->max_outstanding > 1) {
+			detail_ack(data, packet, false);
+			fr_radius_free(&packet);
+			return 0;
+		}
+
 		data->state = STATE_NO_REPLY;	/* try again later */
 
 	signal_thread:
@@ -429,6 +741,270 @@ int detail_recv(rad_listen_t *listener)
 }
 #endif
 
+/*
+ *	Create a packet from a detail file record.
+ */
+static RADIUS_PACKET *detail_packet_alloc(listen_detail_t *data, VALUE_PAIR *vps, fr_ipaddr_t const *client_ip,
+					  time_t timestamp, int tries)
+{
+	VALUE_PAIR	*vp;
+	RADIUS_PACKET	*packet;
+
+	/*
+	 *	Allocate the packet.  If we fail, it's a serious
+	 *	problem.
+	 */
+	packet = fr_radius_alloc(NULL, true);
+	if (!packet) {
+		ERROR("detail (%s): FATAL: Failed allocating memory for detail", data->name);
+		fr_exit(1);
+	}
+
+	memset(packet, 0, sizeof(*packet));
+	packet->sockfd = -1;
+	packet->src_ipaddr.af = AF_INET;
+	packet->src_ipaddr.ipaddr.ip4addr.s_addr = htonl(INADDR_NONE);
+
+	/*
+	 *	If everything's OK, this is a waste of memory.
+	 *	Otherwise, it lets us re-send the original packet
+	 *	contents, unmolested.
+	 */
+	packet->vps = fr_pair_list_copy(packet, vps);
+
+	packet->code = PW_CODE_ACCOUNTING_REQUEST;
+	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_TYPE, TAG_ANY);
+	if (vp) packet->code = vp->vp_integer;
+
+	gettimeofday(&packet->timestamp, NULL);
+
+	/*
+	 *	Remember where it came from, so that we don't
+	 *	proxy it to the place it came from...
+	 */
+	if (client_ip->af != AF_UNSPEC) {
+		packet->src_ipaddr = *client_ip;
+	}
+
+	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_SRC_IP_ADDRESS, TAG_ANY);
+	if (vp) {
+		packet->src_ipaddr.af = AF_INET;
+		packet->src_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
+		packet->src_ipaddr.prefix = 32;
+	} else {
+		vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_SRC_IPV6_ADDRESS, TAG_ANY);
+		if (vp) {
+			packet->src_ipaddr.af = AF_INET6;
+			memcpy(&packet->src_ipaddr.ipaddr.ip6addr,
+			       &vp->vp_ipv6addr, sizeof(vp->vp_ipv6addr));
+			packet->src_ipaddr.prefix = 128;
+		}
+	}
+
+	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_DST_IP_ADDRESS, TAG_ANY);
+	if (vp) {
+		packet->dst_ipaddr.af = AF_INET;
+		packet->dst_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
+		packet->dst_ipaddr.prefix = 32;
+	} else {
+		vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_DST_IPV6_ADDRESS, TAG_ANY);
+		if (vp) {
+			packet->dst_ipaddr.af = AF_INET6;
+			memcpy(&packet->dst_ipaddr.ipaddr.ip6addr,
+			       &vp->vp_ipv6addr, sizeof(vp->vp_ipv6addr));
+			packet->dst_ipaddr.prefix = 128;
+		}
+	}
+
+	/*
+	 *	Generate packet ID, ports, IP via a counter.
+	 */
+	packet->id = data->counter & 0xff;
+	packet->src_port = 1024 + ((data->counter >> 8) & 0xff);
+	packet->dst_port = 1024 + ((data->counter >> 16) & 0xff);
+
+	packet->dst_ipaddr.af = AF_INET;
+	packet->dst_ipaddr.ipaddr.ip4addr.s_addr = htonl((INADDR_LOOPBACK & ~0xffffff) | ((data->counter >> 24) & 0xff));
+
+	/*
+	 *	Create / update accounting attributes.
+	 */
+	if (packet->code == PW_CODE_ACCOUNTING_REQUEST) {
+		/*
+		 *	Prefer the Event-Timestamp in the packet, if it
+		 *	exists.  That is when the event occurred, whereas the
+		 *	"Timestamp" field is when we wrote the packet to the
+		 *	detail file, which could have been much later.
+		 */
+		vp = fr_pair_find_by_num(packet->vps, 0, PW_EVENT_TIMESTAMP, TAG_ANY);
+		if (vp) {
+			timestamp = vp->vp_integer;
+		}
+
+		/*
+		 *	Look for Acct-Delay-Time, and update
+		 *	based on Acct-Delay-Time += (time(NULL) - timestamp)
+		 */
+		vp = fr_pair_find_by_num(packet->vps, 0, PW_ACCT_DELAY_TIME, TAG_ANY);
+		if (!vp) {
+			vp = fr_pair_afrom_num(packet, 0, PW_ACCT_DELAY_TIME);
+			rad_assert(vp != NULL);
+			fr_pair_add(&packet->vps, vp);
+		}
+		if (timestamp != 0) {
+			vp->vp_integer += time(NULL) - timestamp;
+		}
+	}
+
+	/*
+	 *	Set the transmission count.
+	 */
+	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_TRANSMIT_COUNTER, TAG_ANY);
+	if (!vp) {
+		vp = fr_pair_afrom_num(packet, 0, PW_PACKET_TRANSMIT_COUNTER);
+		rad_assert(vp != NULL);
+		fr_pair_add(&packet->vps, vp);
+	}
+	vp->vp_integer = tries;
+
+	return packet;
+}
+
+/*
+ *	Read a binary record, written by rlm_detail, or by an
+ *	accounting listener with a "journal".
+ *
+ *	The packet is decoded into data->vps, with the same extra
+ *	attributes as a text record would have.
+ */
+static int detail_binary_read(listen_detail_t *data)
+{
+	detail_binary_t	hdr;
+	uint8_t		buffer[MAX_RADIUS_LEN];
+	size_t		len;
+	bool		journal;
+	char const	*secret = DETAIL_BINARY_SECRET;
+	RADIUS_PACKET	*packet;
+	VALUE_PAIR	*vp;
+	vp_cursor_t	cursor;
+
+	if (detail_read(data, &hdr, sizeof(hdr)) < sizeof(hdr)) {
+	truncated:
+		ERROR("detail (%s): Truncated record: treating it as EOF for detail file %s",
+		      data->name, data->filename_work);
+		return -1;
+	}
+
+	len = (hdr.length[0] << 8) | hdr.length[1];
+	journal = (memcmp(hdr.magic, DETAIL_JOURNAL_MAGIC, sizeof(hdr.magic)) == 0);
+	if ((!journal && (memcmp(hdr.magic, DETAIL_BINARY_MAGIC, sizeof(hdr.magic)) != 0)) ||
+	    (len < RADIUS_HDR_LEN) || (len > sizeof(buffer))) {
+		ERROR("detail (%s): Badly formatted binary record in detail file %s",
+		      data->name, data->filename_work);
+		return -1;
+	}
+
+	if (detail_read(data, buffer, len) < len) goto truncated;
+
+	data->last_offset = data->header_offset;
+	data->offset = detail_tell(data);
+	data->binary = true;
+	data->done_entry = (hdr.done != 0);
+	data->timestamp_offset = data->header_offset + offsetof(detail_binary_t, done);
+	data->timestamp = ((uint32_t) hdr.timestamp[0] << 24) | (hdr.timestamp[1] << 16) |
+			  (hdr.timestamp[2] << 8) | hdr.timestamp[3];
+
+	memset(&data->client_ip, 0, sizeof(data->client_ip));
+	switch (hdr.af) {
+	case 4:
+		data->client_ip.af = AF_INET;
+		memcpy(&data->client_ip.ipaddr.ip4addr, hdr.src_ipaddr, sizeof(data->client_ip.ipaddr.ip4addr));
+		data->client_ip.prefix = 32;
+		break;
+
+	case 6:
+		data->client_ip.af = AF_INET6;
+		memcpy(&data->client_ip.ipaddr.ip6addr, hdr.src_ipaddr, sizeof(data->client_ip.ipaddr.ip6addr));
+		data->client_ip.prefix = 128;
+		break;
+
+	default:
+		data->client_ip.af = AF_UNSPEC;
+		break;
+	}
+
+	packet = fr_radius_alloc(NULL, false);
+	if (!packet) {
+		ERROR("detail (%s): FATAL: Failed allocating memory for detail", data->name);
+		fr_exit(1);
+	}
+
+	packet->data = buffer;
+	packet->data_len = len;
+	packet->src_ipaddr = data->client_ip;
+	packet->code = buffer[0];
+	memcpy(packet->vector, buffer + 4, sizeof(packet->vector));
+
+	/*
+	 *	Journal records are packets as they were received.
+	 *	Accounting-Requests rarely contain encrypted
+	 *	attributes, but if they do, we need the secret of the
+	 *	client which sent it.
+	 */
+	if (journal) {
+		RADCLIENT *client = NULL;
+
+		if (data->client_ip.af != AF_UNSPEC) client = client_find(NULL, &data->client_ip, IPPROTO_UDP);
+		secret = client ? client->secret : "";
+	}
+
+	/*
+	 *	The writer used the packet as its own "original", so
+	 *	that every encrypted attribute used the same vector.
+	 *	For journal records, that's the Request Authenticator,
+	 *	as usual.
+	 */
+	if (!fr_radius_ok(packet, 0, NULL) || (fr_radius_decode(packet, packet, secret) < 0)) {
+		ERROR("detail (%s): Failed decoding binary record in detail file %s: %s",
+		      data->name, data->filename_work, fr_strerror());
+		packet->data = NULL;
+		fr_radius_free(&packet);
+		return -1;
+	}
+
+	for (vp = fr_cursor_init(&cursor, &packet->vps);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		fr_pair_steal(data, vp);
+	}
+	data->vps = packet->vps;
+	packet->vps = NULL;
+	packet->data = NULL;
+	fr_radius_free(&packet);
+
+	fr_cursor_init(&cursor, &data->vps);
+
+	/*
+	 *	Text records have these as attributes.
+	 */
+	vp = fr_pair_afrom_num(data, 0, PW_PACKET_TYPE);
+	if (vp) {
+		vp->vp_integer = buffer[0];
+		fr_cursor_insert(&cursor, vp);
+	}
+
+	vp = fr_pair_afrom_num(data, 0, PW_PACKET_ORIGINAL_TIMESTAMP);
+	if (vp) {
+		vp->vp_date = (uint32_t) data->timestamp;
+		vp->type = VT_DATA;
+		fr_cursor_insert(&cursor, vp);
+	}
+
+	data->state = STATE_QUEUED;
+
+	return 0;
+}
+
 static RADIUS_PACKET *detail_poll(rad_listen_t *listener)
 {
 	char		key[256], op[8], value[1024];
@@ -492,6 +1068,21 @@ open_file:
 			fr_exit(1);
 		}
 
+#ifdef HAVE_SYS_MMAN_H
+		if (detail_map(data) < 0) {
+			ERROR("detail (%s): Failed mapping detail file: %s", data->name, fr_syserror(errno));
+			fclose(data->fp);
+			data->fp = NULL;
+			data->work_fd = -1;
+			data->state = STATE_UNOPENED;
+			return NULL;
+		}
+#endif
+
+#ifdef WITH_DETAIL_THREAD
+		if (data->max_outstanding > 1) detail_checkpoint_load(data);
+#endif
+
 		/*
 		 *	Look for the header
 		 */
@@ -505,35 +1096,37 @@ open_file:
 	do_header:
 		data->done_entry = false;
 		data->timestamp_offset = 0;
+		data->binary = false;
 
 		data->tries = 0;
 		if (!data->fp) {
 			data->state = STATE_UNOPENED;
-			goto open_file;
-		}
-
-		{
-			struct stat buf;
-
-			if (fstat(data->work_fd, &buf) < 0) {
-				ERROR("detail (%s): Failed to stat detail file: %s",
-				      data->name, fr_syserror(errno));
-
-				goto cleanup;
-			}
-			if (((off_t) ftell(data->fp)) == buf.st_size) {
-				goto cleanup;
-			}
+			goto open_file;
 		}
+		data->header_offset = detail_tell(data);
 
 		/*
 		 *	End of file.  Delete it, and re-set
 		 *	everything.
 		 */
-		if (feof(data->fp)) {
+		if (detail_eof(data)) {
 		cleanup:
+#ifdef WITH_DETAIL_THREAD
+			/*
+			 *	Remove the checkpoint first.  It must
+			 *	never be applied to the next detail.work.
+			 */
+			if (data->checkpoint_fd >= 0) {
+				unlink(data->filename_checkpoint);
+				close(data->checkpoint_fd);
+				data->checkpoint_fd = -1;
+			}
+#endif
 			DEBUG("detail (%s): Unlinking %s", data->name, data->filename_work);
 			unlink(data->filename_work);
+#ifdef HAVE_SYS_MMAN_H
+			detail_unmap(data);
+#endif
 			if (data->fp) fclose(data->fp);
 			data->fp = NULL;
 			data->work_fd = -1;
@@ -559,7 +1152,7 @@ open_file:
 	 *	we have.
 	 */
 	case STATE_READING:
-		if (data->fp && !feof(data->fp)) break;
+		if (data->fp && !detail_eof(data)) break;
 		data->state = STATE_QUEUED;
 
 		/* FALL-THROUGH */
@@ -597,21 +1190,7 @@ open_file:
 		if (data->track) {
 			rad_assert(data->fp != NULL);
 
-			if (fseek(data->fp, data->timestamp_offset, SEEK_SET) < 0) {
-				WARN("detail (%s): Failed seeking to timestamp offset: %s",
-				     data->name, fr_syserror(errno));
-			} else if (fwrite("\tDone", 1, 5, data->fp) < 5) {
-				WARN("detail (%s): Failed marking request as done: %s",
-				     data->name, fr_syserror(errno));
-			} else if (fflush(data->fp) != 0) {
-				WARN("detail (%s): Failed flushing marked detail file to disk: %s",
-				     data->name, fr_syserror(errno));
-			}
-
-			if (fseek(data->fp, data->offset, SEEK_SET) < 0) {
-				WARN("detail (%s): Failed seeking to next detail request: %s",
-				     data->name, fr_syserror(errno));
-			}
+			detail_mark_done(data, data->timestamp_offset, data->binary);
 		}
 
 		fr_pair_list_free(&data->vps);
@@ -619,14 +1198,28 @@ open_file:
 		goto do_header;
 	}
 
+	/*
+	 *	Binary records are read in one go.
+	 */
+	if ((data->state == STATE_HEADER) && (detail_peek(data) == '\0')) {
+		if (detail_binary_read(data) < 0) {
+			fr_pair_list_free(&data->vps);
+			goto cleanup;
+		}
+
+		data->tries = 0;
+		data->packets++;
+		goto alloc_packet;
+	}
+
 	fr_cursor_init(&cursor, &data->vps);
 
 	/*
 	 *	Read a header, OR a value-pair.
 	 */
-	while (fgets(buffer, sizeof(buffer), data->fp)) {
+	while (detail_gets(data, buffer, sizeof(buffer))) {
 		data->last_offset = data->offset;
-		data->offset = ftell(data->fp); /* for statistics */
+		data->offset = detail_tell(data); /* for statistics */
 
 		/*
 		 *	Badly formatted file: delete it.
@@ -744,7 +1337,9 @@ open_file:
 	 *	FIXME: Leave the file in-place, and warn the
 	 *	administrator?
 	 */
+#ifndef HAVE_SYS_MMAN_H
 	if (ferror(data->fp)) goto cleanup;
+#endif
 
 	data->tries = 0;
 	data->packets++;
@@ -781,126 +1376,11 @@ open_file:
 	 */
 	if (!data->vps) {
 		data->state = STATE_HEADER;
-		if (!data->fp || feof(data->fp)) goto cleanup;
+		if (!data->fp || detail_eof(data)) goto cleanup;
 		return NULL;
 	}
 
-	/*
-	 *	Allocate the packet.  If we fail, it's a serious
-	 *	problem.
-	 */
-	packet = fr_radius_alloc(NULL, true);
-	if (!packet) {
-		ERROR("detail (%s): FATAL: Failed allocating memory for detail", data->name);
-		fr_exit(1);
-	}
-
-	memset(packet, 0, sizeof(*packet));
-	packet->sockfd = -1;
-	packet->src_ipaddr.af = AF_INET;
-	packet->src_ipaddr.ipaddr.ip4addr.s_addr = htonl(INADDR_NONE);
-
-	/*
-	 *	If everything's OK, this is a waste of memory.
-	 *	Otherwise, it lets us re-send the original packet
-	 *	contents, unmolested.
-	 */
-	packet->vps = fr_pair_list_copy(packet, data->vps);
-
-	packet->code = PW_CODE_ACCOUNTING_REQUEST;
-	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_TYPE, TAG_ANY);
-	if (vp) packet->code = vp->vp_integer;
-
-	gettimeofday(&packet->timestamp, NULL);
-
-	/*
-	 *	Remember where it came from, so that we don't
-	 *	proxy it to the place it came from...
-	 */
-	if (data->client_ip.af != AF_UNSPEC) {
-		packet->src_ipaddr = data->client_ip;
-	}
-
-	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_SRC_IP_ADDRESS, TAG_ANY);
-	if (vp) {
-		packet->src_ipaddr.af = AF_INET;
-		packet->src_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
-		packet->src_ipaddr.prefix = 32;
-	} else {
-		vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_SRC_IPV6_ADDRESS, TAG_ANY);
-		if (vp) {
-			packet->src_ipaddr.af = AF_INET6;
-			memcpy(&packet->src_ipaddr.ipaddr.ip6addr,
-			       &vp->vp_ipv6addr, sizeof(vp->vp_ipv6addr));
-			packet->src_ipaddr.prefix = 128;
-		}
-	}
-
-	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_DST_IP_ADDRESS, TAG_ANY);
-	if (vp) {
-		packet->dst_ipaddr.af = AF_INET;
-		packet->dst_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
-		packet->dst_ipaddr.prefix = 32;
-	} else {
-		vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_DST_IPV6_ADDRESS, TAG_ANY);
-		if (vp) {
-			packet->dst_ipaddr.af = AF_INET6;
-			memcpy(&packet->dst_ipaddr.ipaddr.ip6addr,
-			       &vp->vp_ipv6addr, sizeof(vp->vp_ipv6addr));
-			packet->dst_ipaddr.prefix = 128;
-		}
-	}
-
-	/*
-	 *	Generate packet ID, ports, IP via a counter.
-	 */
-	packet->id = data->counter & 0xff;
-	packet->src_port = 1024 + ((data->counter >> 8) & 0xff);
-	packet->dst_port = 1024 + ((data->counter >> 16) & 0xff);
-
-	packet->dst_ipaddr.af = AF_INET;
-	packet->dst_ipaddr.ipaddr.ip4addr.s_addr = htonl((INADDR_LOOPBACK & ~0xffffff) | ((data->counter >> 24) & 0xff));
-
-	/*
-	 *	Create / update accounting attributes.
-	 */
-	if (packet->code == PW_CODE_ACCOUNTING_REQUEST) {
-		/*
-		 *	Prefer the Event-Timestamp in the packet, if it
-		 *	exists.  That is when the event occurred, whereas the
-		 *	"Timestamp" field is when we wrote the packet to the
-		 *	detail file, which could have been much later.
-		 */
-		vp = fr_pair_find_by_num(packet->vps, 0, PW_EVENT_TIMESTAMP, TAG_ANY);
-		if (vp) {
-			data->timestamp = vp->vp_integer;
-		}
-
-		/*
-		 *	Look for Acct-Delay-Time, and update
-		 *	based on Acct-Delay-Time += (time(NULL) - timestamp)
-		 */
-		vp = fr_pair_find_by_num(packet->vps, 0, PW_ACCT_DELAY_TIME, TAG_ANY);
-		if (!vp) {
-			vp = fr_pair_afrom_num(packet, 0, PW_ACCT_DELAY_TIME);
-			rad_assert(vp != NULL);
-			fr_pair_add(&packet->vps, vp);
-		}
-		if (data->timestamp != 0) {
-			vp->vp_integer += time(NULL) - data->timestamp;
-		}
-	}
-
-	/*
-	 *	Set the transmission count.
-	 */
-	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_TRANSMIT_COUNTER, TAG_ANY);
-	if (!vp) {
-		vp = fr_pair_afrom_num(packet, 0, PW_PACKET_TRANSMIT_COUNTER);
-		rad_assert(vp != NULL);
-		fr_pair_add(&packet->vps, vp);
-	}
-	vp->vp_integer = data->tries;
+	packet = detail_packet_alloc(data, data->vps, &data->client_ip, data->timestamp, data->tries);
 
 	data->state = STATE_RUNNING;
 	data->running = packet->timestamp.tv_sec;
@@ -950,11 +1430,22 @@ static int _detail_free(listen_detail_t *data)
 	}
 #endif
 
+#ifdef HAVE_SYS_MMAN_H
+	detail_unmap(data);
+#endif
+
 	if (data->fp != NULL) {
 		fclose(data->fp);
 		data->fp = NULL;
 	}
 
+#ifdef WITH_DETAIL_THREAD
+	if (data->checkpoint_fd >= 0) {
+		close(data->checkpoint_fd);
+		data->checkpoint_fd = -1;
+	}
+#endif
+
 	return 0;
 }
 
@@ -983,7 +1474,7 @@ static int detail_delay(listen_detail_t *data)
 	 *	Add +/- 0.25s of jitter
 	 */
 	delay += (USEC * 3) / 4;
-	delay += fr_rand() % (USEC / 2);
+	delay += fr_fast_rand() % (USEC / 2);
 
 	DEBUG2("detail (%s): Detail listener state %s waiting %d.%06d sec",
 	       data->name,
@@ -1089,6 +1580,256 @@ static void *detail_handler_thread(void *arg)
 
 	return NULL;
 }
+
+/*
+ *	Whether an earlier record in the same session is still being
+ *	replayed.
+ */
+static bool detail_session_busy(listen_detail_t *data, detail_entry_t const *entry)
+{
+	uint32_t i;
+
+	if (!entry->session_id) return false;
+
+	for (i = 0; i < data->max_outstanding; i++) {
+		detail_entry_t const *other = &data->entries[i];
+
+		if ((other == entry) || !other->session_id) continue;
+
+		if ((other->state != STATE_RUNNING) && (other->state != STATE_NO_REPLY)) continue;
+
+		if (strcmp(other->session_id, entry->session_id) == 0) return true;
+	}
+
+	return false;
+}
+
+/*
+ *	Pass a record to the master thread.  If we don't already have
+ *	a packet for it, create one.
+ */
+static void detail_entry_send(listen_detail_t *data, detail_entry_t *entry, RADIUS_PACKET *packet)
+{
+	if (!packet) {
+		entry->tries++;
+		packet = detail_packet_alloc(data, entry->vps, &entry->client_ip, entry->timestamp, entry->tries);
+	}
+
+	entry->counter = data->counter++;
+	entry->running = packet->timestamp.tv_sec;
+	entry->state = STATE_RUNNING;
+
+	if (write(data->master_pipe[1], &packet, sizeof(packet)) < 0) {
+		ERROR("detail (%s): Failed passing detail packet pointer to master: %s",
+		      data->name, fr_syserror(errno));
+		fr_radius_free(&packet);
+		entry->state = STATE_NO_REPLY;
+	}
+}
+
+/*
+ *	The record has been replied to.  Mark it as done, and move
+ *	the checkpoint past everything which has been replied to.
+ */
+static void detail_entry_done(listen_detail_t *data, detail_entry_t *entry)
+{
+	uint32_t	i;
+	off_t		checkpoint;
+	bool		current = (entry->generation == data->generation) && data->fp;
+
+	if (current && data->track && (entry->timestamp_offset > 0)) {
+		detail_mark_done(data, entry->timestamp_offset, entry->binary);
+	}
+
+	fr_pair_list_free(&entry->vps);
+	entry->session_id = NULL;
+	entry->state = STATE_UNOPENED;
+	data->outstanding--;
+
+	if (!current) return;
+
+	checkpoint = detail_tell(data);
+	for (i = 0; i < data->max_outstanding; i++) {
+		detail_entry_t const *other = &data->entries[i];
+
+		if ((other->state == STATE_UNOPENED) || (other->generation != data->generation)) continue;
+
+		if (other->start < checkpoint) checkpoint = other->start;
+	}
+
+	detail_checkpoint_save(data, checkpoint);
+}
+
+/*
+ *	Reader thread used when "max_outstanding" is more than one.
+ *
+ *	Up to max_outstanding records are replayed at once.  A record
+ *	with the same Acct-Session-Id as one which is still being
+ *	replayed waits for it, and we don't read past it until then.
+ *	So the records for a session are processed in file order.
+ */
+static void *detail_replay_thread(void *arg)
+{
+	rad_listen_t *this = arg;
+	listen_detail_t *data = this->data;
+
+	while (data->child_pipe[0] >= 0) {
+		uint32_t	i;
+		int		rcode;
+		bool		queued = false;
+		time_t		now = time(NULL);
+		struct timeval	wake;
+		fd_set		fds;
+		detail_ack_t	acks[64];
+		ssize_t		len, n;
+
+		/*
+		 *	Send the records which were waiting for an
+		 *	earlier one, and retry the ones which have
+		 *	had no reply for "retry_interval".
+		 */
+		for (i = 0; i < data->max_outstanding; i++) {
+			detail_entry_t *entry = &data->entries[i];
+
+			switch (entry->state) {
+			case STATE_QUEUED:
+				if (detail_session_busy(data, entry)) {
+					queued = true;
+					break;
+				}
+				detail_entry_send(data, entry, NULL);
+				break;
+
+			case STATE_RUNNING:
+			case STATE_NO_REPLY:
+				if (now < (entry->running + (int)data->retry_interval)) break;
+
+				DEBUG("detail (%s): No response to detail request.  Retrying", data->name);
+				detail_entry_send(data, entry, NULL);
+				break;
+
+			default:
+				break;
+			}
+		}
+
+		/*
+		 *	Read as many new records as we have room for.
+		 *	Don't read to EOF while there are records
+		 *	outstanding, as that deletes the file.
+		 */
+		wake.tv_sec = 1;
+		wake.tv_usec = 0;
+
+		while (!queued && (data->outstanding < (int) data->max_outstanding)) {
+			RADIUS_PACKET	*packet;
+			VALUE_PAIR	*vp;
+			detail_entry_t	*entry = NULL;
+
+			if (data->outstanding && detail_eof(data)) break;
+
+			packet = detail_poll(this);
+			if (!packet) {
+				if (!data->outstanding) {
+					int delay = detail_delay(data);
+
+					wake.tv_sec = delay / USEC;
+					wake.tv_usec = delay % USEC;
+				}
+				break;
+			}
+
+			for (i = 0; i < data->max_outstanding; i++) {
+				if (data->entries[i].state == STATE_UNOPENED) {
+					entry = &data->entries[i];
+					break;
+				}
+			}
+			rad_assert(entry != NULL);
+
+			/*
+			 *	The entry now owns the record.
+			 */
+			entry->vps = data->vps;
+			data->vps = NULL;
+			data->state = STATE_HEADER;
+
+			entry->generation = data->generation;
+			entry->client_ip = data->client_ip;
+			entry->timestamp = data->timestamp;
+			entry->start = data->header_offset;
+			entry->timestamp_offset = data->timestamp_offset;
+			entry->binary = data->binary;
+			entry->tries = data->tries;
+
+			vp = fr_pair_find_by_num(entry->vps, 0, PW_ACCT_SESSION_ID, TAG_ANY);
+			entry->session_id = vp ? vp->vp_strvalue : NULL;
+
+			data->outstanding++;
+
+			if (detail_session_busy(data, entry)) {
+				fr_radius_free(&packet);
+				entry->tries--;
+				entry->state = STATE_QUEUED;
+				queued = true;
+				break;
+			}
+
+			detail_entry_send(data, entry, packet);
+		}
+
+		/*
+		 *	Wait for the replies.
+		 */
+		if (data->child_pipe[0] < 0) break;
+
+		FD_ZERO(&fds);
+		FD_SET(data->child_pipe[0], &fds);
+
+		rcode = select(data->child_pipe[0] + 1, &fds, NULL, NULL, &wake);
+		if (rcode <= 0) continue;
+
+		len = read(data->child_pipe[0], acks, sizeof(acks));
+		if (len <= 0) continue;
+
+		now = time(NULL);
+		for (n = 0; n < (len / (ssize_t) sizeof(acks[0])); n++) {
+			detail_ack_t *ack = &acks[n];
+
+			for (i = 0; i < data->max_outstanding; i++) {
+				detail_entry_t *entry = &data->entries[i];
+
+				/*
+				 *	Replies to packets we've since
+				 *	retransmitted don't match.
+				 */
+				if ((entry->state != STATE_RUNNING) || (entry->counter != ack->counter)) continue;
+
+				if (ack->replied) {
+					detail_entry_done(data, entry);
+				} else {
+					entry->state = STATE_NO_REPLY;
+					entry->running = now;
+				}
+				break;
+			}
+		}
+	}
+
+	/*
+	 *	Tell the master thread we've exited.
+	 */
+	{
+		RADIUS_PACKET *packet = NULL;
+
+		if (write(data->master_pipe[1], &packet, sizeof(packet)) < 0) {
+			ERROR("detail (%s): Failed writing exit status to master: %s",
+			      data->name, fr_syserror(errno));
+		}
+	}
+
+	return NULL;
+}
 #endif
 
 
@@ -1100,6 +1841,9 @@ static const CONF_PARSER detail_config[] = {
 	{ FR_CONF_OFFSET("retry_interval", PW_TYPE_INTEGER, listen_detail_t, retry_interval), .dflt = STRINGIFY(30) },
 	{ FR_CONF_OFFSET("one_shot", PW_TYPE_BOOLEAN, listen_detail_t, one_shot), .dflt = "no" },
 	{ FR_CONF_OFFSET("track", PW_TYPE_BOOLEAN, listen_detail_t, track), .dflt = "no" },
+#ifdef WITH_DETAIL_THREAD
+	{ FR_CONF_OFFSET("max_outstanding", PW_TYPE_INTEGER, listen_detail_t, max_outstanding), .dflt = STRINGIFY(1) },
+#endif
 	CONF_PARSER_TERMINATOR
 };
 
@@ -1144,6 +1888,15 @@ int detail_parse(CONF_SECTION *cs, rad_listen_t *this)
 	FR_INTEGER_BOUND_CHECK("retry_interval", data->retry_interval, >=, 4);
 	FR_INTEGER_BOUND_CHECK("retry_interval", data->retry_interval, <=, 3600);
 
+#ifdef WITH_DETAIL_THREAD
+	FR_INTEGER_BOUND_CHECK("max_outstanding", data->max_outstanding, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_outstanding", data->max_outstanding, <=, 1024);
+#endif
+
+#ifdef WITH_DETAIL_THREAD
+	data->checkpoint_fd = -1;
+#endif
+
 	/*
 	 *	Only checking the config.  Don't start threads or anything else.
 	 */
@@ -1187,6 +1940,27 @@ int detail_parse(CONF_SECTION *cs, rad_listen_t *this)
 
 	data->filename_work = talloc_strdup(data, buffer);
 
+#ifdef WITH_DETAIL_THREAD
+	/*
+	 *	The checkpoint is a hidden file, so that it doesn't
+	 *	match the glob for the detail files.
+	 */
+	if (data->max_outstanding > 1) {
+		char const *q;
+
+		q = strrchr(data->filename_work, FR_DIR_SEP);
+		if (q) {
+			data->filename_checkpoint = talloc_asprintf(data, "%.*s.%s.checkpoint",
+								    (int) (q + 1 - data->filename_work),
+								    data->filename_work, q + 1);
+		} else {
+			data->filename_checkpoint = talloc_asprintf(data, ".%s.checkpoint", data->filename_work);
+		}
+
+		data->entries = talloc_zero_array(data, detail_entry_t, data->max_outstanding);
+	}
+#endif
+
 	data->work_fd = -1;
 	data->vps = NULL;
 	data->fp = NULL;
@@ -1233,7 +2007,8 @@ int detail_socket_open(UNUSED CONF_SECTION *cs, rad_listen_t *this)
 		fr_exit(1);
 	}
 
-	pthread_create(&data->pthread_id, NULL, detail_handler_thread, this);
+	pthread_create(&data->pthread_id, NULL,
+		       (data->max_outstanding > 1) ? detail_replay_thread : detail_handler_thread, this);
 
 	this->fd = data->master_pipe[0];
 
@@ -166,7 +166,7 @@ static int cond_do_regex(REQUEST *request, fr_cond_t const *c,
 	ssize_t		slen;
 	int		ret;
 
-	regex_t		*preg, *rreg = NULL;
+	regex_t		*preg;
 	regmatch_t	rxmatch[REQUEST_MAX_REGEX + 1];	/* +1 for %{0} (whole match) capture group */
 	size_t		nmatch = sizeof(rxmatch) / sizeof(regmatch_t);
 
@@ -185,15 +185,14 @@ static int cond_do_regex(REQUEST *request, fr_cond_t const *c,
 	default:
 		if (!rad_cond_assert(rhs_type == PW_TYPE_STRING)) return -1;
 		if (!rad_cond_assert(rhs && rhs->strvalue)) return -1;
-		slen = regex_compile(request, &rreg, rhs->strvalue, rhs->length,
-				     map->rhs->tmpl_iflag, map->rhs->tmpl_mflag, true, true);
+		slen = regex_compile_cached(&preg, rhs->strvalue, rhs->length,
+					    map->rhs->tmpl_iflag, map->rhs->tmpl_mflag, true);
 		if (slen <= 0) {
 			REMARKER(rhs->strvalue, -slen, fr_strerror());
 			EVAL_DEBUG("FAIL %d", __LINE__);
 
 			return -1;
 		}
-		preg = rreg;
 		break;
 	}
 
@@ -218,8 +217,6 @@ static int cond_do_regex(REQUEST *request, fr_cond_t const *c,
 		break;
 	}
 
-	if (preg) talloc_free(rreg);
-
 	return ret;
 }
 #endif
@@ -320,6 +317,7 @@ static int cond_cmp_values(REQUEST *request, fr_cond_t const *c,
 
 		value_data_copy(vp, &vp->data, rhs_type, rhs);
 
+		(void) request_decode_pending(request, NULL);
 		rcode = paircompare(request, request->packet->vps, vp, NULL);
 		rcode = (rcode == 0) ? 1 : 0;
 		talloc_free(vp);
@@ -627,8 +625,22 @@ int radius_evaluate_map(REQUEST *request, UNUSED int modreturn, UNUSED int depth
 			 *	Evaluate all LHS values, condition evaluates to true
 			 *	if we get at least one set of operands that
 			 *	evaluates to true.
+			 *
+			 *	If the RHS was cast to the type of the
+			 *	attribute when it was parsed, there's no
+			 *	need to normalise the operands.
 			 */
-	     		rcode = cond_normalise_and_cmp(request, c, vp->da->type, vp->da, &vp->data);
+			if (c->precast && (vp->da->type == map->lhs->tmpl_da->type)) {
+#ifdef WITH_EVAL_DEBUG
+				EVAL_DEBUG("CMP PRECAST OPERANDS");
+				cond_print_operands(request, vp->da->type, &vp->data,
+						    map->rhs->tmpl_data_type, &map->rhs->tmpl_data_value);
+#endif
+				rcode = value_data_cmp_op(map->op, vp->da->type, &vp->data,
+							  map->rhs->tmpl_data_type, &map->rhs->tmpl_data_value);
+			} else {
+				rcode = cond_normalise_and_cmp(request, c, vp->da->type, vp->da, &vp->data);
+			}
 	     		if (rcode != 0) break;
 		}
 	}
@@ -43,6 +43,8 @@ RCSID("$Id$")
 #	define WIFEXITED(stat_val) (((stat_val) & 255) == 0)
 #endif
 
+#define LOG_PREFIX "exec"
+
 #define MAX_ARGV (256)
 
 #define USEC 1000000
@@ -651,3 +653,300 @@ wait:
 
 	return -1;
 }
+
+/** A persistent helper process
+ *
+ */
+typedef struct exec_helper {
+	pid_t		pid;			//!< Of the helper, or -1 if it needs (re)starting.
+	int		to_child;		//!< Helper's stdin.
+	int		from_child;		//!< Helper's stdout.
+} exec_helper_t;
+
+/** A pool of persistent helper processes
+ *
+ * Helpers are started once, then exchange line oriented requests and
+ * responses with the server over pipes, instead of a new process being
+ * forked for every call.
+ */
+struct exec_helper_pool {
+	char const	*cmd;			//!< Command used to start the helpers.
+	char const	*terminator;		//!< Line ending a response.  If NULL, responses
+						//!< are a single line.
+	int		timeout;		//!< How long to wait for a response, in seconds.
+
+	exec_helper_t	*helpers;		//!< All helpers.
+	exec_helper_t	**idle;			//!< Helpers not currently in use.
+	uint32_t	num;			//!< Number of helpers.
+	uint32_t	num_idle;		//!< Number of helpers in idle.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;			//!< Protects idle.
+	pthread_cond_t	cond;			//!< Signalled when a helper is returned.
+#endif
+};
+
+static int exec_helper_start(exec_helper_pool_t *pool, exec_helper_t *helper)
+{
+	helper->pid = radius_start_program(pool->cmd, NULL, true, &helper->to_child, &helper->from_child,
+					   NULL, false);
+	if (helper->pid < 0) {
+		helper->pid = -1;
+		return -1;
+	}
+
+	DEBUG2("Started helper \"%s\" (PID %u)", pool->cmd, helper->pid);
+
+	return 0;
+}
+
+static void exec_helper_stop(exec_helper_t *helper)
+{
+	int status;
+
+	if (helper->pid < 0) return;
+
+	kill(helper->pid, SIGTERM);
+	close(helper->to_child);
+	close(helper->from_child);
+
+	rad_waitpid(helper->pid, &status);
+	helper->pid = -1;
+}
+
+static int _exec_helper_pool_free(exec_helper_pool_t *pool)
+{
+	uint32_t i;
+
+	for (i = 0; i < pool->num; i++) exec_helper_stop(&pool->helpers[i]);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->cond);
+#endif
+
+	return 0;
+}
+
+/** Start a pool of persistent helper processes
+ *
+ * @param ctx to allocate the pool in.  The helpers are stopped when it's freed.
+ * @param cmd to start the helpers with.  This is split into argv[] parts but
+ *	not xlat'ed, as the helpers outlive any one request.
+ * @param num number of helpers to start.
+ * @param terminator line which ends a response e.g. "." for ntlm_auth.
+ *	If NULL, responses are a single line.
+ * @param timeout how long to wait for a response, in seconds.
+ * @return
+ *	- New pool.
+ *	- NULL if any of the helpers couldn't be started.
+ */
+exec_helper_pool_t *exec_helper_pool_alloc(TALLOC_CTX *ctx, char const *cmd, uint32_t num,
+					   char const *terminator, int timeout)
+{
+	exec_helper_pool_t	*pool;
+	uint32_t		i;
+
+	rad_assert(num > 0);
+
+	pool = talloc_zero(ctx, exec_helper_pool_t);
+	if (!pool) return NULL;
+
+	pool->cmd = talloc_typed_strdup(pool, cmd);
+	if (terminator) pool->terminator = talloc_typed_strdup(pool, terminator);
+	pool->timeout = timeout;
+
+	pool->helpers = talloc_array(pool, exec_helper_t, num);
+	pool->idle = talloc_array(pool, exec_helper_t *, num);
+	if (!pool->helpers || !pool->idle) {
+		talloc_free(pool);
+		return NULL;
+	}
+	for (i = 0; i < num; i++) pool->helpers[i].pid = -1;
+	pool->num = num;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+#endif
+	talloc_set_destructor(pool, _exec_helper_pool_free);
+
+	for (i = 0; i < num; i++) {
+		if (exec_helper_start(pool, &pool->helpers[i]) < 0) {
+			talloc_free(pool);
+			return NULL;
+		}
+		pool->idle[i] = &pool->helpers[i];
+	}
+	pool->num_idle = num;
+
+	return pool;
+}
+
+/** Write a request to a helper and read back its response
+ *
+ * @return
+ *	- Length of the response.
+ *	- -1 on failure, in which case the helper should be restarted.
+ */
+static ssize_t exec_helper_exchange(exec_helper_pool_t *pool, exec_helper_t *helper, REQUEST *request,
+				    char *out, size_t outlen, char const *in, size_t inlen)
+{
+	size_t		done = 0, used = 0;
+	char		*line = out;
+	struct timeval	start;
+
+	while (done < inlen) {
+		ssize_t len;
+
+		len = write(helper->to_child, in + done, inlen - done);
+		if (len < 0) {
+			if (errno == EINTR) continue;
+
+			ROPTIONAL(REDEBUG, ERROR, "Failed writing to helper (PID %u): %s",
+				  helper->pid, fr_syserror(errno));
+			return -1;
+		}
+		done += len;
+	}
+
+	/*
+	 *	Read until we have a complete response.  Helpers
+	 *	answer one request at a time, so there should never
+	 *	be anything after it.
+	 */
+	gettimeofday(&start, NULL);
+	while (true) {
+		int		rcode;
+		ssize_t		len;
+		char		*eol;
+		fd_set		fds;
+		struct timeval	when, elapsed, wake;
+
+		if (used >= (outlen - 1)) {
+			ROPTIONAL(REDEBUG, ERROR, "Response from helper (PID %u) is too long", helper->pid);
+			return -1;
+		}
+
+		FD_ZERO(&fds);
+		FD_SET(helper->from_child, &fds);
+
+		gettimeofday(&when, NULL);
+		tv_sub(&when, &start, &elapsed);
+		if (elapsed.tv_sec >= pool->timeout) goto too_long;
+
+		when.tv_sec = pool->timeout;
+		when.tv_usec = 0;
+		tv_sub(&when, &elapsed, &wake);
+
+		rcode = select(helper->from_child + 1, &fds, NULL, NULL, &wake);
+		if (rcode == 0) {
+		too_long:
+			ROPTIONAL(REDEBUG, ERROR, "Helper (PID %u) is taking too much time: restarting it",
+				  helper->pid);
+			return -1;
+		}
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+
+			ROPTIONAL(REDEBUG, ERROR, "Failed waiting for helper (PID %u): %s",
+				  helper->pid, fr_syserror(errno));
+			return -1;
+		}
+
+		len = read(helper->from_child, out + used, outlen - used - 1);
+		if (len == 0) {
+			ROPTIONAL(REDEBUG, ERROR, "Helper (PID %u) exited", helper->pid);
+			return -1;
+		}
+		if (len < 0) {
+			if (errno == EINTR) continue;
+
+			ROPTIONAL(REDEBUG, ERROR, "Failed reading from helper (PID %u): %s",
+				  helper->pid, fr_syserror(errno));
+			return -1;
+		}
+		used += len;
+		out[used] = '\0';
+
+		while ((eol = memchr(line, '\n', (out + used) - line))) {
+			size_t line_len = eol - line;
+
+			if (!pool->terminator ||
+			    ((line_len == strlen(pool->terminator)) &&
+			     (memcmp(line, pool->terminator, line_len) == 0))) {
+				if ((eol + 1) != (out + used)) {
+					ROPTIONAL(REDEBUG, ERROR, "Unexpected data after response from "
+						  "helper (PID %u)", helper->pid);
+					return -1;
+				}
+
+				/*
+				 *	Strip the terminator line, and the
+				 *	newline ending the last line of the
+				 *	response.
+				 */
+				if (!pool->terminator) {
+					*eol = '\0';
+					return line_len;
+				}
+				*line = '\0';
+				if (line == out) return 0;
+
+				line[-1] = '\0';
+				return (line - out) - 1;
+			}
+			line = eol + 1;
+		}
+	}
+}
+
+/** Send a request to a helper from the pool
+ *
+ * Blocks until a helper is idle.  Helpers which time out, exit or break
+ * the protocol are killed, and restarted the next time they're used.
+ *
+ * @param[in] pool to take a helper from.
+ * @param[in] request Current request (may be NULL).
+ * @param[out] out Where to write the response, without the terminator line
+ *	or trailing newline.
+ * @param[in] outlen Length of out.
+ * @param[in] in Request to write to the helper.  Must include any newlines
+ *	or terminator the helper expects.
+ * @param[in] inlen Length of in.
+ * @return
+ *	- Length of the response.
+ *	- -1 on failure.
+ */
+ssize_t exec_helper_request(exec_helper_pool_t *pool, REQUEST *request, char *out, size_t outlen,
+			    char const *in, size_t inlen)
+{
+	exec_helper_t	*helper;
+	ssize_t		slen = -1;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->num_idle == 0) pthread_cond_wait(&pool->cond, &pool->mutex);
+#endif
+	helper = pool->idle[--pool->num_idle];
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&pool->mutex);
+#endif
+
+	if ((helper->pid < 0) && (exec_helper_start(pool, helper) < 0)) goto finish;
+
+	slen = exec_helper_exchange(pool, helper, request, out, outlen, in, inlen);
+	if (slen < 0) exec_helper_stop(helper);
+
+finish:
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&pool->mutex);
+#endif
+	pool->idle[pool->num_idle++] = helper;
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+#endif
+
+	return slen;
+}
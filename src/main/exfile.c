@@ -25,17 +25,47 @@
  */
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/exfile.h>
+#include <freeradius-devel/atomic_queue.h>
 
 #include <sys/stat.h>
 #include <fcntl.h>
 
-typedef struct exfile_entry_t {
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_STDATOMIC_H)
+#  include <stdatomic.h>
+#  define WITH_EXFILE_ASYNC (1)
+
+/*
+ *	We use the system calls directly, so there's no dependency on
+ *	liburing.
+ */
+#  if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_MMAN_H)
+#    include <linux/io_uring.h>
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+#    if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#      define WITH_EXFILE_URING (1)
+#    endif
+#  endif
+#endif
+
+typedef struct exfile_entry_t exfile_entry_t;
+
+struct exfile_entry_t {
 	int		fd;		//!< File descriptor associated with an entry.
-	int		dup;
-	uint32_t	hash;		//!< Hash for cheap comparison.
+	int		dup;		//!< Given to the caller which has the entry.
+	uint32_t	hash;		//!< Of the filename.
 	time_t		last_used;	//!< Last time the entry was used.
 	char		*filename;	//!< Filename.
-} exfile_entry_t;
+
+	uint32_t	users;		//!< Threads which have, or are waiting for, the entry.
+					//!< The entry can't be freed until this is zero.
+	exfile_entry_t	*prev;		//!< Used more recently.
+	exfile_entry_t	*next;		//!< Used less recently.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;		//!< Held from exfile_open() until exfile_close().
+#endif
+};
 
 
 struct exfile_t {
@@ -43,10 +73,91 @@ struct exfile_t {
 	uint32_t	max_idle;	//!< Maximum idle time for a descriptor.
 
 #ifdef HAVE_PTHREAD_H
-	pthread_mutex_t mutex;
+	pthread_mutex_t mutex;		//!< Protects the tables and the list, but not the entries.
 #endif
-	exfile_entry_t *entries;
+	fr_hash_table_t	*by_name;	//!< Entries by filename.
+	fr_hash_table_t	*by_fd;		//!< Entries which callers have, by dup.
+	exfile_entry_t	*head;		//!< Most recently used entry.
+	exfile_entry_t	*tail;		//!< Least recently used entry.
 	bool		locking;
+
+#ifdef WITH_EXFILE_ASYNC
+	exfile_async_t	async;		//!< Writer thread configuration.
+	bool		async_running;	//!< Whether the writer thread was started.
+	bool		async_exit;	//!< Tell the writer thread to exit.
+	pthread_t	async_thread;
+	pthread_mutex_t	async_mutex;	//!< Protects async_exit, and async_cond.
+	pthread_cond_t	async_cond;	//!< Wakes the writer thread early.
+	fr_atomic_queue_t *queue;	//!< Records waiting to be written.
+	atomic_size_t	queued;		//!< How many bytes are waiting.
+	struct exfile_record_t **batch;	//!< What the writer thread is currently writing.
+	struct iovec	*vector;	//!< Used to write the batch.
+#endif
+
+#ifdef WITH_EXFILE_URING
+	struct exfile_uring_t *uring;	//!< Used by the writer thread, if io_uring is enabled.
+#endif
+};
+
+#ifdef WITH_EXFILE_URING
+/** The rings shared with the kernel
+ *
+ */
+typedef struct exfile_uring_t {
+	int			fd;
+
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		*sq_mask;
+	unsigned		*sq_array;
+	struct io_uring_sqe	*sqes;
+
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	void			*sq_ring;
+	size_t			sq_ring_len;
+	void			*cq_ring;	//!< May be the same as sq_ring.
+	size_t			cq_ring_len;
+	size_t			sqes_len;
+
+	bool			cur_pos;	//!< Kernel supports writing at the current position.
+} exfile_uring_t;
+#endif
+
+#ifdef WITH_EXFILE_ASYNC
+/** A record waiting for the writer thread
+ *
+ * The filename and data are in the same allocation.
+ */
+typedef struct exfile_record_t {
+	char const	*filename;
+	mode_t		permissions;
+	gid_t		group;
+	size_t		len;
+	uint8_t		*data;
+} exfile_record_t;
+
+/*
+ *	Maximum number of records written by one call to writev().
+ */
+#ifdef IOV_MAX
+#  define EXFILE_IOV_MAX IOV_MAX
+#else
+#  define EXFILE_IOV_MAX 1024
+#endif
+#endif
+
+CONF_PARSER const exfile_async_config[] = {
+	{ FR_CONF_OFFSET("enable", PW_TYPE_BOOLEAN, exfile_async_t, enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("flush_interval", PW_TYPE_TIMEVAL, exfile_async_t, flush_interval), .dflt = "0.1" },
+	{ FR_CONF_OFFSET("flush_size", PW_TYPE_INTEGER, exfile_async_t, flush_size), .dflt = "65536" },
+	{ FR_CONF_OFFSET("queue_size", PW_TYPE_INTEGER, exfile_async_t, queue_size), .dflt = "4096" },
+	{ FR_CONF_OFFSET("fsync", PW_TYPE_BOOLEAN, exfile_async_t, fsync), .dflt = "no" },
+	{ FR_CONF_OFFSET("io_uring", PW_TYPE_BOOLEAN, exfile_async_t, io_uring), .dflt = "no" },
+	CONF_PARSER_TERMINATOR
 };
 
 
@@ -65,18 +176,340 @@ struct exfile_t {
 #define MAX_TRY_LOCK 4			//!< How many times we attempt to acquire a lock
 					//!< before giving up.
 
-static int _exfile_free(exfile_t *ef)
+#ifdef WITH_EXFILE_URING
+static void exfile_uring_free(exfile_uring_t *uring)
 {
-	uint32_t i;
+	if (uring->sqes) munmap(uring->sqes, uring->sqes_len);
+	if (uring->cq_ring && (uring->cq_ring != uring->sq_ring)) munmap(uring->cq_ring, uring->cq_ring_len);
+	if (uring->sq_ring) munmap(uring->sq_ring, uring->sq_ring_len);
+	if (uring->fd >= 0) close(uring->fd);
+	talloc_free(uring);
+}
 
-	PTHREAD_MUTEX_LOCK(&ef->mutex);
+/*
+ *	The writer thread submits at most a writev() and an fsync() at
+ *	a time, so the rings can be tiny.
+ */
+#define EXFILE_URING_ENTRIES (4)
 
-	for (i = 0; i < ef->max_entries; i++) {
-		if (!ef->entries[i].filename) continue;
+static exfile_uring_t *exfile_uring_alloc(TALLOC_CTX *ctx)
+{
+	exfile_uring_t		*uring;
+	struct io_uring_params	params;
+	uint8_t			*sq, *cq;
+
+	uring = talloc_zero(ctx, exfile_uring_t);
+	if (!uring) return NULL;
+
+	memset(&params, 0, sizeof(params));
+	uring->fd = syscall(__NR_io_uring_setup, EXFILE_URING_ENTRIES, &params);
+	if (uring->fd < 0) {
+		fr_strerror_printf("io_uring_setup() failed: %s", fr_syserror(errno));
+		talloc_free(uring);
+		return NULL;
+	}
 
-		close(ef->entries[i].fd);
+	uring->sq_ring_len = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+	uring->cq_ring_len = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring->cq_ring_len > uring->sq_ring_len) uring->sq_ring_len = uring->cq_ring_len;
+		uring->cq_ring_len = uring->sq_ring_len;
 	}
 
+	uring->sq_ring = mmap(NULL, uring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			      uring->fd, IORING_OFF_SQ_RING);
+	if (uring->sq_ring == MAP_FAILED) {
+		uring->sq_ring = NULL;
+	error:
+		fr_strerror_printf("Failed mapping io_uring: %s", fr_syserror(errno));
+		exfile_uring_free(uring);
+		return NULL;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		uring->cq_ring = uring->sq_ring;
+	} else {
+		uring->cq_ring = mmap(NULL, uring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				      uring->fd, IORING_OFF_CQ_RING);
+		if (uring->cq_ring == MAP_FAILED) {
+			uring->cq_ring = NULL;
+			goto error;
+		}
+	}
+
+	uring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			   uring->fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		goto error;
+	}
+
+	sq = uring->sq_ring;
+	uring->sq_head = (unsigned *) (sq + params.sq_off.head);
+	uring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	uring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	uring->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+	cq = uring->cq_ring;
+	uring->cq_head = (unsigned *) (cq + params.cq_off.head);
+	uring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	uring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+#ifdef IORING_FEAT_RW_CUR_POS
+	uring->cur_pos = ((params.features & IORING_FEAT_RW_CUR_POS) != 0);
+#endif
+
+	return uring;
+}
+
+static struct io_uring_sqe *exfile_uring_sqe(exfile_uring_t *uring, unsigned *tail)
+{
+	unsigned		idx = *tail & *uring->sq_mask;
+	struct io_uring_sqe	*sqe = &uring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	uring->sq_array[idx] = idx;
+	(*tail)++;
+
+	return sqe;
+}
+
+/** Write, and maybe sync, with one system call
+ *
+ * The fsync() is linked to the writev(), so it only runs if the whole
+ * of the data was written.  If the write is short, the rest is written
+ * with fr_writev(), and the file is synced separately.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, with errno set.
+ */
+static int exfile_uring_writev(exfile_uring_t *uring, int fd, struct iovec *vector, int iovcnt, bool sync)
+{
+	struct io_uring_sqe	*sqe;
+	unsigned		tail, head, submitted, i;
+	ssize_t			wrote = -1;
+	size_t			total = 0;
+	bool			synced = false;
+	int			rcode;
+
+	for (i = 0; i < (unsigned) iovcnt; i++) total += vector[i].iov_len;
+
+	tail = *uring->sq_tail;
+
+	sqe = exfile_uring_sqe(uring, &tail);
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t) vector;
+	sqe->len = iovcnt;
+	sqe->off = uring->cur_pos ? (uint64_t) -1 : 0;	/* the file is O_APPEND */
+	sqe->user_data = 0;
+
+	if (sync) {
+		sqe->flags |= IOSQE_IO_LINK;
+
+		sqe = exfile_uring_sqe(uring, &tail);
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = fd;
+		sqe->user_data = 1;
+	}
+
+	submitted = tail - *uring->sq_tail;
+	__atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	do {
+		rcode = syscall(__NR_io_uring_enter, uring->fd, submitted, submitted, IORING_ENTER_GETEVENTS, NULL, 0);
+	} while ((rcode < 0) && (errno == EINTR));
+	if (rcode < 0) return -1;
+
+	/*
+	 *	Reap the completions.
+	 */
+	for (i = 0; i < submitted; i++) {
+		struct io_uring_cqe *cqe;
+
+		head = *uring->cq_head;
+		while (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+			rcode = syscall(__NR_io_uring_enter, uring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+			if ((rcode < 0) && (errno != EINTR)) return -1;
+		}
+
+		cqe = &uring->cqes[head & *uring->cq_mask];
+		if (cqe->user_data == 0) {
+			wrote = cqe->res;
+		} else {
+			synced = (cqe->res >= 0);
+		}
+		__atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+	}
+
+	if (wrote < 0) {
+		errno = -wrote;
+		return -1;
+	}
+
+	if ((size_t) wrote < total) {
+		/*
+		 *	Skip what was written, and write the rest.
+		 */
+		while (wrote > 0) {
+			if ((size_t) wrote >= vector->iov_len) {
+				wrote -= vector->iov_len;
+				vector++;
+				iovcnt--;
+				continue;
+			}
+			vector->iov_base = ((uint8_t *) vector->iov_base) + wrote;
+			vector->iov_len -= wrote;
+			wrote = 0;
+		}
+
+		if (fr_writev(fd, vector, iovcnt, NULL) < 0) return -1;
+	}
+
+	if (sync && !synced) return fsync(fd);
+
+	return 0;
+}
+#endif
+
+#ifdef WITH_EXFILE_ASYNC
+static void exfile_flush(exfile_t *ef);
+
+/*
+ *	Write part of a batch for one file.
+ */
+static int exfile_writev(exfile_t *ef, int fd, struct iovec *vector, int iovcnt, bool sync)
+{
+#ifdef WITH_EXFILE_URING
+	if (ef->uring) return exfile_uring_writev(ef->uring, fd, vector, iovcnt, sync);
+#endif
+
+	if (fr_writev(fd, vector, iovcnt, NULL) < 0) return -1;
+
+	if (sync) return fsync(fd);
+
+	return 0;
+}
+#endif
+
+static uint32_t exfile_entry_hash(void const *data)
+{
+	exfile_entry_t const *entry = data;
+
+	return entry->hash;
+}
+
+static int exfile_entry_cmp(void const *one, void const *two)
+{
+	exfile_entry_t const *a = one, *b = two;
+
+	if (a->hash != b->hash) return (a->hash < b->hash) ? -1 : 1;
+
+	return strcmp(a->filename, b->filename);
+}
+
+static uint32_t exfile_entry_fd_hash(void const *data)
+{
+	exfile_entry_t const *entry = data;
+
+	return fr_hash(&entry->dup, sizeof(entry->dup));
+}
+
+static int exfile_entry_fd_cmp(void const *one, void const *two)
+{
+	exfile_entry_t const *a = one, *b = two;
+
+	return a->dup - b->dup;
+}
+
+/** Remove an entry from the recently used list
+ *
+ * @note Called with the exfile mutex held.
+ */
+static void exfile_entry_unlink(exfile_t *ef, exfile_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		ef->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		ef->tail = entry->prev;
+	}
+
+	entry->prev = entry->next = NULL;
+}
+
+/** Add an entry to the front of the recently used list
+ *
+ * @note Called with the exfile mutex held.
+ */
+static void exfile_entry_link(exfile_t *ef, exfile_entry_t *entry)
+{
+	entry->prev = NULL;
+	entry->next = ef->head;
+
+	if (ef->head) {
+		ef->head->prev = entry;
+	} else {
+		ef->tail = entry;
+	}
+	ef->head = entry;
+}
+
+/** Close an entry's file, and free it
+ *
+ * @note Called with the exfile mutex held, and only for entries
+ *	which no thread is using.
+ */
+static void exfile_entry_free(exfile_t *ef, exfile_entry_t *entry)
+{
+	exfile_entry_unlink(ef, entry);
+	fr_hash_table_delete(ef->by_name, entry);
+
+	if (entry->fd >= 0) close(entry->fd);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&entry->mutex);
+#endif
+	talloc_free(entry);
+}
+
+static int _exfile_free(exfile_t *ef)
+{
+#ifdef WITH_EXFILE_ASYNC
+	/*
+	 *	The writer thread writes everything which is queued
+	 *	before it exits.
+	 */
+	if (ef->async_running) {
+		pthread_mutex_lock(&ef->async_mutex);
+		ef->async_exit = true;
+		pthread_cond_signal(&ef->async_cond);
+		pthread_mutex_unlock(&ef->async_mutex);
+
+		pthread_join(ef->async_thread, NULL);
+		ef->async_running = false;
+
+		pthread_cond_destroy(&ef->async_cond);
+		pthread_mutex_destroy(&ef->async_mutex);
+	}
+#endif
+
+#ifdef WITH_EXFILE_URING
+	if (ef->uring) exfile_uring_free(ef->uring);
+#endif
+
+	PTHREAD_MUTEX_LOCK(&ef->mutex);
+
+	while (ef->head) exfile_entry_free(ef, ef->head);
+
 	PTHREAD_MUTEX_UNLOCK(&ef->mutex);
 
 #ifdef HAVE_PTHREAD_H
@@ -104,8 +537,9 @@ exfile_t *exfile_init(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t max_idle,
 	ef = talloc_zero(ctx, exfile_t);
 	if (!ef) return NULL;
 
-	ef->entries = talloc_zero_array(ef, exfile_entry_t, max_entries);
-	if (!ef->entries) {
+	ef->by_name = fr_hash_table_create(ef, exfile_entry_hash, exfile_entry_cmp, NULL);
+	ef->by_fd = fr_hash_table_create(ef, exfile_entry_fd_hash, exfile_entry_fd_cmp, NULL);
+	if (!ef->by_name || !ef->by_fd) {
 		talloc_free(ef);
 		return NULL;
 	}
@@ -141,80 +575,93 @@ exfile_t *exfile_init(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t max_idle,
  */
 int exfile_open(exfile_t *ef, char const *filename, mode_t permissions, bool append)
 {
-	uint32_t i, tries;
-	uint32_t hash;
-	time_t now = time(NULL);
-	struct stat st;
+	uint32_t	tries;
+	time_t		now = time(NULL);
+	struct stat	st;
+	exfile_entry_t	*entry, *next, find;
 
 	if (!ef || !filename) return -1;
 
-	hash = fr_hash_string(filename);
+	find.hash = fr_hash_string(filename);
+	memcpy(&find.filename, &filename, sizeof(find.filename));
 
 	PTHREAD_MUTEX_LOCK(&ef->mutex);
 
 	/*
-	 *	Clean up old entries.
+	 *	Clean up old entries.  The list is in order of
+	 *	use, so they're all at the end.
 	 */
-	for (i = 0; i < ef->max_entries; i++) {
-		if (!ef->entries[i].filename) continue;
-		if ((ef->entries[i].last_used + ef->max_idle) < now) {
-			/*
-			 *	This will block forever if a thread is
-			 *	doing something stupid.
-			 */
-			TALLOC_FREE(ef->entries[i].filename);
-			close(ef->entries[i].fd);
-		}
+	for (entry = ef->tail; entry && ((entry->last_used + ef->max_idle) < now); entry = next) {
+		next = entry->prev;
+
+		if (!entry->users) exfile_entry_free(ef, entry);
 	}
 
 	/*
-	 *	Find the matching entry.
+	 *	Find the matching entry, or create one.
 	 */
-	for (i = 0; i < ef->max_entries; i++) {
-		if (!ef->entries[i].filename) continue;
+	entry = fr_hash_table_finddata(ef->by_name, &find);
+	if (entry) {
+		exfile_entry_unlink(ef, entry);
+	} else {
+		/*
+		 *	Make room by closing the least recently
+		 *	used file which nothing is writing to.
+		 */
+		if ((uint32_t) fr_hash_table_num_elements(ef->by_name) >= ef->max_entries) {
+			for (entry = ef->tail; entry && entry->users; entry = entry->prev);
 
-		if (ef->entries[i].hash == hash) {
-			/*
-			 *	Same hash but different filename.  Give up.
-			 */
-			if (strcmp(ef->entries[i].filename, filename) != 0) {
-				PTHREAD_MUTEX_UNLOCK(&ef->mutex);
-				return -1;
-			}
-			/*
-			 *	Someone else failed to create the entry.
-			 */
-			if (!ef->entries[i].filename) {
-				PTHREAD_MUTEX_UNLOCK(&ef->mutex);
+			if (!entry) {
+				fr_strerror_printf("Too many different filenames");
+				PTHREAD_MUTEX_UNLOCK(&(ef->mutex));
 				return -1;
 			}
-			goto do_return;
+			exfile_entry_free(ef, entry);
 		}
-	}
 
-	/*
-	 *	Find an unused entry
-	 */
-	for (i = 0; i < ef->max_entries; i++) {
-		if (!ef->entries[i].filename) break;
-	}
+		entry = talloc_zero(ef, exfile_entry_t);
+		if (!entry) {
+			fr_strerror_printf("Out of memory");
+			PTHREAD_MUTEX_UNLOCK(&(ef->mutex));
+			return -1;
+		}
+		entry->hash = find.hash;
+		entry->filename = talloc_strdup(entry, filename);
+		entry->fd = -1;
+		entry->dup = -1;
 
-	if (i >= ef->max_entries) {
-		fr_strerror_printf("Too many different filenames");
-		PTHREAD_MUTEX_UNLOCK(&(ef->mutex));
-		return -1;
+#ifdef HAVE_PTHREAD_H
+		if (pthread_mutex_init(&entry->mutex, NULL) != 0) {
+			fr_strerror_printf("Failed initialising mutex: %s", fr_syserror(errno));
+			talloc_free(entry);
+			PTHREAD_MUTEX_UNLOCK(&(ef->mutex));
+			return -1;
+		}
+#endif
+
+		if (!entry->filename || !fr_hash_table_insert(ef->by_name, entry)) {
+			fr_strerror_printf("Failed adding %s", filename);
+#ifdef HAVE_PTHREAD_H
+			pthread_mutex_destroy(&entry->mutex);
+#endif
+			talloc_free(entry);
+			PTHREAD_MUTEX_UNLOCK(&(ef->mutex));
+			return -1;
+		}
 	}
+	exfile_entry_link(ef, entry);
+	entry->last_used = now;
+	entry->users++;
+
+	PTHREAD_MUTEX_UNLOCK(&ef->mutex);
 
 	/*
-	 *	Create a new entry.
+	 *	Only writers to the same file wait here.
 	 */
+	PTHREAD_MUTEX_LOCK(&entry->mutex);
 
-	ef->entries[i].hash = hash;
-	ef->entries[i].filename = talloc_strdup(ef->entries, filename);
-	ef->entries[i].fd = -1;
-
-	ef->entries[i].fd = open(filename, O_RDWR | O_APPEND | O_CREAT, permissions);
-	if (ef->entries[i].fd < 0) {
+	if (entry->fd < 0) entry->fd = open(filename, O_RDWR | O_APPEND | O_CREAT, permissions);
+	if (entry->fd < 0) {
 		mode_t dirperm;
 		char *p, *dir;
 
@@ -222,11 +669,12 @@ int exfile_open(exfile_t *ef, char const *filename, mode_t permissions, bool app
 		 *	Maybe the directory doesn't exist.  Try to
 		 *	create it.
 		 */
-		dir = talloc_strdup(ef, filename);
+		dir = talloc_strdup(NULL, filename);
 		if (!dir) goto error;
 		p = strrchr(dir, FR_DIR_SEP);
 		if (!p) {
 			fr_strerror_printf("No '/' in '%s'", filename);
+			talloc_free(dir);
 			goto error;
 		}
 		*p = '\0';
@@ -248,28 +696,33 @@ int exfile_open(exfile_t *ef, char const *filename, mode_t permissions, bool app
 		}
 		talloc_free(dir);
 
-		ef->entries[i].fd = open(filename, O_WRONLY | O_CREAT, permissions);
-		if (ef->entries[i].fd < 0) {
+		entry->fd = open(filename, O_WRONLY | O_CREAT, permissions);
+		if (entry->fd < 0) {
 			fr_strerror_printf("Failed to open file %s: %s",
 					   filename, strerror(errno));
 			goto error;
 		} /* else fall through to creating the rest of the entry */
 	} /* else the file was already opened */
 
-do_return:
 	/*
 	 *	Lock from the start of the file.
 	 */
-	if (lseek(ef->entries[i].fd, 0, SEEK_SET) < 0) {
+	if (lseek(entry->fd, 0, SEEK_SET) < 0) {
 		fr_strerror_printf("Failed to seek in file %s: %s", filename, strerror(errno));
 
 	error:
-		ef->entries[i].hash = 0;
-		TALLOC_FREE(ef->entries[i].filename);
-		close(ef->entries[i].fd);
-		ef->entries[i].fd = -1;
+		/*
+		 *	The file will be opened again by the next
+		 *	caller.
+		 */
+		if (entry->fd >= 0) close(entry->fd);
+		entry->fd = -1;
 
-		PTHREAD_MUTEX_UNLOCK(&(ef->mutex));
+		PTHREAD_MUTEX_UNLOCK(&entry->mutex);
+
+		PTHREAD_MUTEX_LOCK(&ef->mutex);
+		entry->users--;
+		PTHREAD_MUTEX_UNLOCK(&ef->mutex);
 		return -1;
 	}
 
@@ -281,16 +734,16 @@ do_return:
 	 */
 	if (ef->locking) {
 		for (tries = 0; tries < MAX_TRY_LOCK; tries++) {
-			if (rad_lockfd_nonblock(ef->entries[i].fd, 0) >= 0) break;
+			if (rad_lockfd_nonblock(entry->fd, 0) >= 0) break;
 
 			if (errno != EAGAIN) {
 				fr_strerror_printf("Failed to lock file %s: %s", filename, strerror(errno));
 				goto error;
 			}
 
-			close(ef->entries[i].fd);
-			ef->entries[i].fd = open(filename, O_WRONLY | O_CREAT, permissions);
-			if (ef->entries[i].fd < 0) {
+			close(entry->fd);
+			entry->fd = open(filename, O_WRONLY | O_CREAT, permissions);
+			if (entry->fd < 0) {
 				fr_strerror_printf("Failed to open file %s: %s",
 						   filename, strerror(errno));
 				goto error;
@@ -307,15 +760,15 @@ do_return:
 	 *	Maybe someone deleted the file while we were waiting
 	 *	for the lock.  If so, re-open it.
 	 */
-	if (fstat(ef->entries[i].fd, &st) < 0) {
+	if (fstat(entry->fd, &st) < 0) {
 		fr_strerror_printf("Failed to stat file %s: %s", filename, strerror(errno));
 		goto error;
 	}
 
 	if (st.st_nlink == 0) {
-		close(ef->entries[i].fd);
-		ef->entries[i].fd = open(filename, O_WRONLY | O_CREAT, permissions);
-		if (ef->entries[i].fd < 0) {
+		close(entry->fd);
+		entry->fd = open(filename, O_WRONLY | O_CREAT, permissions);
+		if (entry->fd < 0) {
 			fr_strerror_printf("Failed to open file %s: %s",
 					   filename, strerror(errno));
 			goto error;
@@ -326,19 +779,68 @@ do_return:
 	 *	Seek to the end of the file before returning the FD to
 	 *	the caller.
 	 */
-	if (append) lseek(ef->entries[i].fd, 0, SEEK_END);
+	if (append) lseek(entry->fd, 0, SEEK_END);
+
+	entry->dup = dup(entry->fd);
+	if (entry->dup < 0) {
+		fr_strerror_printf("Failed calling dup(): %s", strerror(errno));
+		goto error;
+	}
 
 	/*
 	 *	Return holding the mutex for the entry.
 	 */
-	ef->entries[i].last_used = now;
-	ef->entries[i].dup = dup(ef->entries[i].fd);
-	if (ef->entries[i].dup < 0) {
-		fr_strerror_printf("Failed calling dup(): %s", strerror(errno));
-		goto error;
+	PTHREAD_MUTEX_LOCK(&ef->mutex);
+	fr_hash_table_insert(ef->by_fd, entry);
+	PTHREAD_MUTEX_UNLOCK(&ef->mutex);
+
+	return entry->dup;
+}
+
+/** Find the entry a caller was given, and release it
+ *
+ * @param ef The logfile context returned from #exfile_init.
+ * @param fd the caller was given by #exfile_open.
+ * @param close_fd whether to unlock and close fd, or leave it to the caller.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int exfile_release(exfile_t *ef, int fd, bool close_fd)
+{
+	exfile_entry_t *entry, find;
+
+	find.dup = fd;
+
+	PTHREAD_MUTEX_LOCK(&ef->mutex);
+	entry = fr_hash_table_yank(ef->by_fd, &find);
+	PTHREAD_MUTEX_UNLOCK(&ef->mutex);
+
+	if (!entry) {
+		fr_strerror_printf("Attempt to unlock file which does not exist");
+		return -1;
 	}
 
-	return ef->entries[i].dup;
+	/*
+	 *	Unlock the bytes that we had previously locked.
+	 */
+	if (close_fd) {
+		if (ef->locking) (void) rad_unlockfd(entry->dup, 0);
+		close(entry->dup); /* releases the fcntl lock */
+	}
+	entry->dup = -1;
+
+	PTHREAD_MUTEX_UNLOCK(&entry->mutex);
+
+	/*
+	 *	Once there are no users, the entry may be freed
+	 *	at any time.
+	 */
+	PTHREAD_MUTEX_LOCK(&ef->mutex);
+	entry->users--;
+	PTHREAD_MUTEX_UNLOCK(&ef->mutex);
+
+	return 0;
 }
 
 /** Close the log file.  Really just return it to the pool.
@@ -355,46 +857,299 @@ do_return:
  */
 int exfile_close(exfile_t *ef, int fd)
 {
-	uint32_t i;
+	return exfile_release(ef, fd, true);
+}
 
-	for (i = 0; i < ef->max_entries; i++) {
-		if (!ef->entries[i].filename) continue;
+/** Return the log file to the pool, leaving the caller to close the FD
+ *
+ * @param ef The logfile context returned from #exfile_init.
+ * @param fd the FD to return to the pool.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int exfile_unlock(exfile_t *ef, int fd)
+{
+	return exfile_release(ef, fd, false);
+}
 
-		/*
-		 *	Unlock the bytes that we had previously locked.
-		 */
-		if (ef->entries[i].dup == fd) {
-			if (ef->locking) (void) rad_unlockfd(ef->entries[i].dup, 0);
-			close(ef->entries[i].dup); /* releases the fcntl lock */
-			ef->entries[i].dup = -1;
+/** Write a record to a file
+ *
+ * If the writer thread is running, the record is copied and queued,
+ * and this function returns immediately.  The writer thread
+ * periodically writes all of the queued records for a file with one
+ * call to writev(), while holding the file lock once.
+ *
+ * Otherwise, or if the queue is full, the record is written before
+ * this function returns.
+ *
+ * @param ef The logfile context returned from exfile_init().
+ * @param filename the file to write to.
+ * @param permissions to use if the file is created.
+ * @param group to set on the file, or -1 to leave it alone.
+ * @param vector the data to write.  May be modified.
+ * @param iovcnt the number of elements in vector.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int exfile_write(exfile_t *ef, char const *filename, mode_t permissions, gid_t group,
+		 struct iovec *vector, int iovcnt)
+{
+	int fd;
+	ssize_t wrote;
+
+#ifdef WITH_EXFILE_ASYNC
+	if (ef->async_running) {
+		exfile_record_t	*record;
+		size_t		len = 0, namelen;
+		uint8_t		*p;
+		int		i;
+
+		for (i = 0; i < iovcnt; i++) len += vector[i].iov_len;
+		namelen = strlen(filename) + 1;
+
+		record = talloc_size(NULL, sizeof(*record) + namelen + len);
+		if (!record) {
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+		talloc_set_name_const(record, "exfile_record_t");
 
-			PTHREAD_MUTEX_UNLOCK(&(ef->mutex));
+		p = (uint8_t *) (record + 1);
+		memcpy(p, filename, namelen);
+		record->filename = (char const *) p;
+		p += namelen;
+
+		record->data = p;
+		for (i = 0; i < iovcnt; i++) {
+			memcpy(p, vector[i].iov_base, vector[i].iov_len);
+			p += vector[i].iov_len;
+		}
+		record->len = len;
+		record->permissions = permissions;
+		record->group = group;
+
+		if (fr_atomic_queue_push(ef->queue, record)) {
+			/*
+			 *	Wake the writer thread if there's
+			 *	enough to be worth writing.
+			 */
+			if ((atomic_fetch_add(&ef->queued, len) + len) >= ef->async.flush_size) {
+				pthread_mutex_lock(&ef->async_mutex);
+				pthread_cond_signal(&ef->async_cond);
+				pthread_mutex_unlock(&ef->async_mutex);
+			}
 			return 0;
 		}
+
+		/*
+		 *	The queue is full.  Write it ourselves.
+		 */
+		talloc_free(record);
 	}
+#endif
 
-	PTHREAD_MUTEX_UNLOCK(&(ef->mutex));
+	fd = exfile_open(ef, filename, permissions, true);
+	if (fd < 0) return -1;
 
-	fr_strerror_printf("Attempt to unlock file which does not exist");
-	return -1;
+	if ((group != (gid_t) -1) && (chown(filename, -1, group) < 0)) {
+		DEBUG2("Unable to change system group of %s: %s", filename, fr_syserror(errno));
+	}
+
+	wrote = fr_writev(fd, vector, iovcnt, NULL);
+	if (wrote < 0) {
+		fr_strerror_printf("Failed writing to %s: %s", filename, fr_syserror(errno));
+		exfile_close(ef, fd);
+		return -1;
+	}
+
+	exfile_close(ef, fd);
+	return 0;
 }
 
-int exfile_unlock(exfile_t *ef, int fd)
+#ifdef WITH_EXFILE_ASYNC
+/*
+ *	Write everything which is queued.  Records for the same file
+ *	are written together, in the order they were queued.
+ */
+static void exfile_flush(exfile_t *ef)
 {
-	uint32_t i;
+	size_t		count = 0, i, j;
+	void		*data;
 
-	for (i = 0; i < ef->max_entries; i++) {
-		if (!ef->entries[i].filename) continue;
+	while ((count < ef->async.queue_size) && fr_atomic_queue_pop(ef->queue, &data)) {
+		exfile_record_t *record = data;
 
-		if (ef->entries[i].dup == fd) {
-			ef->entries[i].dup = -1;
-			PTHREAD_MUTEX_UNLOCK(&(ef->mutex));
-			return 0;
+		atomic_fetch_sub(&ef->queued, record->len);
+		ef->batch[count++] = record;
+	}
+
+	for (i = 0; i < count; i++) {
+		exfile_record_t	*record = ef->batch[i];
+		char const	*filename;
+		int		fd, iovcnt;
+		bool		synced;
+
+		if (!record) continue;
+
+		filename = record->filename;
+
+		fd = exfile_open(ef, filename, record->permissions, true);
+		if (fd < 0) {
+			ERROR("Failed opening %s: %s", filename, fr_strerror());
+		} else if ((record->group != (gid_t) -1) && (chown(filename, -1, record->group) < 0)) {
+			DEBUG2("Unable to change system group of %s: %s", filename, fr_syserror(errno));
+		}
+
+		/*
+		 *	Gather all of the records for this file.  The
+		 *	file is synced after the last write.
+		 */
+		synced = !ef->async.fsync;
+		j = i;
+		while (j < count) {
+			iovcnt = 0;
+
+			for (; (j < count) && (iovcnt < EXFILE_IOV_MAX); j++) {
+				exfile_record_t *next = ef->batch[j];
+
+				if (!next || (strcmp(next->filename, filename) != 0)) continue;
+
+				ef->vector[iovcnt].iov_base = next->data;
+				ef->vector[iovcnt].iov_len = next->len;
+				iovcnt++;
+			}
+
+			if ((fd < 0) || (iovcnt == 0)) continue;
+
+			if (exfile_writev(ef, fd, ef->vector, iovcnt, !synced && (j >= count)) < 0) {
+				ERROR("Failed writing to %s: %s", filename, fr_syserror(errno));
+				continue;
+			}
+			if (j >= count) synced = true;
+		}
+
+		if (fd >= 0) {
+			if (!synced && (fsync(fd) < 0)) {
+				ERROR("Failed syncing %s: %s", filename, fr_syserror(errno));
+			}
+			exfile_close(ef, fd);
+		}
+
+		/*
+		 *	"filename" belongs to the first record, so it's
+		 *	freed last.
+		 */
+		for (j = i + 1; j < count; j++) {
+			exfile_record_t *next = ef->batch[j];
+
+			if (!next || (strcmp(next->filename, filename) != 0)) continue;
+
+			talloc_free(next);
+			ef->batch[j] = NULL;
+		}
+		talloc_free(record);
+		ef->batch[i] = NULL;
+	}
+}
+
+static void *exfile_writer_thread(void *arg)
+{
+	exfile_t	*ef = arg;
+	bool		done = false;
+
+	while (!done) {
+		struct timeval	now;
+		struct timespec	when;
+
+		gettimeofday(&now, NULL);
+		timeradd(&now, &ef->async.flush_interval, &now);
+		when.tv_sec = now.tv_sec;
+		when.tv_nsec = now.tv_usec * 1000;
+
+		pthread_mutex_lock(&ef->async_mutex);
+		if (!ef->async_exit && (atomic_load(&ef->queued) < ef->async.flush_size)) {
+			pthread_cond_timedwait(&ef->async_cond, &ef->async_mutex, &when);
 		}
+		done = ef->async_exit;
+		pthread_mutex_unlock(&ef->async_mutex);
+
+		exfile_flush(ef);
 	}
 
-	PTHREAD_MUTEX_UNLOCK(&(ef->mutex));
+	/*
+	 *	Anything queued after the last flush.
+	 */
+	exfile_flush(ef);
+
+	return NULL;
+}
+#endif
+
+/** Start a writer thread for a logfile context
+ *
+ * Should be called once, after exfile_init(), from the module's
+ * instantiate function.
+ *
+ * @param ef The logfile context returned from exfile_init().
+ * @param async configuration.  Nothing is done if async->enable is false.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int exfile_async(exfile_t *ef, exfile_async_t const *async)
+{
+	if (!async->enable || check_config) return 0;
 
-	fr_strerror_printf("Attempt to unlock file which does not exist");
+#ifdef WITH_EXFILE_ASYNC
+	ef->async = *async;
+
+	FR_INTEGER_BOUND_CHECK("queue_size", ef->async.queue_size, >=, 16);
+	FR_INTEGER_BOUND_CHECK("queue_size", ef->async.queue_size, <=, 1048576);
+	FR_TIMEVAL_BOUND_CHECK("flush_interval", &ef->async.flush_interval, >=, 0, 1000);
+	FR_TIMEVAL_BOUND_CHECK("flush_interval", &ef->async.flush_interval, <=, 10, 0);
+
+	ef->queue = fr_atomic_queue_create(ef, ef->async.queue_size);
+	ef->batch = talloc_zero_array(ef, exfile_record_t *, ef->async.queue_size);
+	ef->vector = talloc_array(ef, struct iovec, EXFILE_IOV_MAX);
+	if (!ef->queue || !ef->batch || !ef->vector) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+	atomic_init(&ef->queued, 0);
+
+	if (ef->async.io_uring) {
+#ifdef WITH_EXFILE_URING
+		ef->uring = exfile_uring_alloc(ef);
+		if (!ef->uring) WARN("Not using io_uring: %s", fr_strerror());
+#else
+		WARN("Not using io_uring: not supported on this system");
+#endif
+	}
+
+	if (pthread_mutex_init(&ef->async_mutex, NULL) != 0) {
+		fr_strerror_printf("Failed initializing mutex: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if (pthread_cond_init(&ef->async_cond, NULL) != 0) {
+		fr_strerror_printf("Failed initializing condition: %s", fr_syserror(errno));
+		pthread_mutex_destroy(&ef->async_mutex);
+		return -1;
+	}
+
+	if (pthread_create(&ef->async_thread, NULL, exfile_writer_thread, ef) != 0) {
+		fr_strerror_printf("Failed creating writer thread: %s", fr_syserror(errno));
+		pthread_cond_destroy(&ef->async_cond);
+		pthread_mutex_destroy(&ef->async_mutex);
+		return -1;
+	}
+	ef->async_running = true;
+
+	return 0;
+#else
+	fr_strerror_printf("Writing from a background thread is not supported on this system");
 	return -1;
+#endif
 }
@@ -0,0 +1,764 @@
+/*
+ * fiber.c	Run requests on their own stacks, so that a worker can
+ *		process others while one waits for I/O.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#ifdef WITH_FIBERS
+#include <stdatomic.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+/*
+ *	Each worker thread has a scheduler, and runs its requests
+ *	as fibers.  Nothing is pre-empted.  A fiber runs until it
+ *	waits in fr_fiber_poll(), fr_fiber_suspend() or
+ *	fr_fiber_cond_timedwait(), and the worker then runs
+ *	another one.  When none can run, the worker polls for all
+ *	of the file descriptors its fibers are waiting on.
+ *
+ *	Code which calls a library that blocks internally still
+ *	blocks the worker, and all of its fibers.  Only the places
+ *	which wait through the functions here give the worker up.
+ *
+ *	A fiber must never wait while holding a mutex which another
+ *	fiber on the same worker may need, or the worker deadlocks.
+ *	Code which holds such a mutex across calls it doesn't
+ *	control uses fr_fiber_yield_disable(), and the waits then
+ *	block as they would without fibers.
+ */
+
+typedef enum fr_fiber_state_t {
+	FIBER_FREE = 0,			//!< Not in use.
+	FIBER_RUNNABLE,			//!< Waiting for the worker to run it.
+	FIBER_RUNNING,			//!< On the CPU.
+	FIBER_WAITING,			//!< In fr_fiber_poll().
+	FIBER_SUSPENDED,		//!< In fr_fiber_suspend() or fr_fiber_cond_timedwait().
+	FIBER_DONE			//!< Its function has returned.
+} fr_fiber_state_t;
+
+struct fr_fiber {
+	fr_fiber_sched_t	*sched;		//!< Worker the fiber runs on.
+	fr_fiber_state_t	state;
+	ucontext_t		ctx;		//!< Saved registers, when not running.
+
+	uint8_t			*stack;		//!< Including the guard page.  Kept for the next fiber.
+
+	fr_fiber_func_t		func;		//!< Function to run.
+	void			*uctx;		//!< Argument for func.
+
+	struct pollfd		*fds;		//!< File descriptors fr_fiber_poll() is waiting on.
+	nfds_t			nfds;
+	bool			timed;		//!< Whether when is set.
+	struct timeval		when;		//!< When fr_fiber_poll() or fr_fiber_cond_timedwait()
+						//!< times out.
+	int			ready;		//!< What fr_fiber_poll() returns.
+	int			error;		//!< errno, if ready is -1.
+
+	atomic_bool		woken;		//!< Set by fr_fiber_wake().
+
+	fr_fiber_t		*next;		//!< On the free list.
+};
+
+/*
+ *	A fiber in fr_fiber_cond_timedwait().  Lives on the fiber's
+ *	stack, and is protected by the mutex passed to the wait.
+ */
+struct fr_fiber_cond_waiter {
+	fr_fiber_t		*fiber;
+	bool			signalled;	//!< Removed from the queue by a signal.
+	fr_fiber_cond_waiter_t	*next;
+};
+
+struct fr_fiber_sched {
+	ucontext_t		ctx;		//!< The worker's own stack.
+	fr_fiber_t		*fibers;	//!< Array of max_fibers.
+	fr_fiber_t		*free;		//!< Fibers which aren't in use.
+	fr_fiber_t		*current;	//!< Fiber which is running, if any.
+
+	uint32_t		max_fibers;
+	uint32_t		num_fibers;	//!< Which are in use.
+	size_t			stack_size;	//!< Not including the guard page.
+	size_t			page_size;
+	uint32_t		no_yield;	//!< Depth of fr_fiber_yield_disable() calls.
+
+	int			wake[2];	//!< Written by fr_fiber_wake().
+
+	struct pollfd		*pfds;		//!< Scratch space for fr_fiber_sched_run().
+	nfds_t			pfds_len;
+};
+
+fr_thread_local_setup(fr_fiber_sched_t *, fiber_sched)	/* macro */
+
+static int _fiber_sched_free(fr_fiber_sched_t *sched)
+{
+	uint32_t i;
+
+	rad_assert(sched->num_fibers == 0);
+
+	for (i = 0; i < sched->max_fibers; i++) {
+		if (sched->fibers[i].stack) munmap(sched->fibers[i].stack, sched->stack_size + sched->page_size);
+	}
+
+	if (sched->wake[0] >= 0) close(sched->wake[0]);
+	if (sched->wake[1] >= 0) close(sched->wake[1]);
+
+	if (fr_thread_local_get(fiber_sched) == sched) (void) fr_thread_local_set(fiber_sched, NULL);
+
+	return 0;
+}
+
+/** Allocate a scheduler for the calling thread
+ *
+ * Stacks are only allocated when a fiber first needs one, and are
+ * reserved without being committed, so only the pages a fiber
+ * touches use memory.
+ *
+ * @param[in] ctx to allocate the scheduler in.  Must only be freed when no fibers are running.
+ * @param[in] max_fibers which may run at once.
+ * @param[in] stack_size of each fiber, in bytes.
+ * @return
+ *	- A new scheduler.
+ *	- NULL on error.
+ */
+fr_fiber_sched_t *fr_fiber_sched_alloc(TALLOC_CTX *ctx, uint32_t max_fibers, size_t stack_size)
+{
+	fr_fiber_sched_t	*sched;
+	uint32_t		i;
+	long			page_size;
+
+	if (!max_fibers) {
+		fr_strerror_printf("max_fibers must be > 0");
+		return NULL;
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if (page_size <= 0) page_size = 4096;
+
+	sched = talloc_zero(ctx, fr_fiber_sched_t);
+	if (!sched) {
+	oom:
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	sched->wake[0] = sched->wake[1] = -1;
+	talloc_set_destructor(sched, _fiber_sched_free);
+
+	sched->max_fibers = max_fibers;
+	sched->page_size = page_size;
+	sched->stack_size = ((stack_size + page_size - 1) / page_size) * page_size;
+	if (sched->stack_size < (size_t) (4 * page_size)) sched->stack_size = 4 * page_size;
+
+	sched->fibers = talloc_zero_array(sched, fr_fiber_t, max_fibers);
+	if (!sched->fibers) {
+		talloc_free(sched);
+		goto oom;
+	}
+
+	for (i = max_fibers; i > 0; i--) {
+		fr_fiber_t *fiber = &sched->fibers[i - 1];
+
+		fiber->sched = sched;
+		atomic_init(&fiber->woken, false);
+		fiber->next = sched->free;
+		sched->free = fiber;
+	}
+
+	if (pipe(sched->wake) < 0) {
+		fr_strerror_printf("Failed creating pipe: %s", fr_syserror(errno));
+	error:
+		talloc_free(sched);
+		return NULL;
+	}
+	if ((fr_nonblock(sched->wake[0]) < 0) || (fr_nonblock(sched->wake[1]) < 0)) {
+		fr_strerror_printf("Failed setting pipe to non-blocking: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	return sched;
+}
+
+/*
+ *	Returning from here resumes the scheduler, via uc_link.
+ */
+static void _fiber_entry(void)
+{
+	fr_fiber_sched_t	*sched = fr_thread_local_get(fiber_sched);
+	fr_fiber_t		*fiber = sched->current;
+
+	fiber->func(fiber->uctx);
+	fiber->state = FIBER_DONE;
+}
+
+/** Start a fiber
+ *
+ * The fiber doesn't run until the next call to fr_fiber_sched_run().
+ *
+ * @param[in] sched to run the fiber on.
+ * @param[in] func to run.
+ * @param[in] uctx argument for func.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the scheduler is full, or a stack couldn't be allocated.
+ */
+int fr_fiber_start(fr_fiber_sched_t *sched, fr_fiber_func_t func, void *uctx)
+{
+	fr_fiber_t *fiber = sched->free;
+
+	if (!fiber) {
+		fr_strerror_printf("All %u fibers are in use", sched->max_fibers);
+		return -1;
+	}
+
+	if (!fiber->stack) {
+		int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#  ifdef MAP_NORESERVE
+		flags |= MAP_NORESERVE;
+#  endif
+		fiber->stack = mmap(NULL, sched->stack_size + sched->page_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (fiber->stack == MAP_FAILED) {
+			fiber->stack = NULL;
+			fr_strerror_printf("Failed allocating fiber stack: %s", fr_syserror(errno));
+			return -1;
+		}
+
+		/*
+		 *	Stacks grow down, so an overflow hits the
+		 *	guard page instead of another fiber's stack.
+		 */
+		if (mprotect(fiber->stack, sched->page_size, PROT_NONE) < 0) {
+			fr_strerror_printf("Failed protecting fiber stack: %s", fr_syserror(errno));
+			munmap(fiber->stack, sched->stack_size + sched->page_size);
+			fiber->stack = NULL;
+			return -1;
+		}
+	}
+
+	if (getcontext(&fiber->ctx) < 0) {
+		fr_strerror_printf("Failed initialising fiber: %s", fr_syserror(errno));
+		return -1;
+	}
+	fiber->ctx.uc_stack.ss_sp = fiber->stack + sched->page_size;
+	fiber->ctx.uc_stack.ss_size = sched->stack_size;
+	fiber->ctx.uc_link = &sched->ctx;
+	makecontext(&fiber->ctx, _fiber_entry, 0);
+
+	sched->free = fiber->next;
+	fiber->next = NULL;
+
+	fiber->func = func;
+	fiber->uctx = uctx;
+	fiber->fds = NULL;
+	fiber->nfds = 0;
+	fiber->timed = false;
+	atomic_store(&fiber->woken, false);
+	fiber->state = FIBER_RUNNABLE;
+
+	sched->num_fibers++;
+
+	return 0;
+}
+
+/** Return the number of fibers which haven't finished
+ *
+ * @param[in] sched to check.
+ * @return the number of fibers in use.
+ */
+uint32_t fr_fiber_sched_num(fr_fiber_sched_t const *sched)
+{
+	return sched->num_fibers;
+}
+
+static void fiber_resume(fr_fiber_sched_t *sched, fr_fiber_t *fiber)
+{
+	sched->current = fiber;
+	fiber->state = FIBER_RUNNING;
+
+	swapcontext(&sched->ctx, &fiber->ctx);
+
+	sched->current = NULL;
+
+	if (fiber->state != FIBER_DONE) return;
+
+	fiber->state = FIBER_FREE;
+	fiber->next = sched->free;
+	sched->free = fiber;
+
+	rad_assert(sched->num_fibers > 0);
+	sched->num_fibers--;
+}
+
+/*
+ *	Give the CPU back to the scheduler.  The caller has set
+ *	the state the fiber is waiting in.
+ */
+static void fiber_yield(fr_fiber_t *fiber)
+{
+	swapcontext(&fiber->ctx, &fiber->sched->ctx);
+}
+
+/** Wait for the fibers to be able to run, then run them
+ *
+ * Runs each fiber until it waits again, or finishes.  Fibers which
+ * were started or woken since the last call are run without waiting.
+ *
+ * @param[in] sched to run.
+ * @param[in] fd another file descriptor to wait for, e.g. to be told about
+ *	more work.  -1 for none.
+ * @param[in] timeout in milliseconds, or -1 to wait until a fiber can run.
+ * @return
+ *	- 1 if fd is readable.
+ *	- 0 if it isn't.
+ *	- -1 on error.
+ */
+int fr_fiber_sched_run(fr_fiber_sched_t *sched, int fd, int timeout)
+{
+	uint32_t	i;
+	nfds_t		n, needed;
+	struct timeval	now;
+	int		ret, extra = 0;
+	bool		runnable = false;
+
+	(void) fr_thread_local_set(fiber_sched, sched);
+
+	needed = 2;
+	for (i = 0; i < sched->max_fibers; i++) {
+		if (sched->fibers[i].state == FIBER_WAITING) needed += sched->fibers[i].nfds;
+	}
+
+	if (needed > sched->pfds_len) {
+		struct pollfd *pfds;
+
+		pfds = talloc_realloc(sched, sched->pfds, struct pollfd, needed);
+		if (!pfds) {
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+		sched->pfds = pfds;
+		sched->pfds_len = needed;
+	}
+
+	n = 0;
+	sched->pfds[n].fd = sched->wake[0];
+	sched->pfds[n].events = POLLIN;
+	sched->pfds[n++].revents = 0;
+
+	sched->pfds[n].fd = fd;
+	sched->pfds[n].events = POLLIN;
+	sched->pfds[n++].revents = 0;
+
+	gettimeofday(&now, NULL);
+
+	for (i = 0; i < sched->max_fibers; i++) {
+		fr_fiber_t *fiber = &sched->fibers[i];
+
+		switch (fiber->state) {
+		case FIBER_RUNNABLE:
+			runnable = true;
+			break;
+
+		case FIBER_SUSPENDED:
+			if (atomic_load(&fiber->woken)) runnable = true;
+			break;
+
+		case FIBER_WAITING:
+			if (fiber->nfds) memcpy(&sched->pfds[n], fiber->fds, sizeof(*fiber->fds) * fiber->nfds);
+			n += fiber->nfds;
+			break;
+
+		default:
+			continue;
+		}
+
+		if (fiber->timed) {
+			int left;
+
+			left = ((fiber->when.tv_sec - now.tv_sec) * 1000) +
+			       ((fiber->when.tv_usec - now.tv_usec + 999) / 1000);
+			if (left < 0) left = 0;
+			if ((timeout < 0) || (left < timeout)) timeout = left;
+		}
+	}
+
+	if (runnable) timeout = 0;
+
+	ret = poll(sched->pfds, n, timeout);
+	if ((ret < 0) && (errno != EINTR)) {
+		int error = errno;
+
+		/*
+		 *	Let the fibers see the error, rather than
+		 *	waiting forever.
+		 */
+		for (i = 0; i < sched->max_fibers; i++) {
+			fr_fiber_t *fiber = &sched->fibers[i];
+
+			if (fiber->state != FIBER_WAITING) continue;
+
+			fiber->ready = -1;
+			fiber->error = error;
+			fiber->state = FIBER_RUNNABLE;
+		}
+
+		fr_strerror_printf("Failed polling: %s", fr_syserror(error));
+		extra = -1;
+		goto run;
+	}
+
+	if (ret > 0) {
+		if (sched->pfds[0].revents) {
+			uint8_t buff[64];
+
+			while (read(sched->wake[0], buff, sizeof(buff)) > 0);
+		}
+
+		if ((fd >= 0) && sched->pfds[1].revents) extra = 1;
+	}
+
+	gettimeofday(&now, NULL);
+
+	n = 2;
+	for (i = 0; i < sched->max_fibers; i++) {
+		fr_fiber_t	*fiber = &sched->fibers[i];
+		nfds_t		j;
+		int		ready = 0;
+
+		switch (fiber->state) {
+		case FIBER_SUSPENDED:
+			if (atomic_exchange(&fiber->woken, false) ||
+			    (fiber->timed && !timercmp(&now, &fiber->when, <))) fiber->state = FIBER_RUNNABLE;
+			break;
+
+		case FIBER_WAITING:
+			for (j = 0; j < fiber->nfds; j++, n++) {
+				fiber->fds[j].revents = (ret > 0) ? sched->pfds[n].revents : 0;
+				if (fiber->fds[j].revents) ready++;
+			}
+
+			if (ready || (fiber->timed && !timercmp(&now, &fiber->when, <))) {
+				fiber->ready = ready;
+				fiber->state = FIBER_RUNNABLE;
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+run:
+	for (i = 0; i < sched->max_fibers; i++) {
+		if (sched->fibers[i].state == FIBER_RUNNABLE) fiber_resume(sched, &sched->fibers[i]);
+	}
+
+	return extra;
+}
+
+/** Return the fiber which is running, if it may yield
+ *
+ * @return
+ *	- The current fiber.
+ *	- NULL if the caller isn't running on a fiber, or yielding has
+ *	  been disabled with fr_fiber_yield_disable().
+ */
+fr_fiber_t *fr_fiber_current(void)
+{
+	fr_fiber_sched_t *sched = fr_thread_local_get(fiber_sched);
+
+	if (!sched || sched->no_yield) return NULL;
+
+	return sched->current;
+}
+
+/** Wait for file descriptors, letting the worker run other fibers
+ *
+ * A drop-in replacement for poll().  If the caller isn't running on a
+ * fiber, it calls poll().
+ *
+ * @param[in,out] fds to wait for.  revents is set as for poll().
+ * @param[in] nfds number of entries in fds.
+ * @param[in] timeout in milliseconds, or -1 for none.
+ * @return as poll().
+ */
+int fr_fiber_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	fr_fiber_t	*fiber = fr_fiber_current();
+	nfds_t		i;
+
+	if (!fiber) return poll(fds, nfds, timeout);
+
+	for (i = 0; i < nfds; i++) fds[i].revents = 0;
+
+	fiber->fds = fds;
+	fiber->nfds = nfds;
+	fiber->ready = 0;
+	fiber->timed = (timeout >= 0);
+	if (fiber->timed) {
+		struct timeval offset;
+
+		offset.tv_sec = timeout / 1000;
+		offset.tv_usec = (timeout % 1000) * 1000;
+		gettimeofday(&fiber->when, NULL);
+		timeradd(&fiber->when, &offset, &fiber->when);
+	}
+	fiber->state = FIBER_WAITING;
+
+	fiber_yield(fiber);
+
+	fiber->fds = NULL;
+	fiber->nfds = 0;
+	fiber->timed = false;
+
+	if (fiber->ready < 0) errno = fiber->error;
+
+	return fiber->ready;
+}
+
+/*
+ *	Give the CPU up until woken, or until "when", if it's set.
+ */
+static void fiber_suspend(fr_fiber_t *fiber, struct timeval const *when)
+{
+	/*
+	 *	Woken before we got here.
+	 */
+	if (atomic_exchange(&fiber->woken, false)) return;
+
+	fiber->timed = (when != NULL);
+	if (when) fiber->when = *when;
+	fiber->state = FIBER_SUSPENDED;
+
+	fiber_yield(fiber);
+
+	fiber->timed = false;
+}
+
+/** Wait until another thread calls fr_fiber_wake()
+ *
+ * May return without being woken, so callers must check whatever
+ * they're waiting for, and call it again.
+ *
+ * @note Must only be called when fr_fiber_current() returns a fiber.
+ */
+void fr_fiber_suspend(void)
+{
+	fr_fiber_t *fiber = fr_fiber_current();
+
+	rad_assert(fiber != NULL);
+
+	fiber_suspend(fiber, NULL);
+}
+
+/** Wake a fiber which is in fr_fiber_suspend()
+ *
+ * May be called from any thread.  The fiber must not be able to
+ * finish before this returns, e.g. it waits for a flag which the
+ * caller sets under a mutex, and the caller calls this before
+ * releasing the mutex.
+ *
+ * @param[in] fiber to wake.
+ */
+void fr_fiber_wake(fr_fiber_t *fiber)
+{
+	atomic_store(&fiber->woken, true);
+
+	/*
+	 *	A full pipe means the worker already has
+	 *	a wakeup pending.
+	 */
+	if (write(fiber->sched->wake[1], "w", 1) < 0) { /* nothing */ }
+}
+
+/** Initialise a condition which fibers can wait on
+ *
+ * @param[in] cond to initialise.
+ * @return as pthread_cond_init().
+ */
+int fr_fiber_cond_init(fr_fiber_cond_t *cond)
+{
+	cond->head = cond->tail = NULL;
+
+	return pthread_cond_init(&cond->cond, NULL);
+}
+
+/** Free the resources held by a condition
+ *
+ * @param[in] cond to destroy.  Nothing may be waiting on it.
+ */
+void fr_fiber_cond_destroy(fr_fiber_cond_t *cond)
+{
+	rad_assert(cond->head == NULL);
+
+	pthread_cond_destroy(&cond->cond);
+}
+
+/*
+ *	Take the oldest fiber off the queue, and wake it.  It can't
+ *	return from fr_fiber_cond_timedwait() until the caller
+ *	releases the mutex.
+ */
+static bool fiber_cond_wake_one(fr_fiber_cond_t *cond)
+{
+	fr_fiber_cond_waiter_t *waiter = cond->head;
+
+	if (!waiter) return false;
+
+	cond->head = waiter->next;
+	if (!cond->head) cond->tail = NULL;
+
+	waiter->signalled = true;
+	fr_fiber_wake(waiter->fiber);
+
+	return true;
+}
+
+/** Wake one waiter on a condition
+ *
+ * Fibers are woken before threads, oldest first.
+ *
+ * @param[in] cond to signal.  Its mutex must be held.
+ */
+void fr_fiber_cond_signal(fr_fiber_cond_t *cond)
+{
+	if (fiber_cond_wake_one(cond)) return;
+
+	pthread_cond_signal(&cond->cond);
+}
+
+/** Wake all of the waiters on a condition
+ *
+ * @param[in] cond to signal.  Its mutex must be held.
+ */
+void fr_fiber_cond_broadcast(fr_fiber_cond_t *cond)
+{
+	while (fiber_cond_wake_one(cond));
+
+	pthread_cond_broadcast(&cond->cond);
+}
+
+/** Wait on a condition, letting the worker run other fibers
+ *
+ * A drop-in replacement for pthread_cond_timedwait().  On a fiber,
+ * the fiber is queued on the condition and suspended, and the worker
+ * runs its other fibers until the condition is signalled, or abstime
+ * passes.  Like pthread_cond_timedwait(), it may return before the
+ * condition is signalled.
+ *
+ * @param[in] cond to wait on.
+ * @param[in] mutex which is held.  It's held again on return.
+ * @param[in] abstime when to give up, or NULL to wait until signalled.
+ * @return
+ *	- 0 if the caller should check the condition again.
+ *	- ETIMEDOUT if abstime has passed.
+ */
+int fr_fiber_cond_timedwait(fr_fiber_cond_t *cond, pthread_mutex_t *mutex, struct timespec const *abstime)
+{
+	fr_fiber_t		*fiber = fr_fiber_current();
+	fr_fiber_cond_waiter_t	waiter, *w, *prev = NULL;
+	struct timeval		now, when;
+
+	if (!fiber) {
+		if (!abstime) return pthread_cond_wait(&cond->cond, mutex);
+
+		return pthread_cond_timedwait(&cond->cond, mutex, abstime);
+	}
+
+	if (abstime) {
+		when.tv_sec = abstime->tv_sec;
+		when.tv_usec = abstime->tv_nsec / 1000;
+
+		gettimeofday(&now, NULL);
+		if (!timercmp(&now, &when, <)) return ETIMEDOUT;
+	}
+
+	waiter.fiber = fiber;
+	waiter.signalled = false;
+	waiter.next = NULL;
+
+	if (cond->tail) {
+		cond->tail->next = &waiter;
+	} else {
+		cond->head = &waiter;
+	}
+	cond->tail = &waiter;
+
+	/*
+	 *	A signal sent between the unlock and the suspend sets
+	 *	"woken", so the suspend returns straight away.
+	 */
+	pthread_mutex_unlock(mutex);
+	fiber_suspend(fiber, abstime ? &when : NULL);
+	pthread_mutex_lock(mutex);
+
+	if (waiter.signalled) return 0;
+
+	/*
+	 *	Timed out, or woken by something else.  Either way,
+	 *	we're still on the queue.
+	 */
+	for (w = cond->head; w != &waiter; w = w->next) prev = w;
+
+	if (prev) {
+		prev->next = waiter.next;
+	} else {
+		cond->head = waiter.next;
+	}
+	if (cond->tail == &waiter) cond->tail = prev;
+
+	if (!abstime) return 0;
+
+	gettimeofday(&now, NULL);
+	if (!timercmp(&now, &when, <)) return ETIMEDOUT;
+
+	return 0;
+}
+
+/** Stop the current fiber from yielding
+ *
+ * Until fr_fiber_yield_enable() is called, fr_fiber_current() returns
+ * NULL, and the functions which would wait on a fiber block instead.
+ * Calls may be nested.
+ */
+void fr_fiber_yield_disable(void)
+{
+	fr_fiber_sched_t *sched = fr_thread_local_get(fiber_sched);
+
+	if (sched) sched->no_yield++;
+}
+
+/** Undo fr_fiber_yield_disable()
+ *
+ */
+void fr_fiber_yield_enable(void)
+{
+	fr_fiber_sched_t *sched = fr_thread_local_get(fiber_sched);
+
+	if (!sched) return;
+
+	rad_assert(sched->no_yield > 0);
+	sched->no_yield--;
+}
+#endif	/* WITH_FIBERS */
@@ -56,11 +56,16 @@ char const modcall_spaces[] = "
 #ifdef HAVE_PTHREAD_H
 /*
  *	Lock the mutex for the module
+ *
+ *	A fiber mustn't give up the thread while it holds the mutex,
+ *	as another fiber on the same thread may be waiting for it.
  */
 static void safe_lock(module_instance_t *instance)
 {
-	if (instance->mutex)
+	if (instance->mutex) {
+		fr_fiber_yield_disable();
 		pthread_mutex_lock(instance->mutex);
+	}
 }
 
 /*
@@ -68,8 +73,10 @@ static void safe_lock(module_instance_t *instance)
  */
 static void safe_unlock(module_instance_t *instance)
 {
-	if (instance->mutex)
+	if (instance->mutex) {
 		pthread_mutex_unlock(instance->mutex);
+		fr_fiber_yield_enable();
+	}
 }
 #else
 /*
@@ -82,6 +89,11 @@ static void safe_unlock(module_instance_t *instance)
 static rlm_rcode_t CC_HINT(nonnull) call_modsingle(rlm_components_t component, modsingle *sp, REQUEST *request)
 {
 	int blocked;
+	struct timeval start;
+#ifdef WITH_STATS
+	struct timeval end;
+	fr_stats_alloc_mark_t mark;
+#endif
 
 	/*
 	 *	If the request should stop, refuse to do anything.
@@ -103,10 +115,34 @@ static rlm_rcode_t CC_HINT(nonnull) call_modsingle(rlm_components_t component, m
 	 */
 	request->module = sp->modinst->name;
 
+	/*
+	 *	Modules access request->packet->vps directly.
+	 */
+	(void) request_decode_pending(request, NULL);
+
+	FR_PROBE3(module_start, request->number, sp->modinst->name, component);
+
+#ifdef WITH_STATS
+	fr_stats_alloc_start(&mark, request);
+#endif
+
+	gettimeofday(&start, NULL);
+
 	safe_lock(sp->modinst);
 	request->rcode = sp->modinst->entry->module->methods[component](sp->modinst->insthandle, request);
 	safe_unlock(sp->modinst);
 
+	FR_PROBE4(module_done, request->number, sp->modinst->name, component, request->rcode);
+
+#ifdef WITH_STATS
+	gettimeofday(&end, NULL);
+	fr_stats_alloc_end(&sp->modinst->alloc, &mark);
+	if (sp->modinst->latency[component]) fr_stats_latency_add(sp->modinst->latency[component], &start, &end);
+	FR_PROFILE(request, FR_PROFILE_MODULE, sp->modinst->name, comp2str[component], &start, &end);
+#endif
+
+	FR_TRACE(request, FR_TRACE_MODULE_CALL, sp->modinst->name, component, request->rcode, &start);
+
 	request->module = "";
 
 	/*
@@ -139,7 +175,7 @@ typedef struct modcall_stack_entry_t {
 	bool was_if;
 	bool if_taken;
 	bool iterative;
-	modcallable *c;
+	modcall_insn_t const *insn;
 } modcall_stack_entry_t;
 
 typedef struct modcall_stack_t {
@@ -162,7 +198,7 @@ typedef modcall_action_t (*modcall_function_t)(REQUEST *request, modcall_stack_t
 
 static void modcall_recurse(REQUEST *request, modcall_stack_t *stack, rlm_rcode_t *presult, int *ppriority);
 
-static void modcall_push(modcall_stack_t *stack, modcallable *c, rlm_rcode_t result, bool do_next_sibling)
+static void modcall_push(modcall_stack_t *stack, modcall_insn_t const *insn, rlm_rcode_t result, bool do_next_sibling)
 {
 	modcall_stack_entry_t *next;
 
@@ -177,7 +213,7 @@ static void modcall_push(modcall_stack_t *stack, modcallable *c, rlm_rcode_t res
 	 *	Initialize the next stack frame.
 	 */
 	next = &stack->entry[stack->depth];
-	next->c = c;
+	next->insn = insn;
 	next->result = result;
 	next->priority = 0;
 	next->unwind = 0;
@@ -207,10 +243,10 @@ static void modcall_pop(modcall_stack_t *stack)
 /*
  *	Call a child of a block.
  */
-static void modcall_child(REQUEST *request, modcall_stack_t *stack, modcallable *c,
+static void modcall_child(REQUEST *request, modcall_stack_t *stack, modcall_insn_t const *insn,
 			  rlm_rcode_t *result, int *priority, bool do_next_sibling)
 {
-	modcall_push(stack, c, stack->entry[stack->depth].result, do_next_sibling);
+	modcall_push(stack, insn, stack->entry[stack->depth].result, do_next_sibling);
 
 	modcall_recurse(request, stack, result, priority);
 
@@ -221,31 +257,29 @@ static modcall_action_t modcall_load_balance(UNUSED REQUEST *request, modcall_st
 					     rlm_rcode_t *presult, int *priority)
 {
 	modcall_stack_entry_t *entry = &stack->entry[stack->depth];
-	modcallable *c = entry->c;
-	modgroup *g;
+	modcall_insn_t const *insn = entry->insn;
 
 	uint32_t count = 0;
-	modcallable *this, *found;
+	modcall_insn_t const *this, *found;
 
-	g = mod_callabletogroup(c);
-	if (!g->children) {
+	if (!insn->child) {
 		*presult = RLM_MODULE_NOOP;
-		*priority = c->actions[*presult];
+		*priority = insn->actions[*presult];
 		return MODCALL_CALCULATE_RESULT;
 	}
 
 	/*
 	 *	Choose a child at random.
 	 */
-	for (this = found = g->children; this; this = this->next) {
+	for (this = found = insn->child; this; this = this->next) {
 		count++;
 
-		if ((count * (fr_rand() & 0xffff)) < (uint32_t) 0x10000) {
+		if ((count * (fr_fast_rand() & 0xffff)) < (uint32_t) 0x10000) {
 			found = this;
 		}
 	}
 
-	if (c->type == MOD_LOAD_BALANCE) {
+	if (insn->type == MOD_LOAD_BALANCE) {
 		modcall_push(stack, found, entry->result, false);
 		return MODCALL_ITERATIVE;
 
@@ -261,7 +295,7 @@ static modcall_action_t modcall_load_balance(UNUSED REQUEST *request, modcall_st
 		}
 
 		this = this->next;
-		if (!this) this = g->children;
+		if (!this) this = insn->child;
 	} while (this != found);
 
 	return MODCALL_CALCULATE_RESULT;
@@ -271,12 +305,8 @@ static modcall_action_t modcall_case(UNUSED REQUEST *request, modcall_stack_t *s
 				     rlm_rcode_t *presult, UNUSED int *priority)
 {
 	modcall_stack_entry_t *entry = &stack->entry[stack->depth];
-	modcallable *c = entry->c;
-	modgroup *g;
 
-	g = mod_callabletogroup(c);
-
-	if (!g->children) {
+	if (!entry->insn->child) {
 		*presult = RLM_MODULE_NOOP;
 		// ?? priority
 		return MODCALL_CALCULATE_RESULT;
@@ -291,21 +321,21 @@ static modcall_action_t modcall_return(REQUEST *request, modcall_stack_t *stack,
 	int i;
 	VALUE_PAIR **copy_p;
 	modcall_stack_entry_t *entry = &stack->entry[stack->depth];
-	modcallable *c = entry->c;
+	modcall_insn_t const *insn = entry->insn;
 
-	RDEBUG2("%s", unlang_keyword[c->type]);
+	RDEBUG2("%s", unlang_keyword[insn->type]);
 
 	for (i = 8; i >= 0; i--) {
 		copy_p = request_data_get(request, (void *)radius_get_vp, i);
 		if (copy_p) {
-			if (c->type == MOD_BREAK) {
+			if (insn->type == MOD_BREAK) {
 				RDEBUG2("# break Foreach-Variable-%d", i);
 				break;
 			}
 		}
 	}
 
-	entry->unwind = c->type;
+	entry->unwind = insn->type;
 
 	*presult = entry->result;
 	*priority = entry->priority;
@@ -317,11 +347,12 @@ static modcall_action_t modcall_foreach(REQUEST *request, modcall_stack_t *stack
 					rlm_rcode_t *presult, int *priority)
 {
 	int i, foreach_depth = -1;
-	VALUE_PAIR *vps, *vp;
+	VALUE_PAIR *vps = NULL, *vp;
 	modcall_stack_entry_t *entry = &stack->entry[stack->depth];
-	modcallable *c = entry->c;
+	modcall_insn_t const *insn = entry->insn;
+	modcallable *c = insn->c;
 	modgroup *g;
-	vp_cursor_t copy;
+	vp_cursor_t cursor;
 
 	g = mod_callabletogroup(c);
 
@@ -349,27 +380,39 @@ static modcall_action_t modcall_foreach(REQUEST *request, modcall_stack_t *stack
 	}
 
 	/*
-	 *	Copy the VPs from the original request, this ensures deterministic
-	 *	behaviour if someone decides to add or remove VPs in the set were
-	 *	iterating over.
+	 *	If nothing in the body can change the list, we iterate
+	 *	over it directly.
+	 */
+	if (g->foreach_inplace) {
+		vp = tmpl_cursor_init(NULL, &cursor, request, g->vpt);
+
+	/*
+	 *	Otherwise copy the VPs from the original request, this ensures
+	 *	deterministic behaviour if someone decides to add or remove VPs
+	 *	in the set were iterating over.
 	 */
-	if (tmpl_copy_vps(request, &vps, request, g->vpt) < 0) {	/* nothing to loop over */
+	} else if (tmpl_copy_vps(request, &vps, request, g->vpt) < 0) {
+		vp = NULL;
+
+	} else {
+		rad_assert(vps != NULL);
+		vp = fr_cursor_init(&cursor, &vps);
+	}
+
+	if (!vp) {	/* nothing to loop over */
 		*presult = RLM_MODULE_NOOP;
-		*priority = c->actions[RLM_MODULE_NOOP];
+		*priority = insn->actions[RLM_MODULE_NOOP];
 		return MODCALL_CALCULATE_RESULT;
 	}
 
-	rad_assert(vps != NULL);
-	fr_cursor_init(&copy, &vps);
-
 	RDEBUG2("foreach %s ", c->name);
 
 	/*
 	 *	This is the actual body of the foreach loop
 	 */
-	for (vp = fr_cursor_first(&copy);
+	for (;
 	     vp != NULL;
-	     vp = fr_cursor_next(&copy)) {
+	     vp = vps ? fr_cursor_next(&cursor) : tmpl_cursor_next(&cursor, g->vpt)) {
 #ifndef NDEBUG
 		if (fr_debug_lvl >= 2) {
 			char buffer[1024];
@@ -385,7 +428,7 @@ static modcall_action_t modcall_foreach(REQUEST *request, modcall_stack_t *stack
 		 */
 		request_data_add(request, (void *)radius_get_vp, foreach_depth, &vp, false, false, false);
 
-		modcall_child(request, stack, g->children, presult, priority, true);
+		modcall_child(request, stack, insn->child, presult, priority, true);
 
 		/*
 		 *	We've been asked to unwind to the
@@ -406,14 +449,14 @@ static modcall_action_t modcall_foreach(REQUEST *request, modcall_stack_t *stack
 	} /* loop over VPs */
 
 	/*
-	 *	Free the copied vps and the request data
+	 *	Free the copied vps (if any) and the request data
 	 *	If we don't remove the request data, something could call
 	 *	the xlat outside of a foreach loop and trigger a segv.
 	 */
 	fr_pair_list_free(&vps);
 	request_data_get(request, (void *)radius_get_vp, foreach_depth);
 
-	*priority = c->actions[*presult];
+	*priority = insn->actions[*presult];
 	return MODCALL_CALCULATE_RESULT;
 }
 
@@ -421,14 +464,14 @@ static modcall_action_t modcall_xlat(REQUEST *request, modcall_stack_t *stack,
 				     UNUSED rlm_rcode_t *presult, UNUSED int *priority)
 {
 	modcall_stack_entry_t *entry = &stack->entry[stack->depth];
-	modcallable *c = entry->c;
-	modxlat *mx = mod_callabletoxlat(c);
+	modxlat *mx = mod_callabletoxlat(entry->insn->c);
 	char buffer[128];
 
 	if (!mx->exec) {
 		radius_xlat(buffer, sizeof(buffer), request, mx->xlat_name, NULL, NULL);
 	} else {
 		RDEBUG("`%s`", mx->xlat_name);
+		(void) request_decode_pending(request, NULL);
 		radius_exec_program(request, NULL, 0, NULL, request, mx->xlat_name, request->packet->vps,
 				    false, true, EXEC_TIMEOUT);
 	}
@@ -440,15 +483,15 @@ static modcall_action_t modcall_switch(REQUEST *request, modcall_stack_t *stack,
 				       UNUSED rlm_rcode_t *presult, UNUSED int *priority)
 {
 	modcall_stack_entry_t *entry = &stack->entry[stack->depth];
-	modcallable *c = entry->c;
-	modcallable *this, *found, *null_case;
+	modcall_insn_t const *insn = entry->insn;
+	modcall_insn_t const *this, *found, *null_case;
 	modgroup *g, *h;
 	fr_cond_t cond;
 	value_data_t data;
 	vp_map_t map;
 	vp_tmpl_t vpt;
 
-	g = mod_callabletogroup(c);
+	g = mod_callabletogroup(insn->c);
 
 	memset(&cond, 0, sizeof(cond));
 	memset(&map, 0, sizeof(map));
@@ -470,10 +513,10 @@ static modcall_action_t modcall_switch(REQUEST *request, modcall_stack_t *stack,
 	 */
 	if ((g->vpt->type == TMPL_TYPE_ATTR) && (tmpl_find_vp(NULL, request, g->vpt) < 0)) {
 	find_null_case:
-		for (this = g->children; this; this = this->next) {
+		for (this = insn->child; this; this = this->next) {
 			rad_assert(this->type == MOD_CASE);
 
-			h = mod_callabletogroup(this);
+			h = mod_callabletogroup(this->c);
 			if (h->vpt) continue;
 
 			found = this;
@@ -483,6 +526,34 @@ static modcall_action_t modcall_switch(REQUEST *request, modcall_stack_t *stack,
 		goto do_null_case;
 	}
 
+	/*
+	 *	All of the cases are static values, so look each
+	 *	instance of the attribute up in the case table.  As
+	 *	with the linear search, the first case (in order)
+	 *	which matches any instance wins.
+	 */
+	if (g->cases) {
+		VALUE_PAIR *vp;
+		vp_cursor_t cursor;
+		modcall_case_t my_case, *match, *best = NULL;
+
+		my_case.type = g->vpt->tmpl_da->type;
+
+		for (vp = tmpl_cursor_init(NULL, &cursor, request, g->vpt);
+		     vp;
+		     vp = tmpl_cursor_next(&cursor, g->vpt)) {
+			my_case.data = &vp->data;
+
+			match = fr_hash_oa_finddata(g->cases, &my_case);
+			if (match && (!best || (match->order < best->order))) best = match;
+		}
+
+		if (!best) goto find_null_case;
+
+		found = best->insn;
+		goto do_null_case;
+	}
+
 	/*
 	 *	Expand the template if necessary, so that it
 	 *	is evaluated once instead of for each 'case'
@@ -504,10 +575,10 @@ static modcall_action_t modcall_switch(REQUEST *request, modcall_stack_t *stack,
 	 *	Find either the exact matching name, or the
 	 *	"case {...}" statement.
 	 */
-	for (this = g->children; this; this = this->next) {
+	for (this = insn->child; this; this = this->next) {
 		rad_assert(this->type == MOD_CASE);
 
-		h = mod_callabletogroup(this);
+		h = mod_callabletogroup(this->c);
 
 		/*
 		 *	Remember the default case
@@ -578,23 +649,19 @@ static modcall_action_t modcall_update(REQUEST *request, modcall_stack_t *stack,
 {
 	int rcode;
 	modcall_stack_entry_t *entry = &stack->entry[stack->depth];
-	modcallable *c = entry->c;
-	modgroup *g = mod_callabletogroup(c);
-	vp_map_t *map;
+	modcall_insn_t const *insn = entry->insn;
+	modgroup *g = mod_callabletogroup(insn->c);
 
 	RINDENT();
-	for (map = g->map; map != NULL; map = map->next) {
-		rcode = map_to_request(request, map, map_to_vp, NULL);
-		if (rcode < 0) {
-			*presult = (rcode == -2) ? RLM_MODULE_INVALID : RLM_MODULE_FAIL;
-			REXDENT();
-			return MODCALL_CALCULATE_RESULT;
-		}
-	}
+	rcode = map_list_to_request(request, g->map, map_to_vp, NULL);
 	REXDENT();
+	if (rcode < 0) {
+		*presult = (rcode == -2) ? RLM_MODULE_INVALID : RLM_MODULE_FAIL;
+		return MODCALL_CALCULATE_RESULT;
+	}
 
 	*presult = RLM_MODULE_NOOP;
-	*priority = c->actions[RLM_MODULE_NOOP];
+	*priority = insn->actions[RLM_MODULE_NOOP];
 	return MODCALL_CALCULATE_RESULT;
 }
 
@@ -603,14 +670,14 @@ static modcall_action_t modcall_map(REQUEST *request, modcall_stack_t *stack,
 				       rlm_rcode_t *presult, UNUSED int *priority)
 {
 	modcall_stack_entry_t *entry = &stack->entry[stack->depth];
-	modcallable *c = entry->c;
-	modgroup *g = mod_callabletogroup(c);
+	modcall_insn_t const *insn = entry->insn;
+	modgroup *g = mod_callabletogroup(insn->c);
 
 	RINDENT();
 	*presult = map_proc(request, g->proc_inst);
 	REXDENT();
 
-	*priority = c->actions[*presult];
+	*priority = insn->actions[*presult];
 	return MODCALL_CALCULATE_RESULT;
 }
 
@@ -619,7 +686,8 @@ static modcall_action_t modcall_single(REQUEST *request, modcall_stack_t *stack,
 {
 	modsingle *sp;
 	modcall_stack_entry_t *entry = &stack->entry[stack->depth];
-	modcallable *c = entry->c;
+	modcall_insn_t const *insn = entry->insn;
+	modcallable *c = insn->c;
 
 	/*
 	 *	Process a stand-alone child, and fall through
@@ -628,7 +696,7 @@ static modcall_action_t modcall_single(REQUEST *request, modcall_stack_t *stack,
 	sp = mod_callabletosingle(c);
 
 	*presult = call_modsingle(c->method, sp, request);
-	*priority = c->actions[*presult];
+	*priority = insn->actions[*presult];
 
 	RDEBUG2("%s (%s)", c->name ? c->name : "",
 		fr_int2str(mod_rcode_table, *presult, "<invalid>"));
@@ -641,10 +709,10 @@ static modcall_action_t modcall_if(REQUEST *request, modcall_stack_t *stack,
 {
 	int condition;
 	modcall_stack_entry_t *entry = &stack->entry[stack->depth];
-	modcallable *c = entry->c;
+	modcall_insn_t const *insn = entry->insn;
 	modgroup *g;
 
-	g = mod_callabletogroup(c);
+	g = mod_callabletogroup(insn->c);
 	rad_assert(g->cond != NULL);
 
 	condition = radius_evaluate_cond(request, *result, 0, g->cond);
@@ -671,7 +739,7 @@ static modcall_action_t modcall_if(REQUEST *request, modcall_stack_t *stack,
 		entry->was_if = true;
 		entry->if_taken = false;
 
-		*priority = c->actions[*result];
+		*priority = insn->actions[*result];
 		return MODCALL_NEXT_SIBLING;
 	}
 
@@ -687,18 +755,13 @@ static modcall_action_t modcall_elsif(REQUEST *request, modcall_stack_t *stack,
 				   rlm_rcode_t *result, int *priority)
 {
 	modcall_stack_entry_t *entry = &stack->entry[stack->depth];
-	modcallable *c = entry->c;
-	rad_assert(entry->was_if);
 
 	/*
-	 *	Like MOD_ELSE, but allow for a later "else"
+	 *	A taken "if" or "elsif" jumps over the rest of its
+	 *	chain, so we only get here if nothing before us matched.
 	 */
-	if (entry->if_taken) {
-		RDEBUG2("... skipping %s for request %d: Preceding \"if\" was taken",
-			unlang_keyword[c->type], request->number);
-		entry->if_taken = true;
-		return MODCALL_NEXT_SIBLING;
-	}
+	rad_assert(entry->was_if);
+	rad_assert(!entry->if_taken);
 
 	/*
 	 *	Check the "if" condition.
@@ -706,27 +769,18 @@ static modcall_action_t modcall_elsif(REQUEST *request, modcall_stack_t *stack,
 	return modcall_if(request, stack, result, priority);
 }
 
-static modcall_action_t modcall_else(REQUEST *request, modcall_stack_t *stack,
+static modcall_action_t modcall_else(UNUSED REQUEST *request, modcall_stack_t *stack,
 				     UNUSED rlm_rcode_t *result, UNUSED int *priority)
 {
 	modcall_stack_entry_t *entry = &stack->entry[stack->depth];
-	modcallable *c = entry->c;
-	rad_assert(entry->was_if);
-
-	if (entry->if_taken) {
-		RDEBUG2("... skipping %s for request %d: Preceding \"if\" was taken",
-			unlang_keyword[c->type], request->number);
-		entry->was_if = false;
-		entry->if_taken = false;
-
-		*result = RLM_MODULE_NOOP;
-		*priority = c->actions[*result];
-		return MODCALL_NEXT_SIBLING;
-	}
 
 	/*
-	 *	We need to process it.  Go do that.
+	 *	As with "elsif", we're only reached if the preceding
+	 *	"if" wasn't taken.  Go process the body.
 	 */
+	rad_assert(entry->was_if);
+	rad_assert(!entry->if_taken);
+
 	entry->was_if = false;
 	entry->if_taken = false;
 	return MODCALL_DO_CHILDREN;
@@ -796,10 +850,10 @@ static bool modcall_brace[MOD_NUM_TYPES] = {
  */
 static void modcall_recurse(REQUEST *request, modcall_stack_t *stack, rlm_rcode_t *presult, int *ppriority)
 {
+	modcall_insn_t const *insn;
 	modcallable *c;
 	int priority;
 	rlm_rcode_t result;
-	modgroup *g;
 	modcall_stack_entry_t *entry;
 	modcall_action_t action = MODCALL_BREAK;
 
@@ -815,10 +869,11 @@ redo:
 	RINDENT();
 
 	/*
-	 *	Loop over all modules in this list.
+	 *	Loop over all instructions in this block.
 	 */
-	while (entry->c != NULL) {
-		c = entry->c;
+	while (entry->insn != NULL) {
+		insn = entry->insn;
+		c = insn->c;
 
 		rad_assert(c->debug_name != NULL); /* if this happens, all bets are off. */
 
@@ -834,13 +889,11 @@ redo:
 			break;
 		}
 
-		if (modcall_brace[c->type]) RDEBUG2("%s {", c->debug_name);
+		if (modcall_brace[insn->type]) RDEBUG2("%s {", c->debug_name);
 
-		action = modcall_functions[c->type](request, stack, &result, &priority);
+		action = modcall_functions[insn->type](request, stack, &result, &priority);
 		switch (action) {
 		case MODCALL_DO_CHILDREN:
-			g = mod_callabletogroup(c);
-
 			/*
 			 *	This should really have been caught in the
 			 *	compiler, and the node never generated.  But
@@ -848,12 +901,12 @@ redo:
 			 *	it returns a flag instead of the compiled
 			 *	MOD_GROUP.
 			 */
-			if (!g->children) {
+			if (!insn->child) {
 				RDEBUG2("} # %s ... <ignoring empty subsection>", c->debug_name);
 				goto next_sibling;
 			}
 
-			modcall_push(stack, g->children, entry->result, true);
+			modcall_push(stack, insn->child, entry->result, true);
 
 		case MODCALL_ITERATIVE:
 			(entry + 1)->iterative = true;
@@ -864,13 +917,14 @@ redo:
 
 			entry = &stack->entry[stack->depth];
 
-			c = entry->c;
-			rad_assert(c != NULL);
+			insn = entry->insn;
+			rad_assert(insn != NULL);
+			c = insn->c;
 
 			/* FALL-THROUGH */
 
 		case MODCALL_CALCULATE_RESULT:
-			if (modcall_brace[c->type]) RDEBUG2("} # %s (%s)", c->debug_name,
+			if (modcall_brace[insn->type]) RDEBUG2("} # %s (%s)", c->debug_name,
 							    fr_int2str(mod_rcode_table, result, "<invalid>"));
 			action = MODCALL_CALCULATE_RESULT;
 
@@ -887,7 +941,7 @@ redo:
 			/*
 			 *	The child's action says return.  Do so.
 			 */
-			if (c->actions[result] == MOD_ACTION_RETURN) {
+			if (insn->actions[result] == MOD_ACTION_RETURN) {
 		 case MODCALL_BREAK:
 				entry->result = result;
 				goto done;
@@ -897,7 +951,7 @@ redo:
 			 *	If "reject", break out of the loop and return
 			 *	reject.
 			 */
-			if (c->actions[result] == MOD_ACTION_REJECT) {
+			if (insn->actions[result] == MOD_ACTION_REJECT) {
 				entry->result = RLM_MODULE_REJECT;
 				goto done;
 			}
@@ -907,7 +961,7 @@ redo:
 			 *	code.  Grab it in preference to any unset priority.
 			 */
 			if (priority < 0) {
-				priority = c->actions[result];
+				priority = insn->actions[result];
 			}
 
 			/*
@@ -928,14 +982,28 @@ redo:
 			/* FALL-THROUGH */
 
 		case MODCALL_NEXT_SIBLING:
-			if ((action == MODCALL_NEXT_SIBLING) && modcall_brace[c->type]) RDEBUG2("}");
+			if ((action == MODCALL_NEXT_SIBLING) && modcall_brace[insn->type]) RDEBUG2("}");
 
 		next_sibling:
 			if (!entry->do_next_sibling) goto done;
 
 		} /* switch over return code from the interpretor function */
 
-		entry->c = entry->c->next;
+#ifdef WITH_UNLANG
+		/*
+		 *	A taken "if" or "elsif" jumps over the rest of
+		 *	its chain.
+		 */
+		if (entry->if_taken && ((insn->type == MOD_IF) || (insn->type == MOD_ELSIF))) {
+			entry->was_if = false;
+			entry->if_taken = false;
+			entry->insn = insn->skip;
+			continue;
+		}
+#endif
+
+
+		entry->insn = insn->next;
 	}
 
 	/*
@@ -985,6 +1053,13 @@ int modcall(rlm_components_t component, modcallable *c, REQUEST *request)
 	int priority;
 	rlm_rcode_t result;
 	modcall_stack_t stack;
+	modcall_insn_t const *insn;
+
+	/*
+	 *	Empty sections just return the default.  Don't
+	 *	bother setting up a stack to find that out.
+	 */
+	if (!c) return default_component_results[component];
 
 	memset(&stack, 0, sizeof(stack));
 
@@ -994,7 +1069,14 @@ int modcall(rlm_components_t component, modcallable *c, REQUEST *request)
 	stack.component = component;
 	stack.depth = 0;
 
-	modcall_push(&stack, c, result, true);
+	/*
+	 *	Sections are lowered when the virtual server is
+	 *	compiled.  We run the instructions, not the tree.
+	 */
+	insn = mod_callabletogroup(c)->insn;
+	rad_assert(insn != NULL);
+
+	modcall_push(&stack, insn, result, true);
 
 	/*
 	 *	Call the main handler.
@@ -5,6 +5,7 @@ SOURCES	:=	conffile.c \
 		evaluate.c \
 		exec.c \
 		exfile.c \
+		fiber.c \
 		log.c \
 		parser.c \
 		map_proc.c \
@@ -14,9 +15,11 @@ SOURCES	:=	conffile.c \
 		threads.c \
 		trigger.c \
 		tmpl.c \
+		trace.c \
 		util.c \
 		version.c \
 		pair.c \
+		profile.c \
 		xlat.c
 
 # This lets the linker determine which version of the SSLeay functions to use.
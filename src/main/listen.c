@@ -32,8 +32,10 @@ RCSID("$Id$")
 #include <freeradius-devel/net.h>
 
 #include <freeradius-devel/detail.h>
+#include <freeradius-devel/exfile.h>
 
 #include <freeradius-devel/udp.h>
+#include <freeradius-devel/md5.h>
 
 #ifdef HAVE_SYS_RESOURCE_H
 #  include <sys/resource.h>
@@ -94,6 +96,11 @@ static int command_tcp_send(rad_listen_t *listener, REQUEST *request);
 static int command_write_magic(int newfd, listen_socket_t *sock);
 #endif
 
+#if defined(WITH_METRICS_SOCKET) && defined(WITH_TCP)
+static int metrics_tcp_recv(rad_listen_t *listener);
+static int metrics_tcp_send(rad_listen_t *listener, REQUEST *request);
+#endif
+
 static fr_protocol_t master_listen[];
 
 static int _listen_config_free(listen_config_t *lc)
@@ -140,6 +147,7 @@ int listen_bootstrap(CONF_SECTION *server, CONF_SECTION *cs, char const *server_
 	 */
 	if (!server_name) {
 		if ((strcmp(value, "control") != 0) &&
+		    (strcmp(value, "metrics") != 0) &&
 		    (strcmp(value, "proxy") != 0)) {
 			cf_log_err_cs(cs, "Listeners of type '%s' MUST be defined in a server.", value);
 			return -1;
@@ -147,6 +155,7 @@ int listen_bootstrap(CONF_SECTION *server, CONF_SECTION *cs, char const *server_
 
 	} else {
 		if ((strcmp(value, "control") == 0) ||
+		    (strcmp(value, "metrics") == 0) ||
 		    (strcmp(value, "proxy") == 0)) {
 			cf_log_err_cs(cs, "Listeners of type '%s' MUST NOT be defined in a server.", value);
 			return -1;
@@ -160,6 +169,7 @@ int listen_bootstrap(CONF_SECTION *server, CONF_SECTION *cs, char const *server_
 	 *	At some point, we'll move all of these to plugins.
 	 */
 	if (!((strcmp(value, "control") == 0) ||
+	      (strcmp(value, "metrics") == 0) ||
 	      (strcmp(value, "status") == 0) ||
 	      (strcmp(value, "coa") == 0) ||
 	      (strcmp(value, "detail") == 0) ||
@@ -338,6 +348,231 @@ int listen_bootstrap(CONF_SECTION *server, CONF_SECTION *cs, char const *server_
 }
 
 
+#ifdef WITH_DYNAMIC_CLIENTS
+/*
+ *	Run a fake request through the dynamic_clients virtual server.
+ */
+static rlm_rcode_t client_resolve_run(REQUEST *request)
+{
+	rlm_rcode_t rcode;
+
+	/*
+	 *	Look for FreeRADIUS-Client-IP-Address
+	 *		 FreeRADIUS-Client-Secret
+	 *		...
+	 *
+	 *	and create the RADCLIENT structure from that.
+	 */
+	RDEBUG("server %s {", request->server);
+
+	rcode = process_authorize(0, request);
+
+	RDEBUG("} # server %s", request->server);
+
+	return rcode;
+}
+
+/*
+ *	Create, or add, the client found by the dynamic_clients
+ *	virtual server.  Frees the request.
+ */
+static RADCLIENT *client_resolved(RADCLIENT_LIST *clients, RADCLIENT *network, REQUEST *request,
+				  rlm_rcode_t rcode)
+{
+	RADCLIENT *created;
+
+	switch (rcode) {
+	case RLM_MODULE_OK:
+	case RLM_MODULE_UPDATED:
+		break;
+
+	/*
+	 *	Likely a fatal error we want to warn the user about
+	 */
+	case RLM_MODULE_INVALID:
+	case RLM_MODULE_FAIL:
+		ERROR("Virtual-Server %s returned %s, creating dynamic client failed", request->server,
+		      fr_int2str(mod_rcode_table, rcode, "<INVALID>"));
+		talloc_free(request);
+		return NULL;
+
+	/*
+	 *	Probably the result of policy, or the client not existing.
+	 */
+	default:
+		DEBUG("Virtual-Server %s returned %s, ignoring client", request->server,
+		      fr_int2str(mod_rcode_table, rcode, "<INVALID>"));
+		talloc_free(request);
+		return NULL;
+	}
+
+	/*
+	 *	If the client was updated by rlm_dynamic_clients,
+	 *	don't create the client from attribute-value pairs.
+	 */
+	if (request->client == network) {
+		created = client_afrom_request(clients, request);
+	} else {
+		created = request->client;
+
+		/*
+		 *	This frees the client if it isn't valid.
+		 */
+		if (!client_add_dynamic(clients, network, created)) {
+			talloc_free(request);
+			return NULL;
+		}
+	}
+
+	request->server = network->server;
+	trigger_exec(request, NULL, "server.client.add", false, NULL);
+
+	talloc_free(request);
+
+	return created;
+}
+
+#  ifdef HAVE_PTHREAD_H
+/*
+ *	Networks with "asynchronous = yes" have their dynamic_clients
+ *	virtual server run by a separate thread, so that the listener
+ *	isn't blocked on SQL or LDAP.  The packet which started the
+ *	lookup is discarded, and the client is added by the next call
+ *	to client_listener_find() after the lookup finishes.  By then
+ *	the NAS will have retransmitted.
+ *
+ *	The client lists are only changed by the threads reading
+ *	packets, as they are without this.
+ */
+#    define CLIENT_RESOLVE_MAX	(1024)	//!< Most lookups queued, or waiting to be added.
+
+typedef struct client_resolve {
+	REQUEST		*request;	//!< Fake request for the dynamic_clients virtual server.
+	RADCLIENT_LIST	*clients;	//!< List to add the client to.
+	RADCLIENT	*network;	//!< Network which defined the virtual server.
+	fr_ipaddr_t	ipaddr;		//!< Source address being looked up.
+	rlm_rcode_t	rcode;		//!< What the virtual server returned.
+} client_resolve_t;
+
+static pthread_mutex_t	client_resolve_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	client_resolve_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t	client_resolve_once = PTHREAD_ONCE_INIT;
+static fr_fifo_t	*client_resolve_todo;	//!< Waiting for the virtual server.
+static fr_fifo_t	*client_resolve_done;	//!< Waiting to be added to a client list.
+static uint32_t		client_resolve_num;	//!< In either fifo.
+static uint32_t		client_resolve_num_done;
+static bool		client_resolve_running;
+
+static void *client_resolve_thread(UNUSED void *arg)
+{
+	client_resolve_t *resolve;
+
+	for (;;) {
+		pthread_mutex_lock(&client_resolve_mutex);
+		while ((resolve = fr_fifo_pop(client_resolve_todo)) == NULL) {
+			pthread_cond_wait(&client_resolve_cond, &client_resolve_mutex);
+		}
+		pthread_mutex_unlock(&client_resolve_mutex);
+
+		resolve->rcode = client_resolve_run(resolve->request);
+
+		pthread_mutex_lock(&client_resolve_mutex);
+		fr_fifo_push(client_resolve_done, resolve);
+		__atomic_add_fetch(&client_resolve_num_done, 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&client_resolve_mutex);
+	}
+
+	return NULL;
+}
+
+static void client_resolve_start(void)
+{
+	pthread_t id;
+	pthread_attr_t attr;
+
+	client_resolve_todo = fr_fifo_create(NULL, CLIENT_RESOLVE_MAX, NULL);
+	client_resolve_done = fr_fifo_create(NULL, CLIENT_RESOLVE_MAX, NULL);
+	if (!client_resolve_todo || !client_resolve_done) return;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&id, &attr, client_resolve_thread, NULL) != 0) {
+		ERROR("Failed creating thread for dynamic client lookups: %s", fr_syserror(errno));
+	} else {
+		client_resolve_running = true;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ *	Queue a lookup for the resolver thread.
+ */
+static bool client_resolve_queue(RADCLIENT_LIST *clients, RADCLIENT *network, fr_ipaddr_t const *ipaddr,
+				 REQUEST *request)
+{
+	client_resolve_t *resolve;
+
+	pthread_once(&client_resolve_once, client_resolve_start);
+	if (!client_resolve_running) return false;
+
+	resolve = talloc_zero(request, client_resolve_t);
+	if (!resolve) return false;
+
+	resolve->request = request;
+	resolve->clients = clients;
+	resolve->network = network;
+	resolve->ipaddr = *ipaddr;
+
+	pthread_mutex_lock(&client_resolve_mutex);
+	if ((client_resolve_num >= CLIENT_RESOLVE_MAX) || !fr_fifo_push(client_resolve_todo, resolve)) {
+		pthread_mutex_unlock(&client_resolve_mutex);
+		talloc_free(resolve);
+		return false;
+	}
+	client_resolve_num++;
+	pthread_cond_signal(&client_resolve_cond);
+	pthread_mutex_unlock(&client_resolve_mutex);
+
+	return true;
+}
+
+/*
+ *	Add the clients found by the resolver thread.
+ */
+static void client_resolve_finish(void)
+{
+	client_resolve_t	*resolve;
+	RADCLIENT		*created;
+	RADCLIENT		*network;
+	fr_ipaddr_t		ipaddr;
+
+	if (!__atomic_load_n(&client_resolve_num_done, __ATOMIC_ACQUIRE)) return;
+
+	for (;;) {
+		pthread_mutex_lock(&client_resolve_mutex);
+		resolve = fr_fifo_pop(client_resolve_done);
+		if (resolve) {
+			client_resolve_num--;
+			__atomic_sub_fetch(&client_resolve_num_done, 1, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&client_resolve_mutex);
+
+		if (!resolve) break;
+
+		/*
+		 *	The request, and resolve with it, are freed
+		 *	by client_resolved().
+		 */
+		network = resolve->network;
+		ipaddr = resolve->ipaddr;
+
+		created = client_resolved(resolve->clients, network, resolve->request, resolve->rcode);
+		client_lookup_done(network, &ipaddr, (created != NULL));
+	}
+}
+#  endif
+#endif
+
 /*
  *	Find a per-socket client.
  */
@@ -345,7 +580,7 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 				fr_ipaddr_t const *ipaddr, uint16_t src_port)
 {
 #ifdef WITH_DYNAMIC_CLIENTS
-	int rcode;
+	rlm_rcode_t rcode;
 	REQUEST *request;
 	RADCLIENT *created;
 #endif
@@ -365,6 +600,10 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 	 */
 	rad_assert(clients != NULL);
 
+#if defined(WITH_DYNAMIC_CLIENTS) && defined(HAVE_PTHREAD_H)
+	client_resolve_finish();
+#endif
+
 	client = client_find(clients, ipaddr, sock->proto);
 	if (!client) {
 		char name[256], buffer[INET6_ADDRSTRLEN];
@@ -493,10 +732,21 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 		if (now == client->last_new_client) goto unknown;
 	}
 
+	/*
+	 *	Ignore sources for which no client was found
+	 *	recently, or which are already being looked up, and
+	 *	limit the rate of lookups for this network.
+	 */
+	if (!client_lookup_start(client, ipaddr)) goto unknown;
+
 	client->last_new_client = now;
 
 	request = request_alloc(NULL);
-	if (!request) goto unknown;
+	if (!request) {
+	lookup_failed:
+		client_lookup_done(client, ipaddr, false);
+		goto unknown;
+	}
 
 	request->listener = listener;
 	request->client = client;
@@ -504,77 +754,31 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 	if (!request->packet) {				/* badly formed, etc */
 		talloc_free(request);
 		if (DEBUG_ENABLED) ERROR("Receive - %s", fr_strerror());
-		goto unknown;
+		goto lookup_failed;
 	}
 	(void) talloc_steal(request, request->packet);
 	request->reply = fr_radius_alloc_reply(request, request->packet);
 	if (!request->reply) {
 		talloc_free(request);
-		goto unknown;
+		goto lookup_failed;
 	}
 	request->number = 0;
 	request->priority = listener->type;
 	request->server = client->client_server;
 	request->root = &main_config;
 
+#  ifdef HAVE_PTHREAD_H
 	/*
-	 *	Run a fake request through the given virtual server.
-	 *	Look for FreeRADIUS-Client-IP-Address
-	 *		 FreeRADIUS-Client-Secret
-	 *		...
-	 *
-	 *	and create the RADCLIENT structure from that.
-	 */
-	RDEBUG("server %s {", request->server);
-
-	rcode = process_authorize(0, request);
-
-	RDEBUG("} # server %s", request->server);
-
-	switch (rcode) {
-	case RLM_MODULE_OK:
-	case RLM_MODULE_UPDATED:
-		break;
-
-	/*
-	 *	Likely a fatal error we want to warn the user about
-	 */
-	case RLM_MODULE_INVALID:
-	case RLM_MODULE_FAIL:
-		ERROR("Virtual-Server %s returned %s, creating dynamic client failed", request->server,
-		      fr_int2str(mod_rcode_table, rcode, "<INVALID>"));
-		talloc_free(request);
-		goto unknown;
-
-	/*
-	 *	Probably the result of policy, or the client not existing.
-	 */
-	default:
-		DEBUG("Virtual-Server %s returned %s, ignoring client", request->server,
-		      fr_int2str(mod_rcode_table, rcode, "<INVALID>"));
-		talloc_free(request);
-		goto unknown;
-	}
-
-	/*
-	 *	If the client was updated by rlm_dynamic_clients,
-	 *	don't create the client from attribute-value pairs.
+	 *	Drop this packet, and wait for the NAS to retransmit.
 	 */
-	if (request->client == client) {
-		created = client_afrom_request(clients, request);
-	} else {
-		created = request->client;
-
-		/*
-		 *	This frees the client if it isn't valid.
-		 */
-		if (!client_add_dynamic(clients, client, created)) goto unknown;
-	}
+	if (client->lookup_async && main_config.spawn_workers &&
+	    client_resolve_queue(clients, client, ipaddr, request)) return NULL;
+#  endif
 
-	request->server = client->server;
-	trigger_exec(request, NULL, "server.client.add", false, NULL);
+	rcode = client_resolve_run(request);
 
-	talloc_free(request);
+	created = client_resolved(clients, client, request, rcode);
+	client_lookup_done(client, ipaddr, (created != NULL));
 
 	if (!created) goto unknown;
 
@@ -695,75 +899,21 @@ int rad_status_server(REQUEST *request)
 }
 
 #ifdef WITH_TCP
-static int dual_tcp_recv(rad_listen_t *listener)
+/*
+ *	How much data to read from a TCP connection at once.  Enough
+ *	for a reasonable number of packets sent back to back.
+ */
+#define TCP_RECV_BUFFER_SIZE	(64 * 1024)
+
+/*
+ *	Process one packet read from a TCP connection.
+ */
+static int dual_tcp_recv_one(rad_listen_t *listener, RADIUS_PACKET *packet)
 {
-	int rcode;
-	RADIUS_PACKET	*packet;
 	RAD_REQUEST_FUNP fun = NULL;
 	listen_socket_t *sock = listener->data;
 	RADCLIENT	*client = sock->client;
 
-	if (!rad_cond_assert(client != NULL)) return 0;
-
-	if (listener->status != RAD_LISTEN_STATUS_KNOWN) return 0;
-
-	/*
-	 *	Allocate a packet for partial reads.
-	 */
-	if (!sock->packet) {
-		sock->packet = fr_radius_alloc(sock, false);
-		if (!sock->packet) return 0;
-
-		sock->packet->sockfd = listener->fd;
-		sock->packet->src_ipaddr = sock->other_ipaddr;
-		sock->packet->src_port = sock->other_port;
-		sock->packet->dst_ipaddr = sock->my_ipaddr;
-		sock->packet->dst_port = sock->my_port;
-		sock->packet->proto = sock->proto;
-	}
-
-	/*
-	 *	Grab the packet currently being processed.
-	 */
-	packet = sock->packet;
-
-	rcode = fr_tcp_read_packet(packet, 0);
-
-	/*
-	 *	Still only a partial packet.  Put it back, and return,
-	 *	so that we'll read more data when it's ready.
-	 */
-	if (rcode == 0) {
-		return 0;
-	}
-
-	if (rcode == -1) {	/* error reading packet */
-		char buffer[256];
-
-		ERROR("Invalid packet from %s port %d, closing socket: %s",
-		       fr_inet_ntoh(&packet->src_ipaddr, buffer, sizeof(buffer)),
-		       packet->src_port, fr_strerror());
-	}
-
-	if (rcode < 0) {	/* error or connection reset */
-		listener->status = RAD_LISTEN_STATUS_EOL;
-
-		/*
-		 *	Tell the event handler that an FD has disappeared.
-		 */
-		DEBUG("Client has closed connection");
-		radius_update_listener(listener);
-
-		/*
-		 *	Do NOT free the listener here.  It's in use by
-		 *	a request, and will need to hang around until
-		 *	all of the requests are done.
-		 *
-		 *	It is instead free'd in remove_from_request_hash()
-		 */
-		return 0;
-	}
-
 	/*
 	 *	Some sanity checks, based on the packet code.
 	 */
@@ -786,7 +936,7 @@ static int dual_tcp_recv(rad_listen_t *listener)
 		if (!main_config.status_server) {
 			FR_STATS_INC(auth, total_unknown_types);
 			WARN("Ignoring Status-Server request due to security configuration");
-			fr_radius_free(&sock->packet);
+			fr_radius_free(&packet);
 			return 0;
 		}
 		fun = rad_status_server;
@@ -798,49 +948,141 @@ static int dual_tcp_recv(rad_listen_t *listener)
 
 		DEBUG("Invalid packet code %d sent from client %s port %d : IGNORED",
 		      packet->code, client->shortname, packet->src_port);
-		fr_radius_free(&sock->packet);
+		fr_radius_free(&packet);
 		return 0;
 	} /* switch over packet types */
 
 	if (!request_receive(NULL, listener, packet, client, fun)) {
 		FR_STATS_INC(auth, total_packets_dropped);
-		fr_radius_free(&sock->packet);
+		fr_radius_free(&packet);
 		return 0;
 	}
 
-	sock->packet = NULL;	/* we have no need for more partial reads */
 	return 1;
 }
 
 /*
- *	Ensure that we always keep the correct counters.
+ *	Read everything which is available on the connection, and
+ *	process every complete packet in it.  Any partial packet at
+ *	the end is kept until the rest of it arrives.
  */
-#ifdef WITH_TCP
-static int _common_socket_free(listen_socket_t *sock)
+static int dual_tcp_recv(rad_listen_t *listener)
 {
-	if (sock->proto != IPPROTO_TCP) return 0;
+	int		rcode, received = 0;
+	ssize_t		len;
+	RADIUS_PACKET	*packet;
+	listen_socket_t *sock = listener->data;
+	RADCLIENT	*client = sock->client;
 
-	/*
-	 *      Decrement the number of connections.
-	 */
-	if (sock->parent && (sock->parent->limit.num_connections > 0)) {
-		sock->parent->limit.num_connections--;
-	}
-	if (sock->client && sock->client->limit.num_connections > 0) {
-		sock->client->limit.num_connections--;
+	if (!rad_cond_assert(client != NULL)) return 0;
+
+	if (listener->status != RAD_LISTEN_STATUS_KNOWN) return 0;
+
+	if (!sock->recv_buf) {
+		sock->recv_buf = fr_tcp_buffer_alloc(sock, TCP_RECV_BUFFER_SIZE);
+		if (!sock->recv_buf) return 0;
 	}
-	if (sock->home && sock->home->limit.num_connections > 0) {
-		sock->home->limit.num_connections--;
+
+	len = fr_tcp_buffer_recv(listener->fd, sock->recv_buf);
+	if (len < 0) {
+		if (len == -1) ERROR("Failed reading from socket %d: %s", listener->fd, fr_strerror());
+		goto error;
 	}
 
-	return 0;
-}
-#endif
+	for (;;) {
+		packet = fr_radius_alloc(NULL, false);
+		if (!packet) break;
 
-static int dual_tcp_accept(rad_listen_t *listener)
-{
-	int newfd;
-	uint16_t src_port;
+		packet->sockfd = listener->fd;
+		packet->src_ipaddr = sock->other_ipaddr;
+		packet->src_port = sock->other_port;
+		packet->dst_ipaddr = sock->my_ipaddr;
+		packet->dst_port = sock->my_port;
+		packet->proto = sock->proto;
+
+		rcode = fr_tcp_buffer_packet(sock->recv_buf, packet, 0);
+
+		/*
+		 *	Only a partial packet left.  We'll read the
+		 *	rest of it when it's ready.
+		 */
+		if (rcode == 0) {
+			fr_radius_free(&packet);
+			break;
+		}
+
+		if (rcode < 0) {
+			char buffer[256];
+
+			ERROR("Invalid packet from %s port %d, closing socket: %s",
+			       fr_inet_ntoh(&packet->src_ipaddr, buffer, sizeof(buffer)),
+			       packet->src_port, fr_strerror());
+			fr_radius_free(&packet);
+			goto error;
+		}
+
+		received += dual_tcp_recv_one(listener, packet);
+
+		/*
+		 *	The listener may have been closed while
+		 *	processing the packet.
+		 */
+		if (listener->status != RAD_LISTEN_STATUS_KNOWN) break;
+	}
+
+	return received;
+
+error:
+	/*
+	 *	Error or connection reset.
+	 */
+	listener->status = RAD_LISTEN_STATUS_EOL;
+
+	/*
+	 *	Tell the event handler that an FD has disappeared.
+	 */
+	DEBUG("Client has closed connection");
+	radius_update_listener(listener);
+
+	/*
+	 *	Do NOT free the listener here.  It's in use by
+	 *	a request, and will need to hang around until
+	 *	all of the requests are done.
+	 *
+	 *	It is instead free'd in remove_from_request_hash()
+	 */
+	return received;
+}
+
+/*
+ *	Ensure that we always keep the correct counters.
+ */
+#ifdef WITH_TCP
+static int _common_socket_free(listen_socket_t *sock)
+{
+	if (sock->proto != IPPROTO_TCP) return 0;
+
+	/*
+	 *      Decrement the number of connections.
+	 */
+	if (sock->parent && (sock->parent->limit.num_connections > 0)) {
+		sock->parent->limit.num_connections--;
+	}
+	if (sock->client && sock->client->limit.num_connections > 0) {
+		sock->client->limit.num_connections--;
+	}
+	if (sock->home && sock->home->limit.num_connections > 0) {
+		sock->home->limit.num_connections--;
+	}
+
+	return 0;
+}
+#endif
+
+static int dual_tcp_accept(rad_listen_t *listener)
+{
+	int newfd;
+	uint16_t src_port;
 	rad_listen_t *this;
 	socklen_t salen;
 	struct sockaddr_storage src;
@@ -984,6 +1226,12 @@ static int dual_tcp_accept(rad_listen_t *listener)
 		this->send = command_tcp_send;
 		command_write_magic(this->fd, sock);
 	} else
+#  endif
+#  ifdef WITH_METRICS_SOCKET
+	if (this->type == RAD_LISTEN_METRICS) {
+		this->recv = metrics_tcp_recv;
+		this->send = metrics_tcp_send;
+	} else
 #  endif
 	{
 
@@ -1224,12 +1472,28 @@ static CONF_PARSER performance_config[] = {
 	{ FR_CONF_OFFSET("synchronous", PW_TYPE_BOOLEAN, rad_listen_t, synchronous) },
 
 	{ FR_CONF_OFFSET("workers", PW_TYPE_INTEGER, rad_listen_t, workers) },
+
+	{ FR_CONF_OFFSET("reuse_port", PW_TYPE_BOOLEAN, rad_listen_t, reuse_port) },
+
+	{ FR_CONF_OFFSET("recv_batch", PW_TYPE_INTEGER, rad_listen_t, recv_batch), .dflt = "0" },
+
+	{ FR_CONF_OFFSET("send_batch", PW_TYPE_INTEGER, rad_listen_t, send_batch), .dflt = "0" },
+
+	{ FR_CONF_OFFSET("zero_copy", PW_TYPE_BOOLEAN, rad_listen_t, zero_copy), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("lazy_decode", PW_TYPE_BOOLEAN, rad_listen_t, lazy_decode), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("cpu_affinity", PW_TYPE_STRING, rad_listen_t, cpu_affinity) },
+
+	{ FR_CONF_OFFSET("numa_node", PW_TYPE_SIGNED, rad_listen_t, numa_node), .dflt = "-1" },
 	CONF_PARSER_TERMINATOR
 };
 
 
 static CONF_PARSER limit_config[] = {
 	{ FR_CONF_OFFSET("max_pps", PW_TYPE_INTEGER, listen_socket_t, max_rate) },
+	{ FR_CONF_OFFSET("max_pps_burst", PW_TYPE_INTEGER, listen_socket_t, pps_limit.burst) },
+	{ FR_CONF_OFFSET("filter_clients", PW_TYPE_BOOLEAN, listen_socket_t, filter_clients), .dflt = "no" },
 
 #ifdef WITH_TCP
 	{ FR_CONF_OFFSET("max_connections", PW_TYPE_INTEGER, listen_socket_t, limit.max_connections), .dflt = "16" },
@@ -1239,6 +1503,15 @@ static CONF_PARSER limit_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+#ifdef WITH_ACCOUNTING
+static CONF_PARSER journal_config[] = {
+	{ FR_CONF_OFFSET("filename", PW_TYPE_FILE_OUTPUT | PW_TYPE_REQUIRED, listen_socket_t, journal_file) },
+	{ FR_CONF_OFFSET("permissions", PW_TYPE_INTEGER, listen_socket_t, journal_perm), .dflt = "0600" },
+	{ FR_CONF_OFFSET("fsync", PW_TYPE_BOOLEAN, listen_socket_t, journal_fsync), .dflt = "yes" },
+	CONF_PARSER_TERMINATOR
+};
+#endif
+
 
 #ifdef WITH_TCP
 /*
@@ -1386,6 +1659,96 @@ int common_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 			WARN("Setting 'workers' requires 'synchronous'.  Disabling 'workers'");
 			this->workers = 0;
 		}
+
+		if (this->reuse_port) {
+#ifndef SO_REUSEPORT
+			WARN("Setting 'reuse_port' is not supported on this system.  Disabling 'reuse_port'");
+			this->reuse_port = false;
+#else
+			if (!this->workers) {
+				WARN("Setting 'reuse_port' requires 'workers'.  Disabling 'reuse_port'");
+				this->reuse_port = false;
+			}
+#  ifdef WITH_TCP
+			if (sock->proto == IPPROTO_TCP) {
+				WARN("Setting 'reuse_port' is only supported for 'proto = udp'.  Disabling 'reuse_port'");
+				this->reuse_port = false;
+			}
+#  endif
+#endif
+		}
+
+		if (this->recv_batch) {
+#ifndef HAVE_RECVMMSG
+			WARN("Setting 'recv_batch' is not supported on this system.  Disabling 'recv_batch'");
+			this->recv_batch = 0;
+#else
+			FR_INTEGER_BOUND_CHECK("recv_batch", this->recv_batch, <=, 1024);
+
+			/*
+			 *	Worker threads sharing one socket would
+			 *	also share the buffers.
+			 */
+			if (this->workers && !this->reuse_port) {
+				WARN("Setting 'recv_batch' with 'workers' requires 'reuse_port'.  Disabling 'recv_batch'");
+				this->recv_batch = 0;
+			}
+#  ifdef WITH_TCP
+			if (sock->proto == IPPROTO_TCP) {
+				WARN("Setting 'recv_batch' is only supported for 'proto = udp'.  Disabling 'recv_batch'");
+				this->recv_batch = 0;
+			}
+#  endif
+#endif
+		}
+
+		if (this->send_batch) {
+#ifndef HAVE_SENDMMSG
+			WARN("Setting 'send_batch' is not supported on this system.  Disabling 'send_batch'");
+			this->send_batch = 0;
+#else
+			FR_INTEGER_BOUND_CHECK("send_batch", this->send_batch, <=, 1024);
+
+			/*
+			 *	Otherwise the replies are sent by the
+			 *	worker threads, while the main thread is
+			 *	reading more packets.
+			 */
+			if (!this->synchronous) {
+				WARN("Setting 'send_batch' requires 'synchronous'.  Disabling 'send_batch'");
+				this->send_batch = 0;
+			}
+
+			if (this->workers && !this->reuse_port) {
+				WARN("Setting 'send_batch' with 'workers' requires 'reuse_port'.  Disabling 'send_batch'");
+				this->send_batch = 0;
+			}
+#  ifdef WITH_TCP
+			if (sock->proto == IPPROTO_TCP) {
+				WARN("Setting 'send_batch' is only supported for 'proto = udp'.  Disabling 'send_batch'");
+				this->send_batch = 0;
+			}
+#  endif
+#endif
+		}
+
+		if (this->cpu_affinity || (this->numa_node >= 0)) {
+#ifndef WITH_THREAD_AFFINITY
+			WARN("Setting 'cpu_affinity' and 'numa_node' is not supported on this system.  Ignoring them");
+			this->cpu_affinity = NULL;
+			this->numa_node = -1;
+#else
+			if (!this->workers) {
+				WARN("Setting 'cpu_affinity' and 'numa_node' requires 'workers'.  Ignoring them");
+				this->cpu_affinity = NULL;
+				this->numa_node = -1;
+
+			} else if (thread_affinity_check(this->cpu_affinity, this->numa_node) < 0) {
+				cf_log_err_cs(subcs, "Invalid cpu_affinity or numa_node: %s", fr_strerror());
+				return -1;
+			}
+#endif
+		}
 	}
 
 	subcs = cf_section_sub_find(cs, "limit");
@@ -1400,6 +1763,41 @@ int common_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 			return -1;
 		}
 
+		if (sock->pps_limit.burst > 1000000) {
+			cf_log_err_cs(cs,
+				      "Invalid value for \"max_pps_burst\"");
+			return -1;
+		}
+
+		/*
+		 *	UDP authentication and accounting sockets
+		 *	check max_pps before the packet is decoded, so
+		 *	request_receive() doesn't need to.
+		 */
+		if ((sock->proto == IPPROTO_UDP) &&
+		    ((this->type == RAD_LISTEN_AUTH) || (this->type == RAD_LISTEN_ACCT))) {
+			sock->pps_limit.rate = sock->max_rate;
+			sock->max_rate = 0;
+		}
+
+		if (sock->filter_clients) {
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_FILTER)
+			if ((sock->proto != IPPROTO_UDP) ||
+			    ((this->type != RAD_LISTEN_AUTH) && (this->type != RAD_LISTEN_ACCT)
+#  ifdef WITH_COA
+			     && (this->type != RAD_LISTEN_COA)
+#  endif
+				    )) {
+				WARN("Setting 'filter_clients' is only supported for UDP auth, acct and coa sockets.  "
+				     "Disabling 'filter_clients'");
+				sock->filter_clients = false;
+			}
+#else
+			WARN("Setting 'filter_clients' is not supported on this system.  Disabling 'filter_clients'");
+			sock->filter_clients = false;
+#endif
+		}
+
 #ifdef WITH_TCP
 		if ((sock->limit.idle_timeout > 0) && (sock->limit.idle_timeout < 5)) {
 			WARN("Setting idle_timeout to 5");
@@ -1430,6 +1828,25 @@ int common_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 #endif
 	}
 
+#ifdef WITH_ACCOUNTING
+	subcs = cf_section_sub_find(cs, "journal");
+	if (subcs) {
+		if ((this->type != RAD_LISTEN_ACCT) || (sock->proto != IPPROTO_UDP)) {
+			cf_log_err_cs(subcs, "A 'journal' can only be used with UDP accounting sockets");
+			return -1;
+		}
+
+		rcode = cf_section_parse(subcs, sock, journal_config);
+		if (rcode < 0) return -1;
+
+		sock->journal = exfile_init(sock, 1, 30, true);
+		if (!sock->journal) {
+			cf_log_err_cs(subcs, "Failed creating journal");
+			return -1;
+		}
+	}
+#endif
+
 	sock->my_ipaddr = ipaddr;
 	sock->my_port = listen_port;
 	sock->recv_buff = recv_buff;
@@ -1625,10 +2042,38 @@ int common_socket_open(CONF_SECTION *cs, rad_listen_t *this)
 	return 0;
 }
 
+/*
+ *	Send a reply.  While a "synchronous" socket is processing the
+ *	packets it has just read, the replies are queued, and then all
+ *	sent with one sendmmsg() when it has finished.
+ */
+static int socket_send_reply(rad_listen_t *listener, REQUEST *request)
+{
+#ifdef HAVE_SENDMMSG
+	listen_socket_t *sock = listener->data;
+
+	if (sock->batching && (request->reply->sockfd == listener->fd)) {
+		int rcode;
+		RADIUS_PACKET *reply = request->reply;
+
+		rcode = fr_radius_send_prepare(reply, request->packet, request->client->secret);
+		if (rcode <= 0) return rcode;
+
+		return udp_send_batch_add(reply->sockfd, sock->send_pending, reply->data, reply->data_len,
+					  &reply->src_ipaddr, reply->src_port, reply->if_index,
+					  &reply->dst_ipaddr, reply->dst_port);
+	}
+#else
+	UNUSED_VAR(listener);
+#endif
+
+	return fr_radius_send(request->reply, request->packet, request->client->secret);
+}
+
 /*
  *	Send an authentication response packet
  */
-static int auth_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *request)
+static int auth_socket_send(rad_listen_t *listener, REQUEST *request)
 {
 	rad_assert(request->listener == listener);
 	rad_assert(listener->send == auth_socket_send);
@@ -1647,8 +2092,7 @@ static int auth_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *reque
 	}
 #endif
 
-	if (fr_radius_send(request->reply, request->packet,
-			   request->client->secret) < 0) {
+	if (socket_send_reply(listener, request) < 0) {
 		RERROR("Failed sending reply: %s",
 			       fr_strerror());
 		return -1;
@@ -1662,7 +2106,7 @@ static int auth_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *reque
 /*
  *	Send an accounting response packet (or not)
  */
-static int acct_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *request)
+static int acct_socket_send(rad_listen_t *listener, REQUEST *request)
 {
 	rad_assert(request->listener == listener);
 	rad_assert(listener->send == acct_socket_send);
@@ -1687,8 +2131,7 @@ static int acct_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *reque
 	}
 #  endif
 
-	if (fr_radius_send(request->reply, request->packet,
-			   request->client->secret) < 0) {
+	if (socket_send_reply(listener, request) < 0) {
 		RERROR("Failed sending reply: %s",
 			       fr_strerror());
 		return -1;
@@ -1720,6 +2163,454 @@ static int proxy_socket_send(NDEBUG_UNUSED rad_listen_t *listener, REQUEST *requ
 }
 #endif
 
+/*
+ *	Helpers so that the receive functions can read packets either
+ *	directly from the socket, or from a batch which has already
+ *	been read with recvmmsg().
+ */
+static ssize_t socket_recv_header(rad_listen_t *listener, udp_batch_entry_t *entry,
+				  fr_ipaddr_t *src_ipaddr, uint16_t *src_port, unsigned int *code)
+{
+	if (!entry) return fr_radius_recv_header(listener->fd, src_ipaddr, src_port, code);
+
+	*src_ipaddr = entry->src_ipaddr;
+	*src_port = entry->src_port;
+
+	return fr_radius_recv_header_data(entry->data, entry->data_len, src_ipaddr, code);
+}
+
+static void socket_recv_discard(rad_listen_t *listener, udp_batch_entry_t *entry)
+{
+	/*
+	 *	Packets in a batch have already been read.
+	 */
+	if (!entry) udp_recv_discard(listener->fd);
+}
+
+static RADIUS_PACKET *socket_recv_packet(TALLOC_CTX *ctx, rad_listen_t *listener, udp_batch_entry_t *entry,
+					 size_t packet_len, int flags)
+{
+	RADIUS_PACKET *packet;
+
+	if (!entry) return fr_radius_recv(ctx, listener->fd, flags);
+
+	packet = fr_radius_recv_data(ctx, listener->fd, entry->data, entry->data_len, packet_len,
+				     &entry->src_ipaddr, entry->src_port,
+				     &entry->dst_ipaddr, entry->dst_port,
+				     entry->if_index, &entry->timestamp, flags);
+	if (packet) packet->verified = entry->verified;
+
+	return packet;
+}
+
+typedef int (*socket_recv_one_t)(rad_listen_t *listener, udp_batch_entry_t *entry);
+
+#ifdef WITH_ACCOUNTING
+/*
+ *	An Accounting-Request which is waiting to be written to the
+ *	journal, and then acknowledged.
+ */
+typedef struct listen_journal_entry_t {
+	TALLOC_CTX		*ctx;
+	RADIUS_PACKET		*packet;
+	RADCLIENT		*client;
+	detail_binary_t		hdr;
+} listen_journal_entry_t;
+
+typedef struct listen_journal_t {
+	int			num;
+	int			max;
+	listen_journal_entry_t	*entries;
+} listen_journal_t;
+
+/*
+ *	Records written by each call to writev().
+ */
+#define JOURNAL_WRITEV_MAX	(256)
+
+static void acct_journal_ack(rad_listen_t *listener, listen_journal_entry_t *entry)
+{
+	RADIUS_PACKET	*reply;
+	RADCLIENT	*client = entry->client;
+#ifdef HAVE_SENDMMSG
+	listen_socket_t	*sock = listener->data;
+#endif
+
+	reply = fr_radius_alloc_reply(entry->ctx, entry->packet);
+	if (!reply) return;
+	reply->code = PW_CODE_ACCOUNTING_RESPONSE;
+
+#ifdef HAVE_SENDMMSG
+	if (sock->batching) {
+		if ((fr_radius_send_prepare(reply, entry->packet, client->secret) <= 0) ||
+		    (udp_send_batch_add(reply->sockfd, sock->send_pending, reply->data, reply->data_len,
+					&reply->src_ipaddr, reply->src_port, reply->if_index,
+					&reply->dst_ipaddr, reply->dst_port) < 0)) return;
+	} else
+#endif
+	if (fr_radius_send(reply, entry->packet, client->secret) < 0) {
+		ERROR("Failed sending Accounting-Response to client %s: %s", client->shortname, fr_strerror());
+		return;
+	}
+
+	FR_STATS_INC(acct, total_responses);
+}
+
+/*
+ *	Write the pending records to the journal, and sync it.  Then
+ *	acknowledge them.
+ *
+ *	If the journal can't be written, the packets are processed
+ *	as if there was no journal, so that nothing is lost.
+ */
+static void acct_journal_flush(rad_listen_t *listener, listen_journal_t *journal)
+{
+	int		i, j, fd;
+	bool		written = false;
+	off_t		start = -1;
+	struct iovec	vector[JOURNAL_WRITEV_MAX * 2];
+	listen_socket_t	*sock = listener->data;
+
+	if (!journal->num) return;
+
+	fd = exfile_open(sock->journal, sock->journal_file, sock->journal_perm, true);
+	if (fd < 0) {
+		ERROR("Failed opening journal %s: %s", sock->journal_file, fr_strerror());
+		goto process;
+	}
+
+	start = lseek(fd, 0, SEEK_END);
+
+	for (i = 0; i < journal->num; i += j) {
+		int n = 0;
+
+		for (j = 0; (j < JOURNAL_WRITEV_MAX) && ((i + j) < journal->num); j++) {
+			listen_journal_entry_t *entry = &journal->entries[i + j];
+
+			vector[n].iov_base = &entry->hdr;
+			vector[n++].iov_len = sizeof(entry->hdr);
+			vector[n].iov_base = entry->packet->data;
+			vector[n++].iov_len = entry->packet->data_len;
+		}
+
+		if (fr_writev(fd, vector, n, NULL) < 0) {
+			ERROR("Failed writing journal %s: %s", sock->journal_file, fr_syserror(errno));
+			goto close;
+		}
+	}
+
+	if (sock->journal_fsync && (fsync(fd) < 0)) {
+		ERROR("Failed syncing journal %s: %s", sock->journal_file, fr_syserror(errno));
+		goto close;
+	}
+
+	written = true;
+
+close:
+	/*
+	 *	Don't leave a partial record for the reader to trip
+	 *	over.  The packets will be processed below instead.
+	 */
+	if (!written && (start >= 0) && (ftruncate(fd, start) < 0)) {
+		ERROR("Failed truncating journal %s: %s", sock->journal_file, fr_syserror(errno));
+	}
+	exfile_close(sock->journal, fd);
+
+process:
+	for (i = 0; i < journal->num; i++) {
+		listen_journal_entry_t	*entry = &journal->entries[i];
+		RADCLIENT		*client = entry->client;
+
+		if (written) {
+			acct_journal_ack(listener, entry);
+			fr_radius_free(&entry->packet);
+			talloc_free(entry->ctx);
+			continue;
+		}
+
+		if (!request_receive(entry->ctx, listener, entry->packet, client, rad_accounting)) {
+			FR_STATS_INC(acct, total_packets_dropped);
+			fr_radius_free(&entry->packet);
+			talloc_free(entry->ctx);
+		}
+	}
+
+	journal->num = 0;
+}
+
+/*
+ *	Add an Accounting-Request to the journal.  It's written with
+ *	the rest of the batch, or now if we're not reading batches.
+ *
+ *	The record is the packet as it was received, so it's not
+ *	decoded here, only checked.
+ */
+static int acct_journal_add(rad_listen_t *listener, udp_batch_entry_t *batch, TALLOC_CTX *ctx,
+			    RADIUS_PACKET *packet, RADCLIENT *client)
+{
+	listen_socket_t		*sock = listener->data;
+	listen_journal_t	one, *journal = &one;
+	listen_journal_entry_t	single, *entry;
+	uint32_t		timestamp = packet->timestamp.tv_sec;
+
+	if (fr_radius_verify(packet, NULL, client->secret) < 0) {
+		if (DEBUG_ENABLED) ERROR("Receive - %s", fr_strerror());
+		FR_STATS_INC(acct, total_bad_authenticators);
+		fr_radius_free(&packet);
+		talloc_free(ctx);
+		return 0;
+	}
+
+	/*
+	 *	Checking it zeroed the Request Authenticator, and the
+	 *	reader needs it to decode any encrypted attributes.
+	 */
+	memcpy(packet->data + 4, packet->vector, AUTH_VECTOR_LEN);
+
+	if (batch) {
+		if (!sock->journal_pending) {
+			sock->journal_pending = talloc_zero(sock, listen_journal_t);
+			if (sock->journal_pending) {
+				sock->journal_pending->max = listener->recv_batch;
+				sock->journal_pending->entries = talloc_array(sock->journal_pending,
+									      listen_journal_entry_t,
+									      listener->recv_batch);
+				if (!sock->journal_pending->entries) TALLOC_FREE(sock->journal_pending);
+			}
+		}
+		if (sock->journal_pending) journal = sock->journal_pending;
+	}
+
+	if (journal == &one) {
+		one.num = 0;
+		one.max = 1;
+		one.entries = &single;
+	}
+
+	rad_assert(journal->num < journal->max);
+	entry = &journal->entries[journal->num++];
+
+	entry->ctx = ctx;
+	entry->packet = packet;
+	entry->client = client;
+
+	memset(&entry->hdr, 0, sizeof(entry->hdr));
+	memcpy(entry->hdr.magic, DETAIL_JOURNAL_MAGIC, sizeof(entry->hdr.magic));
+	entry->hdr.length[0] = packet->data_len >> 8;
+	entry->hdr.length[1] = packet->data_len & 0xff;
+	entry->hdr.timestamp[0] = timestamp >> 24;
+	entry->hdr.timestamp[1] = timestamp >> 16;
+	entry->hdr.timestamp[2] = timestamp >> 8;
+	entry->hdr.timestamp[3] = timestamp;
+
+	switch (packet->src_ipaddr.af) {
+	case AF_INET:
+		entry->hdr.af = 4;
+		memcpy(entry->hdr.src_ipaddr, &packet->src_ipaddr.ipaddr.ip4addr,
+		       sizeof(packet->src_ipaddr.ipaddr.ip4addr));
+		memcpy(entry->hdr.dst_ipaddr, &packet->dst_ipaddr.ipaddr.ip4addr,
+		       sizeof(packet->dst_ipaddr.ipaddr.ip4addr));
+		break;
+
+	case AF_INET6:
+		entry->hdr.af = 6;
+		memcpy(entry->hdr.src_ipaddr, &packet->src_ipaddr.ipaddr.ip6addr,
+		       sizeof(packet->src_ipaddr.ipaddr.ip6addr));
+		memcpy(entry->hdr.dst_ipaddr, &packet->dst_ipaddr.ipaddr.ip6addr,
+		       sizeof(packet->dst_ipaddr.ipaddr.ip6addr));
+		break;
+
+	default:
+		break;
+	}
+	entry->hdr.src_port[0] = packet->src_port >> 8;
+	entry->hdr.src_port[1] = packet->src_port & 0xff;
+	entry->hdr.dst_port[0] = packet->dst_port >> 8;
+	entry->hdr.dst_port[1] = packet->dst_port & 0xff;
+
+	if (journal == &one) acct_journal_flush(listener, journal);
+
+	return 1;
+}
+#endif
+
+#ifdef HAVE_RECVMMSG
+#ifdef WITH_ACCOUNTING
+/*
+ *	Room for a packet, and the secret appended to it.
+ */
+#define VERIFY_BUF_LEN	(MAX_RADIUS_LEN + 256)
+
+/*
+ *	Check the Request Authenticators of a batch of Accounting-Requests
+ *	with fr_md5_calc_multi(), instead of one at a time when each request
+ *	is decoded.  Packets which pass are marked with the secret they
+ *	were checked with.  Packets which fail, or which can't be checked
+ *	here, are left alone, and fr_radius_verify() checks (and complains
+ *	about) them as usual.
+ */
+static void acct_socket_verify_batch(rad_listen_t *listener, udp_batch_entry_t *entries, int num)
+{
+	int			i, j, n = 0;
+	listen_socket_t		*sock = listener->data;
+	uint8_t			digest[FR_MD5_LANES][MD5_DIGEST_LENGTH];
+	uint8_t			*out[FR_MD5_LANES];
+	uint8_t const		*in[FR_MD5_LANES];
+	size_t			inlen[FR_MD5_LANES];
+	udp_batch_entry_t	*todo[FR_MD5_LANES];
+	char const		*secret[FR_MD5_LANES];
+
+	if (!sock->verify_buf) {
+		sock->verify_buf = talloc_array(sock, uint8_t, FR_MD5_LANES * VERIFY_BUF_LEN);
+		if (!sock->verify_buf) return;
+	}
+
+	for (i = 0; i <= num; i++) {
+		if (i < num) {
+			udp_batch_entry_t	*entry = &entries[i];
+			RADCLIENT		*client;
+			size_t			len, secret_len;
+			uint8_t			*p;
+
+			if ((entry->data_len < RADIUS_HDR_LEN) ||
+			    (entry->data[0] != PW_CODE_ACCOUNTING_REQUEST)) continue;
+
+			len = (entry->data[2] << 8) | entry->data[3];
+			if ((len < RADIUS_HDR_LEN) || (len > entry->data_len)) continue;
+
+			client = client_find(sock->clients, &entry->src_ipaddr, sock->proto);
+			if (!client) continue;
+#ifdef WITH_DYNAMIC_CLIENTS
+			/*
+			 *	client_listener_find() may replace
+			 *	these, so we don't know the secret yet.
+			 */
+			if (client->dynamic || client->client_server) continue;
+#endif
+			secret_len = strlen(client->secret);
+			if ((len + secret_len) > VERIFY_BUF_LEN) continue;
+
+			p = sock->verify_buf + (n * VERIFY_BUF_LEN);
+			memcpy(p, entry->data, len);
+			memset(p + 4, 0, AUTH_VECTOR_LEN);
+			memcpy(p + len, client->secret, secret_len);
+
+			in[n] = p;
+			inlen[n] = len + secret_len;
+			out[n] = digest[n];
+			todo[n] = entry;
+			secret[n] = client->secret;
+
+			if (++n < FR_MD5_LANES) continue;
+		}
+
+		if (n == 0) continue;
+
+		fr_md5_calc_multi(out, in, inlen, n);
+
+		for (j = 0; j < n; j++) {
+			if (fr_radius_digest_cmp(digest[j], todo[j]->data + 4, AUTH_VECTOR_LEN) == 0) {
+				todo[j]->verified = secret[j];
+			}
+		}
+		n = 0;
+	}
+}
+#endif
+
+/*
+ *	Read as many packets as are available (up to recv_batch)
+ *	with one system call, and then process each one in turn.
+ */
+static int socket_recv_batch(rad_listen_t *listener, socket_recv_one_t recv_one)
+{
+	int			i, num, rcode = 0;
+	listen_socket_t		*sock = listener->data;
+	udp_batch_entry_t	*entries;
+
+	/*
+	 *	Allocated here, and not when the socket is opened, so
+	 *	that each "workers" clone gets its own buffers.
+	 */
+	if (!sock->batch) {
+		sock->batch = udp_batch_alloc(listener, listener->recv_batch, MAX_RADIUS_LEN);
+		if (!sock->batch) {
+			ERROR("Failed allocating buffers for 'recv_batch'.  Reading one packet at a time");
+			listener->recv_batch = 0;
+			return recv_one(listener, NULL);
+		}
+	}
+
+	num = udp_batch_recv(listener->fd, sock->batch, &entries);
+	if (num <= 0) return 0;
+
+#ifdef WITH_ACCOUNTING
+	if ((listener->type == RAD_LISTEN_ACCT) && (num > 1)) acct_socket_verify_batch(listener, entries, num);
+#endif
+
+	for (i = 0; i < num; i++) {
+		rcode += recv_one(listener, &entries[i]);
+	}
+
+#ifdef WITH_ACCOUNTING
+	/*
+	 *	Before any replies are sent.
+	 */
+	if (sock->journal_pending) acct_journal_flush(listener, sock->journal_pending);
+#endif
+
+	return rcode;
+}
+#endif
+
+/*
+ *	Read one packet, or a batch of packets, and process them.
+ */
+static int socket_recv(rad_listen_t *listener, socket_recv_one_t recv_one)
+{
+	int		rcode;
+#ifdef HAVE_SENDMMSG
+	listen_socket_t	*sock = listener->data;
+
+	/*
+	 *	This is only done for "synchronous" sockets, so the
+	 *	replies are all sent by this thread, before we return.
+	 */
+	if (listener->send_batch) {
+		if (!sock->send_pending) {
+			sock->send_pending = udp_send_batch_alloc(listener, listener->send_batch, MAX_RADIUS_LEN);
+			if (!sock->send_pending) {
+				ERROR("Failed allocating buffers for 'send_batch'.  Sending one reply at a time");
+				listener->send_batch = 0;
+			}
+		}
+		sock->batching = (sock->send_pending != NULL);
+	}
+#endif
+
+#ifdef HAVE_RECVMMSG
+	if (listener->recv_batch) {
+		rcode = socket_recv_batch(listener, recv_one);
+	} else
+#endif
+	{
+		rcode = recv_one(listener, NULL);
+	}
+
+#ifdef HAVE_SENDMMSG
+	if (sock->batching) {
+		sock->batching = false;
+
+		if (udp_send_batch_pending(sock->send_pending) &&
+		    (udp_send_batch_flush(sock->send_pending) < 0)) {
+			ERROR("Failed sending replies: %s", fr_strerror());
+		}
+	}
+#endif
+
+	return rcode;
+}
+
 #ifdef WITH_STATS
 /*
  *	Check if an incoming request is "ok"
@@ -1741,53 +2632,250 @@ static int stats_socket_recv(rad_listen_t *listener)
 
 	FR_STATS_INC(auth, total_requests);
 
-	if (rcode < 20) {	/* RADIUS_HDR_LEN */
-		if (DEBUG_ENABLED) ERROR("Receive - %s", fr_strerror());
-		FR_STATS_INC(auth, total_malformed_requests);
-		return 0;
-	}
+	if (rcode < 20) {	/* RADIUS_HDR_LEN */
+		if (DEBUG_ENABLED) ERROR("Receive - %s", fr_strerror());
+		FR_STATS_INC(auth, total_malformed_requests);
+		return 0;
+	}
+
+	client = client_listener_find(listener, &src_ipaddr, src_port);
+	if (!client) {
+		udp_recv_discard(listener->fd);
+		FR_STATS_INC(auth, total_invalid_requests);
+		return 0;
+	}
+
+	FR_STATS_TYPE_INC(client->auth.total_requests);
+
+	/*
+	 *	We only understand Status-Server on this socket.
+	 */
+	if (code != PW_CODE_STATUS_SERVER) {
+		DEBUG("Ignoring packet code %d sent to Status-Server port",
+		      code);
+		udp_recv_discard(listener->fd);
+		FR_STATS_INC(auth, total_unknown_types);
+		return 0;
+	}
+
+	/*
+	 *	Now that we've sanity checked everything, receive the
+	 *	packet.
+	 */
+	packet = fr_radius_recv(NULL, listener->fd, 1); /* require message authenticator */
+	if (!packet) {
+		FR_STATS_INC(auth, total_malformed_requests);
+		if (DEBUG_ENABLED) ERROR("Receive - %s", fr_strerror());
+		return 0;
+	}
+
+	if (!request_receive(NULL, listener, packet, client, rad_status_server)) {
+		FR_STATS_INC(auth, total_packets_dropped);
+		fr_radius_free(&packet);
+		return 0;
+	}
+
+	return 1;
+}
+#endif
+
+/*
+ *	talloc doesn't say how much of a pool has been used, so we
+ *	estimate it from the number of chunks.  This is roughly the
+ *	size of a talloc chunk header on 64bit systems.
+ */
+#define REQUEST_POOL_CHUNK_OVERHEAD	(96)
+
+/*
+ *	Don't let one huge request make every request allocate
+ *	a huge pool.
+ */
+#define REQUEST_POOL_SIZE_MAX		(64 * 1024)
+
+/*
+ *	Walking the request to find out how much memory it
+ *	used isn't free, so only do it for one request in this many.
+ */
+#define REQUEST_POOL_SAMPLE		(16)
+
+/*
+ *	How many empty pools each thread keeps for re-use.
+ */
+#define REQUEST_POOL_CACHE		(4)
+
+/** Empty request pools, kept for re-use by the thread which freed them
+ *
+ */
+typedef struct listen_pool_cache_t {
+	uint32_t	num;				//!< Number of pools in the cache.
+	TALLOC_CTX	*pool[REQUEST_POOL_CACHE];	//!< Empty pools.
+	uint32_t	size[REQUEST_POOL_CACHE];	//!< Size each pool was allocated with.
+} listen_pool_cache_t;
+
+fr_thread_local_setup(listen_pool_cache_t *, listen_pool_cache)	/* macro */
+
+/*
+ *	Free the pool cache when the thread exits.
+ */
+static void _listen_pool_cache_free(void *arg)
+{
+	listen_pool_cache_t *cache = arg;
+
+	while (cache->num > 0) talloc_free(cache->pool[--cache->num]);
+	free(cache);
+}
+
+/** Get the pool cache for this thread, allocating it if necessary
+ *
+ */
+static listen_pool_cache_t *listen_pool_cache_get(void)
+{
+	listen_pool_cache_t *cache;
+
+	cache = fr_thread_local_init(listen_pool_cache, _listen_pool_cache_free);
+	if (!cache) {
+		/*
+		 *	malloc is thread safe, talloc is not
+		 */
+		cache = calloc(1, sizeof(*cache));
+		if (!cache) return NULL;
+
+		if (fr_thread_local_set(listen_pool_cache, cache) != 0) {
+			free(cache);
+			return NULL;
+		}
+	}
+
+	return cache;
+}
+
+/** Allocate a talloc pool to hold a new request
+ *
+ * The pool is sized from the high-water mark of requests received on the
+ * listener, so that the request, its packets, and their attributes are
+ * (usually) all carved out of one block of memory, and freeing the request
+ * is one call to free().
+ *
+ * For synchronous listeners, the request is allocated and freed by the same
+ * thread, so pools are re-used from the thread's cache where possible.
+ *
+ * @param[in] listener the request will be received on.  May be NULL.
+ * @return
+ *	- A new talloc pool.
+ *	- NULL on error.
+ */
+TALLOC_CTX *listen_pool_alloc(rad_listen_t const *listener)
+{
+	uint32_t size = main_config.talloc_pool_size;
+
+	if (listener && (listener->pool_size > size)) size = listener->pool_size;
+
+	if (listener && listener->synchronous) {
+		listen_pool_cache_t *cache;
+
+		cache = listen_pool_cache_get();
+		while (cache && (cache->num > 0)) {
+			cache->num--;
+			if (cache->size[cache->num] >= size) return cache->pool[cache->num];
+
+			/*
+			 *	The high-water mark has gone up since
+			 *	this pool was allocated.
+			 */
+			talloc_free(cache->pool[cache->num]);
+		}
+	}
+
+	return talloc_pool(NULL, size);
+}
+
+/** Update the high-water mark of the request's listener, before the request is freed
+ *
+ * @note The listener's pool size is updated without locking.  Losing an update
+ *	just means the pool grows a little later than it could have.
+ *
+ * @param[in] request which is about to be freed.
+ * @param[in] pool the request was allocated from.
+ */
+static void listen_pool_update(REQUEST const *request, TALLOC_CTX const *pool)
+{
+	rad_listen_t	*listener = request->listener;
+	size_t		used, max;
+
+	if (!listener || ((request->number % REQUEST_POOL_SAMPLE) != 0)) return;
+
+	used = talloc_total_size(pool) + (talloc_total_blocks(pool) * REQUEST_POOL_CHUNK_OVERHEAD);
+	if (used <= listener->pool_size) return;
+
+	max = REQUEST_POOL_SIZE_MAX;
+	if (main_config.talloc_pool_size > max) max = main_config.talloc_pool_size;
+
+	used = (used + 1023) & ~((size_t) 1023);
+	if (used > max) used = max;
 
-	client = client_listener_find(listener, &src_ipaddr, src_port);
-	if (!client) {
-		udp_recv_discard(listener->fd);
-		FR_STATS_INC(auth, total_invalid_requests);
-		return 0;
-	}
+	listener->pool_size = used;
+}
 
-	FR_STATS_TYPE_INC(client->auth.total_requests);
+/** Free a request which was allocated from a pool returned by #listen_pool_alloc
+ *
+ * For synchronous listeners the request is freed, and the now empty (and still
+ * warm) pool is put into the thread's cache for the next request.  Otherwise
+ * the request and pool are freed together.
+ *
+ * @param[in] request to free.
+ * @param[in] pool the request was allocated from.
+ */
+void listen_pool_free(REQUEST *request, TALLOC_CTX *pool)
+{
+	rad_listen_t		*listener = request->listener;
+	listen_pool_cache_t	*cache;
+	uint32_t		size;
 
 	/*
-	 *	We only understand Status-Server on this socket.
+	 *	The pool was allocated at the listener's pool size,
+	 *	which is only changed below.  So this is (almost
+	 *	always) the size of the pool.
 	 */
-	if (code != PW_CODE_STATUS_SERVER) {
-		DEBUG("Ignoring packet code %d sent to Status-Server port",
-		      code);
-		udp_recv_discard(listener->fd);
-		FR_STATS_INC(auth, total_unknown_types);
-		return 0;
-	}
+	size = main_config.talloc_pool_size;
+	if (listener && (listener->pool_size > size)) size = listener->pool_size;
 
-	/*
-	 *	Now that we've sanity checked everything, receive the
-	 *	packet.
-	 */
-	packet = fr_radius_recv(NULL, listener->fd, 1); /* require message authenticator */
-	if (!packet) {
-		FR_STATS_INC(auth, total_malformed_requests);
-		if (DEBUG_ENABLED) ERROR("Receive - %s", fr_strerror());
-		return 0;
-	}
+	listen_pool_update(request, pool);
 
-	if (!request_receive(NULL, listener, packet, client, rad_status_server)) {
-		FR_STATS_INC(auth, total_packets_dropped);
-		fr_radius_free(&packet);
-		return 0;
+	if (!listener || !listener->synchronous) {
+	free_pool:
+		talloc_free(pool);
+		return;
 	}
 
-	return 1;
+	cache = listen_pool_cache_get();
+	if (!cache || (cache->num >= REQUEST_POOL_CACHE)) goto free_pool;
+
+	talloc_free_children(pool);
+	if (talloc_total_blocks(pool) != 1) goto free_pool;	/* something refused to be freed */
+
+	cache->pool[cache->num] = pool;
+	cache->size[cache->num] = size;
+	cache->num++;
 }
-#endif
 
+/*
+ *	Check the client's and the socket's max_pps.  This is done
+ *	before the packet is read, so that packets we throw away don't
+ *	cost us a decode, and an MD5 of the packet.
+ */
+static bool socket_recv_rate_ok(rad_listen_t *listener, RADCLIENT *client)
+{
+	listen_socket_t *sock = listener->data;
+	struct timeval now;
+
+	if (!client->pps_limit.rate && !sock->pps_limit.rate) return true;
+
+	gettimeofday(&now, NULL);
+
+	if (!rad_token_bucket_take(&client->pps_limit, &now)) return false;
+
+	return rad_token_bucket_take(&sock->pps_limit, &now);
+}
 
 /*
  *	Check if an incoming request is "ok"
@@ -1795,7 +2883,7 @@ static int stats_socket_recv(rad_listen_t *listener)
  *	It takes packets, not requests.  It sees if the packet looks
  *	OK.  If so, it does a number of sanity checks on it.
   */
-static int auth_socket_recv(rad_listen_t *listener)
+static int auth_socket_recv_one(rad_listen_t *listener, udp_batch_entry_t *entry)
 {
 	ssize_t		rcode;
 	unsigned int	code;
@@ -1806,7 +2894,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 	fr_ipaddr_t	src_ipaddr;
 	TALLOC_CTX	*ctx;
 
-	rcode = fr_radius_recv_header(listener->fd, &src_ipaddr, &src_port, &code);
+	rcode = socket_recv_header(listener, entry, &src_ipaddr, &src_port, &code);
 	if (rcode < 0) return 0;
 
 	FR_STATS_INC(auth, total_requests);
@@ -1819,7 +2907,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 
 	client = client_listener_find(listener, &src_ipaddr, src_port);
 	if (!client) {
-		udp_recv_discard(listener->fd);
+		socket_recv_discard(listener, entry);
 		FR_STATS_INC(auth, total_invalid_requests);
 		return 0;
 	}
@@ -1836,7 +2924,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 
 	case PW_CODE_STATUS_SERVER:
 		if (!main_config.status_server) {
-			udp_recv_discard(listener->fd);
+			socket_recv_discard(listener, entry);
 			FR_STATS_INC(auth, total_unknown_types);
 			WARN("Ignoring Status-Server request due to security configuration");
 			return 0;
@@ -1845,7 +2933,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 		break;
 
 	default:
-		udp_recv_discard(listener->fd);
+		socket_recv_discard(listener, entry);
 		FR_STATS_INC(auth, total_unknown_types);
 
 		if (DEBUG_ENABLED) ERROR("Receive - Invalid packet code %d sent to authentication port from "
@@ -1853,9 +2941,19 @@ static int auth_socket_recv(rad_listen_t *listener)
 		return 0;
 	} /* switch over packet types */
 
-	ctx = talloc_pool(NULL, main_config.talloc_pool_size);
+	/*
+	 *	Status-Server is never rate limited, so that the
+	 *	client can see we're alive.
+	 */
+	if ((code != PW_CODE_STATUS_SERVER) && !socket_recv_rate_ok(listener, client)) {
+		socket_recv_discard(listener, entry);
+		FR_STATS_INC(auth, total_rate_limited);
+		return 0;
+	}
+
+	ctx = listen_pool_alloc(listener);
 	if (!ctx) {
-		udp_recv_discard(listener->fd);
+		socket_recv_discard(listener, entry);
 		FR_STATS_INC(auth, total_packets_dropped);
 		return 0;
 	}
@@ -1865,7 +2963,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 	 *	Now that we've sanity checked everything, receive the
 	 *	packet.
 	 */
-	packet = fr_radius_recv(ctx, listener->fd, client->message_authenticator);
+	packet = socket_recv_packet(ctx, listener, entry, rcode, client->message_authenticator);
 	if (!packet) {
 		FR_STATS_INC(auth, total_malformed_requests);
 		if (DEBUG_ENABLED) ERROR("Receive - %s", fr_strerror());
@@ -1904,12 +3002,17 @@ static int auth_socket_recv(rad_listen_t *listener)
 	return 1;
 }
 
+static int auth_socket_recv(rad_listen_t *listener)
+{
+	return socket_recv(listener, auth_socket_recv_one);
+}
+
 
 #ifdef WITH_ACCOUNTING
 /*
  *	Receive packets from an accounting socket
  */
-static int acct_socket_recv(rad_listen_t *listener)
+static int acct_socket_recv_one(rad_listen_t *listener, udp_batch_entry_t *entry)
 {
 	ssize_t		rcode;
 	unsigned int	code;
@@ -1920,7 +3023,7 @@ static int acct_socket_recv(rad_listen_t *listener)
 	fr_ipaddr_t	src_ipaddr;
 	TALLOC_CTX	*ctx;
 
-	rcode = fr_radius_recv_header(listener->fd, &src_ipaddr, &src_port, &code);
+	rcode = socket_recv_header(listener, entry, &src_ipaddr, &src_port, &code);
 	if (rcode < 0) return 0;
 
 	FR_STATS_INC(acct, total_requests);
@@ -1933,7 +3036,7 @@ static int acct_socket_recv(rad_listen_t *listener)
 
 	if ((client = client_listener_find(listener,
 					   &src_ipaddr, src_port)) == NULL) {
-		udp_recv_discard(listener->fd);
+		socket_recv_discard(listener, entry);
 		FR_STATS_INC(acct, total_invalid_requests);
 		return 0;
 	}
@@ -1950,7 +3053,7 @@ static int acct_socket_recv(rad_listen_t *listener)
 
 	case PW_CODE_STATUS_SERVER:
 		if (!main_config.status_server) {
-			udp_recv_discard(listener->fd);
+			socket_recv_discard(listener, entry);
 			FR_STATS_INC(acct, total_unknown_types);
 
 			WARN("Ignoring Status-Server request due to security configuration");
@@ -1960,7 +3063,7 @@ static int acct_socket_recv(rad_listen_t *listener)
 		break;
 
 	default:
-		udp_recv_discard(listener->fd);
+		socket_recv_discard(listener, entry);
 		FR_STATS_INC(acct, total_unknown_types);
 
 		DEBUG("Invalid packet code %d sent to a accounting port from client %s port %d : IGNORED",
@@ -1968,9 +3071,15 @@ static int acct_socket_recv(rad_listen_t *listener)
 		return 0;
 	} /* switch over packet types */
 
-	ctx = talloc_pool(NULL, main_config.talloc_pool_size);
+	if ((code != PW_CODE_STATUS_SERVER) && !socket_recv_rate_ok(listener, client)) {
+		socket_recv_discard(listener, entry);
+		FR_STATS_INC(acct, total_rate_limited);
+		return 0;
+	}
+
+	ctx = listen_pool_alloc(listener);
 	if (!ctx) {
-		udp_recv_discard(listener->fd);
+		socket_recv_discard(listener, entry);
 		FR_STATS_INC(acct, total_packets_dropped);
 		return 0;
 	}
@@ -1980,7 +3089,7 @@ static int acct_socket_recv(rad_listen_t *listener)
 	 *	Now that we've sanity checked everything, receive the
 	 *	packet.
 	 */
-	packet = fr_radius_recv(ctx, listener->fd, 0);
+	packet = socket_recv_packet(ctx, listener, entry, rcode, 0);
 	if (!packet) {
 		FR_STATS_INC(acct, total_malformed_requests);
 		if (DEBUG_ENABLED) ERROR("Receive - %s", fr_strerror());
@@ -1988,6 +3097,17 @@ static int acct_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
+	/*
+	 *	Acknowledge it once it's in the journal, and let the
+	 *	detail listener process it later.  Dynamic clients
+	 *	have to be defined first, which is done by processing
+	 *	the packet.
+	 */
+	if (((listen_socket_t *) listener->data)->journal && (code == PW_CODE_ACCOUNTING_REQUEST) &&
+	    !client->client_server) {
+		return acct_journal_add(listener, entry, ctx, packet, client);
+	}
+
 	/*
 	 *	There can be no duplicate accounting packets.
 	 */
@@ -2000,6 +3120,11 @@ static int acct_socket_recv(rad_listen_t *listener)
 
 	return 1;
 }
+
+static int acct_socket_recv(rad_listen_t *listener)
+{
+	return socket_recv(listener, acct_socket_recv_one);
+}
 #endif
 
 
@@ -2195,7 +3320,7 @@ int rad_coa_recv(REQUEST *request)
  *	It takes packets, not requests.  It sees if the packet looks
  *	OK.  If so, it does a number of sanity checks on it.
   */
-static int coa_socket_recv(rad_listen_t *listener)
+static int coa_socket_recv_one(rad_listen_t *listener, udp_batch_entry_t *entry)
 {
 	ssize_t		rcode;
 	unsigned int	code;
@@ -2206,7 +3331,7 @@ static int coa_socket_recv(rad_listen_t *listener)
 	fr_ipaddr_t	src_ipaddr;
 	TALLOC_CTX	*ctx;
 
-	rcode = fr_radius_recv_header(listener->fd, &src_ipaddr, &src_port, &code);
+	rcode = socket_recv_header(listener, entry, &src_ipaddr, &src_port, &code);
 	if (rcode < 0) return 0;
 
 	if (rcode < 20) {	/* RADIUS_HDR_LEN */
@@ -2217,7 +3342,7 @@ static int coa_socket_recv(rad_listen_t *listener)
 
 	if ((client = client_listener_find(listener,
 					   &src_ipaddr, src_port)) == NULL) {
-		udp_recv_discard(listener->fd);
+		socket_recv_discard(listener, entry);
 		FR_STATS_INC(coa, total_requests);
 		FR_STATS_INC(coa, total_invalid_requests);
 		return 0;
@@ -2238,16 +3363,16 @@ static int coa_socket_recv(rad_listen_t *listener)
 		break;
 
 	default:
-		udp_recv_discard(listener->fd);
+		socket_recv_discard(listener, entry);
 		FR_STATS_INC(coa, total_unknown_types);
 		DEBUG("Invalid packet code %d sent to coa port from client %s port %d : IGNORED",
 		      code, client->shortname, src_port);
 		return 0;
 	} /* switch over packet types */
 
-	ctx = talloc_pool(NULL, main_config.talloc_pool_size);
+	ctx = listen_pool_alloc(listener);
 	if (!ctx) {
-		udp_recv_discard(listener->fd);
+		socket_recv_discard(listener, entry);
 		FR_STATS_INC(coa, total_packets_dropped);
 		return 0;
 	}
@@ -2257,7 +3382,7 @@ static int coa_socket_recv(rad_listen_t *listener)
 	 *	Now that we've sanity checked everything, receive the
 	 *	packet.
 	 */
-	packet = fr_radius_recv(ctx, listener->fd, client->message_authenticator);
+	packet = socket_recv_packet(ctx, listener, entry, rcode, client->message_authenticator);
 	if (!packet) {
 		FR_STATS_INC(coa, total_malformed_requests);
 		if (DEBUG_ENABLED) ERROR("Receive - %s", fr_strerror());
@@ -2274,6 +3399,11 @@ static int coa_socket_recv(rad_listen_t *listener)
 
 	return 1;
 }
+
+static int coa_socket_recv(rad_listen_t *listener)
+{
+	return socket_recv(listener, coa_socket_recv_one);
+}
 #endif
 
 #ifdef WITH_PROXY
@@ -2322,7 +3452,7 @@ static int proxy_socket_recv(rad_listen_t *listener)
 		      fr_inet_ntoh(&packet->src_ipaddr, buffer, sizeof(buffer)),
 		      packet->src_port, packet->id);
 #  ifdef WITH_STATS
-		listener->stats.total_unknown_types++;
+		FR_STATS_TYPE_INC(listener->stats.total_unknown_types);
 #  endif
 		fr_radius_free(&packet);
 		return 0;
@@ -2335,7 +3465,7 @@ static int proxy_socket_recv(rad_listen_t *listener)
 
 	if (!request_proxy_reply(packet)) {
 #  ifdef WITH_STATS
-		listener->stats.total_packets_dropped++;
+		FR_STATS_TYPE_INC(listener->stats.total_packets_dropped);
 #  endif
 		fr_radius_free(&packet);
 		return 0;
@@ -2435,7 +3565,7 @@ static int client_socket_encode(UNUSED rad_listen_t *listener, REQUEST *request)
 }
 
 
-static int client_socket_decode(UNUSED rad_listen_t *listener, REQUEST *request)
+static int client_socket_decode(rad_listen_t *listener, REQUEST *request)
 {
 #ifdef WITH_TLS
 	listen_socket_t *sock;
@@ -2466,6 +3596,14 @@ static int client_socket_decode(UNUSED rad_listen_t *listener, REQUEST *request)
 	}
 #endif
 
+	request->packet->zero_copy = listener->zero_copy;
+
+	/*
+	 *	The core server looks at the attributes of other
+	 *	packets before running any policies.
+	 */
+	request->packet->lazy = listener->lazy_decode && (request->packet->code == PW_CODE_ACCOUNTING_REQUEST);
+
 	return fr_radius_decode(request->packet, NULL,
 				request->client->secret);
 }
@@ -2473,7 +3611,23 @@ static int client_socket_decode(UNUSED rad_listen_t *listener, REQUEST *request)
 #ifdef WITH_PROXY
 static int proxy_socket_encode(UNUSED rad_listen_t *listener, REQUEST *request)
 {
-	if (fr_radius_encode(request->proxy, NULL, request->home_server->secret) < 0) {
+	int rcode = 0;
+
+	/*
+	 *	Packets for "fake" requests weren't received, and
+	 *	have no data.
+	 */
+	if (request->home_server->verbatim && request->packet->data &&
+	    (request->proxy->code == request->packet->code)) {
+		rcode = fr_radius_encode_verbatim(request->proxy, request->packet, request->home_server->secret);
+		if (rcode < 0) {
+			RERROR("Failed encoding proxied packet: %s", fr_strerror());
+
+			return -1;
+		}
+	}
+
+	if ((rcode == 0) && (fr_radius_encode(request->proxy, NULL, request->home_server->secret) < 0)) {
 		RERROR("Failed encoding proxied packet: %s", fr_strerror());
 
 		return -1;
@@ -2501,6 +3655,7 @@ static int proxy_socket_decode(UNUSED rad_listen_t *listener, REQUEST *request)
 #endif
 
 #include "command.c"
+#include "metrics.c"
 
 #define NO_LISTENER { .name = "undefined", }
 
@@ -2656,6 +3811,26 @@ static fr_protocol_t master_listen[] = {
 	NO_LISTENER,
 #endif
 
+#if defined(WITH_METRICS_SOCKET) && defined(WITH_TCP)
+	/* Prometheus metrics over HTTP */
+	{
+		.magic = RLM_MODULE_INIT,
+		.name = "metrics",
+		.inst_size = sizeof(listen_socket_t),
+		.tls = false,
+		.parse = metrics_socket_parse,
+		.open = common_socket_open,
+		.recv = metrics_tcp_recv,
+		.send = metrics_tcp_send,
+		.print = common_socket_print,
+		.debug = common_packet_debug,
+		.encode = metrics_socket_encode,
+		.decode = metrics_socket_decode
+	},
+#else
+	NO_LISTENER,
+#endif
+
 	NO_LISTENER		/* bfd */
 };
 
@@ -2715,6 +3890,109 @@ static int init_pcap(rad_listen_t *this)
 /*
  *	Binds a listener to a socket.
  */
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_FILTER)
+/*
+ *	Filter packets in the kernel, so that floods from unknown, or
+ *	spoofed, addresses never wake up the server.  Each client is
+ *	matched on its prefix, so "client" networks used for dynamic
+ *	clients let their members through.
+ */
+typedef struct client_sources_t {
+	fr_ipaddr_t		*sources;
+	size_t			num;
+	size_t			max;
+} client_sources_t;
+
+static int filter_add_client(void *ctx, void *data)
+{
+	client_sources_t *cs = ctx;
+	RADCLIENT *client = data;
+
+	if (cs->num == cs->max) {
+		cs->max = cs->max ? (cs->max * 2) : 64;
+		cs->sources = talloc_realloc(NULL, cs->sources, fr_ipaddr_t, cs->max);
+		if (!cs->sources) return 1;
+	}
+	cs->sources[cs->num++] = client->ipaddr;
+
+	return 0;
+}
+
+/*
+ *	(Re)build the filter for a socket, and attach it.  Attaching
+ *	a new filter atomically replaces the old one.
+ */
+static int listen_filter_clients(rad_listen_t *this)
+{
+	listen_socket_t *sock = this->data;
+	client_sources_t cs;
+	int rcode;
+
+	if (!sock->filter_clients || (this->fd < 0)) return 0;
+
+	memset(&cs, 0, sizeof(cs));
+	if (client_list_walk(sock->clients, filter_add_client, &cs) != 0) {
+		ERROR("Failed building client filter for FD %d: Out of memory", this->fd);
+		talloc_free(cs.sources);
+		return -1;
+	}
+
+	rcode = fr_socket_filter_sources(this->fd, cs.sources, cs.num);
+	talloc_free(cs.sources);
+
+	if (rcode < 0) {
+		ERROR("Failed attaching client filter to FD %d: %s", this->fd, fr_strerror());
+		return -1;
+	}
+
+	/*
+	 *	Too many clients to fit.  Everything is let through,
+	 *	and left to client_listener_find().
+	 */
+	if (rcode > 0) {
+		WARN("Too many clients for 'filter_clients' on FD %d.  Not filtering packets", this->fd);
+		return 0;
+	}
+
+	DEBUG3("Attached client filter for %zu clients to FD %d", cs.num, this->fd);
+
+	return 0;
+}
+
+/** Rebuild the client filters of all sockets
+ *
+ * Called when clients are added at run time.
+ */
+void listen_filter_clients_update(void)
+{
+	rad_listen_t *this, *clone;
+
+	for (this = main_config.listen; this != NULL; this = this->next) {
+		if ((this->type != RAD_LISTEN_AUTH) && (this->type != RAD_LISTEN_ACCT)
+#  ifdef WITH_COA
+		    && (this->type != RAD_LISTEN_COA)
+#  endif
+			) continue;
+
+		(void) listen_filter_clients(this);
+
+		/*
+		 *	The other workers have their own sockets,
+		 *	which need the same filter.
+		 */
+		for (clone = this->clones; clone != NULL; clone = clone->next_clone) {
+			(void) listen_filter_clients(clone);
+		}
+	}
+}
+#else
+#  define listen_filter_clients(_x) (0)
+
+void listen_filter_clients_update(void)
+{
+}
+#endif
+
 static int listen_bind(rad_listen_t *this)
 {
 	int			rcode, port;
@@ -2756,6 +4034,12 @@ static int listen_bind(rad_listen_t *this)
 			break;
 #endif
 
+#ifdef WITH_METRICS_SOCKET
+		case RAD_LISTEN_METRICS:
+			sock->my_port = PW_METRICS_PORT;
+			break;
+#endif
+
 #ifdef WITH_COA
 		case RAD_LISTEN_COA:
 			port_name = "radius-dynauth";
@@ -2839,6 +4123,27 @@ static int listen_bind(rad_listen_t *this)
 	}
 	if (!sock->my_port) sock->my_port = port;
 
+#ifdef SO_REUSEPORT
+	/*
+	 *	Allow each worker to bind its own socket to the same
+	 *	address.  The kernel then shards incoming packets
+	 *	across the sockets by source IP / port, so duplicates
+	 *	always arrive at the same worker.  The same goes for
+	 *	each worker process, when there are several.
+	 */
+	if (this->reuse_port || (main_config.num_processes > 1)) {
+		int on = 1;
+
+		DEBUG4("[FD %i] Setting reuse_port -- setsockopt(%i, SOL_SOCKET, SO_REUSEPORT, 1)",
+		       this->fd, this->fd);
+		if (setsockopt(this->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+			close(this->fd);
+			ERROR("Failed setting SO_REUSEPORT: %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+#endif
+
 	/*
 	 *	Set the receive buffer size
 	 */
@@ -2888,6 +4193,15 @@ static int listen_bind(rad_listen_t *this)
 	}
 #endif
 
+	/*
+	 *	Drop packets from unknown clients, before we start
+	 *	reading any.
+	 */
+	if (sock->filter_clients && (listen_filter_clients(this) < 0)) {
+		close(this->fd);
+		return -1;
+	}
+
 	/*
 	 *	Mostly for proxy sockets.
 	 */
@@ -2915,6 +4229,9 @@ static int _listener_free(rad_listen_t *this)
 #ifdef WITH_COMMAND_SOCKET
 	    || ((this->type == RAD_LISTEN_COMMAND) &&
 		(((fr_command_socket_t *) this->data)->magic != COMMAND_SOCKET_MAGIC))
+#endif
+#ifdef WITH_METRICS_SOCKET
+	    || (this->type == RAD_LISTEN_METRICS)
 #endif
 		) {
 		listen_socket_t *sock = this->data;
@@ -2974,6 +4291,8 @@ static rad_listen_t *listen_alloc(TALLOC_CTX *ctx, RAD_LISTEN_TYPE type, fr_prot
 	this->debug = proto->debug;
 	this->encode = proto->encode;
 	this->decode = proto->decode;
+	this->decode_pending = proto->decode_pending;
+	this->numa_node = -1;
 
 	talloc_set_destructor(this, _listener_free);
 
@@ -3108,10 +4427,52 @@ rad_listen_t *proxy_new_listener(TALLOC_CTX *ctx, home_server_t *home, uint16_t
 
 	home->limit.num_connections++;
 
+#ifdef WITH_TCP
+	if (home->proto == IPPROTO_TCP) {
+		sock->active = true;
+		home->num_active++;
+	}
+#endif
+
 	return this;
 }
 #endif
 
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Find the thread pool which processes the requests from a
+ *	listener.  "thread_pool" in the listen section wins over one
+ *	in its virtual server.
+ */
+static int listen_thread_pool(rad_listen_t *this)
+{
+	CONF_PAIR	*cp;
+	CONF_SECTION	*server_cs;
+	char const	*name;
+
+	cp = cf_pair_find(this->cs, "thread_pool");
+	if (!cp && this->server) {
+		server_cs = cf_section_sub_find_name2(main_config.config, "server", this->server);
+		if (server_cs) cp = cf_pair_find(server_cs, "thread_pool");
+	}
+	if (!cp) return 0;
+
+	name = cf_pair_value(cp);
+	if (!name) {
+		cf_log_err_cp(cp, "No value given for thread_pool");
+		return -1;
+	}
+
+	this->thread_pool = thread_pool_find(name);
+	if (!this->thread_pool) {
+		cf_log_err_cp(cp, "No 'pool %s { ... }' in the 'thread pool' section", name);
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
 /*
  *	Parse the configuration for a listener.
  */
@@ -3153,6 +4514,13 @@ static rad_listen_t *listen_parse(listen_config_t *lc)
 		return NULL;
 	}
 
+#ifdef HAVE_PTHREAD_H
+	if (listen_thread_pool(this) < 0) {
+		listen_free(&this);
+		return NULL;
+	}
+#endif
+
 	cf_log_info(cs, "}");
 
 	return this;
@@ -3160,21 +4528,85 @@ static rad_listen_t *listen_parse(listen_config_t *lc)
 
 
 #ifdef HAVE_PTHREAD_H
+static void recv_thread_socket_handler(UNUSED fr_event_list_t *el, UNUSED int fd, void *ctx)
+{
+	rad_listen_t *this = talloc_get_type_abort(ctx, rad_listen_t);
+
+	this->recv(this);
+}
+
 /*
  *	A child thread which does NOTHING other than read and process
  *	packets.
+ *
+ *	Each thread owns its own event list, so it never touches the
+ *	main event loop, or the thread pool queue.  Packets are read,
+ *	processed, and replied to, all in this thread.
  */
 static void *recv_thread(void *arg)
 {
 	rad_listen_t *this = arg;
+	fr_event_list_t *el;
+
+	el = fr_event_list_create(NULL, NULL);
+	if (!el) {
+		ERROR("Failed creating event list for worker thread");
+		fr_exit(1);
+	}
 
-	while (1) {
-		this->recv(this);
-		DEBUG("%p", &this);
+	if (!fr_event_fd_insert(el, 0, this->fd, recv_thread_socket_handler, this)) {
+		ERROR("Failed adding socket to worker event list: %s", fr_strerror());
+		fr_exit(1);
 	}
 
+	(void) fr_event_loop(el);
+
+	talloc_free(el);
+
 	return NULL;
 }
+
+/*
+ *	Create a copy of a listener, with its own socket bound to the
+ *	same address.  This is used to give each worker thread its own
+ *	SO_REUSEPORT socket.
+ *
+ *	The copy is parented by the original listener, and is freed
+ *	when the original is freed.  It's added to the original's
+ *	list of clones.
+ */
+static rad_listen_t *listen_clone(rad_listen_t *this)
+{
+	rad_listen_t	*clone;
+	void		*data;
+
+	clone = listen_alloc(this, this->type, this->proto);
+	data = clone->data;
+
+	memcpy(clone, this, sizeof(*clone));
+	memcpy(data, this->data, this->proto->inst_size);
+
+	clone->data = data;
+	clone->next = NULL;
+	clone->clones = NULL;
+	clone->fd = -1;
+
+	if (listen_bind(clone) < 0) {
+		clone->fd = -1;	/* listen_bind() has closed it */
+		talloc_free(clone);
+		return NULL;
+	}
+
+	/*
+	 *	Clones aren't in the main list of listeners, so
+	 *	remember them here, for things which have to
+	 *	update every socket.
+	 */
+	clone->next_clone = this->clones;
+	this->clones = clone;
+
+	return clone;
+}
 #endif
 
 
@@ -3200,6 +4632,7 @@ int listen_init(rad_listen_t **head, bool spawn_workers)
 
 	for (lc = listen_config; lc != NULL; lc = lc->next) {
 		if (lc->type == RAD_LISTEN_COMMAND) continue;
+		if (lc->type == RAD_LISTEN_METRICS) continue;
 		if (lc->type == RAD_LISTEN_PROXY) continue;
 
 		incoming_sockets = true;
@@ -3230,6 +4663,15 @@ int listen_init(rad_listen_t **head, bool spawn_workers)
 	last = head;
 
 	for (lc = listen_config; lc != NULL; lc = lc->next) {
+		/*
+		 *	Only the first worker process runs the control
+		 *	and metrics sockets, and reads detail files.  The
+		 *	statistics they show are for all of the processes.
+		 */
+		if ((main_config.process_index > 0) &&
+		    ((lc->type == RAD_LISTEN_COMMAND) || (lc->type == RAD_LISTEN_METRICS) ||
+		     (lc->type == RAD_LISTEN_DETAIL))) continue;
+
 		if (lc->proto->open(lc->cs, lc->listener) < 0) {
 			TALLOC_FREE(listen_ctx);
 			return -1;
@@ -3268,11 +4710,41 @@ int listen_init(rad_listen_t **head, bool spawn_workers)
 
 			for (i = 0; i < this->workers; i++) {
 				pthread_t id;
+				pthread_attr_t attr;
+				rad_listen_t *worker = this;
+
+				/*
+				 *	The first worker uses the socket we've
+				 *	already opened.  The others get their
+				 *	own socket, bound to the same address.
+				 */
+				if ((i > 0) && this->reuse_port) {
+					worker = listen_clone(this);
+					if (!worker) {
+						ERROR("Failed opening socket for worker %d of %s", i, buffer);
+						fr_exit(1);
+					}
+				}
+
+				pthread_attr_init(&attr);
+#  ifdef WITH_THREAD_AFFINITY
+				/*
+				 *	Each worker gets its own CPU, so
+				 *	that its socket buffers and event
+				 *	list stay on one NUMA node.
+				 */
+				if ((this->cpu_affinity || (this->numa_node >= 0)) &&
+				    (thread_affinity_attr(&attr, this->cpu_affinity, this->numa_node, i) < 0)) {
+					ERROR("Failed binding worker %d of %s: %s", i, buffer, fr_strerror());
+					fr_exit(1);
+				}
+#  endif
 
 				/*
 				 *	FIXME: create detached?
 				 */
-				rcode = pthread_create(&id, 0, recv_thread, this);
+				rcode = pthread_create(&id, &attr, recv_thread, worker);
+				pthread_attr_destroy(&attr);
 				if (rcode != 0) {
 					ERROR("Thread create failed: %s", fr_syserror(rcode));
 					fr_exit(1);
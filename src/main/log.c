@@ -46,6 +46,14 @@ RCSID("$Id$")
 #include <pthread.h>
 #endif
 
+#include <sys/uio.h>
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_STDATOMIC_H)
+#  include <freeradius-devel/atomic_queue.h>
+#  include <stdatomic.h>
+#  define WITH_LOG_ASYNC (1)
+#endif
+
 log_lvl_t	rad_debug_lvl = 0;		//!< Global debugging level
 static bool	rate_limit = true;		//!< Whether repeated log entries should be rate limited
 
@@ -364,6 +372,425 @@ int radlog_init(fr_log_t *log, bool daemonize)
 	return 0;
 }
 
+/** Write a formatted log message to the log destination
+ *
+ * @param type of log message.
+ * @param buffer containing the message, ending with a newline.
+ * @param len of the message.
+ */
+static int radlog_write(log_type_t type, char const *buffer, size_t len)
+{
+	switch (default_log.dst) {
+
+#ifdef HAVE_SYSLOG_H
+	case L_DST_SYSLOG:
+		switch (type) {
+		case L_DBG:
+		case L_DBG_WARN:
+		case L_DBG_ERR:
+		case L_DBG_ERR_REQ:
+		case L_DBG_WARN_REQ:
+			type = LOG_DEBUG;
+			break;
+
+		case L_AUTH:
+		case L_PROXY:
+		case L_ACCT:
+			type = LOG_NOTICE;
+			break;
+
+		case L_INFO:
+			type = LOG_INFO;
+			break;
+
+		case L_WARN:
+			type = LOG_WARNING;
+			break;
+
+		case L_ERR:
+			type = LOG_ERR;
+			break;
+		}
+		syslog(type, "%.*s", (int) len, buffer);
+		break;
+#endif
+
+	case L_DST_FILES:
+	case L_DST_STDOUT:
+	case L_DST_STDERR:
+		return write(default_log.fd, buffer, len);
+
+	default:
+	case L_DST_NULL:	/* should have been caught above */
+		break;
+	}
+
+	return 0;
+}
+
+#ifdef WITH_LOG_ASYNC
+/*
+ *	Asynchronous logging.
+ *
+ *	Each thread formats its own messages, and pushes them onto a
+ *	ring which only it writes to.  A logger thread takes messages
+ *	off all of the rings, and writes them to the log destination.
+ *	So a slow disk, or a slow syslog daemon, only holds up the
+ *	logger thread.
+ *
+ *	If a ring is full, the message is discarded, and counted.  The
+ *	logger thread then logs how many messages were discarded.
+ *	Messages from one thread are written in the order they were
+ *	logged.  Messages from different threads may be interleaved.
+ */
+#define LOG_ASYNC_BATCH		(64)
+
+typedef struct log_async_msg_t {
+	log_type_t		type;
+	size_t			len;
+	char			buffer[];
+} log_async_msg_t;
+
+typedef struct log_async_ring_t log_async_ring_t;
+struct log_async_ring_t {
+	fr_spsc_queue_t		*queue;		//!< Messages from one thread.
+	atomic_uint_fast64_t	dropped;	//!< Messages discarded because the queue was full.
+	uint64_t		reported;	//!< Discarded messages the logger thread has logged.
+	atomic_bool		exited;		//!< The thread has exited.  Free the ring once it's empty.
+	log_async_ring_t	*next;
+};
+
+static pthread_t		log_async_thread;
+static pthread_mutex_t		log_async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		log_async_cond = PTHREAD_COND_INITIALIZER;
+static log_async_ring_t		*log_async_rings = NULL;	//!< Protected by log_async_mutex.
+static size_t			log_async_size;
+
+static atomic_bool		log_async_running;
+static atomic_bool		log_async_stopping;
+static atomic_bool		log_async_sleeping;
+static atomic_uint_fast64_t	log_async_dropped;
+
+fr_thread_local_setup(log_async_ring_t *, log_async_ring)	/* macro */
+
+/*
+ *	The logger thread frees the ring, once it has written
+ *	everything in it.
+ */
+static void _log_async_ring_exit(void *arg)
+{
+	log_async_ring_t *ring = arg;
+
+	atomic_store_explicit(&ring->exited, true, memory_order_release);
+}
+
+static log_async_ring_t *log_async_ring_get(void)
+{
+	log_async_ring_t *ring;
+
+	ring = fr_thread_local_init(log_async_ring, _log_async_ring_exit);
+	if (ring) return ring;
+
+	/*
+	 *	malloc is thread safe, talloc is not
+	 */
+	ring = calloc(1, sizeof(*ring));
+	if (!ring) return NULL;
+
+	ring->queue = fr_spsc_queue_create(NULL, log_async_size);
+	if (!ring->queue) {
+		free(ring);
+		return NULL;
+	}
+	atomic_init(&ring->dropped, 0);
+	atomic_init(&ring->exited, false);
+
+	if (fr_thread_local_set(log_async_ring, ring) != 0) {
+		talloc_free(ring->queue);
+		free(ring);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&log_async_mutex);
+	ring->next = log_async_rings;
+	log_async_rings = ring;
+	pthread_mutex_unlock(&log_async_mutex);
+
+	return ring;
+}
+
+/** Queue a formatted message for the logger thread
+ *
+ * @return
+ *	- true if the message was queued, or discarded.
+ *	- false if the caller should write it.
+ */
+static bool log_async_push(log_type_t type, char const *buffer, size_t len)
+{
+	log_async_ring_t	*ring;
+	log_async_msg_t		*msg;
+
+	if (!atomic_load_explicit(&log_async_running, memory_order_acquire)) return false;
+
+	/*
+	 *	The logger thread writes its own messages.
+	 */
+	if (pthread_equal(pthread_self(), log_async_thread)) return false;
+
+	ring = log_async_ring_get();
+	if (!ring) return false;
+
+	msg = malloc(sizeof(*msg) + len);
+	if (!msg) goto drop;
+
+	msg->type = type;
+	msg->len = len;
+	memcpy(msg->buffer, buffer, len);
+
+	if (!fr_spsc_queue_push(ring->queue, msg)) {
+		free(msg);
+	drop:
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&log_async_dropped, 1, memory_order_relaxed);
+		return true;
+	}
+
+	/*
+	 *	Pairs with the fence in log_async_sleep().  Either we
+	 *	see that the logger is going to sleep, or it sees the
+	 *	message we just pushed.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_load_explicit(&log_async_sleeping, memory_order_relaxed) &&
+	    atomic_exchange_explicit(&log_async_sleeping, false, memory_order_relaxed)) {
+		pthread_mutex_lock(&log_async_mutex);
+		pthread_cond_signal(&log_async_cond);
+		pthread_mutex_unlock(&log_async_mutex);
+	}
+
+	return true;
+}
+
+/*
+ *	Write a batch of messages with as few system calls as we can.
+ */
+static void log_async_write(log_async_msg_t **msgs, size_t num)
+{
+	size_t i;
+
+	switch (default_log.dst) {
+	case L_DST_FILES:
+	case L_DST_STDOUT:
+	case L_DST_STDERR:
+	{
+		struct iovec iov[LOG_ASYNC_BATCH];
+
+		for (i = 0; i < num; i++) {
+			iov[i].iov_base = msgs[i]->buffer;
+			iov[i].iov_len = msgs[i]->len;
+		}
+
+		if (writev(default_log.fd, iov, num) < 0) {
+			fr_strerror_printf("Failed writing to log: %s", fr_syserror(errno));
+		}
+	}
+		break;
+
+	default:
+		for (i = 0; i < num; i++) radlog_write(msgs[i]->type, msgs[i]->buffer, msgs[i]->len);
+		break;
+	}
+
+	for (i = 0; i < num; i++) free(msgs[i]);
+}
+
+/*
+ *	Write everything which is in the rings, and free the rings of
+ *	threads which have exited.
+ *
+ *	Returns the number of messages written.
+ */
+static size_t log_async_drain(void)
+{
+	log_async_ring_t	*ring, **last;
+	void			*msgs[LOG_ASYNC_BATCH];
+	size_t			num, total = 0;
+
+	/*
+	 *	Threads only ever add rings to the head of the list,
+	 *	and only this thread removes them.  So we only need
+	 *	the lock to read the head, and to unlink.
+	 */
+	pthread_mutex_lock(&log_async_mutex);
+	ring = log_async_rings;
+	pthread_mutex_unlock(&log_async_mutex);
+
+	for (; ring; ring = ring->next) {
+		uint64_t dropped;
+
+		while ((num = fr_spsc_queue_pop_batch(ring->queue, msgs, LOG_ASYNC_BATCH)) > 0) {
+			log_async_write((log_async_msg_t **) msgs, num);
+			total += num;
+		}
+
+		dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+		if (dropped != ring->reported) {
+			radlog(L_WARN, "Log queue full - discarded %" PRIu64 " messages",
+			       dropped - ring->reported);
+			ring->reported = dropped;
+		}
+	}
+
+	pthread_mutex_lock(&log_async_mutex);
+	last = &log_async_rings;
+	while ((ring = *last) != NULL) {
+		if (!atomic_load_explicit(&ring->exited, memory_order_acquire) ||
+		    (fr_spsc_queue_num_elements(ring->queue) > 0)) {
+			last = &ring->next;
+			continue;
+		}
+
+		*last = ring->next;
+		talloc_free(ring->queue);
+		free(ring);
+	}
+	pthread_mutex_unlock(&log_async_mutex);
+
+	return total;
+}
+
+static bool log_async_pending(void)
+{
+	log_async_ring_t *ring;
+
+	pthread_mutex_lock(&log_async_mutex);
+	for (ring = log_async_rings; ring; ring = ring->next) {
+		if (fr_spsc_queue_num_elements(ring->queue) > 0) break;
+	}
+	pthread_mutex_unlock(&log_async_mutex);
+
+	return (ring != NULL);
+}
+
+/*
+ *	Wait until there's something to log.  The timeout is only a
+ *	backstop, the threads signal us when we're sleeping.
+ */
+static void log_async_sleep(void)
+{
+	struct timespec when;
+
+	atomic_store_explicit(&log_async_sleeping, true, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (log_async_pending() || atomic_load(&log_async_stopping)) {
+		atomic_store_explicit(&log_async_sleeping, false, memory_order_relaxed);
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &when);
+	when.tv_sec++;
+
+	pthread_mutex_lock(&log_async_mutex);
+	if (atomic_load_explicit(&log_async_sleeping, memory_order_relaxed)) {
+		pthread_cond_timedwait(&log_async_cond, &log_async_mutex, &when);
+	}
+	pthread_mutex_unlock(&log_async_mutex);
+
+	atomic_store_explicit(&log_async_sleeping, false, memory_order_relaxed);
+}
+
+static void *log_async_main(UNUSED void *arg)
+{
+	for (;;) {
+		if (log_async_drain() > 0) continue;
+
+		if (atomic_load(&log_async_stopping)) break;
+
+		log_async_sleep();
+	}
+
+	return NULL;
+}
+
+/** Start writing log messages from a separate thread
+ *
+ * @param[in] size of each thread's queue of messages.  Rounded up to a power of 2.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int radlog_async_start(uint32_t size)
+{
+	int rcode;
+
+	if (atomic_load(&log_async_running)) return 0;
+
+	if (size < 2) size = 2;
+	log_async_size = size;
+
+	atomic_store(&log_async_stopping, false);
+
+	rcode = pthread_create(&log_async_thread, NULL, log_async_main, NULL);
+	if (rcode != 0) {
+		fr_strerror_printf("Failed creating log thread: %s", fr_syserror(rcode));
+		return -1;
+	}
+
+	atomic_store_explicit(&log_async_running, true, memory_order_release);
+
+	return 0;
+}
+
+/** Write any queued log messages, and stop the logger thread
+ *
+ * Messages logged after this are written by the thread which logs
+ * them.
+ */
+void radlog_async_stop(void)
+{
+	if (!atomic_exchange(&log_async_running, false)) return;
+
+	atomic_store(&log_async_stopping, true);
+
+	pthread_mutex_lock(&log_async_mutex);
+	pthread_cond_signal(&log_async_cond);
+	pthread_mutex_unlock(&log_async_mutex);
+
+	pthread_join(log_async_thread, NULL);
+
+	/*
+	 *	Catch anything which was queued while the logger
+	 *	thread was exiting.
+	 */
+	log_async_drain();
+}
+
+/** Return the number of log messages discarded because a queue was full
+ *
+ */
+uint64_t radlog_async_dropped(void)
+{
+	return atomic_load_explicit(&log_async_dropped, memory_order_relaxed);
+}
+#else
+int radlog_async_start(UNUSED uint32_t size)
+{
+	fr_strerror_printf("Asynchronous logging requires threads, and <stdatomic.h>");
+	return -1;
+}
+
+void radlog_async_stop(void)
+{
+}
+
+uint64_t radlog_async_dropped(void)
+{
+	return 0;
+}
+#endif	/* WITH_LOG_ASYNC */
+
 /** Send a server log message to its destination
  *
  * @param type of log message.
@@ -477,52 +904,13 @@ int vradlog(log_type_t type, char const *msg, va_list ap)
 		buffer[sizeof(buffer) - 1] = '\0';
 	}
 
-	switch (default_log.dst) {
+	len = strlen(buffer);
 
-#ifdef HAVE_SYSLOG_H
-	case L_DST_SYSLOG:
-		switch (type) {
-		case L_DBG:
-		case L_DBG_WARN:
-		case L_DBG_ERR:
-		case L_DBG_ERR_REQ:
-		case L_DBG_WARN_REQ:
-			type = LOG_DEBUG;
-			break;
-
-		case L_AUTH:
-		case L_PROXY:
-		case L_ACCT:
-			type = LOG_NOTICE;
-			break;
-
-		case L_INFO:
-			type = LOG_INFO;
-			break;
-
-		case L_WARN:
-			type = LOG_WARNING;
-			break;
-
-		case L_ERR:
-			type = LOG_ERR;
-			break;
-		}
-		syslog(type, "%s", buffer);
-		break;
+#ifdef WITH_LOG_ASYNC
+	if (log_async_push(type, buffer, len)) return len;
 #endif
 
-	case L_DST_FILES:
-	case L_DST_STDOUT:
-	case L_DST_STDERR:
-		return write(default_log.fd, buffer, strlen(buffer));
-
-	default:
-	case L_DST_NULL:	/* should have been caught above */
-		break;
-	}
-
-	return 0;
+	return radlog_write(type, buffer, len);
 }
 
 /** Send a server log message to its destination
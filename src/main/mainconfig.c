@@ -32,6 +32,10 @@ RCSID("$Id$")
 #include <pwd.h>
 #include <grp.h>
 
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#endif
+
 #ifdef HAVE_SYSLOG_H
 #  include <syslog.h>
 #endif
@@ -43,9 +47,11 @@ RCSID("$Id$")
 main_config_t		main_config;				//!< Main server configuration.
 
 extern fr_cond_t	*debug_condition;
+extern fr_cond_t	*trace_condition;
 extern fr_log_t		debug_log;
 
 fr_cond_t		*debug_condition = NULL;		//!< Condition used to mark packets up for checking.
+fr_cond_t		*trace_condition = NULL;		//!< Condition used to mark packets up for tracing.
 fr_log_t		debug_log = { .fd = -1, .dst = L_DST_NULL };
 bool			event_loop_started = false;		//!< Whether the main event loop has been started yet.
 
@@ -145,6 +151,8 @@ static const CONF_PARSER log_config[] = {
 	{ FR_CONF_POINTER("msg_goodpass", PW_TYPE_STRING, &main_config.auth_goodpass_msg) },
 	{ FR_CONF_POINTER("colourise", PW_TYPE_BOOLEAN, &do_colourise) },
 	{ FR_CONF_POINTER("use_utc", PW_TYPE_BOOLEAN, &log_dates_utc) },
+	{ FR_CONF_POINTER("async", PW_TYPE_BOOLEAN, &main_config.log_async), .dflt = "no" },
+	{ FR_CONF_POINTER("async_queue_size", PW_TYPE_INTEGER, &main_config.log_async_queue_size), .dflt = "1024" },
 	{ FR_CONF_POINTER("msg_denied", PW_TYPE_STRING, &main_config.denied_msg), .dflt = "You are already logged in - access denied" },
 #ifdef WITH_CONF_WRITE
 	{ FR_CONF_POINTER("write_dir", PW_TYPE_STRING, &main_config.write_dir), .dflt = NULL },
@@ -174,6 +182,7 @@ static const CONF_PARSER resources[] = {
 	 *	it exists.
 	 */
 	{ FR_CONF_POINTER("talloc_pool_size", PW_TYPE_INTEGER, &main_config.talloc_pool_size) },
+	{ FR_CONF_POINTER("huge_pages", PW_TYPE_BOOLEAN, &fr_hugepages), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -199,6 +208,7 @@ static const CONF_PARSER server_config[] = {
 	{ FR_CONF_POINTER("cleanup_delay", PW_TYPE_INTEGER, &main_config.cleanup_delay), .dflt = STRINGIFY(CLEANUP_DELAY) },
 	{ FR_CONF_POINTER("continuation_timeout", PW_TYPE_INTEGER, &main_config.continuation_timeout), .dflt = "15" },
 	{ FR_CONF_POINTER("max_requests", PW_TYPE_INTEGER, &main_config.max_requests), .dflt = STRINGIFY(MAX_REQUESTS) },
+	{ FR_CONF_POINTER("num_processes", PW_TYPE_INTEGER, &main_config.num_processes), .dflt = "0" },
 	{ FR_CONF_POINTER("pidfile", PW_TYPE_STRING, &main_config.pid_file), .dflt = "${run_dir}/radiusd.pid"},
 	{ FR_CONF_POINTER("checkrad", PW_TYPE_STRING, &main_config.checkrad), .dflt = "${sbindir}/checkrad" },
 
@@ -972,11 +982,34 @@ do {\
 
 	FR_INTEGER_BOUND_CHECK("cleanup_delay", main_config.cleanup_delay, <=, 10);
 
+	if (main_config.num_processes) {
+#if defined(SO_REUSEPORT) && defined(WITH_STATS)
+		FR_INTEGER_BOUND_CHECK("num_processes", main_config.num_processes, <=, 256);
+#else
+		WARN("Setting 'num_processes' is not supported on this system.  Disabling 'num_processes'");
+		main_config.num_processes = 0;
+#endif
+	}
+
 	FR_TIMEVAL_BOUND_CHECK("reject_delay", &main_config.reject_delay, <=, main_config.cleanup_delay, 0);
 
 	FR_INTEGER_BOUND_CHECK("resources.talloc_pool_size", main_config.talloc_pool_size, >=, 2 * 1024);
 	FR_INTEGER_BOUND_CHECK("resources.talloc_pool_size", main_config.talloc_pool_size, <=, 1024 * 1024);
 
+	/*
+	 *	The dictionaries were read before the configuration,
+	 *	so their memory has to be advised now.  Tables
+	 *	allocated from here on are advised as they're created.
+	 */
+	if (fr_hugepages) {
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_HUGEPAGE)
+		fr_dict_hugepage_advise(main_config.dict);
+#else
+		WARN("Setting 'resources.huge_pages' is not supported on this system.  Disabling 'huge_pages'");
+		fr_hugepages = false;
+#endif
+	}
+
 	/*
 	 * Set default initial request processing delay to 1/3 of a second.
 	 * Will be updated by the lowest response window across all home servers,
@@ -1131,6 +1164,35 @@ static int hup_callback(void *ctx, void *data)
 	return 0;
 }
 
+/** Report clients which have changed
+ *
+ * Client lists are owned by the listeners, and can't be replaced while
+ * the server is running.
+ */
+static void hup_clients(CONF_SECTION *config)
+{
+	CONF_SECTION *cs, *running;
+
+	for (cs = cf_subsection_find_next(config, NULL, "client");
+	     cs != NULL;
+	     cs = cf_subsection_find_next(config, cs, "client")) {
+		char const *name = cf_section_name2(cs);
+
+		if (!name) continue;
+
+		running = cf_section_sub_find_name2(main_config.config, "client", name);
+		if (!running) {
+			WARN("Client \"%s\" was added.  The server must be restarted to use it", name);
+			continue;
+		}
+
+		if (!cf_section_equal(running, cs)) {
+			WARN("Client \"%s\" has changed.  The server must be restarted to use the new "
+			     "configuration", name);
+		}
+	}
+}
+
 void main_config_hup(void)
 {
 	int rcode;
@@ -1222,12 +1284,15 @@ void main_config_hup(void)
 	INFO("HUP - loading modules");
 
 	/*
-	 *	Prefer the new module configuration.
+	 *	Prefer the new module configuration.  Only modules
+	 *	whose configuration has changed are reloaded.
 	 */
 	modules_hup(cf_section_sub_find(cs, "modules"));
 
 	/*
-	 *	Load the new servers.
+	 *	Recompile the servers which have changed.
 	 */
-	virtual_servers_init(cs);
+	virtual_servers_hup(cs);
+
+	hup_clients(cs);
 }
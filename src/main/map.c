@@ -1002,6 +1002,46 @@ do {\
 	}\
 } while (0)
 
+/*
+ *	Update the cached username && password.  This is code
+ *	we execute on EVERY update (sigh) so that SOME modules
+ *	MIGHT NOT have to do the search themselves.
+ *
+ *	TBH, we should probably make each module just do the
+ *	search themselves.
+ */
+static void map_cache_auth(REQUEST *context, VALUE_PAIR **list)
+{
+	vp_cursor_t cursor;
+	VALUE_PAIR *vp;
+
+	context->username = NULL;
+	context->password = NULL;
+
+	for (vp = fr_cursor_init(&cursor, list);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+
+		if (vp->da->vendor != 0) continue;
+		if (vp->da->flags.has_tag) continue;
+
+		if (!context->username && (vp->da->attr == PW_USER_NAME)) {
+			context->username = vp;
+			continue;
+		}
+
+		if (vp->da->attr == PW_STRIPPED_USER_NAME) {
+			context->username = vp;
+			continue;
+		}
+
+		if (vp->da->attr == PW_USER_PASSWORD) {
+			context->password = vp;
+			continue;
+		}
+	}
+}
+
 /** Convert #vp_map_t to #VALUE_PAIR (s) and add them to a #REQUEST.
  *
  * Takes a single #vp_map_t, resolves request and list identifiers
@@ -1427,41 +1467,267 @@ int map_to_request(REQUEST *request, vp_map_t const *map, radius_map_getvalue_t
 finish:
 	rad_assert(!head);
 
-	/*
-	 *	Update the cached username && password.  This is code
-	 *	we execute on EVERY update (sigh) so that SOME modules
-	 *	MIGHT NOT have to do the search themselves.
-	 *
-	 *	TBH, we should probably make each module just do the
-	 *	search themselves.
-	 */
-	if (map->lhs->tmpl_list == PAIR_LIST_REQUEST) {
-		context->username = NULL;
-		context->password = NULL;
+	if (map->lhs->tmpl_list == PAIR_LIST_REQUEST) map_cache_auth(context, list);
 
-		for (vp = fr_cursor_init(&src_list, list);
-		     vp;
-		     vp = fr_cursor_next(&src_list)) {
+	return 0;
+}
 
-			if (vp->da->vendor != 0) continue;
-			if (vp->da->flags.has_tag) continue;
+/*
+ *	Index of the first attribute with each da in a list, used
+ *	by map_list_to_request().
+ */
+typedef struct {
+	fr_dict_attr_t const	*da;
+	VALUE_PAIR		**link;		//!< Pointer to the first attribute with da.
+} map_index_entry_t;
 
-			if (!context->username && (vp->da->attr == PW_USER_NAME)) {
-				context->username = vp;
-				continue;
-			}
+typedef struct {
+	map_index_entry_t	*entry;
+	uint32_t		mask;
+	VALUE_PAIR		**tail;		//!< Pointer to the end of the list.
+} map_index_t;
+
+/*
+ *	Maps can share one index if they set, add, or set if absent
+ *	a whole attribute, in the same list, from a source which
+ *	can't modify the request.  Anything else goes through
+ *	map_to_request().
+ */
+static bool map_indexable(vp_map_t const *map, vp_map_t const *first)
+{
+	switch (map->op) {
+	case T_OP_SET:
+	case T_OP_ADD:
+	case T_OP_EQ:
+		break;
+
+	default:
+		return false;
+	}
+
+	switch (map->rhs->type) {
+	case TMPL_TYPE_UNPARSED:
+	case TMPL_TYPE_ATTR:
+	case TMPL_TYPE_DATA:
+		break;
+
+	default:
+		return false;
+	}
+
+	if ((map->lhs->type != TMPL_TYPE_ATTR) ||
+	    (map->lhs->tmpl_num != NUM_ANY) ||
+	    (map->lhs->tmpl_tag != TAG_ANY)) return false;
+
+	if ((map->lhs->tmpl_list == PAIR_LIST_COA) ||
+	    (map->lhs->tmpl_list == PAIR_LIST_DM)) return false;
+
+	return (map->lhs->tmpl_request == first->lhs->tmpl_request) &&
+	       (map->lhs->tmpl_list == first->lhs->tmpl_list);
+}
+
+static inline map_index_entry_t *map_index_find(map_index_t *index, fr_dict_attr_t const *da)
+{
+	uint32_t i = (((uintptr_t) da >> 3) * 2654435761U) & index->mask;
+
+	while (index->entry[i].da && (index->entry[i].da != da)) i = (i + 1) & index->mask;
+
+	return &index->entry[i];
+}
 
-			if (vp->da->attr == PW_STRIPPED_USER_NAME) {
-				context->username = vp;
+/*
+ *	Append attributes to the list, recording the first of
+ *	each da.
+ */
+static void map_index_append(map_index_t *index, VALUE_PAIR *vp)
+{
+	map_index_entry_t *e;
+
+	*index->tail = vp;
+
+	for (; vp != NULL; vp = vp->next) {
+		e = map_index_find(index, vp->da);
+		if (!e->da) {
+			e->da = vp->da;
+			e->link = index->tail;
+		}
+		index->tail = &vp->next;
+	}
+}
+
+/** Convert a list of #vp_map_t to #VALUE_PAIR (s) and add them to a #REQUEST.
+ *
+ * Has the same effect as calling #map_to_request for each map in turn, but
+ * runs of maps which set or add attributes in the same list share a single
+ * lookup of the request and list, and an index of the list, so they don't
+ * each have to search it.
+ *
+ * @param request The current request.
+ * @param head of the list of maps.
+ * @param func to retrieve module specific values and convert them to
+ *	#VALUE_PAIR.
+ * @param ctx to be passed to func.
+ * @return
+ *	- -1 if an operation failed.
+ *	- -2 in a source attribute wasn't valid.
+ *	- 0 on success.
+ */
+int map_list_to_request(REQUEST *request, vp_map_t const *head, radius_map_getvalue_t func, void *ctx)
+{
+	vp_map_t const		*map, *first;
+	map_index_entry_t	buffer[64];
+	map_index_t		index;
+	REQUEST			*context;
+	VALUE_PAIR		**list, *vp;
+	TALLOC_CTX		*parent;
+	uint32_t		num, size;
+	int			rcode = 0;
+
+	map = head;
+	while (map) {
+		/*
+		 *	Runs of one map don't need an index.
+		 */
+		if (!map->next || !map_indexable(map, map) || !map_indexable(map->next, map)) {
+		single:
+			rcode = map_to_request(request, map, func, ctx);
+			if (rcode < 0) return rcode;
+
+			map = map->next;
+			continue;
+		}
+
+		/*
+		 *	Let map_to_request() produce any errors.
+		 */
+		context = request;
+		if (radius_request(&context, map->lhs->tmpl_request) < 0) goto single;
+
+		list = radius_list(context, map->lhs->tmpl_list);
+		if (!list) goto single;
+
+		parent = radius_list_ctx(context, map->lhs->tmpl_list);
+		rad_assert(parent);
+
+		/*
+		 *	Size the index for everything in the list, and one
+		 *	new attribute per map, so it's never more than half
+		 *	full.
+		 */
+		first = map;
+		for (num = 0, vp = *list; vp != NULL; vp = vp->next) num++;
+		for (; map && map_indexable(map, first); map = map->next) num++;
+		for (size = 16; size < (num * 2); size <<= 1);
+
+		if (size <= (sizeof(buffer) / sizeof(buffer[0]))) {
+			index.entry = buffer;
+			memset(buffer, 0, sizeof(buffer[0]) * size);
+		} else {
+			index.entry = talloc_zero_array(request, map_index_entry_t, size);
+			if (!index.entry) return -1;
+		}
+		index.mask = size - 1;
+		index.tail = list;
+
+		vp = *list;
+		*list = NULL;
+		map_index_append(&index, vp);
+
+		for (map = first; map && map_indexable(map, first); map = map->next) {
+			VALUE_PAIR		*src = NULL, *dst, **last;
+			map_index_entry_t	*e;
+
+			rcode = func(parent, &src, request, map, ctx);
+			if (rcode < 0) {
+				rad_assert(!src);
+				break;
+			}
+			if (!src) {
+				RDEBUG2("%.*s skipped: No values available", (int)map->lhs->len, map->lhs->name);
 				continue;
 			}
 
-			if (vp->da->attr == PW_USER_PASSWORD) {
-				context->password = vp;
-				continue;
+			if (rad_debug_lvl) for (vp = src; vp; vp = vp->next) map_debug_log(request, map, vp);
+
+			e = map_index_find(&index, map->lhs->tmpl_da);
+
+			switch (map->op) {
+			/*
+			 *	= - Set only if not already set, from the first src attribute
+			 */
+			case T_OP_EQ:
+				if (e->da) {
+					RDEBUG3("Refusing to overwrite (use :=)");
+					fr_pair_list_free(&src);
+					break;
+				}
+
+				vp = src;
+				src = src->next;
+				vp->next = NULL;
+				map_index_append(&index, vp);
+				fr_pair_list_free(&src);
+				break;
+
+			/*
+			 *	:= - Overwrite existing attribute with the last src attribute
+			 */
+			case T_OP_SET:
+				for (last = &src; (*last)->next; last = &(*last)->next);
+				vp = *last;
+				*last = NULL;
+				fr_pair_list_free(&src);
+
+				if (!e->da) {
+					map_index_append(&index, vp);
+					break;
+				}
+
+				dst = *e->link;
+				DEBUG_OVERWRITE(dst, vp);
+
+				vp->next = dst->next;
+				*e->link = vp;
+				dst->next = NULL;
+
+				/*
+				 *	Whatever pointed at &dst->next
+				 *	must now point at &vp->next.
+				 */
+				if (index.tail == &dst->next) {
+					index.tail = &vp->next;
+				} else {
+					map_index_entry_t *after = map_index_find(&index, vp->next->da);
+
+					if (after->link == &dst->next) after->link = &vp->next;
+				}
+				fr_pair_list_free(&dst);
+				break;
+
+			/*
+			 *	+= - Add all src attributes to the destination
+			 */
+			case T_OP_ADD:
+				map_index_append(&index, src);
+				break;
+
+			default:
+				rad_assert(0);
+				break;
 			}
 		}
+
+		if (index.entry != buffer) talloc_free(index.entry);
+
+		if (first->lhs->tmpl_list == PAIR_LIST_REQUEST) map_cache_auth(context, list);
+
+		if (rcode < 0) return rcode;
+
+		/*
+		 *	Map is now the first one we didn't apply.
+		 */
 	}
+
 	return 0;
 }
 
@@ -0,0 +1,610 @@
+/*
+ * metrics.c	Export statistics in the Prometheus text format.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2016 The FreeRADIUS server project
+ */
+
+/*
+ *	This file is included by listen.c, in the same way as command.c.
+ *
+ *	A "metrics" listener is a TCP socket which answers "GET /metrics"
+ *	with all of the server's statistics, in the format Prometheus
+ *	(and OpenMetrics) scrapers expect.  One request is answered per
+ *	connection, and the connection is then closed.
+ *
+ *	Everything is read from counters which the workers update
+ *	themselves, so a scrape never stops or locks the workers.
+ */
+#if defined(WITH_METRICS_SOCKET) && defined(WITH_TCP)
+
+#include <freeradius-devel/state.h>
+
+#define METRICS_BUFFER_SIZE (1024)
+
+/*
+ *	Partially read HTTP request.
+ */
+typedef struct metrics_buffer_t {
+	size_t		offset;
+	char		buffer[METRICS_BUFFER_SIZE];
+} metrics_buffer_t;
+
+static char const *metrics_elapsed_names[8] = {
+	"1us", "10us", "100us", "1ms", "10ms", "100ms", "1s", "10s"
+};
+
+typedef struct metrics_stats_field_t {
+	char const	*name;
+	char const	*help;
+	size_t		offset;
+} metrics_stats_field_t;
+
+#define STATS_FIELD(_name, _help, _field) { _name, _help, offsetof(fr_stats_t, _field) }
+
+static metrics_stats_field_t const metrics_stats_fields[] = {
+	STATS_FIELD("requests_total", "Requests received", total_requests),
+	STATS_FIELD("invalid_requests_total", "Requests from unknown clients", total_invalid_requests),
+	STATS_FIELD("dup_requests_total", "Duplicate requests", total_dup_requests),
+	STATS_FIELD("responses_total", "Responses sent", total_responses),
+	STATS_FIELD("access_accepts_total", "Access-Accepts sent", total_access_accepts),
+	STATS_FIELD("access_rejects_total", "Access-Rejects sent", total_access_rejects),
+	STATS_FIELD("access_challenges_total", "Access-Challenges sent", total_access_challenges),
+	STATS_FIELD("malformed_requests_total", "Malformed requests", total_malformed_requests),
+	STATS_FIELD("bad_authenticators_total", "Requests with bad authenticators", total_bad_authenticators),
+	STATS_FIELD("packets_dropped_total", "Packets dropped", total_packets_dropped),
+	STATS_FIELD("rate_limited_total", "Packets dropped by max_pps, before decoding", total_rate_limited),
+	STATS_FIELD("no_records_total", "Accounting requests which weren't recorded", total_no_records),
+	STATS_FIELD("unknown_types_total", "Packets of unknown type", total_unknown_types),
+	STATS_FIELD("timeouts_total", "Requests which timed out", total_timeouts),
+	{ NULL, NULL, 0 }
+};
+
+typedef struct metrics_stats_t {
+	char const	*role;
+	char const		*type;
+	fr_stats_global_t	which;
+} metrics_stats_t;
+
+static metrics_stats_t const metrics_stats[] = {
+	{ "server", "auth", FR_STATS_AUTH },
+#ifdef WITH_ACCOUNTING
+	{ "server", "acct", FR_STATS_ACCT },
+#endif
+#ifdef WITH_COA
+	{ "server", "coa", FR_STATS_COA },
+	{ "server", "disconnect", FR_STATS_DSC },
+#endif
+#ifdef WITH_PROXY
+	{ "proxy", "auth", FR_STATS_PROXY_AUTH },
+#ifdef WITH_ACCOUNTING
+	{ "proxy", "acct", FR_STATS_PROXY_ACCT },
+#endif
+#ifdef WITH_COA
+	{ "proxy", "coa", FR_STATS_PROXY_COA },
+	{ "proxy", "disconnect", FR_STATS_PROXY_DSC },
+#endif
+#endif
+	{ NULL, NULL, FR_STATS_GLOBAL_MAX }
+};
+
+#define MPRINTF(_out, _fmt, ...) *(_out) = talloc_asprintf_append_buffer(*(_out), _fmt, ## __VA_ARGS__)
+
+/*
+ *	Label values are mostly names from the configuration, which
+ *	can contain anything.
+ */
+static char const *metrics_label(char *buffer, size_t bufsize, char const *in)
+{
+	char *p = buffer, *end = buffer + bufsize - 1;
+
+	while (*in && (p < (end - 1))) {
+		switch (*in) {
+		case '\\':
+		case '"':
+			*(p++) = '\\';
+			*(p++) = *in;
+			break;
+
+		case '\n':
+			*(p++) = '\\';
+			*(p++) = 'n';
+			break;
+
+		default:
+			*(p++) = *in;
+			break;
+		}
+		in++;
+	}
+	*p = '\0';
+
+	return buffer;
+}
+
+static void metrics_header(char **out, char const *name, char const *type, char const *help)
+{
+	MPRINTF(out, "# HELP freeradius_%s %s\n# TYPE freeradius_%s %s\n", name, help, name, type);
+}
+
+static void metrics_print_stats(char **out)
+{
+	metrics_stats_field_t const	*field;
+	metrics_stats_t const		*m;
+	fr_stats_t			stats[sizeof(metrics_stats) / sizeof(metrics_stats[0])];
+	int				i, j;
+
+	/*
+	 *	Add up the per-thread counters once, so that every
+	 *	metric comes from the same snapshot.
+	 */
+	for (j = 0, m = metrics_stats; m->role; j++, m++) radius_stats_global(&stats[j], m->which);
+
+	for (field = metrics_stats_fields; field->name; field++) {
+		metrics_header(out, field->name, "counter", field->help);
+
+		for (j = 0, m = metrics_stats; m->role; j++, m++) {
+			fr_uint_t value;
+
+			memcpy(&value, ((uint8_t *) &stats[j]) + field->offset, sizeof(value));
+			MPRINTF(out, "freeradius_%s{role=\"%s\",type=\"%s\"} %" PRIu64 "\n",
+				field->name, m->role, m->type, (uint64_t) value);
+		}
+	}
+
+	metrics_header(out, "last_packet_seconds", "gauge", "When the last packet was received");
+	for (j = 0, m = metrics_stats; m->role; j++, m++) {
+		MPRINTF(out, "freeradius_last_packet_seconds{role=\"%s\",type=\"%s\"} %" PRIu64 "\n",
+			m->role, m->type, (uint64_t) stats[j].last_packet);
+	}
+
+	metrics_header(out, "elapsed_total", "counter", "Requests, by the power of 10 of their processing time");
+	for (j = 0, m = metrics_stats; m->role; j++, m++) {
+		for (i = 0; i < 8; i++) {
+			MPRINTF(out, "freeradius_elapsed_total{role=\"%s\",type=\"%s\",bucket=\"%s\"} %" PRIu64 "\n",
+				m->role, m->type, metrics_elapsed_names[i], (uint64_t) stats[j].elapsed[i]);
+		}
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+static void metrics_print_queues(char **out)
+{
+	static char const *queue_names[] = { "internal", "proxy", "auth", "acct", "detail" };
+	int array[RAD_LISTEN_MAX], pps[2];
+	uint32_t queued;
+	uint64_t completed, rejected, wait_usec, run_usec;
+	uint64_t shed[QUEUE_SHED_MAX];
+	size_t i;
+
+	thread_pool_queue_stats(array, pps);
+	thread_pool_shed_stats(shed);
+
+	metrics_header(out, "queue_length", "gauge", "Requests waiting for a thread");
+	for (i = 0; i < (sizeof(queue_names) / sizeof(queue_names[0])); i++) {
+		MPRINTF(out, "freeradius_queue_length{queue=\"%s\"} %d\n", queue_names[i], array[i]);
+	}
+
+	metrics_header(out, "queue_pps_in", "gauge", "Requests queued per second");
+	MPRINTF(out, "freeradius_queue_pps_in %d\n", pps[0]);
+
+	metrics_header(out, "queue_pps_out", "gauge", "Requests dequeued per second");
+	MPRINTF(out, "freeradius_queue_pps_out %d\n", pps[1]);
+
+	metrics_header(out, "queue_shed_total", "counter", "Requests dropped instead of being queued");
+	for (i = 0; i < QUEUE_SHED_MAX; i++) {
+		MPRINTF(out, "freeradius_queue_shed_total{reason=\"%s\"} %" PRIu64 "\n",
+			fr_int2str(queue_shed_table, i, "?"), shed[i]);
+	}
+
+	thread_pool_offload_stats(&queued, &completed, &rejected, &wait_usec, &run_usec);
+
+	metrics_header(out, "offload_queue_length", "gauge", "Blocking calls waiting for an offload thread");
+	MPRINTF(out, "freeradius_offload_queue_length %" PRIu32 "\n", queued);
+
+	metrics_header(out, "offload_completed_total", "counter", "Blocking calls completed by offload threads");
+	MPRINTF(out, "freeradius_offload_completed_total %" PRIu64 "\n", completed);
+
+	metrics_header(out, "offload_rejected_total", "counter", "Blocking calls rejected because the queue was full");
+	MPRINTF(out, "freeradius_offload_rejected_total %" PRIu64 "\n", rejected);
+
+	metrics_header(out, "offload_wait_microseconds_total", "counter", "Time blocking calls spent queued");
+	MPRINTF(out, "freeradius_offload_wait_microseconds_total %" PRIu64 "\n", wait_usec);
+
+	metrics_header(out, "offload_run_microseconds_total", "counter", "Time blocking calls spent running");
+	MPRINTF(out, "freeradius_offload_run_microseconds_total %" PRIu64 "\n", run_usec);
+}
+#endif
+
+static void metrics_print_state(char **out)
+{
+	metrics_header(out, "state_created_total", "counter", "State entries created");
+	MPRINTF(out, "freeradius_state_created_total %" PRIu64 "\n", fr_state_entries_created(global_state));
+
+	metrics_header(out, "state_timeout_total", "counter", "State entries which expired");
+	MPRINTF(out, "freeradius_state_timeout_total %" PRIu64 "\n", fr_state_entries_timeout(global_state));
+
+	metrics_header(out, "state_tracked", "gauge", "State entries being tracked");
+	MPRINTF(out, "freeradius_state_tracked %" PRIu32 "\n", fr_state_entries_tracked(global_state));
+}
+
+static void metrics_print_log(char **out)
+{
+	metrics_header(out, "log_dropped_total", "counter", "Log messages discarded because a queue was full");
+	MPRINTF(out, "freeradius_log_dropped_total %" PRIu64 "\n", radlog_async_dropped());
+}
+
+/*
+ *	Samples for each metric have to be printed together, so the
+ *	pools are walked once, and each metric written to its own
+ *	buffer.
+ */
+typedef struct metrics_pool_ctx_t {
+	char		*num;
+	char		*active;
+	char		*pending;
+	char		*spawned;
+} metrics_pool_ctx_t;
+
+static void metrics_pool_walk(void *ctx, char const *name, fr_connection_pool_state_t const *state)
+{
+	metrics_pool_ctx_t *p = ctx;
+	char label[256];
+
+	metrics_label(label, sizeof(label), name);
+
+	MPRINTF(&p->num, "freeradius_pool_connections{module=\"%s\"} %" PRIu32 "\n", label, state->num);
+	MPRINTF(&p->active, "freeradius_pool_connections_active{module=\"%s\"} %" PRIu32 "\n", label, state->active);
+	MPRINTF(&p->pending, "freeradius_pool_connections_pending{module=\"%s\"} %" PRIu32 "\n",
+		label, state->pending);
+	MPRINTF(&p->spawned, "freeradius_pool_connections_spawned_total{module=\"%s\"} %" PRIu64 "\n",
+		label, state->count);
+}
+
+static void metrics_print_pools(char **out)
+{
+	metrics_pool_ctx_t p;
+
+	p.num = talloc_strdup(*out, "");
+	p.active = talloc_strdup(*out, "");
+	p.pending = talloc_strdup(*out, "");
+	p.spawned = talloc_strdup(*out, "");
+
+	modules_connection_pool_walk(metrics_pool_walk, &p);
+
+	metrics_header(out, "pool_connections", "gauge", "Connections in the module's pool");
+	MPRINTF(out, "%s", p.num);
+	metrics_header(out, "pool_connections_active", "gauge", "Connections reserved by requests");
+	MPRINTF(out, "%s", p.active);
+	metrics_header(out, "pool_connections_pending", "gauge", "Connections being opened");
+	MPRINTF(out, "%s", p.pending);
+	metrics_header(out, "pool_connections_spawned_total", "counter", "Connections opened");
+	MPRINTF(out, "%s", p.spawned);
+
+	talloc_free(p.num);
+	talloc_free(p.active);
+	talloc_free(p.pending);
+	talloc_free(p.spawned);
+}
+
+typedef struct metrics_alloc_ctx_t {
+	char const	*label;
+	char		*bytes;
+	char		*blocks;
+	char		*held_bytes;
+	char		*held_blocks;
+} metrics_alloc_ctx_t;
+
+static void metrics_alloc_walk(void *ctx, char const *name, fr_stats_alloc_t const *alloc,
+			       size_t bytes, size_t blocks)
+{
+	metrics_alloc_ctx_t *a = ctx;
+	char label[256];
+
+	metrics_label(label, sizeof(label), name);
+
+	MPRINTF(&a->bytes, "freeradius_%s_request_bytes_total{%s=\"%s\"} %" PRIu64 "\n",
+		a->label, a->label, label, alloc->bytes);
+	MPRINTF(&a->blocks, "freeradius_%s_request_blocks_total{%s=\"%s\"} %" PRIu64 "\n",
+		a->label, a->label, label, alloc->blocks);
+	MPRINTF(&a->held_bytes, "freeradius_%s_memory_bytes{%s=\"%s\"} %zu\n", a->label, a->label, label, bytes);
+	MPRINTF(&a->held_blocks, "freeradius_%s_memory_blocks{%s=\"%s\"} %zu\n", a->label, a->label, label, blocks);
+}
+
+static void metrics_print_alloc(char **out, char const *label, char const *what,
+				void (*walk)(fr_stats_alloc_walk_t, void *))
+{
+	metrics_alloc_ctx_t a;
+	char name[64], help[128];
+
+	a.label = label;
+	a.bytes = talloc_strdup(*out, "");
+	a.blocks = talloc_strdup(*out, "");
+	a.held_bytes = talloc_strdup(*out, "");
+	a.held_blocks = talloc_strdup(*out, "");
+
+	walk(metrics_alloc_walk, &a);
+
+	snprintf(name, sizeof(name), "%s_request_bytes_total", label);
+	snprintf(help, sizeof(help), "Bytes each %s left in requests", what);
+	metrics_header(out, name, "counter", help);
+	MPRINTF(out, "%s", a.bytes);
+
+	snprintf(name, sizeof(name), "%s_request_blocks_total", label);
+	snprintf(help, sizeof(help), "Memory blocks each %s left in requests", what);
+	metrics_header(out, name, "counter", help);
+	MPRINTF(out, "%s", a.blocks);
+
+	snprintf(name, sizeof(name), "%s_memory_bytes", label);
+	snprintf(help, sizeof(help), "Bytes held by each %s", what);
+	metrics_header(out, name, "gauge", help);
+	MPRINTF(out, "%s", a.held_bytes);
+
+	snprintf(name, sizeof(name), "%s_memory_blocks", label);
+	snprintf(help, sizeof(help), "Memory blocks held by each %s", what);
+	metrics_header(out, name, "gauge", help);
+	MPRINTF(out, "%s", a.held_blocks);
+
+	talloc_free(a.bytes);
+	talloc_free(a.blocks);
+	talloc_free(a.held_bytes);
+	talloc_free(a.held_blocks);
+}
+
+/*
+ *	Measuring memory walks everything each module holds, so it's
+ *	only done while memory accounting has been enabled from radmin.
+ */
+static void metrics_print_allocations(char **out)
+{
+	size_t bytes, blocks;
+
+	if (!main_config.memory_accounting) return;
+
+	metrics_print_alloc(out, "module", "module instance", modules_alloc_walk);
+	metrics_print_alloc(out, "server", "virtual server", virtual_servers_alloc_walk);
+
+	if (!global_state) return;
+
+	fr_state_memory(global_state, &bytes, &blocks);
+
+	metrics_header(out, "state_memory_bytes", "gauge", "Bytes held by state entries");
+	MPRINTF(out, "freeradius_state_memory_bytes %zu\n", bytes);
+
+	metrics_header(out, "state_memory_blocks", "gauge", "Memory blocks held by state entries");
+	MPRINTF(out, "freeradius_state_memory_blocks %zu\n", blocks);
+}
+
+typedef struct metrics_latency_ctx_t {
+	char		**out;
+	char const	*metric;
+	char const	*name_label;
+	char const	*section_label;
+} metrics_latency_ctx_t;
+
+static void metrics_latency_walk(void *ctx, char const *name, char const *section, fr_stats_latency_t *lat)
+{
+	static double const pct[] = { 50, 99, 99.9 };
+	static char const *quantile[] = { "0.5", "0.99", "0.999" };
+	metrics_latency_ctx_t *m = ctx;
+	uint64_t usec[3], count;
+	char label[256], labels[512];
+	int i;
+
+	count = fr_stats_latency_percentiles(lat, usec, pct, 3);
+	if (!count) return;
+
+	/*
+	 *	The server wide histograms are only labelled by phase.
+	 */
+	if (m->name_label) {
+		metrics_label(label, sizeof(label), name);
+		snprintf(labels, sizeof(labels), "%s=\"%s\",%s=\"%s\"", m->name_label, label, m->section_label, section);
+	} else {
+		snprintf(labels, sizeof(labels), "%s=\"%s\"", m->section_label, section);
+	}
+
+	for (i = 0; i < 3; i++) {
+		MPRINTF(m->out, "freeradius_%s{%s,quantile=\"%s\"} %" PRIu64 "\n",
+			m->metric, labels, quantile[i], usec[i]);
+	}
+	MPRINTF(m->out, "freeradius_%s_sum{%s} %" PRIu64 "\n", m->metric, labels, fr_stats_latency_sum(lat));
+	MPRINTF(m->out, "freeradius_%s_count{%s} %" PRIu64 "\n", m->metric, labels, count);
+}
+
+static void metrics_print_latency(char **out)
+{
+	metrics_latency_ctx_t m;
+
+	m.out = out;
+
+	m.metric = "request_latency_microseconds";
+	m.name_label = NULL;
+	m.section_label = "phase";
+	metrics_header(out, m.metric, "summary", "Time requests spend queued, waiting for home servers, and in total");
+	request_latency_walk(metrics_latency_walk, &m);
+
+	m.metric = "server_latency_microseconds";
+	m.name_label = "server";
+	m.section_label = "section";
+	metrics_header(out, m.metric, "summary", "Time spent running each section of each virtual server");
+	virtual_servers_latency_walk(metrics_latency_walk, &m);
+
+	m.metric = "module_latency_microseconds";
+	m.name_label = "module";
+	m.section_label = "method";
+	metrics_header(out, m.metric, "summary", "Time spent in each method of each module");
+	modules_latency_walk(metrics_latency_walk, &m);
+}
+
+static char *metrics_body(TALLOC_CTX *ctx)
+{
+	char *out;
+
+	out = talloc_strdup(ctx, "");
+
+	metrics_print_stats(&out);
+#ifdef HAVE_PTHREAD_H
+	metrics_print_queues(&out);
+#endif
+	metrics_print_state(&out);
+	metrics_print_log(&out);
+	metrics_print_pools(&out);
+	metrics_print_latency(&out);
+	metrics_print_allocations(&out);
+
+	return out;
+}
+
+static void metrics_close_socket(rad_listen_t *this)
+{
+	this->status = RAD_LISTEN_STATUS_EOL;
+
+	radius_update_listener(this);
+}
+
+static void metrics_write(int fd, char const *data, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = write(fd, data, len);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+
+			DEBUG2(" ... failed writing to metrics socket: %s", fr_syserror(errno));
+			return;
+		}
+
+		data += r;
+		len -= r;
+	}
+}
+
+static void metrics_respond(rad_listen_t *this, char const *status, char const *body)
+{
+	char header[256];
+	size_t len;
+
+	len = strlen(body);
+	snprintf(header, sizeof(header),
+		 "HTTP/1.0 %s\r\n"
+		 "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+		 "Content-Length: %zu\r\n"
+		 "Connection: close\r\n"
+		 "\r\n", status, len);
+
+	metrics_write(this->fd, header, strlen(header));
+	metrics_write(this->fd, body, len);
+}
+
+static int metrics_tcp_recv(rad_listen_t *this)
+{
+	listen_socket_t		*sock = this->data;
+	metrics_buffer_t	*mb = (void *) sock->packet;
+	ssize_t			r;
+	char			*path, *p;
+
+	if (!mb) {
+		mb = talloc_zero(sock, metrics_buffer_t);
+		sock->packet = (void *) mb;
+	}
+
+	r = read(this->fd, mb->buffer + mb->offset, sizeof(mb->buffer) - mb->offset - 1);
+	if (r <= 0) {
+		if ((r < 0) && ((errno == EINTR) || (errno == EAGAIN))) return 0;
+
+	do_close:
+		metrics_close_socket(this);
+		return 0;
+	}
+	mb->offset += r;
+	mb->buffer[mb->offset] = '\0';
+
+	/*
+	 *	Wait for the end of the headers.  We don't care what's
+	 *	in them.
+	 */
+	if (!strstr(mb->buffer, "\r\n\r\n") && !strstr(mb->buffer, "\n\n")) {
+		if (mb->offset < (sizeof(mb->buffer) - 1)) return 0;
+
+		metrics_respond(this, "431 Request Header Fields Too Large", "Request too large\n");
+		goto do_close;
+	}
+
+	if ((strncmp(mb->buffer, "GET ", 4) != 0)) {
+		metrics_respond(this, "405 Method Not Allowed", "Only GET is supported\n");
+		goto do_close;
+	}
+
+	path = mb->buffer + 4;
+	p = strpbrk(path, " ?\r\n");
+	if (p) *p = '\0';
+
+	if (strcmp(path, "/metrics") != 0) {
+		metrics_respond(this, "404 Not Found", "Metrics are at /metrics\n");
+		goto do_close;
+	}
+
+	p = metrics_body(NULL);
+	metrics_respond(this, "200 OK", p);
+	talloc_free(p);
+
+	goto do_close;
+}
+
+/*
+ *	Should never be called.  Responses are written by metrics_tcp_recv.
+ */
+static int metrics_tcp_send(UNUSED rad_listen_t *listener, UNUSED REQUEST *request)
+{
+	return 0;
+}
+
+static int metrics_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
+{
+	listen_socket_t *sock;
+
+	if (common_socket_parse(cs, this) < 0) return -1;
+
+#ifdef WITH_TLS
+	if (this->tls) {
+		cf_log_err_cs(cs, "TLS is not supported for metrics sockets");
+		return -1;
+	}
+#endif
+
+	sock = this->data;
+	if (sock->proto != IPPROTO_TCP) {
+		cf_log_err_cs(cs, "Metrics sockets require 'proto = tcp'");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int metrics_socket_encode(UNUSED rad_listen_t *listener, UNUSED REQUEST *request)
+{
+	return 0;
+}
+
+static int metrics_socket_decode(UNUSED rad_listen_t *listener, UNUSED REQUEST *request)
+{
+	return 0;
+}
+#endif	/* WITH_METRICS_SOCKET && WITH_TCP */
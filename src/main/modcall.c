@@ -653,6 +653,15 @@ static bool pass2_cond_callback(void *ctx, fr_cond_t *c)
 		 *	These guys can't have a paircompare fixup applied.
 		 */
 		c->pass2_fixup = PASS2_FIXUP_NONE;
+
+		/*
+		 *	The value exists now, so cast the RHS once,
+		 *	instead of on every evaluation.
+		 */
+		if ((map->rhs->type == TMPL_TYPE_UNPARSED) &&
+		    (tmpl_cast_in_place(map->rhs, map->lhs->tmpl_da->type, map->lhs->tmpl_da) == 0)) {
+			fr_cond_precast(c);
+		}
 		return true;
 	}
 
@@ -855,10 +864,14 @@ static bool pass2_cond_callback(void *ctx, fr_cond_t *c)
 	if ((map->lhs->type != TMPL_TYPE_ATTR) ||
 	    (map->lhs->tmpl_request != REQUEST_CURRENT) ||
 	    (map->lhs->tmpl_list != PAIR_LIST_REQUEST)) {
+		fr_cond_precast(c);
 		return true;
 	}
 
-	if (!radius_find_compare(map->lhs->tmpl_da)) return true;
+	if (!radius_find_compare(map->lhs->tmpl_da)) {
+		fr_cond_precast(c);
+		return true;
+	}
 
 	if (map->rhs->type == TMPL_TYPE_ATTR) {
 		cf_log_err(map->ci, "Cannot compare virtual attribute %s to another attribute",
@@ -889,6 +902,7 @@ static bool pass2_cond_callback(void *ctx, fr_cond_t *c)
 	 *	fr_pair_cmp().
 	 */
 	c->pass2_fixup = PASS2_PAIRCOMPARE;
+	c->precast = false;
 
 	return true;
 }
@@ -2927,3 +2941,296 @@ void modcall_append(modcallable *parent, modcallable *this)
 
 	add_child(g, this);
 }
+
+/*
+ *	Only MOD_SINGLE and MOD_XLAT are not groups.  Update, map,
+ *	break and return are groups which never have children.
+ */
+static inline modcallable *lower_children(modcallable *c)
+{
+	if ((c->type == MOD_SINGLE) || (c->type == MOD_XLAT)) return NULL;
+
+	return mod_callabletogroup(c)->children;
+}
+
+static size_t lower_count(modcallable *c)
+{
+	size_t count = 0;
+
+	for (; c != NULL; c = c->next) {
+		count++;
+		count += lower_count(lower_children(c));
+	}
+
+	return count;
+}
+
+#ifdef WITH_UNLANG
+/*
+ *	Types where "==" is plain equality of the value, so it's
+ *	safe to hash them.
+ */
+static ssize_t case_key(uint8_t const **key, PW_TYPE type, value_data_t const *data)
+{
+	switch (type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_OCTETS:
+		*key = data->octets;
+		return data->length;
+
+	case PW_TYPE_BYTE:
+		*key = &data->byte;
+		return sizeof(data->byte);
+
+	case PW_TYPE_SHORT:
+		*key = (uint8_t const *) &data->ushort;
+		return sizeof(data->ushort);
+
+	case PW_TYPE_INTEGER:
+		*key = (uint8_t const *) &data->integer;
+		return sizeof(data->integer);
+
+	case PW_TYPE_DATE:
+		*key = (uint8_t const *) &data->date;
+		return sizeof(data->date);
+
+	case PW_TYPE_SIGNED:
+		*key = (uint8_t const *) &data->sinteger;
+		return sizeof(data->sinteger);
+
+	case PW_TYPE_INTEGER64:
+		*key = (uint8_t const *) &data->integer64;
+		return sizeof(data->integer64);
+
+	case PW_TYPE_IPV4_ADDR:
+		*key = (uint8_t const *) &data->ipaddr;
+		return sizeof(data->ipaddr);
+
+	case PW_TYPE_IPV6_ADDR:
+		*key = (uint8_t const *) &data->ipv6addr;
+		return sizeof(data->ipv6addr);
+
+	case PW_TYPE_ETHERNET:
+		*key = data->ether;
+		return sizeof(data->ether);
+
+	case PW_TYPE_IFID:
+		*key = data->ifid;
+		return sizeof(data->ifid);
+
+	default:
+		return -1;
+	}
+}
+
+static uint32_t case_hash(void const *data)
+{
+	modcall_case_t const *a = data;
+	uint8_t const *key = NULL;
+	ssize_t len;
+
+	len = case_key(&key, a->type, a->data);
+	rad_assert(len >= 0);
+
+	return fr_hash(key, len);
+}
+
+static int case_cmp(void const *one, void const *two)
+{
+	modcall_case_t const *a = one, *b = two;
+
+	return value_data_cmp(a->type, a->data, b->type, b->data);
+}
+
+/*
+ *	Build the case table for a switch over an attribute, so the
+ *	interpreter can find the matching case without evaluating
+ *	each one in turn.  If any case isn't a static value of the
+ *	attribute's type, we leave the switch to the linear search.
+ */
+static void lower_switch(modgroup *g, modcall_insn_t *insn)
+{
+	modcall_insn_t *this;
+	modcall_case_t *entry;
+	modgroup *h;
+	PW_TYPE type;
+	uint8_t const *key;
+	unsigned int order = 0;
+
+	TALLOC_FREE(g->cases);
+
+	if (g->vpt->type != TMPL_TYPE_ATTR) return;
+	type = g->vpt->tmpl_da->type;
+
+	for (this = insn->child; this != NULL; this = this->next) {
+		h = mod_callabletogroup(this->c);
+		if (!h->vpt) continue;
+
+		if ((h->vpt->type != TMPL_TYPE_DATA) ||
+		    (h->vpt->tmpl_data_type != type) ||
+		    (case_key(&key, type, &h->vpt->tmpl_data_value) < 0)) return;
+	}
+
+	g->cases = fr_hash_oa_create(g, case_hash, case_cmp, NULL);
+	if (!g->cases) return;
+
+	for (this = insn->child; this != NULL; this = this->next, order++) {
+		h = mod_callabletogroup(this->c);
+		if (!h->vpt) continue;
+
+		entry = talloc_zero(g->cases, modcall_case_t);
+		if (!entry) {
+		error:
+			TALLOC_FREE(g->cases);
+			return;
+		}
+		entry->type = type;
+		entry->data = &h->vpt->tmpl_data_value;
+		entry->order = order;
+		entry->insn = this;
+
+		/*
+		 *	Duplicate values can only ever match the
+		 *	first case with that value.
+		 */
+		if (!fr_hash_oa_insert(g->cases, entry)) {
+			if (fr_hash_oa_finddata(g->cases, entry)) {
+				talloc_free(entry);
+				continue;
+			}
+			goto error;
+		}
+	}
+}
+#endif
+
+#ifdef WITH_UNLANG
+/*
+ *	Whether anything in a foreach body may add, remove or
+ *	modify attributes in the list the foreach is iterating
+ *	over.  Modules can change anything, so any module call
+ *	counts.  Conditions and xlats only read the request.
+ */
+static bool foreach_body_modifies(vp_tmpl_t const *vpt, modcallable *c)
+{
+	vp_map_t *map;
+
+	for (; c != NULL; c = c->next) {
+		switch (c->type) {
+		case MOD_SINGLE:
+			return true;
+
+		case MOD_XLAT:
+			continue;
+
+		case MOD_UPDATE:
+		case MOD_MAP:
+			for (map = mod_callabletogroup(c)->map; map != NULL; map = map->next) {
+				vp_tmpl_t const *lhs = map->lhs;
+
+				if ((lhs->type != TMPL_TYPE_ATTR) && (lhs->type != TMPL_TYPE_LIST)) return true;
+				if (lhs->tmpl_list != vpt->tmpl_list) continue;
+
+				/*
+				 *	"outer" and "parent" may be the
+				 *	current request, so only different
+				 *	lists are known to be safe.
+				 */
+				if ((lhs->tmpl_request == vpt->tmpl_request) ||
+				    (lhs->tmpl_request != REQUEST_CURRENT) ||
+				    (vpt->tmpl_request != REQUEST_CURRENT)) return true;
+			}
+			continue;
+
+		default:
+			break;
+		}
+
+		if (foreach_body_modifies(vpt, lower_children(c))) return true;
+	}
+
+	return false;
+}
+#endif
+
+/*
+ *	Lower one block (a list of siblings) starting at "p", returning
+ *	the first unused instruction.
+ */
+static modcall_insn_t *lower_block(modcall_insn_t *p, modcallable *c)
+{
+	modcall_insn_t *insn, *prev = NULL, *chain = NULL, *i;
+	modcallable *children;
+
+	for (; c != NULL; c = c->next) {
+		insn = p++;
+
+		insn->type = c->type;
+		insn->c = c;
+		memcpy(insn->actions, c->actions, sizeof(insn->actions));
+		if (prev) prev->next = insn;
+		prev = insn;
+
+		/*
+		 *	A taken "if" or "elsif" jumps over the rest of
+		 *	its chain, so resolve the chain once we see the
+		 *	first instruction which isn't part of it.  If
+		 *	the chain ends the block, "skip" stays NULL.
+		 */
+#ifdef WITH_UNLANG
+		if (chain && (c->type != MOD_ELSIF) && (c->type != MOD_ELSE)) {
+			for (i = chain; i != insn; i = i->next) i->skip = insn;
+			chain = NULL;
+		}
+		if (c->type == MOD_IF) chain = insn;
+#endif
+
+		children = lower_children(c);
+		if (children) {
+			insn->child = p;
+			p = lower_block(p, children);
+		}
+
+#ifdef WITH_UNLANG
+		if (c->type == MOD_SWITCH) lower_switch(mod_callabletogroup(c), insn);
+
+		if (c->type == MOD_FOREACH) {
+			modgroup *g = mod_callabletogroup(c);
+
+			g->foreach_inplace = !foreach_body_modifies(g->vpt, children);
+		}
+#endif
+	}
+
+	return p;
+}
+
+/** Lower a compiled section into a flat array of instructions
+ *
+ * @param root of the section, as returned by modcall_compile() or modcall_compile_section().
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int modcall_lower(modcallable *root)
+{
+	modgroup *g;
+	modcall_insn_t *insn;
+	size_t count;
+
+	g = mod_callabletogroup(root);
+
+	count = lower_count(root);
+	insn = talloc_zero_array(g, modcall_insn_t, count);
+	if (!insn) return -1;
+
+	if (lower_block(insn, root) != (insn + count)) {
+		talloc_free(insn);
+		return -1;
+	}
+
+	talloc_free(g->insn);
+	g->insn = insn;
+
+	return 0;
+}
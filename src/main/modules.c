@@ -40,15 +40,35 @@ typedef struct indexed_modcallable {
 	modcallable		*modulelist;
 } indexed_modcallable;
 
-typedef struct virtual_server_t {
-	char const	*name;
-	CONF_SECTION	*cs;
-	rbtree_t	*components;
-	modcallable	*mc[MOD_COUNT];
-	CONF_SECTION	*subcs[MOD_COUNT];
-} virtual_server_t;
+/** Perfect hash of the Auth-Type, Autz-Type etc. sub-sections of one component
+ *
+ * The indexes are the values of those attributes, which define_type() picks
+ * at random, so they can't be used to index an array directly.  Instead we
+ * pick a multiplier which sends each index to a different slot, and a lookup
+ * is a multiply, a shift, and one compare.
+ */
+typedef struct indexed_modcallable_hash {
+	uint32_t		mult;		//!< Maps an index to its slot.
+	uint8_t			shift;		//!< 32 - log2(number of slots).
+	indexed_modcallable	**slots;	//!< NULL if the component has no sub-sections.
+} indexed_modcallable_hash_t;
+
+typedef struct virtual_server_t virtual_server_t;
+struct virtual_server_t {
+	char const		*name;
+	CONF_SECTION		*cs;
+	rbtree_t		*components;	//!< Used whilst loading the server.
+	indexed_modcallable_hash_t subcomp[MOD_COUNT];	//!< Used when running it.
+	modcallable		*mc[MOD_COUNT];
+	CONF_SECTION		*subcs[MOD_COUNT];
+	virtual_server_t	*reloaded;	//!< Newer version of this server, compiled on HUP.
+#ifdef WITH_STATS
+	fr_stats_latency_t	*latency[MOD_COUNT];	//!< How long each section takes.
+	fr_stats_alloc_t	alloc;			//!< Memory the sections left in requests.
+#endif
+};
 
-static rbtree_t *module_tree = NULL;
+static fr_hash_rcu_t *module_tree = NULL;
 
 struct fr_module_hup_t {
 	module_instance_t	*mi;
@@ -285,11 +305,55 @@ char const *lt_dlerror(void)
 static virtual_server_t *virtual_server_find(char const *name)
 {
 	CONF_SECTION *cs;
+	virtual_server_t *server;
 
 	cs = cf_section_sub_find_name2(main_config.config, "server", name);
 	if (!cs) return NULL;
 
-	return (virtual_server_t *) cf_data_find(cs, name);
+	server = cf_data_find(cs, name);
+	if (!server) return NULL;
+
+	/*
+	 *	Servers are only ever replaced, never freed, so
+	 *	the chain can be walked without locking.
+	 */
+	while (server->reloaded) server = server->reloaded;
+
+	return server;
+}
+
+/*
+ *	The last server each thread ran.  Tunnelled EAP methods run
+ *	the same inner server over and over, so this saves a couple
+ *	of tree lookups per section they call.
+ */
+fr_thread_local_setup(virtual_server_t *, virtual_server_last)	/* macro */
+fr_thread_local_setup(CONF_SECTION *, virtual_server_last_config)	/* macro */
+
+/** Find a virtual server, checking the one this thread last used first
+ *
+ * The cached server is only used if the main config hasn't been
+ * swapped since it was found.  Servers re-compiled on HUP are
+ * found by following the reloaded chain, as with #virtual_server_find.
+ */
+static virtual_server_t *virtual_server_find_cached(char const *name)
+{
+	virtual_server_t *server;
+
+	server = fr_thread_local_get(virtual_server_last);
+	if (server && (fr_thread_local_get(virtual_server_last_config) == main_config.config) &&
+	    name && server->name && (strcmp(server->name, name) == 0)) {
+		while (server->reloaded) server = server->reloaded;
+		return server;
+	}
+
+	server = virtual_server_find(name);
+	if (server) {
+		(void) fr_thread_local_set(virtual_server_last, server);
+		(void) fr_thread_local_set(virtual_server_last_config, main_config.config);
+	}
+
+	return server;
 }
 
 static int _virtual_server_free(virtual_server_t *server)
@@ -386,6 +450,13 @@ static int module_entry_cmp(void const *one, void const *two)
 	return strcmp(a->name, b->name);
 }
 
+static uint32_t module_entry_hash(void const *data)
+{
+	module_entry_t const *entry = data;
+
+	return fr_hash_string(entry->name);
+}
+
 /*
  *	Free a module entry.
  */
@@ -411,7 +482,7 @@ static int _module_entry_free(module_entry_t *this)
  */
 int modules_free(void)
 {
-	rbtree_free(module_tree);
+	fr_hash_rcu_free(module_tree);
 
 	return 0;
 }
@@ -432,7 +503,7 @@ static module_entry_t *module_dlopen(CONF_SECTION *cs)
 	name1 = cf_section_name1(cs);
 
 	myentry.name = name1;
-	node = rbtree_finddata(module_tree, &myentry);
+	node = fr_hash_rcu_finddata(module_tree, &myentry);
 	if (node) return node;
 
 	/*
@@ -490,7 +561,7 @@ static module_entry_t *module_dlopen(CONF_SECTION *cs)
 	 *	Add the module as "rlm_foo-version" to the configuration
 	 *	section.
 	 */
-	if (!rbtree_insert(module_tree, node)) {
+	if (!fr_hash_rcu_insert(module_tree, node)) {
 		ERROR("Failed to cache module %s", module_name);
 		dlclose(handle);
 		talloc_free(node);
@@ -503,7 +574,7 @@ static module_entry_t *module_dlopen(CONF_SECTION *cs)
 /** Parse module's configuration section and setup destructors
  *
  */
-static int module_conf_parse(module_instance_t *node, void **handle)
+static int module_conf_parse(module_instance_t *node, CONF_SECTION *cs, void **handle)
 {
 	*handle = NULL;
 
@@ -519,8 +590,8 @@ static int module_conf_parse(module_instance_t *node, void **handle)
 				node->entry->module->name ? node->entry->module->name : "config");
 
 		if (node->entry->module->config &&
-		    (cf_section_parse(node->cs, *handle, node->entry->module->config) < 0)) {
-			cf_log_err_cs(node->cs,"Invalid configuration for module \"%s\"", node->name);
+		    (cf_section_parse(cs, *handle, node->entry->module->config) < 0)) {
+			cf_log_err_cs(cs, "Invalid configuration for module \"%s\"", node->name);
 			talloc_free(*handle);
 
 			return -1;
@@ -601,10 +672,16 @@ static module_instance_t *module_bootstrap(CONF_SECTION *modules, CONF_SECTION *
 	cf_log_module(cs, "Loading module \"%s\" from file %s", node->name,
 		      cf_section_filename(cs));
 
+#ifdef WITH_STATS
+	for (i = 0; i < MOD_COUNT; i++) {
+		if (node->entry->module->methods[i]) node->latency[i] = fr_stats_latency_alloc(node);
+	}
+#endif
+
 	/*
 	 *	Parse the modules configuration.
 	 */
-	if (module_conf_parse(node, &node->insthandle) < 0) {
+	if (module_conf_parse(node, node->cs, &node->insthandle) < 0) {
 		talloc_free(node);
 		return NULL;
 	}
@@ -649,6 +726,132 @@ module_instance_t *module_find(CONF_SECTION *modules, char const *askedname)
 }
 
 
+#ifdef HAVE_PTHREAD_H
+/** Maximum number of threads used to instantiate modules
+ *
+ */
+#define MODULES_INSTANTIATE_THREADS	(16)
+
+/** A thread instantiating modules in parallel
+ *
+ */
+typedef struct module_instantiate_worker {
+	pthread_t		thread;
+	module_instance_t	*waiting_for;		//!< Module being instantiated by another worker
+							//!< which this worker is waiting on.
+} module_instantiate_worker_t;
+
+/*
+ *	Module instantiation is serialised by instantiate_mutex.  Workers
+ *	only release it when they're waiting on a module another worker is
+ *	instantiating, or when a connection pool is opening its initial
+ *	connections.  That's where startup time goes, and it means the
+ *	instantiate callbacks themselves never run concurrently.
+ */
+static pthread_mutex_t			instantiate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t			instantiate_cond = PTHREAD_COND_INITIALIZER;
+static module_instantiate_worker_t	*instantiate_workers = NULL;
+static int				instantiate_workers_num = 0;
+
+static CONF_SECTION			*instantiate_modules = NULL;
+static CONF_ITEM			*instantiate_next = NULL;	//!< Next module section to instantiate.
+static int				instantiate_ret = 0;
+
+/** Find the worker struct for the current thread
+ *
+ * @return
+ *	- The worker, if modules are being instantiated in parallel.
+ *	- NULL if they're not, or the caller isn't a worker.
+ */
+static module_instantiate_worker_t *module_instantiate_worker_self(void)
+{
+	int i;
+
+	if (!instantiate_workers) return NULL;
+
+	for (i = 0; i < instantiate_workers_num; i++) {
+		if (pthread_equal(instantiate_workers[i].thread, pthread_self())) return &instantiate_workers[i];
+	}
+
+	return NULL;
+}
+
+/** Allow other modules to instantiate whilst the current one blocks
+ *
+ * Must be paired with #modules_instantiate_resume.  Does nothing unless
+ * called from a thread instantiating modules in parallel.
+ */
+void modules_instantiate_yield(void)
+{
+	if (!module_instantiate_worker_self()) return;
+
+	pthread_mutex_unlock(&instantiate_mutex);
+}
+
+/** Re-acquire the instantiation lock released by #modules_instantiate_yield
+ *
+ */
+void modules_instantiate_resume(void)
+{
+	if (!module_instantiate_worker_self()) return;
+
+	pthread_mutex_lock(&instantiate_mutex);
+}
+#endif
+
+/** Mark a module as no longer being instantiated, and wake up anything waiting on it
+ *
+ */
+static void module_instantiate_done(module_instance_t *node)
+{
+	node->instantiating = false;
+
+#ifdef HAVE_PTHREAD_H
+	node->instantiator = NULL;
+	if (instantiate_workers) pthread_cond_broadcast(&instantiate_cond);
+#endif
+}
+
+/** Wait for a module which is already being instantiated
+ *
+ * If the module is being instantiated by another worker, block until it's done.
+ * Otherwise the module must (indirectly) reference itself, which is an error.
+ *
+ * @param[in] node	being instantiated.
+ * @return
+ *	- The module, if it was instantiated successfully.
+ *	- NULL on error.
+ */
+static module_instance_t *module_instantiate_wait(module_instance_t *node)
+{
+#ifdef HAVE_PTHREAD_H
+	module_instantiate_worker_t *self, *worker;
+
+	self = module_instantiate_worker_self();
+	if (self) {
+		/*
+		 *	Follow the chain of workers waiting on each other.
+		 *	If it leads back to us, we'd wait forever.
+		 */
+		for (worker = node->instantiator;
+		     worker && (worker != self);
+		     worker = worker->waiting_for ? worker->waiting_for->instantiator : NULL);
+
+		if (!worker) {
+			self->waiting_for = node;
+			while (node->instantiating) pthread_cond_wait(&instantiate_cond, &instantiate_mutex);
+			self->waiting_for = NULL;
+
+			return node->instantiated ? node : NULL;
+		}
+	}
+#endif
+
+	cf_log_err_cs(node->cs, "Circular reference to module \"%s\"", node->name);
+
+	return NULL;
+}
+
 /** Load a module, and instantiate it.
  *
  */
@@ -670,6 +873,16 @@ module_instance_t *module_instantiate(CONF_SECTION *modules, char const *askedna
 	 */
 	if (node->instantiated) return node;
 
+	/*
+	 *	Something else is instantiating the module.
+	 */
+	if (node->instantiating) return module_instantiate_wait(node);
+
+	node->instantiating = true;
+#ifdef HAVE_PTHREAD_H
+	node->instantiator = module_instantiate_worker_self();
+#endif
+
 	/*
 	 *	Now that ALL modules are instantiated, and ALL xlats
 	 *	are defined, go compile the config items marked as XLAT.
@@ -677,7 +890,7 @@ module_instance_t *module_instantiate(CONF_SECTION *modules, char const *askedna
 	if (node->entry->module->config &&
 	    (cf_section_parse_pass2(node->cs, node->insthandle,
 				    node->entry->module->config) < 0)) {
-		return NULL;
+		goto error;
 	}
 
 	/*
@@ -693,6 +906,8 @@ module_instance_t *module_instantiate(CONF_SECTION *modules, char const *askedna
 		if ((node->entry->module->instantiate)(node->cs, node->insthandle) < 0) {
 			cf_log_err_cs(node->cs, "Instantiation failed for module \"%s\"", node->name);
 
+		error:
+			module_instantiate_done(node);
 			return NULL;
 		}
 	}
@@ -716,6 +931,8 @@ module_instance_t *module_instantiate(CONF_SECTION *modules, char const *askedna
 	node->instantiated = true;
 	node->last_hup = time(NULL); /* don't let us load it, then immediately hup it */
 
+	module_instantiate_done(node);
+
 	return node;
 }
 
@@ -878,6 +1095,112 @@ static indexed_modcallable *lookup_by_index(rbtree_t *components,
 	return rbtree_finddata(components, &myc);
 }
 
+static inline indexed_modcallable *lookup_by_hash(indexed_modcallable_hash_t const *hash, int idx)
+{
+	indexed_modcallable *c;
+
+	if (!hash->slots) return NULL;
+
+	c = hash->slots[((uint32_t) idx * hash->mult) >> hash->shift];
+	if (!c || (c->idx != idx)) return NULL;
+
+	return c;
+}
+
+/*
+ *	Build the perfect hash for one component, from the
+ *	sub-sections in list.
+ */
+static void indexed_modcallable_hash_build(TALLOC_CTX *ctx, indexed_modcallable_hash_t *hash,
+					   indexed_modcallable **list, int num)
+{
+	int bits, tries, i;
+
+	/*
+	 *	Start with at least twice as many slots as entries.
+	 *	Each time we fail to find a multiplier, double the
+	 *	number of slots.  With 2^32 slots any odd multiplier
+	 *	works, so this always terminates.
+	 */
+	for (bits = 1; (1 << bits) < (num * 2); bits++);
+
+	for (;;) {
+		hash->slots = talloc_zero_array(ctx, indexed_modcallable *, (size_t) 1 << bits);
+		hash->shift = 32 - bits;
+
+		for (tries = 0; tries < 64; tries++) {
+			hash->mult = fr_rand() | 1;
+
+			for (i = 0; i < num; i++) {
+				indexed_modcallable **slot;
+
+				slot = &hash->slots[((uint32_t) list[i]->idx * hash->mult) >> hash->shift];
+				if (*slot) break;
+				*slot = list[i];
+			}
+			if (i == num) return;
+
+			memset(hash->slots, 0, sizeof(hash->slots[0]) << bits);
+		}
+
+		talloc_free(hash->slots);
+		bits++;
+	}
+}
+
+static int _virtual_server_collect(void *ctx, void *data)
+{
+	indexed_modcallable ***p = ctx;
+
+	*(*p)++ = data;
+
+	return 0;
+}
+
+/*
+ *	Build the perfect hashes for all of the components, so
+ *	that indexed_modcall() doesn't have to search the tree.
+ */
+static int virtual_server_hash_build(virtual_server_t *server)
+{
+	indexed_modcallable **list, **end;
+	indexed_modcallable **p;
+	uint32_t num;
+
+	num = rbtree_num_elements(server->components);
+	if (num == 0) return 0;
+
+	list = end = talloc_array(NULL, indexed_modcallable *, num);
+	if (!list) return -1;
+
+	/*
+	 *	In order, so the entries for each component are
+	 *	together, with index 0 (if any) first.
+	 */
+	if (rbtree_walk(server->components, RBTREE_IN_ORDER, _virtual_server_collect, &end) != 0) {
+		talloc_free(list);
+		return -1;
+	}
+
+	for (p = list; p < end; ) {
+		rlm_components_t comp = (*p)->comp;
+		indexed_modcallable **q;
+
+		/*
+		 *	Index 0 is cached in server->mc[].
+		 */
+		if ((*p)->idx == 0) p++;
+
+		for (q = p; (q < end) && ((*q)->comp == comp); q++);
+
+		if (q > p) indexed_modcallable_hash_build(server, &server->subcomp[comp], p, q - p);
+		p = q;
+	}
+
+	talloc_free(list);
+	return 0;
+}
+
 /*
  *	Create a new sublist.
  */
@@ -921,11 +1244,15 @@ rlm_rcode_t indexed_modcall(rlm_components_t comp, int idx, REQUEST *request)
 	rlm_rcode_t rcode;
 	modcallable *list = NULL;
 	virtual_server_t *server;
+	struct timeval start, end;
+#ifdef WITH_STATS
+	fr_stats_alloc_mark_t mark;
+#endif
 
 	/*
 	 *	Hack to find the correct virtual server.
 	 */
-	server = virtual_server_find(request->server);
+	server = virtual_server_find_cached(request->server);
 	if (!server) {
 		RDEBUG("No such virtual server \"%s\"", request->server);
 		return RLM_MODULE_FAIL;
@@ -944,7 +1271,7 @@ rlm_rcode_t indexed_modcall(rlm_components_t comp, int idx, REQUEST *request)
 	} else {
 		indexed_modcallable *this;
 
-		this = lookup_by_index(server->components, comp, idx);
+		this = lookup_by_hash(&server->subcomp[comp], idx);
 		if (this) {
 			list = this->modulelist;
 		} else {
@@ -974,7 +1301,37 @@ rlm_rcode_t indexed_modcall(rlm_components_t comp, int idx, REQUEST *request)
 	}
 	request->component = section_type_value[comp].section;
 
+	FR_TRACE(request, FR_TRACE_SECTION_ENTER, request->server, comp, 0, NULL);
+
+#ifdef WITH_STATS
+	fr_stats_alloc_start(&mark, request);
+#endif
+
+	gettimeofday(&start, NULL);
 	rcode = modcall(comp, list, request);
+	gettimeofday(&end, NULL);
+
+#ifdef WITH_STATS
+	fr_stats_alloc_end(&server->alloc, &mark);
+#endif
+
+	/*
+	 *	Sections can be run more than once, e.g. post-auth
+	 *	for a Challenge, and then a Reject.  Record the first
+	 *	start, and the last end.
+	 */
+	if (comp < REQUEST_MAX_SECTIONS) {
+		if (request->times.section_start[comp].tv_sec == 0) request->times.section_start[comp] = start;
+		request->times.section_end[comp] = end;
+	}
+
+#ifdef WITH_STATS
+	if (server->latency[comp]) fr_stats_latency_add(server->latency[comp], &start, &end);
+#endif
+	FR_PROFILE(request, FR_PROFILE_SECTION, server->name ? server->name : "default", section_type_value[comp].section,
+		   &start, &end);
+
+	FR_TRACE(request, FR_TRACE_SECTION_EXIT, request->server, comp, rcode, &start);
 
 	request->module = "";
 	request->component = "<core>";
@@ -1192,6 +1549,19 @@ static int load_component_section(CONF_SECTION *cs,
 	return 0;
 }
 
+/*
+ *	Lower each compiled section into the flat instruction array
+ *	which the interpreter runs.
+ */
+static int _virtual_server_lower(UNUSED void *ctx, void *data)
+{
+	indexed_modcallable *c = data;
+
+	if (!c->modulelist) return 0;
+
+	return modcall_lower(c->modulelist);
+}
+
 static int virtual_server_compile(CONF_SECTION *cs)
 {
 	rlm_components_t comp, found;
@@ -1265,6 +1635,9 @@ static int virtual_server_compile(CONF_SECTION *cs)
 		if (c) server->mc[comp] = c->modulelist;
 
 		server->subcs[comp] = subcs;
+#ifdef WITH_STATS
+		server->latency[comp] = fr_stats_latency_alloc(server);
+#endif
 
 		found = 1;
 	} /* loop over components */
@@ -1333,6 +1706,16 @@ static int virtual_server_compile(CONF_SECTION *cs)
 #endif
 	} while (0);
 
+	if (rbtree_walk(components, RBTREE_IN_ORDER, _virtual_server_lower, NULL) != 0) {
+		cf_log_err_cs(cs, "Failed lowering sections");
+		goto error;
+	}
+
+	if (virtual_server_hash_build(server) < 0) {
+		ERROR("Failed building component index");
+		goto error;
+	}
+
 	cf_log_info(cs, "} # server %s", name);
 
 	if (rad_debug_lvl == 0) {
@@ -1506,6 +1889,11 @@ int virtual_servers_bootstrap(CONF_SECTION *config)
 			char const *name1;
 
 			if (cf_item_is_pair(ci)) {
+				/*
+				 *	Used by the listeners, see listen_thread_pool().
+				 */
+				if (strcmp(cf_pair_attr(cf_item_to_pair(ci)), "thread_pool") == 0) continue;
+
 				cf_log_err(ci, "Cannot set variables inside of a virtual server.");
 				return -1;
 			}
@@ -1594,6 +1982,230 @@ int virtual_servers_init(CONF_SECTION *config)
 	return 0;
 }
 
+/** Reload a module using a new configuration
+ *
+ * @param[in] cs	the new configuration for the module.  May be the same as node->cs,
+ *			if files the module reads have changed.
+ * @param[in] node	the module instance to reload.
+ * @param[in] when	the HUP was received.
+ * @return
+ *	- 1 if the module was reloaded, or can't be reloaded.
+ *	- 0 if reloading failed, and the old instance is still in use.
+ */
+/** Recompile the virtual servers whose configuration has changed
+ *
+ * The new version of the server is linked to the running one, and is used
+ * for all new requests.  Requests already being processed continue to use
+ * the old version, which is never freed.
+ *
+ * @param[in] config	the newly read configuration.
+ * @return
+ *	- 0 on success.
+ *	- -1 if any server failed to compile.  The old version remains in use.
+ */
+int virtual_servers_hup(CONF_SECTION *config)
+{
+	CONF_SECTION *cs;
+	int ret = 0;
+
+	for (cs = cf_subsection_find_next(config, NULL, "server");
+	     cs != NULL;
+	     cs = cf_subsection_find_next(config, cs, "server")) {
+		char const *name = cf_section_name2(cs);
+		virtual_server_t *old, *server;
+
+		if (!name) continue;
+
+		old = virtual_server_find(name);
+		if (!old) {
+			WARN("Virtual server \"%s\" was added.  The server must be restarted to load it", name);
+			continue;
+		}
+
+		if (cf_section_equal(old->cs, cs)) {
+			DEBUG2("Virtual server \"%s\" is unchanged", name);
+			continue;
+		}
+
+		INFO("HUP - Reloading virtual server \"%s\"", name);
+		if (virtual_server_compile(cs) < 0) {
+			ERROR("HUP failed for virtual server \"%s\".  Using old configuration", name);
+			ret = -1;
+			continue;
+		}
+
+		server = cf_data_find(cs, name);
+		if (!server) {
+			ret = -1;
+			continue;
+		}
+
+#ifdef WITH_STATS
+		{
+			rlm_components_t comp;
+
+			/*
+			 *	Keep the history for sections which are
+			 *	still there.  The old server is never freed.
+			 */
+			for (comp = 0; comp < MOD_COUNT; comp++) {
+				if (!server->latency[comp] || !old->latency[comp]) continue;
+
+				talloc_free(server->latency[comp]);
+				server->latency[comp] = old->latency[comp];
+			}
+
+			server->alloc = old->alloc;
+		}
+#endif
+
+		old->reloaded = server;
+	}
+
+	return ret;
+}
+
+#ifdef WITH_STATS
+/** Call a function for the latency histogram of each section of each virtual server
+ *
+ * @param[in] walk	function to call.
+ * @param[in] ctx	to pass to the function.
+ */
+void virtual_servers_latency_walk(fr_stats_latency_walk_t walk, void *ctx)
+{
+	CONF_SECTION *cs;
+
+	for (cs = cf_subsection_find_next(main_config.config, NULL, "server");
+	     cs != NULL;
+	     cs = cf_subsection_find_next(main_config.config, cs, "server")) {
+		char const *name = cf_section_name2(cs);
+		virtual_server_t *server;
+		rlm_components_t comp;
+
+		if (!name) continue;
+
+		server = virtual_server_find(name);
+		if (!server) continue;
+
+		for (comp = 0; comp < MOD_COUNT; comp++) {
+			if (!server->latency[comp]) continue;
+
+			walk(ctx, name, section_type_value[comp].section, server->latency[comp]);
+		}
+	}
+}
+
+/** Call a function for the latency histogram of each method of each module instance
+ *
+ * @param[in] walk	function to call.
+ * @param[in] ctx	to pass to the function.
+ */
+void modules_latency_walk(fr_stats_latency_walk_t walk, void *ctx)
+{
+	CONF_SECTION *modules;
+	CONF_ITEM *ci;
+
+	modules = cf_section_sub_find(main_config.config, "modules");
+	if (!modules) return;
+
+	for (ci = cf_item_find_next(modules, NULL);
+	     ci != NULL;
+	     ci = cf_item_find_next(modules, ci)) {
+		char const *instance_name;
+		module_instance_t *node;
+		rlm_components_t comp;
+		CONF_SECTION *cs;
+
+		if (!cf_item_is_section(ci)) continue;
+
+		cs = cf_item_to_section(ci);
+
+		instance_name = cf_section_name2(cs);
+		if (!instance_name) instance_name = cf_section_name1(cs);
+
+		node = module_find(modules, instance_name);
+		if (!node) continue;
+
+		for (comp = 0; comp < MOD_COUNT; comp++) {
+			if (!node->latency[comp]) continue;
+
+			walk(ctx, node->name, section_type_value[comp].section, node->latency[comp]);
+		}
+	}
+}
+
+/** Call a function for the memory of each virtual server
+ *
+ * The memory held by each server is its configuration, and the
+ * sections compiled from it.
+ *
+ * @param[in] walk	function to call.
+ * @param[in] ctx	to pass to the function.
+ */
+void virtual_servers_alloc_walk(fr_stats_alloc_walk_t walk, void *ctx)
+{
+	CONF_SECTION *cs;
+
+	for (cs = cf_subsection_find_next(main_config.config, NULL, "server");
+	     cs != NULL;
+	     cs = cf_subsection_find_next(main_config.config, cs, "server")) {
+		char const *name = cf_section_name2(cs);
+		virtual_server_t *server;
+
+		if (!name) continue;
+
+		server = virtual_server_find(name);
+		if (!server) continue;
+
+		walk(ctx, name, &server->alloc, talloc_total_size(server->cs), talloc_total_blocks(server->cs));
+	}
+}
+
+/** Call a function for the memory of each module instance
+ *
+ * The memory held by each instance, e.g. caches and connection pools,
+ * is measured while other threads may be changing it, so this should
+ * only be called while memory accounting is enabled.
+ *
+ * @param[in] walk	function to call.
+ * @param[in] ctx	to pass to the function.
+ */
+void modules_alloc_walk(fr_stats_alloc_walk_t walk, void *ctx)
+{
+	CONF_SECTION *modules;
+	CONF_ITEM *ci;
+
+	modules = cf_section_sub_find(main_config.config, "modules");
+	if (!modules) return;
+
+	for (ci = cf_item_find_next(modules, NULL);
+	     ci != NULL;
+	     ci = cf_item_find_next(modules, ci)) {
+		char const *instance_name;
+		module_instance_t *node;
+		CONF_SECTION *cs;
+		size_t bytes = 0, blocks = 0;
+
+		if (!cf_item_is_section(ci)) continue;
+
+		cs = cf_item_to_section(ci);
+
+		instance_name = cf_section_name2(cs);
+		if (!instance_name) instance_name = cf_section_name1(cs);
+
+		node = module_find(modules, instance_name);
+		if (!node) continue;
+
+		if (node->insthandle) {
+			bytes = talloc_total_size(node->insthandle);
+			blocks = talloc_total_blocks(node->insthandle);
+		}
+
+		walk(ctx, node->name, &node->alloc, bytes, blocks);
+	}
+}
+#endif
+
 int module_hup_module(CONF_SECTION *cs, module_instance_t *node, time_t when)
 {
 	void *insthandle;
@@ -1619,13 +2231,20 @@ int module_hup_module(CONF_SECTION *cs, module_instance_t *node, time_t when)
 	 *	module's detach method is called when it's instance data is
 	 *	about to be freed.
 	 */
-	if (module_conf_parse(node, &insthandle) < 0) {
+	if (module_conf_parse(node, cs, &insthandle) < 0) {
+	parse_error:
 		cf_log_err_cs(cs, "HUP failed for module \"%s\" (parsing config failed). "
 			      "Using old configuration", node->name);
 
 		return 0;
 	}
 
+	if (node->entry->module->config &&
+	    (cf_section_parse_pass2(cs, insthandle, node->entry->module->config) < 0)) {
+		talloc_free(insthandle);
+		goto parse_error;
+	}
+
 	if ((node->entry->module->instantiate)(cs, insthandle) < 0) {
 		cf_log_err_cs(cs, "HUP failed for module \"%s\".  Using old configuration.", node->name);
 		talloc_free(insthandle);
@@ -1649,8 +2268,10 @@ int module_hup_module(CONF_SECTION *cs, module_instance_t *node, time_t when)
 
 	/*
 	 *	Replace the instance handle while the module is running.
+	 *	Later HUPs compare against the configuration we're now using.
 	 */
 	node->insthandle = insthandle;
+	node->cs = cs;
 
 	/*
 	 *	FIXME: Set a timeout to come back in 60s, so that
@@ -1660,16 +2281,26 @@ int module_hup_module(CONF_SECTION *cs, module_instance_t *node, time_t when)
 	return 1;
 }
 
-
+/** Reload the modules whose configuration has changed
+ *
+ * Modules with the same configuration as the running instance are left
+ * alone, so their connection pools stay warm.
+ *
+ * @param[in] modules section from the newly read configuration.
+ * @return 1.
+ */
 int modules_hup(CONF_SECTION *modules)
 {
 	time_t when;
 	CONF_ITEM *ci;
-	CONF_SECTION *cs;
+	CONF_SECTION *cs, *running;
 	module_instance_t *node;
 
 	if (!modules) return 0;
 
+	running = cf_section_sub_find(main_config.config, "modules");
+	if (!running) return 0;
+
 	when = time(NULL);
 
 	/*
@@ -1690,8 +2321,27 @@ int modules_hup(CONF_SECTION *modules)
 		instance_name = cf_section_name2(cs);
 		if (!instance_name) instance_name = cf_section_name1(cs);
 
-		node = module_find(modules, instance_name);
-		if (!node) continue;
+		/*
+		 *	Module instances are associated with the
+		 *	original "modules" section.
+		 */
+		node = module_find(running, instance_name);
+		if (!node) {
+			WARN("Module \"%s\" was added.  The server must be restarted to load it", instance_name);
+			continue;
+		}
+
+		if (cf_section_equal(node->cs, cs)) {
+			DEBUG2("Module \"%s\" is unchanged", node->name);
+			continue;
+		}
+
+		if (node->entry->module->bootstrap ||
+		    ((node->entry->module->type & RLM_TYPE_HUP_SAFE) == 0)) {
+			WARN("Module \"%s\" has changed, but can't be reloaded.  The server must be restarted "
+			     "to use the new configuration", node->name);
+			continue;
+		}
 
 		module_hup_module(cs, node, when);
 	}
@@ -1839,6 +2489,47 @@ fr_connection_pool_t *module_connection_pool_init(CONF_SECTION *module,
 	return pool;
 }
 
+#ifdef WITH_STATS
+/** Call a function for the connection pool of each module instance which has one
+ *
+ * Modules which share a pool each have it passed to the function.
+ *
+ * @param[in] walk	function to call.
+ * @param[in] ctx	to pass to the function.
+ */
+void modules_connection_pool_walk(module_connection_pool_walk_t walk, void *ctx)
+{
+	CONF_SECTION *modules;
+	CONF_ITEM *ci;
+
+	modules = cf_section_sub_find(main_config.config, "modules");
+	if (!modules) return;
+
+	for (ci = cf_item_find_next(modules, NULL);
+	     ci != NULL;
+	     ci = cf_item_find_next(modules, ci)) {
+		char const *instance_name;
+		fr_connection_pool_t *pool;
+		CONF_SECTION *cs;
+
+		if (!cf_item_is_section(ci)) continue;
+
+		cs = cf_item_to_section(ci);
+
+		instance_name = cf_section_name2(cs);
+		if (!instance_name) instance_name = cf_section_name1(cs);
+
+		cs = cf_section_sub_find(cs, "pool");
+		if (!cs) continue;
+
+		pool = cf_data_find(cs, CONNECTION_POOL_CF_KEY);
+		if (!pool) continue;
+
+		walk(ctx, instance_name, fr_connection_pool_state(pool));
+	}
+}
+#endif
+
 /*
  *	Parse the module config sections, and load
  *	and call each module's init() function.
@@ -1851,7 +2542,7 @@ int modules_bootstrap(CONF_SECTION *config)
 	/*
 	 *	Set up the internal module struct.
 	 */
-	module_tree = rbtree_create(NULL, module_entry_cmp, NULL, 0);
+	module_tree = fr_hash_rcu_create(NULL, module_entry_hash, module_entry_cmp, NULL);
 	if (!module_tree) {
 		ERROR("Failed to initialize modules\n");
 		return -1;
@@ -2038,6 +2729,92 @@ int modules_bootstrap(CONF_SECTION *config)
 	return 0;
 }
 
+#ifdef HAVE_PTHREAD_H
+/** Pull modules off the shared list and instantiate them
+ *
+ */
+static void *modules_init_thread(UNUSED void *arg)
+{
+	pthread_mutex_lock(&instantiate_mutex);
+
+	while ((instantiate_ret == 0) && instantiate_next) {
+		char const *name;
+		CONF_ITEM *ci = instantiate_next;
+		CONF_SECTION *subcs;
+
+		instantiate_next = cf_item_find_next(instantiate_modules, ci);
+
+		if (!cf_item_is_section(ci)) continue;
+
+		subcs = cf_item_to_section(ci);
+		name = cf_section_name2(subcs);
+		if (!name) name = cf_section_name1(subcs);
+
+		if (!module_instantiate(instantiate_modules, name)) instantiate_ret = -1;
+	}
+
+	pthread_mutex_unlock(&instantiate_mutex);
+
+	return NULL;
+}
+
+/** Instantiate the modules using a pool of worker threads
+ *
+ * Modules which reference other modules call #module_instantiate for them,
+ * and block until the referenced module has been instantiated, so the
+ * dependency order is the same as when instantiating serially.
+ *
+ * @param[in] modules section.
+ * @return
+ *	- 1 if no threads could be created, and the caller should instantiate serially.
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int modules_init_parallel(CONF_SECTION *modules)
+{
+	CONF_ITEM	*ci;
+	int		i, num = 0;
+
+	for (ci = cf_item_find_next(modules, NULL);
+	     ci != NULL;
+	     ci = cf_item_find_next(modules, ci)) {
+		if (cf_item_is_section(ci)) num++;
+	}
+	if (num < 2) return 1;
+	if (num > MODULES_INSTANTIATE_THREADS) num = MODULES_INSTANTIATE_THREADS;
+
+	instantiate_workers = talloc_zero_array(NULL, module_instantiate_worker_t, num);
+	if (!instantiate_workers) return 1;
+
+	instantiate_modules = modules;
+	instantiate_next = cf_item_find_next(modules, NULL);
+	instantiate_ret = 0;
+
+	/*
+	 *	Hold the mutex until all the workers have been
+	 *	created, so they can find themselves in the array.
+	 */
+	pthread_mutex_lock(&instantiate_mutex);
+	for (i = 0; i < num; i++) {
+		if (pthread_create(&instantiate_workers[i].thread, NULL, modules_init_thread, NULL) != 0) {
+			WARN("Failed creating module instantiation thread: %s", fr_syserror(errno));
+			break;
+		}
+	}
+	instantiate_workers_num = i;
+	pthread_mutex_unlock(&instantiate_mutex);
+
+	for (i = 0; i < instantiate_workers_num; i++) pthread_join(instantiate_workers[i].thread, NULL);
+
+	TALLOC_FREE(instantiate_workers);
+
+	if (instantiate_workers_num == 0) return 1;
+	instantiate_workers_num = 0;
+
+	return instantiate_ret;
+}
+#endif
+
 /** Instantiate the modules.
  *
  */
@@ -2049,6 +2826,19 @@ int modules_init(CONF_SECTION *config)
 	modules = cf_section_sub_find(config, "modules");
 	if (!modules) return 0;
 
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	Instantiate independent modules in parallel, so that
+	 *	slow connection pools don't delay each other.
+	 */
+	if (main_config.spawn_workers && !check_config) {
+		int ret;
+
+		ret = modules_init_parallel(modules);
+		if (ret <= 0) return ret;
+	}
+#endif
+
 	for (ci=cf_item_find_next(modules, NULL);
 	     ci != NULL;
 	     ci=next) {
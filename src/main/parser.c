@@ -105,14 +105,14 @@ next:
 		break;
 
 	case COND_TYPE_TRUE:
-		len = strlcpy(out, "true", outlen);
+		len = strlcpy(p, "true", end - p);
 		RETURN_IF_TRUNCATED(p, len, end - p);
-		return p - out;
+		break;
 
 	case COND_TYPE_FALSE:
-		len = strlcpy(out, "false", outlen);
+		len = strlcpy(p, "false", end - p);
 		RETURN_IF_TRUNCATED(p, len, end - p);
-		return p - out;
+		break;
 
 	default:
 		*out = '\0';
@@ -427,6 +427,121 @@ static bool condition_check_types(fr_cond_t *c, PW_TYPE lhs_type)
 #define return_rhs(_x) *error = _x;goto return_rhs
 #define return_SLEN goto return_slen
 
+/** Whether a condition node always evaluates to true or false
+ *
+ * i.e. it never returns an error, and has no side effects.  These are
+ * constants, module return codes, and existence checks for attributes
+ * which are already defined.  Xlats, execs, regexes and comparisons
+ * can all fail, or change the request.
+ */
+static bool condition_is_pure(fr_cond_t const *c)
+{
+	fr_cond_t const *child;
+
+	if (c->pass2_fixup != PASS2_FIXUP_NONE) return false;
+
+	switch (c->type) {
+	case COND_TYPE_TRUE:
+	case COND_TYPE_FALSE:
+		return true;
+
+	case COND_TYPE_EXISTS:
+		switch (c->data.vpt->type) {
+		case TMPL_TYPE_UNPARSED:
+		case TMPL_TYPE_ATTR:
+		case TMPL_TYPE_LIST:
+			return true;
+
+		default:
+			return false;
+		}
+
+	case COND_TYPE_CHILD:
+		for (child = c->data.child; child != NULL; child = child->next) {
+			if (!condition_is_pure(child)) return false;
+		}
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+
+/** Mark a condition as comparing an attribute directly with data
+ *
+ * Literals on the RHS of a condition are cast to the type of the LHS
+ * attribute when they're parsed.  If nothing is left to do at run time,
+ * each value of the attribute can be passed to value_data_cmp_op() along
+ * with the RHS data, instead of being cast on every evaluation.
+ *
+ * IP addresses compared with prefixes are included, because
+ * value_data_cmp_op() compares addresses with prefixes directly.
+ *
+ * Must be called again if the condition is changed in pass 2.
+ *
+ * @param[in] c to check.
+ */
+void fr_cond_precast(fr_cond_t *c)
+{
+	vp_map_t const	*map;
+	PW_TYPE		lhs_type, rhs_type;
+
+	c->precast = false;
+
+	if ((c->type != COND_TYPE_MAP) || (c->pass2_fixup != PASS2_FIXUP_NONE)) return;
+
+	map = c->data.map;
+	if ((map->lhs->type != TMPL_TYPE_ATTR) || (map->rhs->type != TMPL_TYPE_DATA)) return;
+
+	/*
+	 *	Virtual attributes are turned into xlats in pass 2.
+	 */
+	if (map->lhs->tmpl_da->flags.virtual) return;
+
+	switch (map->op) {
+	case T_OP_CMP_EQ:
+	case T_OP_NE:
+	case T_OP_LT:
+	case T_OP_LE:
+	case T_OP_GT:
+	case T_OP_GE:
+		break;
+
+	default:
+		return;
+	}
+
+	lhs_type = map->lhs->tmpl_da->type;
+	rhs_type = map->rhs->tmpl_data_type;
+
+	/*
+	 *	The only casts we can skip are the ones the parser adds
+	 *	for "Framed-IP-Address < 192.0.2.0/24".
+	 */
+	if (c->cast) {
+		if (c->cast->type != rhs_type) return;
+
+		switch (rhs_type) {
+		case PW_TYPE_IPV4_PREFIX:
+			if ((lhs_type != PW_TYPE_IPV4_ADDR) && (lhs_type != PW_TYPE_IPV4_PREFIX)) return;
+			break;
+
+		case PW_TYPE_IPV6_PREFIX:
+			if ((lhs_type != PW_TYPE_IPV6_ADDR) && (lhs_type != PW_TYPE_IPV6_PREFIX)) return;
+			break;
+
+		default:
+			if (lhs_type != rhs_type) return;
+			break;
+		}
+
+	} else if (lhs_type != rhs_type) {
+		return;
+	}
+
+	c->precast = true;
+}
 
 /** Tokenize a conditional check
  *
@@ -1619,6 +1734,8 @@ done:
 		}
 	}
 
+	if (c->type == COND_TYPE_MAP) fr_cond_precast(c);
+
 	/*
 	 *	!TRUE -> FALSE
 	 */
@@ -1689,6 +1806,40 @@ done:
 		c->next_op = COND_NONE;
 	}
 
+	/*
+	 *	The rest of the condition has already been
+	 *	simplified, so it may now be a bare "true" or "false".
+	 *
+	 *	FOO && true --> FOO
+	 *	FOO || false --> FOO
+	 */
+	if (c->next && !c->next->next &&
+	    (((c->next_op == COND_AND) && (c->next->type == COND_TYPE_TRUE)) ||
+	     ((c->next_op == COND_OR) && (c->next->type == COND_TYPE_FALSE)))) {
+		TALLOC_FREE(c->next);
+		c->next_op = COND_NONE;
+	}
+
+	/*
+	 *	FOO && false --> false
+	 *	FOO || true --> true
+	 *
+	 *	But only if FOO doesn't need to be evaluated.
+	 */
+	if (c->next && !c->next->next &&
+	    (((c->next_op == COND_AND) && (c->next->type == COND_TYPE_FALSE)) ||
+	     ((c->next_op == COND_OR) && (c->next->type == COND_TYPE_TRUE))) &&
+	    condition_is_pure(c)) {
+		fr_cond_t *next;
+
+		next = talloc_steal(ctx, c->next);
+		c->next = NULL;
+
+		lhs = rhs = NULL;
+		talloc_free(c);
+		c = next;
+	}
+
 	if (lhs) talloc_free(lhs);
 	if (rhs) talloc_free(rhs);
 
@@ -46,11 +46,17 @@ RCSID("$Id$")
 
 extern pid_t radius_pid;
 extern fr_cond_t *debug_condition;
+extern fr_cond_t *trace_condition;
 
 static bool spawn_workers = false;
 static bool just_started = true;
 time_t fr_start_time = (time_t)-1;
-static rbtree_t *pl = NULL;
+
+/*
+ *	Live requests, for duplicate detection.  Only the main thread
+ *	touches it, so there's no lock.
+ */
+static fr_hash_oa_t *pl = NULL;
 static fr_event_list_t *el = NULL;
 
 fr_event_list_t *radius_event_list_corral(UNUSED event_corral_t hint) {
@@ -410,6 +416,19 @@ static void tv_add(struct timeval *tv, int usec_delay)
  *
  ***********************************************************************/
 
+/*
+ *	The response window for the home server, either as configured,
+ *	or as derived from its response times.
+ */
+static struct timeval *home_response_window(home_server_t *home)
+{
+	if (home->adaptive_window && timerisset(&home->adaptive_response_window)) {
+		return &home->adaptive_response_window;
+	}
+
+	return &home->response_window;
+}
+
 static struct timeval *request_response_window(REQUEST *request)
 {
 	VERIFY_REQUEST(request);
@@ -420,17 +439,17 @@ static struct timeval *request_response_window(REQUEST *request)
 		 *	either the home server one, if set, or the global one.
 		 */
 		if (!timerisset(&request->client->response_window)) {
-			return &request->home_server->response_window;
+			return home_response_window(request->home_server);
 		}
 
 		if (timercmp(&request->client->response_window,
-			     &request->home_server->response_window, <)) {
+			     home_response_window(request->home_server), <)) {
 			return &request->client->response_window;
 		}
 	}
 
 	rad_assert(request->home_server != NULL);
-	return &request->home_server->response_window;
+	return home_response_window(request->home_server);
 }
 
 /*
@@ -474,7 +493,7 @@ static void request_timer(void *ctx, UNUSED struct timeval *now)
 
 /*
  *	Wrapper for talloc pools.  If there's no parent, just free the
- *	request.  If there is a parent, free the parent INSTEAD of the
+ *	request.  If there is a parent, free (or re-use) the parent INSTEAD of the
  *	request.
  */
 static void request_free(REQUEST *request)
@@ -492,7 +511,7 @@ static void request_free(REQUEST *request)
 
 	ptr = talloc_parent(request);
 	rad_assert(ptr != NULL);
-	talloc_free(ptr);
+	listen_pool_free(request, ptr);
 }
 
 
@@ -640,7 +659,7 @@ static void request_done(REQUEST *request, int action)
 	 *	Remove it from the request hash.
 	 */
 	if (request->in_request_hash) {
-		if (!rbtree_deletebydata(pl, &request->packet)) {
+		if (!fr_hash_oa_delete(pl, &request->packet)) {
 			rad_assert(0 == 1);
 		}
 		request->in_request_hash = false;
@@ -715,6 +734,9 @@ static void request_done(REQUEST *request, int action)
 	rad_assert(request->child_pid == NO_SUCH_CHILD_PID);
 #endif
 
+	FR_TRACE(request, FR_TRACE_REQUEST_DONE, request->server, request->reply ? request->reply->code : 0, 0,
+		 &request->packet->timestamp);
+
 	/*
 	 *	@todo: do final states for TCP sockets, too?
 	 */
@@ -869,6 +891,16 @@ static bool request_max_time(REQUEST *request)
 			      request->component ? request->component : "<core>",
 			      request->module ? request->module : "<core>");
 			trigger_exec(request, NULL, "server.thread.unresponsive", true, NULL);
+
+			/*
+			 *	If the child is blocked in a backend
+			 *	call, abort it, so that the thread and
+			 *	the connection are freed up.
+			 */
+			if (request_cancel(request)) {
+				ERROR("Cancelled backend call for request %u in module %s",
+				      request->number, request->module ? request->module : "<core>");
+			}
 		}
 #endif
 		/*
@@ -1126,6 +1158,7 @@ static void request_response_delay(REQUEST *request, int action)
 
 		RDEBUG2("Sending delayed response");
 		request->listener->debug(request, request->reply, false);
+		gettimeofday(&request->times.reply_sent, NULL);
 		request->listener->send(request->listener, request);
 
 		/*
@@ -1164,7 +1197,7 @@ static int request_pre_handler(REQUEST *request, UNUSED int action)
 		return 1;
 	}
 
-	if (!request->packet->vps) { /* FIXME: check for correct state */
+	if (!request->packet->vps && !request->packet->pending) { /* FIXME: check for correct state */
 		rcode = request->listener->decode(request->listener, request);
 
 #ifdef WITH_UNLANG
@@ -1178,8 +1211,20 @@ static int request_pre_handler(REQUEST *request, UNUSED int action)
 				request->log.output = &debug_log;
 			}
 		}
+
+		if (trace_condition && radius_evaluate_cond(request, RLM_MODULE_OK, 0, trace_condition)) {
+			request->trace = true;
+			FR_TRACE(request, FR_TRACE_REQUEST_START, request->server, request->packet->code, 0, NULL);
+		}
 #endif
 
+		request->profile = fr_profile_sample();
+
+		/*
+		 *	Lazily decoded packets are printed in full.
+		 */
+		if ((rcode == 0) && RDEBUG_ENABLED) (void) request_decode_pending(request, NULL);
+
 		request->listener->debug(request, request->packet, true);
 	} else {
 		rcode = 0;
@@ -1192,6 +1237,7 @@ static int request_pre_handler(REQUEST *request, UNUSED int action)
 	}
 
 	if (!request->username) {
+		(void) request_decode_pending(request, fr_dict_attr_by_num(NULL, 0, PW_USER_NAME));
 		request->username = fr_pair_find_by_num(request->packet->vps, 0, PW_USER_NAME, TAG_ANY);
 	}
 
@@ -1254,6 +1300,7 @@ static void request_finish(REQUEST *request, int action)
 	/*
 	 *	Copy Proxy-State from the request to the reply.
 	 */
+	(void) request_decode_pending(request, fr_dict_attr_by_num(NULL, 0, PW_PROXY_STATE));
 	vp = fr_pair_list_copy_by_num(request->reply, request->packet->vps, 0, PW_PROXY_STATE, TAG_ANY);
 	if (vp) fr_pair_add(&request->reply->vps, vp);
 
@@ -1298,6 +1345,8 @@ static void request_finish(REQUEST *request, int action)
 	 */
 	gettimeofday(&request->reply->timestamp, NULL);
 
+	FR_PROBE3(request_finish, request->number, request->packet->code, request->reply->code);
+
 	/*
 	 *	Fake packets get marked as "done", and have the
 	 *	proxy-reply section deal with the reply attributes.
@@ -1412,6 +1461,7 @@ static void request_finish(REQUEST *request, int action)
 		 */
 		if (request->reply->code != 0) {
 			request->listener->debug(request, request->reply, false);
+			gettimeofday(&request->times.reply_sent, NULL);
 			request->listener->send(request->listener, request);
 		}
 
@@ -1551,10 +1601,16 @@ int request_receive(TALLOC_CTX *ctx, rad_listen_t *listener, RADIUS_PACKET *pack
 
 	/*
 	 *	Skip everything if required.
+	 *
+	 *	Synchronous listeners finish each request before
+	 *	reading the next packet, so there is never a live
+	 *	request to be a duplicate of.  They may also be run
+	 *	from multiple worker threads, and the request list
+	 *	isn't thread-safe.
 	 */
-	if (listener->nodup) goto skip_dup;
+	if (listener->nodup || listener->synchronous) goto skip_dup;
 
-	packet_p = rbtree_finddata(pl, &packet);
+	packet_p = fr_hash_oa_finddata(pl, &packet);
 	if (packet_p) {
 		rad_child_state_t child_state;
 
@@ -1640,7 +1696,7 @@ int request_receive(TALLOC_CTX *ctx, rad_listen_t *listener, RADIUS_PACKET *pack
 	 *	Quench maximum number of outstanding requests.
 	 */
 	if (main_config.max_requests &&
-	    ((count = rbtree_num_elements(pl)) > main_config.max_requests)) {
+	    ((count = fr_hash_oa_num_elements(pl)) > main_config.max_requests)) {
 		RATE_LIMIT(ERROR("Dropping request (%d is too many): from client %s port %d - ID: %d", count,
 				 client->shortname,
 				 packet->src_port, packet->id);
@@ -1670,7 +1726,7 @@ skip_dup:
 	 *	Allocate a pool for the request.
 	 */
 	if (!ctx) {
-		ctx = talloc_pool(NULL, main_config.talloc_pool_size);
+		ctx = listen_pool_alloc(listener);
 		if (!ctx) return 0;
 		talloc_set_name_const(ctx, "request_receive_pool");
 
@@ -1692,11 +1748,13 @@ skip_dup:
 	 */
 	request->options |= RAD_REQUEST_OPTION_CTX;
 
+	FR_PROBE3(request_receive, request->number, packet->code, client->shortname);
+
 	/*
 	 *	Remember the request in the list.
 	 */
-	if (!listener->nodup) {
-		if (!rbtree_insert(pl, &request->packet)) {
+	if (!listener->nodup && !listener->synchronous) {
+		if (!fr_hash_oa_insert(pl, &request->packet)) {
 			RERROR("Failed to insert request in the list of live requests: discarding it");
 			request_done(request, FR_ACTION_DONE);
 			return 1;
@@ -1714,12 +1772,14 @@ skip_dup:
 #endif
 
 		request->listener->decode(request->listener, request);
+		(void) request_decode_pending(request, fr_dict_attr_by_num(NULL, 0, PW_USER_NAME));
 		request->username = fr_pair_find_by_num(request->packet->vps, 0, PW_USER_NAME, TAG_ANY);
 		request->password = fr_pair_find_by_num(request->packet->vps, 0, PW_USER_PASSWORD, TAG_ANY);
 
 		if (fun(request) < 0) REDEBUG("Error processing request: %s", fr_strerror());
 
 		if (request->reply->code != 0) {
+			gettimeofday(&request->times.reply_sent, NULL);
 			request->listener->send(request->listener, request);
 		} else {
 			RDEBUG("Not sending reply");
@@ -1786,11 +1846,11 @@ static REQUEST *request_setup(TALLOC_CTX *ctx, rad_listen_t *listener, RADIUS_PA
 	request->listener->stats.last_packet = request->packet->timestamp.tv_sec;
 	if (packet->code == PW_CODE_ACCESS_REQUEST) {
 		request->client->auth.last_packet = request->packet->timestamp.tv_sec;
-		radius_auth_stats.last_packet = request->packet->timestamp.tv_sec;
+		radius_stats_local(FR_STATS_AUTH)->last_packet = request->packet->timestamp.tv_sec;
 #ifdef WITH_ACCOUNTING
 	} else if (packet->code == PW_CODE_ACCOUNTING_REQUEST) {
 		request->client->acct.last_packet = request->packet->timestamp.tv_sec;
-		radius_acct_stats.last_packet = request->packet->timestamp.tv_sec;
+		radius_stats_local(FR_STATS_ACCT)->last_packet = request->packet->timestamp.tv_sec;
 #endif
 	}
 #endif	/* WITH_STATS */
@@ -1851,6 +1911,10 @@ static REQUEST *request_setup(TALLOC_CTX *ctx, rad_listen_t *listener, RADIUS_PA
  *
  ***********************************************************************/
 
+#ifdef WITH_PROXY
+static void proxy_socket_retire(rad_listen_t *this);
+#endif
+
 /*
  *	Timer function for all TCP sockets.
  */
@@ -1913,6 +1977,7 @@ static void tcp_socket_timer(void *ctx, struct timeval *now)
 					ERROR("Fatal error freezing socket: %s", fr_strerror());
 					fr_exit(1);
 				}
+				proxy_socket_retire(listener);
 				PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
 			}
 #endif
@@ -1940,9 +2005,22 @@ static void tcp_socket_timer(void *ctx, struct timeval *now)
 		idle.tv_usec = 0;
 
 		if (timercmp(&idle, now, <=)) {
-			listener->print(listener, buffer, sizeof(buffer));
-			DEBUG("Reached idle timeout on socket %s", buffer);
-			goto do_close;
+#ifdef WITH_PROXY
+			/*
+			 *	Idle connections are kept open, so long
+			 *	as they're needed for "min_connections".
+			 */
+			if ((listener->type == RAD_LISTEN_PROXY) &&
+			    (sock->home->num_active <= limit->min_connections)) {
+				idle = *now;
+				idle.tv_sec += limit->idle_timeout;
+			} else
+#endif
+			{
+				listener->print(listener, buffer, sizeof(buffer));
+				DEBUG("Reached idle timeout on socket %s", buffer);
+				goto do_close;
+			}
 		}
 
 		/*
@@ -1965,6 +2043,63 @@ static void tcp_socket_timer(void *ctx, struct timeval *now)
 	}
 }
 
+#ifdef WITH_PROXY
+/*
+ *	Timer function for UDP sockets to home servers which
+ *	use "spare_ids".  When the other sockets have enough
+ *	free IDs for everything outstanding, stop using this one.
+ *	It's closed once the requests using it have finished.
+ */
+static void proxy_udp_socket_timer(void *ctx, struct timeval *now)
+{
+	rad_listen_t *listener = talloc_get_type_abort(ctx, rad_listen_t);
+	listen_socket_t *sock = listener->data;
+	fr_socket_limit_t *limit = &sock->home->limit;
+	struct timeval when;
+	char buffer[256];
+
+	ASSERT_MASTER;
+
+	if (listener->status != RAD_LISTEN_STATUS_KNOWN) return;
+
+	fr_event_now(el, now);
+
+	PTHREAD_MUTEX_LOCK(&proxy_mutex);
+	if ((limit->num_connections > 1) &&
+	    (((((int64_t) limit->num_connections - 1) * 256) - sock->home->currently_outstanding) >=
+	     limit->spare_ids)) {
+		if (!fr_packet_list_socket_freeze(proxy_list, listener->fd)) {
+			ERROR("Fatal error freezing socket: %s", fr_strerror());
+			fr_exit(1);
+		}
+
+		/*
+		 *	Decrement it here, so that the timers on the
+		 *	other sockets see one fewer, and don't all
+		 *	close at once.
+		 */
+		limit->num_connections--;
+		PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
+
+		listener->print(listener, buffer, sizeof(buffer));
+		DEBUG("No longer need spare socket %s", buffer);
+
+		listener->status = RAD_LISTEN_STATUS_FROZEN;
+		event_new_fd(listener);
+		return;
+	}
+	PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
+
+	when = *now;
+	when.tv_sec += limit->idle_timeout;
+
+	ASSERT_MASTER;
+	if (!fr_event_insert(el, proxy_udp_socket_timer, listener, &when, &sock->ev)) {
+		rad_panic("Failed to insert event");
+	}
+}
+#endif
+
 
 #ifdef WITH_PROXY
 /*
@@ -1977,7 +2112,7 @@ static void add_jitter(struct timeval *when)
 
 	when->tv_sec -= 2;
 
-	jitter = fr_rand();
+	jitter = fr_fast_rand();
 	jitter ^= (jitter >> 10);
 	jitter &= ((1 << 22) - 1); /* 22 bits of 1 */
 
@@ -2134,12 +2269,98 @@ static void remove_from_proxy_hash(REQUEST *request)
 	PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
 }
 
+/*
+ *	Open a new socket to the home server, and add it to the
+ *	packet list and the event loop.
+ *
+ *	Called, and returns, with the proxy mutex locked.
+ */
+static rad_listen_t *proxy_socket_open(home_server_t *home)
+{
+	rad_listen_t *this;
+	listen_socket_t *sock;
+
+#ifdef HAVE_PTHREAD_H
+	if (proxy_no_new_sockets) return NULL;
+#endif
+
+	DEBUG3("proxy: Trying to open a new listener to home server %s", home->log_name);
+	this = proxy_new_listener(proxy_ctx, home, 0);
+	if (!this) return NULL;
+
+	sock = this->data;
+	if (!fr_packet_list_socket_add(proxy_list, this->fd,
+				       sock->proto,
+				       &sock->other_ipaddr, sock->other_port,
+				       this)) {
+
+#ifdef HAVE_PTHREAD_H
+		proxy_no_new_sockets = true;
+#endif
+
+		/*
+		 *	This is bad.  However, the
+		 *	packet list now supports 256
+		 *	open sockets, which should
+		 *	minimize this problem.
+		 */
+		ERROR("Failed adding proxy socket: %s",
+		      fr_strerror());
+		return NULL;
+	}
+
+	/*
+	 *	Add it to the event loop.  Ensure that we have
+	 *	only one mutex locked at a time.
+	 */
+	PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
+	radius_update_listener(this);
+	PTHREAD_MUTEX_LOCK(&proxy_mutex);
+
+	return this;
+}
+
+#ifdef WITH_TCP
+/*
+ *	A TCP connection to a home server will no longer be used for
+ *	new requests.  If that leaves fewer than "min_connections",
+ *	open a replacement now, rather than waiting for a request to
+ *	find the connections full.
+ *
+ *	Called, and returns, with the proxy mutex locked.
+ */
+static void proxy_socket_retire(rad_listen_t *this)
+{
+	listen_socket_t *sock = this->data;
+	home_server_t *home = sock->home;
+
+	if (!home || !sock->active) return;
+
+	sock->active = false;
+	home->num_active--;
+
+	if (home->num_active >= home->limit.min_connections) return;
+
+	/*
+	 *	Don't hammer home servers which are down.  The
+	 *	connections will be re-opened by new requests when
+	 *	it comes back.
+	 */
+	if (home->state == HOME_STATE_IS_DEAD) return;
+
+	DEBUG("Replacing connection to home server %s (%u of %u open)", home->log_name,
+	      home->num_active, home->limit.min_connections);
+	(void) proxy_socket_open(home);
+}
+#endif
+
 static int insert_into_proxy_hash(REQUEST *request)
 {
 	char buffer[INET6_ADDRSTRLEN];
 	int tries;
 	bool success = false;
 	void *proxy_listener;
+	fr_socket_limit_t *limit;
 
 	VERIFY_REQUEST(request);
 
@@ -2154,9 +2375,6 @@ static int insert_into_proxy_hash(REQUEST *request)
 	request->num_proxied_responses = 0;
 
 	for (tries = 0; tries < 2; tries++) {
-		rad_listen_t *this;
-		listen_socket_t *sock;
-
 		RDEBUG3("proxy: Trying to allocate ID (%d/2)", tries);
 		success = fr_packet_list_id_alloc(proxy_list,
 						request->home_server->proto,
@@ -2169,45 +2387,12 @@ static int insert_into_proxy_hash(REQUEST *request)
 		if (proxy_no_new_sockets) break;
 #endif
 
-		RDEBUG3("proxy: Trying to open a new listener to the home server");
-		this = proxy_new_listener(proxy_ctx, request->home_server, 0);
-		if (!this) {
-			PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
-			goto fail;
-		}
-
 		request->proxy->src_port = 0; /* Use any new socket */
-		proxy_listener = this;
-
-		sock = this->data;
-		if (!fr_packet_list_socket_add(proxy_list, this->fd,
-					       sock->proto,
-					       &sock->other_ipaddr, sock->other_port,
-					       this)) {
-
-#ifdef HAVE_PTHREAD_H
-			proxy_no_new_sockets = true;
-#endif
+		proxy_listener = proxy_socket_open(request->home_server);
+		if (!proxy_listener) {
 			PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
-
-			/*
-			 *	This is bad.  However, the
-			 *	packet list now supports 256
-			 *	open sockets, which should
-			 *	minimize this problem.
-			 */
-			ERROR("Failed adding proxy socket: %s",
-			      fr_strerror());
 			goto fail;
 		}
-
-		/*
-		 *	Add it to the event loop.  Ensure that we have
-		 *	only one mutex locked at a time.
-		 */
-		PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
-		radius_update_listener(this);
-		PTHREAD_MUTEX_LOCK(&proxy_mutex);
 	}
 
 	if (!proxy_listener || !success) {
@@ -2236,6 +2421,34 @@ static int insert_into_proxy_hash(REQUEST *request)
 	request->proxy_listener->count++;
 #endif
 
+	/*
+	 *	The number of IDs in use to a home server is roughly
+	 *	its packet rate multiplied by its latency.  When
+	 *	either grows, open another source port before the
+	 *	existing ones run out, rather than on the request
+	 *	which finds them all full.
+	 */
+	limit = &request->home_server->limit;
+	if (limit->spare_ids &&
+	    (!limit->max_connections || (limit->num_connections < limit->max_connections)) &&
+	    ((((int64_t) limit->num_connections * 256) - request->home_server->currently_outstanding) <
+	     limit->spare_ids)) {
+		RDEBUG3("proxy: Fewer than %u IDs free to the home server", limit->spare_ids);
+		(void) proxy_socket_open(request->home_server);
+	}
+
+#ifdef WITH_TCP
+	/*
+	 *	Open connections up to "min_connections" as traffic
+	 *	arrives, so that requests are spread over them.
+	 */
+	if ((request->home_server->proto == IPPROTO_TCP) &&
+	    (request->home_server->num_active < limit->min_connections)) {
+		RDEBUG3("proxy: Fewer than %u connections open to the home server", limit->min_connections);
+		(void) proxy_socket_open(request->home_server);
+	}
+#endif
+
 	PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
 
 	RDEBUG3("proxy: allocating destination %s port %d - Id %d",
@@ -2370,7 +2583,7 @@ static int process_proxy_reply(REQUEST *request, RADIUS_PACKET *reply)
 	 *	running Post-Proxy-Type = Fail.
 	 */
 	if (reply) {
-		fr_pair_add(&request->reply->vps, fr_pair_list_copy(request->reply, reply->vps));
+		fr_pair_add(&request->reply->vps, fr_pair_list_copy_ref(request->reply, reply->vps));
 
 		/*
 		 *	Delete the Proxy-State Attributes from
@@ -2478,6 +2691,14 @@ int request_proxy_reply(RADIUS_PACKET *packet)
 
 		request->home_server->last_packet_recv = now.tv_sec;
 		sock->last_packet = now.tv_sec;
+
+		/*
+		 *	Only time replies to packets we sent once.
+		 *	Otherwise we don't know which one it's for.
+		 */
+		if (!request->proxy_reply && (request->num_proxied_requests == 1)) {
+			home_server_update_latency(request->home_server, &request->proxy->timestamp, &now);
+		}
 	}
 
 	/*
@@ -2499,53 +2720,62 @@ int request_proxy_reply(RADIUS_PACKET *packet)
 	 */
 	request->proxy_reply = talloc_steal(request, packet);
 	request->priority = RAD_LISTEN_PROXY;
+	request->times.proxy_reply = now;
+
+	if (request->proxy->code != PW_CODE_STATUS_SERVER) {
+		request_stats_latency(FR_STATS_LATENCY_PROXY, &request->times.proxy_sent, &now);
+	}
+
+	FR_PROBE3(request_proxy_reply, request->number, packet->code, request->home_server->log_name);
+
+	FR_TRACE(request, FR_TRACE_PROXY_REPLY, request->home_server->log_name, packet->code, 0,
+		 &request->proxy->timestamp);
 
 #ifdef WITH_STATS
 	/*
-	 *	Update the proxy listener stats here, because only one
-	 *	thread accesses that at a time.  The home_server and
-	 *	main proxy_*_stats structures are updated once the
+	 *	Update the proxy listener stats here.  The home_server
+	 *	and server wide proxy stats are updated once the
 	 *	request is cleaned up.
 	 */
-	request->proxy_listener->stats.total_responses++;
+	FR_STATS_TYPE_INC(request->proxy_listener->stats.total_responses);
 
 	request->home_server->stats.last_packet = packet->timestamp.tv_sec;
 	request->proxy_listener->stats.last_packet = packet->timestamp.tv_sec;
 
 	switch (request->proxy->code) {
 	case PW_CODE_ACCESS_REQUEST:
-		proxy_auth_stats.last_packet = packet->timestamp.tv_sec;
+		radius_stats_local(FR_STATS_PROXY_AUTH)->last_packet = packet->timestamp.tv_sec;
 
 		if (request->proxy_reply->code == PW_CODE_ACCESS_ACCEPT) {
-			request->proxy_listener->stats.total_access_accepts++;
+			FR_STATS_TYPE_INC(request->proxy_listener->stats.total_access_accepts);
 
 		} else if (request->proxy_reply->code == PW_CODE_ACCESS_REJECT) {
-			request->proxy_listener->stats.total_access_rejects++;
+			FR_STATS_TYPE_INC(request->proxy_listener->stats.total_access_rejects);
 
 		} else if (request->proxy_reply->code == PW_CODE_ACCESS_CHALLENGE) {
-			request->proxy_listener->stats.total_access_challenges++;
+			FR_STATS_TYPE_INC(request->proxy_listener->stats.total_access_challenges);
 		}
 		break;
 
 #ifdef WITH_ACCOUNTING
 	case PW_CODE_ACCOUNTING_REQUEST:
-		proxy_acct_stats.last_packet = packet->timestamp.tv_sec;
+		radius_stats_local(FR_STATS_PROXY_ACCT)->last_packet = packet->timestamp.tv_sec;
 
-		request->proxy_listener->stats.total_responses++;
-		proxy_acct_stats.last_packet = packet->timestamp.tv_sec;
+		FR_STATS_TYPE_INC(request->proxy_listener->stats.total_responses);
+		radius_stats_local(FR_STATS_PROXY_ACCT)->last_packet = packet->timestamp.tv_sec;
 		break;
 
 #endif
 
 #ifdef WITH_COA
 	case PW_CODE_COA_REQUEST:
-		request->proxy_listener->stats.total_responses++;
-		proxy_coa_stats.last_packet = packet->timestamp.tv_sec;
+		FR_STATS_TYPE_INC(request->proxy_listener->stats.total_responses);
+		radius_stats_local(FR_STATS_PROXY_COA)->last_packet = packet->timestamp.tv_sec;
 		break;
 
 	case PW_CODE_DISCONNECT_REQUEST:
-		request->proxy_listener->stats.total_responses++;
-		proxy_dsc_stats.last_packet = packet->timestamp.tv_sec;
+		FR_STATS_TYPE_INC(request->proxy_listener->stats.total_responses);
+		radius_stats_local(FR_STATS_PROXY_DSC)->last_packet = packet->timestamp.tv_sec;
 		break;
 
 #endif
@@ -3072,7 +3302,8 @@ static int proxy_to_virtual_server(REQUEST *request)
 
 	fake = request_alloc_fake(request);
 
-	fake->packet->vps = fr_pair_list_copy(fake->packet, request->packet->vps);
+	(void) request_decode_pending(request, NULL);
+	fake->packet->vps = fr_pair_list_copy_ref(fake->packet, request->packet->vps);
 	talloc_free(request->proxy);
 
 	fake->server = request->home_server->server;
@@ -3180,6 +3411,7 @@ static int request_proxy(REQUEST *request, int retransmit)
 	gettimeofday(&request->proxy_retransmit, NULL);
 	if (!retransmit) {
 		request->proxy->timestamp = request->proxy_retransmit;
+		request->times.proxy_sent = request->proxy_retransmit;
 	}
 	request->home_server->last_packet_sent = request->proxy_retransmit.tv_sec;
 
@@ -3203,6 +3435,9 @@ static int request_proxy(REQUEST *request, int retransmit)
 	request->module = "";
 	NO_CHILD_THREAD;
 
+	FR_TRACE(request, FR_TRACE_PROXY_SEND, request->home_server->log_name, request->proxy->code, 0, NULL);
+	FR_PROBE3(request_proxy, request->number, request->proxy->code, request->home_server->log_name);
+
 	/*
 	 *	And send the packet.
 	 */
@@ -3894,15 +4129,18 @@ static void proxy_wait_for_reply(REQUEST *request, int action)
 				mark_home_server_zombie(home, &now, response_window);
 		}
 
+		FR_TRACE(request, FR_TRACE_PROXY_TIMEOUT, home->log_name, request->proxy->code, 0,
+			 &request->proxy->timestamp);
+
 		FR_STATS_TYPE_INC(home->stats.total_timeouts);
 		if (home->type == HOME_TYPE_AUTH) {
 			if (request->proxy_listener) FR_STATS_TYPE_INC(request->proxy_listener->stats.total_timeouts);
-			FR_STATS_TYPE_INC(proxy_auth_stats.total_timeouts);
+			FR_STATS_LOCAL_INC(FR_STATS_PROXY_AUTH, total_timeouts);
 		}
 #ifdef WITH_ACCT
 		else if (home->type == HOME_TYPE_ACCT) {
 			if (request->proxy_listener) FR_STATS_TYPE_INC(request->proxy_listener->stats.total_timeouts);
-			FR_STATS_TYPE_INC(proxy_acct_stats.total_timeouts);
+			FR_STATS_LOCAL_INC(FR_STATS_PROXY_ACCT, total_timeouts);
 		}
 #endif
 #ifdef WITH_COA
@@ -3910,9 +4148,9 @@ static void proxy_wait_for_reply(REQUEST *request, int action)
 			if (request->proxy_listener) FR_STATS_TYPE_INC(request->proxy_listener->stats.total_timeouts);
 
 			if (request->packet->code == PW_CODE_COA_REQUEST) {
-				FR_STATS_TYPE_INC(proxy_coa_stats.total_timeouts);
+				FR_STATS_LOCAL_INC(FR_STATS_PROXY_COA, total_timeouts);
 			} else {
-				FR_STATS_TYPE_INC(proxy_dsc_stats.total_timeouts);
+				FR_STATS_LOCAL_INC(FR_STATS_PROXY_DSC, total_timeouts);
 			}
 		}
 #endif
@@ -4235,7 +4473,7 @@ static void coa_retransmit(REQUEST *request)
 		 *	2^20 ~ USEC, and we want 2.
 		 *	rand(0,0.2) USEC ~ (rand(0,2^21) / 10)
 		 */
-		delay = (fr_rand() & ((1 << 22) - 1)) / 10;
+		delay = (fr_fast_rand() & ((1 << 22) - 1)) / 10;
 		request->delay = delay * request->home_server->coa_irt;
 		delay = request->home_server->coa_irt * USEC;
 		delay -= delay / 10;
@@ -4282,7 +4520,7 @@ static void coa_retransmit(REQUEST *request)
 	 *	   = 1.9 * RTprev + rand(0,.2) * RTprev
 	 *	   = 1.9 * RTprev + rand(0,1) * (RTprev / 5)
 	 */
-	delay = fr_rand();
+	delay = fr_fast_rand();
 	delay ^= (delay >> 16);
 	delay &= 0xffff;
 	frac = request->delay / 5;
@@ -4301,7 +4539,7 @@ static void coa_retransmit(REQUEST *request)
 		 *	delay = MRT + RAND * MRT
 		 *	      = 0.9 MRT + rand(0,.2)  * MRT
 		 */
-		delay = fr_rand();
+		delay = fr_fast_rand();
 		delay ^= (delay >> 15);
 		delay &= 0x1ffff;
 		delay = ((mrt_usec >> 16) * delay) + (((mrt_usec & 0xffff) * delay) >> 16);
@@ -4689,7 +4927,7 @@ static int proxy_eol_cb(void *ctx, void *data)
 	 *	server.
 	 */
 	fr_event_now(el, &when);
-	tv_add(&when, fr_rand() % USEC);
+	tv_add(&when, fr_fast_rand() % USEC);
 	STATE_MACHINE_TIMER(FR_ACTION_TIMER);
 
 	/*
@@ -4785,6 +5023,24 @@ static int event_new_fd(rad_listen_t *this)
 					rad_panic("Failed to insert event");
 				}
 			}
+
+			/*
+			 *	And to UDP sockets which were opened
+			 *	for a particular home server.
+			 */
+			if (sock->proto == IPPROTO_UDP && sock->home && sock->opened &&
+			    sock->home->limit.spare_ids && sock->home->limit.idle_timeout) {
+				struct timeval when;
+
+				when.tv_sec = sock->opened + sock->home->limit.idle_timeout;
+				when.tv_usec = 0;
+
+				ASSERT_MASTER;
+				if (!fr_event_insert(el, proxy_udp_socket_timer, this, &when,
+						     &(sock->ev))) {
+					rad_panic("Failed to insert event");
+				}
+			}
 #endif
 			break;
 #endif	/* WITH_PROXY */
@@ -4883,6 +5139,7 @@ static int event_new_fd(rad_listen_t *this)
 				ERROR("Fatal error freezing socket: %s", fr_strerror());
 				fr_exit(1);
 			}
+			proxy_socket_retire(this);
 
 			if (this->count > 0) {
 				fr_packet_list_walk(proxy_list, this, proxy_eol_cb);
@@ -4999,7 +5256,7 @@ static int event_new_fd(rad_listen_t *this)
 			/*
 			 *	EOL all requests using this socket.
 			 */
-			rbtree_walk(pl, RBTREE_DELETE_ORDER, eol_listener, this);
+			fr_hash_oa_walk(pl, eol_listener, this);
 		}
 
 		/*
@@ -5126,6 +5383,13 @@ static void handle_signal_self(int flag)
 		FD_MUTEX_UNLOCK(&fd_mutex);
 	}
 #endif
+
+#ifdef WITH_COA
+	/*
+	 *	Packets were added to the bulk CoA queues.
+	 */
+	if ((flag & RADIUS_SIGNAL_SELF_COA) != 0) coa_bulk_wake();
+#endif
 }
 
 #ifndef HAVE_PTHREAD_H
@@ -5201,6 +5465,13 @@ int radius_event_init(TALLOC_CTX *ctx) {
 	return 1;
 }
 
+static uint32_t packet_entry_hash(void const *data)
+{
+	RADIUS_PACKET const * const *packet = data;
+
+	return fr_packet_hash(*packet);
+}
+
 static int packet_entry_cmp(void const *one, void const *two)
 {
 	RADIUS_PACKET const * const *a = one;
@@ -5328,7 +5599,7 @@ int radius_event_start(bool have_children)
 		 */
 		rad_assert(el);
 
-		pl = rbtree_create(NULL, packet_entry_cmp, NULL, 0);
+		pl = fr_hash_oa_create(NULL, packet_entry_hash, packet_entry_cmp, NULL);
 		if (!pl) return 0;	/* leak el */
 	}
 
@@ -5496,6 +5767,7 @@ static int request_delete_cb(UNUSED void *ctx, void *data)
 	rad_assert(request->in_proxy_hash == false);
 #endif
 
+	fr_hash_oa_delete(pl, &request->packet);
 	request->in_request_hash = false;
 	ASSERT_MASTER;
 	if (request->ev) fr_event_delete(el, &request->ev);
@@ -5514,10 +5786,7 @@ static int request_delete_cb(UNUSED void *ctx, void *data)
 
 	request_free(request);
 
-	/*
-	 *	Delete it from the list, and continue;
-	 */
-	return 2;
+	return 0;
 }
 
 
@@ -5535,7 +5804,7 @@ void radius_event_free(void)
 	}
 #endif
 
-	rbtree_walk(pl, RBTREE_DELETE_ORDER,  request_delete_cb, NULL);
+	fr_hash_oa_walk(pl, request_delete_cb, NULL);
 
 	if (spawn_workers) {
 		/*
@@ -5555,15 +5824,15 @@ void radius_event_free(void)
 			}
 #endif
 
-			rbtree_walk(pl, RBTREE_DELETE_ORDER, request_delete_cb, NULL);
-			num = rbtree_num_elements(pl);
+			fr_hash_oa_walk(pl, request_delete_cb, NULL);
+			num = fr_hash_oa_num_elements(pl);
 			if (num > 0) {
 				ERROR("Request list has %d requests still in it.", num);
 			}
 		}
 	}
 
-	rbtree_free(pl);
+	fr_hash_oa_free(pl);
 	pl = NULL;
 
 #ifdef WITH_PROXY
@@ -5576,6 +5845,7 @@ void radius_event_free(void)
 	TALLOC_FREE(el);
 
 	if (debug_condition) talloc_free(debug_condition);
+	if (trace_condition) talloc_free(trace_condition);
 }
 
 int radius_event_process(void)
@@ -0,0 +1,404 @@
+/*
+ * profile.c	Sampled timing of what requests spend their time on.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+
+#include <ctype.h>
+
+#ifdef WITH_STATS
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+/*
+ *	While profiling is running, a percentage of requests are
+ *	marked for profiling when they're received.  For those
+ *	requests, the time taken by each section, module call,
+ *	expansion, and SQL or LDAP query is added to a histogram for
+ *	its name.  The histograms are kept until profiling is next
+ *	started, so they can be read after it stops.
+ *
+ *	Queries are named by their text with the values taken out,
+ *	so that all of the lookups for different users are counted
+ *	together.
+ *
+ *	Only sampled requests take the mutex, and then only to find
+ *	the histogram.  Entries are only ever added to the front of
+ *	the list, so it can be walked without the mutex.
+ */
+#define PROFILE_NAME_LEN	(256)		//!< Longer names are truncated.
+#define PROFILE_MAX_ENTRIES	(10000)		//!< So that odd queries can't use all of the memory.
+
+typedef struct profile_entry_t profile_entry_t;
+struct profile_entry_t {
+	fr_profile_type_t	type;
+	char const		*name;
+	fr_stats_latency_t	*lat;
+	profile_entry_t		*next;
+};
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define PROFILE_LOCK		pthread_mutex_lock(&profile_mutex)
+#  define PROFILE_UNLOCK	pthread_mutex_unlock(&profile_mutex)
+#else
+#  define PROFILE_LOCK
+#  define PROFILE_UNLOCK
+#endif
+
+static TALLOC_CTX	*profile_ctx = NULL;	//!< Holds the entries.
+static fr_hash_table_t	*profile_ht = NULL;	//!< Entries by type and name.
+static profile_entry_t	*profile_head = NULL;	//!< Newest entry.
+static uint32_t		profile_num_entries = 0;
+
+static bool		profile_running = false;
+static time_t		profile_until = 0;
+static uint32_t		profile_percent = 0;
+
+static uint32_t profile_entry_hash(void const *data)
+{
+	profile_entry_t const *entry = data;
+
+	return fr_hash_update(&entry->type, sizeof(entry->type), fr_hash_string(entry->name));
+}
+
+static int profile_entry_cmp(void const *one, void const *two)
+{
+	profile_entry_t const *a = one, *b = two;
+
+	if (a->type != b->type) return (a->type < b->type) ? -1 : +1;
+
+	return strcmp(a->name, b->name);
+}
+
+/** Start profiling, discarding the results of the last run
+ *
+ * @param[in] seconds to profile for.
+ * @param[in] percent of requests to profile, 1 to 100.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_profile_start(uint32_t seconds, uint32_t percent)
+{
+	TALLOC_CTX	*ctx, *old;
+	fr_hash_table_t	*ht;
+
+	if (!seconds || !percent || (percent > 100)) {
+		fr_strerror_printf("Invalid arguments");
+		return -1;
+	}
+
+	ctx = talloc_pool(NULL, 64 * 1024);
+	if (!ctx) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	ht = fr_hash_table_create(ctx, profile_entry_hash, profile_entry_cmp, NULL);
+	if (!ht) {
+		talloc_free(ctx);
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	/*
+	 *	Requests which are still being profiled add
+	 *	their remaining samples to the new run.
+	 */
+	PROFILE_LOCK;
+	old = profile_ctx;
+	profile_ctx = ctx;
+	profile_ht = ht;
+	profile_head = NULL;
+	profile_num_entries = 0;
+
+	profile_percent = percent;
+	profile_until = time(NULL) + seconds;
+	profile_running = true;
+	PROFILE_UNLOCK;
+
+	talloc_free(old);
+
+	return 0;
+}
+
+/** Stop profiling
+ *
+ * The results are kept until profiling is next started.
+ */
+void fr_profile_stop(void)
+{
+	profile_running = false;
+}
+
+/** Whether profiling is running
+ *
+ * @param[out] until when profiling will stop.  May be NULL.
+ * @param[out] percent of requests which are being profiled.  May be NULL.
+ * @return true if profiling is running.
+ */
+bool fr_profile_running(time_t *until, uint32_t *percent)
+{
+	if (profile_running && (time(NULL) >= profile_until)) profile_running = false;
+
+	if (until) *until = profile_until;
+	if (percent) *percent = profile_percent;
+
+	return profile_running;
+}
+
+/** Decide whether a new request should be profiled
+ *
+ * @return true if the request should be profiled.
+ */
+bool fr_profile_sample(void)
+{
+	if (!profile_running) return false;
+
+	if (time(NULL) >= profile_until) {
+		profile_running = false;
+		return false;
+	}
+
+	return ((fr_rand() % 100) < profile_percent);
+}
+
+static void profile_add(fr_profile_type_t type, char const *name,
+			struct timeval const *start, struct timeval const *end)
+{
+	profile_entry_t *entry, find;
+
+	find.type = type;
+	find.name = name;
+
+	PROFILE_LOCK;
+	if (!profile_ht) goto done;
+
+	entry = fr_hash_table_finddata(profile_ht, &find);
+	if (!entry) {
+		if (profile_num_entries >= PROFILE_MAX_ENTRIES) goto done;
+
+		entry = talloc_zero(profile_ctx, profile_entry_t);
+		if (!entry) goto done;
+
+		entry->type = type;
+		entry->name = talloc_typed_strdup(entry, name);
+		entry->lat = fr_stats_latency_alloc(entry);
+		if (!entry->name || !entry->lat || !fr_hash_table_insert(profile_ht, entry)) {
+			talloc_free(entry);
+			goto done;
+		}
+
+		entry->next = profile_head;
+		profile_head = entry;
+		profile_num_entries++;
+	}
+
+	fr_stats_latency_add(entry->lat, start, end);
+
+done:
+	PROFILE_UNLOCK;
+}
+
+/** Add the time taken by a section, module call, or expansion
+ *
+ * Use FR_PROFILE(), which checks whether the request is being profiled.
+ *
+ * @param[in] request being processed.
+ * @param[in] type of thing which was timed.
+ * @param[in] name of the server, module or expansion.
+ * @param[in] sub section or method.  Appended to the name after a ".", if not NULL.
+ * @param[in] start when the thing being timed started.
+ * @param[in] end when it finished, or NULL for now.
+ */
+void fr_profile_event(UNUSED REQUEST *request, fr_profile_type_t type, char const *name, char const *sub,
+		      struct timeval const *start, struct timeval const *end)
+{
+	char		buffer[PROFILE_NAME_LEN];
+	struct timeval	now;
+
+	if (!name) return;
+
+	if (!end) {
+		gettimeofday(&now, NULL);
+		end = &now;
+	}
+
+	if (sub) {
+		snprintf(buffer, sizeof(buffer), "%s.%s", name, sub);
+		name = buffer;
+	}
+
+	profile_add(type, name, start, end);
+}
+
+/*
+ *	Replace string and numeric literals with '?', and collapse
+ *	whitespace.  Double quotes are left alone, as they're
+ *	identifiers in most SQL dialects.
+ */
+static void profile_normalise_sql(char *out, size_t outlen, char const *query)
+{
+	char const	*p = query;
+	char		*q = out, *end = out + outlen - 1;
+
+	while (*p && (q < end)) {
+		if (*p == '\'') {
+			p++;
+			while (*p) {
+				if ((*p == '\\') && p[1]) {
+					p += 2;
+					continue;
+				}
+
+				if (*p == '\'') {
+					if (p[1] == '\'') {	/* '' is an escaped quote */
+						p += 2;
+						continue;
+					}
+					p++;
+					break;
+				}
+				p++;
+			}
+			*q++ = '?';
+			continue;
+		}
+
+		if (isdigit((uint8_t) *p) &&
+		    ((p == query) || (!isalnum((uint8_t) p[-1]) && (p[-1] != '_') && (p[-1] != '.')))) {
+			while (isalnum((uint8_t) *p) || (*p == '.')) p++;
+			*q++ = '?';
+			continue;
+		}
+
+		if (isspace((uint8_t) *p)) {
+			while (isspace((uint8_t) *p)) p++;
+			if ((q > out) && *p) *q++ = ' ';
+			continue;
+		}
+
+		*q++ = *p++;
+	}
+	*q = '\0';
+}
+
+/*
+ *	Replace the value of each filter item with '?'.  Presence
+ *	filters, e.g. (attr=*), are left alone.  Values can't
+ *	contain a literal ')', as it has to be escaped as \29.
+ */
+static void profile_normalise_ldap(char *out, size_t outlen, char const *filter)
+{
+	char const	*p = filter;
+	char		*q = out, *end = out + outlen - 1;
+
+	while (*p && (q < end)) {
+		if (*p != '=') {
+			*q++ = *p++;
+			continue;
+		}
+		*q++ = *p++;
+
+		if ((p[0] == '*') && ((p[1] == ')') || (p[1] == '\0'))) continue;
+
+		while (*p && (*p != ')')) p++;
+		if (q < end) *q++ = '?';
+	}
+	*q = '\0';
+}
+
+/** Add the time taken by an SQL query
+ *
+ * @param[in] request the query was for.  Nothing is added unless it's being profiled.
+ * @param[in] module instance which ran the query.
+ * @param[in] query which was run.
+ * @param[in] start when the query was sent.
+ */
+void fr_profile_sql(REQUEST *request, char const *module, char const *query, struct timeval const *start)
+{
+	char		buffer[PROFILE_NAME_LEN];
+	struct timeval	now;
+	int		len;
+
+	if (!request || !request->profile || !query) return;
+
+	gettimeofday(&now, NULL);
+
+	len = snprintf(buffer, sizeof(buffer), "%s: ", module);
+	if ((len < 0) || ((size_t) len >= sizeof(buffer))) return;
+
+	profile_normalise_sql(buffer + len, sizeof(buffer) - len, query);
+	profile_add(FR_PROFILE_QUERY, buffer, start, &now);
+}
+
+/** Add the time taken by an LDAP search
+ *
+ * @param[in] request the search was for.  Nothing is added unless it's being profiled.
+ * @param[in] module instance which ran the search.
+ * @param[in] filter of the search.
+ * @param[in] start when the search was sent.
+ */
+void fr_profile_ldap(REQUEST *request, char const *module, char const *filter, struct timeval const *start)
+{
+	char		buffer[PROFILE_NAME_LEN];
+	struct timeval	now;
+	int		len;
+
+	if (!request || !request->profile) return;
+
+	gettimeofday(&now, NULL);
+
+	len = snprintf(buffer, sizeof(buffer), "%s: ", module);
+	if ((len < 0) || ((size_t) len >= sizeof(buffer))) return;
+
+	profile_normalise_ldap(buffer + len, sizeof(buffer) - len, filter ? filter : "(objectClass=*)");
+	profile_add(FR_PROFILE_QUERY, buffer, start, &now);
+}
+
+/** Call a function for each profile entry of a type
+ *
+ * Must not be called at the same time as fr_profile_start(), which
+ * frees the entries.  Both are only called from the command socket.
+ *
+ * @param[in] type of entries to walk.
+ * @param[in] walk function to call.
+ * @param[in] ctx to pass to the function.
+ */
+void fr_profile_walk(fr_profile_type_t type, fr_profile_walk_t walk, void *ctx)
+{
+	profile_entry_t *entry;
+
+	PROFILE_LOCK;
+	entry = profile_head;
+	PROFILE_UNLOCK;
+
+	for (/* nothing */; entry; entry = entry->next) {
+		if (entry->type != type) continue;
+
+		walk(ctx, entry->name, entry->lat);
+	}
+}
+#endif /* WITH_STATS */
@@ -0,0 +1,728 @@
+/*
+ * radbench.c	Micro-benchmarks for the hot paths in the libraries.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/parser.h>
+#include <freeradius-devel/heap.h>
+
+static char const *progname = "radbench";
+
+#define NSEC		(1000000000)
+#define BENCH_KEYS	(1024)			//!< Entries in the hash table, tree and heap.  Power of 2.
+#define BENCH_SECRET	"testing123"
+
+/*
+ *	Count every call to malloc, so that we see the allocations an
+ *	operation makes and frees, as well as the ones it keeps.  Only
+ *	glibc lets us get at the real allocator underneath.
+ *
+ *	radbench is single threaded, so the counters aren't atomic.
+ */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static bool	alloc_counting = false;
+static uint64_t	alloc_calls;
+static uint64_t	alloc_bytes;
+
+void *malloc(size_t size)
+{
+	if (alloc_counting) {
+		alloc_calls++;
+		alloc_bytes += size;
+	}
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (alloc_counting) {
+		alloc_calls++;
+		alloc_bytes += nmemb * size;
+	}
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (alloc_counting) {
+		alloc_calls++;
+		alloc_bytes += size;
+	}
+	return __libc_realloc(ptr, size);
+}
+#  define HAVE_ALLOC_COUNTING (1)
+static bool const alloc_counted = true;
+#else
+static bool const alloc_counted = false;
+#endif
+
+typedef struct bench_item_t {
+	uint32_t	key;
+	int		heap_id;
+} bench_item_t;
+
+/*
+ *	Everything the benchmarks work on is set up once, before any
+ *	of them run.
+ */
+static fr_dict_t	*dict;
+static REQUEST		*request;
+static uint8_t		*encoded;
+static size_t		encoded_len;
+static bench_item_t	items[BENCH_KEYS * 2];	//!< The first half are inserted, the second half aren't.
+static fr_hash_table_t	*ht;
+static rbtree_t		*tree;
+static fr_heap_t	*heap;
+static xlat_exp_t	*xlat;
+static vp_tmpl_t	*vpt;
+static fr_cond_t	*cond;
+static uint8_t		sha1_data[1024];
+
+static char const *attr_names[] = {
+	"User-Name", "NAS-IP-Address", "NAS-Port", "Framed-IP-Address", "Class",
+	"Acct-Session-Id", "Tunnel-Type", "Framed-IPv6-Prefix", "Cisco-AVPair", "Called-Station-Id"
+};
+
+/*
+ *	The request, as radclient would send it.
+ */
+static char const *request_pairs = "User-Name = \"bob@example.com\", User-Password = \"hello\", "
+	"NAS-IP-Address = 192.0.2.1, NAS-Port = 17, NAS-Port-Type = Ethernet, "
+	"Called-Station-Id = \"00-11-22-33-44-55:example\", Calling-Station-Id = \"66-77-88-99-aa-bb\", "
+	"Framed-MTU = 1400, Service-Type = Framed-User, Cisco-AVPair = \"shell:priv-lvl=15\", "
+	"Tunnel-Type = VLAN, Tunnel-Medium-Type = IEEE-802, Tunnel-Private-Group-Id = \"10\"";
+
+/** One operation of a benchmark
+ *
+ * @param[in] ctx to allocate anything the operation keeps in.  It's
+ *	emptied after each operation.
+ * @param[in] i which operation this is.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The error is in fr_strerror().
+ */
+typedef int (*bench_func_t)(TALLOC_CTX *ctx, uint64_t i);
+
+static int bench_encode(TALLOC_CTX *ctx, UNUSED uint64_t i)
+{
+	RADIUS_PACKET	*packet;
+	int		rcode;
+
+	packet = fr_radius_alloc(ctx, false);
+	if (!packet) return -1;
+
+	packet->code = PW_CODE_ACCESS_REQUEST;
+	packet->id = i & 0xff;
+	packet->vps = request->packet->vps;	/* borrowed */
+
+	rcode = fr_radius_encode(packet, NULL, BENCH_SECRET);
+	if (rcode == 0) rcode = fr_radius_sign(packet, NULL, BENCH_SECRET);
+
+	packet->vps = NULL;
+	return rcode;
+}
+
+static int bench_decode_common(TALLOC_CTX *ctx, bool lazy, bool zero_copy)
+{
+	RADIUS_PACKET	*packet;
+	int		rcode;
+
+	packet = fr_radius_alloc(ctx, false);
+	if (!packet) return -1;
+
+	packet->data = encoded;			/* borrowed */
+	packet->data_len = encoded_len;
+	packet->lazy = lazy;
+	packet->zero_copy = zero_copy;
+
+	rcode = fr_radius_decode(packet, NULL, BENCH_SECRET);
+
+	packet->data = NULL;
+	return rcode;
+}
+
+static int bench_decode(TALLOC_CTX *ctx, UNUSED uint64_t i)
+{
+	return bench_decode_common(ctx, false, false);
+}
+
+static int bench_decode_zero_copy(TALLOC_CTX *ctx, UNUSED uint64_t i)
+{
+	return bench_decode_common(ctx, false, true);
+}
+
+static int bench_decode_lazy(TALLOC_CTX *ctx, UNUSED uint64_t i)
+{
+	return bench_decode_common(ctx, true, false);
+}
+
+static int bench_dict_attr_by_name(UNUSED TALLOC_CTX *ctx, uint64_t i)
+{
+	if (!fr_dict_attr_by_name(dict, attr_names[i % (sizeof(attr_names) / sizeof(attr_names[0]))])) {
+		fr_strerror_printf("Attribute not found");
+		return -1;
+	}
+
+	return 0;
+}
+
+static uint32_t item_hash(void const *data)
+{
+	bench_item_t const *item = data;
+
+	return fr_hash(&item->key, sizeof(item->key));
+}
+
+static int item_cmp(void const *one, void const *two)
+{
+	bench_item_t const *a = one, *b = two;
+
+	return (a->key > b->key) - (a->key < b->key);
+}
+
+static int bench_hash_find(UNUSED TALLOC_CTX *ctx, uint64_t i)
+{
+	if (!fr_hash_table_finddata(ht, &items[i & (BENCH_KEYS - 1)])) {
+		fr_strerror_printf("Hash entry not found");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bench_hash_insert_delete(UNUSED TALLOC_CTX *ctx, uint64_t i)
+{
+	bench_item_t *item = &items[BENCH_KEYS + (i & (BENCH_KEYS - 1))];
+
+	if (!fr_hash_table_insert(ht, item) || !fr_hash_table_delete(ht, item)) {
+		fr_strerror_printf("Hash insert or delete failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bench_rbtree_find(UNUSED TALLOC_CTX *ctx, uint64_t i)
+{
+	if (!rbtree_finddata(tree, &items[i & (BENCH_KEYS - 1)])) {
+		fr_strerror_printf("Tree entry not found");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bench_rbtree_insert_delete(UNUSED TALLOC_CTX *ctx, uint64_t i)
+{
+	bench_item_t *item = &items[BENCH_KEYS + (i & (BENCH_KEYS - 1))];
+
+	if (!rbtree_insert(tree, item) || !rbtree_deletebydata(tree, item)) {
+		fr_strerror_printf("Tree insert or delete failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Insert one, and take the smallest one out, so the heap stays
+ *	the same size.
+ */
+static int bench_heap_insert_extract(UNUSED TALLOC_CTX *ctx, UNUSED uint64_t i)
+{
+	bench_item_t *item;
+
+	item = fr_heap_peek(heap);
+	if (!item || !fr_heap_extract(heap, item)) {
+		fr_strerror_printf("Heap extract failed");
+		return -1;
+	}
+
+	/*
+	 *	Put it back as the largest, so it goes all the way down.
+	 */
+	item->key += BENCH_KEYS;
+	if (!fr_heap_insert(heap, item)) {
+		fr_strerror_printf("Heap insert failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bench_xlat_parse_eval(UNUSED TALLOC_CTX *ctx, UNUSED uint64_t i)
+{
+	char *out = NULL;
+
+	if (radius_axlat(&out, request, "%{User-Name} on %{NAS-IP-Address}:%{strlen:%{Called-Station-Id}}",
+			 NULL, NULL) < 0) return -1;
+	talloc_free(out);
+
+	return 0;
+}
+
+static int bench_xlat_eval(UNUSED TALLOC_CTX *ctx, UNUSED uint64_t i)
+{
+	char *out = NULL;
+
+	if (radius_axlat_struct(&out, request, xlat, NULL, NULL) < 0) return -1;
+	talloc_free(out);
+
+	return 0;
+}
+
+static int bench_tmpl_find_vp(UNUSED TALLOC_CTX *ctx, UNUSED uint64_t i)
+{
+	VALUE_PAIR *vp;
+
+	if (tmpl_find_vp(&vp, request, vpt) < 0) {
+		fr_strerror_printf("Attribute not found");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bench_tmpl_expand(TALLOC_CTX *ctx, UNUSED uint64_t i)
+{
+	char *out;
+
+	if (tmpl_aexpand(ctx, &out, request, vpt, NULL, NULL) < 0) return -1;
+
+	return 0;
+}
+
+static int bench_cond_eval(UNUSED TALLOC_CTX *ctx, UNUSED uint64_t i)
+{
+	if (radius_evaluate_cond(request, RLM_MODULE_OK, 0, cond) != 1) {
+		fr_strerror_printf("Condition didn't match");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	EAP-SIM/AKA key derivation, and SSHA passwords, hash
+ *	small inputs.  TLS and script digests hash larger ones.
+ */
+static int bench_sha1(UNUSED TALLOC_CTX *ctx, UNUSED uint64_t i)
+{
+	fr_sha1_ctx	sha1;
+	uint8_t		digest[SHA1_DIGEST_LENGTH];
+
+	fr_sha1_init(&sha1);
+	fr_sha1_update(&sha1, sha1_data, sizeof(sha1_data));
+	fr_sha1_final(digest, &sha1);
+
+	return 0;
+}
+
+static int bench_hmac_sha1(UNUSED TALLOC_CTX *ctx, UNUSED uint64_t i)
+{
+	uint8_t digest[SHA1_DIGEST_LENGTH];
+
+	fr_hmac_sha1(digest, sha1_data, 64, sha1_data + 64, 16);
+
+	return 0;
+}
+
+#ifndef WITH_OPENSSL_SHA1
+/*
+ *	The same, without the CPU's SHA instructions, for comparison.
+ */
+static int bench_sha1_generic(TALLOC_CTX *ctx, uint64_t i)
+{
+	int ret;
+
+	fr_sha1_select(false);
+	ret = bench_sha1(ctx, i);
+	fr_sha1_select(true);
+
+	return ret;
+}
+
+static int bench_hmac_sha1_generic(TALLOC_CTX *ctx, uint64_t i)
+{
+	int ret;
+
+	fr_sha1_select(false);
+	ret = bench_hmac_sha1(ctx, i);
+	fr_sha1_select(true);
+
+	return ret;
+}
+#endif
+
+/*
+ *	MS-CHAP and LEAP hash a password into an NT hash, then hash
+ *	that again.  Both fit in one MD4 block.  The .x4 variant
+ *	hashes four at a time, so divide by four.
+ */
+static int bench_md4_nthash(UNUSED TALLOC_CTX *ctx, UNUSED uint64_t i)
+{
+	uint8_t digest[MD4_DIGEST_LENGTH];
+
+	fr_md4_calc(digest, sha1_data, 16);
+
+	return 0;
+}
+
+static int bench_md4_nthash_x4(UNUSED TALLOC_CTX *ctx, UNUSED uint64_t i)
+{
+	uint8_t		digest[4][MD4_DIGEST_LENGTH];
+	uint8_t const	*in[4] = { sha1_data, sha1_data + 16, sha1_data + 32, sha1_data + 48 };
+	size_t const	inlen[4] = { 16, 16, 16, 16 };
+
+	fr_md4_calc_multi(digest, in, inlen, 4);
+
+	return 0;
+}
+
+typedef struct bench_t {
+	char const	*name;
+	bench_func_t	func;
+} bench_t;
+
+static bench_t const benchmarks[] = {
+	{ "radius.encode",		bench_encode },
+	{ "radius.decode",		bench_decode },
+	{ "radius.decode.zero_copy",	bench_decode_zero_copy },
+	{ "radius.decode.lazy",		bench_decode_lazy },
+	{ "dict.attr_by_name",		bench_dict_attr_by_name },
+	{ "hash.find",			bench_hash_find },
+	{ "hash.insert_delete",		bench_hash_insert_delete },
+	{ "rbtree.find",		bench_rbtree_find },
+	{ "rbtree.insert_delete",	bench_rbtree_insert_delete },
+	{ "heap.insert_extract",	bench_heap_insert_extract },
+	{ "xlat.parse_eval",		bench_xlat_parse_eval },
+	{ "xlat.eval",			bench_xlat_eval },
+	{ "tmpl.find_vp",		bench_tmpl_find_vp },
+	{ "tmpl.expand",		bench_tmpl_expand },
+	{ "cond.eval",			bench_cond_eval },
+	{ "sha1.1k",			bench_sha1 },
+	{ "hmac_sha1.64",		bench_hmac_sha1 },
+#ifndef WITH_OPENSSL_SHA1
+	{ "sha1.1k.generic",		bench_sha1_generic },
+	{ "hmac_sha1.64.generic",	bench_hmac_sha1_generic },
+#endif
+	{ "md4.nthash",			bench_md4_nthash },
+	{ "md4.nthash.x4",		bench_md4_nthash_x4 },
+	{ NULL, NULL }
+};
+
+static ssize_t xlat_bench(UNUSED char **out, UNUSED size_t outlen,
+			  UNUSED void const *mod_inst, UNUSED void const *xlat_inst,
+			  UNUSED REQUEST *req, UNUSED char const *fmt)
+{
+	return 0;
+}
+
+static int bench_init(void)
+{
+	size_t		i;
+	char		*fmt;
+	char const	*error = NULL;
+	RADIUS_PACKET	*packet;
+
+	/*
+	 *	Registering any expansion registers the built-in ones.
+	 */
+	if (xlat_register(NULL, "bench", xlat_bench, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN) < 0) {
+		fr_strerror_printf("Failed registering xlat");
+		return -1;
+	}
+
+	request = request_alloc(NULL);
+	if (!request) return -1;
+
+	request->packet = fr_radius_alloc(request, false);
+	request->reply = fr_radius_alloc(request, false);
+	if (!request->packet || !request->reply) return -1;
+
+	request->packet->code = PW_CODE_ACCESS_REQUEST;
+	if (fr_pair_list_afrom_str(request->packet, request_pairs, &request->packet->vps) == T_INVALID) return -1;
+
+	/*
+	 *	Something to decode.
+	 */
+	packet = fr_radius_alloc(request, false);
+	if (!packet) return -1;
+
+	packet->code = PW_CODE_ACCESS_REQUEST;
+	packet->vps = request->packet->vps;
+	if ((fr_radius_encode(packet, NULL, BENCH_SECRET) < 0) ||
+	    (fr_radius_sign(packet, NULL, BENCH_SECRET) < 0)) return -1;
+	packet->vps = NULL;
+
+	encoded = packet->data;
+	encoded_len = packet->data_len;
+
+	/*
+	 *	The containers hold the first half of the items.
+	 */
+	ht = fr_hash_table_create(NULL, item_hash, item_cmp, NULL);
+	tree = rbtree_create(NULL, item_cmp, NULL, RBTREE_FLAG_NONE);
+	heap = fr_heap_create(item_cmp, offsetof(bench_item_t, heap_id));
+	if (!ht || !tree || !heap) return -1;
+
+	for (i = 0; i < (sizeof(items) / sizeof(items[0])); i++) {
+		items[i].key = i * 2654435761U;	/* unique, and spread out */
+		items[i].heap_id = -1;
+		if (i >= BENCH_KEYS) continue;
+
+		if (!fr_hash_table_insert(ht, &items[i]) || !rbtree_insert(tree, &items[i])) return -1;
+	}
+
+	/*
+	 *	The heap gets copies, as it changes the keys.
+	 */
+	for (i = 0; i < BENCH_KEYS; i++) {
+		bench_item_t *item;
+
+		item = talloc(request, bench_item_t);
+		if (!item) return -1;
+
+		item->key = i;
+		item->heap_id = -1;
+		if (!fr_heap_insert(heap, item)) return -1;
+	}
+
+	/*
+	 *	As the server does for "update" sections and module
+	 *	configuration, parse once, then evaluate.
+	 */
+	fmt = talloc_typed_strdup(request, "%{User-Name} on %{NAS-IP-Address}:%{strlen:%{Called-Station-Id}}");
+	if (xlat_tokenize(request, fmt, &xlat, &error) < 0) {
+		fr_strerror_printf("Failed parsing expansion: %s", error);
+		return -1;
+	}
+
+	if (tmpl_afrom_attr_str(request, &vpt, "&Called-Station-Id", REQUEST_CURRENT, PAIR_LIST_REQUEST,
+				false, false) <= 0) return -1;
+
+	if (fr_condition_tokenize(request, NULL, "(&User-Name == 'bob@example.com') && (&NAS-Port > 10) && "
+				  "!(&Service-Type == Login-User)", &cond, &error, FR_COND_ONE_PASS) <= 0) {
+		fr_strerror_printf("Failed parsing condition: %s", error);
+		return -1;
+	}
+
+	return 0;
+}
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * NSEC) + ts.tv_nsec;
+}
+
+static int bench_run(bench_t const *b, uint64_t iterations, bool json, bool *first)
+{
+	TALLOC_CTX	*ctx;
+	uint64_t	i, start, elapsed;
+	uint64_t	calls = 0, bytes = 0;
+	double		ns_op;
+
+	ctx = talloc_new(NULL);
+	if (!ctx) return -1;
+
+	/*
+	 *	Warm up the caches, and grow anything which grows.
+	 */
+	for (i = 0; i < (iterations / 10) + 1; i++) {
+		if (b->func(ctx, i) < 0) {
+		fail:
+			fprintf(stderr, "%s: %s failed: %s\n", progname, b->name, fr_strerror());
+			talloc_free(ctx);
+			return -1;
+		}
+		talloc_free_children(ctx);
+	}
+
+#ifdef HAVE_ALLOC_COUNTING
+	alloc_calls = alloc_bytes = 0;
+	alloc_counting = true;
+#endif
+	start = now_nsec();
+	for (i = 0; i < iterations; i++) {
+		if (b->func(ctx, i) < 0) {
+#ifdef HAVE_ALLOC_COUNTING
+			alloc_counting = false;
+#endif
+			goto fail;
+		}
+		talloc_free_children(ctx);
+	}
+	elapsed = now_nsec() - start;
+#ifdef HAVE_ALLOC_COUNTING
+	alloc_counting = false;
+	calls = alloc_calls;
+	bytes = alloc_bytes;
+#endif
+	talloc_free(ctx);
+
+	ns_op = (double) elapsed / iterations;
+
+	if (json) {
+		printf("%s\n  { \"name\": \"%s\", \"iterations\": %" PRIu64 ", \"ns_per_op\": %.1f, "
+		       "\"ops_per_sec\": %.0f, \"allocs_per_op\": %.2f, \"bytes_per_op\": %.1f }",
+		       *first ? "" : ",", b->name, iterations, ns_op, ns_op > 0 ? NSEC / ns_op : 0,
+		       (double) calls / iterations, (double) bytes / iterations);
+	} else {
+		printf("%s\t%" PRIu64 "\t%.1f\t%.0f\t%.2f\t%.1f\n",
+		       b->name, iterations, ns_op, ns_op > 0 ? NSEC / ns_op : 0,
+		       (double) calls / iterations, (double) bytes / iterations);
+	}
+	*first = false;
+
+	return 0;
+}
+
+static void NEVER_RETURNS usage(int status)
+{
+	FILE		*output = status ? stderr : stdout;
+	bench_t const	*b;
+
+	fprintf(output, "Usage: %s [options] [<benchmark> ...]\n", progname);
+	fprintf(output, "Run micro-benchmarks, and print the time and allocations per operation.\n");
+	fprintf(output, "Options:\n");
+	fprintf(output, "  -d <raddb>    Set user dictionary directory (defaults to " RADDBDIR ").\n");
+	fprintf(output, "  -D <dictdir>  Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(output, "  -h            Print this help message.\n");
+	fprintf(output, "  -j            Print the results as JSON.\n");
+	fprintf(output, "  -l            List the benchmarks.\n");
+	fprintf(output, "  -n <count>    Operations per benchmark (default 1000000).\n");
+	fprintf(output, "Benchmarks are selected by prefix, e.g. \"radius.\".  The default is all of them:\n");
+	for (b = benchmarks; b->name; b++) fprintf(output, "  %s\n", b->name);
+
+	exit(status);
+}
+
+int main(int argc, char *argv[])
+{
+	int		c, i;
+	char const	*radius_dir = RADDBDIR;
+	char const	*dict_dir = DICTDIR;
+	uint64_t	iterations = 1000000;
+	bool		json = false;
+	bool		first = true;
+	bench_t const	*b;
+
+#ifndef NDEBUG
+	if (fr_fault_setup(getenv("PANIC_ACTION"), argv[0]) < 0) {
+		fr_perror("radbench");
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	while ((c = getopt(argc, argv, "d:D:hjln:")) != EOF) switch (c) {
+	case 'd':
+		radius_dir = optarg;
+		break;
+
+	case 'D':
+		dict_dir = optarg;
+		break;
+
+	case 'h':
+		usage(0);
+
+	case 'j':
+		json = true;
+		break;
+
+	case 'l':
+		for (b = benchmarks; b->name; b++) printf("%s\n", b->name);
+		exit(EXIT_SUCCESS);
+
+	case 'n':
+		iterations = strtoull(optarg, NULL, 10);
+		if (!iterations) usage(1);
+		break;
+
+	default:
+		usage(1);
+	}
+	argc -= optind;
+	argv += optind;
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) {
+		fr_perror("radbench");
+		exit(EXIT_FAILURE);
+	}
+
+	if (fr_dict_init(NULL, &dict, dict_dir, RADIUS_DICTIONARY, "radius") < 0) {
+		fr_perror("radbench");
+		exit(EXIT_FAILURE);
+	}
+
+	if (fr_dict_read(dict, radius_dir, RADIUS_DICTIONARY) == -1) {
+		fr_perror("radbench");
+		exit(EXIT_FAILURE);
+	}
+
+	if (bench_init() < 0) {
+		fprintf(stderr, "%s: Failed setting up benchmarks: %s\n", progname, fr_strerror());
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Lines starting with '#' are for humans.  Everything else
+	 *	is for scripts comparing one build with another.
+	 */
+	if (json) {
+		printf("{ \"version\": \"%s\", \"allocs_counted\": %s, \"results\": [",
+		       radiusd_version_short, alloc_counted ? "true" : "false");
+	} else {
+		printf("# %s %s\n", progname, radiusd_version_short);
+		if (!alloc_counted) printf("# Allocations are not counted on this platform\n");
+		printf("# name\titerations\tns_per_op\tops_per_sec\tallocs_per_op\tbytes_per_op\n");
+	}
+
+	for (b = benchmarks; b->name; b++) {
+		if (argc > 0) {
+			for (i = 0; i < argc; i++) {
+				if (strncmp(b->name, argv[i], strlen(argv[i])) == 0) break;
+			}
+			if (i == argc) continue;
+		}
+
+		if (bench_run(b, iterations, json, &first) < 0) exit(EXIT_FAILURE);
+	}
+
+	if (json) printf("\n] }\n");
+
+	talloc_free(request);
+
+	return 0;
+}
@@ -0,0 +1,5 @@
+TARGET		:= radbench
+SOURCES		:= radbench.c
+
+TGT_PREREQS	:= libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
@@ -93,13 +93,21 @@ static void NEVER_RETURNS usage(void)
 	fprintf(stderr, "  -F                     Print the file name, packet number and reply code.\n");
 	fprintf(stderr, "  -h                     Print usage help information.\n");
 	fprintf(stderr, "  -i <id>                Set request id to 'id'.  Values may be 0..255\n");
+	fprintf(stderr, "  -l <seconds>           With -R, send for 'seconds' (defaults to 10).\n");
 	fprintf(stderr, "  -n <num>               Send N requests/s\n");
 	fprintf(stderr, "  -p <num>               Send 'num' packets from a file in parallel.\n");
 	fprintf(stderr, "  -q                     Do not print anything out.\n");
 	fprintf(stderr, "  -r <retries>           If timeout, retry sending the packet 'retries' times.\n");
+	fprintf(stderr, "  -R <rate>              Send 'rate' packets/s, whether or not replies arrive, and print\n");
+	fprintf(stderr, "                         a summary with latency percentiles.  Packets from the files are\n");
+	fprintf(stderr, "                         used in turn, expanding %%{seq}, %%{seq:N}, %%{rand:N}, %%{hex:N}\n");
+	fprintf(stderr, "                         and %%{thread} in strings.  -p sets the most packets outstanding\n");
+	fprintf(stderr, "                         per thread (defaults to 4096).  Packets are not retried.\n");
 	fprintf(stderr, "  -s                     Print out summary information of auth results.\n");
+	fprintf(stderr, "                         With -R, also print the latency histogram.\n");
 	fprintf(stderr, "  -S <file>              read secret from file, not command line.\n");
 	fprintf(stderr, "  -t <timeout>           Wait 'timeout' seconds before retrying (may be a floating point number).\n");
+	fprintf(stderr, "  -T <threads>           With -R, send from 'threads' threads, each with its own sockets.\n");
 	fprintf(stderr, "  -v                     Show program version information.\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
 
@@ -1148,7 +1156,9 @@ int main(int argc, char **argv)
 	int		do_summary = false;
 	int		persec = 0;
 	int		parallel = 1;
+	bool		parallel_set = false;
 	rc_request_t	*this;
+	rc_load_t	load;
 	int		force_af = AF_UNSPEC;
 	fr_dict_t	*dict = NULL;
 
@@ -1169,6 +1179,10 @@ int main(int argc, char **argv)
 
 	talloc_set_log_stderr();
 
+	memset(&load, 0, sizeof(load));
+	load.duration = 10;
+	load.threads = 1;
+
 	filename_tree = rbtree_create(NULL, filename_cmp, NULL, 0);
 	if (!filename_tree) {
 	oom:
@@ -1176,7 +1190,7 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	while ((c = getopt(argc, argv, "46c:d:D:f:Fhi:n:p:qr:sS:t:vx"
+	while ((c = getopt(argc, argv, "46c:d:D:f:Fhi:l:n:p:qr:R:sS:t:T:vx"
 #ifdef WITH_TCP
 		"P:"
 #endif
@@ -1237,6 +1251,12 @@ int main(int argc, char **argv)
 			}
 			break;
 
+		case 'l':
+			if (!isdigit((int) *optarg)) usage();
+			load.duration = atoi(optarg);
+			if (load.duration == 0) usage();
+			break;
+
 		case 'n':
 			persec = atoi(optarg);
 			if (persec <= 0) usage();
@@ -1252,6 +1272,7 @@ int main(int argc, char **argv)
 		case 'p':
 			parallel = atoi(optarg);
 			if (parallel <= 0) usage();
+			parallel_set = true;
 			break;
 
 #ifdef WITH_TCP
@@ -1281,6 +1302,12 @@ int main(int argc, char **argv)
 			if ((retries == 0) || (retries > 1000)) usage();
 			break;
 
+		case 'R':
+			if (!isdigit((int) *optarg)) usage();
+			load.rate = atoi(optarg);
+			if (load.rate == 0) usage();
+			break;
+
 		case 's':
 			do_summary = true;
 			break;
@@ -1321,6 +1348,18 @@ int main(int argc, char **argv)
 			timeout = atof(optarg);
 			break;
 
+		case 'T':
+			if (!isdigit((int) *optarg)) usage();
+			load.threads = atoi(optarg);
+			if ((load.threads == 0) || (load.threads > 1024)) usage();
+#ifndef HAVE_PTHREAD_H
+			if (load.threads > 1) {
+				ERROR("Multiple threads are not supported on this platform");
+				exit(1);
+			}
+#endif
+			break;
+
 		case 'v':
 			fr_debug_lvl = 1;
 			DEBUG("%s", radclient_version);
@@ -1341,6 +1380,13 @@ int main(int argc, char **argv)
 		ERROR("Insufficient arguments");
 		usage();
 	}
+
+#ifdef WITH_TCP
+	if (load.rate && proto) {
+		ERROR("-R can only be used with UDP");
+		exit(1);
+	}
+#endif
 	/*
 	 *	Mismatch between the binary and the libraries it depends on
 	 */
@@ -1471,6 +1517,34 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/*
+	 *	Open loop.  The rate decides when packets are sent,
+	 *	not the replies.
+	 */
+	if (load.rate) {
+		int rcode;
+
+		load.outstanding = parallel_set ? parallel : 4096;
+		load.timeout = timeout;
+		load.client_ipaddr = client_ipaddr;
+		load.secret = secret;
+		load.quiet = !do_output;
+		load.histogram = do_summary;
+
+		rcode = rc_load_run(&load, request_head);
+		if (rcode < 0) {
+			ERROR("%s", fr_strerror());
+			exit(1);
+		}
+
+		rbtree_free(filename_tree);
+		fr_packet_list_free(pl);
+		while (request_head) TALLOC_FREE(request_head);
+		talloc_free(dict);
+
+		exit(rcode);
+	}
+
 	/*
 	 *	Walk over the packets to send, until
 	 *	we're all done.
@@ -0,0 +1,737 @@
+/*
+ * radclient_load.c	Open loop load generation for radclient.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2016  The FreeRADIUS server project
+ */
+
+/*
+ *	The normal radclient loop only sends a packet once an earlier
+ *	one has been answered.  When the server slows down, so does the
+ *	client, and the requests which would have been waiting are never
+ *	sent, or measured.
+ *
+ *	Here, the time at which each packet is sent is fixed in advance
+ *	by the rate.  Latency is measured from that time, and not from
+ *	when the packet actually went out, so any time the client spends
+ *	behind schedule is counted against the server.  Packets are never
+ *	retried.
+ *
+ *	The request files are used as templates, in turn.  String values
+ *	may contain:
+ *
+ *	  %{seq}	the packet number, from 0.
+ *	  %{seq:N}	the packet number, modulo N.
+ *	  %{rand:N}	a random number from 0 to N - 1.
+ *	  %{hex:N}	N random hex digits.
+ *	  %{thread}	the number of the thread sending the packet.
+ *	  %%		a literal '%'.
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radclient.h>
+
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#define NSEC		(1000000000)
+#define LOAD_IDS	(256)		//!< RADIUS IDs per socket.
+#define LOAD_BURST	(256)		//!< Most packets sent, or received, before doing something else.
+#define LOAD_POLL	(10000)		//!< Longest we wait for a reply before checking timeouts (us).
+
+/*
+ *	Latency histogram, in microseconds.  Below LOAD_SUB, each value
+ *	has its own bucket.  Above that, each power of two is split into
+ *	LOAD_SUB buckets, so a bucket is never wider than 1/16th of the
+ *	values in it.
+ */
+#define LOAD_SUB_BITS	(4)
+#define LOAD_SUB	(1 << LOAD_SUB_BITS)
+#define LOAD_MAX_BITS	(40)
+#define LOAD_BUCKETS	((LOAD_MAX_BITS - LOAD_SUB_BITS + 1) * LOAD_SUB)
+
+typedef struct rc_load_slot {
+	RADIUS_PACKET		*packet;	//!< NULL if the ID is free.
+	rc_request_t		*request;	//!< The template it was made from.
+	uint64_t		when;		//!< When the packet should have been sent.
+	uint64_t		sent;		//!< When it was sent.
+} rc_load_slot_t;
+
+typedef struct rc_load_thread {
+	rc_load_t const		*config;
+	unsigned int		num;		//!< Of this thread.
+
+	rc_request_t		**templates;
+	unsigned int		num_templates;
+
+	uint64_t		start;		//!< When packet 0 should be sent.
+	uint64_t		rand;		//!< State of the thread's PRNG.
+#ifdef HAVE_PTHREAD_H
+	pthread_t		pthread_id;
+#endif
+	TALLOC_CTX		*ctx;		//!< Packets are allocated here.
+
+	int			*sockets;
+	unsigned int		num_sockets;
+
+	rc_load_slot_t		*slots;		//!< LOAD_IDS for each socket.
+	uint32_t		*idle;		//!< Stack of free slots.
+	uint32_t		num_idle;
+	uint32_t		max_idle;	//!< Number of free slots when nothing is outstanding.
+
+	uint64_t		sent;
+	uint64_t		not_sent;	//!< No free ID, or sending failed.
+	uint64_t		received;
+	uint64_t		lost;
+	uint64_t		invalid;	//!< Replies we couldn't match, or which failed verification.
+	uint64_t		codes[FR_MAX_PACKET_CODE];
+
+	uint64_t		max_lag;	//!< Furthest behind schedule we've been, in ns.
+	uint64_t		max_latency;	//!< In us.
+	uint64_t		histogram[LOAD_BUCKETS];
+
+	char			error[256];	//!< The first reason a packet couldn't be sent.
+} rc_load_thread_t;
+
+static uint64_t load_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * NSEC) + ts.tv_nsec;
+}
+
+/*
+ *	fr_rand() isn't thread safe, and needn't be cryptographically
+ *	strong here, so each thread has an xorshift64* generator.
+ */
+static uint64_t load_rand(rc_load_thread_t *t)
+{
+	uint64_t x = t->rand;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	t->rand = x;
+
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+static unsigned int load_bucket(uint64_t usec)
+{
+	unsigned int msb = LOAD_SUB_BITS;
+
+	if (usec < LOAD_SUB) return usec;
+	if (usec >= ((uint64_t) 1 << LOAD_MAX_BITS)) return LOAD_BUCKETS - 1;
+
+	while ((usec >> (msb + 1)) != 0) msb++;
+
+	return ((msb - LOAD_SUB_BITS + 1) * LOAD_SUB) + ((usec >> (msb - LOAD_SUB_BITS)) & (LOAD_SUB - 1));
+}
+
+/** The smallest value which goes into a bucket
+ *
+ */
+static uint64_t load_bucket_low(unsigned int bucket)
+{
+	unsigned int msb;
+
+	if (bucket < LOAD_SUB) return bucket;
+
+	msb = (bucket / LOAD_SUB) + LOAD_SUB_BITS - 1;
+
+	return ((uint64_t) (LOAD_SUB + (bucket % LOAD_SUB))) << (msb - LOAD_SUB_BITS);
+}
+
+/** The largest value which goes into a bucket
+ *
+ */
+static uint64_t load_bucket_high(unsigned int bucket)
+{
+	if (bucket >= (LOAD_BUCKETS - 1)) return UINT64_MAX;
+
+	return load_bucket_low(bucket + 1) - 1;
+}
+
+/** Expand the %{...} sequences in a template string
+ *
+ * @param[out] out	Where to write the expansion.
+ * @param[in] outlen	Size of out.
+ * @param[in] t		Thread the packet is being sent from.
+ * @param[in] seq	Number of the packet.
+ * @param[in] fmt	To expand.
+ * @return
+ *	- Length of the expansion.
+ *	- -1 on error.
+ */
+static ssize_t load_expand(char *out, size_t outlen, rc_load_thread_t *t, uint64_t seq, char const *fmt)
+{
+	char const	*p = fmt;
+	char		*q = out;
+	char		*end = out + outlen - 1;
+
+	while (*p) {
+		char		value[128];
+		char const	*name, *arg, *brace;
+		size_t		name_len, len;
+		unsigned long	num = 0;
+
+		if ((p[0] != '%') || ((p[1] != '%') && (p[1] != '{'))) {
+			if (q >= end) goto too_long;
+			*q++ = *p++;
+			continue;
+		}
+
+		if (p[1] == '%') {
+			if (q >= end) goto too_long;
+			*q++ = '%';
+			p += 2;
+			continue;
+		}
+
+		name = p + 2;
+		brace = strchr(name, '}');
+		if (!brace) {
+			fr_strerror_printf("Missing '}' in \"%s\"", fmt);
+			return -1;
+		}
+		p = brace + 1;
+
+		arg = memchr(name, ':', brace - name);
+		if (arg) {
+			char *num_end;
+
+			name_len = arg - name;
+			num = strtoul(arg + 1, &num_end, 10);
+			if ((num_end != brace) || (num == 0)) {
+				fr_strerror_printf("Invalid number in \"%.*s\"", (int) (brace - name), name);
+				return -1;
+			}
+		} else {
+			name_len = brace - name;
+		}
+
+		if ((name_len == 3) && (memcmp(name, "seq", 3) == 0)) {
+			snprintf(value, sizeof(value), "%" PRIu64, arg ? (seq % num) : seq);
+
+		} else if ((name_len == 6) && !arg && (memcmp(name, "thread", 6) == 0)) {
+			snprintf(value, sizeof(value), "%u", t->num);
+
+		} else if ((name_len == 4) && arg && (memcmp(name, "rand", 4) == 0)) {
+			snprintf(value, sizeof(value), "%" PRIu64, load_rand(t) % num);
+
+		} else if ((name_len == 3) && arg && (memcmp(name, "hex", 3) == 0)) {
+			unsigned long i;
+
+			if (num >= sizeof(value)) {
+				fr_strerror_printf("Too many digits in \"%.*s\"", (int) (brace - name), name);
+				return -1;
+			}
+			for (i = 0; i < num; i++) value[i] = "0123456789abcdef"[load_rand(t) & 0x0f];
+			value[num] = '\0';
+
+		} else {
+			fr_strerror_printf("Unknown expansion \"%%{%.*s}\"", (int) (brace - name), name);
+			return -1;
+		}
+
+		len = strlen(value);
+		if ((size_t) (end - q) < len) goto too_long;
+		memcpy(q, value, len);
+		q += len;
+	}
+	*q = '\0';
+
+	return q - out;
+
+too_long:
+	fr_strerror_printf("Expansion of \"%s\" is too long", fmt);
+	return -1;
+}
+
+/** Expand the templated string attributes in a packet
+ *
+ */
+static int load_packet_expand(rc_load_thread_t *t, RADIUS_PACKET *packet, uint64_t seq)
+{
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	char		buffer[FR_MAX_STRING_LEN + 1];
+
+	for (vp = fr_cursor_init(&cursor, &packet->vps);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		if (vp->da->type != PW_TYPE_STRING) continue;
+		if (!memchr(vp->vp_strvalue, '%', vp->vp_length)) continue;
+
+		if (load_expand(buffer, sizeof(buffer), t, seq, vp->vp_strvalue) < 0) return -1;
+		fr_pair_value_strcpy(vp, buffer);
+	}
+
+	return 0;
+}
+
+static void load_send(rc_load_thread_t *t, uint64_t seq, uint64_t when)
+{
+	rc_request_t	*request = t->templates[seq % t->num_templates];
+	rc_load_slot_t	*slot;
+	RADIUS_PACKET	*packet;
+	VALUE_PAIR	*password, *vp;
+	uint64_t	vector[2];
+	uint32_t	i;
+
+	if (!t->num_idle) {
+		t->not_sent++;
+		return;
+	}
+	i = t->idle[--t->num_idle];
+	slot = &t->slots[i];
+
+	packet = fr_radius_alloc(t->ctx, false);
+	if (!packet) {
+		fr_strerror_printf("Out of memory");
+		goto error;
+	}
+
+	vector[0] = load_rand(t);
+	vector[1] = load_rand(t);
+	memcpy(packet->vector, vector, sizeof(packet->vector));
+
+	packet->code = request->packet->code;
+	packet->id = i % LOAD_IDS;
+	packet->sockfd = t->sockets[i / LOAD_IDS];
+	packet->src_ipaddr = t->config->client_ipaddr;
+	packet->dst_ipaddr = request->packet->dst_ipaddr;
+	packet->dst_port = request->packet->dst_port;
+
+	packet->vps = fr_pair_list_copy(packet, request->packet->vps);
+	if (load_packet_expand(t, packet, seq) < 0) goto error;
+
+	/*
+	 *	As with the normal loop, the password is re-encrypted
+	 *	for each packet, after any expansions.
+	 */
+	password = fr_pair_find_by_num(packet->vps, 0, PW_CLEARTEXT_PASSWORD, TAG_ANY);
+	if (password) {
+		if ((vp = fr_pair_find_by_num(packet->vps, 0, PW_USER_PASSWORD, TAG_ANY)) != NULL) {
+			fr_pair_value_strcpy(vp, password->vp_strvalue);
+
+		} else if ((vp = fr_pair_find_by_num(packet->vps, 0, PW_CHAP_PASSWORD, TAG_ANY)) != NULL) {
+			uint8_t buffer[17];
+
+			fr_radius_encode_chap_password(buffer, packet, load_rand(t) & 0xff, password);
+			fr_pair_value_memcpy(vp, buffer, 17);
+		}
+	}
+
+	if (fr_radius_send(packet, NULL, t->config->secret) < 0) goto error;
+
+	slot->packet = packet;
+	slot->request = request;
+	slot->when = when;
+	slot->sent = load_now();
+	t->sent++;
+	return;
+
+error:
+	if (!t->error[0]) strlcpy(t->error, fr_strerror(), sizeof(t->error));
+	talloc_free(packet);
+	t->idle[t->num_idle++] = i;
+	t->not_sent++;
+}
+
+static void load_done(rc_load_thread_t *t, uint32_t i)
+{
+	TALLOC_FREE(t->slots[i].packet);
+	t->idle[t->num_idle++] = i;
+}
+
+/** Give up on packets which have been outstanding for longer than the timeout
+ *
+ */
+static void load_expire(rc_load_thread_t *t, uint64_t now, uint64_t timeout)
+{
+	uint32_t i;
+
+	for (i = 0; i < (t->num_sockets * LOAD_IDS); i++) {
+		rc_load_slot_t *slot = &t->slots[i];
+
+		if (!slot->packet || ((now - slot->sent) < timeout)) continue;
+
+		t->lost++;
+		load_done(t, i);
+	}
+}
+
+static void load_reply(rc_load_thread_t *t, unsigned int socket_num, RADIUS_PACKET *reply, uint64_t now)
+{
+	uint32_t	i = (socket_num * LOAD_IDS) + reply->id;
+	rc_load_slot_t	*slot = &t->slots[i];
+	uint64_t	latency;
+	unsigned int	bucket;
+
+	/*
+	 *	Either a reply to a packet which has timed out, or
+	 *	one which wasn't for us.
+	 */
+	if (!slot->packet || (fr_radius_verify(reply, slot->packet, t->config->secret) < 0)) {
+		t->invalid++;
+		return;
+	}
+
+	latency = (now > slot->when) ? (now - slot->when) / 1000 : 0;
+	bucket = load_bucket(latency);
+
+	t->histogram[bucket]++;
+	if (latency > t->max_latency) t->max_latency = latency;
+
+	t->received++;
+	t->codes[reply->code]++;
+
+	load_done(t, i);
+}
+
+/** Wait for replies, for at most wait ns
+ *
+ */
+static void load_recv(rc_load_thread_t *t, uint64_t wait)
+{
+	fd_set		fds;
+	struct timeval	tv;
+	int		max_fd = -1;
+	unsigned int	i;
+
+	FD_ZERO(&fds);
+	for (i = 0; i < t->num_sockets; i++) {
+		FD_SET(t->sockets[i], &fds);
+		if (t->sockets[i] > max_fd) max_fd = t->sockets[i];
+	}
+
+	tv.tv_sec = wait / NSEC;
+	tv.tv_usec = (wait % NSEC) / 1000;
+
+	if (select(max_fd + 1, &fds, NULL, NULL, &tv) <= 0) return;
+
+	for (i = 0; i < t->num_sockets; i++) {
+		int j;
+
+		if (!FD_ISSET(t->sockets[i], &fds)) continue;
+
+		for (j = 0; j < LOAD_BURST; j++) {
+			RADIUS_PACKET *reply;
+
+			reply = fr_radius_recv(t->ctx, t->sockets[i], 0);
+			if (!reply) break;
+
+			load_reply(t, i, reply, load_now());
+			talloc_free(reply);
+		}
+	}
+}
+
+static void *load_thread(void *arg)
+{
+	rc_load_thread_t	*t = arg;
+	rc_load_t const		*config = t->config;
+	uint64_t		total = (uint64_t) config->rate * config->duration;
+	uint64_t		timeout = config->timeout * NSEC;
+	uint64_t		seq = t->num;
+	uint64_t		next_expire = 0;
+
+	for (;;) {
+		uint64_t	now = load_now();
+		uint64_t	wait = (uint64_t) LOAD_POLL * 1000;
+		uint64_t	when = 0;
+		int		burst;
+
+		/*
+		 *	Send everything which is due.  If we're behind,
+		 *	it all goes out at once, as it would if the
+		 *	requests came from many independent clients.
+		 */
+		for (burst = 0; (seq < total) && (burst < LOAD_BURST); burst++) {
+			when = t->start + ((seq * NSEC) / config->rate);
+			if (when > now) break;
+
+			if ((now - when) > t->max_lag) t->max_lag = now - when;
+
+			load_send(t, seq, when);
+			seq += config->threads;
+		}
+
+		if (now >= next_expire) {
+			load_expire(t, now, timeout);
+			next_expire = now + ((uint64_t) LOAD_POLL * 1000);
+		}
+
+		if (seq >= total) {
+			if (t->num_idle == t->max_idle) break;
+
+		} else if ((burst == LOAD_BURST) || (when <= now)) {
+			wait = 0;
+
+		} else if ((when - now) < wait) {
+			wait = when - now;
+		}
+
+		load_recv(t, wait);
+	}
+
+	return NULL;
+}
+
+static int load_thread_init(rc_load_thread_t *t)
+{
+	unsigned int i;
+
+	t->ctx = talloc_new(NULL);
+	if (!t->ctx) {
+	oom:
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	t->num_sockets = (t->config->outstanding + LOAD_IDS - 1) / LOAD_IDS;
+	t->sockets = talloc_array(t->ctx, int, t->num_sockets);
+	t->slots = talloc_zero_array(t->ctx, rc_load_slot_t, t->num_sockets * LOAD_IDS);
+	t->idle = talloc_array(t->ctx, uint32_t, t->config->outstanding);
+	if (!t->sockets || !t->slots || !t->idle) goto oom;
+
+	for (i = 0; i < t->num_sockets; i++) {
+		fr_ipaddr_t ipaddr = t->config->client_ipaddr;
+
+		t->sockets[i] = fr_socket(&ipaddr, 0);
+		if (t->sockets[i] < 0) {
+			t->num_sockets = i;
+			return -1;
+		}
+		fr_nonblock(t->sockets[i]);
+	}
+
+	/*
+	 *	Pushed in reverse, so the IDs are used in order.
+	 */
+	for (i = 0; i < t->config->outstanding; i++) t->idle[i] = t->config->outstanding - 1 - i;
+	t->num_idle = t->max_idle = t->config->outstanding;
+
+	return 0;
+}
+
+static void load_thread_free(rc_load_thread_t *t)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->num_sockets; i++) close(t->sockets[i]);
+	TALLOC_FREE(t->ctx);
+}
+
+static double load_percentile(uint64_t const *histogram, uint64_t count, uint64_t max, double pct)
+{
+	uint64_t	rank, seen = 0;
+	unsigned int	i;
+
+	if (!count) return 0;
+
+	rank = (count * pct) / 100;
+	if (rank < 1) rank = 1;
+	if (rank > count) rank = count;
+
+	for (i = 0; i < LOAD_BUCKETS; i++) {
+		seen += histogram[i];
+		if (seen >= rank) break;
+	}
+
+	return (double) ((load_bucket_high(i) < max) ? load_bucket_high(i) : max) / 1000;
+}
+
+static void load_summary(rc_load_t const *config, rc_load_thread_t *threads, uint64_t elapsed)
+{
+	rc_load_thread_t	total;
+	unsigned int		i, j;
+	char const		*error = NULL;
+
+	memset(&total, 0, sizeof(total));
+
+	for (i = 0; i < config->threads; i++) {
+		rc_load_thread_t *t = &threads[i];
+
+		total.sent += t->sent;
+		total.not_sent += t->not_sent;
+		total.received += t->received;
+		total.lost += t->lost;
+		total.invalid += t->invalid;
+		for (j = 0; j < FR_MAX_PACKET_CODE; j++) total.codes[j] += t->codes[j];
+		for (j = 0; j < LOAD_BUCKETS; j++) total.histogram[j] += t->histogram[j];
+		if (t->max_lag > total.max_lag) total.max_lag = t->max_lag;
+		if (t->max_latency > total.max_latency) total.max_latency = t->max_latency;
+		if (!error && t->error[0]) error = t->error;
+	}
+
+	if (error) fprintf(stderr, "radclient: Failed sending packets: %s\n", error);
+
+	printf("Load summary:\n"
+	       "\tDuration       : %.3f s\n"
+	       "\tRequested rate : %u /s\n"
+	       "\tAchieved rate  : %.1f /s\n"
+	       "\tSent           : %" PRIu64 "\n"
+	       "\tNot sent       : %" PRIu64 "\n"
+	       "\tReceived       : %" PRIu64 "\n"
+	       "\tLost           : %" PRIu64 "\n"
+	       "\tInvalid        : %" PRIu64 "\n"
+	       "\tMax send lag   : %.3f ms\n",
+	       (double) elapsed / NSEC,
+	       config->rate,
+	       elapsed ? (double) total.sent * NSEC / elapsed : 0,
+	       total.sent, total.not_sent, total.received, total.lost, total.invalid,
+	       (double) total.max_lag / 1000000);
+
+	for (j = 0; j < FR_MAX_PACKET_CODE; j++) {
+		if (!total.codes[j]) continue;
+
+		printf("\t%-15s: %" PRIu64 "\n", fr_packet_codes[j], total.codes[j]);
+	}
+
+	printf("\tLatency (ms)   : p50: %.3f, p90: %.3f, p99: %.3f, p99.9: %.3f, p99.99: %.3f, max: %.3f\n",
+	       load_percentile(total.histogram, total.received, total.max_latency, 50),
+	       load_percentile(total.histogram, total.received, total.max_latency, 90),
+	       load_percentile(total.histogram, total.received, total.max_latency, 99),
+	       load_percentile(total.histogram, total.received, total.max_latency, 99.9),
+	       load_percentile(total.histogram, total.received, total.max_latency, 99.99),
+	       (double) total.max_latency / 1000);
+
+	if (!config->histogram || !total.received) return;
+
+	/*
+	 *	Tab separated, for plotting.  Only buckets with
+	 *	something in them are printed.
+	 */
+	{
+		uint64_t seen = 0;
+
+		printf("# low_us\thigh_us\tcount\tcumulative\n");
+		for (j = 0; j < LOAD_BUCKETS; j++) {
+			if (!total.histogram[j]) continue;
+
+			seen += total.histogram[j];
+			printf("%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%.6f\n",
+			       load_bucket_low(j), load_bucket_high(j), total.histogram[j],
+			       (double) seen / total.received);
+		}
+	}
+}
+
+/** Send packets at a fixed rate, and print a summary of the replies
+ *
+ * @param[in] config	from the command line.
+ * @param[in] requests	the packets read from the input files, already sanity checked.
+ * @return
+ *	- 0 if every packet was sent, and answered.
+ *	- 1 if some were lost, or couldn't be sent.
+ *	- -1 on error.
+ */
+int rc_load_run(rc_load_t const *config, rc_request_t *requests)
+{
+	rc_load_thread_t	*threads;
+	rc_request_t		**templates, *request;
+	unsigned int		num_templates = 0, i;
+	uint64_t		start, lost = 0;
+	int			rcode = -1;
+
+	for (request = requests; request; request = request->next) num_templates++;
+
+	templates = talloc_array(NULL, rc_request_t *, num_templates);
+	threads = talloc_zero_array(templates, rc_load_thread_t, config->threads);
+	if (!templates || !threads) {
+		fr_strerror_printf("Out of memory");
+		talloc_free(templates);
+		return -1;
+	}
+
+	/*
+	 *	Check the expansions now, rather than finding out
+	 *	from the summary that nothing was sent.
+	 */
+	for (request = requests, i = 0; request; request = request->next, i++) {
+		RADIUS_PACKET *packet;
+
+		templates[i] = request;
+
+		threads[0].rand = 1;
+		packet = fr_radius_alloc(templates, false);
+		if (!packet) {
+			fr_strerror_printf("Out of memory");
+			goto done;
+		}
+		packet->vps = fr_pair_list_copy(packet, request->packet->vps);
+		if (load_packet_expand(&threads[0], packet, 0) < 0) {
+			fr_strerror_printf("%s: %s", request->name, fr_strerror());
+			goto done;
+		}
+		talloc_free(packet);
+	}
+
+	for (i = 0; i < config->threads; i++) {
+		rc_load_thread_t *t = &threads[i];
+
+		t->config = config;
+		t->num = i;
+		t->templates = templates;
+		t->num_templates = num_templates;
+		t->rand = ((uint64_t) fr_rand() << 32) | fr_rand() | 1;
+
+		if (load_thread_init(t) < 0) goto done;
+	}
+
+	/*
+	 *	Give the threads time to start, so the first packets
+	 *	aren't already late.
+	 */
+	start = load_now() + (NSEC / 100);
+	for (i = 0; i < config->threads; i++) threads[i].start = start;
+
+#ifdef HAVE_PTHREAD_H
+	for (i = 0; i < config->threads; i++) {
+		int ret;
+
+		ret = pthread_create(&threads[i].pthread_id, NULL, load_thread, &threads[i]);
+		if (ret != 0) {
+			fr_strerror_printf("Failed creating thread: %s", fr_syserror(ret));
+			while (i > 0) pthread_join(threads[--i].pthread_id, NULL);
+			goto done;
+		}
+	}
+
+	for (i = 0; i < config->threads; i++) pthread_join(threads[i].pthread_id, NULL);
+#else
+	for (i = 0; i < config->threads; i++) load_thread(&threads[i]);
+#endif
+
+	if (!config->quiet) load_summary(config, threads, load_now() - start);
+
+	rcode = 0;
+	for (i = 0; i < config->threads; i++) lost += threads[i].lost + threads[i].not_sent;
+	if (lost > 0) rcode = 1;
+
+done:
+	for (i = 0; i < config->threads; i++) load_thread_free(&threads[i]);
+	talloc_free(templates);
+
+	return rcode;
+}
@@ -82,6 +82,10 @@ static void sig_fatal (int);
 static void sig_hup (int);
 #endif
 
+#if defined(SO_REUSEPORT) && defined(WITH_STATS)
+static void prefork(void);
+#endif
+
 /*
  *	The main guy.
  */
@@ -445,6 +449,16 @@ int main(int argc, char *argv[])
 	 */
 	if (modules_bootstrap(main_config.config) < 0) exit(EXIT_FAILURE);
 
+#if defined(SO_REUSEPORT) && defined(WITH_STATS)
+	/*
+	 *	Fork the worker processes before the modules are
+	 *	instantiated, so that each process has its own
+	 *	connections, interpreters, etc.  Only the workers
+	 *	return.
+	 */
+	if ((main_config.num_processes > 1) && !check_config) prefork();
+#endif
+
 	/*
 	 *	Load the modules before starting up any threads.
 	 */
@@ -472,6 +486,11 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	if (main_config.log_async && (radlog_async_start(main_config.log_async_queue_size) < 0)) {
+		ERROR("%s", fr_strerror());
+		exit(EXIT_FAILURE);
+	}
+
 #ifdef HAVE_PTHREAD_H
 	/*
 	 *	Initialize the threads ONLY if we're spawning, AND
@@ -536,8 +555,9 @@ int main(int argc, char *argv[])
 
 	/*
 	 *  Write the PID after we've forked, so that we write the correct one.
+	 *  If there are worker processes, the supervisor has written its own.
 	 */
-	if (main_config.write_pid) {
+	if (main_config.write_pid && (main_config.num_processes <= 1)) {
 		FILE *fp;
 
 		fp = fopen(main_config.pid_file, "w");
@@ -563,7 +583,7 @@ int main(int argc, char *argv[])
 	 *  parent gets a read failure.
 	 */
 	if (main_config.daemonize) {
-		if (write(from_child[1], "\001", 1) < 0) {
+		if ((main_config.process_index == 0) && (write(from_child[1], "\001", 1) < 0)) {
 			WARN("Failed informing parent of successful start: %s",
 			     fr_syserror(errno));
 		}
@@ -579,6 +599,9 @@ int main(int argc, char *argv[])
 	 *  Initialise the state rbtree (used to link multiple rounds of challenges).
 	 */
 	global_state = fr_state_tree_init(autofree, main_config.max_requests * 2, main_config.continuation_timeout);
+	if (fr_state_replication_init(global_state, cf_section_sub_find(main_config.config, "state_replication")) < 0) {
+		exit(EXIT_FAILURE);
+	}
 
 	/*
 	 *  Process requests until HUP or exit.
@@ -622,7 +645,7 @@ int main(int argc, char *argv[])
 	 *  We're exiting, so we can delete the PID file.
 	 *  (If it doesn't exist, we can ignore the error returned by unlink)
 	 */
-	if (main_config.daemonize) unlink(main_config.pid_file);
+	if (main_config.daemonize && (main_config.num_processes <= 1)) unlink(main_config.pid_file);
 
 	/*
 	 *	Free memory in an explicit and consistent order
@@ -641,6 +664,8 @@ int main(int argc, char *argv[])
 	talloc_free(global_state);	/* Free state entries */
 
 cleanup:
+	radlog_async_stop();		/* Write any queued log messages */
+
 	main_config_free();		/* Free the main config */
 
 	modules_free();			/* Detach any modules (and their connection pools) */
@@ -733,3 +758,166 @@ static void sig_hup(UNUSED int sig)
 	radius_signal_self(RADIUS_SIGNAL_SELF_HUP);
 }
 #endif
+
+#if defined(SO_REUSEPORT) && defined(WITH_STATS)
+static volatile sig_atomic_t prefork_signal = 0;
+
+static void sig_prefork(int sig)
+{
+	prefork_signal = sig;
+}
+
+/*
+ *	Start a worker process.  Returns true in the worker.
+ */
+static bool prefork_spawn(pid_t *pids, time_t *started, uint32_t i)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		ERROR("Failed forking worker process %u: %s", i, fr_syserror(errno));
+		return false;
+	}
+
+	if (pid == 0) {
+		radius_pid = getpid();
+		main_config.process_index = i;
+		radius_stats_shared_attach(i);
+
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+#ifdef SIGHUP
+		signal(SIGHUP, SIG_DFL);
+#endif
+		return true;
+	}
+
+	pids[i] = pid;
+	started[i] = time(NULL);
+	DEBUG("Started worker process %u with PID %d", i, (int) pid);
+
+	return false;
+}
+
+/*
+ *	Fork "num_processes" copies of the server.  Each one
+ *	instantiates the modules, and binds to the same listeners
+ *	with SO_REUSEPORT, so the kernel shares the packets out
+ *	between them.  The statistics are kept in shared memory, so
+ *	that radmin and Status-Server see the totals for the server.
+ *
+ *	This function returns only in the workers.  The original
+ *	process supervises them: it restarts workers which exit,
+ *	passes on SIGHUP, and stops all of them on SIGTERM.
+ */
+static void prefork(void)
+{
+	uint32_t	i, num = main_config.num_processes;
+	pid_t		*pids;
+	time_t		*started;
+	pid_t		pid;
+	int		status;
+
+	if (radius_stats_shared_init(num) < 0) {
+		ERROR("%s", fr_strerror());
+		exit(EXIT_FAILURE);
+	}
+
+	pids = talloc_zero_array(NULL, pid_t, num);
+	started = talloc_zero_array(NULL, time_t, num);
+	if (!pids || !started) {
+		ERROR("Out of memory");
+		exit(EXIT_FAILURE);
+	}
+
+	if (main_config.write_pid) {
+		FILE *fp;
+
+		fp = fopen(main_config.pid_file, "w");
+		if (!fp) {
+			ERROR("Failed creating PID file %s: %s", main_config.pid_file, fr_syserror(errno));
+			exit(EXIT_FAILURE);
+		}
+		fprintf(fp, "%d\n", (int) radius_pid);
+		fclose(fp);
+	}
+
+	/*
+	 *	Set the handlers first, so that a signal which
+	 *	arrives while forking isn't lost.  The workers set
+	 *	their own.
+	 */
+	if ((fr_set_signal(SIGTERM, sig_prefork) < 0) ||
+	    (fr_set_signal(SIGINT, sig_prefork) < 0)
+#ifdef SIGHUP
+	    || (fr_set_signal(SIGHUP, sig_prefork) < 0)
+#endif
+	    ) {
+		ERROR("%s", fr_strerror());
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < num; i++) {
+		if (prefork_spawn(pids, started, i)) goto worker;
+		if (!pids[i]) goto stop;
+	}
+
+	INFO("Started %u worker processes", num);
+
+	for (;;) {
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno != EINTR) {
+				ERROR("Failed waiting for worker processes: %s", fr_syserror(errno));
+				goto stop;
+			}
+
+#ifdef SIGHUP
+			if (prefork_signal == SIGHUP) {
+				prefork_signal = 0;
+				INFO("Passing SIGHUP to the worker processes");
+				for (i = 0; i < num; i++) if (pids[i]) kill(pids[i], SIGHUP);
+				continue;
+			}
+#endif
+			if (prefork_signal) goto stop;
+			continue;
+		}
+
+		for (i = 0; i < num; i++) if (pids[i] == pid) break;
+		if (i == num) continue;
+		pids[i] = 0;
+
+		/*
+		 *	A worker which fails during startup will keep
+		 *	failing.  Don't restart it forever.
+		 */
+		if (time(NULL) < (started[i] + 5)) {
+			ERROR("Worker process %u exited during startup", i);
+			goto stop;
+		}
+
+		WARN("Worker process %u (PID %d) exited with status %d.  Restarting it",
+		     i, (int) pid, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+		if (prefork_spawn(pids, started, i)) goto worker;
+		if (!pids[i]) goto stop;
+	}
+
+stop:
+	signal(SIGTERM, SIG_IGN);
+	for (i = 0; i < num; i++) if (pids[i]) kill(pids[i], SIGTERM);
+	while ((waitpid(-1, &status, 0) > 0) || (errno == EINTR));
+
+	if (main_config.write_pid) unlink(main_config.pid_file);
+
+	if (!prefork_signal) exit(EXIT_FAILURE);
+
+	INFO("Exiting normally");
+	exit(EXIT_SUCCESS);
+
+worker:
+	talloc_free(pids);
+	talloc_free(started);
+}
+#endif
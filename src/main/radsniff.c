@@ -36,6 +36,7 @@ RCSID("$Id$")
 #include <freeradius-devel/conf.h>
 #include <freeradius-devel/pcap.h>
 #include <freeradius-devel/radsniff.h>
+#include <freeradius-devel/str.h>
 
 #ifdef HAVE_COLLECTDC_H
 #  include <collectd/client.h>
@@ -44,14 +45,28 @@ RCSID("$Id$")
 #define RS_ASSERT(_x) if (!(_x) && !fr_cond_assert(_x)) exit(1)
 
 static rs_t *conf;
-static struct timeval start_pcap = {0, 0};
-static char timestr[50];
 
-static rbtree_t *request_tree = NULL;
-static rbtree_t *link_tree = NULL;
-static fr_event_list_t *events;
+/*
+ *	With -j, each worker thread has its own copy of these, so
+ *	the packet processing code doesn't need to know which thread
+ *	it's running in.
+ */
+static _fr_thread_local struct timeval start_pcap = {0, 0};
+static _fr_thread_local char timestr[50];
+
+static _fr_thread_local rbtree_t *request_tree = NULL;
+static _fr_thread_local rbtree_t *link_tree = NULL;
+static _fr_thread_local fr_event_list_t *events;
 static bool cleanup;
 
+#ifdef HAVE_PTHREAD_H
+static _fr_thread_local rs_worker_t *worker;	//!< The worker we're running in.  NULL in the main thread.
+static rs_worker_t *workers;			//!< conf->workers of them.
+
+#  define RS_WORKER_LOCK(_w)	pthread_mutex_lock(&(_w)->mutex)
+#  define RS_WORKER_UNLOCK(_w)	pthread_mutex_unlock(&(_w)->mutex)
+#endif
+
 static int self_pipe[2] = {-1, -1};		//!< Signals from sig handlers
 
 typedef int (*rbcmp)(void const *, void const *);
@@ -218,8 +233,11 @@ static void rs_time_print(char *out, size_t len, struct timeval const *t)
 
 static size_t rs_snprint_csv(char *out, size_t outlen, char const *in, size_t inlen)
 {
+	static fr_str_set_t const unsafe = FR_STR_SET(0x20, 0x7e, "\"");
+
 	char const	*start = out;
 	uint8_t const	*str = (uint8_t const *) in;
+	size_t		safe;
 
 	if (!in) {
 		if (outlen) {
@@ -234,6 +252,21 @@ static size_t rs_snprint_csv(char *out, size_t outlen, char const *in, size_t in
 	}
 
 	while ((inlen > 0) && (outlen > 2)) {
+		/*
+		 *	Copy runs of printable chars in one go.
+		 */
+		safe = fr_str_span(&unsafe, str, inlen);
+		if (safe) {
+			if (safe > (outlen - 2)) safe = outlen - 2;
+			memcpy(out, str, safe);
+			out += safe;
+			str += safe;
+			outlen -= safe;
+			inlen -= safe;
+
+			continue;
+		}
+
 		/*
 		 *	Escape double quotes with... MORE DOUBLE QUOTES!
 		 */
@@ -501,7 +534,14 @@ static inline void rs_packet_print(rs_request_t *request, uint64_t count, rs_sta
 	if (!conf->logger) return;
 
 	if (request) request->logged = true;
+
+	/*
+	 *	Loggers print a packet with several calls, so keep
+	 *	other workers from printing in the middle of it.
+	 */
+	flockfile(fr_log_fp);
 	conf->logger(count, status, handle, packet, elapsed, latency, response, body);
+	funlockfile(fr_log_fp);
 }
 
 /** Query libpcap to see if it dropped any packets
@@ -805,6 +845,68 @@ static void rs_stats_print_csv(rs_update_t *this, rs_stats_t *stats, UNUSED stru
 	fprintf(stdout , "%s\n", buffer);
 }
 
+#ifdef HAVE_PTHREAD_H
+/** Add a worker's stats for the interval to the totals
+ *
+ */
+static void rs_stats_merge_latency(rs_latency_t *out, rs_latency_t const *in)
+{
+	int i;
+
+	out->interval.received_total += in->interval.received_total;
+	out->interval.linked_total += in->interval.linked_total;
+	out->interval.unlinked_total += in->interval.unlinked_total;
+	out->interval.reused_total += in->interval.reused_total;
+	out->interval.lost_total += in->interval.lost_total;
+
+	for (i = 0; i <= RS_RETRANSMIT_MAX; i++) out->interval.rt_total[i] += in->interval.rt_total[i];
+
+	out->interval.latency_total += in->interval.latency_total;
+
+	if (in->interval.latency_high > out->interval.latency_high) {
+		out->interval.latency_high = in->interval.latency_high;
+	}
+	if (in->interval.latency_low &&
+	    (!out->interval.latency_low || (in->interval.latency_low < out->interval.latency_low))) {
+		out->interval.latency_low = in->interval.latency_low;
+	}
+}
+
+/** Stop the workers, and move their stats for the interval into the totals
+ *
+ * The workers stay stopped until rs_stats_workers_unlock() is called, so
+ * their pcap handles can be queried while nothing is reading from them.
+ */
+static void rs_stats_workers_lock(rs_stats_t *stats)
+{
+	size_t	i;
+	size_t	rs_codes_len = (sizeof(rs_useful_codes) / sizeof(*rs_useful_codes));
+	int	j;
+
+	if (!workers) return;
+
+	for (j = 0; j < conf->workers; j++) {
+		RS_WORKER_LOCK(&workers[j]);
+
+		for (i = 0; i < rs_codes_len; i++) {
+			rs_latency_t *in = &workers[j].stats->exchange[rs_useful_codes[i]];
+
+			rs_stats_merge_latency(&stats->exchange[rs_useful_codes[i]], in);
+			memset(&in->interval, 0, sizeof(in->interval));
+		}
+	}
+}
+
+static void rs_stats_workers_unlock(void)
+{
+	int j;
+
+	if (!workers) return;
+
+	for (j = 0; j < conf->workers; j++) RS_WORKER_UNLOCK(&workers[j]);
+}
+#endif
+
 /** Process stats for a single interval
  *
  */
@@ -823,6 +925,10 @@ static void rs_stats_process(void *ctx, struct timeval *now)
 
 	stats->intervals++;
 
+#ifdef HAVE_PTHREAD_H
+	rs_stats_workers_lock(stats);
+#endif
+
 	for (in_p = this->in;
 	     in_p;
 	     in_p = in_p->next) {
@@ -866,6 +972,10 @@ clear:
 		       sizeof(stats->exchange[rs_useful_codes[i]].interval));
 	}
 
+#ifdef HAVE_PTHREAD_H
+	rs_stats_workers_unlock();
+#endif
+
 	{
 		static fr_event_t *event;
 
@@ -1088,6 +1198,16 @@ static void _rs_event(void *ctx, UNUSED struct timeval *now)
 {
 	rs_request_t *request = talloc_get_type_abort(ctx, rs_request_t);
 	request->event = NULL;
+
+#ifdef HAVE_PTHREAD_H
+	if (worker) {
+		RS_WORKER_LOCK(worker);
+		rs_packet_cleanup(request);
+		RS_WORKER_UNLOCK(worker);
+		return;
+	}
+#endif
+
 	rs_packet_cleanup(request);
 }
 
@@ -1214,7 +1334,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	bool			response;		/* Was it a response code */
 
 	decode_fail_t		reason;			/* Why we failed decoding the packet */
-	static uint64_t		captured = 0;
+	static _fr_thread_local uint64_t captured = 0;
 
 	rs_status_t		status = RS_NORMAL;	/* Any special conditions (RTX, Unlinked, ID-Reused) */
 	RADIUS_PACKET		*current;		/* Current packet were processing */
@@ -1319,7 +1439,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	 *	recover once some requests timeout, so make an effort to deal
 	 *	with allocation failures gracefully.
 	 */
-	current = fr_radius_alloc(conf, false);
+	current = fr_radius_alloc(event->ctx, false);
 	if (!current) {
 		REDEBUG("Failed allocating memory to hold decoded packet");
 		rs_tv_add_ms(&header->ts, conf->stats.timeout, &stats->quiet);
@@ -1622,7 +1742,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 *	...nope it's a new request.
 		 */
 		} else {
-			original = talloc_zero(conf, rs_request_t);
+			original = talloc_zero(event->ctx, rs_request_t);
 			talloc_set_destructor(original, _request_free);
 
 			original->id = count;
@@ -1770,7 +1890,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 
 static void rs_got_packet(fr_event_list_t *el, int fd, void *ctx)
 {
-	static uint64_t	count = 0;	/* Packets seen */
+	static _fr_thread_local uint64_t count = 0;	/* Packets seen */
 	rs_event_t	*event = ctx;
 	pcap_t		*handle = event->in->handle;
 
@@ -2088,6 +2208,217 @@ fr_event_list_t *list, int fd, UNUSED void *ctx)
 	}
 }
 
+#ifdef HAVE_PTHREAD_H
+static int workers_started;
+
+static void rs_worker_got_packet(fr_event_list_t *el, int fd, void *ctx)
+{
+	RS_WORKER_LOCK(worker);
+	rs_got_packet(el, fd, ctx);
+	RS_WORKER_UNLOCK(worker);
+}
+
+/** Read from the worker's pipe, and exit its event loop
+ *
+ */
+static void rs_worker_exit(fr_event_list_t *el, int fd, UNUSED void *ctx)
+{
+	char c;
+
+	if (read(fd, &c, sizeof(c)) < 0) {
+		ERROR("Failed reading from worker pipe: %s", fr_syserror(errno));
+	}
+
+	fr_event_loop_exit(el, 1);
+}
+
+static void *rs_worker_thread(void *arg)
+{
+	rs_worker_t *this = arg;
+
+	worker = this;
+	events = this->events;
+	request_tree = this->request_tree;
+	link_tree = this->link_tree;
+
+	fr_event_loop(events);
+
+	/*
+	 *	The requests' destructors remove them from this
+	 *	thread's trees and event list, so they have to be
+	 *	freed here, and not when conf is.
+	 */
+	RS_WORKER_LOCK(this);
+	TALLOC_FREE(this->ctx);
+	RS_WORKER_UNLOCK(this);
+
+	return NULL;
+}
+
+/** Open a capture handle for each worker on each interface, and set up the workers
+ *
+ * The handles main() opened go to the first worker.  The other workers'
+ * handles are added to the end of the list, so the stats show every handle.
+ *
+ * @param in handles opened on each interface.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int rs_workers_init(fr_pcap_t *in)
+{
+	fr_pcap_t	*in_p, *last = NULL;
+	int		num_in = 0, i, j;
+
+	for (in_p = in; in_p; in_p = in_p->next) {
+		last = in_p;
+		num_in++;
+	}
+
+	workers = talloc_zero_array(conf, rs_worker_t, conf->workers);
+	if (!workers) {
+	oom:
+		ERROR("Out of memory");
+		return -1;
+	}
+
+	for (i = 0; i < conf->workers; i++) {
+		rs_worker_t *w = &workers[i];
+
+		w->num = i;
+		w->pipe[0] = w->pipe[1] = -1;
+		w->in = talloc_array(workers, fr_pcap_t *, num_in);
+		w->stats = talloc_zero(workers, rs_stats_t);
+		if (!w->in || !w->stats) goto oom;
+	}
+
+	for (in_p = in, j = 0; j < num_in; in_p = in_p->next, j++) {
+		uint16_t group = (getpid() + in_p->if_index) & 0xffff;
+
+		for (i = 0; i < conf->workers; i++) {
+			fr_pcap_t *handle = in_p;
+
+			if (i > 0) {
+				handle = fr_pcap_init(conf, in_p->name, PCAP_INTERFACE_IN);
+				if (!handle) goto oom;
+
+				handle->promiscuous = conf->promiscuous;
+				handle->buffer_pkts = conf->buffer_pkts;
+				if (fr_pcap_open(handle) < 0) {
+					ERROR("Failed opening pcap handle (%s): %s", handle->name, fr_strerror());
+					return -1;
+				}
+
+				if (conf->pcap_filter && (fr_pcap_apply_filter(handle, conf->pcap_filter) < 0)) {
+					ERROR("Failed applying filter");
+					return -1;
+				}
+
+				last->next = handle;
+				last = handle;
+			}
+
+			if (fr_pcap_fanout(handle, group) < 0) {
+				ERROR("%s", fr_strerror());
+				return -1;
+			}
+
+			workers[i].in[j] = handle;
+		}
+	}
+
+	for (i = 0; i < conf->workers; i++) {
+		rs_worker_t *w = &workers[i];
+
+		w->ctx = talloc_new(NULL);
+		if (!w->ctx) goto oom;
+
+		w->events = fr_event_list_create(w->ctx, NULL);
+		w->request_tree = rbtree_create(w->ctx, (rbcmp) rs_packet_cmp, _unmark_request, 0);
+		if (!w->events || !w->request_tree) goto oom;
+
+		if (conf->link_da_num) {
+			w->link_tree = rbtree_create(w->ctx, (rbcmp) rs_rtx_cmp, _unmark_link, 0);
+			if (!w->link_tree) goto oom;
+		}
+
+		if (pipe(w->pipe) < 0) {
+			ERROR("Couldn't open worker pipe: %s", fr_syserror(errno));
+			return -1;
+		}
+
+		if (!fr_event_fd_insert(w->events, 0, w->pipe[0], rs_worker_exit, NULL)) {
+			ERROR("Failed inserting worker pipe descriptor: %s", fr_strerror());
+			return -1;
+		}
+
+		for (j = 0; j < num_in; j++) {
+			rs_event_t *event;
+
+			event = talloc_zero(w->ctx, rs_event_t);
+			if (!event) goto oom;
+
+			event->list = w->events;
+			event->in = w->in[j];
+			event->stats = w->stats;
+			event->ctx = w->ctx;
+
+			if (!fr_event_fd_insert(w->events, 0, w->in[j]->fd, rs_worker_got_packet, event)) {
+				ERROR("Failed inserting file descriptor");
+				return -1;
+			}
+		}
+
+		pthread_mutex_init(&w->mutex, NULL);
+	}
+
+	return 0;
+}
+
+static int rs_workers_start(void)
+{
+	int i;
+
+	for (i = 0; i < conf->workers; i++) {
+		int ret;
+
+		ret = pthread_create(&workers[i].pthread_id, NULL, rs_worker_thread, &workers[i]);
+		if (ret != 0) {
+			ERROR("Failed creating worker thread: %s", fr_syserror(ret));
+			return -1;
+		}
+		workers_started++;
+	}
+
+	return 0;
+}
+
+/** Tell the workers to exit, and wait for them
+ *
+ */
+static void rs_workers_stop(void)
+{
+	int i;
+
+	if (!workers) return;
+
+	for (i = 0; i < workers_started; i++) {
+		if (write(workers[i].pipe[1], "x", 1) < 0) {
+			ERROR("Failed writing to worker pipe: %s", fr_syserror(errno));
+		}
+	}
+
+	for (i = 0; i < workers_started; i++) pthread_join(workers[i].pthread_id, NULL);
+	workers_started = 0;
+
+	for (i = 0; i < conf->workers; i++) {
+		if (workers[i].pipe[0] >= 0) close(workers[i].pipe[0]);
+		if (workers[i].pipe[1] >= 0) close(workers[i].pipe[1]);
+		TALLOC_FREE(workers[i].ctx);	/* If the worker never started */
+	}
+}
+#endif
+
 static void NEVER_RETURNS usage(int status)
 {
 	FILE *output = status ? stderr : stdout;
@@ -2111,6 +2442,10 @@ static void NEVER_RETURNS usage(int status)
 	fprintf(output, "  -h                    This help message.\n");
 	fprintf(output, "  -i <interface>        Capture packets from interface (defaults to all if supported).\n");
 	fprintf(output, "  -I <file>             Read packets from file (overrides input of -F).\n");
+#ifdef HAVE_PTHREAD_H
+	fprintf(output, "  -j <threads>          Share live capture between threads, by flow.  Needs Linux.\n");
+	fprintf(output, "                        Can't be used with -c, -S or -w.\n");
+#endif
 	fprintf(output, "  -l <attr>[,<attr>]    Output packet sig and a list of attributes.\n");
 	fprintf(output, "  -L <attr>[,<attr>]    Detect retransmissions using these attributes to link requests.\n");
 	fprintf(output, "  -m                    Don't put interface(s) into promiscuous mode.\n");
@@ -2205,7 +2540,7 @@ int main(int argc, char *argv[])
 	/*
 	 *  Get options
 	 */
-	while ((opt = getopt(argc, argv, "ab:c:Cd:D:e:EFf:hi:I:l:L:mp:P:qr:R:s:Svw:xXW:T:P:N:O:")) != EOF) {
+	while ((opt = getopt(argc, argv, "ab:c:Cd:D:e:EFf:hi:I:j:l:L:mp:P:qr:R:s:Svw:xXW:T:P:N:O:")) != EOF) {
 		switch (opt) {
 		case 'a':
 		{
@@ -2290,6 +2625,20 @@ int main(int argc, char *argv[])
 			conf->from_file = true;
 			break;
 
+		case 'j':
+			conf->workers = atoi(optarg);
+			if (conf->workers <= 0) {
+				ERROR("Invalid number of threads \"%s\"", optarg);
+				usage(64);
+			}
+#ifndef HAVE_PTHREAD_H
+			if (conf->workers > 1) {
+				ERROR("Threads are not supported on this platform");
+				usage(64);
+			}
+#endif
+			break;
+
 		case 'l':
 			conf->list_attributes = optarg;
 			break;
@@ -2422,6 +2771,12 @@ int main(int argc, char *argv[])
 		usage(64);
 	}
 
+	/* The workers can't share a capture limit, or an output file */
+	if ((conf->workers > 1) && (conf->limit || conf->to_file || conf->to_stdout)) {
+		ERROR("-j can't be used with -c, -S or -w");
+		usage(64);
+	}
+
 	/* Can't set stats export mode if we're not writing stats */
 	if ((conf->stats.out == RS_STATS_OUT_STDIO_CSV) && !conf->stats.interval) {
 		usage(64);
@@ -2634,6 +2989,12 @@ int main(int argc, char *argv[])
 		INFO("Defaulting to capture on all interfaces");
 	}
 
+	if ((conf->workers > 1) && !conf->from_dev) {
+		ERROR("-j can only be used when capturing from interfaces");
+		ret = 64;
+		goto finish;
+	}
+
 	/*
 	 *	Print captures values which will be used
 	 */
@@ -2805,8 +3166,14 @@ int main(int argc, char *argv[])
 		}
 
 		/*
-		 *  Now add fd's for each of the pcap sessions we opened
+		 *  Now add fd's for each of the pcap sessions we opened,
+		 *  or give them to the workers.
 		 */
+#ifdef HAVE_PTHREAD_H
+		if (conf->workers > 1) {
+			if (rs_workers_init(in) < 0) goto finish;
+		} else
+#endif
 		for (in_p = in;
 		     in_p;
 		     in_p = in_p->next) {
@@ -2817,6 +3184,7 @@ int main(int argc, char *argv[])
 			event->in = in_p;
 			event->out = out;
 			event->stats = stats;
+			event->ctx = conf;
 
 			if (!fr_event_fd_insert(events, 0, in_p->fd, rs_got_packet, event)) {
 				ERROR("Failed inserting file descriptor");
@@ -2826,6 +3194,7 @@ int main(int argc, char *argv[])
 
 		buff = fr_pcap_device_names(conf, in, ' ');
 		DEBUG("Sniffing on (%s)", buff);
+		if (conf->workers > 1) DEBUG("Sharing capture between %i threads", conf->workers);
 
 		/*
 		 *  Insert our stats processor
@@ -2855,6 +3224,13 @@ int main(int argc, char *argv[])
 	fr_set_signal(SIGQUIT, rs_signal_self);
 #endif
 
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	After daemonizing, as threads don't survive fork().
+	 */
+	if (workers && (rs_workers_start() < 0)) goto finish;
+#endif
+
 	fr_event_loop(events);	/* Enter the main event loop */
 
 	DEBUG("Done sniffing");
@@ -2863,6 +3239,10 @@ int main(int argc, char *argv[])
 
 	cleanup = true;
 
+#ifdef HAVE_PTHREAD_H
+	rs_workers_stop();
+#endif
+
 	/*
 	 *	Free all the things! This also closes all the sockets and file descriptors
 	 */
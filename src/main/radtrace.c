@@ -0,0 +1,252 @@
+/*
+ * radtrace.c	Decode trace files written by "radmin trace dump".
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+
+static char const *progname = "radtrace";
+
+/*
+ *	These tables are indexed by values in the trace file, so
+ *	they only ever get new entries at the end.
+ */
+static const FR_NAME_NUMBER trace_types[] = {
+	{ "request-start",	FR_TRACE_REQUEST_START },
+	{ "request-done",	FR_TRACE_REQUEST_DONE },
+	{ "section-enter",	FR_TRACE_SECTION_ENTER },
+	{ "section-exit",	FR_TRACE_SECTION_EXIT },
+	{ "module",		FR_TRACE_MODULE_CALL },
+	{ "xlat",		FR_TRACE_XLAT },
+	{ "proxy-send",		FR_TRACE_PROXY_SEND },
+	{ "proxy-reply",	FR_TRACE_PROXY_REPLY },
+	{ "proxy-timeout",	FR_TRACE_PROXY_TIMEOUT },
+	{ NULL, 0 }
+};
+
+static char const *trace_sections[] = {
+	"authenticate",
+	"authorize",
+	"preacct",
+	"accounting",
+	"session",
+	"pre-proxy",
+	"post-proxy",
+	"post-auth",
+	"recv-coa",
+	"send-coa"
+};
+
+static char const *trace_rcodes[] = {
+	"reject",
+	"fail",
+	"ok",
+	"handled",
+	"invalid",
+	"userlock",
+	"notfound",
+	"noop",
+	"updated"
+};
+
+#define TRACE_NAME(_table, _x) (((_x) < (sizeof(_table) / sizeof(_table[0]))) ? _table[_x] : "?")
+
+static void NEVER_RETURNS usage(int status)
+{
+	FILE *output = status ? stderr : stdout;
+
+	fprintf(output, "Usage: %s [options] <file>\n", progname);
+	fprintf(output, "Decode a trace file written by \"radmin -e 'trace dump <file>'\".\n");
+	fprintf(output, "Options:\n");
+	fprintf(output, "  -h            Print this help message.\n");
+	fprintf(output, "  -n <number>   Only print events for request <number>.\n");
+	fprintf(output, "  -u            Print times as microseconds since the epoch.\n");
+
+	exit(status);
+}
+
+/*
+ *	Events from each thread are in order, but the threads are
+ *	one after the other.  Put them all in time order.
+ */
+static int trace_cmp(void const *one, void const *two)
+{
+	fr_trace_event_t const *a = one, *b = two;
+
+	if (a->when < b->when) return -1;
+	if (a->when > b->when) return +1;
+
+	if (a->number < b->number) return -1;
+	if (a->number > b->number) return +1;
+
+	return 0;
+}
+
+static char const *packet_code(unsigned int code)
+{
+	if ((code > 0) && (code < FR_MAX_PACKET_CODE)) return fr_packet_codes[code];
+
+	return "none";
+}
+
+static void trace_print(FILE *fp, fr_trace_event_t const *ev, bool raw_time)
+{
+	char		when[64];
+	char		name[FR_TRACE_NAME_LEN];
+
+	if (raw_time) {
+		snprintf(when, sizeof(when), "%" PRIu64, ev->when);
+	} else {
+		time_t		secs = ev->when / 1000000;
+		struct tm	tm;
+		size_t		len;
+
+		len = strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&secs, &tm));
+		snprintf(when + len, sizeof(when) - len, ".%06u", (unsigned int) (ev->when % 1000000));
+	}
+
+	/*
+	 *	Don't trust the file.
+	 */
+	memcpy(name, ev->name, sizeof(name));
+	name[sizeof(name) - 1] = '\0';
+
+	fprintf(fp, "%s (%u) %s", when, ev->number, fr_int2str(trace_types, ev->type, "unknown"));
+
+	switch (ev->type) {
+	case FR_TRACE_REQUEST_START:
+		fprintf(fp, " %s %s\n", name, packet_code(ev->code));
+		break;
+
+	case FR_TRACE_REQUEST_DONE:
+		fprintf(fp, " %s %s %uus\n", name, packet_code(ev->code), ev->duration);
+		break;
+
+	case FR_TRACE_SECTION_ENTER:
+		fprintf(fp, " %s %s\n", name, TRACE_NAME(trace_sections, ev->code));
+		break;
+
+	case FR_TRACE_SECTION_EXIT:
+	case FR_TRACE_MODULE_CALL:
+		fprintf(fp, " %s %s %s %uus\n", name, TRACE_NAME(trace_sections, ev->code),
+			TRACE_NAME(trace_rcodes, ev->rcode), ev->duration);
+		break;
+
+	case FR_TRACE_XLAT:
+		fprintf(fp, " %s %s %uus\n", name, ev->code ? "failed" : "ok", ev->duration);
+		break;
+
+	case FR_TRACE_PROXY_SEND:
+		fprintf(fp, " %s %s\n", name, packet_code(ev->code));
+		break;
+
+	case FR_TRACE_PROXY_REPLY:
+	case FR_TRACE_PROXY_TIMEOUT:
+		fprintf(fp, " %s %s %uus\n", name, packet_code(ev->code), ev->duration);
+		break;
+
+	default:
+		fprintf(fp, " %s %u %u %uus\n", name, ev->code, ev->rcode, ev->duration);
+		break;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int			c;
+	FILE			*fp;
+	fr_trace_header_t	hdr;
+	fr_trace_event_t	*events;
+	uint64_t		i, count;
+	bool			raw_time = false;
+	bool			only = false;
+	unsigned long		number = 0;
+
+	while ((c = getopt(argc, argv, "hn:u")) != EOF) switch (c) {
+	case 'h':
+		usage(0);
+
+	case 'n':
+		only = true;
+		number = strtoul(optarg, NULL, 10);
+		break;
+
+	case 'u':
+		raw_time = true;
+		break;
+
+	default:
+		usage(1);
+	}
+	argc -= (optind - 1);
+	argv += (optind - 1);
+
+	if (argc != 2) usage(1);
+
+	fp = fopen(argv[1], "r");
+	if (!fp) {
+		fprintf(stderr, "%s: Failed opening %s: %s\n", progname, argv[1], fr_syserror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if ((fread(&hdr, sizeof(hdr), 1, fp) != 1) ||
+	    (memcmp(hdr.magic, FR_TRACE_MAGIC, sizeof(FR_TRACE_MAGIC)) != 0)) {
+		fprintf(stderr, "%s: %s is not a trace file\n", progname, argv[1]);
+		exit(EXIT_FAILURE);
+	}
+
+	if ((hdr.version != FR_TRACE_VERSION) || (hdr.event_size != sizeof(fr_trace_event_t))) {
+		fprintf(stderr, "%s: %s was written by an incompatible server (version %u, event size %u)\n",
+			progname, argv[1], hdr.version, hdr.event_size);
+		exit(EXIT_FAILURE);
+	}
+
+	if (hdr.count > (SIZE_MAX / sizeof(fr_trace_event_t))) {
+		fprintf(stderr, "%s: %s has too many events\n", progname, argv[1]);
+		exit(EXIT_FAILURE);
+	}
+
+	events = malloc(hdr.count * sizeof(fr_trace_event_t) + 1);
+	if (!events) {
+		fprintf(stderr, "%s: Out of memory\n", progname);
+		exit(EXIT_FAILURE);
+	}
+
+	count = fread(events, sizeof(fr_trace_event_t), hdr.count, fp);
+	if (count != hdr.count) {
+		fprintf(stderr, "%s: %s is truncated.  Expected %" PRIu64 " events, found %" PRIu64 "\n",
+			progname, argv[1], hdr.count, count);
+	}
+	fclose(fp);
+
+	qsort(events, count, sizeof(fr_trace_event_t), trace_cmp);
+
+	for (i = 0; i < count; i++) {
+		if (only && (events[i].number != number)) continue;
+
+		trace_print(stdout, &events[i], raw_time);
+	}
+
+	free(events);
+
+	return 0;
+}
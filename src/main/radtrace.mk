@@ -0,0 +1,5 @@
+TARGET		:= radtrace
+SOURCES		:= radtrace.c
+
+TGT_PREREQS	:= libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
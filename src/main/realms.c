@@ -33,7 +33,7 @@ RCSID("$Id$")
 #include <ctype.h>
 #include <fcntl.h>
 
-static rbtree_t *realms_byname = NULL;
+static fr_hash_rcu_t *realms_byname = NULL;
 #ifdef WITH_TCP
 bool home_servers_udp = false;
 #endif
@@ -47,9 +47,35 @@ typedef struct realm_regex realm_regex_t;
 struct realm_regex {
 	REALM		*realm;		//!< The realm this regex matches.
 	regex_t		*preg;		//!< The pre-compiled regular expression.
+	uint32_t	order;		//!< Position in the configuration.  The first
+					//!< realm which matches is used.
 	realm_regex_t	*next;		//!< The next realm in the list of regular expressions.
+	realm_regex_t	*next_pattern;	//!< The next realm which isn't in the suffix trie.
 };
 static realm_regex_t *realms_regex = NULL;
+static realm_regex_t *realms_pattern = NULL;
+static uint32_t realms_regex_num = 0;
+
+typedef struct realm_suffix realm_suffix_t;
+
+/** A domain in the suffix trie of regex realms
+ *
+ * Regular expressions such as "^(.*\.)?example\.com$" just match a domain,
+ * and the names below it.  Rather than running each of them in turn, they're
+ * kept in a trie of domain labels, starting with the top level domain.
+ *
+ * All the nodes are in one hash table, keyed by their parent and label, so
+ * that it can be read without locking, like #realms_byname.
+ */
+struct realm_suffix {
+	realm_suffix_t const	*parent;	//!< NULL for top level domains.
+	char const		*label;		//!< In lower case.
+	size_t			label_len;
+
+	realm_regex_t		*exact;		//!< Matches this domain.
+	realm_regex_t		*below;		//!< Matches any name ending in "." and this domain.
+};
+static fr_hash_rcu_t *realms_suffix = NULL;
 #endif /* HAVE_REGEX */
 
 struct realm_config {
@@ -80,14 +106,14 @@ static const FR_NAME_NUMBER home_ping_check[] = {
 static realm_config_t *realm_config = NULL;
 
 #ifdef WITH_PROXY
-static rbtree_t	*home_servers_byaddr = NULL;
-static rbtree_t	*home_servers_byname = NULL;
+static fr_hash_rcu_t	*home_servers_byaddr = NULL;
+static fr_hash_rcu_t	*home_servers_byname = NULL;
 #ifdef WITH_STATS
 static int home_server_max_number = 0;
-static rbtree_t	*home_servers_bynumber = NULL;
+static fr_hash_rcu_t	*home_servers_bynumber = NULL;
 #endif
 
-static rbtree_t	*home_pools_byname = NULL;
+static fr_hash_rcu_t	*home_pools_byname = NULL;
 
 /*
  *  Map the proxy server configuration parameters to variables.
@@ -116,6 +142,13 @@ static int realm_name_cmp(void const *one, void const *two)
 	return strcasecmp(a->name, b->name);
 }
 
+static uint32_t realm_name_hash(void const *data)
+{
+	REALM const *r = data;
+
+	return fr_hash_case_string(r->name);
+}
+
 
 #ifdef WITH_PROXY
 static void home_server_free(void *data)
@@ -136,6 +169,36 @@ static int home_server_name_cmp(void const *one, void const *two)
 	return strcasecmp(a->name, b->name);
 }
 
+static uint32_t home_server_name_hash(void const *data)
+{
+	home_server_t const *home = data;
+
+	return fr_hash_update(&home->type, sizeof(home->type), fr_hash_case_string(home->name));
+}
+
+/*
+ *	Hashes the same fields as fr_ipaddr_cmp() compares.
+ */
+static uint32_t home_server_ipaddr_hash(fr_ipaddr_t const *ipaddr, uint32_t hash)
+{
+	hash = fr_hash_update(&ipaddr->af, sizeof(ipaddr->af), hash);
+	hash = fr_hash_update(&ipaddr->prefix, sizeof(ipaddr->prefix), hash);
+
+	switch (ipaddr->af) {
+	case AF_INET:
+		return fr_hash_update(&ipaddr->ipaddr.ip4addr, sizeof(ipaddr->ipaddr.ip4addr), hash);
+
+#ifdef HAVE_STRUCT_SOCKADDR_IN6
+	case AF_INET6:
+		hash = fr_hash_update(&ipaddr->zone_id, sizeof(ipaddr->zone_id), hash);
+		return fr_hash_update(&ipaddr->ipaddr.ip6addr, sizeof(ipaddr->ipaddr.ip6addr), hash);
+#endif
+
+	default:
+		return hash;
+	}
+}
+
 static int home_server_addr_cmp(void const *one, void const *two)
 {
 	int rcode;
@@ -164,6 +227,22 @@ static int home_server_addr_cmp(void const *one, void const *two)
 	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
 }
 
+static uint32_t home_server_addr_hash(void const *data)
+{
+	home_server_t const *home = data;
+	uint32_t hash;
+
+	if (home->server) return fr_hash_update(&home->type, sizeof(home->type), fr_hash_string(home->server));
+
+	hash = fr_hash(&home->port, sizeof(home->port));
+#ifdef WITH_TCP
+	hash = fr_hash_update(&home->proto, sizeof(home->proto), hash);
+#endif
+	hash = home_server_ipaddr_hash(&home->src_ipaddr, hash);
+
+	return home_server_ipaddr_hash(&home->ipaddr, hash);
+}
+
 #ifdef WITH_STATS
 static int home_server_number_cmp(void const *one, void const *two)
 {
@@ -172,6 +251,13 @@ static int home_server_number_cmp(void const *one, void const *two)
 
 	return (a->number - b->number);
 }
+
+static uint32_t home_server_number_hash(void const *data)
+{
+	home_server_t const *home = data;
+
+	return fr_hash(&home->number, sizeof(home->number));
+}
 #endif
 
 static int home_pool_name_cmp(void const *one, void const *two)
@@ -185,6 +271,13 @@ static int home_pool_name_cmp(void const *one, void const *two)
 	return strcasecmp(a->name, b->name);
 }
 
+static uint32_t home_pool_name_hash(void const *data)
+{
+	home_pool_t const *pool = data;
+
+	return fr_hash_update(&pool->server_type, sizeof(pool->server_type), fr_hash_case_string(pool->name));
+}
+
 
 static size_t CC_HINT(nonnull) xlat_cs(CONF_SECTION *cs, char const *fmt, char *out, size_t outlen)
 {
@@ -257,23 +350,30 @@ void realms_free(void)
 {
 #ifdef WITH_PROXY
 #  ifdef WITH_STATS
-	rbtree_free(home_servers_bynumber);
+	fr_hash_rcu_free(home_servers_bynumber);
 	home_servers_bynumber = NULL;
 #  endif
 
-	rbtree_free(home_servers_byname);
+	fr_hash_rcu_free(home_servers_byname);
 	home_servers_byname = NULL;
 
-	rbtree_free(home_servers_byaddr);
+	fr_hash_rcu_free(home_servers_byaddr);
 	home_servers_byaddr = NULL;
 
-	rbtree_free(home_pools_byname);
+	fr_hash_rcu_free(home_pools_byname);
 	home_pools_byname = NULL;
 #endif
 
-	rbtree_free(realms_byname);
+	fr_hash_rcu_free(realms_byname);
 	realms_byname = NULL;
 
+#ifdef HAVE_REGEX
+	fr_hash_rcu_free(realms_suffix);
+	realms_suffix = NULL;
+	realms_regex = realms_pattern = NULL;
+	realms_regex_num = 0;
+#endif
+
 	realm_pool_free(NULL);
 
 	talloc_free(realm_config);
@@ -284,9 +384,11 @@ void realms_free(void)
 #ifdef WITH_PROXY
 static CONF_PARSER limit_config[] = {
 	{ FR_CONF_OFFSET("max_connections", PW_TYPE_INTEGER, home_server_t, limit.max_connections), .dflt = "16" },
+	{ FR_CONF_OFFSET("min_connections", PW_TYPE_INTEGER, home_server_t, limit.min_connections), .dflt = "0" },
 	{ FR_CONF_OFFSET("max_requests", PW_TYPE_INTEGER, home_server_t, limit.max_requests), .dflt = "0" },
 	{ FR_CONF_OFFSET("lifetime", PW_TYPE_INTEGER, home_server_t, limit.lifetime), .dflt = "0" },
 	{ FR_CONF_OFFSET("idle_timeout", PW_TYPE_INTEGER, home_server_t, limit.idle_timeout), .dflt = "0" },
+	{ FR_CONF_OFFSET("spare_ids", PW_TYPE_INTEGER, home_server_t, limit.spare_ids), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -296,6 +398,10 @@ static CONF_PARSER home_server_coa[] = {
 	{ FR_CONF_OFFSET("mrt", PW_TYPE_INTEGER, home_server_t, coa_mrt), .dflt = STRINGIFY(16) },
 	{ FR_CONF_OFFSET("mrc", PW_TYPE_INTEGER, home_server_t, coa_mrc), .dflt = STRINGIFY(5) },
 	{ FR_CONF_OFFSET("mrd", PW_TYPE_INTEGER, home_server_t, coa_mrd), .dflt = STRINGIFY(30) },
+
+	{ FR_CONF_OFFSET("bulk_rate", PW_TYPE_INTEGER, home_server_t, coa_bulk_limit.rate), .dflt = "1000" },
+	{ FR_CONF_OFFSET("bulk_burst", PW_TYPE_INTEGER, home_server_t, coa_bulk_limit.burst), .dflt = "0" },
+	{ FR_CONF_OFFSET("bulk_queue", PW_TYPE_INTEGER, home_server_t, coa_bulk_queue), .dflt = "65536" },
 	CONF_PARSER_TERMINATOR
 };
 #endif
@@ -319,11 +425,14 @@ static CONF_PARSER home_server_config[] = {
 	{ FR_CONF_OFFSET("src_ipaddr", PW_TYPE_STRING, home_server_t, src_ipaddr_str) },
 
 	{ FR_CONF_OFFSET("response_window", PW_TYPE_TIMEVAL, home_server_t, response_window), .dflt = "30" },
+	{ FR_CONF_OFFSET("adaptive_response_window", PW_TYPE_BOOLEAN, home_server_t, adaptive_window), .dflt = "no" },
 	{ FR_CONF_OFFSET("response_timeouts", PW_TYPE_INTEGER, home_server_t, max_response_timeouts), .dflt = "1" },
 	{ FR_CONF_OFFSET("max_outstanding", PW_TYPE_INTEGER, home_server_t, max_outstanding), .dflt = "65536" },
 
 	{ FR_CONF_OFFSET("zombie_period", PW_TYPE_INTEGER, home_server_t, zombie_period), .dflt = "40" },
 
+	{ FR_CONF_OFFSET("verbatim", PW_TYPE_BOOLEAN, home_server_t, verbatim), .dflt = "no" },
+
 	{ FR_CONF_OFFSET("status_check", PW_TYPE_STRING, home_server_t, ping_check_str), .dflt = "none" },
 	{ FR_CONF_OFFSET("ping_check", PW_TYPE_STRING, home_server_t, ping_check_str) },
 
@@ -408,15 +517,36 @@ void realm_home_server_sanitize(home_server_t *home, CONF_SECTION *cs)
 
 	FR_INTEGER_BOUND_CHECK("coa_mrd", home->coa_mrd, >=, 5);
 	FR_INTEGER_BOUND_CHECK("coa_mrd", home->coa_mrd, <=, 60);
+
+	FR_INTEGER_BOUND_CHECK("coa_bulk_rate", home->coa_bulk_limit.rate, <=, 1000000);
+	FR_INTEGER_BOUND_CHECK("coa_bulk_burst", home->coa_bulk_limit.burst, <=, 1000000);
+	FR_INTEGER_BOUND_CHECK("coa_bulk_queue", home->coa_bulk_queue, >=, 2);
+	FR_INTEGER_BOUND_CHECK("coa_bulk_queue", home->coa_bulk_queue, <=, 1048576);
 #endif
 
 	FR_INTEGER_BOUND_CHECK("max_connections", home->limit.max_connections, <=, 1024);
+	FR_INTEGER_BOUND_CHECK("min_connections", home->limit.min_connections, <=, 1024);
+	FR_INTEGER_BOUND_CHECK("spare_ids", home->limit.spare_ids, <=, 16384);
 
 #ifdef WITH_TCP
 	/*
-	 *	UDP sockets can't be connection limited.
+	 *	UDP sockets can't be connection limited, unless we're
+	 *	opening them ahead of time.  TCP connections carry
+	 *	their own limits.
 	 */
-	if (home->proto != IPPROTO_TCP) home->limit.max_connections = 0;
+	if (home->proto != IPPROTO_TCP) {
+		if (!home->limit.spare_ids) home->limit.max_connections = 0;
+		home->limit.min_connections = 0;
+	} else {
+		home->limit.spare_ids = 0;
+
+		if (home->limit.max_connections) {
+			FR_INTEGER_BOUND_CHECK("min_connections", home->limit.min_connections, <=,
+					       home->limit.max_connections);
+		}
+	}
+#else
+	home->limit.min_connections = 0;
 #endif
 
 	if ((home->limit.idle_timeout > 0) && (home->limit.idle_timeout < 5))
@@ -449,23 +579,23 @@ void realm_home_server_sanitize(home_server_t *home, CONF_SECTION *cs)
  */
 static bool home_server_insert(home_server_t *home, CONF_SECTION *cs)
 {
-	if (home->name && !rbtree_insert(home_servers_byname, home)) {
+	if (home->name && !fr_hash_rcu_insert(home_servers_byname, home)) {
 		cf_log_err_cs(cs, "Internal error %d adding home server %s", __LINE__, home->log_name);
 		return false;
 	}
 
-	if (!home->server && !rbtree_insert(home_servers_byaddr, home)) {
-		rbtree_deletebydata(home_servers_byname, home);
+	if (!home->server && !fr_hash_rcu_insert(home_servers_byaddr, home)) {
+		fr_hash_rcu_delete(home_servers_byname, home);
 		cf_log_err_cs(cs, "Internal error %d adding home server %s", __LINE__, home->log_name);
 		return false;
 	}
 
 #ifdef WITH_STATS
 	home->number = home_server_max_number++;
-	if (!rbtree_insert(home_servers_bynumber, home)) {
-		rbtree_deletebydata(home_servers_byname, home);
+	if (!fr_hash_rcu_insert(home_servers_bynumber, home)) {
+		fr_hash_rcu_delete(home_servers_byname, home);
 		if (home->ipaddr.af != AF_UNSPEC) {
-			rbtree_deletebydata(home_servers_byname, home);
+			fr_hash_rcu_delete(home_servers_byname, home);
 		}
 		cf_log_err_cs(cs, "Internal error %d adding home server %s", __LINE__, home->log_name);
 		return false;
@@ -493,12 +623,12 @@ bool realm_home_server_add(home_server_t *home)
 		return false;
 	}
 
-	if (home->name && (rbtree_finddata(home_servers_byname, home) != NULL)) {
+	if (home->name && (fr_hash_rcu_finddata(home_servers_byname, home) != NULL)) {
 		cf_log_err_cs(home->cs, "Duplicate home server name %s", home->name);
 		return false;
 	}
 
-	if (!home->server && (rbtree_finddata(home_servers_byaddr, home) != NULL)) {
+	if (!home->server && (fr_hash_rcu_finddata(home_servers_byaddr, home) != NULL)) {
 		char buffer[INET6_ADDRSTRLEN];
 
 		inet_ntop(home->ipaddr.af, &home->ipaddr.ipaddr, buffer, sizeof(buffer));
@@ -732,7 +862,7 @@ home_server_t *home_server_afrom_cs(TALLOC_CTX *ctx, realm_config_t *rc, CONF_SE
 		home->proto = proto;
 	}
 
-	if (!home->server && rbtree_finddata(home_servers_byaddr, home)) {
+	if (!home->server && fr_hash_rcu_finddata(home_servers_byaddr, home)) {
 		cf_log_err_cs(cs, "Duplicate home server");
 		goto error;
 	}
@@ -981,7 +1111,7 @@ static int pool_check_home_server(UNUSED realm_config_t *rc, CONF_PAIR *cp,
 
 	myhome.name = name;
 	myhome.type = server_type;
-	home = rbtree_finddata(home_servers_byname, &myhome);
+	home = fr_hash_rcu_finddata(home_servers_byname, &myhome);
 	if (home) {
 		*phome = home;
 		return 1;
@@ -991,7 +1121,7 @@ static int pool_check_home_server(UNUSED realm_config_t *rc, CONF_PAIR *cp,
 	case HOME_TYPE_AUTH:
 	case HOME_TYPE_ACCT:
 		myhome.type = HOME_TYPE_AUTH_ACCT;
-		home = rbtree_finddata(home_servers_byname, &myhome);
+		home = fr_hash_rcu_finddata(home_servers_byname, &myhome);
 		if (home) {
 			*phome = home;
 			return 1;
@@ -1119,7 +1249,7 @@ int realm_pool_add(home_pool_t *pool, UNUSED CONF_SECTION *cs)
 		return 0;
 	}
 
-	if (!rbtree_insert(home_pools_byname, pool)) {
+	if (!fr_hash_rcu_insert(home_pools_byname, pool)) {
 		rad_assert("Internal sanity check failed" == NULL);
 		return 0;
 	}
@@ -1219,6 +1349,8 @@ static int server_pool_add(realm_config_t *rc,
 			{ "client-balance", HOME_POOL_CLIENT_BALANCE },
 			{ "client-port-balance", HOME_POOL_CLIENT_PORT_BALANCE },
 			{ "keyed-balance", HOME_POOL_KEYED_BALANCE },
+			{ "latency-balance", HOME_POOL_LATENCY_BALANCE },
+			{ "consistent-balance", HOME_POOL_CONSISTENT_BALANCE },
 			{ NULL, 0 }
 		};
 
@@ -1271,13 +1403,13 @@ static int server_pool_add(realm_config_t *rc,
 		myhome.name = value;
 		myhome.type = server_type;
 
-		home = rbtree_finddata(home_servers_byname, &myhome);
+		home = fr_hash_rcu_finddata(home_servers_byname, &myhome);
 		if (!home) {
 			switch (server_type) {
 			case HOME_TYPE_AUTH:
 			case HOME_TYPE_ACCT:
 				myhome.type = HOME_TYPE_AUTH_ACCT;
-				home = rbtree_finddata(home_servers_byname, &myhome);
+				home = fr_hash_rcu_finddata(home_servers_byname, &myhome);
 				break;
 
 			default:
@@ -1353,7 +1485,7 @@ static int old_server_add(realm_config_t *rc, CONF_SECTION *cs,
 #else
 	mypool.name = realm;
 	mypool.server_type = type;
-	pool = rbtree_finddata(home_pools_byname, &mypool);
+	pool = fr_hash_rcu_finddata(home_pools_byname, &mypool);
 	if (pool) {
 		if (pool->type != ldflag) {
 			cf_log_err_cs(cs, "Inconsistent ldflag for server pool \"%s\"", name);
@@ -1368,7 +1500,7 @@ static int old_server_add(realm_config_t *rc, CONF_SECTION *cs,
 
 	myhome.name = name;
 	myhome.type = type;
-	home = rbtree_finddata(home_servers_byname, &myhome);
+	home = fr_hash_rcu_finddata(home_servers_byname, &myhome);
 	if (home) {
 		if (secret && (strcmp(home->secret, secret) != 0)) {
 			cf_log_err_cs(cs, "Inconsistent shared secret for home server \"%s\"", name);
@@ -1490,20 +1622,20 @@ static int old_server_add(realm_config_t *rc, CONF_SECTION *cs,
 
 		home->revive_interval = rc->dead_time;
 
-		if (rbtree_finddata(home_servers_byaddr, home)) {
+		if (fr_hash_rcu_finddata(home_servers_byaddr, home)) {
 			cf_log_err_cs(cs, "Home server %s has the same IP address and/or port as another home server.", name);
 			talloc_free(home);
 			return 0;
 		}
 
-		if (!rbtree_insert(home_servers_byname, home)) {
+		if (!fr_hash_rcu_insert(home_servers_byname, home)) {
 			cf_log_err_cs(cs, "Internal error %d adding home server %s.", __LINE__, name);
 			talloc_free(home);
 			return 0;
 		}
 
-		if (!rbtree_insert(home_servers_byaddr, home)) {
-			rbtree_deletebydata(home_servers_byname, home);
+		if (!fr_hash_rcu_insert(home_servers_byaddr, home)) {
+			fr_hash_rcu_delete(home_servers_byname, home);
 			cf_log_err_cs(cs, "Internal error %d adding home server %s.", __LINE__, name);
 			talloc_free(home);
 			return 0;
@@ -1511,10 +1643,10 @@ static int old_server_add(realm_config_t *rc, CONF_SECTION *cs,
 
 #ifdef WITH_STATS
 		home->number = home_server_max_number++;
-		if (!rbtree_insert(home_servers_bynumber, home)) {
-			rbtree_deletebydata(home_servers_byname, home);
+		if (!fr_hash_rcu_insert(home_servers_bynumber, home)) {
+			fr_hash_rcu_delete(home_servers_byname, home);
 			if (home->ipaddr.af != AF_UNSPEC) {
-				rbtree_deletebydata(home_servers_byname, home);
+				fr_hash_rcu_delete(home_servers_byname, home);
 			}
 			cf_log_err_cs(cs,
 				   "Internal error %d adding home server %s.",
@@ -1567,7 +1699,7 @@ static int old_server_add(realm_config_t *rc, CONF_SECTION *cs,
 
 	pool->servers[0] = home;
 
-	if (!rbtree_insert(home_pools_byname, pool)) {
+	if (!fr_hash_rcu_insert(home_pools_byname, pool)) {
 		rad_assert("Internal sanity check failed" == NULL);
 		return 0;
 	}
@@ -1718,7 +1850,7 @@ static int add_pool_to_realm(realm_config_t *rc, CONF_SECTION *cs,
 	mypool.name = name;
 	mypool.server_type = server_type;
 
-	pool = rbtree_finddata(home_pools_byname, &mypool);
+	pool = fr_hash_rcu_finddata(home_pools_byname, &mypool);
 	if (!pool) {
 		CONF_SECTION *pool_cs;
 
@@ -1739,7 +1871,7 @@ static int add_pool_to_realm(realm_config_t *rc, CONF_SECTION *cs,
 			return 0;
 		}
 
-		pool = rbtree_finddata(home_pools_byname, &mypool);
+		pool = fr_hash_rcu_finddata(home_pools_byname, &mypool);
 		if (!pool) {
 			ERROR("Internal sanity check failed in add_pool_to_realm");
 			return 0;
@@ -1953,6 +2085,199 @@ static int realm_add(realm_config_t *rc, CONF_SECTION *cs)
 	return 0;
 }
 
+#ifdef HAVE_REGEX
+static uint32_t realm_suffix_hash(void const *data)
+{
+	realm_suffix_t const	*node = data;
+	uint32_t		hash = fr_hash(&node->parent, sizeof(node->parent));
+	size_t			i;
+
+	for (i = 0; i < node->label_len; i++) {
+		uint8_t c = tolower((uint8_t) node->label[i]);
+
+		hash = fr_hash_update(&c, 1, hash);
+	}
+
+	return hash;
+}
+
+static int realm_suffix_cmp(void const *one, void const *two)
+{
+	realm_suffix_t const *a = one, *b = two;
+
+	if (a->parent != b->parent) return (a->parent < b->parent) ? -1 : 1;
+	if (a->label_len != b->label_len) return (a->label_len < b->label_len) ? -1 : 1;
+
+	return strncasecmp(a->label, b->label, a->label_len);
+}
+
+static void _realm_suffix_free(void *data)
+{
+	talloc_free(data);
+}
+
+/** Add a regex realm to the suffix trie, if it just matches a domain
+ *
+ * The regular expressions are case insensitive, so the trie is too.
+ * Only expressions anchored at the start are accepted, as without the
+ * anchor, "(.*\.)?example\.com$" also matches "myexample.com".
+ *
+ *   - "^example\.com$" matches the domain.
+ *   - "^(.*\.)?example\.com$" matches the domain, and any name ending
+ *     in ".example.com".
+ *   - "\.example\.com$", ".*\.example\.com$" and "^.*\.example\.com$"
+ *     match any name ending in ".example.com".
+ *
+ * @param[in] rr	the regex realm.
+ * @param[in] pattern	the regular expression, without the '~'.
+ * @return
+ *	- true if the realm was added to the trie.
+ *	- false if it has to be run as a regular expression.
+ */
+static bool realm_suffix_add(realm_regex_t *rr, char const *pattern)
+{
+	static char const	*below_only[] = { "\\.", ".*\\.", "^.*\\." };
+	char			domain[256];
+	char const		*p, *q, *end;
+	char			*out = domain;
+	bool			exact = false, below = false;
+	realm_suffix_t const	*parent = NULL;
+	realm_suffix_t		*node = NULL, find;
+	size_t			i;
+
+	if (strncmp(pattern, "^(.*\\.)?", 8) == 0) {
+		exact = below = true;
+		p = pattern + 8;
+	} else if (pattern[0] == '^') {
+		exact = true;
+		p = pattern + 1;
+	} else {
+		p = NULL;
+		for (i = 0; i < sizeof(below_only) / sizeof(*below_only); i++) {
+			size_t len = strlen(below_only[i]);
+
+			if (strncmp(pattern, below_only[i], len) == 0) {
+				below = true;
+				p = pattern + len;
+			}
+		}
+		if (!p) return false;
+	}
+
+	/*
+	 *	The rest has to be a domain name, with escaped dots,
+	 *	anchored at the end.
+	 */
+	end = p + strlen(p);
+	if ((end == p) || (end[-1] != '$')) return false;
+	end--;
+
+	while (p < end) {
+		if ((p[0] == '\\') && ((p + 1) < end) && (p[1] == '.')) {
+			*out++ = '.';
+			p += 2;
+		} else if (isalnum((uint8_t) *p) || (*p == '-') || (*p == '_')) {
+			*out++ = tolower((uint8_t) *p);
+			p++;
+		} else {
+			return false;
+		}
+
+		if (out >= (domain + sizeof(domain) - 1)) return false;
+	}
+	*out = '\0';
+
+	/*
+	 *	No empty labels.
+	 */
+	if (!domain[0] || (domain[0] == '.') || (out[-1] == '.') || strstr(domain, "..")) return false;
+
+	if (!realms_suffix) {
+		realms_suffix = fr_hash_rcu_create(NULL, realm_suffix_hash, realm_suffix_cmp, _realm_suffix_free);
+		if (!realms_suffix) return false;
+	}
+
+	/*
+	 *	Walk down from the top level domain, creating nodes as
+	 *	we go.
+	 */
+	end = out;
+	while (end > domain) {
+		for (q = end; (q > domain) && (q[-1] != '.'); q--);
+
+		find.parent = parent;
+		find.label = q;
+		find.label_len = end - q;
+
+		node = fr_hash_rcu_finddata(realms_suffix, &find);
+		if (!node) {
+			node = talloc_zero(NULL, realm_suffix_t);
+			if (!node) return false;
+
+			node->parent = parent;
+			node->label = talloc_strndup(node, q, end - q);
+			node->label_len = end - q;
+			if (!node->label || !fr_hash_rcu_insert(realms_suffix, node)) {
+				talloc_free(node);
+				return false;
+			}
+		}
+
+		parent = node;
+		end = (q > domain) ? q - 1 : q;
+	}
+
+	/*
+	 *	Where two realms match the same names, the first one
+	 *	wins, as it would have done when they were both run in
+	 *	order.
+	 */
+	if (exact && !node->exact) node->exact = rr;
+	if (below && !node->below) node->below = rr;
+
+	return true;
+}
+
+/** Find the first regex realm in the suffix trie which matches a name
+ *
+ */
+static realm_regex_t *realm_suffix_find(char const *name)
+{
+	char const		*p, *end = name + strlen(name);
+	realm_suffix_t const	*parent = NULL;
+	realm_suffix_t		*node, find;
+	realm_regex_t		*best = NULL;
+
+	if (!realms_suffix) return NULL;
+
+	for (;;) {
+		for (p = end; (p > name) && (p[-1] != '.'); p--);
+
+		find.parent = parent;
+		find.label = p;
+		find.label_len = end - p;
+
+		node = fr_hash_rcu_finddata(realms_suffix, &find);
+		if (!node) break;
+
+		if (p == name) {
+			if (node->exact && (!best || (node->exact->order < best->order))) best = node->exact;
+			break;
+		}
+
+		/*
+		 *	What's left of the name ends in a '.'
+		 */
+		if (node->below && (!best || (node->below->order < best->order))) best = node->below;
+
+		parent = node;
+		end = p - 1;
+	}
+
+	return best;
+}
+#endif
+
 #ifdef HAVE_REGEX
 int realm_realm_add(REALM *r, CONF_SECTION *cs)
 #else
@@ -1999,18 +2324,30 @@ int realm_realm_add(REALM *r, UNUSED CONF_SECTION *cs)
 			return 0;
 		}
 
-		last = &realms_regex;
-		while (*last) last = &((*last)->next);  /* O(N^2)... sue me. */
-
 		rr->realm = r;
+		rr->order = realms_regex_num++;
 		rr->next = NULL;
+		rr->next_pattern = NULL;
+
+		/*
+		 *	Domain style expressions go into the trie.
+		 *	Everything else is run in order.
+		 */
+		if (!realm_suffix_add(rr, r->name + 1)) {
+			last = &realms_pattern;
+			while (*last) last = &((*last)->next_pattern);
+			*last = rr;
+		}
+
+		last = &realms_regex;
+		while (*last) last = &((*last)->next);  /* O(N^2)... sue me. */
 
 		*last = rr;
 		return 1;
 	}
 #endif
 
-	if (!rbtree_insert(realms_byname, r)) {
+	if (!fr_hash_rcu_insert(realms_byname, r)) {
 		rad_assert("Internal sanity check failed" == NULL);
 		return 0;
 	}
@@ -2070,7 +2407,6 @@ static int pool_peek_type(CONF_SECTION *config, CONF_SECTION *cs)
 int realms_init(CONF_SECTION *config)
 {
 	CONF_SECTION *cs;
-	int flags = 0;
 #ifdef WITH_PROXY
 	CONF_SECTION *server_cs;
 #endif
@@ -2097,22 +2433,22 @@ int realms_init(CONF_SECTION *config)
 		rc->wake_all_if_all_dead= 0;
 	}
 
-	if (rc->dynamic) {
-		flags = RBTREE_FLAG_LOCK;
-	}
-
-	home_servers_byaddr = rbtree_create(NULL, home_server_addr_cmp, home_server_free, flags);
+	/*
+	 *	Lookups don't lock, and dynamic home servers can be
+	 *	added while other threads are looking.
+	 */
+	home_servers_byaddr = fr_hash_rcu_create(NULL, home_server_addr_hash, home_server_addr_cmp, home_server_free);
 	if (!home_servers_byaddr) goto error;
 
-	home_servers_byname = rbtree_create(NULL, home_server_name_cmp, NULL, flags);
+	home_servers_byname = fr_hash_rcu_create(NULL, home_server_name_hash, home_server_name_cmp, NULL);
 	if (!home_servers_byname) goto error;
 
 #ifdef WITH_STATS
-	home_servers_bynumber = rbtree_create(NULL, home_server_number_cmp, NULL, flags);
+	home_servers_bynumber = fr_hash_rcu_create(NULL, home_server_number_hash, home_server_number_cmp, NULL);
 	if (!home_servers_bynumber) goto error;
 #endif
 
-	home_pools_byname = rbtree_create(NULL, home_pool_name_cmp, NULL, flags);
+	home_pools_byname = fr_hash_rcu_create(NULL, home_pool_name_hash, home_pool_name_cmp, NULL);
 	if (!home_pools_byname) goto error;
 
 	for (cs = cf_subsection_find_next(config, NULL, "home_server");
@@ -2148,7 +2484,7 @@ int realms_init(CONF_SECTION *config)
 	 *	Now create the realms, which point to the home servers
 	 *	and home server pools.
 	 */
-	realms_byname = rbtree_create(NULL, realm_name_cmp, NULL, flags);
+	realms_byname = fr_hash_rcu_create(NULL, realm_name_hash, realm_name_cmp, NULL);
 	if (!realms_byname) goto error;
 
 	for (cs = cf_subsection_find_next(config, NULL, "realm");
@@ -2206,7 +2542,7 @@ REALM *realm_find2(char const *name)
 	if (!name) name = "NULL";
 
 	myrealm.name = name;
-	realm = rbtree_finddata(realms_byname, &myrealm);
+	realm = fr_hash_rcu_finddata(realms_byname, &myrealm);
 	if (realm) return realm;
 
 #ifdef HAVE_REGEX
@@ -2225,7 +2561,7 @@ REALM *realm_find2(char const *name)
 	 *	Couldn't find a realm.  Look for DEFAULT.
 	 */
 	myrealm.name = "DEFAULT";
-	return rbtree_finddata(realms_byname, &myrealm);
+	return fr_hash_rcu_finddata(realms_byname, &myrealm);
 }
 
 
@@ -2240,16 +2576,23 @@ REALM *realm_find(char const *name)
 	if (!name) name = "NULL";
 
 	myrealm.name = name;
-	realm = rbtree_finddata(realms_byname, &myrealm);
+	realm = fr_hash_rcu_finddata(realms_byname, &myrealm);
 	if (realm) return realm;
 
 #ifdef HAVE_REGEX
 	if (realms_regex) {
-		realm_regex_t *this;
+		realm_regex_t *this, *suffix;
 
-		for (this = realms_regex;
-		     this != NULL;
-		     this = this->next) {
+		/*
+		 *	The trie finds the first domain style realm
+		 *	which matches.  Only the other expressions
+		 *	before it need to be run.
+		 */
+		suffix = realm_suffix_find(name);
+
+		for (this = realms_pattern;
+		     this && (!suffix || (this->order < suffix->order));
+		     this = this->next_pattern) {
 			int compare;
 
 			compare = regex_exec(this->preg, name, strlen(name), NULL, NULL);
@@ -2259,6 +2602,8 @@ REALM *realm_find(char const *name)
 			}
 			if (compare == 1) return this->realm;
 		}
+
+		if (suffix) return suffix->realm;
 	}
 #endif
 
@@ -2266,7 +2611,7 @@ REALM *realm_find(char const *name)
 	 *	Couldn't find a realm.  Look for DEFAULT.
 	 */
 	myrealm.name = "DEFAULT";
-	return rbtree_finddata(realms_byname, &myrealm);
+	return fr_hash_rcu_finddata(realms_byname, &myrealm);
 }
 
 
@@ -2321,8 +2666,9 @@ void home_server_update_request(home_server_t *home, REQUEST *request)
 		 *	attribute is the one hacked through
 		 *	the 'hints' file.
 		 */
-		request->proxy->vps = fr_pair_list_copy(request->proxy,
-					       request->packet->vps);
+		(void) request_decode_pending(request, NULL);
+		request->proxy->vps = fr_pair_list_copy_ref(request->proxy,
+							   request->packet->vps);
 	}
 
 	/*
@@ -2349,6 +2695,126 @@ void home_server_update_request(home_server_t *home, REQUEST *request)
 	}
 }
 
+/*
+ *	Add a response time to the histogram, and re-derive the
+ *	response window from its 99th percentile.  The window is
+ *	never less than the configured "response_window", and
+ *	never more than "zombie_period".
+ */
+static void home_server_update_window(home_server_t *home, int64_t sample)
+{
+	int		i, bucket;
+	uint32_t	want, seen;
+	uint64_t	usec;
+	struct timeval	window;
+
+	for (bucket = 0; (bucket < (HOME_LATENCY_BUCKETS - 1)) && (sample > 1); bucket++) sample >>= 1;
+
+	home->latency_hist[bucket]++;
+	home->latency_samples++;
+
+	if (home->latency_samples < 100) return;
+
+	want = home->latency_samples - (home->latency_samples / 100);
+	seen = 0;
+	for (i = 0; i < (HOME_LATENCY_BUCKETS - 1); i++) {
+		seen += home->latency_hist[i];
+		if (seen >= want) break;
+	}
+
+	/*
+	 *	The top of the bucket holding the 99th percentile.
+	 */
+	usec = ((uint64_t) 1) << (i + 1);
+	window.tv_sec = usec / 1000000;
+	window.tv_usec = usec % 1000000;
+
+	if (timercmp(&window, &home->response_window, <)) window = home->response_window;
+	if (window.tv_sec >= (time_t) home->zombie_period) {
+		window.tv_sec = home->zombie_period;
+		window.tv_usec = 0;
+	}
+	home->adaptive_response_window = window;
+
+	/*
+	 *	Age out old samples, so that the window follows
+	 *	the home server when it speeds up again.
+	 */
+	if (home->latency_samples >= 4096) {
+		home->latency_samples = 0;
+		for (i = 0; i < HOME_LATENCY_BUCKETS; i++) {
+			home->latency_hist[i] >>= 1;
+			home->latency_samples += home->latency_hist[i];
+		}
+	}
+}
+
+/*
+ *	Update the moving average of the home server response
+ *	time.  The weight of each new sample is 1/8, as with the
+ *	TCP smoothed round trip time.
+ */
+void home_server_update_latency(home_server_t *home, struct timeval const *sent,
+				struct timeval const *received)
+{
+	struct timeval	diff;
+	int64_t		sample;
+
+	if (timercmp(received, sent, <)) return;
+
+	fr_timeval_subtract(&diff, received, sent);
+	if (diff.tv_sec > 60) diff.tv_sec = 60;	/* don't let one outlier swamp it */
+
+	sample = ((int64_t) diff.tv_sec * 1000000) + diff.tv_usec;
+	if (sample == 0) sample = 1;		/* 0 means "not measured" */
+
+	if (!home->latency) {
+		home->latency = sample;
+	} else {
+		int64_t average;
+
+		average = home->latency + ((sample - (int64_t) home->latency) / 8);
+		home->latency = (average > 0) ? average : 1;
+	}
+
+	if (home->adaptive_window) home_server_update_window(home, sample);
+}
+
+/*
+ *	Expected wait for a new request sent to the home server,
+ *	as used by "latency-balance".
+ */
+static uint64_t home_server_cost(home_server_t const *home)
+{
+	return (uint64_t) home->latency * (home->currently_outstanding + 1);
+}
+
+/*
+ *	The most requests a home server may have outstanding before
+ *	"consistent-balance" moves keys away from it.  This is 25%
+ *	over the average for the live servers in the pool, so that
+ *	one popular key can't overload one server.
+ */
+static uint32_t home_pool_max_load(home_pool_t const *pool)
+{
+	int		i;
+	uint32_t	live = 0;
+	uint64_t	total = 1;	/* count the request we're about to send */
+
+	for (i = 0; i < pool->num_home_servers; i++) {
+		home_server_t const *home = pool->servers[i];
+
+		if (!home || (home->state == HOME_STATE_IS_DEAD)) continue;
+
+		live++;
+		total += home->currently_outstanding;
+	}
+
+	if (!live) return 1;
+
+	return ((total * 5) + (4 * live) - 1) / (4 * live);
+}
+
 home_server_t *home_server_ldb(char const *realmname,
 			     home_pool_t *pool, REQUEST *request)
 {
@@ -2356,8 +2822,11 @@ home_server_t *home_server_ldb(char const *realmname,
 	int		count;
 	home_server_t	*found = NULL;
 	home_server_t	*zombie = NULL;
+	home_server_t	*busy = NULL;
 	VALUE_PAIR	*vp;
-	uint32_t	hash;
+	uint32_t	hash = 0;
+	uint32_t	max_load = 0;
+	uint32_t	weight, found_weight = 0, busy_weight = 0;
 
 	/*
 	 *	Determine how to pick choose the home server.
@@ -2413,6 +2882,22 @@ home_server_t *home_server_ldb(char const *realmname,
 		start = hash % pool->num_home_servers;
 		break;
 
+		/*
+		 *	Rendezvous hashing.  Every live server gets a
+		 *	weight from hashing the key with its name,
+		 *	and the highest weight wins.  When a server
+		 *	goes away, only the keys it had are moved, and
+		 *	they are spread over all of the others.
+		 */
+	case HOME_POOL_CONSISTENT_BALANCE:
+		if ((vp = fr_pair_find_by_num(request->config, 0, PW_LOAD_BALANCE_KEY, TAG_ANY)) != NULL) {
+			hash = fr_hash(vp->vp_strvalue, vp->vp_length);
+			max_load = home_pool_max_load(pool);
+			start = 0;
+			break;
+		}
+		/* FALL-THROUGH */
+
 	case HOME_POOL_KEYED_BALANCE:
 		if ((vp = fr_pair_find_by_num(request->config, 0, PW_LOAD_BALANCE_KEY, TAG_ANY)) != NULL) {
 			hash = fr_hash(vp->vp_strvalue, vp->vp_length);
@@ -2426,6 +2911,14 @@ home_server_t *home_server_ldb(char const *realmname,
 		start = 0;
 		break;
 
+		/*
+		 *	Start at a random server.  The first two live
+		 *	ones from there are the candidates.
+		 */
+	case HOME_POOL_LATENCY_BALANCE:
+		start = fr_fast_rand() % pool->num_home_servers;
+		break;
+
 	default:		/* this shouldn't happen... */
 		start = 0;
 		break;
@@ -2508,6 +3001,56 @@ home_server_t *home_server_ldb(char const *realmname,
 			continue;
 		}
 
+		if (max_load) {
+			weight = fr_hash_update(&hash, sizeof(hash), fr_hash_string(home->log_name));
+
+			/*
+			 *	Too busy.  Only use it if all of the
+			 *	others are too busy, too.
+			 */
+			if (home->currently_outstanding >= max_load) {
+				if (!busy || (weight > busy_weight)) {
+					busy = home;
+					busy_weight = weight;
+				}
+				continue;
+			}
+
+			if (!found || (weight > found_weight)) {
+				found = home;
+				found_weight = weight;
+			}
+			continue;
+		}
+
+		/*
+		 *	Pick the better of two candidates, by expected
+		 *	wait.  Choosing between two random servers
+		 *	avoids sending everything to whichever one
+		 *	looks fastest right now.
+		 */
+		if (pool->type == HOME_POOL_LATENCY_BALANCE) {
+			if (!found) {
+				found = home;
+				continue;
+			}
+
+			/*
+			 *	The latency of one of them hasn't been
+			 *	measured yet.  Go by load alone.
+			 */
+			if (!home->latency || !found->latency) {
+				if (home->currently_outstanding < found->currently_outstanding) found = home;
+
+			} else if (home_server_cost(home) < home_server_cost(found)) {
+				found = home;
+			}
+
+			RDEBUG3("PROXY Choosing %s (%u us, %u outstanding)", found->log_name,
+				found->latency, found->currently_outstanding);
+			break;
+		}
+
 		/*
 		 *	We've found the first "live" one.  Use that.
 		 */
@@ -2554,11 +3097,13 @@ home_server_t *home_server_ldb(char const *realmname,
 		 *	From the list of servers which have the same
 		 *	load, choose one at random.
 		 */
-		if (((count + 1) * (fr_rand() & 0xffff)) < (uint32_t) 0x10000) {
+		if (((count + 1) * (fr_fast_rand() & 0xffff)) < (uint32_t) 0x10000) {
 			found = home;
 		}
 	} /* loop over the home servers */
 
+	if (!found && busy) found = busy;
+
 	/*
 	 *	We have no live servers, BUT we have a zombie.  Use
 	 *	the zombie as a last resort.
@@ -2672,7 +3217,7 @@ home_server_t *home_server_find(fr_ipaddr_t *ipaddr, uint16_t port, int proto)
 #endif
 	myhome.server = NULL;	/* we're not called for internal proxying */
 
-	return rbtree_finddata(home_servers_byaddr, &myhome);
+	return fr_hash_rcu_finddata(home_servers_byaddr, &myhome);
 }
 
 #ifdef WITH_COA
@@ -2684,7 +3229,7 @@ home_server_t *home_server_byname(char const *name, int type)
 	myhome.type = type;
 	myhome.name = name;
 
-	return rbtree_finddata(home_servers_byname, &myhome);
+	return fr_hash_rcu_finddata(home_servers_byname, &myhome);
 }
 #endif
 
@@ -2697,7 +3242,7 @@ home_server_t *home_server_bynumber(int number)
 	myhome.number = number;
 	myhome.server = NULL;	/* we're not called for internal proxying */
 
-	return rbtree_finddata(home_servers_bynumber, &myhome);
+	return fr_hash_rcu_finddata(home_servers_bynumber, &myhome);
 }
 #endif
 
@@ -2708,7 +3253,7 @@ home_pool_t *home_pool_byname(char const *name, int type)
 	memset(&mypool, 0, sizeof(mypool));
 	mypool.name = name;
 	mypool.server_type = type;
-	return rbtree_finddata(home_pools_byname, &mypool);
+	return fr_hash_rcu_finddata(home_pools_byname, &mypool);
 }
 
 #endif
@@ -32,6 +32,12 @@ RCSID("$Id$")
 
 #define REQUEST_DATA_REGEX (0xadbeef00)
 
+#ifdef HAVE_PCRE
+#  define PCRE_UNUSED
+#else
+#  define PCRE_UNUSED UNUSED
+#endif
+
 typedef struct regcapture {
 	regex_t		*preg;		//!< Compiled pattern.
 	char const	*value;		//!< Original string.
@@ -94,6 +100,12 @@ void regex_sub_to_request(REQUEST *request, regex_t **preg, char const *value, s
 	if (!(*preg)->precompiled) {
 		new_sc->preg = talloc_steal(new_sc, *preg);
 		*preg = NULL;
+	/*
+	 *	Cached expressions may be evicted before the
+	 *	subcaptures are used, so take a copy.
+	 */
+	} else if ((*preg)->cached) {
+		MEM(new_sc->preg = regex_dup(new_sc, *preg));
 	} else
 #endif
 	{
@@ -279,4 +291,193 @@ int regex_request_to_sub(TALLOC_CTX *ctx, char **out, REQUEST *request, uint32_t
 	return 0;
 }
 #  endif
+
+/** A set of expressions, evaluated together
+ *
+ * With libpcre the expressions are combined into a single expression of the form:
+ *
+ *	\A(?:(?=[\s\S]*?(?:<pattern0>))(?<_set0>)|(?=[\s\S]*?(?:<pattern1>))(?<_set1>)|...)
+ *
+ * The alternatives are tried in order, so the empty "marker" capture group
+ * which is set identifies the first pattern in the set which matched.  Patterns
+ * are compiled without automatic capturing, so only named groups are numbered.  Sets
+ * containing patterns which can't be combined (back references, duplicate
+ * named groups) fall back to evaluating each expression in turn.
+ */
+struct regex_set {
+	size_t		count;		//!< Number of patterns in the set.
+	regex_t		**preg;		//!< Individually compiled patterns.
+
+#  ifdef HAVE_PCRE
+	regex_t		*combined;	//!< All patterns combined into a single expression.
+	int		*marker;	//!< Capture group which identifies each pattern.
+	size_t		nmatch;		//!< Number of capture groups in the combined expression (+1).
+#  endif
+};
+
+#  ifdef HAVE_PCRE
+/** Combine the patterns in a set into a single expression
+ *
+ * @param set to combine.
+ * @param patterns to combine.
+ * @param ignore_case whether to do case insensitive matching.
+ * @param multiline If true $ matches newlines.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the patterns couldn't be combined.
+ */
+static int regex_set_combine(regex_set_t *set, char const **patterns, bool ignore_case, bool multiline)
+{
+	char	*combined;
+	size_t	i;
+	int	group = 0;
+	ssize_t	slen;
+
+	set->marker = talloc_array(set, int, set->count);
+	if (!set->marker) return -1;
+
+	combined = talloc_typed_strdup(set, "\\A(?:");
+	for (i = 0; i < set->count; i++) {
+		int captures, backrefs;
+
+		if ((pcre_fullinfo(set->preg[i]->compiled, NULL, PCRE_INFO_CAPTURECOUNT, &captures) != 0) ||
+		    (pcre_fullinfo(set->preg[i]->compiled, NULL, PCRE_INFO_BACKREFMAX, &backrefs) != 0) ||
+		    (backrefs > 0)) {
+		error:
+			talloc_free(combined);
+			TALLOC_FREE(set->marker);
+			return -1;
+		}
+
+		group += captures + 1;
+		set->marker[i] = group;
+
+		combined = talloc_asprintf_append_buffer(combined, "%s(?=[\\s\\S]*?(?:%s))(?<_set%zu>)",
+							 (i > 0) ? "|" : "", patterns[i], i);
+		if (!combined) goto error;
+	}
+	combined = talloc_strdup_append_buffer(combined, ")");
+	if (!combined) goto error;
+
+	slen = regex_compile(set, &set->combined, combined, talloc_array_length(combined) - 1,
+			     ignore_case, multiline, false, false);
+	if (slen <= 0) goto error;
+	talloc_free(combined);
+
+	set->nmatch = group + 1;
+
+	return 0;
+}
+#  endif
+
+/** Compile a set of expressions for evaluation in a single pass
+ *
+ * @param ctx to allocate the set in.
+ * @param out Where to write the compiled set.
+ * @param patterns to compile.
+ * @param count Number of patterns.
+ * @param ignore_case whether to do case insensitive matching.
+ * @param multiline If true $ matches newlines.
+ * @return
+ *	- 0 on success.
+ *	- < 0 on error, the negated index (+1) of the pattern which failed to compile.
+ */
+int regex_set_compile(TALLOC_CTX *ctx, regex_set_t **out, char const **patterns, size_t count,
+		      bool ignore_case, bool multiline)
+{
+	regex_set_t	*set;
+	size_t		i;
+
+	*out = NULL;
+
+	set = talloc_zero(ctx, regex_set_t);
+	if (!set) return -1;
+
+	set->count = count;
+	set->preg = talloc_zero_array(set, regex_t *, count);
+	if (!set->preg) {
+		talloc_free(set);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		ssize_t slen;
+
+		slen = regex_compile(set, &set->preg[i], patterns[i], strlen(patterns[i]),
+				     ignore_case, multiline, false, false);
+		if (slen <= 0) {
+			talloc_free(set);
+			return -(int)(i + 1);
+		}
+	}
+
+#  ifdef HAVE_PCRE
+	if (regex_set_combine(set, patterns, ignore_case, multiline) < 0) {
+		DEBUG3("Can't combine regex set, patterns will be evaluated individually");
+	}
+#  endif
+
+	*out = set;
+
+	return 0;
+}
+
+/** Find the first expression in a set which matches the subject
+ *
+ * @param ctx to allocate temporary buffers in.
+ * @param set to evaluate.
+ * @param subject to match.
+ * @param len of subject.
+ * @return
+ *	- >= 0 the index of the first matching pattern.
+ *	- -1 if no patterns matched.
+ *	- -2 on error.
+ */
+int regex_set_exec(PCRE_UNUSED TALLOC_CTX *ctx, regex_set_t const *set, char const *subject, size_t len)
+{
+	size_t	i;
+	int	ret;
+
+#  ifdef HAVE_PCRE
+	if (set->combined) {
+		regmatch_t	*rxmatch;
+		size_t		nmatch = set->nmatch;
+		int const	*ovector;
+
+		rxmatch = talloc_array(ctx, regmatch_t, nmatch);
+		if (!rxmatch) return -2;
+
+		ret = regex_exec(set->combined, subject, len, rxmatch, &nmatch);
+		if (ret <= 0) {
+			talloc_free(rxmatch);
+			return (ret == 0) ? -1 : -2;
+		}
+
+		/*
+		 *	Exactly one of the markers will be set,
+		 *	unless there were more groups than
+		 *	we had space for (which we don't expect).
+		 */
+		ovector = (int const *)rxmatch;
+		for (i = 0; i < set->count; i++) {
+			if ((size_t)set->marker[i] >= nmatch) break;
+			if (ovector[set->marker[i] * 2] >= 0) {
+				talloc_free(rxmatch);
+				return (int)i;
+			}
+		}
+		talloc_free(rxmatch);
+
+		return -2;
+	}
+#  endif
+
+	for (i = 0; i < set->count; i++) {
+		ret = regex_exec(set->preg[i], subject, len, NULL, NULL);
+		if (ret < 0) return -2;
+		if (ret == 1) return (int)i;
+	}
+
+	return -1;
+}
 #endif
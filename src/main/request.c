@@ -109,11 +109,26 @@ REQUEST *request_alloc(TALLOC_CTX *ctx)
 	request->component = "<core>";
 	request->log.func = vradlog_request;
 
-	request->state_ctx = talloc_init("session-state");
-
 	return request;
 }
 
+/** Return the context session-state attributes and persistent data should be allocated in
+ *
+ * The context is only created the first time it's needed, or is moved into the
+ * request from a #fr_state_entry_t when the session is restored.  Most requests
+ * (accounting, single round auth) never touch session-state, so there's no point
+ * in creating and freeing a context for every one of them.
+ *
+ * @param[in] request	to get the session-state context for.
+ * @return the session-state context.
+ */
+TALLOC_CTX *request_state_ctx(REQUEST *request)
+{
+	if (!request->state_ctx) MEM(request->state_ctx = talloc_init("session-state"));
+
+	return request->state_ctx;
+}
+
 
 /*
  *	Create a new REQUEST, based on an old one.
@@ -200,6 +215,8 @@ REQUEST *request_alloc_fake(REQUEST *request)
 	 */
 	memcpy(&(fake->log), &(request->log), sizeof(fake->log));
 	fake->log.indent = 0;	/* Apart from the indent which we reset */
+	fake->trace = request->trace;
+	fake->profile = request->profile;
 
 	return fake;
 }
@@ -231,6 +248,133 @@ REQUEST *request_alloc_coa(REQUEST *request)
 }
 #endif
 
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	cancel_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define CANCEL_LOCK	pthread_mutex_lock(&cancel_mutex)
+#  define CANCEL_UNLOCK	pthread_mutex_unlock(&cancel_mutex)
+#else
+#  define CANCEL_LOCK
+#  define CANCEL_UNLOCK
+#endif
+
+/** Set a function to abort the backend call a request is about to block in
+ *
+ * Must be cleared with request_cancel_clear() as soon as the call returns,
+ * and before the handle is released or freed.
+ *
+ * Child requests share the worker thread of their parent, so the function
+ * is set on the outermost request, which is the one the main thread times
+ * out.
+ *
+ * @param[in] request about to block.
+ * @param[in] func to call if the request times out.
+ * @param[in] uctx to pass to func.
+ * @param[in] handle to pass to func, usually the connection the call is using.
+ */
+void request_cancel_set(REQUEST *request, fr_request_cancel_t func, void *uctx, void *handle)
+{
+	while (request->parent) request = request->parent;
+
+	CANCEL_LOCK;
+	request->cancel.func = func;
+	request->cancel.uctx = uctx;
+	request->cancel.handle = handle;
+	request->cancel.cancelled = false;
+	CANCEL_UNLOCK;
+}
+
+/** Clear the function set by request_cancel_set()
+ *
+ * Once this returns, the function won't be called, so the handle can be
+ * released.
+ *
+ * @param[in] request which is no longer blocked.
+ */
+void request_cancel_clear(REQUEST *request)
+{
+	while (request->parent) request = request->parent;
+
+	CANCEL_LOCK;
+	request->cancel.func = NULL;
+	request->cancel.uctx = NULL;
+	request->cancel.handle = NULL;
+	CANCEL_UNLOCK;
+}
+
+/** Abort the backend call a request is blocked in, if there is one
+ *
+ * Called from the main thread when a request runs past max_request_time.
+ * The function is only called once, and request->cancel.cancelled is set
+ * so that modules can tell why the call failed.
+ *
+ * @param[in] request which timed out.
+ * @return
+ *	- true if a backend call was cancelled.
+ *	- false if the request wasn't blocked in a call which can be cancelled.
+ */
+bool request_cancel(REQUEST *request)
+{
+	bool cancelled = false;
+
+	CANCEL_LOCK;
+	if (request->cancel.func) {
+		request->cancel.func(request, request->cancel.uctx, request->cancel.handle);
+		request->cancel.func = NULL;
+		request->cancel.cancelled = cancelled = true;
+	}
+	CANCEL_UNLOCK;
+
+	return cancelled;
+}
+
+/** Whether the last backend call for the request was cancelled because it timed out
+ *
+ * Should be checked after request_cancel_clear(), so that modules don't
+ * retry the call, e.g. on another connection.
+ *
+ * @param[in] request to check.
+ * @return true if the call was cancelled.
+ */
+bool request_cancelled(REQUEST *request)
+{
+	while (request->parent) request = request->parent;
+
+	return request->cancel.cancelled;
+}
+
+/** Decode request attributes which were skipped by a lazy decode
+ *
+ * Must be called before accessing request->packet->vps directly, for
+ * packets received on a listener with "lazy_decode" enabled.
+ *
+ * @param[in] request to decode attributes for.
+ * @param[in] da to decode, or NULL to decode everything which is left.
+ * @return
+ *	- 0 on success.
+ *	- -1 on decoding error.
+ */
+int request_decode_pending(REQUEST *request, fr_dict_attr_t const *da)
+{
+	if (!request->packet) return 0;
+
+	if (request->packet->proto_index && request->listener && request->listener->decode_pending) {
+		if (request->listener->decode_pending(request->listener, request, da) < 0) {
+			REDEBUG("Failed decoding attributes: %s", fr_strerror());
+			return -1;
+		}
+		return 0;
+	}
+
+	if (!request->packet->pending) return 0;
+
+	if (fr_radius_decode_pending(request->packet, NULL, request->client->secret, da) < 0) {
+		REDEBUG("Failed decoding attributes: %s", fr_strerror());
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Ensure opaque data is freed by binding its lifetime to the request_data_t
  *
  * @param this Request data being freed.
@@ -277,10 +421,6 @@ int request_data_add(REQUEST *request, void *unique_ptr, int unique_int, void *o
 {
 	request_data_t *this, **last, *next;
 
-	/*
-	 *	Request must have a state ctx
-	 */
-	rad_assert(!persist || request->state_ctx);
 	rad_assert(request);
 
 	this = next = NULL;
@@ -325,8 +465,7 @@ int request_data_add(REQUEST *request, void *unique_ptr, int unique_int, void *o
 	 */
 	if (!this) {
 		if (persist) {
-			rad_assert(request->state_ctx);
-			this = talloc_zero(request->state_ctx, request_data_t);
+			this = talloc_zero(request_state_ctx(request), request_data_t);
 		} else {
 			this = talloc_zero(request, request_data_t);
 		}
@@ -68,20 +68,98 @@ typedef struct state_entry {
 	VALUE_PAIR		*vps;				//!< session-state VALUE_PAIRs, parented by ctx.
 
 	request_data_t		*data;				//!< Persistable request data, also parented ctx.
+
+	rbnode_t		node;				//!< Node in the shard's tree.
 } fr_state_entry_t;
 
-struct fr_state_tree_t {
-	uint64_t		id;				//!< Next ID to assign.
+/*
+ *	Number of independently locked shards the state entries are
+ *	spread over.  Must be a power of 2.
+ */
+#define STATE_SHARDS		16
+
+/*
+ *	Replication packets.  One datagram carries one entry.
+ *
+ *	0       1       2               4
+ *	+-------+-------+---------------+
+ *	|version|  op   |    length     |
+ *	+-------+-------+---------------+
+ *	|      timestamp (seconds)      |
+ *	+-------------------------------+
+ *	|      lifetime (seconds)       |
+ *	+-------+-----------------------+
+ *	| tries |       reserved        |
+ *	+-------+-----------------------+
+ *	|       State value (16)        |
+ *	+-------------------------------+
+ *	|     attributes (ADD only)     |
+ *	+-------------------------------+
+ *	|     HMAC-MD5 of the above     |
+ *	+-------------------------------+
+ *
+ *	Each attribute is vendor (4), attr (4), tag (1), length (2) and
+ *	the value.  string and octets values are sent as-is, the others
+ *	in their printed form.  All integers are in network byte order.
+ */
+#define STATE_REPL_VERSION	1
+#define STATE_REPL_ADD		1
+#define STATE_REPL_DEL		2
+#define STATE_REPL_HDR_LEN	(16 + AUTH_VECTOR_LEN)
+#define STATE_REPL_MAX_LEN	4096
+
+/** Where, and how, state entries are replicated
+ *
+ */
+typedef struct state_replication {
+	fr_ipaddr_t		ipaddr;				//!< To receive replicated entries on.
+	uint16_t		port;
+	char const		*secret;			//!< Shared by all the peers.
+	char const		**peer_names;			//!< "address:port" of the other nodes.
+
+	int			sockfd;				//!< Sends to, and receives from, the peers.
+	fr_hmac_md5_ctx_t	hmac;				//!< HMAC-MD5 pad states keyed with the secret.
+
+	struct sockaddr_storage	*peers;				//!< Parsed peer_names.
+	socklen_t		*peers_len;
+	int			num_peers;
+
+	uint64_t		sent;				//!< Packets sent.
+	uint64_t		received;			//!< Entries added or removed by peers.
+	uint64_t		dropped;			//!< Packets ignored, or which couldn't be sent.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_t		thread;				//!< Receives packets from the peers.
+	bool			stop;
+#endif
+} state_replication_t;
+
+/** One shard of the state tree
+ *
+ * Entries are assigned to a shard by a hash of their State value,
+ * so each lookup only ever needs the mutex of a single shard.
+ */
+typedef struct state_shard {
+	uint64_t		created;			//!< Number of entries created in this shard.
 	uint64_t		timed_out;			//!< Number of states that were cleaned up due to
 								//!< timeout.
-	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
 	rbtree_t		*tree;				//!< rbtree used to lookup state value.
 
 	fr_state_entry_t	*head, *tail;			//!< Entries to expire.
-	uint32_t		timeout;			//!< How long to wait before cleaning up state entires.
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
 #endif
+} state_shard_t;
+
+struct fr_state_tree_t {
+	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
+	uint32_t		num_sessions;			//!< Number of sessions across all shards.
+								//!< Only accessed with the __atomic builtins.
+	uint32_t		timeout;			//!< How long to wait before cleaning up state entires.
+
+	state_shard_t		shard[STATE_SHARDS];		//!< Entries, by hash of their State value.
+
+	state_replication_t	*repl;				//!< Peers we replicate entries to, if any.
 };
 
 fr_state_tree_t *global_state = NULL;
@@ -97,7 +175,12 @@ fr_state_tree_t *global_state = NULL;
 #  define PTHREAD_MUTEX_UNLOCK(_x)
 #endif
 
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry);
+static void state_entry_unlink(fr_state_tree_t *state, state_shard_t *shard, fr_state_entry_t *entry);
+static fr_state_entry_t *state_shard_expire(fr_state_tree_t *state, state_shard_t *shard, time_t now);
+static size_t state_replication_encode(uint8_t *out, size_t outlen, fr_state_tree_t *state, int op,
+				       uint8_t const *value, int tries, VALUE_PAIR *vps);
+static void state_replication_send(fr_state_tree_t *state, uint8_t const *packet, size_t len);
+static void state_replication_stop(fr_state_tree_t *state);
 
 /** Compare two fr_state_entry_t based on their state value i.e. the value of the attribute
  *
@@ -110,36 +193,83 @@ static int state_entry_cmp(void const *one, void const *two)
 	return memcmp(a->state, b->state, sizeof(a->state));
 }
 
-/** Free the state tree
+/** Return the shard responsible for a State value
  *
  */
-static int _state_tree_free(fr_state_tree_t *state)
+static inline state_shard_t *state_shard(fr_state_tree_t *state, uint8_t const *value)
 {
-	fr_state_entry_t *this;
+	return &state->shard[fr_hash(value, AUTH_VECTOR_LEN) & (STATE_SHARDS - 1)];
+}
 
-#ifdef HAVE_PTHREAD_H
-	if (main_config.spawn_workers) pthread_mutex_destroy(&state->mutex);
-#endif
+/** Reserve a session against max_sessions
+ *
+ * The limit is global, so an uneven spread of State values over the
+ * shards can't cause sessions to be refused early.  The shard mutexes
+ * only protect the trees.
+ *
+ * @return true if the session may be inserted, false if we're at the limit.
+ */
+static inline bool state_session_reserve(fr_state_tree_t *state)
+{
+	uint32_t num = __atomic_load_n(&state->num_sessions, __ATOMIC_RELAXED);
 
-	DEBUG4("Freeing state tree %p", state);
+	do {
+		if (num >= state->max_sessions) return false;
+	} while (!__atomic_compare_exchange_n(&state->num_sessions, &num, num + 1, true,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
-	while (state->head) {
-		this = state->head;
-		state_entry_unlink(state, this);
-		talloc_free(this);
-	}
+	return true;
+}
 
-	for (this = state->head; this; this = this->next) DEBUG4("State %" PRIu64 " needs freeing prev was %" PRIu64 "", this->id, this->prev ? this->prev->id : 100000);
+/** Release a session reserved with #state_session_reserve
+ *
+ */
+static inline void state_session_release(fr_state_tree_t *state)
+{
+	__atomic_sub_fetch(&state->num_sessions, 1, __ATOMIC_RELAXED);
+}
 
-	/*
-	 *	Ensure we got *all* the entries
-	 */
-	rad_assert(!state->head);
+/** Free the state tree
+ *
+ */
+static int _state_tree_free(fr_state_tree_t *state)
+{
+	fr_state_entry_t	*this;
+	int			i;
+
+	DEBUG4("Freeing state tree %p", state);
 
 	/*
-	 *	Free the rbtree
+	 *	The receiver thread inserts entries, so
+	 *	it has to go before they do.
 	 */
-	rbtree_free(state->tree);
+	if (state->repl) state_replication_stop(state);
+
+	for (i = 0; i < STATE_SHARDS; i++) {
+		state_shard_t *shard = &state->shard[i];
+
+		if (!shard->tree) continue;
+
+#ifdef HAVE_PTHREAD_H
+		if (main_config.spawn_workers) pthread_mutex_destroy(&shard->mutex);
+#endif
+
+		while (shard->head) {
+			this = shard->head;
+			state_entry_unlink(state, shard, this);
+			talloc_free(this);
+		}
+
+		/*
+		 *	Ensure we got *all* the entries
+		 */
+		rad_assert(!shard->head);
+
+		/*
+		 *	Free the rbtree
+		 */
+		rbtree_free(shard->tree);
+	}
 
 	if (state == global_state) global_state = NULL;
 
@@ -156,6 +286,7 @@ static int _state_tree_free(fr_state_tree_t *state)
 fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint32_t timeout)
 {
 	fr_state_tree_t *state;
+	int		i;
 
 	state = talloc_zero(NULL, fr_state_tree_t);
 	if (!state) return 0;
@@ -171,26 +302,33 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint
 	 *	tree.
 	 */
 	fr_talloc_link_ctx(ctx, state);
+	talloc_set_destructor(state, _state_tree_free);
+
+	for (i = 0; i < STATE_SHARDS; i++) {
+		state_shard_t *shard = &state->shard[i];
+
+		/*
+		 *	We need to do controlled freeing of the
+		 *	rbtree, so that all the state entries
+		 *	are freed before it's destroyed.  Hence
+		 *	it being parented from the NULL ctx.
+		 */
+		shard->tree = rbtree_create_intrusive(NULL, state_entry_cmp, NULL,
+						      offsetof(fr_state_entry_t, node), 0);
+		if (!shard->tree) {
+			talloc_free(state);
+			return NULL;
+		}
 
 #ifdef HAVE_PTHREAD_H
-	if (main_config.spawn_workers && (pthread_mutex_init(&state->mutex, NULL) != 0)) {
-		talloc_free(state);
-		return NULL;
-	}
+		if (main_config.spawn_workers && (pthread_mutex_init(&shard->mutex, NULL) != 0)) {
+			rbtree_free(shard->tree);
+			shard->tree = NULL;
+			talloc_free(state);
+			return NULL;
+		}
 #endif
-
-	/*
-	 *	We need to do controlled freeing of the
-	 *	rbtree, so that all the state entries
-	 *	are freed before it's destroyed.  Hence
-	 *	it being parented from the NULL ctx.
-	 */
-	state->tree = rbtree_create(NULL, state_entry_cmp, NULL, 0);
-	if (!state->tree) {
-		talloc_free(state);
-		return NULL;
 	}
-	talloc_set_destructor(state, _state_tree_free);
 
 	return state;
 }
@@ -198,7 +336,7 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint
 /** Unlink an entry and remove if from the tree
  *
  */
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
+static void state_entry_unlink(fr_state_tree_t *state, state_shard_t *shard, fr_state_entry_t *entry)
 {
 	fr_state_entry_t *prev, *next;
 
@@ -206,28 +344,49 @@ static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
 	next = entry->next;
 
 	if (prev) {
-		rad_assert(state->head != entry);
+		rad_assert(shard->head != entry);
 		prev->next = next;
-	} else if (state->head) {
-		rad_assert(state->head == entry);
-		state->head = next;
+	} else if (shard->head) {
+		rad_assert(shard->head == entry);
+		shard->head = next;
 	}
 
 	if (next) {
-		rad_assert(state->tail != entry);
+		rad_assert(shard->tail != entry);
 		next->prev = prev;
-	} else if (state->tail) {
-		rad_assert(state->tail == entry);
-		state->tail = prev;
+	} else if (shard->tail) {
+		rad_assert(shard->tail == entry);
+		shard->tail = prev;
 	}
 	entry->next = NULL;
 	entry->prev = NULL;
 
-	rbtree_deletebydata(state->tree, entry);
+	rbtree_deletebydata(shard->tree, entry);
+	state_session_release(state);
 
 	DEBUG4("State ID %" PRIu64 " unlinked", entry->id);
 }
 
+/** Link an entry to the end of a shard's cleanup list
+ *
+ * The list is implicitly ordered by cleanup time.
+ */
+static void state_entry_link(state_shard_t *shard, fr_state_entry_t *entry)
+{
+	if (!shard->head) {
+		entry->prev = entry->next = NULL;
+		shard->head = shard->tail = entry;
+	} else {
+		rad_assert(shard->tail != NULL);
+
+		entry->prev = shard->tail;
+		shard->tail->next = entry;
+
+		entry->next = NULL;
+		shard->tail = entry;
+	}
+}
+
 /** Frees any data associated with a state
  *
  */
@@ -266,83 +425,40 @@ static int _state_entry_free(fr_state_entry_t *entry)
 	return 0;
 }
 
-/** Create a new state entry
+/** Free a list of unlinked entries
+ *
+ * We do it outside of the mutex as freeing may involve significantly
+ * more work than just freeing the data.
  *
- * @note Called with the mutex held.
+ * If there's request data that was persisted it will now be freed also,
+ * and it may have complex destructors associated with it.
  */
-static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, RADIUS_PACKET *packet, fr_state_entry_t *old)
+static void state_entry_list_free(fr_state_entry_t *head)
 {
-	size_t			i;
-	uint32_t		x;
-	time_t			now = time(NULL);
-	VALUE_PAIR		*vp;
-	fr_state_entry_t	*entry, *next;
-	fr_state_entry_t	*free_head = NULL, **free_next = &free_head;
-
-	uint8_t			old_state[AUTH_VECTOR_LEN];
-	int			old_tries = 0;
-
-	/*
-	 *	Clean up old entries.
-	 */
-	for (entry = state->head; entry != NULL; entry = next) {
-		next = entry->next;
-
-		if (entry == old) continue;
-
-		/*
-		 *	Too old, we can delete it.
-		 */
-		if (entry->cleanup < now) {
-			state_entry_unlink(state, entry);
-			*free_next = entry;
-			free_next = &(entry->next);
-			state->timed_out++;
-			continue;
-		}
+	fr_state_entry_t *entry, *next;
 
-		break;
-	}
-
-	if (rbtree_num_elements(state->tree) >= (uint32_t) state->max_sessions) return NULL;
-
-	/*
-	 *	Record the information from the old state, we may base the
-	 *	new state off the old one.
-	 *
-	 *	Once we release the mutex, the state of old becomes indeterminate
-	 *	so we have to grab the values now.
-	 */
-	if (old) {
-		old_tries = old->tries;
-
-		memcpy(old_state, old->state, sizeof(old_state));
-
-		/*
-		 *	The old one isn't used any more, so we can free it.
-		 */
-		if (!old->data) {
-			state_entry_unlink(state, old);
-			*free_next = old;
-		}
-	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
-
-	/*
-	 *	Now free the unlinked entries.
-	 *
-	 *	We do it here as freeing may involve significantly more
-	 *	work than just freeing the data.
-	 *
-	 *	If there's request data that was persisted it will now
-	 *	be freed also, and it may have complex destructors associated
-	 *	with it.
-	 */
-	for (next = free_head; next;) {
+	for (next = head; next;) {
 		entry = next;
 		next = entry->next;
 		talloc_free(entry);
 	}
+}
+
+/** Create a new state entry, and transfer the request's state to it
+ *
+ * The entry is inserted into the shard its State value hashes to.
+ *
+ * @note Called with no mutex held.
+ */
+static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *request, request_data_t *data,
+					    RADIUS_PACKET *packet, uint8_t const *old_state, int old_tries)
+{
+	time_t			now = time(NULL);
+	VALUE_PAIR		*vp;
+	state_shard_t		*shard;
+	fr_state_entry_t	*entry, *free_head;
+	uint8_t			repl[STATE_REPL_MAX_LEN];
+	size_t			repl_len = 0;
 
 	/*
 	 *	Allocation doesn't need to occur inside the critical region
@@ -352,12 +468,8 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, RADIUS_PACKE
 	 *	we can't do it now due to thread safety issues with talloc.
 	 */
 	entry = talloc_zero(NULL, fr_state_entry_t);
-	if (!entry) {
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
-		return NULL;
-	}
+	if (!entry) return NULL;
 	talloc_set_destructor(entry, _state_entry_free);
-	entry->id = state->id++;
 
 	/*
 	 *	Limit the lifetime of this entry based on how long the
@@ -384,7 +496,7 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, RADIUS_PACKE
 		/*
 		 *	Base the new state on the old state if we had one.
 		 */
-		if (old) {
+		if (old_state) {
 			memcpy(entry->state, old_state, sizeof(entry->state));
 			entry->tries = old_tries + 1;
 		}
@@ -399,10 +511,7 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, RADIUS_PACKE
 		 *	16 octets of randomness should be enough to
 		 *	have a globally unique state.
 		 */
-		for (i = 0; i < sizeof(entry->state) / sizeof(x); i++) {
-			x = fr_rand();
-			memcpy(entry->state + (i * 4), &x, sizeof(x));
-		}
+		fr_rand_fill(entry->state, sizeof(entry->state));
 
 		/*
 		 *	Allow a portion ofthe State attribute to be set.
@@ -417,53 +526,81 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, RADIUS_PACKE
 		fr_pair_add(&packet->vps, vp);
 	}
 
-	if (DEBUG_ENABLED4) {
-		char hex[(sizeof(entry->state) * 2) + 1];
+	/*
+	 *	The attributes belong to whichever request restores
+	 *	the entry as soon as it's in the tree, so they have
+	 *	to be encoded now.  Persistable request data can't
+	 *	be encoded at all, so those entries stay local.
+	 */
+	if (state->repl && !data) {
+		repl_len = state_replication_encode(repl, sizeof(repl), state, STATE_REPL_ADD,
+						    entry->state, entry->tries, request->state);
+	}
 
-		fr_bin2hex(hex, entry->state, sizeof(entry->state));
+	shard = state_shard(state, entry->state);
 
-		DEBUG4("State ID %" PRIu64 " created, value 0x%s, expires %" PRIu64 "s",
-		       entry->id, hex, (uint64_t)entry->cleanup - now);
-	}
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	/*
+	 *	Clean up old entries.
+	 */
+	free_head = state_shard_expire(state, shard, now);
+
+	/*
+	 *	IDs are unique across the tree, the low bits
+	 *	identify the shard.
+	 */
+	entry->id = (shard->created++ * STATE_SHARDS) + (shard - state->shard);
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	if (rbtree_num_elements(state->tree) >= (uint32_t) state->max_sessions) {
+	if (!state_session_reserve(state)) {
+	fail:
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+		state_entry_list_free(free_head);
 		talloc_free(entry);
 		return NULL;
 	}
 
-	if (!rbtree_insert(state->tree, entry)) {
-		talloc_free(entry);
-		return NULL;
+	if (!rbtree_insert(shard->tree, entry)) {
+		state_session_release(state);
+		goto fail;
 	}
 
-	/*
-	 *	Link it to the end of the list, which is implicitely
-	 *	ordered by cleanup time.
-	 */
-	if (!state->head) {
-		entry->prev = entry->next = NULL;
-		state->head = state->tail = entry;
-	} else {
-		rad_assert(state->tail != NULL);
+	state_entry_link(shard, entry);
 
-		entry->prev = state->tail;
-		state->tail->next = entry;
+	entry->ctx = request->state_ctx;
+	entry->vps = request->state;
+	entry->data = data;
 
-		entry->next = NULL;
-		state->tail = entry;
+	request->state_ctx = NULL;
+	request->state = NULL;
+
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	state_entry_list_free(free_head);
+
+	if (repl_len) state_replication_send(state, repl, repl_len);
+
+	if (DEBUG_ENABLED4) {
+		char hex[(sizeof(entry->state) * 2) + 1];
+
+		fr_bin2hex(hex, entry->state, sizeof(entry->state));
+
+		DEBUG4("State ID %" PRIu64 " created, value 0x%s, expires %" PRIu64 "s",
+		       entry->id, hex, (uint64_t)entry->cleanup - now);
 	}
 
 	return entry;
 }
 
-/** Find the entry, based on the State attribute
+/** Find the shard, and the entry, based on the State attribute
  *
+ * @note Called with no mutex held.  On success, the shard is returned locked.
  */
-static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, RADIUS_PACKET *packet)
+static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, state_shard_t **out, RADIUS_PACKET *packet)
 {
-	VALUE_PAIR *vp;
-	fr_state_entry_t *entry, my_entry;
+	VALUE_PAIR		*vp;
+	state_shard_t		*shard;
+	fr_state_entry_t	*entry, my_entry;
 
 	vp = fr_pair_find_by_num(packet->vps, 0, PW_STATE, TAG_ANY);
 	if (!vp) return NULL;
@@ -472,12 +609,20 @@ static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, RADIUS_PACKET
 
 	memcpy(my_entry.state, vp->vp_octets, sizeof(my_entry.state));
 
-	entry = rbtree_finddata(state->tree, &my_entry);
+	shard = state_shard(state, my_entry.state);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = rbtree_finddata(shard->tree, &my_entry);
+	if (!entry) {
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+		return NULL;
+	}
 
 #ifdef WITH_VERIFY_PTR
-	if (entry) (void) talloc_get_type_abort(entry, fr_state_entry_t);
+	(void) talloc_get_type_abort(entry, fr_state_entry_t);
 #endif
 
+	*out = shard;
 	return entry;
 }
 
@@ -486,16 +631,23 @@ static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, RADIUS_PACKET
  */
 void fr_state_discard(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *original)
 {
+	state_shard_t *shard;
 	fr_state_entry_t *entry;
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	entry = state_entry_find(state, original);
-	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
-		return;
+	entry = state_entry_find(state, &shard, original);
+	if (!entry) return;
+
+	state_entry_unlink(state, shard, entry);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	if (state->repl) {
+		uint8_t	repl[STATE_REPL_HDR_LEN + MD5_DIGEST_LENGTH];
+		size_t	repl_len;
+
+		repl_len = state_replication_encode(repl, sizeof(repl), state, STATE_REPL_DEL,
+						    entry->state, 0, NULL);
+		if (repl_len) state_replication_send(state, repl, repl_len);
 	}
-	state_entry_unlink(state, entry);
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
 
 	/*
 	 *	The state and request must be in the same state
@@ -522,6 +674,7 @@ void fr_state_discard(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *o
  */
 void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *packet)
 {
+	state_shard_t *shard;
 	fr_state_entry_t *entry;
 	TALLOC_CTX *old_ctx = NULL;
 
@@ -535,9 +688,7 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 		return;
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-
-	entry = state_entry_find(state, packet);
+	entry = state_entry_find(state, &shard, packet);
 	if (entry) {
 		if (request->state_ctx) old_ctx = request->state_ctx;
 
@@ -548,9 +699,9 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 		entry->ctx = NULL;
 		entry->vps = NULL;
 		entry->data = NULL;
-	}
 
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
 
 	if (request->state) {
 		RDEBUG2("Restored &session-state");
@@ -578,8 +729,11 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
  */
 bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *original, RADIUS_PACKET *packet)
 {
-	fr_state_entry_t *entry, *old;
+	state_shard_t *shard;
+	fr_state_entry_t *old = NULL;
 	request_data_t *data;
+	uint8_t old_state[AUTH_VECTOR_LEN], *base = NULL;
+	int old_tries = 0;
 
 	request_data_by_persistance(&data, request, true);
 
@@ -590,28 +744,44 @@ bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 		rdebug_pair_list(L_DBG_LVL_2, request, request->state, "&session-state:");
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-
-	old = original ? state_entry_find(state, original) :
-			 NULL;
+	/*
+	 *	Record the information from the old state, we may base the
+	 *	new state off the old one.
+	 *
+	 *	Once we release the mutex, the state of old becomes indeterminate
+	 *	so we have to grab the values now.
+	 */
+	if (original) old = state_entry_find(state, &shard, original);
+	if (old) {
+		old_tries = old->tries;
+		memcpy(old_state, old->state, sizeof(old_state));
+		base = old_state;
 
-	entry = state_entry_create(state, packet, old);
-	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
-		return false;
-	}
+		/*
+		 *	The old one isn't used any more, so we can free it.
+		 */
+		if (!old->data) {
+			state_entry_unlink(state, shard, old);
+		} else {
+			old = NULL;
+		}
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
-	rad_assert(entry->ctx == NULL);
-	rad_assert(request->state_ctx);
+		if (old) {
+			talloc_free(old);
 
-	entry->ctx = request->state_ctx;
-	entry->vps = request->state;
-	entry->data = data;
+			if (state->repl) {
+				uint8_t	repl[STATE_REPL_HDR_LEN + MD5_DIGEST_LENGTH];
+				size_t	repl_len;
 
-	request->state_ctx = NULL;
-	request->state = NULL;
+				repl_len = state_replication_encode(repl, sizeof(repl), state, STATE_REPL_DEL,
+								    old_state, 0, NULL);
+				if (repl_len) state_replication_send(state, repl, repl_len);
+			}
+		}
+	}
 
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	if (!state_entry_create(state, request, data, packet, base, old_tries)) return false;
 
 	rad_assert(request->state == NULL);
 	VERIFY_REQUEST(request);
@@ -623,7 +793,12 @@ bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
  */
 uint64_t fr_state_entries_created(fr_state_tree_t *state)
 {
-	return state->id;
+	uint64_t	total = 0;
+	int		i;
+
+	for (i = 0; i < STATE_SHARDS; i++) total += state->shard[i].created;
+
+	return total;
 }
 
 /** Return number of entries that timed out
@@ -631,7 +806,12 @@ uint64_t fr_state_entries_created(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
 {
-	return state->timed_out;
+	uint64_t	total = 0;
+	int		i;
+
+	for (i = 0; i < STATE_SHARDS; i++) total += state->shard[i].timed_out;
+
+	return total;
 }
 
 /** Return number of entries we're currently tracking
@@ -639,5 +819,539 @@ uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
  */
 uint32_t fr_state_entries_tracked(fr_state_tree_t *state)
 {
-	return (uint32_t)rbtree_num_elements(state->tree);
+	uint32_t	total = 0;
+	int		i;
+
+	for (i = 0; i < STATE_SHARDS; i++) total += rbtree_num_elements(state->shard[i].tree);
+
+	return total;
+}
+
+/** Return the memory held by the entries we're currently tracking
+ *
+ * Each shard is locked while its entries are measured.
+ */
+void fr_state_memory(fr_state_tree_t *state, size_t *bytes, size_t *blocks)
+{
+	fr_state_entry_t	*entry;
+	int			i;
+
+	*bytes = *blocks = 0;
+
+	for (i = 0; i < STATE_SHARDS; i++) {
+		state_shard_t *shard = &state->shard[i];
+
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		for (entry = shard->head; entry; entry = entry->next) {
+			*bytes += talloc_total_size(entry);
+			*blocks += talloc_total_blocks(entry);
+
+			if (!entry->ctx) continue;
+
+			*bytes += talloc_total_size(entry->ctx);
+			*blocks += talloc_total_blocks(entry->ctx);
+		}
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
+}
+
+/** Return the number of shards the state entries are spread over
+ *
+ */
+uint32_t fr_state_entries_shards(UNUSED fr_state_tree_t *state)
+{
+	return STATE_SHARDS;
+}
+
+/** Return number of entries created in one shard
+ *
+ */
+uint64_t fr_state_entries_shard_created(fr_state_tree_t *state, uint32_t shard)
+{
+	if (shard >= STATE_SHARDS) return 0;
+
+	return state->shard[shard].created;
+}
+
+/** Return number of entries that timed out in one shard
+ *
+ */
+uint64_t fr_state_entries_shard_timeout(fr_state_tree_t *state, uint32_t shard)
+{
+	if (shard >= STATE_SHARDS) return 0;
+
+	return state->shard[shard].timed_out;
+}
+
+/** Return number of entries one shard is currently tracking
+ *
+ */
+uint32_t fr_state_entries_shard_tracked(fr_state_tree_t *state, uint32_t shard)
+{
+	if (shard >= STATE_SHARDS) return 0;
+
+	return (uint32_t)rbtree_num_elements(state->shard[shard].tree);
+}
+
+/** Remove expired entries from a shard
+ *
+ * @note Called with the shard's mutex held.
+ *
+ * @return a list of the entries, to be freed with #state_entry_list_free once the mutex is released.
+ */
+static fr_state_entry_t *state_shard_expire(fr_state_tree_t *state, state_shard_t *shard, time_t now)
+{
+	fr_state_entry_t	*next;
+	fr_state_entry_t	*free_head = NULL, **free_next = &free_head;
+
+	while ((next = shard->head) && (next->cleanup < now)) {
+		state_entry_unlink(state, shard, next);
+		*free_next = next;
+		free_next = &(next->next);
+		shard->timed_out++;
+	}
+
+	return free_head;
+}
+
+static const CONF_PARSER state_replication_config[] = {
+	{ FR_CONF_OFFSET("ipaddr", PW_TYPE_COMBO_IP_ADDR, state_replication_t, ipaddr), .dflt = "*" },
+	{ FR_CONF_OFFSET("port", PW_TYPE_SHORT, state_replication_t, port), .dflt = "1815" },
+	{ FR_CONF_OFFSET("secret", PW_TYPE_STRING | PW_TYPE_SECRET | PW_TYPE_REQUIRED, state_replication_t, secret) },
+	{ FR_CONF_OFFSET("peer", PW_TYPE_STRING | PW_TYPE_MULTI | PW_TYPE_REQUIRED, state_replication_t, peer_names) },
+	CONF_PARSER_TERMINATOR
+};
+
+/** Encode a replication packet
+ *
+ * @param[out] out	Where to write the packet.
+ * @param[in] outlen	Size of out.
+ * @param[in] state	tree the entry belongs to.
+ * @param[in] op	STATE_REPL_ADD or STATE_REPL_DEL.
+ * @param[in] value	of the State attribute.
+ * @param[in] tries	of the entry.
+ * @param[in] vps	session-state attributes, for STATE_REPL_ADD.
+ * @return the length of the packet, or 0 if the attributes don't fit.
+ */
+static size_t state_replication_encode(uint8_t *out, size_t outlen, fr_state_tree_t *state, int op,
+				       uint8_t const *value, int tries, VALUE_PAIR *vps)
+{
+	uint8_t		*p = out + STATE_REPL_HDR_LEN;
+	uint8_t		*end = out + outlen - MD5_DIGEST_LENGTH;
+	uint32_t	u32;
+	size_t		len;
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+
+	out[0] = STATE_REPL_VERSION;
+	out[1] = op;
+	u32 = htonl((uint32_t) time(NULL));
+	memcpy(out + 4, &u32, sizeof(u32));
+	u32 = htonl(state->timeout);
+	memcpy(out + 8, &u32, sizeof(u32));
+	out[12] = tries;
+	memset(out + 13, 0, 3);
+	memcpy(out + 16, value, AUTH_VECTOR_LEN);
+
+	for (vp = fr_cursor_init(&cursor, &vps);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		char		buffer[1024];
+		uint8_t const	*data;
+
+		switch (vp->da->type) {
+		case PW_TYPE_STRING:
+			data = (uint8_t const *) vp->vp_strvalue;
+			len = vp->vp_length;
+			break;
+
+		case PW_TYPE_OCTETS:
+			data = vp->vp_octets;
+			len = vp->vp_length;
+			break;
+
+		default:
+			len = fr_pair_value_snprint(buffer, sizeof(buffer), vp, '\0');
+			if (is_truncated(len, sizeof(buffer))) goto too_big;
+			data = (uint8_t const *) buffer;
+			break;
+		}
+
+		if ((len > 0xffff) || ((size_t)(end - p) < (11 + len))) {
+		too_big:
+			DEBUG3("session-state too large to replicate");
+			state->repl->dropped++;
+			return 0;
+		}
+
+		u32 = htonl(vp->da->vendor);
+		memcpy(p, &u32, sizeof(u32));
+		u32 = htonl(vp->da->attr);
+		memcpy(p + 4, &u32, sizeof(u32));
+		p[8] = (uint8_t) vp->tag;
+		p[9] = (len >> 8) & 0xff;
+		p[10] = len & 0xff;
+		memcpy(p + 11, data, len);
+		p += 11 + len;
+	}
+
+	len = (p - out) + MD5_DIGEST_LENGTH;
+	out[2] = (len >> 8) & 0xff;
+	out[3] = len & 0xff;
+
+	fr_hmac_md5_calc(p, out, p - out, &state->repl->hmac);
+
+	return len;
+}
+
+/** Send a replication packet to all of the peers
+ *
+ * Replication is best effort.  Nothing is acknowledged or retransmitted,
+ * and the caller never waits for the peers.
+ */
+static void state_replication_send(fr_state_tree_t *state, uint8_t const *packet, size_t len)
+{
+	state_replication_t	*repl = state->repl;
+	int			i;
+
+	for (i = 0; i < repl->num_peers; i++) {
+		if (sendto(repl->sockfd, packet, len, MSG_DONTWAIT,
+			   (struct sockaddr const *) &repl->peers[i], repl->peers_len[i]) < 0) {
+			DEBUG3("Failed replicating state to %s: %s", repl->peer_names[i], fr_syserror(errno));
+			repl->dropped++;
+			continue;
+		}
+		repl->sent++;
+	}
+}
+
+/** Insert an entry received from a peer
+ *
+ * Takes ownership of ctx, and the attributes allocated in it.
+ *
+ * The entry goes at the end of the cleanup list even if it expires
+ * sooner than the entries before it.  It's cleaned up late, but never
+ * later than the continuation timeout.
+ */
+static void state_replication_insert(fr_state_tree_t *state, uint8_t const *value, int tries, time_t cleanup,
+				     TALLOC_CTX *ctx, VALUE_PAIR *vps)
+{
+	state_shard_t		*shard;
+	fr_state_entry_t	*entry, *free_head;
+
+	entry = talloc_zero(NULL, fr_state_entry_t);
+	if (!entry) {
+		talloc_free(ctx);
+		return;
+	}
+	talloc_set_destructor(entry, _state_entry_free);
+
+	memcpy(entry->state, value, sizeof(entry->state));
+	entry->tries = tries;
+	entry->cleanup = cleanup;
+	entry->ctx = ctx;
+	entry->vps = vps;
+
+	shard = state_shard(state, entry->state);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	free_head = state_shard_expire(state, shard, time(NULL));
+
+	/*
+	 *	State values are never re-used, so an existing
+	 *	entry is either a duplicate, or the one this node
+	 *	created itself.  Either way, it's left alone.
+	 */
+	if (rbtree_finddata(shard->tree, entry) || !state_session_reserve(state)) {
+	fail:
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+		state_entry_list_free(free_head);
+		talloc_free(entry);
+		return;
+	}
+
+	if (!rbtree_insert(shard->tree, entry)) {
+		state_session_release(state);
+		goto fail;
+	}
+
+	entry->id = (shard->created++ * STATE_SHARDS) + (shard - state->shard);
+	state_entry_link(shard, entry);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	state_entry_list_free(free_head);
+
+	DEBUG4("State ID %" PRIu64 " replicated from peer", entry->id);
+}
+
+/** Remove an entry because a peer has finished with it
+ *
+ */
+static void state_replication_remove(fr_state_tree_t *state, uint8_t const *value)
+{
+	state_shard_t		*shard;
+	fr_state_entry_t	*entry, my_entry;
+
+	memcpy(my_entry.state, value, sizeof(my_entry.state));
+
+	shard = state_shard(state, my_entry.state);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = rbtree_finddata(shard->tree, &my_entry);
+	if (entry) state_entry_unlink(state, shard, entry);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	talloc_free(entry);
+}
+
+/** Decode a replication packet, and apply it to the tree
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the packet was malformed or not signed with the secret.
+ */
+static int state_replication_recv(fr_state_tree_t *state, uint8_t const *packet, size_t len)
+{
+	uint8_t		digest[MD5_DIGEST_LENGTH];
+	uint8_t const	*p, *end;
+	uint32_t	u32;
+	time_t		now = time(NULL), sent, cleanup;
+	size_t		vlen = 0;
+	TALLOC_CTX	*ctx;
+	VALUE_PAIR	*vps = NULL, *vp;
+	vp_cursor_t	cursor;
+
+	if (len < (STATE_REPL_HDR_LEN + MD5_DIGEST_LENGTH)) return -1;
+	if (packet[0] != STATE_REPL_VERSION) return -1;
+	if ((size_t)((packet[2] << 8) | packet[3]) != len) return -1;
+
+	end = packet + len - MD5_DIGEST_LENGTH;
+	fr_hmac_md5_calc(digest, packet, end - packet, &state->repl->hmac);
+	if (fr_radius_digest_cmp(digest, end, sizeof(digest)) != 0) return -1;
+
+	/*
+	 *	Packets which are older than the entry they describe
+	 *	are replays, or have been stuck somewhere.
+	 */
+	memcpy(&u32, packet + 4, sizeof(u32));
+	sent = ntohl(u32);
+	memcpy(&u32, packet + 8, sizeof(u32));
+	u32 = ntohl(u32);
+	if (u32 > state->timeout) u32 = state->timeout;
+	cleanup = sent + u32;
+	if ((cleanup <= now) || (sent > (now + (time_t) state->timeout))) return 0;
+
+	switch (packet[1]) {
+	case STATE_REPL_DEL:
+		state_replication_remove(state, packet + 16);
+		return 0;
+
+	case STATE_REPL_ADD:
+		break;
+
+	default:
+		return -1;
+	}
+
+	ctx = talloc_init("session-state");
+	if (!ctx) return -1;
+
+	fr_cursor_init(&cursor, &vps);
+	for (p = packet + STATE_REPL_HDR_LEN; p < end; p += 11 + vlen) {
+		unsigned int	vendor, attr;
+
+		if ((end - p) < 11) goto error;
+
+		memcpy(&u32, p, sizeof(u32));
+		vendor = ntohl(u32);
+		memcpy(&u32, p + 4, sizeof(u32));
+		attr = ntohl(u32);
+		vlen = (p[9] << 8) | p[10];
+		if (vlen > (size_t)(end - (p + 11))) goto error;
+
+		vp = fr_pair_afrom_num(ctx, vendor, attr);
+		if (!vp) goto error;
+
+		switch (vp->da->type) {
+		case PW_TYPE_STRING:
+			fr_pair_value_bstrncpy(vp, p + 11, vlen);
+			break;
+
+		case PW_TYPE_OCTETS:
+			fr_pair_value_memcpy(vp, p + 11, vlen);
+			break;
+
+		default:
+			if (fr_pair_value_from_str(vp, (char const *) p + 11, vlen) < 0) goto error;
+			break;
+		}
+		vp->tag = (int8_t) p[8];
+
+		fr_cursor_insert(&cursor, vp);
+	}
+
+	state_replication_insert(state, packet + 16, packet[12], cleanup, ctx, vps);
+
+	return 0;
+
+error:
+	talloc_free(ctx);
+	return -1;
+}
+
+#ifdef HAVE_PTHREAD_H
+/** Receive entries from the peers
+ *
+ */
+static void *state_replication_thread(void *arg)
+{
+	fr_state_tree_t		*state = arg;
+	state_replication_t	*repl = state->repl;
+	uint8_t			packet[STATE_REPL_MAX_LEN];
+	ssize_t			len;
+
+	while (!repl->stop) {
+		/*
+		 *	The socket has a receive timeout, so
+		 *	we notice when we're told to stop.
+		 */
+		len = recv(repl->sockfd, packet, sizeof(packet), 0);
+		if (len <= 0) continue;
+
+		if (state_replication_recv(state, packet, len) < 0) {
+			repl->dropped++;
+			continue;
+		}
+		repl->received++;
+	}
+
+	return NULL;
+}
+#endif
+
+/** Stop receiving entries from the peers
+ *
+ */
+static void state_replication_stop(fr_state_tree_t *state)
+{
+	state_replication_t *repl = state->repl;
+
+#ifdef HAVE_PTHREAD_H
+	repl->stop = true;
+	pthread_join(repl->thread, NULL);
+#endif
+	close(repl->sockfd);
+
+	state->repl = NULL;
+	talloc_free(repl);
+}
+
+/** Replicate state entries to the other nodes listed in a state_replication section
+ *
+ * Entries are sent to the peers when they're created, and deleted when
+ * they're discarded, so that a request which continues a session can be
+ * sent to any node.  Entries holding persistable request data (such as
+ * EAP sessions) can't be serialised, so they're only ever held locally.
+ *
+ * @param[in] state	tree to replicate.
+ * @param[in] cs	state_replication section, may be NULL.
+ * @return
+ *	- 0 on success, or if replication isn't configured.
+ *	- -1 on failure.
+ */
+int fr_state_replication_init(fr_state_tree_t *state, CONF_SECTION *cs)
+{
+	state_replication_t	*repl;
+	struct sockaddr_storage	salocal;
+	socklen_t		salen;
+	int			i;
+	struct timeval		tv = { 1, 0 };
+
+	if (!cs) return 0;
+
+	if (!main_config.spawn_workers) {
+		WARN("Setting 'state_replication' requires a thread pool.  Disabling 'state_replication'");
+		return 0;
+	}
+
+	if (main_config.num_processes > 1) {
+		cf_log_err_cs(cs, "'state_replication' can't be used with 'num_processes'");
+		return -1;
+	}
+
+	repl = talloc_zero(state, state_replication_t);
+	if (!repl) return -1;
+	repl->sockfd = -1;
+
+	if (cf_section_parse(cs, repl, state_replication_config) < 0) {
+	error:
+		if (repl->sockfd >= 0) close(repl->sockfd);
+		talloc_free(repl);
+		return -1;
+	}
+
+	repl->num_peers = talloc_array_length(repl->peer_names);
+	repl->peers = talloc_zero_array(repl, struct sockaddr_storage, repl->num_peers);
+	repl->peers_len = talloc_zero_array(repl, socklen_t, repl->num_peers);
+
+	for (i = 0; i < repl->num_peers; i++) {
+		fr_ipaddr_t	ipaddr;
+		uint16_t	port = 0;
+
+		if ((fr_inet_pton_port(&ipaddr, &port, repl->peer_names[i], -1, repl->ipaddr.af, true, false) < 0) ||
+		    (fr_ipaddr_to_sockaddr(&ipaddr, port ? port : repl->port, &repl->peers[i], &repl->peers_len[i]) < 0)) {
+			cf_log_err_cs(cs, "Invalid peer \"%s\": %s", repl->peer_names[i], fr_strerror());
+			goto error;
+		}
+	}
+
+	fr_hmac_md5_init(&repl->hmac, (uint8_t const *) repl->secret, strlen(repl->secret));
+
+	repl->sockfd = socket(repl->ipaddr.af, SOCK_DGRAM, 0);
+	if (repl->sockfd < 0) {
+		cf_log_err_cs(cs, "Failed creating socket: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	if ((fr_ipaddr_to_sockaddr(&repl->ipaddr, repl->port, &salocal, &salen) < 0) ||
+	    (bind(repl->sockfd, (struct sockaddr *) &salocal, salen) < 0)) {
+		cf_log_err_cs(cs, "Failed binding to port %u: %s", repl->port, fr_syserror(errno));
+		goto error;
+	}
+
+	if (setsockopt(repl->sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+		cf_log_err_cs(cs, "Failed setting receive timeout: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	state->repl = repl;
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_create(&repl->thread, NULL, state_replication_thread, state) != 0) {
+		cf_log_err_cs(cs, "Failed creating replication thread: %s", fr_syserror(errno));
+		state->repl = NULL;
+		goto error;
+	}
+#endif
+
+	INFO("Replicating state to %i peers on port %u", repl->num_peers, repl->port);
+
+	return 0;
+}
+
+/** Return replication counters
+ *
+ * The counters are updated without locking, so they're approximate.
+ *
+ * @return false if state isn't being replicated.
+ */
+bool fr_state_replication_stats(fr_state_tree_t *state, uint64_t *sent, uint64_t *received, uint64_t *dropped)
+{
+	if (!state->repl) return false;
+
+	*sent = state->repl->sent;
+	*received = state->repl->received;
+	*dropped = state->repl->dropped;
+
+	return true;
 }
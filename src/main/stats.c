@@ -26,6 +26,10 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/rad_assert.h>
 
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#endif
+
 #ifdef WITH_STATS
 
 #define USEC (1000000)
@@ -35,28 +39,271 @@ RCSID("$Id$")
 static struct timeval	start_time;
 static struct timeval	hup_time;
 
-#define FR_STATS_INIT { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 	\
-				 { 0, 0, 0, 0, 0, 0, 0, 0 }}
+/*
+ *	The server wide statistics for one thread.
+ */
+typedef struct stats_slab_t stats_slab_t;
+struct stats_slab_t {
+	fr_stats_t	stats[FR_STATS_GLOBAL_MAX];
+	stats_slab_t	*next;
+};
 
-fr_stats_t radius_auth_stats = FR_STATS_INIT;
-#ifdef WITH_ACCOUNTING
-fr_stats_t radius_acct_stats = FR_STATS_INIT;
-#endif
-#ifdef WITH_COA
-fr_stats_t radius_coa_stats = FR_STATS_INIT;
-fr_stats_t radius_dsc_stats = FR_STATS_INIT;
+/*
+ *	The lock only protects the list of slabs.  Each slab is only
+ *	written to by its own thread.
+ */
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	stats_slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define SLAB_LOCK	pthread_mutex_lock(&stats_slab_mutex)
+#  define SLAB_UNLOCK	pthread_mutex_unlock(&stats_slab_mutex)
+#else
+#  define SLAB_LOCK
+#  define SLAB_UNLOCK
 #endif
 
-#ifdef WITH_PROXY
-fr_stats_t proxy_auth_stats = FR_STATS_INIT;
-#ifdef WITH_ACCOUNTING
-fr_stats_t proxy_acct_stats = FR_STATS_INIT;
-#endif
-#ifdef WITH_COA
-fr_stats_t proxy_coa_stats = FR_STATS_INIT;
-fr_stats_t proxy_dsc_stats = FR_STATS_INIT;
-#endif
+static stats_slab_t	*stats_slabs = NULL;
+
+/*
+ *	Counts from threads which have exited.  Also used if a thread
+ *	can't allocate a slab.
+ */
+static fr_stats_t	stats_retired[FR_STATS_GLOBAL_MAX];
+
+fr_thread_local_setup(stats_slab_t *, stats_slab)	/* macro */
+
+/*
+ *	When the server runs as several processes, the slabs are in a
+ *	shared memory segment instead, so that each process can add
+ *	up the counts of all of them.  Each process has a fixed number
+ *	of slabs, and its own copy of the retired counts.
+ */
+#define STATS_SHARED_SLABS	128
+
+typedef struct stats_shared_t {
+	fr_stats_t	retired[FR_STATS_GLOBAL_MAX];
+	stats_slab_t	slabs[STATS_SHARED_SLABS];
+	bool		used[STATS_SHARED_SLABS];	//!< Only read and written by the owning process.
+} stats_shared_t;
+
+static stats_shared_t	*stats_shared = NULL;	//!< One for each process.
+static uint32_t		stats_shared_num;
+static stats_shared_t	*stats_shared_self;	//!< The one for this process.
+
+/*
+ *	Server wide latency histograms, for each phase of a request.
+ */
+static fr_stats_latency_t	*request_latency[FR_STATS_LATENCY_MAX];
+
+static char const *request_latency_names[FR_STATS_LATENCY_MAX] = {
+	"queue",
+	"proxy",
+	"total"
+};
+
+static void stats_add(fr_stats_t *out, fr_stats_t const *in)
+{
+	int i;
+
+	out->total_requests += in->total_requests;
+	out->total_invalid_requests += in->total_invalid_requests;
+	out->total_dup_requests += in->total_dup_requests;
+	out->total_responses += in->total_responses;
+	out->total_access_accepts += in->total_access_accepts;
+	out->total_access_rejects += in->total_access_rejects;
+	out->total_access_challenges += in->total_access_challenges;
+	out->total_malformed_requests += in->total_malformed_requests;
+	out->total_bad_authenticators += in->total_bad_authenticators;
+	out->total_packets_dropped += in->total_packets_dropped;
+	out->total_rate_limited += in->total_rate_limited;
+	out->total_no_records += in->total_no_records;
+	out->total_unknown_types += in->total_unknown_types;
+	out->total_timeouts += in->total_timeouts;
+	if (in->last_packet > out->last_packet) out->last_packet = in->last_packet;
+
+	for (i = 0; i < 8; i++) out->elapsed[i] += in->elapsed[i];
+}
+
+/*
+ *	Keep the counts when a thread exits.
+ */
+static void _stats_slab_free(void *arg)
+{
+	stats_slab_t *slab = arg, **last;
+	int i;
+
+	if (stats_shared_self &&
+	    (slab >= stats_shared_self->slabs) && (slab < stats_shared_self->slabs + STATS_SHARED_SLABS)) {
+		SLAB_LOCK;
+		for (i = 0; i < FR_STATS_GLOBAL_MAX; i++) stats_add(&stats_shared_self->retired[i], &slab->stats[i]);
+		memset(slab, 0, sizeof(*slab));
+		stats_shared_self->used[slab - stats_shared_self->slabs] = false;
+		SLAB_UNLOCK;
+		return;
+	}
+
+	SLAB_LOCK;
+	for (last = &stats_slabs; *last; last = &(*last)->next) {
+		if (*last != slab) continue;
+
+		*last = slab->next;
+		break;
+	}
+
+	for (i = 0; i < FR_STATS_GLOBAL_MAX; i++) stats_add(&stats_retired[i], &slab->stats[i]);
+	SLAB_UNLOCK;
+
+	free(slab);
+}
+
+/** Get this thread's copy of the server wide statistics
+ *
+ * Only the calling thread may update the counters.
+ *
+ * @param[in] which statistics to return.
+ * @return the counters to update.
+ */
+fr_stats_t *radius_stats_local(fr_stats_global_t which)
+{
+	stats_slab_t *slab;
+
+	slab = fr_thread_local_init(stats_slab, _stats_slab_free);
+	if (!slab && stats_shared_self) {
+		int i;
+
+		SLAB_LOCK;
+		for (i = 0; i < STATS_SHARED_SLABS; i++) {
+			if (stats_shared_self->used[i]) continue;
+
+			stats_shared_self->used[i] = true;
+			slab = &stats_shared_self->slabs[i];
+			break;
+		}
+		SLAB_UNLOCK;
+
+		/*
+		 *	More threads than slabs.  The rest share the
+		 *	retired counts.
+		 */
+		if (!slab) return &stats_shared_self->retired[which];
+
+		if (fr_thread_local_set(stats_slab, slab) != 0) {
+			_stats_slab_free(slab);
+			return &stats_shared_self->retired[which];
+		}
+
+		return &slab->stats[which];
+	}
+
+	if (!slab) {
+		/*
+		 *	malloc is thread safe, talloc is not
+		 */
+		slab = calloc(1, sizeof(*slab));
+		if (!slab) return &stats_retired[which];
+
+		if (fr_thread_local_set(stats_slab, slab) != 0) {
+			free(slab);
+			return &stats_retired[which];
+		}
+
+		SLAB_LOCK;
+		slab->next = stats_slabs;
+		stats_slabs = slab;
+		SLAB_UNLOCK;
+	}
+
+	return &slab->stats[which];
+}
+
+/** Add up the server wide statistics from all threads
+ *
+ * The threads aren't stopped, so each counter is only as recent as
+ * the last time it was read.
+ *
+ * @param[out] out where to write the totals.
+ * @param[in] which statistics to read.
+ */
+void radius_stats_global(fr_stats_t *out, fr_stats_global_t which)
+{
+	stats_slab_t *slab;
+
+	memset(out, 0, sizeof(*out));
+
+	/*
+	 *	The other processes aren't locked out, so their
+	 *	counters are read as they are.  Unused slabs are
+	 *	zero, so there's no need to check which are in use.
+	 */
+	if (stats_shared) {
+		uint32_t i;
+		int j;
+
+		for (i = 0; i < stats_shared_num; i++) {
+			stats_add(out, &stats_shared[i].retired[which]);
+			for (j = 0; j < STATS_SHARED_SLABS; j++) stats_add(out, &stats_shared[i].slabs[j].stats[which]);
+		}
+	}
+
+	SLAB_LOCK;
+	stats_add(out, &stats_retired[which]);
+	for (slab = stats_slabs; slab; slab = slab->next) stats_add(out, &slab->stats[which]);
+	SLAB_UNLOCK;
+}
+
+/** Allocate the shared statistics segment, before forking the worker processes
+ *
+ * @param[in] num	number of processes which will share it.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, with the error in fr_strerror().
+ */
+int radius_stats_shared_init(uint32_t num)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+	void *mem;
+
+	mem = mmap(NULL, sizeof(stats_shared_t) * num, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		fr_strerror_printf("Failed allocating shared statistics: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	stats_shared = mem;
+	stats_shared_num = num;
+
+	return 0;
+#else
+	fr_strerror_printf("Shared statistics are not supported on this system");
+	return -1;
 #endif
+}
+
+/** Count this process' statistics in the shared segment
+ *
+ * Called by each worker process after it's forked.  If the process
+ * replaces one which exited, the counts of that process are kept,
+ * but its slabs are released.
+ *
+ * @param[in] index	of this process, from 0.
+ */
+void radius_stats_shared_attach(uint32_t index)
+{
+	stats_shared_t *self;
+	int i, j;
+
+	rad_assert(stats_shared && (index < stats_shared_num));
+
+	self = &stats_shared[index];
+	for (i = 0; i < STATS_SHARED_SLABS; i++) {
+		if (!self->used[i]) continue;
+
+		for (j = 0; j < FR_STATS_GLOBAL_MAX; j++) stats_add(&self->retired[j], &self->slabs[i].stats[j]);
+		memset(&self->slabs[i], 0, sizeof(self->slabs[i]));
+		self->used[i] = false;
+	}
+
+	stats_shared_self = self;
+}
 
 static void tv_sub(struct timeval *end, struct timeval *start,
 		   struct timeval *elapsed)
@@ -77,38 +324,37 @@ static void tv_sub(struct timeval *end, struct timeval *start,
 	}
 }
 
-static void stats_time(fr_stats_t *stats, struct timeval *start,
-		       struct timeval *end)
+/*
+ *	Which of the "elapsed" counters a request goes into.
+ */
+static int stats_elapsed(struct timeval *start, struct timeval *end)
 {
 	struct timeval diff;
-	uint32_t delay;
+	uint32_t delay, cmp;
+	int i;
 
 	if ((start->tv_sec == 0) || (end->tv_sec == 0) ||
-	    (end->tv_sec < start->tv_sec)) return;
+	    (end->tv_sec < start->tv_sec)) return -1;
 
 	tv_sub(end, start, &diff);
 
-	if (diff.tv_sec >= 10) {
-		stats->elapsed[7]++;
-	} else {
-		int i;
-		uint32_t cmp;
+	if (diff.tv_sec >= 10) return 7;
 
-		delay = (diff.tv_sec * USEC) + diff.tv_usec;
+	delay = (diff.tv_sec * USEC) + diff.tv_usec;
 
-		cmp = 10;
-		for (i = 0; i < 7; i++) {
-			if (delay < cmp) {
-				stats->elapsed[i]++;
-				break;
-			}
-			cmp *= 10;
-		}
+	cmp = 10;
+	for (i = 0; i < 7; i++) {
+		if (delay < cmp) return i;
+		cmp *= 10;
 	}
+
+	return -1;
 }
 
 void request_stats_final(REQUEST *request)
 {
+	int bucket = -1;
+
 	if (request->master_state == REQUEST_COUNTED) return;
 
 	if (!request->listener) return;
@@ -128,25 +374,25 @@ void request_stats_final(REQUEST *request)
 		return;
 
 #undef INC_AUTH
-#define INC_AUTH(_x) radius_auth_stats._x++;request->listener->stats._x++;request->client->auth._x++;
+#define INC_AUTH(_x) FR_STATS_LOCAL_INC(FR_STATS_AUTH, _x);FR_STATS_TYPE_INC(request->listener->stats._x);FR_STATS_TYPE_INC(request->client->auth._x);
 
 #undef INC_ACCT
 #ifdef WITH_ACCOUNTING
-#define INC_ACCT(_x) radius_acct_stats._x++;request->listener->stats._x++;request->client->acct._x++
+#define INC_ACCT(_x) FR_STATS_LOCAL_INC(FR_STATS_ACCT, _x);FR_STATS_TYPE_INC(request->listener->stats._x);FR_STATS_TYPE_INC(request->client->acct._x)
 #else
 #define INC_ACCT(_x)
 #endif
 
 #undef INC_COA
 #ifdef WITH_COA
-#define INC_COA(_x) radius_coa_stats._x++;request->listener->stats._x++;request->client->coa._x++
+#define INC_COA(_x) FR_STATS_LOCAL_INC(FR_STATS_COA, _x);FR_STATS_TYPE_INC(request->listener->stats._x);FR_STATS_TYPE_INC(request->client->coa._x)
 #else
 #define INC_COA(_x)
 #endif
 
 #undef INC_DSC
 #ifdef WITH_DSC
-#define INC_DSC(_x) radius_dsc_stats._x++;request->listener->stats._x++;request->client->dsc._x++
+#define INC_DSC(_x) FR_STATS_LOCAL_INC(FR_STATS_DSC, _x);FR_STATS_TYPE_INC(request->listener->stats._x);FR_STATS_TYPE_INC(request->client->dsc._x)
 #else
 #define INC_DSC(_x)
 #endif
@@ -154,11 +400,14 @@ void request_stats_final(REQUEST *request)
 	/*
 	 *	Update the statistics.
 	 *
-	 *	Note that we do NOT do this in a child thread.
-	 *	Instead, we update the stats when a request is
-	 *	deleted, because only the main server thread calls
-	 *	this function, which makes it thread-safe.
+	 *	This may be called from any thread.  The server wide
+	 *	counters are local to the thread, and the others are
+	 *	updated atomically.
 	 */
+	if (request->reply) bucket = stats_elapsed(&request->packet->timestamp, &request->reply->timestamp);
+
+	request_stats_latency(FR_STATS_LATENCY_TOTAL, &request->packet->timestamp, &request->times.reply_sent);
+
 	if (request->reply && (request->packet->code != PW_CODE_STATUS_SERVER)) switch (request->reply->code) {
 	case PW_CODE_ACCESS_ACCEPT:
 		INC_AUTH(total_access_accepts);
@@ -166,18 +415,9 @@ void request_stats_final(REQUEST *request)
 		auth_stats:
 		INC_AUTH(total_responses);
 
-		/*
-		 *	FIXME: Do the time calculations once...
-		 */
-		stats_time(&radius_auth_stats,
-			   &request->packet->timestamp,
-			   &request->reply->timestamp);
-		stats_time(&request->client->auth,
-			   &request->packet->timestamp,
-			   &request->reply->timestamp);
-		stats_time(&request->listener->stats,
-			   &request->packet->timestamp,
-			   &request->reply->timestamp);
+		if (bucket >= 0) {
+			INC_AUTH(elapsed[bucket]);
+		}
 		break;
 
 	case PW_CODE_ACCESS_REJECT:
@@ -191,12 +431,10 @@ void request_stats_final(REQUEST *request)
 #ifdef WITH_ACCOUNTING
 	case PW_CODE_ACCOUNTING_RESPONSE:
 		INC_ACCT(total_responses);
-		stats_time(&radius_acct_stats,
-			   &request->packet->timestamp,
-			   &request->reply->timestamp);
-		stats_time(&request->client->acct,
-			   &request->packet->timestamp,
-			   &request->reply->timestamp);
+		if (bucket >= 0) {
+			FR_STATS_LOCAL_INC(FR_STATS_ACCT, elapsed[bucket]);
+			FR_STATS_TYPE_INC(request->client->acct.elapsed[bucket]);
+		}
 		break;
 #endif
 
@@ -205,9 +443,7 @@ void request_stats_final(REQUEST *request)
 		INC_COA(total_access_accepts);
 	  coa_stats:
 		INC_COA(total_responses);
-		stats_time(&request->client->coa,
-			   &request->packet->timestamp,
-			   &request->reply->timestamp);
+		if (bucket >= 0) FR_STATS_TYPE_INC(request->client->coa.elapsed[bucket]);
 		break;
 
 	case PW_CODE_COA_NAK:
@@ -218,9 +454,7 @@ void request_stats_final(REQUEST *request)
 		INC_DSC(total_access_accepts);
 	  dsc_stats:
 		INC_DSC(total_responses);
-		stats_time(&request->client->dsc,
-			   &request->packet->timestamp,
-			   &request->reply->timestamp);
+		if (bucket >= 0) FR_STATS_TYPE_INC(request->client->dsc.elapsed[bucket]);
 		break;
 
 	case PW_CODE_DISCONNECT_NAK:
@@ -255,28 +489,27 @@ void request_stats_final(REQUEST *request)
 #ifdef WITH_PROXY
 	if (!request->proxy || !request->home_server) goto done;	/* simplifies formatting */
 
+#undef INC
+#define INC(_w, _x, _n) radius_stats_local(_w)->_x += _n; FR_STATS_TYPE_ADD(request->home_server->stats._x, _n)
+
 	switch (request->proxy->code) {
 	case PW_CODE_ACCESS_REQUEST:
-		proxy_auth_stats.total_requests += request->num_proxied_requests;
-		request->home_server->stats.total_requests += request->num_proxied_requests;
+		INC(FR_STATS_PROXY_AUTH, total_requests, request->num_proxied_requests);
 		break;
 
 #ifdef WITH_ACCOUNTING
 	case PW_CODE_ACCOUNTING_REQUEST:
-		proxy_acct_stats.total_requests += request->num_proxied_requests;
-		request->home_server->stats.total_requests += request->num_proxied_requests;
+		INC(FR_STATS_PROXY_ACCT, total_requests, request->num_proxied_requests);
 		break;
 #endif
 
 #ifdef WITH_COA
 	case PW_CODE_COA_REQUEST:
-		proxy_coa_stats.total_requests += request->num_proxied_requests;
-		request->home_server->stats.total_requests += request->num_proxied_requests;
+		INC(FR_STATS_PROXY_COA, total_requests, request->num_proxied_requests);
 		break;
 
 	case PW_CODE_DISCONNECT_REQUEST:
-		proxy_dsc_stats.total_requests += request->num_proxied_requests;
-		request->home_server->stats.total_requests += request->num_proxied_requests;
+		INC(FR_STATS_PROXY_DSC, total_requests, request->num_proxied_requests);
 		break;
 #endif
 
@@ -286,72 +519,55 @@ void request_stats_final(REQUEST *request)
 
 	if (!request->proxy_reply) goto done;	/* simplifies formatting */
 
-#undef INC
-#define INC(_x) proxy_auth_stats._x += request->num_proxied_responses; request->home_server->stats._x += request->num_proxied_responses;
+	bucket = stats_elapsed(&request->proxy->timestamp, &request->proxy_reply->timestamp);
 
 	switch (request->proxy_reply->code) {
 	case PW_CODE_ACCESS_ACCEPT:
-		INC(total_access_accepts);
+		INC(FR_STATS_PROXY_AUTH, total_access_accepts, request->num_proxied_responses);
 	proxy_stats:
-		INC(total_responses);
-		stats_time(&proxy_auth_stats,
-			   &request->proxy->timestamp,
-			   &request->proxy_reply->timestamp);
-		stats_time(&request->home_server->stats,
-			   &request->proxy->timestamp,
-			   &request->proxy_reply->timestamp);
+		INC(FR_STATS_PROXY_AUTH, total_responses, request->num_proxied_responses);
+		if (bucket >= 0) {
+			INC(FR_STATS_PROXY_AUTH, elapsed[bucket], 1);
+		}
 		break;
 
 	case PW_CODE_ACCESS_REJECT:
-		INC(total_access_rejects);
+		INC(FR_STATS_PROXY_AUTH, total_access_rejects, request->num_proxied_responses);
 		goto proxy_stats;
 
 	case PW_CODE_ACCESS_CHALLENGE:
-		INC(total_access_challenges);
+		INC(FR_STATS_PROXY_AUTH, total_access_challenges, request->num_proxied_responses);
 		goto proxy_stats;
 
 #ifdef WITH_ACCOUNTING
 	case PW_CODE_ACCOUNTING_RESPONSE:
-		proxy_acct_stats.total_responses++;
-		request->home_server->stats.total_responses++;
-		stats_time(&proxy_acct_stats,
-			   &request->proxy->timestamp,
-			   &request->proxy_reply->timestamp);
-		stats_time(&request->home_server->stats,
-			   &request->proxy->timestamp,
-			   &request->proxy_reply->timestamp);
+		INC(FR_STATS_PROXY_ACCT, total_responses, 1);
+		if (bucket >= 0) {
+			INC(FR_STATS_PROXY_ACCT, elapsed[bucket], 1);
+		}
 		break;
 #endif
 
 #ifdef WITH_COA
 	case PW_CODE_COA_ACK:
 	case PW_CODE_COA_NAK:
-		proxy_coa_stats.total_responses++;
-		request->home_server->stats.total_responses++;
-		stats_time(&proxy_coa_stats,
-			   &request->proxy->timestamp,
-			   &request->proxy_reply->timestamp);
-		stats_time(&request->home_server->stats,
-			   &request->proxy->timestamp,
-			   &request->proxy_reply->timestamp);
+		INC(FR_STATS_PROXY_COA, total_responses, 1);
+		if (bucket >= 0) {
+			INC(FR_STATS_PROXY_COA, elapsed[bucket], 1);
+		}
 		break;
 
 	case PW_CODE_DISCONNECT_ACK:
 	case PW_CODE_DISCONNECT_NAK:
-		proxy_dsc_stats.total_responses++;
-		request->home_server->stats.total_responses++;
-		stats_time(&proxy_dsc_stats,
-			   &request->proxy->timestamp,
-			   &request->proxy_reply->timestamp);
-		stats_time(&request->home_server->stats,
-			   &request->proxy->timestamp,
-			   &request->proxy_reply->timestamp);
+		INC(FR_STATS_PROXY_DSC, total_responses, 1);
+		if (bucket >= 0) {
+			INC(FR_STATS_PROXY_DSC, elapsed[bucket], 1);
+		}
 		break;
 #endif
 
 	default:
-		proxy_auth_stats.total_unknown_types++;
-		request->home_server->stats.total_unknown_types++;
+		INC(FR_STATS_PROXY_AUTH, total_unknown_types, 1);
 		break;
 	}
 
@@ -481,6 +697,7 @@ static void request_stats_addvp(REQUEST *request,
 void request_stats_reply(REQUEST *request)
 {
 	VALUE_PAIR *flag, *vp;
+	fr_stats_t stats;
 
 	/*
 	 *	Statistics are available ONLY on a "status" port.
@@ -496,7 +713,8 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_integer & 0x01) != 0) &&
 	    ((flag->vp_integer & 0xc0) == 0)) {
-		request_stats_addvp(request, authvp, &radius_auth_stats);
+		radius_stats_global(&stats, FR_STATS_AUTH);
+		request_stats_addvp(request, authvp, &stats);
 	}
 
 #ifdef WITH_ACCOUNTING
@@ -505,7 +723,8 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_integer & 0x02) != 0) &&
 	    ((flag->vp_integer & 0xc0) == 0)) {
-		request_stats_addvp(request, acctvp, &radius_acct_stats);
+		radius_stats_global(&stats, FR_STATS_ACCT);
+		request_stats_addvp(request, acctvp, &stats);
 	}
 #endif
 
@@ -515,7 +734,8 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_integer & 0x04) != 0) &&
 	    ((flag->vp_integer & 0x20) == 0)) {
-		request_stats_addvp(request, proxy_authvp, &proxy_auth_stats);
+		radius_stats_global(&stats, FR_STATS_PROXY_AUTH);
+		request_stats_addvp(request, proxy_authvp, &stats);
 	}
 
 #ifdef WITH_ACCOUNTING
@@ -524,7 +744,8 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_integer & 0x08) != 0) &&
 	    ((flag->vp_integer & 0x20) == 0)) {
-		request_stats_addvp(request, proxy_acctvp, &proxy_acct_stats);
+		radius_stats_global(&stats, FR_STATS_PROXY_ACCT);
+		request_stats_addvp(request, proxy_acctvp, &stats);
 	}
 #endif
 #endif
@@ -831,8 +1052,14 @@ void request_stats_reply(REQUEST *request)
 void radius_stats_init(int flag)
 {
 	if (!flag) {
+		int i;
+
 		gettimeofday(&start_time, NULL);
 		hup_time = start_time; /* it's just nicer this way */
+
+		for (i = 0; i < FR_STATS_LATENCY_MAX; i++) {
+			if (!request_latency[i]) request_latency[i] = fr_stats_latency_alloc(NULL);
+		}
 	} else {
 		gettimeofday(&hup_time, NULL);
 	}
@@ -895,4 +1122,335 @@ void radius_stats_ema(fr_stats_ema_t *ema,
 #endif
 }
 
+/*
+ *	Latency histograms.
+ *
+ *	Values below 16us each get their own bucket.  Above that,
+ *	each power of 2 is split into 16 linear buckets, so every
+ *	value is reported to within about 6%.  Anything over 2^36us
+ *	(about 19 hours) goes in the last bucket.
+ *
+ *	Each thread counts into one of several shards, so that
+ *	threads calling the same module don't all increment the same
+ *	cache lines.  The shards are only merged when the histogram
+ *	is read.
+ */
+#define LATENCY_SUB_BITS	(4)
+#define LATENCY_SUB_COUNT	(1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS	(36)
+#define LATENCY_BUCKETS		((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT)
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+
+#  define LATENCY_SHARDS	(16)
+
+typedef struct latency_shard_t {
+	atomic_uint_fast64_t	count[LATENCY_BUCKETS];
+	atomic_uint_fast64_t	sum;
+} latency_shard_t;
+
+#  define COUNT_INC(_x)		atomic_fetch_add_explicit(&(_x), 1, memory_order_relaxed)
+#  define COUNT_ADD(_x, _y)	atomic_fetch_add_explicit(&(_x), _y, memory_order_relaxed)
+#  define COUNT_LOAD(_x)	atomic_load_explicit(&(_x), memory_order_relaxed)
+
+static atomic_uint latency_thread_ids;
+fr_thread_local_setup(unsigned int, latency_thread_id)	/* macro */
+#else
+#  define LATENCY_SHARDS	(1)
+
+typedef struct latency_shard_t {
+	uint64_t		count[LATENCY_BUCKETS];
+	uint64_t		sum;
+} latency_shard_t;
+
+#  define COUNT_INC(_x)		(_x)++
+#  define COUNT_ADD(_x, _y)	(_x) += (_y)
+#  define COUNT_LOAD(_x)	(_x)
+#endif
+
+struct fr_stats_latency_t {
+#ifdef HAVE_STDATOMIC_H
+	_Atomic(latency_shard_t *)	shard[LATENCY_SHARDS];
+#else
+	latency_shard_t			*shard[LATENCY_SHARDS];
+#endif
+};
+
+static int _stats_latency_free(fr_stats_latency_t *lat)
+{
+	int i;
+
+	for (i = 0; i < LATENCY_SHARDS; i++) free(lat->shard[i]);
+
+	return 0;
+}
+
+/** Allocate a latency histogram
+ *
+ * @param[in] ctx to allocate the histogram in.
+ * @return
+ *	- The new histogram.
+ *	- NULL on error.
+ */
+fr_stats_latency_t *fr_stats_latency_alloc(TALLOC_CTX *ctx)
+{
+	fr_stats_latency_t *lat;
+
+	lat = talloc_zero(ctx, fr_stats_latency_t);
+	if (!lat) return NULL;
+
+	talloc_set_destructor(lat, _stats_latency_free);
+
+	return lat;
+}
+
+static int latency_bucket(uint64_t usec)
+{
+	int msb;
+
+	if (usec < LATENCY_SUB_COUNT) return usec;
+	if (usec >= ((uint64_t) 1 << LATENCY_MAX_BITS)) return LATENCY_BUCKETS - 1;
+
+	msb = 63 - __builtin_clzll(usec);
+
+	return ((msb - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) +
+		((usec >> (msb - LATENCY_SUB_BITS)) & (LATENCY_SUB_COUNT - 1));
+}
+
+/*
+ *	The largest value which goes into a bucket.
+ */
+static uint64_t latency_bucket_max(int bucket)
+{
+	int shift;
+	uint64_t sub;
+
+	if (bucket < LATENCY_SUB_COUNT) return bucket;
+
+	shift = (bucket >> LATENCY_SUB_BITS) - 1;
+	sub = (bucket & (LATENCY_SUB_COUNT - 1)) + LATENCY_SUB_COUNT;
+
+	return ((sub + 1) << shift) - 1;
+}
+
+static latency_shard_t *latency_shard(fr_stats_latency_t *lat)
+{
+#ifdef HAVE_STDATOMIC_H
+	unsigned int id;
+	latency_shard_t *shard, *expected = NULL;
+
+	id = fr_thread_local_get(latency_thread_id);
+	if (id == 0) {
+		id = atomic_fetch_add(&latency_thread_ids, 1) + 1;
+		(void) fr_thread_local_set(latency_thread_id, id);
+	}
+	id %= LATENCY_SHARDS;
+
+	shard = atomic_load_explicit(&lat->shard[id], memory_order_acquire);
+	if (shard) return shard;
+
+	shard = calloc(1, sizeof(*shard));
+	if (!shard) return NULL;
+
+	/*
+	 *	Another thread using the same shard got there first.
+	 */
+	if (!atomic_compare_exchange_strong_explicit(&lat->shard[id], &expected, shard,
+						     memory_order_acq_rel, memory_order_acquire)) {
+		free(shard);
+		return expected;
+	}
+
+	return shard;
+#else
+	if (!lat->shard[0]) lat->shard[0] = calloc(1, sizeof(*lat->shard[0]));
+
+	return lat->shard[0];
+#endif
+}
+
+/** Add a sample to a latency histogram
+ *
+ * @param[in] lat to add the sample to.
+ * @param[in] start of the operation.
+ * @param[in] end of the operation.
+ */
+void fr_stats_latency_add(fr_stats_latency_t *lat, struct timeval const *start, struct timeval const *end)
+{
+	latency_shard_t *shard;
+	int64_t usec;
+
+	shard = latency_shard(lat);
+	if (!shard) return;
+
+	usec = (end->tv_sec - start->tv_sec) * (int64_t) USEC;
+	usec += end->tv_usec - start->tv_usec;
+	if (usec < 0) usec = 0;		/* clock went backwards */
+
+	COUNT_INC(shard->count[latency_bucket(usec)]);
+	COUNT_ADD(shard->sum, usec);
+}
+
+static latency_shard_t *latency_shard_get(fr_stats_latency_t *lat, int s)
+{
+#ifdef HAVE_STDATOMIC_H
+	return atomic_load_explicit(&lat->shard[s], memory_order_acquire);
+#else
+	return lat->shard[s];
+#endif
+}
+
+/** Get the total of all of the samples in a latency histogram
+ *
+ * @param[in] lat to read.
+ * @return the sum of the samples, in microseconds.
+ */
+uint64_t fr_stats_latency_sum(fr_stats_latency_t *lat)
+{
+	uint64_t	sum = 0;
+	int		s;
+
+	for (s = 0; s < LATENCY_SHARDS; s++) {
+		latency_shard_t *shard = latency_shard_get(lat, s);
+
+		if (shard) sum += COUNT_LOAD(shard->sum);
+	}
+
+	return sum;
+}
+
+/** Remember the size of a request, before calling a module or section
+ *
+ * Does nothing unless memory accounting is enabled.  Measuring the
+ * request walks all of the memory allocated under it, so it's not
+ * something to do all of the time.
+ *
+ * @param[out] mark to pass to fr_stats_alloc_end().
+ * @param[in] ctx to measure, usually the request.
+ */
+void fr_stats_alloc_start(fr_stats_alloc_mark_t *mark, void const *ctx)
+{
+	if (!main_config.memory_accounting) {
+		mark->ctx = NULL;
+		return;
+	}
+
+	mark->ctx = ctx;
+	mark->bytes = talloc_total_size(ctx);
+	mark->blocks = talloc_total_blocks(ctx);
+}
+
+/** Count the memory added to a request since fr_stats_alloc_start()
+ *
+ * Memory which was freed isn't counted.
+ *
+ * @param[in] alloc of the module or virtual server.
+ * @param[in] mark from fr_stats_alloc_start().
+ */
+void fr_stats_alloc_end(fr_stats_alloc_t *alloc, fr_stats_alloc_mark_t const *mark)
+{
+	size_t bytes, blocks;
+
+	if (!mark->ctx) return;
+
+	bytes = talloc_total_size(mark->ctx);
+	blocks = talloc_total_blocks(mark->ctx);
+
+	FR_STATS_TYPE_INC(alloc->calls);
+	if (bytes > mark->bytes) FR_STATS_TYPE_ADD(alloc->bytes, bytes - mark->bytes);
+	if (blocks > mark->blocks) FR_STATS_TYPE_ADD(alloc->blocks, blocks - mark->blocks);
+}
+
+/** Add a sample to one of the server wide latency histograms
+ *
+ * Nothing is added unless both times are set.
+ *
+ * @param[in] which histogram to add the sample to.
+ * @param[in] start of the phase.
+ * @param[in] end of the phase.
+ */
+void request_stats_latency(fr_stats_request_latency_t which, struct timeval const *start, struct timeval const *end)
+{
+	if (!request_latency[which]) return;
+
+	if ((start->tv_sec == 0) || (end->tv_sec == 0)) return;
+
+	fr_stats_latency_add(request_latency[which], start, end);
+}
+
+/** Call a function for each of the server wide latency histograms
+ *
+ * @param[in] walk function to call.  The name is "request", and the
+ *	section is the phase, e.g. "queue".
+ * @param[in] ctx to pass to the function.
+ */
+void request_latency_walk(fr_stats_latency_walk_t walk, void *ctx)
+{
+	int i;
+
+	for (i = 0; i < FR_STATS_LATENCY_MAX; i++) {
+		if (!request_latency[i]) continue;
+
+		walk(ctx, "request", request_latency_names[i], request_latency[i]);
+	}
+}
+
+/** Get percentiles from a latency histogram
+ *
+ * Samples added while the histogram is being read may or may not
+ * be included.
+ *
+ * @param[in] lat to read.
+ * @param[out] out the latency in microseconds for each percentile.
+ * @param[in] pct percentiles to get, e.g. 50, 99, 99.9.
+ * @param[in] num of percentiles.
+ * @return the number of samples in the histogram.  If 0, out isn't written.
+ */
+uint64_t fr_stats_latency_percentiles(fr_stats_latency_t *lat, uint64_t *out, double const *pct, size_t num)
+{
+	uint64_t	*count;
+	uint64_t	total = 0, seen;
+	size_t		i;
+	int		s, b;
+
+	count = talloc_zero_array(NULL, uint64_t, LATENCY_BUCKETS);
+	if (!count) return 0;
+
+	for (s = 0; s < LATENCY_SHARDS; s++) {
+		latency_shard_t *shard = latency_shard_get(lat, s);
+
+		if (!shard) continue;
+
+		for (b = 0; b < LATENCY_BUCKETS; b++) {
+			uint64_t n = COUNT_LOAD(shard->count[b]);
+
+			count[b] += n;
+			total += n;
+		}
+	}
+
+	if (!total) goto done;
+
+	for (i = 0; i < num; i++) {
+		uint64_t rank;
+
+		rank = (uint64_t) ((pct[i] * total) / 100.0);
+		if (rank < 1) rank = 1;
+		if (rank > total) rank = total;
+
+		seen = 0;
+		for (b = 0; b < LATENCY_BUCKETS; b++) {
+			seen += count[b];
+			if (seen >= rank) break;
+		}
+
+		out[i] = latency_bucket_max(b);
+	}
+
+done:
+	talloc_free(count);
+	return total;
+}
+
 #endif /* WITH_STATS */
@@ -27,8 +27,14 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/process.h>
 #include <freeradius-devel/heap.h>
+#include <freeradius-devel/atomic_queue.h>
+#include <freeradius-devel/thread_channel.h>
 #include <freeradius-devel/rad_assert.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#endif
+
 /*
  *	Other OS's have sem_init, OS X doesn't.
  */
@@ -76,8 +82,14 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #  include <gperftools/profiler.h>
 #endif
 
+#ifdef WITH_THREAD_AFFINITY
+#  include <ctype.h>
+#  include <sched.h>
+#endif
+
 #ifndef WITH_GCD
 #  define SEMAPHORE_LOCKED	(0)
+#  define USEC			(1000000)
 
 #  define THREAD_RUNNING	(1)
 #  define THREAD_CANCELLED	(2)
@@ -95,9 +107,97 @@ typedef struct THREAD_HANDLE {
 	int			status;		//!< Is the thread running or exited?
 	unsigned int		request_count;	//!< The number of requests that this thread has handled.
 	time_t			timestamp;	//!< When the thread started executing.
-	REQUEST			*request;
+	REQUEST			*request;	//!< With fibers, the last request started, or NULL if
+						//!< none are running.
+	int			slot;		//!< Which local queue this thread services first.
+#  ifdef WITH_FIBERS
+	fr_fiber_sched_t	*fibers;	//!< Runs the thread's requests, if "fibers" is set.
+	int			kick[2];	//!< Written to wake the thread, when it's polling.
+	bool			polling;	//!< Whether the thread is in fiber_polling.
+	struct THREAD_HANDLE	*next_polling;	//!< Next thread polling for requests.
+#  endif
 } THREAD_HANDLE;
 
+/*
+ *	A unit of CPU-heavy work (e.g. a password hash) handed from a
+ *	worker to the offload threads.  It lives on the stack of the
+ *	worker, which waits for it to complete.
+ */
+typedef struct offload_job_t {
+	struct offload_job_t	*next;
+	thread_pool_offload_t	func;		//!< Function to run.
+	void			*uctx;		//!< Argument for func.
+	int			rcode;		//!< What func returned.
+	bool			done;		//!< Set by the offload thread when func has run.
+	struct timeval		queued;		//!< When the job was submitted.
+	pthread_cond_t		cond;		//!< Signalled when done is set.
+} offload_job_t;
+
+/*
+ *	A small, fixed size pool of threads with its own queue.  Slow
+ *	hashing runs here, so that it can't use more than
+ *	offload_threads CPUs, no matter how many workers are waiting
+ *	on it.  The workers left over are free to process cheap
+ *	requests e.g. accounting.
+ */
+typedef struct offload_pool_t {
+	uint32_t	num_threads;
+	uint32_t	max_queue_size;
+	pthread_t	*threads;
+	bool		stop;
+
+	pthread_mutex_t	mutex;		//!< Protects everything below.
+	pthread_cond_t	cond;		//!< Signalled when a job is queued.
+	offload_job_t	*head;
+	offload_job_t	*tail;
+	uint32_t	num_queued;
+
+	uint64_t	completed;	//!< Jobs which have run.
+	uint64_t	rejected;	//!< Jobs which were refused because the queue was full.
+	uint64_t	wait_usec;	//!< Total time jobs spent in the queue.
+	uint64_t	run_usec;	//!< Total time jobs spent running.
+} offload_pool_t;
+
+/*
+ *	A named pool of threads with its own queue.  Listeners, or
+ *	virtual servers, which set "thread_pool = <name>" have their
+ *	requests processed here instead of by the main pool.  So a
+ *	slow accounting database can only tie up the threads of the
+ *	accounting pool, and authentication requests never wait
+ *	behind accounting requests.
+ */
+struct isolated_pool_t {
+	isolated_pool_t	*next;
+	char const	*name;
+
+	uint32_t	num_threads;
+	uint32_t	max_queue_size;
+	char const	*queue_priority;
+	fr_heap_cmp_t	heap_cmp;
+	pthread_t	*threads;
+	bool		stop;
+
+	pthread_mutex_t	mutex;		//!< Protects everything below.
+	pthread_cond_t	cond;		//!< Signalled when a request is queued.
+	fr_heap_t	*heap;		//!< Ordered by queue_priority.
+
+	uint32_t	active;		//!< Threads processing a request.
+	uint64_t	completed;	//!< Requests which have been processed.
+	uint64_t	rejected;	//!< Requests which were refused because the queue was full.
+	uint64_t	wait_usec;	//!< Total time requests spent in the queue.
+	uint64_t	run_usec;	//!< Total time requests spent running.
+};
+
+/*
+ *	The requests from one client, for the "fair" queue type.
+ */
+typedef struct fair_queue_t {
+	struct fair_queue_t	*next;		//!< Next client in turn, or on the free list.
+	RADCLIENT const		*client;	//!< Only used as a key.  It's never dereferenced.
+	uint32_t		weight;		//!< From the client, when it joined the turn order.
+	uint32_t		deficit;	//!< Requests left in this turn.
+	fr_heap_t		*heap;		//!< Ordered by queue_priority.
+} fair_queue_t;
 #endif	/* WITH_GCD */
 
 typedef struct thread_fork_t {
@@ -127,7 +227,11 @@ typedef struct THREAD_POOL {
 	THREAD_HANDLE	*head;
 	THREAD_HANDLE	*tail;
 
+#  ifdef HAVE_STDATOMIC_H
+	atomic_uint_least32_t active_threads;	/* atomic, so the lock-free queue doesn't need queue_mutex */
+#  else
 	uint32_t	active_threads;	/* protected by queue_mutex */
+#  endif
 	uint32_t	total_threads;
 
 	uint32_t	exited_threads;
@@ -176,16 +280,321 @@ typedef struct THREAD_POOL {
 
 	uint32_t	max_queue_size;
 	fr_heap_t	*heap;
+
+	/*
+	 *	When the queue type is "fair", each client has its own
+	 *	heap.  The threads take up to "queue_weight" requests
+	 *	from one client, then move on to the next client which
+	 *	has requests waiting, i.e. deficit round robin.  So a
+	 *	client sending a flood of packets only delays its own
+	 *	requests.  Protected by queue_mutex.
+	 */
+	bool		fair;
+	fr_hash_table_t	*fair_queues;		//!< Clients which have requests queued.
+	fair_queue_t	*fair_head;		//!< Whose turn it is.
+	fair_queue_t	*fair_tail;
+	fair_queue_t	*fair_free;		//!< Empty queues, for re-use.
+	uint32_t	fair_num;		//!< Requests in all of the fair queues.
+
+	/*
+	 *	Admission control.  The threads note when requests
+	 *	started waiting in the queue for longer than
+	 *	queue_delay_target.  If that lasts for more than
+	 *	queue_delay_interval, the main thread sheds load
+	 *	until a request is dequeued under the target again.
+	 */
+	uint32_t	queue_delay_target;	//!< In milliseconds, 0 is off.
+	uint32_t	queue_delay_interval;	//!< In milliseconds.
+#  ifdef HAVE_STDATOMIC_H
+	atomic_uint_fast64_t delay_above;	/* atomic, as the lock-free queues don't take queue_mutex */
+	atomic_uint_fast64_t last_dequeued;
+#  else
+	uint64_t	delay_above;		/* protected by queue_mutex */
+	uint64_t	last_dequeued;
+#  endif
+
+	uint64_t	shed[QUEUE_SHED_MAX];	//!< Only updated by the main thread.
+
+	char const	*cpu_affinity;		//!< CPUs the main and worker threads may run on.
+	int32_t		numa_node;		//!< Or the NUMA node they run on, -1 for any.
+
+	/*
+	 *	Thread pool sizing by queue delay.  If requests wait
+	 *	for longer than spawn_delay_target, or there are more
+	 *	requests queued than idle threads, the main thread
+	 *	spawns enough threads to take them, without waiting
+	 *	for min_spare_servers to be reached.
+	 */
+	uint32_t	spawn_delay_target;	//!< In milliseconds, 0 is off.
+#  ifdef HAVE_STDATOMIC_H
+	atomic_uint_fast64_t last_delay;	/* atomic, as the lock-free queues don't take queue_mutex */
+#  else
+	uint64_t	last_delay;		/* protected by queue_mutex */
+#  endif
+
+	char const	*queue_type;
+
+#  ifdef HAVE_STDATOMIC_H
+	/*
+	 *	When the queue type is "lockfree", requests are put
+	 *	into one FIFO per priority, instead of into the heap.
+	 *	Lower numbered lanes are serviced first.
+	 */
+	bool		lockfree;
+	int		num_lanes;
+	fr_atomic_queue_t *lanes[RAD_LISTEN_MAX];
+
+	/*
+	 *	When the queue type is "stealing", each thread has a
+	 *	local queue.  Requests are handed out to the local
+	 *	queues round-robin, and a thread which finds its own
+	 *	queue empty steals from the busiest one.  The slots
+	 *	are only assigned or released by the main thread.
+	 */
+	bool		stealing;
+	int		num_slots;
+	int		next_slot;
+	bool		*slot_used;
+	fr_atomic_queue_t **slots;
+
+	/*
+	 *	When the queue type is "channel", each thread has a
+	 *	channel from the main thread, and uses the slots
+	 *	above to find it.  Threads sleep on their channel
+	 *	instead of on the semaphore, and are only woken when
+	 *	their channel was empty.  Nothing is stolen.
+	 */
+	bool		channels;
+	fr_thread_channel_t **channel;
+#  endif
+
+	/*
+	 *	When "fibers" is more than 1, each thread runs up to
+	 *	that many requests at once, each on its own stack.
+	 *	While a request waits for I/O, the thread runs the
+	 *	others, or takes more from the queue.  Threads with
+	 *	room for more poll their own kick pipe, instead of
+	 *	waiting on the semaphore, and put themselves on
+	 *	fiber_polling.  Each new request kicks one of them.
+	 */
+	uint32_t	fibers;
+	uint32_t	fiber_stack_size;
+	pthread_mutex_t	fiber_mutex;		/* protects fiber_polling */
+	struct THREAD_HANDLE *fiber_polling;
+
+	offload_pool_t	offload;
+	isolated_pool_t	*isolated;		//!< Named pools, from "pool <name> { ... }".
 #endif	/* WITH_GCD */
 } THREAD_POOL;
 
 static THREAD_POOL thread_pool;
 static bool pool_initialized = false;
 
+FR_NAME_NUMBER const queue_shed_table[] = {
+	{ "full",		QUEUE_SHED_FULL },
+	{ "acct_limit",		QUEUE_SHED_ACCT_LIMIT },
+	{ "delay_acct",		QUEUE_SHED_DELAY_ACCT },
+	{ "delay_client",	QUEUE_SHED_DELAY_CLIENT },
+	{ NULL, -1 }
+};
+
+#ifdef WITH_THREAD_AFFINITY
+/*
+ *	Add a list of CPUs such as "0-3,8,10-11" to a set.
+ */
+static int affinity_parse_list(cpu_set_t *set, char const *list)
+{
+	char const *p = list;
+	char *end;
+	unsigned long first, last;
+
+	while (*p) {
+		first = strtoul(p, &end, 10);
+		if (end == p) goto error;
+		p = end;
+
+		last = first;
+		if (*p == '-') {
+			p++;
+			last = strtoul(p, &end, 10);
+			if ((end == p) || (last < first)) goto error;
+			p = end;
+		}
+
+		if (last >= CPU_SETSIZE) {
+			fr_strerror_printf("CPU %lu is larger than the maximum of %i", last, CPU_SETSIZE - 1);
+			return -1;
+		}
+
+		while (first <= last) CPU_SET(first++, set);
+
+		if (*p == ',') {
+			p++;
+			continue;
+		}
+
+		if (*p && !isspace((int) *p)) goto error;
+		while (isspace((int) *p)) p++;
+	}
+
+	return 0;
+
+error:
+	fr_strerror_printf("Invalid CPU list \"%s\"", list);
+	return -1;
+}
+
+/*
+ *	Build the set of CPUs a thread may run on.  If both a list and
+ *	a NUMA node are given, it's the CPUs of the node which are
+ *	also in the list.
+ */
+static int affinity_parse(cpu_set_t *set, char const *cpus, int32_t numa_node)
+{
+	CPU_ZERO(set);
+
+	if (numa_node >= 0) {
+		char	path[64], buffer[1024];
+		FILE	*fp;
+		size_t	len;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%i/cpulist", numa_node);
+
+		fp = fopen(path, "r");
+		if (!fp) {
+			fr_strerror_printf("Failed reading CPUs of NUMA node %i: %s", numa_node, fr_syserror(errno));
+			return -1;
+		}
+		len = fread(buffer, 1, sizeof(buffer) - 1, fp);
+		fclose(fp);
+		buffer[len] = '\0';
+
+		if (affinity_parse_list(set, buffer) < 0) return -1;
+
+		if (cpus) {
+			cpu_set_t list;
+
+			CPU_ZERO(&list);
+			if (affinity_parse_list(&list, cpus) < 0) return -1;
+			CPU_AND(set, set, &list);
+		}
+	} else if (cpus) {
+		if (affinity_parse_list(set, cpus) < 0) return -1;
+	}
+
+	if (CPU_COUNT(set) == 0) {
+		fr_strerror_printf("No CPUs selected");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Check that a CPU list and NUMA node are valid
+ *
+ * @param[in] cpus	a list of CPU numbers and ranges, such as "0-3,8".  May be NULL.
+ * @param[in] numa_node	to use the CPUs of, or -1.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, with the error in fr_strerror().
+ */
+int thread_affinity_check(char const *cpus, int32_t numa_node)
+{
+	cpu_set_t set;
+
+	return affinity_parse(&set, cpus, numa_node);
+}
+
+/*
+ *	As affinity_parse(), but if index >= 0, the set is just one of
+ *	the CPUs, chosen round robin.
+ */
+static int affinity_select(cpu_set_t *set, char const *cpus, int32_t numa_node, int index)
+{
+	int cpu, n;
+
+	if (affinity_parse(set, cpus, numa_node) < 0) return -1;
+
+	if (index < 0) return 0;
+
+	n = index % CPU_COUNT(set);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, set)) continue;
+		if (n-- == 0) break;
+	}
+
+	CPU_ZERO(set);
+	CPU_SET(cpu, set);
+
+	return 0;
+}
+
+/** Bind the calling thread to a set of CPUs
+ *
+ * Memory the thread allocates after this is usually local to the
+ * NUMA node it's running on.  Threads it creates inherit the set.
+ *
+ * @param[in] cpus	a list of CPU numbers and ranges, such as "0-3,8".  May be NULL.
+ * @param[in] numa_node	to use the CPUs of, or -1.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, with the error in fr_strerror().
+ */
+int thread_affinity_set(char const *cpus, int32_t numa_node)
+{
+	cpu_set_t	set;
+	int		rcode;
+
+	if (affinity_select(&set, cpus, numa_node, -1) < 0) return -1;
+
+	rcode = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (rcode != 0) {
+		fr_strerror_printf("Failed setting CPU affinity: %s", fr_syserror(rcode));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Set the CPU a thread will be created on
+ *
+ * Binding the thread before it starts means everything it allocates
+ * is local to that CPU's NUMA node.
+ *
+ * @param[in] attr	to create the thread with.
+ * @param[in] cpus	a list of CPU numbers and ranges, such as "0-3,8".  May be NULL.
+ * @param[in] numa_node	to use the CPUs of, or -1.
+ * @param[in] index	of the thread.  Thread N is bound to the Nth CPU of the
+ *			set, wrapping around if there are more threads than CPUs.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, with the error in fr_strerror().
+ */
+int thread_affinity_attr(pthread_attr_t *attr, char const *cpus, int32_t numa_node, int index)
+{
+	cpu_set_t	set;
+	int		rcode;
+
+	if (affinity_select(&set, cpus, numa_node, index) < 0) return -1;
+
+	rcode = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+	if (rcode != 0) {
+		fr_strerror_printf("Failed setting CPU affinity: %s", fr_syserror(rcode));
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
 #ifndef WITH_GCD
 static time_t last_cleaned = 0;
 
 static void thread_pool_manage(time_t now);
+static int offload_init(offload_pool_t *pool);
+static void offload_stop(offload_pool_t *pool);
+static int isolated_init(isolated_pool_t *pool);
+static void isolated_stop(isolated_pool_t *pool);
 #endif
 
 #ifndef WITH_GCD
@@ -201,6 +610,16 @@ static const CONF_PARSER thread_config[] = {
 	{ FR_CONF_POINTER("cleanup_delay", PW_TYPE_INTEGER, &thread_pool.cleanup_delay), .dflt = "5" },
 	{ FR_CONF_POINTER("max_queue_size", PW_TYPE_INTEGER, &thread_pool.max_queue_size), .dflt = "65536" },
 	{ FR_CONF_POINTER("queue_priority", PW_TYPE_STRING, &thread_pool.queue_priority), .dflt = NULL },
+	{ FR_CONF_POINTER("queue_type", PW_TYPE_STRING, &thread_pool.queue_type), .dflt = "heap" },
+	{ FR_CONF_POINTER("queue_delay_target", PW_TYPE_INTEGER, &thread_pool.queue_delay_target), .dflt = "0" },
+	{ FR_CONF_POINTER("queue_delay_interval", PW_TYPE_INTEGER, &thread_pool.queue_delay_interval), .dflt = "100" },
+	{ FR_CONF_POINTER("spawn_delay_target", PW_TYPE_INTEGER, &thread_pool.spawn_delay_target), .dflt = "0" },
+	{ FR_CONF_POINTER("cpu_affinity", PW_TYPE_STRING, &thread_pool.cpu_affinity), .dflt = NULL },
+	{ FR_CONF_POINTER("numa_node", PW_TYPE_SIGNED, &thread_pool.numa_node), .dflt = "-1" },
+	{ FR_CONF_POINTER("offload_threads", PW_TYPE_INTEGER, &thread_pool.offload.num_threads), .dflt = "0" },
+	{ FR_CONF_POINTER("offload_queue_size", PW_TYPE_INTEGER, &thread_pool.offload.max_queue_size), .dflt = "1024" },
+	{ FR_CONF_POINTER("fibers", PW_TYPE_INTEGER, &thread_pool.fibers), .dflt = "0" },
+	{ FR_CONF_POINTER("fiber_stack_size", PW_TYPE_INTEGER, &thread_pool.fiber_stack_size), .dflt = "1048576" },
 #  ifdef WITH_STATS
 #    ifdef WITH_ACCOUNTING
 	{ FR_CONF_POINTER("auto_limit_acct", PW_TYPE_BOOLEAN, &thread_pool.auto_limit_acct) },
@@ -208,6 +627,13 @@ static const CONF_PARSER thread_config[] = {
 #  endif
 	CONF_PARSER_TERMINATOR
 };
+
+static const CONF_PARSER isolated_config[] = {
+	{ FR_CONF_OFFSET("num_threads", PW_TYPE_INTEGER, isolated_pool_t, num_threads), .dflt = "4" },
+	{ FR_CONF_OFFSET("max_queue_size", PW_TYPE_INTEGER, isolated_pool_t, max_queue_size), .dflt = "1024" },
+	{ FR_CONF_OFFSET("queue_priority", PW_TYPE_STRING, isolated_pool_t, queue_priority), .dflt = NULL },
+	CONF_PARSER_TERMINATOR
+};
 #endif
 
 #ifdef WNOHANG
@@ -256,14 +682,582 @@ static void reap_children(void)
 #endif /* WNOHANG */
 
 #ifndef WITH_GCD
+/*
+ *	The heap needs the queue mutex.  The lock-free queues don't.
+ */
+static inline void queue_lock(void)
+{
+#  ifdef HAVE_STDATOMIC_H
+	if (thread_pool.lockfree) return;
+#  endif
+	pthread_mutex_lock(&thread_pool.queue_mutex);
+}
+
+static inline void queue_unlock(void)
+{
+#  ifdef HAVE_STDATOMIC_H
+	if (thread_pool.lockfree) return;
+#  endif
+	pthread_mutex_unlock(&thread_pool.queue_mutex);
+}
+
+/*
+ *	Return the number of requests waiting to be processed.  For
+ *	the lock-free queues, this is only an approximation.
+ */
+static size_t queue_num_elements(void)
+{
+#  ifdef HAVE_STDATOMIC_H
+	if (thread_pool.lockfree) {
+		int i;
+		size_t num = 0;
+
+		for (i = 0; i < thread_pool.num_lanes; i++) {
+			num += fr_atomic_queue_num_elements(thread_pool.lanes[i]);
+		}
+
+		for (i = 0; i < thread_pool.num_slots; i++) {
+			if (thread_pool.channels) {
+				num += fr_thread_channel_num_elements(thread_pool.channel[i], FR_THREAD_CHANNEL_WORKER);
+				continue;
+			}
+
+			num += fr_atomic_queue_num_elements(thread_pool.slots[i]);
+		}
+
+		return num;
+	}
+#  endif
+
+	if (thread_pool.fair) return thread_pool.fair_num;
+
+	return fr_heap_num_elements(thread_pool.heap);
+}
+
+static uint32_t fair_hash(void const *data)
+{
+	fair_queue_t const *fq = data;
+
+	return fr_hash(&fq->client, sizeof(fq->client));
+}
+
+static int fair_cmp(void const *one, void const *two)
+{
+	fair_queue_t const *a = one;
+	fair_queue_t const *b = two;
+
+	return (a->client > b->client) - (a->client < b->client);
+}
+
+static void fair_free(void *data)
+{
+	fair_queue_t *fq = data;
+
+	fr_heap_delete(fq->heap);
+	talloc_free(fq);
+}
+
+/*
+ *	Add a request to its client's queue.  If the client had
+ *	nothing queued, it goes to the back of the turn order.
+ *
+ *	Called with queue_mutex held.
+ */
+static bool fair_push(REQUEST *request)
+{
+	fair_queue_t my_fq, *fq;
+
+	my_fq.client = request->client;
+	fq = fr_hash_table_finddata(thread_pool.fair_queues, &my_fq);
+	if (!fq) {
+		if (thread_pool.fair_free) {
+			fq = thread_pool.fair_free;
+			thread_pool.fair_free = fq->next;
+		} else {
+			fq = talloc_zero(NULL, fair_queue_t);
+			if (!fq) return false;
+
+			fq->heap = fr_heap_create(thread_pool.heap_cmp, offsetof(REQUEST, heap_id));
+			if (!fq->heap) {
+				talloc_free(fq);
+				return false;
+			}
+		}
+
+		fq->client = request->client;
+		fq->weight = request->client ? request->client->queue_weight : 1;
+		if (!fq->weight) fq->weight = 1;
+		fq->deficit = fq->weight;
+
+		if (!fr_hash_table_insert(thread_pool.fair_queues, fq)) {
+			fq->next = thread_pool.fair_free;
+			thread_pool.fair_free = fq;
+			return false;
+		}
+
+		fq->next = NULL;
+		if (thread_pool.fair_tail) {
+			thread_pool.fair_tail->next = fq;
+		} else {
+			thread_pool.fair_head = fq;
+		}
+		thread_pool.fair_tail = fq;
+	}
+
+	if (!fr_heap_insert(fq->heap, request)) return false;
+
+	thread_pool.fair_num++;
+
+	return true;
+}
+
+/*
+ *	Take a request from the client whose turn it is.  When the
+ *	client has used up its turn, it goes to the back of the turn
+ *	order.  When it has nothing left, it leaves the turn order.
+ *
+ *	Called with queue_mutex held.
+ */
+static REQUEST *fair_pop(void)
+{
+	fair_queue_t *fq = thread_pool.fair_head;
+	REQUEST *request;
+
+	if (!fq) return NULL;
+
+	request = fr_heap_peek(fq->heap);
+	rad_assert(request != NULL);
+	(void) fr_heap_extract(fq->heap, request);
+	thread_pool.fair_num--;
+	fq->deficit--;
+
+	/*
+	 *	Nothing left, so there's no need to remember the
+	 *	client.
+	 */
+	if (fr_heap_num_elements(fq->heap) == 0) {
+		thread_pool.fair_head = fq->next;
+		if (!thread_pool.fair_head) thread_pool.fair_tail = NULL;
+
+		(void) fr_hash_table_yank(thread_pool.fair_queues, fq);
+		fq->next = thread_pool.fair_free;
+		thread_pool.fair_free = fq;
+
+		return request;
+	}
+
+	/*
+	 *	Its turn is over.  Let the next client go.
+	 */
+	if (!fq->deficit && fq->next) {
+		thread_pool.fair_head = fq->next;
+		thread_pool.fair_tail->next = fq;
+		thread_pool.fair_tail = fq;
+		fq->next = NULL;
+	}
+	if (!fq->deficit) fq->deficit = fq->weight;
+
+	return request;
+}
+
+#  ifdef HAVE_STDATOMIC_H
+/*
+ *	Give the request to the next thread, round-robin.  If that
+ *	thread's queue is full, try the others.  Slots which don't
+ *	have a thread are only used as a last resort.  Requests in
+ *	them will be stolen by the other threads.
+ */
+static bool slot_push(REQUEST *request)
+{
+	int i, slot;
+
+	for (i = 0; i < thread_pool.num_slots; i++) {
+		slot = (thread_pool.next_slot + i) % thread_pool.num_slots;
+		if (!thread_pool.slot_used[slot]) continue;
+
+		if (fr_atomic_queue_push(thread_pool.slots[slot], request)) {
+			thread_pool.next_slot = slot + 1;
+			return true;
+		}
+	}
+
+	for (i = 0; i < thread_pool.num_slots; i++) {
+		if (fr_atomic_queue_push(thread_pool.slots[i], request)) return true;
+	}
+
+	return false;
+}
+
+/*
+ *	Take a request from our own queue.  If there isn't one, steal
+ *	one from the queue which has the most requests.
+ */
+static REQUEST *slot_pop(int own)
+{
+	int i, tries;
+	void *data = NULL;
+
+	if (fr_atomic_queue_pop(thread_pool.slots[own], &data)) return data;
+
+	/*
+	 *	The counts are approximate, and another thread may
+	 *	steal the request before we do.  So we re-scan a
+	 *	limited number of times.
+	 */
+	for (tries = 0; tries < thread_pool.num_slots; tries++) {
+		int busiest = -1;
+		size_t num, most = 0;
+
+		for (i = 0; i < thread_pool.num_slots; i++) {
+			if (i == own) continue;
+
+			num = fr_atomic_queue_num_elements(thread_pool.slots[i]);
+			if (num > most) {
+				most = num;
+				busiest = i;
+			}
+		}
+
+		if (busiest < 0) break;
+
+		if (fr_atomic_queue_pop(thread_pool.slots[busiest], &data)) return data;
+	}
+
+	/*
+	 *	A request may have been pushed to our own queue
+	 *	while we were looking elsewhere.
+	 */
+	if (fr_atomic_queue_pop(thread_pool.slots[own], &data)) return data;
+
+	return NULL;
+}
+
+/*
+ *	Send the request to the next thread, round-robin.  If that
+ *	thread's channel is full, try the others.  If they're all
+ *	full, the threads aren't keeping up, and the request is
+ *	dropped.
+ */
+static bool channel_push(REQUEST *request)
+{
+	int i, slot;
+	void *data = request;
+
+	for (i = 0; i < thread_pool.num_slots; i++) {
+		slot = (thread_pool.next_slot + i) % thread_pool.num_slots;
+		if (!thread_pool.slot_used[slot]) continue;
+
+		if (fr_thread_channel_send(thread_pool.channel[slot], FR_THREAD_CHANNEL_MASTER, &data, 1)) {
+			thread_pool.next_slot = slot + 1;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ *	Take a request from our own channel.
+ */
+static REQUEST *channel_pop(int own)
+{
+	void *data = NULL;
+
+	if (!fr_thread_channel_recv(thread_pool.channel[own], FR_THREAD_CHANNEL_WORKER, &data, 1)) return NULL;
+
+	return data;
+}
+
+/*
+ *	Wake up a thread, so that it sees it's been told to exit.
+ */
+static void thread_wake(THREAD_HANDLE *handle)
+{
+	if (thread_pool.channels) {
+		fr_thread_channel_signal(thread_pool.channel[handle->slot], FR_THREAD_CHANNEL_WORKER);
+		return;
+	}
+
+	sem_post(&thread_pool.semaphore);
+}
+#  else
+#    define thread_wake(_handle) sem_post(&thread_pool.semaphore)
+#  endif
+
+#  define TV_TO_USEC(_tv) (((uint64_t) (_tv)->tv_sec * USEC) + (_tv)->tv_usec)
+
+/*
+ *	Called by a thread for each request it takes from the queue.
+ *	Remember when the queue delay first went over the target, or
+ *	forget it if this request was under.
+ */
+static void queue_delay_update(REQUEST *request)
+{
+	uint64_t queued, dequeued;
+
+	if (!thread_pool.queue_delay_target && !thread_pool.spawn_delay_target) return;
+
+	queued = TV_TO_USEC(&request->times.queued);
+	dequeued = TV_TO_USEC(&request->times.dequeued);
+
+	thread_pool.last_delay = dequeued - queued;
+
+	if (!thread_pool.queue_delay_target) return;
+
+	thread_pool.last_dequeued = dequeued;
+
+	if ((dequeued - queued) < (thread_pool.queue_delay_target * (uint64_t) 1000)) {
+		thread_pool.delay_above = 0;
+		return;
+	}
+
+	/*
+	 *	Two threads may race here.  Either time is close
+	 *	enough.
+	 */
+	if (!thread_pool.delay_above) thread_pool.delay_above = dequeued;
+}
+
+/*
+ *	Decide whether or not the main thread should queue a request.
+ *
+ *	A long queue makes things worse.  By the time the request is
+ *	processed, the NAS has retransmitted it, or given up.  So when
+ *	requests have waited for longer than the target for a whole
+ *	interval, we shed accounting requests.  If that continues for
+ *	another interval, we also shed requests from clients marked
+ *	"low_priority".  Authentication requests from other clients
+ *	are only dropped when the queue is full.
+ *
+ *	Like CoDel, short bursts are let through, and shedding stops
+ *	as soon as one request is dequeued under the target.
+ */
+static bool queue_admit(REQUEST *request)
+{
+	uint64_t now, above, interval;
+	struct timeval tv;
+
+	if (!thread_pool.queue_delay_target) return true;
+
+	/*
+	 *	Replies from home servers and Status-Server are
+	 *	always cheap, and always wanted.
+	 */
+	if (request->proxy_reply || (request->packet->code == PW_CODE_STATUS_SERVER)) return true;
+
+	gettimeofday(&tv, NULL);
+	now = TV_TO_USEC(&tv);
+	interval = thread_pool.queue_delay_interval * (uint64_t) 1000;
+
+	above = thread_pool.delay_above;
+
+	/*
+	 *	If the threads are all stuck, nothing is dequeued, and
+	 *	delay_above is never set.  Use the age of the last
+	 *	dequeue instead.
+	 */
+	if (!above && (queue_num_elements() > 0)) {
+		uint64_t last = thread_pool.last_dequeued;
+		uint64_t target = thread_pool.queue_delay_target * (uint64_t) 1000;
+
+		if (last && ((now - last) > target)) above = last + target;
+	}
+
+	if (!above || (now < above + interval)) return true;
+
+	if (request->packet->code == PW_CODE_ACCOUNTING_REQUEST) {
+		thread_pool.shed[QUEUE_SHED_DELAY_ACCT]++;
+		return false;
+	}
+
+	if ((now >= above + (2 * interval)) && request->client && request->client->low_priority) {
+		thread_pool.shed[QUEUE_SHED_DELAY_CLIENT]++;
+		return false;
+	}
+
+	return true;
+}
+
 /*
  *	Add a request to the list of waiting requests.
  *	This function gets called ONLY from the main handler thread...
  *
  *	This function should never fail.
  */
+/*
+ *	Put a request into the queue of a named pool.
+ */
+static int isolated_enqueue(isolated_pool_t *pool, REQUEST *request)
+{
+	pthread_mutex_lock(&pool->mutex);
+	if (fr_heap_num_elements(pool->heap) >= pool->max_queue_size) {
+		pool->rejected++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		RATE_LIMIT(ERROR("Something is blocking thread pool %s.  There are %u packets in its queue, "
+				 "waiting to be processed.  Ignoring the new request.",
+				 pool->name, pool->max_queue_size));
+		return 0;
+	}
+
+	request->component = "<core>";
+	request->module = "<queue>";
+	request->child_state = REQUEST_QUEUED;
+
+	gettimeofday(&request->times.queued, NULL);
+	FR_PROBE2(request_enqueue, request->number, request->packet->code);
+
+	if (!fr_heap_insert(pool->heap, request)) {
+		pthread_mutex_unlock(&pool->mutex);
+		ERROR("!!! ERROR !!! Failed inserting request %d into the queue of thread pool %s",
+		      request->number, pool->name);
+		return 0;
+	}
+
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	return 1;
+}
+
+/*
+ *	The threads of a named pool.  There's a fixed number of them,
+ *	so there's none of the spawning and reaping of the main pool.
+ */
+static void *isolated_thread(void *arg)
+{
+	isolated_pool_t	*pool = arg;
+	REQUEST		*request;
+	struct timeval	start, end, wait, run;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->stop && (fr_heap_num_elements(pool->heap) == 0)) {
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		}
+		if (pool->stop) break;
+
+		request = fr_heap_peek(pool->heap);
+		(void) fr_heap_extract(pool->heap, request);
+
+		VERIFY_REQUEST(request);
+
+		/*
+		 *	Too late.  Mark it as done, and continue.
+		 */
+		if (request->master_state == REQUEST_STOP_PROCESSING) {
+			request->module = "<done>";
+			request->child_state = REQUEST_DONE;
+			continue;
+		}
+
+		request->component = "<core>";
+		request->module = "";
+		request->child_state = REQUEST_RUNNING;
+		request->child_pid = pthread_self();
+		gettimeofday(&start, NULL);
+		request->times.dequeued = start;
+		FR_PROBE2(request_dequeue, request->number, request->packet->code);
+
+		pool->active++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		request_stats_latency(FR_STATS_LATENCY_QUEUE, &request->times.queued, &request->times.dequeued);
+		fr_timeval_subtract(&wait, &request->times.dequeued, &request->times.queued);
+
+#  ifdef HAVE_OPENSSL_ERR_H
+		ERR_clear_error();
+#  endif
+
+		/*
+		 *	The request may be freed as soon as it's been
+		 *	processed, so don't touch it afterwards.
+		 */
+		request->process(request, FR_ACTION_RUN);
+
+		gettimeofday(&end, NULL);
+		fr_timeval_subtract(&run, &end, &start);
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->active--;
+		pool->completed++;
+		pool->wait_usec += (wait.tv_sec * (uint64_t)USEC) + wait.tv_usec;
+		pool->run_usec += (run.tv_sec * (uint64_t)USEC) + run.tv_usec;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+#  ifdef HAVE_OPENSSL_ERR_H
+	ERR_remove_state(0);
+#  endif
+
+	return NULL;
+}
+
+#  ifdef WITH_FIBERS
+/*
+ *	Wake one thread which is polling for requests.  It's taken off
+ *	the list, so the next request wakes a different one.  The
+ *	write is done with the mutex held, so the thread can't exit
+ *	and close the pipe underneath us.  A full pipe means it
+ *	already has a wakeup pending.
+ */
+static void fiber_kick(void)
+{
+	THREAD_HANDLE *handle;
+
+	pthread_mutex_lock(&thread_pool.fiber_mutex);
+	handle = thread_pool.fiber_polling;
+	if (handle) {
+		thread_pool.fiber_polling = handle->next_polling;
+		handle->next_polling = NULL;
+		handle->polling = false;
+
+		if ((write(handle->kick[1], "r", 1) < 0) && (errno != EAGAIN)) {
+			RATE_LIMIT(ERROR("Failed waking thread %d: %s", handle->thread_num, fr_syserror(errno)));
+		}
+	}
+	pthread_mutex_unlock(&thread_pool.fiber_mutex);
+}
+
+static void kick_close(THREAD_HANDLE *handle)
+{
+	if (handle->kick[0] >= 0) close(handle->kick[0]);
+	if (handle->kick[1] >= 0) close(handle->kick[1]);
+	handle->kick[0] = handle->kick[1] = -1;
+}
+
+/*
+ *	Add ourselves to, or remove ourselves from, the threads
+ *	which are polling for requests.
+ */
+static void fiber_polling(THREAD_HANDLE *self, bool polling)
+{
+	THREAD_HANDLE **last;
+
+	pthread_mutex_lock(&thread_pool.fiber_mutex);
+	if (polling && !self->polling) {
+		self->next_polling = thread_pool.fiber_polling;
+		thread_pool.fiber_polling = self;
+		self->polling = true;
+
+	} else if (!polling && self->polling) {
+		for (last = &thread_pool.fiber_polling; *last != self; last = &(*last)->next_polling) {
+			rad_assert(*last != NULL);
+		}
+		*last = self->next_polling;
+		self->next_polling = NULL;
+		self->polling = false;
+	}
+	pthread_mutex_unlock(&thread_pool.fiber_mutex);
+}
+#  endif
+
 int request_enqueue(REQUEST *request)
 {
+	if (request->listener && request->listener->thread_pool) {
+		return isolated_enqueue(request->listener->thread_pool, request);
+	}
+
 	/*
 	 *	If we haven't checked the number of child threads
 	 *	in a while, OR if the thread pool appears to be full,
@@ -275,8 +1269,11 @@ int request_enqueue(REQUEST *request)
 		thread_pool_manage(request->timestamp.tv_sec);
 	}
 
-
-	pthread_mutex_lock(&thread_pool.queue_mutex);
+	/*
+	 *	The lock-free queues don't need the mutex.  The
+	 *	statistics below are only updated by this thread.
+	 */
+	queue_lock();
 
 #  if defined(WITH_STATS) && defined(WITH_ACCOUNTING)
 	if (thread_pool.auto_limit_acct) {
@@ -313,7 +1310,7 @@ int request_enqueue(REQUEST *request)
 		 *	SOME of the new accounting packets.
 		 */
 		if ((request->packet->code == PW_CODE_ACCOUNTING_REQUEST) &&
-		    (fr_heap_num_elements(thread_pool.heap) > (thread_pool.max_queue_size / 2)) &&
+		    (queue_num_elements() > (thread_pool.max_queue_size / 2)) &&
 		    (thread_pool.pps_in.pps_now > thread_pool.pps_out.pps_now)) {
 			uint32_t prob;
 			uint32_t keep;
@@ -325,7 +1322,7 @@ int request_enqueue(REQUEST *request)
 			 *	anything more than that.
 			 */
 			keep = (thread_pool.max_queue_size / 2);
-			prob = fr_rand() & ((1 << 10) - 1);
+			prob = fr_fast_rand() & ((1 << 10) - 1);
 			keep *= prob;
 			keep >>= 10;
 			keep += (thread_pool.max_queue_size / 2);
@@ -334,8 +1331,9 @@ int request_enqueue(REQUEST *request)
 			 *	If the queue is larger than our dice
 			 *	roll, we throw the packet away.
 			 */
-			if (fr_heap_num_elements(thread_pool.heap) > keep) {
-				pthread_mutex_unlock(&thread_pool.queue_mutex);
+			if (queue_num_elements() > keep) {
+				thread_pool.shed[QUEUE_SHED_ACCT_LIMIT]++;
+				queue_unlock();
 				return 0;
 			}
 		}
@@ -357,20 +1355,78 @@ int request_enqueue(REQUEST *request)
 
 	thread_pool.request_count++;
 
-	if (fr_heap_num_elements(thread_pool.heap) >= thread_pool.max_queue_size) {
-		pthread_mutex_unlock(&thread_pool.queue_mutex);
+	if (!queue_admit(request)) {
+		queue_unlock();
+		RATE_LIMIT(WARN("Requests are waiting in the queue for more than %ums.  Shedding load.",
+				thread_pool.queue_delay_target));
+		return 0;
+	}
+
+	if (queue_num_elements() >= thread_pool.max_queue_size) {
+		thread_pool.shed[QUEUE_SHED_FULL]++;
+		queue_unlock();
 
 		/*
 		 *	Mark the request as done.
 		 */
 		RATE_LIMIT(ERROR("Something is blocking the server.  There are %zd packets in the queue, "
-				 "waiting to be processed.  Ignoring the new request.", fr_heap_num_elements(thread_pool.heap)));
+				 "waiting to be processed.  Ignoring the new request.", queue_num_elements()));
 		return 0;
 	}
 	request->component = "<core>";
 	request->module = "<queue>";
 	request->child_state = REQUEST_QUEUED;
 
+	/*
+	 *	Before the push, as the request belongs to another
+	 *	thread as soon as it's in the queue.
+	 */
+	gettimeofday(&request->times.queued, NULL);
+	FR_PROBE2(request_enqueue, request->number, request->packet->code);
+
+#  ifdef HAVE_STDATOMIC_H
+	/*
+	 *	Send the request to one of the threads.
+	 */
+	if (thread_pool.channels) {
+		if (!channel_push(request)) {
+			RATE_LIMIT(ERROR("All of the threads are busy.  Ignoring the new request."));
+			return 0;
+		}
+	} else
+	/*
+	 *	Push the request onto one of the thread queues.
+	 */
+	if (thread_pool.stealing) {
+		if (!slot_push(request)) {
+			ERROR("!!! ERROR !!! Failed inserting request %d into the queue", request->number);
+			return 0;
+		}
+	} else
+	/*
+	 *	Push the request onto the end of its lane.
+	 */
+	if (thread_pool.lockfree) {
+		int lane = 0;
+
+		if (thread_pool.num_lanes > 1) lane = request->priority;
+
+		if (!fr_atomic_queue_push(thread_pool.lanes[lane], request)) {
+			ERROR("!!! ERROR !!! Failed inserting request %d into the queue", request->number);
+			return 0;
+		}
+	} else
+#  endif
+	/*
+	 *	Push the request onto its client's heap.
+	 */
+	if (thread_pool.fair) {
+		if (!fair_push(request)) {
+			queue_unlock();
+			ERROR("!!! ERROR !!! Failed inserting request %d into the queue", request->number);
+			return 0;
+		}
+	} else
 	/*
 	 *	Push the request onto the incoming heap
 	 */
@@ -380,7 +1436,15 @@ int request_enqueue(REQUEST *request)
 		return 0;
 	}
 
-	pthread_mutex_unlock(&thread_pool.queue_mutex);
+	queue_unlock();
+
+#  ifdef HAVE_STDATOMIC_H
+	/*
+	 *	The channel has already woken the thread up, if it
+	 *	was asleep.
+	 */
+	if (thread_pool.channels) return 1;
+#  endif
 
 	/*
 	 *	There's one more request in the queue.
@@ -393,27 +1457,44 @@ int request_enqueue(REQUEST *request)
 	 */
 	sem_post(&thread_pool.semaphore);
 
+#  ifdef WITH_FIBERS
+	/*
+	 *	Threads running fibers may be polling instead of
+	 *	waiting on the semaphore.
+	 */
+	if (thread_pool.fibers > 1) fiber_kick();
+#  endif
+
 	return 1;
 }
 
 /*
  *	Remove a request from the queue.
  */
-static int request_dequeue(REQUEST **prequest)
+static int request_dequeue(THREAD_HANDLE *self, REQUEST **prequest)
 {
 	time_t blocked;
 	static time_t last_complained = 0;
 	static time_t total_blocked = 0;
 	int num_blocked = 0;
 	REQUEST *request = NULL;
+	bool active = (self->request != NULL);	/* only with fibers */
 	reap_children();
 
-	pthread_mutex_lock(&thread_pool.queue_mutex);
+	queue_lock();
 
 #  if defined(WITH_STATS) && defined(WITH_ACCOUNTING)
 	if (thread_pool.auto_limit_acct) {
 		struct timeval now;
 
+		/*
+		 *	Many threads update the departure rate, so the
+		 *	lock-free queues still need the mutex here.
+		 */
+#    ifdef HAVE_STDATOMIC_H
+		if (thread_pool.lockfree) pthread_mutex_lock(&thread_pool.queue_mutex);
+#    endif
+
 		gettimeofday(&now, NULL);
 
 		/*
@@ -425,21 +1506,77 @@ static int request_dequeue(REQUEST **prequest)
 						   &thread_pool.pps_out.time_old,
 						   &now);
 		thread_pool.pps_out.pps_now++;
+
+#    ifdef HAVE_STDATOMIC_H
+		if (thread_pool.lockfree) pthread_mutex_unlock(&thread_pool.queue_mutex);
+#    endif
 	}
 #  endif
 
 retry:
+#  ifdef HAVE_STDATOMIC_H
 	/*
-	 *	Grab the first entry.
+	 *	Grab the next request sent to us.
 	 */
-	request = fr_heap_peek(thread_pool.heap);
-	if (!request) {
-		pthread_mutex_unlock(&thread_pool.queue_mutex);
-		*prequest = NULL;
-		return 0;
-	}
+	if (thread_pool.channels) {
+		request = channel_pop(self->slot);
+		if (!request) {
+			*prequest = NULL;
+			return 0;
+		}
+	} else
+	/*
+	 *	Grab the first entry from our own queue, or steal one.
+	 */
+	if (thread_pool.stealing) {
+		request = slot_pop(self->slot);
+		if (!request) {
+			*prequest = NULL;
+			return 0;
+		}
+	} else
+	/*
+	 *	Grab the first entry from the highest priority lane
+	 *	which has one.
+	 */
+	if (thread_pool.lockfree) {
+		int i;
+		void *data = NULL;
+
+		for (i = 0; i < thread_pool.num_lanes; i++) {
+			if (fr_atomic_queue_pop(thread_pool.lanes[i], &data)) break;
+		}
+
+		request = data;
+		if (!request) {
+			*prequest = NULL;
+			return 0;
+		}
+	} else
+#  endif
+	/*
+	 *	Grab the first entry from the client whose turn it is.
+	 */
+	if (thread_pool.fair) {
+		request = fair_pop();
+		if (!request) {
+			pthread_mutex_unlock(&thread_pool.queue_mutex);
+			*prequest = NULL;
+			return 0;
+		}
+	} else {
+		/*
+		 *	Grab the first entry.
+		 */
+		request = fr_heap_peek(thread_pool.heap);
+		if (!request) {
+			pthread_mutex_unlock(&thread_pool.queue_mutex);
+			*prequest = NULL;
+			return 0;
+		}
 
-	(void) fr_heap_extract(thread_pool.heap, request);
+		(void) fr_heap_extract(thread_pool.heap, request);
+	}
 
 	VERIFY_REQUEST(request);
 
@@ -463,10 +1600,14 @@ retry:
 	request->module = "";
 	request->child_state = REQUEST_RUNNING;
 
+	FR_PROBE2(request_dequeue, request->number, request->packet->code);
+
 	/*
-	 *	The thread is currently processing a request.
+	 *	The thread is currently processing a request.  A
+	 *	thread running fibers is only counted once, however
+	 *	many requests it has.
 	 */
-	thread_pool.active_threads++;
+	if (!active) thread_pool.active_threads++;
 
 	blocked = time(NULL);
 	if (!request->proxy && (blocked - request->timestamp.tv_sec) > 5) {
@@ -483,7 +1624,12 @@ retry:
 		blocked = 0;
 	}
 
-	pthread_mutex_unlock(&thread_pool.queue_mutex);
+	gettimeofday(&request->times.dequeued, NULL);
+	queue_delay_update(request);
+
+	queue_unlock();
+
+	request_stats_latency(FR_STATS_LATENCY_QUEUE, &request->times.queued, &request->times.dequeued);
 
 	if (blocked) {
 		ERROR("%d requests have been waiting in the processing queue for %d seconds.  Check that all databases are running properly!",
@@ -494,6 +1640,203 @@ retry:
 }
 
 
+/*
+ *	Called by a thread for each request it takes from the queue,
+ *	just before processing it.
+ */
+static void request_prepare(THREAD_HANDLE *self, REQUEST *request)
+{
+	request->child_pid = self->pthread_id;
+	self->request_count++;
+
+	DEBUG2("Thread %d handling request %d, (%d handled so far)",
+	       self->thread_num, request->number,
+	       self->request_count);
+
+#  ifdef WITH_ACCOUNTING
+	if ((request->packet->code == PW_CODE_ACCOUNTING_REQUEST) &&
+	    thread_pool.auto_limit_acct) {
+		VALUE_PAIR *vp;
+
+		vp = radius_pair_create(request, &request->config,
+				       181, VENDORPEC_FREERADIUS);
+		if (vp) vp->vp_integer = thread_pool.pps_in.pps;
+
+		vp = radius_pair_create(request, &request->config,
+				       182, VENDORPEC_FREERADIUS);
+		if (vp) vp->vp_integer = thread_pool.pps_in.pps;
+
+		vp = radius_pair_create(request, &request->config,
+				       183, VENDORPEC_FREERADIUS);
+		if (vp) {
+			vp->vp_integer = thread_pool.max_queue_size - queue_num_elements();
+			vp->vp_integer *= 100;
+			vp->vp_integer /= thread_pool.max_queue_size;
+		}
+	}
+#  endif
+}
+
+#  ifdef WITH_FIBERS
+static void _request_fiber(void *uctx)
+{
+	REQUEST *request = uctx;
+
+	request->process(request, FR_ACTION_RUN);
+}
+
+/*
+ *	Once all of its fibers have finished, the thread is idle.
+ */
+static void request_fibers_idle(THREAD_HANDLE *self)
+{
+	if (!self->request || fr_fiber_sched_num(self->fibers)) return;
+
+	self->request = NULL;
+
+	queue_lock();
+	rad_assert(thread_pool.active_threads > 0);
+	thread_pool.active_threads--;
+	queue_unlock();
+}
+
+/*
+ *	Take a request from the queue, and start a fiber for it.
+ */
+static void request_fiber_start(THREAD_HANDLE *self, bool *draining)
+{
+	REQUEST *request;
+
+#    ifdef HAVE_OPENSSL_ERR_H
+	ERR_clear_error();
+#    endif
+
+	if (thread_pool.stop_flag) {
+		*draining = true;
+		return;
+	}
+
+	if (!request_dequeue(self, &request)) return;
+
+	self->request = request;
+	request_prepare(self, request);
+
+	if (fr_fiber_start(self->fibers, _request_fiber, request) < 0) {
+		ERROR("Thread %d failed starting fiber: %s.  Processing request %d without one",
+		      self->thread_num, fr_strerror(), request->number);
+		request->process(request, FR_ACTION_RUN);
+		request_fibers_idle(self);
+	}
+
+	if ((self->status == THREAD_CANCELLED) ||
+	    ((thread_pool.max_requests_per_thread > 0) &&
+	     (self->request_count >= thread_pool.max_requests_per_thread))) *draining = true;
+}
+
+/*
+ *	The thread handler when "fibers" is set.
+ *
+ *	With no requests running, wait on the semaphore as usual.
+ *	Otherwise run the fibers, and take more requests whenever
+ *	they're all waiting for I/O and there's room.  When told to
+ *	exit, finish the requests which are running first.
+ */
+static void request_handler_fibers(THREAD_HANDLE *self)
+{
+	bool	draining = false;
+	uint8_t	buff[64];
+
+	self->fibers = fr_fiber_sched_alloc(NULL, thread_pool.fibers, thread_pool.fiber_stack_size);
+	if (!self->fibers) {
+		ERROR("Thread %d failed allocating fibers: %s: Exiting", self->thread_num, fr_strerror());
+		return;
+	}
+
+	while (true) {
+		int fd = -1, rcode;
+
+#    ifdef HAVE_GPERFTOOLS_PROFILER_H
+		ProfilerRegisterThread();
+#    endif
+
+		if (!fr_fiber_sched_num(self->fibers)) {
+			if (draining || (self->status == THREAD_CANCELLED)) break;
+
+			DEBUG2("Thread %d waiting to be assigned a request",
+			       self->thread_num);
+			if (sem_wait(&thread_pool.semaphore) != 0) {
+				if (errno == EINTR) continue;
+
+				ERROR("Thread %d failed waiting for semaphore: %s: Exiting\n",
+				      self->thread_num, fr_syserror(errno));
+				break;
+			}
+
+			DEBUG2("Thread %d got semaphore", self->thread_num);
+
+			request_fiber_start(self, &draining);
+			if (!fr_fiber_sched_num(self->fibers)) continue;
+		}
+
+		/*
+		 *	Go on the list before checking the semaphore,
+		 *	so that a request queued after the check kicks
+		 *	us.  Then take as many requests as we have room
+		 *	for.
+		 */
+		if (!draining && (fr_fiber_sched_num(self->fibers) < thread_pool.fibers)) {
+			bool more = true;
+
+			fiber_polling(self, true);
+
+			while (!draining && (fr_fiber_sched_num(self->fibers) < thread_pool.fibers)) {
+				if (sem_trywait(&thread_pool.semaphore) != 0) {
+					more = false;
+					break;
+				}
+				request_fiber_start(self, &draining);
+			}
+
+			if (!draining && (fr_fiber_sched_num(self->fibers) < thread_pool.fibers)) {
+				fd = self->kick[0];
+			} else {
+				fiber_polling(self, false);
+
+				/*
+				 *	We may have used up a kick which
+				 *	was for more requests than we had
+				 *	room for.  Pass it on.
+				 */
+				if (more) fiber_kick();
+			}
+		}
+
+		rcode = fr_fiber_sched_run(self->fibers, fd, -1);
+		if (rcode < 0) ERROR("Thread %d failed running fibers: %s", self->thread_num, fr_strerror());
+
+		/*
+		 *	With no fibers left, we go back to the
+		 *	semaphore.
+		 */
+		if (!fr_fiber_sched_num(self->fibers)) fiber_polling(self, false);
+
+		request_fibers_idle(self);
+
+		/*
+		 *	We were kicked.  The requests are taken on the
+		 *	next time around the loop.
+		 */
+		if (rcode > 0) while (read(fd, buff, sizeof(buff)) > 0);
+	}
+
+	fiber_polling(self, false);
+
+	rad_assert(self->request == NULL);
+
+	TALLOC_FREE(self->fibers);
+}
+#  endif
+
 /*
  *	The main thread handler for requests.
  *
@@ -503,6 +1846,13 @@ static void *request_handler_thread(void *arg)
 {
 	THREAD_HANDLE *self = (THREAD_HANDLE *) arg;
 
+#  ifdef WITH_FIBERS
+	if (thread_pool.fibers > 1) {
+		request_handler_fibers(self);
+		goto done;
+	}
+#  endif
+
 	/*
 	 *	Loop forever, until told to exit.
 	 */
@@ -517,6 +1867,22 @@ static void *request_handler_thread(void *arg)
 		DEBUG2("Thread %d waiting to be assigned a request",
 		       self->thread_num);
 	re_wait:
+#  ifdef HAVE_STDATOMIC_H
+		/*
+		 *	Only sleep if there's nothing in our channel.
+		 */
+		if (thread_pool.channels) {
+			if (fr_thread_channel_wait(thread_pool.channel[self->slot], FR_THREAD_CHANNEL_WORKER) < 0) {
+				if (errno == EINTR) {
+					DEBUG2("Re-wait %d", self->thread_num);
+					goto re_wait;
+				}
+				ERROR("Thread %d failed waiting for requests: %s: Exiting\n",
+				      self->thread_num, fr_strerror());
+				break;
+			}
+		} else
+#  endif
 		if (sem_wait(&thread_pool.semaphore) != 0) {
 			/*
 			 *	Interrupted system call.  Go back to
@@ -553,38 +1919,9 @@ static void *request_handler_thread(void *arg)
 		 *	It may be empty, in which case we fail
 		 *	gracefully.
 		 */
-		if (!request_dequeue(&self->request)) continue;
-
-		self->request->child_pid = self->pthread_id;
-		self->request_count++;
+		if (!request_dequeue(self, &self->request)) continue;
 
-		DEBUG2("Thread %d handling request %d, (%d handled so far)",
-		       self->thread_num, self->request->number,
-		       self->request_count);
-
-#  ifdef WITH_ACCOUNTING
-		if ((self->request->packet->code == PW_CODE_ACCOUNTING_REQUEST) &&
-		    thread_pool.auto_limit_acct) {
-			VALUE_PAIR *vp;
-			REQUEST *request = self->request;
-
-			vp = radius_pair_create(request, &request->config,
-					       181, VENDORPEC_FREERADIUS);
-			if (vp) vp->vp_integer = thread_pool.pps_in.pps;
-
-			vp = radius_pair_create(request, &request->config,
-					       182, VENDORPEC_FREERADIUS);
-			if (vp) vp->vp_integer = thread_pool.pps_in.pps;
-
-			vp = radius_pair_create(request, &request->config,
-					       183, VENDORPEC_FREERADIUS);
-			if (vp) {
-				vp->vp_integer = thread_pool.max_queue_size - fr_heap_num_elements(thread_pool.heap);
-				vp->vp_integer *= 100;
-				vp->vp_integer /= thread_pool.max_queue_size;
-			}
-		}
-#  endif
+		request_prepare(self, self->request);
 
 		self->request->process(self->request, FR_ACTION_RUN);
 		self->request = NULL;
@@ -592,10 +1929,10 @@ static void *request_handler_thread(void *arg)
 		/*
 		 *	Update the active threads.
 		 */
-		pthread_mutex_lock(&thread_pool.queue_mutex);
+		queue_lock();
 		rad_assert(thread_pool.active_threads > 0);
 		thread_pool.active_threads--;
-		pthread_mutex_unlock(&thread_pool.queue_mutex);
+		queue_unlock();
 
 		/*
 		 *	If the thread has handled too many requests, then make it
@@ -609,6 +1946,9 @@ static void *request_handler_thread(void *arg)
 		}
 	} while (self->status != THREAD_CANCELLED);
 
+#  ifdef WITH_FIBERS
+done:
+#  endif
 	DEBUG2("Thread %d exiting...", self->thread_num);
 
 #  ifdef HAVE_OPENSSL_ERR_H
@@ -655,6 +1995,34 @@ static void delete_thread(THREAD_HANDLE *handle)
 	rad_assert(thread_pool.total_threads > 0);
 	thread_pool.total_threads--;
 
+#  ifdef HAVE_STDATOMIC_H
+	/*
+	 *	Any requests left in the thread's queue will be
+	 *	stolen by the other threads.
+	 */
+	if (thread_pool.stealing) thread_pool.slot_used[handle->slot] = false;
+
+	/*
+	 *	The thread has exited, so we can take the requests it
+	 *	didn't get to, and give them to the other threads.
+	 *	If they're all busy, the requests are left for the
+	 *	next thread which uses this slot.
+	 */
+	if (thread_pool.channels) {
+		void *data;
+		fr_thread_channel_t *ch = thread_pool.channel[handle->slot];
+
+		thread_pool.slot_used[handle->slot] = false;
+
+		while (!thread_pool.stop_flag && fr_thread_channel_recv(ch, FR_THREAD_CHANNEL_WORKER, &data, 1)) {
+			if (channel_push(data)) continue;
+
+			(void) fr_thread_channel_send(ch, FR_THREAD_CHANNEL_MASTER, &data, 1);
+			break;
+		}
+	}
+#  endif
+
 	/*
 	 *	Remove the handle from the list.
 	 */
@@ -672,6 +2040,10 @@ static void delete_thread(THREAD_HANDLE *handle)
 		next->prev = prev;
 	}
 
+#  ifdef WITH_FIBERS
+	kick_close(handle);
+#  endif
+
 	/*
 	 *	Free the handle, now that it's no longer referencable.
 	 */
@@ -710,6 +2082,38 @@ static THREAD_HANDLE *spawn_thread(time_t now, int do_trigger)
 	handle->status = THREAD_RUNNING;
 	handle->timestamp = time(NULL);
 
+#  ifdef WITH_FIBERS
+	/*
+	 *	So that fiber_kick() can wake the thread when it's
+	 *	polling for requests.
+	 */
+	handle->kick[0] = handle->kick[1] = -1;
+	if ((thread_pool.fibers > 1) &&
+	    ((pipe(handle->kick) < 0) || (fr_nonblock(handle->kick[0]) < 0) || (fr_nonblock(handle->kick[1]) < 0))) {
+		ERROR("Thread create failed: Failed creating pipe: %s", fr_syserror(errno));
+		kick_close(handle);
+		free(handle);
+		return NULL;
+	}
+#  endif
+
+#  ifdef HAVE_STDATOMIC_H
+	/*
+	 *	There are max_threads slots, so there's always a free one.
+	 */
+	if (thread_pool.stealing || thread_pool.channels) {
+		int i;
+
+		for (i = 0; i < thread_pool.num_slots; i++) {
+			if (!thread_pool.slot_used[i]) break;
+		}
+		rad_assert(i < thread_pool.num_slots);
+
+		handle->slot = i;
+		thread_pool.slot_used[i] = true;
+	}
+#  endif
+
 	/*
 	 *	Create the thread joinable, so that it can be cleaned up
 	 *	using pthread_join().
@@ -719,6 +2123,12 @@ static THREAD_HANDLE *spawn_thread(time_t now, int do_trigger)
 	 */
 	rcode = pthread_create(&handle->pthread_id, 0, request_handler_thread, handle);
 	if (rcode != 0) {
+#  ifdef HAVE_STDATOMIC_H
+		if (thread_pool.stealing || thread_pool.channels) thread_pool.slot_used[handle->slot] = false;
+#  endif
+#  ifdef WITH_FIBERS
+		kick_close(handle);
+#  endif
 		free(handle);
 		ERROR("Thread create failed: %s",
 		       fr_syserror(rcode));
@@ -777,58 +2187,287 @@ static int pid_cmp(void const *one, void const *two)
 	thread_fork_t const *a = one;
 	thread_fork_t const *b = two;
 
-	return (a->pid - b->pid);
+	return (a->pid - b->pid);
+}
+#endif
+
+static int timestamp_cmp(void const *one, void const *two)
+{
+	REQUEST const *a = one;
+	REQUEST const *b = two;
+
+	if (timercmp(&a->timestamp, &b->timestamp, < )) return -1;
+	if (timercmp(&a->timestamp, &b->timestamp, > )) return +1;
+
+	return 0;
+}
+
+/*
+ *	Smaller entries go to the top of the heap.
+ *	Larger ones to the bottom of the heap.
+ */
+static int default_cmp(void const *one, void const *two)
+{
+	REQUEST const *a = one;
+	REQUEST const *b = two;
+
+	if (a->priority < b->priority) return -1;
+	if (a->priority > b->priority) return +1;
+
+	return timestamp_cmp(one, two);
+}
+
+
+/*
+ *	Prioritize by how far along the EAP session is.
+ */
+static int state_cmp(void const *one, void const *two)
+{
+	REQUEST const *a = one;
+	REQUEST const *b = two;
+
+	/*
+	 *	Rounds which are further along go higher in the heap.
+	 */
+	if (a->packet->rounds > b->packet->rounds) return -1;
+	if (a->packet->rounds < b->packet->rounds) return +1;
+
+	return default_cmp(one, two);
+}
+
+
+/** Parse the configuration for the thread pool
+ *
+ */
+#ifndef WITH_GCD
+static void *offload_thread(void *arg)
+{
+	offload_pool_t	*pool = arg;
+	offload_job_t	*job;
+	struct timeval	start, end, wait, run;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->head && !pool->stop) pthread_cond_wait(&pool->cond, &pool->mutex);
+
+		/*
+		 *	Only exit once the queue has been drained, so
+		 *	no worker is left waiting.
+		 */
+		job = pool->head;
+		if (!job) break;
+
+		pool->head = job->next;
+		if (!pool->head) pool->tail = NULL;
+		pool->num_queued--;
+		pthread_mutex_unlock(&pool->mutex);
+
+		gettimeofday(&start, NULL);
+		job->rcode = job->func(job->uctx);
+		gettimeofday(&end, NULL);
+
+		fr_timeval_subtract(&wait, &start, &job->queued);
+		fr_timeval_subtract(&run, &end, &start);
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->completed++;
+		pool->wait_usec += (wait.tv_sec * (uint64_t)USEC) + wait.tv_usec;
+		pool->run_usec += (run.tv_sec * (uint64_t)USEC) + run.tv_usec;
+
+		job->done = true;
+		pthread_cond_signal(&job->cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+/** Start the offload threads, if any were configured
+ *
+ */
+static int offload_init(offload_pool_t *pool)
+{
+	uint32_t	i;
+	int		rcode;
+
+	if (!pool->num_threads) return 0;
+
+	if ((pthread_mutex_init(&pool->mutex, NULL) != 0) || (pthread_cond_init(&pool->cond, NULL) != 0)) {
+		ERROR("FATAL: Failed to initialize offload queue: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	pool->threads = talloc_zero_array(NULL, pthread_t, pool->num_threads);
+	if (!pool->threads) {
+		ERROR("FATAL: Failed to allocate offload threads");
+		return -1;
+	}
+
+	for (i = 0; i < pool->num_threads; i++) {
+		rcode = pthread_create(&pool->threads[i], NULL, offload_thread, pool);
+		if (rcode != 0) {
+			ERROR("FATAL: Failed to create offload thread: %s", fr_syserror(rcode));
+			pool->num_threads = i;
+			offload_stop(pool);
+			return -1;
+		}
+	}
+
+	DEBUG2("Offload pool initialized with %u threads", pool->num_threads);
+
+	return 0;
+}
+
+/** Stop the offload threads, after they've finished any queued jobs
+ *
+ */
+static void offload_stop(offload_pool_t *pool)
+{
+	uint32_t i;
+
+	if (!pool->threads) return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_threads; i++) pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+	TALLOC_FREE(pool->threads);
+}
+
+/** Start the threads of a named pool
+ *
+ */
+static int isolated_init(isolated_pool_t *pool)
+{
+	uint32_t	i;
+	int		rcode;
+
+	if ((pthread_mutex_init(&pool->mutex, NULL) != 0) || (pthread_cond_init(&pool->cond, NULL) != 0)) {
+		ERROR("FATAL: Failed to initialize queue of thread pool %s: %s", pool->name, fr_syserror(errno));
+		return -1;
+	}
+
+	pool->heap = fr_heap_create(pool->heap_cmp, offsetof(REQUEST, heap_id));
+	if (!pool->heap) {
+		ERROR("FATAL: Failed to initialize queue of thread pool %s", pool->name);
+		return -1;
+	}
+
+	pool->threads = talloc_zero_array(pool, pthread_t, pool->num_threads);
+	if (!pool->threads) {
+		ERROR("FATAL: Failed to allocate threads of thread pool %s", pool->name);
+		return -1;
+	}
+
+	for (i = 0; i < pool->num_threads; i++) {
+		rcode = pthread_create(&pool->threads[i], NULL, isolated_thread, pool);
+		if (rcode != 0) {
+			ERROR("FATAL: Failed to create thread for thread pool %s: %s", pool->name, fr_syserror(rcode));
+			pool->num_threads = i;
+			isolated_stop(pool);
+			return -1;
+		}
+	}
+
+	DEBUG2("Thread pool %s initialized with %u threads", pool->name, pool->num_threads);
+
+	return 0;
 }
-#endif
 
-static int timestamp_cmp(void const *one, void const *two)
+/** Stop the threads of a named pool
+ *
+ * Requests left in the queue are not processed.  The main loop
+ * has already stopped, so no one is waiting for them.
+ */
+static void isolated_stop(isolated_pool_t *pool)
 {
-	REQUEST const *a = one;
-	REQUEST const *b = two;
+	uint32_t i;
 
-	if (timercmp(&a->timestamp, &b->timestamp, < )) return -1;
-	if (timercmp(&a->timestamp, &b->timestamp, > )) return +1;
+	if (!pool->threads) return;
 
-	return 0;
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_threads; i++) pthread_join(pool->threads[i], NULL);
+
+	fr_heap_delete(pool->heap);
+	pool->heap = NULL;
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+	TALLOC_FREE(pool->threads);
 }
+#endif	/* WITH_GCD */
 
+#ifndef WITH_GCD
 /*
- *	Smaller entries go to the top of the heap.
- *	Larger ones to the bottom of the heap.
+ *	Map a queue_priority to the function which orders the queue.
  */
-static int default_cmp(void const *one, void const *two)
+static fr_heap_cmp_t queue_priority_cmp(char const *name)
 {
-	REQUEST const *a = one;
-	REQUEST const *b = two;
+	if (!name || (strcmp(name, "default") == 0)) return default_cmp;
 
-	if (a->priority < b->priority) return -1;
-	if (a->priority > b->priority) return +1;
+	if (strcmp(name, "eap") == 0) return state_cmp;
 
-	return timestamp_cmp(one, two);
-}
+	if (strcmp(name, "time") == 0) return timestamp_cmp;
 
+	return NULL;
+}
 
 /*
- *	Prioritize by how far along the EAP session is.
+ *	Parse the "pool <name> { ... }" subsections.
  */
-static int state_cmp(void const *one, void const *two)
+static int isolated_bootstrap(CONF_SECTION *pool_cf)
 {
-	REQUEST const *a = one;
-	REQUEST const *b = two;
+	CONF_SECTION	*subcs;
+	isolated_pool_t	*pool, **last = &thread_pool.isolated;
 
-	/*
-	 *	Rounds which are further along go higher in the heap.
-	 */
-	if (a->packet->rounds > b->packet->rounds) return -1;
-	if (a->packet->rounds < b->packet->rounds) return +1;
+	for (subcs = cf_subsection_find_next(pool_cf, NULL, "pool");
+	     subcs != NULL;
+	     subcs = cf_subsection_find_next(pool_cf, subcs, "pool")) {
+		char const *name = cf_section_name2(subcs);
 
-	return default_cmp(one, two);
-}
+		if (!name) {
+			cf_log_err_cs(subcs, "Thread pools must have a name");
+			return -1;
+		}
 
+		if (thread_pool_find(name)) {
+			cf_log_err_cs(subcs, "Duplicate thread pool %s", name);
+			return -1;
+		}
+
+		pool = talloc_zero(NULL, isolated_pool_t);
+		if (!pool) return -1;
+
+		pool->name = talloc_typed_strdup(pool, name);
+		*last = pool;
+		last = &pool->next;
+
+		if (cf_section_parse(subcs, pool, isolated_config) < 0) return -1;
+
+		FR_INTEGER_BOUND_CHECK("num_threads", pool->num_threads, >=, 1);
+		FR_INTEGER_BOUND_CHECK("num_threads", pool->num_threads, <=, 1024);
+		FR_INTEGER_BOUND_CHECK("max_queue_size", pool->max_queue_size, >=, 2);
+		FR_INTEGER_BOUND_CHECK("max_queue_size", pool->max_queue_size, <=, 1024 * 1024);
+
+		pool->heap_cmp = queue_priority_cmp(pool->queue_priority);
+		if (!pool->heap_cmp) {
+			cf_log_err_cs(subcs, "Invalid queue_priority '%s'", pool->queue_priority);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+#endif	/* WITH_GCD */
 
-/** Parse the configuration for the thread pool
- *
- */
 int thread_pool_bootstrap(CONF_SECTION *cs, bool *spawn_workers)
 {
 	CONF_SECTION	*pool_cf;
@@ -847,6 +2486,7 @@ int thread_pool_bootstrap(CONF_SECTION *cs, bool *spawn_workers)
 	thread_pool.max_thread_num = 1;
 	thread_pool.cleanup_delay = 5;
 	thread_pool.stop_flag = false;
+	thread_pool.numa_node = -1;
 #endif
 	thread_pool.spawn_workers = *spawn_workers;
 
@@ -878,6 +2518,26 @@ int thread_pool_bootstrap(CONF_SECTION *cs, bool *spawn_workers)
 		ERROR("FATAL: max_queue_size value must be in range 2-1048576");
 		return -1;
 	}
+	if (thread_pool.queue_delay_target) {
+		FR_INTEGER_BOUND_CHECK("queue_delay_interval", thread_pool.queue_delay_interval, >=, 10);
+		FR_INTEGER_BOUND_CHECK("queue_delay_interval", thread_pool.queue_delay_interval, <=, 10000);
+	}
+	if (thread_pool.spawn_delay_target) {
+		FR_INTEGER_BOUND_CHECK("spawn_delay_target", thread_pool.spawn_delay_target, <=, 10000);
+	}
+
+	if (thread_pool.cpu_affinity || (thread_pool.numa_node >= 0)) {
+#  ifdef WITH_THREAD_AFFINITY
+		if (thread_affinity_check(thread_pool.cpu_affinity, thread_pool.numa_node) < 0) {
+			ERROR("FATAL: Invalid cpu_affinity or numa_node: %s", fr_strerror());
+			return -1;
+		}
+#  else
+		WARN("Setting 'cpu_affinity' and 'numa_node' is not supported on this system.  Ignoring them");
+		thread_pool.cpu_affinity = NULL;
+		thread_pool.numa_node = -1;
+#  endif
+	}
 
 	if (thread_pool.start_threads > thread_pool.max_threads) {
 		ERROR("FATAL: start_servers (%i) must be <= max_servers (%i)",
@@ -885,21 +2545,88 @@ int thread_pool_bootstrap(CONF_SECTION *cs, bool *spawn_workers)
 		return -1;
 	}
 
-	if (!thread_pool.queue_priority ||
-	    (strcmp(thread_pool.queue_priority, "default") == 0)) {
-		thread_pool.heap_cmp = default_cmp;
+	thread_pool.heap_cmp = queue_priority_cmp(thread_pool.queue_priority);
+	if (!thread_pool.heap_cmp) {
+		ERROR("FATAL: Invalid queue_priority '%s'", thread_pool.queue_priority);
+		return -1;
+	}
 
-	} else if (strcmp(thread_pool.queue_priority, "eap") == 0) {
-		thread_pool.heap_cmp = state_cmp;
+	if ((strcmp(thread_pool.queue_type, "lockfree") == 0) ||
+	    (strcmp(thread_pool.queue_type, "stealing") == 0) ||
+	    (strcmp(thread_pool.queue_type, "channel") == 0)) {
+#  ifdef HAVE_STDATOMIC_H
+		/*
+		 *	The lanes are FIFOs, so they can only order
+		 *	requests by priority, and then by time.
+		 */
+		if (thread_pool.heap_cmp == state_cmp) {
+			ERROR("FATAL: queue_priority 'eap' cannot be used with queue_type '%s'",
+			      thread_pool.queue_type);
+			return -1;
+		}
 
-	} else if (strcmp(thread_pool.queue_priority, "time") == 0) {
-		thread_pool.heap_cmp = timestamp_cmp;
+		thread_pool.lockfree = true;
 
-	} else {
-		ERROR("FATAL: Invalid queue_priority '%s'", thread_pool.queue_priority);
+		/*
+		 *	Each thread queue is a FIFO, so requests are
+		 *	processed in (approximately) the order they
+		 *	arrived.
+		 */
+		if (thread_pool.queue_type[0] == 's') {
+			thread_pool.stealing = true;
+			thread_pool.num_slots = thread_pool.max_threads;
+		} else if (thread_pool.queue_type[0] == 'c') {
+			thread_pool.channels = true;
+			thread_pool.num_slots = thread_pool.max_threads;
+		} else {
+			thread_pool.num_lanes = (thread_pool.heap_cmp == timestamp_cmp) ? 1 : RAD_LISTEN_MAX;
+		}
+#  else
+		ERROR("FATAL: queue_type '%s' requires <stdatomic.h>, which was not found at build time",
+		      thread_pool.queue_type);
+		return -1;
+#  endif
+
+	} else if (strcmp(thread_pool.queue_type, "fair") == 0) {
+		thread_pool.fair = true;
+
+	} else if (strcmp(thread_pool.queue_type, "heap") != 0) {
+		ERROR("FATAL: Invalid queue_type '%s'", thread_pool.queue_type);
+		return -1;
+	}
+
+	if (thread_pool.fibers > 1) {
+#  ifdef WITH_FIBERS
+		/*
+		 *	Threads running fibers wait on the
+		 *	semaphore, not on their own channel.
+		 */
+		if (thread_pool.channels) {
+			ERROR("FATAL: fibers cannot be used with queue_type 'channel'");
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("fibers", thread_pool.fibers, <=, 1024);
+		FR_INTEGER_BOUND_CHECK("fiber_stack_size", thread_pool.fiber_stack_size, >=, 65536);
+#  else
+		WARN("Fibers are not supported on this system.  Ignoring 'fibers'");
+		thread_pool.fibers = 0;
+#  endif
+	}
+
+	if (thread_pool.offload.num_threads > thread_pool.max_threads) {
+		ERROR("FATAL: offload_threads (%i) must be <= max_servers (%i)",
+		      thread_pool.offload.num_threads, thread_pool.max_threads);
 		return -1;
 	}
 
+	if (thread_pool.offload.num_threads && (thread_pool.offload.max_queue_size < 1)) {
+		ERROR("FATAL: offload_queue_size must be >= 1");
+		return -1;
+	}
+
+	if (isolated_bootstrap(pool_cf) < 0) return -1;
+
 #endif	/* WITH_GCD */
 	return 0;
 }
@@ -933,6 +2660,19 @@ int thread_pool_init(void)
 	 */
 	if (pool_initialized) return 0;
 
+#if defined(WITH_THREAD_AFFINITY) && !defined(WITH_GCD)
+	/*
+	 *	Bind the main thread first, so that the queues are
+	 *	allocated on its NUMA node.  The worker threads
+	 *	inherit its CPU set when they're created.
+	 */
+	if ((thread_pool.cpu_affinity || (thread_pool.numa_node >= 0)) &&
+	    (thread_affinity_set(thread_pool.cpu_affinity, thread_pool.numa_node) < 0)) {
+		ERROR("FATAL: %s", fr_strerror());
+		return -1;
+	}
+#endif
+
 #ifdef WNOHANG
 	if ((pthread_mutex_init(&thread_pool.wait_mutex,NULL) != 0)) {
 		ERROR("FATAL: Failed to initialize wait mutex: %s",
@@ -975,6 +2715,80 @@ int thread_pool_init(void)
 		ERROR("FATAL: Failed to initialize the incoming queue.");
 		return -1;
 	}
+
+#  ifdef WITH_FIBERS
+	if (thread_pool.fibers > 1) {
+		rcode = pthread_mutex_init(&thread_pool.fiber_mutex, NULL);
+		if (rcode != 0) {
+			ERROR("FATAL: Failed to initialize fiber mutex: %s", fr_syserror(rcode));
+			return -1;
+		}
+		thread_pool.fiber_polling = NULL;
+	}
+#  endif
+
+	if (thread_pool.fair) {
+		thread_pool.fair_queues = fr_hash_table_create(NULL, fair_hash, fair_cmp, fair_free);
+		if (!thread_pool.fair_queues) {
+			ERROR("FATAL: Failed to initialize the incoming queue.");
+			return -1;
+		}
+	}
+
+#  ifdef HAVE_STDATOMIC_H
+	/*
+	 *	Each lane is large enough to hold the whole queue, so
+	 *	the max_queue_size check in request_enqueue() is what
+	 *	limits the number of queued requests.
+	 */
+	for (i = 0; i < (uint32_t) thread_pool.num_lanes; i++) {
+		thread_pool.lanes[i] = fr_atomic_queue_create(NULL, thread_pool.max_queue_size);
+		if (!thread_pool.lanes[i]) {
+			ERROR("FATAL: Failed to initialize the incoming queue.");
+			return -1;
+		}
+	}
+
+	/*
+	 *	The thread queues share max_queue_size between them.
+	 */
+	if (thread_pool.stealing || thread_pool.channels) {
+		size_t size;
+
+		size = (thread_pool.max_queue_size + thread_pool.num_slots - 1) / thread_pool.num_slots;
+		if (size < 2) size = 2;
+
+		thread_pool.slot_used = talloc_zero_array(NULL, bool, thread_pool.num_slots);
+		if (!thread_pool.slot_used) {
+		queue_error:
+			ERROR("FATAL: Failed to initialize the incoming queue.");
+			return -1;
+		}
+
+		if (thread_pool.channels) {
+			thread_pool.channel = talloc_zero_array(thread_pool.slot_used, fr_thread_channel_t *,
+								thread_pool.num_slots);
+			if (!thread_pool.channel) goto queue_error;
+
+			for (i = 0; i < (uint32_t) thread_pool.num_slots; i++) {
+				thread_pool.channel[i] = fr_thread_channel_create(thread_pool.channel, size);
+				if (!thread_pool.channel[i]) {
+					ERROR("FATAL: Failed to initialize the incoming queue: %s", fr_strerror());
+					return -1;
+				}
+			}
+		} else {
+			thread_pool.slots = talloc_zero_array(thread_pool.slot_used, fr_atomic_queue_t *,
+							      thread_pool.num_slots);
+			if (!thread_pool.slots) goto queue_error;
+
+			for (i = 0; i < (uint32_t) thread_pool.num_slots; i++) {
+				thread_pool.slots[i] = fr_atomic_queue_create(thread_pool.slots, size);
+				if (!thread_pool.slots[i]) goto queue_error;
+			}
+		}
+	}
+#  endif
 #endif
 
 #ifndef WITH_GCD
@@ -988,6 +2802,16 @@ int thread_pool_init(void)
 			return -1;
 		}
 	}
+
+	if (offload_init(&thread_pool.offload) < 0) return -1;
+
+	{
+		isolated_pool_t *pool;
+
+		for (pool = thread_pool.isolated; pool; pool = pool->next) {
+			if (isolated_init(pool) < 0) return -1;
+		}
+	}
 #else
 	thread_pool.queue = dispatch_queue_create("org.freeradius.threads", NULL);
 	if (!thread_pool.queue) {
@@ -1024,9 +2848,30 @@ void thread_pool_stop(void)
 	/*
 	 *	Wakeup all threads to make them see stop flag.
 	 */
-	total_threads = thread_pool.total_threads;
-	for (i = 0; i != total_threads; i++) {
-		sem_post(&thread_pool.semaphore);
+#  ifdef HAVE_STDATOMIC_H
+	if (thread_pool.channels) {
+		for (handle = thread_pool.head; handle; handle = handle->next) thread_wake(handle);
+	} else
+#  endif
+	{
+		total_threads = thread_pool.total_threads;
+		for (i = 0; i != total_threads; i++) {
+			sem_post(&thread_pool.semaphore);
+		}
+
+#  ifdef WITH_FIBERS
+		/*
+		 *	Threads running fibers may be polling their
+		 *	pipe instead.
+		 */
+		if (thread_pool.fibers > 1) {
+			for (handle = thread_pool.head; handle; handle = handle->next) {
+				if ((write(handle->kick[1], "s", 1) < 0) && (errno != EAGAIN)) {
+					ERROR("Failed waking thread %d: %s", handle->thread_num, fr_syserror(errno));
+				}
+			}
+		}
+#  endif
 	}
 
 	/*
@@ -1038,8 +2883,48 @@ void thread_pool_stop(void)
 		delete_thread(handle);
 	}
 
+	/*
+	 *	After the workers, as they may have been waiting
+	 *	on offloaded jobs.
+	 */
+	offload_stop(&thread_pool.offload);
+
+	while (thread_pool.isolated) {
+		isolated_pool_t *pool = thread_pool.isolated;
+
+		thread_pool.isolated = pool->next;
+		isolated_stop(pool);
+		talloc_free(pool);
+	}
+
 	fr_heap_delete(thread_pool.heap);
 
+#  ifdef WITH_FIBERS
+	if (thread_pool.fibers > 1) pthread_mutex_destroy(&thread_pool.fiber_mutex);
+#  endif
+
+	fr_hash_table_free(thread_pool.fair_queues);
+	thread_pool.fair_queues = NULL;
+	while (thread_pool.fair_free) {
+		fair_queue_t *fq = thread_pool.fair_free;
+
+		thread_pool.fair_free = fq->next;
+		fair_free(fq);
+	}
+	thread_pool.fair_head = thread_pool.fair_tail = NULL;
+	thread_pool.fair_num = 0;
+
+#  ifdef HAVE_STDATOMIC_H
+	for (i = 0; i < thread_pool.num_lanes; i++) {
+		TALLOC_FREE(thread_pool.lanes[i]);
+	}
+
+	TALLOC_FREE(thread_pool.slot_used);
+	thread_pool.slots = NULL;
+	thread_pool.channel = NULL;
+	thread_pool.num_slots = 0;
+#  endif
+
 #  ifdef WNOHANG
 	fr_hash_table_free(thread_pool.waiters);
 #  endif
@@ -1115,6 +3000,50 @@ static void thread_pool_manage(time_t now)
 		}
 	}
 
+	/*
+	 *	If requests are waiting for too long, or there are more
+	 *	requests queued than there are threads to take them,
+	 *	spawn threads for all of them now.  Waiting until
+	 *	there are too few spares only adds one thread at a
+	 *	time, which is too slow for a burst of traffic.
+	 */
+	if (thread_pool.spawn_delay_target && (thread_pool.total_threads < thread_pool.max_threads)) {
+		uint32_t queued = queue_num_elements();
+		bool slow = (thread_pool.last_delay > (thread_pool.spawn_delay_target * (uint64_t) 1000));
+
+		if ((queued > spare) || slow) {
+			total = (queued > spare) ? queued - spare : 0;
+
+			if (slow && (total < (int) thread_pool.min_spare_threads)) total = thread_pool.min_spare_threads;
+
+			/*
+			 *	Never more than double the pool at once.
+			 *	The new threads take a while to start,
+			 *	and may be enough.
+			 */
+			if (total > (int) thread_pool.total_threads) total = thread_pool.total_threads ? thread_pool.total_threads : 1;
+			if ((total + thread_pool.total_threads) > thread_pool.max_threads) {
+				total = thread_pool.max_threads - thread_pool.total_threads;
+			}
+
+			DEBUG2("Threads: Spawning %d threads for %u queued requests", total, queued);
+
+			for (i = 0; i < total; i++) {
+				handle = spawn_thread(now, 1);
+				if (handle == NULL) {
+					return;
+				}
+			}
+
+			/*
+			 *	Only spawn for this delay once.  The new
+			 *	threads will measure it again.
+			 */
+			thread_pool.last_delay = 0;
+			return;
+		}
+	}
+
 	/*
 	 *	If there are too few spare threads.  Go create some more.
 	 */
@@ -1159,6 +3088,15 @@ static void thread_pool_manage(time_t now)
 		return;
 	}
 
+	/*
+	 *	Don't delete threads while requests are still waiting
+	 *	for longer than half the target.
+	 */
+	if (thread_pool.spawn_delay_target &&
+	    (thread_pool.last_delay > (thread_pool.spawn_delay_target * (uint64_t) 500))) {
+		return;
+	}
+
 	/*
 	 *	If there are too many spare threads, delete one.
 	 *
@@ -1191,10 +3129,10 @@ static void thread_pool_manage(time_t now)
 			    (handle->status == THREAD_RUNNING)) {
 				handle->status = THREAD_CANCELLED;
 				/*
-				 *	Post an extra semaphore, as a
-				 *	signal to wake up, and exit.
+				 *	Wake it up, so that it sees it
+				 *	should exit.
 				 */
-				sem_post(&thread_pool.semaphore);
+				thread_wake(handle);
 				spare--;
 				break;
 			}
@@ -1318,7 +3256,16 @@ void thread_pool_queue_stats(int array[RAD_LISTEN_MAX], int pps[2])
 		 *	fixed in size.
 		 */
 		memset(array, 0, sizeof(array[0]) * RAD_LISTEN_MAX);
-		array[0] = fr_heap_num_elements(thread_pool.heap);
+#  ifdef HAVE_STDATOMIC_H
+		if (thread_pool.lockfree && (thread_pool.num_lanes > 1)) {
+			for (i = 0; i < thread_pool.num_lanes; i++) {
+				array[i] = fr_atomic_queue_num_elements(thread_pool.lanes[i]);
+			}
+		} else
+#  endif
+		{
+			array[0] = queue_num_elements();
+		}
 
 		gettimeofday(&now, NULL);
 
@@ -1349,4 +3296,168 @@ uint32_t thread_pool_max_threads(void)
 {
 	return thread_pool.max_threads;
 }
+
+/** Run a CPU-heavy function in the offload pool
+ *
+ * The calling thread blocks until the function has run.  If no
+ * offload threads are configured, the function is run by the caller.
+ *
+ * @param[in] request	The current request.
+ * @param[in] func	to run.
+ * @param[in] uctx	to pass to func.
+ * @param[out] rcode	What func returned.
+ * @return
+ *	- 0 if func ran.
+ *	- -1 if the offload queue was full, and func was not run.
+ */
+int thread_pool_offload(REQUEST *request, thread_pool_offload_t func, void *uctx, int *rcode)
+{
+#ifndef WITH_GCD
+	offload_pool_t	*pool = &thread_pool.offload;
+	offload_job_t	job;
+
+	if (!pool->threads) {
+#endif
+		*rcode = func(uctx);
+		return 0;
+#ifndef WITH_GCD
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.func = func;
+	job.uctx = uctx;
+	gettimeofday(&job.queued, NULL);
+	if (pthread_cond_init(&job.cond, NULL) != 0) {
+		REDEBUG("Failed initializing offload job: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->stop || (pool->num_queued >= pool->max_queue_size)) {
+		pool->rejected++;
+		pthread_mutex_unlock(&pool->mutex);
+		pthread_cond_destroy(&job.cond);
+
+		REDEBUG("Offload queue is full (%u jobs), refusing to run job", pool->max_queue_size);
+		return -1;
+	}
+
+	if (pool->tail) {
+		pool->tail->next = &job;
+	} else {
+		pool->head = &job;
+	}
+	pool->tail = &job;
+	pool->num_queued++;
+	pthread_cond_signal(&pool->cond);
+
+	while (!job.done) pthread_cond_wait(&job.cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+
+	pthread_cond_destroy(&job.cond);
+
+	*rcode = job.rcode;
+	return 0;
+#endif
+}
+
+/** Return the number of requests dropped instead of being queued
+ *
+ * @param[out] shed	Counts, indexed by queue_shed_t.
+ */
+void thread_pool_shed_stats(uint64_t shed[QUEUE_SHED_MAX])
+{
+#ifndef WITH_GCD
+	memcpy(shed, thread_pool.shed, sizeof(thread_pool.shed));
+#else
+	memset(shed, 0, sizeof(shed[0]) * QUEUE_SHED_MAX);
+#endif
+}
+
+/** Return statistics for the offload pool
+ *
+ * @param[out] queued	Jobs waiting for an offload thread.
+ * @param[out] completed	Jobs which have run.
+ * @param[out] rejected	Jobs refused because the queue was full.
+ * @param[out] wait_usec	Total time completed jobs spent queued.
+ * @param[out] run_usec	Total time completed jobs spent running.
+ */
+void thread_pool_offload_stats(uint32_t *queued, uint64_t *completed, uint64_t *rejected,
+			       uint64_t *wait_usec, uint64_t *run_usec)
+{
+#ifndef WITH_GCD
+	offload_pool_t *pool = &thread_pool.offload;
+
+	if (pool->threads) {
+		pthread_mutex_lock(&pool->mutex);
+		*queued = pool->num_queued;
+		*completed = pool->completed;
+		*rejected = pool->rejected;
+		*wait_usec = pool->wait_usec;
+		*run_usec = pool->run_usec;
+		pthread_mutex_unlock(&pool->mutex);
+		return;
+	}
+#endif
+
+	*queued = 0;
+	*completed = *rejected = *wait_usec = *run_usec = 0;
+}
+
+/** Find a named thread pool
+ *
+ * @param[in] name	of the pool, from "pool <name> { ... }" in the "thread pool" section.
+ * @return the pool, or NULL if there's no pool of that name.
+ */
+isolated_pool_t *thread_pool_find(char const *name)
+{
+#ifndef WITH_GCD
+	isolated_pool_t *pool;
+
+	for (pool = thread_pool.isolated; pool; pool = pool->next) {
+		if (strcmp(pool->name, name) == 0) return pool;
+	}
+#endif
+
+	return NULL;
+}
+
+/** Return statistics for a named thread pool
+ *
+ * @param[in] i		index of the pool, starting from 0.
+ * @param[out] name	of the pool.
+ * @param[out] queued	Requests waiting for a thread.
+ * @param[out] active	Threads processing a request.
+ * @param[out] completed	Requests which have been processed.
+ * @param[out] rejected	Requests refused because the queue was full.
+ * @param[out] wait_usec	Total time processed requests spent queued.
+ * @param[out] run_usec	Total time processed requests spent running.
+ * @return
+ *	- 0 on success.
+ *	- -1 if there are fewer than i + 1 pools.
+ */
+int thread_pool_isolated_stats(unsigned int i, char const **name, uint32_t *queued, uint32_t *active,
+			       uint64_t *completed, uint64_t *rejected, uint64_t *wait_usec, uint64_t *run_usec)
+{
+#ifndef WITH_GCD
+	isolated_pool_t *pool;
+
+	for (pool = thread_pool.isolated; pool && (i > 0); pool = pool->next) i--;
+	if (!pool || !pool->threads) return -1;
+
+	pthread_mutex_lock(&pool->mutex);
+	*name = pool->name;
+	*queued = fr_heap_num_elements(pool->heap);
+	*active = pool->active;
+	*completed = pool->completed;
+	*rejected = pool->rejected;
+	*wait_usec = pool->wait_usec;
+	*run_usec = pool->run_usec;
+	pthread_mutex_unlock(&pool->mutex);
+
+	return 0;
+#else
+	return -1;
+#endif
+}
 #endif /* HAVE_PTHREAD_H */
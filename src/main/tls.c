@@ -55,6 +55,8 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #  ifdef HAVE_OPENSSL_EVP_H
 #    include <openssl/evp.h>
 #  endif
+#  include <openssl/hmac.h>
+#  include <openssl/rand.h>
 #  include <openssl/ssl.h>
 
 #define LOG_PREFIX "tls"
@@ -354,6 +356,18 @@ tls_session_t *tls_session_init_client(TALLOC_CTX *ctx, fr_tls_server_conf_t *co
 
 	SSL_set_ex_data(session->ssl, FR_TLS_EX_INDEX_CONF, (void *)conf);
 	SSL_set_ex_data(session->ssl, FR_TLS_EX_INDEX_TLS_SESSION, (void *)session);
+
+#ifdef SSL_OP_ENABLE_KTLS
+	/*
+	 *	OpenSSL hands the keys to the kernel once the handshake
+	 *	is done, if the kernel and the negotiated cipher support
+	 *	it.  If not, records are encrypted in user space as
+	 *	usual.  This only works because we're using a socket
+	 *	BIO, and not memory BIOs as server sessions do.
+	 */
+	if (conf->ktls) SSL_set_options(session->ssl, SSL_OP_ENABLE_KTLS);
+#endif
+
 	SSL_set_fd(session->ssl, fd);
 	if (SSL_connect(session->ssl) <= 0) {
 		int err;
@@ -363,6 +377,14 @@ tls_session_t *tls_session_init_client(TALLOC_CTX *ctx, fr_tls_server_conf_t *co
 		return NULL;
 	}
 
+#ifdef SSL_OP_ENABLE_KTLS
+	if (conf->ktls) {
+		DEBUG2("tls: kTLS %s for sending, %s for receiving",
+		       BIO_get_ktls_send(SSL_get_wbio(session->ssl)) ? "enabled" : "not available",
+		       BIO_get_ktls_recv(SSL_get_rbio(session->ssl)) ? "enabled" : "not available");
+	}
+#endif
+
 	session->mtu = conf->fragment_size;
 
 	return session;
@@ -396,21 +418,6 @@ tls_session_t *tls_session_init_server(TALLOC_CTX *ctx, fr_tls_server_conf_t *co
 
 	ssl_ctx = conf->ctx[(conf->ctx_count == 1) ? 0 : conf->ctx_next++ % conf->ctx_count];	/* mutex not needed */
 
-	/*
-	 *	Manually flush the sessions every so often.  If HALF
-	 *	of the session lifetime has passed since we last
-	 *	flushed, then flush it again.
-	 *
-	 *	FIXME: Also do it every N sessions?
-	 */
-	if (conf->session_cache_enable && !conf->session_cache_server &&
-	    ((conf->session_last_flushed + ((int)conf->session_timeout * 1800)) <= request->timestamp.tv_sec)){
-		RDEBUG2("Flushing TLS sessions (of #%ld)", SSL_CTX_sess_number(ssl_ctx));
-
-		SSL_CTX_flush_sessions(ssl_ctx, request->timestamp.tv_sec);
-		conf->session_last_flushed = request->timestamp.tv_sec;
-	}
-
 	new_tls = SSL_new(ssl_ctx);
 	if (new_tls == NULL) {
 		RERROR("Error creating new TLS session: %s", ERR_error_string(ERR_get_error(), NULL));
@@ -569,6 +576,69 @@ static int tls_error_log(REQUEST *request, SSL *s, int ret, char const *text)
 	return 1;
 }
 
+#ifdef SSL_MODE_ASYNC
+/** Wait for an engine to complete an async crypto job
+ *
+ * Called when an SSL function returns SSL_ERROR_WANT_ASYNC.  There's no way
+ * to park an EAP request and resume it later, so the worker sleeps on the
+ * engine's notification fds instead.  The CPU is still free for other
+ * workers while the engine does the private key operation.
+ *
+ * @param[in] request the handshake is for.
+ * @param[in] ssl session with an async job in progress.
+ * @param[in] ret from the SSL function.
+ * @return
+ *	- true if the SSL function should be called again.
+ *	- false if no async job is pending, or the engine failed to complete it.
+ */
+static bool tls_async_wait(REQUEST *request, SSL *ssl, int ret)
+{
+	OSSL_ASYNC_FD	fds[8];
+	size_t		num_fds, i;
+	fd_set		read_fds;
+	int		max_fd = -1;
+	struct timeval	tv;
+
+	if (ret > 0) return false;
+	if (SSL_get_error(ssl, ret) != SSL_ERROR_WANT_ASYNC) return false;
+
+	if (!SSL_get_all_async_fds(ssl, NULL, &num_fds) || (num_fds > (sizeof(fds) / sizeof(*fds)))) {
+		REDEBUG("Failed getting async fds from engine");
+		return false;
+	}
+
+	/*
+	 *	Engines which don't signal completion
+	 *	are polled.
+	 */
+	if (num_fds == 0) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100;
+		select(0, NULL, NULL, NULL, &tv);
+		return true;
+	}
+
+	SSL_get_all_async_fds(ssl, fds, &num_fds);
+
+	FD_ZERO(&read_fds);
+	for (i = 0; i < num_fds; i++) {
+		FD_SET(fds[i], &read_fds);
+		if (fds[i] > max_fd) max_fd = fds[i];
+	}
+
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	if (select(max_fd + 1, &read_fds, NULL, NULL, &tv) <= 0) {
+		REDEBUG("Timed out waiting for engine to complete async job");
+		return false;
+	}
+
+	return true;
+}
+#else
+#  define tls_async_wait(_request, _ssl, _ret) (false)
+#endif
+
 /*
  * We are the server, we always get the dirty data
  * (Handshake data is also considered as dirty data)
@@ -596,8 +666,10 @@ int tls_handshake_recv(REQUEST *request, tls_session_t *session)
 	}
 	record_init(&session->dirty_in);
 
-	err = SSL_read(session->ssl, session->clean_out.data + session->clean_out.used,
-		       sizeof(session->clean_out.data) - session->clean_out.used);
+	do {
+		err = SSL_read(session->ssl, session->clean_out.data + session->clean_out.used,
+			       sizeof(session->clean_out.data) - session->clean_out.used);
+	} while (tls_async_wait(request, session->ssl, err));
 	if (err > 0) {
 		session->clean_out.used += err;
 		return 1;
@@ -681,7 +753,9 @@ int tls_handshake_send(REQUEST *request, tls_session_t *session)
 	if (session->clean_in.used > 0) {
 		int written;
 
-		written = SSL_write(session->ssl, session->clean_in.data, session->clean_in.used);
+		do {
+			written = SSL_write(session->ssl, session->clean_in.data, session->clean_in.used);
+		} while (tls_async_wait(request, session->ssl, written));
 		record_to_buff(&session->clean_in, NULL, written);
 
 		/* Get the dirty data from Bio to send it */
@@ -1089,8 +1163,11 @@ static CONF_PARSER cache_config[] = {
 
 	{ FR_CONF_OFFSET("virtual_server", PW_TYPE_STRING, fr_tls_server_conf_t, session_cache_server) },
 
-	{ FR_CONF_OFFSET("lifetime", PW_TYPE_INTEGER | PW_TYPE_DEPRECATED, fr_tls_server_conf_t, session_timeout), .dflt = "24" },
-	{ FR_CONF_OFFSET("max_entries", PW_TYPE_INTEGER | PW_TYPE_DEPRECATED, fr_tls_server_conf_t, session_cache_size), .dflt = "255" },
+	{ FR_CONF_OFFSET("lifetime", PW_TYPE_INTEGER, fr_tls_server_conf_t, session_timeout), .dflt = "24" },
+	{ FR_CONF_OFFSET("max_entries", PW_TYPE_INTEGER, fr_tls_server_conf_t, session_cache_size), .dflt = "255" },
+
+	{ FR_CONF_OFFSET("session_tickets", PW_TYPE_BOOLEAN, fr_tls_server_conf_t, session_tickets), .dflt = "no" },
+	{ FR_CONF_OFFSET("ticket_key_lifetime", PW_TYPE_INTEGER, fr_tls_server_conf_t, ticket_key_lifetime), .dflt = "3600" },
 	{ FR_CONF_DEPRECATED("persist_dir", PW_TYPE_STRING | PW_TYPE_DEPRECATED, fr_tls_server_conf_t, NULL) },
 
 	CONF_PARSER_TERMINATOR
@@ -1113,6 +1190,10 @@ static CONF_PARSER ocsp_config[] = {
 	{ FR_CONF_OFFSET("use_nonce", PW_TYPE_BOOLEAN, fr_tls_server_conf_t, ocsp_use_nonce), .dflt = "yes" },
 	{ FR_CONF_OFFSET("timeout", PW_TYPE_INTEGER, fr_tls_server_conf_t, ocsp_timeout), .dflt = "yes" },
 	{ FR_CONF_OFFSET("softfail", PW_TYPE_BOOLEAN, fr_tls_server_conf_t, ocsp_softfail), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("cache", PW_TYPE_BOOLEAN, fr_tls_server_conf_t, ocsp_cache_enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("cache_max_entries", PW_TYPE_INTEGER, fr_tls_server_conf_t, ocsp_cache_max_entries), .dflt = "4096" },
+	{ FR_CONF_OFFSET("cache_refresh", PW_TYPE_INTEGER, fr_tls_server_conf_t, ocsp_cache_refresh), .dflt = "300" },
 	CONF_PARSER_TERMINATOR
 };
 #endif
@@ -1141,11 +1222,16 @@ static CONF_PARSER tls_server_config[] = {
 	{ FR_CONF_OFFSET("check_all_crl", PW_TYPE_BOOLEAN, fr_tls_server_conf_t, check_all_crl), .dflt = "no" },
 #endif
 	{ FR_CONF_OFFSET("allow_expired_crl", PW_TYPE_BOOLEAN, fr_tls_server_conf_t, allow_expired_crl) },
+	{ FR_CONF_OFFSET("crl_file", PW_TYPE_FILE_INPUT, fr_tls_server_conf_t, crl_file) },
+	{ FR_CONF_OFFSET("crl_check_interval", PW_TYPE_INTEGER, fr_tls_server_conf_t, crl_check_interval), .dflt = "60" },
 	{ FR_CONF_OFFSET("check_cert_cn", PW_TYPE_STRING, fr_tls_server_conf_t, check_cert_cn) },
 	{ FR_CONF_OFFSET("cipher_list", PW_TYPE_STRING, fr_tls_server_conf_t, cipher_list) },
 	{ FR_CONF_OFFSET("check_cert_issuer", PW_TYPE_STRING, fr_tls_server_conf_t, check_cert_issuer) },
 	{ FR_CONF_OFFSET("require_client_cert", PW_TYPE_BOOLEAN, fr_tls_server_conf_t, require_client_cert) },
 
+	{ FR_CONF_OFFSET("engine", PW_TYPE_STRING, fr_tls_server_conf_t, engine_id) },
+	{ FR_CONF_OFFSET("async", PW_TYPE_BOOLEAN, fr_tls_server_conf_t, async), .dflt = "no" },
+
 #if OPENSSL_VERSION_NUMBER >= 0x0090800fL
 #ifndef OPENSSL_NO_ECDH
 	{ FR_CONF_OFFSET("ecdh_curve", PW_TYPE_STRING, fr_tls_server_conf_t, ecdh_curve), .dflt = "prime256v1" },
@@ -1209,6 +1295,8 @@ static CONF_PARSER tls_client_config[] = {
 #ifdef SSL_OP_NO_TLSv1_2
 	{ FR_CONF_OFFSET("disable_tlsv1_2", PW_TYPE_BOOLEAN, fr_tls_server_conf_t, disable_tlsv1_2) },
 #endif
+
+	{ FR_CONF_OFFSET("ktls", PW_TYPE_BOOLEAN, fr_tls_server_conf_t, ktls), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -1403,7 +1491,7 @@ static int cache_write_session(SSL *ssl, SSL_SESSION *sess)
 	/*
 	 *	Put the SSL data into an attribute.
 	 */
-	vp = fr_pair_afrom_num(request->state, 0, PW_TLS_SESSION_DATA);
+	vp = fr_pair_afrom_num(request_state_ctx(request), 0, PW_TLS_SESSION_DATA);
 	if (!vp) goto error;
 
 	fr_pair_value_memsteal(vp, data);
@@ -1562,6 +1650,450 @@ static void cache_delete_session(SSL_CTX *ctx, SSL_SESSION *sess)
 	talloc_free(request);
 }
 
+/*
+ *	In-memory session cache, shared by all of the SSL_CTXs of
+ *	a TLS configuration.  OpenSSL's internal cache is per
+ *	SSL_CTX, and we create one SSL_CTX per thread, so a client
+ *	could only resume a session if it happened to be given the
+ *	same SSL_CTX again.
+ *
+ *	Entries are spread over a number of shards, each with its
+ *	own lock.  Every entry has the same lifetime, so the order
+ *	in which entries were added is also the order in which they
+ *	expire, and a list is enough to find expired entries, or
+ *	the oldest entry to evict.
+ */
+#define TLS_CACHE_SHARDS	(16)
+
+typedef struct tls_cache_entry tls_cache_entry_t;
+struct tls_cache_entry {
+	tls_cache_entry_t	*prev;
+	tls_cache_entry_t	*next;
+	time_t			expires;	//!< When the entry may no longer be used.
+	uint8_t			id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	size_t			id_len;
+	uint8_t			*data;		//!< Serialised SSL_SESSION.
+	size_t			data_len;
+};
+
+typedef struct tls_cache_shard {
+	pthread_mutex_t		mutex;
+	fr_hash_table_t		*ht;		//!< Entries, by session ID.
+	tls_cache_entry_t	*head;		//!< Oldest entry.
+	tls_cache_entry_t	*tail;		//!< Newest entry.
+	uint32_t		num_entries;
+} tls_cache_shard_t;
+
+struct tls_session_cache {
+	uint32_t		lifetime;	//!< In seconds.
+	uint32_t		max_entries;	//!< Per shard, 0 for no limit.
+	tls_cache_shard_t	shards[TLS_CACHE_SHARDS];
+};
+
+static uint32_t tls_cache_entry_hash(void const *data)
+{
+	tls_cache_entry_t const *entry = data;
+
+	return fr_hash(entry->id, entry->id_len);
+}
+
+static int tls_cache_entry_cmp(void const *one, void const *two)
+{
+	tls_cache_entry_t const *a = one, *b = two;
+
+	if (a->id_len != b->id_len) return (a->id_len < b->id_len) ? -1 : +1;
+
+	return memcmp(a->id, b->id, a->id_len);
+}
+
+static inline tls_cache_shard_t *tls_cache_shard(tls_session_cache_t *cache, uint8_t const *id, size_t id_len)
+{
+	return &cache->shards[fr_hash(id, id_len) % TLS_CACHE_SHARDS];
+}
+
+/** Remove an entry from its shard and free it
+ *
+ * @note Must be called with the shard locked.
+ */
+static void tls_cache_entry_free(tls_cache_shard_t *shard, tls_cache_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		shard->head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		shard->tail = entry->prev;
+	}
+
+	fr_hash_table_delete(shard->ht, entry);
+	shard->num_entries--;
+
+	talloc_free(entry);
+}
+
+static int _tls_session_cache_free(tls_session_cache_t *cache)
+{
+	int i;
+
+	for (i = 0; i < TLS_CACHE_SHARDS; i++) {
+		tls_cache_shard_t *shard = &cache->shards[i];
+
+		while (shard->head) tls_cache_entry_free(shard, shard->head);
+		pthread_mutex_destroy(&shard->mutex);
+	}
+
+	return 0;
+}
+
+/** Allocate the in-memory session cache
+ *
+ * @param[in] ctx to allocate the cache in.
+ * @param[in] lifetime of entries, in seconds.
+ * @param[in] max_entries in the whole cache, 0 for no limit.
+ * @return
+ *	- The new cache.
+ *	- NULL on error.
+ */
+static tls_session_cache_t *tls_session_cache_alloc(TALLOC_CTX *ctx, uint32_t lifetime, uint32_t max_entries)
+{
+	tls_session_cache_t	*cache;
+	int			i;
+
+	cache = talloc_zero(ctx, tls_session_cache_t);
+	if (!cache) return NULL;
+
+	cache->lifetime = lifetime;
+	if (max_entries) cache->max_entries = (max_entries + TLS_CACHE_SHARDS - 1) / TLS_CACHE_SHARDS;
+
+	for (i = 0; i < TLS_CACHE_SHARDS; i++) {
+		tls_cache_shard_t *shard = &cache->shards[i];
+
+		shard->ht = fr_hash_table_create(cache, tls_cache_entry_hash, tls_cache_entry_cmp, NULL);
+		if (!shard->ht) {
+		error:
+			talloc_free(cache);
+			return NULL;
+		}
+		if (pthread_mutex_init(&shard->mutex, NULL) != 0) goto error;
+	}
+	talloc_set_destructor(cache, _tls_session_cache_free);
+
+	return cache;
+}
+
+/** Write a newly created session to the shared cache
+ *
+ * @param[in] ssl session state.
+ * @param[in] sess to serialise and write to the cache.
+ * @return 0, so that OpenSSL frees its reference to the session.
+ */
+static int shared_cache_write_session(SSL *ssl, SSL_SESSION *sess)
+{
+	fr_tls_server_conf_t	*conf = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF);
+	REQUEST			*request = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_REQUEST);
+	tls_session_cache_t	*cache = conf->session_cache;
+	tls_cache_shard_t	*shard;
+	tls_cache_entry_t	*entry, *old;
+	ssize_t			slen;
+	int			len;
+	uint8_t			*p;
+	time_t			now;
+
+	entry = talloc_zero(NULL, tls_cache_entry_t);
+	if (!entry) return 0;
+
+	slen = tls_session_id(entry->id, sizeof(entry->id), sess);
+	if (slen <= 0) {
+		ROPTIONAL(RWDEBUG, WARN, "Not caching session without a valid session ID");
+	error:
+		talloc_free(entry);
+		return 0;
+	}
+	entry->id_len = slen;
+
+	len = i2d_SSL_SESSION(sess, NULL);
+	if (len < 1) {
+		ROPTIONAL(RWDEBUG, WARN, "Session serialisation failed, couldn't determine required buffer length");
+		goto error;
+	}
+
+	entry->data = p = talloc_array(entry, uint8_t, len);
+	if (!entry->data) goto error;
+
+	/* openssl mutates &p */
+	if (i2d_SSL_SESSION(sess, &p) != len) {
+		ROPTIONAL(RWDEBUG, WARN, "Session serialisation failed");
+		goto error;
+	}
+	entry->data_len = len;
+
+	now = time(NULL);
+	entry->expires = now + cache->lifetime;
+
+	shard = tls_cache_shard(cache, entry->id, entry->id_len);
+	pthread_mutex_lock(&shard->mutex);
+
+	/*
+	 *	Make room, first by removing expired entries, then
+	 *	the oldest ones.
+	 */
+	while (shard->head && (shard->head->expires <= now)) tls_cache_entry_free(shard, shard->head);
+
+	old = fr_hash_table_finddata(shard->ht, entry);
+	if (old) tls_cache_entry_free(shard, old);
+
+	while (cache->max_entries && shard->head && (shard->num_entries >= cache->max_entries)) {
+		tls_cache_entry_free(shard, shard->head);
+	}
+
+	if (!fr_hash_table_insert(shard->ht, entry)) {
+		pthread_mutex_unlock(&shard->mutex);
+		goto error;
+	}
+
+	entry->prev = shard->tail;
+	if (shard->tail) {
+		shard->tail->next = entry;
+	} else {
+		shard->head = entry;
+	}
+	shard->tail = entry;
+	shard->num_entries++;
+
+	pthread_mutex_unlock(&shard->mutex);
+
+	ROPTIONAL(RDEBUG3, DEBUG3, "Wrote %zu bytes of session data to the session cache", entry->data_len);
+
+	return 0;
+}
+
+/** Read session data from the shared cache
+ *
+ * @param[in] ssl session state.
+ * @param[in] key to retrieve session data for.
+ * @param[in] key_len The length of the key.
+ * @param[out] copy Always set to 0, as the session is deserialised and
+ *	OpenSSL gets the only reference to it.
+ * @return
+ *	- Deserialised session data on success.
+ *	- NULL if there was no valid session.
+ */
+static SSL_SESSION *shared_cache_read_session(SSL *ssl, unsigned char *key, int key_len, int *copy)
+{
+	fr_tls_server_conf_t	*conf = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF);
+	REQUEST			*request = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_REQUEST);
+	tls_session_cache_t	*cache = conf->session_cache;
+	tls_cache_shard_t	*shard;
+	tls_cache_entry_t	find, *entry;
+	SSL_SESSION		*sess = NULL;
+	uint8_t const		*p;
+
+	*copy = 0;
+
+	if ((key_len <= 0) || ((size_t)key_len > sizeof(find.id))) return NULL;
+
+	memcpy(find.id, key, key_len);
+	find.id_len = key_len;
+
+	shard = tls_cache_shard(cache, find.id, find.id_len);
+	pthread_mutex_lock(&shard->mutex);
+
+	entry = fr_hash_table_finddata(shard->ht, &find);
+	if (entry && (entry->expires <= time(NULL))) {
+		tls_cache_entry_free(shard, entry);
+		entry = NULL;
+	}
+
+	if (entry) {
+		p = entry->data;	/* openssl mutates &p */
+		sess = d2i_SSL_SESSION(NULL, &p, entry->data_len);
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	if (!entry) {
+		ROPTIONAL(RDEBUG2, DEBUG2, "No cached session found");
+		return NULL;
+	}
+
+	if (!sess) {
+		ROPTIONAL(RWDEBUG, WARN, "Failed loading cached session: %s", ERR_error_string(ERR_get_error(), NULL));
+		return NULL;
+	}
+	ROPTIONAL(RDEBUG3, DEBUG3, "Read session data from the session cache");
+
+	return sess;
+}
+
+/** Delete session data from the shared cache
+ *
+ * @param[in] ctx Current ssl context.
+ * @param[in] sess to be deleted.
+ */
+static void shared_cache_delete_session(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+	fr_tls_server_conf_t	*conf = SSL_CTX_get_app_data(ctx);
+	tls_session_cache_t	*cache = conf->session_cache;
+	tls_cache_shard_t	*shard;
+	tls_cache_entry_t	find, *entry;
+	ssize_t			slen;
+
+	slen = tls_session_id(find.id, sizeof(find.id), sess);
+	if (slen <= 0) return;
+	find.id_len = slen;
+
+	shard = tls_cache_shard(cache, find.id, find.id_len);
+	pthread_mutex_lock(&shard->mutex);
+	entry = fr_hash_table_finddata(shard->ht, &find);
+	if (entry) tls_cache_entry_free(shard, entry);
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+/*
+ *	Keys for stateless session tickets, shared by all of the
+ *	SSL_CTXs of a TLS configuration, so that a ticket issued
+ *	by one thread can be decrypted by any other.
+ *
+ *	The keys are rotated every ticket_key_lifetime seconds.
+ *	The previous key is kept so that tickets issued just before
+ *	a rotation can still be used, and the client is sent a new
+ *	ticket encrypted with the current key.
+ */
+typedef struct tls_ticket_key {
+	uint8_t			name[16];	//!< Identifies the key in the ticket.
+	uint8_t			aes_key[32];
+	uint8_t			hmac_key[32];
+	time_t			created;	//!< 0 if the key isn't valid.
+} tls_ticket_key_t;
+
+struct tls_ticket_keys {
+	pthread_mutex_t		mutex;
+	uint32_t		lifetime;
+	tls_ticket_key_t	current;
+	tls_ticket_key_t	previous;
+};
+
+static int _tls_ticket_keys_free(tls_ticket_keys_t *keys)
+{
+	pthread_mutex_destroy(&keys->mutex);
+	memset(&keys->current, 0, sizeof(keys->current));
+	memset(&keys->previous, 0, sizeof(keys->previous));
+
+	return 0;
+}
+
+/** Generate a new current key, keeping the old one as the previous key
+ *
+ * @note Must be called with the keys locked.
+ */
+static int tls_ticket_keys_rotate(tls_ticket_keys_t *keys, time_t now)
+{
+	tls_ticket_key_t key;
+
+	if ((RAND_bytes(key.name, sizeof(key.name)) != 1) ||
+	    (RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1) ||
+	    (RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1)) return -1;
+	key.created = now;
+
+	/*
+	 *	If no tickets have been issued for a whole
+	 *	lifetime, the current key is too old to keep.
+	 */
+	if (keys->current.created && ((keys->current.created + (2 * keys->lifetime)) > now)) {
+		keys->previous = keys->current;
+	} else {
+		memset(&keys->previous, 0, sizeof(keys->previous));
+	}
+	keys->current = key;
+	memset(&key, 0, sizeof(key));
+
+	return 0;
+}
+
+static tls_ticket_keys_t *tls_ticket_keys_alloc(TALLOC_CTX *ctx, uint32_t lifetime)
+{
+	tls_ticket_keys_t *keys;
+
+	keys = talloc_zero(ctx, tls_ticket_keys_t);
+	if (!keys) return NULL;
+
+	if (pthread_mutex_init(&keys->mutex, NULL) != 0) {
+		talloc_free(keys);
+		return NULL;
+	}
+	talloc_set_destructor(keys, _tls_ticket_keys_free);
+
+	keys->lifetime = lifetime;
+	if (tls_ticket_keys_rotate(keys, time(NULL)) < 0) {
+		talloc_free(keys);
+		return NULL;
+	}
+
+	return keys;
+}
+
+/** Set up the cipher and HMAC contexts used to encrypt or decrypt a session ticket
+ *
+ * @return
+ *	- 1 to use the ticket.
+ *	- 2 to use the ticket, but issue a new one (it was encrypted with the previous key).
+ *	- 0 if the key used for the ticket isn't known, so a full handshake is needed.
+ *	- -1 on error.
+ */
+static int tls_ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+			     EVP_CIPHER_CTX *cipher_ctx, HMAC_CTX *hmac_ctx, int enc)
+{
+	fr_tls_server_conf_t	*conf = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	tls_ticket_keys_t	*keys = conf->ticket_keys;
+	tls_ticket_key_t	key;
+	time_t			now = time(NULL);
+	int			rcode = 1;
+
+	pthread_mutex_lock(&keys->mutex);
+	if (((keys->current.created + keys->lifetime) <= now) && (tls_ticket_keys_rotate(keys, now) < 0)) {
+		pthread_mutex_unlock(&keys->mutex);
+		return -1;
+	}
+
+	if (enc) {
+		key = keys->current;
+
+	} else if (memcmp(key_name, keys->current.name, sizeof(keys->current.name)) == 0) {
+		key = keys->current;
+
+	} else if (keys->previous.created &&
+		   (memcmp(key_name, keys->previous.name, sizeof(keys->previous.name)) == 0)) {
+		key = keys->previous;
+		rcode = 2;
+
+	} else {
+		pthread_mutex_unlock(&keys->mutex);
+		return 0;
+	}
+	pthread_mutex_unlock(&keys->mutex);
+
+	if (enc) {
+		memcpy(key_name, key.name, sizeof(key.name));
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) {
+			rcode = -1;
+			goto done;
+		}
+		EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv);
+	} else {
+		EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv);
+	}
+	HMAC_Init_ex(hmac_ctx, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), NULL);
+
+done:
+	memset(&key, 0, sizeof(key));
+
+	return rcode;
+}
+#endif
+
 #define MAX_SESSION_SIZE (256)
 
 #ifdef HAVE_OPENSSL_OCSP_H
@@ -1681,24 +2213,267 @@ typedef enum {
 } ocsp_status_t;
 
 /*
- * This function sends a OCSP request to a defined OCSP responder
- * and checks the OCSP response for correctness.
+ *	In-memory cache of OCSP responses.
+ *
+ *	Only definitive answers (good or revoked) are cached, and
+ *	only until the nextUpdate time the responder gave us.  If
+ *	cache_refresh is set, a background thread re-queries the
+ *	responder shortly before nextUpdate, so that certificates
+ *	which are in use never have to wait for the responder.
+ *
+ *	Entries are keyed by the DER encoding of the OCSP CertID,
+ *	which is derived from the issuer name, issuer key and the
+ *	serial number of the certificate.
  */
-static int ocsp_check(REQUEST *request, X509_STORE *store,
-		      X509 *issuer_cert, X509 *client_cert,
-		      fr_tls_server_conf_t *conf)
+#define OCSP_CACHE_KEY_MAX	(256)
+#define OCSP_CACHE_RETRY	(30)	//!< Seconds between refresh attempts for the same entry.
+
+typedef struct tls_ocsp_cache_entry tls_ocsp_cache_entry_t;
+struct tls_ocsp_cache_entry {
+	tls_ocsp_cache_entry_t	*prev;
+	tls_ocsp_cache_entry_t	*next;
+	uint8_t			*key;		//!< DER encoded OCSP_CERTID.
+	size_t			key_len;
+	ocsp_status_t		status;
+	time_t			next_update;	//!< When the response may no longer be used.
+	time_t			refresh;	//!< When the refresh thread should next query the responder.
+	X509			*issuer_cert;	//!< Copies, used to build the refresh request.
+	X509			*client_cert;
+};
+
+struct tls_ocsp_cache {
+	fr_tls_server_conf_t	*conf;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	fr_hash_table_t		*ht;		//!< Entries, by CertID.
+	tls_ocsp_cache_entry_t	*head;		//!< Oldest entry.
+	tls_ocsp_cache_entry_t	*tail;		//!< Newest entry.
+	uint32_t		num_entries;
+
+	bool			running;	//!< Whether the refresh thread was started.
+	bool			stop;		//!< Tell the refresh thread to exit.
+	pthread_t		thread;
+};
+
+static uint32_t ocsp_cache_entry_hash(void const *data)
 {
-	OCSP_CERTID	*certid;
-	OCSP_REQUEST	*req = NULL;
-	OCSP_RESPONSE	*resp = NULL;
-	OCSP_BASICRESP	*bresp = NULL;
-	char		*host = NULL;
-	char		*port = NULL;
-	char		*path = NULL;
-	char		host_header[1024];
-	int		use_ssl = -1;
-	long		this_fudge = MAX_VALIDITY_PERIOD, this_max_age = -1;
-	BIO		*conn = NULL, *ssl_log = NULL;
+	tls_ocsp_cache_entry_t const *entry = data;
+
+	return fr_hash(entry->key, entry->key_len);
+}
+
+static int ocsp_cache_entry_cmp(void const *one, void const *two)
+{
+	tls_ocsp_cache_entry_t const *a = one, *b = two;
+
+	if (a->key_len != b->key_len) return (a->key_len < b->key_len) ? -1 : +1;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+static int _ocsp_cache_entry_free(tls_ocsp_cache_entry_t *entry)
+{
+	X509_free(entry->issuer_cert);
+	X509_free(entry->client_cert);
+
+	return 0;
+}
+
+/** Remove an entry from the OCSP cache and free it
+ *
+ * @note Must be called with the cache locked.
+ */
+static void ocsp_cache_entry_free(tls_ocsp_cache_t *cache, tls_ocsp_cache_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+
+	fr_hash_table_delete(cache->ht, entry);
+	cache->num_entries--;
+
+	talloc_free(entry);
+}
+
+/** Build the cache key for a certificate
+ *
+ * @param[out] key buffer of at least OCSP_CACHE_KEY_MAX bytes.
+ * @param[in] issuer_cert of client_cert.
+ * @param[in] client_cert to build the key for.
+ * @return
+ *	- The length of the key.
+ *	- 0 on error.
+ */
+static size_t ocsp_cache_key(uint8_t *key, X509 *issuer_cert, X509 *client_cert)
+{
+	OCSP_CERTID	*certid;
+	unsigned char	*p = key;
+	int		len;
+
+	certid = OCSP_cert_to_id(NULL, client_cert, issuer_cert);
+	if (!certid) return 0;
+
+	len = i2d_OCSP_CERTID(certid, NULL);
+	if ((len <= 0) || (len > OCSP_CACHE_KEY_MAX)) {
+		OCSP_CERTID_free(certid);
+		return 0;
+	}
+
+	len = i2d_OCSP_CERTID(certid, &p);
+	OCSP_CERTID_free(certid);
+
+	return (len > 0) ? len : 0;
+}
+
+/** Look up a cached OCSP status
+ *
+ * On a hit &request:TLS-OCSP-Next-Update is added, the same as
+ * if the responder had been queried.
+ *
+ * @param[in] request the OCSP check is for.
+ * @param[in] cache to search.
+ * @param[in] issuer_cert of client_cert.
+ * @param[in] client_cert to find the status of.
+ * @param[out] status of the certificate.
+ * @return
+ *	- true if a usable entry was found.
+ *	- false if no entry was found, or it had expired.
+ */
+static bool ocsp_cache_find(REQUEST *request, tls_ocsp_cache_t *cache,
+			    X509 *issuer_cert, X509 *client_cert, ocsp_status_t *status)
+{
+	uint8_t			key[OCSP_CACHE_KEY_MAX];
+	tls_ocsp_cache_entry_t	find, *entry;
+	time_t			now = time(NULL), next_update = 0;
+	VALUE_PAIR		*vp;
+
+	find.key = key;
+	find.key_len = ocsp_cache_key(key, issuer_cert, client_cert);
+	if (!find.key_len) return false;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = fr_hash_table_finddata(cache->ht, &find);
+	if (entry) {
+		if (entry->next_update <= now) {
+			ocsp_cache_entry_free(cache, entry);
+		} else {
+			*status = entry->status;
+			next_update = entry->next_update;
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (!next_update) return false;
+
+	RDEBUG2("ocsp: Found cached response, certificate is %s", (*status == OCSP_STATUS_OK) ? "good" : "revoked");
+	RINDENT();
+	vp = pair_make_request("TLS-OCSP-Next-Update", NULL, T_OP_SET);
+	vp->vp_integer = next_update - now;
+	rdebug_pair(L_DBG_LVL_2, request, vp, NULL);
+	REXDENT();
+
+	return true;
+}
+
+/** Add or replace a cached OCSP status
+ *
+ * @param[in] cache to insert into.
+ * @param[in] issuer_cert of client_cert.
+ * @param[in] client_cert the status is for.
+ * @param[in] status of the certificate, either OCSP_STATUS_OK or OCSP_STATUS_FAILED.
+ * @param[in] next_update from the OCSP response.
+ */
+static void ocsp_cache_insert(tls_ocsp_cache_t *cache, X509 *issuer_cert, X509 *client_cert,
+			      ocsp_status_t status, time_t next_update)
+{
+	fr_tls_server_conf_t	*conf = cache->conf;
+	uint8_t			key[OCSP_CACHE_KEY_MAX];
+	size_t			key_len;
+	tls_ocsp_cache_entry_t	*entry, *old;
+
+	key_len = ocsp_cache_key(key, issuer_cert, client_cert);
+	if (!key_len) return;
+
+	entry = talloc_zero(NULL, tls_ocsp_cache_entry_t);
+	if (!entry) return;
+	talloc_set_destructor(entry, _ocsp_cache_entry_free);
+
+	entry->key = talloc_memdup(entry, key, key_len);
+	entry->key_len = key_len;
+	entry->status = status;
+	entry->next_update = next_update;
+
+	/*
+	 *	Revoked certificates don't become un-revoked, so
+	 *	there's no point keeping them fresh.
+	 */
+	if (conf->ocsp_cache_refresh && (status == OCSP_STATUS_OK)) {
+		entry->refresh = next_update - conf->ocsp_cache_refresh;
+		entry->issuer_cert = X509_dup(issuer_cert);
+		entry->client_cert = X509_dup(client_cert);
+		if (!entry->key || !entry->issuer_cert || !entry->client_cert) {
+			talloc_free(entry);
+			return;
+		}
+	} else {
+		entry->refresh = next_update;
+		if (!entry->key) {
+			talloc_free(entry);
+			return;
+		}
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+	old = fr_hash_table_finddata(cache->ht, entry);
+	if (old) ocsp_cache_entry_free(cache, old);
+
+	if (conf->ocsp_cache_max_entries && (cache->num_entries >= conf->ocsp_cache_max_entries)) {
+		ocsp_cache_entry_free(cache, cache->head);
+	}
+
+	if (!fr_hash_table_insert(cache->ht, entry)) {
+		pthread_mutex_unlock(&cache->mutex);
+		talloc_free(entry);
+		return;
+	}
+
+	entry->prev = cache->tail;
+	if (cache->tail) {
+		cache->tail->next = entry;
+	} else {
+		cache->head = entry;
+	}
+	cache->tail = entry;
+	cache->num_entries++;
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/*
+ * This function sends a OCSP request to a defined OCSP responder
+ * and checks the OCSP response for correctness.
+ */
+static int ocsp_check(REQUEST *request, X509_STORE *store,
+		      X509 *issuer_cert, X509 *client_cert,
+		      fr_tls_server_conf_t *conf, bool refresh)
+{
+	OCSP_CERTID	*certid;
+	OCSP_REQUEST	*req = NULL;
+	OCSP_RESPONSE	*resp = NULL;
+	OCSP_BASICRESP	*bresp = NULL;
+	char		*host = NULL;
+	char		*port = NULL;
+	char		*path = NULL;
+	char		host_header[1024];
+	int		use_ssl = -1;
+	long		this_fudge = MAX_VALIDITY_PERIOD, this_max_age = -1;
+	BIO		*conn = NULL, *ssl_log = NULL;
 	ocsp_status_t   ocsp_status = OCSP_STATUS_FAILED;
 	ocsp_status_t	status;
 	ASN1_GENERALIZEDTIME *rev, *this_update, *next_update;
@@ -1712,6 +2487,12 @@ static int ocsp_check(REQUEST *request, X509_STORE *store,
 	time_t		next;
 	VALUE_PAIR	*vp;
 
+	/*
+	 *	The refresh thread always wants to hear from the
+	 *	responder, and has no use for the virtual server.
+	 */
+	if (refresh) goto query;
+
 	if (conf->ocsp_cache_server) switch (cache_process(request, conf->ocsp_cache_server,
 							   CACHE_ACTION_OCSP_READ)) {
 	case RLM_MODULE_REJECT:
@@ -1755,6 +2536,11 @@ static int ocsp_check(REQUEST *request, X509_STORE *store,
 		break;
 	}
 
+	if (conf->ocsp_cache && ocsp_cache_find(request, conf->ocsp_cache, issuer_cert, client_cert, &ocsp_status)) {
+		goto finish;
+	}
+
+query:
 	/*
 	 *	Setup logging for this OCSP operation
 	 */
@@ -1915,142 +2701,778 @@ static int ocsp_check(REQUEST *request, X509_STORE *store,
 	}
 
 	/*
-	 *	Here we check the fields 'thisUpdate' and 'nextUpdate'
-	 *	from the OCSP response against the server's time.
-	 *
-	 *	this_fudge is the number of seconds +- between the current
-	 *	time and this_update.
-	 *
-	 *	The default for this_fudge is 300, defined by MAX_VALIDITY_PERIOD.
+	 *	Here we check the fields 'thisUpdate' and 'nextUpdate'
+	 *	from the OCSP response against the server's time.
+	 *
+	 *	this_fudge is the number of seconds +- between the current
+	 *	time and this_update.
+	 *
+	 *	The default for this_fudge is 300, defined by MAX_VALIDITY_PERIOD.
+	 */
+	if (!OCSP_check_validity(this_update, next_update, this_fudge, this_max_age)) {
+		/*
+		 *	We want this to show up in the global log
+		 *	so someone will fix it...
+		 */
+		RATE_LIMIT(RERROR("ocsp: Delta +/- between OCSP response time and our time is greater than %li "
+				  "seconds.  Check servers are synchronised to a common time source",
+				  this_fudge));
+		SSL_DRAIN_ERROR_QUEUE(REDEBUG, "ocsp: ", ssl_log);
+		goto finish;
+	}
+
+	/*
+	 *	Print any messages we may have accumulated
+	 */
+	SSL_DRAIN_ERROR_QUEUE(REDEBUG, "ocsp: ", ssl_log);
+	if (RDEBUG_ENABLED) {
+		RDEBUG2("ocsp: OCSP response valid from:");
+		ASN1_GENERALIZEDTIME_print(ssl_log, this_update);
+		RINDENT();
+		SSL_DRAIN_LOG_QUEUE(RDEBUG2, "", ssl_log);
+		REXDENT();
+
+		RDEBUG2("ocsp: New information available at:");
+		ASN1_GENERALIZEDTIME_print(ssl_log, next_update);
+		RINDENT();
+		SSL_DRAIN_LOG_QUEUE(RDEBUG2, "", ssl_log);
+		REXDENT();
+	}
+
+	/*
+	 *	Sometimes we already know what 'now' is depending
+	 *	on the code path, other times we don't.
+	 */
+	if (now.tv_sec == 0) gettimeofday(&now, NULL);
+	next = ocsp_asn1time_to_epoch(next_update);
+	if (now.tv_sec < next){
+		RDEBUG2("ocsp: Adding OCSP TTL attribute");
+		RINDENT();
+		vp = pair_make_request("TLS-OCSP-Next-Update", NULL, T_OP_SET);
+		vp->vp_integer = next - now.tv_sec;
+		rdebug_pair(L_DBG_LVL_2, request, vp, NULL);
+		REXDENT();
+	} else {
+		RDEBUG2("ocsp: Update time is in the past.  Not adding &TLS-OCSP-Next-Update");
+	}
+
+	switch (status) {
+	case V_OCSP_CERTSTATUS_GOOD:
+		RDEBUG2("ocsp: Cert status: good");
+		ocsp_status = OCSP_STATUS_OK;
+		if (conf->ocsp_cache && (now.tv_sec < next)) {
+			ocsp_cache_insert(conf->ocsp_cache, issuer_cert, client_cert, ocsp_status, next);
+		}
+		break;
+
+	default:
+		/* REVOKED / UNKNOWN */
+		REDEBUG("ocsp: Cert status: %s", OCSP_cert_status_str(status));
+		if (reason != -1) REDEBUG("ocsp: Reason: %s", OCSP_crl_reason_str(reason));
+
+		/*
+		 *	"unknown" may well change the next time the
+		 *	responder is asked, so only cache revocations.
+		 */
+		if (conf->ocsp_cache && (status == V_OCSP_CERTSTATUS_REVOKED) && (now.tv_sec < next)) {
+			ocsp_cache_insert(conf->ocsp_cache, issuer_cert, client_cert, OCSP_STATUS_FAILED, next);
+		}
+
+		/*
+		 *	Print any messages we may have accumulated
+		 */
+		SSL_DRAIN_LOG_QUEUE(RDEBUG, "ocsp: ", ssl_log);
+		if (RDEBUG_ENABLED) {
+			RDEBUG2("ocsp: Revocation time:");
+			ASN1_GENERALIZEDTIME_print(ssl_log, rev);
+			RINDENT();
+			SSL_DRAIN_LOG_QUEUE(RDEBUG2, "", ssl_log);
+			REXDENT();
+		}
+		break;
+	}
+
+finish:
+	/* Free OCSP Stuff */
+	OCSP_REQUEST_free(req);
+	OCSP_RESPONSE_free(resp);
+	free(host);
+	free(port);
+	free(path);
+	BIO_free_all(conn);
+	BIO_free(ssl_log);
+	OCSP_BASICRESP_free(bresp);
+
+	switch (ocsp_status) {
+	case OCSP_STATUS_OK:
+		RDEBUG2("ocsp: Certificate is valid");
+		vp = pair_make_request("TLS-OCSP-Cert-Valid", NULL, T_OP_SET);
+		vp->vp_integer = 1;	/* yes */
+		ocsp_status = OCSP_STATUS_OK;
+		break;
+
+	case OCSP_STATUS_SKIPPED:
+	skipped:
+		vp = pair_make_request("TLS-OCSP-Cert-Valid", NULL, T_OP_SET);
+		vp->vp_integer = 2;	/* skipped */
+		if (conf->ocsp_softfail) {
+			RWDEBUG("ocsp: Unable to check certificate, assuming it's valid");
+			RWDEBUG("ocsp: This may be insecure");
+			ocsp_status = OCSP_STATUS_OK;
+
+			/* Remove OpenSSL errors from queue or handshake will fail */
+			while (ERR_get_error());
+		} else {
+			REDEBUG("ocsp: Unable to check certificate, failing");
+			ocsp_status = OCSP_STATUS_FAILED;
+		}
+		break;
+
+	default:
+		vp = pair_make_request("TLS-OCSP-Cert-Valid", NULL, T_OP_SET);
+		vp->vp_integer = 0;	/* no */
+		REDEBUG("ocsp: Failed to validate certificate");
+		break;
+	}
+
+	if (conf->ocsp_cache_server && !refresh) switch (cache_process(request, conf->ocsp_cache_server, CACHE_ACTION_OCSP_WRITE)) {
+	case RLM_MODULE_OK:
+	case RLM_MODULE_UPDATED:
+		break;
+
+	default:
+		RWDEBUG("Failed writing cached OCSP status");
+		break;
+	}
+
+	return ocsp_status;
+}
+
+/** Re-query the OCSP responder for cached entries which are close to nextUpdate
+ *
+ * Runs until the cache is freed.  The responder is queried with the cache
+ * unlocked, so lookups are never blocked behind a slow responder.
+ */
+static void *ocsp_cache_refresh_thread(void *arg)
+{
+	tls_ocsp_cache_t	*cache = arg;
+	fr_tls_server_conf_t	*conf = cache->conf;
+	tls_ocsp_cache_entry_t	*entry, *next;
+	struct timespec		wait;
+	time_t			now;
+
+	pthread_mutex_lock(&cache->mutex);
+	while (!cache->stop) {
+		wait.tv_sec = time(NULL) + 1;
+		wait.tv_nsec = 0;
+		pthread_cond_timedwait(&cache->cond, &cache->mutex, &wait);
+
+	again:
+		if (cache->stop) break;
+
+		now = time(NULL);
+		for (entry = cache->head; entry; entry = next) {
+			REQUEST		*request;
+			X509		*issuer_cert, *client_cert;
+
+			next = entry->next;
+
+			if (entry->next_update <= now) {
+				ocsp_cache_entry_free(cache, entry);
+				continue;
+			}
+			if (!entry->client_cert || (entry->refresh > now)) continue;
+
+			/*
+			 *	If the responder doesn't answer, we try
+			 *	again later.  If it does, the entry is
+			 *	replaced.
+			 */
+			entry->refresh = now + OCSP_CACHE_RETRY;
+
+			issuer_cert = X509_dup(entry->issuer_cert);
+			client_cert = X509_dup(entry->client_cert);
+			pthread_mutex_unlock(&cache->mutex);
+
+			request = request_alloc(NULL);
+			if (request && issuer_cert && client_cert) {
+				request->packet = fr_radius_alloc(request, false);
+				request->reply = fr_radius_alloc(request, false);
+
+				DEBUG2(LOG_PREFIX ": Refreshing cached OCSP response");
+				(void) ocsp_check(request, conf->ocsp_store, issuer_cert, client_cert, conf, true);
+			}
+			talloc_free(request);
+			X509_free(issuer_cert);
+			X509_free(client_cert);
+
+			/*
+			 *	The list may have changed while it was
+			 *	unlocked, so start again from the top.
+			 *	Entries we've already tried are skipped,
+			 *	as their refresh time is in the future.
+			 */
+			pthread_mutex_lock(&cache->mutex);
+			goto again;
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return NULL;
+}
+
+static int _ocsp_cache_free(tls_ocsp_cache_t *cache)
+{
+	if (cache->running) {
+		pthread_mutex_lock(&cache->mutex);
+		cache->stop = true;
+		pthread_cond_signal(&cache->cond);
+		pthread_mutex_unlock(&cache->mutex);
+
+		pthread_join(cache->thread, NULL);
+	}
+
+	while (cache->head) ocsp_cache_entry_free(cache, cache->head);
+
+	pthread_cond_destroy(&cache->cond);
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate the OCSP response cache, and start its refresh thread
+ *
+ * @param[in] conf to allocate the cache for.  conf->ocsp_store must already be initialised.
+ * @return
+ *	- The new cache.
+ *	- NULL on error.
+ */
+static tls_ocsp_cache_t *ocsp_cache_alloc(fr_tls_server_conf_t *conf)
+{
+	tls_ocsp_cache_t *cache;
+
+	cache = talloc_zero(conf, tls_ocsp_cache_t);
+	if (!cache) return NULL;
+
+	cache->conf = conf;
+	cache->ht = fr_hash_table_create(cache, ocsp_cache_entry_hash, ocsp_cache_entry_cmp, NULL);
+	if (!cache->ht) {
+		talloc_free(cache);
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+		talloc_free(cache);
+		return NULL;
+	}
+
+	if (pthread_cond_init(&cache->cond, NULL) != 0) {
+		pthread_mutex_destroy(&cache->mutex);
+		talloc_free(cache);
+		return NULL;
+	}
+	talloc_set_destructor(cache, _ocsp_cache_free);
+
+	if (conf->ocsp_cache_refresh) {
+		if (pthread_create(&cache->thread, NULL, ocsp_cache_refresh_thread, cache) != 0) {
+			ERROR(LOG_PREFIX ": Failed starting OCSP cache refresh thread: %s", fr_syserror(errno));
+			talloc_free(cache);
+			return NULL;
+		}
+		cache->running = true;
+	}
+
+	return cache;
+}
+#endif	/* HAVE_OPENSSL_OCSP_H */
+
+/*
+ *	Indexed CRL store.
+ *
+ *	OpenSSL searches the revoked list of each CRL linearly, and
+ *	only picks up new CRLs when the server is reloaded.  When
+ *	'crl_file' is set we load the CRLs ourselves, and index the
+ *	revoked serials by (issuer, serial).  A thread checks the
+ *	file for changes, builds a new index, and swaps it in.
+ *	Lookups only hold the mutex while searching the hash tables,
+ *	so handshakes aren't held up while the new index is built.
+ */
+typedef struct tls_crl_issuer {
+	uint8_t			id[SHA_DIGEST_LENGTH];	//!< SHA1 of the issuer name.
+	time_t			next_update;	//!< When the newest CRL for this issuer expires.
+						//!< 0 if it doesn't.
+} tls_crl_issuer_t;
+
+typedef struct tls_crl_serial {
+	uint8_t			*key;		//!< Issuer ID, followed by the serial number.
+	size_t			key_len;
+} tls_crl_serial_t;
+
+typedef struct tls_crl_index {
+	fr_hash_table_t		*issuers;	//!< Issuers we have CRLs for.
+	fr_hash_table_t		*serials;	//!< Revoked certificates.
+	uint32_t		num_crls;
+	uint32_t		num_revoked;
+} tls_crl_index_t;
+
+struct tls_crl_store {
+	fr_tls_server_conf_t	*conf;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	tls_crl_index_t		*index;		//!< Current index.  Only replaced with the mutex held.
+	struct stat		st;		//!< Of crl_file, when the current index was built.
+
+	bool			running;	//!< Whether the check thread was started.
+	bool			stop;		//!< Tell the check thread to exit.
+	pthread_t		thread;
+};
+
+/*
+ *	RFC 5280 limits serial numbers to 20 octets, but leave
+ *	some room for CAs which don't follow it.
+ */
+#define CRL_SERIAL_MAX_LEN	(64)
+
+static uint32_t crl_issuer_hash(void const *data)
+{
+	tls_crl_issuer_t const *issuer = data;
+
+	return fr_hash(issuer->id, sizeof(issuer->id));
+}
+
+static int crl_issuer_cmp(void const *one, void const *two)
+{
+	tls_crl_issuer_t const *a = one, *b = two;
+
+	return memcmp(a->id, b->id, sizeof(a->id));
+}
+
+static uint32_t crl_serial_hash(void const *data)
+{
+	tls_crl_serial_t const *serial = data;
+
+	return fr_hash(serial->key, serial->key_len);
+}
+
+static int crl_serial_cmp(void const *one, void const *two)
+{
+	tls_crl_serial_t const *a = one, *b = two;
+
+	if (a->key_len != b->key_len) return (a->key_len < b->key_len) ? -1 : +1;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+/** Check the signature on a CRL against the CA certificates
+ *
+ * @param[in] conf with the CA file and path.
+ * @param[in] crl to check.
+ * @return
+ *	- 0 if the CRL was signed by a CA we trust.
+ *	- -1 on error.
+ */
+static int crl_verify(fr_tls_server_conf_t *conf, X509_CRL *crl)
+{
+	X509_STORE	*store;
+	X509_STORE_CTX	*vctx;
+	EVP_PKEY	*pkey = NULL;
+	int		ret = -1;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	X509_OBJECT	*obj;
+#else
+	X509_OBJECT	obj;
+#endif
+
+	store = X509_STORE_new();
+	if (!store) return -1;
+
+	/*
+	 *	Load the CAs each time, so that the CA which signed
+	 *	a new CRL doesn't also need a reload.
+	 */
+	if (!X509_STORE_load_locations(store, conf->ca_file, conf->ca_path)) {
+		ERROR(LOG_PREFIX ": Error reading Trusted root CA list: %s", ERR_error_string(ERR_get_error(), NULL));
+		X509_STORE_free(store);
+		return -1;
+	}
+
+	vctx = X509_STORE_CTX_new();
+	if (!vctx || !X509_STORE_CTX_init(vctx, store, NULL, NULL)) goto finish;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	obj = X509_STORE_CTX_get_obj_by_subject(vctx, X509_LU_X509, X509_CRL_get_issuer(crl));
+	if (obj) {
+		pkey = X509_get_pubkey(X509_OBJECT_get0_X509(obj));
+		X509_OBJECT_free(obj);
+	}
+#else
+	if (X509_STORE_get_by_subject(vctx, X509_LU_X509, X509_CRL_get_issuer(crl), &obj) == 1) {
+		pkey = X509_get_pubkey(obj.data.x509);
+		X509_OBJECT_free_contents(&obj);
+	}
+#endif
+	if (!pkey) goto finish;
+
+	if (X509_CRL_verify(crl, pkey) == 1) ret = 0;
+	EVP_PKEY_free(pkey);
+
+finish:
+	if (vctx) X509_STORE_CTX_free(vctx);
+	X509_STORE_free(store);
+
+	return ret;
+}
+
+/** Add the revoked serials from a CRL to an index
+ *
+ * @param[in] conf the index is being built for.
+ * @param[in] index to add the serials to.
+ * @param[in] crl to add.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+static int crl_index_add(fr_tls_server_conf_t *conf, tls_crl_index_t *index, X509_CRL *crl)
+{
+	tls_crl_issuer_t	*issuer, find;
+	STACK_OF(X509_REVOKED)	*revoked;
+	ASN1_TIME		*asn_time;
+	time_t			next_update = 0;
+	unsigned int		len;
+	char			name[256];
+	int			i;
+
+	X509_NAME_oneline(X509_CRL_get_issuer(crl), name, sizeof(name));
+	name[sizeof(name) - 1] = '\0';
+
+	if (crl_verify(conf, crl) < 0) {
+		ERROR(LOG_PREFIX ": Couldn't verify the signature on the CRL issued by %s", name);
+		return -1;
+	}
+
+	if (!X509_NAME_digest(X509_CRL_get_issuer(crl), EVP_sha1(), find.id, &len)) return -1;
+
+	asn_time = X509_CRL_get_nextUpdate(crl);
+	if (asn_time) {
+		int days, secs;
+
+		if (!ASN1_TIME_diff(&days, &secs, NULL, asn_time)) {
+			ERROR(LOG_PREFIX ": Invalid nextUpdate in the CRL issued by %s", name);
+			return -1;
+		}
+		next_update = time(NULL) + ((time_t) days * 86400) + secs;
+	}
+
+	issuer = fr_hash_table_finddata(index->issuers, &find);
+	if (!issuer) {
+		issuer = talloc_zero(index, tls_crl_issuer_t);
+		if (!issuer) return -1;
+
+		memcpy(issuer->id, find.id, sizeof(issuer->id));
+		issuer->next_update = next_update;
+		if (!fr_hash_table_insert(index->issuers, issuer)) {
+			talloc_free(issuer);
+			return -1;
+		}
+
+	/*
+	 *	An issuer with several CRLs is current until
+	 *	the last one expires.
+	 */
+	} else if (issuer->next_update && (!next_update || (next_update > issuer->next_update))) {
+		issuer->next_update = next_update;
+	}
+
+	revoked = X509_CRL_get_REVOKED(crl);
+	for (i = 0; i < sk_X509_REVOKED_num(revoked); i++) {
+		tls_crl_serial_t	*serial;
+		ASN1_INTEGER const	*sn;
+
+		sn = X509_REVOKED_get0_serialNumber(sk_X509_REVOKED_value(revoked, i));
+		if (!sn || (sn->length <= 0) || (sn->length > CRL_SERIAL_MAX_LEN)) continue;
+
+		serial = talloc_zero(index, tls_crl_serial_t);
+		if (!serial) return -1;
+
+		serial->key_len = sizeof(issuer->id) + sn->length;
+		serial->key = talloc_array(serial, uint8_t, serial->key_len);
+		if (!serial->key) {
+			talloc_free(serial);
+			return -1;
+		}
+		memcpy(serial->key, issuer->id, sizeof(issuer->id));
+		memcpy(serial->key + sizeof(issuer->id), sn->data, sn->length);
+
+		/*
+		 *	Serials may be listed in more than one CRL.
+		 */
+		if (!fr_hash_table_insert(index->serials, serial)) {
+			talloc_free(serial);
+			continue;
+		}
+		index->num_revoked++;
+	}
+
+	index->num_crls++;
+	DEBUG3(LOG_PREFIX ": Indexed %i revoked serials from the CRL issued by %s",
+	       sk_X509_REVOKED_num(revoked), name);
+
+	return 0;
+}
+
+/** Load the CRLs in crl_file, and index them
+ *
+ * @param[in] conf with the CRL file.
+ * @return
+ *	- The new index.
+ *	- NULL on error.
+ */
+static tls_crl_index_t *crl_index_alloc(fr_tls_server_conf_t *conf)
+{
+	tls_crl_index_t	*index;
+	X509_CRL	*crl;
+	BIO		*bio;
+	unsigned long	err;
+
+	bio = BIO_new_file(conf->crl_file, "r");
+	if (!bio) {
+		ERROR(LOG_PREFIX ": Failed opening %s: %s", conf->crl_file, ERR_error_string(ERR_get_error(), NULL));
+		return NULL;
+	}
+
+	/*
+	 *	Not parented by the store, as indexes are built
+	 *	and freed by the check thread.
+	 */
+	index = talloc_zero(NULL, tls_crl_index_t);
+	if (!index) goto error;
+
+	index->issuers = fr_hash_table_create(index, crl_issuer_hash, crl_issuer_cmp, NULL);
+	index->serials = fr_hash_table_create(index, crl_serial_hash, crl_serial_cmp, NULL);
+	if (!index->issuers || !index->serials) goto error;
+
+	while ((crl = PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL)) != NULL) {
+		if (crl_index_add(conf, index, crl) < 0) {
+			X509_CRL_free(crl);
+			goto error;
+		}
+		X509_CRL_free(crl);
+	}
+
+	/*
+	 *	Running out of CRLs looks like an error too.  Anything
+	 *	else means the file is corrupt, or still being written.
 	 */
-	if (!OCSP_check_validity(this_update, next_update, this_fudge, this_max_age)) {
-		/*
-		 *	We want this to show up in the global log
-		 *	so someone will fix it...
-		 */
-		RATE_LIMIT(RERROR("ocsp: Delta +/- between OCSP response time and our time is greater than %li "
-				  "seconds.  Check servers are synchronised to a common time source",
-				  this_fudge));
-		SSL_DRAIN_ERROR_QUEUE(REDEBUG, "ocsp: ", ssl_log);
-		goto finish;
+	err = ERR_peek_last_error();
+	if (err && (ERR_GET_REASON(err) != PEM_R_NO_START_LINE)) {
+		ERROR(LOG_PREFIX ": Failed reading CRLs from %s: %s", conf->crl_file, ERR_error_string(err, NULL));
+		goto error;
 	}
+	ERR_clear_error();
+
+	if (!index->num_crls) {
+		ERROR(LOG_PREFIX ": No CRLs found in %s", conf->crl_file);
+		goto error;
+	}
+	BIO_free(bio);
+
+	DEBUG2(LOG_PREFIX ": Loaded %u revoked serials from %u CRLs in %s",
+	       index->num_revoked, index->num_crls, conf->crl_file);
+
+	return index;
+
+error:
+	ERR_clear_error();
+	BIO_free(bio);
+	talloc_free(index);
+
+	return NULL;
+}
+
+/** Check whether a certificate has been revoked
+ *
+ * @param[in] store to search.
+ * @param[in] cert to check.
+ * @return
+ *	- X509_V_OK if the certificate hasn't been revoked.
+ *	- X509_V_ERR_CERT_REVOKED if it has.
+ *	- X509_V_ERR_CRL_HAS_EXPIRED if the issuer's CRLs have expired.
+ *	- X509_V_ERR_UNABLE_TO_GET_CRL if we have no CRL for the issuer.
+ */
+static int crl_store_check(tls_crl_store_t *store, X509 *cert)
+{
+	tls_crl_issuer_t	*issuer, find_issuer;
+	tls_crl_serial_t	find_serial;
+	ASN1_INTEGER		*sn;
+	uint8_t			key[SHA_DIGEST_LENGTH + CRL_SERIAL_MAX_LEN];
+	unsigned int		len;
+	time_t			next_update = 0;
+	bool			found, revoked = false;
 
 	/*
-	 *	Print any messages we may have accumulated
+	 *	Roots don't have CRLs, they're trusted directly.
 	 */
-	SSL_DRAIN_ERROR_QUEUE(REDEBUG, "ocsp: ", ssl_log);
-	if (RDEBUG_ENABLED) {
-		RDEBUG2("ocsp: OCSP response valid from:");
-		ASN1_GENERALIZEDTIME_print(ssl_log, this_update);
-		RINDENT();
-		SSL_DRAIN_LOG_QUEUE(RDEBUG2, "", ssl_log);
-		REXDENT();
+	if (X509_check_issued(cert, cert) == X509_V_OK) return X509_V_OK;
 
-		RDEBUG2("ocsp: New information available at:");
-		ASN1_GENERALIZEDTIME_print(ssl_log, next_update);
-		RINDENT();
-		SSL_DRAIN_LOG_QUEUE(RDEBUG2, "", ssl_log);
-		REXDENT();
+	sn = X509_get_serialNumber(cert);
+	if (!sn || (sn->length <= 0) || (sn->length > CRL_SERIAL_MAX_LEN)) return X509_V_ERR_UNABLE_TO_GET_CRL;
+
+	if (!X509_NAME_digest(X509_get_issuer_name(cert), EVP_sha1(), find_issuer.id, &len)) {
+		return X509_V_ERR_UNABLE_TO_GET_CRL;
 	}
 
-	/*
-	 *	Sometimes we already know what 'now' is depending
-	 *	on the code path, other times we don't.
-	 */
-	if (now.tv_sec == 0) gettimeofday(&now, NULL);
-	next = ocsp_asn1time_to_epoch(next_update);
-	if (now.tv_sec < next){
-		RDEBUG2("ocsp: Adding OCSP TTL attribute");
-		RINDENT();
-		vp = pair_make_request("TLS-OCSP-Next-Update", NULL, T_OP_SET);
-		vp->vp_integer = next - now.tv_sec;
-		rdebug_pair(L_DBG_LVL_2, request, vp, NULL);
-		REXDENT();
-	} else {
-		RDEBUG2("ocsp: Update time is in the past.  Not adding &TLS-OCSP-Next-Update");
+	memcpy(key, find_issuer.id, sizeof(find_issuer.id));
+	memcpy(key + sizeof(find_issuer.id), sn->data, sn->length);
+	find_serial.key = key;
+	find_serial.key_len = sizeof(find_issuer.id) + sn->length;
+
+	pthread_mutex_lock(&store->mutex);
+	issuer = fr_hash_table_finddata(store->index->issuers, &find_issuer);
+	found = (issuer != NULL);
+	if (found) {
+		next_update = issuer->next_update;
+		revoked = (fr_hash_table_finddata(store->index->serials, &find_serial) != NULL);
 	}
+	pthread_mutex_unlock(&store->mutex);
 
-	switch (status) {
-	case V_OCSP_CERTSTATUS_GOOD:
-		RDEBUG2("ocsp: Cert status: good");
-		ocsp_status = OCSP_STATUS_OK;
-		break;
+	if (!found) return X509_V_ERR_UNABLE_TO_GET_CRL;
+	if (revoked) return X509_V_ERR_CERT_REVOKED;
+	if (next_update && (next_update < time(NULL))) return X509_V_ERR_CRL_HAS_EXPIRED;
 
-	default:
-		/* REVOKED / UNKNOWN */
-		REDEBUG("ocsp: Cert status: %s", OCSP_cert_status_str(status));
-		if (reason != -1) REDEBUG("ocsp: Reason: %s", OCSP_crl_reason_str(reason));
+	return X509_V_OK;
+}
+
+static void *crl_store_check_thread(void *arg)
+{
+	tls_crl_store_t		*store = arg;
+	fr_tls_server_conf_t	*conf = store->conf;
+	struct timespec		wait;
+
+	pthread_mutex_lock(&store->mutex);
+	while (!store->stop) {
+		struct stat	st;
+		tls_crl_index_t	*index, *old;
+
+		wait.tv_sec = time(NULL) + conf->crl_check_interval;
+		wait.tv_nsec = 0;
+		pthread_cond_timedwait(&store->cond, &store->mutex, &wait);
+		if (store->stop) break;
 
 		/*
-		 *	Print any messages we may have accumulated
+		 *	Only this thread changes store->st, so it can
+		 *	be read without the mutex.
 		 */
-		SSL_DRAIN_LOG_QUEUE(RDEBUG, "ocsp: ", ssl_log);
-		if (RDEBUG_ENABLED) {
-			RDEBUG2("ocsp: Revocation time:");
-			ASN1_GENERALIZEDTIME_print(ssl_log, rev);
-			RINDENT();
-			SSL_DRAIN_LOG_QUEUE(RDEBUG2, "", ssl_log);
-			REXDENT();
+		pthread_mutex_unlock(&store->mutex);
+
+		if (stat(conf->crl_file, &st) < 0) {
+			ERROR(LOG_PREFIX ": Failed checking %s: %s", conf->crl_file, fr_syserror(errno));
+			goto next;
 		}
-		break;
+
+		if ((st.st_mtime == store->st.st_mtime) && (st.st_size == store->st.st_size) &&
+		    (st.st_ino == store->st.st_ino)) goto next;
+
+		/*
+		 *	If the new file can't be loaded, we keep the
+		 *	old index, and try again at the next check.
+		 */
+		index = crl_index_alloc(conf);
+		if (!index) {
+			ERROR(LOG_PREFIX ": Failed reloading %s, continuing with the previous CRLs", conf->crl_file);
+			goto next;
+		}
+
+		pthread_mutex_lock(&store->mutex);
+		old = store->index;
+		store->index = index;
+		store->st = st;
+		pthread_mutex_unlock(&store->mutex);
+
+		talloc_free(old);
+		INFO(LOG_PREFIX ": Reloaded %u revoked serials from %s", index->num_revoked, conf->crl_file);
+
+	next:
+		pthread_mutex_lock(&store->mutex);
 	}
+	pthread_mutex_unlock(&store->mutex);
 
-finish:
-	/* Free OCSP Stuff */
-	OCSP_REQUEST_free(req);
-	OCSP_RESPONSE_free(resp);
-	free(host);
-	free(port);
-	free(path);
-	BIO_free_all(conn);
-	BIO_free(ssl_log);
-	OCSP_BASICRESP_free(bresp);
+	return NULL;
+}
 
-	switch (ocsp_status) {
-	case OCSP_STATUS_OK:
-		RDEBUG2("ocsp: Certificate is valid");
-		vp = pair_make_request("TLS-OCSP-Cert-Valid", NULL, T_OP_SET);
-		vp->vp_integer = 1;	/* yes */
-		ocsp_status = OCSP_STATUS_OK;
-		break;
+static int _crl_store_free(tls_crl_store_t *store)
+{
+	if (store->running) {
+		pthread_mutex_lock(&store->mutex);
+		store->stop = true;
+		pthread_cond_signal(&store->cond);
+		pthread_mutex_unlock(&store->mutex);
 
-	case OCSP_STATUS_SKIPPED:
-	skipped:
-		vp = pair_make_request("TLS-OCSP-Cert-Valid", NULL, T_OP_SET);
-		vp->vp_integer = 2;	/* skipped */
-		if (conf->ocsp_softfail) {
-			RWDEBUG("ocsp: Unable to check certificate, assuming it's valid");
-			RWDEBUG("ocsp: This may be insecure");
-			ocsp_status = OCSP_STATUS_OK;
+		pthread_join(store->thread, NULL);
+	}
 
-			/* Remove OpenSSL errors from queue or handshake will fail */
-			while (ERR_get_error());
-		} else {
-			REDEBUG("ocsp: Unable to check certificate, failing");
-			ocsp_status = OCSP_STATUS_FAILED;
-		}
-		break;
+	talloc_free(store->index);
 
-	default:
-		vp = pair_make_request("TLS-OCSP-Cert-Valid", NULL, T_OP_SET);
-		vp->vp_integer = 0;	/* no */
-		REDEBUG("ocsp: Failed to validate certificate");
-		break;
+	pthread_cond_destroy(&store->cond);
+	pthread_mutex_destroy(&store->mutex);
+
+	return 0;
+}
+
+/** Load and index the CRLs in crl_file, and start the thread which checks it for changes
+ *
+ * @param[in] conf to allocate the store for.
+ * @return
+ *	- The new store.
+ *	- NULL on error.
+ */
+static tls_crl_store_t *crl_store_alloc(fr_tls_server_conf_t *conf)
+{
+	tls_crl_store_t *store;
+
+	store = talloc_zero(conf, tls_crl_store_t);
+	if (!store) return NULL;
+
+	store->conf = conf;
+
+	if (pthread_mutex_init(&store->mutex, NULL) != 0) {
+		talloc_free(store);
+		return NULL;
 	}
 
-	if (conf->ocsp_cache_server) switch (cache_process(request, conf->ocsp_cache_server, CACHE_ACTION_OCSP_WRITE)) {
-	case RLM_MODULE_OK:
-	case RLM_MODULE_UPDATED:
-		break;
+	if (pthread_cond_init(&store->cond, NULL) != 0) {
+		pthread_mutex_destroy(&store->mutex);
+		talloc_free(store);
+		return NULL;
+	}
+	talloc_set_destructor(store, _crl_store_free);
 
-	default:
-		RWDEBUG("Failed writing cached OCSP status");
-		break;
+	/*
+	 *	stat() first, so that changes made while we're
+	 *	loading the file are picked up by the next check.
+	 */
+	if (stat(conf->crl_file, &store->st) < 0) {
+		ERROR(LOG_PREFIX ": Failed reading %s: %s", conf->crl_file, fr_syserror(errno));
+		talloc_free(store);
+		return NULL;
 	}
 
-	return ocsp_status;
+	store->index = crl_index_alloc(conf);
+	if (!store->index) {
+		talloc_free(store);
+		return NULL;
+	}
+
+	if (conf->crl_check_interval) {
+		if (pthread_create(&store->thread, NULL, crl_store_check_thread, store) != 0) {
+			ERROR(LOG_PREFIX ": Failed starting CRL check thread: %s", fr_syserror(errno));
+			talloc_free(store);
+			return NULL;
+		}
+		store->running = true;
+	}
+
+	return store;
 }
-#endif	/* HAVE_OPENSSL_OCSP_H */
 
 /*
  *	For creating certificate attributes.
@@ -2288,6 +3710,18 @@ do { \
 		if (names != NULL) sk_GENERAL_NAME_free(names);
 	}
 
+	/*
+	 *	Check the indexed CRLs.  Intermediate CAs are only
+	 *	checked if we've been told to.
+	 */
+	if (my_ok && conf->crl_store && ((depth == 0) || conf->check_all_crl)) {
+		err = crl_store_check(conf->crl_store, client_cert);
+		if (err != X509_V_OK) {
+			X509_STORE_CTX_set_error(ctx, err);
+			my_ok = 0;
+		}
+	}
+
 	/*
 	 *	If the CRL has expired, that might still be OK.
 	 */
@@ -2374,7 +3808,7 @@ do { \
 		 *	cert_vps have a different talloc parent, so we
 		 *	can't just reference them.
 		 */
-		fr_pair_list_mcopy_by_num(request->state_ctx, &request->state, &cert_vps, 0, 0, TAG_ANY);
+		fr_pair_list_mcopy_by_num(request_state_ctx(request), &request->state, &cert_vps, 0, 0, TAG_ANY);
 		fr_pair_list_free(&cert_vps);
 	}
 
@@ -2499,7 +3933,7 @@ do { \
 			if (X509_STORE_CTX_get1_issuer(&issuer_cert, ctx, client_cert) != 1) {
 				RERROR("Couldn't get issuer_cert for %s", common_name);
 			} else {
-				my_ok = ocsp_check(request, ocsp_store, issuer_cert, client_cert, conf);
+				my_ok = ocsp_check(request, ocsp_store, issuer_cert, client_cert, conf, false);
 			}
 		}
 #endif
@@ -3152,6 +4586,14 @@ post_ca:
 		SSL_CTX_set_mode(ctx, SSL_MODE_NO_AUTO_CHAIN);
 	}
 
+#ifdef SSL_MODE_ASYNC
+	/*
+	 *	Allow the engine to run private key operations
+	 *	as async jobs.
+	 */
+	if (conf->async) SSL_CTX_set_mode(ctx, SSL_MODE_ASYNC);
+#endif
+
 	/* Set Info callback */
 	SSL_CTX_set_info_callback(ctx, cbtls_info);
 
@@ -3163,7 +4605,26 @@ post_ca:
 			SSL_CTX_sess_set_new_cb(ctx, cache_write_session);
 			SSL_CTX_sess_set_get_cb(ctx, cache_read_session);
 			SSL_CTX_sess_set_remove_cb(ctx, cache_delete_session);
+
+		} else if (conf->session_cache) {
+			SSL_CTX_sess_set_new_cb(ctx, shared_cache_write_session);
+			SSL_CTX_sess_set_get_cb(ctx, shared_cache_read_session);
+			SSL_CTX_sess_set_remove_cb(ctx, shared_cache_delete_session);
+		}
+
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+		/*
+		 *	Tickets encrypted with OpenSSL's own keys can
+		 *	only be decrypted by the SSL_CTX which issued
+		 *	them, so either use our shared keys, or make
+		 *	the client resume by session ID.
+		 */
+		if (conf->ticket_keys) {
+			SSL_CTX_set_tlsext_ticket_key_cb(ctx, tls_ticket_key_cb);
+		} else {
+			SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
 		}
+#endif
 
 		SSL_CTX_set_quiet_shutdown(ctx, 1);
 	}
@@ -3172,7 +4633,7 @@ post_ca:
 	 *	Check the certificates for revocation.
 	 */
 #ifdef X509_V_FLAG_CRL_CHECK
-	if (conf->check_crl) {
+	if (conf->check_crl && !conf->crl_file) {
 		cert_vpstore = SSL_CTX_get_cert_store(ctx);
 		if (cert_vpstore == NULL) {
 			ERROR(LOG_PREFIX ": SSL error %s", ERR_error_string(ERR_get_error(), NULL));
@@ -3225,12 +4686,18 @@ post_ca:
 	 */
 	if (conf->session_cache_enable) {
 		/*
-		 *	If a virtual server is caching the TLS
-		 *	sessions, then don't use the internal cache.
+		 *	If a virtual server, or the shared cache is
+		 *	caching the TLS sessions, then don't use the
+		 *	internal cache.
 		 */
-		if (conf->session_cache_server) {
+		if (conf->session_cache_server || conf->session_cache) {
 			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
 
+			/*
+			 *	Our timeout is in hours, this is in seconds.
+			 */
+			SSL_CTX_set_timeout(ctx, conf->session_timeout * 3600);
+
 		} else {	/* in-memory cache. */
 			/*
 			 *	Cache it, and DON'T auto-clear it.
@@ -3286,6 +4753,51 @@ post_ca:
  *	added to automatically free the data when the CONF_SECTION
  *	is freed.
  */
+#ifdef HAVE_OPENSSL_ENGINE_H
+/** Load the configured crypto engine, and make it the default for public key operations
+ *
+ * Hardware engines (e.g. Intel QAT) do RSA, DH and EC operations far faster
+ * than the CPU, and with 'async' set, the worker thread sleeps while they do.
+ *
+ * @param[in] conf with the engine to load.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int tls_engine_init(fr_tls_server_conf_t *conf)
+{
+	ENGINE *e;
+
+	e = ENGINE_by_id(conf->engine_id);
+	if (!e) {
+		ERROR(LOG_PREFIX ": Failed loading engine \"%s\": %s", conf->engine_id,
+		      ERR_error_string(ERR_get_error(), NULL));
+		return -1;
+	}
+
+	if (!ENGINE_init(e)) {
+		ERROR(LOG_PREFIX ": Failed initialising engine \"%s\": %s", conf->engine_id,
+		      ERR_error_string(ERR_get_error(), NULL));
+		ENGINE_free(e);
+		return -1;
+	}
+
+	if (!ENGINE_set_default(e, ENGINE_METHOD_RSA | ENGINE_METHOD_DSA | ENGINE_METHOD_DH |
+				ENGINE_METHOD_EC | ENGINE_METHOD_PKEY_METHS)) {
+		ERROR(LOG_PREFIX ": Failed setting engine \"%s\" as the default: %s", conf->engine_id,
+		      ERR_error_string(ERR_get_error(), NULL));
+		ENGINE_finish(e);
+		ENGINE_free(e);
+		return -1;
+	}
+
+	DEBUG2(LOG_PREFIX ": Using engine \"%s\" (%s)", ENGINE_get_id(e), ENGINE_get_name(e));
+	conf->engine = e;
+
+	return 0;
+}
+#endif
+
 static int _tls_server_conf_free(fr_tls_server_conf_t *conf)
 {
 	uint32_t i;
@@ -3293,10 +4805,23 @@ static int _tls_server_conf_free(fr_tls_server_conf_t *conf)
 	for (i = 0; i < conf->ctx_count; i++) SSL_CTX_free(conf->ctx[i]);
 
 #ifdef HAVE_OPENSSL_OCSP_H
+	/*
+	 *	Stop the refresh thread before the store it uses
+	 *	goes away.
+	 */
+	TALLOC_FREE(conf->ocsp_cache);
 	if (conf->ocsp_store) X509_STORE_free(conf->ocsp_store);
 	conf->ocsp_store = NULL;
 #endif
 
+#ifdef HAVE_OPENSSL_ENGINE_H
+	if (conf->engine) {
+		ENGINE_finish(conf->engine);
+		ENGINE_free(conf->engine);
+		conf->engine = NULL;
+	}
+#endif
+
 #ifndef NDEBUG
 	memset(conf, 0, sizeof(*conf));
 #endif
@@ -3359,7 +4884,7 @@ fr_tls_server_conf_t *tls_server_conf_parse(CONF_SECTION *cs)
 	/*
 	 *	Setup session caching
 	 */
-	if (conf->session_cache_enable && conf->session_cache_server) {
+	if (conf->session_cache_enable) {
 		/*
 		 *	Create a unique context Id per EAP-TLS configuration.
 		 */
@@ -3370,6 +4895,47 @@ fr_tls_server_conf_t *tls_server_conf_parse(CONF_SECTION *cs)
 			snprintf(conf->session_context_id, sizeof(conf->session_context_id),
 				 "FR eap %p", conf);
 		}
+
+		if (!conf->session_cache_server) {
+			conf->session_cache = tls_session_cache_alloc(conf, conf->session_timeout * 3600,
+								      conf->session_cache_size);
+			if (!conf->session_cache) {
+				ERROR(LOG_PREFIX ": Failed allocating session cache");
+				goto error;
+			}
+		}
+
+		if (conf->session_tickets) {
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+			if (conf->ticket_key_lifetime < 60) conf->ticket_key_lifetime = 60;
+
+			conf->ticket_keys = tls_ticket_keys_alloc(conf, conf->ticket_key_lifetime);
+			if (!conf->ticket_keys) {
+				ERROR(LOG_PREFIX ": Failed generating session ticket keys");
+				goto error;
+			}
+#else
+			WARN(LOG_PREFIX ": Ignoring 'session_tickets', OpenSSL does not support ticket key callbacks");
+#endif
+		}
+	}
+
+	if (conf->engine_id) {
+#ifdef HAVE_OPENSSL_ENGINE_H
+		if (tls_engine_init(conf) < 0) goto error;
+#else
+		ERROR(LOG_PREFIX ": Can't use 'engine', OpenSSL was built without engine support");
+		goto error;
+#endif
+	}
+
+	if (conf->async) {
+#ifndef SSL_MODE_ASYNC
+		WARN(LOG_PREFIX ": Ignoring 'async', OpenSSL does not support asynchronous jobs");
+		conf->async = false;
+#else
+		if (!conf->engine_id) WARN(LOG_PREFIX ": 'async' has no effect unless an 'engine' is set");
+#endif
 	}
 
 #ifdef __APPLE__
@@ -3392,6 +4958,20 @@ fr_tls_server_conf_t *tls_server_conf_parse(CONF_SECTION *cs)
 		if (conf->ctx == NULL) goto error;
 	}
 
+	/*
+	 *	Index the CRLs, instead of having OpenSSL search
+	 *	them.
+	 */
+	if (conf->crl_file) {
+		if (!conf->check_crl) {
+			WARN(LOG_PREFIX ": Setting 'crl_file' requires 'check_crl = yes'.  Disabling 'crl_file'");
+			conf->crl_file = NULL;
+		} else {
+			conf->crl_store = crl_store_alloc(conf);
+			if (!conf->crl_store) goto error;
+		}
+	}
+
 #ifdef HAVE_OPENSSL_OCSP_H
 	/*
 	 * 	Initialize OCSP Revocation Store
@@ -3399,6 +4979,11 @@ fr_tls_server_conf_t *tls_server_conf_parse(CONF_SECTION *cs)
 	if (conf->ocsp_enable) {
 		conf->ocsp_store = init_revocation_store(conf);
 		if (conf->ocsp_store == NULL) goto error;
+
+		if (conf->ocsp_cache_enable) {
+			conf->ocsp_cache = ocsp_cache_alloc(conf);
+			if (!conf->ocsp_cache) goto error;
+		}
 	}
 #endif /*HAVE_OPENSSL_OCSP_H*/
 
@@ -3470,6 +5055,14 @@ fr_tls_server_conf_t *tls_client_conf_parse(CONF_SECTION *cs)
 	 */
 	if (conf->fragment_size < 100) conf->fragment_size = 100;
 
+#ifndef SSL_OP_ENABLE_KTLS
+	if (conf->ktls) {
+		WARN(LOG_PREFIX ": Setting 'ktls' requires OpenSSL 3.0 or later, built with kTLS support.  "
+		     "Disabling 'ktls'");
+		conf->ktls = false;
+	}
+#endif
+
 	/*
 	 *	Initialize TLS
 	 */
@@ -3585,7 +5178,9 @@ fr_tls_status_t tls_application_data(tls_session_t *session, REQUEST *request)
 	 *      SSL session, and put it into the decrypted
 	 *      data buffer.
 	 */
-	err = SSL_read(session->ssl, session->clean_out.data, sizeof(session->clean_out.data));
+	do {
+		err = SSL_read(session->ssl, session->clean_out.data, sizeof(session->clean_out.data));
+	} while (tls_async_wait(request, session->ssl, err));
 	if (err < 0) {
 		int code;
 
@@ -203,6 +203,7 @@ VALUE_PAIR **radius_list(REQUEST *request, pair_lists_t list)
 
 	case PAIR_LIST_REQUEST:
 		if (!request->packet) return NULL;
+		(void) request_decode_pending(request, NULL);
 		return &request->packet->vps;
 
 	case PAIR_LIST_REPLY:
@@ -343,7 +344,7 @@ TALLOC_CTX *radius_list_ctx(REQUEST *request, pair_lists_t list)
 		return request;
 
 	case PAIR_LIST_STATE:
-		return request->state_ctx;
+		return request_state_ctx(request);
 
 #ifdef WITH_PROXY
 	case PAIR_LIST_PROXY_REQUEST:
@@ -1327,6 +1328,24 @@ int tmpl_cast_to_vp(VALUE_PAIR **out, REQUEST *request,
 		return 0;
 	}
 
+	/*
+	 *	Evaluate pre-parsed xlats straight into the
+	 *	value, so attribute references aren't printed
+	 *	and parsed again.  Combo types may change the
+	 *	attribute, so they go through the slow path.
+	 */
+	if ((vpt->type == TMPL_TYPE_XLAT_STRUCT) &&
+	    (vp->da->type != PW_TYPE_COMBO_IP_ADDR) && (vp->da->type != PW_TYPE_COMBO_IP_PREFIX)) {
+		if (xlat_eval_value(vp, &vp->data, vp->da->type, vp->da, request, vpt->tmpl_xlat) < 0) {
+			fr_pair_list_free(&vp);
+			return -1;
+		}
+		vp->type = VT_DATA;
+
+		*out = vp;
+		return 0;
+	}
+
 	rcode = tmpl_aexpand(vp, &p, request, vpt, NULL, NULL);
 	if (rcode < 0) {
 		fr_pair_list_free(&vp);
@@ -1618,6 +1637,70 @@ ssize_t tmpl_expand(char const **out, char *buff, size_t bufflen, REQUEST *reque
 	return slen;
 }
 
+/** Expand a #vp_tmpl_t to a typed value, without allocating memory
+ *
+ * For #TMPL_TYPE_ATTR and #TMPL_TYPE_DATA the value is returned with its own type, so
+ * integers, dates and addresses don't need to be printed and parsed again.  The value
+ * is a shallow copy, so for #PW_TYPE_STRING and #PW_TYPE_OCTETS it points into the
+ * #VALUE_PAIR or the template, and is only valid while they are.
+ *
+ * Other template types are expanded as for #tmpl_expand, and returned as a
+ * #PW_TYPE_STRING, which may point to buff or to the name of the template.
+ *
+ * @param[out] out Where to write the value.
+ * @param[out] type of the value.
+ * @param buff Expansion buffer, used by #TMPL_TYPE_EXEC, #TMPL_TYPE_XLAT and
+ *	#TMPL_TYPE_XLAT_STRUCT.  May be NULL for other types.
+ * @param bufflen Length of expansion buffer.
+ * @param request Current request.
+ * @param vpt to expand.  Must be one of the types accepted by #tmpl_expand.
+ * @param escape xlat escape function (only used for xlat types).
+ * @param escape_ctx xlat escape function data.
+ * @return
+ *	- -2 if the attribute wasn't found.
+ *	- -1 on failure.
+ *	- The length of the value.
+ */
+ssize_t tmpl_expand_value(value_data_t *out, PW_TYPE *type, char *buff, size_t bufflen,
+			  REQUEST *request, vp_tmpl_t const *vpt,
+			  xlat_escape_t escape, void *escape_ctx)
+{
+	VALUE_PAIR	*vp;
+	char const	*str;
+	ssize_t		slen;
+
+	VERIFY_TMPL(vpt);
+
+	switch (vpt->type) {
+	case TMPL_TYPE_ATTR:
+		RDEBUG4("EXPAND TMPL ATTR VALUE");
+		if (tmpl_find_vp(&vp, request, vpt) < 0) return -2;
+
+		memcpy(out, &vp->data, sizeof(*out));
+		*type = vp->da->type;
+		return vp->vp_length;
+
+	case TMPL_TYPE_DATA:
+		RDEBUG4("EXPAND TMPL DATA VALUE");
+		memcpy(out, &vpt->tmpl_data_value, sizeof(*out));
+		*type = vpt->tmpl_data_type;
+		return vpt->tmpl_data_length;
+
+	default:
+		break;
+	}
+
+	slen = tmpl_expand(&str, buff, bufflen, request, vpt, escape, escape_ctx);
+	if (slen < 0) return slen;
+
+	memset(out, 0, sizeof(*out));
+	out->strvalue = str;
+	out->length = slen;
+	*type = PW_TYPE_STRING;
+
+	return slen;
+}
+
 /** Expand a template to a string, allocing a new buffer to hold the string
  *
  * The intended use of #tmpl_expand and #tmpl_aexpand is for modules to easily convert a #vp_tmpl_t
@@ -2004,7 +2087,16 @@ VALUE_PAIR *tmpl_cursor_init(int *err, vp_cursor_t *cursor, REQUEST *request, vp
 		if (err) *err = -3;
 		return NULL;
 	}
-	vps = radius_list(request, vpt->tmpl_list);
+	/*
+	 *	Only decode the attribute we're looking for,
+	 *	radius_list() decodes all of them.
+	 */
+	if ((vpt->type == TMPL_TYPE_ATTR) && (vpt->tmpl_list == PAIR_LIST_REQUEST) && request->packet) {
+		(void) request_decode_pending(request, vpt->tmpl_da);
+		vps = &request->packet->vps;
+	} else {
+		vps = radius_list(request, vpt->tmpl_list);
+	}
 	if (!vps) {
 		if (err) *err = -2;
 		return NULL;
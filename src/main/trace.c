@@ -0,0 +1,239 @@
+/*
+ * trace.c	Binary tracing of requests.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+/*
+ *	Each thread records events for the requests it processes
+ *	into its own ring.  When the ring is full, the oldest events
+ *	are overwritten, so the rings always hold the most recent
+ *	activity.  Nothing is formatted until the rings are dumped,
+ *	and the dump is decoded offline, by radtrace.
+ *
+ *	Only the thread which owns a ring writes to it.  "head" is
+ *	the number of events ever written, and is updated after the
+ *	event, so that the dump can tell which events it may have
+ *	read while they were being overwritten.
+ */
+#define USEC			(1000000)
+#define TRACE_RING_SIZE		(4096)		//!< Events per thread.  Must be a power of 2.
+
+typedef struct trace_ring_t trace_ring_t;
+struct trace_ring_t {
+	uint64_t		head;			//!< Events written.
+	trace_ring_t		*next;
+	fr_trace_event_t	events[TRACE_RING_SIZE];
+};
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define TRACE_LOCK	pthread_mutex_lock(&trace_mutex)
+#  define TRACE_UNLOCK	pthread_mutex_unlock(&trace_mutex)
+#else
+#  define TRACE_LOCK
+#  define TRACE_UNLOCK
+#endif
+
+static trace_ring_t	*trace_rings = NULL;	//!< Protected by trace_mutex.
+
+fr_thread_local_setup(trace_ring_t *, trace_ring)	/* macro */
+
+static void _trace_ring_free(void *arg)
+{
+	trace_ring_t *ring = arg, **last;
+
+	TRACE_LOCK;
+	for (last = &trace_rings; *last; last = &(*last)->next) {
+		if (*last != ring) continue;
+
+		*last = ring->next;
+		break;
+	}
+	TRACE_UNLOCK;
+
+	free(ring);
+}
+
+static trace_ring_t *trace_ring_get(void)
+{
+	trace_ring_t *ring;
+
+	ring = fr_thread_local_init(trace_ring, _trace_ring_free);
+	if (ring) return ring;
+
+	/*
+	 *	malloc is thread safe, talloc is not
+	 */
+	ring = calloc(1, sizeof(*ring));
+	if (!ring) return NULL;
+
+	if (fr_thread_local_set(trace_ring, ring) != 0) {
+		free(ring);
+		return NULL;
+	}
+
+	TRACE_LOCK;
+	ring->next = trace_rings;
+	trace_rings = ring;
+	TRACE_UNLOCK;
+
+	return ring;
+}
+
+/** Record an event for a request
+ *
+ * Use the FR_TRACE macro, which checks whether the request is being
+ * traced first.
+ *
+ * @param[in] request being processed.
+ * @param[in] type of event.
+ * @param[in] name of the section, module, etc.  May be NULL.
+ * @param[in] code packet code, or section.
+ * @param[in] rcode returned, or 0.
+ * @param[in] start when the thing being traced started.  If NULL, the
+ *	duration is zero.
+ */
+void fr_trace_event(REQUEST *request, fr_trace_type_t type, char const *name,
+		    unsigned int code, unsigned int rcode, struct timeval const *start)
+{
+	trace_ring_t		*ring;
+	fr_trace_event_t	*ev;
+	struct timeval		now;
+	uint64_t		head;
+
+	ring = trace_ring_get();
+	if (!ring) return;
+
+	gettimeofday(&now, NULL);
+
+	head = ring->head;
+	ev = &ring->events[head & (TRACE_RING_SIZE - 1)];
+
+	ev->when = ((uint64_t) now.tv_sec * USEC) + now.tv_usec;
+	ev->number = request->number;
+	ev->duration = 0;
+	if (start && timercmp(&now, start, >)) {
+		struct timeval diff;
+
+		timersub(&now, start, &diff);
+		if (diff.tv_sec > 4000) {
+			ev->duration = UINT32_MAX;
+		} else {
+			ev->duration = (diff.tv_sec * USEC) + diff.tv_usec;
+		}
+	}
+	ev->type = type;
+	ev->code = code;
+	ev->rcode = rcode;
+
+	if (name) {
+		strlcpy(ev->name, name, sizeof(ev->name));
+	} else {
+		ev->name[0] = '\0';
+	}
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/** Write the events from every thread to a file
+ *
+ * Threads carry on recording events while the rings are copied.  Any
+ * event which may have been overwritten during the copy is skipped.
+ *
+ * @param[in] fp to write to.
+ * @param[out] count of events written.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_trace_dump(FILE *fp, uint64_t *count)
+{
+	trace_ring_t		*ring;
+	fr_trace_header_t	hdr;
+	fr_trace_event_t	*copy;
+	int			rcode = 0;
+
+	*count = 0;
+
+	copy = malloc(sizeof(ring->events));
+	if (!copy) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	/*
+	 *	The count is filled in afterwards.
+	 */
+	memset(&hdr, 0, sizeof(hdr));
+	strlcpy(hdr.magic, FR_TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = FR_TRACE_VERSION;
+	hdr.event_size = sizeof(fr_trace_event_t);
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+	write_error:
+		fr_strerror_printf("Failed writing trace: %s", fr_syserror(errno));
+		rcode = -1;
+		goto done;
+	}
+
+	TRACE_LOCK;
+	for (ring = trace_rings; ring; ring = ring->next) {
+		uint64_t start, end, first, i;
+
+		end = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		start = (end > TRACE_RING_SIZE) ? end - TRACE_RING_SIZE : 0;
+
+		for (i = start; i < end; i++) {
+			copy[i - start] = ring->events[i & (TRACE_RING_SIZE - 1)];
+		}
+
+		/*
+		 *	The owner may have started overwriting any
+		 *	event before the one it's writing now.
+		 */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		first = __atomic_load_n(&ring->head, __ATOMIC_RELAXED) + 1;
+		first = (first > TRACE_RING_SIZE) ? first - TRACE_RING_SIZE : 0;
+		if (first < start) first = start;
+		if (first >= end) continue;
+
+		if (fwrite(&copy[first - start], sizeof(copy[0]), end - first, fp) != (end - first)) {
+			TRACE_UNLOCK;
+			goto write_error;
+		}
+		*count += end - first;
+	}
+	TRACE_UNLOCK;
+
+	hdr.count = *count;
+	if ((fseek(fp, 0, SEEK_SET) < 0) || (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)) goto write_error;
+
+done:
+	free(copy);
+	return rcode;
+}
@@ -30,6 +30,13 @@ RCSID("$Id$")
 
 static CONF_SECTION *trigger_exec_main, *trigger_exec_subcs;
 
+static char const		*trigger_helper;	//!< Command to run persistent trigger helpers with.
+static uint32_t			trigger_helpers = 1;	//!< Number of trigger helpers.
+static exec_helper_pool_t	*trigger_helper_pool;	//!< Started on first use, after we've daemonized.
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t		trigger_helper_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 #define REQUEST_INDEX_TRIGGER_NAME	1
 #define REQUEST_INDEX_TRIGGER_ARGS	2
 
@@ -81,12 +88,63 @@ static ssize_t xlat_trigger(char **out, UNUSED size_t outlen,
  */
 void trigger_exec_init(CONF_SECTION *cs)
 {
+	CONF_PAIR *cp;
+
 	trigger_exec_main = cs;
 	trigger_exec_subcs = cf_section_sub_find(cs, "trigger");
 
+	/*
+	 *	Pass triggers to persistent helpers, instead of
+	 *	forking a new process for each one.
+	 */
+	if (trigger_exec_subcs && (cp = cf_pair_find(trigger_exec_subcs, "helper"))) {
+		trigger_helper = cf_pair_value(cp);
+
+		cp = cf_pair_find(trigger_exec_subcs, "helpers");
+		if (cp && cf_pair_value(cp)) trigger_helpers = strtoul(cf_pair_value(cp), NULL, 10);
+		if (trigger_helpers < 1) trigger_helpers = 1;
+	}
+
 	xlat_register(NULL, "trigger", xlat_trigger, NULL, NULL, 0, 0);
 }
 
+/** Send a trigger to one of the persistent trigger helpers
+ *
+ * The expanded trigger is written to the helper as a single line,
+ * and the helper must acknowledge it with a single line.
+ */
+static int trigger_helper_exec(REQUEST *request, char const *value)
+{
+	exec_helper_pool_t	*pool;
+	char			*line, *p;
+	char			answer[1024];
+	ssize_t			slen;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&trigger_helper_mutex);
+#endif
+	if (!trigger_helper_pool) {
+		trigger_helper_pool = exec_helper_pool_alloc(trigger_exec_main, trigger_helper, trigger_helpers,
+							     NULL, EXEC_TIMEOUT);
+	}
+	pool = trigger_helper_pool;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&trigger_helper_mutex);
+#endif
+	if (!pool) return -1;
+
+	slen = radius_axlat(&line, request, value, NULL, NULL);
+	if (slen < 0) return -1;
+
+	for (p = line; *p; p++) if (*p == '\n') *p = ' ';
+	line = talloc_strdup_append_buffer(line, "\n");
+
+	slen = exec_helper_request(pool, request, answer, sizeof(answer), line, talloc_array_length(line) - 1);
+	talloc_free(line);
+
+	return (slen < 0) ? -1 : 0;
+}
+
 static void time_free(void *data)
 {
 	free(data);
@@ -175,7 +233,10 @@ int trigger_exec(REQUEST *request, CONF_SECTION *cs, char const *name, bool quen
 	 *	May be called for Status-Server packets.
 	 */
 	vp = NULL;
-	if (request && request->packet) vp = request->packet->vps;
+	if (request && request->packet) {
+		(void) request_decode_pending(request, NULL);
+		vp = request->packet->vps;
+	}
 
 	/*
 	 *	Perform periodic quenching.
@@ -234,7 +295,11 @@ int trigger_exec(REQUEST *request, CONF_SECTION *cs, char const *name, bool quen
 		}
 	}
 
-	ret = radius_exec_program(request, NULL, 0, NULL, request, value, vp, false, true, EXEC_TIMEOUT);
+	if (trigger_helper) {
+		ret = trigger_helper_exec(request, value);
+	} else {
+		ret = radius_exec_program(request, NULL, 0, NULL, request, value, vp, false, true, EXEC_TIMEOUT);
+	}
 	if (fake) talloc_free(fake);
 
 	request_data_reference(request, xlat_trigger, REQUEST_INDEX_TRIGGER_NAME);
@@ -611,6 +611,9 @@ int rad_copy_variable(char *to, char const *from)
 #ifndef USEC
 #define USEC 1000000
 #endif
+#ifndef NSEC
+#define NSEC ((uint64_t) 1000000000)
+#endif
 
 uint32_t rad_pps(uint32_t *past, uint32_t *present, time_t *then, struct timeval *now)
 {
@@ -649,6 +652,40 @@ uint32_t rad_pps(uint32_t *past, uint32_t *present, time_t *then, struct timeval
 	return pps;
 }
 
+/** Take a token from a bucket
+ *
+ * This is the "generic cell rate algorithm" form of a token bucket.
+ * Each packet moves the time at which the bucket is full again
+ * forward by 1/rate seconds.  If that time is more than burst/rate
+ * seconds in the future, the bucket is empty.
+ *
+ * @param tb	to take the token from.
+ * @param now	the current time.
+ * @return
+ *	- true if there was a token, or the bucket has no limit.
+ *	- false if the packet should be dropped.
+ */
+bool rad_token_bucket_take(fr_token_bucket_t *tb, struct timeval const *now)
+{
+	uint64_t t, tat, next, interval, tolerance;
+
+	if (!tb->rate) return true;
+
+	t = ((uint64_t) now->tv_sec * NSEC) + ((uint64_t) now->tv_usec * 1000);
+	interval = NSEC / tb->rate;
+	tolerance = interval * ((tb->burst ? tb->burst : tb->rate) - 1);
+
+	tat = __atomic_load_n(&tb->tat, __ATOMIC_RELAXED);
+	do {
+		next = (tat > t) ? tat : t;
+		if ((next - t) > tolerance) return false;
+
+		next += interval;
+	} while (!__atomic_compare_exchange_n(&tb->tat, &tat, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return true;
+}
+
 /** Split string into words and expand each one
  *
  * @param request Current request.
@@ -30,6 +30,7 @@ RCSID("$Id$")
 #include <freeradius-devel/parser.h>
 #include <freeradius-devel/rad_assert.h>
 #include <freeradius-devel/base64.h>
+#include <freeradius-devel/modules.h>
 
 #include <ctype.h>
 
@@ -43,6 +44,8 @@ typedef struct xlat_t {
 	size_t			inst_size;		//!< Length of instance data to pre-allocate.
 	size_t			buf_len;		//!< Length of output buffer to pre-allocate.
 	bool			internal;		//!< If true, cannot be redefined.
+	bool			pure;			//!< Output depends only on the input string,
+							//!< so results may be memoised per request.
 } xlat_t;
 
 typedef enum {
@@ -76,7 +79,18 @@ typedef struct xlat_out {
 	size_t len;		//!< Length of the output string.
 } xlat_out_t;
 
-static rbtree_t *xlat_root = NULL;
+static fr_hash_rcu_t *xlat_root = NULL;
+
+#define REQUEST_DATA_XLAT_MEMO (0xadbeef10)
+
+/** A memoised result of a pure xlat function
+ *
+ */
+typedef struct xlat_memo_t {
+	xlat_t const	*xlat;		//!< The xlat function which produced the result.
+	char const	*in;		//!< The expanded input string.
+	char const	*out;		//!< The result.
+} xlat_memo_t;
 
 #ifdef WITH_UNLANG
 static char const * const xlat_foreach_names[] = {"Foreach-Variable-0",
@@ -513,6 +527,97 @@ static ssize_t xlat_module(char **out, size_t outlen,
 	return strlen(*out);
 }
 
+/** Print how long part of the request took, in microseconds
+ *
+ * - queue, proxy and total are how long the request waited in the
+ *   thread pool queue, how long the home server took to reply, and
+ *   how long it's been since the request was received.
+ * - queued, dequeued, proxy_sent, proxy_reply and reply_sent are
+ *   when those things happened, relative to when the request was
+ *   received.
+ * - A section name, e.g. authorize, is how long the request spent in
+ *   that section.
+ *
+ * Phases which are still going on are timed until now.  Anything
+ * which hasn't happened expands to nothing.
+ *
+ * Example: "%{timing:queue}"
+ */
+static ssize_t xlat_timing(char **out, size_t outlen,
+			   UNUSED void const *mod_inst, UNUSED void const *xlat_inst,
+			   REQUEST *request, char const *fmt)
+{
+	struct timeval const	*start = &request->packet->timestamp;
+	struct timeval const	*end = NULL;
+	struct timeval		now;
+	bool			running = true;
+	int64_t			usec;
+	int			i;
+
+	while (isspace((int) *fmt)) fmt++;
+
+	if (strcmp(fmt, "queue") == 0) {
+		start = &request->times.queued;
+		end = &request->times.dequeued;
+
+#ifdef WITH_PROXY
+	} else if (strcmp(fmt, "proxy") == 0) {
+		start = &request->times.proxy_sent;
+		end = &request->times.proxy_reply;
+#endif
+
+	} else if (strcmp(fmt, "total") == 0) {
+		end = &request->times.reply_sent;
+
+	} else {
+		running = false;
+
+		if (strcmp(fmt, "queued") == 0) {
+			end = &request->times.queued;
+
+		} else if (strcmp(fmt, "dequeued") == 0) {
+			end = &request->times.dequeued;
+
+		} else if (strcmp(fmt, "proxy_sent") == 0) {
+			end = &request->times.proxy_sent;
+
+		} else if (strcmp(fmt, "proxy_reply") == 0) {
+			end = &request->times.proxy_reply;
+
+		} else if (strcmp(fmt, "reply_sent") == 0) {
+			end = &request->times.reply_sent;
+
+		} else for (i = 0; i < MOD_COUNT; i++) {
+			if (strcmp(fmt, section_type_value[i].section) != 0) continue;
+
+			start = &request->times.section_start[i];
+			end = &request->times.section_end[i];
+			running = true;
+			break;
+		}
+	}
+
+	if (!end) {
+		REDEBUG("Unknown timing \"%s\"", fmt);
+		return -1;
+	}
+
+	if (start->tv_sec == 0) return 0;
+
+	if (end->tv_sec == 0) {
+		if (!running) return 0;
+
+		gettimeofday(&now, NULL);
+		end = &now;
+	}
+
+	usec = (end->tv_sec - start->tv_sec) * (int64_t) 1000000;
+	usec += end->tv_usec - start->tv_usec;
+	if (usec < 0) usec = 0;
+
+	return snprintf(*out, outlen, "%" PRId64, usec);
+}
+
 #if defined(HAVE_REGEX) && defined(HAVE_PCRE)
 static ssize_t xlat_regex(char **out, size_t outlen,
 			  UNUSED void const *mod_inst, UNUSED void const *xlat_inst,
@@ -696,6 +801,18 @@ static int xlat_cmp(void const *one, void const *two)
 	return memcmp(a->name, b->name, a->length);
 }
 
+static uint32_t xlat_hash(void const *data)
+{
+	xlat_t const *c = data;
+
+	return fr_hash(c->name, c->length);
+}
+
+static void xlat_node_free(void *data)
+{
+	talloc_free(data);
+}
+
 
 /*
  *	find the appropriate registered xlat function.
@@ -707,7 +824,7 @@ static xlat_t *xlat_find(char const *name)
 	strlcpy(my_xlat.name, name, sizeof(my_xlat.name));
 	my_xlat.length = strlen(my_xlat.name);
 
-	return rbtree_finddata(xlat_root, &my_xlat);
+	return fr_hash_rcu_finddata(xlat_root, &my_xlat);
 }
 
 
@@ -732,7 +849,6 @@ int xlat_register(void *mod_inst, char const *name,
 {
 	xlat_t	*c;
 	xlat_t	my_xlat;
-	rbnode_t *node;
 
 	if (!name || !*name) {
 		DEBUG("xlat_register: Invalid xlat name");
@@ -750,9 +866,9 @@ int xlat_register(void *mod_inst, char const *name,
 		int i;
 #endif
 
-		xlat_root = rbtree_create(NULL, xlat_cmp, NULL, RBTREE_FLAG_REPLACE);
+		xlat_root = fr_hash_rcu_create(NULL, xlat_hash, xlat_cmp, xlat_node_free);
 		if (!xlat_root) {
-			DEBUG("xlat_register: Failed to create tree");
+			DEBUG("xlat_register: Failed to create table");
 			return -1;
 		}
 
@@ -783,6 +899,7 @@ int xlat_register(void *mod_inst, char const *name,
 		XLAT_REGISTER(xlat);
 		XLAT_REGISTER(map);
 		XLAT_REGISTER(module);
+		XLAT_REGISTER(timing);
 		XLAT_REGISTER(debug_attr);
 #if defined(HAVE_REGEX) && defined(HAVE_PCRE)
 		XLAT_REGISTER(regex);
@@ -799,7 +916,7 @@ int xlat_register(void *mod_inst, char const *name,
 	 */
 	strlcpy(my_xlat.name, name, sizeof(my_xlat.name));
 	my_xlat.length = strlen(my_xlat.name);
-	c = rbtree_finddata(xlat_root, &my_xlat);
+	c = fr_hash_rcu_finddata(xlat_root, &my_xlat);
 	if (c) {
 		if (c->internal) {
 			DEBUG("xlat_register: Cannot re-define internal xlat");
@@ -812,13 +929,14 @@ int xlat_register(void *mod_inst, char const *name,
 		c->mod_inst = mod_inst;
 		c->instantiate = instantiate;
 		c->inst_size = inst_size;
+		c->pure = false;
 		return 0;
 	}
 
 	/*
 	 *	Doesn't exist.  Create it.
 	 */
-	c = talloc_zero(xlat_root, xlat_t);
+	c = talloc_zero(NULL, xlat_t);
 
 	c->func = func;
 	c->buf_len = buf_len;
@@ -831,21 +949,41 @@ int xlat_register(void *mod_inst, char const *name,
 
 	DEBUG3("xlat_register: %s", c->name);
 
-	node = rbtree_insert_node(xlat_root, c);
-	if (!node) {
+	/*
+	 *	The table frees the xlat when it's deleted.
+	 */
+	if (!fr_hash_rcu_insert(xlat_root, c)) {
 		talloc_free(c);
 		return -1;
 	}
 
-	/*
-	 *	Ensure that the data is deleted when the node is
-	 *	deleted.
-	 *
-	 *	@todo: Maybe this should be the other way around...
-	 *	when a thing IN the tree is deleted, it's automatically
-	 *	removed from the tree.  But for now, this works.
-	 */
-	(void) talloc_steal(node, c);
+	return 0;
+}
+
+/** Register an xlat function whose output depends only on its input
+ *
+ * Results of pure xlat functions are memoised for the lifetime of a request,
+ * so repeated expansions with the same input don't call the function again.
+ *
+ * Functions which read attributes directly (i.e. take an &Attribute-Name
+ * argument), call out to external services, or have side effects, must be
+ * registered with #xlat_register instead.
+ *
+ * @see xlat_register
+ */
+int xlat_register_pure(void *mod_inst, char const *name,
+		       xlat_func_t func, xlat_escape_t escape,
+		       xlat_instantiate_t instantiate, size_t inst_size,
+		       size_t buf_len)
+{
+	xlat_t *c;
+
+	if (xlat_register(mod_inst, name, func, escape, instantiate, inst_size, buf_len) < 0) return -1;
+
+	c = xlat_find(name);
+	rad_assert(c != NULL);
+	c->pure = true;
+
 	return 0;
 }
 
@@ -868,26 +1006,26 @@ void xlat_unregister(void *mod_inst, char const *name, UNUSED xlat_func_t func)
 	strlcpy(my_xlat.name, name, sizeof(my_xlat.name));
 	my_xlat.length = strlen(my_xlat.name);
 
-	c = rbtree_finddata(xlat_root, &my_xlat);
+	c = fr_hash_rcu_finddata(xlat_root, &my_xlat);
 	if (!c) return;
 
 	if (c->mod_inst != mod_inst) return;
 
-	rbtree_deletebydata(xlat_root, c);
+	fr_hash_rcu_delete(xlat_root, c);
 }
 
 static int xlat_unregister_callback(void *mod_inst, void *data)
 {
 	xlat_t *c = (xlat_t *) data;
 
-	if (c->mod_inst != mod_inst) return 0; /* keep walking */
+	if (c->mod_inst == mod_inst) fr_hash_rcu_delete(xlat_root, c);
 
-	return 2;		/* delete it */
+	return 0;		/* keep walking */
 }
 
 void xlat_unregister_module(void *instance)
 {
-	rbtree_walk(xlat_root, RBTREE_DELETE_ORDER, xlat_unregister_callback, instance);
+	fr_hash_rcu_walk(xlat_root, xlat_unregister_callback, instance);
 }
 
 /*
@@ -984,7 +1122,7 @@ static ssize_t xlat_load_balance(char **out, NDEBUG_UNUSED size_t outlen,
 		 *	Replace the previously found one with a random
 		 *	new one.
 		 */
-		if ((count * (fr_rand() & 0xffff)) < (uint32_t) 0x10000) {
+		if ((count * (fr_fast_rand() & 0xffff)) < (uint32_t) 0x10000) {
 			found = ci;
 		}
 	}
@@ -1157,7 +1295,8 @@ ssize_t xlat_fmt_to_ref(uint8_t const **out, REQUEST *request, char const *fmt)
  */
 void xlat_free(void)
 {
-	rbtree_free(xlat_root);
+	fr_hash_rcu_free(xlat_root);
+	xlat_root = NULL;
 }
 
 #ifdef DEBUG_XLAT
@@ -1800,6 +1939,53 @@ ssize_t xlat_tokenize(TALLOC_CTX *ctx, char *fmt, xlat_exp_t **head,
 	return xlat_tokenize_literal(ctx, fmt, head, false, error);
 }
 
+/** Tokenize a format string once, so it can be expanded many times
+ *
+ * Modules should call this at instantiation time for format strings
+ * taken from their configuration, and expand the result with
+ * #radius_xlat_struct or #radius_axlat_struct.  #radius_xlat and
+ * #radius_axlat re-tokenize the format string on every call.
+ *
+ * @param[in] ctx to allocate the expansion in.
+ * @param[out] head the head of the xlat list / tree structure.
+ * @param[in] fmt the format string to tokenize.  It is copied, not modified.
+ * @param[out] error the parse error (if any).
+ * @return
+ *	- Length of the format string.
+ *	- < 0 (the offset to the offending error) on error.
+ */
+ssize_t xlat_compile(TALLOC_CTX *ctx, xlat_exp_t **head, char const *fmt, char const **error)
+{
+	ssize_t slen;
+	char *tokens;
+
+	*head = NULL;
+
+	tokens = talloc_typed_strdup(ctx, fmt);
+	if (!tokens) {
+		*error = "Out of memory";
+		return -1;
+	}
+
+	slen = xlat_tokenize_literal(ctx, tokens, head, false, error);
+	if (slen < 0) {
+		talloc_free(tokens);
+		return slen;
+	}
+
+	/*
+	 *	Zero length expansion, return a zero length node.
+	 */
+	if (!*head) *head = talloc_zero(ctx, xlat_exp_t);
+
+	/*
+	 *	The nodes point into "tokens", so free it with them.
+	 */
+	(void) talloc_steal(*head, tokens);
+
+	return slen;
+}
+
 
 /** Tokenize an xlat expansion
  *
@@ -2149,12 +2335,89 @@ finish:
 static const char xlat_spaces[] = "                                                                                                                                                                                                                                                                ";
 #endif
 
+static uint32_t xlat_memo_hash(void const *data)
+{
+	xlat_memo_t const *memo = data;
+
+	return fr_hash_update(&memo->xlat, sizeof(memo->xlat), fr_hash_string(memo->in));
+}
+
+static int xlat_memo_cmp(void const *one, void const *two)
+{
+	xlat_memo_t const *a = one, *b = two;
+
+	if (a->xlat != b->xlat) return (a->xlat < b->xlat) - (a->xlat > b->xlat);
+
+	return strcmp(a->in, b->in);
+}
+
+/** Find the memoised result of a pure xlat function
+ *
+ * @param[in] request The current request.
+ * @param[in] xlat function that was called.
+ * @param[in] in the expanded input string.
+ * @return
+ *	- The result of a previous call with the same input.
+ *	- NULL if the function hasn't been called with this input.
+ */
+static char const *xlat_memo_find(REQUEST *request, xlat_t const *xlat, char const *in)
+{
+	fr_hash_oa_t *ht;
+	xlat_memo_t my_memo, *memo;
+
+	ht = request_data_reference(request, request, REQUEST_DATA_XLAT_MEMO);
+	if (!ht) return NULL;
+
+	my_memo.xlat = xlat;
+	my_memo.in = in;
+
+	memo = fr_hash_oa_finddata(ht, &my_memo);
+	if (!memo) return NULL;
+
+	return memo->out;
+}
+
+/** Record the result of a pure xlat function
+ *
+ * @param[in] request The current request.
+ * @param[in] xlat function that was called.
+ * @param[in] in the expanded input string.
+ * @param[in] out the result.
+ */
+static void xlat_memo_add(REQUEST *request, xlat_t const *xlat, char const *in, char const *out)
+{
+	fr_hash_oa_t *ht;
+	xlat_memo_t *memo;
+
+	ht = request_data_reference(request, request, REQUEST_DATA_XLAT_MEMO);
+	if (!ht) {
+		ht = fr_hash_oa_create(request, xlat_memo_hash, xlat_memo_cmp, NULL);
+		if (!ht) return;
+
+		if (request_data_add(request, request, REQUEST_DATA_XLAT_MEMO, ht, true, false, false) < 0) {
+			talloc_free(ht);
+			return;
+		}
+	}
+
+	memo = talloc(ht, xlat_memo_t);
+	if (!memo) return;
+
+	memo->xlat = xlat;
+	memo->in = talloc_typed_strdup(memo, in);
+	memo->out = talloc_typed_strdup(memo, out);
+
+	if (!fr_hash_oa_insert(ht, memo)) talloc_free(memo);
+}
+
 static char *xlat_aprint(TALLOC_CTX *ctx, REQUEST *request, xlat_exp_t const * const node,
 			 xlat_escape_t escape, void *escape_ctx, int lvl)
 {
 	ssize_t rcode;
 	char *str = NULL, *child;
 	char const *p;
+	bool memoise;
+	struct timeval start = { 0, 0 };
 
 	XLAT_DEBUG("%.*sxlat aprint %d %s", lvl, xlat_spaces, node->type, node->fmt);
 
@@ -2290,7 +2553,11 @@ static char *xlat_aprint(TALLOC_CTX *ctx, REQUEST *request, xlat_exp_t const * c
 			str = talloc_array(request, char, node->xlat->buf_len);
 			str[0] = '\0';	/* Be sure the string is \0 terminated */
 		}
+		if (!node->xlat->internal) (void) request_decode_pending(request, NULL);
+		if (request->trace || request->profile) gettimeofday(&start, NULL);
 		rcode = node->xlat->func(&str, node->xlat->buf_len, node->xlat->mod_inst, NULL, request, NULL);
+		FR_TRACE(request, FR_TRACE_XLAT, node->xlat->name, (rcode < 0), 0, &start);
+		FR_PROFILE(request, FR_PROFILE_XLAT, node->xlat->name, NULL, &start, NULL);
 		if (rcode < 0) {
 			talloc_free(str);
 			return NULL;
@@ -2362,16 +2629,43 @@ static char *xlat_aprint(TALLOC_CTX *ctx, REQUEST *request, xlat_exp_t const * c
 			*q = '\0';
 		}
 
+		/*
+		 *	Pure functions with the same input produce
+		 *	the same output, so re-use the result of any
+		 *	previous call.  Attribute references are read
+		 *	by the function itself, so the input string
+		 *	doesn't identify the result.
+		 */
+		for (p = child; isspace((int) *p); p++);
+		memoise = node->xlat->pure && (*p != '&');
+		if (memoise) {
+			char const *memo;
+
+			memo = xlat_memo_find(request, node->xlat, child);
+			if (memo) {
+				RDEBUG3("EXPAND %s (memoised)", node->xlat->name);
+				talloc_free(child);
+				str = talloc_typed_strdup(request, memo);
+				break;
+			}
+		}
+
 		if (node->xlat->buf_len > 0) {
 			str = talloc_array(request, char, node->xlat->buf_len);
 			str[0] = '\0';	/* Be sure the string is \0 terminated */
 		}
+		if (!node->xlat->internal) (void) request_decode_pending(request, NULL);
+		if (request->trace || request->profile) gettimeofday(&start, NULL);
 		rcode = node->xlat->func(&str, node->xlat->buf_len, node->xlat->mod_inst, NULL, request, child);
-		talloc_free(child);
+		FR_TRACE(request, FR_TRACE_XLAT, node->xlat->name, (rcode < 0), 0, &start);
+		FR_PROFILE(request, FR_PROFILE_XLAT, node->xlat->name, NULL, &start, NULL);
 		if (rcode < 0) {
+			talloc_free(child);
 			talloc_free(str);
 			return NULL;
 		}
+		if (memoise && str) xlat_memo_add(request, node->xlat, child, str);
+		talloc_free(child);
 		break;
 
 #ifdef HAVE_REGEX
@@ -2675,3 +2969,61 @@ ssize_t radius_axlat_struct(char **out, REQUEST *request, xlat_exp_t const *xlat
 {
 	return xlat_expand_struct(out, 0, request, xlat, escape, ctx);
 }
+
+/** Evaluate a pre-compiled xlat expansion into a #value_data_t of the given type
+ *
+ * If the expansion is a single attribute reference, the value of the attribute
+ * is copied or cast directly, without being printed to a string and re-parsed.
+ * All other expansions are expanded to a string, and the result parsed as the
+ * requested type.
+ *
+ * @param[in] ctx to allocate any buffers in the #value_data_t in.
+ * @param[out] out Where to write the value.
+ * @param[in] type of value to produce.
+ * @param[in] enumv enumeration values used to parse the result (may be NULL).
+ * @param[in] request The current request.
+ * @param[in] xlat to evaluate, as produced by #xlat_compile.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int xlat_eval_value(TALLOC_CTX *ctx, value_data_t *out, PW_TYPE type, fr_dict_attr_t const *enumv,
+		    REQUEST *request, xlat_exp_t const *xlat)
+{
+	char	*buff = NULL;
+	ssize_t	slen;
+	int	ret;
+
+	memset(out, 0, sizeof(*out));
+
+	/*
+	 *	Single attribute reference, skip the
+	 *	print / parse round trip.
+	 */
+	if ((xlat->type == XLAT_ATTRIBUTE) && !xlat->next && !xlat->alternate &&
+	    (xlat->attr.type == TMPL_TYPE_ATTR) && !xlat->attr.tmpl_da->flags.virtual &&
+	    (xlat->attr.tmpl_num != NUM_ALL) && (xlat->attr.tmpl_num != NUM_COUNT)) {
+		VALUE_PAIR *vp;
+
+		if (tmpl_find_vp(&vp, request, &xlat->attr) == 0) {
+			if (vp->da->type == type) return value_data_copy(ctx, out, type, &vp->data);
+
+			return value_data_cast(ctx, out, type, enumv, vp->da->type, vp->da, &vp->data);
+		}
+	}
+
+	slen = xlat_expand_struct(&buff, 0, request, xlat, NULL, NULL);
+	if (slen < 0) return -1;
+	if (!buff) MEM(buff = talloc_typed_strdup(ctx, ""));
+
+	if (type == PW_TYPE_STRING) {
+		out->strvalue = talloc_steal(ctx, buff);
+		out->length = slen;
+		return 0;
+	}
+
+	ret = value_data_from_str(ctx, out, &type, enumv, buff, slen, '\0');
+	talloc_free(buff);
+
+	return ret;
+}
@@ -61,22 +61,80 @@ typedef enum bfd_auth_type_t {
 
 #define BFD_AUTH_INVALID (BFD_AUTH_MET_KEYED_SHA1 + 1)
 
+typedef struct bfd_auth_basic_t {
+	uint8_t		auth_type;
+	uint8_t		auth_len;
+	uint8_t		key_id;
+} bfd_auth_basic_t;
+
+
+typedef struct bfd_auth_simple_t {
+	uint8_t		auth_type;
+	uint8_t		auth_len;
+	uint8_t		key_id;
+	uint8_t		password[16];
+} bfd_auth_simple_t;
+
+typedef struct bfd_auth_md5_t {
+	uint8_t		auth_type;
+	uint8_t		auth_len;
+	uint8_t		key_id;
+	uint8_t		reserved;
+	uint32_t	sequence_no;
+	uint8_t		digest[MD5_DIGEST_LENGTH];
+} bfd_auth_md5_t;
+
+typedef struct bfd_auth_sha1_t {
+	uint8_t		auth_type;
+	uint8_t		auth_len;
+	uint8_t		key_id;
+	uint8_t		reserved;
+	uint32_t	sequence_no;
+	uint8_t		digest[SHA1_DIGEST_LENGTH];
+} bfd_auth_sha1_t;
+
+typedef union bfd_auth_t {
+	bfd_auth_basic_t        basic;
+	bfd_auth_simple_t	password;
+	bfd_auth_md5_t		md5;
+	bfd_auth_sha1_t		sha1;
+} bfd_auth_t;
+
+/*
+ *	All of the sessions on a socket are run by one thread, from a
+ *	timer wheel.  Each slot holds the timers which expire in one
+ *	tick.  Timers more than one rotation away stay in their slot
+ *	until the wheel comes round to them again.
+ */
+#define BFD_WHEEL_TICK		(100)		/* usec */
+#define BFD_WHEEL_SLOTS		(4096)		/* ~0.4s per rotation, must be a power of 2 */
+
+typedef void (*bfd_timer_callback_t)(void *ctx, struct timeval *now);
+
+typedef struct bfd_timer_t {
+	struct bfd_timer_t	*next;
+	struct bfd_timer_t	**prev_next;	//!< NULL if the timer isn't armed.
+	uint64_t		when;		//!< In usec.
+	bfd_timer_callback_t	callback;
+	void			*ctx;
+} bfd_timer_t;
+
+typedef struct bfd_wheel_t {
+	uint64_t		tick;		//!< Last tick which was run.
+	bfd_timer_t		*slot[BFD_WHEEL_SLOTS];
+} bfd_wheel_t;
+
 typedef struct bfd_state_t {
 	int		number;
 	int		sockfd;
 
-	fr_event_list_t *el;
+	bfd_wheel_t	*wheel;
 	const char	*server;
 
-#ifdef HAVE_PTHREAD_H
-	bool		blocked;
-	int		pipefd[2];
-	pthread_t	pthread_id;
-#endif
-
 	bfd_auth_type_t auth_type;
 	uint8_t		secret[BFD_MAX_SECRET_LENGTH];
 	size_t		secret_len;
+	bfd_auth_t	auth;		//!< What we send, apart from the sequence number.
 
 	fr_ipaddr_t	local_ipaddr;
 	fr_ipaddr_t	remote_ipaddr;
@@ -89,8 +147,8 @@ typedef struct bfd_state_t {
 	struct sockaddr_storage remote_sockaddr;
 	socklen_t	salen;
 
-	fr_event_t	*ev_timeout;
-	fr_event_t	*ev_packet;
+	bfd_timer_t	ev_timeout;
+	bfd_timer_t	ev_packet;
 	struct timeval	last_recv;
 	struct timeval	next_recv;
 	struct timeval	last_sent;
@@ -129,45 +187,6 @@ typedef struct bfd_state_t {
 	int		passive;
 } bfd_state_t;
 
-typedef struct bfd_auth_basic_t {
-	uint8_t		auth_type;
-	uint8_t		auth_len;
-	uint8_t		key_id;
-} bfd_auth_basic_t;
-
-
-typedef struct bfd_auth_simple_t {
-	uint8_t		auth_type;
-	uint8_t		auth_len;
-	uint8_t		key_id;
-	uint8_t		password[16];
-} bfd_auth_simple_t;
-
-typedef struct bfd_auth_md5_t {
-	uint8_t		auth_type;
-	uint8_t		auth_len;
-	uint8_t		key_id;
-	uint8_t		reserved;
-	uint32_t	sequence_no;
-	uint8_t		digest[MD5_DIGEST_LENGTH];
-} bfd_auth_md5_t;
-
-typedef struct bfd_auth_sha1_t {
-	uint8_t		auth_type;
-	uint8_t		auth_len;
-	uint8_t		key_id;
-	uint8_t		reserved;
-	uint32_t	sequence_no;
-	uint8_t		digest[SHA1_DIGEST_LENGTH];
-} bfd_auth_sha1_t;
-
-typedef union bfd_auth_t {
-	bfd_auth_basic_t        basic;
-	bfd_auth_simple_t	password;
-	bfd_auth_md5_t		md5;
-	bfd_auth_sha1_t		sha1;
-} bfd_auth_t;
-
 
 /*
  *	A packet
@@ -225,142 +244,266 @@ typedef struct bfd_socket_t {
 	size_t		secret_len;
 
 	rbtree_t	*session_tree;
+
+	bfd_wheel_t	*wheel;
+	int		pipefd[2];	//!< Packets from the listener to the engine thread.
+#ifdef HAVE_PTHREAD_H
+	pthread_t	pthread_id;
+#endif
 } bfd_socket_t;
 
+/*
+ *	A packet, handed over to the engine thread.
+ */
+typedef struct bfd_message_t {
+	bfd_state_t	*session;
+	bfd_packet_t	bfd;
+} bfd_message_t;
+
 static int bfd_start_packets(bfd_state_t *session);
 static int bfd_start_control(bfd_state_t *session);
 static int bfd_stop_control(bfd_state_t *session);
 static void bfd_detection_timeout(void *ctx, struct timeval *now);
 static int bfd_process(bfd_state_t *session, bfd_packet_t *bfd);
 
-static fr_event_list_t *el = NULL; /* don't ask */
+static inline uint64_t bfd_timeval_to_usec(struct timeval const *tv)
+{
+	return ((uint64_t) tv->tv_sec * USEC) + tv->tv_usec;
+}
 
-void bfd_init(fr_event_list_t *xel);
+static void bfd_timer_link(bfd_timer_t **head, bfd_timer_t *timer)
+{
+	timer->next = *head;
+	if (timer->next) timer->next->prev_next = &timer->next;
+	timer->prev_next = head;
+	*head = timer;
+}
 
-void bfd_init(fr_event_list_t *xel)
+static void bfd_timer_delete(bfd_timer_t *timer)
 {
-	el = xel;
+	if (!timer->prev_next) return;
+
+	*timer->prev_next = timer->next;
+	if (timer->next) timer->next->prev_next = timer->prev_next;
+
+	timer->next = NULL;
+	timer->prev_next = NULL;
 }
 
+static inline bool bfd_timer_armed(bfd_timer_t const *timer)
+{
+	return (timer->prev_next != NULL);
+}
 
-#ifdef HAVE_PTHREAD_H
-static void bfd_pthread_free(bfd_state_t *session)
+static void bfd_timer_insert(bfd_wheel_t *wheel, bfd_timer_t *timer,
+			     bfd_timer_callback_t callback, void *ctx, struct timeval const *when)
 {
-	session->blocked = true;
+	uint64_t tick;
 
-	close(session->pipefd[0]);
-	close(session->pipefd[1]);
+	bfd_timer_delete(timer);
 
-	talloc_free(session->el);
+	timer->when = bfd_timeval_to_usec(when);
+	timer->callback = callback;
+	timer->ctx = ctx;
 
-	session->el = NULL;
-	session->pipefd[0] = session->pipefd[1] = -1;
+	/*
+	 *	Timers in the past fire on the next tick.
+	 */
+	tick = timer->when / BFD_WHEEL_TICK;
+	if (tick <= wheel->tick) tick = wheel->tick + 1;
 
-	session->blocked = false;
+	bfd_timer_link(&wheel->slot[tick & (BFD_WHEEL_SLOTS - 1)], timer);
 }
 
 /*
- *	A child thread reads the packet from a pipe, and processes it.
+ *	Fire every timer which has expired.
  */
-static void bfd_pipe_recv(UNUSED fr_event_list_t *xel, int fd, void *ctx)
+static void bfd_wheel_run(bfd_wheel_t *wheel, struct timeval *now)
 {
-	ssize_t num;
-	bfd_state_t *session = ctx;
-	bfd_packet_t bfd;
+	uint64_t	target = bfd_timeval_to_usec(now) / BFD_WHEEL_TICK;
+	uint64_t	tick;
+	bfd_timer_t	*expired, *timer, *next;
 
-	if (session->blocked) return;
+	if (target <= wheel->tick) return;
 
 	/*
-	 *	Read the header
+	 *	After a stall, look at each slot once.
 	 */
-	num = read(fd, &bfd, 4);
-	if ((num < 4) || (bfd.length < 4)) {
-	fail:
-		ERROR("BFD Failed reading from pipe!");
-		session->blocked = true;
-		return;
+	if ((target - wheel->tick) > BFD_WHEEL_SLOTS) wheel->tick = target - BFD_WHEEL_SLOTS;
+
+	for (tick = wheel->tick + 1; tick <= target; tick++) {
+		wheel->tick = tick;
+		expired = NULL;
+
+		for (timer = wheel->slot[tick & (BFD_WHEEL_SLOTS - 1)]; timer; timer = next) {
+			next = timer->next;
+
+			if ((timer->when / BFD_WHEEL_TICK) > tick) continue;
+
+			bfd_timer_delete(timer);
+			bfd_timer_link(&expired, timer);
+		}
+
+		/*
+		 *	Callbacks may delete other expired timers, or
+		 *	re-arm their own.
+		 */
+		while ((timer = expired) != NULL) {
+			bfd_timer_delete(timer);
+			timer->callback(timer->ctx, now);
+		}
 	}
+}
 
-	/*
-	 *	Read the rest of the packet.
-	 */
-	num = read(fd, ((uint8_t *) &bfd) + 4, bfd.length - 4);
-	if ((num < 0) || ((num + 4) != bfd.length)) goto fail;
+/*
+ *	How long until the next timer fires, up to one rotation.
+ */
+static void bfd_wheel_delay(bfd_wheel_t *wheel, struct timeval *now, struct timeval *delay)
+{
+	uint64_t	start = bfd_timeval_to_usec(now);
+	uint64_t	when = start + (BFD_WHEEL_SLOTS * BFD_WHEEL_TICK);
+	uint64_t	tick;
+	bfd_timer_t	*timer;
+	bool		found = false;
+
+	for (tick = wheel->tick + 1; !found && (tick <= (wheel->tick + BFD_WHEEL_SLOTS)); tick++) {
+		for (timer = wheel->slot[tick & (BFD_WHEEL_SLOTS - 1)]; timer; timer = timer->next) {
+			if ((timer->when / BFD_WHEEL_TICK) > tick) continue;
+
+			if (timer->when < when) when = timer->when;
+			found = true;
+		}
+	}
 
-	bfd_process(session, &bfd);
+	if (when < start) when = start;
+
+	delay->tv_sec = (when - start) / USEC;
+	delay->tv_usec = (when - start) % USEC;
+}
+
+#ifdef HAVE_PTHREAD_H
+static int bfd_session_start(UNUSED void *ctx, void *data)
+{
+	bfd_start_control(data);
+
+	return 0;
 }
 
 /*
- *	Do nothing more than read from the sockets and process the
- *	timers.
+ *	Run the timers for every session on the socket, and process
+ *	the packets which the listener hands over through the pipe.
  */
-static void *bfd_child_thread(void *ctx)
+static void *bfd_engine_thread(void *ctx)
 {
-	bfd_state_t *session = ctx;
+	bfd_socket_t	*sock = ctx;
+	bfd_message_t	msg;
+	struct timeval	now, delay;
+	fd_set		fds;
+	ssize_t		num;
+
+	DEBUG("BFD starting engine thread for %u sessions", rbtree_num_elements(sock->session_tree));
+
+	gettimeofday(&now, NULL);
+	sock->wheel->tick = bfd_timeval_to_usec(&now) / BFD_WHEEL_TICK;
+
+	rbtree_walk(sock->session_tree, RBTREE_IN_ORDER, bfd_session_start, NULL);
+
+	for (;;) {
+		gettimeofday(&now, NULL);
+		bfd_wheel_run(sock->wheel, &now);
+		bfd_wheel_delay(sock->wheel, &now, &delay);
+
+		FD_ZERO(&fds);
+		FD_SET(sock->pipefd[0], &fds);
+
+		if (select(sock->pipefd[0] + 1, &fds, NULL, NULL, &delay) < 0) {
+			if (errno == EINTR) continue;
+
+			ERROR("BFD failed waiting for packets: %s", fr_syserror(errno));
+			break;
+		}
+
+		if (!FD_ISSET(sock->pipefd[0], &fds)) continue;
+
+		/*
+		 *	Messages are smaller than PIPE_BUF, and are
+		 *	written in one go, so we always read whole ones.
+		 */
+		for (;;) {
+			num = read(sock->pipefd[0], &msg, sizeof(msg));
+			if (num == sizeof(msg)) {
+				bfd_process(msg.session, &msg.bfd);
+				continue;
+			}
 
-	DEBUG("BFD %d starting child thread", session->number);
-	bfd_start_control(session);
+			if (num == 0) return NULL;	/* the listener has gone */
 
-	fr_event_loop(session->el);
+			if (num < 0) {
+				if (errno == EINTR) continue;
+				if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+			}
 
-	bfd_pthread_free(session);
+			ERROR("BFD failed reading from pipe");
+			return NULL;
+		}
+	}
 
 	return NULL;
 }
 
+static int _bfd_socket_free(bfd_socket_t *sock)
+{
+	if (sock->pipefd[1] < 0) return 0;
+
+	/*
+	 *	The engine thread exits when it sees the pipe close.
+	 */
+	close(sock->pipefd[1]);
+	pthread_join(sock->pthread_id, NULL);
+	close(sock->pipefd[0]);
 
-static int bfd_pthread_create(bfd_state_t *session)
+	sock->pipefd[0] = sock->pipefd[1] = -1;
+
+	return 0;
+}
+
+static int bfd_engine_start(bfd_socket_t *sock)
 {
 	int rcode;
-	pthread_attr_t attr;
 
-	if (pipe(session->pipefd) < 0) {
+	if (pipe(sock->pipefd) < 0) {
 		ERROR("Failed opening pipe: %s", fr_syserror(errno));
-		return 0;
-	}
-
-	session->el = fr_event_list_create(session, NULL);
-	if (!session->el) {
-		ERROR("Failed creating event list");
-	close_pipes:
-		close(session->pipefd[0]);
-		close(session->pipefd[1]);
-		session->pipefd[0] = session->pipefd[1] = -1;
-		return 0;
+		sock->pipefd[0] = sock->pipefd[1] = -1;
+		return -1;
 	}
 
 #ifdef O_NONBLOCK
-	fcntl(session->pipefd[0], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
-	fcntl(session->pipefd[1], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
+	fcntl(sock->pipefd[0], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
+	fcntl(sock->pipefd[1], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
 #endif
 
-	if (!fr_event_fd_insert(session->el, 0, session->pipefd[0],
-				bfd_pipe_recv, session)) {
-		ERROR("Failed inserting file descriptor into event list: %s", fr_strerror());
-		goto close_pipes;
-	}
-
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
 	/*
-	 *	Create the thread detached, so that it cleans up it's
-	 *	own memory when it exits.
-	 *
 	 *	Note that the function returns non-zero on error, NOT
 	 *	-1.  The return code is the error, and errno isn't set.
 	 */
-	rcode = pthread_create(&session->pthread_id, &attr,
-			       bfd_child_thread, session);
+	rcode = pthread_create(&sock->pthread_id, NULL, bfd_engine_thread, sock);
 	if (rcode != 0) {
-		talloc_free(session->el);
-		session->el = NULL;
 		ERROR("Thread create failed: %s", fr_syserror(rcode));
-		goto close_pipes;
+		close(sock->pipefd[0]);
+		close(sock->pipefd[1]);
+		sock->pipefd[0] = sock->pipefd[1] = -1;
+		return -1;
 	}
-	pthread_attr_destroy(&attr);
 
-	return 1;
+	talloc_set_destructor(sock, _bfd_socket_free);
+
+	return 0;
+}
+#else
+static int bfd_engine_start(UNUSED bfd_socket_t *sock)
+{
+	ERROR("BFD requires the server to be built with thread support");
+	return -1;
 }
 #endif	/* HAVE_PTHREAD_H */
 
@@ -408,15 +551,6 @@ static void bfd_session_free(void *ctx)
 {
 	bfd_state_t *session = ctx;
 
-#ifdef WITH_PTHREAD_H
-	if (el != session->el) {
-		/*
-		 *	FIXME: this isn't particularly safe.
-		 */
-		bfd_pthread_free(session);
-	}
-#endif
-
 	talloc_free(session);
 }
 
@@ -458,6 +592,39 @@ static ssize_t bfd_parse_secret(CONF_SECTION *cs, uint8_t secret[BFD_MAX_SECRET_
 
 
 
+/*
+ *	The auth section we send is the same for every packet, apart
+ *	from the sequence number.  The digest is calculated over the
+ *	packet with the secret in place of the digest, so keep the
+ *	padded secret there, and only copy it in to sign or verify.
+ */
+static void bfd_auth_init(bfd_state_t *session)
+{
+	bfd_auth_t *auth = &session->auth;
+
+	memset(auth, 0, sizeof(*auth));
+
+	switch (session->auth_type) {
+	case BFD_AUTH_KEYED_MD5:
+	case BFD_AUTH_MET_KEYED_MD5:
+		auth->md5.auth_type = session->auth_type;
+		auth->md5.auth_len = sizeof(auth->md5);
+		memcpy(auth->md5.digest, session->secret, sizeof(auth->md5.digest));
+		break;
+
+	case BFD_AUTH_KEYED_SHA1:
+	case BFD_AUTH_MET_KEYED_SHA1:
+		auth->sha1.auth_type = session->auth_type;
+		auth->sha1.auth_len = sizeof(auth->sha1);
+		memcpy(auth->sha1.digest, session->secret, sizeof(auth->sha1.digest));
+		break;
+
+	default:
+		break;
+	}
+}
+
+
 /*
  *	Create a new session.
  */
@@ -541,6 +708,16 @@ static bfd_state_t *bfd_new_session(bfd_socket_t *sock, int sockfd,
 		memcpy(session->secret, sock->secret, sizeof(session->secret));
 	}
 
+	if (((session->auth_type == BFD_AUTH_KEYED_MD5) ||
+	     (session->auth_type == BFD_AUTH_MET_KEYED_MD5)) &&
+	    (session->secret_len > MD5_DIGEST_LENGTH)) {
+		cf_log_err(cf_section_to_item(cs), "Secret must be no more than 16 bytes when using MD5");
+		talloc_free(session);
+		return NULL;
+	}
+
+	bfd_auth_init(session);
+
 	/*
 	 *	Initialize the detection time.
 	 */
@@ -572,24 +749,9 @@ static bfd_state_t *bfd_new_session(bfd_socket_t *sock, int sockfd,
 	bfd_trigger(session);
 
 	/*
-	 *	Check for threaded / non-threaded operation.
+	 *	The engine thread starts sending packets.
 	 */
-	if (el) {
-		session->el = el;
-
-		bfd_start_control(session);
-
-#ifdef HAVE_PTHREAD_H
-		session->pipefd[0] = session->pipefd[1] = -1;
-		session->pthread_id = pthread_self();
-	} else {
-		if (!bfd_pthread_create(session)) {
-			rbtree_deletebydata(sock->session_tree, session);
-			talloc_free(session);
-			return NULL;
-		}
-#endif
-	}
+	session->wheel = sock->wheel;
 
 	return session;
 }
@@ -627,11 +789,9 @@ static void bfd_calc_md5(bfd_state_t *session, bfd_packet_t *bfd)
 	FR_MD5_CTX ctx;
 	bfd_auth_md5_t *md5 = &bfd->auth.md5;
 
-	rad_assert(session->secret_len <= sizeof(md5->digest));
 	rad_assert(md5->auth_len == sizeof(*md5));
 
-	memset(md5->digest, 0, sizeof(md5->digest));
-	memcpy(md5->digest, session->secret, session->secret_len);
+	memcpy(md5->digest, session->auth.md5.digest, sizeof(md5->digest));
 
 	fr_md5_init(&ctx);
 	fr_md5_update(&ctx, (const uint8_t *) bfd, bfd->length);
@@ -642,11 +802,9 @@ static void bfd_auth_md5(bfd_state_t *session, bfd_packet_t *bfd)
 {
 	bfd_auth_md5_t *md5 = &bfd->auth.md5;
 
-	md5->auth_type = session->auth_type;
-	md5->auth_len = sizeof(*md5);
+	memcpy(md5, &session->auth.md5, sizeof(*md5));
 	bfd->length += md5->auth_len;
 
-	md5->key_id = 0;
 	md5->sequence_no = session->xmit_auth_seq++;
 
 	bfd_calc_md5(session, bfd);
@@ -696,11 +854,9 @@ static void bfd_calc_sha1(bfd_state_t *session, bfd_packet_t *bfd)
 	fr_sha1_ctx ctx;
 	bfd_auth_sha1_t *sha1 = &bfd->auth.sha1;
 
-	rad_assert(session->secret_len <= sizeof(sha1->digest));
 	rad_assert(sha1->auth_len == sizeof(*sha1));
 
-	memset(sha1->digest, 0, sizeof(sha1->digest));
-	memcpy(sha1->digest, session->secret, session->secret_len);
+	memcpy(sha1->digest, session->auth.sha1.digest, sizeof(sha1->digest));
 
 	fr_sha1_init(&ctx);
 	fr_sha1_update(&ctx, (const uint8_t *) bfd, bfd->length);
@@ -711,11 +867,9 @@ static void bfd_auth_sha1(bfd_state_t *session, bfd_packet_t *bfd)
 {
 	bfd_auth_sha1_t *sha1 = &bfd->auth.sha1;
 
-	sha1->auth_type = session->auth_type;
-	sha1->auth_len = sizeof(*sha1);
+	memcpy(sha1, &session->auth.sha1, sizeof(*sha1));
 	bfd->length += sha1->auth_len;
 
-	sha1->key_id = 0;
 	sha1->sequence_no = session->xmit_auth_seq++;
 
 	bfd_calc_sha1(session, bfd);
@@ -892,7 +1046,7 @@ static int bfd_start_packets(bfd_state_t *session)
 	/*
 	 *	Reset the timers.
 	 */
-	fr_event_delete(session->el, &session->ev_packet);
+	bfd_timer_delete(&session->ev_packet);
 
 	gettimeofday(&session->last_sent, NULL);
 	now = session->last_sent;
@@ -903,7 +1057,7 @@ static int bfd_start_packets(bfd_state_t *session)
 		interval = session->remote_min_rx_interval;
 	}
 	base = (interval * 3) / 4;
-	jitter = fr_rand();	/* 32-bit number */
+	jitter = fr_fast_rand();	/* 32-bit number */
 
 	if (session->detect_multi == 1) {
 		jitter *= 644245094;	/* 15% of 2^32 */
@@ -927,10 +1081,7 @@ static int bfd_start_packets(bfd_state_t *session)
 		now.tv_usec -= USEC;
 	}
 
-	if (!fr_event_insert(session->el, bfd_send_packet, session, &now,
-			     &session->ev_packet)) {
-		rad_assert("Failed to insert event" == NULL);
-	}
+	bfd_timer_insert(session->wheel, &session->ev_packet, bfd_send_packet, session, &now);
 
 	return 0;
 }
@@ -940,7 +1091,7 @@ static void bfd_set_timeout(bfd_state_t *session, struct timeval *when)
 {
 	struct timeval now = *when;
 
-	fr_event_delete(session->el, &session->ev_timeout);
+	bfd_timer_delete(&session->ev_timeout);
 
 	if (session->detection_time >= USEC) {
 		now.tv_sec += session->detection_time / USEC;
@@ -968,10 +1119,7 @@ static void bfd_set_timeout(bfd_state_t *session, struct timeval *when)
 		}
 	}
 
-	if (!fr_event_insert(session->el, bfd_detection_timeout, session, &now,
-			     &session->ev_timeout)) {
-		rad_assert("Failed to insert event" == NULL);
-	}
+	bfd_timer_insert(session->wheel, &session->ev_timeout, bfd_detection_timeout, session, &now);
 }
 
 
@@ -994,15 +1142,15 @@ static int bfd_start_control(bfd_state_t *session)
 
 	bfd_set_timeout(session, &session->last_recv);
 
-	if (session->ev_packet) return 0;
+	if (bfd_timer_armed(&session->ev_packet)) return 0;
 
 	return bfd_start_packets(session);
 }
 
 static int bfd_stop_control(bfd_state_t *session)
 {
-	fr_event_delete(session->el, &session->ev_timeout);
-	fr_event_delete(session->el, &session->ev_packet);
+	bfd_timer_delete(&session->ev_timeout);
+	bfd_timer_delete(&session->ev_packet);
 	return 1;
 }
 
@@ -1047,8 +1195,8 @@ static int bfd_stop_poll(bfd_state_t *session)
 	 *	re-set the timers.
 	 */
 	if (!session->remote_demand_mode) {
-		rad_assert(session->ev_timeout != NULL);
-		rad_assert(session->ev_packet != NULL);
+		rad_assert(bfd_timer_armed(&session->ev_timeout));
+		rad_assert(bfd_timer_armed(&session->ev_packet));
 		session->doing_poll = 0;
 
 		bfd_stop_control(session);
@@ -1421,6 +1569,7 @@ static int bfd_socket_recv(rad_listen_t *listener)
 	struct sockaddr_storage src;
 	socklen_t	sizeof_src = sizeof(src);
 	bfd_packet_t	bfd;
+	bfd_message_t	msg;
 
 	rcode = recvfrom(listener->fd, &bfd, sizeof(bfd), 0,
 			 (struct sockaddr *)&src, &sizeof_src);
@@ -1499,42 +1648,18 @@ static int bfd_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
-#ifdef HAVE_PTHREAD_H
-	if (!el) {
-		uint8_t *p = (uint8_t *) &bfd;
-		size_t total = bfd.length;
-
-		/*
-		 *	A child has had a problem.  Do some cleanups.
-		 */
-		if (session->blocked) bfd_pthread_free(session);
-
-		/*
-		 *	No event list, try to create a new one.
-		 */
-		if (!session->el && !bfd_pthread_create(session)) {
-			DEBUG("BFD %d - error trying to create child thread",
-			      session->number);
-			return 0;
-		}
-
-		do {
-			rcode = write(session->pipefd[1], p, total);
-			if ((rcode < 0) && (errno == EINTR)) continue;
-
-			if (rcode < 0) {
-				session->blocked = true;
-				return 0;
-			}
+	/*
+	 *	The engine thread owns the sessions.  If it's
+	 *	behind, drop the packet, as BFD tolerates loss.
+	 */
+	msg.session = session;
+	memcpy(&msg.bfd, &bfd, sizeof(msg.bfd));
 
-			total -= rcode;
-			p += rcode;
-		} while (total > 0);
-		return 0;
+	if (write(sock->pipefd[1], &msg, sizeof(msg)) < 0) {
+		DEBUG("BFD %d dropping packet: %s", session->number, fr_syserror(errno));
 	}
-#endif
 
-	return bfd_process(session, &bfd);
+	return 0;
 }
 
 static int bfd_parse_ip_port(CONF_SECTION *cs, fr_ipaddr_t *ipaddr, uint16_t *port)
@@ -1723,6 +1848,13 @@ static int bfd_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 		exit(1);
 	}
 
+	sock->wheel = talloc_zero(sock, bfd_wheel_t);
+	if (!sock->wheel) {
+		ERROR("Failed creating timer wheel!");
+		exit(1);
+	}
+	sock->pipefd[0] = sock->pipefd[1] = -1;
+
 	return 0;
 }
 
@@ -1765,6 +1897,10 @@ static int bfd_socket_open(CONF_SECTION *cs, rad_listen_t *this)
 		exit(1);
 	}
 
+	if (bfd_engine_start(sock) < 0) {
+		exit(1);
+	}
+
 	return 0;
 }
 
@@ -179,70 +179,242 @@ static int dhcp_header_sizes[] = {
 #define DHCP_FILE_FIELD	  	(1)
 #define DHCP_SNAME_FIELD  	(2)
 
-static uint8_t const *dhcp_get_option(dhcp_packet_t const *packet, size_t packet_size, unsigned int option)
+/** Where each option is in a DHCP packet
+ *
+ * Built in one pass over the options field, and then over the file
+ * and sname fields if option 52 says they hold options too.
+ */
+typedef struct dhcp_option_index {
+	uint16_t	first[256];	//!< Offset of the first instance of each option, 0 if absent.
+	uint16_t	num;		//!< Number of options.
+	uint16_t	left;		//!< Number which haven't been decoded.
+	uint16_t	offset[];	//!< Of each option in packet->data, 0 once decoded.
+} dhcp_option_index_t;
+
+/** Record where the options are, checking that they're well formed
+ *
+ * @param ctx to allocate the index in.
+ * @param data of the DHCP packet.
+ * @param data_len of the DHCP packet.  Must be at least MIN_PACKET_SIZE.
+ * @return
+ *	- The index.
+ *	- NULL if an option overflows its field.
+ */
+static dhcp_option_index_t *dhcp_option_index(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len)
 {
-	int overload = 0;
-	int field = DHCP_OPTION_FIELD;
-	size_t where, size;
-	uint8_t const *data;
+	dhcp_option_index_t	*index;
+	uint16_t		first[256];
+	uint16_t		offset[MAX_PACKET_SIZE / 2];
+	unsigned int		num = 0;
+	int			overload = 0;
+	int			field = DHCP_OPTION_FIELD;
+	size_t			where, end;
 
-	where = 0;
-	size = packet_size - offsetof(dhcp_packet_t, options);
-	data = &packet->options[where];
+	memset(first, 0, sizeof(first));
 
-	while (where < size) {
-		if (data[0] == 0) { /* padding */
-			where++;
-			continue;
-		}
+	where = offsetof(dhcp_packet_t, options);
+	end = data_len;
 
-		if (data[0] == 255) { /* end of options */
-			if ((field == DHCP_OPTION_FIELD) &&
-			    (overload & DHCP_FILE_FIELD)) {
-				data = packet->file;
-				where = 0;
-				size = sizeof(packet->file);
-				field = DHCP_FILE_FIELD;
-				continue;
+	for (;;) {
+		while (where < end) {
+			uint8_t const *p = data + where;
 
-			} else if ((field == DHCP_FILE_FIELD) &&
-				   (overload & DHCP_SNAME_FIELD)) {
-				data = packet->sname;
-				where = 0;
-				size = sizeof(packet->sname);
-				field = DHCP_SNAME_FIELD;
+			if (p[0] == 0) { /* padding */
+				where++;
 				continue;
 			}
 
-			return NULL;
+			if (p[0] == 255) break; /* end of options */
+
+			/*
+			 *	We MUST have a real option here.
+			 */
+			if ((where + 2) > end) {
+				fr_strerror_printf("Options overflow field at %u", (unsigned int) where);
+				return NULL;
+			}
+
+			if ((where + 2 + p[1]) > end) {
+				fr_strerror_printf("Option length overflows field at %u", (unsigned int) where);
+				return NULL;
+			}
+
+			/*
+			 *	Overload sname and/or file.
+			 */
+			if ((p[0] == 52) && (field == DHCP_OPTION_FIELD) && (p[1] >= 1)) overload = p[2];
+
+			if (!first[p[0]]) first[p[0]] = where;
+			if (num < (sizeof(offset) / sizeof(offset[0]))) offset[num++] = where;
+
+			where += p[1] + 2;
 		}
 
-		/*
-		 *	We MUST have a real option here.
-		 */
-		if ((where + 2) > size) {
-			fr_strerror_printf("Options overflow field at %u",
-					   (unsigned int) (data - (uint8_t const *) packet));
-			return NULL;
+		if ((field == DHCP_OPTION_FIELD) && (overload & DHCP_FILE_FIELD)) {
+			field = DHCP_FILE_FIELD;
+			where = offsetof(dhcp_packet_t, file);
+			end = where + DHCP_FILE_LEN;
+			continue;
 		}
 
-		if ((where + 2 + data[1]) > size) {
-			fr_strerror_printf("Option length overflows field at %u",
-					   (unsigned int) (data - (uint8_t const *) packet));
-			return NULL;
+		if ((field != DHCP_SNAME_FIELD) && (overload & DHCP_SNAME_FIELD)) {
+			field = DHCP_SNAME_FIELD;
+			where = offsetof(dhcp_packet_t, sname);
+			end = where + DHCP_SNAME_LEN;
+			continue;
 		}
 
-		if (data[0] == option) return data;
+		break;
+	}
+
+	index = talloc_size(ctx, sizeof(*index) + (num * sizeof(index->offset[0])));
+	if (!index) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	talloc_set_name_const(index, "dhcp_option_index_t");
+
+	memcpy(index->first, first, sizeof(index->first));
+	index->num = index->left = num;
+	memcpy(index->offset, offset, num * sizeof(index->offset[0]));
+
+	return index;
+}
+
+static inline uint8_t const *dhcp_option_find(dhcp_option_index_t const *index, uint8_t const *data,
+					     unsigned int option)
+{
+	if (!index || (option > 255) || !index->first[option]) return NULL;
+
+	return data + index->first[option];
+}
+
+/** Find the first instance of an option in an indexed packet
+ *
+ * @param packet with an index, built by fr_dhcp_packet_ok or fr_dhcp_decode.
+ * @param option to find.
+ * @return
+ *	- The option, starting at its code.
+ *	- NULL if the option isn't in the packet.
+ */
+uint8_t const *fr_dhcp_option_find(RADIUS_PACKET const *packet, unsigned int option)
+{
+	return dhcp_option_find(packet->proto_index, packet->data, option);
+}
+
+/** Find where the options field ends
+ *
+ * @return offset of the end-of-options marker, or of the end of the
+ *	packet if there isn't one.
+ */
+static size_t dhcp_options_end(uint8_t const *data, size_t data_len)
+{
+	size_t where = offsetof(dhcp_packet_t, options);
 
-		if (data[0] == 52) { /* overload sname and/or file */
-			overload = data[3];
+	while (where < data_len) {
+		if (data[where] == 255) break;
+		if (data[where] == 0) {
+			where++;
+			continue;
 		}
+		if ((where + 2) > data_len) break;
+		where += data[where + 1] + 2;
+	}
+
+	return (where > data_len) ? data_len : where;
+}
+
+/** Add an encoded option to the end of the options field of a received packet
+ *
+ * Used by the relay code, which forwards the original packet instead of
+ * re-encoding it.  The option index is rebuilt.
+ *
+ * @param packet with an index, built by fr_dhcp_packet_ok or fr_dhcp_decode.
+ * @param option to add, starting at its code.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the packet would be too large.
+ */
+int fr_dhcp_option_append(RADIUS_PACKET *packet, uint8_t const *option)
+{
+	dhcp_option_index_t	*index;
+	size_t			end, len = option[1] + 2;
+	uint8_t			*data;
 
-		where += data[1] + 2;
-		data += data[1] + 2;
+	end = dhcp_options_end(packet->data, packet->data_len);
+	if ((end + len + 1) > MAX_PACKET_SIZE) {
+		fr_strerror_printf("No room for option %u", option[0]);
+		return -1;
 	}
 
-	return NULL;
+	if ((end + len + 1) > talloc_array_length(packet->data)) {
+		data = talloc_realloc(packet, packet->data, uint8_t, end + len + 1);
+		if (!data) {
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+		packet->data = data;
+	}
+
+	memcpy(packet->data + end, option, len);
+	packet->data[end + len] = 255;
+	if (packet->data_len < (end + len + 1)) packet->data_len = end + len + 1;
+
+	index = dhcp_option_index(packet, packet->data, packet->data_len);
+	if (!index) return -1;
+	talloc_free(packet->proto_index);
+	packet->proto_index = index;
+
+	return 0;
+}
+
+/** Remove every instance of an option from the options field of a received packet
+ *
+ * The options which follow are moved down, and the space left at the
+ * end is zeroed, so the packet keeps its length.  The option index is
+ * rebuilt.
+ *
+ * @param packet with an index, built by fr_dhcp_packet_ok or fr_dhcp_decode.
+ * @param option to remove.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_dhcp_option_remove(RADIUS_PACKET *packet, unsigned int option)
+{
+	dhcp_option_index_t	*index;
+	uint8_t			*data = packet->data;
+	size_t			where, end, len;
+
+	if (!dhcp_option_find(packet->proto_index, data, option)) return 0;
+
+	end = dhcp_options_end(data, packet->data_len);
+	where = offsetof(dhcp_packet_t, options);
+
+	while (where < end) {
+		if (data[where] == 0) {
+			where++;
+			continue;
+		}
+		if ((where + 2) > end) break;
+
+		len = data[where + 1] + 2;
+		if (data[where] != option) {
+			where += len;
+			continue;
+		}
+
+		memmove(data + where, data + where + len, packet->data_len - (where + len));
+		memset(data + packet->data_len - len, 0, len);
+		end -= len;
+	}
+
+	index = dhcp_option_index(packet, data, packet->data_len);
+	if (!index) return -1;
+	talloc_free(packet->proto_index);
+	packet->proto_index = index;
+
+	return 0;
 }
 
 /** Receive DHCP packet using socket
@@ -376,21 +548,32 @@ RADIUS_PACKET *fr_dhcp_packet_ok(uint8_t const *data, ssize_t data_len, fr_ipadd
 	memcpy(&magic, data + 4, 4);
 	pkt_id = ntohl(magic);
 
-	code = dhcp_get_option((dhcp_packet_t const *) data, data_len, PW_DHCP_MESSAGE_TYPE);
+	packet = fr_radius_alloc(NULL, false);
+	if (!packet) {
+		fr_strerror_printf("Failed allocating packet");
+		return NULL;
+	}
+
+	/*
+	 *	One pass over the options, which checks them, and
+	 *	lets later lookups and lazy decoding skip the scan.
+	 */
+	packet->proto_index = dhcp_option_index(packet, data, data_len);
+	if (!packet->proto_index) {
+		fr_radius_free(&packet);
+		return NULL;
+	}
+
+	code = dhcp_option_find(packet->proto_index, data, PW_DHCP_MESSAGE_TYPE);
 	if (!code) {
 		fr_strerror_printf("No message-type option was found in the packet");
+		fr_radius_free(&packet);
 		return NULL;
 	}
 
 	if ((code[1] < 1) || (code[2] == 0) || (code[2] >= DHCP_MAX_MESSAGE_TYPE)) {
 		fr_strerror_printf("Unknown value %d for message-type option", code[2]);
-		return NULL;
-	}
-
-	/* Now that checks are done, allocate packet */
-	packet = fr_radius_alloc(NULL, false);
-	if (!packet) {
-		fr_strerror_printf("Failed allocating packet");
+		fr_radius_free(&packet);
 		return NULL;
 	}
 
@@ -430,24 +613,23 @@ RADIUS_PACKET *fr_dhcp_packet_ok(uint8_t const *data, ssize_t data_len, fr_ipadd
 	return packet;
 }
 
-#ifdef HAVE_PCAP_H
-/** Receive DHCP packet using PCAP
+#if defined(HAVE_PCAP_H) || defined(HAVE_DHCP_RING)
+/** Check the IP and UDP headers of a captured frame, and build a RADIUS_PACKET from its payload
  *
- * @param pcap handle
+ * @param data the frame, starting at the link layer header.
+ * @param caplen how much of the frame was captured.
+ * @param link_len length of the link layer header.
  * @return
  *	- pointer to RADIUS_PACKET if successful.
- *	- NULL if failed.
+ *	- NULL if the frame isn't a valid DHCP packet.
  */
-RADIUS_PACKET *fr_dhcp_recv_pcap(fr_pcap_t *pcap)
+static RADIUS_PACKET *dhcp_frame_decode(uint8_t const *data, size_t caplen, ssize_t link_len)
 {
 	int			ret;
-
-	uint8_t const		*data;
 	ssize_t			data_len;
 	fr_ipaddr_t		src_ipaddr, dst_ipaddr;
 	uint16_t		src_port, dst_port;
-	struct pcap_pkthdr	*header;
-	ssize_t			link_len, len;
+	ssize_t			len;
 	RADIUS_PACKET		*packet;
 
 	/*
@@ -459,22 +641,6 @@ RADIUS_PACKET *fr_dhcp_recv_pcap(fr_pcap_t *pcap)
 	udp_header_t const	*udp;		/* The UDP header */
 	uint8_t			version;	/* IP header version */
 
-	ret = pcap_next_ex(pcap->handle, &header, &data);
-	if (ret == 0) {
-		DEBUG("DHCP: No packet received");
-		return NULL; /* no packet */
-	}
-	if (ret < 0) {
-		fr_strerror_printf("Error requesting next packet, got (%i): %s", ret, pcap_geterr(pcap->handle));
-		return NULL;
-	}
-
-	link_len = fr_link_layer_offset(data, header->caplen, pcap->link_layer);
-	if (link_len < 0) {
-		fr_strerror_printf("Failed determining link layer header offset: %s", fr_strerror());
-		return NULL;
-	}
-
 	p = data;
 
 	/* Skip ethernet header */
@@ -507,7 +673,7 @@ RADIUS_PACKET *fr_dhcp_recv_pcap(fr_pcap_t *pcap)
 	 *	End of variable length bits, do basic check now to see if packet looks long enough
 	 */
 	len = (p - data) + UDP_HDR_SIZE;	/* length value */
-	if ((size_t) len > header->caplen) {
+	if ((size_t) len > caplen) {
 		DEBUG("DHCP: Payload (%d) smaller than required for layers 2+3+4", (int)len);
 		return NULL;
 	}
@@ -515,7 +681,7 @@ RADIUS_PACKET *fr_dhcp_recv_pcap(fr_pcap_t *pcap)
 	/*
 	 *	UDP header validation.
 	 */
-	ret = fr_udp_header_check(p, (header->caplen - (p - data)), ip);
+	ret = fr_udp_header_check(p, (caplen - (p - data)), ip);
 	if (ret < 0) {
 		DEBUG("DHCP: %s", fr_strerror());
 		return NULL;
@@ -542,8 +708,114 @@ RADIUS_PACKET *fr_dhcp_recv_pcap(fr_pcap_t *pcap)
 	dst_ipaddr.zone_id        = 0;
 
 	packet = fr_dhcp_packet_ok(p, data_len, src_ipaddr, src_port, dst_ipaddr, dst_port);
+	if (packet) packet->data = talloc_memdup(packet, p, packet->data_len);
+
+	return packet;
+}
+
+/** Build an Ethernet / IPv4 / UDP frame around an encoded DHCP packet
+ *
+ * @param frame to write to.  Must be at least 1518 bytes.
+ * @param src_ether_addr Ethernet source address.
+ * @param dst_ether_addr Ethernet destination address.
+ * @param packet to wrap.  Must already be encoded.
+ * @return the length of the frame.
+ */
+static size_t dhcp_frame_encode(uint8_t *frame, uint8_t const *src_ether_addr, uint8_t const *dst_ether_addr,
+				RADIUS_PACKET *packet)
+{
+	ethernet_header_t	*eth_hdr;
+	ip_header_t		*ip_hdr;
+	udp_header_t		*udp_hdr;
+	dhcp_packet_t		*dhcp;
+	/* Pointer to the current position in the frame */
+	uint8_t			*end = frame;
+	uint16_t		l4_len;
+
+	/* fill in Ethernet layer (L2) */
+	eth_hdr = (ethernet_header_t *)frame;
+	memcpy(eth_hdr->ether_dst, dst_ether_addr, ETH_ADDR_LEN);
+	memcpy(eth_hdr->ether_src, src_ether_addr, ETH_ADDR_LEN);
+	eth_hdr->ether_type = htons(ETH_TYPE_IP);
+	end += ETH_ADDR_LEN + ETH_ADDR_LEN + sizeof(eth_hdr->ether_type);
+
+	/* fill in IP layer (L3) */
+	ip_hdr = (ip_header_t *)(end);
+	ip_hdr->ip_vhl = IP_VHL(4, 5);
+	ip_hdr->ip_tos = 0;
+	ip_hdr->ip_len = htons(IP_HDR_SIZE +  UDP_HDR_SIZE + packet->data_len);
+	ip_hdr->ip_id = 0;
+	ip_hdr->ip_off = 0;
+	ip_hdr->ip_ttl = 64;
+	ip_hdr->ip_p = 17;
+	ip_hdr->ip_sum = 0; /* Filled later */
+
+	ip_hdr->ip_src.s_addr = packet->src_ipaddr.ipaddr.ip4addr.s_addr;
+	ip_hdr->ip_dst.s_addr = packet->dst_ipaddr.ipaddr.ip4addr.s_addr;
+
+	/* IP header checksum */
+	ip_hdr->ip_sum = fr_ip_header_checksum((uint8_t const *)ip_hdr, 5);
+	end += IP_HDR_SIZE;
+
+	/* fill in UDP layer (L4) */
+	udp_hdr = (udp_header_t *)end;
+
+	udp_hdr->src = htons(packet->src_port);
+	udp_hdr->dst = htons(packet->dst_port);
+	l4_len = (UDP_HDR_SIZE + packet->data_len);
+	udp_hdr->len = htons(l4_len);
+	udp_hdr->checksum = 0; /* UDP checksum will be done after dhcp header */
+	end += UDP_HDR_SIZE;
+
+	/* DHCP layer (L7) */
+	dhcp = (dhcp_packet_t *)end;
+	/* just copy what FreeRADIUS has encoded for us. */
+	memcpy(dhcp, packet->data, packet->data_len);
+
+	/* UDP checksum is done here */
+	udp_hdr->checksum = fr_udp_checksum((uint8_t const *)udp_hdr, ntohs(udp_hdr->len), udp_hdr->checksum,
+					    packet->src_ipaddr.ipaddr.ip4addr,
+					    packet->dst_ipaddr.ipaddr.ip4addr);
+
+	return (end - frame) + packet->data_len;
+}
+#endif
+
+#ifdef HAVE_PCAP_H
+/** Receive DHCP packet using PCAP
+ *
+ * @param pcap handle
+ * @return
+ *	- pointer to RADIUS_PACKET if successful.
+ *	- NULL if failed.
+ */
+RADIUS_PACKET *fr_dhcp_recv_pcap(fr_pcap_t *pcap)
+{
+	int			ret;
+
+	uint8_t const		*data;
+	struct pcap_pkthdr	*header;
+	ssize_t			link_len;
+	RADIUS_PACKET		*packet;
+
+	ret = pcap_next_ex(pcap->handle, &header, &data);
+	if (ret == 0) {
+		DEBUG("DHCP: No packet received");
+		return NULL; /* no packet */
+	}
+	if (ret < 0) {
+		fr_strerror_printf("Error requesting next packet, got (%i): %s", ret, pcap_geterr(pcap->handle));
+		return NULL;
+	}
+
+	link_len = fr_link_layer_offset(data, header->caplen, pcap->link_layer);
+	if (link_len < 0) {
+		fr_strerror_printf("Failed determining link layer header offset: %s", fr_strerror());
+		return NULL;
+	}
+
+	packet = dhcp_frame_decode(data, header->caplen, link_len);
 	if (packet) {
-		packet->data = talloc_memdup(packet, p, packet->data_len);
 		packet->timestamp = header->ts;
 		packet->if_index = pcap->if_index;
 		return packet;
@@ -609,60 +881,11 @@ int fr_dhcp_send_pcap(fr_pcap_t *pcap, uint8_t *dst_ether_addr, RADIUS_PACKET *p
 {
 	int			ret;
 	uint8_t			dhcp_packet[1518] = { 0 };
-	ethernet_header_t	*eth_hdr;
-	ip_header_t		*ip_hdr;
-	udp_header_t		*udp_hdr;
-	dhcp_packet_t		*dhcp;
-	/* Pointer to the current position in the frame */
-	uint8_t			*end = dhcp_packet;
-	uint16_t		l4_len;
+	size_t			len;
 
-	/* fill in Ethernet layer (L2) */
-	eth_hdr = (ethernet_header_t *)dhcp_packet;
-	memcpy(eth_hdr->ether_dst, dst_ether_addr, ETH_ADDR_LEN);
-	memcpy(eth_hdr->ether_src, pcap->ether_addr, ETH_ADDR_LEN);
-	eth_hdr->ether_type = htons(ETH_TYPE_IP);
-	end += ETH_ADDR_LEN + ETH_ADDR_LEN + sizeof(eth_hdr->ether_type);
-
-	/* fill in IP layer (L3) */
-	ip_hdr = (ip_header_t *)(end);
-	ip_hdr->ip_vhl = IP_VHL(4, 5);
-	ip_hdr->ip_tos = 0;
-	ip_hdr->ip_len = htons(IP_HDR_SIZE +  UDP_HDR_SIZE + packet->data_len);
-	ip_hdr->ip_id = 0;
-	ip_hdr->ip_off = 0;
-	ip_hdr->ip_ttl = 64;
-	ip_hdr->ip_p = 17;
-	ip_hdr->ip_sum = 0; /* Filled later */
-
-	ip_hdr->ip_src.s_addr = packet->src_ipaddr.ipaddr.ip4addr.s_addr;
-	ip_hdr->ip_dst.s_addr = packet->dst_ipaddr.ipaddr.ip4addr.s_addr;
-
-	/* IP header checksum */
-	ip_hdr->ip_sum = fr_ip_header_checksum((uint8_t const *)ip_hdr, 5);
-	end += IP_HDR_SIZE;
-
-	/* fill in UDP layer (L4) */
-	udp_hdr = (udp_header_t *)end;
-
-	udp_hdr->src = htons(packet->src_port);
-	udp_hdr->dst = htons(packet->dst_port);
-	l4_len = (UDP_HDR_SIZE + packet->data_len);
-	udp_hdr->len = htons(l4_len);
-	udp_hdr->checksum = 0; /* UDP checksum will be done after dhcp header */
-	end += UDP_HDR_SIZE;
-
-	/* DHCP layer (L7) */
-	dhcp = (dhcp_packet_t *)end;
-	/* just copy what FreeRADIUS has encoded for us. */
-	memcpy(dhcp, packet->data, packet->data_len);
+	len = dhcp_frame_encode(dhcp_packet, pcap->ether_addr, dst_ether_addr, packet);
 
-	/* UDP checksum is done here */
-	udp_hdr->checksum = fr_udp_checksum((uint8_t const *)udp_hdr, ntohs(udp_hdr->len), udp_hdr->checksum,
-					    packet->src_ipaddr.ipaddr.ip4addr,
-					    packet->dst_ipaddr.ipaddr.ip4addr);
-
-	ret = pcap_inject(pcap->handle, dhcp_packet, (end - dhcp_packet + packet->data_len));
+	ret = pcap_inject(pcap->handle, dhcp_packet, len);
 	if (ret < 0) {
 		fr_strerror_printf("DHCP: Error sending packet with pcap: %d, %s", ret, pcap_geterr(pcap->handle));
 		return -1;
@@ -1107,6 +1330,87 @@ ssize_t fr_dhcp_decode_option(TALLOC_CTX *ctx, vp_cursor_t *cursor,
 	return ret;
 }
 
+/** Decode options recorded in the packet's index, which haven't been decoded yet
+ *
+ * @param[in] packet with an index.
+ * @param[in,out] cursor Where to write the decoded options.
+ * @param[in] attr option to decode all instances of, or 0 for all of them.
+ * @return
+ *	- 0 on success.
+ *	- -1 on decoding error.
+ */
+static int dhcp_decode_options(RADIUS_PACKET *packet, vp_cursor_t *cursor, unsigned int attr)
+{
+	dhcp_option_index_t	*index = packet->proto_index;
+	uint16_t		i;
+
+	if (!index->left) return 0;
+	if (attr && ((attr > 255) || !index->first[attr])) return 0;
+
+	for (i = 0; (i < index->num) && (index->left > 0); i++) {
+		uint8_t const *p;
+
+		if (!index->offset[i]) continue;
+
+		p = packet->data + index->offset[i];
+		if (attr && (p[0] != attr)) continue;
+
+		if (fr_dhcp_decode_option(packet, cursor, fr_dict_root(fr_dict_internal), p, p[1] + 2, NULL) < 0) {
+			return -1;
+		}
+
+		index->offset[i] = 0;
+		index->left--;
+	}
+
+	return 0;
+}
+
+/** Decode options skipped by a lazy fr_dhcp_decode
+ *
+ * Decoded options are added to the end of packet->vps.  Each option is
+ * only decoded once.
+ *
+ * @param[in] packet which was decoded with packet->lazy set.
+ * @param[in] da to decode.  All instances of the option containing da are
+ *	decoded.  If NULL, all of the remaining options are decoded.
+ * @return
+ *	- 0 on success (including if there was nothing to decode).
+ *	- -1 on decoding error.
+ */
+int fr_dhcp_decode_pending(RADIUS_PACKET *packet, fr_dict_attr_t const *da)
+{
+	dhcp_option_index_t	*index = packet->proto_index;
+	unsigned int		attr = 0;
+	VALUE_PAIR		*head = NULL;
+	vp_cursor_t		cursor, out;
+
+	if (!index || !index->left) return 0;
+
+	if (da) {
+		while (da->parent && (da->parent->type != PW_TYPE_VENDOR)) da = da->parent;
+
+		/*
+		 *	Header fields and internal attributes are
+		 *	never pending.
+		 */
+		if (!da->parent || (da->vendor != DHCP_MAGIC_VENDOR) || (da->attr > 255)) return 0;
+		attr = da->attr;
+	}
+
+	fr_cursor_init(&cursor, &head);
+	if (dhcp_decode_options(packet, &cursor, attr) < 0) {
+		fr_pair_list_free(&head);
+		return -1;
+	}
+
+	fr_cursor_init(&out, &packet->vps);
+	fr_cursor_last(&out);		/* Move insertion point to the end of the list */
+	fr_cursor_merge(&out, head);
+
+	return 0;
+}
+
 int fr_dhcp_decode(RADIUS_PACKET *packet)
 {
 	size_t i;
@@ -1217,32 +1521,46 @@ int fr_dhcp_decode(RADIUS_PACKET *packet)
 	}
 
 	/*
-	 *	Loop over the options.
+	 *	Packets we didn't receive, e.g. ones we encoded
+	 *	ourselves, haven't been indexed yet.
 	 */
+	if (!packet->proto_index) {
+		if (packet->data_len < MIN_PACKET_SIZE) {
+			fr_strerror_printf("DHCP packet is too small (%zu < %d)", packet->data_len, MIN_PACKET_SIZE);
+			fr_pair_list_free(&head);
+			return -1;
+		}
+
+		packet->proto_index = dhcp_option_index(packet, packet->data, packet->data_len);
+		if (!packet->proto_index) {
+			fr_pair_list_free(&head);
+			return -1;
+		}
+	}
 
 	/*
-	 * 	Nothing uses tail after this call, if it does in the future
-	 *	it'll need to find the new tail...
+	 *	Lazy decoding only does the options the server
+	 *	looks at itself.  The rest are decoded by
+	 *	fr_dhcp_decode_pending() when something asks for them.
 	 */
-	{
-		uint8_t const *end;
-		ssize_t len;
-
-		p = packet->data + 240;
-		end = p + (packet->data_len - 240);
-
-		/*
-		 *	Loop over all the options data
-		 */
-		while (p < end) {
-			len = fr_dhcp_decode_option(packet, &cursor, fr_dict_root(fr_dict_internal),
-						    p, ((end - p) > UINT8_MAX) ? UINT8_MAX : (end - p), NULL);
-			if (len <= 0) {
+	if (packet->lazy) {
+		static unsigned int const eager[] = {
+			PW_DHCP_MESSAGE_TYPE,
+			26,			/* DHCP-Interface-MTU-Size */
+			57,			/* DHCP-DHCP-Maximum-Msg-Size */
+			63,			/* DHCP-Netware-Sub-Options, checked for "MSFT 98" below */
+			82			/* DHCP-Relay-Agent-Information */
+		};
+
+		for (i = 0; i < (sizeof(eager) / sizeof(eager[0])); i++) {
+			if (dhcp_decode_options(packet, &cursor, eager[i]) < 0) {
 				fr_pair_list_free(&head);
-				return len;
+				return -1;
 			}
-			p += len;
 		}
+	} else if (dhcp_decode_options(packet, &cursor, 0) < 0) {
+		fr_pair_list_free(&head);
+		return -1;
 	}
 
 	/*
@@ -2166,7 +2484,13 @@ RADIUS_PACKET *fr_dhcp_recv_raw_packet(int sockfd, struct sockaddr_ll *link_laye
 	TALLOC_FREE(raw_packet);
 	packet->id = xid;
 
-	code = dhcp_get_option((dhcp_packet_t const *) packet->data, packet->data_len, PW_DHCP_MESSAGE_TYPE);
+	packet->proto_index = dhcp_option_index(packet, packet->data, packet->data_len);
+	if (!packet->proto_index) {
+		fr_radius_free(&packet);
+		return NULL;
+	}
+
+	code = fr_dhcp_option_find(packet, PW_DHCP_MESSAGE_TYPE);
 	if (!code) {
 		fr_strerror_printf("No message-type option was found in the packet");
 		fr_radius_free(&packet);
@@ -2207,3 +2531,380 @@ RADIUS_PACKET *fr_dhcp_recv_raw_packet(int sockfd, struct sockaddr_ll *link_laye
 	return packet;
 }
 #endif
+
+#ifdef HAVE_DHCP_RING
+#include <sys/mman.h>
+#include <net/if.h>
+#include <linux/filter.h>
+
+#define DHCP_RING_BLOCK_SIZE	(1 << 18)
+#define DHCP_RING_FRAME_SIZE	(1 << 11)
+
+/*
+ *	How long the kernel holds on to a partially filled RX block,
+ *	before handing it over to us.  This is the worst-case added
+ *	latency when the server isn't busy.
+ */
+#define DHCP_RING_BLOCK_TIMEOUT	(4)
+
+/*
+ *	Queued replies are flushed at least this often, so a long
+ *	run of requests doesn't hold back the first replies.
+ */
+#define DHCP_RING_TX_BATCH	(64)
+
+static int _dhcp_ring_free(fr_dhcp_ring_t *ring)
+{
+	if (ring->rx_map) munmap(ring->rx_map, ring->rx_req.tp_block_size * ring->rx_req.tp_block_nr);
+	if (ring->tx_map) munmap(ring->tx_map, ring->tx_req.tp_block_size * ring->tx_req.tp_block_nr);
+
+	if (ring->fd >= 0) close(ring->fd);
+	if (ring->tx_fd >= 0) close(ring->tx_fd);
+	if (ring->bound_fd >= 0) close(ring->bound_fd);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&ring->mutex);
+#endif
+
+	return 0;
+}
+
+/** Open PACKET_MMAP RX and TX rings on an interface
+ *
+ * The RX socket has a BPF filter attached, so the kernel only copies
+ * unfragmented IPv4 UDP packets for the DHCP port into the ring.
+ *
+ * @param ctx to allocate the ring in.
+ * @param interface to bind the rings to.
+ * @param port DHCP packets are sent to, usually 67.
+ * @param size of the RX ring in bytes.  The TX ring is a quarter of this.
+ * @return
+ *	- The new ring.
+ *	- NULL on error.
+ */
+fr_dhcp_ring_t *fr_dhcp_ring_alloc(TALLOC_CTX *ctx, char const *interface, uint16_t port, size_t size)
+{
+	fr_dhcp_ring_t		*ring;
+	struct sockaddr_ll	rx_ll;
+	struct ifreq		ifr;
+	struct sock_fprog	prog;
+	int			version, one = 1;
+
+	/*
+	 *	ether[12:2] == ip && ip[9] == udp && !(ip[6:2] & 0x1fff) && udp[2:2] == port
+	 */
+	struct sock_filter	filter[] = {
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 8),
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 6),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),
+		BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 4, 0),
+		BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, ETH_HDR_SIZE),
+		BPF_STMT(BPF_LD | BPF_H | BPF_IND, ETH_HDR_SIZE + 2),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, port, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffff),
+		BPF_STMT(BPF_RET | BPF_K, 0)
+	};
+
+	ring = talloc_zero(ctx, fr_dhcp_ring_t);
+	if (!ring) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	ring->fd = ring->tx_fd = ring->bound_fd = -1;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&ring->mutex, NULL);
+#endif
+	talloc_set_destructor(ring, _dhcp_ring_free);
+
+	ring->if_index = if_nametoindex(interface);
+	if (!ring->if_index) {
+		fr_strerror_printf("Unknown interface \"%s\"", interface);
+	error:
+		talloc_free(ring);
+		return NULL;
+	}
+
+	/*
+	 *	Protocol 0, so nothing is queued to the socket
+	 *	until the filter is attached and we bind it.
+	 */
+	ring->fd = socket(PF_PACKET, SOCK_RAW, 0);
+	if (ring->fd < 0) {
+		fr_strerror_printf("Failed opening packet socket: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	version = TPACKET_V3;
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		fr_strerror_printf("Failed enabling TPACKET_V3: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	prog.len = sizeof(filter) / sizeof(filter[0]);
+	prog.filter = filter;
+	if (setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		fr_strerror_printf("Failed attaching filter: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	ring->rx_req.tp_block_size = DHCP_RING_BLOCK_SIZE;
+	ring->rx_req.tp_block_nr = size / DHCP_RING_BLOCK_SIZE;
+	if (ring->rx_req.tp_block_nr < 2) ring->rx_req.tp_block_nr = 2;
+	ring->rx_req.tp_frame_size = DHCP_RING_FRAME_SIZE;
+	ring->rx_req.tp_frame_nr = (DHCP_RING_BLOCK_SIZE / DHCP_RING_FRAME_SIZE) * ring->rx_req.tp_block_nr;
+	ring->rx_req.tp_retire_blk_tov = DHCP_RING_BLOCK_TIMEOUT;
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &ring->rx_req, sizeof(ring->rx_req)) < 0) {
+		fr_strerror_printf("Failed creating RX ring: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	ring->rx_map = mmap(NULL, ring->rx_req.tp_block_size * ring->rx_req.tp_block_nr,
+			    PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+	if (ring->rx_map == MAP_FAILED) {
+		ring->rx_map = NULL;
+		fr_strerror_printf("Failed mapping RX ring: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	memset(&rx_ll, 0, sizeof(rx_ll));
+	rx_ll.sll_family = AF_PACKET;
+	rx_ll.sll_protocol = htons(ETH_P_IP);
+	rx_ll.sll_ifindex = ring->if_index;
+	if (bind(ring->fd, (struct sockaddr *)&rx_ll, sizeof(rx_ll)) < 0) {
+		fr_strerror_printf("Failed binding RX ring to \"%s\": %s", interface, fr_syserror(errno));
+		goto error;
+	}
+
+#ifdef PACKET_IGNORE_OUTGOING
+	/*
+	 *	Don't see our own replies.  Older kernels don't have
+	 *	this, and we skip them in fr_dhcp_ring_recv() instead.
+	 */
+	(void) setsockopt(ring->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+#endif
+
+	/*
+	 *	The TX socket never receives anything.
+	 */
+	ring->tx_fd = socket(PF_PACKET, SOCK_RAW, 0);
+	if (ring->tx_fd < 0) {
+		fr_strerror_printf("Failed opening packet socket: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	version = TPACKET_V2;
+	if (setsockopt(ring->tx_fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		fr_strerror_printf("Failed enabling TPACKET_V2: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	/*
+	 *	Skip malformed frames, instead of stopping the ring.
+	 */
+	if (setsockopt(ring->tx_fd, SOL_PACKET, PACKET_LOSS, &one, sizeof(one)) < 0) {
+		fr_strerror_printf("Failed setting PACKET_LOSS: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	ring->tx_req.tp_block_size = DHCP_RING_BLOCK_SIZE;
+	ring->tx_req.tp_block_nr = size / (4 * DHCP_RING_BLOCK_SIZE);
+	if (ring->tx_req.tp_block_nr < 1) ring->tx_req.tp_block_nr = 1;
+	ring->tx_req.tp_frame_size = DHCP_RING_FRAME_SIZE;
+	ring->tx_req.tp_frame_nr = (DHCP_RING_BLOCK_SIZE / DHCP_RING_FRAME_SIZE) * ring->tx_req.tp_block_nr;
+	if (setsockopt(ring->tx_fd, SOL_PACKET, PACKET_TX_RING, &ring->tx_req, sizeof(ring->tx_req)) < 0) {
+		fr_strerror_printf("Failed creating TX ring: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	ring->tx_map = mmap(NULL, ring->tx_req.tp_block_size * ring->tx_req.tp_block_nr,
+			    PROT_READ | PROT_WRITE, MAP_SHARED, ring->tx_fd, 0);
+	if (ring->tx_map == MAP_FAILED) {
+		ring->tx_map = NULL;
+		fr_strerror_printf("Failed mapping TX ring: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	ring->link_layer.sll_family = AF_PACKET;
+	ring->link_layer.sll_protocol = htons(ETH_P_IP);
+	ring->link_layer.sll_ifindex = ring->if_index;
+	ring->link_layer.sll_halen = ETH_ADDR_LEN;
+	if (bind(ring->tx_fd, (struct sockaddr *)&ring->link_layer, sizeof(ring->link_layer)) < 0) {
+		fr_strerror_printf("Failed binding TX ring to \"%s\": %s", interface, fr_syserror(errno));
+		goto error;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	strlcpy(ifr.ifr_name, interface, sizeof(ifr.ifr_name));
+	if (ioctl(ring->tx_fd, SIOCGIFHWADDR, &ifr) < 0) {
+		fr_strerror_printf("Failed getting MAC address of \"%s\": %s", interface, fr_syserror(errno));
+		goto error;
+	}
+	memcpy(ring->ether_addr, ifr.ifr_hwaddr.sa_data, ETH_ADDR_LEN);
+
+	return ring;
+}
+
+/** Read the next DHCP packet from the RX ring
+ *
+ * Frames are read directly from the memory shared with the kernel.  A block
+ * is only returned to the kernel once every frame in it has been read, so
+ * callers should keep calling this until it returns 0.
+ *
+ * @param[out] out where to write the packet.
+ * @param[in] ring to read from.
+ * @return
+ *	- 1 if a packet was read.
+ *	- 0 if the ring is empty.
+ *	- -1 if the frame wasn't a valid DHCP packet.  The next call reads the next frame.
+ */
+int fr_dhcp_ring_recv(RADIUS_PACKET **out, fr_dhcp_ring_t *ring)
+{
+	struct tpacket_block_desc	*block;
+	struct tpacket3_hdr		*hdr;
+	struct sockaddr_ll		*ll;
+	RADIUS_PACKET			*packet;
+
+	*out = NULL;
+
+	while (!ring->rx_left) {
+		block = (struct tpacket_block_desc *)(ring->rx_map + (ring->rx_block * ring->rx_req.tp_block_size));
+
+		/*
+		 *	We've read everything in this block, give
+		 *	it back to the kernel and move on.
+		 */
+		if (ring->rx_frame) {
+			__sync_synchronize();
+			block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+			ring->rx_frame = NULL;
+			ring->rx_block = (ring->rx_block + 1) % ring->rx_req.tp_block_nr;
+			continue;
+		}
+
+		if (!(block->hdr.bh1.block_status & TP_STATUS_USER)) return 0;
+		__sync_synchronize();
+
+		ring->rx_left = block->hdr.bh1.num_pkts;
+		ring->rx_frame = (uint8_t *)block + block->hdr.bh1.offset_to_first_pkt;
+	}
+
+	hdr = (struct tpacket3_hdr *)ring->rx_frame;
+	ring->rx_frame += hdr->tp_next_offset;
+	ring->rx_left--;
+
+	ll = (struct sockaddr_ll *)((uint8_t *)hdr + TPACKET_ALIGN(sizeof(*hdr)));
+	if (ll->sll_pkttype == PACKET_OUTGOING) {
+		fr_strerror_printf("Ignoring outgoing frame");
+		return -1;
+	}
+
+	if (hdr->tp_snaplen <= (ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE)) {
+		fr_strerror_printf("Frame (%u bytes) too small for DHCP", hdr->tp_snaplen);
+		return -1;
+	}
+
+	packet = dhcp_frame_decode((uint8_t *)hdr + hdr->tp_mac, hdr->tp_snaplen, ETH_HDR_SIZE);
+	if (!packet) return -1;
+
+	packet->sockfd = ring->bound_fd;
+	packet->if_index = ring->if_index;
+	packet->timestamp.tv_sec = hdr->tp_sec;
+	packet->timestamp.tv_usec = hdr->tp_nsec / 1000;
+
+	*out = packet;
+	return 1;
+}
+
+/** Kick the kernel to send the frames queued in the TX ring
+ *
+ * @param ring to flush.
+ * @param wait for the kernel to finish sending them.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_dhcp_ring_flush(fr_dhcp_ring_t *ring, bool wait)
+{
+	uint32_t pending;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&ring->mutex);
+#endif
+	pending = ring->tx_pending;
+	ring->tx_pending = 0;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&ring->mutex);
+#endif
+
+	if (!pending && !wait) return 0;
+
+	if ((sendto(ring->tx_fd, NULL, 0, wait ? 0 : MSG_DONTWAIT,
+		    (struct sockaddr *)&ring->link_layer, sizeof(ring->link_layer)) < 0) &&
+	    (errno != EAGAIN) && (errno != ENOBUFS)) {
+		fr_strerror_printf("Failed flushing TX ring: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Queue a DHCP packet in the TX ring
+ *
+ * @param ring to write to.
+ * @param dst_ether_addr Ethernet destination address.
+ * @param packet to send.  Must already be encoded.
+ * @param flush the ring now.  If false, the caller must call fr_dhcp_ring_flush() later,
+ *	though the ring is still flushed every DHCP_RING_TX_BATCH frames.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_dhcp_ring_send(fr_dhcp_ring_t *ring, uint8_t const *dst_ether_addr, RADIUS_PACKET *packet, bool flush)
+{
+	struct tpacket2_hdr	*hdr;
+	int			tries;
+
+	if ((ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE + packet->data_len) >
+	    (DHCP_RING_FRAME_SIZE - TPACKET_ALIGN(sizeof(*hdr)))) {
+		fr_strerror_printf("Packet (%zu bytes) is too large for the TX ring", packet->data_len);
+		return -1;
+	}
+
+	for (tries = 0; tries < 2; tries++) {
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_lock(&ring->mutex);
+#endif
+		hdr = (struct tpacket2_hdr *)(ring->tx_map + (ring->tx_frame * ring->tx_req.tp_frame_size));
+		if (hdr->tp_status == TP_STATUS_AVAILABLE) break;
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_unlock(&ring->mutex);
+#endif
+
+		/*
+		 *	The ring is full.  Wait for the kernel to
+		 *	drain it, and try once more.
+		 */
+		if (tries || (fr_dhcp_ring_flush(ring, true) < 0)) {
+			fr_strerror_printf("TX ring is full");
+			return -1;
+		}
+	}
+
+	hdr->tp_len = dhcp_frame_encode((uint8_t *)hdr + TPACKET_ALIGN(sizeof(*hdr)),
+					ring->ether_addr, dst_ether_addr, packet);
+	__sync_synchronize();
+	hdr->tp_status = TP_STATUS_SEND_REQUEST;
+
+	ring->tx_frame = (ring->tx_frame + 1) % ring->tx_req.tp_frame_nr;
+	if (++ring->tx_pending >= DHCP_RING_TX_BATCH) flush = true;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&ring->mutex);
+#endif
+
+	if (flush) return fr_dhcp_ring_flush(ring, false);
+
+	return 0;
+}
+#endif	/* HAVE_DHCP_RING */
@@ -56,6 +56,26 @@
 #include <sys/ioctl.h>
 #endif
 
+#ifdef HAVE_DHCP_RING
+#include <linux/filter.h>
+
+/*
+ *	Most packets we read from the RX ring in one go, so that
+ *	other listeners get a turn during a storm.
+ */
+#define DHCP_RING_RECV_MAX	(1024)
+#endif
+
+#ifdef WITH_UDPFROMTO
+/*
+ *	Subnet whose relayed packets go through the virtual server.
+ */
+typedef struct dhcp_relay_subnet {
+	uint32_t	addr;			//!< Masked, in network byte order.
+	uint32_t	mask;			//!< In network byte order.
+} dhcp_relay_subnet_t;
+#endif
+
 /*
  *	Same contents as listen_socket_t.
  */
@@ -69,6 +89,23 @@ typedef struct dhcp_socket_t {
 	RADCLIENT	dhcp_client;
 	char const	*src_interface;
 	fr_ipaddr_t	src_ipaddr;
+
+#ifdef HAVE_DHCP_RING
+	bool		packet_ring;		//!< Read and write frames through PACKET_MMAP rings.
+	uint32_t	packet_ring_size;	//!< Size of the RX ring in bytes.
+	fr_dhcp_ring_t	*ring;
+	bool		ring_batching;		//!< Replies are flushed by dhcp_ring_recv().
+#endif
+
+#ifdef WITH_UDPFROMTO
+	bool		relay;			//!< Relay packets from the listener.
+	fr_ipaddr_t	relay_server;		//!< Where requests from clients are relayed to.
+	fr_ipaddr_t	relay_giaddr;		//!< Our address on the clients' link.
+	uint32_t	relay_max_hops;
+	uint8_t		*relay_agent_info;	//!< Option 82 to add to requests, or NULL.
+	dhcp_relay_subnet_t *relay_policy;	//!< Links whose packets go through the virtual server.
+	unsigned int	relay_policy_num;
+#endif
 } dhcp_socket_t;
 
 static void dhcp_packet_debug(REQUEST *request, RADIUS_PACKET *packet, bool received);
@@ -263,6 +300,182 @@ static int dhcprelay_process_server_reply(REQUEST *request)
 
 	return fr_dhcp_send_socket(request->packet);
 }
+
+/** Relay a packet from the listener, without decoding it, or running it through the virtual server
+ *
+ * Requests from clients get giaddr, and any configured option 82, and are
+ * sent to the server.  Replies from the server have our option 82 removed,
+ * and are sent to the client.  Packets for links which match a "policy"
+ * subnet are left for the virtual server.
+ *
+ * @param listener the packet was received on.
+ * @param packet_p the packet.  Freed, and set to NULL, if it's been dealt with.
+ * @return
+ *	- true if the packet was relayed, or discarded.
+ *	- false if it should be processed as normal.
+ */
+static bool dhcp_relay_fast(rad_listen_t *listener, RADIUS_PACKET **packet_p)
+{
+	RADIUS_PACKET	*packet = *packet_p;
+	dhcp_socket_t	*sock = listener->data;
+	uint8_t const	*code;
+	uint8_t		dst_ether_addr[6];
+	uint32_t	giaddr, ciaddr, link;
+	unsigned int	i;
+
+#ifdef PCAP_RAW_SOCKETS
+	if (sock->lsock.pcap) return false;
+#endif
+
+	memcpy(&giaddr, packet->data + 24, sizeof(giaddr));
+
+	/*
+	 *	Requests straight from clients are on our link.
+	 *	Everything else is on the link giaddr says.
+	 */
+	link = ((packet->data[0] == 1) && !giaddr) ? sock->relay_giaddr.ipaddr.ip4addr.s_addr : giaddr;
+
+	for (i = 0; i < sock->relay_policy_num; i++) {
+		if ((link & sock->relay_policy[i].mask) == sock->relay_policy[i].addr) return false;
+	}
+
+	if (packet->data[0] == 1) {
+		/*
+		 * It's invalid to have giaddr=0 AND a relay option
+		 */
+		if (!giaddr && fr_dhcp_option_find(packet, PW_DHCP_OPTION_82)) {
+			DEBUG2("Received packet with giaddr = 0 and containing relay option: Discarding packet");
+			goto done;
+		}
+
+		/*
+		 * RFC 1542 (BOOTP), page 15
+		 */
+		if (packet->data[3] > sock->relay_max_hops) {
+			DEBUG2("Number of hops is greater than %u: not relaying", sock->relay_max_hops);
+			goto done;
+		}
+		packet->data[3]++;
+
+		if (!giaddr) {
+			memcpy(packet->data + 24, &sock->relay_giaddr.ipaddr.ip4addr.s_addr, sizeof(giaddr));
+
+			if (sock->relay_agent_info && (fr_dhcp_option_append(packet, sock->relay_agent_info) < 0)) {
+				ERROR("Failed adding relay agent information: %s", fr_strerror());
+				goto done;
+			}
+		}
+
+		packet->src_ipaddr = sock->relay_giaddr;
+		packet->src_port = sock->lsock.my_port;
+		packet->dst_ipaddr = sock->relay_server;
+		packet->dst_port = sock->lsock.my_port;
+		packet->if_index = 0;
+
+		goto send;
+	}
+
+	/*
+	 *	A reply from the server, which the server sends to
+	 *	the giaddr we put in the request.
+	 */
+	if ((giaddr != sock->relay_giaddr.ipaddr.ip4addr.s_addr) &&
+	    (giaddr != packet->dst_ipaddr.ipaddr.ip4addr.s_addr)) {
+		DEBUG2("Packet received from server was not for us (was for 0x%x).  Discarding packet",
+		       ntohl(giaddr));
+		goto done;
+	}
+
+	/*
+	 *	RFC 3046 Section 2.2, the option we added doesn't go
+	 *	back to the client.
+	 */
+	if (sock->relay_agent_info && (fr_dhcp_option_remove(packet, PW_DHCP_OPTION_82) < 0)) {
+		ERROR("Failed removing relay agent information: %s", fr_strerror());
+		goto done;
+	}
+
+	code = fr_dhcp_option_find(packet, PW_DHCP_MESSAGE_TYPE);
+	rad_assert(code != NULL);
+
+	memcpy(&ciaddr, packet->data + 12, sizeof(ciaddr));
+	memcpy(dst_ether_addr, packet->data + 28, sizeof(dst_ether_addr));
+
+	packet->src_ipaddr = sock->relay_giaddr;
+	packet->src_port = sock->lsock.my_port;
+	packet->dst_ipaddr.af = AF_INET;
+	packet->dst_port = sock->lsock.my_port + 1;
+	packet->if_index = 0;
+
+	/*
+	 * RFC 2131, page 23
+	 *
+	 * Broadcast on
+	 * - DHCPNAK
+	 * or
+	 * - Broadcast flag is set up and ciaddr == NULL
+	 */
+	if ((code[2] == (PW_DHCP_NAK - PW_DHCP_OFFSET)) || !sock->src_interface ||
+	    ((packet->data[10] & 0x80) && !ciaddr)) {
+		packet->dst_ipaddr.ipaddr.ip4addr.s_addr = htonl(INADDR_BROADCAST);
+		memset(dst_ether_addr, 0xff, sizeof(dst_ether_addr));
+
+	/*
+	 * Unicast to
+	 * - ciaddr if present
+	 * otherwise to yiaddr
+	 */
+	} else if (ciaddr) {
+		packet->dst_ipaddr.ipaddr.ip4addr.s_addr = ciaddr;
+
+	} else {
+		memcpy(&packet->dst_ipaddr.ipaddr.ip4addr.s_addr, packet->data + 16, sizeof(ciaddr));
+
+		/*
+		 *	The client doesn't answer ARP until it has an
+		 *	address, so add an entry for it.  The rings
+		 *	write the client's MAC address themselves.
+		 */
+		if ((code[2] == (PW_DHCP_OFFER - PW_DHCP_OFFSET))
+#ifdef HAVE_DHCP_RING
+		    && !sock->ring
+#endif
+		    ) {
+			VALUE_PAIR *hwvp, *ipvp;
+
+			hwvp = fr_pair_afrom_num(packet, DHCP_MAGIC_VENDOR, 267); /* DHCP-Client-Hardware-Address */
+			ipvp = fr_pair_afrom_num(packet, DHCP_MAGIC_VENDOR, 264); /* DHCP-Your-IP-Address */
+			if (!hwvp || !ipvp) {
+				ERROR("Out of memory");
+				goto done;
+			}
+			memcpy(hwvp->vp_ether, dst_ether_addr, sizeof(hwvp->vp_ether));
+			hwvp->vp_length = sizeof(hwvp->vp_ether);
+			ipvp->vp_ipaddr = packet->dst_ipaddr.ipaddr.ip4addr.s_addr;
+
+			if (fr_dhcp_add_arp_entry(packet->sockfd, sock->src_interface, hwvp, ipvp) < 0) {
+				ERROR("Failed adding ARP entry: %s", fr_strerror());
+				goto done;
+			}
+		}
+	}
+
+#ifdef HAVE_DHCP_RING
+	if (sock->ring) {
+		if (fr_dhcp_ring_send(sock->ring, dst_ether_addr, packet, !sock->ring_batching) < 0) {
+			ERROR("Failed relaying DHCP packet: %s", fr_strerror());
+		}
+		goto done;
+	}
+#endif
+
+send:
+	if (fr_dhcp_send_socket(packet) < 0) ERROR("Failed relaying DHCP packet: %s", fr_strerror());
+
+done:
+	fr_radius_free(packet_p);
+	return true;
+}
 #else  /* WITH_UDPFROMTO */
 static int dhcprelay_process_server_reply(UNUSED REQUEST *request)
 {
@@ -614,6 +827,13 @@ static int dhcp_process(REQUEST *request)
 	RDEBUG2("Reply will be unicast to &DHCP-Your-IP-Address");
 	request->reply->dst_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
 
+#ifdef HAVE_DHCP_RING
+	/*
+	 *	The TX ring writes the client's MAC address itself.
+	 */
+	if (sock->ring) return 1;
+#endif
+
 	/*
 	 *	When sending a DHCP_OFFER, make sure our ARP table
 	 *	contains an entry for the client IP address.
@@ -693,12 +913,123 @@ static const char *dhcp_pcap_filter_build(rad_listen_t *this)
 }
 #endif
 
+#ifdef WITH_UDPFROMTO
+/*
+ *	Parse the "relay" subsection, which has the listener relay
+ *	packets itself.
+ */
+static int dhcp_relay_parse(CONF_SECTION *cs, dhcp_socket_t *sock)
+{
+	int		rcode;
+	CONF_PAIR	*cp;
+	char const	*circuit_id = NULL, *remote_id = NULL;
+	size_t		circuit_len = 0, remote_len = 0;
+	uint8_t		*p;
+
+	if (!cf_pair_find(cs, "server")) {
+		cf_log_err_cs(cs, "Missing 'server' in 'relay'");
+		return -1;
+	}
+
+	rcode = cf_pair_parse(cs, "server", FR_ITEM_POINTER(PW_TYPE_IPV4_ADDR, &sock->relay_server), NULL, T_INVALID);
+	if (rcode < 0) return -1;
+
+	/*
+	 *	Defaults to the address we send from.
+	 */
+	if (cf_pair_find(cs, "giaddr")) {
+		rcode = cf_pair_parse(cs, "giaddr", FR_ITEM_POINTER(PW_TYPE_IPV4_ADDR, &sock->relay_giaddr), NULL, T_INVALID);
+		if (rcode < 0) return -1;
+	} else {
+		sock->relay_giaddr = sock->src_ipaddr;
+	}
+
+	if (fr_is_inaddr_any(&sock->relay_giaddr)) {
+		cf_log_err_cs(cs, "Setting 'giaddr' in 'relay' must be set when 'src_ipaddr' is not known");
+		return -1;
+	}
+
+	rcode = cf_pair_parse(cs, "max_hops", FR_ITEM_POINTER(PW_TYPE_INTEGER, &sock->relay_max_hops), "16", T_BARE_WORD);
+	if (rcode < 0) return -1;
+	FR_INTEGER_BOUND_CHECK("max_hops", sock->relay_max_hops, <=, 255);
+
+	/*
+	 *	Sub-options 1 and 2 of option 82, encoded once.
+	 */
+	rcode = cf_pair_parse(cs, "circuit_id", FR_ITEM_POINTER(PW_TYPE_STRING, &circuit_id), NULL, T_INVALID);
+	if (rcode < 0) return -1;
+	if (circuit_id) circuit_len = strlen(circuit_id);
+
+	rcode = cf_pair_parse(cs, "remote_id", FR_ITEM_POINTER(PW_TYPE_STRING, &remote_id), NULL, T_INVALID);
+	if (rcode < 0) return -1;
+	if (remote_id) remote_len = strlen(remote_id);
+
+	if ((circuit_len > 255) || (remote_len > 255) ||
+	    ((circuit_len ? circuit_len + 2 : 0) + (remote_len ? remote_len + 2 : 0) > 255)) {
+		cf_log_err_cs(cs, "Settings 'circuit_id' and 'remote_id' in 'relay' are too long");
+		return -1;
+	}
+
+	if (circuit_len || remote_len) {
+		p = sock->relay_agent_info = talloc_array(sock, uint8_t, 2 + 2 + circuit_len + 2 + remote_len);
+		if (!p) return -1;
+
+		*p++ = PW_DHCP_OPTION_82;
+		*p++ = 0;
+		if (circuit_len) {
+			*p++ = 1;
+			*p++ = circuit_len;
+			memcpy(p, circuit_id, circuit_len);
+			p += circuit_len;
+		}
+		if (remote_len) {
+			*p++ = 2;
+			*p++ = remote_len;
+			memcpy(p, remote_id, remote_len);
+			p += remote_len;
+		}
+		sock->relay_agent_info[1] = (p - sock->relay_agent_info) - 2;
+	}
+
+	/*
+	 *	Links with policy configured for them still go through
+	 *	the virtual server.
+	 */
+	for (cp = cf_pair_find(cs, "policy");
+	     cp;
+	     cp = cf_pair_find_next(cs, cp, "policy")) {
+		fr_ipaddr_t		subnet;
+		dhcp_relay_subnet_t	*policy;
+
+		if (fr_inet_pton4(&subnet, cf_pair_value(cp), -1, false, false, true) < 0) {
+			cf_log_err_cp(cp, "Invalid subnet: %s", fr_strerror());
+			return -1;
+		}
+
+		policy = talloc_realloc(sock, sock->relay_policy, dhcp_relay_subnet_t, sock->relay_policy_num + 1);
+		if (!policy) return -1;
+		sock->relay_policy = policy;
+
+		policy[sock->relay_policy_num].mask = subnet.prefix ? htonl(~(uint32_t)0 << (32 - subnet.prefix)) : 0;
+		policy[sock->relay_policy_num].addr = subnet.ipaddr.ip4addr.s_addr & policy[sock->relay_policy_num].mask;
+		sock->relay_policy_num++;
+	}
+
+	sock->relay = true;
+
+	return 0;
+}
+#endif
+
 static int dhcp_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 {
 	int rcode;
 	dhcp_socket_t *sock = this->data;
 	RADCLIENT *client;
 	CONF_PAIR *cp;
+#ifdef WITH_UDPFROMTO
+	CONF_SECTION *subcs;
+#endif
 
 #ifdef PCAP_RAW_SOCKETS
 	sock->lsock.pcap_filter_builder = dhcp_pcap_filter_build;
@@ -789,6 +1120,48 @@ static int dhcp_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 		}
 	}
 
+#ifdef HAVE_DHCP_RING
+	sock->packet_ring = false;
+	cp = cf_pair_find(cs, "packet_ring");
+	if (cp) {
+		rcode = cf_pair_parse(cs, "packet_ring", FR_ITEM_POINTER(PW_TYPE_BOOLEAN, &sock->packet_ring), NULL, T_INVALID);
+		if (rcode < 0) return -1;
+	}
+
+	if (sock->packet_ring) {
+		if (!sock->lsock.interface) {
+			cf_log_err_cs(cs, "Setting 'packet_ring' requires 'interface'");
+			return -1;
+		}
+
+		rcode = cf_pair_parse(cs, "packet_ring_size", FR_ITEM_POINTER(PW_TYPE_INTEGER, &sock->packet_ring_size),
+				      "16777216", T_BARE_WORD);
+		if (rcode < 0) return -1;
+		FR_INTEGER_BOUND_CHECK("packet_ring_size", sock->packet_ring_size, >=, (1 << 20));
+
+		/*
+		 *	Only one thread can read from the RX ring.
+		 */
+		if (this->workers) {
+			WARN("Setting 'workers' is incompatible with 'packet_ring'.  Disabling 'workers'");
+			this->workers = 0;
+		}
+	}
+#else
+	if (cf_pair_find(cs, "packet_ring")) {
+		WARN("Setting 'packet_ring' is not supported on this system.  Ignoring 'packet_ring'");
+	}
+#endif
+
+#ifdef WITH_UDPFROMTO
+	subcs = cf_section_sub_find(cs, "relay");
+	if (subcs && (dhcp_relay_parse(subcs, sock) < 0)) return -1;
+#else
+	if (cf_section_sub_find(cs, "relay")) {
+		WARN("DHCP Relaying requires the server to be configured with UDPFROMTO.  Ignoring 'relay'");
+	}
+#endif
+
 	/*
 	 *	Initialize the fake client.
 	 */
@@ -805,6 +1178,104 @@ static int dhcp_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 }
 
 
+static int dhcp_socket_open(CONF_SECTION *cs, rad_listen_t *this)
+{
+#ifdef HAVE_DHCP_RING
+	dhcp_socket_t		*sock = this->data;
+	struct sock_filter	drop = BPF_STMT(BPF_RET | BPF_K, 0);
+	struct sock_fprog	prog = { .len = 1, .filter = &drop };
+#endif
+
+	if (common_socket_open(cs, this) < 0) return -1;
+
+#ifdef HAVE_DHCP_RING
+	if (!sock->packet_ring) return 0;
+
+	sock->ring = fr_dhcp_ring_alloc(sock, sock->lsock.interface,
+					sock->lsock.my_port ? sock->lsock.my_port : 67, sock->packet_ring_size);
+	if (!sock->ring) {
+		cf_log_err_cs(cs, "Failed opening packet ring on \"%s\": %s", sock->lsock.interface, fr_strerror());
+		return -1;
+	}
+
+	/*
+	 *	The UDP socket stays open, so that the port stays
+	 *	bound, and unicast requests don't get ICMP port
+	 *	unreachable replies.  Replies to relays are still
+	 *	sent through it.  But everything it would read also
+	 *	arrives in the RX ring, so have the kernel discard
+	 *	the copies.
+	 */
+	if (setsockopt(this->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		WARN("Failed attaching filter to UDP socket: %s", fr_syserror(errno));
+	}
+
+	/*
+	 *	The event loop watches the RX ring, and the ring
+	 *	owns the UDP socket.
+	 */
+	sock->ring->bound_fd = this->fd;
+	this->fd = sock->ring->fd;
+	sock->ring->fd = -1;
+#endif
+
+	return 0;
+}
+
+#ifdef HAVE_DHCP_RING
+/*
+ *	Read the packets the kernel has put in the RX ring.  For
+ *	"synchronous" listeners, the replies are queued in the TX
+ *	ring as they're generated, and flushed together at the end.
+ */
+static int dhcp_ring_recv(rad_listen_t *listener)
+{
+	int		rcode, count = 0, i;
+	RADIUS_PACKET	*packet;
+	dhcp_socket_t	*sock = listener->data;
+	RADCLIENT	*client = &sock->dhcp_client;
+
+	sock->ring_batching = listener->synchronous;
+
+	for (i = 0; i < DHCP_RING_RECV_MAX; i++) {
+		rcode = fr_dhcp_ring_recv(&packet, sock->ring);
+		if (rcode == 0) break;
+
+		FR_STATS_INC(auth, total_requests);
+		FR_STATS_TYPE_INC(client->auth.total_requests);
+
+		if (rcode < 0) {
+			FR_STATS_INC(auth, total_malformed_requests);
+			DEBUG3("Discarding frame: %s", fr_strerror());
+			continue;
+		}
+
+#ifdef WITH_UDPFROMTO
+		if (sock->relay && dhcp_relay_fast(listener, &packet)) {
+			count++;
+			continue;
+		}
+#endif
+
+		if (!request_receive(NULL, listener, packet, client, dhcp_process)) {
+			FR_STATS_INC(auth, total_packets_dropped);
+			fr_radius_free(&packet);
+			continue;
+		}
+
+		count++;
+	}
+
+	if (sock->ring_batching) {
+		sock->ring_batching = false;
+
+		if (fr_dhcp_ring_flush(sock->ring, false) < 0) ERROR("Failed sending replies: %s", fr_strerror());
+	}
+
+	return count;
+}
+#endif
+
 /*
  *	Check if an incoming request is "ok"
  *
@@ -819,6 +1290,10 @@ static int dhcp_socket_recv(rad_listen_t *listener)
 
 	if (!rad_cond_assert(client != NULL)) return 1;
 
+#ifdef HAVE_DHCP_RING
+	if (sock->ring) return dhcp_ring_recv(listener);
+#endif
+
 	FR_STATS_INC(auth, total_requests);
 	FR_STATS_TYPE_INC(client->auth.total_requests);
 
@@ -837,6 +1312,10 @@ static int dhcp_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
+#ifdef WITH_UDPFROMTO
+	if (sock->relay && dhcp_relay_fast(listener, &packet)) return 1;
+#endif
+
 	if (!request_receive(NULL, listener, packet, &sock->dhcp_client, dhcp_process)) {
 		FR_STATS_INC(auth, total_packets_dropped);
 		fr_radius_free(&packet);
@@ -866,6 +1345,32 @@ static int dhcp_socket_send(rad_listen_t *listener, REQUEST *request)
 
 	if (sock->suppress_responses) return 0;
 
+#ifdef HAVE_DHCP_RING
+	/*
+	 *	Replies to relays go through the UDP socket, as we
+	 *	don't know the relay's MAC address.  The kernel does.
+	 */
+	if (sock->ring &&
+	    !fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 272, TAG_ANY)) { /* DHCP-Relay-IP-Address */
+		uint8_t dhmac[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+		VALUE_PAIR *vp;
+
+		vp = fr_pair_find_by_num(request->reply->vps, DHCP_MAGIC_VENDOR, 266, TAG_ANY); /* DHCP-Gateway-IP-Address */
+		if (!vp || (vp->vp_ipaddr == htonl(INADDR_ANY))) {
+			if (request->reply->dst_ipaddr.ipaddr.ip4addr.s_addr != htonl(INADDR_BROADCAST)) {
+				vp = fr_pair_find_by_num(request->packet->vps, DHCP_MAGIC_VENDOR, 267, TAG_ANY);
+				if (!vp || (vp->data.length != sizeof(vp->vp_ether))) {
+					REDEBUG("&DHCP-Client-Hardware-Address not found in request");
+					return -1;
+				}
+				memcpy(dhmac, vp->vp_ether, sizeof(vp->vp_ether));
+			}
+
+			return fr_dhcp_ring_send(sock->ring, dhmac, request->reply, !sock->ring_batching);
+		}
+	}
+#endif
+
 #ifdef PCAP_RAW_SOCKETS
 	if (sock->lsock.pcap) {
 		/* set ethernet destination address to DHCP-Client-Hardware-Address in request. */
@@ -969,6 +1474,7 @@ static void dhcp_packet_debug(REQUEST *request, RADIUS_PACKET *packet, bool rece
 	}
 
 	if (received) {
+		(void) request_decode_pending(request, NULL);
 		rdebug_pair_list(L_DBG_LVL_2, request, packet->vps, "&request:");
 	} else {
 		rdebug_proto_pair_list(L_DBG_LVL_2, request, packet->vps, "&reply:");
@@ -982,11 +1488,18 @@ static int dhcp_socket_encode(UNUSED rad_listen_t *listener, UNUSED REQUEST *req
 }
 
 
-static int dhcp_socket_decode(UNUSED rad_listen_t *listener, REQUEST *request)
+static int dhcp_socket_decode(rad_listen_t *listener, REQUEST *request)
 {
+	request->packet->lazy = listener->lazy_decode;
+
 	return fr_dhcp_decode(request->packet);
 }
 
+static int dhcp_socket_decode_pending(UNUSED rad_listen_t *listener, REQUEST *request, fr_dict_attr_t const *da)
+{
+	return fr_dhcp_decode_pending(request->packet, da);
+}
+
 extern fr_protocol_t proto_dhcp;
 fr_protocol_t proto_dhcp = {
 	.magic		= RLM_MODULE_INIT,
@@ -995,11 +1508,12 @@ fr_protocol_t proto_dhcp = {
 	.transports	= TRANSPORT_UDP,
 	.tls		= false,
 	.parse		= dhcp_socket_parse,
-	.open		= common_socket_open,
+	.open		= dhcp_socket_open,
 	.recv		= dhcp_socket_recv,
 	.send		= dhcp_socket_send,
 	.print		= common_socket_print,
 	.debug		= dhcp_packet_debug,
 	.encode		= dhcp_socket_encode,
-	.decode		= dhcp_socket_decode
+	.decode		= dhcp_socket_decode,
+	.decode_pending	= dhcp_socket_decode_pending
 };
@@ -33,15 +33,39 @@ RCSID("$Id$")
 #include	<ctype.h>
 #include	<fcntl.h>
 
+/*
+ *	Each entry in the filter file is compiled into a table of
+ *	check items by attribute, so each attribute in the packet is
+ *	only compared against the rules which describe it.
+ */
+typedef struct attr_filter_checks {
+	fr_dict_attr_t const	*da;
+	VALUE_PAIR		**checks;	//!< Check items for da, in file order.
+	uint32_t		num_checks;
+} attr_filter_checks_t;
+
+typedef struct attr_filter_rule {
+	PAIR_LIST		*pl;
+	fr_hash_oa_t		*by_da;		//!< attr_filter_checks_t, by attribute.
+	VALUE_PAIR		**set;		//!< ':=' items, which are added to the output.
+	uint32_t		num_set;
+	uint32_t		vsa_any;	//!< Number of 'Vendor-Specific =* ANY' items,
+						//!< which allow any VSA.
+	int			relax_filter;	//!< Relax-Filter, or -1 to use the module setting.
+	bool			fall_through;
+} attr_filter_rule_t;
+
 /*
  *	Define a structure with the module configuration, so it can
  *	be used as the instance handle.
  */
 typedef struct rlm_attr_filter {
-	char const	*filename;
-	vp_tmpl_t	*key;
-	bool		relaxed;
-	PAIR_LIST	*attrs;
+	char const		*filename;
+	vp_tmpl_t		*key;
+	bool			relaxed;
+	PAIR_LIST		*attrs;
+	attr_filter_rule_t	*rules;		//!< One per entry in attrs, in file order.
+	uint32_t		num_rules;
 } rlm_attr_filter_t;
 
 static const CONF_PARSER module_config[] = {
@@ -125,6 +149,92 @@ static int attr_filter_getfile(TALLOC_CTX *ctx, char const *filename, PAIR_LIST
 }
 
 
+static uint32_t attr_filter_checks_hash(void const *data)
+{
+	attr_filter_checks_t const *checks = data;
+
+	return fr_hash(&checks->da, sizeof(checks->da));
+}
+
+static int attr_filter_checks_cmp(void const *one, void const *two)
+{
+	attr_filter_checks_t const *a = one, *b = two;
+
+	if (a->da < b->da) return -1;
+	if (a->da > b->da) return +1;
+
+	return 0;
+}
+
+/** Compile an entry into a table of check items by attribute
+ *
+ * The table gives the same pass and fail counts as comparing each
+ * attribute in the packet against every check item in the entry.
+ */
+static int attr_filter_compile(TALLOC_CTX *ctx, attr_filter_rule_t *rule, PAIR_LIST *pl)
+{
+	VALUE_PAIR		*vp;
+	attr_filter_checks_t	find, *checks;
+
+	rule->pl = pl;
+	rule->relax_filter = -1;
+
+	for (vp = pl->check; vp; vp = vp->next) {
+		if (!vp->da->vendor && (vp->da->attr == PW_FALL_THROUGH) && (vp->vp_integer == 1)) {
+			rule->fall_through = true;
+			goto compare;
+		}
+
+		if (!vp->da->vendor && (vp->da->attr == PW_RELAX_FILTER)) {
+			rule->relax_filter = vp->vp_integer;
+			goto compare;
+		}
+
+		if (vp->op == T_OP_SET) {
+			rule->set = talloc_realloc(ctx, rule->set, VALUE_PAIR *, rule->num_set + 1);
+			if (!rule->set) return -1;
+			rule->set[rule->num_set++] = vp;
+		}
+
+	compare:
+		/*
+		 *	check_pair() ignores these.
+		 */
+		if (vp->op == T_OP_SET) continue;
+
+		/*
+		 *	Any VSA passes, without being compared.  A VSA
+		 *	can only have the same da as the check item if
+		 *	the check item is itself a VSA.
+		 */
+		if ((vp->da->attr == PW_VENDOR_SPECIFIC) && (vp->op == T_OP_CMP_TRUE)) {
+			rule->vsa_any++;
+			if (vp->da->vendor != 0) continue;
+		}
+
+		if (!rule->by_da) {
+			rule->by_da = fr_hash_oa_create(ctx, attr_filter_checks_hash, attr_filter_checks_cmp, NULL);
+			if (!rule->by_da) return -1;
+		}
+
+		find.da = vp->da;
+		checks = fr_hash_oa_finddata(rule->by_da, &find);
+		if (!checks) {
+			checks = talloc_zero(rule->by_da, attr_filter_checks_t);
+			if (!checks) return -1;
+			checks->da = vp->da;
+
+			if (!fr_hash_oa_insert(rule->by_da, checks)) return -1;
+		}
+
+		checks->checks = talloc_realloc(checks, checks->checks, VALUE_PAIR *, checks->num_checks + 1);
+		if (!checks->checks) return -1;
+		checks->checks[checks->num_checks++] = vp;
+	}
+
+	return 0;
+}
+
 /*
  *	(Re-)read the "attrs" file into memory.
  */
@@ -133,6 +243,9 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 	rlm_attr_filter_t *inst = instance;
 	int rcode;
 
+	PAIR_LIST *pl;
+	uint32_t i;
+
 	rcode = attr_filter_getfile(inst, inst->filename, &inst->attrs);
 	if (rcode != 0) {
 		ERROR("Errors reading %s", inst->filename);
@@ -140,6 +253,19 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	for (pl = inst->attrs; pl; pl = pl->next) inst->num_rules++;
+
+	inst->rules = talloc_zero_array(inst, attr_filter_rule_t, inst->num_rules);
+	if (!inst->rules) return -1;
+
+	for (pl = inst->attrs, i = 0; pl; pl = pl->next, i++) {
+		if (attr_filter_compile(inst->rules, &inst->rules[i], pl) < 0) {
+			ERROR("Failed compiling entry %s at line %d", pl->name, pl->lineno);
+
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -151,9 +277,10 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void *instance, REQU
 {
 	rlm_attr_filter_t *inst = instance;
 	VALUE_PAIR	*vp;
-	vp_cursor_t	input, check, out;
-	VALUE_PAIR	*input_item, *check_item, *output;
+	vp_cursor_t	input, out;
+	VALUE_PAIR	*input_item, *output;
 	PAIR_LIST	*pl;
+	uint32_t	i, j;
 	int		found = 0;
 	int		pass, fail = 0;
 	char const	*keyname = NULL;
@@ -178,9 +305,11 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void *instance, REQU
 	/*
 	 *      Find the attr_filter profile entry for the entry.
 	 */
-	for (pl = inst->attrs; pl; pl = pl->next) {
-		int fall_through = 0;
-		int relax_filter = inst->relaxed;
+	for (i = 0; i < inst->num_rules; i++) {
+		attr_filter_rule_t const *rule = &inst->rules[i];
+		int relax_filter = (rule->relax_filter < 0) ? inst->relaxed : rule->relax_filter;
+
+		pl = rule->pl;
 
 		/*
 		 *  If the current entry is NOT a default,
@@ -195,66 +324,44 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void *instance, REQU
 		RDEBUG2("Matched entry %s at line %d", pl->name, pl->lineno);
 		found = 1;
 
-		for (check_item = fr_cursor_init(&check, &pl->check);
-		     check_item;
-		     check_item = fr_cursor_next(&check)) {
-			if (!check_item->da->vendor &&
-			    (check_item->da->attr == PW_FALL_THROUGH) &&
-				(check_item->vp_integer == 1)) {
-				fall_through = 1;
-				continue;
-			}
-			else if (!check_item->da->vendor && check_item->da->attr == PW_RELAX_FILTER) {
-				relax_filter = check_item->vp_integer;
-				continue;
-			}
-
-			/*
-			 *    If it is a SET operator, add the attribute to
-			 *    the output list without checking it.
-			 */
-			if (check_item->op == T_OP_SET ) {
-				vp = fr_pair_copy(packet, check_item);
-				if (!vp) {
-					goto error;
-				}
-				radius_xlat_do(request, vp);
-				fr_cursor_insert(&out, vp);
+		/*
+		 *    SET operators add the attribute to the output
+		 *    list without checking it.
+		 */
+		for (j = 0; j < rule->num_set; j++) {
+			vp = fr_pair_copy(packet, rule->set[j]);
+			if (!vp) {
+				goto error;
 			}
+			radius_xlat_do(request, vp);
+			fr_cursor_insert(&out, vp);
 		}
 
 		/*
 		 *	Iterate through the input items, comparing
-		 *	each item to every rule, then moving it to the
-		 *	output list only if it matches all rules
-		 *	for that attribute.  IE, Idle-Timeout is moved
-		 *	only if it matches all rules that describe an
+		 *	each item to the rules for its attribute, then
+		 *	moving it to the output list only if it matches
+		 *	all of them.  IE, Idle-Timeout is moved only if
+		 *	it matches all rules that describe an
 		 *	Idle-Timeout.
 		 */
 		for (input_item = fr_cursor_init(&input, &packet->vps);
 		     input_item;
 		     input_item = fr_cursor_next(&input)) {
+			attr_filter_checks_t find, *checks;
+
 			pass = fail = 0; /* reset the pass,fail vars for each reply item */
 
 			/*
-			 *  Reset the check_item pointer to beginning of the list
+			 *  Vendor-Specific is special, and matches any VSA if the
+			 *  comparison is always true.
 			 */
-			for (check_item = fr_cursor_first(&check);
-			     check_item;
-			     check_item = fr_cursor_next(&check)) {
-				/*
-				 *  Vendor-Specific is special, and matches any VSA if the
-				 *  comparison is always true.
-				 */
-				if ((check_item->da->attr == PW_VENDOR_SPECIFIC) && (input_item->da->vendor != 0) &&
-				    (check_item->op == T_OP_CMP_TRUE)) {
-					pass++;
-					continue;
-				}
+			if (input_item->da->vendor != 0) pass += rule->vsa_any;
 
-				if (input_item->da == check_item->da) {
-					check_pair(request, check_item, input_item, &pass, &fail);
-				}
+			find.da = input_item->da;
+			checks = fr_hash_oa_finddata(rule->by_da, &find);
+			if (checks) for (j = 0; j < checks->num_checks; j++) {
+				check_pair(request, checks->checks[j], input_item, &pass, &fail);
 			}
 
 			RDEBUG3("Attribute \"%s\" allowed by %i rules, disallowed by %i rules",
@@ -276,7 +383,7 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void *instance, REQU
 		}
 
 		/* If we shouldn't fall through, break */
-		if (!fall_through) {
+		if (!rule->fall_through) {
 			break;
 		}
 	}
@@ -36,11 +36,13 @@ typedef struct rlm_cache_memcached_handle {
 
 typedef struct rlm_cache_memcached {
 	char const 		*options;	//!< Connection options
+	bool			binary;		//!< Store entries in the binary format.
 	fr_connection_pool_t	*pool;
 } rlm_cache_memcached_t;
 
 static const CONF_PARSER driver_config[] = {
 	{ FR_CONF_OFFSET("options", PW_TYPE_STRING | PW_TYPE_REQUIRED, rlm_cache_memcached_t, options), .dflt = "--SERVER=localhost" },
+	{ FR_CONF_OFFSET("binary", PW_TYPE_BOOLEAN, rlm_cache_memcached_t, binary), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -180,7 +182,7 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 		return CACHE_ERROR;
 	}
 	RDEBUG2("Retrieved %zu bytes from memcached", len);
-	RDEBUG2("%s", from_store);
+	if ((len > 0) && ((uint8_t)from_store[0] != CACHE_SERIALIZE_BINARY_MAGIC)) RDEBUG2("%s", from_store);
 
 	c = talloc_zero(NULL,  rlm_cache_entry_t);
 	ret = cache_deserialize(c, from_store, len);
@@ -200,28 +202,42 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
  *
  * @copydetails cache_entry_insert_t
  */
-static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, UNUSED void *driver_inst,
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *driver_inst,
 					 REQUEST *request, void *handle, const rlm_cache_entry_t *c)
 {
+	rlm_cache_memcached_t *driver = driver_inst;
 	rlm_cache_memcached_handle_t *mandle = handle;
 
 	memcached_return_t ret;
 
 	TALLOC_CTX *pool;
 	char *to_store;
+	size_t len;
 
 	pool = talloc_pool(NULL, 1024);
 	if (!pool) return CACHE_ERROR;
 
-	if (cache_serialize(pool, &to_store, c) < 0) {
-		talloc_free(pool);
+	if (driver->binary) {
+		uint8_t *bin;
 
-		return CACHE_ERROR;
+		if (cache_serialize_binary(pool, &bin, c) < 0) {
+			talloc_free(pool);
+
+			return CACHE_ERROR;
+		}
+		to_store = (char *)bin;
+		len = talloc_array_length(bin);
+	} else {
+		if (cache_serialize(pool, &to_store, c) < 0) {
+			talloc_free(pool);
+
+			return CACHE_ERROR;
+		}
+		len = to_store ? talloc_array_length(to_store) - 1 : 0;
 	}
 
 	ret = memcached_set(mandle->handle, (char const *)c->key, c->key_len,
-		            to_store ? to_store : "",
-		            to_store ? talloc_array_length(to_store) - 1 : 0, c->expires, 0);
+		            to_store ? to_store : "", len, c->expires, 0);
 	talloc_free(pool);
 	if (ret != MEMCACHED_SUCCESS) {
 		RERROR("Failed storing entry: %s: %s", memcached_strerror(mandle->handle, ret),
@@ -25,6 +25,11 @@
 #include <freeradius-devel/heap.h>
 #include <freeradius-devel/rad_assert.h>
 #include "../../rlm_cache.h"
+#include "../../serialize.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #ifdef HAVE_PTHREAD_H
 #  define PTHREAD_MUTEX_LOCK pthread_mutex_lock
@@ -34,18 +39,54 @@
 #  define PTHREAD_MUTEX_UNLOCK(_x)
 #endif
 
+/*
+ *	Snapshot file format, all integers are in network byte order.
+ *
+ *	The file starts with the magic string "FRCS", and a 32bit
+ *	version number, followed by zero or more records of:
+ *
+ *	  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	  |                          Key Length                           |
+ *	  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	  |  Key ...
+ *	  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	  |                         Entry Length                          |
+ *	  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	  |  Entry (see cache_serialize_binary) ...
+ *	  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ */
+#define SNAPSHOT_MAGIC		"FRCS"
+#define SNAPSHOT_VERSION	1
+#define SNAPSHOT_HDR_LEN	8
+
 typedef struct rlm_cache_rbtree {
 	rbtree_t		*cache;		//!< Tree for looking up cache keys.
 	fr_heap_t		*heap;		//!< For managing entry expiry.
 
+	char const		*snapshot;	//!< File to write snapshots of the cache to.
+	uint32_t		snapshot_interval;	//!< How often to write snapshots.
+
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_t		mutex;		//!< Protect the tree from multiple readers/writers.
+
+	pthread_t		snapshot_thread;	//!< Thread writing periodic snapshots.
+	bool			snapshot_started;	//!< Whether snapshot_thread was started.
+	pthread_mutex_t		snapshot_mutex;	//!< Protects snapshot_stop.
+	pthread_cond_t		snapshot_cond;	//!< Signalled when snapshot_stop is set.
+	bool			snapshot_stop;	//!< Tell the snapshot thread to exit.
 #endif
 } rlm_cache_rbtree_t;
 
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("snapshot", PW_TYPE_FILE_OUTPUT, rlm_cache_rbtree_t, snapshot) },
+	{ FR_CONF_OFFSET("snapshot_interval", PW_TYPE_INTEGER, rlm_cache_rbtree_t, snapshot_interval), .dflt = "300" },
+	CONF_PARSER_TERMINATOR
+};
+
 typedef struct rlm_cache_rbtree_entry {
 	rlm_cache_entry_t	fields;		//!< Entry data.
 	size_t			offset;		//!< Offset used for heap.
+	rbnode_t		node;		//!< Node in the cache tree.
 } rlm_cache_rbtree_entry_t;
 
 /** Compare two entries by key
@@ -78,31 +119,320 @@ static int cache_heap_cmp(void const *one, void const *two)
 	return 0;
 }
 
-/** Walk over the cache rbtree
+/** Append data to a snapshot buffer, growing it as needed
+ *
+ */
+static int cache_snapshot_append(uint8_t **buff, size_t *used, void const *data, size_t len)
+{
+	size_t size = talloc_array_length(*buff);
+
+	if ((*used + len) > size) {
+		uint8_t *n;
+
+		while ((*used + len) > size) size *= 2;
+
+		n = talloc_realloc(NULL, *buff, uint8_t, size);
+		if (!n) return -1;
+		*buff = n;
+	}
+
+	memcpy(*buff + *used, data, len);
+	*used += len;
+
+	return 0;
+}
+
+typedef struct {
+	uint8_t		*buff;		//!< Snapshot being built.
+	size_t		used;		//!< How much of buff has been written to.
+	time_t		now;		//!< Entries which expired before this aren't written.
+	uint32_t	count;		//!< Number of entries written.
+} cache_snapshot_ctx_t;
+
+/** Add an entry to a snapshot
+ *
+ */
+static int _cache_snapshot_entry(void *ctx, void *data)
+{
+	cache_snapshot_ctx_t	*snap = ctx;
+	rlm_cache_entry_t	*c = data;
+	uint8_t			*entry;
+	uint32_t		len;
+	int			ret;
+
+	if (c->expires < snap->now) return 0;
+
+	if (cache_serialize_binary(NULL, &entry, c) < 0) {
+		WARN("rlm_cache_rbtree: Not writing entry to snapshot: %s", fr_strerror());
+		return 0;
+	}
+
+	len = htonl(c->key_len);
+	ret = cache_snapshot_append(&snap->buff, &snap->used, &len, sizeof(len));
+	if (ret == 0) ret = cache_snapshot_append(&snap->buff, &snap->used, c->key, c->key_len);
+	len = htonl(talloc_array_length(entry));
+	if (ret == 0) ret = cache_snapshot_append(&snap->buff, &snap->used, &len, sizeof(len));
+	if (ret == 0) ret = cache_snapshot_append(&snap->buff, &snap->used, entry, talloc_array_length(entry));
+	talloc_free(entry);
+	if (ret < 0) return -1;
+
+	snap->count++;
+
+	return 0;
+}
+
+/** Write the contents of the cache to the snapshot file
  *
- * Used to free any entries left in the tree on detach.
+ * The tree is only locked whilst the entries are serialized, the
+ * snapshot is written to a temporary file, which then replaces the
+ * previous snapshot, so there's always a complete snapshot to load.
  *
- * @param ctx unused.
- * @param data to free.
- * @return 2
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static int _cache_entry_free(UNUSED void *ctx, void *data)
+static int cache_snapshot_write(rlm_cache_rbtree_t *driver)
 {
-	talloc_free(data);
+	cache_snapshot_ctx_t	snap = { .now = time(NULL) };
+	uint32_t		version = htonl(SNAPSHOT_VERSION);
+	char			*tmp;
+	uint8_t const		*p, *end;
+	ssize_t			slen;
+	int			fd, ret;
+
+	snap.buff = talloc_array(NULL, uint8_t, 4096);
+	if (!snap.buff) return -1;
+
+	cache_snapshot_append(&snap.buff, &snap.used, SNAPSHOT_MAGIC, 4);
+	cache_snapshot_append(&snap.buff, &snap.used, &version, sizeof(version));
 
-	return 2;
+	PTHREAD_MUTEX_LOCK(&driver->mutex);
+	ret = rbtree_walk(driver->cache, RBTREE_IN_ORDER, _cache_snapshot_entry, &snap);
+	PTHREAD_MUTEX_UNLOCK(&driver->mutex);
+	if (ret != 0) {
+		ERROR("rlm_cache_rbtree: Out of memory building snapshot");
+		talloc_free(snap.buff);
+		return -1;
+	}
+
+	tmp = talloc_asprintf(snap.buff, "%s.tmp", driver->snapshot);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		ERROR("rlm_cache_rbtree: Failed opening \"%s\": %s", tmp, fr_syserror(errno));
+		talloc_free(snap.buff);
+		return -1;
+	}
+
+	for (p = snap.buff, end = p + snap.used; p < end; p += slen) {
+		slen = write(fd, p, end - p);
+		if (slen < 0) {
+			if (errno == EINTR) {
+				slen = 0;
+				continue;
+			}
+			ERROR("rlm_cache_rbtree: Failed writing \"%s\": %s", tmp, fr_syserror(errno));
+		error:
+			close(fd);
+			unlink(tmp);
+			talloc_free(snap.buff);
+			return -1;
+		}
+	}
+
+	if (fsync(fd) < 0) {
+		ERROR("rlm_cache_rbtree: Failed syncing \"%s\": %s", tmp, fr_syserror(errno));
+		goto error;
+	}
+
+	if (rename(tmp, driver->snapshot) < 0) {
+		ERROR("rlm_cache_rbtree: Failed renaming \"%s\" to \"%s\": %s", tmp, driver->snapshot,
+		      fr_syserror(errno));
+		goto error;
+	}
+	close(fd);
+
+	DEBUG2("rlm_cache_rbtree: Wrote %u entries to \"%s\"", snap.count, driver->snapshot);
+	talloc_free(snap.buff);
+
+	return 0;
 }
 
+/** Load entries from the snapshot file
+ *
+ * Entries which have expired since the snapshot was written are
+ * discarded.  A missing or damaged snapshot isn't fatal, we just
+ * start with fewer entries.
+ */
+static void cache_snapshot_load(rlm_cache_rbtree_t *driver)
+{
+	int		fd;
+	struct stat	st;
+	uint8_t		*map;
+	uint8_t const	*p, *end;
+	time_t		now = time(NULL);
+	uint32_t	version, count = 0;
+
+	fd = open(driver->snapshot, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) {
+			DEBUG2("rlm_cache_rbtree: No snapshot at \"%s\", starting empty", driver->snapshot);
+			return;
+		}
+		WARN("rlm_cache_rbtree: Failed opening \"%s\": %s", driver->snapshot, fr_syserror(errno));
+		return;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		WARN("rlm_cache_rbtree: Failed reading \"%s\": %s", driver->snapshot, fr_syserror(errno));
+		close(fd);
+		return;
+	}
+
+	if (st.st_size < SNAPSHOT_HDR_LEN) {
+	bad_header:
+		WARN("rlm_cache_rbtree: Ignoring \"%s\", not a cache snapshot", driver->snapshot);
+		close(fd);
+		return;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		WARN("rlm_cache_rbtree: Failed mapping \"%s\": %s", driver->snapshot, fr_syserror(errno));
+		close(fd);
+		return;
+	}
+
+	memcpy(&version, map + 4, sizeof(version));
+	if ((memcmp(map, SNAPSHOT_MAGIC, 4) != 0) || (ntohl(version) != SNAPSHOT_VERSION)) {
+		munmap(map, st.st_size);
+		goto bad_header;
+	}
+
+	p = map + SNAPSHOT_HDR_LEN;
+	end = map + st.st_size;
+
+	while (p < end) {
+		rlm_cache_rbtree_entry_t	*c;
+		uint32_t			key_len, len;
+		uint8_t const			*key;
+
+		if ((end - p) < 4) goto truncated;
+		memcpy(&key_len, p, sizeof(key_len));
+		key_len = ntohl(key_len);
+		p += 4;
+		if ((size_t)(end - p) < key_len) goto truncated;
+		key = p;
+		p += key_len;
+
+		if ((end - p) < 4) goto truncated;
+		memcpy(&len, p, sizeof(len));
+		len = ntohl(len);
+		p += 4;
+		if ((size_t)(end - p) < len) {
+		truncated:
+			WARN("rlm_cache_rbtree: Snapshot \"%s\" is truncated", driver->snapshot);
+			break;
+		}
+
+		c = talloc_zero(NULL, rlm_cache_rbtree_entry_t);
+		if (!c) break;
+
+		if (cache_deserialize_binary(&c->fields, p, len) < 0) {
+			WARN("rlm_cache_rbtree: Discarding snapshot entry: %s", fr_strerror());
+		discard:
+			talloc_free(c);
+			p += len;
+			continue;
+		}
+		p += len;
+
+		if (c->fields.expires < now) goto discard;
+
+		c->fields.key = talloc_memdup(c, key, key_len);
+		c->fields.key_len = key_len;
+
+		if (!rbtree_insert(driver->cache, c)) goto discard;
+		if (!fr_heap_insert(driver->heap, c)) {
+			rbtree_deletebydata(driver->cache, c);
+			goto discard;
+		}
+		count++;
+	}
+
+	munmap(map, st.st_size);
+	close(fd);
+
+	INFO("rlm_cache_rbtree: Loaded %u entries from \"%s\"", count, driver->snapshot);
+}
+
+#ifdef HAVE_PTHREAD_H
+/** Periodically write snapshots of the cache
+ *
+ */
+static void *cache_snapshot_thread(void *arg)
+{
+	rlm_cache_rbtree_t	*driver = arg;
+	struct timespec		when;
+
+	pthread_mutex_lock(&driver->snapshot_mutex);
+	while (!driver->snapshot_stop) {
+		when.tv_sec = time(NULL) + driver->snapshot_interval;
+		when.tv_nsec = 0;
+
+		if (pthread_cond_timedwait(&driver->snapshot_cond, &driver->snapshot_mutex, &when) != ETIMEDOUT) {
+			continue;
+		}
+
+		pthread_mutex_unlock(&driver->snapshot_mutex);
+		cache_snapshot_write(driver);
+		pthread_mutex_lock(&driver->snapshot_mutex);
+	}
+	pthread_mutex_unlock(&driver->snapshot_mutex);
+
+	return NULL;
+}
+#endif
+
 /** Cleanup a cache_rbtree instance
  *
  */
 static int _mod_detach(rlm_cache_rbtree_t *driver)
 {
-	if (driver->heap) fr_heap_delete(driver->heap);
-	if (driver->cache) {
-		rbtree_walk(driver->cache, RBTREE_DELETE_ORDER, _cache_entry_free, NULL);
-		rbtree_free(driver->cache);
+#ifdef HAVE_PTHREAD_H
+	if (driver->snapshot_started) {
+		pthread_mutex_lock(&driver->snapshot_mutex);
+		driver->snapshot_stop = true;
+		pthread_cond_signal(&driver->snapshot_cond);
+		pthread_mutex_unlock(&driver->snapshot_mutex);
+
+		pthread_join(driver->snapshot_thread, NULL);
+		pthread_cond_destroy(&driver->snapshot_cond);
+		pthread_mutex_destroy(&driver->snapshot_mutex);
+	}
+#endif
+
+	/*
+	 *	Write a final snapshot, so we start with
+	 *	the most recent entries.
+	 */
+	if (driver->snapshot && driver->cache) cache_snapshot_write(driver);
+
+	/*
+	 *	Every entry in the tree is also in the heap.  The
+	 *	tree nodes are part of the entries, so they're
+	 *	removed from the tree before being freed.
+	 */
+	if (driver->heap) {
+		rlm_cache_entry_t *c;
+
+		while ((c = fr_heap_peek(driver->heap))) {
+			fr_heap_extract(driver->heap, c);
+			if (driver->cache) rbtree_deletebydata(driver->cache, c);
+			talloc_free(c);
+		}
+		fr_heap_delete(driver->heap);
 	}
+	if (driver->cache) rbtree_free(driver->cache);
 
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_destroy(&driver->mutex);
@@ -114,16 +444,19 @@ static int _mod_detach(rlm_cache_rbtree_t *driver)
  *
  * @copydetails cache_instantiate_t
  */
-static int mod_instantiate(UNUSED CONF_SECTION *conf, UNUSED rlm_cache_config_t const *config, void *driver_inst)
+static int mod_instantiate(CONF_SECTION *conf, UNUSED rlm_cache_config_t const *config, void *driver_inst)
 {
 	rlm_cache_rbtree_t *driver = driver_inst;
 
+	if (cf_section_parse(conf, driver, driver_config) < 0) return -1;
+
 	talloc_set_destructor(driver, _mod_detach);
 
 	/*
 	 *	The cache.
 	 */
-	driver->cache = rbtree_create(NULL, cache_entry_cmp, NULL, 0);
+	driver->cache = rbtree_create_intrusive(NULL, cache_entry_cmp, NULL,
+						offsetof(rlm_cache_rbtree_entry_t, node), 0);
 	if (!driver->cache) {
 		ERROR("Failed to create cache");
 		return -1;
@@ -146,6 +479,28 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, UNUSED rlm_cache_config_t
 	}
 #endif
 
+	if (!driver->snapshot) return 0;
+
+	/*
+	 *	Come up warm.
+	 */
+	cache_snapshot_load(driver);
+
+#ifdef HAVE_PTHREAD_H
+	if (driver->snapshot_interval > 0) {
+		pthread_mutex_init(&driver->snapshot_mutex, NULL);
+		pthread_cond_init(&driver->snapshot_cond, NULL);
+
+		if (pthread_create(&driver->snapshot_thread, NULL, cache_snapshot_thread, driver) != 0) {
+			ERROR("Failed starting snapshot thread: %s", fr_syserror(errno));
+			pthread_cond_destroy(&driver->snapshot_cond);
+			pthread_mutex_destroy(&driver->snapshot_mutex);
+			return -1;
+		}
+		driver->snapshot_started = true;
+	}
+#endif
+
 	return 0;
 }
 
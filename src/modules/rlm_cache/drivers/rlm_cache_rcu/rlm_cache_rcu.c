@@ -0,0 +1,643 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_rcu.c
+ * @brief In memory cache with lock free lookups, for read mostly workloads.
+ *
+ * Lookups walk hash bucket chains using atomic loads only, and never take a
+ * lock.  Writers (insert, expire, set_ttl) are serialised by a mutex, publish
+ * new entries with a single atomic store, and unlink old entries without
+ * modifying them.
+ *
+ * Unlinked entries can't be freed straight away, as readers may still be
+ * using them.  Memory is reclaimed using epochs.  When a thread acquires a
+ * handle it publishes the current global epoch in its slot.  When a writer
+ * retires an entry, it records the current epoch and advances the global
+ * epoch.  The entry is freed once no slot holds an epoch less than or equal
+ * to the one it was retired in.
+ *
+ * Threads beyond the number of epoch slots fall back to holding the writer
+ * mutex between acquire and release.
+ *
+ * Entries are shared between readers, so hit counts maintained by rlm_cache
+ * are approximate.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/heap.h>
+#include <freeradius-devel/rad_assert.h>
+#include "../../rlm_cache.h"
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#  define WITH_CACHE_RCU
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#  define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#  define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#  define PTHREAD_MUTEX_LOCK(_x)
+#  define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+#ifdef WITH_CACHE_RCU
+/** Number of threads which can perform lock free lookups
+ *
+ * Any threads after this hold the writer mutex between acquire and release.
+ */
+#define CACHE_RCU_SLOTS		(128)
+
+#define CACHE_LINE_SIZE		(64)
+
+typedef struct rlm_cache_rcu_entry rlm_cache_rcu_entry_t;
+
+struct rlm_cache_rcu_entry {
+	rlm_cache_entry_t		fields;		//!< Entry data.
+	size_t				offset;		//!< Offset used for heap.
+	uint32_t			hash;		//!< Hash of the entry's key.
+
+	_Atomic(rlm_cache_rcu_entry_t *) next;		//!< Next entry in the bucket.
+
+	rlm_cache_rcu_entry_t		*retired_next;	//!< Next entry waiting to be freed.
+	uint_fast64_t			retired_epoch;	//!< Epoch the entry was unlinked in.
+};
+
+/** Epoch published by a single thread
+ *
+ * Padded to a cache line, as each slot is written by a different thread.
+ */
+typedef struct rlm_cache_rcu_slot {
+	atomic_uint_fast64_t		epoch;		//!< Epoch the thread entered in, or 0
+							//!< if the thread holds no handle.
+	uint8_t				pad[CACHE_LINE_SIZE - sizeof(atomic_uint_fast64_t)];
+} rlm_cache_rcu_slot_t;
+
+typedef struct rlm_cache_rcu {
+	uint32_t			num_buckets;	//!< Number of hash buckets, a power of 2.
+
+	_Atomic(rlm_cache_rcu_entry_t *) *buckets;	//!< Heads of the bucket chains.
+	atomic_uint_fast32_t		num_entries;	//!< Entries currently linked.
+
+	atomic_uint_fast64_t		epoch;		//!< Global epoch, advanced whenever an
+							//!< entry is retired.
+	rlm_cache_rcu_slot_t		*slots;		//!< Per thread epochs.
+
+	fr_heap_t			*heap;		//!< For managing entry expiry.  Writers only.
+	rlm_cache_rcu_entry_t		*retired;	//!< Entries waiting to be freed.  Writers only.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t			mutex;		//!< Serialise writers.
+#endif
+} rlm_cache_rcu_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("buckets", PW_TYPE_INTEGER, rlm_cache_rcu_t, num_buckets), .dflt = "4096" },
+	CONF_PARSER_TERMINATOR
+};
+
+static atomic_int cache_rcu_thread_ids;
+fr_thread_local_setup(int, cache_rcu_thread_id)	/* macro */
+
+/** Find the epoch slot for the current thread
+ *
+ * @return
+ *	- The slot for this thread.
+ *	- NULL if there are too many threads.
+ */
+static inline rlm_cache_rcu_slot_t *cache_rcu_slot(rlm_cache_rcu_t *driver)
+{
+	int id;
+
+	id = fr_thread_local_get(cache_rcu_thread_id);
+	if (id == 0) {
+		id = atomic_fetch_add(&cache_rcu_thread_ids, 1) + 1;
+		(void) fr_thread_local_set(cache_rcu_thread_id, id);
+	}
+	if (id > CACHE_RCU_SLOTS) return NULL;
+
+	return &driver->slots[id - 1];
+}
+
+/** Lock the writer mutex, unless the handle already holds it
+ *
+ * Handles for threads without an epoch slot are the driver itself, and
+ * hold the mutex from acquire to release.
+ */
+static inline void cache_rcu_writer_lock(rlm_cache_rcu_t *driver, void *handle)
+{
+	if (handle != driver) PTHREAD_MUTEX_LOCK(&driver->mutex);
+}
+
+static inline void cache_rcu_writer_unlock(rlm_cache_rcu_t *driver, void *handle)
+{
+	if (handle != driver) PTHREAD_MUTEX_UNLOCK(&driver->mutex);
+}
+
+/** Compare an entry with a key
+ *
+ */
+static inline bool cache_rcu_entry_match(rlm_cache_rcu_entry_t const *c, uint32_t hash,
+					 uint8_t const *key, size_t key_len)
+{
+	return (c->hash == hash) && (c->fields.key_len == key_len) && (memcmp(c->fields.key, key, key_len) == 0);
+}
+
+/** Compare two entries by expiry time
+ *
+ * There may be multiple entries with the same expiry time.
+ */
+static int cache_heap_cmp(void const *one, void const *two)
+{
+	rlm_cache_entry_t const *a = one;
+	rlm_cache_entry_t const *b = two;
+
+	if (a->expires < b->expires) return -1;
+	if (a->expires > b->expires) return +1;
+
+	return 0;
+}
+
+/** Free retired entries no reader can still reference
+ *
+ * @note Must be called with the writer mutex held.
+ */
+static void cache_rcu_reclaim(rlm_cache_rcu_t *driver)
+{
+	rlm_cache_rcu_entry_t	**p, *c;
+	uint_fast64_t		min = UINT_FAST64_MAX;
+	int			i;
+
+	if (!driver->retired) return;
+
+	/*
+	 *	Pairs with the fence in cache_acquire.  Either we
+	 *	see the reader's epoch, or the reader sees the
+	 *	entries we unlinked as gone.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	for (i = 0; i < CACHE_RCU_SLOTS; i++) {
+		uint_fast64_t epoch;
+
+		epoch = atomic_load_explicit(&driver->slots[i].epoch, memory_order_relaxed);
+		if (epoch && (epoch < min)) min = epoch;
+	}
+
+	p = &driver->retired;
+	while ((c = *p)) {
+		if (c->retired_epoch < min) {
+			*p = c->retired_next;
+			talloc_free(c);
+			continue;
+		}
+		p = &c->retired_next;
+	}
+}
+
+/** Unlink an entry from its bucket and queue it to be freed
+ *
+ * Readers currently looking at the entry can continue to follow its next
+ * pointer, which is left unchanged.
+ *
+ * @note Must be called with the writer mutex held.
+ */
+static void cache_rcu_retire(rlm_cache_rcu_t *driver, rlm_cache_rcu_entry_t *c)
+{
+	_Atomic(rlm_cache_rcu_entry_t *)	*p;
+	rlm_cache_rcu_entry_t			*this;
+
+	p = &driver->buckets[c->hash & (driver->num_buckets - 1)];
+	while ((this = atomic_load_explicit(p, memory_order_relaxed)) != c) {
+		if (!rad_cond_assert(this)) return;
+		p = &this->next;
+	}
+	atomic_store_explicit(p, atomic_load_explicit(&c->next, memory_order_relaxed), memory_order_release);
+	atomic_fetch_sub_explicit(&driver->num_entries, 1, memory_order_relaxed);
+
+	fr_heap_extract(driver->heap, c);
+
+	c->retired_epoch = atomic_fetch_add(&driver->epoch, 1);
+	c->retired_next = driver->retired;
+	driver->retired = c;
+}
+
+/** Find an entry with the writer mutex held
+ *
+ */
+static rlm_cache_rcu_entry_t *cache_rcu_find_locked(rlm_cache_rcu_t *driver, uint32_t hash,
+						    uint8_t const *key, size_t key_len)
+{
+	rlm_cache_rcu_entry_t *c;
+
+	for (c = atomic_load_explicit(&driver->buckets[hash & (driver->num_buckets - 1)], memory_order_relaxed);
+	     c;
+	     c = atomic_load_explicit(&c->next, memory_order_relaxed)) {
+		if (cache_rcu_entry_match(c, hash, key, key_len)) return c;
+	}
+
+	return NULL;
+}
+
+/** Retire any entries which have expired
+ *
+ * @note Must be called with the writer mutex held.
+ */
+static void cache_rcu_reap(rlm_cache_rcu_t *driver, time_t now)
+{
+	rlm_cache_entry_t *c;
+
+	while ((c = fr_heap_peek(driver->heap)) && (c->expires < now)) {
+		cache_rcu_retire(driver, (rlm_cache_rcu_entry_t *)c);
+	}
+}
+
+/** Cleanup a cache_rcu instance
+ *
+ * No readers or writers can be active at this point.
+ */
+static int _mod_detach(rlm_cache_rcu_t *driver)
+{
+	rlm_cache_rcu_entry_t	*c, *next;
+	uint32_t		i;
+
+	if (driver->buckets) for (i = 0; i < driver->num_buckets; i++) {
+		for (c = atomic_load(&driver->buckets[i]); c; c = next) {
+			next = atomic_load(&c->next);
+			talloc_free(c);
+		}
+	}
+
+	for (c = driver->retired; c; c = next) {
+		next = c->retired_next;
+		talloc_free(c);
+	}
+
+	if (driver->heap) fr_heap_delete(driver->heap);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&driver->mutex);
+#endif
+	return 0;
+}
+
+/** Create a new cache_rcu instance
+ *
+ * @copydetails cache_instantiate_t
+ */
+static int mod_instantiate(CONF_SECTION *conf, UNUSED rlm_cache_config_t const *config, void *driver_inst)
+{
+	rlm_cache_rcu_t	*driver = driver_inst;
+	uint32_t	i, num_buckets;
+
+	if (cf_section_parse(conf, driver, driver_config) < 0) return -1;
+
+	FR_INTEGER_BOUND_CHECK("buckets", driver->num_buckets, >=, 16);
+	FR_INTEGER_BOUND_CHECK("buckets", driver->num_buckets, <=, (1 << 24));
+
+	/*
+	 *	Round up to a power of 2, so we can mask instead
+	 *	of dividing.
+	 */
+	for (num_buckets = 16; num_buckets < driver->num_buckets; num_buckets <<= 1);
+	driver->num_buckets = num_buckets;
+
+	talloc_set_destructor(driver, _mod_detach);
+
+	/*
+	 *	The cache.
+	 */
+	driver->buckets = talloc_array(driver, _Atomic(rlm_cache_rcu_entry_t *), driver->num_buckets);
+	if (!driver->buckets) {
+		ERROR("Failed to create cache");
+		return -1;
+	}
+	for (i = 0; i < driver->num_buckets; i++) atomic_init(&driver->buckets[i], NULL);
+	atomic_init(&driver->num_entries, 0);
+
+	/*
+	 *	Epoch 0 marks a slot as inactive.
+	 */
+	driver->slots = talloc_array(driver, rlm_cache_rcu_slot_t, CACHE_RCU_SLOTS);
+	if (!driver->slots) {
+		ERROR("Failed to create epoch slots");
+		return -1;
+	}
+	for (i = 0; i < CACHE_RCU_SLOTS; i++) atomic_init(&driver->slots[i].epoch, 0);
+	atomic_init(&driver->epoch, 1);
+
+	/*
+	 *	The heap of entries to expire.
+	 */
+	driver->heap = fr_heap_create(cache_heap_cmp, offsetof(rlm_cache_rcu_entry_t, offset));
+	if (!driver->heap) {
+		ERROR("Failed to create heap for the cache");
+		return -1;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&driver->mutex, NULL) < 0) {
+		ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+/** Custom allocation function for the driver
+ *
+ * Allows allocation of cache entry structures with additional fields.
+ *
+ * @copydetails cache_entry_alloc_t
+ */
+static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *config, UNUSED void *driver_inst,
+					    REQUEST *request)
+{
+	rlm_cache_rcu_entry_t *c;
+
+	c = talloc_zero(NULL, rlm_cache_rcu_entry_t);
+	if (!c) {
+		RERROR("Failed allocating cache entry");
+		return NULL;
+	}
+	atomic_init(&c->next, NULL);
+
+	return (rlm_cache_entry_t *)c;
+}
+
+/** Locate a cache entry
+ *
+ * Lock free.  Expired entries are returned, and removed by rlm_cache calling
+ * the expire callback.
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       UNUSED rlm_cache_config_t const *config, void *driver_inst,
+				       UNUSED REQUEST *request, UNUSED void *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_rcu_t		*driver = driver_inst;
+	rlm_cache_rcu_entry_t	*c;
+	uint32_t		hash;
+
+	hash = fr_hash(key, key_len);
+
+	for (c = atomic_load_explicit(&driver->buckets[hash & (driver->num_buckets - 1)], memory_order_acquire);
+	     c;
+	     c = atomic_load_explicit(&c->next, memory_order_acquire)) {
+		if (cache_rcu_entry_match(c, hash, key, key_len)) {
+			*out = (rlm_cache_entry_t *)c;
+			return CACHE_OK;
+		}
+	}
+
+	*out = NULL;
+	return CACHE_MISS;
+}
+
+/** Unlink an entry from the data store
+ *
+ * @copydetails cache_entry_expire_t
+ */
+static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *driver_inst,
+					 REQUEST *request, void *handle,
+					 uint8_t const *key, size_t key_len)
+{
+	rlm_cache_rcu_t		*driver = driver_inst;
+	rlm_cache_rcu_entry_t	*c;
+
+	if (!request) return CACHE_ERROR;
+
+	cache_rcu_writer_lock(driver, handle);
+	c = cache_rcu_find_locked(driver, fr_hash(key, key_len), key, key_len);
+	if (!c) {
+		cache_rcu_writer_unlock(driver, handle);
+		return CACHE_MISS;
+	}
+
+	cache_rcu_retire(driver, c);
+	cache_rcu_reclaim(driver);
+	cache_rcu_writer_unlock(driver, handle);
+
+	return CACHE_OK;
+}
+
+/** Insert a new entry into the data store
+ *
+ * The new entry is published at the head of its bucket before any existing
+ * entry with the same key is unlinked, so readers always find one of them.
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *driver_inst,
+					 REQUEST *request, void *handle,
+					 rlm_cache_entry_t const *c)
+{
+	rlm_cache_rcu_t				*driver = driver_inst;
+	rlm_cache_rcu_entry_t			*my_c, *old;
+	_Atomic(rlm_cache_rcu_entry_t *)	*bucket;
+
+	if (!request) return CACHE_ERROR;
+
+	memcpy(&my_c, &c, sizeof(my_c));
+	my_c->hash = fr_hash(c->key, c->key_len);
+	bucket = &driver->buckets[my_c->hash & (driver->num_buckets - 1)];
+
+	cache_rcu_writer_lock(driver, handle);
+
+	/*
+	 *	Clear out old entries
+	 */
+	cache_rcu_reap(driver, request->timestamp.tv_sec);
+
+	old = cache_rcu_find_locked(driver, my_c->hash, c->key, c->key_len);
+
+	if (!fr_heap_insert(driver->heap, my_c)) {
+		cache_rcu_writer_unlock(driver, handle);
+		RERROR("Failed adding entry to expiry heap");
+
+		return CACHE_ERROR;
+	}
+
+	atomic_store_explicit(&my_c->next, atomic_load_explicit(bucket, memory_order_relaxed), memory_order_relaxed);
+	atomic_store_explicit(bucket, my_c, memory_order_release);
+	atomic_fetch_add_explicit(&driver->num_entries, 1, memory_order_relaxed);
+
+	/*
+	 *	Allow overwriting
+	 */
+	if (old) cache_rcu_retire(driver, old);
+
+	cache_rcu_reclaim(driver);
+	cache_rcu_writer_unlock(driver, handle);
+
+	return CACHE_OK;
+}
+
+/** Update the TTL of an entry
+ *
+ * rlm_cache updates the expiry time of the entry before calling us, so
+ * writers may briefly see the heap out of order.  Re-inserting the entry
+ * restores the heap property.
+ *
+ * @copydetails cache_entry_set_ttl_t
+ */
+static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, void *driver_inst,
+					  REQUEST *request, void *handle,
+					  rlm_cache_entry_t *c)
+{
+	rlm_cache_rcu_t	*driver = driver_inst;
+
+	cache_rcu_writer_lock(driver, handle);
+
+	/*
+	 *	The entry may have been unlinked by another
+	 *	writer since we found it.
+	 */
+	if (fr_heap_extract(driver->heap, c) != 1) {
+		cache_rcu_writer_unlock(driver, handle);
+		RWDEBUG("Entry was removed before its TTL could be updated");
+		return CACHE_OK;
+	}
+
+	if (!fr_heap_insert(driver->heap, c)) {
+		cache_rcu_retire(driver, (rlm_cache_rcu_entry_t *)c);	/* make sure we don't leak entries... */
+		cache_rcu_writer_unlock(driver, handle);
+		RERROR("Failed updating entry TTL.  Entry was forcefully expired");
+		return CACHE_ERROR;
+	}
+	cache_rcu_writer_unlock(driver, handle);
+
+	return CACHE_OK;
+}
+
+/** Return the number of entries in the cache
+ *
+ * @copydetails cache_entry_count_t
+ */
+static uint32_t cache_entry_count(UNUSED rlm_cache_config_t const *config, void *driver_inst,
+				  UNUSED REQUEST *request, UNUSED void *handle)
+{
+	rlm_cache_rcu_t *driver = driver_inst;
+
+	return atomic_load_explicit(&driver->num_entries, memory_order_relaxed);
+}
+
+/** Enter the current epoch
+ *
+ * Entries found after this point won't be freed until the handle is released.
+ *
+ * @copydetails cache_acquire_t
+ */
+static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, void *driver_inst,
+			 REQUEST *request)
+{
+	rlm_cache_rcu_t		*driver = driver_inst;
+	rlm_cache_rcu_slot_t	*slot;
+
+	slot = cache_rcu_slot(driver);
+	if (!slot) {
+		PTHREAD_MUTEX_LOCK(&driver->mutex);
+		*handle = driver;
+
+		RDEBUG3("No epoch slot available, mutex acquired");
+		return 0;
+	}
+
+	atomic_store_explicit(&slot->epoch, atomic_load(&driver->epoch), memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	*handle = slot;
+
+	return 0;
+}
+
+/** Leave the epoch we entered in #cache_acquire
+ *
+ * @copydetails cache_release_t
+ */
+static void cache_release(UNUSED rlm_cache_config_t const *config, void *driver_inst, REQUEST *request,
+			  rlm_cache_handle_t *handle)
+{
+	rlm_cache_rcu_t		*driver = driver_inst;
+	rlm_cache_rcu_slot_t	*slot = handle;
+
+	if (handle == driver) {
+		PTHREAD_MUTEX_UNLOCK(&driver->mutex);
+
+		RDEBUG3("Mutex released");
+		return;
+	}
+
+	atomic_store_explicit(&slot->epoch, 0, memory_order_release);
+}
+#else
+/** Fail instantiation if the server was built without atomic operations
+ *
+ * @copydetails cache_instantiate_t
+ */
+static int mod_instantiate(CONF_SECTION *conf, UNUSED rlm_cache_config_t const *config, UNUSED void *driver_inst)
+{
+	cf_log_err_cs(conf, "Server was built without support for atomic operations, use rlm_cache_rbtree instead");
+
+	return -1;
+}
+
+static cache_status_t cache_entry_find(UNUSED rlm_cache_entry_t **out, UNUSED rlm_cache_config_t const *config,
+				       UNUSED void *driver_inst, UNUSED REQUEST *request, UNUSED void *handle,
+				       UNUSED uint8_t const *key, UNUSED size_t key_len)
+{
+	return CACHE_ERROR;
+}
+
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, UNUSED void *driver_inst,
+					 UNUSED REQUEST *request, UNUSED void *handle,
+					 UNUSED rlm_cache_entry_t const *c)
+{
+	return CACHE_ERROR;
+}
+
+static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, UNUSED void *driver_inst,
+					 UNUSED REQUEST *request, UNUSED void *handle,
+					 UNUSED uint8_t const *key, UNUSED size_t key_len)
+{
+	return CACHE_ERROR;
+}
+#endif
+
+extern cache_driver_t rlm_cache_rcu;
+cache_driver_t rlm_cache_rcu = {
+	.name		= "rlm_cache_rcu",
+	.instantiate	= mod_instantiate,
+#ifdef WITH_CACHE_RCU
+	.inst_size	= sizeof(rlm_cache_rcu_t),
+	.alloc		= cache_entry_alloc,
+#endif
+
+	.find		= cache_entry_find,
+	.insert		= cache_entry_insert,
+	.expire		= cache_entry_expire,
+#ifdef WITH_CACHE_RCU
+	.set_ttl	= cache_entry_set_ttl,
+	.count		= cache_entry_count,
+
+	.acquire	= cache_acquire,
+	.release	= cache_release,
+#endif
+};
@@ -25,24 +25,65 @@
 #include <freeradius-devel/rad_assert.h>
 
 #include "../../rlm_cache.h"
+#include "../../serialize.h"
 #include "../../../rlm_redis/redis.h"
 #include "../../../rlm_redis/cluster.h"
 
-static CONF_PARSER driver_config[] = {
-	REDIS_COMMON_CONFIG,
-	CONF_PARSER_TERMINATOR
-};
-
 typedef struct rlm_cache_redis {
 	fr_redis_conf_t		conf;		//!< Connection parameters for the Redis server.
 						//!< Must be first field in this struct.
 
+	char const		*invalidate_channel;	//!< Pub/sub channel to publish modified keys to.
+	bool			binary;		//!< Store entries as a single binary blob.
+
 	vp_tmpl_t		created_attr;	//!< LHS of the Cache-Created map.
 	vp_tmpl_t		expires_attr;	//!< LHS of the Cache-Expires map.
 
 	fr_redis_cluster_t	*cluster;
+
+	cache_invalidate_t	invalidate;	//!< Called with keys modified by other servers.
+	void			*uctx;		//!< Passed to invalidate.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_t		subscriber;	//!< Thread receiving invalidations.
+	bool			subscribed;	//!< Whether the subscriber thread was started.
+
+	pthread_mutex_t		mutex;		//!< Protects sub and stop.
+	redisContext		*sub;		//!< Connection the subscriber is reading from.
+	bool			stop;		//!< Tell the subscriber thread to exit.
+#endif
 } rlm_cache_redis_t;
 
+static CONF_PARSER driver_config[] = {
+	REDIS_COMMON_CONFIG,
+	{ FR_CONF_OFFSET("invalidate_channel", PW_TYPE_STRING, rlm_cache_redis_t, invalidate_channel) },
+	{ FR_CONF_OFFSET("binary", PW_TYPE_BOOLEAN, rlm_cache_redis_t, binary), .dflt = "no" },
+	CONF_PARSER_TERMINATOR
+};
+
+#ifdef HAVE_PTHREAD_H
+/** Stop the subscriber thread
+ *
+ */
+static int _mod_detach(rlm_cache_redis_t *driver)
+{
+	if (driver->subscribed) {
+		/*
+		 *	Unblock the subscriber if it's waiting for a message.
+		 */
+		pthread_mutex_lock(&driver->mutex);
+		driver->stop = true;
+		if (driver->sub) shutdown(driver->sub->fd, SHUT_RDWR);
+		pthread_mutex_unlock(&driver->mutex);
+
+		pthread_join(driver->subscriber, NULL);
+	}
+	pthread_mutex_destroy(&driver->mutex);
+
+	return 0;
+}
+#endif
+
 /** Create a new rlm_cache_redis instance
  *
  * @copydetails cache_instantiate_t
@@ -81,6 +122,14 @@ static int mod_instantiate(CONF_SECTION *conf, rlm_cache_config_t const *config,
 		return -1;
 	}
 
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&driver->mutex, NULL) < 0) {
+		ERROR("rlm_cache_redis: Failed initializing mutex: %s", fr_syserror(errno));
+		return -1;
+	}
+	talloc_set_destructor(driver, _mod_detach);
+#endif
+
 	return 0;
 }
 
@@ -89,6 +138,74 @@ static void cache_entry_free(rlm_cache_entry_t *c)
 	talloc_free(c);
 }
 
+/** Locate a cache entry stored in the binary format
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find_binary(rlm_cache_entry_t **out, rlm_cache_redis_t *driver,
+					      REQUEST *request, uint8_t const *key, size_t key_len)
+{
+	fr_redis_cluster_state_t	state;
+	fr_redis_conn_t			*conn;
+	fr_redis_rcode_t		status;
+	redisReply			*reply = NULL;
+	int				s_ret;
+
+	rlm_cache_entry_t		*c;
+
+	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, key, key_len, false);
+	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
+	     s_ret = fr_redis_cluster_state_next(&state, &conn, driver->cluster, request, status, &reply)) {
+		if (RDEBUG_ENABLED3) {
+			char *p;
+
+			p = fr_asprint(NULL, (char const *)key, key_len, '"');
+			RDEBUG3("GET \"%s\"", p);
+			talloc_free(p);
+		}
+		reply = fr_redis_command(conn, "GET %b", key, key_len);
+		status = fr_redis_command_status(conn, reply);
+	}
+	if (s_ret != REDIS_RCODE_SUCCESS) {
+	error:
+		RERROR("Failed retrieving entry");
+		fr_redis_reply_free(reply);
+		return CACHE_ERROR;
+	}
+
+	if (!rad_cond_assert(reply)) goto error;
+
+	switch (reply->type) {
+	case REDIS_REPLY_NIL:
+		fr_redis_reply_free(reply);
+		return CACHE_MISS;
+
+	case REDIS_REPLY_STRING:
+		break;
+
+	default:
+		REDEBUG("Bad result type, expected string, got %s",
+			fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
+		goto error;
+	}
+
+	RDEBUG3("Retrieved %zu bytes", (size_t)reply->len);
+
+	c = talloc_zero(NULL, rlm_cache_entry_t);
+	if (cache_deserialize_binary(c, (uint8_t const *)reply->str, reply->len) < 0) {
+		REDEBUG("%s", fr_strerror());
+		talloc_free(c);
+		goto error;
+	}
+	fr_redis_reply_free(reply);
+
+	c->key = talloc_memdup(c, key, key_len);
+	c->key_len = key_len;
+	*out = c;
+
+	return CACHE_OK;
+}
+
 /** Locate a cache entry in redis
  *
  * @copydetails cache_entry_find_t
@@ -112,6 +229,8 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 #endif
 	rlm_cache_entry_t		*c;
 
+	if (driver->binary) return cache_entry_find_binary(out, driver, request, key, key_len);
+
 	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, key, key_len, false);
 	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
 	     s_ret = fr_redis_cluster_state_next(&state, &conn, driver->cluster, request, status, &reply)) {
@@ -126,7 +245,7 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 			RDEBUG3("LRANGE %s 0 -1", key);
 			talloc_free(p);
 		}
-		reply = redisCommand(conn->handle, "LRANGE %b 0 -1", key, key_len);
+		reply = fr_redis_command(conn, "LRANGE %b 0 -1", key, key_len);
 		status = fr_redis_command_status(conn, reply);
 	}
 	if (s_ret != REDIS_RCODE_SUCCESS) {
@@ -245,13 +364,14 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 	int			s_ret;
 
 	static char const	command[] = "RPUSH";
-	char const		**argv;
-	size_t			*argv_len;
+	char const		**argv = NULL;
+	size_t			*argv_len = NULL;
+	uint8_t			*blob = NULL;
 	char const		**argv_p;
 	size_t			*argv_len_p;
 
 	int			pipelined = 0;	/* How many commands pending in the pipeline */
-	redisReply		*replies[5];	/* Should have the same number of elements as pipelined commands */
+	redisReply		*replies[6];	/* Should have the same number of elements as pipelined commands */
 	size_t			reply_num = 0, i;
 
 	char			*p;
@@ -302,6 +422,19 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 	pool = talloc_pool(request, 1024);
 	if (!pool) return CACHE_ERROR;
 
+	/*
+	 *	Binary entries are written with a single SET,
+	 *	the created and expires dates are in the blob.
+	 */
+	if (driver->binary) {
+		if (cache_serialize_binary(pool, &blob, c) < 0) {
+			REDEBUG("Failed serializing entry: %s", fr_strerror());
+			talloc_free(pool);
+			return CACHE_ERROR;
+		}
+		goto do_insert;
+	}
+
 	argv_p = argv = talloc_array(pool, char const *, (cnt * 3) + 2);	/* pair = 3 + cmd + key */
 	argv_len_p = argv_len = talloc_array(pool, size_t, (cnt * 3) + 2);	/* pair = 3 + cmd + key */
 
@@ -324,6 +457,7 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 		argv_len_p += 3;
 	}
 
+do_insert:
 	RDEBUG3("Pipelining commands");
 	RINDENT();
 
@@ -345,6 +479,19 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 			pipelined++;
 		}
 
+		if (blob) {
+			if (RDEBUG_ENABLED3) {
+				p = fr_asprint(request, (char const *)c->key, c->key_len, '\0');
+				RDEBUG3("SET \"%s\" <%zu bytes>", p, talloc_array_length(blob));
+				talloc_free(p);
+			}
+
+			if (redisAppendCommand(conn->handle, "SET %b %b", c->key, c->key_len,
+					       blob, talloc_array_length(blob)) != REDIS_OK) goto append_error;
+			pipelined++;
+			goto do_expire;
+		}
+
 		if (RDEBUG_ENABLED3) {
 			p = fr_asprint(request, (char const *)c->key, c->key_len, '\0');
 			RDEBUG3("DEL \"%s\"", p);
@@ -368,6 +515,7 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 		redisAppendCommandArgv(conn->handle, talloc_array_length(argv), argv, argv_len);
 		pipelined++;
 
+	do_expire:
 		/*
 		 *	Set the expiry time and close out the transaction.
 		 */
@@ -384,6 +532,16 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 			if (redisAppendCommand(conn->handle, "EXEC") != REDIS_OK) goto append_error;
 			pipelined++;
 		}
+
+		/*
+		 *	Tell other servers to drop their local copies.
+		 */
+		if (driver->invalidate_channel) {
+			RDEBUG3("PUBLISH %s", driver->invalidate_channel);
+			if (redisAppendCommand(conn->handle, "PUBLISH %s %b", driver->invalidate_channel,
+					       c->key, c->key_len) != REDIS_OK) goto append_error;
+			pipelined++;
+		}
 		REXDENT();
 
 		reply_num = fr_redis_pipeline_result(&status, replies, sizeof(replies) / sizeof(*replies),
@@ -422,13 +580,36 @@ static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config
 	redisReply			*reply = NULL;
 	int				s_ret;
 
+	redisReply			*replies[2];
+	size_t				reply_num = 0, i;
+
 	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, key, key_len, false);
 	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
 	     s_ret = fr_redis_cluster_state_next(&state, &conn, driver->cluster, request, status, &reply)) {
-	     	reply = redisCommand(conn->handle, "DEL %b", key, key_len);
-	     	status = fr_redis_command_status(conn, reply);
+		if (!driver->invalidate_channel) {
+			reply = fr_redis_command(conn, "DEL %b", key, key_len);
+			status = fr_redis_command_status(conn, reply);
+			continue;
+		}
+
+		/*
+		 *	Tell other servers to drop their local copies.
+		 */
+		if ((redisAppendCommand(conn->handle, "DEL %b", key, key_len) != REDIS_OK) ||
+		    (redisAppendCommand(conn->handle, "PUBLISH %s %b", driver->invalidate_channel,
+					key, key_len) != REDIS_OK)) {
+			RERROR("Failed appending Redis command to output buffer: %s", conn->handle->errstr);
+			return CACHE_ERROR;
+		}
+		reply_num = fr_redis_pipeline_result(&status, replies, sizeof(replies) / sizeof(*replies), conn, 2);
+		reply = replies[0];
 	}
 
+	/*
+	 *	We only care about the result of the DEL
+	 */
+	for (i = 1; i < reply_num; i++) fr_redis_reply_free(replies[i]);
+
 	if (s_ret != REDIS_RCODE_SUCCESS) {
 		RERROR("Failed expiring entry");
 	error:
@@ -450,6 +631,164 @@ static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config
 	return CACHE_ERROR;
 }
 
+#ifdef HAVE_PTHREAD_H
+/** Check whether the subscriber thread should exit
+ *
+ */
+static bool cache_redis_subscriber_stopped(rlm_cache_redis_t *driver)
+{
+	bool stop;
+
+	pthread_mutex_lock(&driver->mutex);
+	stop = driver->stop;
+	pthread_mutex_unlock(&driver->mutex);
+
+	return stop;
+}
+
+/** Connect to the first configured server and subscribe to the invalidation channel
+ *
+ * PUBLISH messages are broadcast to every node in a Redis cluster, so it
+ * doesn't matter which node we subscribe on.
+ */
+static redisContext *cache_redis_subscriber_connect(rlm_cache_redis_t *driver)
+{
+	fr_ipaddr_t	ipaddr;
+	uint16_t	port = 0;
+	char		buffer[INET6_ADDRSTRLEN];
+	struct timeval	timeout = { 5, 0 };
+	redisContext	*handle;
+	redisReply	*reply = NULL;
+	char const	*server = driver->conf.hostname[0];
+
+	if (fr_inet_pton_port(&ipaddr, &port, server, talloc_array_length(server) - 1, AF_UNSPEC, true, true) < 0) {
+		ERROR("rlm_cache_redis: Failed parsing server \"%s\": %s", server, fr_strerror());
+		return NULL;
+	}
+	if (!port) port = driver->conf.port;
+
+	if (!inet_ntop(ipaddr.af, &ipaddr.ipaddr, buffer, sizeof(buffer))) return NULL;
+
+	handle = redisConnectWithTimeout(buffer, port, timeout);
+	if (!handle) {
+		ERROR("rlm_cache_redis: Subscriber connection to %s:%u failed", buffer, port);
+		return NULL;
+	}
+	if (handle->err) {
+		ERROR("rlm_cache_redis: Subscriber connection to %s:%u failed: %s", buffer, port, handle->errstr);
+	error:
+		if (reply) fr_redis_reply_free(reply);
+		redisFree(handle);
+		return NULL;
+	}
+
+	if (driver->conf.password) {
+		reply = redisCommand(handle, "AUTH %s", driver->conf.password);
+		if (!reply || (reply->type == REDIS_REPLY_ERROR)) {
+			ERROR("rlm_cache_redis: Subscriber failed authenticating: %s",
+			      reply ? reply->str : handle->errstr);
+			goto error;
+		}
+		fr_redis_reply_free(reply);
+	}
+
+	reply = redisCommand(handle, "SUBSCRIBE %s", driver->invalidate_channel);
+	if (!reply || (reply->type != REDIS_REPLY_ARRAY)) {
+		ERROR("rlm_cache_redis: Failed subscribing to \"%s\": %s", driver->invalidate_channel,
+		      (reply && (reply->type == REDIS_REPLY_ERROR)) ? reply->str : handle->errstr);
+		goto error;
+	}
+	fr_redis_reply_free(reply);
+
+	DEBUG2("rlm_cache_redis: Subscribed to \"%s\" on %s:%u", driver->invalidate_channel, buffer, port);
+
+	return handle;
+}
+
+/** Receive the keys of entries modified by other servers
+ *
+ * Reconnects if the connection is lost.  Any invalidations sent whilst we're
+ * disconnected are missed, so copies in the local tier may be stale until
+ * they expire.
+ */
+static void *cache_redis_subscriber(void *arg)
+{
+	rlm_cache_redis_t	*driver = arg;
+	redisContext		*handle;
+	redisReply		*reply;
+
+	while (!cache_redis_subscriber_stopped(driver)) {
+		handle = cache_redis_subscriber_connect(driver);
+		if (!handle) {
+			sleep(1);
+			continue;
+		}
+
+		pthread_mutex_lock(&driver->mutex);
+		if (driver->stop) {
+			pthread_mutex_unlock(&driver->mutex);
+			redisFree(handle);
+			break;
+		}
+		driver->sub = handle;
+		pthread_mutex_unlock(&driver->mutex);
+
+		while (redisGetReply(handle, (void **)&reply) == REDIS_OK) {
+			/*
+			 *	[ "message", <channel>, <key> ]
+			 */
+			if ((reply->type == REDIS_REPLY_ARRAY) && (reply->elements == 3) &&
+			    (reply->element[0]->type == REDIS_REPLY_STRING) &&
+			    (strcmp(reply->element[0]->str, "message") == 0) &&
+			    (reply->element[2]->type == REDIS_REPLY_STRING)) {
+				driver->invalidate(driver->uctx, (uint8_t const *)reply->element[2]->str,
+						   reply->element[2]->len);
+			}
+			fr_redis_reply_free(reply);
+		}
+
+		pthread_mutex_lock(&driver->mutex);
+		driver->sub = NULL;
+		pthread_mutex_unlock(&driver->mutex);
+
+		if (!cache_redis_subscriber_stopped(driver)) {
+			WARN("rlm_cache_redis: Lost subscriber connection: %s", handle->errstr);
+		}
+		redisFree(handle);
+	}
+
+	return NULL;
+}
+#endif
+
+/** Start receiving invalidations for the local tier
+ *
+ * @copydetails cache_subscribe_t
+ */
+static int cache_subscribe(UNUSED rlm_cache_config_t const *config, void *driver_inst,
+			   cache_invalidate_t callback, void *uctx)
+{
+	rlm_cache_redis_t *driver = driver_inst;
+
+	if (!driver->invalidate_channel) return 0;
+
+#ifdef HAVE_PTHREAD_H
+	driver->invalidate = callback;
+	driver->uctx = uctx;
+
+	if (pthread_create(&driver->subscriber, NULL, cache_redis_subscriber, driver) != 0) {
+		ERROR("rlm_cache_redis: Failed creating subscriber thread: %s", fr_syserror(errno));
+		return -1;
+	}
+	driver->subscribed = true;
+
+	return 0;
+#else
+	ERROR("rlm_cache_redis: Server was built without thread support, can't use 'invalidate_channel'");
+	return -1;
+#endif
+}
+
 extern cache_driver_t rlm_cache_redis;
 cache_driver_t rlm_cache_redis = {
 	.name		= "rlm_cache_redis",
@@ -460,4 +799,6 @@ cache_driver_t rlm_cache_redis = {
 	.find		= cache_entry_find,
 	.insert		= cache_entry_insert,
 	.expire		= cache_entry_expire,
+
+	.subscribe	= cache_subscribe,
 };
@@ -0,0 +1,554 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_sharded.c
+ * @brief Sharded, lock striped, in memory cache with LRU eviction.
+ *
+ * Entries are distributed between a fixed number of shards by a hash of
+ * their key.  Each shard has its own hash table, expiry heap, LRU list
+ * and mutex, so requests operating on different keys rarely contend for
+ * the same lock.
+ *
+ * When a shard reaches its share of max_entries the least recently used
+ * entry is evicted to make room for the new one, instead of the insert
+ * failing.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/heap.h>
+#include <freeradius-devel/rad_assert.h>
+#include "../../rlm_cache.h"
+
+#ifdef HAVE_PTHREAD_H
+#  define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#  define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#  define PTHREAD_MUTEX_LOCK(_x)
+#  define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+typedef struct rlm_cache_sharded_entry rlm_cache_sharded_entry_t;
+
+struct rlm_cache_sharded_entry {
+	rlm_cache_entry_t		fields;		//!< Entry data.
+	uint32_t			hash;		//!< Hash of the entry's key.
+	size_t				offset;		//!< Offset used for heap.
+
+	rlm_cache_sharded_entry_t	*lru_prev;	//!< More recently used entry.
+	rlm_cache_sharded_entry_t	*lru_next;	//!< Less recently used entry.
+};
+
+typedef struct rlm_cache_sharded_shard {
+	fr_hash_table_t			*cache;		//!< Table for looking up cache keys.
+	fr_heap_t			*heap;		//!< For managing entry expiry.
+
+	rlm_cache_sharded_entry_t	*lru_head;	//!< Most recently used entry.
+	rlm_cache_sharded_entry_t	*lru_tail;	//!< Least recently used entry.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t			mutex;		//!< Protect the shard from multiple readers/writers.
+#endif
+} rlm_cache_sharded_shard_t;
+
+typedef struct rlm_cache_sharded {
+	uint32_t			num_shards;	//!< How many shards to split the cache into.
+	uint32_t			max_entries;	//!< Maximum entries across all shards.
+	uint32_t			shard_max;	//!< Maximum entries per shard.
+
+	rlm_cache_sharded_shard_t	*shards;	//!< Array of shards.
+} rlm_cache_sharded_t;
+
+/** Tracks which shard a request holds the lock for
+ *
+ */
+typedef struct rlm_cache_sharded_handle {
+	REQUEST				*request;	//!< Request which acquired the handle.
+	rlm_cache_sharded_shard_t	*shard;		//!< Shard currently locked, or NULL.
+} rlm_cache_sharded_handle_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("shards", PW_TYPE_INTEGER, rlm_cache_sharded_t, num_shards), .dflt = "16" },
+	{ FR_CONF_OFFSET("max_entries", PW_TYPE_INTEGER, rlm_cache_sharded_t, max_entries), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
+/** Hash an entry
+ *
+ * The hash is calculated once when the entry is inserted, or when the key is looked up.
+ */
+static uint32_t cache_entry_hash(void const *data)
+{
+	rlm_cache_sharded_entry_t const *c = data;
+
+	return c->hash;
+}
+
+/** Compare two entries by key
+ *
+ * There may only be one entry with the same key.
+ */
+static int cache_entry_cmp(void const *one, void const *two)
+{
+	rlm_cache_entry_t const *a = one;
+	rlm_cache_entry_t const *b = two;
+
+	if (a->key_len < b->key_len) return -1;
+	if (a->key_len > b->key_len) return +1;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+/** Compare two entries by expiry time
+ *
+ * There may be multiple entries with the same expiry time.
+ */
+static int cache_heap_cmp(void const *one, void const *two)
+{
+	rlm_cache_entry_t const *a = one;
+	rlm_cache_entry_t const *b = two;
+
+	if (a->expires < b->expires) return -1;
+	if (a->expires > b->expires) return +1;
+
+	return 0;
+}
+
+/** Map a key hash to a shard
+ *
+ * The hash tables pick buckets using the low bits of the hash, so we rotate
+ * it before taking the modulo, otherwise every entry in a shard would share
+ * the same low bits and collide in a small subset of buckets.
+ */
+static inline rlm_cache_sharded_shard_t *cache_shard(rlm_cache_sharded_t const *driver, uint32_t hash)
+{
+	return &driver->shards[((hash >> 16) | (hash << 16)) % driver->num_shards];
+}
+
+/** Lock the shard responsible for a hash
+ *
+ * The handle remembers which shard is locked, so multiple operations on the
+ * same key only lock the shard once.  rlm_cache only operates on a single key
+ * between acquiring and releasing a handle, but if the shard does change we
+ * release the previous lock first, so we never hold more than one shard lock.
+ */
+static rlm_cache_sharded_shard_t *cache_shard_lock(rlm_cache_sharded_t const *driver,
+						   rlm_cache_sharded_handle_t *handle, uint32_t hash)
+{
+	rlm_cache_sharded_shard_t *shard;
+
+	shard = cache_shard(driver, hash);
+	if (handle->shard == shard) return shard;
+
+	if (handle->shard) PTHREAD_MUTEX_UNLOCK(&handle->shard->mutex);
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	handle->shard = shard;
+
+	return shard;
+}
+
+/** Remove an entry from the LRU list
+ *
+ */
+static inline void cache_lru_unlink(rlm_cache_sharded_shard_t *shard, rlm_cache_sharded_entry_t *c)
+{
+	if (c->lru_prev) {
+		c->lru_prev->lru_next = c->lru_next;
+	} else {
+		shard->lru_head = c->lru_next;
+	}
+
+	if (c->lru_next) {
+		c->lru_next->lru_prev = c->lru_prev;
+	} else {
+		shard->lru_tail = c->lru_prev;
+	}
+
+	c->lru_prev = c->lru_next = NULL;
+}
+
+/** Add an entry to the head of the LRU list
+ *
+ */
+static inline void cache_lru_push(rlm_cache_sharded_shard_t *shard, rlm_cache_sharded_entry_t *c)
+{
+	c->lru_prev = NULL;
+	c->lru_next = shard->lru_head;
+
+	if (shard->lru_head) {
+		shard->lru_head->lru_prev = c;
+	} else {
+		shard->lru_tail = c;
+	}
+	shard->lru_head = c;
+}
+
+/** Remove an entry from all the shard's structures and free it
+ *
+ */
+static void cache_entry_remove(rlm_cache_sharded_shard_t *shard, rlm_cache_sharded_entry_t *c)
+{
+	fr_heap_extract(shard->heap, c);
+	fr_hash_table_yank(shard->cache, c);
+	cache_lru_unlink(shard, c);
+	talloc_free(c);
+}
+
+/** Remove any entries from a shard which have expired
+ *
+ */
+static void cache_shard_reap(rlm_cache_sharded_shard_t *shard, time_t now)
+{
+	rlm_cache_entry_t *c;
+
+	while ((c = fr_heap_peek(shard->heap)) && (c->expires < now)) {
+		cache_entry_remove(shard, (rlm_cache_sharded_entry_t *)c);
+	}
+}
+
+/** Cleanup a cache_sharded instance
+ *
+ */
+static int _mod_detach(rlm_cache_sharded_t *driver)
+{
+	uint32_t i;
+
+	if (!driver->shards) return 0;
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_sharded_shard_t	*shard = &driver->shards[i];
+		rlm_cache_entry_t		*c;
+
+		if (shard->heap) {
+			while ((c = fr_heap_peek(shard->heap))) {
+				fr_heap_extract(shard->heap, c);
+				talloc_free(c);
+			}
+			fr_heap_delete(shard->heap);
+		}
+		if (shard->cache) fr_hash_table_free(shard->cache);
+
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&shard->mutex);
+#endif
+	}
+
+	return 0;
+}
+
+/** Create a new cache_sharded instance
+ *
+ * @copydetails cache_instantiate_t
+ */
+static int mod_instantiate(CONF_SECTION *conf, rlm_cache_config_t const *config, void *driver_inst)
+{
+	rlm_cache_sharded_t	*driver = driver_inst;
+	uint32_t		i;
+
+	if (cf_section_parse(conf, driver, driver_config) < 0) return -1;
+
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, >=, 1);
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, <=, 1024);
+
+	/*
+	 *	Fall back to the module's max_entries.  We don't
+	 *	provide a count callback, so rlm_cache won't refuse
+	 *	inserts when the cache is full, we evict instead.
+	 */
+	if (!driver->max_entries) driver->max_entries = config->max_entries;
+	if (driver->max_entries) {
+		driver->shard_max = (driver->max_entries + driver->num_shards - 1) / driver->num_shards;
+	}
+
+	driver->shards = talloc_zero_array(driver, rlm_cache_sharded_shard_t, driver->num_shards);
+	if (!driver->shards) {
+		ERROR("Failed allocating shards");
+		return -1;
+	}
+
+	talloc_set_destructor(driver, _mod_detach);
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_sharded_shard_t *shard = &driver->shards[i];
+
+		/*
+		 *	The cache.
+		 */
+		shard->cache = fr_hash_table_create(driver->shards, cache_entry_hash, cache_entry_cmp, NULL);
+		if (!shard->cache) {
+			ERROR("Failed to create cache");
+			return -1;
+		}
+
+		/*
+		 *	The heap of entries to expire.
+		 */
+		shard->heap = fr_heap_create(cache_heap_cmp, offsetof(rlm_cache_sharded_entry_t, offset));
+		if (!shard->heap) {
+			ERROR("Failed to create heap for the cache");
+			return -1;
+		}
+
+#ifdef HAVE_PTHREAD_H
+		if (pthread_mutex_init(&shard->mutex, NULL) < 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+			return -1;
+		}
+#endif
+	}
+
+	return 0;
+}
+
+/** Custom allocation function for the driver
+ *
+ * Allows allocation of cache entry structures with additional fields.
+ *
+ * @copydetails cache_entry_alloc_t
+ */
+static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *config, UNUSED void *driver_inst,
+					    REQUEST *request)
+{
+	rlm_cache_sharded_entry_t *c;
+
+	c = talloc_zero(NULL, rlm_cache_sharded_entry_t);
+	if (!c) {
+		RERROR("Failed allocating cache entry");
+		return NULL;
+	}
+
+	return (rlm_cache_entry_t *)c;
+}
+
+/** Locate a cache entry
+ *
+ * Marks the entry as the most recently used entry in its shard.
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       UNUSED rlm_cache_config_t const *config, void *driver_inst,
+				       REQUEST *request, void *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_sharded_t		*driver = driver_inst;
+	rlm_cache_sharded_shard_t	*shard;
+	rlm_cache_sharded_entry_t	*c, my_c;
+
+	rad_assert(((rlm_cache_sharded_handle_t *)handle)->request == request);
+
+	my_c.fields.key = key;
+	my_c.fields.key_len = key_len;
+	my_c.hash = fr_hash(key, key_len);
+
+	shard = cache_shard_lock(driver, handle, my_c.hash);
+
+	/*
+	 *	Clear out old entries
+	 */
+	cache_shard_reap(shard, request->timestamp.tv_sec);
+
+	/*
+	 *	Is there an entry for this key?
+	 */
+	c = fr_hash_table_finddata(shard->cache, &my_c);
+	if (!c) {
+		*out = NULL;
+		return CACHE_MISS;
+	}
+
+	if (shard->lru_head != c) {
+		cache_lru_unlink(shard, c);
+		cache_lru_push(shard, c);
+	}
+	*out = (rlm_cache_entry_t *)c;
+
+	return CACHE_OK;
+}
+
+/** Free an entry and remove it from the data store
+ *
+ * @copydetails cache_entry_expire_t
+ */
+static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *driver_inst,
+					 REQUEST *request, void *handle,
+					 uint8_t const *key, size_t key_len)
+{
+	rlm_cache_sharded_t		*driver = driver_inst;
+	rlm_cache_sharded_shard_t	*shard;
+	rlm_cache_sharded_entry_t	*c, my_c;
+
+	if (!request) return CACHE_ERROR;
+
+	my_c.fields.key = key;
+	my_c.fields.key_len = key_len;
+	my_c.hash = fr_hash(key, key_len);
+
+	shard = cache_shard_lock(driver, handle, my_c.hash);
+
+	c = fr_hash_table_finddata(shard->cache, &my_c);
+	if (!c) return CACHE_MISS;
+
+	cache_entry_remove(shard, c);
+
+	return CACHE_OK;
+}
+
+/** Insert a new entry into the data store
+ *
+ * If the shard is full, expired entries are removed first, then the least
+ * recently used entries, until there's space for the new entry.
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *driver_inst,
+					 REQUEST *request, void *handle,
+					 rlm_cache_entry_t const *c)
+{
+	rlm_cache_sharded_t		*driver = driver_inst;
+	rlm_cache_sharded_shard_t	*shard;
+	rlm_cache_sharded_entry_t	*my_c, *old;
+
+	if (!request) return CACHE_ERROR;
+
+	memcpy(&my_c, &c, sizeof(my_c));
+	my_c->hash = fr_hash(c->key, c->key_len);
+
+	shard = cache_shard_lock(driver, handle, my_c->hash);
+
+	/*
+	 *	Allow overwriting
+	 */
+	old = fr_hash_table_finddata(shard->cache, my_c);
+	if (old) cache_entry_remove(shard, old);
+
+	if (driver->shard_max &&
+	    ((uint32_t)fr_hash_table_num_elements(shard->cache) >= driver->shard_max)) {
+		cache_shard_reap(shard, request->timestamp.tv_sec);
+
+		while (shard->lru_tail &&
+		       ((uint32_t)fr_hash_table_num_elements(shard->cache) >= driver->shard_max)) {
+			RDEBUG3("Shard full, evicting least recently used entry");
+			cache_entry_remove(shard, shard->lru_tail);
+		}
+	}
+
+	if (!fr_hash_table_insert(shard->cache, my_c)) {
+		RERROR("Failed adding entry");
+
+		return CACHE_ERROR;
+	}
+
+	if (!fr_heap_insert(shard->heap, my_c)) {
+		fr_hash_table_yank(shard->cache, my_c);
+		RERROR("Failed adding entry to expiry heap");
+
+		return CACHE_ERROR;
+	}
+	cache_lru_push(shard, my_c);
+
+	return CACHE_OK;
+}
+
+/** Update the TTL of an entry
+ *
+ * @copydetails cache_entry_set_ttl_t
+ */
+static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, void *driver_inst,
+					  REQUEST *request, void *handle,
+					  rlm_cache_entry_t *c)
+{
+	rlm_cache_sharded_t		*driver = driver_inst;
+	rlm_cache_sharded_shard_t	*shard;
+	rlm_cache_sharded_entry_t	*my_c = (rlm_cache_sharded_entry_t *)c;
+	int				ret;
+
+#ifdef NDEBUG
+	if (!request) return CACHE_ERROR;
+#endif
+
+	shard = cache_shard_lock(driver, handle, my_c->hash);
+
+	ret = fr_heap_extract(shard->heap, c);
+	rad_assert(ret == 1);
+	if (ret != 1) {					/* Need this check if we're not building with asserts */
+		RERROR("Entry not in heap");
+		return CACHE_ERROR;
+	}
+
+	if (!fr_heap_insert(shard->heap, c)) {
+		fr_hash_table_yank(shard->cache, c);	/* make sure we don't leak entries... */
+		cache_lru_unlink(shard, my_c);
+		RERROR("Failed updating entry TTL.  Entry was forcefully expired");
+		return CACHE_ERROR;
+	}
+	return CACHE_OK;
+}
+
+/** Allocate a handle to track which shard is locked
+ *
+ * No locks are acquired here, as we don't know the key yet.  The shard
+ * the key maps to is locked by the first operation using the handle.
+ *
+ * @copydetails cache_acquire_t
+ */
+static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, UNUSED void *driver_inst,
+			 REQUEST *request)
+{
+	rlm_cache_sharded_handle_t *h;
+
+	h = talloc_zero(request, rlm_cache_sharded_handle_t);
+	if (!h) return -1;
+	h->request = request;
+
+	*handle = h;
+
+	return 0;
+}
+
+/** Release a handle unlocking the shard it holds
+ *
+ * @copydetails cache_release_t
+ */
+static void cache_release(UNUSED rlm_cache_config_t const *config, UNUSED void *driver_inst, REQUEST *request,
+			  rlm_cache_handle_t *handle)
+{
+	rlm_cache_sharded_handle_t *h = handle;
+
+	if (h->shard) {
+		PTHREAD_MUTEX_UNLOCK(&h->shard->mutex);
+		RDEBUG3("Shard mutex released");
+	}
+
+	talloc_free(h);
+}
+
+extern cache_driver_t rlm_cache_sharded;
+cache_driver_t rlm_cache_sharded = {
+	.name		= "rlm_cache_sharded",
+	.instantiate	= mod_instantiate,
+	.inst_size	= sizeof(rlm_cache_sharded_t),
+	.alloc		= cache_entry_alloc,
+
+	.find		= cache_entry_find,
+	.insert		= cache_entry_insert,
+	.expire		= cache_entry_expire,
+	.set_ttl	= cache_entry_set_ttl,
+
+	.acquire	= cache_acquire,
+	.release	= cache_release,
+};
@@ -30,6 +30,28 @@ RCSID("$Id$")
 #include <freeradius-devel/rad_assert.h>
 
 #include "rlm_cache.h"
+#include "serialize.h"
+
+#ifdef HAVE_PTHREAD_H
+#  define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#  define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#  define PTHREAD_MUTEX_LOCK(_x)
+#  define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+/** A key being populated by a request, which other requests can wait on
+ *
+ */
+typedef struct cache_flight {
+	uint8_t const		*key;			//!< Key being populated.
+	size_t			key_len;		//!< Length of the key.
+	int			refs;			//!< The populating request, and any waiting for it.
+	bool			done;			//!< Whether the populating request has finished.
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_t		cond;			//!< Signalled when done is set.
+#endif
+} cache_flight_t;
 
 /*
  *	A mapping of configuration file names to internal variables.
@@ -40,6 +62,13 @@ RCSID("$Id$")
  *	to the strdup'd string into 'config.string'.  This gets around
  *	buffer over-flows.
  */
+static const CONF_PARSER local_config[] = {
+	{ FR_CONF_OFFSET("driver", PW_TYPE_STRING, rlm_cache_config_t, local_driver_name) },
+	{ FR_CONF_OFFSET("ttl", PW_TYPE_INTEGER, rlm_cache_config_t, local_ttl), .dflt = "5" },
+	{ FR_CONF_OFFSET("max_entries", PW_TYPE_INTEGER, rlm_cache_config_t, local_max_entries), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("driver", PW_TYPE_STRING, rlm_cache_config_t, driver_name), .dflt = "rlm_cache_rbtree" },
 	{ FR_CONF_OFFSET("key", PW_TYPE_TMPL | PW_TYPE_REQUIRED, rlm_cache_config_t, key) },
@@ -49,6 +78,12 @@ static const CONF_PARSER module_config[] = {
 	/* Should be a type which matches time_t, @fixme before 2038 */
 	{ FR_CONF_OFFSET("epoch", PW_TYPE_SIGNED, rlm_cache_config_t, epoch), .dflt = "0" },
 	{ FR_CONF_OFFSET("add_stats", PW_TYPE_BOOLEAN, rlm_cache_config_t, stats), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("coalesce", PW_TYPE_BOOLEAN, rlm_cache_config_t, coalesce), .dflt = "no" },
+	{ FR_CONF_OFFSET("coalesce_timeout", PW_TYPE_TIMEVAL, rlm_cache_config_t, coalesce_timeout), .dflt = "1.0" },
+	{ FR_CONF_OFFSET("stale_ttl", PW_TYPE_INTEGER, rlm_cache_config_t, stale_ttl), .dflt = "0" },
+
+	{ FR_CONF_POINTER("local", PW_TYPE_SUBSECTION, NULL), .dflt = (void const *) local_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -121,6 +156,298 @@ static void cache_free(rlm_cache_t const *inst, rlm_cache_entry_t **c)
 	*c = NULL;
 }
 
+/** Whether an entry should be refreshed
+ *
+ * Entries are stored with stale_ttl added to their expiry time, so they
+ * can still be served while another request refreshes them.
+ */
+static inline bool cache_entry_stale(rlm_cache_t const *inst, REQUEST *request, rlm_cache_entry_t const *c)
+{
+	return (c->expires - (time_t)inst->config.stale_ttl) < request->timestamp.tv_sec;
+}
+
+static uint32_t cache_flight_hash(void const *data)
+{
+	cache_flight_t const *flight = data;
+
+	return fr_hash(flight->key, flight->key_len);
+}
+
+static int cache_flight_cmp(void const *one, void const *two)
+{
+	cache_flight_t const *a = one, *b = two;
+
+	if (a->key_len != b->key_len) return (a->key_len < b->key_len) ? -1 : +1;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+static int _cache_flight_free(UNUSED cache_flight_t *flight)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_destroy(&flight->cond);
+#endif
+	return 0;
+}
+
+/** Join the flight for a key, creating it if no other request is populating the key
+ *
+ * @param[in] inst of rlm_cache.
+ * @param[out] leader Set to true if we created the flight, and must populate the entry.
+ * @param[in] key being populated.
+ * @param[in] key_len Length of key.
+ * @return
+ *	- The flight.  Must be passed to #cache_flight_leave.
+ *	- NULL on error.
+ */
+static cache_flight_t *cache_flight_join(rlm_cache_t *inst, bool *leader, uint8_t const *key, size_t key_len)
+{
+	cache_flight_t	find, *flight;
+
+	find.key = key;
+	find.key_len = key_len;
+
+	PTHREAD_MUTEX_LOCK(&inst->flights_mutex);
+	flight = fr_hash_table_finddata(inst->flights, &find);
+	if (flight) {
+		flight->refs++;
+		PTHREAD_MUTEX_UNLOCK(&inst->flights_mutex);
+		*leader = false;
+		return flight;
+	}
+
+	flight = talloc_zero(NULL, cache_flight_t);
+	if (!flight) {
+	error:
+		PTHREAD_MUTEX_UNLOCK(&inst->flights_mutex);
+		return NULL;
+	}
+	flight->key = talloc_memdup(flight, key, key_len);
+	flight->key_len = key_len;
+	flight->refs = 1;
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_init(&flight->cond, NULL);
+#endif
+	talloc_set_destructor(flight, _cache_flight_free);
+
+	if (!fr_hash_table_insert(inst->flights, flight)) {
+		talloc_free(flight);
+		goto error;
+	}
+	PTHREAD_MUTEX_UNLOCK(&inst->flights_mutex);
+	*leader = true;
+
+	return flight;
+}
+
+/** Leave a flight, waking any waiting requests if we were populating the entry
+ *
+ */
+static void cache_flight_leave(rlm_cache_t *inst, cache_flight_t *flight, bool leader)
+{
+	PTHREAD_MUTEX_LOCK(&inst->flights_mutex);
+	if (leader) {
+		fr_hash_table_delete(inst->flights, flight);
+		flight->done = true;
+#ifdef HAVE_PTHREAD_H
+		pthread_cond_broadcast(&flight->cond);
+#endif
+	}
+	if (--flight->refs == 0) talloc_free(flight);
+	PTHREAD_MUTEX_UNLOCK(&inst->flights_mutex);
+}
+
+/** Wait for the request populating an entry to finish
+ *
+ * @return
+ *	- true if the request finished.
+ *	- false if we timed out.
+ */
+static bool cache_flight_wait(rlm_cache_t *inst, REQUEST *request, cache_flight_t *flight)
+{
+	bool		done;
+#ifdef HAVE_PTHREAD_H
+	struct timeval	now;
+	struct timespec	when;
+
+	gettimeofday(&now, NULL);
+	when.tv_sec = now.tv_sec + inst->config.coalesce_timeout.tv_sec;
+	when.tv_nsec = (now.tv_usec + inst->config.coalesce_timeout.tv_usec) * 1000;
+	if (when.tv_nsec >= 1000000000) {
+		when.tv_sec++;
+		when.tv_nsec -= 1000000000;
+	}
+#endif
+
+	RDEBUG2("Waiting for another request to populate the entry");
+
+	PTHREAD_MUTEX_LOCK(&inst->flights_mutex);
+#ifdef HAVE_PTHREAD_H
+	while (!flight->done) {
+		if (pthread_cond_timedwait(&flight->cond, &inst->flights_mutex, &when) == ETIMEDOUT) break;
+	}
+#endif
+	done = flight->done;
+	PTHREAD_MUTEX_UNLOCK(&inst->flights_mutex);
+
+	if (!done) RWDEBUG("Timed out waiting for another request to populate the entry");
+
+	return done;
+}
+
+/** Get use of a handle to access the local tier
+ *
+ * @return
+ *	- true if the local tier can be used.
+ *	- false if there's no local tier, or we failed acquiring a handle for it.
+ */
+static bool cache_local_acquire(rlm_cache_handle_t **out, rlm_cache_t const *inst, REQUEST *request)
+{
+	rlm_cache_local_t const *local = inst->local;
+
+	if (!local) return false;
+	if (!local->driver->acquire) return true;
+
+	if (local->driver->acquire(out, &local->config, local->driver_inst, request) < 0) {
+		RWDEBUG("Failed acquiring handle for local tier, bypassing it");
+		return false;
+	}
+
+	return true;
+}
+
+/** Release a handle we previously acquired for the local tier
+ *
+ */
+static void cache_local_release(rlm_cache_t const *inst, REQUEST *request, rlm_cache_handle_t **handle)
+{
+	rlm_cache_local_t const *local = inst->local;
+
+	if (local->driver->release && *handle) local->driver->release(&local->config, local->driver_inst,
+								      request, *handle);
+	*handle = NULL;
+}
+
+/** Find an entry in the local tier
+ *
+ * Local drivers keep ownership of their entries, so the entry returned
+ * must not be freed, and is only valid until the handle is released.
+ *
+ * @return
+ *	- The entry if one was found, and hasn't expired.
+ *	- NULL if no valid entry was found.
+ */
+static rlm_cache_entry_t *cache_local_find(rlm_cache_t const *inst, REQUEST *request, rlm_cache_handle_t *handle,
+					   uint8_t const *key, size_t key_len)
+{
+	rlm_cache_local_t const	*local = inst->local;
+	rlm_cache_entry_t	*c;
+
+	if (local->driver->find(&c, &local->config, local->driver_inst, request, handle,
+				key, key_len) != CACHE_OK) return NULL;
+
+	if (cache_entry_stale(inst, request, c) || (c->created < inst->config.epoch)) {
+		local->driver->expire(&local->config, local->driver_inst, request, handle, key, key_len);
+		return NULL;
+	}
+
+	RDEBUG2("Found entry in local tier");
+	c->hits++;
+
+	return c;
+}
+
+/** Copy an entry retrieved from the main driver into the local tier
+ *
+ * The copy expires after local_ttl seconds, or when the original does,
+ * whichever is sooner.  Failures are not fatal, we just don't get the
+ * benefit of the local tier next time.
+ */
+static void cache_local_store(rlm_cache_t const *inst, REQUEST *request, rlm_cache_handle_t *handle,
+			      rlm_cache_entry_t const *c)
+{
+	rlm_cache_local_t const	*local = inst->local;
+	rlm_cache_entry_t	*local_c;
+	char			*serialized;
+	time_t			expires;
+	int			ret;
+
+	if (cache_serialize(request, &serialized, c) < 0) {
+		RWDEBUG("Failed copying entry to local tier: %s", fr_strerror());
+		return;
+	}
+
+	if (local->driver->alloc) {
+		local_c = local->driver->alloc(&local->config, local->driver_inst, request);
+	} else {
+		local_c = talloc_zero(NULL, rlm_cache_entry_t);
+	}
+	if (!local_c) {
+		talloc_free(serialized);
+		return;
+	}
+
+	ret = cache_deserialize(local_c, serialized, talloc_array_length(serialized) - 1);
+	talloc_free(serialized);
+	if (ret < 0) {
+		RWDEBUG("Failed copying entry to local tier: %s", fr_strerror());
+	error:
+		talloc_free(local_c);
+		return;
+	}
+
+	local_c->key = talloc_memdup(local_c, c->key, c->key_len);
+	local_c->key_len = c->key_len;
+
+	expires = request->timestamp.tv_sec + inst->config.local_ttl + inst->config.stale_ttl;
+	if (local_c->expires > expires) local_c->expires = expires;
+
+	if ((local->config.max_entries > 0) && local->driver->count &&
+	    (local->driver->count(&local->config, local->driver_inst, request, handle) > local->config.max_entries)) {
+		RDEBUG2("Local tier is full: %d entries", local->config.max_entries);
+		goto error;
+	}
+
+	if (local->driver->insert(&local->config, local->driver_inst, request, handle, local_c) != CACHE_OK) {
+		RWDEBUG("Failed inserting entry into local tier");
+		goto error;
+	}
+}
+
+/** Remove an entry from the local tier
+ *
+ */
+static void cache_local_expire(rlm_cache_t const *inst, REQUEST *request, rlm_cache_handle_t *handle,
+			       uint8_t const *key, size_t key_len)
+{
+	rlm_cache_local_t const *local = inst->local;
+
+	local->driver->expire(&local->config, local->driver_inst, request, handle, key, key_len);
+}
+
+/** Remove an entry from the local tier, because another server modified it
+ *
+ * Called by the main driver, potentially from a thread it created.
+ */
+static void _cache_local_invalidate(void *uctx, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_t		*inst = uctx;
+	rlm_cache_handle_t	*handle;
+	REQUEST			*request;
+
+	request = request_alloc(NULL);
+	if (!request) return;
+	request->module = inst->config.name;
+
+	if (cache_local_acquire(&handle, inst, request)) {
+		RDEBUG3("Invalidating entry in local tier");
+		cache_local_expire(inst, request, handle, key, key_len);
+		cache_local_release(inst, request, &handle);
+	}
+
+	talloc_free(request);
+}
+
 /** Merge a cached entry into a #REQUEST
  *
  * @return
@@ -232,7 +559,7 @@ static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst,
 			talloc_free(p);
 		}
 
-		inst->driver->expire(&inst->config, inst->driver_inst, request, handle, c->key, c->key_len);
+		inst->driver->expire(&inst->config, inst->driver_inst, request, *handle, c->key, c->key_len);
 		cache_free(inst, &c);
 		return RLM_MODULE_NOTFOUND;	/* Couldn't find a non-expired entry */
 	}
@@ -300,7 +627,7 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 	TALLOC_CTX		*pool;
 
 	if ((inst->config.max_entries > 0) && inst->driver->count &&
-	    (inst->driver->count(&inst->config, inst->driver_inst, request, handle) > inst->config.max_entries)) {
+	    (inst->driver->count(&inst->config, inst->driver_inst, request, *handle) > inst->config.max_entries)) {
 		RWDEBUG("Cache is full: %d entries", inst->config.max_entries);
 		return RLM_MODULE_FAIL;
 	}
@@ -311,7 +638,7 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 	c->key = talloc_memdup(c, key, key_len);
 	c->key_len = key_len;
 	c->created = c->expires = request->timestamp.tv_sec;
-	c->expires += ttl;
+	c->expires += ttl + inst->config.stale_ttl;
 
 	last = &c->maps;
 
@@ -532,6 +859,60 @@ static int cache_verify(vp_map_t *map, void *ctx)
 	return 0;
 }
 
+/** Wait for another request to populate an entry, or become responsible for populating it
+ *
+ * Handles are released whilst we wait, as the request populating the entry
+ * will need them.
+ *
+ * @param[out] out Where to write the entry populated by another request.
+ * @param[out] flight Where to write the flight we're leading, if we need to
+ *	populate the entry.  Must be passed to #cache_flight_leave.
+ * @param[in] inst of rlm_cache.
+ * @param[in] request The current request.
+ * @param[in,out] handle for the main driver.
+ * @param[in,out] local_handle for the local tier.
+ * @param[in,out] local Whether the local tier can be used.
+ * @param[in] key to populate.
+ * @param[in] key_len Length of key.
+ * @return
+ *	- #RLM_MODULE_OK if another request populated the entry.
+ *	- #RLM_MODULE_NOTFOUND if we need to populate the entry.
+ *	- #RLM_MODULE_FAIL on failure.
+ */
+static rlm_rcode_t cache_coalesce(rlm_cache_entry_t **out, cache_flight_t **flight,
+				  rlm_cache_t *inst, REQUEST *request,
+				  rlm_cache_handle_t **handle, rlm_cache_handle_t **local_handle, bool *local,
+				  uint8_t const *key, size_t key_len)
+{
+	cache_flight_t	*our_flight;
+	bool		leader;
+
+	*out = NULL;
+
+	our_flight = cache_flight_join(inst, &leader, key, key_len);
+	if (!our_flight) return RLM_MODULE_NOTFOUND;	/* Populate it without coalescing */
+
+	if (leader) {
+		*flight = our_flight;
+		return RLM_MODULE_NOTFOUND;
+	}
+
+	if (*local) cache_local_release(inst, request, local_handle);
+	cache_release(inst, request, handle);
+
+	cache_flight_wait(inst, request, our_flight);
+	cache_flight_leave(inst, our_flight, false);
+
+	if (cache_acquire(handle, inst, request) < 0) return RLM_MODULE_FAIL;
+	*local = cache_local_acquire(local_handle, inst, request);
+
+	/*
+	 *	If we timed out, or the other request failed, this
+	 *	will be a miss, and we populate the entry ourselves.
+	 */
+	return cache_find(out, inst, request, handle, key, key_len);
+}
+
 /** Do caching checks
  *
  * Since we can update ANY VP list, we do exactly the same thing for all sections
@@ -548,6 +929,13 @@ static rlm_rcode_t mod_cache_it(void *instance, REQUEST *request)
 
 	rlm_cache_handle_t	*handle;
 
+	cache_flight_t		*flight = NULL;
+	bool			leader;
+
+	rlm_cache_entry_t	*local_c = NULL;
+	rlm_cache_handle_t	*local_handle = NULL;
+	bool			local = false;
+
 	vp_cursor_t		cursor;
 	VALUE_PAIR		*vp;
 
@@ -577,6 +965,12 @@ static rlm_rcode_t mod_cache_it(void *instance, REQUEST *request)
 	vp = fr_pair_find_by_num(request->config, 0, PW_CACHE_STATUS_ONLY, TAG_ANY);
 	if (vp && vp->vp_integer) {
 		if (cache_acquire(&handle, inst, request) < 0) return RLM_MODULE_FAIL;
+		local = cache_local_acquire(&local_handle, inst, request);
+
+		if (local && cache_local_find(inst, request, local_handle, key, key_len)) {
+			rcode = RLM_MODULE_OK;
+			goto finish;
+		}
 
 		rcode = cache_find(&c, inst, request, &handle, key, key_len);
 		if (rcode == RLM_MODULE_FAIL) goto finish;
@@ -611,19 +1005,56 @@ static rlm_rcode_t mod_cache_it(void *instance, REQUEST *request)
 	}
 
 	if (cache_acquire(&handle, inst, request) < 0) return RLM_MODULE_FAIL;
+	local = cache_local_acquire(&local_handle, inst, request);
 
 	/*
 	 *	Retrieve the cache entry and merge it with the current request
 	 *	recording whether the entry existed.
+	 *
+	 *	The local tier is only consulted if we're not modifying the
+	 *	entry, as modifications must be applied to the main driver.
 	 */
 	if (merge) {
-		rcode = cache_find(&c, inst, request, &handle, key, key_len);
+		if (local && !expire && !set_ttl) local_c = cache_local_find(inst, request, local_handle, key, key_len);
+
+		rcode = local_c ? RLM_MODULE_OK : cache_find(&c, inst, request, &handle, key, key_len);
+
+		/*
+		 *	Stale entries are served, unless no other request
+		 *	is refreshing the entry, in which case we do.
+		 */
+		if ((rcode == RLM_MODULE_OK) && c && cache_entry_stale(inst, request, c) &&
+		    insert && !expire && !set_ttl) {
+			flight = cache_flight_join(inst, &leader, key, key_len);
+			if (flight && leader) {
+				RDEBUG2("Entry is stale, refreshing it");
+				cache_free(inst, &c);
+				rcode = RLM_MODULE_NOTFOUND;
+			} else {
+				RDEBUG2("Entry is stale, serving it whilst another request refreshes it");
+				if (flight) cache_flight_leave(inst, flight, false);
+				flight = NULL;
+			}
+
+		/*
+		 *	Don't have every request which misses populate
+		 *	the entry.  Wait for the first one to do it.
+		 */
+		} else if ((rcode == RLM_MODULE_NOTFOUND) && inst->config.coalesce &&
+			   insert && !expire && !set_ttl) {
+			rcode = cache_coalesce(&c, &flight, inst, request, &handle, &local_handle, &local,
+					       key, key_len);
+		}
+
 		switch (rcode) {
 		case RLM_MODULE_FAIL:
 			goto finish;
 
 		case RLM_MODULE_OK:
-			rcode = cache_merge(inst, request, c);
+			if (local && !local_c && !cache_entry_stale(inst, request, c)) {
+				cache_local_store(inst, request, local_handle, c);
+			}
+			rcode = cache_merge(inst, request, local_c ? local_c : c);
 			exists = 1;
 			break;
 
@@ -646,6 +1077,8 @@ static rlm_rcode_t mod_cache_it(void *instance, REQUEST *request)
 	 *	should perform upserts.
 	 */
 	if (expire && ((exists == -1) || (exists == 1))) {
+		if (local) cache_local_expire(inst, request, local_handle, key, key_len);
+
 		if (!insert) {
 			rad_assert(!set_ttl);
 			switch (cache_expire(inst, request, &handle, key, key_len)) {
@@ -683,6 +1116,13 @@ static rlm_rcode_t mod_cache_it(void *instance, REQUEST *request)
 			goto finish;
 
 		case RLM_MODULE_OK:
+			/*
+			 *	Inserting refreshes stale entries.
+			 */
+			if (insert && !set_ttl && cache_entry_stale(inst, request, c)) {
+				exists = 0;
+				break;
+			}
 			exists = 1;
 			if (rcode != RLM_MODULE_UPDATED) rcode = RLM_MODULE_OK;
 			break;
@@ -703,7 +1143,9 @@ static rlm_rcode_t mod_cache_it(void *instance, REQUEST *request)
 	if (set_ttl && (exists == 1)) {
 		rad_assert(c);
 
-		c->expires = request->timestamp.tv_sec + ttl;
+		c->expires = request->timestamp.tv_sec + ttl + inst->config.stale_ttl;
+
+		if (local) cache_local_expire(inst, request, local_handle, key, key_len);
 
 		switch (cache_set_ttl(inst, request, &handle, c)) {
 		case RLM_MODULE_FAIL:
@@ -727,6 +1169,8 @@ static rlm_rcode_t mod_cache_it(void *instance, REQUEST *request)
 	 *	insert.
 	 */
 	if (insert && (exists == 0)) {
+		if (local) cache_local_expire(inst, request, local_handle, key, key_len);
+
 		switch (cache_insert(inst, request, &handle, key, key_len, ttl)) {
 		case RLM_MODULE_FAIL:
 			rcode = RLM_MODULE_FAIL;
@@ -750,8 +1194,14 @@ static rlm_rcode_t mod_cache_it(void *instance, REQUEST *request)
 
 finish:
 	cache_free(inst, &c);
+	if (local) cache_local_release(inst, request, &local_handle);
 	cache_release(inst, request, &handle);
 
+	/*
+	 *	Wake any requests waiting for us to populate the entry.
+	 */
+	if (flight) cache_flight_leave(inst, flight, true);
+
 	/*
 	 *	Clear control attributes
 	 */
@@ -786,7 +1236,11 @@ static ssize_t cache_xlat(char **out, UNUSED size_t freespace,
 {
 	rlm_cache_entry_t 	*c = NULL;
 	rlm_cache_t const	*inst = mod_inst;
-	rlm_cache_handle_t	*handle = NULL;
+	rlm_cache_handle_t	*handle;
+
+	rlm_cache_entry_t	*local_c = NULL;
+	rlm_cache_handle_t	*local_handle = NULL;
+	bool			local;
 
 	ssize_t			slen;
 	ssize_t			ret = 0;
@@ -809,19 +1263,23 @@ static ssize_t cache_xlat(char **out, UNUSED size_t freespace,
 	}
 
 	if (cache_acquire(&handle, mod_inst, request) < 0) return -1;
+	local = cache_local_acquire(&local_handle, inst, request);
 
-	switch (cache_find(&c, mod_inst, request, handle, key, key_len)) {
+	if (local) local_c = cache_local_find(inst, request, local_handle, key, key_len);
+	if (!local_c) switch (cache_find(&c, mod_inst, request, &handle, key, key_len)) {
 	case RLM_MODULE_OK:		/* found */
+		if (local) cache_local_store(inst, request, local_handle, c);
 		break;
 
 	case RLM_MODULE_NOTFOUND:	/* not found */
-		return 0;
+		goto finish;
 
 	default:
-		return -1;
+		ret = -1;
+		goto finish;
 	}
 
-	for (map = c->maps; map; map = map->next) {
+	for (map = local_c ? local_c->maps : c->maps; map; map = map->next) {
 		if ((map->lhs->tmpl_da != target.tmpl_da) ||
 		    (map->lhs->tmpl_tag != target.tmpl_tag) ||
 		    (map->lhs->tmpl_list != target.tmpl_list)) continue;
@@ -832,12 +1290,9 @@ static ssize_t cache_xlat(char **out, UNUSED size_t freespace,
 		break;
 	}
 
-	/*
-	 *	Check if we found a matching map
-	 */
-	if (!map) return 0;
-
+finish:
 	cache_free(mod_inst, &c);
+	if (local) cache_local_release(inst, request, &local_handle);
 	cache_release(mod_inst, request, &handle);
 
 	return ret;
@@ -848,10 +1303,24 @@ static ssize_t cache_xlat(char **out, UNUSED size_t freespace,
  */
 static int mod_detach(void *instance)
 {
-	rlm_cache_t *inst = instance;
+	rlm_cache_t	*inst = instance;
+	void		*local_handle = inst->local ? inst->local->handle : NULL;
 
 	talloc_free(inst->maps);
 
+	if (inst->flights) {
+		fr_hash_table_free(inst->flights);
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&inst->flights_mutex);
+#endif
+	}
+
+	/*
+	 *  The main driver may call into the local tier from its own
+	 *  threads, so it must be stopped before the local tier is freed.
+	 */
+	TALLOC_FREE(inst->driver_inst);
+
 	/*
 	 *  We need to explicitly free all children, so if the driver
 	 *  parented any memory off the instance, their destructors
@@ -867,6 +1336,7 @@ static int mod_detach(void *instance)
 	 *  until all instances of rlm_cache that use it have been destroyed.
 	 */
 	if (inst->handle) dlclose(inst->handle);
+	if (local_handle) dlclose(local_handle);
 
 	return 0;
 }
@@ -891,60 +1361,58 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 	return 0;
 }
 
-/** Create a new rlm_cache_instance
+/** Load and instantiate a driver
  *
+ * Driver specific configuration is read from a subsection of conf named
+ * after the driver, i.e. "rbtree" for "rlm_cache_rbtree".
  */
-static int mod_instantiate(CONF_SECTION *conf, void *instance)
+static int cache_driver_load(rlm_cache_t *inst, CONF_SECTION *conf, rlm_cache_config_t const *config,
+			     void **dl_handle, cache_driver_t **driver, void **driver_inst)
 {
-	rlm_cache_t	*inst = instance;
-	CONF_SECTION	*update;
-
-	inst->cs = conf;
-
-	rad_assert(inst->config.key);
+	cache_driver_t *drv;
 
 	/*
 	 *	Sanity check for crazy people.
 	 */
-	if (strncmp(inst->config.driver_name, "rlm_cache_", 8) != 0) {
-		cf_log_err_cs(conf, "\"%s\" is NOT an Cache driver!", inst->config.driver_name);
+	if (strncmp(config->driver_name, "rlm_cache_", 8) != 0) {
+		cf_log_err_cs(conf, "\"%s\" is NOT an Cache driver!", config->driver_name);
 		return -1;
 	}
 
 	/*
 	 *	Load the appropriate driver for our database
 	 */
-	inst->handle = lt_dlopenext(inst->config.driver_name);
-	if (!inst->handle) {
-		cf_log_err_cs(conf, "Could not link driver %s: %s", inst->config.driver_name, fr_strerror());
+	*dl_handle = lt_dlopenext(config->driver_name);
+	if (!*dl_handle) {
+		cf_log_err_cs(conf, "Could not link driver %s: %s", config->driver_name, fr_strerror());
 		cf_log_err_cs(conf, "Make sure it (and all its dependent libraries!) are in the search path"
 			      " of your system's ld");
 		return -1;
 	}
 
-	inst->driver = (cache_driver_t *) dlsym(inst->handle, inst->config.driver_name);
-	if (!inst->driver) {
-		cf_log_err_cs(conf, "Could not link symbol %s: %s", inst->config.driver_name, dlerror());
+	*driver = drv = (cache_driver_t *) dlsym(*dl_handle, config->driver_name);
+	if (!drv) {
+		cf_log_err_cs(conf, "Could not link symbol %s: %s", config->driver_name, dlerror());
 		return -1;
 	}
 
-	DEBUG("      %s: Driver %s loaded and linked", inst->config.name, inst->driver->name);
+	DEBUG("      %s: Driver %s loaded and linked", config->name, drv->name);
 
 	/*
 	 *	Non optional fields and callbacks
 	 */
-	rad_assert(inst->driver->name);
-	rad_assert(inst->driver->find);
-	rad_assert(inst->driver->insert);
-	rad_assert(inst->driver->expire);
+	rad_assert(drv->name);
+	rad_assert(drv->find);
+	rad_assert(drv->insert);
+	rad_assert(drv->expire);
 
-	if (inst->driver->instantiate) {
+	if (drv->instantiate) {
 		CONF_SECTION *cs;
 		char const *name;
 
-		name = strrchr(inst->config.driver_name, '_');
+		name = strrchr(config->driver_name, '_');
 		if (!name) {
-			name = inst->config.driver_name;
+			name = config->driver_name;
 		} else {
 			name++;
 		}
@@ -958,12 +1426,30 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		/*
 		 *	It's up to the driver to register a destructor (using talloc)
 		 *
-		 *	Should write its instance data in inst->driver,
+		 *	Should write its instance data in driver_inst,
 		 *	and parent it off of inst.
 		 */
-		if (inst->driver->inst_size) MEM(inst->driver_inst = talloc_zero_array(inst, uint8_t,
-										       inst->driver->inst_size));
-		if (inst->driver->instantiate(cs, &inst->config, inst->driver_inst) < 0) return -1;
+		if (drv->inst_size) MEM(*driver_inst = talloc_zero_array(inst, uint8_t, drv->inst_size));
+		if (drv->instantiate(cs, config, *driver_inst) < 0) return -1;
+	}
+
+	return 0;
+}
+
+/** Create a new rlm_cache_instance
+ *
+ */
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_cache_t	*inst = instance;
+	CONF_SECTION	*update;
+
+	inst->cs = conf;
+
+	rad_assert(inst->config.key);
+
+	if (cache_driver_load(inst, conf, &inst->config, &inst->handle, &inst->driver, &inst->driver_inst) < 0) {
+		return -1;
 	}
 
 	if (inst->config.ttl == 0) {
@@ -976,6 +1462,24 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	FR_TIMEVAL_BOUND_CHECK("coalesce_timeout", &inst->config.coalesce_timeout, >=, 0, 1000);
+	FR_TIMEVAL_BOUND_CHECK("coalesce_timeout", &inst->config.coalesce_timeout, <=, 30, 0);
+
+	/*
+	 *	Track which keys are being populated, so other
+	 *	requests can wait for them, or serve stale entries.
+	 */
+	if (inst->config.coalesce || (inst->config.stale_ttl > 0)) {
+		inst->flights = fr_hash_table_create(inst, cache_flight_hash, cache_flight_cmp, NULL);
+		if (!inst->flights) {
+			cf_log_err_cs(conf, "Failed creating in flight table");
+			return -1;
+		}
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_init(&inst->flights_mutex, NULL);
+#endif
+	}
+
 	update = cf_section_sub_find(inst->cs, "update");
 	if (!update) {
 		cf_log_err_cs(conf, "Must have an 'update' section in order to cache anything.");
@@ -996,6 +1500,48 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 
 		return -1;
 	}
+
+	/*
+	 *	Setup the local tier
+	 */
+	if (inst->config.local_driver_name) {
+		CONF_SECTION		*local_cs;
+		rlm_cache_local_t	*local;
+
+		local_cs = cf_section_sub_find(conf, "local");
+		rad_assert(local_cs);
+
+		if (inst->config.local_ttl == 0) {
+			cf_log_err_cs(local_cs, "Must set 'ttl' to non-zero");
+			return -1;
+		}
+
+		MEM(local = inst->local = talloc_zero(inst, rlm_cache_local_t));
+		local->config = inst->config;
+		local->config.driver_name = inst->config.local_driver_name;
+		local->config.ttl = inst->config.local_ttl;
+		local->config.max_entries = inst->config.local_max_entries;
+
+		if (cache_driver_load(inst, local_cs, &local->config,
+				      &local->handle, &local->driver, &local->driver_inst) < 0) return -1;
+
+		/*
+		 *	We rely on the local driver keeping the entries
+		 *	it returns from find, so we don't need to free them.
+		 */
+		if (local->driver->free) {
+			cf_log_err_cs(local_cs, "Driver %s can't be used as a local tier, it does not "
+				      "store entries in memory", local->driver->name);
+			return -1;
+		}
+
+		if (inst->driver->subscribe &&
+		    (inst->driver->subscribe(&inst->config, inst->driver_inst, _cache_local_invalidate, inst) < 0)) {
+			cf_log_err_cs(conf, "Failed subscribing to invalidations for local tier");
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -52,8 +52,33 @@ typedef struct rlm_cache_config_t {
 	uint32_t		max_entries;		//!< Maximum entries allowed.
 	int32_t			epoch;			//!< Time after which entries are considered valid.
 	bool			stats;			//!< Generate statistics.
+
+	char const		*local_driver_name;	//!< Driver for the local tier.
+	uint32_t		local_ttl;		//!< Maximum time entries are held in the local tier.
+	uint32_t		local_max_entries;	//!< Maximum entries in the local tier.
+
+	bool			coalesce;		//!< Have concurrent misses for the same key wait
+							//!< for a single request to populate the entry.
+	struct timeval		coalesce_timeout;	//!< How long to wait for another request to
+							//!< populate the entry.
+	uint32_t		stale_ttl;		//!< How long after an entry expires it may be
+							//!< served, while another request refreshes it.
 } rlm_cache_config_t;
 
+/** A local, in process, cache fronting the main driver
+ *
+ * Entries retrieved from the main driver are copied into the local tier
+ * with a short TTL, so hot keys don't require a round trip to a remote
+ * data store.
+ */
+typedef struct rlm_cache_local_t {
+	rlm_cache_config_t	config;			//!< Config passed to the local driver.
+
+	void			*handle;		//!< Local driver library handle.
+	cache_driver_t		*driver;		//!< Local driver.
+	void			*driver_inst;		//!< Local driver instance data.
+} rlm_cache_local_t;
+
 /*
  *	Define a structure for our module configuration.
  *
@@ -70,6 +95,13 @@ typedef struct rlm_cache_t {
 
 	vp_map_t		*maps;			//!< Attribute map applied to users.
 							//!< and profiles.
+	rlm_cache_local_t	*local;			//!< Local tier, or NULL if not configured.
+
+	fr_hash_table_t		*flights;		//!< Keys currently being populated.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		flights_mutex;		//!< Protects flights.
+#endif
+
 	CONF_SECTION		*cs;
 } rlm_cache_t;
 
@@ -275,6 +307,31 @@ typedef void		(*cache_release_t)(rlm_cache_config_t const *config, void *driver_
 typedef int		(*cache_reconnect_t)(rlm_cache_handle_t **handle, rlm_cache_config_t const *config,
 					     void *driver_inst, REQUEST *request);
 
+/** Called when another server modifies or removes an entry
+ *
+ * @param[in] uctx passed to #cache_subscribe_t.
+ * @param[in] key of the entry which changed.
+ * @param[in] key_len the length of the key string.
+ */
+typedef void		(*cache_invalidate_t)(void *uctx, uint8_t const *key, size_t key_len);
+
+/** Subscribe to notifications of entries being modified by other servers
+ *
+ * Used to invalidate copies of entries held in the local tier.  The callback
+ * may be called from any thread.
+ *
+ * @note This callback is optional.
+ * @param[in] config for this instance of the rlm_cache module.
+ * @param[in] driver_inst Driver specific instance data.
+ * @param[in] callback to call with the key of each modified entry.
+ * @param[in] uctx to pass to the callback.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+typedef int		(*cache_subscribe_t)(rlm_cache_config_t const *config, void *driver_inst,
+					     cache_invalidate_t callback, void *uctx);
+
 struct cache_driver {
 	char const			*name;			//!< Driver name.
 
@@ -294,6 +351,8 @@ struct cache_driver {
 	cache_release_t			release;		//!< (optional) Release access to resource acquired
 								//!< with acquire callback.
 	cache_reconnect_t		reconnect;		//!< (optional) Re-initialise resource.
+	cache_subscribe_t		subscribe;		//!< (optional) Receive notifications of entries
+								//!< modified by other servers.
 
 	size_t				inst_size;		//!< How many bytes should be allocated for the driver's
 								//!< instance data.
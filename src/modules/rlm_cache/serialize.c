@@ -90,6 +90,264 @@ finish:
 	return 0;
 }
 
+/*
+ *	Binary format, all integers are in network byte order.
+ *
+ *	Header:
+ *	   0                   1                   2                   3
+ *	   0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ *	  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	  |     Magic     |    Version    |  Created (64 bits) ...
+ *	  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	  |  Expires (64 bits) ...
+ *	  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ *	Followed by zero or more maps:
+ *	  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	  |                            Vendor                             |
+ *	  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	  |                           Attribute                           |
+ *	  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	  |    Request    |     List      |      Tag      |   Operator    |
+ *	  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	  |                         Value Length                          |
+ *	  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	  |  Value ...
+ *	  +-+-+-+-+-+-+-+-+
+ *
+ *	Values are in the same format as they'd be encoded in a RADIUS
+ *	packet.
+ */
+#define CACHE_BINARY_HDR_LEN	18
+#define CACHE_BINARY_MAP_HDR_LEN	16
+
+/** Append data to a binary serialization buffer, growing it as needed
+ *
+ */
+static int cache_binary_append(uint8_t **buff, size_t *used, void const *data, size_t len)
+{
+	size_t size = talloc_array_length(*buff);
+
+	if ((*used + len) > size) {
+		uint8_t *n;
+
+		while ((*used + len) > size) size *= 2;
+
+		n = talloc_realloc(NULL, *buff, uint8_t, size);
+		if (!n) return -1;
+		*buff = n;
+	}
+
+	memcpy(*buff + *used, data, len);
+	*used += len;
+
+	return 0;
+}
+
+/** Serialize a cache entry in a compact binary format
+ *
+ * Faster to produce and parse than #cache_serialize, as attributes are
+ * identified by number, and values are stored without conversion to text.
+ *
+ * @param ctx to alloc buffer in.
+ * @param out Where to write pointer to serialized cache entry.  The length
+ *	of the serialized data is the length of the talloced array.
+ * @param c Cache entry to serialize.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_serialize_binary(TALLOC_CTX *ctx, uint8_t **out, rlm_cache_entry_t const *c)
+{
+	uint8_t		*buff;
+	size_t		used = 0;
+	uint8_t		hdr[CACHE_BINARY_HDR_LEN];
+	uint64_t	date;
+	vp_map_t	*map;
+
+	buff = talloc_array(ctx, uint8_t, 256);
+	if (!buff) return -1;
+
+	hdr[0] = CACHE_SERIALIZE_BINARY_MAGIC;
+	hdr[1] = CACHE_SERIALIZE_BINARY_VERSION;
+	date = htonll((uint64_t)c->created);
+	memcpy(&hdr[2], &date, sizeof(date));
+	date = htonll((uint64_t)c->expires);
+	memcpy(&hdr[10], &date, sizeof(date));
+
+	if (cache_binary_append(&buff, &used, hdr, sizeof(hdr)) < 0) {
+	error:
+		talloc_free(buff);
+		return -1;
+	}
+
+	for (map = c->maps; map; map = map->next) {
+		uint8_t			map_hdr[CACHE_BINARY_MAP_HDR_LEN];
+		uint32_t		num;
+		fr_dict_attr_t const	*da = map->lhs->tmpl_da;
+		value_data_t const	*value = &map->rhs->tmpl_data_value;
+		value_data_t		cast;
+		uint8_t const		*data;
+		size_t			len;
+		int			ret;
+
+		memset(&cast, 0, sizeof(cast));
+
+		switch (map->rhs->tmpl_data_type) {
+		case PW_TYPE_STRING:
+			data = (uint8_t const *)value->strvalue;
+			len = value->length;
+			break;
+
+		case PW_TYPE_OCTETS:
+			data = value->octets;
+			len = value->length;
+			break;
+
+		/*
+		 *	Casting to octets gives us the value in
+		 *	network byte order.
+		 */
+		default:
+			if (value_data_cast(buff, &cast, PW_TYPE_OCTETS, NULL,
+					    map->rhs->tmpl_data_type, NULL, value) < 0) goto error;
+			data = cast.octets;
+			len = cast.length;
+			break;
+		}
+
+		num = htonl(da->vendor);
+		memcpy(&map_hdr[0], &num, sizeof(num));
+		num = htonl(da->attr);
+		memcpy(&map_hdr[4], &num, sizeof(num));
+		map_hdr[8] = map->lhs->tmpl_request;
+		map_hdr[9] = map->lhs->tmpl_list;
+		map_hdr[10] = (uint8_t)map->lhs->tmpl_tag;
+		map_hdr[11] = map->op;
+		num = htonl(len);
+		memcpy(&map_hdr[12], &num, sizeof(num));
+
+		ret = cache_binary_append(&buff, &used, map_hdr, sizeof(map_hdr));
+		if (ret == 0) ret = cache_binary_append(&buff, &used, data, len);
+		rad_const_free(cast.octets);
+		if (ret < 0) goto error;
+	}
+
+	/*
+	 *	Trim the buffer, so its length is the
+	 *	length of the serialized data.
+	 */
+	*out = talloc_realloc(ctx, buff, uint8_t, used);
+	if (!*out) goto error;
+
+	return 0;
+}
+
+/** Converts a binary serialized cache entry back into a structure
+ *
+ * @param c Cache entry to populate (should already be allocated)
+ * @param in Binary representation of cache entry.
+ * @param inlen Length of binary data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_deserialize_binary(rlm_cache_entry_t *c, uint8_t const *in, size_t inlen)
+{
+	vp_map_t	**last = &c->maps;
+	uint8_t const	*p = in, *end = in + inlen;
+	uint64_t	date;
+
+	if ((inlen < CACHE_BINARY_HDR_LEN) || (in[0] != CACHE_SERIALIZE_BINARY_MAGIC)) {
+		fr_strerror_printf("Serialized entry too short or has bad magic");
+		return -1;
+	}
+
+	if (in[1] != CACHE_SERIALIZE_BINARY_VERSION) {
+		fr_strerror_printf("Unsupported serialization version %u", in[1]);
+		return -1;
+	}
+
+	memcpy(&date, &in[2], sizeof(date));
+	c->created = (time_t)ntohll(date);
+	memcpy(&date, &in[10], sizeof(date));
+	c->expires = (time_t)ntohll(date);
+
+	p += CACHE_BINARY_HDR_LEN;
+
+	while (p < end) {
+		vp_map_t		*map;
+		fr_dict_attr_t const	*da;
+		uint32_t		vendor, attr, len;
+
+		if ((end - p) < CACHE_BINARY_MAP_HDR_LEN) {
+			fr_strerror_printf("Serialized map truncated");
+			return -1;
+		}
+
+		memcpy(&vendor, &p[0], sizeof(vendor));
+		memcpy(&attr, &p[4], sizeof(attr));
+		memcpy(&len, &p[12], sizeof(len));
+		vendor = ntohl(vendor);
+		attr = ntohl(attr);
+		len = ntohl(len);
+
+		if ((size_t)(end - (p + CACHE_BINARY_MAP_HDR_LEN)) < len) {
+			fr_strerror_printf("Serialized value truncated");
+			return -1;
+		}
+
+		da = fr_dict_attr_by_num(NULL, vendor, attr);
+		if (!da) {
+			fr_strerror_printf("Unknown attribute %u:%u.  Check local dictionaries", vendor, attr);
+			return -1;
+		}
+
+		MEM(map = talloc_zero(c, vp_map_t));
+		map->op = p[11];
+
+		MEM(map->lhs = talloc(map, vp_tmpl_t));
+		tmpl_from_da(map->lhs, da, (int8_t)p[10], NUM_ANY, p[8], p[9]);
+
+		MEM(map->rhs = tmpl_init(talloc(map, vp_tmpl_t), TMPL_TYPE_DATA, "<BINARY>", 8, T_BARE_WORD));
+		map->rhs->tmpl_data_type = da->type;
+
+		p += CACHE_BINARY_MAP_HDR_LEN;
+
+		switch (da->type) {
+		case PW_TYPE_STRING:
+			map->rhs->tmpl_data_value.strvalue = talloc_bstrndup(map->rhs, (char const *)p, len);
+			map->rhs->tmpl_data_length = len;
+			break;
+
+		case PW_TYPE_OCTETS:
+			map->rhs->tmpl_data_value.octets = talloc_memdup(map->rhs, p, len);
+			map->rhs->tmpl_data_length = len;
+			break;
+
+		default:
+		{
+			value_data_t src;
+
+			src.octets = p;
+			src.length = len;
+			if (value_data_cast(map->rhs, &map->rhs->tmpl_data_value, da->type, da,
+					    PW_TYPE_OCTETS, NULL, &src) < 0) {
+				talloc_free(map);
+				return -1;
+			}
+		}
+			break;
+		}
+		p += len;
+
+		*last = map;
+		last = &(*last)->next;
+	}
+
+	return 0;
+}
+
 /** Converts a serialized cache entry back into a structure
  *
  * @param c Cache entry to populate (should already be allocated)
@@ -105,6 +363,10 @@ int cache_deserialize(rlm_cache_entry_t *c, char *in, ssize_t inlen)
 	vp_map_t	**last = &c->maps;
 	char		*p, *q;
 
+	if ((inlen > 0) && ((uint8_t)in[0] == CACHE_SERIALIZE_BINARY_MAGIC)) {
+		return cache_deserialize_binary(c, (uint8_t const *)in, inlen);
+	}
+
 	if (inlen < 0) inlen = strlen(in);
 
 	p = in;
@@ -25,5 +25,15 @@
  */
 RCSIDH(serialize_h, "$Id$")
 
+/** First byte of a binary serialized entry
+ *
+ * Text serialized entries always start with '&', so the formats can be told apart.
+ */
+#define CACHE_SERIALIZE_BINARY_MAGIC	0xfc
+#define CACHE_SERIALIZE_BINARY_VERSION	0x01
+
 int cache_serialize(TALLOC_CTX *ctx, char **out, rlm_cache_entry_t const *c);
 int cache_deserialize(rlm_cache_entry_t *c, char *in, ssize_t inlen);
+
+int cache_serialize_binary(TALLOC_CTX *ctx, uint8_t **out, rlm_cache_entry_t const *c);
+int cache_deserialize_binary(rlm_cache_entry_t *c, uint8_t const *in, size_t inlen);
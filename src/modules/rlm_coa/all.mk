@@ -0,0 +1,2 @@
+TARGET		:= rlm_coa.a
+SOURCES		:= rlm_coa.c
@@ -0,0 +1,119 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_coa.c
+ * @brief Queue CoA and Disconnect requests for bulk sending.
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/process.h>
+
+#if defined(WITH_PROXY) && defined(WITH_COA)
+typedef struct rlm_coa_t {
+	char const	*name;		//!< Name of this instance of the module.
+	char const	*home_server;	//!< Name of the CoA home server to send packets to.
+
+	home_server_t	*home;
+} rlm_coa_t;
+
+static const CONF_PARSER module_config[] = {
+	{ FR_CONF_OFFSET("home_server", PW_TYPE_STRING | PW_TYPE_REQUIRED, rlm_coa_t, home_server) },
+	CONF_PARSER_TERMINATOR
+};
+
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_coa_t *inst = instance;
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	inst->home = home_server_byname(inst->home_server, HOME_TYPE_COA);
+	if (!inst->home) {
+		cf_log_err_cs(conf, "No such CoA home_server \"%s\"", inst->home_server);
+		return -1;
+	}
+
+	if (inst->home->server
+#ifdef WITH_TCP
+	    || (inst->home->proto != IPPROTO_UDP)
+#endif
+	    ) {
+		cf_log_err_cs(conf, "home_server \"%s\" must use UDP, and must not be a virtual server",
+			      inst->home_server);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Take the "coa" or "disconnect" list, and queue it.  The
+ *	CoA request which the server would otherwise send for this
+ *	request is cancelled.
+ */
+static rlm_rcode_t CC_HINT(nonnull) mod_coa(void *instance, REQUEST *request)
+{
+	rlm_coa_t	*inst = instance;
+	VALUE_PAIR	*vp;
+	PW_CODE		code;
+
+	if (!request->coa) {
+		RDEBUG2("No \"coa\" or \"disconnect\" list, not sending anything");
+		return RLM_MODULE_NOOP;
+	}
+
+	code = request->coa->proxy->code;
+	vp = fr_pair_find_by_num(request->coa->proxy->vps, 0, PW_PACKET_TYPE, TAG_ANY);
+	if (vp) code = vp->vp_integer;
+	if (!code) code = PW_CODE_COA_REQUEST;
+
+	if (coa_bulk_enqueue(inst->home, code, request->coa->proxy->vps) < 0) {
+		REDEBUG("Failed queueing packet: %s", fr_strerror());
+		TALLOC_FREE(request->coa);
+		return RLM_MODULE_FAIL;
+	}
+
+	RDEBUG2("Queued %s to home server %s", fr_packet_codes[code], inst->home->log_name);
+	TALLOC_FREE(request->coa);
+
+	return RLM_MODULE_OK;
+}
+#endif
+
+extern module_t rlm_coa;
+module_t rlm_coa = {
+	.magic		= RLM_MODULE_INIT,
+	.name		= "coa",
+	.type		= RLM_TYPE_THREAD_SAFE,
+#if defined(WITH_PROXY) && defined(WITH_COA)
+	.inst_size	= sizeof(rlm_coa_t),
+	.config		= module_config,
+	.instantiate	= mod_instantiate,
+	.methods = {
+		[MOD_AUTHORIZE]		= mod_coa,
+		[MOD_PREACCT]		= mod_coa,
+		[MOD_ACCOUNTING]	= mod_coa,
+		[MOD_POST_AUTH]		= mod_coa,
+	},
+#endif
+};
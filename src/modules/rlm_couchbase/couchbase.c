@@ -72,6 +72,33 @@ void couchbase_store_callback(lcb_t instance, const void *cookie, lcb_storage_t
 	(void)resp;
 }
 
+#ifdef HAVE_LCB_SCHED
+/** Couchbase callback for store and subdocument mutation operations
+ *
+ * Records the result in the #couchbase_op_t passed as the cookie, if there is one.
+ *
+ * @param instance Couchbase connection instance.
+ * @param cbtype   Couchbase callback type.
+ * @param resp     Couchbase response object.
+ */
+void couchbase_op_callback(lcb_t instance, int cbtype, const lcb_RESPBASE *resp)
+{
+	couchbase_op_t *op = resp->cookie;
+
+	if (op) {
+		op->error = resp->rc;
+		return;
+	}
+
+	if (resp->rc != LCB_SUCCESS) {
+		/* log error */
+		ERROR("rlm_couchbase: (op_callback) %s (0x%x)", lcb_strerror(instance, resp->rc), resp->rc);
+	}
+	/* silent compiler */
+	(void)cbtype;
+}
+#endif
+
 /** Couchbase callback for get (read) operations
  *
  * @param instance Couchbase connection instance.
@@ -227,7 +254,14 @@ lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const c
 
 	/* set general method callbacks */
 	lcb_set_stat_callback(*instance, couchbase_stat_callback);
+#ifdef HAVE_LCB_SCHED
+	lcb_install_callback3(*instance, LCB_CALLBACK_STORE, couchbase_op_callback);
+#  ifdef HAVE_LCB_SUBDOC
+	lcb_install_callback3(*instance, LCB_CALLBACK_SDMUTATE, couchbase_op_callback);
+#  endif
+#else
 	lcb_set_store_callback(*instance, couchbase_store_callback);
+#endif
 	lcb_set_get_callback(*instance, couchbase_get_callback);
 	lcb_set_http_data_callback(*instance, couchbase_http_data_callback);
 	/* wait on connection */
@@ -306,6 +340,57 @@ lcb_error_t couchbase_set_key(lcb_t instance, const char *key, const char *docum
 	return error;
 }
 
+#ifdef HAVE_LCB_SCHED
+/** Write a batch of documents in Couchbase
+ *
+ * Schedule all of the writes, so that they're sent in one network flush, and
+ * wait for the results.  The result of each write is stored in its @p error field.
+ *
+ * @param instance Couchbase connection instance.
+ * @param head     First write in the batch.
+ */
+void couchbase_op_run(lcb_t instance, couchbase_op_t *head)
+{
+	couchbase_op_t *op;                 /* current write */
+
+	/* hold the writes until they're all scheduled */
+	lcb_sched_enter(instance);
+
+	for (op = head; op; op = op->next) {
+#ifdef HAVE_LCB_SUBDOC
+		if (!op->document) {
+			lcb_CMDSUBDOC cmd;          /* subdocument command struct */
+
+			memset(&cmd, 0, sizeof(cmd));
+			LCB_CMD_SET_KEY(&cmd, op->key, strlen(op->key));
+			cmd.specs = op->specs;
+			cmd.nspecs = op->nspecs;
+			cmd.cmdflags = op->cmdflags;
+			cmd.exptime = op->expire;
+
+			op->error = lcb_subdoc3(instance, op, &cmd);
+			continue;
+		}
+#endif
+		{
+			lcb_CMDSTORE cmd;           /* store command struct */
+
+			memset(&cmd, 0, sizeof(cmd));
+			LCB_CMD_SET_KEY(&cmd, op->key, strlen(op->key));
+			LCB_CMD_SET_VALUE(&cmd, op->document, strlen(op->document));
+			cmd.operation = LCB_SET;
+			cmd.exptime = op->expire;
+
+			op->error = lcb_store3(instance, op, &cmd);
+		}
+	}
+
+	/* send everything which was scheduled */
+	lcb_sched_leave(instance);
+	lcb_wait(instance);
+}
+#endif
+
 /** Retrieve a document by key from Couchbase
  *
  * Setup and execute a Couchbase get request and wait for the result.
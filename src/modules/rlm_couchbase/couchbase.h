@@ -32,6 +32,25 @@ RCSIDH(couchbase_h, "$Id$")
 #include <libcouchbase/couchbase.h>
 #include "../rlm_json/json.h"
 
+/*
+ *	libcouchbase 2.4.0 added lcb_sched_enter() and the "v3" API, which
+ *	lets many operations be scheduled and sent in one network flush.
+ */
+#if defined(LCB_VERSION) && (LCB_VERSION >= 0x020400)
+#  define HAVE_LCB_SCHED (1)
+#endif
+
+/*
+ *	Subdocument mutations, which can create the document if it
+ *	doesn't exist.
+ */
+#if defined(HAVE_LCB_SCHED) && defined(LCB_CMDSUBDOC_F_UPSERT_DOC)
+#  define HAVE_LCB_SUBDOC (1)
+
+/* maximum number of paths the server accepts in one subdocument operation */
+#  define COUCHBASE_SUBDOC_MAX_SPECS 16
+#endif
+
 /** Information relating to the parsing of Couchbase document payloads
  *
  * This structure holds various references to json-c objects used when parsing
@@ -53,6 +72,25 @@ typedef union cookie_u {
 	void *data;           //!< Non-constant pointer to data payload (@p cookie_t).
 } cookie_u;
 
+/** A write to a document
+ *
+ * Writes from several requests may be scheduled together, and sent in one
+ * network flush.
+ */
+typedef struct couchbase_op_t {
+	struct couchbase_op_t *next;    //!< Next write in the batch.
+	char const *key;                //!< Document key.
+	char const *document;           //!< Document body to store, or NULL for a subdocument mutation.
+	int expire;                     //!< Expiration time for the document (0 = never).
+#ifdef HAVE_LCB_SUBDOC
+	lcb_SDSPEC const *specs;        //!< Paths to mutate, if document is NULL.
+	size_t nspecs;                  //!< Number of paths to mutate.
+	lcb_U32 cmdflags;               //!< Flags for the subdocument command.
+#endif
+	lcb_error_t error;              //!< Result of the write.
+	bool done;                      //!< Whether the write has been attempted.
+} couchbase_op_t;
+
 /* couchbase statistics callback */
 void couchbase_stat_callback(lcb_t instance, const void *cookie, lcb_error_t error,
 	const lcb_server_stat_resp_t *resp);
@@ -85,4 +123,12 @@ lcb_error_t couchbase_get_key(lcb_t instance, const void *cookie, const char *ke
 /* query a couchbase view via http */
 lcb_error_t couchbase_query_view(lcb_t instance, const void *cookie, const char *path, const char *post);
 
+#ifdef HAVE_LCB_SCHED
+/* couchbase callback for writes */
+void couchbase_op_callback(lcb_t instance, int cbtype, const lcb_RESPBASE *resp);
+
+/* send a batch of writes in one network flush */
+void couchbase_op_run(lcb_t instance, couchbase_op_t *head);
+#endif
+
 #endif /* _couchbase_h_ */
@@ -34,6 +34,8 @@ RCSIDH(mod_h, "$Id$")
 #include <libcouchbase/couchbase.h>
 #include "../rlm_json/json.h"
 
+#include "couchbase.h"
+
 /* maximum size of a stored value */
 #define MAX_VALUE_SIZE 20480
 
@@ -48,6 +50,10 @@ typedef struct rlm_couchbase_t {
 	vp_tmpl_t		*acct_key;		//!< Accounting document key.
 	char const		*doctype;		//!< Value of accounting 'docType' element name.
 	uint32_t		expire;			//!< Accounting document expire time in seconds.
+	uint32_t		acct_batch;		//!< Maximum number of accounting writes to send
+						//!< in one network flush.
+	bool			acct_subdoc;		//!< Update accounting documents with subdocument
+						//!< mutations, instead of rewriting them.
 
 	char const		*server_raw;     	//!< Raw server string before parsing.
 	char const		*server;         	//!< Couchbase server list.
@@ -68,6 +74,14 @@ typedef struct rlm_couchbase_t {
 
 	json_object		*map;           	//!< Json object to hold user defined attribute map.
 	fr_connection_pool_t	*pool;			//!< Connection pool.
+
+	couchbase_op_t		*op_head;		//!< Accounting writes waiting to be sent.
+	couchbase_op_t		*op_tail;		//!< Last accounting write waiting to be sent.
+	bool			op_busy;		//!< Whether a batch of writes is being sent.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;			//!< Protects the write queue.
+	pthread_cond_t		cond;			//!< Signalled when a batch of writes completes.
+#endif
 } rlm_couchbase_t;
 
 /** Couchbase instance specific information
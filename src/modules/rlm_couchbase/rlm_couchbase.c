@@ -56,6 +56,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("acct_key", PW_TYPE_TMPL, rlm_couchbase_t, acct_key), .dflt = "radacct_%{%{Acct-Unique-Session-Id}:-%{Acct-Session-Id}}", .quote = T_DOUBLE_QUOTED_STRING },
 	{ FR_CONF_OFFSET("doctype", PW_TYPE_STRING, rlm_couchbase_t, doctype), .dflt = "radacct" },
 	{ FR_CONF_OFFSET("expire", PW_TYPE_INTEGER, rlm_couchbase_t, expire), .dflt = 0 },
+	{ FR_CONF_OFFSET("acct_batch", PW_TYPE_INTEGER, rlm_couchbase_t, acct_batch), .dflt = "1" },
+	{ FR_CONF_OFFSET("acct_subdoc", PW_TYPE_BOOLEAN, rlm_couchbase_t, acct_subdoc), .dflt = "no" },
 #endif
 	{ FR_CONF_OFFSET("user_key", PW_TYPE_TMPL, rlm_couchbase_t, user_key), .dflt = "raduser_%{md5:%{tolower:%{%{Stripped-User-Name}:-%{User-Name}}}}", .quote = T_DOUBLE_QUOTED_STRING },
 	{ FR_CONF_OFFSET("read_clients", PW_TYPE_BOOLEAN, rlm_couchbase_t, read_clients) }, /* NULL defaults to "no" */
@@ -121,6 +123,31 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		inst->server = server;
 	}
 
+#ifdef WITH_ACCOUNTING
+	FR_INTEGER_BOUND_CHECK("acct_batch", inst->acct_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("acct_batch", inst->acct_batch, <=, 1024);
+
+#ifndef HAVE_LCB_SCHED
+	if (inst->acct_batch > 1) {
+		WARN("rlm_couchbase: Setting 'acct_batch' requires libcouchbase >= 2.4.0.  Disabling 'acct_batch'");
+		inst->acct_batch = 1;
+	}
+#endif
+
+#ifndef HAVE_LCB_SUBDOC
+	if (inst->acct_subdoc) {
+		WARN("rlm_couchbase: Setting 'acct_subdoc' requires libcouchbase with subdocument support.  "
+		     "Disabling 'acct_subdoc'");
+		inst->acct_subdoc = false;
+	}
+#endif
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&inst->mutex, NULL);
+	pthread_cond_init(&inst->cond, NULL);
+#endif
+#endif
+
 	/* setup item map */
 	if (mod_build_attribute_element_map(conf, inst) != 0) {
 		/* fail */
@@ -257,6 +284,239 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 }
 
 #ifdef WITH_ACCOUNTING
+#ifdef HAVE_LCB_SCHED
+/** Send a batch of accounting writes using a connection from the pool
+ *
+ * @param inst The module instance.
+ * @param head First write in the batch.
+ */
+static void mod_acct_run(rlm_couchbase_t *inst, couchbase_op_t *head)
+{
+	rlm_couchbase_handle_t *handle;         /* connection pool handle */
+	couchbase_op_t *op;                     /* current write */
+
+	/* get handle */
+	handle = fr_connection_get(inst->pool);
+	if (!handle) {
+		for (op = head; op; op = op->next) op->error = LCB_CLIENT_ETMPFAIL;
+		return;
+	}
+
+	couchbase_op_run(handle->handle, head);
+
+	/* release our connection handle */
+	fr_connection_release(inst->pool, handle);
+}
+
+/** Send accounting writes, combining them with writes from other threads
+ *
+ * While a batch of writes is being sent, writes from other threads queue up.
+ * When the batch completes, one of the waiting threads sends up to acct_batch
+ * of the queued writes in the next network flush.
+ *
+ * @param inst  The module instance.
+ * @param ops   Writes for this request.
+ * @param count Number of writes.
+ */
+static void mod_acct_write(rlm_couchbase_t *inst, couchbase_op_t *ops, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		ops[i].next = (i + 1 < count) ? &ops[i + 1] : NULL;
+		ops[i].done = false;
+	}
+
+	if (inst->acct_batch <= 1) {
+		mod_acct_run(inst, ops);
+		return;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&inst->mutex);
+	if (inst->op_tail) {
+		inst->op_tail->next = ops;
+	} else {
+		inst->op_head = ops;
+	}
+	inst->op_tail = &ops[count - 1];
+
+	while (!ops[count - 1].done) {
+		couchbase_op_t	*head, *p;
+		uint32_t	num;
+
+		if (inst->op_busy) {
+			pthread_cond_wait(&inst->cond, &inst->mutex);
+			continue;
+		}
+
+		/*
+		 *	Take as many writes as we're allowed off
+		 *	the queue, and send them ourselves.
+		 */
+		head = inst->op_head;
+		for (p = head, num = 1; p->next && (num < inst->acct_batch); p = p->next, num++);
+		inst->op_head = p->next;
+		if (!inst->op_head) inst->op_tail = NULL;
+		p->next = NULL;
+		inst->op_busy = true;
+		pthread_mutex_unlock(&inst->mutex);
+
+		DEBUG3("rlm_couchbase: sending %u accounting writes", num);
+		mod_acct_run(inst, head);
+
+		pthread_mutex_lock(&inst->mutex);
+		for (p = head; p; p = p->next) p->done = true;
+		inst->op_busy = false;
+		pthread_cond_broadcast(&inst->cond);
+	}
+	pthread_mutex_unlock(&inst->mutex);
+#else
+	mod_acct_run(inst, ops);
+#endif
+}
+#endif
+
+#ifdef HAVE_LCB_SUBDOC
+/** Update an accounting document with subdocument mutations
+ *
+ * Only the mapped elements are sent, so the document doesn't have to be fetched
+ * and rewritten.  The document is created if it doesn't exist.
+ *
+ * @param inst    The module instance.
+ * @param request The accounting request object.
+ * @param dockey  The document key.
+ * @param status  The Acct-Status-Type of the request.
+ * @return Operation status (#rlm_rcode_t).
+ */
+static rlm_rcode_t mod_accounting_subdoc(rlm_couchbase_t *inst, REQUEST *request, char const *dockey, int status)
+{
+	rlm_rcode_t rcode = RLM_MODULE_OK;      /* return code */
+	VALUE_PAIR *vp;                         /* radius value pair linked list */
+	char element[MAX_KEY_SIZE];             /* mapped radius attribute to element name */
+	json_object *jobj;                      /* elements to set */
+	json_object *jstart = NULL;             /* start time to add if there isn't one */
+	json_object *jval = NULL;               /* json object value */
+	lcb_SDSPEC *specs;                      /* one spec per element */
+	couchbase_op_t *ops;                    /* writes for this request */
+	size_t nspecs, nops, i, j;
+
+	/* create json object holding the elements to set */
+	jobj = json_object_new_object();
+	json_object_object_add(jobj, "docType", json_object_new_string(inst->doctype));
+
+	/* status specific replacements for start/stop time */
+	switch (status) {
+	case PW_STATUS_START:
+		/* add start time */
+		if ((vp = fr_pair_find_by_num(request->packet->vps, 0, PW_EVENT_TIMESTAMP, TAG_ANY)) != NULL) {
+			json_object_object_add(jobj, "startTimestamp", mod_value_pair_to_json_object(request, vp));
+		}
+		break;
+
+	case PW_STATUS_STOP:
+		/* add stop time */
+		if ((vp = fr_pair_find_by_num(request->packet->vps, 0, PW_EVENT_TIMESTAMP, TAG_ANY)) != NULL) {
+			json_object_object_add(jobj, "stopTimestamp", mod_value_pair_to_json_object(request, vp));
+		}
+		/* FALL-THROUGH */
+
+	case PW_STATUS_ALIVE:
+		/* calculate a start time, which is only added if the document doesn't have one */
+		jstart = json_object_new_object();
+		json_object_object_add(jstart, "startTimestamp", NULL);
+		mod_ensure_start_timestamp(jstart, request->packet->vps);
+		break;
+
+	default:
+		/* don't doing anything */
+		json_object_put(jobj);
+		return RLM_MODULE_NOOP;
+	}
+
+	/* loop through pairs and add to json object */
+	for (vp = request->packet->vps; vp; vp = vp->next) {
+		/* map attribute to element */
+		if (mod_attribute_to_element(vp->da->name, inst->map, &element) == 0) {
+			/* debug */
+			RDEBUG3("mapped attribute %s => %s", vp->da->name, element);
+			/* add to json object with mapped name */
+			json_object_object_add(jobj, element, mod_value_pair_to_json_object(request, vp));
+		}
+	}
+
+	/* the server limits the number of paths in one operation */
+	nspecs = json_object_object_length(jobj);
+	nops = (nspecs + COUCHBASE_SUBDOC_MAX_SPECS - 1) / COUCHBASE_SUBDOC_MAX_SPECS;
+	if (jstart && json_object_object_get_ex(jstart, "startTimestamp", &jval) && jval) nops++;
+
+	specs = talloc_zero_array(request, lcb_SDSPEC, nspecs + 1);
+	ops = talloc_zero_array(request, couchbase_op_t, nops);
+	if (!specs || !ops) {
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+
+	i = 0;
+	{
+		json_object_object_foreach(jobj, key, val) {
+			char const *value = json_object_to_json_string(val);
+
+			RDEBUG3("setting '%s' path '%s' => '%s'", dockey, key, value);
+
+			specs[i].sdcmd = LCB_SDCMD_DICT_UPSERT;
+			LCB_SDSPEC_SET_PATH(&specs[i], key, strlen(key));
+			LCB_SDSPEC_SET_VALUE(&specs[i], value, strlen(value));
+			i++;
+		}
+	}
+
+	for (i = 0, j = 0; i < nspecs; i += COUCHBASE_SUBDOC_MAX_SPECS, j++) {
+		ops[j].key = dockey;
+		ops[j].expire = inst->expire;
+		ops[j].specs = &specs[i];
+		ops[j].nspecs = (nspecs - i) < COUCHBASE_SUBDOC_MAX_SPECS ? (nspecs - i) : COUCHBASE_SUBDOC_MAX_SPECS;
+		ops[j].cmdflags = LCB_CMDSUBDOC_F_UPSERT_DOC;
+	}
+
+	/*
+	 *	Add the calculated start time in its own operation,
+	 *	after the document has been created.  It fails if
+	 *	there's already a start time, which is fine.
+	 */
+	if (j < nops) {
+		char const *value = json_object_to_json_string(jval);
+
+		specs[nspecs].sdcmd = LCB_SDCMD_DICT_ADD;
+		LCB_SDSPEC_SET_PATH(&specs[nspecs], "startTimestamp", strlen("startTimestamp"));
+		LCB_SDSPEC_SET_VALUE(&specs[nspecs], value, strlen(value));
+
+		ops[j].key = dockey;
+		ops[j].expire = inst->expire;
+		ops[j].specs = &specs[nspecs];
+		ops[j].nspecs = 1;
+	}
+
+	mod_acct_write(inst, ops, nops);
+
+	for (i = 0; i < nspecs; i += COUCHBASE_SUBDOC_MAX_SPECS) {
+		lcb_error_t cb_error = ops[i / COUCHBASE_SUBDOC_MAX_SPECS].error;
+
+		if (cb_error != LCB_SUCCESS) {
+			RERROR("failed to update document (%s): %s (0x%x)", dockey, lcb_strerror(NULL, cb_error), cb_error);
+		}
+	}
+
+finish:
+	talloc_free(specs);
+	talloc_free(ops);
+	if (jstart) json_object_put(jstart);
+	json_object_put(jobj);
+
+	return rcode;
+}
+#endif
+
 /** Write accounting data to Couchbase documents
  *
  * Handle accounting requests and store the associated data into JSON documents
@@ -283,6 +543,7 @@ static rlm_rcode_t mod_accounting(void *instance, REQUEST *request)
 	int status = 0;                         /* account status type */
 	int docfound = 0;                       /* document found toggle */
 	lcb_error_t cb_error = LCB_SUCCESS;     /* couchbase error holder */
+	cookie_t *cookie = NULL;                /* couchbase cookie */
 	ssize_t slen;
 
 	/* assert packet as not null */
@@ -307,6 +568,20 @@ static rlm_rcode_t mod_accounting(void *instance, REQUEST *request)
 		return RLM_MODULE_OK;
 	}
 
+	/* attempt to build document key */
+	slen = tmpl_expand(&dockey, buffer, sizeof(buffer), request, inst->acct_key, NULL, NULL);
+	if (slen < 0) return RLM_MODULE_FAIL;
+	if ((dockey == buffer) && is_truncated((size_t)slen, sizeof(buffer))) {
+		REDEBUG("Key too long, expected < " STRINGIFY(sizeof(buffer)) " bytes, got %zi bytes", slen);
+		/* return */
+		return RLM_MODULE_FAIL;
+	}
+
+#ifdef HAVE_LCB_SUBDOC
+	/* update the document in place */
+	if (inst->acct_subdoc) return mod_accounting_subdoc(inst, request, dockey, status);
+#endif
+
 	/* get handle */
 	handle = fr_connection_get(inst->pool);
 
@@ -317,20 +592,7 @@ static rlm_rcode_t mod_accounting(void *instance, REQUEST *request)
 	lcb_t cb_inst = handle->handle;
 
 	/* set cookie */
-	cookie_t *cookie = handle->cookie;
-
-	/* attempt to build document key */
-	slen = tmpl_expand(&dockey, buffer, sizeof(buffer), request, inst->acct_key, NULL, NULL);
-	if (slen < 0) {
-		rcode = RLM_MODULE_FAIL;
-		goto finish;
-	}
-	if ((dockey == buffer) && is_truncated((size_t)slen, sizeof(buffer))) {
-		REDEBUG("Key too long, expected < " STRINGIFY(sizeof(buffer)) " bytes, got %zi bytes", slen);
-		rcode = RLM_MODULE_FAIL;
-		/* return */
-		goto finish;
-	}
+	cookie = handle->cookie;
 
 	/* attempt to fetch document */
 	cb_error = couchbase_get_key(cb_inst, cookie, dockey);
@@ -423,8 +685,34 @@ static rlm_rcode_t mod_accounting(void *instance, REQUEST *request)
 	/* debugging */
 	RDEBUG3("setting '%s' => '%s'", dockey, document);
 
+#ifdef HAVE_LCB_SCHED
+	{
+		couchbase_op_t op;              /* our write */
+
+		/* free and reset json object */
+		json_object_put(cookie->jobj);
+		cookie->jobj = NULL;
+		cookie = NULL;
+
+		/*
+		 *	The write may be sent on another connection,
+		 *	along with writes from other requests.
+		 */
+		fr_connection_release(inst->pool, handle);
+		handle = NULL;
+
+		memset(&op, 0, sizeof(op));
+		op.key = dockey;
+		op.document = document;
+		op.expire = inst->expire;
+
+		mod_acct_write(inst, &op, 1);
+		cb_error = op.error;
+	}
+#else
 	/* store document/key in couchbase */
 	cb_error = couchbase_set_key(cb_inst, dockey, document, inst->expire);
+#endif
 
 	/* check return */
 	if (cb_error != LCB_SUCCESS) {
@@ -433,7 +721,7 @@ static rlm_rcode_t mod_accounting(void *instance, REQUEST *request)
 
 finish:
 	/* free and reset json object */
-	if (cookie->jobj) {
+	if (cookie && cookie->jobj) {
 		json_object_put(cookie->jobj);
 		cookie->jobj = NULL;
 	}
@@ -854,6 +1142,11 @@ static int mod_detach(void *instance)
 	if (inst->map) json_object_put(inst->map);
 	if (inst->pool) fr_connection_pool_free(inst->pool);
 
+#if defined(WITH_ACCOUNTING) && defined(HAVE_PTHREAD_H)
+	pthread_mutex_destroy(&inst->mutex);
+	pthread_cond_destroy(&inst->cond);
+#endif
+
 	return 0;
 }
 
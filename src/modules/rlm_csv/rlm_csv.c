@@ -30,6 +30,8 @@ RCSID("$Id$")
 
 #include	<freeradius-devel/map_proc.h>
 
+#include <sys/stat.h>
+
 static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST *request,
 				char const *key, vp_map_t const *maps);
 
@@ -54,6 +56,17 @@ typedef struct rlm_csv_t {
 	char const     	**field_names;
 	int		*field_offsets; /* field X from the file maps to array entry Y here */
 	rbtree_t	*tree;
+
+	uint32_t	reload_interval;	//!< How often to check the file for changes.
+	CONF_SECTION	*cs;
+	time_t		next_check;
+	ino_t		ino;		//!< Identify the file the tree was built from.
+	time_t		mtime;
+	off_t		size;
+#ifdef HAVE_PTHREAD_H
+	pthread_rwlock_t tree_lock;	//!< Held for reading while a lookup uses tree.
+	pthread_mutex_t	reload_mutex;	//!< Only one thread checks for changes.
+#endif
 } rlm_csv_t;
 
 typedef struct rlm_csv_entry_t {
@@ -70,6 +83,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("delimiter", PW_TYPE_STRING | PW_TYPE_REQUIRED | PW_TYPE_NOT_EMPTY, rlm_csv_t, delimiter), .dflt = "," },
 	{ FR_CONF_OFFSET("header", PW_TYPE_STRING | PW_TYPE_REQUIRED | PW_TYPE_NOT_EMPTY, rlm_csv_t, header) },
 	{ FR_CONF_OFFSET("key_field", PW_TYPE_STRING | PW_TYPE_REQUIRED | PW_TYPE_NOT_EMPTY, rlm_csv_t, key) },
+	{ FR_CONF_OFFSET("reload_interval", PW_TYPE_INTEGER, rlm_csv_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -155,13 +169,13 @@ static bool buf2entry(rlm_csv_t *inst, char *buf, char **out)
 /*
  *	Convert a buffer to a CSV entry
  */
-static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno, char *buffer)
+static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, rbtree_t *tree, int lineno, char *buffer)
 {
 	rlm_csv_entry_t *e;
 	int i;
 	char *p, *q;
 
-	e = (rlm_csv_entry_t *) talloc_zero_array(inst->tree, uint8_t, sizeof(*e) + inst->used_fields + sizeof(e->data[0]));
+	e = (rlm_csv_entry_t *) talloc_zero_array(tree, uint8_t, sizeof(*e) + inst->used_fields + sizeof(e->data[0]));
 	if (!e) {
 		cf_log_err_cs(conf, "Out of memory");
 		return NULL;
@@ -204,7 +218,7 @@ static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno
 	/*
 	 *	FIXME: Allow duplicate keys later.
 	 */
-	if (!rbtree_insert(inst->tree, e)) {
+	if (!rbtree_insert(tree, e)) {
 		cf_log_err_cs(conf, "Failed inserting entry for filename %s line %d: duplicate entry",
 			      inst->filename, lineno);
 		return NULL;
@@ -214,6 +228,119 @@ static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno
 }
 
 
+/** Read the CSV file into a new tree
+ *
+ * @param[in] conf to log errors against.
+ * @param[in] inst of rlm_csv.
+ * @param[out] st of the file which was read.
+ * @return
+ *	- The new tree.
+ *	- NULL on error.
+ */
+static rbtree_t *csv_load(CONF_SECTION *conf, rlm_csv_t *inst, struct stat *st)
+{
+	rbtree_t	*tree;
+	FILE		*fp;
+	int		lineno;
+	char		buffer[8192];
+
+	/*
+	 *	Trees aren't parented by the instance, as they may
+	 *	be replaced while other threads are running.
+	 */
+	tree = rbtree_create(NULL, csv_entry_cmp, NULL, 0);
+	if (!tree) {
+		cf_log_err_cs(conf, "Out of memory");
+		return NULL;
+	}
+
+	/*
+	 *	Read the file line by line.
+	 */
+	fp = fopen(inst->filename, "r");
+	if (!fp) {
+		cf_log_err_cs(conf, "Error opening filename %s: %s", inst->filename, strerror(errno));
+	error:
+		talloc_free(tree);
+		return NULL;
+	}
+
+	if (fstat(fileno(fp), st) < 0) {
+		cf_log_err_cs(conf, "Error reading filename %s: %s", inst->filename, strerror(errno));
+		fclose(fp);
+		goto error;
+	}
+
+	lineno = 1;
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		rlm_csv_entry_t *e;
+
+		e = file2csv(conf, inst, tree, lineno, buffer);
+		if (!e) {
+			fclose(fp);
+			goto error;
+		}
+
+		lineno++;
+	}
+
+	fclose(fp);
+
+	return tree;
+}
+
+/** Re-read the file if it has changed
+ *
+ * Lookups carry on using the old tree while the new one is built.
+ * If the new file can't be parsed, the old tree is kept.
+ */
+static void csv_check(rlm_csv_t *inst)
+{
+	struct stat	st;
+	time_t		now = time(NULL);
+	rbtree_t	*tree, *old;
+
+	if (!inst->reload_interval || (now < inst->next_check)) return;
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_trylock(&inst->reload_mutex) != 0) return;
+#endif
+	if (now < inst->next_check) goto done;
+	inst->next_check = now + inst->reload_interval;
+
+	if (stat(inst->filename, &st) < 0) goto done;
+	if ((st.st_ino == inst->ino) && (st.st_mtime == inst->mtime) && (st.st_size == inst->size)) goto done;
+
+	tree = csv_load(inst->cs, inst, &st);
+	if (!tree) {
+		WARN("rlm_csv (%s): Failed reloading %s, continuing to use the previous contents",
+		     inst->name, inst->filename);
+		goto done;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_rwlock_wrlock(&inst->tree_lock);
+#endif
+	old = inst->tree;
+	inst->tree = tree;
+#ifdef HAVE_PTHREAD_H
+	pthread_rwlock_unlock(&inst->tree_lock);
+#endif
+	talloc_free(old);
+
+	inst->ino = st.st_ino;
+	inst->mtime = st.st_mtime;
+	inst->size = st.st_size;
+
+	INFO("rlm_csv (%s): Reloaded %s", inst->name, inst->filename);
+
+done:
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&inst->reload_mutex);
+#endif
+	return;
+}
+
 static int fieldname2offset(rlm_csv_t *inst, char const *field_name)
 {
 	int i;
@@ -274,9 +401,7 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 	char const *p;
 	char *q;
 	char *header;
-	FILE *fp;
-	int lineno;
-	char buffer[8192];
+	struct stat st;
 
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) {
@@ -365,32 +490,18 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
-	inst->tree = rbtree_create(inst, csv_entry_cmp, NULL, 0);
-	if (!inst->tree) goto oom;
-
-	/*
-	 *	Read the file line by line.
-	 */
-	fp = fopen(inst->filename, "r");
-	if (!fp) {
-		cf_log_err_cs(conf, "Error opening filename %s: %s", inst->filename, strerror(errno));
-		return -1;
-	}
-
-	lineno = 1;
-	while (fgets(buffer, sizeof(buffer), fp)) {
-		rlm_csv_entry_t *e;
-
-		e = file2csv(conf, inst, lineno, buffer);
-		if (!e) {
-			fclose(fp);
-			return -1;
-		}
-
-		lineno++;
-	}
+	inst->tree = csv_load(conf, inst, &st);
+	if (!inst->tree) return -1;
 
-	fclose(fp);
+	inst->cs = conf;
+	inst->ino = st.st_ino;
+	inst->mtime = st.st_mtime;
+	inst->size = st.st_size;
+	inst->next_check = time(NULL) + inst->reload_interval;
+#ifdef HAVE_PTHREAD_H
+	pthread_rwlock_init(&inst->tree_lock, NULL);
+	pthread_mutex_init(&inst->reload_mutex, NULL);
+#endif
 
 	/*
 	 *	And register the map function.
@@ -477,11 +588,20 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 	rlm_csv_t		*inst = mod_inst;
 	rlm_csv_entry_t		*e, my_entry;
 	vp_map_t const		*map;
+	rlm_rcode_t		rcode = RLM_MODULE_UPDATED;
 
 	my_entry.key = key;
 
+	csv_check(inst);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_rwlock_rdlock(&inst->tree_lock);
+#endif
 	e = rbtree_finddata(inst->tree, &my_entry);
-	if (!e) return RLM_MODULE_NOOP;
+	if (!e) {
+		rcode = RLM_MODULE_NOOP;
+		goto finish;
+	}
 
 	RINDENT();
 	for (map = maps;
@@ -496,7 +616,8 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 		if (map->rhs->type != TMPL_TYPE_UNPARSED) {
 			if (tmpl_aexpand(request, &field_name, request, map->rhs, NULL, NULL) < 0) {
 				RDEBUG("Failed expanding RHS at %s", map->lhs->name);
-				return RLM_MODULE_FAIL;
+				rcode = RLM_MODULE_FAIL;
+				goto finish;
 			}
 		} else {
 			memcpy(&field_name, &map->rhs->name, sizeof(field_name)); /* const */
@@ -508,7 +629,8 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 
 		if (field < 0) {
 			RDEBUG("No such field name %s", map->rhs->name);
-			return RLM_MODULE_FAIL;
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
 		}
 
 		/*
@@ -516,11 +638,32 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 		 *	create the VP and add it to the map.
 		 */
 		if (map_to_request(request, map, csv_map_getvalue, e->data[field]) < 0) {
-			return RLM_MODULE_FAIL;
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
 		}
 	}
 
-	return RLM_MODULE_UPDATED;
+finish:
+#ifdef HAVE_PTHREAD_H
+	pthread_rwlock_unlock(&inst->tree_lock);
+#endif
+
+	return rcode;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_csv_t *inst = instance;
+
+	if (!inst->tree) return 0;
+
+	TALLOC_FREE(inst->tree);
+#ifdef HAVE_PTHREAD_H
+	pthread_rwlock_destroy(&inst->tree_lock);
+	pthread_mutex_destroy(&inst->reload_mutex);
+#endif
+
+	return 0;
 }
 
 extern module_t rlm_csv;
@@ -531,4 +674,5 @@ module_t rlm_csv = {
 	.inst_size	= sizeof(rlm_csv_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
+	.detach		= mod_detach,
 };
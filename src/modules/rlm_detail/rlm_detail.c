@@ -28,6 +28,7 @@ RCSID("$Id$")
 #include <freeradius-devel/rad_assert.h>
 #include <freeradius-devel/detail.h>
 #include <freeradius-devel/exfile.h>
+#include <freeradius-devel/net.h>
 
 #include <ctype.h>
 #include <fcntl.h>
@@ -62,11 +63,14 @@ typedef struct detail_instance {
 
 	bool		log_srcdst;	//!< Add IP src/dst attributes to entries.
 
+	bool		binary;		//!< Write binary records instead of text.
+
 	bool		escape;		//!< do filename escaping, yes / no
 
 	xlat_escape_t escape_func; //!< escape function
 
 	exfile_t    	*ef;		//!< Log file handler
+	exfile_async_t	async;		//!< Writer thread configuration.
 
 	fr_hash_table_t *ht;		//!< Holds suppressed attributes.
 } rlm_detail_t;
@@ -79,6 +83,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("locking", PW_TYPE_BOOLEAN, rlm_detail_t, locking), .dflt = "no" },
 	{ FR_CONF_OFFSET("escape_filenames", PW_TYPE_BOOLEAN, rlm_detail_t, escape), .dflt = "no" },
 	{ FR_CONF_OFFSET("log_packet_header", PW_TYPE_BOOLEAN, rlm_detail_t, log_srcdst), .dflt = "no" },
+	{ FR_CONF_OFFSET("binary", PW_TYPE_BOOLEAN, rlm_detail_t, binary), .dflt = "no" },
+	{ FR_CONF_OFFSET("async", PW_TYPE_SUBSECTION, rlm_detail_t, async), .dflt = (void const *) exfile_async_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -136,6 +142,18 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+#ifndef HAVE_OPEN_MEMSTREAM
+	if (inst->async.enable) {
+		cf_log_err_cs(conf, "'async' requires open_memstream(), which is not available on this system");
+		return -1;
+	}
+#endif
+
+	if (exfile_async(inst->ef, &inst->async) < 0) {
+		cf_log_err_cs(conf, "%s", fr_strerror());
+		return -1;
+	}
+
 	/*
 	 *	Suppress certain attributes.
 	 */
@@ -336,6 +354,115 @@ static int detail_write(FILE *out, rlm_detail_t *inst, REQUEST *request, RADIUS_
 	return 0;
 }
 
+/** Write a single binary detail entry to file pointer
+ *
+ * The entry is a detail_binary_t header, followed by the packet
+ * encoded as RADIUS.  Attributes which can't go into a RADIUS
+ * packet are not written.
+ *
+ * @param[in] out Where to write entry.
+ * @param[in] inst Instance of rlm_detail.
+ * @param[in] request The current request.
+ * @param[in] packet associated with the request (request, reply, proxy-request, proxy-reply...).
+ * @param[in] compat Write out entry in compatibility mode.
+ */
+static int detail_write_binary(FILE *out, rlm_detail_t *inst, REQUEST *request, RADIUS_PACKET *packet, bool compat)
+{
+	uint8_t			buffer[sizeof(detail_binary_t) + MAX_RADIUS_LEN];
+	detail_binary_t		*hdr = (detail_binary_t *) buffer;
+	radius_packet_t		*raw = (radius_packet_t *) (buffer + sizeof(*hdr));
+	uint8_t			*ptr = raw->data;
+	uint8_t			*end = buffer + sizeof(buffer);
+	size_t			len;
+	uint32_t		timestamp = request->timestamp.tv_sec;
+	VALUE_PAIR		*vp;
+	vp_cursor_t		cursor;
+	RADIUS_PACKET		vector;
+
+	/*
+	 *	Encrypted attributes all use the packet's own vector,
+	 *	whatever the packet type, so the reader doesn't need
+	 *	the original request.
+	 */
+	fr_radius_ctx_t		encoder_ctx = { .packet = &vector, .original = &vector, .secret = DETAIL_BINARY_SECRET };
+
+	memset(&vector, 0, sizeof(vector));
+	vector.code = packet->code;
+	memcpy(vector.vector, packet->vector, sizeof(vector.vector));
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, DETAIL_BINARY_MAGIC, sizeof(hdr->magic));
+	hdr->timestamp[0] = timestamp >> 24;
+	hdr->timestamp[1] = timestamp >> 16;
+	hdr->timestamp[2] = timestamp >> 8;
+	hdr->timestamp[3] = timestamp;
+
+	switch (packet->src_ipaddr.af) {
+	case AF_INET:
+		hdr->af = 4;
+		memcpy(hdr->src_ipaddr, &packet->src_ipaddr.ipaddr.ip4addr, sizeof(packet->src_ipaddr.ipaddr.ip4addr));
+		memcpy(hdr->dst_ipaddr, &packet->dst_ipaddr.ipaddr.ip4addr, sizeof(packet->dst_ipaddr.ipaddr.ip4addr));
+		break;
+
+	case AF_INET6:
+		hdr->af = 6;
+		memcpy(hdr->src_ipaddr, &packet->src_ipaddr.ipaddr.ip6addr, sizeof(packet->src_ipaddr.ipaddr.ip6addr));
+		memcpy(hdr->dst_ipaddr, &packet->dst_ipaddr.ipaddr.ip6addr, sizeof(packet->dst_ipaddr.ipaddr.ip6addr));
+		break;
+
+	default:
+		break;
+	}
+	hdr->src_port[0] = packet->src_port >> 8;
+	hdr->src_port[1] = packet->src_port & 0xff;
+	hdr->dst_port[0] = packet->dst_port >> 8;
+	hdr->dst_port[1] = packet->dst_port & 0xff;
+
+	raw->code = packet->code;
+	raw->id = packet->id;
+	memcpy(raw->vector, packet->vector, sizeof(raw->vector));
+
+	fr_cursor_init(&cursor, &packet->vps);
+	while ((vp = fr_cursor_current(&cursor))) {
+		ssize_t slen;
+
+		if (vp->da->flags.internal || (!vp->da->vendor && (vp->da->attr >= 256)) ||
+		    (inst->ht && fr_hash_table_finddata(inst->ht, vp->da)) ||
+		    (compat && !vp->da->vendor && (vp->da->attr == PW_USER_PASSWORD))) {
+			fr_cursor_next(&cursor);
+			continue;
+		}
+
+		slen = fr_radius_encode_pair(ptr, end - ptr, &cursor, &encoder_ctx);
+		if (slen < 0) {
+			RERROR("Failed encoding %s for detail file: %s", vp->da->name, fr_strerror());
+			return -1;
+		}
+
+		/*
+		 *	The packet is full.
+		 */
+		if ((slen == 0) && (vp->vp_length != 0)) {
+			RWARN("No room for %s in detail record", vp->da->name);
+			break;
+		}
+
+		ptr += slen;
+	}
+
+	len = ptr - (uint8_t *) raw;
+	raw->length[0] = hdr->length[0] = len >> 8;
+	raw->length[1] = hdr->length[1] = len & 0xff;
+
+	len += sizeof(*hdr);
+	if (fwrite(buffer, 1, len, out) < len) {
+		RERROR("Failed writing to detail file: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  *	Do detail, compatible with old accounting
  */
@@ -381,6 +508,59 @@ static rlm_rcode_t CC_HINT(nonnull) detail_do(void *instance, REQUEST *request,
 #endif
 #endif
 
+#ifdef HAVE_OPEN_MEMSTREAM
+	/*
+	 *	Write the entry to memory, and queue it for the
+	 *	writer thread.
+	 */
+	if (inst->async.enable) {
+		char		*data = NULL;
+		size_t		len = 0;
+		struct iovec	vector;
+		int		rcode;
+
+		gid = (gid_t) -1;
+		if (inst->group != NULL) {
+			gid = strtol(inst->group, &endptr, 10);
+			if ((*endptr != '\0') && (rad_getgid(request, &gid, inst->group) < 0)) {
+				RDEBUG2("Unable to find system group '%s'", inst->group);
+				gid = (gid_t) -1;
+			}
+		}
+
+		outfp = open_memstream(&data, &len);
+		if (!outfp) {
+			RERROR("Couldn't allocate detail entry: %s", fr_syserror(errno));
+			return RLM_MODULE_FAIL;
+		}
+
+		if (inst->binary) {
+			rcode = detail_write_binary(outfp, inst, request, packet, compat);
+		} else {
+			rcode = detail_write(outfp, inst, request, packet, compat);
+		}
+		fclose(outfp);
+
+		if (rcode < 0) {
+			free(data);
+			return RLM_MODULE_FAIL;
+		}
+
+		vector.iov_base = data;
+		vector.iov_len = len;
+
+		rcode = exfile_write(inst->ef, buffer, inst->perm, gid, &vector, 1);
+		free(data);
+
+		if (rcode < 0) {
+			RERROR("%s", fr_strerror());
+			return RLM_MODULE_FAIL;
+		}
+
+		return RLM_MODULE_OK;
+	}
+#endif
+
 	outfd = exfile_open(inst->ef, buffer, inst->perm, true);
 	if (outfd < 0) {
 		RERROR("Couldn't open file %s: %s", buffer, fr_strerror());
@@ -413,7 +593,11 @@ skip_group:
 		return RLM_MODULE_FAIL;
 	}
 
-	if (detail_write(outfp, inst, request, packet, compat) < 0) goto fail;
+	if (inst->binary) {
+		if (detail_write_binary(outfp, inst, request, packet, compat) < 0) goto fail;
+	} else {
+		if (detail_write(outfp, inst, request, packet, compat) < 0) goto fail;
+	}
 
 	/*
 	 *	Flush everything
@@ -1126,6 +1126,7 @@ void eap_session_freeze(eap_session_t **eap_session)
 
 	rad_assert((*eap_session)->request);
 	(*eap_session)->request = NULL;
+	eap_session_stats_memory(*eap_session);
 	*eap_session = NULL;
 }
 
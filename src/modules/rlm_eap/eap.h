@@ -86,6 +86,8 @@ struct _eap_session {
 	int		rounds;				//!< How many roundtrips have occurred this session.
 
 	time_t		updated;			//!< The last time we received a packet for this EAP session.
+	struct timeval	created;			//!< When the session was allocated.
+	size_t		mem_size;			//!< talloc memory used, as of the last time it was frozen.
 
 	bool		tls;				//!< Whether EAP method uses TLS.
 	bool		finished;			//!< Whether we consider this session complete.
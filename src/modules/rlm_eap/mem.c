@@ -26,6 +26,8 @@ RCSID("$Id$")
 #include <stdio.h>
 #include "rlm_eap.h"
 
+static void eap_session_stats_update(rlm_eap_t *inst, eap_session_t *eap_session);
+
 /*
  * Allocate a new eap_packet_t
  */
@@ -82,9 +84,57 @@ static int _eap_session_free(eap_session_t *eap_session)
 
 	ROPTIONAL(RDEBUG4, DEBUG4, "Freeing eap_session_t %p", eap_session);
 
+	eap_session_stats_update(eap_session->inst, eap_session);
+
 	return 0;
 }
 
+/** Record a session which is being freed in the instance's counters
+ *
+ */
+static void eap_session_stats_update(rlm_eap_t *inst, eap_session_t *eap_session)
+{
+	struct timeval		now, lifetime;
+	eap_method_stats_t	*stats = NULL;
+
+	gettimeofday(&now, NULL);
+	fr_timeval_subtract(&lifetime, &now, &eap_session->created);
+
+	if ((eap_session->type > 0) && (eap_session->type < PW_EAP_MAX_TYPES)) {
+		stats = &inst->method_stats[eap_session->type];
+	}
+
+	pthread_mutex_lock(&inst->session_mutex);
+	inst->sessions_active--;
+	inst->sessions_memory -= eap_session->mem_size;
+	if (stats) {
+		stats->sessions++;
+		stats->rounds += eap_session->rounds;
+		stats->lifetime_usec += (lifetime.tv_sec * (uint64_t)1000000) + lifetime.tv_usec;
+	}
+	pthread_mutex_unlock(&inst->session_mutex);
+}
+
+/** Update the memory accounted to a session
+ *
+ * Called when the session is frozen, as it's then held by the state
+ * API until the next round.
+ */
+void eap_session_stats_memory(eap_session_t *eap_session)
+{
+	rlm_eap_t	*inst = eap_session->inst;
+	size_t		size;
+
+	size = talloc_total_size(eap_session);
+
+	pthread_mutex_lock(&inst->session_mutex);
+	inst->sessions_memory += size;
+	inst->sessions_memory -= eap_session->mem_size;
+	pthread_mutex_unlock(&inst->session_mutex);
+
+	eap_session->mem_size = size;
+}
+
 /** Allocate a new eap_session_t
  *
  * Allocates a new eap_session_t, and inserts it into the REQUEST_DATA_EAP_SESSION index
@@ -97,20 +147,36 @@ static int _eap_session_free(eap_session_t *eap_session)
  * @param request That generated this eap_session_t.
  * @return
  *	- A new #eap_session_t on success.
- *	- NULL on failure.
+ *	- NULL on failure, or if max_sessions sessions are already active.
  */
 eap_session_t *eap_session_alloc(rlm_eap_t *inst, REQUEST *request)
 {
 	eap_session_t	*eap_session;
 
+	pthread_mutex_lock(&inst->session_mutex);
+	if (inst->max_sessions && (inst->sessions_active >= inst->max_sessions)) {
+		inst->sessions_refused++;
+		pthread_mutex_unlock(&inst->session_mutex);
+
+		RERROR("Too many EAP sessions (%u) in progress, refusing to start another", inst->max_sessions);
+		return NULL;
+	}
+	inst->sessions_active++;
+	pthread_mutex_unlock(&inst->session_mutex);
+
 	eap_session = talloc_zero(NULL, eap_session_t);
 	if (!eap_session) {
+		pthread_mutex_lock(&inst->session_mutex);
+		inst->sessions_active--;
+		pthread_mutex_unlock(&inst->session_mutex);
+
 		ERROR("Failed allocating eap_session");
 		return NULL;
 	}
 	eap_session->inst = inst;
 	eap_session->request = request;
 	eap_session->updated = request->timestamp.tv_sec;
+	gettimeofday(&eap_session->created, NULL);
 
 	talloc_set_destructor(eap_session, _eap_session_free);
 
@@ -195,6 +195,10 @@ typedef struct rc_stats {
 
 	rc_wf_stats_t wf_stats[RC_WF_MAX];
 
+	uint32_t *rtt;					//!< RTT of each successful transaction (us), for percentiles
+	uint32_t nb_rtt;				//!< number of entries used in rtt
+	uint32_t max_rtt;				//!< number of entries allocated in rtt
+
 } rc_stats_t;
 
 #define STATS_INC(_stat_type) { \
@@ -2013,6 +2017,50 @@ static void rc_wf_stat_update(rc_transaction_t *trans, rc_wf_type_t wf_type)
 		timeradd(&my_stats->tv_rtt_cumul, &tv_rtt, &my_stats->tv_rtt_cumul);
 		my_stats->num ++;
 	}
+
+	/* keep each RTT, so that the summary can print percentiles. */
+	if (!do_summary) return;
+
+	if (stats.nb_rtt == stats.max_rtt) {
+		uint32_t *rtt;
+		uint32_t max_rtt = stats.max_rtt ? (stats.max_rtt * 2) : 1024;
+
+		rtt = talloc_realloc(autofree, stats.rtt, uint32_t, max_rtt);
+		if (!rtt) return;
+
+		stats.rtt = rtt;
+		stats.max_rtt = max_rtt;
+	}
+
+	if (tv_rtt.tv_sec > 4000) {
+		stats.rtt[stats.nb_rtt++] = UINT32_MAX;
+	} else {
+		stats.rtt[stats.nb_rtt++] = (tv_rtt.tv_sec * 1000000) + tv_rtt.tv_usec;
+	}
+}
+
+static int rc_rtt_cmp(void const *one, void const *two)
+{
+	uint32_t a = *(uint32_t const *) one, b = *(uint32_t const *) two;
+
+	return (a > b) - (a < b);
+}
+
+/** Get the RTT (in ms) below which 'pct' percent of the transactions completed.
+ *
+ * stats.rtt must be sorted.
+ */
+static float rc_rtt_percentile(double pct)
+{
+	uint32_t i;
+
+	if (!stats.nb_rtt) return 0;
+
+	i = (uint32_t) ((pct * stats.nb_rtt) / 100);
+	if ((i > 0) && ((i * 100) >= (pct * stats.nb_rtt))) i--;
+	if (i >= stats.nb_rtt) i = stats.nb_rtt - 1;
+
+	return (float) stats.rtt[i] / 1000;
 }
 
 /** Print per-workflow detailed statistics.
@@ -2080,6 +2128,22 @@ static void rc_summary(void)
 	fprintf(fp, "\t%-*.*s: %u (retries: %u)\n", LG_PAD_STATS, LG_PAD_STATS, "Packets sent", stats.nb_packets_sent, stats.nb_packets_retries);
 	fprintf(fp, "\t%-*.*s: %u\n", LG_PAD_STATS, LG_PAD_STATS, "Packets received", stats.nb_packets_recv);
 
+	if (stats.nb_rtt > 0) {
+		uint32_t u_ms_elapsed = rc_get_elapsed();
+
+		qsort(stats.rtt, stats.nb_rtt, sizeof(stats.rtt[0]), rc_rtt_cmp);
+
+		fprintf(fp, "\t%-*.*s: p50: %.3f, p99: %.3f, p99.9: %.3f, max: %.3f\n",
+			LG_PAD_STATS, LG_PAD_STATS, "Latency (ms)",
+			rc_rtt_percentile(50), rc_rtt_percentile(99), rc_rtt_percentile(99.9),
+			(float) stats.rtt[stats.nb_rtt - 1] / 1000);
+
+		if (u_ms_elapsed > 0) {
+			fprintf(fp, "\t%-*.*s: %.3f\n", LG_PAD_STATS, LG_PAD_STATS, "Throughput (/s)",
+				(float)(stats.nb_rtt * 1000) / (float)u_ms_elapsed);
+		}
+	}
+
 	rc_print_wf_stats(fp);
 }
 
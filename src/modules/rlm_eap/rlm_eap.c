@@ -36,7 +36,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("ignore_unknown_eap_types", PW_TYPE_BOOLEAN, rlm_eap_t, ignore_unknown_types), .dflt = "no" },
 	{ FR_CONF_OFFSET("cisco_accounting_username_bug", PW_TYPE_BOOLEAN, rlm_eap_t,
 			 mod_accounting_username_bug), .dflt = "no" },
-	{ FR_CONF_DEPRECATED("max_sessions", PW_TYPE_INTEGER, rlm_eap_t, max_sessions), .dflt = "2048" },
+	{ FR_CONF_OFFSET("max_sessions", PW_TYPE_INTEGER, rlm_eap_t, max_sessions), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -44,6 +44,72 @@ static rlm_rcode_t mod_post_proxy(void *instance, REQUEST *request) CC_HINT(nonn
 static rlm_rcode_t mod_authenticate(void *instance, REQUEST *request) CC_HINT(nonnull);
 static rlm_rcode_t mod_authorize(void *instance, REQUEST *request) CC_HINT(nonnull);
 
+/** Return the value of one of the session counters
+ *
+ * Names are "active", "refused" and "memory", or "<method>.sessions",
+ * "<method>.rounds" and "<method>.lifetime" (in microseconds), e.g.
+ * %{eap_stats:peap.rounds}.
+ */
+static ssize_t eap_stats_xlat(char **out, size_t outlen,
+			      void const *mod_inst, UNUSED void const *xlat_inst,
+			      REQUEST *request, char const *fmt)
+{
+	rlm_eap_t		*inst;
+	char const		*p;
+	char			buffer[64];
+	eap_type_t		method;
+	eap_method_stats_t	stats;
+	uint64_t		value;
+
+	memcpy(&inst, &mod_inst, sizeof(inst));
+
+	p = strchr(fmt, '.');
+	if (!p) {
+		pthread_mutex_lock(&inst->session_mutex);
+		if (strcmp(fmt, "active") == 0) {
+			value = inst->sessions_active;
+		} else if (strcmp(fmt, "refused") == 0) {
+			value = inst->sessions_refused;
+		} else if (strcmp(fmt, "memory") == 0) {
+			value = inst->sessions_memory;
+		} else {
+			pthread_mutex_unlock(&inst->session_mutex);
+			goto unknown;
+		}
+		pthread_mutex_unlock(&inst->session_mutex);
+
+		return snprintf(*out, outlen, "%" PRIu64, value);
+	}
+
+	if ((size_t)(p - fmt) >= sizeof(buffer)) goto unknown;
+	strlcpy(buffer, fmt, (p - fmt) + 1);
+
+	method = eap_name2type(buffer);
+	if ((method <= 0) || (method >= PW_EAP_MAX_TYPES)) {
+		REDEBUG("Unknown EAP method \"%s\"", buffer);
+		return -1;
+	}
+
+	pthread_mutex_lock(&inst->session_mutex);
+	stats = inst->method_stats[method];
+	pthread_mutex_unlock(&inst->session_mutex);
+
+	p++;
+	if (strcmp(p, "sessions") == 0) {
+		value = stats.sessions;
+	} else if (strcmp(p, "rounds") == 0) {
+		value = stats.rounds;
+	} else if (strcmp(p, "lifetime") == 0) {
+		value = stats.lifetime_usec;
+	} else {
+	unknown:
+		REDEBUG("Unknown EAP counter \"%s\"", fmt);
+		return -1;
+	}
+
+	return snprintf(*out, outlen, "%" PRIu64, value);
+}
+
 static int mod_bootstrap(CONF_SECTION *cs, void *instance)
 {
 	int		i, ret;
@@ -62,6 +128,16 @@ static int mod_bootstrap(CONF_SECTION *cs, void *instance)
 	inst->xlat_name = cf_section_name2(cs);
 	if (!inst->xlat_name) inst->xlat_name = "EAP";
 
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&inst->session_mutex, NULL) < 0) {
+		ERROR("rlm_eap (%s): Failed initializing mutex: %s", inst->xlat_name, fr_syserror(errno));
+		return -1;
+	}
+#endif
+
+	xlat_register(inst, talloc_asprintf(inst, "%s_stats", cf_section_name2(cs) ? inst->xlat_name : "eap"),
+		      eap_stats_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+
 	/* Load all the configured EAP-Types */
 	num_methods = 0;
 	for (scs = cf_subsection_find_next(cs, NULL, NULL);
@@ -660,6 +736,15 @@ static rlm_rcode_t mod_post_auth(void *instance, REQUEST *request)
 	return RLM_MODULE_UPDATED;
 }
 
+static int mod_detach(void *instance)
+{
+	rlm_eap_t *inst = instance;
+
+	pthread_mutex_destroy(&inst->session_mutex);
+
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -671,6 +756,7 @@ module_t rlm_eap = {
 	.inst_size	= sizeof(rlm_eap_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
+	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize,
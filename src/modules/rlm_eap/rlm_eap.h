@@ -42,11 +42,23 @@ typedef struct eap_module {
 	void			*instance;
 } eap_module_t;
 
+/*
+ * Counters for sessions of a single EAP method, updated when
+ * the session is freed.
+ */
+typedef struct eap_method_stats {
+	uint64_t	sessions;		//!< Sessions which have ended.
+	uint64_t	rounds;			//!< Total round trips of those sessions.
+	uint64_t	lifetime_usec;		//!< Total lifetime of those sessions.
+} eap_method_stats_t;
+
 /*
  * This structure contains eap's persistent data.
- * sessions = remembered sessions, in a tree for speed.
  * types = All supported EAP-Types
- * mutex = ensure only one thread is updating the sessions[] struct
+ * mutex = protects the session counters
+ *
+ * The sessions themselves are held by the state API, which
+ * shards them by State.
  */
 typedef struct rlm_eap {
 	eap_module_t 	*methods[PW_EAP_MAX_TYPES];
@@ -56,10 +68,15 @@ typedef struct rlm_eap {
 
 	bool		ignore_unknown_types;
 	bool		mod_accounting_username_bug;
+	uint32_t	max_sessions;			//!< Maximum number of live sessions, 0 for no limit.
 
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_t	session_mutex;
 #endif
+	uint32_t	sessions_active;		//!< Sessions currently allocated.
+	uint64_t	sessions_refused;		//!< Sessions not started because of max_sessions.
+	size_t		sessions_memory;		//!< talloc memory held by frozen sessions.
+	eap_method_stats_t method_stats[PW_EAP_MAX_TYPES];
 
 	char const	*xlat_name; /* no xlat's yet */
 	fr_randctx	rand_pool;
@@ -105,5 +122,6 @@ eap_session_t 	*eap_session_continue(eap_packet_raw_t **eap_packet, rlm_eap_t *i
  */
 eap_round_t	*eap_round_alloc(eap_session_t *eap_session) CC_HINT(nonnull);
 eap_session_t	*eap_session_alloc(rlm_eap_t *inst, REQUEST *request) CC_HINT(nonnull);
+void		eap_session_stats_memory(eap_session_t *eap_session) CC_HINT(nonnull);
 
 #endif /*_RLM_EAP_H*/
@@ -345,7 +345,6 @@ leap_packet_t *eap_leap_stage6(REQUEST *request, leap_packet_t *packet, VALUE_PA
  */
 leap_packet_t *eap_leap_initiate(REQUEST *request, eap_round_t *eap_round, VALUE_PAIR *user_name)
 {
-	int i;
 	leap_packet_t 	*reply;
 
 	reply = talloc(eap_round, leap_packet_t);
@@ -366,9 +365,7 @@ leap_packet_t *eap_leap_initiate(REQUEST *request, eap_round_t *eap_round, VALUE
 	/*
 	 *	Fill the challenge with random bytes.
 	 */
-	for (i = 0; i < reply->count; i++) {
-		reply->challenge[i] = fr_rand();
-	}
+	fr_rand_fill(reply->challenge, reply->count);
 	RDEBUG2("Issuing AP Challenge");
 
 	/*
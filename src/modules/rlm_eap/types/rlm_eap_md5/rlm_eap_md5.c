@@ -38,7 +38,6 @@ static int mod_process(UNUSED void *arg, eap_session_t *eap_session);
  */
 static int mod_session_init(UNUSED void *instance, eap_session_t *eap_session)
 {
-	int		i;
 	MD5_PACKET	*reply;
 	REQUEST		*request = eap_session->request;
 
@@ -69,9 +68,7 @@ static int mod_session_init(UNUSED void *instance, eap_session_t *eap_session)
 	/*
 	 *	Get a random challenge.
 	 */
-	for (i = 0; i < reply->value_size; i++) {
-		reply->value[i] = fr_rand();
-	}
+	fr_rand_fill(reply->value, reply->value_size);
 	RDEBUG2("Issuing MD5 Challenge");
 
 	/*
@@ -231,7 +231,6 @@ static int CC_HINT(nonnull) mod_process(void *instance, eap_session_t *eap_sessi
  */
 static int mod_session_init(void *instance, eap_session_t *eap_session)
 {
-	int			i;
 	VALUE_PAIR		*challenge;
 	mschapv2_opaque_t	*data;
 	REQUEST			*request = eap_session->request;
@@ -254,7 +253,7 @@ static int mod_session_init(void *instance, eap_session_t *eap_session)
 		 *	Get a random challenge.
 		 */
 		p = talloc_array(challenge, uint8_t, MSCHAPV2_CHALLENGE_LEN);
-		for (i = 0; i < MSCHAPV2_CHALLENGE_LEN; i++) p[i] = fr_rand();
+		fr_rand_fill(p, MSCHAPV2_CHALLENGE_LEN);
 		fr_pair_value_memsteal(challenge, p);
 	}
 	RDEBUG2("Issuing Challenge");
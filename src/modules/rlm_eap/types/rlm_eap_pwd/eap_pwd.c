@@ -100,16 +100,213 @@ static void eap_pwd_kdf(uint8_t *key, int keylen, char const *label, int labelle
 	}
 }
 
-int compute_password_element (pwd_session_t *session, uint16_t grp_num,
-			      char const *password, int password_len,
-			      char const *id_server, int id_server_len,
-			      char const *id_peer, int id_peer_len,
-			      uint32_t *token)
+/*
+ *	Constant time helpers.  A mask is all ones for true, and
+ *	all zeros for false.
+ */
+static inline unsigned int const_time_msb(unsigned int val)
 {
-	BIGNUM *x_candidate = NULL, *rnd = NULL, *cofactor = NULL;
-	HMAC_CTX ctx;
-	uint8_t pwe_digest[SHA256_DIGEST_LENGTH], *prfbuf = NULL, ctr;
-	int nid, is_odd, primebitlen, primebytelen, ret = 0;
+	return 0 - (val >> (sizeof(val) * 8 - 1));
+}
+
+static inline unsigned int const_time_is_zero(unsigned int val)
+{
+	return const_time_msb(~val & (val - 1));
+}
+
+static inline unsigned int const_time_eq(unsigned int a, unsigned int b)
+{
+	return const_time_is_zero(a ^ b);
+}
+
+static inline int const_time_select_int(unsigned int mask, int a, int b)
+{
+	return (int) ((mask & (unsigned int) a) | (~mask & (unsigned int) b));
+}
+
+static inline void const_time_select_bin(unsigned int mask, uint8_t const *a, uint8_t const *b,
+					 size_t len, uint8_t *out)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) out[i] = (uint8_t) ((mask & a[i]) | (~mask & b[i]));
+}
+
+/*
+ *	Mask for a < b, where a and b are big endian numbers of len bytes.
+ */
+static unsigned int const_time_lt_bin(uint8_t const *a, uint8_t const *b, size_t len)
+{
+	unsigned int lt = 0, decided = 0, ne;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		ne = ~const_time_eq(a[i], b[i]);
+		lt |= ~decided & ne & const_time_msb((unsigned int) a[i] - (unsigned int) b[i]);
+		decided |= ne;
+	}
+
+	return lt;
+}
+
+/*
+ *	Write a bignum as a big endian number of exactly len bytes.
+ */
+static void bn_to_bin_pad(BIGNUM const *bn, uint8_t *out, int len)
+{
+	int num = BN_num_bytes(bn);
+
+	memset(out, 0, len - num);
+	BN_bn2bin(bn, out + len - num);
+}
+
+/*
+ *	Legendre symbol of a mod p, using exponentiation which doesn't
+ *	depend on the value of a.  Returns 1, 0 or -1, or -2 on error.
+ */
+static int legendre(BIGNUM *a, pwd_group_t const *grp, BN_CTX *bnctx)
+{
+	BIGNUM	*res, *exp;
+	int	ret = -2;
+
+	BN_CTX_start(bnctx);
+	res = BN_CTX_get(bnctx);
+	exp = BN_CTX_get(bnctx);
+	if (!exp) goto done;
+
+	/* exp = (p - 1) / 2 */
+	if (!BN_rshift1(exp, grp->prime)) goto done;
+
+	BN_set_flags(a, BN_FLG_CONSTTIME);
+	if (!BN_mod_exp_mont_consttime(res, a, exp, grp->prime, bnctx, grp->mont)) goto done;
+
+	if (BN_is_word(res, 1)) {
+		ret = 1;
+	} else if (BN_is_zero(res)) {
+		ret = 0;
+	} else {
+		ret = -1;
+	}
+
+done:
+	BN_CTX_end(bnctx);
+	return ret;
+}
+
+/*
+ *	Whether val is a quadratic residue mod p, without the time
+ *	taken depending on the answer.  val is blinded with a random
+ *	square, and then multiplied by a known residue or non-residue,
+ *	so the Legendre symbol of the result is unrelated to val.
+ *
+ *	Returns 1 or 0, or -1 on error.
+ */
+static int is_quadratic_residue(BIGNUM *val, pwd_group_t const *grp, BN_CTX *bnctx)
+{
+	BIGNUM		*r, *res, *pm1, *qr_or_qnr;
+	uint8_t		qr_bin[EAP_PWD_MAX_PRIME_LEN], qnr_bin[EAP_PWD_MAX_PRIME_LEN];
+	uint8_t		select_bin[EAP_PWD_MAX_PRIME_LEN];
+	unsigned int	mask;
+	int		check, ret = -1;
+
+	BN_CTX_start(bnctx);
+	r = BN_CTX_get(bnctx);
+	res = BN_CTX_get(bnctx);
+	pm1 = BN_CTX_get(bnctx);
+	qr_or_qnr = BN_CTX_get(bnctx);
+	if (!qr_or_qnr) goto done;
+
+	BN_set_flags(r, BN_FLG_CONSTTIME);
+	BN_set_flags(res, BN_FLG_CONSTTIME);
+
+	if (!BN_sub(pm1, grp->prime, BN_value_one())) goto done;
+	do {
+		if (!BN_rand_range(r, pm1)) goto done;
+	} while (BN_is_zero(r));
+
+	/* res = r^2 * val */
+	if (!BN_mod_sqr(res, r, grp->prime, bnctx) ||
+	    !BN_mod_mul(res, res, val, grp->prime, bnctx)) goto done;
+
+	/* multiply by a residue if r is odd, or a non-residue if it's even */
+	bn_to_bin_pad(grp->qr, qr_bin, grp->prime_len);
+	bn_to_bin_pad(grp->qnr, qnr_bin, grp->prime_len);
+	mask = const_time_is_zero(BN_is_odd(r));
+	const_time_select_bin(mask, qnr_bin, qr_bin, grp->prime_len, select_bin);
+	if (!BN_bin2bn(select_bin, grp->prime_len, qr_or_qnr) ||
+	    !BN_mod_mul(res, res, qr_or_qnr, grp->prime, bnctx)) goto done;
+
+	check = const_time_select_int(mask, -1, 1);
+	ret = legendre(res, grp, bnctx);
+	if (ret == -2) {
+		ret = -1;
+		goto done;
+	}
+
+	ret = const_time_select_int(const_time_eq(ret, check), 1, 0);
+
+done:
+	BN_CTX_end(bnctx);
+	return ret;
+}
+
+/*
+ *	y^2 = x^3 + ax + b
+ */
+static int do_equation(pwd_group_t const *grp, BIGNUM *y2, BIGNUM *x, BN_CTX *bnctx)
+{
+	BIGNUM	*a, *b, *tmp;
+	int	ret = -1;
+
+	BN_CTX_start(bnctx);
+	a = BN_CTX_get(bnctx);
+	b = BN_CTX_get(bnctx);
+	tmp = BN_CTX_get(bnctx);
+	if (!tmp) goto done;
+
+	if (!EC_GROUP_get_curve_GFp(grp->group, NULL, a, b, bnctx)) goto done;
+
+	if (!BN_mod_sqr(tmp, x, grp->prime, bnctx) ||
+	    !BN_mod_mul(y2, tmp, x, grp->prime, bnctx) ||
+	    !BN_mod_mul(tmp, a, x, grp->prime, bnctx) ||
+	    !BN_mod_add_quick(y2, y2, tmp, grp->prime) ||
+	    !BN_mod_add_quick(y2, y2, b, grp->prime)) goto done;
+
+	ret = 0;
+
+done:
+	BN_CTX_end(bnctx);
+	return ret;
+}
+
+static int _pwd_group_free(pwd_group_t *grp)
+{
+	EC_GROUP_free(grp->group);
+	BN_free(grp->prime);
+	BN_free(grp->order);
+	BN_free(grp->cofactor);
+	BN_free(grp->qr);
+	BN_free(grp->qnr);
+	BN_MONT_CTX_free(grp->mont);
+
+	return 0;
+}
+
+/** Build the values which depend only on the group
+ *
+ * These are the same for every session, so they can be built
+ * once and shared.  They're never modified after they're built.
+ *
+ * @param[in] ctx to allocate the group in.
+ * @param[in] grp_num IANA group number.
+ * @return the group, or NULL on error.
+ */
+pwd_group_t *pwd_group_alloc(TALLOC_CTX *ctx, uint16_t grp_num)
+{
+	pwd_group_t	*grp;
+	BN_CTX		*bnctx = NULL;
+	BIGNUM		*r;
+	int		nid, res;
 
 	switch (grp_num) { /* from IANA registry for IKE D-H groups */
 	case 19:
@@ -134,57 +331,155 @@ int compute_password_element (pwd_session_t *session, uint16_t grp_num,
 
 	default:
 		DEBUG("unknown group %d", grp_num);
-		goto fail;
+		return NULL;
 	}
 
-	session->pwe = NULL;
-	session->order = NULL;
-	session->prime = NULL;
+	grp = talloc_zero(ctx, pwd_group_t);
+	if (!grp) return NULL;
+	talloc_set_destructor(grp, _pwd_group_free);
 
-	if ((session->group = EC_GROUP_new_by_curve_name(nid)) == NULL) {
+	grp->num = grp_num;
+
+	if ((grp->group = EC_GROUP_new_by_curve_name(nid)) == NULL) {
 		DEBUG("unable to create EC_GROUP");
 		goto fail;
 	}
 
-	if (((rnd = BN_new()) == NULL) ||
-	    ((cofactor = BN_new()) == NULL) ||
-	    ((session->pwe = EC_POINT_new(session->group)) == NULL) ||
-	    ((session->order = BN_new()) == NULL) ||
-	    ((session->prime = BN_new()) == NULL) ||
-	    ((x_candidate = BN_new()) == NULL)) {
+	if (((bnctx = BN_CTX_new()) == NULL) ||
+	    ((grp->prime = BN_new()) == NULL) ||
+	    ((grp->order = BN_new()) == NULL) ||
+	    ((grp->cofactor = BN_new()) == NULL) ||
+	    ((grp->qr = BN_new()) == NULL) ||
+	    ((grp->qnr = BN_new()) == NULL) ||
+	    ((grp->mont = BN_MONT_CTX_new()) == NULL)) {
 		DEBUG("unable to create bignums");
 		goto fail;
 	}
 
-	if (!EC_GROUP_get_curve_GFp(session->group, session->prime, NULL, NULL, NULL)) {
+	if (!EC_GROUP_get_curve_GFp(grp->group, grp->prime, NULL, NULL, NULL)) {
 		DEBUG("unable to get prime for GFp curve");
 		goto fail;
 	}
 
-	if (!EC_GROUP_get_order(session->group, session->order, NULL)) {
+	if (!EC_GROUP_get_order(grp->group, grp->order, NULL)) {
 		DEBUG("unable to get order for curve");
 		goto fail;
 	}
 
-	if (!EC_GROUP_get_cofactor(session->group, cofactor, NULL)) {
+	if (!EC_GROUP_get_cofactor(grp->group, grp->cofactor, NULL)) {
 		DEBUG("unable to get cofactor for curve");
 		goto fail;
 	}
 
-	primebitlen = BN_num_bits(session->prime);
-	primebytelen = BN_num_bytes(session->prime);
-	if ((prfbuf = talloc_zero_array(session, uint8_t, primebytelen)) == NULL) {
-		DEBUG("unable to alloc space for prf buffer");
+	if (!BN_MONT_CTX_set(grp->mont, grp->prime, bnctx)) {
+		DEBUG("unable to create Montgomery context for prime");
 		goto fail;
 	}
-	ctr = 0;
-	while (1) {
-		if (ctr > 10) {
-			DEBUG("unable to find random point on curve for group %d, something's fishy", grp_num);
-			goto fail;
+
+	grp->prime_bits = BN_num_bits(grp->prime);
+	grp->prime_len = BN_num_bytes(grp->prime);
+	if (grp->prime_len > EAP_PWD_MAX_PRIME_LEN) {
+		DEBUG("prime for group %d is too large", grp_num);
+		goto fail;
+	}
+	bn_to_bin_pad(grp->prime, grp->prime_bin, grp->prime_len);
+
+	/*
+	 *	Find a random residue and non-residue, for blinding
+	 *	is_quadratic_residue().  Neither depends on the
+	 *	password, so this doesn't need to be constant time.
+	 */
+	BN_CTX_start(bnctx);
+	r = BN_CTX_get(bnctx);
+	while (r && (BN_is_zero(grp->qr) || BN_is_zero(grp->qnr))) {
+		if (!BN_rand_range(r, grp->prime)) break;
+
+		res = legendre(r, grp, bnctx);
+		if ((res == 1) && BN_is_zero(grp->qr)) {
+			if (!BN_copy(grp->qr, r)) break;
+		} else if ((res == -1) && BN_is_zero(grp->qnr)) {
+			if (!BN_copy(grp->qnr, r)) break;
+		} else if (res == -2) {
+			break;
 		}
-		ctr++;
+	}
+	BN_CTX_end(bnctx);
+
+	if (BN_is_zero(grp->qr) || BN_is_zero(grp->qnr)) {
+		DEBUG("unable to find quadratic residues for group %d", grp_num);
+		goto fail;
+	}
+
+	BN_CTX_free(bnctx);
+	return grp;
 
+fail:
+	BN_CTX_free(bnctx);
+	talloc_free(grp);
+	return NULL;
+}
+
+/** Derive the password element
+ *
+ * The hunting and pecking loop always runs for the same number of
+ * rounds, and the rounds take the same time whether or not they find
+ * a point, so the time taken doesn't say anything about the password.
+ *
+ * Doesn't allocate anything from the session's talloc context, so it
+ * can be run in the offload pool.
+ *
+ * @param[in] session to set the group, prime, order and password element of.
+ * @param[in] grp values for the session's group, from pwd_group_alloc().
+ * @param[in] password for the peer.
+ * @param[in] password_len length of the password.
+ * @param[in] id_server our identity.
+ * @param[in] id_server_len length of our identity.
+ * @param[in] id_peer the peer's identity.
+ * @param[in] id_peer_len length of the peer's identity.
+ * @param[in] token sent in the ID request.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int compute_password_element (pwd_session_t *session, pwd_group_t const *grp,
+			      char const *password, int password_len,
+			      char const *id_server, int id_server_len,
+			      char const *id_peer, int id_peer_len,
+			      uint32_t *token)
+{
+	BIGNUM		*x_candidate = NULL, *y_sqrd = NULL;
+	BN_CTX		*bnctx = NULL;
+	HMAC_CTX	ctx;
+	uint8_t		pwe_digest[SHA256_DIGEST_LENGTH], prfbuf[EAP_PWD_MAX_PRIME_LEN], ctr;
+	uint8_t		x_bin[EAP_PWD_MAX_PRIME_LEN], x_save[EAP_PWD_MAX_PRIME_LEN];
+	unsigned int	found = 0, mask, in_range;
+	int		is_odd, save_is_odd = 0, res, ret = 0;
+
+	session->pwe = NULL;
+	session->order = NULL;
+	session->prime = NULL;
+
+	/*
+	 *	The session gets its own copies, as EC_GROUPs and
+	 *	BIGNUMs can't be shared between threads.  Copying
+	 *	keeps the precomputed values in the EC_GROUP.
+	 */
+	if (((session->group = EC_GROUP_dup(grp->group)) == NULL) ||
+	    ((session->pwe = EC_POINT_new(session->group)) == NULL) ||
+	    ((session->order = BN_dup(grp->order)) == NULL) ||
+	    ((session->prime = BN_dup(grp->prime)) == NULL) ||
+	    ((bnctx = BN_CTX_new()) == NULL) ||
+	    ((x_candidate = BN_new()) == NULL) ||
+	    ((y_sqrd = BN_new()) == NULL)) {
+		DEBUG("unable to create bignums");
+		goto fail;
+	}
+	BN_set_flags(x_candidate, BN_FLG_CONSTTIME);
+	BN_set_flags(y_sqrd, BN_FLG_CONSTTIME);
+
+	memset(x_save, 0, sizeof(x_save));
+
+	for (ctr = 1; ctr <= EAP_PWD_HUNT_AND_PECK_ROUNDS; ctr++) {
 		/*
 		 * compute counter-mode password value and stretch to prime
 		 *    pwd-seed = H(token | peer-id | server-id | password |
@@ -198,11 +493,15 @@ int compute_password_element (pwd_session_t *session, uint16_t grp_num,
 		H_Update(&ctx, (uint8_t *)&ctr, sizeof(ctr));
 		H_Final(&ctx, pwe_digest);
 
-		BN_bin2bn(pwe_digest, SHA256_DIGEST_LENGTH, rnd);
+		/*
+		 * need to unambiguously identify the solution, if there is
+		 * one...
+		 */
+		is_odd = pwe_digest[SHA256_DIGEST_LENGTH - 1] & 0x01;
+
 		eap_pwd_kdf(pwe_digest, SHA256_DIGEST_LENGTH, "EAP-pwd Hunting And Pecking",
-			    strlen("EAP-pwd Hunting And Pecking"), prfbuf, primebitlen);
+			    strlen("EAP-pwd Hunting And Pecking"), prfbuf, grp->prime_bits);
 
-		BN_bin2bn(prfbuf, primebytelen, x_candidate);
 		/*
 		 * eap_pwd_kdf() returns a string of bits 0..primebitlen but
 		 * BN_bin2bn will treat that string of bits as a big endian
@@ -210,62 +509,85 @@ int compute_password_element (pwd_session_t *session, uint16_t grp_num,
 		 * then excessive bits-- those _after_ primebitlen-- so now
 		 * we have to shift right the amount we masked off.
 		 */
-		if (primebitlen % 8) BN_rshift(x_candidate, x_candidate, (8 - (primebitlen % 8)));
-		if (BN_ucmp(x_candidate, session->prime) >= 0) continue;
+		BN_bin2bn(prfbuf, grp->prime_len, x_candidate);
+		if (grp->prime_bits % 8) BN_rshift(x_candidate, x_candidate, (8 - (grp->prime_bits % 8)));
+		bn_to_bin_pad(x_candidate, x_bin, grp->prime_len);
 
 		/*
-		 * need to unambiguously identify the solution, if there is
-		 * one...
+		 * candidates which aren't less than the prime are skipped,
+		 * but the rest of the round is still done.
 		 */
-		is_odd = BN_is_odd(rnd) ? 1 : 0;
+		in_range = const_time_lt_bin(x_bin, grp->prime_bin, grp->prime_len);
 
 		/*
 		 * solve the quadratic equation, if it's not solvable then we
 		 * don't have a point
 		 */
-		if (!EC_POINT_set_compressed_coordinates_GFp(session->group, session->pwe, x_candidate, is_odd, NULL)) {
-			continue;
-		}
+		if (do_equation(grp, y_sqrd, x_candidate, bnctx) < 0) goto fail;
+
+		res = is_quadratic_residue(y_sqrd, grp, bnctx);
+		if (res < 0) goto fail;
 
 		/*
-		 * If there's a solution to the equation then the point must be
-		 * on the curve so why check again explicitly? OpenSSL code
-		 * says this is required by X9.62. We're not X9.62 but it can't
-		 * hurt just to be sure.
+		 * keep the first candidate which works
 		 */
-		if (!EC_POINT_is_on_curve(session->group, session->pwe, NULL)) {
-			DEBUG("EAP-pwd: point is not on curve");
-			continue;
+		mask = in_range & ~const_time_is_zero(res) & ~found;
+		const_time_select_bin(mask, x_bin, x_save, grp->prime_len, x_save);
+		save_is_odd = const_time_select_int(mask, is_odd, save_is_odd);
+		found |= mask;
+	}
+
+	memset(prfbuf, 0, sizeof(prfbuf));
+	memset(x_bin, 0, sizeof(x_bin));
+	memset(pwe_digest, 0, sizeof(pwe_digest));
+
+	if (!found) {
+		DEBUG("unable to find random point on curve for group %d, something's fishy", grp->num);
+		goto fail;
+	}
+
+	BN_bin2bn(x_save, grp->prime_len, x_candidate);
+	if (!EC_POINT_set_compressed_coordinates_GFp(session->group, session->pwe, x_candidate, save_is_odd, bnctx)) {
+		DEBUG("EAP-pwd: unable to set point coordinates");
+		goto fail;
+	}
+
+	/*
+	 * If there's a solution to the equation then the point must be
+	 * on the curve so why check again explicitly? OpenSSL code
+	 * says this is required by X9.62. We're not X9.62 but it can't
+	 * hurt just to be sure.
+	 */
+	if (!EC_POINT_is_on_curve(session->group, session->pwe, bnctx)) {
+		DEBUG("EAP-pwd: point is not on curve");
+		goto fail;
+	}
+
+	if (BN_cmp(grp->cofactor, BN_value_one())) {
+		/* make sure the point is not in a small sub-group */
+		if (!EC_POINT_mul(session->group, session->pwe, NULL, session->pwe,
+				  grp->cofactor, bnctx)) {
+			DEBUG("EAP-pwd: cannot multiply generator by order");
+			goto fail;
 		}
 
-		if (BN_cmp(cofactor, BN_value_one())) {
-			/* make sure the point is not in a small sub-group */
-			if (!EC_POINT_mul(session->group, session->pwe, NULL, session->pwe,
-				cofactor, NULL)) {
-				DEBUG("EAP-pwd: cannot multiply generator by order");
-				continue;
-			}
-
-			if (EC_POINT_is_at_infinity(session->group, session->pwe)) {
-				DEBUG("EAP-pwd: point is at infinity");
-				continue;
-			}
+		if (EC_POINT_is_at_infinity(session->group, session->pwe)) {
+			DEBUG("EAP-pwd: point is at infinity");
+			goto fail;
 		}
-		/* if we got here then we have a new generator. */
-		break;
 	}
 
-	session->group_num = grp_num;
+	session->group_num = grp->num;
 	if (0) {
 		fail:		/* DON'T free session, it's in eap_session->opaque */
 		ret = -1;
 	}
 
 	/* cleanliness and order.... */
-	BN_clear_free(cofactor);
+	memset(x_save, 0, sizeof(x_save));
 	BN_clear_free(x_candidate);
-	BN_clear_free(rnd);
-	talloc_free(prfbuf);
+	BN_clear_free(y_sqrd);
+	BN_CTX_free(bnctx);
 
 	return ret;
 }
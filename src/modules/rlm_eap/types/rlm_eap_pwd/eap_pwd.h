@@ -73,6 +73,33 @@ typedef struct _pwd_id_packet {
     char identity[];
 } CC_HINT(packed) pwd_id_packet_t;
 
+/*
+ *	Enough for the largest supported prime, P-521.
+ */
+#define EAP_PWD_MAX_PRIME_LEN		66
+
+/*
+ *	The hunting and pecking loop always runs this many times.
+ */
+#define EAP_PWD_HUNT_AND_PECK_ROUNDS	40
+
+/*
+ *	Values which depend only on the group.
+ */
+typedef struct _pwd_group_t {
+    uint16_t num;
+    EC_GROUP *group;
+    BIGNUM *prime;
+    BIGNUM *order;
+    BIGNUM *cofactor;
+    BIGNUM *qr;			/* a quadratic residue mod prime */
+    BIGNUM *qnr;		/* a quadratic non-residue mod prime */
+    BN_MONT_CTX *mont;		/* for exponentiation mod prime */
+    int prime_bits;
+    int prime_len;
+    uint8_t prime_bin[EAP_PWD_MAX_PRIME_LEN];
+} pwd_group_t;
+
 typedef struct _pwd_session_t {
     uint16_t state;
 #define PWD_STATE_ID_REQ		1
@@ -103,7 +130,8 @@ typedef struct _pwd_session_t {
     uint8_t my_confirm[SHA256_DIGEST_LENGTH];
 } pwd_session_t;
 
-int compute_password_element(pwd_session_t *sess, uint16_t grp_num,
+pwd_group_t *pwd_group_alloc(TALLOC_CTX *ctx, uint16_t grp_num);
+int compute_password_element(pwd_session_t *sess, pwd_group_t const *grp,
 			     char const *password, int password_len,
 			     char const *id_server, int id_server_len,
 			     char const *id_peer, int id_peer_len,
@@ -46,6 +46,7 @@ static CONF_PARSER pwd_module_config[] = {
 	{ FR_CONF_OFFSET("fragment_size", PW_TYPE_INTEGER, eap_pwd_t, fragment_size), .dflt = "1020" },
 	{ FR_CONF_OFFSET("server_id", PW_TYPE_STRING, eap_pwd_t, server_id) },
 	{ FR_CONF_OFFSET("virtual_server", PW_TYPE_STRING, eap_pwd_t, virtual_server) },
+	{ FR_CONF_OFFSET("group_cache", PW_TYPE_BOOLEAN, eap_pwd_t, group_cache), .dflt = "yes" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -79,6 +80,19 @@ static int mod_instantiate (CONF_SECTION *cs, void **instance)
 		return -1;
 	}
 
+	/*
+	 *	The curve, its parameters and the Montgomery context
+	 *	for the prime are the same for every session, so build
+	 *	them once, instead of on every handshake.
+	 */
+	if (inst->group_cache) {
+		inst->grp = pwd_group_alloc(inst, inst->group);
+		if (!inst->grp) {
+			cf_log_err_cs(cs, "Failed precomputing values for group %u", inst->group);
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -98,6 +112,34 @@ static int _free_pwd_session (pwd_session_t *session)
 	return 0;
 }
 
+typedef struct pwd_pwe_job_t {
+	pwd_session_t		*session;
+	pwd_group_t const	*grp;		//!< Cached group, or NULL to build one.
+	char const		*password;
+	char const		*server_id;
+} pwd_pwe_job_t;
+
+static int pwd_pwe_offload(void *uctx)
+{
+	pwd_pwe_job_t	*job = uctx;
+	pwd_group_t	*grp = NULL;
+	int		ret;
+
+	if (!job->grp) {
+		grp = pwd_group_alloc(NULL, job->session->group_num);
+		if (!grp) return -1;
+	}
+
+	ret = compute_password_element(job->session, grp ? grp : job->grp,
+				       job->password, strlen(job->password),
+				       job->server_id, strlen(job->server_id),
+				       job->session->peer_id, strlen(job->session->peer_id),
+				       &job->session->token);
+	talloc_free(grp);
+
+	return ret;
+}
+
 static int send_pwd_request (pwd_session_t *session, eap_round_t *eap_round)
 {
 	size_t len;
@@ -281,6 +323,8 @@ static int mod_process(void *arg, eap_session_t *eap_session)
 	uint8_t exch, *in, *ptr, msk[MSK_EMSK_LEN], emsk[MSK_EMSK_LEN];
 	uint8_t peer_confirm[SHA256_DIGEST_LENGTH];
 	BIGNUM *x = NULL, *y = NULL;
+	pwd_pwe_job_t job;
+	int rcode;
 
 	if (((eap_round = eap_session->this_round) == NULL) || !inst) return 0;
 
@@ -479,11 +523,17 @@ static int mod_process(void *arg, eap_session_t *eap_session)
 			return 0;
 		}
 
-		if (compute_password_element(session, session->group_num,
-					     pw->data.strvalue, strlen(pw->data.strvalue),
-					     inst->server_id, strlen(inst->server_id),
-					     session->peer_id, strlen(session->peer_id),
-					     &session->token)) {
+		/*
+		 *	Hunting and pecking is expensive, so run it in
+		 *	the offload pool (if there is one), instead of
+		 *	tying up a CPU which could be processing other
+		 *	requests.
+		 */
+		job.session = session;
+		job.grp = inst->grp;
+		job.password = pw->vp_strvalue;
+		job.server_id = inst->server_id;
+		if ((thread_pool_offload(request, pwd_pwe_offload, &job, &rcode) < 0) || (rcode != 0)) {
 			DEBUG2("failed to obtain password element");
 			talloc_free(fake);
 			return 0;
@@ -46,6 +46,9 @@ typedef struct _eap_pwd_t {
     uint32_t	fragment_size;
     char const	*server_id;
     char const	*virtual_server;
+
+    bool	group_cache;
+    pwd_group_t	*grp;		/* built at startup if group_cache is set */
 } eap_pwd_t;
 
 #endif  /* _RLM_EAP_PWD_H */
@@ -43,6 +43,526 @@ typedef struct eap_sim_server_state {
 	int  sim_id;
 } eap_sim_state_t;
 
+/*
+ *	Vector cache.
+ *
+ *	When 'vector_cache' has a virtual server, and the request has
+ *	no Ki or triplets of its own, triplets are taken from a cache
+ *	of unused ones for the subscriber.  The virtual server is run
+ *	with the subscriber's identity as the User-Name, and should
+ *	add control:EAP-SIM-RAND1..3, SRES1..3 and KC1..3, as many
+ *	times as the backend returns vectors.
+ *
+ *	A thread keeps 'vectors' unused triplets for each subscriber
+ *	which has authenticated in the last 'lifetime' seconds, so
+ *	the backend is only queried on the authentication path the
+ *	first time a subscriber is seen, or if it runs out.  Triplets
+ *	are only ever handed out once.
+ */
+#define VECTOR_CACHE_RETRY	(5)		//!< Seconds to wait after a failed fetch.
+
+typedef struct eap_sim_vector {
+	uint8_t			rand[EAPSIM_RAND_SIZE];
+	uint8_t			sres[EAPSIM_SRES_SIZE];
+	uint8_t			kc[EAPSIM_KC_SIZE];
+} eap_sim_vector_t;
+
+typedef struct eap_sim_subscriber eap_sim_subscriber_t;
+struct eap_sim_subscriber {
+	eap_sim_subscriber_t	*prev;
+	eap_sim_subscriber_t	*next;
+	char const		*identity;
+	eap_sim_vector_t	*vectors;	//!< Unused triplets, oldest first.
+	uint32_t		num_vectors;
+	time_t			last_used;	//!< When triplets were last taken.
+	time_t			retry;		//!< Don't fetch before this time.
+	bool			fetching;	//!< The thread is fetching triplets.
+};
+
+typedef struct rlm_eap_sim rlm_eap_sim_t;
+
+typedef struct eap_sim_vector_cache {
+	rlm_eap_sim_t const	*inst;
+	fr_hash_table_t		*ht;		//!< Subscribers, by identity.
+	eap_sim_subscriber_t	*head;		//!< Least recently used.
+	eap_sim_subscriber_t	*tail;		//!< Most recently used.
+	uint32_t		num_entries;
+	uint32_t		max_vectors;	//!< Space for triplets in each entry.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	bool			running;	//!< Whether the prefetch thread was started.
+	bool			stop;		//!< Tell the prefetch thread to exit.
+	pthread_t		thread;
+#endif
+} eap_sim_vector_cache_t;
+
+#ifdef HAVE_PTHREAD_H
+#  define VECTOR_CACHE_LOCK(_cache)	pthread_mutex_lock(&(_cache)->mutex)
+#  define VECTOR_CACHE_UNLOCK(_cache)	pthread_mutex_unlock(&(_cache)->mutex)
+#  define VECTOR_CACHE_SIGNAL(_cache)	pthread_cond_signal(&(_cache)->cond)
+#else
+#  define VECTOR_CACHE_LOCK(_cache)
+#  define VECTOR_CACHE_UNLOCK(_cache)
+#  define VECTOR_CACHE_SIGNAL(_cache)
+#endif
+
+struct rlm_eap_sim {
+	char const		*virtual_server;	//!< Fetches triplets for the vector cache.
+	uint32_t		vectors;		//!< Unused triplets to keep for each subscriber.
+	uint32_t		lifetime;		//!< Forget subscribers which are idle for this long.
+	uint32_t		max_entries;		//!< Maximum number of subscribers to cache.
+
+	eap_sim_vector_cache_t	*cache;
+};
+
+static CONF_PARSER vector_cache_config[] = {
+	{ FR_CONF_OFFSET("virtual_server", PW_TYPE_STRING, rlm_eap_sim_t, virtual_server) },
+	{ FR_CONF_OFFSET("vectors", PW_TYPE_INTEGER, rlm_eap_sim_t, vectors), .dflt = "6" },
+	{ FR_CONF_OFFSET("lifetime", PW_TYPE_INTEGER, rlm_eap_sim_t, lifetime), .dflt = "3600" },
+	{ FR_CONF_OFFSET("max_entries", PW_TYPE_INTEGER, rlm_eap_sim_t, max_entries), .dflt = "16384" },
+	CONF_PARSER_TERMINATOR
+};
+
+static CONF_PARSER submodule_config[] = {
+	{ FR_CONF_POINTER("vector_cache", PW_TYPE_SUBSECTION, NULL), .dflt = (void const *) vector_cache_config },
+	CONF_PARSER_TERMINATOR
+};
+
+static uint32_t vector_cache_entry_hash(void const *data)
+{
+	eap_sim_subscriber_t const *entry = data;
+
+	return fr_hash_string(entry->identity);
+}
+
+static int vector_cache_entry_cmp(void const *one, void const *two)
+{
+	eap_sim_subscriber_t const *a = one, *b = two;
+
+	return strcmp(a->identity, b->identity);
+}
+
+static int _vector_cache_entry_free(eap_sim_subscriber_t *entry)
+{
+	memset(entry->vectors, 0, talloc_array_length(entry->vectors) * sizeof(entry->vectors[0]));
+
+	return 0;
+}
+
+static void vector_cache_unlink(eap_sim_vector_cache_t *cache, eap_sim_subscriber_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+	entry->prev = entry->next = NULL;
+}
+
+static void vector_cache_link(eap_sim_vector_cache_t *cache, eap_sim_subscriber_t *entry)
+{
+	entry->prev = cache->tail;
+	if (cache->tail) {
+		cache->tail->next = entry;
+	} else {
+		cache->head = entry;
+	}
+	cache->tail = entry;
+}
+
+/** Remove a subscriber from the vector cache and free it
+ *
+ * @note Must be called with the cache locked.
+ */
+static void vector_cache_entry_free(eap_sim_vector_cache_t *cache, eap_sim_subscriber_t *entry)
+{
+	vector_cache_unlink(cache, entry);
+	fr_hash_table_delete(cache->ht, entry);
+	cache->num_entries--;
+
+	talloc_free(entry);
+}
+
+/** Find a subscriber, adding them if they're not in the cache
+ *
+ * @note Must be called with the cache locked.
+ */
+static eap_sim_subscriber_t *vector_cache_entry_find(eap_sim_vector_cache_t *cache, char const *identity)
+{
+	eap_sim_subscriber_t	*entry, find;
+
+	find.identity = identity;
+	entry = fr_hash_table_finddata(cache->ht, &find);
+	if (entry) return entry;
+
+	if (cache->num_entries >= cache->inst->max_entries) {
+		if (!cache->head || cache->head->fetching) return NULL;
+		vector_cache_entry_free(cache, cache->head);
+	}
+
+	entry = talloc_zero(cache, eap_sim_subscriber_t);
+	if (!entry) return NULL;
+	talloc_set_destructor(entry, _vector_cache_entry_free);
+
+	entry->identity = talloc_typed_strdup(entry, identity);
+	entry->vectors = talloc_zero_array(entry, eap_sim_vector_t, cache->max_vectors);
+	if (!entry->identity || !entry->vectors || !fr_hash_table_insert(cache->ht, entry)) {
+		talloc_free(entry);
+		return NULL;
+	}
+	vector_cache_link(cache, entry);
+	cache->num_entries++;
+
+	return entry;
+}
+
+/** Add fetched triplets to the end of a subscriber's list
+ *
+ * @note Must be called with the cache locked.
+ */
+static void vector_cache_entry_add(eap_sim_vector_cache_t *cache, eap_sim_subscriber_t *entry,
+				   eap_sim_vector_t const *vectors, uint32_t num)
+{
+	if (num > (cache->max_vectors - entry->num_vectors)) num = cache->max_vectors - entry->num_vectors;
+
+	memcpy(entry->vectors + entry->num_vectors, vectors, num * sizeof(vectors[0]));
+	entry->num_vectors += num;
+}
+
+/** Run the vector cache's virtual server, and read the triplets it returns
+ *
+ * @param[in] inst of rlm_eap_sim.
+ * @param[in] request to run the virtual server with.
+ * @param[in] identity of the subscriber.
+ * @param[out] out where to write the triplets.
+ * @param[in] max number of triplets to write.
+ * @return the number of triplets written.
+ */
+static uint32_t vector_cache_fetch(rlm_eap_sim_t const *inst, REQUEST *request, char const *identity,
+				   eap_sim_vector_t *out, uint32_t max)
+{
+	VALUE_PAIR	*vp;
+	uint32_t	num = 0;
+	int		i;
+
+	request->server = inst->virtual_server;
+	request->module = "eap_sim";
+
+	vp = fr_pair_afrom_num(request->packet, 0, PW_USER_NAME);
+	if (!vp) return 0;
+	fr_pair_value_strcpy(vp, identity);
+	fr_pair_replace(&request->packet->vps, vp);
+	request->username = vp;
+
+	RDEBUG2("Fetching triplets for \"%s\" from server %s", identity, inst->virtual_server);
+	RINDENT();
+	process_authorize(0, request);
+	REXDENT();
+
+	for (i = 0; i < 3; i++) {
+		vp_cursor_t	rand_c, sres_c, kc_c;
+		VALUE_PAIR	*rand, *sres, *kc;
+
+		fr_cursor_init(&rand_c, &request->config);
+		fr_cursor_init(&sres_c, &request->config);
+		fr_cursor_init(&kc_c, &request->config);
+
+		while ((num < max) &&
+		       (rand = fr_cursor_next_by_num(&rand_c, 0, PW_EAP_SIM_RAND1 + i, TAG_ANY)) &&
+		       (sres = fr_cursor_next_by_num(&sres_c, 0, PW_EAP_SIM_SRES1 + i, TAG_ANY)) &&
+		       (kc = fr_cursor_next_by_num(&kc_c, 0, PW_EAP_SIM_KC1 + i, TAG_ANY))) {
+			if ((rand->vp_length != EAPSIM_RAND_SIZE) || (sres->vp_length != EAPSIM_SRES_SIZE) ||
+			    (kc->vp_length != EAPSIM_KC_SIZE)) {
+				RWDEBUG("Ignoring triplet with invalid RAND, SRES or Kc length");
+				continue;
+			}
+
+			memcpy(out[num].rand, rand->vp_octets, EAPSIM_RAND_SIZE);
+			memcpy(out[num].sres, sres->vp_octets, EAPSIM_SRES_SIZE);
+			memcpy(out[num].kc, kc->vp_octets, EAPSIM_KC_SIZE);
+			num++;
+		}
+	}
+
+	RDEBUG2("Got %u triplets", num);
+
+	return num;
+}
+
+/** Take three triplets for a subscriber, fetching them if none are cached
+ *
+ * @param[in] inst of rlm_eap_sim.
+ * @param[in] eap_session being started.
+ * @param[in] ess to write the triplets to.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int vector_cache_get(rlm_eap_sim_t const *inst, eap_session_t *eap_session, eap_sim_state_t *ess)
+{
+	eap_sim_vector_cache_t	*cache = inst->cache;
+	REQUEST			*request = eap_session->request;
+	REQUEST			*fake;
+	eap_sim_subscriber_t	*entry;
+	eap_sim_vector_t	*vectors = NULL;
+	uint32_t		num, i;
+	int			ret = -1;
+
+	if (!eap_session->identity) {
+		REDEBUG("No identity to look up triplets for");
+		return -1;
+	}
+
+	VECTOR_CACHE_LOCK(cache);
+	entry = vector_cache_entry_find(cache, eap_session->identity);
+	if (entry && (entry->num_vectors >= 3)) {
+		for (i = 0; i < 3; i++) {
+			memcpy(ess->keys.rand[i], entry->vectors[i].rand, EAPSIM_RAND_SIZE);
+			memcpy(ess->keys.sres[i], entry->vectors[i].sres, EAPSIM_SRES_SIZE);
+			memcpy(ess->keys.Kc[i], entry->vectors[i].kc, EAPSIM_KC_SIZE);
+		}
+
+		/*
+		 *	Triplets must never be used twice.
+		 */
+		entry->num_vectors -= 3;
+		memmove(entry->vectors, entry->vectors + 3, entry->num_vectors * sizeof(entry->vectors[0]));
+		memset(entry->vectors + entry->num_vectors, 0, 3 * sizeof(entry->vectors[0]));
+
+		entry->last_used = time(NULL);
+		vector_cache_unlink(cache, entry);
+		vector_cache_link(cache, entry);
+
+		RDEBUG2("Using cached triplets for \"%s\", %u left", eap_session->identity, entry->num_vectors);
+		if (entry->num_vectors < inst->vectors) VECTOR_CACHE_SIGNAL(cache);
+		VECTOR_CACHE_UNLOCK(cache);
+
+		return 0;
+	}
+	if (entry) {
+		entry->last_used = time(NULL);
+		entry->retry = entry->last_used + VECTOR_CACHE_RETRY;	/* we're fetching now */
+	}
+	VECTOR_CACHE_UNLOCK(cache);
+
+	/*
+	 *	Nothing cached, so we have to ask the backend now.
+	 *	Anything more than we need goes into the cache.
+	 */
+	RDEBUG2("No cached triplets for \"%s\"", eap_session->identity);
+
+	fake = request_alloc_fake(request);
+	if (!fake) return -1;
+
+	vectors = talloc_zero_array(fake, eap_sim_vector_t, cache->max_vectors + 3);
+	if (!vectors) goto finish;
+
+	num = vector_cache_fetch(inst, fake, eap_session->identity, vectors, cache->max_vectors + 3);
+	if (num < 3) {
+		REDEBUG("Need 3 triplets for \"%s\", server %s returned %u", eap_session->identity,
+			inst->virtual_server, num);
+		goto finish;
+	}
+
+	for (i = 0; i < 3; i++) {
+		memcpy(ess->keys.rand[i], vectors[i].rand, EAPSIM_RAND_SIZE);
+		memcpy(ess->keys.sres[i], vectors[i].sres, EAPSIM_SRES_SIZE);
+		memcpy(ess->keys.Kc[i], vectors[i].kc, EAPSIM_KC_SIZE);
+	}
+
+	VECTOR_CACHE_LOCK(cache);
+	entry = vector_cache_entry_find(cache, eap_session->identity);
+	if (entry) {
+		entry->last_used = time(NULL);
+		entry->retry = 0;
+		vector_cache_entry_add(cache, entry, vectors + 3, num - 3);
+		if (entry->num_vectors < inst->vectors) VECTOR_CACHE_SIGNAL(cache);
+	}
+	VECTOR_CACHE_UNLOCK(cache);
+
+	ret = 0;
+
+finish:
+	if (vectors) memset(vectors, 0, talloc_array_length(vectors) * sizeof(vectors[0]));
+	talloc_free(fake);
+
+	return ret;
+}
+
+#ifdef HAVE_PTHREAD_H
+/** Keep each active subscriber topped up with triplets
+ *
+ * Runs until the cache is freed.  The backend is queried with the cache
+ * unlocked, so authentications are never blocked behind a slow backend.
+ */
+static void *vector_cache_thread(void *arg)
+{
+	eap_sim_vector_cache_t	*cache = arg;
+	rlm_eap_sim_t const	*inst = cache->inst;
+	eap_sim_subscriber_t	*entry, *next;
+	struct timespec		wait;
+	time_t			now;
+
+	pthread_mutex_lock(&cache->mutex);
+	while (!cache->stop) {
+		wait.tv_sec = time(NULL) + 1;
+		wait.tv_nsec = 0;
+		pthread_cond_timedwait(&cache->cond, &cache->mutex, &wait);
+
+	again:
+		if (cache->stop) break;
+
+		now = time(NULL);
+		for (entry = cache->head; entry; entry = next) {
+			REQUEST			*request;
+			eap_sim_vector_t	*vectors = NULL;
+			char			*identity;
+			uint32_t		num = 0;
+
+			next = entry->next;
+
+			if (entry->fetching) continue;
+
+			if ((entry->last_used + (time_t) inst->lifetime) <= now) {
+				vector_cache_entry_free(cache, entry);
+				continue;
+			}
+
+			if ((entry->num_vectors >= inst->vectors) || (entry->retry > now)) continue;
+
+			/*
+			 *	If the backend doesn't return enough,
+			 *	we try again later.
+			 */
+			entry->retry = now + VECTOR_CACHE_RETRY;
+			entry->fetching = true;
+			identity = talloc_typed_strdup(NULL, entry->identity);
+			pthread_mutex_unlock(&cache->mutex);
+
+			request = request_alloc(NULL);
+			if (request && identity) {
+				request->packet = fr_radius_alloc(request, false);
+				request->reply = fr_radius_alloc(request, false);
+				vectors = talloc_zero_array(request, eap_sim_vector_t, cache->max_vectors);
+
+				if (request->packet && request->reply && vectors) {
+					num = vector_cache_fetch(inst, request, identity, vectors, cache->max_vectors);
+				}
+			}
+
+			/*
+			 *	The entry may have been freed while the
+			 *	cache was unlocked, so look it up again.
+			 */
+			pthread_mutex_lock(&cache->mutex);
+			if (identity) {
+				eap_sim_subscriber_t find;
+
+				find.identity = identity;
+				entry = fr_hash_table_finddata(cache->ht, &find);
+				if (entry) {
+					entry->fetching = false;
+					vector_cache_entry_add(cache, entry, vectors, num);
+				}
+			}
+
+			if (vectors) memset(vectors, 0, talloc_array_length(vectors) * sizeof(vectors[0]));
+			talloc_free(request);
+			talloc_free(identity);
+
+			/*
+			 *	The list may have changed while it was
+			 *	unlocked, so start again from the top.
+			 *	Entries we've already tried are skipped,
+			 *	as their retry time is in the future.
+			 */
+			goto again;
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return NULL;
+}
+#endif
+
+static int _vector_cache_free(eap_sim_vector_cache_t *cache)
+{
+#ifdef HAVE_PTHREAD_H
+	if (cache->running) {
+		pthread_mutex_lock(&cache->mutex);
+		cache->stop = true;
+		pthread_cond_signal(&cache->cond);
+		pthread_mutex_unlock(&cache->mutex);
+
+		pthread_join(cache->thread, NULL);
+	}
+#endif
+
+	while (cache->head) vector_cache_entry_free(cache, cache->head);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_destroy(&cache->cond);
+	pthread_mutex_destroy(&cache->mutex);
+#endif
+
+	return 0;
+}
+
+/** Allocate the vector cache, and start its prefetch thread
+ *
+ * @param[in] inst to allocate the cache for.
+ * @return
+ *	- The new cache.
+ *	- NULL on error.
+ */
+static eap_sim_vector_cache_t *vector_cache_alloc(rlm_eap_sim_t *inst)
+{
+	eap_sim_vector_cache_t *cache;
+
+	cache = talloc_zero(inst, eap_sim_vector_cache_t);
+	if (!cache) return NULL;
+
+	cache->inst = inst;
+	cache->max_vectors = inst->vectors * 2;
+	cache->ht = fr_hash_table_create(cache, vector_cache_entry_hash, vector_cache_entry_cmp, NULL);
+	if (!cache->ht) {
+		talloc_free(cache);
+		return NULL;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+		talloc_free(cache);
+		return NULL;
+	}
+
+	if (pthread_cond_init(&cache->cond, NULL) != 0) {
+		pthread_mutex_destroy(&cache->mutex);
+		talloc_free(cache);
+		return NULL;
+	}
+#endif
+	talloc_set_destructor(cache, _vector_cache_free);
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_create(&cache->thread, NULL, vector_cache_thread, cache) != 0) {
+		ERROR("rlm_eap_sim: Failed starting vector cache thread: %s", fr_syserror(errno));
+		talloc_free(cache);
+		return NULL;
+	}
+	cache->running = true;
+#endif
+
+	return cache;
+}
+
 /*
  *	build a reply to be sent.
  */
@@ -451,8 +971,9 @@ static int CC_HINT(nonnull) mod_process(void *instance, eap_session_t *eap_sessi
  *	Initiate the EAP-SIM session by starting the state machine
  *      and initiating the state.
  */
-static int mod_session_init(UNUSED void *instance, eap_session_t *eap_session)
+static int mod_session_init(void *instance, eap_session_t *eap_session)
 {
+	rlm_eap_sim_t *inst = instance;
 	REQUEST *request = eap_session->request;
 	eap_sim_state_t *ess;
 	time_t n;
@@ -466,12 +987,22 @@ static int mod_session_init(UNUSED void *instance, eap_session_t *eap_session)
 	eap_session->opaque = ess;
 
 	/*
-	 *	Save the keying material, because it could change on a subsequent retrieval.
+	 *	Triplets or a Ki from the request take precedence over
+	 *	the vector cache.
 	 */
-	if (!eap_sim_get_challenge(eap_session, request->config, 0, ess) ||
-	    !eap_sim_get_challenge(eap_session, request->config, 1, ess) ||
-	    !eap_sim_get_challenge(eap_session, request->config, 2, ess)) {
-		return 0;
+	if (inst->cache &&
+	    !fr_pair_find_by_num(request->config, 0, PW_EAP_SIM_KI, TAG_ANY) &&
+	    !fr_pair_find_by_num(request->config, 0, PW_EAP_SIM_RAND1, TAG_ANY)) {
+		if (vector_cache_get(inst, eap_session, ess) < 0) return 0;
+	} else {
+		/*
+		 *	Save the keying material, because it could change on a subsequent retrieval.
+		 */
+		if (!eap_sim_get_challenge(eap_session, request->config, 0, ess) ||
+		    !eap_sim_get_challenge(eap_session, request->config, 1, ess) ||
+		    !eap_sim_get_challenge(eap_session, request->config, 2, ess)) {
+			return 0;
+		}
 	}
 
 	/*
@@ -682,6 +1213,44 @@ static int mod_process(UNUSED void *arg, eap_session_t *eap_session)
 	return 0;
 }
 
+/*
+ *	Attach the module.
+ */
+static int mod_instantiate(CONF_SECTION *cs, void **instance)
+{
+	rlm_eap_sim_t *inst;
+
+	*instance = inst = talloc_zero(cs, rlm_eap_sim_t);
+	if (!inst) return -1;
+
+	if (cf_section_parse(cs, inst, submodule_config) < 0) return -1;
+
+	if (!inst->virtual_server) return 0;
+
+	if (!cf_section_sub_find_name2(main_config.config, "server", inst->virtual_server)) {
+		cf_log_err_cs(cs, "Unknown virtual server '%s' in vector_cache", inst->virtual_server);
+		return -1;
+	}
+
+	if (inst->vectors < 3) {
+		cf_log_err_cs(cs, "vector_cache 'vectors' must be at least 3");
+		return -1;
+	}
+
+	if (!inst->max_entries) {
+		cf_log_err_cs(cs, "vector_cache 'max_entries' must be greater than 0");
+		return -1;
+	}
+
+	inst->cache = vector_cache_alloc(inst);
+	if (!inst->cache) {
+		cf_log_err_cs(cs, "Failed creating vector cache");
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -689,6 +1258,7 @@ static int mod_process(UNUSED void *arg, eap_session_t *eap_session)
 extern rlm_eap_module_t rlm_eap_sim;
 rlm_eap_module_t rlm_eap_sim = {
 	.name		= "eap_sim",
+	.instantiate	= mod_instantiate,	/* Create new submodule instance */
 	.session_init	= mod_session_init,	/* Initialise a new EAP session */
 	.process	= mod_process,		/* Process next round of EAP method */
 };
@@ -167,7 +167,7 @@ static int CC_HINT(nonnull) mod_process(void *type_arg, eap_session_t *eap_sessi
 			fake = request_alloc_fake(request);
 			rad_assert(!fake->packet->vps);
 
-			fake->packet->vps = fr_pair_list_copy(fake->packet, request->packet->vps);
+			fake->packet->vps = fr_pair_list_copy_ref(fake->packet, request->packet->vps);
 
 			/* set the virtual server to use */
 			if ((vp = fr_pair_find_by_num(request->config, 0, PW_VIRTUAL_SERVER, TAG_ANY)) != NULL) {
@@ -44,6 +44,8 @@ typedef struct rlm_exec_t {
 	unsigned int	packet_code;
 	bool		shell_escape;
 	uint32_t	timeout;
+	uint32_t	helpers;		//!< Number of persistent copies of program to run.
+	exec_helper_pool_t *helper_pool;	//!< Persistent copies of program.
 } rlm_exec_t;
 
 /*
@@ -63,6 +65,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("packet_type", PW_TYPE_STRING, rlm_exec_t, packet_type) },
 	{ FR_CONF_OFFSET("shell_escape", PW_TYPE_BOOLEAN, rlm_exec_t, shell_escape), .dflt = "yes" },
 	{ FR_CONF_OFFSET("timeout", PW_TYPE_INTEGER, rlm_exec_t, timeout) },
+	{ FR_CONF_OFFSET("helpers", PW_TYPE_INTEGER, rlm_exec_t, helpers), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -150,6 +153,72 @@ static rlm_rcode_t rlm_exec_status2rcode(REQUEST *request, char *answer, size_t
 	return status;
 }
 
+/** Pass a request to a persistent copy of the program
+ *
+ * The input pairs are written one per line, followed by an empty line.
+ * The helper replies with its status code (as it would exit with) on
+ * the first line, then any output, then an empty line.
+ *
+ * @return the status code, or -1 on failure.
+ */
+static int rlm_exec_helper(rlm_exec_t const *inst, REQUEST *request, char *out, size_t outlen,
+			   TALLOC_CTX *ctx, VALUE_PAIR **output_pairs, VALUE_PAIR *input_pairs)
+{
+	char		buffer[4096];
+	char		answer[4096];
+	char		*p, *line, *next;
+	size_t		len = 0;
+	int		status;
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+
+	*out = '\0';
+
+	for (vp = fr_cursor_init(&cursor, &input_pairs);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		len += fr_pair_snprint(buffer + len, sizeof(buffer) - len, vp);
+		if (len >= (sizeof(buffer) - 2)) {
+			REDEBUG("Too many input pairs for helper");
+			return -1;
+		}
+		buffer[len++] = '\n';
+	}
+	buffer[len++] = '\n';
+
+	if (exec_helper_request(inst->helper_pool, request, answer, sizeof(answer), buffer, len) < 0) return -1;
+
+	status = strtol(answer, &p, 10);
+	if ((p == answer) || ((*p != '\0') && (*p != '\n'))) {
+		REDEBUG("Invalid status code from helper: %s", answer);
+		return -1;
+	}
+	if (*p) p++;
+
+	if (output_pairs) {
+		for (line = p; *line; line = next) {
+			next = strchr(line, '\n');
+			if (next) {
+				*next++ = '\0';
+			} else {
+				next = line + strlen(line);
+			}
+
+			if (fr_pair_list_afrom_str(ctx, line, output_pairs) == T_INVALID) {
+				RERROR("Failed parsing output from helper: %s", fr_strerror());
+				strlcpy(out, line, outlen);
+				return -1;
+			}
+		}
+	} else {
+		strlcpy(out, p, outlen);
+	}
+
+	RDEBUG2("Helper returned code (%d)", status);
+
+	return status;
+}
+
 /*
  *	Do xlat of strings.
  */
@@ -275,6 +344,29 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	if (inst->helpers && (!inst->wait || !inst->program)) {
+		cf_log_err_cs(conf, "'helpers' requires 'program' to be set, and 'wait = yes'");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_exec_t	*inst = instance;
+
+	if (!inst->helpers) return 0;
+
+	/*
+	 *	Responses are terminated by an empty line
+	 */
+	inst->helper_pool = exec_helper_pool_alloc(inst, inst->program, inst->helpers, "", inst->timeout);
+	if (!inst->helper_pool) {
+		cf_log_err_cs(conf, "Failed starting helpers");
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -339,9 +431,14 @@ static rlm_rcode_t CC_HINT(nonnull) mod_exec_dispatch(void *instance, REQUEST *r
 	 *	This function does it's own xlat of the input program
 	 *	to execute.
 	 */
-	status = radius_exec_program(ctx, out, sizeof(out), inst->output ? &answer : NULL, request,
-				     inst->program, inst->input ? *input_pairs : NULL,
-				     inst->wait, inst->shell_escape, inst->timeout);
+	if (inst->helper_pool) {
+		status = rlm_exec_helper(inst, request, out, sizeof(out), ctx, inst->output ? &answer : NULL,
+					 inst->input ? *input_pairs : NULL);
+	} else {
+		status = radius_exec_program(ctx, out, sizeof(out), inst->output ? &answer : NULL, request,
+					     inst->program, inst->input ? *input_pairs : NULL,
+					     inst->wait, inst->shell_escape, inst->timeout);
+	}
 	rcode = rlm_exec_status2rcode(request, out, strlen(out), status);
 
 	/*
@@ -468,6 +565,7 @@ module_t rlm_exec = {
 	.inst_size	= sizeof(rlm_exec_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
+	.instantiate	= mod_instantiate,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_exec_dispatch,
 		[MOD_AUTHORIZE]		= mod_exec_dispatch,
@@ -29,6 +29,7 @@ USES_APPLE_DEPRECATED_API
 #include <freeradius-devel/md5.h>
 #include <freeradius-devel/sha1.h>
 #include <freeradius-devel/base64.h>
+#include <freeradius-devel/str.h>
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
 
@@ -878,26 +879,23 @@ static ssize_t unescape_xlat(char **out, size_t outlen,
  *
  * Example: "%{tolower:Bar}" == "bar"
  *
- * Probably only works for ASCII
+ * Only folds ASCII letters.
  */
 static ssize_t lc_xlat(char **out, size_t outlen,
 		       UNUSED void const *mod_inst, UNUSED void const *xlat_inst,
 		       UNUSED REQUEST *request, char const *fmt)
 {
-	char *q;
-	char const *p;
+	size_t len;
 
 	if (outlen <= 1) return 0;
 
-	for (p = fmt, q = *out; *p != '\0'; p++, outlen--) {
-		if (outlen <= 1) break;
+	len = strlen(fmt);
+	if (len >= outlen) len = outlen - 1;
 
-		*(q++) = tolower((int) *p);
-	}
-
-	*q = '\0';
+	fr_str_tolower(*out, fmt, len);
+	(*out)[len] = '\0';
 
-	return strlen(*out);
+	return len;
 }
 
 /** Convert a string to uppercase
@@ -1637,24 +1635,24 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 
 	xlat_register(inst, "rand", rand_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 	xlat_register(inst, "randstr", randstr_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
-	xlat_register(inst, "urlquote", urlquote_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
-	xlat_register(inst, "urlunquote", urlunquote_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
-	xlat_register(inst, "escape", escape_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
-	xlat_register(inst, "unescape", unescape_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
-	xlat_register(inst, "tolower", lc_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
-	xlat_register(inst, "toupper", uc_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
-	xlat_register(inst, "md5", md5_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
-	xlat_register(inst, "sha1", sha1_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "urlquote", urlquote_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "urlunquote", urlunquote_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "escape", escape_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "unescape", unescape_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "tolower", lc_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "toupper", uc_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "md5", md5_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "sha1", sha1_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 #ifdef HAVE_OPENSSL_EVP_H
-	xlat_register(inst, "sha256", sha256_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
-	xlat_register(inst, "sha512", sha512_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "sha256", sha256_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "sha512", sha512_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 #endif
 	xlat_register(inst, "hmacmd5", hmac_md5_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 	xlat_register(inst, "hmacsha1", hmac_sha1_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 	xlat_register(inst, "pairs", pairs_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 
-	xlat_register(inst, "base64", base64_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
-	xlat_register(inst, "base64tohex", base64_to_hex_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "base64", base64_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat_register_pure(inst, "base64tohex", base64_to_hex_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 
 	xlat_register(inst, "explode", explode_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 
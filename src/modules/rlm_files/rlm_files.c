@@ -30,40 +30,63 @@ RCSID("$Id$")
 #include	<ctype.h>
 #include	<fcntl.h>
 
+/*
+ *	DEFAULT entries are indexed by the value of an equality
+ *	check, so that only entries which can match the request
+ *	are compared against it.
+ */
+#define FILES_INDEX_MIN_ENTRIES	(8)	//!< Don't bother indexing fewer DEFAULT entries than this.
+
+typedef struct files_index_bucket {
+	VALUE_PAIR const	*vp;		//!< Check item the entries were indexed by.
+	PAIR_LIST const		**entries;	//!< DEFAULT entries with this value, in file order.
+	size_t			num_entries;
+} files_index_bucket_t;
+
+typedef struct files_table {
+	rbtree_t		*tree;		//!< Entries by name.  DEFAULT entries hang off the
+						//!< first DEFAULT.
+	fr_dict_attr_t const	*index_da;	//!< Attribute DEFAULT entries are indexed by, or NULL.
+	fr_hash_oa_t		*index;		//!< Buckets of DEFAULT entries, by value of index_da.
+	PAIR_LIST const		**unindexed;	//!< DEFAULT entries with no equality check on
+						//!< index_da, in file order.
+	size_t			num_unindexed;
+} files_table_t;
+
 typedef struct rlm_files_t {
 	char const *compat_mode;
 
 	char const *key;
 
 	char const *filename;
-	rbtree_t *common;
+	files_table_t *common;
 
 	/* autz */
 	char const *usersfile;
-	rbtree_t *users;
+	files_table_t *users;
 
 
 	/* authenticate */
 	char const *auth_usersfile;
-	rbtree_t *auth_users;
+	files_table_t *auth_users;
 
 	/* preacct */
 	char const *acct_usersfile;
-	rbtree_t *acct_users;
+	files_table_t *acct_users;
 
 #ifdef WITH_PROXY
 	/* pre-proxy */
 	char const *preproxy_usersfile;
-	rbtree_t *preproxy_users;
+	files_table_t *preproxy_users;
 
 	/* post-proxy */
 	char const *postproxy_usersfile;
-	rbtree_t *postproxy_users;
+	files_table_t *postproxy_users;
 #endif
 
 	/* post-authenticate */
 	char const *postauth_usersfile;
-	rbtree_t *postauth_users;
+	files_table_t *postauth_users;
 } rlm_files_t;
 
 
@@ -100,16 +123,181 @@ static int pairlist_cmp(void const *a, void const *b)
 		      ((PAIR_LIST const *)b)->name);
 }
 
-static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree, char const *compat_mode_str)
+/** Get the bytes of a value used as an index key
+ *
+ * Only types whose comparison is a simple byte comparison can be indexed.
+ *
+ * @return the length of the key, or 0 if the type can't be indexed.
+ */
+static size_t files_index_key(VALUE_PAIR const *vp, uint8_t const **out)
+{
+	switch (vp->da->type) {
+	case PW_TYPE_STRING:
+		*out = (uint8_t const *) vp->vp_strvalue;
+		return vp->vp_length;
+
+	case PW_TYPE_OCTETS:
+		*out = vp->vp_octets;
+		return vp->vp_length;
+
+	case PW_TYPE_INTEGER:
+		*out = (uint8_t const *) &vp->vp_integer;
+		return sizeof(vp->vp_integer);
+
+	case PW_TYPE_IPV4_ADDR:
+		*out = (uint8_t const *) &vp->vp_ipaddr;
+		return sizeof(vp->vp_ipaddr);
+
+	default:
+		return 0;
+	}
+}
+
+static uint32_t files_index_hash(void const *data)
+{
+	files_index_bucket_t const *bucket = data;
+	uint8_t const *key;
+	size_t len;
+
+	len = files_index_key(bucket->vp, &key);
+
+	return fr_hash(key, len);
+}
+
+static int files_index_cmp(void const *one, void const *two)
+{
+	files_index_bucket_t const *a = one, *b = two;
+	uint8_t const *a_key, *b_key;
+	size_t a_len, b_len;
+
+	a_len = files_index_key(a->vp, &a_key);
+	b_len = files_index_key(b->vp, &b_key);
+
+	if (a_len != b_len) return (a_len < b_len) ? -1 : +1;
+
+	return memcmp(a_key, b_key, a_len);
+}
+
+/** Find the check item an entry can be indexed by
+ *
+ * That's an equality check against an on-the-wire attribute, with a
+ * literal value of a type we can index.  Attributes with registered
+ * comparison functions and attributes which paircompare() treats
+ * specially are never indexed.
+ */
+static VALUE_PAIR const *files_index_vp(PAIR_LIST const *entry, fr_dict_attr_t const *da)
+{
+	VALUE_PAIR const *vp;
+	uint8_t const *key;
+
+	for (vp = entry->check; vp; vp = vp->next) {
+		if (da && (vp->da != da)) continue;
+
+		if ((vp->op != T_OP_CMP_EQ) && (vp->op != T_OP_EQ)) continue;
+		if (vp->type != VT_DATA) continue;
+		if (vp->da->flags.has_tag) continue;
+		if ((vp->da->vendor == 0) && ((vp->da->attr >= 0x100) || (vp->da->attr == PW_USER_PASSWORD))) continue;
+		if (radius_find_compare(vp->da)) continue;
+		if (!files_index_key(vp, &key)) continue;
+
+		return vp;
+	}
+
+	return NULL;
+}
+
+/** Index the DEFAULT entries of a users file
+ *
+ * The attribute used is the one which appears in an indexable check item
+ * of the most DEFAULT entries.  Entries without such a check go on the
+ * unindexed list, and are always compared against the request.
+ *
+ * @param[in] table to build the index for.
+ * @param[in] defaults the DEFAULT entries, in file order.
+ * @return
+ *	- 0 on success (including when no index was built).
+ *	- -1 on error.
+ */
+static int files_index_build(files_table_t *table, PAIR_LIST const *defaults)
+{
+	PAIR_LIST const		*entry;
+	VALUE_PAIR const	*vp;
+	fr_dict_attr_t const	*das[32];
+	size_t			counts[32];
+	size_t			num_das = 0, num_defaults = 0, i, best = 0;
+
+	/*
+	 *	Count the candidate attributes.  We only look at
+	 *	the first indexable check item of each entry, which
+	 *	is almost always the one the admin intended to key on.
+	 */
+	for (entry = defaults; entry; entry = entry->next) {
+		num_defaults++;
+
+		vp = files_index_vp(entry, NULL);
+		if (!vp) continue;
+
+		for (i = 0; i < num_das; i++) if (das[i] == vp->da) break;
+		if (i == num_das) {
+			if (num_das == (sizeof(das) / sizeof(*das))) continue;
+			das[num_das] = vp->da;
+			counts[num_das++] = 0;
+		}
+		counts[i]++;
+	}
+
+	if ((num_defaults < FILES_INDEX_MIN_ENTRIES) || !num_das) return 0;
+
+	for (i = 1; i < num_das; i++) if (counts[i] > counts[best]) best = i;
+
+	table->index_da = das[best];
+	table->index = fr_hash_oa_create(table, files_index_hash, files_index_cmp, NULL);
+	if (!table->index) return -1;
+
+	table->unindexed = talloc_array(table, PAIR_LIST const *, num_defaults - counts[best]);
+	if (!table->unindexed) return -1;
+
+	for (entry = defaults; entry; entry = entry->next) {
+		files_index_bucket_t find, *bucket;
+
+		vp = files_index_vp(entry, table->index_da);
+		if (!vp) {
+			table->unindexed[table->num_unindexed++] = entry;
+			continue;
+		}
+
+		find.vp = vp;
+		bucket = fr_hash_oa_finddata(table->index, &find);
+		if (!bucket) {
+			bucket = talloc_zero(table->index, files_index_bucket_t);
+			if (!bucket) return -1;
+			bucket->vp = vp;
+
+			if (!fr_hash_oa_insert(table->index, bucket)) return -1;
+		}
+
+		bucket->entries = talloc_realloc(bucket, bucket->entries, PAIR_LIST const *, bucket->num_entries + 1);
+		if (!bucket->entries) return -1;
+		bucket->entries[bucket->num_entries++] = entry;
+	}
+
+	DEBUG2("rlm_files: Indexed %zu of %zu DEFAULT entries by %s",
+	       num_defaults - table->num_unindexed, num_defaults, table->index_da->name);
+
+	return 0;
+}
+
+static int getusersfile(TALLOC_CTX *ctx, char const *filename, files_table_t **ptable, char const *compat_mode_str)
 {
 	int rcode;
 	PAIR_LIST *users = NULL;
 	PAIR_LIST *entry, *next;
 	PAIR_LIST *user_list, *default_list, **default_tail;
+	files_table_t *table;
 	rbtree_t *tree;
 
 	if (!filename) {
-		*ptree = NULL;
+		*ptable = NULL;
 		return 0;
 	}
 
@@ -235,9 +423,16 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree,
 		}
 	}
 
-	tree = rbtree_create(ctx, pairlist_cmp, NULL, RBTREE_FLAG_NONE);
+	table = talloc_zero(ctx, files_table_t);
+	if (!table) {
+		pairlist_free(&users);
+		return -1;
+	}
+
+	tree = table->tree = rbtree_create(table, pairlist_cmp, NULL, RBTREE_FLAG_NONE);
 	if (!tree) {
 		pairlist_free(&users);
+		talloc_free(table);
 		return -1;
 	}
 
@@ -271,7 +466,7 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree,
 				error:
 					pairlist_free(&entry);
 					pairlist_free(&next);
-					rbtree_free(tree);
+					talloc_free(table);
 					return -1;
 				}
 
@@ -307,7 +502,13 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree,
 		}
 	}
 
-	*ptree = tree;
+	if (files_index_build(table, default_list) < 0) {
+		ERROR("rlm_files: Failed indexing DEFAULT entries in %s", filename);
+		talloc_free(table);
+		return -1;
+	}
+
+	*ptable = table;
 
 	return 0;
 }
@@ -339,10 +540,99 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 	return 0;
 }
 
+/** Iterates over the DEFAULT entries which may match a request, in file order
+ *
+ * Either walks the full DEFAULT list, or merges the index bucket for the
+ * request's value of the index attribute with the unindexed entries.
+ */
+typedef struct files_default_cursor {
+	PAIR_LIST const		*list;		//!< Next entry, when walking the full list.
+
+	PAIR_LIST const		**bucket;	//!< Indexed candidates.
+	size_t			bucket_len;
+	PAIR_LIST const		**unindexed;	//!< Entries we always have to check.
+	size_t			unindexed_len;
+	bool			indexed;
+} files_default_cursor_t;
+
+static void files_default_cursor_init(files_default_cursor_t *cursor, files_table_t const *table,
+				      VALUE_PAIR *vps, PAIR_LIST const *defaults)
+{
+	VALUE_PAIR		*vp, *found = NULL;
+	files_index_bucket_t	find, *bucket;
+
+	memset(cursor, 0, sizeof(*cursor));
+	cursor->list = defaults;
+
+	if (!table->index) return;
+
+	/*
+	 *	A comparison function may have been registered
+	 *	since we built the index, and with more than one
+	 *	instance of the attribute any of them may match.
+	 *	In both cases we have to check every entry.
+	 */
+	if (radius_find_compare(table->index_da)) return;
+
+	for (vp = vps; vp; vp = vp->next) {
+		if (vp->da != table->index_da) continue;
+		if (found) return;
+		found = vp;
+	}
+
+	cursor->indexed = true;
+	cursor->unindexed = table->unindexed;
+	cursor->unindexed_len = table->num_unindexed;
+
+	/*
+	 *	No instance of the attribute, so none of the
+	 *	indexed entries can match.
+	 */
+	if (!found) return;
+
+	find.vp = found;
+	bucket = fr_hash_oa_finddata(table->index, &find);
+	if (!bucket) return;
+
+	cursor->bucket = bucket->entries;
+	cursor->bucket_len = bucket->num_entries;
+}
+
+static PAIR_LIST const *files_default_cursor_peek(files_default_cursor_t const *cursor)
+{
+	if (!cursor->indexed) return cursor->list;
+
+	if (!cursor->bucket_len) return cursor->unindexed_len ? cursor->unindexed[0] : NULL;
+	if (!cursor->unindexed_len) return cursor->bucket[0];
+
+	return (cursor->bucket[0]->lineno < cursor->unindexed[0]->lineno) ? cursor->bucket[0] : cursor->unindexed[0];
+}
+
+static void files_default_cursor_next(files_default_cursor_t *cursor)
+{
+	PAIR_LIST const *pl;
+
+	if (!cursor->indexed) {
+		if (cursor->list) cursor->list = cursor->list->next;
+		return;
+	}
+
+	pl = files_default_cursor_peek(cursor);
+	if (!pl) return;
+
+	if (cursor->bucket_len && (cursor->bucket[0] == pl)) {
+		cursor->bucket++;
+		cursor->bucket_len--;
+	} else {
+		cursor->unindexed++;
+		cursor->unindexed_len--;
+	}
+}
+
 /*
  *	Common code called by everything below.
  */
-static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *filename, rbtree_t *tree,
+static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *filename, files_table_t *table,
 			       RADIUS_PACKET *request_packet, RADIUS_PACKET *reply_packet)
 {
 	char const	*name, *match;
@@ -352,6 +642,7 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 	bool		found = false;
 	PAIR_LIST	my_pl;
 	char		buffer[256];
+	files_default_cursor_t defaults;
 
 	if (!inst->key) {
 		VALUE_PAIR	*namepair;
@@ -369,12 +660,13 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 		name = len ? buffer : "NONE";
 	}
 
-	if (!tree) return RLM_MODULE_NOOP;
+	if (!table) return RLM_MODULE_NOOP;
 
 	my_pl.name = name;
-	user_pl = rbtree_finddata(tree, &my_pl);
+	user_pl = rbtree_finddata(table->tree, &my_pl);
 	my_pl.name = "DEFAULT";
-	default_pl = rbtree_finddata(tree, &my_pl);
+	files_default_cursor_init(&defaults, table, request_packet->vps, rbtree_finddata(table->tree, &my_pl));
+	default_pl = files_default_cursor_peek(&defaults);
 
 	/*
 	 *	Find the entry for the user.
@@ -396,7 +688,8 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 		} else if (!user_pl && default_pl) {
 			pl = default_pl;
 			match = "DEFAULT";
-			default_pl = default_pl->next;
+			files_default_cursor_next(&defaults);
+			default_pl = files_default_cursor_peek(&defaults);
 
 		} else if (user_pl->lineno < default_pl->lineno) {
 			pl = user_pl;
@@ -406,7 +699,8 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 		} else {
 			pl = default_pl;
 			match = "DEFAULT";
-			default_pl = default_pl->next;
+			files_default_cursor_next(&defaults);
+			default_pl = files_default_cursor_peek(&defaults);
 		}
 
 		check_tmp = fr_pair_list_copy(request, pl->check);
@@ -135,6 +135,26 @@ int fr_json_object_to_value_data(TALLOC_CTX *ctx, value_data_t *out, json_object
 	return 0;
 }
 
+/** Characters which must be escaped in JSON strings
+ *
+ * 0 if the character can be copied as is, otherwise the character to write
+ * after the '\', or 'u' if the character must be written as \u00XX.
+ * Bytes >= 0x80 are copied as is, so UTF-8 sequences are preserved.
+ */
+static char const json_escape[UINT8_MAX + 1] = {
+	[0x00] = 'u', [0x01] = 'u', [0x02] = 'u', [0x03] = 'u',
+	[0x04] = 'u', [0x05] = 'u', [0x06] = 'u', [0x07] = 'u',
+	['\b'] = 'b', ['\t'] = 't', ['\n'] = 'n', [0x0b] = 'u',
+	['\f'] = 'f', ['\r'] = 'r', [0x0e] = 'u', [0x0f] = 'u',
+	[0x10] = 'u', [0x11] = 'u', [0x12] = 'u', [0x13] = 'u',
+	[0x14] = 'u', [0x15] = 'u', [0x16] = 'u', [0x17] = 'u',
+	[0x18] = 'u', [0x19] = 'u', [0x1a] = 'u', [0x1b] = 'u',
+	[0x1c] = 'u', [0x1d] = 'u', [0x1e] = 'u', [0x1f] = 'u',
+	['"'] = '"', ['\\'] = '\\', ['/'] = '/'
+};
+
+static char const hextab[] = "0123456789abcdef";
+
 /** Prints attribute as string, escaped suitably for use as JSON string
  *
  *  Returns < 0 if the buffer may be (or have been) too small to write the encoded
@@ -149,7 +169,6 @@ int fr_json_object_to_value_data(TALLOC_CTX *ctx, value_data_t *out, json_object
  */
 size_t fr_json_from_pair(char *out, size_t outlen, VALUE_PAIR const *vp)
 {
-	char const	*q;
 	size_t		len, freespace = outlen;
 
 	if (!vp->da->flags.has_tag) {
@@ -184,62 +203,46 @@ size_t fr_json_from_pair(char *out, size_t outlen, VALUE_PAIR const *vp)
 
 	switch (vp->da->type) {
 	case PW_TYPE_STRING:
-		for (q = vp->vp_strvalue; q < vp->vp_strvalue + vp->vp_length; q++) {
-			/* Indicate truncation */
-			if (freespace < 3) return outlen + 1;
+	{
+		uint8_t const *p = (uint8_t const *) vp->vp_strvalue, *q, *end = p + vp->vp_length;
+
+		while (p < end) {
+			/*
+			 *	Copy runs of characters which don't need
+			 *	escaping in one go.  Space is always left
+			 *	for the closing quote and \0.
+			 */
+			for (q = p; (q < end) && !json_escape[*q]; q++);
+			len = q - p;
+			if (len > 0) {
+				/* Indicate truncation */
+				if (freespace < (len + 2)) return outlen + 1;
+				memcpy(out, p, len);
+				out += len;
+				freespace -= len;
+			}
+			if (q == end) break;
 
-			if (*q == '"') {
-				*out++ = '\\';
-				*out++ = '"';
-				freespace -= 2;
-			} else if (*q == '\\') {
+			if (json_escape[*q] == 'u') {
+				/* Indicate truncation */
+				if (freespace < 8) return outlen + 1;
 				*out++ = '\\';
-				*out++ = '\\';
-				freespace -= 2;
-			} else if (*q == '/') {
-				*out++ = '\\';
-				*out++ = '/';
-				freespace -= 2;
-			} else if (*q >= ' ') {
-				*out++ = *q;
-				freespace--;
+				*out++ = 'u';
+				*out++ = '0';
+				*out++ = '0';
+				*out++ = hextab[*q >> 4];
+				*out++ = hextab[*q & 0x0f];
+				freespace -= 6;
 			} else {
+				/* Indicate truncation */
+				if (freespace < 4) return outlen + 1;
 				*out++ = '\\';
-				freespace--;
-
-				switch (*q) {
-				case '\b':
-					*out++ = 'b';
-					freespace--;
-					break;
-
-				case '\f':
-					*out++ = 'f';
-					freespace--;
-					break;
-
-				case '\n':
-					*out++ = 'b';
-					freespace--;
-					break;
-
-				case '\r':
-					*out++ = 'r';
-					freespace--;
-					break;
-
-				case '\t':
-					*out++ = 't';
-					freespace--;
-					break;
-				default:
-					len = snprintf(out, freespace, "u%04X", *q);
-					if (is_truncated(len, freespace)) return (outlen - freespace) + len;
-					out += len;
-					freespace -= len;
-				}
+				*out++ = json_escape[*q];
+				freespace -= 2;
 			}
+			p = q + 1;
 		}
+	}
 		break;
 
 	default:
@@ -0,0 +1,533 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file cache.c
+ * @brief Cache results of user, group and profile searches.
+ *
+ * Search results are stored exactly as they were returned by libldap. The
+ * functions used to parse results (ldap_first_entry, ldap_get_values_len,
+ * ldap_get_dn etc...) never modify the LDAPMessage chain, so a single cached
+ * result can be used by multiple requests concurrently.  Entries are reference
+ * counted, and freed when they've expired and the last request has released them.
+ *
+ * @copyright 2016 The FreeRADIUS Server Project.
+ */
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/heap.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "rlm_ldap.h"
+
+#ifdef HAVE_PTHREAD_H
+#  define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#  define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#  define PTHREAD_MUTEX_LOCK(_x)
+#  define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+typedef struct ldap_cache_entry {
+	char			*key;		//!< Base DN, scope, filter and attributes of the search.
+	ldap_rcode_t		status;		//!< What rlm_ldap_search returned.
+	LDAPMessage		*result;	//!< Result of the search.  NULL for negative entries.
+	char			**dn;		//!< Normalised DNs of the objects in the result, and the
+						//!< base DN for base searches.  Used for invalidation.
+	time_t			expires;	//!< When the entry expires.
+	int			refs;		//!< One for the cache, and one for each request using the result.
+	bool			cached;		//!< Whether the entry is still in the cache.
+	int			heap_id;	//!< Offset used for heap.
+} ldap_cache_entry_t;
+
+struct ldap_cache {
+	rbtree_t		*entries;	//!< Entries by key.
+	rbtree_t		*results;	//!< Entries by result, so requests can release them.
+	fr_heap_t		*heap;		//!< For managing entry expiry.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;		//!< Protect the trees from multiple readers/writers.
+#endif
+};
+
+/** Compare two entries by key
+ *
+ */
+static int cache_entry_cmp(void const *one, void const *two)
+{
+	ldap_cache_entry_t const *a = one;
+	ldap_cache_entry_t const *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+/** Compare two entries by result pointer
+ *
+ */
+static int cache_result_cmp(void const *one, void const *two)
+{
+	ldap_cache_entry_t const *a = one;
+	ldap_cache_entry_t const *b = two;
+
+	if (a->result < b->result) return -1;
+	if (a->result > b->result) return +1;
+
+	return 0;
+}
+
+/** Compare two entries by expiry time
+ *
+ * There may be multiple entries with the same expiry time.
+ */
+static int cache_heap_cmp(void const *one, void const *two)
+{
+	ldap_cache_entry_t const *a = one;
+	ldap_cache_entry_t const *b = two;
+
+	if (a->expires < b->expires) return -1;
+	if (a->expires > b->expires) return +1;
+
+	return 0;
+}
+
+static int _cache_entry_free(ldap_cache_entry_t *entry)
+{
+	if (entry->result) ldap_msgfree(entry->result);
+
+	return 0;
+}
+
+/** Drop a reference to an entry, freeing it if it's no longer in use
+ *
+ * @note Must be called with the mutex held.
+ */
+static void cache_entry_release(ldap_cache_t *cache, ldap_cache_entry_t *entry)
+{
+	rad_assert(entry->refs > 0);
+
+	if (--entry->refs > 0) return;
+
+	rad_assert(!entry->cached);
+
+	if (entry->result) rbtree_deletebydata(cache->results, entry);
+	talloc_free(entry);
+}
+
+/** Remove an entry from the heap, and drop the cache's reference to it
+ *
+ * The caller must remove the entry from the entries tree.
+ *
+ * @note Must be called with the mutex held.
+ */
+static void cache_entry_unlink(ldap_cache_t *cache, ldap_cache_entry_t *entry)
+{
+	fr_heap_extract(cache->heap, entry);
+	entry->cached = false;
+
+	cache_entry_release(cache, entry);
+}
+
+/** Remove an entry from the cache
+ *
+ * @note Must be called with the mutex held.
+ */
+static void cache_entry_remove(ldap_cache_t *cache, ldap_cache_entry_t *entry)
+{
+	rbtree_deletebydata(cache->entries, entry);
+	cache_entry_unlink(cache, entry);
+}
+
+/** Expire entries, and evict entries until there's space for a new one
+ *
+ * @note Must be called with the mutex held.
+ */
+static void cache_reap(rlm_ldap_t const *inst, ldap_cache_t *cache, time_t now)
+{
+	ldap_cache_entry_t *entry;
+
+	while ((entry = fr_heap_peek(cache->heap))) {
+		if ((entry->expires > now) &&
+		    (!inst->cache_max_entries || (fr_heap_num_elements(cache->heap) < inst->cache_max_entries))) break;
+
+		cache_entry_remove(cache, entry);
+	}
+}
+
+/** Build the key for a search
+ *
+ * Controls aren't part of the key, the only control passed to cached searches
+ * is the user object sort control, which is fixed for a given instance.
+ */
+static char *cache_key(TALLOC_CTX *ctx, char const *dn, int scope, char const *filter, char const * const *attrs)
+{
+	char *key;
+
+	key = talloc_asprintf(ctx, "%s\037%i\037%s\037", dn, scope, filter ? filter : "");
+	if (attrs) {
+		char const * const *p;
+
+		for (p = attrs; *p; p++) key = talloc_asprintf_append_buffer(key, "%s,", *p);
+	}
+
+	return key;
+}
+
+/** Record the DNs of all objects in a result, so we know which entries to invalidate
+ *
+ */
+static void cache_entry_dns(ldap_cache_entry_t *entry, LDAP *handle, char const *base_dn, int scope)
+{
+	LDAPMessage	*msg;
+	char		*dn;
+	int		count = 0;
+
+	if (entry->result) count = ldap_count_entries(handle, entry->result);
+	if (count < 0) count = 0;
+
+	entry->dn = talloc_zero_array(entry, char *, count + 2);
+	if (!entry->dn) return;
+
+	count = 0;
+
+	if (scope == LDAP_SCOPE_BASE) {
+		entry->dn[count] = talloc_strdup(entry->dn, base_dn);
+		if (!entry->dn[count]) return;
+
+		rlm_ldap_normalise_dn(entry->dn[count], entry->dn[count]);
+		count++;
+	}
+
+	if (!entry->result) return;
+
+	for (msg = ldap_first_entry(handle, entry->result);
+	     msg;
+	     msg = ldap_next_entry(handle, msg)) {
+		dn = ldap_get_dn(handle, msg);
+		if (!dn) continue;
+
+		entry->dn[count] = talloc_strdup(entry->dn, dn);
+		ldap_memfree(dn);
+		if (!entry->dn[count]) return;
+
+		rlm_ldap_normalise_dn(entry->dn[count], entry->dn[count]);
+		count++;
+	}
+}
+
+/** Search for something in the LDAP directory, using a cached result if one is available
+ *
+ * Arguments, return values, and the semantics of result are the same as #rlm_ldap_search,
+ * except that results must be released with #rlm_ldap_cache_msgfree instead of ldap_msgfree.
+ *
+ * Successful searches are cached for cache.ttl seconds, searches which found no
+ * objects are cached for cache.negative_ttl seconds.
+ *
+ * @param[out] result Where to store the result.  May be NULL.
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
+ * @param[in] dn to use as base for the search.
+ * @param[in] scope to use (LDAP_SCOPE_BASE, LDAP_SCOPE_ONE, LDAP_SCOPE_SUB).
+ * @param[in] filter to use, should be pre-escaped.
+ * @param[in] attrs to retrieve.
+ * @param[in] serverctrls Search controls to pass to the server.  May be NULL.
+ * @param[in] clientctrls Search controls for ldap_search.  May be NULL.
+ * @return One of the LDAP_PROC_* (#ldap_rcode_t) values.
+ */
+ldap_rcode_t rlm_ldap_cache_search(LDAPMessage **result, rlm_ldap_t const *inst, REQUEST *request,
+				   ldap_handle_t **pconn,
+				   char const *dn, int scope, char const *filter, char const * const *attrs,
+				   LDAPControl **serverctrls, LDAPControl **clientctrls)
+{
+	ldap_cache_t		*cache = inst->cache;
+	ldap_cache_entry_t	*entry, *found, my_entry;
+	ldap_rcode_t		status;
+	LDAPMessage		*our_result = NULL;
+	uint32_t		ttl;
+	time_t			now;
+
+	if (!cache) return rlm_ldap_search(result, inst, request, pconn, dn, scope, filter, attrs,
+					   serverctrls, clientctrls);
+
+	if (result) *result = NULL;
+
+	my_entry.key = cache_key(NULL, dn, scope, filter, attrs);
+	if (!my_entry.key) return LDAP_PROC_ERROR;
+
+	now = time(NULL);
+
+	PTHREAD_MUTEX_LOCK(&cache->mutex);
+	found = rbtree_finddata(cache->entries, &my_entry);
+	if (found && (found->expires <= now)) {
+		cache_entry_remove(cache, found);
+		found = NULL;
+	}
+	if (found) {
+		status = found->status;
+		if (result && found->result) {
+			found->refs++;
+			*result = found->result;
+		}
+	}
+	PTHREAD_MUTEX_UNLOCK(&cache->mutex);
+
+	if (found) {
+		talloc_free(my_entry.key);
+
+		LDAP_DBG_REQ("Using cached %s for search in \"%s\" with filter \"%s\"",
+			     (status == LDAP_PROC_SUCCESS) ? "result" : "negative result", dn, filter ? filter : "");
+
+		return status;
+	}
+
+	status = rlm_ldap_search(&our_result, inst, request, pconn, dn, scope, filter, attrs,
+				 serverctrls, clientctrls);
+	switch (status) {
+	case LDAP_PROC_SUCCESS:
+		ttl = inst->cache_ttl;
+		break;
+
+	case LDAP_PROC_NO_RESULT:
+	case LDAP_PROC_BAD_DN:
+		ttl = inst->cache_negative_ttl;
+		break;
+
+	default:
+		ttl = 0;
+		break;
+	}
+
+	if (!ttl || !*pconn) goto finish;
+
+	entry = talloc_zero(NULL, ldap_cache_entry_t);
+	if (!entry) goto finish;
+
+	entry->key = talloc_steal(entry, my_entry.key);
+	my_entry.key = NULL;
+	entry->status = status;
+	entry->result = our_result;
+	entry->expires = now + ttl;
+	entry->refs = 1;
+	entry->cached = true;
+	talloc_set_destructor(entry, _cache_entry_free);
+
+	cache_entry_dns(entry, (*pconn)->handle, dn, scope);
+
+	PTHREAD_MUTEX_LOCK(&cache->mutex);
+	/*
+	 *	Another request may have performed the same
+	 *	search while we were waiting for the result.
+	 */
+	found = rbtree_finddata(cache->entries, entry);
+	if (found) cache_entry_remove(cache, found);
+
+	cache_reap(inst, cache, now);
+
+	if (!rbtree_insert(cache->entries, entry)) goto error;
+
+	if (fr_heap_insert(cache->heap, entry) < 0) {
+		rbtree_deletebydata(cache->entries, entry);
+		goto error;
+	}
+
+	if (our_result) {
+		if (!rbtree_insert(cache->results, entry)) {
+			rbtree_deletebydata(cache->entries, entry);
+			fr_heap_extract(cache->heap, entry);
+			goto error;
+		}
+
+		if (result) {
+			entry->refs++;
+			*result = our_result;
+		}
+	}
+	PTHREAD_MUTEX_UNLOCK(&cache->mutex);
+
+	return status;
+
+error:
+	PTHREAD_MUTEX_UNLOCK(&cache->mutex);
+
+	entry->result = NULL;	/* Still belongs to us */
+	talloc_free(entry);
+
+finish:
+	talloc_free(my_entry.key);
+
+	if (!result) {
+		if (our_result) ldap_msgfree(our_result);
+	} else {
+		*result = our_result;
+	}
+
+	return status;
+}
+
+/** Release a result returned by #rlm_ldap_cache_search
+ *
+ * Results which aren't cached are freed immediately.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] result to release.  May be NULL.
+ */
+void rlm_ldap_cache_msgfree(rlm_ldap_t const *inst, LDAPMessage *result)
+{
+	ldap_cache_t		*cache = inst->cache;
+	ldap_cache_entry_t	*found, my_entry;
+
+	if (!result) return;
+
+	if (!cache) {
+		ldap_msgfree(result);
+		return;
+	}
+
+	my_entry.result = result;
+
+	PTHREAD_MUTEX_LOCK(&cache->mutex);
+	found = rbtree_finddata(cache->results, &my_entry);
+	if (found) cache_entry_release(cache, found);
+	PTHREAD_MUTEX_UNLOCK(&cache->mutex);
+
+	if (!found) ldap_msgfree(result);
+}
+
+typedef struct ldap_cache_invalidate {
+	ldap_cache_t		*cache;
+	char const		*dn;		//!< Normalised DN of the modified object.
+	int			count;		//!< How many entries were invalidated.
+} ldap_cache_invalidate_t;
+
+static int _cache_invalidate_walk(void *ctx, void *data)
+{
+	ldap_cache_invalidate_t	*uctx = ctx;
+	ldap_cache_entry_t	*entry = data;
+	size_t			i;
+
+	if (!entry->dn) return 0;
+
+	for (i = 0; i < talloc_array_length(entry->dn); i++) {
+		if (!entry->dn[i]) break;
+		if (strcasecmp(entry->dn[i], uctx->dn) != 0) continue;
+
+		cache_entry_unlink(uctx->cache, entry);
+		uctx->count++;
+
+		return 2;
+	}
+
+	return 0;
+}
+
+/** Remove all cached results containing an object
+ *
+ * Called after the module modifies an object, so subsequent requests see the change.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] dn of the modified object.
+ */
+void rlm_ldap_cache_invalidate(rlm_ldap_t const *inst, REQUEST *request, char const *dn)
+{
+	ldap_cache_t		*cache = inst->cache;
+	ldap_cache_invalidate_t	uctx;
+	char			*normalised;
+
+	if (!cache) return;
+
+	normalised = talloc_strdup(NULL, dn);
+	if (!normalised) return;
+	rlm_ldap_normalise_dn(normalised, normalised);
+
+	uctx.cache = cache;
+	uctx.dn = normalised;
+	uctx.count = 0;
+
+	PTHREAD_MUTEX_LOCK(&cache->mutex);
+	rbtree_walk(cache->entries, RBTREE_DELETE_ORDER, _cache_invalidate_walk, &uctx);
+	PTHREAD_MUTEX_UNLOCK(&cache->mutex);
+
+	if (uctx.count) LDAP_DBG_REQ("Invalidated %i cached result(s) for \"%s\"", uctx.count, dn);
+
+	talloc_free(normalised);
+}
+
+static int _cache_entry_walk_free(void *ctx, void *data)
+{
+	ldap_cache_t		*cache = ctx;
+	ldap_cache_entry_t	*entry = data;
+
+	entry->cached = false;
+	if (entry->result) rbtree_deletebydata(cache->results, entry);
+	talloc_free(entry);
+
+	return 2;
+}
+
+/** Cleanup the cache
+ *
+ * Called at detach, by which time no requests hold cached results.
+ */
+static int _mod_cache_free(ldap_cache_t *cache)
+{
+	if (cache->heap) fr_heap_delete(cache->heap);
+	if (cache->entries) rbtree_walk(cache->entries, RBTREE_DELETE_ORDER, _cache_entry_walk_free, cache);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&cache->mutex);
+#endif
+	return 0;
+}
+
+/** Initialise the search result cache
+ *
+ * @param inst rlm_ldap configuration.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int rlm_ldap_cache_init(rlm_ldap_t *inst)
+{
+	ldap_cache_t *cache;
+
+	if (!inst->cache_ttl) return 0;
+
+	cache = talloc_zero(inst, ldap_cache_t);
+	if (!cache) return -1;
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&cache->mutex, NULL) < 0) {
+		ERROR("rlm_ldap (%s): Failed initializing cache mutex: %s", inst->name, fr_syserror(errno));
+		talloc_free(cache);
+		return -1;
+	}
+#endif
+	talloc_set_destructor(cache, _mod_cache_free);
+
+	cache->entries = rbtree_create(cache, cache_entry_cmp, NULL, 0);
+	cache->results = rbtree_create(cache, cache_result_cmp, NULL, 0);
+	cache->heap = fr_heap_create(cache_heap_cmp, offsetof(ldap_cache_entry_t, heap_id));
+	if (!cache->entries || !cache->results || !cache->heap) {
+		ERROR("rlm_ldap (%s): Failed creating cache", inst->name);
+		talloc_free(cache);
+		return -1;
+	}
+
+	inst->cache = cache;
+
+	return 0;
+}
@@ -90,7 +90,152 @@ static int _get_client_value(char **out, CONF_PAIR const *cp, void *data)
 	return 0;
 }
 
+/** Create a client from an LDAP entry, and add it to the global list
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] conn the entry was retrieved with.
+ * @param[in] entry to create the client from.
+ * @param[in] tmpl to use as the base for the new client.
+ * @param[in] map of client attributes to LDAP attributes.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int rlm_ldap_client_add(rlm_ldap_t const *inst, ldap_handle_t *conn, LDAPMessage *entry,
+			       CONF_SECTION *tmpl, CONF_SECTION *map)
+{
+	ldap_client_data_t	data;
+
+	CONF_SECTION		*client;
+	CONF_PAIR		*cp;
+	char			*dn, *id;
+
+	struct berval		**values;
+
+	RADCLIENT		*c;
+	int			ret = -1;
+
+	id = dn = ldap_get_dn(conn->handle, entry);
+	if (!dn) {
+		int ldap_errno;
+
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		LDAP_ERR("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
+
+		return -1;
+	}
+	rlm_ldap_normalise_dn(dn, dn);
+
+	cp = cf_pair_find(map, "identifier");
+	if (cp) {
+		values = ldap_get_values_len(conn->handle, entry, cf_pair_value(cp));
+		if (values) id = rlm_ldap_berval_to_string(NULL, values[0]);
+		ldap_value_free_len(values);
+	}
+
+	/*
+	 *	Iterate over mapping sections
+	 */
+	client = tmpl ? cf_section_dup(NULL, tmpl, "client", id, true) :
+			cf_section_alloc(NULL, "client", id);
+
+	data.conn = conn;
+	data.entry = entry;
+
+	if (client_map_section(client, map, _get_client_value, &data) < 0) {
+		talloc_free(client);
+		goto finish;
+	}
+
+	/*
+	 *@todo these should be parented from something
+	 */
+	c = client_afrom_cs(NULL, client, false, false);
+	if (!c) {
+		talloc_free(client);
+		goto finish;
+	}
+
+	/*
+	 *	Client parents the CONF_SECTION which defined it
+	 */
+	talloc_steal(c, client);
+
+	if (!client_add(NULL, c)) {
+		LDAP_ERR("Failed to add client \"%s\", possible duplicate?", dn);
+		client_free(c);
+		goto finish;
+	}
+
+	LDAP_DBG("Client \"%s\" added", dn);
+	ret = 0;
+
+finish:
+	ldap_memfree(dn);
+
+	return ret;
+}
+
+#ifdef HAVE_LDAP_CREATE_PAGE_CONTROL
+/** Get the cookie for the next page of results
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] conn the search was performed with.
+ * @param[in] result of the search.
+ * @param[in,out] cookie from the previous page, which is freed and replaced.  Its value is NULL
+ *	if there are no more pages.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int rlm_ldap_client_page_next(rlm_ldap_t const *inst, ldap_handle_t *conn, LDAPMessage *result,
+				     struct berval *cookie)
+{
+	LDAPControl	**ctrls = NULL;
+	LDAPControl	*ctrl;
+	ber_int_t	estimate;
+	int		ret;
+
+	if (cookie->bv_val) ber_memfree(cookie->bv_val);
+	cookie->bv_val = NULL;
+	cookie->bv_len = 0;
+
+	ret = ldap_parse_result(conn->handle, result, NULL, NULL, NULL, NULL, &ctrls, 0);
+	if (ret != LDAP_SUCCESS) {
+		LDAP_ERR("Failed parsing search result: %s", ldap_err2string(ret));
+		return -1;
+	}
+
+	/*
+	 *	The server ignored the (non-critical) control, so
+	 *	everything was returned in one go.
+	 */
+	ctrl = ldap_control_find(LDAP_CONTROL_PAGEDRESULTS, ctrls, NULL);
+	if (ctrl) {
+		ret = ldap_parse_pageresponse_control(conn->handle, ctrl, &estimate, cookie);
+		if (ret != LDAP_SUCCESS) {
+			LDAP_ERR("Failed parsing paged results control: %s", ldap_err2string(ret));
+			ldap_controls_free(ctrls);
+			return -1;
+		}
+	}
+	ldap_controls_free(ctrls);
+
+	if (cookie->bv_val && !cookie->bv_len) {
+		ber_memfree(cookie->bv_val);
+		cookie->bv_val = NULL;
+	}
+
+	return 0;
+}
+#endif
+
 /** Load clients from LDAP on server start
+ *
+ * If client.page_size is set, the client objects are retrieved in pages
+ * using the Simple Paged Results control (RFC 2696), and each page is
+ * added before the next one is requested.  This means only one page of
+ * results is held in memory at a time.
  *
  * @param[in] inst rlm_ldap configuration.
  * @param[in] tmpl to use as the base for the new client.
@@ -107,14 +252,16 @@ int rlm_ldap_client_load(rlm_ldap_t const *inst, CONF_SECTION *tmpl, CONF_SECTIO
 
 	char const	**attrs = NULL;
 
-	CONF_PAIR	*cp;
-	int		count = 0, idx = 0;
+	int		count = 0, idx = 0, added = 0, pages = 0;
 
 	LDAPMessage	*result = NULL;
 	LDAPMessage	*entry;
-	char		*dn = NULL;
 
-	RADCLIENT	*c;
+	LDAPControl	**serverctrls = NULL;
+#ifdef HAVE_LDAP_CREATE_PAGE_CONTROL
+	LDAPControl	*page_ctrls[2] = { NULL, NULL };
+	struct berval	cookie = { 0, NULL };
+#endif
 
 	LDAP_DBG("Loading dynamic clients");
 
@@ -154,110 +301,95 @@ int rlm_ldap_client_load(rlm_ldap_t const *inst, CONF_SECTION *tmpl, CONF_SECTIO
 		conn->rebound = false;
 	}
 
-	status = rlm_ldap_search(&result, inst, NULL, &conn, inst->clientobj_base_dn, inst->clientobj_scope,
-				 inst->clientobj_filter, attrs, NULL, NULL);
-	switch (status) {
-	case LDAP_PROC_SUCCESS:
-		break;
-
-	case LDAP_PROC_NO_RESULT:
-		LDAP_INFO("No clients were found in the directory");
-		ret = 0;
-		goto finish;
-
-	default:
-		ret = -1;
-		goto finish;
-	}
-
-	rad_assert(conn);
-	entry = ldap_first_entry(conn->handle, result);
-	if (!entry) {
-		int ldap_errno;
-
-		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
-		LDAP_ERR("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
-
-		ret = -1;
-		goto finish;
-	}
-
 	do {
-		ldap_client_data_t	data;
-
-		CONF_SECTION		*client;
-		char			*id;
-
-		struct berval		**values;
-
-		id = dn = ldap_get_dn(conn->handle, entry);
-		if (!dn) {
-			int ldap_errno;
+#ifdef HAVE_LDAP_CREATE_PAGE_CONTROL
+		if (inst->clientobj_page_size) {
+			int rcode;
+
+			/*
+			 *	Not critical, servers which don't
+			 *	support paging return everything.
+			 */
+			rcode = ldap_create_page_control(conn->handle, inst->clientobj_page_size,
+							 cookie.bv_val ? &cookie : NULL, 0, &page_ctrls[0]);
+			if (rcode != LDAP_SUCCESS) {
+				LDAP_ERR("Failed creating paged results control: %s", ldap_err2string(rcode));
+				ret = -1;
+				goto finish;
+			}
+			serverctrls = page_ctrls;
+		}
+#endif
 
-			ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
-			LDAP_ERR("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
+		status = rlm_ldap_search(&result, inst, NULL, &conn, inst->clientobj_base_dn, inst->clientobj_scope,
+					 inst->clientobj_filter, attrs, serverctrls, NULL);
+		switch (status) {
+		case LDAP_PROC_SUCCESS:
+			break;
 
+		case LDAP_PROC_NO_RESULT:
+			if (!pages) LDAP_INFO("No clients were found in the directory");
+			ret = 0;
 			goto finish;
-		}
-		rlm_ldap_normalise_dn(dn, dn);
 
-		cp = cf_pair_find(map, "identifier");
-		if (cp) {
-			values = ldap_get_values_len(conn->handle, entry, cf_pair_value(cp));
-			if (values) id = rlm_ldap_berval_to_string(NULL, values[0]);
-			ldap_value_free_len(values);
+		default:
+			ret = -1;
+			goto finish;
 		}
+		pages++;
 
-		/*
-		 *	Iterate over mapping sections
-		 */
-		client = tmpl ? cf_section_dup(NULL, tmpl, "client", id, true) :
-				cf_section_alloc(NULL, "client", id);
+		rad_assert(conn);
+		entry = ldap_first_entry(conn->handle, result);
+		if (!entry) {
+			int ldap_errno;
 
-		data.conn = conn;
-		data.entry = entry;
+			ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+			LDAP_ERR("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
 
-		if (client_map_section(client, map, _get_client_value, &data) < 0) {
-			talloc_free(client);
 			ret = -1;
 			goto finish;
 		}
 
-		/*
-		 *@todo these should be parented from something
-		 */
-		c = client_afrom_cs(NULL, client, false, false);
-		if (!c) {
-			talloc_free(client);
-			ret = -1;
-			goto finish;
+		do {
+			if (rlm_ldap_client_add(inst, conn, entry, tmpl, map) < 0) {
+				ret = -1;
+				goto finish;
+			}
+			added++;
+		} while ((entry = ldap_next_entry(conn->handle, entry)));
+
+#ifdef HAVE_LDAP_CREATE_PAGE_CONTROL
+		if (serverctrls) {
+			if (rlm_ldap_client_page_next(inst, conn, result, &cookie) < 0) {
+				ret = -1;
+				goto finish;
+			}
+
+			ldap_control_free(page_ctrls[0]);
+			page_ctrls[0] = NULL;
 		}
+#endif
 
-		/*
-		 *	Client parents the CONF_SECTION which defined it
-		 */
-		talloc_steal(c, client);
-
-		if (!client_add(NULL, c)) {
-			LDAP_ERR("Failed to add client \"%s\", possible duplicate?", dn);
-			ret = -1;
-			client_free(c);
-			goto finish;
-		}
+		ldap_msgfree(result);
+		result = NULL;
 
-		LDAP_DBG("Client \"%s\" added", dn);
+#ifdef HAVE_LDAP_CREATE_PAGE_CONTROL
+	} while (cookie.bv_val);
+#else
+	} while (0);
+#endif
 
-		ldap_memfree(dn);
-		dn = NULL;
-	} while ((entry = ldap_next_entry(conn->handle, entry)));
+	LDAP_DBG("Added %i clients from %i page(s) of results", added, pages);
 
 finish:
 	talloc_free(attrs);
-	if (dn) ldap_memfree(dn);
 	if (result) ldap_msgfree(result);
+#ifdef HAVE_LDAP_CREATE_PAGE_CONTROL
+	if (page_ctrls[0]) ldap_control_free(page_ctrls[0]);
+	if (cookie.bv_val) ber_memfree(cookie.bv_val);
+#endif
 
 	mod_conn_release(inst, conn);
 
 	return ret;
 }
-
@@ -102,8 +102,8 @@ static rlm_rcode_t rlm_ldap_group_name2dn(rlm_ldap_t const *inst, REQUEST *reque
 		return RLM_MODULE_INVALID;
 	}
 
-	status = rlm_ldap_search(&result, inst, request, pconn, base_dn, inst->groupobj_scope,
-				 filter, attrs, NULL, NULL);
+	status = rlm_ldap_cache_search(&result, inst, request, pconn, base_dn, inst->groupobj_scope,
+				       filter, attrs, NULL, NULL);
 	switch (status) {
 	case LDAP_PROC_SUCCESS:
 		break;
@@ -166,7 +166,7 @@ static rlm_rcode_t rlm_ldap_group_name2dn(rlm_ldap_t const *inst, REQUEST *reque
 finish:
 	talloc_free(filter);
 	if (result) {
-		ldap_msgfree(result);
+		rlm_ldap_cache_msgfree(inst, result);
 	}
 
 	/*
@@ -214,7 +214,8 @@ static rlm_rcode_t rlm_ldap_group_dn2name(rlm_ldap_t const *inst, REQUEST *reque
 
 	RDEBUG("Resolving group DN \"%s\" to group name", dn);
 
-	status = rlm_ldap_search(&result, inst, request, pconn, dn, LDAP_SCOPE_BASE, NULL, attrs, NULL, NULL);
+	status = rlm_ldap_cache_search(&result, inst, request, pconn, dn, LDAP_SCOPE_BASE,
+				       NULL, attrs, NULL, NULL);
 	switch (status) {
 	case LDAP_PROC_SUCCESS:
 		break;
@@ -249,7 +250,7 @@ static rlm_rcode_t rlm_ldap_group_dn2name(rlm_ldap_t const *inst, REQUEST *reque
 	RDEBUG("Group DN \"%s\" resolves to name \"%s\"", dn, *out);
 
 finish:
-	if (result) ldap_msgfree(result);
+	if (result) rlm_ldap_cache_msgfree(inst, result);
 	if (values) ldap_value_free_len(values);
 
 	return rcode;
@@ -424,7 +425,6 @@ rlm_rcode_t rlm_ldap_cacheable_groupobj(rlm_ldap_t const *inst, REQUEST *request
 	char const *base_dn;
 	char base_dn_buff[LDAP_MAX_DN_STR_LEN];
 
-	char const *filters[] = { inst->groupobj_filter, inst->groupobj_membership_filter };
 	char filter[LDAP_MAX_FILTER_STR_LEN + 1];
 
 	char const *attrs[] = { inst->groupobj_name_attr, NULL };
@@ -440,9 +440,10 @@ rlm_rcode_t rlm_ldap_cacheable_groupobj(rlm_ldap_t const *inst, REQUEST *request
 		return RLM_MODULE_OK;
 	}
 
-	if (rlm_ldap_xlat_filter(request,
-				 filters, sizeof(filters) / sizeof(*filters),
-				 filter, sizeof(filter)) < 0) {
+	if (radius_xlat_struct(filter, sizeof(filter), request, inst->groupobj_membership_xlat,
+			       rlm_ldap_escape_func, NULL) < 0) {
+		REDEBUG("Failed creating filter");
+
 		return RLM_MODULE_INVALID;
 	}
 
@@ -453,8 +454,8 @@ rlm_rcode_t rlm_ldap_cacheable_groupobj(rlm_ldap_t const *inst, REQUEST *request
 		return RLM_MODULE_INVALID;
 	}
 
-	status = rlm_ldap_search(&result, inst, request, pconn, base_dn,
-				 inst->groupobj_scope, filter, attrs, NULL, NULL);
+	status = rlm_ldap_cache_search(&result, inst, request, pconn, base_dn,
+				       inst->groupobj_scope, filter, attrs, NULL, NULL);
 	switch (status) {
 	case LDAP_PROC_SUCCESS:
 		break;
@@ -514,7 +515,7 @@ rlm_rcode_t rlm_ldap_cacheable_groupobj(rlm_ldap_t const *inst, REQUEST *request
 	} while ((entry = ldap_next_entry((*pconn)->handle, entry)));
 
 finish:
-	if (result) ldap_msgfree(result);
+	if (result) rlm_ldap_cache_msgfree(inst, result);
 
 	return rcode;
 }
@@ -557,15 +558,16 @@ rlm_rcode_t rlm_ldap_check_groupobj_dynamic(rlm_ldap_t const *inst, REQUEST *req
 	RDEBUG2("Checking for user in group objects");
 
 	if (rlm_ldap_is_dn(check->vp_strvalue, check->vp_length)) {
-		char const *filters[] = { inst->groupobj_filter, inst->groupobj_membership_filter };
-
 		RINDENT();
-		ret = rlm_ldap_xlat_filter(request,
-					   filters, sizeof(filters) / sizeof(*filters),
-					   filter, sizeof(filter));
+		ret = radius_xlat_struct(filter, sizeof(filter), request, inst->groupobj_membership_xlat,
+					 rlm_ldap_escape_func, NULL);
 		REXDENT();
 
-		if (ret < 0) return RLM_MODULE_INVALID;
+		if (ret < 0) {
+			REDEBUG("Failed creating filter");
+
+			return RLM_MODULE_INVALID;
+		}
 
 		base_dn = check->vp_strvalue;
 	} else {
@@ -603,7 +605,8 @@ rlm_rcode_t rlm_ldap_check_groupobj_dynamic(rlm_ldap_t const *inst, REQUEST *req
 	}
 
 	RINDENT();
-	status = rlm_ldap_search(NULL, inst, request, pconn, base_dn, inst->groupobj_scope, filter, NULL, NULL, NULL);
+	status = rlm_ldap_cache_search(NULL, inst, request, pconn, base_dn, inst->groupobj_scope,
+				       filter, NULL, NULL, NULL);
 	REXDENT();
 	switch (status) {
 	case LDAP_PROC_SUCCESS:
@@ -645,7 +648,8 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(rlm_ldap_t const *inst, REQUEST *requ
 
 	RDEBUG2("Checking user object's %s attributes", inst->userobj_membership_attr);
 	RINDENT();
-	status = rlm_ldap_search(&result, inst, request, pconn, dn, LDAP_SCOPE_BASE, NULL, attrs, NULL, NULL);
+	status = rlm_ldap_cache_search(&result, inst, request, pconn, dn, LDAP_SCOPE_BASE,
+				       NULL, attrs, NULL, NULL);
 	REXDENT();
 	switch (status) {
 	case LDAP_PROC_SUCCESS:
@@ -796,7 +800,7 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(rlm_ldap_t const *inst, REQUEST *requ
 
 finish:
 	if (values) ldap_value_free_len(values);
-	if (result) ldap_msgfree(result);
+	if (result) rlm_ldap_cache_msgfree(inst, result);
 
 	return rcode;
 }
@@ -27,13 +27,16 @@
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/str.h>
 
 #include <stdarg.h>
 #include <ctype.h>
+#include <poll.h>
 
 #include "rlm_ldap.h"
 
 static const char specials[] = ",+\"\\<>;*=()";
+static fr_str_set_t const specials_set = FR_STR_SET(0x00, 0xff, specials);
 static const char hextab[] = "0123456789abcdef";
 
 FR_NAME_NUMBER const ldap_supported_extensions[] = {
@@ -66,10 +69,29 @@ size_t rlm_ldap_escape_func(UNUSED REQUEST *request, char *out, size_t outlen, c
 {
 
 	size_t left = outlen;
+	char const *end = in + strlen(in);
 
 	if (*in && ((*in == ' ') || (*in == '#'))) goto encode;
 
 	while (*in) {
+		size_t len;
+
+		/*
+		 *	Copy runs of safe characters in one go.
+		 */
+		len = fr_str_span(&specials_set, (uint8_t const *) in, end - in);
+		if (len) {
+			if (left <= 1) break;
+
+			if (len >= left) len = left - 1;
+			memcpy(out, in, len);
+			out += len;
+			in += len;
+			left -= len;
+
+			continue;
+		}
+
 		/*
 		 *	Encode unsafe characters.
 		 */
@@ -496,30 +518,25 @@ char const *rlm_ldap_error_str(ldap_handle_t const *conn)
 	return ldap_err2string(lib_errno);
 }
 
-/** Parse response from LDAP server dealing with any errors
- *
- * Should be called after an LDAP operation. Will check result of operation and if it was successful, then attempt
- * to retrieve and parse the result.
- *
- * Will also produce extended error output including any messages the server sent, and information about partial
- * DN matches.
+/** Check the result of an LDAP operation and produce error strings
  *
  * @param[in] inst of LDAP module.
- * @param[in] conn Current connection.
- * @param[in] msgid returned from last operation. May be -1 if no result processing is required.
+ * @param[in] conn The result should be parsed with.
+ * @param[in] lib_errno Error sending the operation or retrieving its result.
  * @param[in] dn Last search or bind DN.
- * @param[out] result Where to write result, if NULL result will be freed.
- * @param[out] error Where to write the error string, may be NULL, must not be freed.
+ * @param[in,out] result The operation produced, freed on error, or if freeit is true.
+ * @param[in] freeit Whether the result should be freed after being parsed.
+ * @param[out] error Where to write the error string, must not be freed.
  * @param[out] extra Where to write additional error string to, may be NULL (faster) or must be freed
  *	(with talloc_free).
  * @return One of the LDAP_PROC_* (#ldap_rcode_t) values.
  */
-ldap_rcode_t rlm_ldap_result(rlm_ldap_t const *inst, ldap_handle_t const *conn, int msgid, char const *dn,
-			     LDAPMessage **result, char const **error, char **extra)
+static ldap_rcode_t rlm_ldap_result_process(rlm_ldap_t const *inst, ldap_handle_t const *conn, int lib_errno,
+					    char const *dn, LDAPMessage **result, bool freeit,
+					    char const **error, char **extra)
 {
 	ldap_rcode_t status = LDAP_PROC_SUCCESS;
 
-	int lib_errno = LDAP_SUCCESS;	// errno returned by the library.
 	int srv_errno = LDAP_SUCCESS;	// errno in the result message.
 
 	char *part_dn = NULL;		// Partial DN match.
@@ -527,55 +544,9 @@ ldap_rcode_t rlm_ldap_result(rlm_ldap_t const *inst, ldap_handle_t const *conn,
 	char *srv_err = NULL;		// Server's extended error message.
 	char *p, *a;
 
-	bool freeit = false;		// Whether the message should be freed after being processed.
 	int len;
 
-	struct timeval tv;		// Holds timeout values.
-
-	LDAPMessage *tmp_msg = NULL;	// Temporary message pointer storage if we weren't provided with one.
-
-	char const *tmp_err;		// Temporary error pointer storage if we weren't provided with one.
-
-	if (!error) error = &tmp_err;
-	*error = NULL;
-
-	if (extra) *extra = NULL;
-	if (result) *result = NULL;
-
-	/*
-	 *	We always need the result, but our caller may not
-	 */
-	if (!result) {
-		result = &tmp_msg;
-		freeit = true;
-	}
-
-	/*
-	 *	Check if there was an error sending the request
-	 */
-	ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER, &lib_errno);
 	if (lib_errno != LDAP_SUCCESS) goto process_error;
-	if (msgid < 0) return LDAP_SUCCESS;	/* No msgid and no error, return now */
-
-	memset(&tv, 0, sizeof(tv));
-	tv.tv_sec = inst->res_timeout;
-
-	/*
-	 *	Now retrieve the result and check for errors
-	 *	ldap_result returns -1 on failure, and 0 on timeout
-	 */
-	lib_errno = ldap_result(conn->handle, msgid, 1, &tv, result);
-	if (lib_errno == 0) {
-		lib_errno = LDAP_TIMEOUT;
-
-		goto process_error;
-	}
-
-	if (lib_errno == -1) {
-		ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER, &lib_errno);
-
-		goto process_error;
-	}
 
 	/*
 	 *	Parse the result and check for errors sent by the server
@@ -732,6 +703,110 @@ process_error:
 	return status;
 }
 
+/** Parse response from LDAP server dealing with any errors
+ *
+ * Should be called after an LDAP operation. Will check result of operation and if it was successful, then attempt
+ * to retrieve and parse the result.
+ *
+ * Will also produce extended error output including any messages the server sent, and information about partial
+ * DN matches.
+ *
+ * @param[in] inst of LDAP module.
+ * @param[in] conn Current connection.
+ * @param[in] msgid returned from last operation. May be -1 if no result processing is required.
+ * @param[in] dn Last search or bind DN.
+ * @param[out] result Where to write result, if NULL result will be freed.
+ * @param[out] error Where to write the error string, may be NULL, must not be freed.
+ * @param[out] extra Where to write additional error string to, may be NULL (faster) or must be freed
+ *	(with talloc_free).
+ * @return One of the LDAP_PROC_* (#ldap_rcode_t) values.
+ */
+ldap_rcode_t rlm_ldap_result(rlm_ldap_t const *inst, ldap_handle_t const *conn, int msgid, char const *dn,
+			     LDAPMessage **result, char const **error, char **extra)
+{
+	int lib_errno = LDAP_SUCCESS;	// errno returned by the library.
+
+	bool freeit = false;		// Whether the message should be freed after being processed.
+
+	struct timeval tv;		// Holds timeout values.
+
+	LDAPMessage *tmp_msg = NULL;	// Temporary message pointer storage if we weren't provided with one.
+
+	char const *tmp_err;		// Temporary error pointer storage if we weren't provided with one.
+
+	if (!error) error = &tmp_err;
+	*error = NULL;
+
+	if (extra) *extra = NULL;
+	if (result) *result = NULL;
+
+	/*
+	 *	We always need the result, but our caller may not
+	 */
+	if (!result) {
+		result = &tmp_msg;
+		freeit = true;
+	}
+
+	/*
+	 *	Check if there was an error sending the request
+	 */
+	ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER, &lib_errno);
+	if (lib_errno != LDAP_SUCCESS) goto process;
+	if (msgid < 0) return LDAP_SUCCESS;	/* No msgid and no error, return now */
+
+	memset(&tv, 0, sizeof(tv));
+	tv.tv_sec = inst->res_timeout;
+
+	/*
+	 *	Now retrieve the result and check for errors
+	 *	ldap_result returns -1 on failure, and 0 on timeout
+	 */
+	lib_errno = ldap_result(conn->handle, msgid, 1, &tv, result);
+	if (lib_errno == 0) {
+		lib_errno = LDAP_TIMEOUT;
+	} else if (lib_errno == -1) {
+		ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER, &lib_errno);
+	} else {
+		lib_errno = LDAP_SUCCESS;
+	}
+
+process:
+	return rlm_ldap_result_process(inst, conn, lib_errno, dn, result, freeit, error, extra);
+}
+
+
+/** Allow the operation we're about to wait for to be cancelled if the request times out
+ *
+ * Operations on shared connections aren't cancelled, as other requests
+ * are waiting on the same socket.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request the operation is for.  May be NULL.
+ * @param[in] conn the operation was sent on.
+ */
+static void rlm_ldap_cancel_watch(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t *conn)
+{
+	if (!request || conn->mux) return;
+
+	if (ldap_get_option(conn->handle, LDAP_OPT_DESC, &conn->fd) != LDAP_OPT_SUCCESS) return;
+
+	fr_connection_cancel_watch(inst->pool, request, conn);
+}
+
+/** Stop the operation being cancelled, now we have the result
+ *
+ * @param[in] request the operation is for.  May be NULL.
+ * @return true if the operation was cancelled, in which case it mustn't be retried.
+ */
+static bool rlm_ldap_cancel_clear(REQUEST *request)
+{
+	if (!request) return false;
+
+	request_cancel_clear(request);
+
+	return request_cancelled(request);
+}
 
 /** Bind to the LDAP directory as a user
  *
@@ -764,6 +839,12 @@ ldap_rcode_t rlm_ldap_bind(rlm_ldap_t const *inst, REQUEST *request, ldap_handle
 	rad_assert(*pconn && (*pconn)->handle);
 	rad_assert(!retry || inst->pool);
 
+	/*
+	 *	Binds change the identity of the connection,
+	 *	so can't be done on a shared one.
+	 */
+	if (mod_conn_exclusive(inst, request, pconn) < 0) return LDAP_PROC_ERROR;
+
 #ifndef WITH_SASL
 	rad_assert(!sasl->mech);
 #endif
@@ -799,7 +880,12 @@ ldap_rcode_t rlm_ldap_bind(rlm_ldap_t const *inst, REQUEST *request, ldap_handle
 				MOD_ROPTIONAL(RDEBUG2, DEBUG2, "Waiting for bind result...");
 			}
 
+			rlm_ldap_cancel_watch(inst, request, *pconn);
 			status = rlm_ldap_result(inst, *pconn, msgid, dn, NULL, &error, &extra);
+			if (rlm_ldap_cancel_clear(request)) {
+				error = "Cancelled, request timed out";
+				status = LDAP_PROC_ERROR;
+			}
 		}
 
 		switch (status) {
@@ -859,6 +945,238 @@ ldap_rcode_t rlm_ldap_bind(rlm_ldap_t const *inst, REQUEST *request, ldap_handle
 	return status; /* caller closes the connection */
 }
 
+#ifdef HAVE_PTHREAD_H
+/** A search waiting for its result on a shared connection
+ *
+ */
+typedef struct ldap_mux_wait {
+	int			msgid;			//!< Of the search.
+	LDAPMessage		*result;		//!< Dispatched to us by the reader.
+	int			lib_errno;		//!< Error sending the search or retrieving the result.
+	bool			done;			//!< Result or error is available.
+	struct ldap_mux_wait	*next;
+} ldap_mux_wait_t;
+
+/** A connection shared by many concurrent searches
+ *
+ * Searches are sent under the mutex, then the first waiting thread becomes the reader,
+ * polling the socket without the mutex held, and dispatching whatever results arrive
+ * to the threads waiting on their msgids.
+ */
+struct ldap_mux {
+	pthread_mutex_t		mutex;
+	fr_fiber_cond_t		cond;			//!< Signalled when results are dispatched, or
+							//!< the reader finishes.
+
+	ldap_handle_t		*conn;			//!< Shared connection, NULL if it needs reconnecting.
+	bool			dead;			//!< Connection failed while a reader was active.
+	bool			reading;		//!< A thread is reading results from the connection.
+
+	ldap_mux_wait_t		*wait;			//!< Searches waiting for results.
+	int			outstanding;		//!< Number of searches in progress.
+
+	rlm_ldap_t		*inst;
+};
+
+/** Fail all outstanding searches and close the shared connection
+ *
+ * @note Must be called with the mutex held, and no reader active.
+ */
+static void rlm_ldap_mux_close(ldap_mux_t *mux, int lib_errno)
+{
+	ldap_mux_wait_t *wait;
+
+	for (wait = mux->wait; wait; wait = wait->next) {
+		wait->lib_errno = lib_errno;
+		wait->done = true;
+	}
+	mux->wait = NULL;
+	mux->dead = false;
+
+	TALLOC_FREE(mux->conn);
+
+	fr_fiber_cond_broadcast(&mux->cond);
+}
+
+/** Read results from the shared connection, and dispatch them to waiting searches
+ *
+ * @note Must be called with the mutex held, which is released while polling.
+ *
+ * @param mux to read from.
+ * @param when to give up waiting for results.
+ */
+static void rlm_ldap_mux_read(ldap_mux_t *mux, struct timeval const *when)
+{
+	struct timeval	now, zero = { 0, 0 };
+	struct pollfd	pfd;
+	LDAPMessage	*msg;
+	int		timeout, ret;
+
+	if (ldap_get_option(mux->conn->handle, LDAP_OPT_DESC, &pfd.fd) != LDAP_OPT_SUCCESS) {
+		rlm_ldap_mux_close(mux, LDAP_SERVER_DOWN);
+		return;
+	}
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	gettimeofday(&now, NULL);
+	timeout = ((when->tv_sec - now.tv_sec) * 1000) + ((when->tv_usec - now.tv_usec) / 1000);
+	if (timeout < 0) timeout = 0;
+
+	mux->reading = true;
+	pthread_mutex_unlock(&mux->mutex);
+
+	ret = fr_fiber_poll(&pfd, 1, timeout);
+
+	pthread_mutex_lock(&mux->mutex);
+	mux->reading = false;
+
+	if ((ret < 0) && (errno != EINTR)) mux->dead = true;
+
+	/*
+	 *	libldap buffers results internally, so keep going
+	 *	until it has nothing more for us.
+	 */
+	while (!mux->dead && (ret > 0)) {
+		ldap_mux_wait_t **last, *wait;
+
+		ret = ldap_result(mux->conn->handle, LDAP_RES_ANY, LDAP_MSG_ALL, &zero, &msg);
+		if (ret < 0) {
+			mux->dead = true;
+			break;
+		}
+		if (ret == 0) break;
+
+		for (last = &mux->wait; *last; last = &(*last)->next) {
+			if ((*last)->msgid == ldap_msgid(msg)) break;
+		}
+
+		/*
+		 *	Search was abandoned after timing out
+		 */
+		wait = *last;
+		if (!wait) {
+			ldap_msgfree(msg);
+			continue;
+		}
+
+		*last = wait->next;
+		wait->result = msg;
+		wait->done = true;
+	}
+
+	if (mux->dead) rlm_ldap_mux_close(mux, LDAP_SERVER_DOWN);
+
+	fr_fiber_cond_broadcast(&mux->cond);
+}
+
+/** Send a search on a shared connection and wait for its result
+ *
+ * @param[out] result of the search.
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] conn Per-request handle, used to parse the result.
+ * @param[in] dn to use as base for the search.
+ * @param[in] scope to use (LDAP_SCOPE_BASE, LDAP_SCOPE_ONE, LDAP_SCOPE_SUB).
+ * @param[in] filter to use, should be pre-escaped.
+ * @param[in] attrs to retrieve.
+ * @param[in] serverctrls Search controls to pass to the server.  May be NULL.
+ * @param[in] clientctrls Search controls for ldap_search.  May be NULL.
+ * @param[out] error Where to write the error string, must not be freed.
+ * @param[out] extra Where to write additional error string to, must be freed (with talloc_free).
+ * @return One of the LDAP_PROC_* (#ldap_rcode_t) values.
+ */
+static ldap_rcode_t rlm_ldap_mux_search(LDAPMessage **result, rlm_ldap_t const *inst, REQUEST *request,
+					ldap_handle_t const *conn,
+					char const *dn, int scope, char const *filter, char **attrs,
+					LDAPControl **serverctrls, LDAPControl **clientctrls,
+					char const **error, char **extra)
+{
+	ldap_mux_t	*mux = conn->mux;
+	ldap_mux_wait_t	wait = { .msgid = -1, .lib_errno = LDAP_SUCCESS };
+	struct timeval	tv, now, when;
+	struct timespec	ts;
+
+	*error = NULL;
+	*extra = NULL;
+	*result = NULL;
+
+	memset(&tv, 0, sizeof(tv));
+	tv.tv_sec = inst->res_timeout;
+
+	gettimeofday(&when, NULL);
+	when.tv_sec += inst->res_timeout;
+
+	pthread_mutex_lock(&mux->mutex);
+	if (!mux->conn) {
+		struct timeval timeout = fr_connection_pool_timeout(inst->pool);
+
+		MOD_ROPTIONAL(RDEBUG2, DEBUG2, "Opening shared search connection");
+		mux->conn = mod_conn_create(NULL, mux->inst, &timeout);
+		if (!mux->conn) {
+			pthread_mutex_unlock(&mux->mutex);
+			return rlm_ldap_result_process(inst, conn, LDAP_SERVER_DOWN, dn, result, false, error, extra);
+		}
+	}
+
+	wait.lib_errno = ldap_search_ext(mux->conn->handle, dn, scope, filter, attrs,
+					 0, serverctrls, clientctrls, &tv, 0, &wait.msgid);
+	if (wait.lib_errno != LDAP_SUCCESS) {
+		if (mux->reading) {
+			mux->dead = true;
+		} else {
+			rlm_ldap_mux_close(mux, LDAP_SERVER_DOWN);
+		}
+		pthread_mutex_unlock(&mux->mutex);
+
+		return rlm_ldap_result_process(inst, conn, wait.lib_errno, dn, result, false, error, extra);
+	}
+
+	wait.next = mux->wait;
+	mux->wait = &wait;
+	mux->outstanding++;
+
+	LDAP_DBG_REQ("Waiting for search result (%i searches outstanding on shared connection)...",
+		     mux->outstanding);
+
+	while (!wait.done) {
+		gettimeofday(&now, NULL);
+		if (timercmp(&now, &when, >=)) {
+			ldap_mux_wait_t **last;
+
+			for (last = &mux->wait; *last; last = &(*last)->next) {
+				if (*last != &wait) continue;
+
+				*last = wait.next;
+				break;
+			}
+			if (mux->conn && !mux->dead) ldap_abandon_ext(mux->conn->handle, wait.msgid, NULL, NULL);
+
+			wait.lib_errno = LDAP_TIMEOUT;
+			break;
+		}
+
+		if (!mux->reading) {
+			rlm_ldap_mux_read(mux, &when);
+			continue;
+		}
+
+		/*
+		 *	The reader may be another fiber on this thread.
+		 */
+		ts.tv_sec = when.tv_sec;
+		ts.tv_nsec = when.tv_usec * 1000;
+		(void) fr_fiber_cond_timedwait(&mux->cond, &mux->mutex, &ts);
+	}
+	mux->outstanding--;
+	pthread_mutex_unlock(&mux->mutex);
+
+	*result = wait.result;
+
+	return rlm_ldap_result_process(inst, conn, wait.lib_errno, dn, result, false, error, extra);
+}
+#endif
+
 /** Search for something in the LDAP directory
  *
  * Binds as the administrative user and performs a search, dealing with any errors.
@@ -890,6 +1208,7 @@ ldap_rcode_t rlm_ldap_search(LDAPMessage **result, rlm_ldap_t const *inst, REQUE
 	int		count = 0;	// Number of results we got.
 
 	struct timeval	tv;		// Holds timeout values.
+	struct timeval	start;		// When the search was sent, for profiling.
 
 	char const 	*error = NULL;
 	char		*extra = NULL;
@@ -944,16 +1263,32 @@ ldap_rcode_t rlm_ldap_search(LDAPMessage **result, rlm_ldap_t const *inst, REQUE
 	memset(&tv, 0, sizeof(tv));
 	tv.tv_sec = inst->res_timeout;
 
+	if (request && request->profile) gettimeofday(&start, NULL);
+
 	/*
 	 *	For sanity, for when no connections are viable,
-	 *	and we can't make a new one.
+	 *	and we can't make a new one.  Shared connections
+	 *	are reopened at most once.
 	 */
-	for (i = fr_connection_pool_state(inst->pool)->num; i >= 0; i--) {
-		(void) ldap_search_ext((*pconn)->handle, dn, scope, filter, search_attrs,
-				       0, our_serverctrls, our_clientctrls, &tv, 0, &msgid);
-
-		LDAP_DBG_REQ("Waiting for search result...");
-		status = rlm_ldap_result(inst, *pconn, msgid, dn, &our_result, &error, &extra);
+	for (i = (*pconn)->mux ? 1 : fr_connection_pool_state(inst->pool)->num; i >= 0; i--) {
+#ifdef HAVE_PTHREAD_H
+		if ((*pconn)->mux) {
+			status = rlm_ldap_mux_search(&our_result, inst, request, *pconn, dn, scope, filter, search_attrs,
+						     our_serverctrls, our_clientctrls, &error, &extra);
+		} else
+#endif
+		{
+			(void) ldap_search_ext((*pconn)->handle, dn, scope, filter, search_attrs,
+					       0, our_serverctrls, our_clientctrls, &tv, 0, &msgid);
+
+			LDAP_DBG_REQ("Waiting for search result...");
+			rlm_ldap_cancel_watch(inst, request, *pconn);
+			status = rlm_ldap_result(inst, *pconn, msgid, dn, &our_result, &error, &extra);
+			if (rlm_ldap_cancel_clear(request)) {
+				error = "Cancelled, request timed out";
+				status = LDAP_PROC_ERROR;
+			}
+		}
 		switch (status) {
 		case LDAP_PROC_SUCCESS:
 			break;
@@ -970,6 +1305,18 @@ ldap_rcode_t rlm_ldap_search(LDAPMessage **result, rlm_ldap_t const *inst, REQUE
 			break;
 
 		case LDAP_PROC_RETRY:
+			/*
+			 *	The shared connection has already been
+			 *	closed, the next search reopens it.
+			 */
+			if ((*pconn)->mux) {
+				LDAP_DBGW_REQ("Search failed: %s. Retrying on new shared connection...", error);
+
+				talloc_free(extra); /* don't leak debug info */
+
+				continue;
+			}
+
 			*pconn = fr_connection_reconnect(inst->pool, *pconn);
 			if (*pconn) {
 				LDAP_DBGW_REQ("Search failed: %s. Got new socket, retrying...", error);
@@ -1017,6 +1364,8 @@ ldap_rcode_t rlm_ldap_search(LDAPMessage **result, rlm_ldap_t const *inst, REQUE
 finish:
 	talloc_free(extra);
 
+	if (request && request->profile) fr_profile_ldap(request, inst->name, filter, &start);
+
 	/*
 	 *	We always need to get the result to count entries, but the caller
 	 *	may not of requested one. If that's the case, free it, else write
@@ -1067,6 +1416,8 @@ ldap_rcode_t rlm_ldap_modify(rlm_ldap_t const *inst, REQUEST *request, ldap_hand
 
 	rad_assert(*pconn && (*pconn)->handle);
 
+	if (mod_conn_exclusive(inst, request, pconn) < 0) return LDAP_PROC_ERROR;
+
 	/*
 	 *	Perform all modifications as the admin user.
 	 */
@@ -1092,7 +1443,12 @@ ldap_rcode_t rlm_ldap_modify(rlm_ldap_t const *inst, REQUEST *request, ldap_hand
 		(void) ldap_modify_ext((*pconn)->handle, dn, mods, our_serverctrls, our_clientctrls, &msgid);
 
 		RDEBUG2("Waiting for modify result...");
+		rlm_ldap_cancel_watch(inst, request, *pconn);
 		status = rlm_ldap_result(inst, *pconn, msgid, dn, NULL, &error, &extra);
+		if (rlm_ldap_cancel_clear(request)) {
+			error = "Cancelled, request timed out";
+			status = LDAP_PROC_ERROR;
+		}
 		switch (status) {
 		case LDAP_PROC_SUCCESS:
 			break;
@@ -1124,6 +1480,12 @@ ldap_rcode_t rlm_ldap_modify(rlm_ldap_t const *inst, REQUEST *request, ldap_hand
 		status = LDAP_PROC_ERROR;
 	}
 
+	/*
+	 *	Cached searches returning the object
+	 *	are now stale.
+	 */
+	if (status == LDAP_PROC_SUCCESS) rlm_ldap_cache_invalidate(inst, request, dn);
+
 finish:
 	talloc_free(extra);
 
@@ -1227,8 +1589,8 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, ldap_ha
 		return NULL;
 	}
 
-	status = rlm_ldap_search(result, inst, request, pconn, base_dn,
-				 inst->userobj_scope, filter, attrs, serverctrls, NULL);
+	status = rlm_ldap_cache_search(result, inst, request, pconn, base_dn,
+				       inst->userobj_scope, filter, attrs, serverctrls, NULL);
 	switch (status) {
 	case LDAP_PROC_SUCCESS:
 		break;
@@ -1306,7 +1668,7 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, ldap_ha
 
 finish:
 	if ((freeit || (*rcode != RLM_MODULE_OK)) && *result) {
-		ldap_msgfree(*result);
+		rlm_ldap_cache_msgfree(inst, *result);
 		*result = NULL;
 	}
 
@@ -1550,6 +1912,7 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *tim
 	conn->inst = inst;
 	conn->rebound = false;
 	conn->referred = false;
+	conn->fd = -1;
 
 	DEBUG("rlm_ldap (%s): Connecting to %s", inst->name, inst->server);
 #ifdef HAVE_LDAP_INITIALIZE
@@ -1710,6 +2073,64 @@ error:
 	return NULL;
 }
 
+/** Check an idle connection is still usable
+ *
+ * Reads the root DSE, requesting no attributes.  Called by the connection pool's
+ * manager thread, outside of any request.
+ *
+ * @param instance rlm_ldap configuration.
+ * @param connection to check.
+ * @return
+ *	- 0 if the server responded.
+ *	- -1 if it didn't, and the connection should be closed.
+ */
+int mod_conn_alive(void *instance, void *connection)
+{
+	rlm_ldap_t	*inst = instance;
+	ldap_handle_t	*conn = connection;
+	char const	*attrs[] = { LDAP_NO_ATTRS, NULL };
+	char const	**attrs_p = attrs;
+	char		**search_attrs;
+	struct timeval	tv;
+	LDAPMessage	*result = NULL;
+	int		ldap_errno;
+
+	/*
+	 *	OpenLDAP doesn't declare attrs as const.
+	 */
+	memcpy(&search_attrs, &attrs_p, sizeof(search_attrs));
+
+	memset(&tv, 0, sizeof(tv));
+	tv.tv_sec = inst->res_timeout;
+
+	ldap_errno = ldap_search_ext_s(conn->handle, "", LDAP_SCOPE_BASE, "(objectClass=*)", search_attrs, 1,
+				       NULL, NULL, &tv, 1, &result);
+	if (result) ldap_msgfree(result);
+
+	if (ldap_errno != LDAP_SUCCESS) {
+		LDAP_ERR("Health check failed: %s", ldap_err2string(ldap_errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Abort an operation which is waiting for a result
+ *
+ * Called by the main thread when the request the operation is for times
+ * out.  Shutting down the socket wakes the thread waiting for the result,
+ * and the operation fails with LDAP_SERVER_DOWN.
+ *
+ * @param instance rlm_ldap configuration.
+ * @param connection the operation was sent on.
+ */
+void mod_conn_cancel(UNUSED void *instance, void *connection)
+{
+	ldap_handle_t	*conn = connection;
+
+	if (conn->fd >= 0) shutdown(conn->fd, SHUT_RDWR);
+}
+
 /** Gets an LDAP socket from the connection pool
  *
  * Retrieve a socket from the connection pool, or NULL on error (of if no sockets are available).
@@ -1728,6 +2149,43 @@ ldap_handle_t *mod_conn_get(rlm_ldap_t const *inst,
 {
 	ldap_handle_t *conn;
 
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	Searches are multiplexed over shared connections.
+	 *	The handle we return is never connected, and is
+	 *	only used to parse results, and hold controls.
+	 *	It's swapped for a pooled connection if the caller
+	 *	needs to do anything other than search.
+	 */
+	if (inst->mux) {
+		uint32_t i;
+
+		conn = talloc_zero(NULL, ldap_handle_t);
+		if (!conn) return NULL;
+		talloc_set_destructor(conn, _mod_conn_free);
+
+		conn->inst = inst->mux[0].inst;
+#  ifdef HAVE_LDAP_INITIALIZE
+		ldap_initialize(&conn->handle, "");
+#  else
+		conn->handle = ldap_init("", 0);
+#  endif
+		if (!conn->handle) {
+			talloc_free(conn);
+			return NULL;
+		}
+
+		/*
+		 *	Pick the shared connection with the fewest
+		 *	searches in progress.  Reading outstanding
+		 *	without the lock is fine, it's only a hint.
+		 */
+		conn->mux = &inst->mux[0];
+		for (i = 1; i < inst->multiplex; i++) {
+			if (inst->mux[i].outstanding < conn->mux->outstanding) conn->mux = &inst->mux[i];
+		}
+	} else
+#endif
 	conn = fr_connection_get(inst->pool);
 
 #ifdef LDAP_CONTROL_X_SESSION_TRACKING
@@ -1738,7 +2196,7 @@ ldap_handle_t *mod_conn_get(rlm_ldap_t const *inst,
 	 */
 	if ((conn != NULL) & (request != NULL) & inst->session_tracking) {
 		if (rlm_ldap_control_add_session_tracking(conn, request) < 0) {
-			fr_connection_release(inst->pool, conn);
+			mod_conn_release(inst, conn);
 			return NULL;
 		}
 	}
@@ -1746,6 +2204,111 @@ ldap_handle_t *mod_conn_get(rlm_ldap_t const *inst,
 	return conn;
 }
 
+/** Swap a handle using a shared search connection for one from the connection pool
+ *
+ * Must be called before any operation which isn't a search, or which changes the
+ * state of the connection (binds).  Controls associated with the handle are moved
+ * to the pooled connection.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request (may be NULL).
+ * @param[in,out] pconn to swap.  Left unchanged if it's already a pooled connection.
+ * @return
+ *	- 0 on success.
+ *	- -1 if no pooled connections were available.
+ */
+int mod_conn_exclusive(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t **pconn)
+{
+	ldap_handle_t *conn;
+
+	if (!(*pconn)->mux) return 0;
+
+	conn = fr_connection_get(inst->pool);
+	if (!conn) {
+		MOD_ROPTIONAL(REDEBUG, ERROR, "No connections available for non-search operation");
+		return -1;
+	}
+
+	memcpy(conn->serverctrls, (*pconn)->serverctrls, sizeof(conn->serverctrls));
+	memcpy(conn->clientctrls, (*pconn)->clientctrls, sizeof(conn->clientctrls));
+	conn->serverctrls_cnt = (*pconn)->serverctrls_cnt;
+	conn->clientctrls_cnt = (*pconn)->clientctrls_cnt;
+	if ((*pconn)->rebound) conn->rebound = true;
+
+	/*
+	 *	Controls now belong to the pooled connection
+	 */
+	(*pconn)->serverctrls_cnt = 0;
+	(*pconn)->clientctrls_cnt = 0;
+	talloc_free(*pconn);
+
+	*pconn = conn;
+
+	return 0;
+}
+
+#ifdef HAVE_PTHREAD_H
+static int _mod_mux_free(ldap_mux_t *mux)
+{
+	size_t i;
+
+	for (i = 0; i < talloc_array_length(mux); i++) {
+		TALLOC_FREE(mux[i].conn);
+
+		pthread_mutex_destroy(&mux[i].mutex);
+		fr_fiber_cond_destroy(&mux[i].cond);
+	}
+
+	return 0;
+}
+#endif
+
+/** Open the connections searches will be multiplexed over
+ *
+ * @param inst rlm_ldap configuration.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int mod_mux_init(rlm_ldap_t *inst)
+{
+#ifdef HAVE_PTHREAD_H
+	struct timeval	timeout;
+	uint32_t	i;
+
+	if (!inst->multiplex) return 0;
+
+	timeout = fr_connection_pool_timeout(inst->pool);
+
+	inst->mux = talloc_zero_array(inst, ldap_mux_t, inst->multiplex);
+	if (!inst->mux) return -1;
+	talloc_set_destructor(inst->mux, _mod_mux_free);
+
+	for (i = 0; i < inst->multiplex; i++) {
+		ldap_mux_t *mux = &inst->mux[i];
+
+		pthread_mutex_init(&mux->mutex, NULL);
+		fr_fiber_cond_init(&mux->cond);
+		mux->inst = inst;
+
+		/*
+		 *	Failure isn't fatal, we try again when
+		 *	the connection is first used.
+		 */
+		mux->conn = mod_conn_create(NULL, inst, &timeout);
+		if (!mux->conn) WARN("rlm_ldap (%s): Failed opening shared search connection %u", inst->name, i);
+	}
+
+	return 0;
+#else
+	if (!inst->multiplex) return 0;
+
+	WARN("rlm_ldap (%s): Ignoring \"multiplex\", server was built without pthread support", inst->name);
+
+	return 0;
+#endif
+}
+
 /** Frees an LDAP socket back to the connection pool
  *
  * If the socket was rebound chasing a referral onto another server then we destroy it.
@@ -1761,6 +2324,14 @@ void mod_conn_release(rlm_ldap_t const *inst, ldap_handle_t *conn)
 	 */
 	if (!conn) return;
 
+	/*
+	 *	Never connected, so there's nothing to return to the pool.
+	 */
+	if (conn->mux) {
+		talloc_free(conn);
+		return;
+	}
+
 	/*
 	 *	Clear any client/server controls associated with the connection.
 	 */
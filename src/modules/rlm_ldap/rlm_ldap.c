@@ -158,6 +158,17 @@ static CONF_PARSER client_config[] = {
 	{ FR_CONF_OFFSET("filter", PW_TYPE_STRING, rlm_ldap_t, clientobj_filter) },
 	{ FR_CONF_OFFSET("scope", PW_TYPE_STRING, rlm_ldap_t, clientobj_scope_str), .dflt = "sub" },
 	{ FR_CONF_OFFSET("base_dn", PW_TYPE_STRING, rlm_ldap_t, clientobj_base_dn), .dflt = "" },
+	{ FR_CONF_OFFSET("page_size", PW_TYPE_INTEGER, rlm_ldap_t, clientobj_page_size), .dflt = "1000" },
+	CONF_PARSER_TERMINATOR
+};
+
+/*
+ *	Search result cache configuration
+ */
+static CONF_PARSER cache_config[] = {
+	{ FR_CONF_OFFSET("ttl", PW_TYPE_INTEGER, rlm_ldap_t, cache_ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("negative_ttl", PW_TYPE_INTEGER, rlm_ldap_t, cache_negative_ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_entries", PW_TYPE_INTEGER, rlm_ldap_t, cache_max_entries), .dflt = "16384" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -200,6 +211,9 @@ static CONF_PARSER option_config[] = {
 	/* timeout for search results */
 	{ FR_CONF_OFFSET("res_timeout", PW_TYPE_INTEGER, rlm_ldap_t, res_timeout), .dflt = "20" },
 
+	/* number of shared connections to multiplex searches over */
+	{ FR_CONF_OFFSET("multiplex", PW_TYPE_INTEGER, rlm_ldap_t, multiplex), .dflt = "0" },
+
 	/* allow server unlimited time for search (server-side limit) */
 	{ FR_CONF_OFFSET("srv_timelimit", PW_TYPE_INTEGER, rlm_ldap_t, srv_timelimit), .dflt = "20" },
 
@@ -250,6 +264,8 @@ static const CONF_PARSER module_config[] = {
 
 	{ FR_CONF_POINTER("options", PW_TYPE_SUBSECTION, NULL), .dflt = (void const *) option_config },
 
+	{ FR_CONF_POINTER("cache", PW_TYPE_SUBSECTION, NULL), .dflt = (void const *) cache_config },
+
 	{ FR_CONF_POINTER("tls", PW_TYPE_SUBSECTION, NULL), .dflt = (void const *) tls_config },
 	CONF_PARSER_TERMINATOR
 };
@@ -643,6 +659,8 @@ static int mod_detach(void *instance)
 {
 	rlm_ldap_t *inst = instance;
 
+	TALLOC_FREE(inst->mux);
+	TALLOC_FREE(inst->cache);
 	fr_connection_pool_free(inst->pool);
 
 	if (inst->user_map) {
@@ -877,6 +895,32 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		}
 	}
 
+	/*
+	 *	Combine the group object and membership filters, and
+	 *	tokenize the result once, so it doesn't need to be
+	 *	re-parsed for every group check.
+	 */
+	if (inst->groupobj_membership_filter) {
+		char		*filter;
+		char const	*error;
+
+		if (inst->groupobj_filter && *inst->groupobj_filter && *inst->groupobj_membership_filter) {
+			filter = talloc_typed_asprintf(inst, "(&%s%s)", inst->groupobj_filter,
+						       inst->groupobj_membership_filter);
+		} else if (*inst->groupobj_membership_filter) {
+			filter = talloc_typed_strdup(inst, inst->groupobj_membership_filter);
+		} else {
+			filter = talloc_typed_strdup(inst, inst->groupobj_filter ? inst->groupobj_filter : "");
+		}
+
+		if (xlat_compile(inst, &inst->groupobj_membership_xlat, filter, &error) < 0) {
+			cf_log_err_cs(conf, "Failed parsing 'group.membership_filter': %s", error);
+			talloc_free(filter);
+			goto error;
+		}
+		talloc_free(filter);
+	}
+
 	/*
 	 *	If we have a *pair* as opposed to a *section*
 	 *	then the module is referencing another ldap module's
@@ -911,6 +955,13 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	}
 #endif
 
+#ifndef HAVE_LDAP_CREATE_PAGE_CONTROL
+	if (inst->do_clients && inst->clientobj_page_size) {
+		LDAP_WARN("Setting 'client.page_size' requires ldap_create_page_control.  Disabling 'client.page_size'");
+		inst->clientobj_page_size = 0;
+	}
+#endif
+
 #ifndef HAVE_LDAP_URL_PARSE
 	if (inst->use_referral_credentials) {
 		cf_log_err_cs(conf, "Configuration item 'use_referral_credentials' not supported.  "
@@ -1332,8 +1383,13 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	/*
 	 *	Initialize the socket pool.
 	 */
-	inst->pool = module_connection_pool_init(inst->cs, inst, mod_conn_create, NULL, NULL, NULL, NULL);
+	inst->pool = module_connection_pool_init(inst->cs, inst, mod_conn_create, mod_conn_alive, NULL, NULL, NULL);
 	if (!inst->pool) goto error;
+	fr_connection_pool_cancel_func(inst->pool, mod_conn_cancel);
+
+	if (mod_mux_init(inst) < 0) goto error;
+
+	if (rlm_ldap_cache_init(inst) < 0) goto error;
 
 	/*
 	 *	Bulk load dynamic clients.
@@ -1529,8 +1585,8 @@ static rlm_rcode_t rlm_ldap_map_profile(rlm_ldap_t const *inst, REQUEST *request
 		return RLM_MODULE_INVALID;
 	}
 
-	status = rlm_ldap_search(&result, inst, request, pconn, dn,
-				 LDAP_SCOPE_BASE, filter, expanded->attrs, NULL, NULL);
+	status = rlm_ldap_cache_search(&result, inst, request, pconn, dn,
+				       LDAP_SCOPE_BASE, filter, expanded->attrs, NULL, NULL);
 	switch (status) {
 	case LDAP_PROC_SUCCESS:
 		break;
@@ -1561,7 +1617,7 @@ static rlm_rcode_t rlm_ldap_map_profile(rlm_ldap_t const *inst, REQUEST *request
 	if (rlm_ldap_map_do(inst, request, handle, expanded, entry) > 0) rcode = RLM_MODULE_UPDATED;
 
 free_result:
-	ldap_msgfree(result);
+	rlm_ldap_cache_msgfree(inst, result);
 
 	return rcode;
 }
@@ -1669,6 +1725,15 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 		char password[256];
 		size_t pass_size = sizeof(password);
 
+		/*
+		 *	Extended operations can't be sent on shared connections
+		 */
+		if (mod_conn_exclusive(inst, request, &conn) < 0) {
+			rcode = RLM_MODULE_FAIL;
+
+			goto finish;
+		}
+
 		/*
 		 *	Retrive universal password
 		 */
@@ -1796,7 +1861,7 @@ skip_edir:
 
 finish:
 	talloc_free(expanded.ctx);
-	if (result) ldap_msgfree(result);
+	if (result) rlm_ldap_cache_msgfree(inst, result);
 	mod_conn_release(inst, conn);
 
 	return rcode;
@@ -161,6 +161,10 @@ typedef struct rlm_ldap_control {
 							//!< we've finished using it.
 } rlm_ldap_control_t;
 
+typedef struct ldap_mux ldap_mux_t;
+
+typedef struct ldap_cache ldap_cache_t;
+
 /** Tracks the state of a libldap connection handle
  *
  */
@@ -179,6 +183,13 @@ typedef struct ldap_handle {
 	int		clientctrls_cnt;		//!< Number of client controls associated with the handle.
 
 	rlm_ldap_t	*inst;				//!< rlm_ldap configuration.
+
+	ldap_mux_t	*mux;				//!< Shared connection searches are sent on.  If set,
+							//!< handle is unconnected and only used to parse results.
+
+	int		fd;				//!< Socket of the handle, recorded before waiting
+							//!< for a result, so it can be shut down if the
+							//!< request times out.
 } ldap_handle_t;
 
 struct ldap_instance {
@@ -255,6 +266,8 @@ struct ldap_instance {
 	char const	*groupobj_name_attr;		//!< The name of the group.
 	char const	*groupobj_membership_filter;	//!< Filter to only retrieve groups which contain
 							//!< the user as a member.
+	xlat_exp_t	*groupobj_membership_xlat;	//!< Pre-compiled combination of the group object
+							//!< and membership filters.
 
 	bool		cacheable_group_name;		//!< If true the server will determine complete set of group
 							//!< memberships for the current user object, and perform any
@@ -285,6 +298,8 @@ struct ldap_instance {
 	char const	*clientobj_base_dn;		//!< DN to search for clients under.
 	char const	*clientobj_scope_str;		//!< Scope (sub, one, base).
 	int		clientobj_scope;		//!< Search scope.
+	uint32_t	clientobj_page_size;		//!< How many client objects to retrieve with each
+							//!< search.  0 retrieves them all at once.
 
 	bool		do_clients;			//!< If true, attempt to load clients on instantiation.
 
@@ -342,6 +357,17 @@ struct ldap_instance {
 							//!< issued for.
 #endif
 	uint32_t	res_timeout;			//!< How long we wait for a result from the server.
+	uint32_t	multiplex;			//!< Number of shared connections searches are
+							//!< multiplexed over.  0 disables multiplexing.
+	ldap_mux_t	*mux;				//!< Shared search connections.
+
+	uint32_t	cache_ttl;			//!< How long results of user, group and profile searches
+							//!< are cached for.  0 disables the cache.
+	uint32_t	cache_negative_ttl;		//!< How long searches which returned no objects are
+							//!< cached for.
+	uint32_t	cache_max_entries;		//!< Maximum number of cached searches.
+	ldap_cache_t	*cache;				//!< Search result cache.
+
 	uint32_t	srv_timelimit;			//!< How long the server should spent on a single request
 							//!< (also bounded by value on the server).
 
@@ -491,8 +517,16 @@ char *rlm_ldap_berval_to_string(TALLOC_CTX *ctx, struct berval const *in);
 
 void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout);
 
+int mod_conn_alive(void *instance, void *connection);
+
+void mod_conn_cancel(void *instance, void *connection);
+
 ldap_handle_t *mod_conn_get(rlm_ldap_t const *inst, REQUEST *request);
 
+int mod_conn_exclusive(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t **pconn);
+
+int mod_mux_init(rlm_ldap_t *inst);
+
 void mod_conn_release(rlm_ldap_t const *inst, ldap_handle_t *conn);
 
 /*
@@ -511,6 +545,20 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(rlm_ldap_t const *inst, REQUEST *requ
 
 rlm_rcode_t rlm_ldap_check_cached(rlm_ldap_t const *inst, REQUEST *request, VALUE_PAIR *check);
 
+/*
+ *	cache.c - Search result cache.
+ */
+ldap_rcode_t rlm_ldap_cache_search(LDAPMessage **result, rlm_ldap_t const *inst, REQUEST *request,
+				   ldap_handle_t **pconn,
+				   char const *dn, int scope, char const *filter, char const * const *attrs,
+				   LDAPControl **serverctrls, LDAPControl **clientctrls);
+
+void rlm_ldap_cache_msgfree(rlm_ldap_t const *inst, LDAPMessage *result);
+
+void rlm_ldap_cache_invalidate(rlm_ldap_t const *inst, REQUEST *request, char const *dn);
+
+int rlm_ldap_cache_init(rlm_ldap_t *inst);
+
 /*
  *	attrmap.c - Attribute mapping code.
  */
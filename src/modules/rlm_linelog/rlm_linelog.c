@@ -27,6 +27,7 @@ RCSID("$Id$")
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
 #include <freeradius-devel/exfile.h>
+#include <freeradius-devel/str.h>
 
 #ifdef HAVE_FCNTL_H
 #  include <fcntl.h>
@@ -100,10 +101,12 @@ typedef struct linelog_instance_t {
 
 	struct {
 		char const		*name;			//!< File to write to.
+		xlat_exp_t		*name_xlat;		//!< Pre-compiled filename expansion.
 		uint32_t		permissions;		//!< Permissions to use when creating new files.
 		char const		*group_str;		//!< Group to set on new files.
 		gid_t			group;			//!< Resolved gid.
 		exfile_t		*ef;			//!< Exclusive file access handle.
+		exfile_async_t		async;			//!< Writer thread configuration.
 		bool			escape;			//!< Do filename escaping, yes / no.
 		xlat_escape_t		escape_func;		//!< Escape function.
 	} file;
@@ -129,6 +132,7 @@ static const CONF_PARSER file_config[] = {
 	{ FR_CONF_OFFSET("permissions", PW_TYPE_INTEGER, linelog_instance_t, file.permissions), .dflt = "0600" },
 	{ FR_CONF_OFFSET("group", PW_TYPE_STRING, linelog_instance_t, file.group_str) },
 	{ FR_CONF_OFFSET("escape_filenames", PW_TYPE_BOOLEAN, linelog_instance_t, file.escape), .dflt = "no" },
+	{ FR_CONF_OFFSET("async", PW_TYPE_SUBSECTION, linelog_instance_t, file.async), .dflt = (void const *) exfile_async_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -340,17 +344,29 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	switch (inst->log_dst) {
 	case LINELOG_DST_FILE:
 	{
+		char const *error;
+
 		if (!inst->file.name) {
 			cf_log_err_cs(conf, "No value provided for 'filename'");
 			return -1;
 		}
 
+		if (xlat_compile(inst, &inst->file.name_xlat, inst->file.name, &error) < 0) {
+			cf_log_err_cs(conf, "Failed parsing 'filename': %s", error);
+			return -1;
+		}
+
 		inst->file.ef = exfile_init(inst, 64, 30, true);
 		if (!inst->file.ef) {
 			cf_log_err_cs(conf, "Failed creating log file context");
 			return -1;
 		}
 
+		if (exfile_async(inst->file.ef, &inst->file.async) < 0) {
+			cf_log_err_cs(conf, "%s", fr_strerror());
+			return -1;
+		}
+
 		if (inst->file.group_str) {
 			char *endptr;
 
@@ -442,7 +458,15 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 static size_t linelog_escape_func(UNUSED REQUEST *request, char *out, size_t outlen,
 				  char const *in, UNUSED void *arg)
 {
+	/*
+	 *	Characters >= ' ' are copied as-is, apart from the
+	 *	backslash.  'char' may be signed, in which case bytes
+	 *	>= 0x80 aren't.
+	 */
+	static fr_str_set_t const unsafe = FR_STR_SET(' ', CHAR_MAX, "\\");
+
 	int len = 0;
+	char const *end = in + strlen(in);
 
 	if (outlen == 0) return 0;
 	if (outlen == 1) {
@@ -451,6 +475,21 @@ static size_t linelog_escape_func(UNUSED REQUEST *request, char *out, size_t out
 	}
 
 	while (in[0]) {
+		size_t safe;
+
+		safe = fr_str_span(&unsafe, (uint8_t const *) in, end - in);
+		if (safe) {
+			if (outlen <= 2) break;
+
+			if (safe > (outlen - 2)) safe = outlen - 2;
+			memcpy(out, in, safe);
+			out += safe;
+			in += safe;
+			outlen -= safe;
+			len += safe;
+			continue;
+		}
+
 		if (in[0] >= ' ') {
 			if (in[0] == '\\') {
 				if (outlen <= 2) break;
@@ -512,7 +551,6 @@ static size_t linelog_escape_func(UNUSED REQUEST *request, char *out, size_t out
 static rlm_rcode_t mod_do_linelog(void *instance, REQUEST *request) CC_HINT(nonnull);
 static rlm_rcode_t mod_do_linelog(void *instance, REQUEST *request)
 {
-	int			fd = -1;
 	linelog_conn_t		*conn;
 	struct timeval		*timeout = NULL;
 
@@ -696,7 +734,7 @@ build_vector:
 	{
 		char path[2048];
 
-		if (radius_xlat(path, sizeof(path), request, inst->file.name, inst->file.escape_func, NULL) < 0) {
+		if (radius_xlat_struct(path, sizeof(path), request, inst->file.name_xlat, inst->file.escape_func, NULL) < 0) {
 			return RLM_MODULE_FAIL;
 		}
 
@@ -712,28 +750,13 @@ build_vector:
 			*p = '/';
 		}
 
-		fd = exfile_open(inst->file.ef, path, inst->file.permissions, true);
-		if (fd < 0) {
-			RERROR("Failed to open %s: %s", path, fr_syserror(errno));
+		if (exfile_write(inst->file.ef, path, inst->file.permissions,
+				 inst->file.group_str ? inst->file.group : (gid_t) -1,
+				 vector_p, vector_len) < 0) {
+			RERROR("%s", fr_strerror());
 			rcode = RLM_MODULE_FAIL;
 			goto finish;
 		}
-
-		if (inst->file.group_str && (chown(path, -1, inst->file.group) == -1)) {
-			RWARN("Unable to change system group of \"%s\": %s", path, fr_strerror());
-		}
-
-		if (writev(fd, vector_p, vector_len) < 0) {
-			RERROR("Failed writing to \"%s\": %s", path, fr_syserror(errno));
-			exfile_close(inst->file.ef, fd);
-
-			/* Assert on the extra fatal errors */
-			rad_assert((errno != EINVAL) && (errno != EFAULT));
-
-			return RLM_MODULE_FAIL;
-		}
-
-		exfile_close(inst->file.ef, fd);
 	}
 		break;
 
@@ -0,0 +1,6 @@
+TARGETNAME	:= rlm_memory_ippool
+TARGET		:= $(TARGETNAME).a
+SOURCES		:= $(TARGETNAME).c
+
+#  Shares the lease result codes and actions with rlm_redis_ippool
+SRC_CFLAGS	+= -I$(top_builddir)/src/modules/rlm_redis_ippool
@@ -0,0 +1,1090 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_memory_ippool.c
+ * @brief IP Allocation module which keeps its leases in memory.
+ *
+ * Leases have the same semantics as in rlm_redis_ippool:
+ * - Each pool is a set of addresses, ordered by expiry time.  The address
+ *   which expired the longest time ago is allocated next.
+ * - Each address records the device (and gateway) which last bound it.
+ * - A device which asks again while its lease is still valid gets the
+ *   same address back.
+ *
+ * Pools are defined in the module configuration.  Allocations are a heap
+ * operation, with no network round trips.
+ *
+ * If a journal file is configured, every change to a lease is appended
+ * to it, and the journal is replayed on startup.  When it grows too
+ * large, it's rewritten with just the current leases.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/heap.h>
+
+#include <fcntl.h>
+
+#include "redis_ippool.h"
+
+/** Largest number of addresses in a single pool
+ *
+ */
+#define MEMORY_IPPOOL_MAX_ADDRS	(1 << 24)
+
+typedef struct memory_ippool_pool memory_ippool_pool_t;
+
+/** The state of a single address
+ *
+ */
+typedef struct memory_ippool_lease {
+	uint32_t		addr;		//!< IPv4 address, in host byte order.
+	time_t			expires;	//!< When the lease expires.  In the past if the
+						//!< address is free.
+	int			heap_id;	//!< Position in the pool's heap.
+	uint32_t		counter;	//!< How many times the address has been bound.
+
+	uint8_t			*device;	//!< Device which last bound this address.
+	size_t			device_len;
+	uint8_t			*gateway;	//!< Gateway the device was behind.
+	size_t			gateway_len;
+} memory_ippool_lease_t;
+
+struct memory_ippool_pool {
+	char const		*name;
+
+	memory_ippool_lease_t	*leases;	//!< One for every address in the pool.
+	uint32_t		num_leases;
+
+	fr_heap_t		*heap;		//!< All leases, ordered by expiry.
+	fr_hash_table_t		*addrs;		//!< Leases by address.
+	fr_hash_table_t		*devices;	//!< Leases by the device which last bound them.
+};
+
+/** rlm_memory_ippool module instance
+ *
+ */
+typedef struct rlm_memory_ippool {
+	char const		*name;		//!< Instance name.
+
+	vp_tmpl_t		*pool_name;	//!< Name of the pool we're allocating IP addresses from.
+
+	vp_tmpl_t		*offer_time;	//!< How long we should reserve a lease for during
+						//!< the pre-allocation stage (typically responding
+						//!< to DHCP discover).
+	vp_tmpl_t		*lease_time;	//!< How long an IP address should be allocated for.
+
+	vp_tmpl_t		*device_id;	//!< Unique device identifier.
+	vp_tmpl_t		*gateway_id;	//!< Gateway identifier.
+
+	vp_tmpl_t		*ip_address;	//!< Attribute to read the IP for renewal from.
+	vp_tmpl_t		*reply_attr;	//!< IP attribute and destination.
+	vp_tmpl_t		*expiry_attr;	//!< Time at which the lease will expire.
+
+	bool			copy_on_update; //!< Copy the address provided by ip_address to the
+						//!< reply_attr if updates are successful.
+
+	char const		*journal_file;	//!< Where lease changes are written.
+	bool			journal_sync;	//!< fsync() after each journal write.
+	int			journal_fd;
+	uint32_t		journal_records; //!< Records written since the journal was last compacted.
+
+	fr_hash_table_t		*pools;		//!< Pools by name.
+	uint32_t		num_leases;	//!< Total addresses in all pools.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;		//!< Protects all pools, and the journal.
+#endif
+} rlm_memory_ippool_t;
+
+#ifdef HAVE_PTHREAD_H
+#  define POOL_LOCK(_inst)	pthread_mutex_lock(&(_inst)->mutex)
+#  define POOL_UNLOCK(_inst)	pthread_mutex_unlock(&(_inst)->mutex)
+#else
+#  define POOL_LOCK(_inst)
+#  define POOL_UNLOCK(_inst)
+#endif
+
+static CONF_PARSER module_config[] = {
+	{ FR_CONF_OFFSET("pool_name", PW_TYPE_TMPL, rlm_memory_ippool_t, pool_name), .dflt = "&control:Pool-Name", .quote = T_BARE_WORD },
+
+	{ FR_CONF_OFFSET("device", PW_TYPE_TMPL | PW_TYPE_REQUIRED, rlm_memory_ippool_t, device_id) },
+	{ FR_CONF_OFFSET("gateway", PW_TYPE_TMPL, rlm_memory_ippool_t, gateway_id) },
+
+	{ FR_CONF_OFFSET("offer_time", PW_TYPE_TMPL, rlm_memory_ippool_t, offer_time) },
+	{ FR_CONF_OFFSET("lease_time", PW_TYPE_TMPL | PW_TYPE_REQUIRED, rlm_memory_ippool_t, lease_time) },
+
+	{ FR_CONF_OFFSET("ip_address", PW_TYPE_TMPL | PW_TYPE_REQUIRED, rlm_memory_ippool_t, ip_address), .dflt = "%{%{DHCP-Requested-IP-Address}:-%{DHCP-Client-IP-Address}}", .quote = T_DOUBLE_QUOTED_STRING },
+	{ FR_CONF_OFFSET("reply_attr", PW_TYPE_TMPL | PW_TYPE_ATTRIBUTE | PW_TYPE_REQUIRED, rlm_memory_ippool_t, reply_attr), .dflt = "&reply:DHCP-Your-IP-Address", .quote = T_BARE_WORD },
+	{ FR_CONF_OFFSET("expiry_attr", PW_TYPE_TMPL | PW_TYPE_ATTRIBUTE, rlm_memory_ippool_t, expiry_attr) },
+
+	{ FR_CONF_OFFSET("copy_on_update", PW_TYPE_BOOLEAN, rlm_memory_ippool_t, copy_on_update), .dflt = "yes", .quote = T_BARE_WORD },
+
+	{ FR_CONF_OFFSET("journal", PW_TYPE_FILE_OUTPUT, rlm_memory_ippool_t, journal_file) },
+	{ FR_CONF_OFFSET("journal_sync", PW_TYPE_BOOLEAN, rlm_memory_ippool_t, journal_sync), .dflt = "no" },
+	CONF_PARSER_TERMINATOR
+};
+
+static int lease_cmp(void const *one, void const *two)
+{
+	memory_ippool_lease_t const *a = one, *b = two;
+
+	if (a->expires < b->expires) return -1;
+	if (a->expires > b->expires) return +1;
+
+	return (a->addr > b->addr) - (a->addr < b->addr);
+}
+
+static uint32_t lease_addr_hash(void const *data)
+{
+	memory_ippool_lease_t const *lease = data;
+
+	return fr_hash(&lease->addr, sizeof(lease->addr));
+}
+
+static int lease_addr_cmp(void const *one, void const *two)
+{
+	memory_ippool_lease_t const *a = one, *b = two;
+
+	return (a->addr > b->addr) - (a->addr < b->addr);
+}
+
+static uint32_t lease_device_hash(void const *data)
+{
+	memory_ippool_lease_t const *lease = data;
+
+	return fr_hash(lease->device, lease->device_len);
+}
+
+static int lease_device_cmp(void const *one, void const *two)
+{
+	memory_ippool_lease_t const *a = one, *b = two;
+
+	if (a->device_len != b->device_len) return (a->device_len > b->device_len) - (a->device_len < b->device_len);
+
+	return memcmp(a->device, b->device, a->device_len);
+}
+
+static uint32_t pool_hash(void const *data)
+{
+	memory_ippool_pool_t const *pool = data;
+
+	return fr_hash_string(pool->name);
+}
+
+static int pool_cmp(void const *one, void const *two)
+{
+	memory_ippool_pool_t const *a = one, *b = two;
+
+	return strcmp(a->name, b->name);
+}
+
+static int _pool_free(memory_ippool_pool_t *pool)
+{
+	if (pool->heap) fr_heap_delete(pool->heap);
+
+	return 0;
+}
+
+/** Change the expiry time of a lease, keeping the heap ordered
+ *
+ */
+static void lease_expires_set(memory_ippool_pool_t *pool, memory_ippool_lease_t *lease, time_t expires)
+{
+	fr_heap_extract(pool->heap, lease);
+	lease->expires = expires;
+	fr_heap_insert(pool->heap, lease);
+}
+
+/** Change the device bound to a lease, keeping the device index up to date
+ *
+ */
+static void lease_device_set(memory_ippool_pool_t *pool, memory_ippool_lease_t *lease,
+			     uint8_t const *device, size_t device_len)
+{
+	memory_ippool_lease_t *old;
+
+	/*
+	 *	Remove the index entry for the previous device, if
+	 *	it still points to this lease.
+	 */
+	if (lease->device) {
+		old = fr_hash_table_finddata(pool->devices, lease);
+		if (old == lease) fr_hash_table_delete(pool->devices, lease);
+		TALLOC_FREE(lease->device);
+		lease->device_len = 0;
+	}
+
+	if (!device || !device_len) return;
+
+	lease->device = talloc_memdup(pool->leases, device, device_len);
+	lease->device_len = device_len;
+
+	/*
+	 *	The device may have been bound to another address
+	 *	which has since been given away.  It now maps to
+	 *	this one.
+	 */
+	old = fr_hash_table_finddata(pool->devices, lease);
+	if (old) fr_hash_table_delete(pool->devices, old);
+	fr_hash_table_insert(pool->devices, lease);
+}
+
+static void lease_gateway_set(memory_ippool_pool_t *pool, memory_ippool_lease_t *lease,
+			      uint8_t const *gateway, size_t gateway_len)
+{
+	if ((gateway_len == lease->gateway_len) &&
+	    ((gateway_len == 0) || (memcmp(gateway, lease->gateway, gateway_len) == 0))) return;
+
+	TALLOC_FREE(lease->gateway);
+	lease->gateway_len = 0;
+
+	if (!gateway || !gateway_len) return;
+
+	lease->gateway = talloc_memdup(pool->leases, gateway, gateway_len);
+	lease->gateway_len = gateway_len;
+}
+
+/** Write the state of a lease to a file descriptor
+ *
+ * Format is @verbatim <pool>\t<ip>\t<expires>\t<counter>\t<device hex>\t<gateway hex>\n @endverbatim
+ */
+static int journal_write_lease(int fd, memory_ippool_pool_t *pool, memory_ippool_lease_t *lease)
+{
+	char		buffer[1024], *p = buffer, *end = buffer + sizeof(buffer);
+	struct in_addr	in;
+	size_t		len;
+
+	if (((lease->device_len + lease->gateway_len) * 2) + strlen(pool->name) + 64 > sizeof(buffer)) return -1;
+
+	in.s_addr = htonl(lease->addr);
+
+	len = snprintf(p, end - p, "%s\t", pool->name);
+	p += len;
+	inet_ntop(AF_INET, &in, p, end - p);
+	p += strlen(p);
+	len = snprintf(p, end - p, "\t%" PRId64 "\t%u\t", (int64_t) lease->expires, lease->counter);
+	p += len;
+	p += fr_bin2hex(p, lease->device, lease->device_len);
+	*p++ = '\t';
+	p += fr_bin2hex(p, lease->gateway, lease->gateway_len);
+	*p++ = '\n';
+
+	if (write(fd, buffer, p - buffer) != (p - buffer)) return -1;
+
+	return 0;
+}
+
+typedef struct {
+	int			fd;
+	memory_ippool_pool_t	*pool;
+	int			ret;
+} journal_compact_ctx_t;
+
+static int _journal_compact_pool(void *ctx, void *data)
+{
+	journal_compact_ctx_t	*jc = ctx;
+	memory_ippool_pool_t	*pool = data;
+	uint32_t		i;
+
+	for (i = 0; i < pool->num_leases; i++) {
+		if (!pool->leases[i].device && !pool->leases[i].counter) continue;
+
+		if (journal_write_lease(jc->fd, pool, &pool->leases[i]) < 0) {
+			jc->ret = -1;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/** Rewrite the journal with just the current state of each lease
+ *
+ * The new journal is written alongside the old one, and renamed over it,
+ * so there's always a complete journal on disk.
+ */
+static int journal_compact(rlm_memory_ippool_t *inst)
+{
+	char			tmp[PATH_MAX];
+	journal_compact_ctx_t	jc = { .ret = 0 };
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", inst->journal_file);
+
+	jc.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (jc.fd < 0) {
+		ERROR("rlm_memory_ippool (%s): Failed creating %s: %s", inst->name, tmp, fr_syserror(errno));
+		return -1;
+	}
+
+	fr_hash_table_walk(inst->pools, _journal_compact_pool, &jc);
+	if ((jc.ret < 0) || (fsync(jc.fd) < 0)) {
+		ERROR("rlm_memory_ippool (%s): Failed writing %s: %s", inst->name, tmp, fr_syserror(errno));
+	error:
+		close(jc.fd);
+		unlink(tmp);
+		return -1;
+	}
+
+	if (rename(tmp, inst->journal_file) < 0) {
+		ERROR("rlm_memory_ippool (%s): Failed renaming %s: %s", inst->name, tmp, fr_syserror(errno));
+		goto error;
+	}
+	close(jc.fd);
+
+	if (inst->journal_fd >= 0) close(inst->journal_fd);
+	inst->journal_fd = open(inst->journal_file, O_WRONLY | O_APPEND);
+	if (inst->journal_fd < 0) {
+		ERROR("rlm_memory_ippool (%s): Failed opening %s: %s", inst->name,
+		      inst->journal_file, fr_syserror(errno));
+		return -1;
+	}
+	inst->journal_records = 0;
+
+	return 0;
+}
+
+/** Record a change to a lease
+ *
+ * Must be called with the instance mutex held.
+ */
+static void journal_append(rlm_memory_ippool_t *inst, REQUEST *request,
+			   memory_ippool_pool_t *pool, memory_ippool_lease_t *lease)
+{
+	if (inst->journal_fd < 0) return;
+
+	if (journal_write_lease(inst->journal_fd, pool, lease) < 0) {
+		RWDEBUG("Failed writing lease to journal: %s", fr_syserror(errno));
+		return;
+	}
+	if (inst->journal_sync) fsync(inst->journal_fd);
+
+	/*
+	 *	Keep the journal to a few times the size of the
+	 *	pools, so replaying it on startup stays quick.
+	 */
+	if (++inst->journal_records > (inst->num_leases * 4) + 1024) journal_compact(inst);
+}
+
+/** Apply the records in the journal to the pools
+ *
+ * Records for pools or addresses which are no longer configured are
+ * ignored.  So is a partial last record, from a crash during a write.
+ */
+static int journal_replay(rlm_memory_ippool_t *inst)
+{
+	FILE			*fp;
+	char			buffer[1024];
+	uint8_t			device[256], gateway[256];
+	int			lineno = 0, applied = 0;
+
+	fp = fopen(inst->journal_file, "r");
+	if (!fp) {
+		if (errno == ENOENT) return 0;
+
+		ERROR("rlm_memory_ippool (%s): Failed opening %s: %s", inst->name,
+		      inst->journal_file, fr_syserror(errno));
+		return -1;
+	}
+
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		char			*field[6], *p, *q;
+		int			i;
+		memory_ippool_pool_t	find_pool, *pool;
+		memory_ippool_lease_t	find_lease, *lease;
+		struct in_addr		in;
+		size_t			device_len, gateway_len;
+
+		lineno++;
+
+		p = strchr(buffer, '\n');
+		if (!p) break;
+		*p = '\0';
+
+		for (i = 0, p = buffer; i < 6; i++) {
+			field[i] = p;
+			q = strchr(p, '\t');
+			if (!q) break;
+			*q = '\0';
+			p = q + 1;
+		}
+		if (i != 5) {
+			WARN("rlm_memory_ippool (%s): Ignoring malformed record at %s[%i]", inst->name,
+			     inst->journal_file, lineno);
+			continue;
+		}
+
+		find_pool.name = field[0];
+		pool = fr_hash_table_finddata(inst->pools, &find_pool);
+		if (!pool) continue;
+
+		if (inet_pton(AF_INET, field[1], &in) != 1) continue;
+		find_lease.addr = ntohl(in.s_addr);
+		lease = fr_hash_table_finddata(pool->addrs, &find_lease);
+		if (!lease) continue;
+
+		device_len = fr_hex2bin(device, sizeof(device), field[4], strlen(field[4]));
+		gateway_len = fr_hex2bin(gateway, sizeof(gateway), field[5], strlen(field[5]));
+
+		lease_expires_set(pool, lease, (time_t) strtoll(field[2], NULL, 10));
+		lease->counter = strtoul(field[3], NULL, 10);
+		lease_device_set(pool, lease, device, device_len);
+		lease_gateway_set(pool, lease, gateway, gateway_len);
+		applied++;
+	}
+	fclose(fp);
+
+	INFO("rlm_memory_ippool (%s): Restored %i lease records from %s", inst->name, applied, inst->journal_file);
+
+	return 0;
+}
+
+/** Add the addresses in a range to a pool
+ *
+ * Ranges are either @verbatim <start>-<end> @endverbatim or @verbatim <network>/<prefix> @endverbatim.
+ */
+static int pool_range_parse(CONF_PAIR *cp, uint32_t *start, uint32_t *end)
+{
+	char const	*value = cf_pair_value(cp);
+	char const	*dash;
+	fr_ipaddr_t	a, b;
+
+	dash = strchr(value, '-');
+	if (dash) {
+		if ((fr_inet_pton4(&a, value, dash - value, false, false, false) < 0) ||
+		    (fr_inet_pton4(&b, dash + 1, -1, false, false, false) < 0)) {
+			cf_log_err_cp(cp, "Invalid range \"%s\": %s", value, fr_strerror());
+			return -1;
+		}
+		*start = ntohl(a.ipaddr.ip4addr.s_addr);
+		*end = ntohl(b.ipaddr.ip4addr.s_addr);
+	} else {
+		if (fr_inet_pton4(&a, value, -1, false, false, true) < 0) {
+			cf_log_err_cp(cp, "Invalid range \"%s\": %s", value, fr_strerror());
+			return -1;
+		}
+		*start = ntohl(a.ipaddr.ip4addr.s_addr);
+		*end = *start | (a.prefix ? (uint32_t)(0xffffffffULL >> a.prefix) : 0xffffffff);
+
+		/*
+		 *	Don't hand out the network and broadcast
+		 *	addresses of real networks.
+		 */
+		if (a.prefix < 31) {
+			(*start)++;
+			(*end)--;
+		}
+	}
+
+	if (*end < *start) {
+		cf_log_err_cp(cp, "Invalid range \"%s\": end is before start", value);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Create a pool from a "pool <name> { range = ... }" section
+ *
+ */
+static memory_ippool_pool_t *pool_alloc(rlm_memory_ippool_t *inst, CONF_SECTION *cs)
+{
+	memory_ippool_pool_t	*pool;
+	CONF_PAIR		*cp;
+	uint64_t		num = 0;
+	uint32_t		start, end, addr, i = 0;
+
+	pool = talloc_zero(inst, memory_ippool_pool_t);
+	if (!pool) return NULL;
+	talloc_set_destructor(pool, _pool_free);
+
+	pool->name = cf_section_name2(cs);
+	if (!pool->name) {
+		cf_log_err_cs(cs, "Pools must have a name");
+	error:
+		talloc_free(pool);
+		return NULL;
+	}
+
+	for (cp = cf_pair_find(cs, "range"); cp; cp = cf_pair_find_next(cs, cp, "range")) {
+		if (pool_range_parse(cp, &start, &end) < 0) goto error;
+		num += ((uint64_t) end - start) + 1;
+	}
+
+	if (num == 0) {
+		cf_log_err_cs(cs, "Pool %s has no addresses", pool->name);
+		goto error;
+	}
+	if (num > MEMORY_IPPOOL_MAX_ADDRS) {
+		cf_log_err_cs(cs, "Pool %s has too many addresses (%" PRIu64 " > %u)", pool->name,
+			      num, MEMORY_IPPOOL_MAX_ADDRS);
+		goto error;
+	}
+
+	pool->leases = talloc_zero_array(pool, memory_ippool_lease_t, num);
+	pool->heap = fr_heap_create(lease_cmp, offsetof(memory_ippool_lease_t, heap_id));
+	pool->addrs = fr_hash_table_create(pool, lease_addr_hash, lease_addr_cmp, NULL);
+	pool->devices = fr_hash_table_create(pool, lease_device_hash, lease_device_cmp, NULL);
+	if (!pool->leases || !pool->heap || !pool->addrs || !pool->devices) {
+		cf_log_err_cs(cs, "Out of memory");
+		goto error;
+	}
+
+	for (cp = cf_pair_find(cs, "range"); cp; cp = cf_pair_find_next(cs, cp, "range")) {
+		(void) pool_range_parse(cp, &start, &end);
+
+		for (addr = start; ; addr++) {
+			memory_ippool_lease_t *lease = &pool->leases[i];
+
+			lease->addr = addr;
+			lease->heap_id = -1;
+			if (!fr_hash_table_insert(pool->addrs, lease)) {
+				cf_log_err_cp(cp, "Address in range \"%s\" is already in pool %s",
+					      cf_pair_value(cp), pool->name);
+				goto error;
+			}
+			fr_heap_insert(pool->heap, lease);
+			i++;
+
+			if (addr == end) break;
+		}
+	}
+	pool->num_leases = i;
+
+	return pool;
+}
+
+/** Allocate a lease, or return the device's existing one
+ *
+ * @return
+ *	- IPPOOL_RCODE_SUCCESS, with out and expires_in set.
+ *	- IPPOOL_RCODE_POOL_EMPTY if there are no free addresses.
+ */
+static ippool_rcode_t memory_ippool_allocate(rlm_memory_ippool_t *inst, REQUEST *request,
+					     memory_ippool_pool_t *pool,
+					     uint8_t const *device_id, size_t device_id_len,
+					     uint8_t const *gateway_id, size_t gateway_id_len,
+					     uint32_t expires, uint32_t *out, uint32_t *expires_in)
+{
+	memory_ippool_lease_t	find, *lease;
+	time_t			now = request->timestamp.tv_sec;
+
+	/*
+	 *	Check to see if the device already has a lease,
+	 *	and if it does return that.
+	 */
+	memcpy(&find.device, &device_id, sizeof(find.device));
+	find.device_len = device_id_len;
+
+	lease = fr_hash_table_finddata(pool->devices, &find);
+	if (lease && (lease->expires > now)) {
+		*out = lease->addr;
+		*expires_in = lease->expires - now;
+		return IPPOOL_RCODE_SUCCESS;
+	}
+
+	/*
+	 *	Else, get the IP address which expired the longest
+	 *	time ago.
+	 */
+	lease = fr_heap_peek(pool->heap);
+	if (!lease || (lease->expires >= now)) return IPPOOL_RCODE_POOL_EMPTY;
+
+	lease_expires_set(pool, lease, now + expires);
+	lease_device_set(pool, lease, device_id, device_id_len);
+	lease_gateway_set(pool, lease, gateway_id, gateway_id_len);
+	lease->counter++;
+
+	journal_append(inst, request, pool, lease);
+
+	*out = lease->addr;
+	*expires_in = expires;
+
+	return IPPOOL_RCODE_SUCCESS;
+}
+
+/** Extend an existing lease
+ *
+ */
+static ippool_rcode_t memory_ippool_update(rlm_memory_ippool_t *inst, REQUEST *request,
+					   memory_ippool_pool_t *pool, uint32_t addr,
+					   uint8_t const *device_id, size_t device_id_len,
+					   uint8_t const *gateway_id, size_t gateway_id_len,
+					   uint32_t expires)
+{
+	memory_ippool_lease_t	find, *lease;
+
+	find.addr = addr;
+	lease = fr_hash_table_finddata(pool->addrs, &find);
+	if (!lease) return IPPOOL_RCODE_NOT_FOUND;
+
+	if ((lease->device_len != device_id_len) ||
+	    (device_id_len && (memcmp(lease->device, device_id, device_id_len) != 0))) {
+		return IPPOOL_RCODE_DEVICE_MISMATCH;
+	}
+
+	lease_expires_set(pool, lease, request->timestamp.tv_sec + expires);
+	lease_gateway_set(pool, lease, gateway_id, gateway_id_len);
+
+	/*
+	 *	The device may have been given another address,
+	 *	in the cusp between its lease expiring and being
+	 *	renewed.  It's now bound to this one.
+	 */
+	if (fr_hash_table_finddata(pool->devices, lease) != lease) {
+		fr_hash_table_delete(pool->devices, lease);
+		fr_hash_table_insert(pool->devices, lease);
+	}
+
+	journal_append(inst, request, pool, lease);
+
+	return IPPOOL_RCODE_SUCCESS;
+}
+
+/** Release a lease
+ *
+ * Sets the expiry time to now - 1 to maximise the time between
+ * allocations of the address.
+ */
+static ippool_rcode_t memory_ippool_release(rlm_memory_ippool_t *inst, REQUEST *request,
+					    memory_ippool_pool_t *pool, uint32_t addr,
+					    uint8_t const *device_id, size_t device_id_len)
+{
+	memory_ippool_lease_t	find, *lease;
+
+	find.addr = addr;
+	lease = fr_hash_table_finddata(pool->addrs, &find);
+	if (!lease || !lease->device) return IPPOOL_RCODE_NOT_FOUND;
+
+	if ((lease->device_len != device_id_len) || (memcmp(lease->device, device_id, device_id_len) != 0)) {
+		return IPPOOL_RCODE_DEVICE_MISMATCH;
+	}
+
+	lease_expires_set(pool, lease, request->timestamp.tv_sec - 1);
+
+	/*
+	 *	Remove the association between the device and the
+	 *	lease, but remember which device last had the address.
+	 */
+	if (fr_hash_table_finddata(pool->devices, lease) == lease) fr_hash_table_delete(pool->devices, lease);
+	lease->counter++;
+
+	journal_append(inst, request, pool, lease);
+
+	return IPPOOL_RCODE_SUCCESS;
+}
+
+/** Release all the leases bound through a gateway
+ *
+ * Used when a NAS sends Accounting-On or Accounting-Off, at which
+ * point none of the sessions it had are active any more.
+ *
+ * @return the number of leases released.
+ */
+static uint32_t memory_ippool_bulk_release(rlm_memory_ippool_t *inst, REQUEST *request,
+					   memory_ippool_pool_t *pool,
+					   uint8_t const *gateway_id, size_t gateway_id_len)
+{
+	time_t			now = request->timestamp.tv_sec;
+	uint32_t		i, released = 0;
+
+	for (i = 0; i < pool->num_leases; i++) {
+		memory_ippool_lease_t *lease = &pool->leases[i];
+
+		if (lease->expires <= now) continue;
+		if ((lease->gateway_len != gateway_id_len) ||
+		    (memcmp(lease->gateway, gateway_id, gateway_id_len) != 0)) continue;
+
+		/*
+		 *	Only the expiry changes the lease's position in
+		 *	the heap, and we're walking the array, so this
+		 *	doesn't disturb the iteration.
+		 */
+		lease_expires_set(pool, lease, now - 1);
+
+		if (fr_hash_table_finddata(pool->devices, lease) == lease) fr_hash_table_delete(pool->devices, lease);
+		lease->counter++;
+
+		journal_append(inst, request, pool, lease);
+		released++;
+	}
+
+	return released;
+}
+
+/** Write a string value to the attribute described by a tmpl
+ *
+ */
+static int memory_ippool_reply(REQUEST *request, vp_tmpl_t const *vpt, char const *value)
+{
+	VALUE_PAIR *vp;
+
+	if (tmpl_find_or_add_vp(&vp, request, vpt) < 0) {
+		REDEBUG("Failed adding %s", vpt->name);
+		return -1;
+	}
+
+	if (fr_pair_value_from_str(vp, value, -1) < 0) {
+		REDEBUG("Failed setting %s: %s", vpt->name, fr_strerror());
+		return -1;
+	}
+	rdebug_pair(L_DBG_LVL_2, request, vp, NULL);
+
+	return 0;
+}
+
+/** Expand a time (offer_time or lease_time)
+ *
+ */
+static int memory_ippool_time(REQUEST *request, vp_tmpl_t const *vpt, uint32_t *out)
+{
+	char		buff[20];
+	char const	*str;
+	char		*q;
+
+	if (tmpl_expand(&str, buff, sizeof(buff), request, vpt, NULL, NULL) < 0) {
+		REDEBUG("Failed expanding %s", vpt->name);
+		return -1;
+	}
+
+	*out = strtoul(str, &q, 10);
+	if (q != (str + strlen(str))) {
+		REDEBUG("Invalid time \"%s\".  Must be an integer value", str);
+		return -1;
+	}
+
+	return 0;
+}
+
+static rlm_rcode_t mod_action(rlm_memory_ippool_t *inst, REQUEST *request, ippool_action_t action)
+{
+	char			pool_name_buff[256], device_id_buff[256], gateway_id_buff[256];
+	char			ip_buff[INET6_ADDRSTRLEN + 4];
+	char const		*pool_name, *ip_str;
+	uint8_t const		*device_id = NULL, *gateway_id = NULL;
+	size_t			device_id_len = 0, gateway_id_len = 0;
+	ssize_t			slen;
+	memory_ippool_pool_t	find, *pool;
+	fr_ipaddr_t		ip;
+	struct in_addr		in;
+	uint32_t		expires, addr, expires_in;
+	ippool_rcode_t		ret;
+	uint32_t		released;
+
+	if (tmpl_expand(&pool_name, pool_name_buff, sizeof(pool_name_buff),
+			request, inst->pool_name, NULL, NULL) < 0) {
+		REDEBUG("Failed expanding pool_name (%s)", inst->pool_name->name);
+		return RLM_MODULE_FAIL;
+	}
+
+	find.name = pool_name;
+	pool = fr_hash_table_finddata(inst->pools, &find);
+	if (!pool) {
+		RDEBUG2("No pool named \"%s\"", pool_name);
+		return RLM_MODULE_NOOP;
+	}
+
+	/*
+	 *	Accounting-On/Off packets identify the NAS, not a
+	 *	device, so there's no device to expand.
+	 */
+	if (action != POOL_ACTION_BULK_RELEASE) {
+		slen = tmpl_expand((char const **)&device_id, device_id_buff, sizeof(device_id_buff),
+				   request, inst->device_id, NULL, NULL);
+		if (slen < 0) {
+			REDEBUG("Failed expanding device (%s)", inst->device_id->name);
+			return RLM_MODULE_FAIL;
+		}
+		device_id_len = (size_t)slen;
+	}
+
+	if (inst->gateway_id) {
+		slen = tmpl_expand((char const **)&gateway_id, gateway_id_buff, sizeof(gateway_id_buff),
+				   request, inst->gateway_id, NULL, NULL);
+		if (slen < 0) {
+			REDEBUG("Failed expanding gateway (%s)", inst->gateway_id->name);
+			return RLM_MODULE_FAIL;
+		}
+		gateway_id_len = (size_t)slen;
+	}
+
+	switch (action) {
+	case POOL_ACTION_ALLOCATE:
+		if (memory_ippool_time(request, inst->offer_time, &expires) < 0) return RLM_MODULE_FAIL;
+
+		POOL_LOCK(inst);
+		ret = memory_ippool_allocate(inst, request, pool, device_id, device_id_len,
+					     gateway_id, gateway_id_len, expires, &addr, &expires_in);
+		POOL_UNLOCK(inst);
+
+		switch (ret) {
+		case IPPOOL_RCODE_SUCCESS:
+			in.s_addr = htonl(addr);
+			inet_ntop(AF_INET, &in, ip_buff, sizeof(ip_buff));
+			RDEBUG2("Allocated %s from pool %s", ip_buff, pool->name);
+
+			if (memory_ippool_reply(request, inst->reply_attr, ip_buff) < 0) return RLM_MODULE_FAIL;
+			if (inst->expiry_attr) {
+				char expires_buff[20];
+
+				snprintf(expires_buff, sizeof(expires_buff), "%u", expires_in);
+				if (memory_ippool_reply(request, inst->expiry_attr, expires_buff) < 0) {
+					return RLM_MODULE_FAIL;
+				}
+			}
+			return RLM_MODULE_UPDATED;
+
+		case IPPOOL_RCODE_POOL_EMPTY:
+			RWDEBUG("Pool contains no free addresses");
+			return RLM_MODULE_NOTFOUND;
+
+		default:
+			return RLM_MODULE_FAIL;
+		}
+
+	case POOL_ACTION_UPDATE:
+	case POOL_ACTION_RELEASE:
+		if (tmpl_expand(&ip_str, ip_buff, sizeof(ip_buff), request, inst->ip_address, NULL, NULL) < 0) {
+			REDEBUG("Failed expanding ip_address (%s)", inst->ip_address->name);
+			return RLM_MODULE_FAIL;
+		}
+
+		if (fr_inet_pton4(&ip, ip_str, -1, false, false, true) < 0) {
+			REDEBUG("%s", fr_strerror());
+			return RLM_MODULE_FAIL;
+		}
+		addr = ntohl(ip.ipaddr.ip4addr.s_addr);
+
+		if (action == POOL_ACTION_RELEASE) {
+			POOL_LOCK(inst);
+			ret = memory_ippool_release(inst, request, pool, addr, device_id, device_id_len);
+			POOL_UNLOCK(inst);
+
+			if (ret == IPPOOL_RCODE_SUCCESS) {
+				RDEBUG2("IP address released");
+				return RLM_MODULE_UPDATED;
+			}
+		} else {
+			if (memory_ippool_time(request, inst->lease_time, &expires) < 0) return RLM_MODULE_FAIL;
+
+			POOL_LOCK(inst);
+			ret = memory_ippool_update(inst, request, pool, addr, device_id, device_id_len,
+						   gateway_id, gateway_id_len, expires);
+			POOL_UNLOCK(inst);
+
+			if (ret == IPPOOL_RCODE_SUCCESS) {
+				RDEBUG2("IP address lease updated");
+
+				if (inst->copy_on_update &&
+				    (memory_ippool_reply(request, inst->reply_attr, ip_str) < 0)) return RLM_MODULE_FAIL;
+
+				return RLM_MODULE_UPDATED;
+			}
+		}
+
+		switch (ret) {
+		/*
+		 *	It's useful to be able to identify the 'not found' case
+		 *	as we can relay to a server where the IP address might
+		 *	be found.
+		 */
+		case IPPOOL_RCODE_NOT_FOUND:
+			REDEBUG("IP address is not a member of the specified pool");
+			return RLM_MODULE_NOTFOUND;
+
+		case IPPOOL_RCODE_DEVICE_MISMATCH:
+			REDEBUG("IP address lease allocated to another device");
+			return RLM_MODULE_INVALID;
+
+		default:
+			return RLM_MODULE_FAIL;
+		}
+
+	/*
+	 *	Without a gateway, we can't tell which leases
+	 *	belonged to the NAS, and releasing all of them
+	 *	would be wrong.
+	 */
+	case POOL_ACTION_BULK_RELEASE:
+		if (!gateway_id_len) {
+			REDEBUG("Bulk release requires a gateway identifier");
+			return RLM_MODULE_INVALID;
+		}
+
+		POOL_LOCK(inst);
+		released = memory_ippool_bulk_release(inst, request, pool, gateway_id, gateway_id_len);
+		POOL_UNLOCK(inst);
+
+		if (!released) {
+			RDEBUG2("No leases bound through gateway");
+			return RLM_MODULE_NOTFOUND;
+		}
+
+		RDEBUG2("Released %u lease(s) bound through gateway", released);
+		return RLM_MODULE_UPDATED;
+
+	default:
+		rad_assert(0);
+		return RLM_MODULE_FAIL;
+	}
+}
+
+static rlm_rcode_t mod_accounting(void *instance, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_accounting(void *instance, REQUEST *request)
+{
+	rlm_memory_ippool_t	*inst = instance;
+	VALUE_PAIR		*vp;
+
+	/*
+	 *	Pool-Action override
+	 */
+	vp = fr_pair_find_by_num(request->config, 0, PW_POOL_ACTION, TAG_ANY);
+	if (vp) return mod_action(inst, request, vp->vp_integer);
+
+	/*
+	 *	Otherwise, guess the action by Acct-Status-Type
+	 */
+	vp = fr_pair_find_by_num(request->packet->vps, 0, PW_ACCT_STATUS_TYPE, TAG_ANY);
+	if (!vp) {
+		RDEBUG2("Couldn't find &request:Acct-Status-Type or &control:Pool-Action, doing nothing...");
+		return RLM_MODULE_NOOP;
+	}
+
+	switch (vp->vp_integer) {
+	case PW_STATUS_START:
+	case PW_STATUS_ALIVE:
+		return mod_action(inst, request, POOL_ACTION_UPDATE);
+
+	case PW_STATUS_STOP:
+		return mod_action(inst, request, POOL_ACTION_RELEASE);
+
+	case PW_STATUS_ACCOUNTING_OFF:
+	case PW_STATUS_ACCOUNTING_ON:
+		return mod_action(inst, request, POOL_ACTION_BULK_RELEASE);
+
+	default:
+		return RLM_MODULE_NOOP;
+	}
+}
+
+static rlm_rcode_t mod_post_auth(void *instance, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_post_auth(void *instance, REQUEST *request)
+{
+	rlm_memory_ippool_t	*inst = instance;
+	VALUE_PAIR		*vp;
+
+	/*
+	 *	Unless it's overridden the default action is to allocate
+	 *	when called in Post-Auth.
+	 */
+	vp = fr_pair_find_by_num(request->config, 0, PW_POOL_ACTION, TAG_ANY);
+	return mod_action(inst, request, vp ? vp->vp_integer : POOL_ACTION_ALLOCATE);
+}
+
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_memory_ippool_t	*inst = instance;
+	CONF_SECTION		*cs;
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	inst->journal_fd = -1;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&inst->mutex, NULL);
+#endif
+
+	rad_assert(inst->reply_attr->type == TMPL_TYPE_ATTR);
+
+	/*
+	 *	If we don't have a separate time specifically for offers
+	 *	just use the lease time.
+	 */
+	if (!inst->offer_time) inst->offer_time = inst->lease_time;
+
+	inst->pools = fr_hash_table_create(inst, pool_hash, pool_cmp, NULL);
+	if (!inst->pools) return -1;
+
+	for (cs = cf_subsection_find_next(conf, NULL, "pool");
+	     cs;
+	     cs = cf_subsection_find_next(conf, cs, "pool")) {
+		memory_ippool_pool_t *pool;
+
+		pool = pool_alloc(inst, cs);
+		if (!pool) return -1;
+
+		if (!fr_hash_table_insert(inst->pools, pool)) {
+			cf_log_err_cs(cs, "Duplicate pool %s", pool->name);
+			return -1;
+		}
+		inst->num_leases += pool->num_leases;
+	}
+
+	if (!fr_hash_table_num_elements(inst->pools)) {
+		cf_log_err_cs(conf, "At least one pool must be defined");
+		return -1;
+	}
+
+	if (inst->journal_file) {
+		if (journal_replay(inst) < 0) return -1;
+
+		/*
+		 *	Start with a compact journal, which also
+		 *	drops records for pools which have gone.
+		 */
+		if (journal_compact(inst) < 0) return -1;
+	}
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_memory_ippool_t *inst = instance;
+
+	if (inst->journal_fd >= 0) {
+		fsync(inst->journal_fd);
+		close(inst->journal_fd);
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&inst->mutex);
+#endif
+
+	return 0;
+}
+
+extern module_t rlm_memory_ippool;
+module_t rlm_memory_ippool = {
+	.magic		= RLM_MODULE_INIT,
+	.name		= "memory_ippool",
+	.type		= RLM_TYPE_THREAD_SAFE,
+	.inst_size	= sizeof(rlm_memory_ippool_t),
+	.config		= module_config,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.methods = {
+		[MOD_ACCOUNTING]	= mod_accounting,
+		[MOD_AUTHORIZE]		= mod_post_auth,
+		[MOD_POST_AUTH]		= mod_post_auth,
+	},
+};
@@ -44,6 +44,8 @@ RCSID("$Id$")
  *	 0    success
  *	 -1   auth failure
  *	 -648 password expired
+ *	 -647 account locked out
+ *	 -691 account disabled
  */
 int do_auth_wbclient(rlm_mschap_t *inst, REQUEST *request,
 		     uint8_t const *challenge, uint8_t const *response,
@@ -122,7 +124,15 @@ int do_auth_wbclient(rlm_mschap_t *inst, REQUEST *request,
 
 	err = wbcCtxAuthenticateUserEx(wb_ctx, &authparams, &info, &error);
 
-	fr_connection_release(inst->wb_pool, wb_ctx);
+	/*
+	 * Don't hand a context which lost its connection to winbind
+	 * to the next request, the pool will open a new one.
+	 */
+	if (err == WBC_ERR_WINBIND_NOT_AVAILABLE) {
+		fr_connection_close(inst->wb_pool, wb_ctx);
+	} else {
+		fr_connection_release(inst->wb_pool, wb_ctx);
+	}
 
 
 	/*
@@ -151,11 +161,17 @@ int do_auth_wbclient(rlm_mschap_t *inst, REQUEST *request,
 		}
 
 		/*
-		 * The password needs to be changed, so set rcode appropriately.
+		 * Map the NT status to the same MS-CHAP error codes as
+		 * the ntlm_auth methods.  These are status codes, not
+		 * flags, so they must be compared exactly.
 		 */
-		if (error->nt_status & NT_STATUS_PASSWORD_EXPIRED ||
-		    error->nt_status & NT_STATUS_PASSWORD_MUST_CHANGE) {
+		if ((error->nt_status == NT_STATUS_PASSWORD_EXPIRED) ||
+		    (error->nt_status == NT_STATUS_PASSWORD_MUST_CHANGE)) {
 			rcode = -648;
+		} else if (error->nt_status == NT_STATUS_ACCOUNT_LOCKED_OUT) {
+			rcode = -647;
+		} else if (error->nt_status == NT_STATUS_ACCOUNT_DISABLED) {
+			rcode = -691;
 		}
 
 		/*
@@ -30,6 +30,7 @@ RCSID("$Id$")
 #include <freeradius-devel/rad_assert.h>
 #include <freeradius-devel/md5.h>
 #include <freeradius-devel/sha1.h>
+#include <freeradius-devel/base64.h>
 
 #include <ctype.h>
 
@@ -555,6 +556,10 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("with_ntdomain_hack", PW_TYPE_BOOLEAN, rlm_mschap_t, with_ntdomain_hack), .dflt = "yes" },
 	{ FR_CONF_OFFSET("ntlm_auth", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_mschap_t, ntlm_auth) },
 	{ FR_CONF_OFFSET("ntlm_auth_timeout", PW_TYPE_INTEGER, rlm_mschap_t, ntlm_auth_timeout) },
+	{ FR_CONF_OFFSET("ntlm_auth_helper", PW_TYPE_STRING, rlm_mschap_t, ntlm_auth_helper) },
+	{ FR_CONF_OFFSET("ntlm_auth_helpers", PW_TYPE_INTEGER, rlm_mschap_t, ntlm_auth_helpers), .dflt = "5" },
+	{ FR_CONF_OFFSET("ntlm_auth_helper_username", PW_TYPE_TMPL, rlm_mschap_t, ntlm_helper_username) },
+	{ FR_CONF_OFFSET("ntlm_auth_helper_domain", PW_TYPE_TMPL, rlm_mschap_t, ntlm_helper_domain) },
 	{ FR_CONF_POINTER("passchange", PW_TYPE_SUBSECTION, NULL), .dflt = (void const *) passchange_config },
 	{ FR_CONF_OFFSET("allow_retry", PW_TYPE_BOOLEAN, rlm_mschap_t, allow_retry), .dflt = "yes" },
 	{ FR_CONF_OFFSET("retry_msg", PW_TYPE_STRING, rlm_mschap_t, retry_msg) },
@@ -620,6 +625,14 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 #endif
 	}
 
+	if (inst->ntlm_auth_helper) {
+		if (!inst->ntlm_helper_username) {
+			cf_log_err_cs(conf, "'ntlm_auth_helper_username' must be set when using 'ntlm_auth_helper'");
+			return -1;
+		}
+		inst->method = AUTH_NTLMAUTH_HELPER;
+	}
+
 	/* preserve existing behaviour: this option overrides all */
 	if (inst->ntlm_auth) {
 		inst->method = AUTH_NTLMAUTH_EXEC;
@@ -632,6 +645,9 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	case AUTH_NTLMAUTH_EXEC:
 		DEBUG("      %s : authenticating by calling 'ntlm_auth'", inst->xlat_name);
 		break;
+	case AUTH_NTLMAUTH_HELPER:
+		DEBUG("      %s : authenticating via persistent 'ntlm_auth' helpers", inst->xlat_name);
+		break;
 #ifdef WITH_AUTH_WINBIND
 	case AUTH_WBCLIENT:
 		DEBUG("      %s : authenticating directly to winbind", inst->xlat_name);
@@ -656,6 +672,24 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	/*
+	 *	Start the helpers now the timeout is known
+	 */
+	if (inst->method == AUTH_NTLMAUTH_HELPER) {
+		if (inst->ntlm_auth_helpers < 1) {
+			cf_log_err_cs(conf, "ntlm_auth_helpers '%d' is too small (minimum: 1)",
+				      inst->ntlm_auth_helpers);
+			return -1;
+		}
+
+		inst->ntlm_helper_pool = exec_helper_pool_alloc(inst, inst->ntlm_auth_helper, inst->ntlm_auth_helpers,
+								".", inst->ntlm_auth_timeout);
+		if (!inst->ntlm_helper_pool) {
+			cf_log_err_cs(conf, "Failed starting ntlm_auth helpers");
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -1094,6 +1128,145 @@ ntlm_auth_err:
 	return -1;
 }
 
+/*
+ *	Map an ntlm_auth error message to an MS-CHAP error code
+ */
+static int mschap_ntlm_auth_error(REQUEST *request, char const *msg)
+{
+	/*
+	 *	look for "Password expired", or "Must change password".
+	 */
+	if (strcasestr(msg, "Password expired") ||
+	    strcasestr(msg, "Must change password")) {
+		REDEBUG2("%s", msg);
+		return -648;
+	}
+
+	if (strcasestr(msg, "Account locked out") ||
+	    strcasestr(msg, "0xC0000234")) {
+		REDEBUG2("%s", msg);
+		return -647;
+	}
+
+	if (strcasestr(msg, "Account disabled") ||
+	    strcasestr(msg, "0xC0000072")) {
+		REDEBUG2("%s", msg);
+		return -691;
+	}
+
+	return -1;
+}
+
+/*
+ *	Authenticate using a persistent ntlm_auth process, running
+ *	with --helper-protocol=ntlm-server-1, instead of starting
+ *	a new one for every request.
+ */
+static int do_auth_ntlm_helper(rlm_mschap_t *inst, REQUEST *request, uint8_t const *challenge,
+			       uint8_t const *response, uint8_t nthashhash[NT_DIGEST_LENGTH])
+{
+	char		buffer[1024], answer[1024];
+	char		username_buf[256], domain_buf[256];
+	char		username[FR_BASE64_ENC_LENGTH(sizeof(username_buf)) + 1];
+	char		domain[FR_BASE64_ENC_LENGTH(sizeof(domain_buf)) + 1];
+	char		challenge_hex[(8 * 2) + 1], response_hex[(24 * 2) + 1];
+	char const	*p;
+	char		*line, *next;
+	char const	*error = NULL, *key = NULL;
+	bool		authenticated = false;
+	ssize_t		slen;
+	int		len;
+
+	slen = tmpl_expand(&p, username_buf, sizeof(username_buf), request, inst->ntlm_helper_username, NULL, NULL);
+	if (slen < 0) {
+		REDEBUG2("Unable to expand ntlm_auth_helper_username");
+		return -1;
+	}
+	fr_base64_encode(username, sizeof(username), (uint8_t const *)p, slen);
+
+	domain[0] = '\0';
+	if (inst->ntlm_helper_domain) {
+		slen = tmpl_expand(&p, domain_buf, sizeof(domain_buf), request, inst->ntlm_helper_domain, NULL, NULL);
+		if (slen < 0) {
+			REDEBUG2("Unable to expand ntlm_auth_helper_domain");
+			return -1;
+		}
+		fr_base64_encode(domain, sizeof(domain), (uint8_t const *)p, slen);
+	}
+
+	fr_bin2hex(challenge_hex, challenge, 8);
+	fr_bin2hex(response_hex, response, 24);
+
+	/*
+	 *	Names are base64 encoded ("::"), so they can contain
+	 *	anything.
+	 */
+	len = snprintf(buffer, sizeof(buffer),
+		       "Username:: %s\n"
+		       "%s%s%s"
+		       "LANMAN-Challenge: %s\n"
+		       "NT-Response: %s\n"
+		       "Request-User-Session-Key: Yes\n"
+		       ".\n",
+		       username,
+		       domain[0] ? "NT-Domain:: " : "", domain, domain[0] ? "\n" : "",
+		       challenge_hex, response_hex);
+	if ((size_t)len >= sizeof(buffer)) {
+		REDEBUG("Request for ntlm_auth helper is too long");
+		return -1;
+	}
+
+	if (exec_helper_request(inst->ntlm_helper_pool, request, answer, sizeof(answer), buffer, len) < 0) {
+		REDEBUG("Failed getting response from ntlm_auth helper");
+		return -1;
+	}
+
+	/*
+	 *	The response is a series of "Name: Value" lines
+	 */
+	for (line = answer; line; line = next) {
+		next = strchr(line, '\n');
+		if (next) *next++ = '\0';
+
+		if (strncasecmp(line, "Authenticated: ", 15) == 0) {
+			authenticated = (strcasecmp(line + 15, "Yes") == 0);
+
+		} else if (strncasecmp(line, "User-Session-Key: ", 18) == 0) {
+			key = line + 18;
+
+		} else if (strncasecmp(line, "Authentication-Error: ", 22) == 0) {
+			error = line + 22;
+
+		} else if (strncasecmp(line, "Error: ", 7) == 0) {
+			error = line + 7;
+		}
+	}
+
+	if (!authenticated) {
+		int ret;
+
+		if (!error) error = "Unknown error";
+
+		ret = mschap_ntlm_auth_error(request, error);
+		if (ret < -1) return ret;
+
+		REDEBUG("ntlm_auth helper says: %s", error);
+		return -1;
+	}
+
+	if (!key || (strlen(key) < (NT_DIGEST_LENGTH * 2))) {
+		REDEBUG("Invalid output from ntlm_auth helper: missing or short User-Session-Key");
+		return -1;
+	}
+
+	if (fr_hex2bin(nthashhash, NT_DIGEST_LENGTH, key, strlen(key)) != NT_DIGEST_LENGTH) {
+		REDEBUG("Invalid output from ntlm_auth helper: User-Session-Key has non-hex values");
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  *	Do the MS-CHAP stuff.
  *
@@ -1157,26 +1330,8 @@ static int CC_HINT(nonnull (1, 2, 4, 5 ,6)) do_mschap(rlm_mschap_t *inst, REQUES
 		if (result != 0) {
 			char *p;
 
-			/*
-			 *	look for "Password expired", or "Must change password".
-			 */
-			if (strcasestr(buffer, "Password expired") ||
-			    strcasestr(buffer, "Must change password")) {
-				REDEBUG2("%s", buffer);
-				return -648;
-			}
-
-			if (strcasestr(buffer, "Account locked out") ||
-			    strcasestr(buffer, "0xC0000234")) {
-				REDEBUG2("%s", buffer);
-				return -647;
-			}
-
-			if (strcasestr(buffer, "Account disabled") ||
-			    strcasestr(buffer, "0xC0000072")) {
-				REDEBUG2("%s", buffer);
-				return -691;
-			}
+			result = mschap_ntlm_auth_error(request, buffer);
+			if (result < -1) return result;
 
 			RDEBUG2("External script failed");
 			p = strchr(buffer, '\n');
@@ -1218,6 +1373,12 @@ static int CC_HINT(nonnull (1, 2, 4, 5 ,6)) do_mschap(rlm_mschap_t *inst, REQUES
 
 		break;
 		}
+	case AUTH_NTLMAUTH_HELPER:
+	/*
+	 *	Process auth via a persistent ntlm_auth helper
+	 */
+		return do_auth_ntlm_helper(inst, request, challenge, response, nthashhash);
+
 #ifdef WITH_AUTH_WINBIND
 	case AUTH_WBCLIENT:
 	/*
@@ -14,9 +14,10 @@ RCSIDH(rlm_mschap_h, "$Id$")
 /* Method of authentication we are going to use */
 typedef enum {
 	AUTH_INTERNAL		= 0,
-	AUTH_NTLMAUTH_EXEC	= 1
+	AUTH_NTLMAUTH_EXEC	= 1,
+	AUTH_NTLMAUTH_HELPER	= 2
 #ifdef WITH_AUTH_WINBIND
-	,AUTH_WBCLIENT       	= 2
+	,AUTH_WBCLIENT       	= 3
 #endif
 } MSCHAP_AUTH_METHOD;
 
@@ -28,6 +29,11 @@ typedef struct rlm_mschap_t {
 	char const		*xlat_name;
 	char const		*ntlm_auth;
 	uint32_t		ntlm_auth_timeout;
+	char const		*ntlm_auth_helper;
+	uint32_t		ntlm_auth_helpers;
+	vp_tmpl_t		*ntlm_helper_username;
+	vp_tmpl_t		*ntlm_helper_domain;
+	exec_helper_pool_t	*ntlm_helper_pool;
 	char const		*ntlm_cpw;
 	char const		*ntlm_cpw_username;
 	char const		*ntlm_cpw_domain;
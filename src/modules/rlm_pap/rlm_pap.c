@@ -544,16 +544,40 @@ static rlm_rcode_t CC_HINT(nonnull) pap_auth_clear(UNUSED rlm_pap_t *inst, REQUE
 	return RLM_MODULE_OK;
 }
 
+typedef struct pap_crypt_job_t {
+	char const	*key;
+	char const	*crypted;
+} pap_crypt_job_t;
+
+static int pap_crypt_offload(void *uctx)
+{
+	pap_crypt_job_t *job = uctx;
+
+	return fr_crypt_check(job->key, job->crypted);
+}
+
 static rlm_rcode_t CC_HINT(nonnull) pap_auth_crypt(UNUSED rlm_pap_t *inst, REQUEST *request, VALUE_PAIR *vp)
 {
+	pap_crypt_job_t	job;
+	int		rcode;
+
 	if (RDEBUG_ENABLED3) {
 		RDEBUG3("Comparing with \"known good\" Crypt-Password \"%s\"", vp->vp_strvalue);
 	} else {
 		RDEBUG("Comparing with \"known-good\" Crypt-password");
 	}
 
-	if (fr_crypt_check(request->password->vp_strvalue,
-			   vp->vp_strvalue) != 0) {
+	/*
+	 *	Modern crypt schemes are deliberately slow, so run
+	 *	them in the offload pool (if there is one), instead
+	 *	of tying up a CPU which could be processing other
+	 *	requests.
+	 */
+	job.key = request->password->vp_strvalue;
+	job.crypted = vp->vp_strvalue;
+	if (thread_pool_offload(request, pap_crypt_offload, &job, &rcode) < 0) return RLM_MODULE_FAIL;
+
+	if (rcode != 0) {
 		REDEBUG("Crypt digest does not match \"known good\" digest");
 		return RLM_MODULE_REJECT;
 	}
@@ -27,6 +27,10 @@ RCSID("$Id$")
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 struct mypasswd {
 	struct mypasswd *next;
 	char *listflag;
@@ -370,6 +374,36 @@ int main(void){
 }
 
 #else  /* TEST */
+/*
+ *	Mapped mode.
+ *
+ *	The file is mmap'd read-only, and the only thing we build is
+ *	an open-addressed index of line offsets, hashed by key.
+ *	Entries are parsed out of the mapping when they're used, so
+ *	memory use is a few bytes per key, rather than a copy of the
+ *	whole file.
+ *
+ *	The file is checked for changes every reload_interval
+ *	seconds.  A new index is built next to the old one, and
+ *	swapped in atomically.
+ */
+typedef struct passwd_map_slot {
+	uint32_t		hash;
+	uint32_t		offset;		//!< Offset of the line in the file, plus one.  0 is empty.
+} passwd_map_slot_t;
+
+typedef struct passwd_map {
+	uint8_t			*data;
+	size_t			len;
+	ino_t			ino;		//!< Identify the file the map was built from.
+	time_t			mtime;
+	off_t			size;
+
+	passwd_map_slot_t	*slots;
+	uint32_t		mask;		//!< Number of slots - 1.
+	uint32_t		num_keys;
+} passwd_map_t;
+
 typedef struct rlm_passwd_t {
 	struct hashtable	*ht;
 	struct mypasswd		*pwdfmt;
@@ -384,6 +418,16 @@ typedef struct rlm_passwd_t {
 	uint32_t		listable;
 	fr_dict_attr_t const		*keyattr;
 	bool			ignore_empty;
+
+	bool			mmap;		//!< Serve lookups from the mapped file.
+	uint32_t		reload_interval;	//!< How often to check the file for changes.
+
+	passwd_map_t		*map;
+#ifdef HAVE_PTHREAD_H
+	pthread_rwlock_t	map_lock;	//!< Held for reading while a lookup uses map.
+	pthread_mutex_t		reload_mutex;	//!< Only one thread checks for changes.
+#endif
+	time_t			next_check;
 } rlm_passwd_t;
 
 static const CONF_PARSER module_config[] = {
@@ -398,9 +442,225 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("allow_multiple_keys", PW_TYPE_BOOLEAN, rlm_passwd_t, allow_multiple), .dflt = "no" },
 
 	{ FR_CONF_OFFSET("hash_size", PW_TYPE_INTEGER, rlm_passwd_t, hash_size), .dflt = "100" },
+
+	{ FR_CONF_OFFSET("mmap", PW_TYPE_BOOLEAN, rlm_passwd_t, mmap), .dflt = "no" },
+	{ FR_CONF_OFFSET("reload_interval", PW_TYPE_INTEGER, rlm_passwd_t, reload_interval), .dflt = "5" },
 	CONF_PARSER_TERMINATOR
 };
 
+/** Find the key field of a line in the mapped file
+ *
+ * @param[in] inst of rlm_passwd.
+ * @param[in] p start of the line.
+ * @param[in] end of the line (excluding the newline).
+ * @param[out] key_len length of the key field.
+ * @return a pointer to the key field, or NULL if the line has no key.
+ */
+static char const *passwd_map_key(rlm_passwd_t const *inst, char const *p, char const *end, size_t *key_len)
+{
+	char const	*q;
+	uint32_t	field = 0;
+
+	while (field < inst->keyfield) {
+		q = memchr(p, *inst->delimiter, end - p);
+		if (!q) return NULL;
+		p = q + 1;
+		field++;
+	}
+
+	q = memchr(p, *inst->delimiter, end - p);
+	if (!q) q = end;
+	if ((q > p) && (q[-1] == '\r')) q--;
+
+	*key_len = q - p;
+
+	return *key_len ? p : NULL;
+}
+
+/** Call a function for every key of every usable line in the mapped file
+ *
+ * Comma separated keys are split if the key field is a list.
+ */
+static void passwd_map_walk(rlm_passwd_t const *inst, passwd_map_t *map,
+			    void (*func)(passwd_map_t *map, uint32_t hash, uint32_t offset))
+{
+	char const *p = (char const *) map->data, *end = p + map->len;
+
+	while (p < end) {
+		char const	*eol, *key, *key_end, *comma;
+		size_t		key_len;
+
+		eol = memchr(p, '\n', end - p);
+		if (!eol) eol = end;
+
+		if ((eol == p) || (inst->ignore_nislike && ((*p == '+') || (*p == '-')))) goto next;
+
+		key = passwd_map_key(inst, p, eol, &key_len);
+		if (!key) goto next;
+
+		if (!inst->listable) {
+			func(map, fr_hash(key, key_len), (p - (char const *) map->data) + 1);
+			goto next;
+		}
+
+		for (key_end = key + key_len; key < key_end; key = comma + 1) {
+			comma = memchr(key, ',', key_end - key);
+			if (!comma) comma = key_end;
+			if (comma > key) func(map, fr_hash(key, comma - key), (p - (char const *) map->data) + 1);
+		}
+
+	next:
+		p = eol + 1;
+	}
+}
+
+static void passwd_map_count(passwd_map_t *map, UNUSED uint32_t hash, UNUSED uint32_t offset)
+{
+	map->num_keys++;
+}
+
+static void passwd_map_insert(passwd_map_t *map, uint32_t hash, uint32_t offset)
+{
+	uint32_t i;
+
+	for (i = hash & map->mask; map->slots[i].offset; i = (i + 1) & map->mask);
+
+	map->slots[i].hash = hash;
+	map->slots[i].offset = offset;
+}
+
+static int _passwd_map_free(passwd_map_t *map)
+{
+	if (map->data) munmap(map->data, map->len);
+
+	return 0;
+}
+
+/** Map a passwd file and index it
+ *
+ * @param[in] inst of rlm_passwd.
+ * @return
+ *	- The new map.
+ *	- NULL on error.
+ */
+static passwd_map_t *passwd_map_load(rlm_passwd_t const *inst)
+{
+	int		fd;
+	struct stat	st;
+	passwd_map_t	*map;
+	uint32_t	num_slots = 16;
+
+	fd = open(inst->filename, O_RDONLY);
+	if (fd < 0) {
+		ERROR("rlm_passwd: Failed opening %s: %s", inst->filename, fr_syserror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		ERROR("rlm_passwd: Failed reading %s: %s", inst->filename, fr_syserror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	if ((uint64_t) st.st_size >= UINT32_MAX) {
+		ERROR("rlm_passwd: %s is too large to map", inst->filename);
+		close(fd);
+		return NULL;
+	}
+
+	map = talloc_zero(NULL, passwd_map_t);
+	if (!map) {
+		close(fd);
+		return NULL;
+	}
+	talloc_set_destructor(map, _passwd_map_free);
+
+	map->ino = st.st_ino;
+	map->mtime = st.st_mtime;
+	map->size = st.st_size;
+
+	if (st.st_size > 0) {
+		map->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map->data == MAP_FAILED) {
+			ERROR("rlm_passwd: Failed mapping %s: %s", inst->filename, fr_syserror(errno));
+			map->data = NULL;
+			close(fd);
+			talloc_free(map);
+			return NULL;
+		}
+		map->len = st.st_size;
+	}
+	close(fd);
+
+	/*
+	 *	Keep the table at most half full, so probe
+	 *	sequences stay short.
+	 */
+	passwd_map_walk(inst, map, passwd_map_count);
+	while (num_slots < (map->num_keys * 2)) num_slots <<= 1;
+
+	map->slots = talloc_zero_array(map, passwd_map_slot_t, num_slots);
+	if (!map->slots) {
+		talloc_free(map);
+		return NULL;
+	}
+	map->mask = num_slots - 1;
+
+	passwd_map_walk(inst, map, passwd_map_insert);
+
+	DEBUG2("rlm_passwd: Mapped %s, %u keys", inst->filename, map->num_keys);
+
+	return map;
+}
+
+/** Rebuild the map if the file has changed
+ *
+ * Lookups carry on using the old map while the new one is built.
+ */
+static void passwd_map_check(rlm_passwd_t *inst)
+{
+	struct stat	st;
+	time_t		now = time(NULL);
+	passwd_map_t	*map, *old;
+
+	if (!inst->reload_interval || (now < inst->next_check)) return;
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_trylock(&inst->reload_mutex) != 0) return;
+#endif
+	if (now < inst->next_check) goto done;
+	inst->next_check = now + inst->reload_interval;
+
+	if (stat(inst->filename, &st) < 0) goto done;
+	if ((st.st_ino == inst->map->ino) && (st.st_mtime == inst->map->mtime) && (st.st_size == inst->map->size)) {
+		goto done;
+	}
+
+	map = passwd_map_load(inst);
+	if (!map) {
+		WARN("rlm_passwd: Failed reloading %s, continuing to use the previous contents", inst->filename);
+		goto done;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_rwlock_wrlock(&inst->map_lock);
+#endif
+	old = inst->map;
+	inst->map = map;
+#ifdef HAVE_PTHREAD_H
+	pthread_rwlock_unlock(&inst->map_lock);
+#endif
+	talloc_free(old);
+
+	INFO("rlm_passwd: Reloaded %s", inst->filename);
+
+done:
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&inst->reload_mutex);
+#endif
+	return;
+}
+
 static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	int nfields=0, keyfield=-1, listable=0;
@@ -453,7 +713,8 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 			      inst->format);
 		return -1;
 	}
-	if (! (inst->ht = build_hash_table (inst->filename, nfields, keyfield, listable, inst->hash_size, inst->ignore_nislike, *inst->delimiter)) ){
+	if (!inst->mmap &&
+	    !(inst->ht = build_hash_table (inst->filename, nfields, keyfield, listable, inst->hash_size, inst->ignore_nislike, *inst->delimiter)) ){
 		ERROR("rlm_passwd: can't build hashtable from passwd file");
 		return -1;
 	}
@@ -496,6 +757,20 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	inst->keyfield = keyfield;
 	inst->listable = listable;
 	DEBUG3("      passwd: nfields: %d keyfield %d(%s) listable: %s", nfields, keyfield, inst->pwdfmt->field[keyfield], listable?"yes":"no");
+
+	if (inst->mmap) {
+		inst->map = passwd_map_load(inst);
+		if (!inst->map) {
+			ERROR("rlm_passwd: can't map passwd file");
+			return -1;
+		}
+		inst->next_check = time(NULL) + inst->reload_interval;
+#ifdef HAVE_PTHREAD_H
+		pthread_rwlock_init(&inst->map_lock, NULL);
+		pthread_mutex_init(&inst->reload_mutex, NULL);
+#endif
+	}
+
 	return 0;
 
 #undef inst
@@ -507,6 +782,13 @@ static int mod_detach (void *instance) {
 		release_ht(inst->ht);
 		inst->ht = NULL;
 	}
+	if (inst->map) {
+		TALLOC_FREE(inst->map);
+#ifdef HAVE_PTHREAD_H
+		pthread_rwlock_destroy(&inst->map_lock);
+		pthread_mutex_destroy(&inst->reload_mutex);
+#endif
+	}
 	free(inst->pwdfmt);
 	return 0;
 #undef inst
@@ -531,6 +813,79 @@ static void addresult (TALLOC_CTX *ctx, rlm_passwd_t *inst, REQUEST *request,
 	}
 }
 
+/** Check whether a parsed entry is one for name
+ *
+ */
+static bool passwd_map_match(rlm_passwd_t const *inst, struct mypasswd *pw, char const *name, size_t name_len)
+{
+	char const *key = pw->field[inst->keyfield], *comma;
+
+	if (!key) return false;
+	if (!inst->listable) return (strlen(key) == name_len) && (memcmp(key, name, name_len) == 0);
+
+	for (;;) {
+		comma = strchr(key, ',');
+		if (!comma) return (strlen(key) == name_len) && (memcmp(key, name, name_len) == 0);
+		if (((size_t)(comma - key) == name_len) && (memcmp(key, name, name_len) == 0)) return true;
+		key = comma + 1;
+	}
+}
+
+/** Add results for every entry in the mapped file matching name
+ *
+ * @return the number of entries found.
+ */
+static int passwd_map_lookup(rlm_passwd_t *inst, REQUEST *request, char const *name)
+{
+	union {
+		struct mypasswd	pw;
+		char		buff[2048];
+	} entry;
+	char		line[1024];
+	size_t		name_len = strlen(name);
+	uint32_t	hash = fr_hash(name, name_len), i;
+	passwd_map_t	*map;
+	int		found = 0;
+
+	passwd_map_check(inst);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_rwlock_rdlock(&inst->map_lock);
+#endif
+	map = inst->map;
+
+	for (i = hash & map->mask; map->slots[i].offset; i = (i + 1) & map->mask) {
+		char const	*p, *eol;
+		size_t		len;
+
+		if (map->slots[i].hash != hash) continue;
+
+		p = (char const *) map->data + map->slots[i].offset - 1;
+		eol = memchr(p, '\n', ((char const *) map->data + map->len) - p);
+		len = eol ? (size_t)(eol - p) : (size_t)(((char const *) map->data + map->len) - p);
+		if (len >= sizeof(line)) {
+			RWDEBUG("Ignoring line at offset %u, it is too long", map->slots[i].offset - 1);
+			continue;
+		}
+		memcpy(line, p, len);
+		line[len] = '\0';
+
+		if (!string_to_entry(line, inst->nfields, *inst->delimiter, &entry.pw, sizeof(entry))) continue;
+		if (!passwd_map_match(inst, &entry.pw, name, name_len)) continue;
+
+		addresult(request, inst, request, &request->config, &entry.pw, 0, "config");
+		addresult(request->reply, inst, request, &request->reply->vps, &entry.pw, 1, "reply_items");
+		addresult(request->packet, inst, request, &request->packet->vps, &entry.pw, 2, "request_items");
+		found++;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_rwlock_unlock(&inst->map_lock);
+#endif
+
+	return found;
+}
+
 static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, REQUEST *request)
 {
 #define inst ((rlm_passwd_t *)instance)
@@ -551,6 +906,12 @@ static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, REQUEST *requ
 		 *	Ensure we have the string form of the attribute
 		 */
 		fr_pair_value_snprint(buffer, sizeof(buffer), i, 0);
+		if (inst->mmap) {
+			if (!passwd_map_lookup(inst, request, buffer)) continue;
+			if (!inst->allow_multiple) break;
+			continue;
+		}
+
 		if (!(pw = get_pw_nam(buffer, inst->ht, &last_found)) ) {
 			continue;
 		}
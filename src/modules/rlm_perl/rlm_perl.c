@@ -77,10 +77,20 @@ typedef struct rlm_perl_t {
 	bool		perl_parsed;
 	pthread_key_t	*thread_key;
 
+	uint32_t	interpreters;		//!< Number of interpreters to clone at instantiation.
+						//!< If 0, each thread clones its own on first use.
 #ifdef USE_ITHREADS
 	pthread_mutex_t	clone_mutex;
+
+	PerlInterpreter	**pool;			//!< Idle pre-cloned interpreters.
+	uint32_t	pool_free;		//!< Number of interpreters in the pool.
+	pthread_mutex_t	pool_mutex;		//!< Protects the pool.
+	pthread_cond_t	pool_cond;		//!< Signalled when an interpreter is returned.
 #endif
 
+	bool		lazy_pairs;		//!< Tie the %RAD_* hashes to the attribute lists
+						//!< instead of copying every attribute in and out.
+
 	HV		*rad_perlconf_hv;	//!< holds "config" items (perl %RAD_PERLCONF hash).
 
 } rlm_perl_t;
@@ -112,6 +122,10 @@ static const CONF_PARSER module_config[] = {
 #endif
 	{ FR_CONF_OFFSET("perl_flags", PW_TYPE_STRING, rlm_perl_t, perl_flags) },
 
+	{ FR_CONF_OFFSET("interpreters", PW_TYPE_INTEGER, rlm_perl_t, interpreters), .dflt = "0" },
+
+	{ FR_CONF_OFFSET("lazy_pairs", PW_TYPE_BOOLEAN, rlm_perl_t, lazy_pairs), .dflt = "no" },
+
 	{ FR_CONF_OFFSET("func_start_accounting", PW_TYPE_STRING, rlm_perl_t, func_start_accounting) },
 
 	{ FR_CONF_OFFSET("func_stop_accounting", PW_TYPE_STRING, rlm_perl_t, func_stop_accounting) },
@@ -231,18 +245,13 @@ static void rlm_perl_make_key(pthread_key_t *key)
 	pthread_key_create(key, (void (*)(void *))rlm_destroy_perl);
 }
 
-static PerlInterpreter *rlm_perl_clone(PerlInterpreter *perl, pthread_key_t *key)
+static PerlInterpreter *rlm_perl_clone_interp(PerlInterpreter *perl)
 {
-	int ret;
-
 	PerlInterpreter *interp;
 	UV clone_flags = 0;
 
 	PERL_SET_CONTEXT(perl);
 
-	interp = pthread_getspecific(*key);
-	if (interp) return interp;
-
 	interp = perl_clone(perl, clone_flags);
 	{
 		dTHXa(interp);
@@ -256,6 +265,22 @@ static PerlInterpreter *rlm_perl_clone(PerlInterpreter *perl, pthread_key_t *key
 	PERL_SET_CONTEXT(aTHX);
 	rlm_perl_clear_handles(aTHX);
 
+	return interp;
+}
+
+static PerlInterpreter *rlm_perl_clone(PerlInterpreter *perl, pthread_key_t *key)
+{
+	int ret;
+
+	PerlInterpreter *interp;
+
+	PERL_SET_CONTEXT(perl);
+
+	interp = pthread_getspecific(*key);
+	if (interp) return interp;
+
+	interp = rlm_perl_clone_interp(perl);
+
 	ret = pthread_setspecific(*key, interp);
 	if (ret != 0) {
 		DEBUG("rlm_perl: Failed associating interpretor with thread %s", fr_syserror(ret));
@@ -266,6 +291,45 @@ static PerlInterpreter *rlm_perl_clone(PerlInterpreter *perl, pthread_key_t *key
 
 	return interp;
 }
+
+/** Get an interpreter to run a call in
+ *
+ * If we have a pool of pre-cloned interpreters, an idle one is removed from
+ * the pool, waiting for another call to return one if necessary.  Otherwise
+ * the calling thread's interpreter is used, cloning it on first use.
+ */
+static PerlInterpreter *rlm_perl_interp_get(rlm_perl_t *inst)
+{
+	PerlInterpreter *interp;
+
+	if (inst->pool) {
+		pthread_mutex_lock(&inst->pool_mutex);
+		while (inst->pool_free == 0) pthread_cond_wait(&inst->pool_cond, &inst->pool_mutex);
+		interp = inst->pool[--inst->pool_free];
+		pthread_mutex_unlock(&inst->pool_mutex);
+
+		return interp;
+	}
+
+	pthread_mutex_lock(&inst->clone_mutex);
+	interp = rlm_perl_clone(inst->perl, inst->thread_key);
+	pthread_mutex_unlock(&inst->clone_mutex);
+
+	return interp;
+}
+
+/** Return an interpreter obtained with rlm_perl_interp_get
+ *
+ */
+static void rlm_perl_interp_release(rlm_perl_t *inst, PerlInterpreter *interp)
+{
+	if (!inst->pool) return;
+
+	pthread_mutex_lock(&inst->pool_mutex);
+	inst->pool[inst->pool_free++] = interp;
+	pthread_cond_signal(&inst->pool_cond);
+	pthread_mutex_unlock(&inst->pool_mutex);
+}
 #endif
 
 /*
@@ -294,6 +358,17 @@ static XS(XS_radiusd_radlog)
 	XSRETURN_NO;
 }
 
+/*
+ *	Methods of the tied attribute list hashes, see perl_list_tie()
+ */
+static XS(XS_radiusd_list_FETCH);
+static XS(XS_radiusd_list_STORE);
+static XS(XS_radiusd_list_DELETE);
+static XS(XS_radiusd_list_EXISTS);
+static XS(XS_radiusd_list_CLEAR);
+static XS(XS_radiusd_list_FIRSTKEY);
+static XS(XS_radiusd_list_NEXTKEY);
+
 static void xs_init(pTHX)
 {
 	char const *file = __FILE__;
@@ -302,6 +377,14 @@ static void xs_init(pTHX)
 	newXS("DynaLoader::boot_DynaLoader", boot_DynaLoader, file);
 
 	newXS("radiusd::radlog",XS_radiusd_radlog, "rlm_perl");
+
+	newXS("radiusd::list::FETCH", XS_radiusd_list_FETCH, "rlm_perl");
+	newXS("radiusd::list::STORE", XS_radiusd_list_STORE, "rlm_perl");
+	newXS("radiusd::list::DELETE", XS_radiusd_list_DELETE, "rlm_perl");
+	newXS("radiusd::list::EXISTS", XS_radiusd_list_EXISTS, "rlm_perl");
+	newXS("radiusd::list::CLEAR", XS_radiusd_list_CLEAR, "rlm_perl");
+	newXS("radiusd::list::FIRSTKEY", XS_radiusd_list_FIRSTKEY, "rlm_perl");
+	newXS("radiusd::list::NEXTKEY", XS_radiusd_list_NEXTKEY, "rlm_perl");
 }
 
 /*
@@ -324,13 +407,11 @@ static ssize_t perl_xlat(char **out, size_t outlen,
 #ifdef USE_ITHREADS
 	PerlInterpreter *interp;
 
-	pthread_mutex_lock(&inst->clone_mutex);
-	interp = rlm_perl_clone(inst->perl, inst->thread_key);
+	interp = rlm_perl_interp_get(inst);
 	{
 		dTHXa(interp);
 		PERL_SET_CONTEXT(interp);
 	}
-	pthread_mutex_unlock(&inst->clone_mutex);
 #else
 	PERL_SET_CONTEXT(inst->perl);
 #endif
@@ -388,6 +469,10 @@ static ssize_t perl_xlat(char **out, size_t outlen,
 
 	}
 
+#ifdef USE_ITHREADS
+	rlm_perl_interp_release(inst, interp);
+#endif
+
 	return ret;
 }
 
@@ -576,6 +661,32 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 
 	PL_endav = end_AV;
 
+	/*
+	 *	Clone the interpreters up front, so that new worker
+	 *	threads don't stall cloning a large Perl program on
+	 *	their first call.
+	 */
+	if (inst->interpreters) {
+#ifdef USE_ITHREADS
+		uint32_t i;
+
+		pthread_mutex_init(&inst->pool_mutex, NULL);
+		pthread_cond_init(&inst->pool_cond, NULL);
+
+		MEM(inst->pool = talloc_array(inst, PerlInterpreter *, inst->interpreters));
+		for (i = 0; i < inst->interpreters; i++) {
+			inst->pool[i] = rlm_perl_clone_interp(inst->perl);
+		}
+		inst->pool_free = inst->interpreters;
+
+		PERL_SET_CONTEXT(inst->perl);
+
+		DEBUG("rlm_perl: Cloned %u interpreters", inst->interpreters);
+#else
+		WARN("rlm_perl: Perl was built without ithreads, ignoring 'interpreters'");
+#endif
+	}
+
 	return 0;
 }
 
@@ -615,6 +726,53 @@ static void perl_vp_to_svpvn_element(REQUEST *request, AV *av, VALUE_PAIR const
 	(*i)++;
 }
 
+/*
+ *	Tagged attributes are added to the hash with name
+ *	<attribute>:<tag>, others just use the normal attribute
+ *	name as the key.
+ */
+static char const *perl_vp_name(char *buffer, size_t bufsize, VALUE_PAIR const *vp)
+{
+	if (!vp->da->flags.has_tag || (vp->tag == TAG_ANY)) return vp->da->name;
+
+	snprintf(buffer, bufsize, "%s:%d", vp->da->name, vp->tag);
+	return buffer;
+}
+
+/*
+ *	Convert a single valued attribute to a Perl scalar
+ */
+static SV *perl_vp_to_sv(REQUEST *request, VALUE_PAIR const *vp, const char *hash_name, const char *list_name)
+{
+	size_t len;
+
+	char buffer[1024];
+
+	switch (vp->da->type) {
+	case PW_TYPE_STRING:
+		RDEBUG("$%s{'%s'} = &%s:%s -> '%s'", hash_name, vp->da->name, list_name,
+		       vp->da->name, vp->vp_strvalue);
+		return newSVpvn(vp->vp_strvalue, vp->vp_length);
+
+	case PW_TYPE_OCTETS:
+		if (RDEBUG_ENABLED) {
+			char *hex;
+
+			hex = fr_abin2hex(request, vp->vp_octets, vp->vp_length);
+			RDEBUG("$%s{'%s'} = &%s:%s -> 0x%s", hash_name, vp->da->name,
+			       list_name, vp->da->name, hex);
+			talloc_free(hex);
+		}
+		return newSVpvn((char const *)vp->vp_octets, vp->vp_length);
+
+	default:
+		len = fr_pair_value_snprint(buffer, sizeof(buffer), vp, 0);
+		RDEBUG("$%s{'%s'} = &%s:%s -> '%s'", hash_name, vp->da->name,
+		       list_name, vp->da->name, buffer);
+		return newSVpvn(buffer, truncate_len(len, sizeof(buffer)));
+	}
+}
+
 /*
  *  	get the vps and put them in perl hash
  *  	If one VP have multiple values it is added as array_ref
@@ -639,21 +797,8 @@ static void perl_store_vps(UNUSED TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR
 
 		char const *name;
 		char namebuf[256];
-		char buffer[1024];
 
-		size_t len;
-
-		/*
-		 *	Tagged attributes are added to the hash with name
-		 *	<attribute>:<tag>, others just use the normal attribute
-		 *	name as the key.
-		 */
-		if (vp->da->flags.has_tag && (vp->tag != TAG_ANY)) {
-			snprintf(namebuf, sizeof(namebuf), "%s:%d", vp->da->name, vp->tag);
-			name = namebuf;
-		} else {
-			name = vp->da->name;
-		}
+		name = perl_vp_name(namebuf, sizeof(namebuf), vp);
 
 		/*
 		 *	We've sorted by type, then tag, so attributes of the
@@ -677,34 +822,7 @@ static void perl_store_vps(UNUSED TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR
 		/*
 		 *	It's a normal single valued attribute
 		 */
-		switch (vp->da->type) {
-		case PW_TYPE_STRING:
-			RDEBUG("$%s{'%s'} = &%s:%s -> '%s'", hash_name, vp->da->name, list_name,
-			       vp->da->name, vp->vp_strvalue);
-			(void)hv_store(rad_hv, name, strlen(name), newSVpvn(vp->vp_strvalue, vp->vp_length), 0);
-			break;
-
-		case PW_TYPE_OCTETS:
-			if (RDEBUG_ENABLED) {
-				char *hex;
-
-				hex = fr_abin2hex(request, vp->vp_octets, vp->vp_length);
-				RDEBUG("$%s{'%s'} = &%s:%s -> 0x%s", hash_name, vp->da->name,
-				       list_name, vp->da->name, hex);
-				talloc_free(hex);
-			}
-			(void)hv_store(rad_hv, name, strlen(name),
-				       newSVpvn((char const *)vp->vp_octets, vp->vp_length), 0);
-			break;
-
-		default:
-			len = fr_pair_value_snprint(buffer, sizeof(buffer), vp, 0);
-			RDEBUG("$%s{'%s'} = &%s:%s -> '%s'", hash_name, vp->da->name,
-			       list_name, vp->da->name, buffer);
-			(void)hv_store(rad_hv, name, strlen(name),
-				       newSVpvn(buffer, truncate_len(len, sizeof(buffer))), 0);
-			break;
-		}
+		(void)hv_store(rad_hv, name, strlen(name), perl_vp_to_sv(request, vp, hash_name, list_name), 0);
 	}
 	REXDENT();
 }
@@ -780,6 +898,381 @@ static int get_hv_content(TALLOC_CTX *ctx, REQUEST *request, HV *my_hv, VALUE_PA
 	return ret;
 }
 
+/*
+ *	Attribute list exposed to Perl as a tied hash.
+ *
+ *	Attributes are only converted to Perl scalars when the script
+ *	reads them, and only the keys the script writes are converted
+ *	back to VALUE_PAIRs after the call returns.
+ */
+typedef struct rlm_perl_list {
+	REQUEST		*request;		//!< The current request.
+	TALLOC_CTX	*ctx;			//!< Context to allocate new VALUE_PAIRs in.
+	VALUE_PAIR	**vps;			//!< List the hash is tied to.
+	char const	*hash_name;		//!< Name of the Perl hash, for debug messages.
+	char const	*list_name;		//!< Name of the attribute list, for debug messages.
+
+	HV		*changed;		//!< Keys written by the script, undef if deleted.
+	bool		cleared;		//!< Whether the script emptied the hash.
+	AV		*keys;			//!< Keys returned by FIRSTKEY and NEXTKEY.
+	I32		key_idx;		//!< Index of the next key to return.
+
+	SV		*obj;			//!< The tie object, zeroed once the call has returned.
+} rlm_perl_list_t;
+
+/*
+ *	Tagged attributes are matched by <attribute>:<tag>, a key
+ *	without a tag only matches untagged instances.
+ */
+#define PERL_LIST_MATCH(_vp, _da, _tag) \
+	(((_vp)->da == (_da)) && (!(_da)->flags.has_tag || ((_vp)->tag == (_tag))))
+
+/*
+ *	Resolve a hash key to an attribute and tag
+ */
+static int perl_list_key(fr_dict_attr_t const **da, int8_t *tag, char const *key)
+{
+	char const	*p;
+	char		buffer[256];
+
+	*tag = TAG_ANY;
+
+	p = strrchr(key, ':');
+	if (p && p[1] && (strspn(p + 1, "0123456789") == strlen(p + 1)) && ((size_t)(p - key) < sizeof(buffer))) {
+		strlcpy(buffer, key, (p - key) + 1);
+
+		*da = fr_dict_attr_by_name(NULL, buffer);
+		if (*da && (*da)->flags.has_tag) {
+			*tag = atoi(p + 1);
+			return 0;
+		}
+	}
+
+	*da = fr_dict_attr_by_name(NULL, key);
+
+	return *da ? 0 : -1;
+}
+
+static rlm_perl_list_t *perl_list_from_sv(SV *self)
+{
+	rlm_perl_list_t *list;
+
+	if (!SvROK(self)) croak("rlm_perl: Invalid attribute list");
+
+	list = INT2PTR(rlm_perl_list_t *, SvIV(SvRV(self)));
+	if (!list) croak("rlm_perl: Attribute list used after the call it was passed to returned");
+
+	return list;
+}
+
+/*
+ *	Convert the attributes matching a key to a scalar, or an
+ *	array_ref if there are multiple instances.
+ */
+static SV *perl_list_fetch(rlm_perl_list_t *list, char const *key)
+{
+	REQUEST			*request = list->request;
+	SV			**changed, *rv;
+	fr_dict_attr_t const	*da;
+	int8_t			tag;
+	VALUE_PAIR		*vp, *first = NULL;
+	int			count = 0, i = 0;
+	AV			*av;
+
+	changed = hv_fetch(list->changed, key, strlen(key), 0);
+	if (changed) return SvOK(*changed) ? newSVsv(*changed) : NULL;
+
+	if (list->cleared || (perl_list_key(&da, &tag, key) < 0)) return NULL;
+
+	for (vp = *list->vps; vp; vp = vp->next) {
+		if (!PERL_LIST_MATCH(vp, da, tag)) continue;
+
+		if (!first) first = vp;
+		count++;
+	}
+
+	if (count == 0) return NULL;
+	if (count == 1) return perl_vp_to_sv(request, first, list->hash_name, list->list_name);
+
+	av = newAV();
+	for (vp = first; vp; vp = vp->next) {
+		if (!PERL_LIST_MATCH(vp, da, tag)) continue;
+
+		perl_vp_to_svpvn_element(request, av, vp, &i, list->hash_name, list->list_name);
+	}
+	rv = newRV_noinc((SV *)av);
+
+	/*
+	 *	Keep the array, so the script can modify it in place
+	 *	e.g. push @{$RAD_REPLY{'Cisco-AVPair'}}, '...'
+	 */
+	(void)hv_store(list->changed, key, strlen(key), newSVsv(rv), 0);
+
+	return rv;
+}
+
+static XS(XS_radiusd_list_FETCH)
+{
+	dXSARGS;
+	rlm_perl_list_t	*list;
+	SV		*sv;
+
+	if (items != 2) croak("Usage: FETCH(self, key)");
+
+	list = perl_list_from_sv(ST(0));
+	sv = perl_list_fetch(list, SvPV_nolen(ST(1)));
+
+	ST(0) = sv ? sv_2mortal(sv) : &PL_sv_undef;
+	XSRETURN(1);
+}
+
+static XS(XS_radiusd_list_STORE)
+{
+	dXSARGS;
+	rlm_perl_list_t	*list;
+	char const	*key;
+	STRLEN		len;
+
+	if (items != 3) croak("Usage: STORE(self, key, value)");
+
+	list = perl_list_from_sv(ST(0));
+	key = SvPV(ST(1), len);
+	(void)hv_store(list->changed, key, len, newSVsv(ST(2)), 0);
+
+	XSRETURN_EMPTY;
+}
+
+static XS(XS_radiusd_list_DELETE)
+{
+	dXSARGS;
+	rlm_perl_list_t	*list;
+	char const	*key;
+	STRLEN		len;
+	SV		*sv;
+
+	if (items != 2) croak("Usage: DELETE(self, key)");
+
+	list = perl_list_from_sv(ST(0));
+	key = SvPV(ST(1), len);
+	sv = perl_list_fetch(list, key);
+	(void)hv_store(list->changed, key, len, newSV(0), 0);
+
+	ST(0) = sv ? sv_2mortal(sv) : &PL_sv_undef;
+	XSRETURN(1);
+}
+
+static XS(XS_radiusd_list_EXISTS)
+{
+	dXSARGS;
+	rlm_perl_list_t		*list;
+	char const		*key;
+	STRLEN			len;
+	SV			**changed;
+	fr_dict_attr_t const	*da;
+	int8_t			tag;
+	VALUE_PAIR		*vp;
+
+	if (items != 2) croak("Usage: EXISTS(self, key)");
+
+	list = perl_list_from_sv(ST(0));
+	key = SvPV(ST(1), len);
+
+	changed = hv_fetch(list->changed, key, len, 0);
+	if (changed) {
+		if (SvOK(*changed)) XSRETURN_YES;
+		XSRETURN_NO;
+	}
+
+	if (list->cleared || (perl_list_key(&da, &tag, key) < 0)) XSRETURN_NO;
+
+	for (vp = *list->vps; vp; vp = vp->next) if (PERL_LIST_MATCH(vp, da, tag)) XSRETURN_YES;
+
+	XSRETURN_NO;
+}
+
+static XS(XS_radiusd_list_CLEAR)
+{
+	dXSARGS;
+	rlm_perl_list_t	*list;
+
+	if (items != 1) croak("Usage: CLEAR(self)");
+
+	list = perl_list_from_sv(ST(0));
+	list->cleared = true;
+	hv_clear(list->changed);
+
+	XSRETURN_EMPTY;
+}
+
+static SV *perl_list_nextkey(rlm_perl_list_t *list)
+{
+	SV **key;
+
+	if (!list->keys || (list->key_idx > av_len(list->keys))) return NULL;
+
+	key = av_fetch(list->keys, list->key_idx++, 0);
+
+	return key ? newSVsv(*key) : NULL;
+}
+
+/*
+ *	Build the list of keys up front, it's the only way to
+ *	de-duplicate multi-valued attributes.
+ */
+static XS(XS_radiusd_list_FIRSTKEY)
+{
+	dXSARGS;
+	rlm_perl_list_t	*list;
+	HV		*seen;
+	HE		*he;
+	VALUE_PAIR	*vp;
+	SV		*key;
+
+	if (items != 1) croak("Usage: FIRSTKEY(self)");
+
+	list = perl_list_from_sv(ST(0));
+
+	if (list->keys) SvREFCNT_dec((SV *)list->keys);
+	list->keys = newAV();
+	list->key_idx = 0;
+
+	seen = newHV();
+
+	if (!list->cleared) for (vp = *list->vps; vp; vp = vp->next) {
+		char const	*name;
+		char		namebuf[256];
+		SV		**changed;
+
+		name = perl_vp_name(namebuf, sizeof(namebuf), vp);
+		if (hv_exists(seen, name, strlen(name))) continue;
+		(void)hv_store(seen, name, strlen(name), newSViv(1), 0);
+
+		changed = hv_fetch(list->changed, name, strlen(name), 0);
+		if (changed && !SvOK(*changed)) continue;
+
+		av_push(list->keys, newSVpv(name, 0));
+	}
+
+	hv_iterinit(list->changed);
+	while ((he = hv_iternext(list->changed))) {
+		char	*name;
+		I32	len;
+
+		if (!SvOK(hv_iterval(list->changed, he))) continue;
+
+		name = hv_iterkey(he, &len);
+		if (hv_exists(seen, name, len)) continue;
+
+		av_push(list->keys, newSVpvn(name, len));
+	}
+
+	SvREFCNT_dec((SV *)seen);
+
+	key = perl_list_nextkey(list);
+
+	ST(0) = key ? sv_2mortal(key) : &PL_sv_undef;
+	XSRETURN(1);
+}
+
+static XS(XS_radiusd_list_NEXTKEY)
+{
+	dXSARGS;
+	rlm_perl_list_t	*list;
+	SV		*key;
+
+	if (items != 2) croak("Usage: NEXTKEY(self, lastkey)");
+
+	list = perl_list_from_sv(ST(0));
+	key = perl_list_nextkey(list);
+
+	ST(0) = key ? sv_2mortal(key) : &PL_sv_undef;
+	XSRETURN(1);
+}
+
+/*
+ *	Tie a hash to an attribute list
+ */
+static void perl_list_tie(rlm_perl_list_t *list, HV *rad_hv, REQUEST *request, TALLOC_CTX *ctx, VALUE_PAIR **vps,
+			  const char *hash_name, const char *list_name)
+{
+	SV *tie;
+
+	memset(list, 0, sizeof(*list));
+	list->request = request;
+	list->ctx = ctx;
+	list->vps = vps;
+	list->hash_name = hash_name;
+	list->list_name = list_name;
+	list->changed = newHV();
+
+	hv_undef(rad_hv);
+
+	tie = newSV(0);
+	list->obj = newSVrv(tie, "radiusd::list");
+	sv_setiv(list->obj, PTR2IV(list));
+
+	sv_magic((SV *)rad_hv, tie, PERL_MAGIC_tied, NULL, 0);
+	SvREFCNT_dec(tie);
+}
+
+/*
+ *	Untie the hash and write back the keys the script changed
+ */
+static void perl_list_untie(rlm_perl_list_t *list, HV *rad_hv)
+{
+	REQUEST			*request = list->request;
+	HE			*he;
+	fr_dict_attr_t const	*da;
+	int8_t			tag;
+
+	sv_setiv(list->obj, 0);
+	sv_unmagic((SV *)rad_hv, PERL_MAGIC_tied);
+
+	if (list->cleared) fr_pair_list_free(list->vps);
+
+	hv_iterinit(list->changed);
+	while ((he = hv_iternext(list->changed))) {
+		char	*key;
+		I32	len, i;
+		SV	*sv;
+
+		key = hv_iterkey(he, &len);
+		sv = hv_iterval(list->changed, he);
+
+		if (!list->cleared && (perl_list_key(&da, &tag, key) == 0)) {
+			VALUE_PAIR **last, *vp;
+
+			for (last = list->vps; *last; ) {
+				vp = *last;
+				if (!PERL_LIST_MATCH(vp, da, tag)) {
+					last = &vp->next;
+					continue;
+				}
+				*last = vp->next;
+				vp->next = NULL;
+				talloc_free(vp);
+			}
+		}
+
+		if (SvROK(sv) && (SvTYPE(SvRV(sv)) == SVt_PVAV)) {
+			AV *av = (AV *)SvRV(sv);
+
+			for (i = 0; i <= av_len(av); i++) {
+				SV **av_sv;
+
+				av_sv = av_fetch(av, i, 0);
+				if (av_sv) pairadd_sv(list->ctx, request, list->vps, key, *av_sv, T_OP_ADD,
+						      list->hash_name, list->list_name);
+			}
+		} else if (SvOK(sv)) {
+			pairadd_sv(list->ctx, request, list->vps, key, sv, T_OP_EQ, list->hash_name, list->list_name);
+		}
+	}
+
+	SvREFCNT_dec((SV *)list->changed);
+	if (list->keys) SvREFCNT_dec((SV *)list->keys);
+}
+
 /*
  * 	Call the function_name inside the module
  * 	Store all vps in hashes %RAD_CONFIG %RAD_REPLY %RAD_REQUEST
@@ -801,6 +1294,7 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 	HV		*rad_request_proxy_hv;
 	HV		*rad_request_proxy_reply_hv;
 #endif
+	rlm_perl_list_t	lists[6];
 
 	/*
 	 *	Radius has told us to call this function, but none
@@ -809,17 +1303,13 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 	if (!function_name) return RLM_MODULE_FAIL;
 
 #ifdef USE_ITHREADS
-	pthread_mutex_lock(&inst->clone_mutex);
-
 	PerlInterpreter *interp;
 
-	interp = rlm_perl_clone(inst->perl,inst->thread_key);
+	interp = rlm_perl_interp_get(inst);
 	{
 		dTHXa(interp);
 		PERL_SET_CONTEXT(interp);
 	}
-
-	pthread_mutex_unlock(&inst->clone_mutex);
 #else
 	PERL_SET_CONTEXT(inst->perl);
 #endif
@@ -835,25 +1325,46 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 		rad_request_hv = get_hv("RAD_REQUEST", 1);
 		rad_state_hv = get_hv("RAD_STATE", 1);
 
-		perl_store_vps(request->packet, request, &request->packet->vps, rad_request_hv, "RAD_REQUEST", "request");
-		perl_store_vps(request->reply, request, &request->reply->vps, rad_reply_hv, "RAD_REPLY", "reply");
-		perl_store_vps(request, request, &request->config, rad_config_hv, "RAD_CONFIG", "control");
-		perl_store_vps(request->state_ctx, request, &request->state, rad_state_hv, "RAD_STATE", "session-state");
+		if (inst->lazy_pairs) {
+			perl_list_tie(&lists[0], rad_request_hv, request, request->packet, &request->packet->vps,
+				      "RAD_REQUEST", "request");
+			perl_list_tie(&lists[1], rad_reply_hv, request, request->reply, &request->reply->vps,
+				      "RAD_REPLY", "reply");
+			perl_list_tie(&lists[2], rad_config_hv, request, request, &request->config,
+				      "RAD_CONFIG", "control");
+			perl_list_tie(&lists[3], rad_state_hv, request, request_state_ctx(request), &request->state,
+				      "RAD_STATE", "session-state");
+		} else {
+			perl_store_vps(request->packet, request, &request->packet->vps, rad_request_hv, "RAD_REQUEST", "request");
+			perl_store_vps(request->reply, request, &request->reply->vps, rad_reply_hv, "RAD_REPLY", "reply");
+			perl_store_vps(request, request, &request->config, rad_config_hv, "RAD_CONFIG", "control");
+			perl_store_vps(request_state_ctx(request), request, &request->state, rad_state_hv, "RAD_STATE", "session-state");
+		}
 
 #ifdef WITH_PROXY
 		rad_request_proxy_hv = get_hv("RAD_REQUEST_PROXY",1);
 		rad_request_proxy_reply_hv = get_hv("RAD_REQUEST_PROXY_REPLY",1);
 
 		if (request->proxy != NULL) {
-			perl_store_vps(request->proxy, request, &request->proxy->vps, rad_request_proxy_hv,
-				       "RAD_REQUEST_PROXY", "proxy-request");
+			if (inst->lazy_pairs) {
+				perl_list_tie(&lists[4], rad_request_proxy_hv, request, request->proxy, &request->proxy->vps,
+					      "RAD_REQUEST_PROXY", "proxy-request");
+			} else {
+				perl_store_vps(request->proxy, request, &request->proxy->vps, rad_request_proxy_hv,
+					       "RAD_REQUEST_PROXY", "proxy-request");
+			}
 		} else {
 			hv_undef(rad_request_proxy_hv);
 		}
 
 		if (request->proxy_reply != NULL) {
-			perl_store_vps(request->proxy_reply, request, &request->proxy_reply->vps,
-				       rad_request_proxy_reply_hv, "RAD_REQUEST_PROXY_REPLY", "proxy-reply");
+			if (inst->lazy_pairs) {
+				perl_list_tie(&lists[5], rad_request_proxy_reply_hv, request, request->proxy_reply,
+					      &request->proxy_reply->vps, "RAD_REQUEST_PROXY_REPLY", "proxy-reply");
+			} else {
+				perl_store_vps(request->proxy_reply, request, &request->proxy_reply->vps,
+					       rad_request_proxy_reply_hv, "RAD_REQUEST_PROXY_REPLY", "proxy-reply");
+			}
 		} else {
 			hv_undef(rad_request_proxy_reply_hv);
 		}
@@ -890,6 +1401,27 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 		FREETMPS;
 		LEAVE;
 
+		if (inst->lazy_pairs) {
+			perl_list_untie(&lists[0], rad_request_hv);
+			perl_list_untie(&lists[1], rad_reply_hv);
+			perl_list_untie(&lists[2], rad_config_hv);
+			perl_list_untie(&lists[3], rad_state_hv);
+#ifdef WITH_PROXY
+			if (request->proxy) perl_list_untie(&lists[4], rad_request_proxy_hv);
+			if (request->proxy_reply) perl_list_untie(&lists[5], rad_request_proxy_reply_hv);
+#endif
+
+			/*
+			 *	Update cached copies
+			 */
+			request->username = fr_pair_find_by_num(request->packet->vps, 0, PW_USER_NAME, TAG_ANY);
+			request->password = fr_pair_find_by_num(request->packet->vps, 0, PW_USER_PASSWORD, TAG_ANY);
+			if (!request->password)
+				request->password = fr_pair_find_by_num(request->packet->vps, 0, PW_CHAP_PASSWORD,
+									TAG_ANY);
+			goto done;
+		}
+
 		vp = NULL;
 		if ((get_hv_content(request->packet, request, rad_request_hv, &vp, "RAD_REQUEST", "request")) == 0) {
 			fr_pair_list_free(&request->packet->vps);
@@ -918,7 +1450,7 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 			vp = NULL;
 		}
 
-		if ((get_hv_content(request->state_ctx, request, rad_state_hv, &vp, "RAD_STATE", "session-state")) == 0) {
+		if ((get_hv_content(request_state_ctx(request), request, rad_state_hv, &vp, "RAD_STATE", "session-state")) == 0) {
 			fr_pair_list_free(&request->state);
 			request->state = vp;
 			vp = NULL;
@@ -943,6 +1475,12 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 #endif
 
 	}
+
+done:
+#ifdef USE_ITHREADS
+	rlm_perl_interp_release(inst, interp);
+#endif
+
 	return exitstatus;
 }
 
@@ -1045,6 +1583,20 @@ static int mod_detach(void *instance)
 	}
 
 #ifdef USE_ITHREADS
+	if (inst->pool) {
+		uint32_t i;
+
+		/*
+		 *	All calls have returned by the time we're
+		 *	detached, so every interpreter is in the pool.
+		 */
+		for (i = 0; i < inst->pool_free; i++) rlm_destroy_perl(inst->pool[i]);
+		TALLOC_FREE(inst->pool);
+
+		pthread_mutex_destroy(&inst->pool_mutex);
+		pthread_cond_destroy(&inst->pool_cond);
+	}
+
 	rlm_perl_destruct(inst->perl);
 	pthread_mutex_destroy(&inst->clone_mutex);
 #else
@@ -30,18 +30,49 @@ RCSID("$Id$")
 
 #include	<ctype.h>
 
+/*
+ *	Huntgroups and hints entries are indexed by the value of an
+ *	equality check on one of these attributes, so that only
+ *	entries which can match the request are compared against it.
+ */
+static unsigned int const preprocess_index_attrs[] = {
+	PW_NAS_IP_ADDRESS,
+	PW_NAS_PORT,
+	PW_CALLED_STATION_ID,
+	0
+};
+
+#define PREPROCESS_INDEX_MIN_ENTRIES	(8)	//!< Don't bother indexing fewer entries than this.
+
+typedef struct preprocess_index_bucket {
+	VALUE_PAIR const	*vp;		//!< Check item the entries were indexed by.
+	uint32_t		*entries;	//!< Positions of the entries with this value, in file order.
+	uint32_t		num_entries;
+} preprocess_index_bucket_t;
+
+typedef struct preprocess_table {
+	PAIR_LIST		**entries;	//!< Every entry, in file order.
+	uint32_t		num_entries;
+
+	fr_dict_attr_t const	*index_da;	//!< Attribute entries are indexed by, or NULL.
+	fr_hash_oa_t		*index;		//!< Buckets of entries, by value of index_da.
+	uint32_t		*unindexed;	//!< Positions of entries with no equality check
+						//!< on index_da, in file order.
+	uint32_t		num_unindexed;
+} preprocess_table_t;
+
 typedef struct rlm_preprocess_t {
-	char const	*huntgroup_file;
-	char const	*hints_file;
-	PAIR_LIST	*huntgroups;
-	PAIR_LIST	*hints;
-	bool		with_ascend_hack;
-	uint32_t	ascend_channels_per_line;
-	bool		with_ntdomain_hack;
-	bool		with_specialix_jetstream_hack;
-	bool		with_cisco_vsa_hack;
-	bool		with_alvarion_vsa_hack;
-	bool		with_cablelabs_vsa_hack;
+	char const		*huntgroup_file;
+	char const		*hints_file;
+	preprocess_table_t	*huntgroups;
+	preprocess_table_t	*hints;
+	bool			with_ascend_hack;
+	uint32_t		ascend_channels_per_line;
+	bool			with_ntdomain_hack;
+	bool			with_specialix_jetstream_hack;
+	bool			with_cisco_vsa_hack;
+	bool			with_alvarion_vsa_hack;
+	bool			with_cablelabs_vsa_hack;
 } rlm_preprocess_t;
 
 static const CONF_PARSER module_config[] = {
@@ -146,8 +177,15 @@ static void cisco_vsa_hack(REQUEST *request)
 			p = vp->vp_strvalue;
 			gettoken(&p, newattr, sizeof(newattr), false);
 
+			/*
+			 *	Add it via the cursor, which knows
+			 *	where the end of the list is.
+			 *	fr_pair_add() would walk the whole
+			 *	list for every Cisco-AVPair.
+			 */
 			if (fr_dict_attr_by_name(NULL, newattr) != NULL) {
-				pair_make_request(newattr, ptr + 1, T_OP_EQ);
+				fr_cursor_insert(&cursor, fr_pair_make(request->packet, NULL,
+								       newattr, ptr + 1, T_OP_EQ));
 			}
 		} else {	/* h322-foo-bar = "h323-foo-bar = baz" */
 			/*
@@ -337,6 +375,300 @@ static void rad_mangle(rlm_preprocess_t *inst, REQUEST *request)
 	}
 }
 
+static bool preprocess_index_attr(fr_dict_attr_t const *da)
+{
+	int i;
+
+	if (da->vendor != 0) return false;
+
+	for (i = 0; preprocess_index_attrs[i] != 0; i++) {
+		if (da->attr == preprocess_index_attrs[i]) return true;
+	}
+
+	return false;
+}
+
+/** Get the bytes of a value used as an index key
+ *
+ * @return the length of the key, or 0 if the type can't be indexed.
+ */
+static size_t preprocess_index_key(VALUE_PAIR const *vp, uint8_t const **out)
+{
+	switch (vp->da->type) {
+	case PW_TYPE_STRING:
+		*out = (uint8_t const *) vp->vp_strvalue;
+		return vp->vp_length;
+
+	case PW_TYPE_INTEGER:
+		*out = (uint8_t const *) &vp->vp_integer;
+		return sizeof(vp->vp_integer);
+
+	case PW_TYPE_IPV4_ADDR:
+		*out = (uint8_t const *) &vp->vp_ipaddr;
+		return sizeof(vp->vp_ipaddr);
+
+	default:
+		return 0;
+	}
+}
+
+static uint32_t preprocess_index_hash(void const *data)
+{
+	preprocess_index_bucket_t const *bucket = data;
+	uint8_t const *key;
+	size_t len;
+
+	len = preprocess_index_key(bucket->vp, &key);
+
+	return fr_hash(key, len);
+}
+
+static int preprocess_index_cmp(void const *one, void const *two)
+{
+	preprocess_index_bucket_t const *a = one, *b = two;
+	uint8_t const *a_key, *b_key;
+	size_t a_len, b_len;
+
+	a_len = preprocess_index_key(a->vp, &a_key);
+	b_len = preprocess_index_key(b->vp, &b_key);
+
+	if (a_len != b_len) return (a_len < b_len) ? -1 : +1;
+
+	return memcmp(a_key, b_key, a_len);
+}
+
+/** Find the check item an entry can be indexed by
+ *
+ * That's an equality check with a literal value, against one of
+ * #preprocess_index_attrs, or against da if it's not NULL.
+ */
+static VALUE_PAIR const *preprocess_index_vp(PAIR_LIST const *entry, fr_dict_attr_t const *da)
+{
+	VALUE_PAIR const *vp;
+	uint8_t const *key;
+
+	for (vp = entry->check; vp; vp = vp->next) {
+		if (da ? (vp->da != da) : !preprocess_index_attr(vp->da)) continue;
+
+		if ((vp->op != T_OP_CMP_EQ) && (vp->op != T_OP_EQ)) continue;
+		if (vp->type != VT_DATA) continue;
+		if (vp->da->flags.has_tag) continue;
+		if (radius_find_compare(vp->da)) continue;
+		if (!preprocess_index_key(vp, &key)) continue;
+
+		return vp;
+	}
+
+	return NULL;
+}
+
+/** Index the entries of a huntgroups or hints file
+ *
+ * The attribute used is the one which appears in an indexable check item
+ * of the most entries.  Entries without such a check go on the unindexed
+ * list, and are always compared against the request.
+ *
+ * @param[in] table to build the index for.
+ * @param[in] filename the entries were read from.
+ * @param[in] adds_pairs whether matching entries add their reply items to
+ *	the request.  If any of them add the index attribute, then later
+ *	entries may match on a value the request didn't arrive with, and
+ *	we don't build an index.
+ * @return
+ *	- 0 on success (including when no index was built).
+ *	- -1 on error.
+ */
+static int preprocess_index_build(preprocess_table_t *table, char const *filename, bool adds_pairs)
+{
+	VALUE_PAIR const	*vp;
+	fr_dict_attr_t const	*das[3];
+	uint32_t		counts[3];
+	uint32_t		i, j, num_das = 0, best = 0;
+
+	if (table->num_entries < PREPROCESS_INDEX_MIN_ENTRIES) return 0;
+
+	for (i = 0; i < table->num_entries; i++) {
+		vp = preprocess_index_vp(table->entries[i], NULL);
+		if (!vp) continue;
+
+		for (j = 0; j < num_das; j++) if (das[j] == vp->da) break;
+		if (j == num_das) {
+			if (num_das == (sizeof(das) / sizeof(*das))) continue;
+			das[num_das] = vp->da;
+			counts[num_das++] = 0;
+		}
+		counts[j]++;
+	}
+
+	if (!num_das) return 0;
+
+	for (i = 1; i < num_das; i++) if (counts[i] > counts[best]) best = i;
+
+	if (adds_pairs) for (i = 0; i < table->num_entries; i++) {
+		if (fr_pair_find_by_da(table->entries[i]->reply, das[best], TAG_ANY)) {
+			DEBUG2("rlm_preprocess: Not indexing %s, as entry %s at line %d sets %s",
+			       filename, table->entries[i]->name, table->entries[i]->lineno, das[best]->name);
+			return 0;
+		}
+	}
+
+	table->index_da = das[best];
+	table->index = fr_hash_oa_create(table, preprocess_index_hash, preprocess_index_cmp, NULL);
+	if (!table->index) return -1;
+
+	table->unindexed = talloc_array(table, uint32_t, table->num_entries - counts[best]);
+	if (!table->unindexed) return -1;
+
+	for (i = 0; i < table->num_entries; i++) {
+		preprocess_index_bucket_t find, *bucket;
+
+		vp = preprocess_index_vp(table->entries[i], table->index_da);
+		if (!vp) {
+			table->unindexed[table->num_unindexed++] = i;
+			continue;
+		}
+
+		find.vp = vp;
+		bucket = fr_hash_oa_finddata(table->index, &find);
+		if (!bucket) {
+			bucket = talloc_zero(table->index, preprocess_index_bucket_t);
+			if (!bucket) return -1;
+			bucket->vp = vp;
+
+			if (!fr_hash_oa_insert(table->index, bucket)) return -1;
+		}
+
+		bucket->entries = talloc_realloc(bucket, bucket->entries, uint32_t, bucket->num_entries + 1);
+		if (!bucket->entries) return -1;
+		bucket->entries[bucket->num_entries++] = i;
+	}
+
+	DEBUG2("rlm_preprocess: Indexed %u of %u entries in %s by %s",
+	       table->num_entries - table->num_unindexed, table->num_entries, filename, table->index_da->name);
+
+	return 0;
+}
+
+/** Read a huntgroups or hints file, and index its entries
+ *
+ */
+static int preprocess_table_read(TALLOC_CTX *ctx, char const *filename, preprocess_table_t **out, bool adds_pairs)
+{
+	preprocess_table_t	*table;
+	PAIR_LIST		*list = NULL, *entry;
+
+	table = talloc_zero(ctx, preprocess_table_t);
+	if (!table) return -1;
+
+	if (pairlist_read(table, filename, &list, 0) < 0) {
+	error:
+		talloc_free(table);
+		return -1;
+	}
+
+	for (entry = list; entry; entry = entry->next) table->num_entries++;
+
+	table->entries = talloc_array(table, PAIR_LIST *, table->num_entries);
+	if (!table->entries) goto error;
+
+	table->num_entries = 0;
+	for (entry = list; entry; entry = entry->next) table->entries[table->num_entries++] = entry;
+
+	if (preprocess_index_build(table, filename, adds_pairs) < 0) goto error;
+
+	*out = table;
+
+	return 0;
+}
+
+/** Iterates over the entries which may match a request, in file order
+ *
+ * Either walks every entry, or merges the index bucket for the request's
+ * value of the index attribute with the unindexed entries.
+ */
+typedef struct preprocess_cursor {
+	preprocess_table_t const *table;
+
+	uint32_t		pos;		//!< Next entry, when walking every entry.
+
+	uint32_t const		*bucket;	//!< Indexed candidates.
+	uint32_t		bucket_len;
+	uint32_t const		*unindexed;	//!< Entries we always have to check.
+	uint32_t		unindexed_len;
+	bool			indexed;
+} preprocess_cursor_t;
+
+static PAIR_LIST *preprocess_cursor_next(preprocess_cursor_t *cursor)
+{
+	uint32_t pos;
+
+	if (!cursor->indexed) {
+		if (cursor->pos >= cursor->table->num_entries) return NULL;
+
+		return cursor->table->entries[cursor->pos++];
+	}
+
+	if (cursor->bucket_len && (!cursor->unindexed_len || (cursor->bucket[0] < cursor->unindexed[0]))) {
+		pos = *cursor->bucket++;
+		cursor->bucket_len--;
+
+	} else if (cursor->unindexed_len) {
+		pos = *cursor->unindexed++;
+		cursor->unindexed_len--;
+
+	} else {
+		return NULL;
+	}
+
+	return cursor->table->entries[pos];
+}
+
+static PAIR_LIST *preprocess_cursor_init(preprocess_cursor_t *cursor, preprocess_table_t const *table,
+					 VALUE_PAIR *vps)
+{
+	VALUE_PAIR			*vp, *found = NULL;
+	preprocess_index_bucket_t	find, *bucket;
+
+	memset(cursor, 0, sizeof(*cursor));
+	cursor->table = table;
+
+	if (!table->index) goto done;
+
+	/*
+	 *	A comparison function may have been registered
+	 *	since we built the index, and with more than one
+	 *	instance of the attribute any of them may match.
+	 *	In both cases we have to check every entry.
+	 */
+	if (radius_find_compare(table->index_da)) goto done;
+
+	for (vp = vps; vp; vp = vp->next) {
+		if (vp->da != table->index_da) continue;
+		if (found) goto done;
+		found = vp;
+	}
+
+	cursor->indexed = true;
+	cursor->unindexed = table->unindexed;
+	cursor->unindexed_len = table->num_unindexed;
+
+	/*
+	 *	No instance of the attribute, so none of the
+	 *	indexed entries can match.
+	 */
+	if (!found) goto done;
+
+	find.vp = found;
+	bucket = fr_hash_oa_finddata(table->index, &find);
+	if (!bucket) goto done;
+
+	cursor->bucket = bucket->entries;
+	cursor->bucket_len = bucket->num_entries;
+
+done:
+	return preprocess_cursor_next(cursor);
+}
+
 /*
  *	Compare the request with the "reply" part in the
  *	huntgroup, which normally only contains username or group.
@@ -369,12 +701,13 @@ static int hunt_paircmp(REQUEST *req, VALUE_PAIR *request, VALUE_PAIR *check)
  *	Add hints to the info sent by the terminal server
  *	based on the pattern of the username, and other attributes.
  */
-static int hints_setup(PAIR_LIST *hints, REQUEST *request)
+static int hints_setup(preprocess_table_t *hints, REQUEST *request)
 {
 	char const     	*name;
 	VALUE_PAIR	*add;
 	VALUE_PAIR	*tmp;
 	PAIR_LIST	*i;
+	preprocess_cursor_t cursor;
 	VALUE_PAIR	*request_pairs;
 	int		updated = 0, ft;
 
@@ -395,7 +728,9 @@ static int hints_setup(PAIR_LIST *hints, REQUEST *request)
 		return RLM_MODULE_NOOP;
 	}
 
-	for (i = hints; i; i = i->next) {
+	for (i = preprocess_cursor_init(&cursor, hints, request_pairs);
+	     i;
+	     i = preprocess_cursor_next(&cursor)) {
 		/*
 		 *	Use "paircompare", which is a little more general...
 		 */
@@ -431,9 +766,10 @@ static int hints_setup(PAIR_LIST *hints, REQUEST *request)
 /*
  *	See if we have access to the huntgroup.
  */
-static int huntgroup_access(REQUEST *request, PAIR_LIST *huntgroups)
+static int huntgroup_access(REQUEST *request, preprocess_table_t *huntgroups)
 {
 	PAIR_LIST	*i;
+	preprocess_cursor_t cursor;
 	int		r = RLM_MODULE_OK;
 	VALUE_PAIR	*request_pairs = request->packet->vps;
 
@@ -445,7 +781,9 @@ static int huntgroup_access(REQUEST *request, PAIR_LIST *huntgroups)
 		return RLM_MODULE_OK;
 	}
 
-	for (i = huntgroups; i; i = i->next) {
+	for (i = preprocess_cursor_init(&cursor, huntgroups, request_pairs);
+	     i;
+	     i = preprocess_cursor_next(&cursor)) {
 		/*
 		 *	See if this entry matches.
 		 */
@@ -524,7 +862,7 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 	 *	Read the huntgroups file.
 	 */
 	if (inst->huntgroup_file) {
-		ret = pairlist_read(inst, inst->huntgroup_file, &(inst->huntgroups), 0);
+		ret = preprocess_table_read(inst, inst->huntgroup_file, &inst->huntgroups, false);
 		if (ret < 0) {
 			ERROR("rlm_preprocess: Error reading %s", inst->huntgroup_file);
 
@@ -536,7 +874,7 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 	 *	Read the hints file.
 	 */
 	if (inst->hints_file) {
-		ret = pairlist_read(inst, inst->hints_file, &(inst->hints), 0);
+		ret = preprocess_table_read(inst, inst->hints_file, &inst->hints, true);
 		if (ret < 0) {
 			ERROR("rlm_preprocess: Error reading %s", inst->hints_file);
 
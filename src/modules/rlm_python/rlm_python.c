@@ -58,6 +58,8 @@ typedef struct rlm_python_t {
 	void		*libpython;
 	PyThreadState	*main_thread_state;
 	char const	*python_path;
+	bool		lazy_pairs;		//!< Pass the request attributes as a PairList
+						//!< instead of a tuple.
 
 	struct py_function_def
 	instantiate,
@@ -102,6 +104,7 @@ static CONF_PARSER module_config[] = {
 #undef A
 
 	{ FR_CONF_OFFSET("python_path", PW_TYPE_STRING, rlm_python_t, python_path) },
+	{ FR_CONF_OFFSET("lazy_pairs", PW_TYPE_BOOLEAN, rlm_python_t, lazy_pairs), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -199,6 +202,67 @@ failed:
 	Py_XDECREF(pTraceback);
 }
 
+static int mod_populate_vptuple(PyObject *pPair, VALUE_PAIR *vp);
+
+/*
+ *	Sequence of (name, value) tuples, which are only built from
+ *	the request attributes when the Python function accesses them.
+ */
+typedef struct {
+	PyObject_HEAD
+	VALUE_PAIR	**vps;		//!< Attributes, NULL once the call has returned.
+	Py_ssize_t	len;		//!< Number of attributes.
+} py_pair_list_t;
+
+static Py_ssize_t mod_pair_list_len(PyObject *self)
+{
+	py_pair_list_t *list = (py_pair_list_t *)self;
+
+	if (!list->vps) {
+		PyErr_SetString(PyExc_RuntimeError, "PairList used after the call it was passed to returned");
+		return -1;
+	}
+
+	return list->len;
+}
+
+static PyObject *mod_pair_list_item(PyObject *self, Py_ssize_t i)
+{
+	py_pair_list_t	*list = (py_pair_list_t *)self;
+	PyObject	*pPair;
+
+	if (mod_pair_list_len(self) < 0) return NULL;
+
+	if ((i < 0) || (i >= list->len)) {
+		PyErr_SetString(PyExc_IndexError, "PairList index out of range");
+		return NULL;
+	}
+
+	if ((pPair = PyTuple_New(2)) == NULL) return NULL;
+
+	if (mod_populate_vptuple(pPair, list->vps[i]) < 0) {
+		Py_DECREF(pPair);
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+
+	return pPair;
+}
+
+static PySequenceMethods pair_list_as_sequence = {
+	.sq_length = mod_pair_list_len,
+	.sq_item = mod_pair_list_item,
+};
+
+static PyTypeObject pair_list_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "radiusd.PairList",
+	.tp_basicsize = sizeof(py_pair_list_t),
+	.tp_as_sequence = &pair_list_as_sequence,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "Request attributes as a sequence of (name, value) tuples",
+};
+
 static int mod_init(rlm_python_t *inst)
 {
 	int i;
@@ -232,6 +296,8 @@ static int mod_init(rlm_python_t *inst)
 	if ((radiusd_module = Py_InitModule3(main_config.name, module_methods, "rlm_python module")) == NULL)
 		goto failed;
 
+	if (PyType_Ready(&pair_list_type) < 0) goto failed;
+
 	for (i = 0; radiusd_constants[i].name; i++) {
 		if ((PyModule_AddIntConstant(radiusd_module, radiusd_constants[i].name,
 					     radiusd_constants[i].value)) < 0) {
@@ -411,6 +477,8 @@ static rlm_rcode_t do_python(rlm_python_t *inst, REQUEST *request, PyObject *pFu
 	PyObject	*pArgs = NULL;
 	int		tuplelen;
 	int		ret;
+	VALUE_PAIR	**vps = NULL;
+	py_pair_list_t	*list = NULL;
 
 	PyGILState_STATE gstate;
 	PyThreadState	*prev_thread_state = NULL;	/* -Wuninitialized */
@@ -471,6 +539,27 @@ static rlm_rcode_t do_python(rlm_python_t *inst, REQUEST *request, PyObject *pFu
 	if (tuplelen == 0) {
 		Py_INCREF(Py_None);
 		pArgs = Py_None;
+	} else if (inst->lazy_pairs) {
+		int i = 0;
+
+		/*
+		 *	Only snapshot the list, the tuples are built
+		 *	as the function accesses them.
+		 */
+		MEM(vps = talloc_array(request, VALUE_PAIR *, tuplelen));
+		for (vp = fr_cursor_init(&cursor, &request->packet->vps);
+		     vp;
+		     vp = fr_cursor_next(&cursor)) {
+			vps[i++] = vp;
+		}
+
+		if ((list = PyObject_New(py_pair_list_t, &pair_list_type)) == NULL) {
+			ret = RLM_MODULE_FAIL;
+			goto finish;
+		}
+		list->vps = vps;
+		list->len = tuplelen;
+		pArgs = (PyObject *)list;
 	} else {
 		int i = 0;
 		if ((pArgs = PyTuple_New(tuplelen)) == NULL) {
@@ -563,6 +652,13 @@ static rlm_rcode_t do_python(rlm_python_t *inst, REQUEST *request, PyObject *pFu
 	}
 
 finish:
+	/*
+	 *	The function may have kept a reference to the list,
+	 *	make sure it can't reach the attributes any more.
+	 */
+	if (list) list->vps = NULL;
+	talloc_free(vps);
+
 	Py_XDECREF(pArgs);
 	Py_XDECREF(pRet);
 
@@ -29,6 +29,8 @@ RCSID("$Id$")
 #include	<freeradius-devel/rad_assert.h>
 
 #include	<fcntl.h>
+#include	<ctype.h>
+#include	<sys/stat.h>
 
 #include "config.h"
 
@@ -36,25 +38,62 @@ RCSID("$Id$")
 
 static char const porttypes[] = "ASITX";
 
-/*
- *	used for caching radutmp lookups in the accounting component. The
- *	session (checksimul) component doesn't use it, but probably should.
+typedef struct radutmp_slot radutmp_slot_t;
+typedef struct radutmp_user radutmp_user_t;
+
+/** A record in the radutmp file
+ *
+ * There's only ever one record for each NAS and port, so records are
+ * found by NAS and port, and never move.
  */
-typedef struct nas_port {
+struct radutmp_slot {
 	uint32_t		nasaddr;
-	uint16_t		port;
-	off_t			offset;
-	struct nas_port 	*next;
-} NAS_PORT;
+	uint32_t		port;
+	off_t			offset;			//!< Of the record in the file.
+
+	radutmp_user_t		*user;			//!< Logged in on this port, or NULL.
+	radutmp_slot_t		*next;			//!< Other ports the user is logged in on.
+};
+
+/** The ports a user is logged in on
+ *
+ */
+struct radutmp_user {
+	char			login[RUT_NAMESIZE + 1];	//!< Folded to lower case if case_sensitive is off.
+	uint32_t		count;			//!< Number of slots.
+	radutmp_slot_t		*slots;
+};
+
+/** Index of the records in the radutmp file, by NAS and port, and by user
+ *
+ * The radutmp file is the only copy of the sessions.  The index is built
+ * from it the first time it's needed, and rebuilt whenever the file has
+ * been changed by anything other than this module.
+ */
+typedef struct radutmp_index {
+	char			*filename;		//!< The index is for.
+	dev_t			dev;
+	ino_t			ino;
+	off_t			size;			//!< Of the file after we last changed it.
+	time_t			mtime;
+#ifdef __linux__
+	long			mtime_nsec;
+#endif
+
+	fr_hash_table_t		*slots;			//!< radutmp_slot_t by NAS and port.
+	fr_hash_table_t		*users;			//!< radutmp_user_t by login.
+} radutmp_index_t;
 
 typedef struct rlm_radutmp_t {
-	NAS_PORT	*nas_port_list;
 	char const	*filename;
 	char const	*username;
 	bool		case_sensitive;
 	bool		check_nas;
 	uint32_t	permission;
 	bool		caller_id_ok;
+	bool		index_sessions;
+
+	radutmp_index_t	*index;
 } rlm_radutmp_t;
 
 static const CONF_PARSER module_config[] = {
@@ -64,10 +103,256 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("check_with_nas", PW_TYPE_BOOLEAN, rlm_radutmp_t, check_nas), .dflt = "yes" },
 	{ FR_CONF_OFFSET("permissions", PW_TYPE_INTEGER, rlm_radutmp_t, permission), .dflt = "0644" },
 	{ FR_CONF_OFFSET("caller_id", PW_TYPE_BOOLEAN, rlm_radutmp_t, caller_id_ok), .dflt = "no" },
+	{ FR_CONF_OFFSET("index", PW_TYPE_BOOLEAN, rlm_radutmp_t, index_sessions), .dflt = "yes" },
 	CONF_PARSER_TERMINATOR
 };
 
 
+static uint32_t radutmp_slot_hash(void const *data)
+{
+	radutmp_slot_t const *slot = data;
+
+	return fr_hash_update(&slot->port, sizeof(slot->port), fr_hash(&slot->nasaddr, sizeof(slot->nasaddr)));
+}
+
+static int radutmp_slot_cmp(void const *one, void const *two)
+{
+	radutmp_slot_t const *a = one, *b = two;
+
+	if (a->nasaddr != b->nasaddr) return (a->nasaddr < b->nasaddr) ? -1 : 1;
+	if (a->port != b->port) return (a->port < b->port) ? -1 : 1;
+
+	return 0;
+}
+
+static uint32_t radutmp_user_hash(void const *data)
+{
+	radutmp_user_t const *user = data;
+
+	return fr_hash_string(user->login);
+}
+
+static int radutmp_user_cmp(void const *one, void const *two)
+{
+	radutmp_user_t const *a = one, *b = two;
+
+	return strcmp(a->login, b->login);
+}
+
+/** Copy a login name into a key, folding it if the comparisons are case insensitive
+ *
+ */
+static void radutmp_user_key(rlm_radutmp_t const *inst, char out[RUT_NAMESIZE + 1], char const *login)
+{
+	size_t i;
+
+	for (i = 0; (i < RUT_NAMESIZE) && login[i]; i++) {
+		out[i] = inst->case_sensitive ? login[i] : tolower((uint8_t) login[i]);
+	}
+	out[i] = '\0';
+}
+
+/** Record what's in a record of the radutmp file
+ *
+ * @param[in] inst	of rlm_radutmp.
+ * @param[in] offset	of the record.
+ * @param[in] u		the record.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, in which case the index is invalid.
+ */
+static int radutmp_index_update(rlm_radutmp_t *inst, off_t offset, struct radutmp const *u)
+{
+	radutmp_index_t	*idx = inst->index;
+	radutmp_slot_t	*slot, find;
+	radutmp_user_t	*user, user_find;
+
+	find.nasaddr = u->nas_address;
+	find.port = u->nas_port;
+
+	slot = fr_hash_table_finddata(idx->slots, &find);
+	if (!slot) {
+		slot = talloc_zero(idx, radutmp_slot_t);
+		if (!slot) return -1;
+
+		slot->nasaddr = u->nas_address;
+		slot->port = u->nas_port;
+		slot->offset = offset;
+
+		if (!fr_hash_table_insert(idx->slots, slot)) {
+			talloc_free(slot);
+			return -1;
+		}
+	}
+
+	/*
+	 *	Take the port away from whoever was logged in on it.
+	 */
+	user = slot->user;
+	if (user) {
+		radutmp_slot_t **last;
+
+		for (last = &user->slots; *last; last = &(*last)->next) {
+			if (*last != slot) continue;
+
+			*last = slot->next;
+			break;
+		}
+		slot->user = NULL;
+		slot->next = NULL;
+
+		if (--user->count == 0) {
+			fr_hash_table_delete(idx->users, user);
+			talloc_free(user);
+		}
+	}
+
+	if (u->type != P_LOGIN) return 0;
+
+	radutmp_user_key(inst, user_find.login, u->login);
+
+	user = fr_hash_table_finddata(idx->users, &user_find);
+	if (!user) {
+		user = talloc_zero(idx, radutmp_user_t);
+		if (!user) return -1;
+
+		strlcpy(user->login, user_find.login, sizeof(user->login));
+		if (!fr_hash_table_insert(idx->users, user)) {
+			talloc_free(user);
+			return -1;
+		}
+	}
+
+	slot->user = user;
+	slot->next = user->slots;
+	user->slots = slot;
+	user->count++;
+
+	return 0;
+}
+
+/** Remember the state of the file after we've changed it
+ *
+ */
+static void radutmp_index_stat(rlm_radutmp_t *inst, struct stat const *st)
+{
+	radutmp_index_t *idx = inst->index;
+
+	idx->dev = st->st_dev;
+	idx->ino = st->st_ino;
+	idx->size = st->st_size;
+	idx->mtime = st->st_mtime;
+#ifdef __linux__
+	idx->mtime_nsec = st->st_mtim.tv_nsec;
+#endif
+}
+
+/** Discard the index, it'll be rebuilt the next time it's needed
+ *
+ */
+static void radutmp_index_clear(rlm_radutmp_t *inst)
+{
+	TALLOC_FREE(inst->index);
+}
+
+/** Make sure the index matches the radutmp file
+ *
+ * @note Must be called with the file locked.
+ *
+ * @param[in] inst	of rlm_radutmp.
+ * @param[in] request	being processed.
+ * @param[in] filename	of the radutmp file.
+ * @param[in] fd	of the radutmp file.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int radutmp_index_sync(rlm_radutmp_t *inst, REQUEST *request, char const *filename, int fd)
+{
+	radutmp_index_t	*idx = inst->index;
+	struct stat	st;
+	struct radutmp	u;
+	off_t		offset;
+
+	if (fstat(fd, &st) < 0) {
+		REDEBUG("Failed reading status of %s: %s", filename, fr_syserror(errno));
+		radutmp_index_clear(inst);
+		return -1;
+	}
+
+	if (idx && (strcmp(idx->filename, filename) == 0) &&
+	    (idx->dev == st.st_dev) && (idx->ino == st.st_ino) &&
+	    (idx->size == st.st_size) && (idx->mtime == st.st_mtime)
+#ifdef __linux__
+	    && (idx->mtime_nsec == st.st_mtim.tv_nsec)
+#endif
+	    ) return 0;
+
+	/*
+	 *	New file, or it's been changed by something else.
+	 */
+	if (idx) RDEBUG2("%s has changed, re-indexing it", filename);
+	radutmp_index_clear(inst);
+
+	MEM(idx = inst->index = talloc_zero(inst, radutmp_index_t));
+	MEM(idx->filename = talloc_typed_strdup(idx, filename));
+	MEM(idx->slots = fr_hash_table_create(idx, radutmp_slot_hash, radutmp_slot_cmp, NULL));
+	MEM(idx->users = fr_hash_table_create(idx, radutmp_user_hash, radutmp_user_cmp, NULL));
+
+	for (offset = 0; pread(fd, &u, sizeof(u), offset) == sizeof(u); offset += sizeof(u)) {
+		if (radutmp_index_update(inst, offset, &u) < 0) {
+			radutmp_index_clear(inst);
+			return -1;
+		}
+	}
+
+	radutmp_index_stat(inst, &st);
+
+	RDEBUG3("Indexed %i records of %s", fr_hash_table_num_elements(idx->slots), filename);
+
+	return 0;
+}
+
+/** Write a record, and add it to the index
+ *
+ */
+static int radutmp_write(rlm_radutmp_t *inst, REQUEST *request, int fd, off_t offset, struct radutmp const *u)
+{
+	struct stat st;
+
+	if (pwrite(fd, u, sizeof(*u), offset) != sizeof(*u)) {
+		REDEBUG("Failed writing: %s", fr_syserror(errno));
+		radutmp_index_clear(inst);
+		return -1;
+	}
+
+	if (!inst->index) return 0;
+
+	if ((fstat(fd, &st) < 0) || (radutmp_index_update(inst, offset, u) < 0)) {
+		radutmp_index_clear(inst);
+		return 0;
+	}
+	radutmp_index_stat(inst, &st);
+
+	return 0;
+}
+
+static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
+{
+	rlm_radutmp_t *inst = instance;
+
+	/*
+	 *	Each process would have its own index, and
+	 *	wouldn't always notice the others' changes.
+	 */
+	if (inst->index_sessions && (main_config.num_processes > 1)) {
+		WARN("rlm_radutmp: Setting 'index' is not supported with 'num_processes'.  Disabling 'index'");
+		inst->index_sessions = false;
+	}
+
+	return 0;
+}
+
 #ifdef WITH_ACCOUNTING
 /*
  *	Zap all users on a NAS from the radutmp file.
@@ -123,22 +408,62 @@ static rlm_rcode_t radutmp_zap(REQUEST *request, char const *filename, uint32_t
 	return RLM_MODULE_OK;
 }
 
-/*
- *	Lookup a NAS_PORT in the nas_port_list
+/** Find the record for a NAS and port
+ *
+ * @note Must be called with the file locked.
+ *
+ * @param[in] inst	of rlm_radutmp.
+ * @param[in] request	being processed.
+ * @param[in] filename	of the radutmp file.
+ * @param[in] fd	of the radutmp file.
+ * @param[in] nasaddr	to find.
+ * @param[in] port	to find.
+ * @param[out] u	the record, if found.
+ * @param[out] offset	of the record, or of the end of the file if it wasn't found.
+ * @return
+ *	- 1 if the record was found.
+ *	- 0 if it wasn't.
+ *	- -1 on error.
  */
-static NAS_PORT *nas_port_find(NAS_PORT *nas_port_list, uint32_t nasaddr, uint16_t port)
+static int radutmp_find(rlm_radutmp_t *inst, REQUEST *request, char const *filename, int fd,
+			uint32_t nasaddr, uint32_t port, struct radutmp *u, off_t *offset)
 {
-	NAS_PORT	*cl;
+	radutmp_slot_t	*slot, find;
+	off_t		off;
 
-	for(cl = nas_port_list; cl; cl = cl->next) {
-		if (nasaddr == cl->nasaddr &&
-			port == cl->port)
-			break;
+	if (inst->index_sessions) {
+		if (radutmp_index_sync(inst, request, filename, fd) < 0) return -1;
+
+		find.nasaddr = nasaddr;
+		find.port = port;
+
+		slot = fr_hash_table_finddata(inst->index->slots, &find);
+		if (!slot) {
+			*offset = inst->index->size - (inst->index->size % sizeof(*u));
+			return 0;
+		}
+
+		if ((pread(fd, u, sizeof(*u), slot->offset) != sizeof(*u)) ||
+		    (u->nas_address != nasaddr) || (u->nas_port != port)) {
+			REDEBUG("Index of %s is out of date", filename);
+			radutmp_index_clear(inst);
+			return -1;
+		}
+
+		*offset = slot->offset;
+		return 1;
 	}
 
-	return cl;
-}
+	for (off = 0; pread(fd, u, sizeof(*u), off) == sizeof(*u); off += sizeof(*u)) {
+		if ((u->nas_address != nasaddr) || (u->nas_port != port)) continue;
+
+		*offset = off;
+		return 1;
+	}
 
+	*offset = off;
+	return 0;
+}
 
 /*
  *	Store logins in the RADIUS utmp file.
@@ -155,10 +480,10 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *requ
 	int		fd = -1;
 	bool		port_seen = false;
 	int		off;
+	off_t		offset;
 	rlm_radutmp_t	*inst = instance;
 	char		ip_name[INET_ADDRSTRLEN]; /* 255.255.255.255 */
 	char const	*nas;
-	NAS_PORT	*cache;
 	int		r;
 
 	char		*filename = NULL;
@@ -326,6 +651,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *requ
 	if (status == PW_STATUS_ACCOUNTING_ON && (ut.nas_address != htonl(INADDR_NONE))) {
 		RIDEBUG("NAS %s restarted (Accounting-On packet seen)", nas);
 		rcode = radutmp_zap(request, filename, ut.nas_address, ut.time);
+		radutmp_index_clear(inst);
 
 		goto finish;
 	}
@@ -333,6 +659,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *requ
 	if (status == PW_STATUS_ACCOUNTING_OFF && (ut.nas_address != htonl(INADDR_NONE))) {
 		RIDEBUG("NAS %s rebooted (Accounting-Off packet seen)", nas);
 		rcode = radutmp_zap(request, filename, ut.nas_address, ut.time);
+		radutmp_index_clear(inst);
 
 		goto finish;
 	}
@@ -403,104 +730,61 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *requ
 	/*
 	 *	Find the entry for this NAS / portno combination.
 	 */
-	if ((cache = nas_port_find(inst->nas_port_list, ut.nas_address, ut.nas_port)) != NULL) {
-		if (lseek(fd, (off_t)cache->offset, SEEK_SET) < 0) {
-			rcode = RLM_MODULE_FAIL;
-			goto finish;
-		}
+	r = radutmp_find(inst, request, filename, fd, ut.nas_address, ut.nas_port, &u, &offset);
+	if (r < 0) {
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
 	}
 
-	r = 0;
-	off = 0;
-	while (read(fd, &u, sizeof(u)) == sizeof(u)) {
-		off += sizeof(u);
-		if ((u.nas_address != ut.nas_address) || (u.nas_port != ut.nas_port)) {
-			continue;
-		}
+	/*
+	 *	Don't compare stop records to unused entries.
+	 */
+	if ((r > 0) && (status == PW_STATUS_STOP) && (u.type == P_IDLE)) r = 0;
 
+	if ((r > 0) && (status == PW_STATUS_STOP) && strncmp(ut.session_id, u.session_id, sizeof(u.session_id)) != 0) {
 		/*
-		 *	Don't compare stop records to unused entries.
+		 *	Don't complain if this is not a
+		 *	login record (some clients can
+		 *	send _only_ logout records).
 		 */
-		if (status == PW_STATUS_STOP && u.type == P_IDLE) {
-			continue;
+		if (u.type == P_LOGIN) {
+			RWDEBUG("Logout entry for NAS %s port %u has wrong ID", nas, u.nas_port);
 		}
 
-		if ((status == PW_STATUS_STOP) && strncmp(ut.session_id, u.session_id, sizeof(u.session_id)) != 0) {
-			/*
-			 *	Don't complain if this is not a
-			 *	login record (some clients can
-			 *	send _only_ logout records).
-			 */
-			if (u.type == P_LOGIN) {
-				RWDEBUG("Logout entry for NAS %s port %u has wrong ID", nas, u.nas_port);
-			}
-
-			r = -1;
-			break;
-		}
-
-		if ((status == PW_STATUS_START) && strncmp(ut.session_id, u.session_id, sizeof(u.session_id)) == 0  &&
-		    u.time >= ut.time) {
-			if (u.type == P_LOGIN) {
-				INFO("rlm_radutmp: Login entry for NAS %s port %u duplicate",
-				       nas, u.nas_port);
-				r = -1;
-				break;
-			}
+		r = -1;
+	}
 
+	if ((r > 0) && (status == PW_STATUS_START) && strncmp(ut.session_id, u.session_id, sizeof(u.session_id)) == 0  &&
+	    u.time >= ut.time) {
+		if (u.type == P_LOGIN) {
+			INFO("rlm_radutmp: Login entry for NAS %s port %u duplicate",
+			       nas, u.nas_port);
+		} else {
 			RWDEBUG("Login entry for NAS %s port %u wrong order", nas, u.nas_port);
-			r = -1;
-			break;
 		}
+		r = -1;
+	}
 
+	/*
+	 *	FIXME: the ALIVE record could need some more checking, but anyway I'd
+	 *	rather rewrite this mess -- miquels.
+	 */
+	if ((r > 0) && (status == PW_STATUS_ALIVE) && strncmp(ut.session_id, u.session_id, sizeof(u.session_id)) == 0  &&
+	    u.type == P_LOGIN) {
 		/*
-		 *	FIXME: the ALIVE record could need some more checking, but anyway I'd
-		 *	rather rewrite this mess -- miquels.
+		 *	Keep the original login time.
 		 */
-		if ((status == PW_STATUS_ALIVE) && strncmp(ut.session_id, u.session_id, sizeof(u.session_id)) == 0  &&
-		    u.type == P_LOGIN) {
-			/*
-			 *	Keep the original login time.
-			 */
-			ut.time = u.time;
-		}
-
-		if (lseek(fd, -(off_t)sizeof(u), SEEK_CUR) < 0) {
-			RWDEBUG("negative lseek!");
-			lseek(fd, (off_t)0, SEEK_SET);
-			off = 0;
-		} else {
-			off -= sizeof(u);
-		}
-
-		r = 1;
-		break;
-	} /* read the file until we find a match */
+		ut.time = u.time;
+	}
 
 	/*
 	 *	Found the entry, do start/update it with
-	 *	the information from the packet.
+	 *	the information from the packet.  If there
+	 *	wasn't one, offset is the end of the file.
 	 */
 	if ((r >= 0) && (status == PW_STATUS_START || status == PW_STATUS_ALIVE)) {
-		/*
-		 *	Remember where the entry was, because it's
-		 *	easier than searching through the entire file.
-		 */
-		if (!cache) {
-			cache = talloc_zero(NULL, NAS_PORT);
-			if (cache) {
-				cache->nasaddr = ut.nas_address;
-				cache->port = ut.nas_port;
-				cache->offset = off;
-				cache->next = inst->nas_port_list;
-				inst->nas_port_list = cache;
-			}
-		}
-
 		ut.type = P_LOGIN;
-		if (write(fd, &ut, sizeof(u)) < 0) {
-			REDEBUG("Failed writing: %s", fr_syserror(errno));
-
+		if (radutmp_write(inst, request, fd, offset, &ut) < 0) {
 			rcode = RLM_MODULE_FAIL;
 			goto finish;
 		}
@@ -515,9 +799,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *requ
 			u.type = P_IDLE;
 			u.time = ut.time;
 			u.delay = ut.delay;
-			if (write(fd, &u, sizeof(u)) < 0) {
-				REDEBUG("Failed writing: %s", fr_syserror(errno));
-
+			if (radutmp_write(inst, request, fd, offset, &u) < 0) {
 				rcode = RLM_MODULE_FAIL;
 				goto finish;
 			}
@@ -539,6 +821,84 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *requ
 #endif
 
 #ifdef WITH_SESSION_MGMT
+/** Check with the NAS whether a session in the radutmp file is still live
+ *
+ * @note Must be called with the file locked.  The lock is released while
+ *	the NAS is queried.
+ *
+ * @return
+ *	- 0 on success, after updating the request's session count.
+ *	- -1 if the NAS couldn't be checked.
+ */
+static int radutmp_check_session(REQUEST *request, int fd, struct radutmp *u, char const *login,
+				 uint32_t ipno, char const *call_num)
+{
+	char	session_id[sizeof(u->session_id) + 1];
+	char	utmp_login[sizeof(u->login) + 1];
+	int	rcode;
+
+	/* Guarantee string is NULL terminated */
+	u->session_id[sizeof(u->session_id) - 1] = '\0';
+	strlcpy(session_id, u->session_id, sizeof(session_id));
+
+	/*
+	 *	The login name MAY fill the whole field,
+	 *	and thus won't be zero-filled.
+	 *
+	 *	Note that we take the user name from
+	 *	the utmp file, as that's the canonical
+	 *	form.  The 'login' variable may contain
+	 *	a string which is an upper/lowercase
+	 *	version of u.login.  When we call the
+	 *	routine to check the terminal server,
+	 *	the NAS may be case sensitive.
+	 *
+	 *	e.g. We ask if "bob" is using a port,
+	 *	and the NAS says "no", because "BOB"
+	 *	is using the port.
+	 */
+	memset(utmp_login, 0, sizeof(utmp_login));
+	memcpy(utmp_login, u->login, sizeof(u->login));
+
+	/*
+	 *	rad_check_ts may take seconds
+	 *	to return, and we don't want
+	 *	to block everyone else while
+	 *	that's happening.  */
+	rad_unlockfd(fd, LOCK_LEN);
+	rcode = rad_check_ts(u->nas_address, u->nas_port, utmp_login, session_id);
+	rad_lockfd(fd, LOCK_LEN);
+
+	if (rcode == 0) {
+		/*
+		 *	Stale record - zap it.
+		 */
+		session_zap(request, u->nas_address, u->nas_port, login, session_id,
+			    u->framed_address, u->proto, 0);
+		return 0;
+	}
+
+	if (rcode == 1) {
+		/*
+		 *	User is still logged in.
+		 */
+		++request->simul_count;
+
+		/*
+		 *	Does it look like a MPP attempt?
+		 */
+		if (strchr("SCPA", u->proto) && ipno && u->framed_address == ipno) {
+			request->simul_mpp = 2;
+		} else if (strchr("SCPA", u->proto) && call_num && !strncmp(u->caller_id, call_num,16)) {
+			request->simul_mpp = 2;
+		}
+		return 0;
+	}
+
+	RWDEBUG("Failed to check the terminal server for user '%s'.", utmp_login);
+	return -1;
+}
+
 /*
  *	See if a user is already logged in. Sets request->simul_count to the
  *	current session count for this user and sets request->simul_mpp to 2
@@ -558,24 +918,29 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST *requ
 	uint32_t	ipno = 0;
 	char const     	*call_num = NULL;
 	rlm_radutmp_t	*inst = instance;
+	radutmp_user_t	*user = NULL;
+	off_t		*offsets = NULL;
+	uint32_t	i, num_offsets = 0;
 
+	char		*filename = NULL;
 	char		*expanded = NULL;
 	ssize_t		len;
 
 	/*
 	 *	Get the filename, via xlat.
 	 */
-	if (radius_axlat(&expanded, request, inst->filename, NULL, NULL) < 0) {
+	if (radius_axlat(&filename, request, inst->filename, NULL, NULL) < 0) {
 		return RLM_MODULE_FAIL;
 	}
 
-	fd = open(expanded, O_RDWR);
+	fd = open(filename, O_RDWR);
 	if (fd < 0) {
 		/*
 		 *	If the file doesn't exist, then no users
 		 *	are logged in.
 		 */
 		if (errno == ENOENT) {
+			talloc_free(filename);
 			request->simul_count=0;
 			return RLM_MODULE_OK;
 		}
@@ -583,15 +948,13 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST *requ
 		/*
 		 *	Error accessing the file.
 		 */
-		ERROR("rlm_radumtp: Error accessing file %s: %s", expanded, fr_syserror(errno));
+		ERROR("rlm_radumtp: Error accessing file %s: %s", filename, fr_syserror(errno));
 
 		rcode = RLM_MODULE_FAIL;
 
 		goto finish;
 	}
 
-	TALLOC_FREE(expanded);
-
 	len = radius_axlat(&expanded, request, inst->username, NULL, NULL);
 	if (len < 0) {
 		rcode = RLM_MODULE_FAIL;
@@ -612,14 +975,33 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST *requ
 	 */
 	request->simul_count = 0;
 
-	/*
-	 *	Loop over utmp, counting how many people MAY be logged in.
-	 */
-	while (read(fd, &u, sizeof(u)) == sizeof(u)) {
-		if (((strncmp(expanded, u.login, RUT_NAMESIZE) == 0) ||
-		    (!inst->case_sensitive && (strncasecmp(expanded, u.login, RUT_NAMESIZE) == 0))) &&
-		     (u.type == P_LOGIN)) {
-			++request->simul_count;
+	if (inst->index_sessions) {
+		radutmp_user_t	find;
+
+		/*
+		 *	The index is only valid while the file is locked.
+		 */
+		rad_lockfd(fd, LOCK_LEN);
+
+		if (radutmp_index_sync(inst, request, filename, fd) < 0) {
+			rcode = RLM_MODULE_FAIL;
+
+			goto finish;
+		}
+
+		radutmp_user_key(inst, find.login, expanded);
+		user = fr_hash_table_finddata(inst->index->users, &find);
+		if (user) request->simul_count = user->count;
+	} else {
+		/*
+		 *	Loop over utmp, counting how many people MAY be logged in.
+		 */
+		while (read(fd, &u, sizeof(u)) == sizeof(u)) {
+			if (((strncmp(expanded, u.login, RUT_NAMESIZE) == 0) ||
+			    (!inst->case_sensitive && (strncasecmp(expanded, u.login, RUT_NAMESIZE) == 0))) &&
+			     (u.type == P_LOGIN)) {
+				++request->simul_count;
+			}
 		}
 	}
 
@@ -632,7 +1014,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST *requ
 
 		goto finish;
 	}
-	lseek(fd, (off_t)0, SEEK_SET);
 
 	/*
 	 *	Setup some stuff, like for MPP detection.
@@ -645,11 +1026,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST *requ
 		call_num = vp->vp_strvalue;
 	}
 
-	/*
-	 *	lock the file while reading/writing.
-	 */
-	rad_lockfd(fd, LOCK_LEN);
-
 	/*
 	 *	FIXME: If we get a 'Start' for a user/nas/port which is
 	 *	listed, but for which we did NOT get a 'Stop', then
@@ -657,67 +1033,51 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST *requ
 	 *	static IP's like DSL.
 	 */
 	request->simul_count = 0;
-	while (read(fd, &u, sizeof(u)) == sizeof(u)) {
-		if (((strncmp(expanded, u.login, RUT_NAMESIZE) == 0) || (!inst->case_sensitive &&
-		    (strncasecmp(expanded, u.login, RUT_NAMESIZE) == 0))) && (u.type == P_LOGIN)) {
-			char session_id[sizeof(u.session_id) + 1];
-			char utmp_login[sizeof(u.login) + 1];
 
-			/* Guarantee string is NULL terminated */
-			u.session_id[sizeof(u.session_id) - 1] = '\0';
-			strlcpy(session_id, u.session_id, sizeof(session_id));
+	if (user) {
+		radutmp_slot_t *slot;
+
+		/*
+		 *	Zapping stale sessions changes the index,
+		 *	so work from a copy of the user's ports.
+		 */
+		MEM(offsets = talloc_array(request, off_t, user->count));
+		for (slot = user->slots; slot; slot = slot->next) offsets[num_offsets++] = slot->offset;
+
+		for (i = 0; i < num_offsets; i++) {
+			if (pread(fd, &u, sizeof(u), offsets[i]) != sizeof(u)) continue;
 
 			/*
-			 *	The login name MAY fill the whole field,
-			 *	and thus won't be zero-filled.
-			 *
-			 *	Note that we take the user name from
-			 *	the utmp file, as that's the canonical
-			 *	form.  The 'login' variable may contain
-			 *	a string which is an upper/lowercase
-			 *	version of u.login.  When we call the
-			 *	routine to check the terminal server,
-			 *	the NAS may be case sensitive.
-			 *
-			 *	e.g. We ask if "bob" is using a port,
-			 *	and the NAS says "no", because "BOB"
-			 *	is using the port.
+			 *	The file may have changed while it
+			 *	was unlocked.
 			 */
-			memset(utmp_login, 0, sizeof(utmp_login));
-			memcpy(utmp_login, u.login, sizeof(u.login));
+			if ((u.type != P_LOGIN) ||
+			    ((strncmp(expanded, u.login, RUT_NAMESIZE) != 0) &&
+			     (inst->case_sensitive || (strncasecmp(expanded, u.login, RUT_NAMESIZE) != 0)))) continue;
 
-			/*
-			 *	rad_check_ts may take seconds
-			 *	to return, and we don't want
-			 *	to block everyone else while
-			 *	that's happening.  */
-			rad_unlockfd(fd, LOCK_LEN);
-			rcode = rad_check_ts(u.nas_address, u.nas_port, utmp_login, session_id);
-			rad_lockfd(fd, LOCK_LEN);
-
-			if (rcode == 0) {
-				/*
-				 *	Stale record - zap it.
-				 */
-				session_zap(request, u.nas_address, u.nas_port, expanded, session_id,
-					    u.framed_address, u.proto, 0);
+			if (radutmp_check_session(request, fd, &u, expanded, ipno, call_num) < 0) {
+				rcode = RLM_MODULE_FAIL;
+
+				goto finish;
 			}
-			else if (rcode == 1) {
-				/*
-				 *	User is still logged in.
-				 */
-				++request->simul_count;
+		}
+
+		goto finish;
+	}
+
+	if (inst->index_sessions) goto finish;
+
+	lseek(fd, (off_t)0, SEEK_SET);
+
+	/*
+	 *	lock the file while reading/writing.
+	 */
+	rad_lockfd(fd, LOCK_LEN);
 
-				/*
-				 *	Does it look like a MPP attempt?
-				 */
-				if (strchr("SCPA", u.proto) && ipno && u.framed_address == ipno) {
-					request->simul_mpp = 2;
-				} else if (strchr("SCPA", u.proto) && call_num && !strncmp(u.caller_id, call_num,16)) {
-					request->simul_mpp = 2;
-				}
-			} else {
-				RWDEBUG("Failed to check the terminal server for user '%s'.", utmp_login);
+	while (read(fd, &u, sizeof(u)) == sizeof(u)) {
+		if (((strncmp(expanded, u.login, RUT_NAMESIZE) == 0) || (!inst->case_sensitive &&
+		    (strncasecmp(expanded, u.login, RUT_NAMESIZE) == 0))) && (u.type == P_LOGIN)) {
+			if (radutmp_check_session(request, fd, &u, expanded, ipno, call_num) < 0) {
 				rcode = RLM_MODULE_FAIL;
 
 				goto finish;
@@ -726,7 +1086,9 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST *requ
 	}
 	finish:
 
+	talloc_free(offsets);
 	talloc_free(expanded);
+	talloc_free(filename);
 
 	if (fd > -1) {
 		close(fd);		/* and implicitely release the locks */
@@ -744,6 +1106,7 @@ module_t rlm_radutmp = {
 	.type		= RLM_TYPE_THREAD_UNSAFE | RLM_TYPE_HUP_SAFE,
 	.inst_size	= sizeof(rlm_radutmp_t),
 	.config		= module_config,
+	.instantiate	= mod_instantiate,
 	.methods = {
 #ifdef WITH_ACCOUNTING
 		[MOD_ACCOUNTING]	= mod_accounting,
@@ -59,6 +59,8 @@
  *        #fr_redis_cluster_state_init will then and reserve/pass back a connection for
  *        the pool associated with the node associated with the key.
  *     4. Use the connection that was passed back, to issue a Redis command against.
+ *        Replies must be retrieved with #fr_redis_command, #fr_redis_command_argv or
+ *        #fr_redis_get_reply, as the connection may be a view of a shared connection.
  *     5. Use #fr_redis_command_status to translate the result of the command into
  *        a #fr_redis_rcode_t value.
  *     6. Call #fr_redis_cluster_state_next with relevant arguments including a pointer
@@ -69,6 +71,20 @@
  *
  * See #fr_redis_cluster_state_init for example code.
  *
+ * Asynchronous operations
+ * -----------------------
+ *
+ *   #fr_redis_cluster_async_command and #fr_redis_cluster_async_command_argv issue a command
+ *   without blocking the caller.  The command is written to a non-blocking connection to the
+ *   node, which is serviced by the event list passed in, and the caller's callback is called
+ *   from that event list once a final result is available.
+ *
+ *   Non-blocking connections are separate from the node's pool, and are opened on demand,
+ *   one per node per event list.  -ASK, -MOVE, -TRYAGAIN and connection failures are handled
+ *   in the same way as for blocking commands, except a '-MOVE' only marks the cluster as
+ *   needing a remap, which is performed by the next blocking operation.
+ *
+ *
  * Structures
  * ----------
  *
@@ -216,6 +232,8 @@ typedef struct cluster_node_conf {
 	uint16_t		port;			//!< Port of Redis cluster node.
 } cluster_node_addr_t;
 
+typedef struct cluster_async_conn cluster_async_conn_t;
+
 /** A Redis cluster node
  *
  * Passed as opaque data to pools which open connection to nodes.
@@ -233,8 +251,44 @@ typedef struct fr_redis_cluster_node {
 	fr_redis_cluster_t	*cluster;		//!< Commmon configuration (database number,
 							//!< password, etc..).
 	fr_connection_pool_t	*pool;			//!< Pool associated with this node.
+	fr_redis_pipe_t		*pipe;			//!< Shared connection commands are pipelined over,
+							//!< if pipelining is enabled.
+	cluster_async_conn_t	*async;			//!< Non-blocking connections, one per event list.
 } cluster_node_t;
 
+/** A non-blocking connection to a node, serviced by a single event list
+ */
+struct cluster_async_conn {
+	cluster_async_conn_t	*next;			//!< Next connection to the same node.
+	cluster_node_t		*node;			//!< Node the connection is to.
+	cluster_node_addr_t	addr;			//!< Address we connected to.
+	fr_event_list_t		*el;			//!< Event list servicing the connection.
+	redisAsyncContext	*ac;			//!< libhiredis context.  NULL if not connected.
+};
+
+/** An asynchronous command, and the state needed to follow redirects and retry it
+ */
+typedef struct cluster_async_op {
+	fr_redis_cluster_t	*cluster;		//!< Cluster the command is being issued against.
+	fr_event_list_t		*el;			//!< Event list the command is serviced by.
+	REQUEST			*request;		//!< The current request.
+
+	uint8_t const		*key;			//!< Key we performed hashing on.
+	size_t			key_len;		//!< Length of the key.
+
+	char			*cmd;			//!< Command in the unified request protocol format.
+	size_t			cmd_len;		//!< Length of the command.
+
+	cluster_node_t		*node;			//!< Node the command was last sent to.
+	uint32_t		redirects;		//!< How many redirects have we followed.
+	uint32_t		retries;		//!< How many time's we've received TRYAGAIN.
+	uint32_t		reconnects;		//!< How many connections we've tried.
+	fr_event_t		*retry_ev;		//!< Delays the command after a TRYAGAIN.
+
+	fr_redis_cluster_async_callback_t callback;	//!< Called with the final result.
+	void			*uctx;			//!< Passed to callback.
+} cluster_async_op_t;
+
 /** Indexes in the cluster_node_t array for a single key slot
  *
  * When dealing with 16K entries, space is a concern. It's significantly
@@ -346,6 +400,12 @@ static void _cluster_node_conf_apply(fr_connection_pool_t *pool, void *opaque)
 
 	node->addr = node->pending_addr;
 
+	/*
+	 *	Shared connection is still pointing
+	 *	at the old address.
+	 */
+	if (node->pipe) fr_redis_pipe_close(node->pipe);
+
 	if (node->cluster->triggers_enabled) {
 		fr_connection_pool_enable_triggers(pool, node->cluster->trigger_prefix);
 
@@ -403,11 +463,23 @@ static cluster_rcode_t cluster_node_connect(fr_redis_cluster_t *cluster, cluster
 		if (!node->pool) return CLUSTER_OP_FAILED;
 		fr_connection_pool_reconnect_func(node->pool, _cluster_node_conf_apply);
 
+		if (cluster->conf->pipeline) {
+			struct timeval timeout;
+
+			timeout = fr_connection_pool_timeout(node->pool);
+			node->pipe = fr_redis_pipe_alloc(cluster, fr_redis_cluster_conn_create, node, &timeout);
+			if (!node->pipe) {
+				TALLOC_FREE(node->pool);
+				return CLUSTER_OP_FAILED;
+			}
+		}
+
 		if (cluster->triggers_enabled) {
 			fr_connection_pool_enable_triggers(node->pool, cluster->trigger_prefix);
 
 			args = trigger_args_afrom_server(node->pool, node->name, node->addr.port);
 			if (!args) {
+				TALLOC_FREE(node->pipe);
 				TALLOC_FREE(node->pool);
 				return CLUSTER_OP_FAILED;
 			}
@@ -844,7 +916,7 @@ static cluster_rcode_t cluster_map_get(redisReply **out, fr_redis_conn_t *conn)
 
 	*out = NULL;
 
-	reply = redisCommand(conn->handle, "cluster slots");
+	reply = fr_redis_command(conn, "cluster slots");
 	switch (fr_redis_command_status(conn, reply)) {
 	case REDIS_RCODE_RECONNECT:
 		fr_redis_reply_free(reply);
@@ -1247,7 +1319,7 @@ static cluster_rcode_t cluster_node_ping(REQUEST *request, cluster_node_t *node,
 	fr_redis_rcode_t	rcode;
 
 	RDEBUG2("[%i] Executing command: PING", node->id);
-	reply = redisCommand(conn->handle, "PING");
+	reply = fr_redis_command(conn, "PING");
 	rcode = fr_redis_command_status(conn, reply);
 	if (rcode != REDIS_RCODE_SUCCESS) {
 		RERROR("[%i] PING failed to %s:%i: %s", node->id, node->name,
@@ -1361,7 +1433,7 @@ static int cluster_node_find_live(cluster_node_t **live_node, fr_redis_conn_t **
 		/*
 		 *	Select a node at random
 		 */
-		find = (fr_rand() & (cumulative - 1));	/* Between 1 and total */
+		find = (fr_fast_rand() & (cumulative - 1));	/* Between 1 and total */
 		first = 0;
 		last = live->next - 1;
 		pivot = (first + last) / 2;
@@ -1547,6 +1619,56 @@ void *fr_redis_cluster_conn_create(TALLOC_CTX *ctx, void *instance, struct timev
 	return conn;
 }
 
+/** Reserve a connection to a node
+ *
+ * If pipelining is enabled this is a view of the node's shared connection,
+ * else it's a connection from the node's pool.
+ *
+ * @param[in] node to reserve connection for.
+ * @return
+ *	- A connection.
+ *	- NULL if no connections are available.
+ */
+static fr_redis_conn_t *cluster_conn_get(cluster_node_t *node)
+{
+	if (node->pipe) return fr_redis_pipe_conn(NULL, node->pipe);
+
+	return fr_connection_get(node->pool);
+}
+
+/** Release a connection reserved with #cluster_conn_get
+ *
+ * @param[in] node the connection belongs to.
+ * @param[in] conn to release.
+ */
+static void cluster_conn_release(cluster_node_t *node, fr_redis_conn_t *conn)
+{
+	if (conn && conn->pipe) {
+		talloc_free(conn);
+		return;
+	}
+
+	fr_connection_release(node->pool, conn);
+}
+
+/** Close a connection reserved with #cluster_conn_get
+ *
+ * For views this closes the shared connection, it'll be reopened on next use.
+ *
+ * @param[in] node the connection belongs to.
+ * @param[in] conn to close.
+ */
+static void cluster_conn_close(cluster_node_t *node, fr_redis_conn_t *conn)
+{
+	if (conn && conn->pipe) {
+		fr_redis_pipe_close(conn->pipe);
+		talloc_free(conn);
+		return;
+	}
+
+	fr_connection_close(node->pool, conn);
+}
+
 /** Implements the key slot selection scheme used by freeradius
  *
  * Like the scheme in the clustering specification but with some differences
@@ -1567,7 +1689,7 @@ static cluster_key_slot_t *cluster_slot_by_key(fr_redis_cluster_t *cluster, REQU
 	cluster_key_slot_t *key_slot;
 
 	if (!key || (key_len == 0)) {
-		key_slot = &cluster->key_slot[(uint16_t)(fr_rand() & (KEY_SLOTS - 1))];
+		key_slot = &cluster->key_slot[(uint16_t)(fr_fast_rand() & (KEY_SLOTS - 1))];
 		RDEBUG2("Key rand() -> slot %zu", key_slot - cluster->key_slot);
 
 		return key_slot;
@@ -1612,7 +1734,7 @@ static cluster_key_slot_t *cluster_slot_by_key(fr_redis_cluster_t *cluster, REQU
     for (s_ret = fr_redis_cluster_state_init(&state, &conn, cluster, key, key_len, false);
          s_ret == REDIS_RCODE_TRY_AGAIN,
          s_ret = fr_redis_cluster_state_next(&state, &conn, cluster, request, status, &reply)) {
-            reply = redisCommand(conn->handle, "SET foo bar");
+            reply = fr_redis_command(conn, "SET foo bar");
             status = fr_redis_command_status(conn, reply);
     }
     // Reply is freed if ret == REDIS_RCODE_TRY_AGAIN, but left in all other cases to allow error
@@ -1666,13 +1788,13 @@ again:
 	 *	2. Fall through to trying the master, and a single alternate node.
 	 */
 	if (read_only) {
-		first = fr_rand() & key_slot->slave_num;
+		first = fr_fast_rand() & key_slot->slave_num;
 		for (i = 0; i < key_slot->slave_num; i++) {
 			uint8_t node_id;
 
 			node_id = key_slot->slave[(first + i) % key_slot->slave_num];
 			node = &cluster->node[node_id];
-			*conn = fr_connection_get(node->pool);
+			*conn = cluster_conn_get(node);
 			if (!*conn) {
 				RDEBUG2("[%i] No connections available (key slot %zu slave %i)",
 					node->id, key_slot - cluster->key_slot, (first + i) % key_slot->slave_num);
@@ -1692,7 +1814,7 @@ again:
 	 *	   give up.
 	 */
 	node = &cluster->node[key_slot->master];
-	*conn = fr_connection_get(node->pool);
+	*conn = cluster_conn_get(node);
 	if (!*conn) {
 		RDEBUG2("[%i] No connections available (key slot %zu master)",
 			node->id, key_slot - cluster->key_slot);
@@ -1707,7 +1829,7 @@ finish:
 	 */
 	if (cluster->remap_needed) {
 		if (cluster_remap(request, cluster, *conn) == CLUSTER_OP_SUCCESS) {
-			fr_connection_release(node->pool, *conn);
+			cluster_conn_release(node, *conn);
 			goto again;	/* New map, try again */
 		}
 		RDEBUG2("%s", fr_strerror());
@@ -1773,7 +1895,7 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 	 */
 	if (state->close_conn) {
 		RDEBUG2("[%i] Connection no longer viable, closing it", state->node->id);
-		fr_connection_close(state->node->pool, *conn);
+		cluster_conn_close(state->node, *conn);
 		*conn = NULL;
 		state->close_conn = false;
 	}
@@ -1802,7 +1924,7 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 	 */
 	switch (status) {
 	case REDIS_RCODE_SUCCESS:
-		fr_connection_release(state->node->pool, *conn);
+		cluster_conn_release(state->node, *conn);
 		*conn = NULL;
 		return REDIS_RCODE_SUCCESS;
 
@@ -1812,7 +1934,7 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 	case REDIS_RCODE_NO_SCRIPT:
 	case REDIS_RCODE_ERROR:
 		REDEBUG("[%i] Command failed: %s", state->node->id, fr_strerror());
-		fr_connection_release(state->node->pool, *conn);
+		cluster_conn_release(state->node, *conn);
 		*conn = NULL;
 		return REDIS_RCODE_ERROR;
 
@@ -1822,12 +1944,12 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 	case REDIS_RCODE_TRY_AGAIN:
 		if (state->retries++ >= cluster->conf->max_retries) {
 			REDEBUG("[%i] Hit maximum retry attempts", state->node->id);
-			fr_connection_release(state->node->pool, *conn);
+			cluster_conn_release(state->node, *conn);
 			*conn = NULL;
 			return REDIS_RCODE_ERROR;
 		}
 
-		if (!*conn) *conn = fr_connection_get(state->node->pool);
+		if (!*conn) *conn = cluster_conn_get(state->node);
 
 		if (FR_TIMEVAL_TO_MS(&cluster->conf->retry_delay)) {
 			struct timespec ts;
@@ -1849,7 +1971,7 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 		RERROR("[%i] Failed communicating with %s:%i: %s", state->node->id, state->node->name,
 		       state->node->addr.port, fr_strerror());
 
-		fr_connection_close(state->node->pool, *conn);	/* He's dead jim */
+		cluster_conn_close(state->node, *conn);	/* He's dead jim */
 
 		if (state->reconnects++ > state->in_pool) {
 			REDEBUG("[%i] Hit maximum reconnect attempts", state->node->id);
@@ -1863,7 +1985,7 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 		key_slot = cluster_slot_by_key(cluster, request, state->key, state->key_len);
 		state->node = &cluster->node[key_slot->master];
 
-		*conn = fr_connection_get(state->node->pool);
+		*conn = cluster_conn_get(state->node);
 		if (!*conn) {
 			REDEBUG("[%i] No connections available for %s:%i", state->node->id, state->node->name,
 				state->node->addr.port);
@@ -1894,7 +2016,7 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 	{
 		cluster_node_t *new;
 
-		fr_connection_release(state->node->pool, *conn);	/* Always release the old connection */
+		cluster_conn_release(state->node, *conn);	/* Always release the old connection */
 
 		if (!rad_cond_assert(*reply)) return REDIS_RCODE_ERROR;
 
@@ -1916,7 +2038,7 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 			       state->node->addr.port, new->id, new->name, new->addr.port);
 			state->node = new;
 
-			*conn = fr_connection_get(state->node->pool);
+			*conn = cluster_conn_get(state->node);
 			if (!*conn) return REDIS_RCODE_RECONNECT;
 
 			/*
@@ -1947,6 +2069,512 @@ try_again:
 	return REDIS_RCODE_TRY_AGAIN;
 }
 
+/** Free a non-blocking connection
+ *
+ * Commands still in flight are completed with #REDIS_RCODE_RECONNECT.
+ */
+static int _cluster_async_conn_free(cluster_async_conn_t *conn)
+{
+	if (conn->ac) {
+		conn->ac->data = NULL;	/* Signal to the reply callbacks that we're going away */
+		redisAsyncFree(conn->ac);
+	}
+
+	return 0;
+}
+
+static void _cluster_async_connected(redisAsyncContext const *ac, int status)
+{
+	cluster_async_conn_t *conn = ac->data;
+
+	if (!conn) return;
+
+	if (status != REDIS_OK) {
+		ERROR("%s [%i]: Connection to %s:%i failed: %s", conn->node->cluster->log_prefix,
+		      conn->node->id, conn->node->name, conn->node->addr.port, ac->errstr);
+		if (conn->ac == ac) conn->ac = NULL;	/* libhiredis frees the context */
+		return;
+	}
+
+	DEBUG2("%s [%i]: Connected to %s:%i (async)", conn->node->cluster->log_prefix,
+	       conn->node->id, conn->node->name, conn->node->addr.port);
+}
+
+static void _cluster_async_disconnected(redisAsyncContext const *ac, int status)
+{
+	cluster_async_conn_t *conn = ac->data;
+
+	if (!conn) return;
+
+	if (status != REDIS_OK) {
+		ERROR("%s [%i]: Connection to %s:%i lost: %s", conn->node->cluster->log_prefix,
+		      conn->node->id, conn->node->name, conn->node->addr.port, ac->errstr);
+	}
+	if (conn->ac == ac) conn->ac = NULL;
+}
+
+/** Check the result of the AUTH and SELECT commands sent when connecting
+ */
+static void _cluster_async_setup(redisAsyncContext *ac, void *r, UNUSED void *privdata)
+{
+	cluster_async_conn_t	*conn = ac->data;
+	redisReply		*reply = r;
+
+	if (!conn || !reply) return;	/* Connection failure is reported elsewhere */
+
+	if ((reply->type == REDIS_REPLY_STATUS) && (strcmp(reply->str, "OK") == 0)) return;
+
+	ERROR("%s [%i]: Connection setup failed: %s", conn->node->cluster->log_prefix, conn->node->id,
+	      (reply->type == REDIS_REPLY_ERROR) || (reply->type == REDIS_REPLY_STATUS) ?
+	      reply->str : fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
+
+	if (conn->ac == ac) conn->ac = NULL;
+	redisAsyncDisconnect(ac);
+}
+
+/** Get the non-blocking connection to a node for an event list, connecting if necessary
+ *
+ * @note Must be called with the cluster mutex free, by the thread servicing el.
+ *
+ * @param[in] cluster the node belongs to.
+ * @param[in] node to get connection to.
+ * @param[in] el the connection will be serviced by.
+ * @return
+ *	- A connection.
+ *	- NULL on error, the error will be available via fr_strerror().
+ */
+static cluster_async_conn_t *cluster_async_conn_get(fr_redis_cluster_t *cluster, cluster_node_t *node,
+						    fr_event_list_t *el)
+{
+	cluster_async_conn_t	*conn;
+	redisAsyncContext	*ac;
+
+	pthread_mutex_lock(&cluster->mutex);
+	for (conn = node->async; conn; conn = conn->next) if (conn->el == el) break;
+	if (!conn) {
+		conn = talloc_zero(cluster, cluster_async_conn_t);
+		if (!conn) {
+			pthread_mutex_unlock(&cluster->mutex);
+			fr_strerror_printf("Out of memory");
+			return NULL;
+		}
+		conn->node = node;
+		conn->el = el;
+		conn->next = node->async;
+		node->async = conn;
+		talloc_set_destructor(conn, _cluster_async_conn_free);
+	}
+	pthread_mutex_unlock(&cluster->mutex);
+
+	/*
+	 *	Only the thread servicing el touches conn->ac
+	 *	so no locking is needed from here on.
+	 *
+	 *	If the node has been reassigned to a different
+	 *	server, drop the connection to the old one.
+	 */
+	if (conn->ac && ((conn->addr.port != node->addr.port) ||
+			 (fr_ipaddr_cmp(&conn->addr.ipaddr, &node->addr.ipaddr) != 0))) {
+		ac = conn->ac;
+		conn->ac = NULL;
+		redisAsyncDisconnect(ac);
+	}
+	if (conn->ac) return conn;
+
+	DEBUG2("%s [%i]: Connecting node to %s:%i (async)", cluster->log_prefix, node->id, node->name, node->addr.port);
+
+	ac = redisAsyncConnect(node->name, node->addr.port);
+	if (!ac) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	if (ac->err) {
+		fr_strerror_printf("Connection to %s:%i failed: %s", node->name, node->addr.port, ac->errstr);
+		redisAsyncFree(ac);
+		return NULL;
+	}
+
+	if (fr_redis_async_attach(el, ac) < 0) {
+		redisAsyncFree(ac);
+		return NULL;
+	}
+	ac->data = conn;
+	redisAsyncSetConnectCallback(ac, _cluster_async_connected);
+	redisAsyncSetDisconnectCallback(ac, _cluster_async_disconnected);
+
+	/*
+	 *	Queued before any other commands, so
+	 *	they're processed first by the server.
+	 */
+	if (cluster->conf->password) {
+		redisAsyncCommand(ac, _cluster_async_setup, NULL, "AUTH %s", cluster->conf->password);
+	}
+	if (cluster->conf->database) {
+		redisAsyncCommand(ac, _cluster_async_setup, NULL, "SELECT %i", cluster->conf->database);
+	}
+
+	conn->addr = node->addr;
+	conn->ac = ac;
+
+	return conn;
+}
+
+static void _cluster_async_reply(redisAsyncContext *ac, void *r, void *privdata);
+
+/** Write an asynchronous command to the node it's currently targeting
+ *
+ * @param[in] op to send.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, the error will be available via fr_strerror().
+ */
+static int cluster_async_send(cluster_async_op_t *op)
+{
+	cluster_async_conn_t	*conn;
+	REQUEST			*request = op->request;
+
+	conn = cluster_async_conn_get(op->cluster, op->node, op->el);
+	if (!conn) return -1;
+
+	RDEBUG2("[%i] >>> Sending command to %s:%i (async)", op->node->id, op->node->name, op->node->addr.port);
+
+	if (redisAsyncFormattedCommand(conn->ac, _cluster_async_reply, op, op->cmd, op->cmd_len) != REDIS_OK) {
+		fr_strerror_printf("Failed writing command to %s:%i: %s", op->node->name, op->node->addr.port,
+				   conn->ac->errstr ? conn->ac->errstr : "Connection closing");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Pass the final result of an asynchronous command to the caller, and free the command
+ */
+static void cluster_async_finish(cluster_async_op_t *op, fr_redis_rcode_t status, redisReply *reply)
+{
+	op->callback(op->request, status, reply, op->uctx);
+	talloc_free(op);
+}
+
+/** Resend a command after the retry_delay has elapsed
+ */
+static void _cluster_async_retry(void *ctx, UNUSED struct timeval *now)
+{
+	cluster_async_op_t	*op = talloc_get_type_abort(ctx, cluster_async_op_t);
+	REQUEST			*request = op->request;
+
+	if (cluster_async_send(op) < 0) {
+		REDEBUG("[%i] %s", op->node->id, fr_strerror());
+		cluster_async_finish(op, REDIS_RCODE_RECONNECT, NULL);
+	}
+}
+
+/** Process the reply to an asynchronous command
+ *
+ * Equivalent to #fr_redis_cluster_state_next, but the next attempt is
+ * written to a non-blocking connection instead of being returned to the caller.
+ */
+static void _cluster_async_reply(redisAsyncContext *ac, void *r, void *privdata)
+{
+	cluster_async_op_t	*op = talloc_get_type_abort(privdata, cluster_async_op_t);
+	fr_redis_cluster_t	*cluster = op->cluster;
+	REQUEST			*request = op->request;
+	redisReply		*reply = r;
+	fr_redis_conn_t		conn = { .handle = &ac->c };
+	fr_redis_rcode_t	status;
+
+	status = fr_redis_command_status(&conn, reply);
+	if (reply) fr_redis_reply_print(L_DBG_LVL_3, reply, request, 0);
+
+	RDEBUG2("[%i] <<< Returned: %s", op->node->id, fr_int2str(redis_rcodes, status, "<UNKNOWN>"));
+
+	switch (status) {
+	/*
+	 *	Success, or a command error that's not fixable.
+	 */
+	default:
+		if (status != REDIS_RCODE_SUCCESS) REDEBUG("[%i] Command failed: %s", op->node->id, fr_strerror());
+		cluster_async_finish(op, status, reply);
+		return;
+
+	/*
+	 *	Cluster's unstable, try again.
+	 */
+	case REDIS_RCODE_TRY_AGAIN:
+		if (op->retries++ >= cluster->conf->max_retries) {
+			REDEBUG("[%i] Hit maximum retry attempts", op->node->id);
+			cluster_async_finish(op, REDIS_RCODE_ERROR, reply);
+			return;
+		}
+
+		if (FR_TIMEVAL_TO_MS(&cluster->conf->retry_delay)) {
+			struct timeval when;
+
+			gettimeofday(&when, NULL);
+			timeradd(&when, &cluster->conf->retry_delay, &when);
+
+			if (!fr_event_insert(op->el, _cluster_async_retry, op, &when, &op->retry_ev)) {
+				REDEBUG("[%i] Failed scheduling retry: %s", op->node->id, fr_strerror());
+				cluster_async_finish(op, REDIS_RCODE_ERROR, reply);
+			}
+			return;
+		}
+		break;
+
+	/*
+	 *	Connection's dead, try the master for the key slot
+	 *	with a new connection.
+	 */
+	case REDIS_RCODE_RECONNECT:
+	{
+		cluster_async_conn_t	*dead = ac->data;
+		cluster_key_slot_t	*key_slot;
+
+		RERROR("[%i] Failed communicating with %s:%i: %s", op->node->id, op->node->name,
+		       op->node->addr.port, fr_strerror());
+
+		/*
+		 *	Connection's being freed with the cluster.
+		 */
+		if (!dead) {
+			cluster_async_finish(op, REDIS_RCODE_RECONNECT, NULL);
+			return;
+		}
+		if (dead->ac == ac) dead->ac = NULL;	/* libhiredis frees the context */
+
+		if (op->reconnects++ >= cluster->conf->max_alt) {
+			REDEBUG("[%i] Hit maximum reconnect attempts", op->node->id);
+			cluster->remap_needed = true;
+			cluster_async_finish(op, REDIS_RCODE_RECONNECT, NULL);
+			return;
+		}
+
+		key_slot = cluster_slot_by_key(cluster, request, op->key, op->key_len);
+		op->node = &cluster->node[key_slot->master];
+		op->retries = 0;
+	}
+		break;
+
+	/*
+	 *	We can't remap without blocking, leave that to
+	 *	the next blocking operation, and treat -MOVE
+	 *	as -ASK.
+	 */
+	case REDIS_RCODE_MOVE:
+		cluster->remap_needed = true;
+		/* FALL-THROUGH */
+
+	case REDIS_RCODE_ASK:
+	{
+		cluster_node_t *new;
+
+		RDEBUG("[%i] Processing redirect \"%s\"", op->node->id, reply->str);
+		if (op->redirects++ >= cluster->conf->max_redirects) {
+			REDEBUG("[%i] Reached max_redirects (%i)", op->node->id, op->redirects);
+			cluster_async_finish(op, REDIS_RCODE_ERROR, reply);
+			return;
+		}
+
+		switch (cluster_redirect(&new, cluster, reply)) {
+		case CLUSTER_OP_SUCCESS:
+			if (new == op->node) {
+				REDEBUG("[%i] %s:%i issued redirect to itself", op->node->id,
+					op->node->name, op->node->addr.port);
+				cluster_async_finish(op, REDIS_RCODE_ERROR, reply);
+				return;
+			}
+
+			RDEBUG("[%i] Redirected from %s:%i to [%i] %s:%i", op->node->id, op->node->name,
+			       op->node->addr.port, new->id, new->name, new->addr.port);
+			op->node = new;
+			op->reconnects = 0;
+			op->retries = 0;
+			break;
+
+		case CLUSTER_OP_NO_CONNECTION:
+			cluster->remap_needed = true;
+			cluster_async_finish(op, REDIS_RCODE_RECONNECT, reply);
+			return;
+
+		default:
+			cluster_async_finish(op, REDIS_RCODE_ERROR, reply);
+			return;
+		}
+	}
+		break;
+	}
+
+	if (cluster_async_send(op) < 0) {
+		REDEBUG("[%i] %s", op->node->id, fr_strerror());
+		cluster_async_finish(op, REDIS_RCODE_RECONNECT, NULL);
+	}
+}
+
+/** Resolve the key for an asynchronous command to a node, and send the command
+ *
+ * @param[in] op to submit.  Freed on error.
+ * @param[in] read_only If true, will send the command to a random slave of the key slot,
+ *	if there are any.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int cluster_async_submit(cluster_async_op_t *op, bool read_only)
+{
+	fr_redis_cluster_t	*cluster = op->cluster;
+	REQUEST			*request = op->request;
+	cluster_key_slot_t	*key_slot;
+
+	if (rbtree_num_elements(cluster->used_nodes) == 0) {
+		REDEBUG("No nodes in cluster");
+		talloc_free(op);
+		return -1;
+	}
+
+	key_slot = cluster_slot_by_key(cluster, request, op->key, op->key_len);
+	if (read_only && key_slot->slave_num) {
+		op->node = &cluster->node[key_slot->slave[fr_fast_rand() % key_slot->slave_num]];
+	} else {
+		op->node = &cluster->node[key_slot->master];
+	}
+
+	if (cluster_async_send(op) < 0) {
+		REDEBUG("[%i] %s", op->node->id, fr_strerror());
+		talloc_free(op);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Allocate an asynchronous command
+ *
+ * @param[in] cmd formatted by libhiredis.  Will be freed.
+ * @param[in] cmd_len length of cmd, or < 0 if formatting failed.
+ */
+static cluster_async_op_t *cluster_async_op_alloc(fr_redis_cluster_t *cluster, fr_event_list_t *el,
+						  REQUEST *request, uint8_t const *key, size_t key_len,
+						  fr_redis_cluster_async_callback_t callback, void *uctx,
+						  char *cmd, int cmd_len)
+{
+	cluster_async_op_t *op;
+
+	if (cmd_len < 0) {
+		REDEBUG("Failed formatting command");
+		return NULL;
+	}
+
+	op = talloc_zero(NULL, cluster_async_op_t);
+	if (!op) {
+	oom:
+		free(cmd);
+		REDEBUG("Out of memory");
+		return NULL;
+	}
+	op->cluster = cluster;
+	op->el = el;
+	op->request = request;
+	op->callback = callback;
+	op->uctx = uctx;
+
+	if (key && (key_len > 0)) {
+		op->key = talloc_memdup(op, key, key_len);
+		if (!op->key) {
+			talloc_free(op);
+			goto oom;
+		}
+		op->key_len = key_len;
+	}
+
+	op->cmd = talloc_memdup(op, cmd, cmd_len);
+	if (!op->cmd) {
+		talloc_free(op);
+		goto oom;
+	}
+	op->cmd_len = cmd_len;
+	free(cmd);
+
+	return op;
+}
+
+/** Issue a command against the cluster without blocking
+ *
+ * The command is sent to the node responsible for key, using a non-blocking connection
+ * serviced by el.  Redirects, retries and reconnects are processed in the same way as
+ * #fr_redis_cluster_state_next, and callback is called from el with the final result.
+ *
+ * @note Must be called by the thread servicing el.  request must remain valid until
+ *	callback has been called.
+ *
+ * @param[in] cluster to issue command against.
+ * @param[in] el to service the command from.
+ * @param[in] request The current request.
+ * @param[in] key to resolve to a cluster node. If key is NULL or key_len is 0 a random
+ *	slot will be chosen.
+ * @param[in] key_len Length of the key.
+ * @param[in] read_only If true, will send the command to a random slave of the key slot,
+ *	if there are any.
+ * @param[in] callback to call with the result.
+ * @param[in] uctx to pass to callback.
+ * @param[in] fmt Command format string.
+ * @return
+ *	- 0 if the command was sent.  callback will be called exactly once.
+ *	- -1 on failure.  callback will not be called.
+ */
+int fr_redis_cluster_async_command(fr_redis_cluster_t *cluster, fr_event_list_t *el, REQUEST *request,
+				   uint8_t const *key, size_t key_len, bool read_only,
+				   fr_redis_cluster_async_callback_t callback, void *uctx, char const *fmt, ...)
+{
+	cluster_async_op_t	*op;
+	va_list			ap;
+	char			*cmd = NULL;
+	int			cmd_len;
+
+	va_start(ap, fmt);
+	cmd_len = redisvFormatCommand(&cmd, fmt, ap);
+	va_end(ap);
+
+	op = cluster_async_op_alloc(cluster, el, request, key, key_len, callback, uctx, cmd, cmd_len);
+	if (!op) return -1;
+
+	return cluster_async_submit(op, read_only);
+}
+
+/** Issue a command against the cluster without blocking
+ *
+ * As #fr_redis_cluster_async_command, but with the command provided as an argument vector.
+ *
+ * @param[in] cluster to issue command against.
+ * @param[in] el to service the command from.
+ * @param[in] request The current request.
+ * @param[in] key to resolve to a cluster node.
+ * @param[in] key_len Length of the key.
+ * @param[in] read_only If true, will prefer slaves of the key slot.
+ * @param[in] callback to call with the result.
+ * @param[in] uctx to pass to callback.
+ * @param[in] argc Number of arguments.
+ * @param[in] argv Command arguments.
+ * @param[in] argv_len Argument lengths.  May be NULL if all arguments are \0 terminated.
+ * @return
+ *	- 0 if the command was sent.  callback will be called exactly once.
+ *	- -1 on failure.  callback will not be called.
+ */
+int fr_redis_cluster_async_command_argv(fr_redis_cluster_t *cluster, fr_event_list_t *el, REQUEST *request,
+					uint8_t const *key, size_t key_len, bool read_only,
+					fr_redis_cluster_async_callback_t callback, void *uctx,
+					int argc, char const **argv, size_t const *argv_len)
+{
+	cluster_async_op_t	*op;
+	char			*cmd = NULL;
+	int			cmd_len;
+
+	cmd_len = redisFormatCommandArgv(&cmd, argc, argv, argv_len);
+
+	op = cluster_async_op_alloc(cluster, el, request, key, key_len, callback, uctx, cmd, cmd_len);
+	if (!op) return -1;
+
+	return cluster_async_submit(op, read_only);
+}
+
 /** Get the pool associated with a node in the cluster
  *
  * @note This is used for testing only.  It's not ifdef'd out because
@@ -56,6 +56,17 @@ typedef struct fr_redis_cluster_state {
 	uint32_t		reconnects;	//!< How many connections we've tried in this pool.
 } fr_redis_cluster_state_t;
 
+/** Called with the final result of an asynchronous command
+ *
+ * @param[in] request the command was issued for.
+ * @param[in] status of the command.
+ * @param[in] reply from the server.  May be NULL on connection failure.  Freed when the
+ *	callback returns.
+ * @param[in] uctx passed when issuing the command.
+ */
+typedef void (*fr_redis_cluster_async_callback_t)(REQUEST *request, fr_redis_rcode_t status,
+						  redisReply *reply, void *uctx);
+
 /*
  *	Callback for the connection pool to create a new connection
  */
@@ -73,6 +84,19 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 					     fr_redis_cluster_t *cluster, REQUEST *request,
 					     fr_redis_rcode_t status, redisReply **reply);
 
+/*
+ *	Issue commands without blocking, results are delivered via an event list.
+ */
+int fr_redis_cluster_async_command(fr_redis_cluster_t *cluster, fr_event_list_t *el, REQUEST *request,
+				   uint8_t const *key, size_t key_len, bool read_only,
+				   fr_redis_cluster_async_callback_t callback, void *uctx, char const *fmt, ...)
+				   CC_HINT(format (printf, 9, 10));
+
+int fr_redis_cluster_async_command_argv(fr_redis_cluster_t *cluster, fr_event_list_t *el, REQUEST *request,
+					uint8_t const *key, size_t key_len, bool read_only,
+					fr_redis_cluster_async_callback_t callback, void *uctx,
+					int argc, char const **argv, size_t const *argv_len);
+
 /*
  *	Testing only
  */
@@ -26,6 +26,16 @@
 #include "redis.h"
 #include <freeradius-devel/rad_assert.h>
 
+#include <poll.h>
+
+#ifdef HAVE_PTHREAD_H
+#  define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#  define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#  define PTHREAD_MUTEX_LOCK(_x)
+#  define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
 FR_NAME_NUMBER const redis_reply_types[] = {
 	{ "string",	REDIS_REPLY_STRING },
 	{ "integer",	REDIS_REPLY_INTEGER },
@@ -434,6 +444,622 @@ int fr_redis_tuple_from_map(TALLOC_CTX *pool, char const *out[], size_t out_len[
 	return 0;
 }
 
+/** Commands written to a shared connection by a single view
+ *
+ * Queued in the order the commands were written, so replies can be
+ * dispatched to the view which sent the commands.
+ */
+struct fr_redis_pipe_wait {
+	fr_redis_pipe_wait_t	*next;		//!< Next set of commands written to the connection.
+
+	redisReply		**replies;	//!< Replies received so far.
+	size_t			expected;	//!< Number of replies we're waiting for.
+	size_t			received;	//!< Number of replies received.
+	size_t			consumed;	//!< Number of replies returned to the caller.
+
+	bool			failed;		//!< The connection failed before all replies were received.
+};
+
+/** A connection shared between requests
+ *
+ * Commands from views of the connection are appended to its output buffer,
+ * and written in batches, by whichever thread is currently performing I/O.
+ * Replies are read back in the same order and dispatched to the views that
+ * sent them, so the cost of a round trip is shared between all requests
+ * with commands in flight.
+ */
+struct fr_redis_pipe {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;		//!< Protects the queue and shared connection.
+	pthread_cond_t		cond;		//!< Signalled when replies have been dispatched.
+#endif
+	fr_redis_conn_t		*conn;		//!< Shared connection.  NULL if not connected.
+	bool			busy;		//!< A thread is writing to/reading from the connection.
+	bool			dead;		//!< Close the connection once no thread is using it.
+
+	fr_redis_pipe_wait_t	*head;		//!< Oldest commands still waiting for replies.
+	fr_redis_pipe_wait_t	*tail;		//!< Newest commands.
+
+	fr_connection_create_t	create;		//!< Opens the shared connection.
+	void			*uctx;		//!< Passed to create.
+	struct timeval		timeout;	//!< Connection timeout.
+};
+
+static int _redis_pipe_wait_free(fr_redis_pipe_wait_t *wait)
+{
+	size_t i;
+
+	for (i = wait->consumed; i < wait->received; i++) fr_redis_reply_free(wait->replies[i]);
+
+	return 0;
+}
+
+/** Count the commands in a libhiredis output buffer
+ *
+ * libhiredis always formats commands using the unified request protocol.
+ *
+ * @param[in] buff to parse.
+ * @param[in] len of buff.
+ * @return
+ *	- The number of commands in the buffer.
+ *	- -1 if the buffer couldn't be parsed.
+ */
+static ssize_t redis_command_count(char const *buff, size_t len)
+{
+	char const	*p = buff, *end = buff + len;
+	char		*q;
+	unsigned long	argc, arg_len;
+	ssize_t		count = 0;
+
+	while (p < end) {
+		if (*p++ != '*') return -1;
+
+		argc = strtoul(p, &q, 10);
+		if ((q == p) || ((end - q) < 2) || (q[0] != '\r')) return -1;
+		p = q + 2;
+
+		while (argc-- > 0) {
+			if ((p >= end) || (*p++ != '$')) return -1;
+
+			arg_len = strtoul(p, &q, 10);
+			if ((q == p) || ((end - q) < 2) || (q[0] != '\r')) return -1;
+			p = q + 2;
+
+			if ((size_t)(end - p) < (arg_len + 2)) return -1;
+			p += arg_len + 2;
+		}
+		count++;
+	}
+
+	return count;
+}
+
+/** Record an error in a view's context, so it's picked up by #fr_redis_command_status
+ *
+ */
+static void redis_pipe_error(fr_redis_conn_t *conn, int type, char const *msg)
+{
+	conn->handle->err = type;
+	strlcpy(conn->handle->errstr, msg, sizeof(conn->handle->errstr));
+}
+
+/** Close the shared connection, failing any commands still waiting for replies
+ *
+ * @note Must be called with the mutex held, and only when no other thread is using the connection.
+ */
+static void redis_pipe_reset(fr_redis_pipe_t *pipe)
+{
+	fr_redis_pipe_wait_t *wait;
+
+	TALLOC_FREE(pipe->conn);
+	pipe->dead = false;
+
+	for (wait = pipe->head; wait; wait = wait->next) wait->failed = true;
+	pipe->head = pipe->tail = NULL;
+}
+
+/** Write any queued commands and read back as many replies as are available
+ *
+ * @note Must be called with the mutex held.  The mutex is released during I/O.
+ */
+static void redis_pipe_io(fr_redis_pipe_t *pipe)
+{
+	redisContext	*handle = pipe->conn->handle;
+	char		*out;
+	size_t		out_len, written = 0;
+	ssize_t		ret;
+	void		*reply;
+	bool		failed = false;
+
+	pipe->busy = true;
+
+	/*
+	 *	Take everything that's been queued so far.  Commands
+	 *	queued whilst we're waiting for replies are written
+	 *	together in the next round.
+	 */
+	out = handle->obuf;
+	out_len = sdslen(out);
+	handle->obuf = sdsempty();
+
+	PTHREAD_MUTEX_UNLOCK(&pipe->mutex);
+
+	while (written < out_len) {
+		ret = write(handle->fd, out + written, out_len - written);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			failed = true;
+			break;
+		}
+		written += ret;
+	}
+	sdsfree(out);
+
+	if (!failed && (redisBufferRead(handle) != REDIS_OK)) failed = true;
+
+	PTHREAD_MUTEX_LOCK(&pipe->mutex);
+
+	/*
+	 *	Dispatch complete replies in the order
+	 *	the commands were written.
+	 */
+	while (!failed) {
+		fr_redis_pipe_wait_t *wait;
+
+		reply = NULL;
+		if (redisReaderGetReply(handle->reader, &reply) != REDIS_OK) {
+			failed = true;
+			break;
+		}
+		if (!reply) break;
+
+		wait = pipe->head;
+		if (!wait) {
+			freeReplyObject(reply);
+			failed = true;	/* Reply we didn't ask for, stream is out of sync */
+			break;
+		}
+
+		wait->replies[wait->received++] = reply;
+		if (wait->received == wait->expected) {
+			pipe->head = wait->next;
+			if (!pipe->head) pipe->tail = NULL;
+		}
+	}
+
+	if (failed || pipe->dead) redis_pipe_reset(pipe);
+
+	pipe->busy = false;
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_broadcast(&pipe->cond);
+#endif
+}
+
+/** Write the commands buffered in a view to the shared connection, and wait for their replies
+ *
+ */
+static int redis_pipe_flush(fr_redis_conn_t *conn)
+{
+	fr_redis_pipe_t		*pipe = conn->pipe;
+	fr_redis_pipe_wait_t	*wait;
+	size_t			len = sdslen(conn->handle->obuf);
+	ssize_t			count;
+
+	count = redis_command_count(conn->handle->obuf, len);
+	if (count <= 0) {
+		sdsfree(conn->handle->obuf);
+		conn->handle->obuf = sdsempty();
+
+		redis_pipe_error(conn, REDIS_ERR_PROTOCOL, count < 0 ? "Malformed command buffer" : "No commands to send");
+		return REDIS_ERR;
+	}
+
+	TALLOC_FREE(conn->wait);
+	MEM(wait = talloc_zero(conn, fr_redis_pipe_wait_t));
+	MEM(wait->replies = talloc_zero_array(wait, redisReply *, count));
+	wait->expected = count;
+	talloc_set_destructor(wait, _redis_pipe_wait_free);
+	conn->wait = wait;
+
+	PTHREAD_MUTEX_LOCK(&pipe->mutex);
+	if (!pipe->busy && pipe->dead) redis_pipe_reset(pipe);
+	if (!pipe->conn) pipe->conn = pipe->create(pipe, pipe->uctx, &pipe->timeout);
+	if (!pipe->conn || (redisAppendFormattedCommand(pipe->conn->handle, conn->handle->obuf, len) != REDIS_OK)) {
+		PTHREAD_MUTEX_UNLOCK(&pipe->mutex);
+		wait->failed = true;
+		goto finish;
+	}
+
+	if (pipe->tail) {
+		pipe->tail->next = wait;
+	} else {
+		pipe->head = wait;
+	}
+	pipe->tail = wait;
+
+	/*
+	 *	Either perform I/O on behalf of all the views with
+	 *	commands queued, or wait for another thread to
+	 *	dispatch our replies.
+	 */
+	while (!wait->failed && (wait->received < wait->expected)) {
+#ifdef HAVE_PTHREAD_H
+		if (pipe->busy) {
+			pthread_cond_wait(&pipe->cond, &pipe->mutex);
+			continue;
+		}
+#endif
+		if (!pipe->conn) {
+			wait->failed = true;
+			break;
+		}
+		redis_pipe_io(pipe);
+	}
+	PTHREAD_MUTEX_UNLOCK(&pipe->mutex);
+
+finish:
+	sdsfree(conn->handle->obuf);
+	conn->handle->obuf = sdsempty();
+
+	if (wait->failed) {
+		redis_pipe_error(conn, REDIS_ERR_IO, "Shared connection failed");
+		return REDIS_ERR;
+	}
+
+	return REDIS_OK;
+}
+
+/** Return the next reply for a view, flushing buffered commands if there are no replies left
+ *
+ */
+static int redis_pipe_get_reply(fr_redis_conn_t *conn, redisReply **reply)
+{
+	fr_redis_pipe_wait_t *wait = conn->wait;
+
+	if (!wait || (wait->consumed == wait->received)) {
+		if (wait && wait->failed) {
+			redis_pipe_error(conn, REDIS_ERR_IO, "Shared connection failed");
+			return REDIS_ERR;
+		}
+
+		if (redis_pipe_flush(conn) != REDIS_OK) return REDIS_ERR;
+		wait = conn->wait;
+	}
+
+	*reply = wait->replies[wait->consumed];
+	wait->replies[wait->consumed++] = NULL;
+
+	return REDIS_OK;
+}
+
+static int _redis_pipe_conn_free(fr_redis_conn_t *conn)
+{
+	TALLOC_FREE(conn->wait);
+	redisFree(conn->handle);
+
+	return 0;
+}
+
+/** Create a view of a shared connection
+ *
+ * Commands are buffered in the view's context as normal, and written to the shared
+ * connection when the first reply is requested with #fr_redis_get_reply.
+ *
+ * @param[in] ctx to allocate view in.
+ * @param[in] pipe to create view of.
+ * @return
+ *	- A new view.
+ *	- NULL on failure.
+ */
+fr_redis_conn_t *fr_redis_pipe_conn(TALLOC_CTX *ctx, fr_redis_pipe_t *pipe)
+{
+	fr_redis_conn_t *conn;
+
+	conn = talloc_zero(ctx, fr_redis_conn_t);
+	if (!conn) return NULL;
+
+	/*
+	 *	Never connected, only used to format
+	 *	commands and record errors.
+	 */
+	conn->handle = redisConnectFd(-1);
+	if (!conn->handle) {
+		talloc_free(conn);
+		return NULL;
+	}
+	conn->pipe = pipe;
+	talloc_set_destructor(conn, _redis_pipe_conn_free);
+
+	return conn;
+}
+
+/** Close the shared connection
+ *
+ * Called when a view's command failed in a way that may have left the connection in
+ * an unknown state.  The connection is closed (and commands still waiting for replies
+ * failed) once no thread is using it.  It's reopened when the next command is written.
+ *
+ * @param[in] pipe to close.
+ */
+void fr_redis_pipe_close(fr_redis_pipe_t *pipe)
+{
+	PTHREAD_MUTEX_LOCK(&pipe->mutex);
+	if (pipe->busy) {
+		pipe->dead = true;
+	} else {
+		redis_pipe_reset(pipe);
+	}
+	PTHREAD_MUTEX_UNLOCK(&pipe->mutex);
+}
+
+static int _redis_pipe_free(fr_redis_pipe_t *pipe)
+{
+	TALLOC_FREE(pipe->conn);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&pipe->mutex);
+	pthread_cond_destroy(&pipe->cond);
+#endif
+	return 0;
+}
+
+/** Allocate a new shared connection
+ *
+ * The connection is opened when the first command is written to it.
+ *
+ * @param[in] ctx to allocate pipe in.
+ * @param[in] create callback to open the connection, usually the same as the pool's.
+ * @param[in] uctx passed to create.
+ * @param[in] timeout passed to create.
+ * @return
+ *	- A new pipe.
+ *	- NULL on failure.
+ */
+fr_redis_pipe_t *fr_redis_pipe_alloc(TALLOC_CTX *ctx, fr_connection_create_t create, void *uctx,
+				     struct timeval const *timeout)
+{
+	fr_redis_pipe_t *pipe;
+
+	pipe = talloc_zero(ctx, fr_redis_pipe_t);
+	if (!pipe) return NULL;
+
+	pipe->create = create;
+	pipe->uctx = uctx;
+	pipe->timeout = *timeout;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&pipe->mutex, NULL);
+	pthread_cond_init(&pipe->cond, NULL);
+#endif
+	talloc_set_destructor(pipe, _redis_pipe_free);
+
+	return pipe;
+}
+
+/** Retrieve the next reply from a connection
+ *
+ * Equivalent to redisGetReply, but also works with views of a shared connection.
+ *
+ * @param[in] conn to retrieve reply from.
+ * @param[out] reply Where to write the reply.  Will be NULL on error.
+ * @return
+ *	- REDIS_OK on success.
+ *	- REDIS_ERR on failure, the error will be available in conn->handle.
+ */
+int fr_redis_get_reply(fr_redis_conn_t *conn, redisReply **reply)
+{
+	*reply = NULL;	/* redisGetReply doesn't NULLify reply on error *sigh* */
+
+	if (conn->pipe) return redis_pipe_get_reply(conn, reply);
+
+	return redisGetReply(conn->handle, (void **)reply);
+}
+
+/** Issue a command and wait for its reply
+ *
+ * Equivalent to redisCommand, but also works with views of a shared connection.
+ *
+ * @param[in] conn to issue command on.
+ * @param[in] fmt Command format string.
+ * @return
+ *	- A reply on success.
+ *	- NULL on error, the error will be available in conn->handle.
+ */
+redisReply *fr_redis_command(fr_redis_conn_t *conn, char const *fmt, ...)
+{
+	va_list		ap;
+	redisReply	*reply;
+	int		ret;
+
+	va_start(ap, fmt);
+	ret = redisvAppendCommand(conn->handle, fmt, ap);
+	va_end(ap);
+	if (ret != REDIS_OK) return NULL;
+
+	if (fr_redis_get_reply(conn, &reply) != REDIS_OK) return NULL;
+
+	return reply;
+}
+
+/** Issue a command and wait for its reply
+ *
+ * Equivalent to redisCommandArgv, but also works with views of a shared connection.
+ *
+ * @param[in] conn to issue command on.
+ * @param[in] argc Number of arguments.
+ * @param[in] argv Command arguments.
+ * @param[in] argv_len Argument lengths.  May be NULL if all arguments are \0 terminated.
+ * @return
+ *	- A reply on success.
+ *	- NULL on error, the error will be available in conn->handle.
+ */
+redisReply *fr_redis_command_argv(fr_redis_conn_t *conn, int argc, char const **argv, size_t const *argv_len)
+{
+	redisReply	*reply;
+
+	if (redisAppendCommandArgv(conn->handle, argc, argv, argv_len) != REDIS_OK) return NULL;
+
+	if (fr_redis_get_reply(conn, &reply) != REDIS_OK) return NULL;
+
+	return reply;
+}
+
+/** Binds a libhiredis async context to an event list
+ *
+ * The event list only signals read readiness, so instead of waiting to be
+ * told the socket is writable, we poll it from a timer whenever libhiredis
+ * has data to write (or a connection in progress).
+ */
+typedef struct redis_async_event {
+	fr_event_list_t		*el;		//!< Event list servicing the context.
+	redisAsyncContext	*ac;		//!< Context being serviced.
+	int			fd;		//!< Socket inserted into the event list.
+	bool			reading;	//!< Whether fd is currently in the event list.
+	fr_event_t		*write_ev;	//!< Timer used to check for write readiness.
+} redis_async_event_t;
+
+#define REDIS_ASYNC_WRITE_RETRY	1000		//!< How long to wait (in microseconds) before
+						//!< retrying a write which would block.
+
+static void redis_async_write_schedule(redis_async_event_t *ev, struct timeval const *now, suseconds_t delay);
+
+static void _redis_async_read(UNUSED fr_event_list_t *el, UNUSED int fd, void *ctx)
+{
+	redis_async_event_t *ev = talloc_get_type_abort(ctx, redis_async_event_t);
+
+	redisAsyncHandleRead(ev->ac);	/* May free ev */
+}
+
+static void _redis_async_write(void *ctx, struct timeval *now)
+{
+	redis_async_event_t	*ev = talloc_get_type_abort(ctx, redis_async_event_t);
+	struct pollfd		pfd;
+
+	/*
+	 *	Still connecting, or the socket buffer is full,
+	 *	check again shortly.
+	 */
+	pfd.fd = ev->fd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) == 0) {
+		redis_async_write_schedule(ev, now, REDIS_ASYNC_WRITE_RETRY);
+		return;
+	}
+
+	redisAsyncHandleWrite(ev->ac);	/* May free ev, or call addWrite again */
+}
+
+static void redis_async_write_schedule(redis_async_event_t *ev, struct timeval const *now, suseconds_t delay)
+{
+	struct timeval when, offset = { .tv_sec = 0, .tv_usec = delay };
+
+	if (now) {
+		when = *now;
+	} else {
+		gettimeofday(&when, NULL);
+	}
+	timeradd(&when, &offset, &when);
+
+	if (!fr_event_insert(ev->el, _redis_async_write, ev, &when, &ev->write_ev)) {
+		ERROR("Failed scheduling write to Redis server: %s", fr_strerror());
+	}
+}
+
+static void _redis_async_add_read(void *privdata)
+{
+	redis_async_event_t *ev = privdata;
+
+	if (ev->reading) return;
+
+	if (!fr_event_fd_insert(ev->el, 0, ev->fd, _redis_async_read, ev)) {
+		ERROR("Failed adding Redis socket to event list: %s", fr_strerror());
+		return;
+	}
+	ev->reading = true;
+}
+
+static void _redis_async_del_read(void *privdata)
+{
+	redis_async_event_t *ev = privdata;
+
+	if (!ev->reading) return;
+
+	fr_event_fd_delete(ev->el, 0, ev->fd);
+	ev->reading = false;
+}
+
+static void _redis_async_add_write(void *privdata)
+{
+	redis_async_event_t *ev = privdata;
+
+	if (ev->write_ev) return;
+
+	redis_async_write_schedule(ev, NULL, 0);
+}
+
+static void _redis_async_del_write(void *privdata)
+{
+	redis_async_event_t *ev = privdata;
+
+	if (!ev->write_ev) return;
+
+	fr_event_delete(ev->el, &ev->write_ev);
+}
+
+static void _redis_async_cleanup(void *privdata)
+{
+	redis_async_event_t *ev = privdata;
+
+	_redis_async_del_read(ev);
+	_redis_async_del_write(ev);
+
+	ev->ac->ev.data = NULL;
+	talloc_free(ev);
+}
+
+/** Service a libhiredis async context from an event list
+ *
+ * Once attached, commands issued with the redisAsync* functions are written, and their
+ * callbacks called, from the event list.  The context must only be used by the thread
+ * servicing the event list.
+ *
+ * The binding is removed automatically when libhiredis frees the context.
+ *
+ * @param[in] el to service the context from.
+ * @param[in] ac to attach.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the context is already attached to an event list.
+ */
+int fr_redis_async_attach(fr_event_list_t *el, redisAsyncContext *ac)
+{
+	redis_async_event_t *ev;
+
+	if (ac->ev.data) {
+		fr_strerror_printf("Context already attached to an event list");
+		return -1;
+	}
+
+	ev = talloc_zero(NULL, redis_async_event_t);
+	if (!ev) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+	ev->el = el;
+	ev->ac = ac;
+	ev->fd = ac->c.fd;
+
+	ac->ev.addRead = _redis_async_add_read;
+	ac->ev.delRead = _redis_async_del_read;
+	ac->ev.addWrite = _redis_async_add_write;
+	ac->ev.delWrite = _redis_async_del_write;
+	ac->ev.cleanup = _redis_async_cleanup;
+	ac->ev.data = ev;
+
+	return 0;
+}
+
 /** Simplifies handling of pipelined commands with Redis cluster
  *
  * Retrieve all available pipelined responses, and write them to the array.
@@ -470,7 +1096,7 @@ fr_redis_rcode_t fr_redis_pipeline_result(fr_redis_rcode_t *rcode, redisReply *o
 #ifdef NDEBUG
 	if ((size_t) pipelined > out_len) {
 		for (i = 0; i < (size_t)pipelined; i++) {
-			if (redisGetReply(conn->handle, (void **)&reply) != REDIS_OK) break;
+			if (fr_redis_get_reply(conn, &reply) != REDIS_OK) break;
 			fr_redis_reply_free(reply);
 		}
 
@@ -488,7 +1114,7 @@ fr_redis_rcode_t fr_redis_pipeline_result(fr_redis_rcode_t *rcode, redisReply *o
 		 *	as it's also stored in the conn->handle.
 		 */
 		reply = NULL;	/* redisGetReply doesn't NULLify reply on error *sigh* */
-		if (redisGetReply(conn->handle, (void **)&reply) == REDIS_OK) maybe_more = true;
+		if (fr_redis_get_reply(conn, &reply) == REDIS_OK) maybe_more = true;
 		status = fr_redis_command_status(conn, reply);
 		*out_p++ = reply;
 
@@ -514,7 +1140,7 @@ fr_redis_rcode_t fr_redis_pipeline_result(fr_redis_rcode_t *rcode, redisReply *o
 			for (j = i + 1; j < (size_t)pipelined; j++) {
 				redisReply *to_clear;
 
-				if (redisGetReply(conn->handle, (void **)&to_clear) != REDIS_OK) break;
+				if (fr_redis_get_reply(conn, &to_clear) != REDIS_OK) break;
 				fr_redis_reply_free(to_clear);
 			}
 
@@ -555,7 +1181,7 @@ fr_redis_rcode_t fr_redis_get_version(char *out, size_t out_len, fr_redis_conn_t
 	rad_assert(out_len > 0);
 	out[0] = '\0';
 
-	reply = redisCommand(conn->handle, "INFO SERVER");
+	reply = fr_redis_command(conn, "INFO SERVER");
 	status = fr_redis_command_status(conn, reply);
 	if (status != REDIS_RCODE_SUCCESS) return status;
 
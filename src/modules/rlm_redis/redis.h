@@ -33,6 +33,7 @@ RCSIDH(redis_h, "$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <hiredis/hiredis.h>
+#include <hiredis/async.h>
 
 #define MAX_REDIS_COMMAND_LEN		4096
 #define MAX_REDIS_ARGS			16
@@ -75,10 +76,18 @@ typedef enum {
 	REDIS_RCODE_NO_SCRIPT = -6,		//!< Script doesn't exist.
 } fr_redis_rcode_t;
 
+typedef struct fr_redis_pipe fr_redis_pipe_t;
+
+typedef struct fr_redis_pipe_wait fr_redis_pipe_wait_t;
+
 /** Connection handle, holding a redis context
  */
 typedef struct redis_conn {
 	redisContext		*handle;	//!< Hiredis context used when issuing commands.
+
+	fr_redis_pipe_t		*pipe;		//!< Shared connection commands are written to.  If set,
+						//!< handle is unconnected and only buffers commands.
+	fr_redis_pipe_wait_t	*wait;		//!< Replies to the last set of commands written to the pipe.
 } fr_redis_conn_t;
 
 /** Configuration parameters for a redis connection
@@ -99,6 +108,9 @@ typedef struct redis_common_conf {
 	uint32_t		max_alt;	//!< Maximum alternative nodes to try.
 	struct timeval		retry_delay;	//!< How long to wait when we received a -TRYAGAIN
 						//!< message.
+
+	bool			pipeline;	//!< Write commands from concurrent requests to a single
+						//!< shared connection per node.
 } fr_redis_conf_t;
 
 #define REDIS_COMMON_CONFIG \
@@ -108,7 +120,8 @@ typedef struct redis_common_conf {
 	{ FR_CONF_OFFSET("password", PW_TYPE_STRING | PW_TYPE_SECRET, fr_redis_conf_t, password) }, \
 	{ FR_CONF_OFFSET("max_nodes", PW_TYPE_BYTE, fr_redis_conf_t, max_nodes), .dflt = "20" }, \
 	{ FR_CONF_OFFSET("max_alt", PW_TYPE_INTEGER, fr_redis_conf_t, max_alt), .dflt = "3" }, \
-	{ FR_CONF_OFFSET("max_redirects", PW_TYPE_INTEGER, fr_redis_conf_t, max_redirects), .dflt = "2" }
+	{ FR_CONF_OFFSET("max_redirects", PW_TYPE_INTEGER, fr_redis_conf_t, max_redirects), .dflt = "2" }, \
+	{ FR_CONF_OFFSET("pipeline", PW_TYPE_BOOLEAN, fr_redis_conf_t, pipeline), .dflt = "no" }
 
 void		fr_redis_version_print(void);
 
@@ -131,6 +144,32 @@ fr_redis_rcode_t	fr_redis_get_version(char *out, size_t out_len, fr_redis_conn_t
 
 uint32_t		fr_redis_version_num(char const *version);
 
+/*
+ *	Issue commands and retrieve replies.  These must be used instead of
+ *	the libhiredis equivalents, as conn may be a view of a shared connection.
+ */
+int			fr_redis_get_reply(fr_redis_conn_t *conn, redisReply **reply);
+
+redisReply		*fr_redis_command(fr_redis_conn_t *conn, char const *fmt, ...);
+
+redisReply		*fr_redis_command_argv(fr_redis_conn_t *conn, int argc, char const **argv,
+					       size_t const *argv_len);
+
+/*
+ *	Shared connections, which commands from concurrent requests are pipelined over.
+ */
+fr_redis_pipe_t		*fr_redis_pipe_alloc(TALLOC_CTX *ctx, fr_connection_create_t create, void *uctx,
+					     struct timeval const *timeout);
+
+fr_redis_conn_t		*fr_redis_pipe_conn(TALLOC_CTX *ctx, fr_redis_pipe_t *pipe);
+
+void			fr_redis_pipe_close(fr_redis_pipe_t *pipe);
+
+/*
+ *	Service a libhiredis async context from an event list.
+ */
+int			fr_redis_async_attach(fr_event_list_t *el, redisAsyncContext *ac);
+
 /*
  *	Process response from pipelined command.
  */
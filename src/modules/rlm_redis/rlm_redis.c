@@ -86,7 +86,7 @@ static int redis_command_read_only(fr_redis_rcode_t *status_out, redisReply **re
 	 *	Process the response for READONLY
 	 */
 	reply = NULL;	/* Doesn't set reply to NULL on error *sigh* */
-	if (redisGetReply(conn->handle, (void **)&reply) == REDIS_OK) maybe_more = true;
+	if (fr_redis_get_reply(conn, &reply) == REDIS_OK) maybe_more = true;
 	status = fr_redis_command_status(conn, reply);
 	if (status != REDIS_RCODE_SUCCESS) {
 		REDEBUG("Setting READONLY failed");
@@ -95,9 +95,9 @@ static int redis_command_read_only(fr_redis_rcode_t *status_out, redisReply **re
 		*status_out = status;
 
 		if (maybe_more) {
-			if (redisGetReply(conn->handle, (void **)&reply) != REDIS_OK) return -1;
+			if (fr_redis_get_reply(conn, &reply) != REDIS_OK) return -1;
 			fr_redis_reply_free(reply);
-			if (redisGetReply(conn->handle, (void **)&reply) != REDIS_OK) return -1;
+			if (fr_redis_get_reply(conn, &reply) != REDIS_OK) return -1;
 			fr_redis_reply_free(reply);
 		}
 		return -1;
@@ -109,14 +109,14 @@ static int redis_command_read_only(fr_redis_rcode_t *status_out, redisReply **re
 	 *	Process the response for the command
 	 */
 	reply = NULL;
-	if (redisGetReply(conn->handle, (void **)&reply) == REDIS_OK) maybe_more = true;
+	if (fr_redis_get_reply(conn, &reply) == REDIS_OK) maybe_more = true;
 	status = fr_redis_command_status(conn, reply);
 	if (status != REDIS_RCODE_SUCCESS) {
 		*reply_out = reply;
 		*status_out = status;
 
 		if (maybe_more) {
-			if (redisGetReply(conn->handle, (void **)&reply) != REDIS_OK) return -1;
+			if (fr_redis_get_reply(conn, &reply) != REDIS_OK) return -1;
 			fr_redis_reply_free(reply);
 		}
 		return -1;
@@ -130,7 +130,7 @@ static int redis_command_read_only(fr_redis_rcode_t *status_out, redisReply **re
 	 */
 	reply = NULL;
 	status = fr_redis_command_status(conn, reply);
-	if ((redisGetReply(conn->handle, (void **)&reply) != REDIS_OK) || (status != REDIS_RCODE_SUCCESS)) {
+	if ((fr_redis_get_reply(conn, &reply) != REDIS_OK) || (status != REDIS_RCODE_SUCCESS)) {
 		REDEBUG("Setting READWRITE failed");
 
 		fr_redis_reply_free(*reply_out);
@@ -223,7 +223,7 @@ static ssize_t redis_xlat(char **out, size_t outlen,
 		}
 
 		if (!read_only) {
-			reply = redisCommandArgv(conn->handle, argc, argv, NULL);
+			reply = fr_redis_command_argv(conn, argc, argv, NULL);
 			status = fr_redis_command_status(conn, reply);
 		} else if (redis_command_read_only(&status, &reply, request, conn, argc, argv) == -2) {
 			goto close_conn;
@@ -281,7 +281,7 @@ static ssize_t redis_xlat(char **out, size_t outlen,
 			REXDENT();
 		}
 		if (!read_only) {
-			reply = redisCommandArgv(conn->handle, argc, argv, NULL);
+			reply = fr_redis_command_argv(conn, argc, argv, NULL);
 			status = fr_redis_command_status(conn, reply);
 		} else if (redis_command_read_only(&status, &reply, request, conn, argc, argv) == -2) {
 			state.close_conn = true;
@@ -126,4 +126,45 @@ do { \
 	} \
 } while (0)
 
+/** Determine which shard of a pool an address or prefix belongs to
+ *
+ * Addresses are assigned to shards by hashing the address, so the module
+ * and the ippool tool agree on where a lease lives without a lookup.
+ *
+ * @param[in] ip to find shard for.
+ * @param[in] shards the pool is split into.
+ * @return shard index.
+ */
+static inline uint32_t ippool_shard_by_ip(fr_ipaddr_t const *ip, uint32_t shards)
+{
+	if (shards <= 1) return 0;
+
+	if (ip->af == AF_INET6) return fr_hash(&ip->ipaddr.ip6addr, sizeof(ip->ipaddr.ip6addr)) % shards;
+
+	return fr_hash(&ip->ipaddr.ip4addr, sizeof(ip->ipaddr.ip4addr)) % shards;
+}
+
+/** Append the shard suffix to a pool name, to give the name of the sub-pool <pool>/<shard>
+ *
+ * Each sub-pool has its own hash tag, so the sub-pools are distributed across
+ * the key slots (and nodes) of the cluster.
+ *
+ * @param[in,out] key Pool name to append the suffix to.
+ * @param[in] key_size Size of the key buffer.
+ * @param[in] key_len Length of the pool name.
+ * @param[in] shard to append.
+ * @return
+ *	- The length of the sub-pool name.
+ *	- -1 if the key buffer was too small.
+ */
+static inline ssize_t ippool_shard_name(uint8_t *key, size_t key_size, size_t key_len, uint32_t shard)
+{
+	size_t len;
+
+	len = snprintf((char *)key + key_len, key_size - key_len, "/%u", shard);
+	if (is_truncated(len, key_size - key_len)) return -1;
+
+	return key_len + len;
+}
+
 #endif /* _REDIS_IPPOOL_H */
@@ -35,6 +35,11 @@
  * - @verbatim {<pool name>:<pool type>}:device:<client id> @endverbatim (string) contains last
  *	IP address bound by this client.
  *
+ * If the pool is split into shards, each shard is a separate pool named
+ * @verbatim <pool name>/<shard> @endverbatim, with its own hash tag, so the shards are
+ * distributed across the nodes of the cluster.  Addresses are assigned to shards by
+ * hashing the address (see #ippool_shard_by_ip).
+ *
  * @copyright 2015 Arran Cudbard-Bell <a.cudbardb@freeradius.org>
  * @copyright 2015 The FreeRADIUS server project
  */
@@ -50,6 +55,40 @@ RCSID("$Id$")
 #include "cluster.h"
 #include "redis_ippool.h"
 
+/** A single lease allocation, which may be combined with others into one script call
+ *
+ */
+typedef struct ippool_alloc {
+	struct ippool_alloc	*next;		//!< Next allocation in the batch.
+
+	uint8_t const		*device_id;	//!< Device to allocate lease for.
+	size_t			device_id_len;	//!< Length of the device identifier.
+	uint8_t const		*gateway_id;	//!< Gateway the device is behind.
+	size_t			gateway_id_len;	//!< Length of the gateway identifier.
+	char			expires[11];	//!< How long the lease should be allocated for.
+
+	fr_redis_rcode_t	status;		//!< Status of the script call.
+	redisReply		*result;	//!< Result of this allocation, if status is
+						//!< REDIS_RCODE_SUCCESS.
+	bool			done;		//!< Whether the allocation has been attempted.
+} ippool_alloc_t;
+
+/** Allocations waiting for a pool
+ *
+ * While a script call is in progress for a pool, other allocations from that
+ * pool queue up, and are sent together in the next script call.
+ */
+typedef struct ippool_alloc_queue {
+	struct ippool_alloc_queue *next;	//!< Next queue.
+
+	uint8_t			key[IPPOOL_MAX_KEY_PREFIX_SIZE];	//!< Pool (or shard) name.
+	size_t			key_len;	//!< Length of the pool name.
+
+	bool			busy;		//!< A thread is allocating from this pool.
+	ippool_alloc_t		*head;		//!< Oldest waiting allocation.
+	ippool_alloc_t		*tail;		//!< Newest waiting allocation.
+} ippool_alloc_queue_t;
+
 /** rlm_redis module instance
  *
  */
@@ -90,7 +129,20 @@ typedef struct rlm_redis_ippool {
 	bool			copy_on_update; //!< Copy the address provided by ip_address to the
 						//!< reply_attr if updates are successful.
 
+	uint32_t		shards;		//!< Number of sub-pools each pool is split into.
+	vp_tmpl_t		*shard;		//!< Shard to try first when allocating.  If not set
+						//!< a hash of the device identifier is used.
+
+	uint32_t		alloc_batch;	//!< Maximum number of allocations from the same pool
+						//!< to combine into a single script call.
+
 	fr_redis_cluster_t	*cluster;	//!< Redis cluster.
+
+	ippool_alloc_queue_t	*alloc_queues;	//!< Allocations waiting for each pool.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;		//!< Protects the allocation queues.
+	pthread_cond_t		cond;		//!< Signalled when a batch of allocations completes.
+#endif
 } rlm_redis_ippool_t;
 
 static CONF_PARSER redis_config[] = {
@@ -118,6 +170,10 @@ static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("ipv4_integer", PW_TYPE_BOOLEAN, rlm_redis_ippool_t, ipv4_integer) },
 	{ FR_CONF_OFFSET("copy_on_update", PW_TYPE_BOOLEAN, rlm_redis_ippool_t, copy_on_update), .dflt = "yes", .quote = T_BARE_WORD },
 
+	{ FR_CONF_OFFSET("shards", PW_TYPE_INTEGER, rlm_redis_ippool_t, shards), .dflt = "1" },
+	{ FR_CONF_OFFSET("shard", PW_TYPE_TMPL, rlm_redis_ippool_t, shard) },
+	{ FR_CONF_OFFSET("alloc_batch", PW_TYPE_INTEGER, rlm_redis_ippool_t, alloc_batch), .dflt = "1" },
+
 	/*
 	 *	Split out to allow conversion to universal ippool module with
 	 *	minimum of config changes.
@@ -136,20 +192,25 @@ static CONF_PARSER module_config[] = {
  * - ARGV[3] Device identifier (administratively configured).
  * - ARGV[4] (optional) Gateway identifier.
  *
- * Returns @verbatim { <rcode>[, <ip>][, <range>][, <lease time>][, <counter>] } @endverbatim
+ * ARGV[2] - ARGV[4] may be repeated to allocate leases for multiple devices
+ * in a single call.
+ *
+ * Returns @verbatim { { <rcode>[, <ip>][, <range>][, <lease time>][, <counter>] }, ... } @endverbatim
+ * with one result for each device.
  * - IPPOOL_RCODE_SUCCESS lease updated..
  * - IPPOOL_RCODE_NOT_FOUND lease not found in pool.
  */
 static char lua_alloc_cmd[] =
-	"local ip" EOL											/* 1 */
-	"local exists" EOL										/* 2 */
+	"local function alloc(expires, device, gateway)" EOL						/* 1 */
+	"  local ip" EOL										/* 2 */
+	"  local exists" EOL										/* 3 */
 
-	"local pool_key" EOL										/* 3 */
-	"local address_key" EOL										/* 4 */
-	"local device_key" EOL										/* 5 */
+	"  local pool_key" EOL										/* 4 */
+	"  local address_key" EOL									/* 5 */
+	"  local device_key" EOL									/* 6 */
 
-	"pool_key = '{' .. KEYS[1] .. '}:"IPPOOL_POOL_KEY"'" EOL					/* 6 */
-	"device_key = '{' .. KEYS[1] .. '}:"IPPOOL_DEVICE_KEY":' .. ARGV[3]" EOL			/* 7 */
+	"  pool_key = '{' .. KEYS[1] .. '}:"IPPOOL_POOL_KEY"'" EOL					/* 7 */
+	"  device_key = '{' .. KEYS[1] .. '}:"IPPOOL_DEVICE_KEY":' .. device" EOL			/* 8 */
 
 	/*
 	 *	Check to see if the client already has a lease,
@@ -158,43 +219,53 @@ static char lua_alloc_cmd[] =
 	 *	The additional sanity checks are to allow for the record
 	 *	of device/ip binding to persist for longer than the lease.
 	 */
-	"exists = redis.call('GET', device_key);" EOL							/* 8 */
-	"if exists then" EOL										/* 9 */
-	"  local expires_in = tonumber(redis.call('ZSCORE', pool_key, exists) - ARGV[1])" EOL		/* 10 */
-	"  if expires_in > 0 then" EOL									/* 11 */
-	"    ip = redis.call('HMGET', '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":' .. exists, 'device', 'range', 'counter')" EOL	/* 12 */
-	"    if ip and (ip[1] == ARGV[3]) then" EOL							/* 13 */
-	"      return {" STRINGIFY(_IPPOOL_RCODE_SUCCESS) ", exists, ip[2], expires_in, ip[3] }" EOL	/* 14 */
-	"    end" EOL											/* 15 */
-	"  end" EOL											/* 16 */
-	"end" EOL											/* 17 */
+	"  exists = redis.call('GET', device_key);" EOL							/* 9 */
+	"  if exists then" EOL										/* 10 */
+	"    local expires_in = tonumber(redis.call('ZSCORE', pool_key, exists) - ARGV[1])" EOL		/* 11 */
+	"    if expires_in > 0 then" EOL								/* 12 */
+	"      ip = redis.call('HMGET', '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":' .. exists, 'device', 'range', 'counter')" EOL	/* 13 */
+	"      if ip and (ip[1] == device) then" EOL							/* 14 */
+	"        return {" STRINGIFY(_IPPOOL_RCODE_SUCCESS) ", exists, ip[2], expires_in, ip[3] }" EOL	/* 15 */
+	"      end" EOL											/* 16 */
+	"    end" EOL											/* 17 */
+	"  end" EOL											/* 18 */
 
 	/*
 	 *	Else, get the IP address which expired the longest time ago.
 	 */
-	"ip = redis.call('ZREVRANGE', pool_key, -1, -1, 'WITHSCORES')" EOL				/* 18 */
-	"if not ip or not ip[1] then" EOL								/* 19 */
-	"  return {" STRINGIFY(_IPPOOL_RCODE_POOL_EMPTY) "}" EOL					/* 20 */
-	"end" EOL											/* 21 */
-	"if ip[2] >= ARGV[1] then" EOL									/* 22 */
-	"  return {" STRINGIFY(_IPPOOL_RCODE_POOL_EMPTY) "}" EOL					/* 23 */
-	"end" EOL											/* 24 */
-	"redis.call('ZADD', pool_key, ARGV[1] + ARGV[2], ip[1])" EOL					/* 25 */
+	"  ip = redis.call('ZREVRANGE', pool_key, -1, -1, 'WITHSCORES')" EOL				/* 19 */
+	"  if not ip or not ip[1] then" EOL								/* 20 */
+	"    return {" STRINGIFY(_IPPOOL_RCODE_POOL_EMPTY) "}" EOL					/* 21 */
+	"  end" EOL											/* 22 */
+	"  if ip[2] >= ARGV[1] then" EOL								/* 23 */
+	"    return {" STRINGIFY(_IPPOOL_RCODE_POOL_EMPTY) "}" EOL					/* 24 */
+	"  end" EOL											/* 25 */
+	"  redis.call('ZADD', pool_key, ARGV[1] + expires, ip[1])" EOL					/* 26 */
 
 	/*
 	 *	Set the device/gateway keys
 	 */
-	"address_key = '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":' .. ip[1]" EOL			/* 26 */
-	"redis.call('HMSET', address_key, 'device', ARGV[3], 'gateway', ARGV[4])" EOL			/* 27 */
-	"redis.call('SET', device_key, ip[1])" EOL							/* 28 */
-	"redis.call('EXPIRE', device_key, ARGV[2])" EOL							/* 29 */
-	"return { " EOL											/* 30 */
-	"  " STRINGIFY(_IPPOOL_RCODE_SUCCESS) "," EOL							/* 31 */
-	"  ip[1], " EOL											/* 32 */
-	"  redis.call('HGET', address_key, 'range'), " EOL						/* 33 */
-	"  tonumber(ARGV[2]), " EOL									/* 34 */
-	"  redis.call('HINCRBY', address_key, 'counter', 1)" EOL					/* 35 */
-	"}" EOL;											/* 36 */
+	"  address_key = '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":' .. ip[1]" EOL			/* 27 */
+	"  redis.call('HMSET', address_key, 'device', device, 'gateway', gateway)" EOL			/* 28 */
+	"  redis.call('SET', device_key, ip[1])" EOL							/* 29 */
+	"  redis.call('EXPIRE', device_key, expires)" EOL						/* 30 */
+	"  return { " EOL										/* 31 */
+	"    " STRINGIFY(_IPPOOL_RCODE_SUCCESS) "," EOL							/* 32 */
+	"    ip[1], " EOL										/* 33 */
+	"    redis.call('HGET', address_key, 'range'), " EOL						/* 34 */
+	"    tonumber(expires), " EOL									/* 35 */
+	"    redis.call('HINCRBY', address_key, 'counter', 1)" EOL					/* 36 */
+	"  }" EOL											/* 37 */
+	"end" EOL											/* 38 */
+
+	/*
+	 *	Allocate a lease for each device in turn
+	 */
+	"local ret = {}" EOL										/* 39 */
+	"for i = 2, #ARGV, 3 do" EOL									/* 40 */
+	"  ret[#ret + 1] = alloc(ARGV[i], ARGV[i + 1], ARGV[i + 2])" EOL				/* 41 */
+	"end" EOL											/* 42 */
+	"return ret" EOL;										/* 43 */
 static char lua_alloc_digest[(SHA1_DIGEST_LENGTH * 2) + 1];
 
 /** Lua script for updating leases
@@ -441,15 +512,15 @@ static void ippool_action_print(REQUEST *request, ippool_action_t action,
  * @param[in] wait_timeout How long to wait for slaves.
  * @param[in] digest of script.
  * @param[in] script to upload.
- * @param[in] cmd EVALSHA command to execute.
- * @param[in] ... Arguments for the eval command.
+ * @param[in] cmd EVALSHA command to execute, formatted by libhiredis.
+ * @param[in] cmd_len Length of the command.
  * @return status of the command.
  */
-static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_redis_cluster_t *cluster,
-				      uint8_t const *key, size_t key_len,
-				      uint32_t wait_num, uint32_t wait_timeout,
-				      char const digest[], char const *script,
-				      char const *cmd, ...)
+static fr_redis_rcode_t ippool_script_formatted(redisReply **out, REQUEST *request, fr_redis_cluster_t *cluster,
+						uint8_t const *key, size_t key_len,
+						uint32_t wait_num, uint32_t wait_timeout,
+						char const digest[], char const *script,
+						char const *cmd, size_t cmd_len)
 {
 	fr_redis_conn_t			*conn;
 	redisReply			*replies[5];	/* Must be equal to the maximum number of pipelined commands */
@@ -459,21 +530,13 @@ static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_red
 	fr_redis_rcode_t		s_ret, status;
 	int				pipelined = 0;
 
-	va_list				ap;
-
 	*out = NULL;
 
-	va_start(ap, cmd);
-
 	for (s_ret = fr_redis_cluster_state_init(&state, &conn, cluster, request, key, key_len, false);
 	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
 	     s_ret = fr_redis_cluster_state_next(&state, &conn, cluster, request, status, &replies[0])) {
-	     	va_list	copy;
-
 	     	RDEBUG3("Calling script 0x%s", digest);
-	     	va_copy(copy, ap);	/* copy or segv */
-		redisvAppendCommand(conn->handle, cmd, copy);
-		va_end(copy);
+		redisAppendFormattedCommand(conn->handle, cmd, cmd_len);
 		pipelined = 1;
 		if (wait_num) {
 			redisAppendCommand(conn->handle, "WAIT %i %i", wait_num, wait_timeout);
@@ -491,9 +554,7 @@ static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_red
 	     	RDEBUG3("Loading script 0x%s", digest);
 		redisAppendCommand(conn->handle, "MULTI");
 		redisAppendCommand(conn->handle, "SCRIPT LOAD %s", script);
-	     	va_copy(copy, ap);	/* copy or segv */
-		redisvAppendCommand(conn->handle, cmd, copy);
-		va_end(copy);
+		redisAppendFormattedCommand(conn->handle, cmd, cmd_len);
 		redisAppendCommand(conn->handle, "EXEC");
 		pipelined = 4;
 		if (wait_num) {
@@ -564,10 +625,231 @@ static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_red
 	}
 
 finish:
-	va_end(ap);
 	return s_ret;
 }
 
+/** Execute a script against Redis cluster
+ *
+ * Formats the command, then calls #ippool_script_formatted.
+ *
+ * @param[in] cmd EVALSHA command format string.
+ * @param[in] ... Arguments for the eval command.
+ */
+static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_redis_cluster_t *cluster,
+				      uint8_t const *key, size_t key_len,
+				      uint32_t wait_num, uint32_t wait_timeout,
+				      char const digest[], char const *script,
+				      char const *cmd, ...)
+{
+	fr_redis_rcode_t	ret;
+	va_list			ap;
+	char			*formatted = NULL;
+	int			len;
+
+	*out = NULL;
+
+	va_start(ap, cmd);
+	len = redisvFormatCommand(&formatted, cmd, ap);
+	va_end(ap);
+	if (len < 0) {
+		REDEBUG("Failed formatting script command");
+		return REDIS_RCODE_ERROR;
+	}
+
+	ret = ippool_script_formatted(out, request, cluster, key, key_len, wait_num, wait_timeout,
+				      digest, script, formatted, (size_t)len);
+	free(formatted);
+
+	return ret;
+}
+
+/** Execute a script against Redis cluster, with the arguments provided as a vector
+ *
+ * Formats the command, then calls #ippool_script_formatted.
+ *
+ * @param[in] argc Number of arguments.
+ * @param[in] argv EVALSHA command and its arguments.
+ * @param[in] argv_len Length of each argument.
+ */
+static fr_redis_rcode_t ippool_script_argv(redisReply **out, REQUEST *request, fr_redis_cluster_t *cluster,
+					   uint8_t const *key, size_t key_len,
+					   uint32_t wait_num, uint32_t wait_timeout,
+					   char const digest[], char const *script,
+					   int argc, char const **argv, size_t const *argv_len)
+{
+	fr_redis_rcode_t	ret;
+	char			*formatted = NULL;
+	int			len;
+
+	*out = NULL;
+
+	len = redisFormatCommandArgv(&formatted, argc, argv, argv_len);
+	if (len < 0) {
+		REDEBUG("Failed formatting script command");
+		return REDIS_RCODE_ERROR;
+	}
+
+	ret = ippool_script_formatted(out, request, cluster, key, key_len, wait_num, wait_timeout,
+				      digest, script, formatted, (size_t)len);
+	free(formatted);
+
+	return ret;
+}
+
+/** Run the allocation script for a batch of allocations
+ *
+ * @param[in] inst This instance of the rlm_redis_ippool module.
+ * @param[in] request The current request.
+ * @param[in] key_prefix Pool (or shard) to allocate from.
+ * @param[in] key_prefix_len Length of key_prefix.
+ * @param[in] head First allocation in the batch.
+ * @param[in] count Number of allocations in the batch.
+ */
+static void ippool_alloc_script(rlm_redis_ippool_t *inst, REQUEST *request,
+				uint8_t const *key_prefix, size_t key_prefix_len,
+				ippool_alloc_t *head, size_t count)
+{
+	struct timeval		now;
+	char			now_buff[11];
+	char const		**argv;
+	size_t			*argv_len;
+	int			argc = 0;
+	ippool_alloc_t		*alloc;
+	redisReply		*reply = NULL;
+	fr_redis_rcode_t	status;
+	size_t			i;
+
+	gettimeofday(&now, NULL);
+	snprintf(now_buff, sizeof(now_buff), "%u", (unsigned int)now.tv_sec);
+
+	argv = talloc_array(request, char const *, 5 + (count * 3));
+	argv_len = talloc_array(argv, size_t, 5 + (count * 3));
+
+#define ARGV_ADD(_arg, _arg_len) \
+do { \
+	argv[argc] = (char const *)(_arg); \
+	argv_len[argc++] = (_arg_len); \
+} while (0)
+
+	ARGV_ADD("EVALSHA", sizeof("EVALSHA") - 1);
+	ARGV_ADD(lua_alloc_digest, sizeof(lua_alloc_digest) - 1);
+	ARGV_ADD("1", 1);
+	ARGV_ADD(key_prefix, key_prefix_len);
+	ARGV_ADD(now_buff, strlen(now_buff));
+	for (alloc = head, i = 0; i < count; alloc = alloc->next, i++) {
+		ARGV_ADD(alloc->expires, strlen(alloc->expires));
+		ARGV_ADD(alloc->device_id, alloc->device_id_len);
+		ARGV_ADD(alloc->gateway_id, alloc->gateway_id_len);
+	}
+#undef ARGV_ADD
+
+	if (count > 1) RDEBUG2("Allocating %zu leases in a single call", count);
+
+	status = ippool_script_argv(&reply, request, inst->cluster,
+				    key_prefix, key_prefix_len,
+				    inst->wait_num, FR_TIMEVAL_TO_MS(&inst->wait_timeout),
+				    lua_alloc_digest, lua_alloc_cmd,
+				    argc, argv, argv_len);
+	talloc_free(argv);
+
+	if (status == REDIS_RCODE_SUCCESS) {
+		rad_assert(reply);
+		if (reply->type != REDIS_REPLY_ARRAY) {
+			REDEBUG("Expected result to be array got \"%s\"",
+				fr_int2str(redis_reply_types, reply->type, "<UNKNOWN>"));
+			status = REDIS_RCODE_ERROR;
+		} else if (reply->elements != count) {
+			REDEBUG("Expected %zu results, got %zu", count, reply->elements);
+			status = REDIS_RCODE_ERROR;
+		}
+	}
+
+	for (alloc = head, i = 0; i < count; alloc = alloc->next, i++) {
+		alloc->status = status;
+		if (status == REDIS_RCODE_SUCCESS) {
+			alloc->result = reply->element[i];
+			reply->element[i] = NULL;	/* Prevent double free */
+		}
+	}
+	fr_redis_reply_free(reply);	/* This works because hiredis checks for NULL elements */
+}
+
+/** Allocate a lease, combining the allocation with others from the same pool
+ *
+ * While a script call is in progress for a pool, allocations from other threads
+ * queue up.  When the call completes, one of the waiting threads sends up to
+ * alloc_batch of the queued allocations in the next call.
+ *
+ * @param[in] inst This instance of the rlm_redis_ippool module.
+ * @param[in] request The current request.
+ * @param[in] key_prefix Pool (or shard) to allocate from.
+ * @param[in] key_prefix_len Length of key_prefix.
+ * @param[in] alloc to perform.
+ */
+static void ippool_alloc_batched(rlm_redis_ippool_t *inst, REQUEST *request,
+				 uint8_t const *key_prefix, size_t key_prefix_len, ippool_alloc_t *alloc)
+{
+#ifdef HAVE_PTHREAD_H
+	ippool_alloc_queue_t	*queue;
+
+	pthread_mutex_lock(&inst->mutex);
+	for (queue = inst->alloc_queues; queue; queue = queue->next) {
+		if ((queue->key_len == key_prefix_len) && (memcmp(queue->key, key_prefix, key_prefix_len) == 0)) break;
+	}
+	if (!queue) {
+		queue = talloc_zero(inst, ippool_alloc_queue_t);
+		if (!queue) {
+			pthread_mutex_unlock(&inst->mutex);
+			ippool_alloc_script(inst, request, key_prefix, key_prefix_len, alloc, 1);
+			return;
+		}
+		memcpy(queue->key, key_prefix, key_prefix_len);
+		queue->key_len = key_prefix_len;
+		queue->next = inst->alloc_queues;
+		inst->alloc_queues = queue;
+	}
+
+	if (queue->tail) {
+		queue->tail->next = alloc;
+	} else {
+		queue->head = alloc;
+	}
+	queue->tail = alloc;
+
+	while (!alloc->done) {
+		ippool_alloc_t	*head, *p;
+		size_t		count;
+
+		if (queue->busy) {
+			pthread_cond_wait(&inst->cond, &inst->mutex);
+			continue;
+		}
+
+		/*
+		 *	Take as many allocations as we're allowed
+		 *	off the queue, and send them ourselves.
+		 */
+		head = queue->head;
+		for (p = head, count = 1; p->next && (count < inst->alloc_batch); p = p->next, count++);
+		queue->head = p->next;
+		if (!queue->head) queue->tail = NULL;
+		p->next = NULL;
+		queue->busy = true;
+		pthread_mutex_unlock(&inst->mutex);
+
+		ippool_alloc_script(inst, request, key_prefix, key_prefix_len, head, count);
+
+		pthread_mutex_lock(&inst->mutex);
+		for (p = head; p; p = p->next) p->done = true;
+		queue->busy = false;
+		pthread_cond_broadcast(&inst->cond);
+	}
+	pthread_mutex_unlock(&inst->mutex);
+#else
+	ippool_alloc_script(inst, request, key_prefix, key_prefix_len, alloc, 1);
+#endif
+}
+
 /** Allocate a new IP address from a pool
  *
  */
@@ -577,37 +859,36 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t *inst, REQUEST *r
 					    uint8_t const *gateway_id, size_t gateway_id_len,
 					    uint32_t expires)
 {
-	struct			timeval now;
 	redisReply		*reply = NULL;
-
-	fr_redis_rcode_t	status;
+	ippool_alloc_t		alloc;
 	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
 
 	rad_assert(key_prefix);
 	rad_assert(device_id);
 
-	gettimeofday(&now, NULL);
-
 	/*
 	 *	hiredis doesn't deal well with NULL string pointers
 	 */
 	if (!gateway_id) gateway_id = (uint8_t const *)"";
 
-	status = ippool_script(&reply, request, inst->cluster,
-			       key_prefix, key_prefix_len,
-			       inst->wait_num, FR_TIMEVAL_TO_MS(&inst->wait_timeout),
-			       lua_alloc_digest, lua_alloc_cmd,
-	 		       "EVALSHA %s 1 %b %u %u %b %b",
-	 		       lua_alloc_digest,
-			       key_prefix, key_prefix_len,
-			       (unsigned int)now.tv_sec, expires,
-			       device_id, device_id_len,
-			       gateway_id, gateway_id_len);
-	if (status != REDIS_RCODE_SUCCESS) {
+	memset(&alloc, 0, sizeof(alloc));
+	alloc.device_id = device_id;
+	alloc.device_id_len = device_id_len;
+	alloc.gateway_id = gateway_id;
+	alloc.gateway_id_len = gateway_id_len;
+	snprintf(alloc.expires, sizeof(alloc.expires), "%u", expires);
+
+	if (inst->alloc_batch > 1) {
+		ippool_alloc_batched(inst, request, key_prefix, key_prefix_len, &alloc);
+	} else {
+		ippool_alloc_script(inst, request, key_prefix, key_prefix_len, &alloc, 1);
+	}
+	if (alloc.status != REDIS_RCODE_SUCCESS) {
 		ret = IPPOOL_RCODE_FAIL;
 		goto finish;
 	}
 
+	reply = alloc.result;
 	rad_assert(reply);
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Expected result to be array got \"%s\"",
@@ -1006,6 +1287,69 @@ finish:
 	return ret;
 }
 
+/** Allocate a new IP address, trying each shard of the pool in turn
+ *
+ * The preferred shard is tried first, and if it has no free addresses the
+ * remaining shards are tried in order.  The order is always the same for a
+ * given device, so a device which was allocated a lease from a later shard
+ * finds that lease again while its preferred shard remains empty.
+ *
+ */
+static ippool_rcode_t ippool_allocate(rlm_redis_ippool_t *inst, REQUEST *request,
+				      uint8_t const *key_prefix, size_t key_prefix_len,
+				      uint8_t const *device_id, size_t device_id_len,
+				      uint8_t const *gateway_id, size_t gateway_id_len,
+				      uint32_t expires)
+{
+	uint8_t		shard_key[IPPOOL_MAX_KEY_PREFIX_SIZE];
+	ssize_t		slen;
+	uint32_t	preferred, shard, i;
+	ippool_rcode_t	ret = IPPOOL_RCODE_POOL_EMPTY;
+
+	if (inst->shards <= 1) {
+		return redis_ippool_allocate(inst, request, key_prefix, key_prefix_len,
+					     device_id, device_id_len, gateway_id, gateway_id_len, expires);
+	}
+
+	if (inst->shard) {
+		char		buff[20];
+		char const	*shard_str;
+		char		*q;
+
+		if (tmpl_expand(&shard_str, buff, sizeof(buff), request, inst->shard, NULL, NULL) < 0) {
+			REDEBUG("Failed expanding shard (%s)", inst->shard->name);
+			return IPPOOL_RCODE_FAIL;
+		}
+
+		preferred = strtoul(shard_str, &q, 10);
+		if (q != (shard_str + strlen(shard_str))) {
+			REDEBUG("Invalid shard.  Must be an integer value");
+			return IPPOOL_RCODE_FAIL;
+		}
+		preferred %= inst->shards;
+	} else {
+		preferred = fr_hash(device_id, device_id_len) % inst->shards;
+	}
+
+	memcpy(shard_key, key_prefix, key_prefix_len);
+	for (i = 0; i < inst->shards; i++) {
+		shard = (preferred + i) % inst->shards;
+
+		slen = ippool_shard_name(shard_key, sizeof(shard_key), key_prefix_len, shard);
+		if (slen < 0) {
+			REDEBUG("Pool name too long to add shard suffix");
+			return IPPOOL_RCODE_FAIL;
+		}
+
+		RDEBUG2("Allocating from shard %u", shard);
+		ret = redis_ippool_allocate(inst, request, shard_key, (size_t)slen,
+					    device_id, device_id_len, gateway_id, gateway_id_len, expires);
+		if (ret != IPPOOL_RCODE_POOL_EMPTY) return ret;
+	}
+
+	return ret;
+}
+
 static rlm_rcode_t mod_action(rlm_redis_ippool_t *inst, REQUEST *request, ippool_action_t action)
 {
 	uint8_t		key_prefix[IPPOOL_MAX_KEY_PREFIX_SIZE], device_id_buff[256], gateway_id_buff[256];
@@ -1061,9 +1405,9 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t *inst, REQUEST *request, ippool
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len, NULL,
 				    device_id, device_id_len, gateway_id, gateway_id_len, expires);
-		switch (redis_ippool_allocate(inst, request, key_prefix, key_prefix_len,
-					      device_id, device_id_len,
-					      gateway_id, gateway_id_len, (uint32_t)expires)) {
+		switch (ippool_allocate(inst, request, key_prefix, key_prefix_len,
+					device_id, device_id_len,
+					gateway_id, gateway_id_len, (uint32_t)expires)) {
 		case IPPOOL_RCODE_SUCCESS:
 			RDEBUG2("IP address lease allocated");
 			return RLM_MODULE_UPDATED;
@@ -1103,6 +1447,19 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t *inst, REQUEST *request, ippool
 			return RLM_MODULE_FAIL;
 		}
 
+		/*
+		 *	Leases are always in the shard the address hashes to
+		 */
+		if (inst->shards > 1) {
+			slen = ippool_shard_name(key_prefix, sizeof(key_prefix), key_prefix_len,
+						 ippool_shard_by_ip(&ip, inst->shards));
+			if (slen < 0) {
+				REDEBUG("Pool name too long to add shard suffix");
+				return RLM_MODULE_FAIL;
+			}
+			key_prefix_len = (size_t)slen;
+		}
+
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
 				    ip_str, device_id, device_id_len, gateway_id, gateway_id_len, expires);
 		switch (redis_ippool_update(inst, request, key_prefix, key_prefix_len,
@@ -1171,6 +1528,19 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t *inst, REQUEST *request, ippool
 			return RLM_MODULE_FAIL;
 		}
 
+		/*
+		 *	Leases are always in the shard the address hashes to
+		 */
+		if (inst->shards > 1) {
+			slen = ippool_shard_name(key_prefix, sizeof(key_prefix), key_prefix_len,
+						 ippool_shard_by_ip(&ip, inst->shards));
+			if (slen < 0) {
+				REDEBUG("Pool name too long to add shard suffix");
+				return RLM_MODULE_FAIL;
+			}
+			key_prefix_len = (size_t)slen;
+		}
+
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
 				    ip_str, device_id, device_id_len, gateway_id, gateway_id_len, 0);
 		switch (redis_ippool_release(inst, request, key_prefix, key_prefix_len,
@@ -1327,6 +1697,28 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	 */
 	if (!inst->offer_time) inst->offer_time = inst->lease_time;
 
+	if (inst->shards == 0) {
+		cf_log_err_cs(conf, "shards must be >= 1");
+		return -1;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&inst->mutex, NULL);
+	pthread_cond_init(&inst->cond, NULL);
+#endif
+
+	return 0;
+}
+
+static int mod_detach(UNUSED void *instance)
+{
+#ifdef HAVE_PTHREAD_H
+	rlm_redis_ippool_t *inst = instance;
+
+	pthread_mutex_destroy(&inst->mutex);
+	pthread_cond_destroy(&inst->cond);
+#endif
+
 	return 0;
 }
 
@@ -1339,6 +1731,7 @@ module_t rlm_redis_ippool = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting,
 		[MOD_AUTHORIZE]		= mod_authorize,
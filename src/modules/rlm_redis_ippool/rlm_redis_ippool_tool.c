@@ -75,6 +75,9 @@ typedef struct ippool_tool_operation {
 	uint8_t			prefix;		//!< Prefix - The bits between the address mask, and the prefix
 						//!< form the addresses to be modified in the pool.
 	ippool_tool_action_t	action;		//!< What to do to the leases described by net/prefix.
+
+	uint32_t		shard;		//!< Only operate on addresses belonging to this shard.
+	uint32_t		shards;		//!< Number of shards the pool is split into.
 } ippool_tool_operation_t;
 
 typedef struct ippool_tool_lease {
@@ -207,6 +210,7 @@ static void NEVER_RETURNS usage(int ret) {
 	INFO("  -r <addr>              Release addresses/prefixes in this range");
 	INFO("  -s <addr>              Show addresses/prefix in this range");
 	INFO("  -p <prefix_len>        Length of prefix to allocate (defaults to 32/128)");
+	INFO("  -n <shards>            Number of shards the pool is split into (defaults to 1)");
 //	INFO("  -i <file>              Import entries from ISC lease file [NYI]");
 	INFO(" ");	/* -Werror=format-zero-length */
 //	INFO("Pool status:");
@@ -435,6 +439,23 @@ static bool ipaddr_next(fr_ipaddr_t *ipaddr, fr_ipaddr_t const *end, uint8_t pre
 	}
 }
 
+/** Advance to the next address/prefix belonging to the operation's shard
+ *
+ * @param[in,out] ipaddr to increment.
+ * @param[in] op being performed.
+ * @return
+ *	- true if there's another address/prefix in the shard (continue).
+ *	- false if there are no more addresses/prefixes in the shard (stop).
+ */
+static bool ipaddr_next_in_shard(fr_ipaddr_t *ipaddr, ippool_tool_operation_t const *op)
+{
+	do {
+		if (!ipaddr_next(ipaddr, &op->end, op->prefix)) return false;
+	} while (ippool_shard_by_ip(ipaddr, op->shards) != op->shard);
+
+	return true;
+}
+
 /** Add a net to the pool
  *
  * @return the number of new addresses added.
@@ -456,6 +477,11 @@ static int driver_do_lease(void *out, void *instance, ippool_tool_operation_t co
 	REQUEST				*request = request_alloc(inst);
 	redisReply			**replies = NULL;
 
+	/*
+	 *	Skip to the first address in our shard
+	 */
+	if (ippool_shard_by_ip(&ipaddr, op->shards) != op->shard) more = ipaddr_next_in_shard(&ipaddr, op);
+
 	while (more) {
 		size_t	reply_cnt = 0;
 
@@ -474,8 +500,7 @@ static int driver_do_lease(void *out, void *instance, ippool_tool_operation_t co
 			 */
 			if (s_ret == REDIS_RCODE_TRY_AGAIN) ipaddr = acked;
 
-			for (i = 0; (i < MAX_PIPELINED) && more; i++, more = ipaddr_next(&ipaddr, &op->end,
-											 op->prefix)) {
+			for (i = 0; (i < MAX_PIPELINED) && more; i++, more = ipaddr_next_in_shard(&ipaddr, op)) {
 				int enqueued;
 
 				enqueued = enqueue(inst, conn, op->pool, op->pool_len,
@@ -506,7 +531,7 @@ static int driver_do_lease(void *out, void *instance, ippool_tool_operation_t co
 
 				ret = process(out, &to_process, replies[i]);
 				if (ret < 0) continue;
-				ipaddr_next(&to_process, &op->end, op->prefix);
+				ipaddr_next_in_shard(&to_process, op);
 			}
 		}
 		fr_redis_pipeline_free(replies, reply_cnt);
@@ -951,6 +976,7 @@ int main(int argc, char *argv[])
 	int				opt;
 
 	char const			*pool_arg, *range_arg = NULL;
+	uint32_t			shards = 1, shard;
 	bool				do_export = false, print_stats = false;
 	char				*do_import = NULL;
 
@@ -978,7 +1004,7 @@ do { \
 	p++; \
 } while (0);
 
-	while ((opt = getopt(argc, argv, "a:d:r:s:p:ihxo:f:")) != EOF)
+	while ((opt = getopt(argc, argv, "a:d:r:s:p:n:ihxo:f:")) != EOF)
 	switch (opt) {
 	case 'a':
 		ADD_ACTION(IPPOOL_TOOL_ADD);
@@ -1016,6 +1042,20 @@ do { \
 	}
 		break;
 
+	case 'n':
+	{
+		unsigned long tmp;
+		char *q;
+
+		tmp = strtoul(optarg, &q, 10);
+		if ((q != (optarg + strlen(optarg))) || (tmp == 0) || (tmp > UINT32_MAX)) {
+			ERROR("Shards must be an integer value > 0");
+			usage(64);
+		}
+		shards = (uint32_t)tmp;
+	}
+		break;
+
 	case 'i':
 		do_import = optarg;
 		break;
@@ -1117,12 +1157,37 @@ do { \
 		}
 	}
 
-	for (p = ops; (p < end) && (p->start.af != AF_UNSPEC); p++) switch (p->action) {
+	for (p = ops; (p < end) && (p->start.af != AF_UNSPEC); p++) for (shard = 0; shard < shards; shard++) {
+	ippool_tool_operation_t	op = *p;
+	uint8_t			shard_pool[IPPOOL_MAX_KEY_PREFIX_SIZE];
+
+	/*
+	 *	Each shard is a separate pool, containing
+	 *	only the addresses which hash to it.
+	 */
+	if (shards > 1) {
+		ssize_t slen = -1;
+
+		if (op.pool_len < sizeof(shard_pool)) {
+			memcpy(shard_pool, op.pool, op.pool_len);
+			slen = ippool_shard_name(shard_pool, sizeof(shard_pool), op.pool_len, shard);
+		}
+		if (slen < 0) {
+			ERROR("Pool name too long to add shard suffix");
+			exit(1);
+		}
+		op.pool = shard_pool;
+		op.pool_len = (size_t)slen;
+		op.shard = shard;
+		op.shards = shards;
+	}
+
+	switch (op.action) {
 	case IPPOOL_TOOL_ADD:
 	{
 		uint64_t count = 0;
 
-		if (driver_add_lease(&count, conf->driver, p) < 0) {
+		if (driver_add_lease(&count, conf->driver, &op) < 0) {
 			exit(1);
 		}
 		INFO("Added %" PRIu64 " addresses/prefixes", count);
@@ -1133,7 +1198,7 @@ do { \
 	{
 		uint64_t count = 0;
 
-		if (driver_remove_lease(&count, conf->driver, p) < 0) {
+		if (driver_remove_lease(&count, conf->driver, &op) < 0) {
 			exit(1);
 		}
 		INFO("Removed %" PRIu64 " addresses/prefixes", count);
@@ -1144,7 +1209,7 @@ do { \
 	{
 		uint64_t count = 0;
 
-		if (driver_release_lease(&count, conf->driver, p) < 0) {
+		if (driver_release_lease(&count, conf->driver, &op) < 0) {
 			exit(1);
 		}
 		INFO("Released %" PRIu64 " addresses/prefixes", count);
@@ -1156,7 +1221,7 @@ do { \
 		ippool_tool_lease_t **leases = NULL;
 		size_t len, i;
 
-		if (driver_show_lease(&leases, conf->driver, p) < 0) {
+		if (driver_show_lease(&leases, conf->driver, &op) < 0) {
 			exit(1);
 		}
 
@@ -1221,6 +1286,7 @@ do { \
 	case IPPOOL_TOOL_NOOP:
 		break;
 	}
+	}
 
 	if (do_import) {
 		ERROR("NOT YET IMPLEMENTED");
@@ -0,0 +1,2 @@
+TARGET		:= rlm_regex.a
+SOURCES		:= rlm_regex.c
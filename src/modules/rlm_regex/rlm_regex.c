@@ -0,0 +1,143 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_regex.c
+ * @brief Match a string against a set of regular expressions in a single pass.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+
+typedef struct rlm_regex_t {
+	char const	*xlat_name;		//!< Name of the xlat, the instance name.
+
+	char const	**patterns;		//!< Expressions to match, in order of precedence.
+	bool		ignore_case;		//!< Case insensitive matching.
+	bool		multiline;		//!< $ matches newlines.
+
+#ifdef HAVE_REGEX
+	regex_set_t	*set;			//!< Compiled expressions.
+#endif
+} rlm_regex_t;
+
+static const CONF_PARSER module_config[] = {
+	{ FR_CONF_OFFSET("pattern", PW_TYPE_STRING | PW_TYPE_MULTI | PW_TYPE_REQUIRED, rlm_regex_t, patterns) },
+	{ FR_CONF_OFFSET("ignore_case", PW_TYPE_BOOLEAN, rlm_regex_t, ignore_case), .dflt = "no" },
+	{ FR_CONF_OFFSET("multiline", PW_TYPE_BOOLEAN, rlm_regex_t, multiline), .dflt = "no" },
+	CONF_PARSER_TERMINATOR
+};
+
+#ifdef HAVE_REGEX
+/** Return the index of the first pattern which matches the subject
+ *
+ * Example:
+@verbatim
+"%{realm_route:&User-Name}" == "2"
+@endverbatim
+ *
+ * Expands to a zero length string if no patterns match.
+ */
+static ssize_t regex_set_xlat(char **out, size_t outlen,
+			      void const *mod_inst, UNUSED void const *xlat_inst,
+			      REQUEST *request, char const *fmt)
+{
+	rlm_regex_t const	*inst = mod_inst;
+	uint8_t const		*subject;
+	ssize_t			len;
+	int			ret;
+
+	len = xlat_fmt_to_ref(&subject, request, fmt);
+	if (len < 0) return 0;
+
+	ret = regex_set_exec(request, inst->set, (char const *)subject, len);
+	switch (ret) {
+	case -1:
+		RDEBUG2("No patterns matched");
+		return 0;
+
+	case -2:
+		REDEBUG("Failed evaluating patterns: %s", fr_strerror());
+		return -1;
+
+	default:
+		RDEBUG2("Matched pattern %i \"%s\"", ret, inst->patterns[ret]);
+		return snprintf(*out, outlen, "%i", ret);
+	}
+}
+#endif
+
+static int mod_bootstrap(CONF_SECTION *conf, void *instance)
+{
+	rlm_regex_t *inst = instance;
+
+	inst->xlat_name = cf_section_name2(conf);
+	if (!inst->xlat_name) inst->xlat_name = cf_section_name1(conf);
+
+#ifdef HAVE_REGEX
+	xlat_register(inst, inst->xlat_name, regex_set_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+#endif
+
+	return 0;
+}
+
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+#ifdef HAVE_REGEX
+	rlm_regex_t	*inst = instance;
+	int		ret;
+
+	ret = regex_set_compile(inst, &inst->set, inst->patterns, talloc_array_length(inst->patterns),
+				inst->ignore_case, inst->multiline);
+	if (ret < 0) {
+		CONF_PAIR *cp;
+		int i;
+
+		/*
+		 *	Point at the pattern which failed.
+		 */
+		cp = cf_pair_find(conf, "pattern");
+		for (i = 1; cp && (i < -ret); i++) cp = cf_pair_find_next(conf, cp, "pattern");
+
+		if (cp) {
+			cf_log_err_cp(cp, "Invalid regular expression: %s", fr_strerror());
+		} else {
+			cf_log_err_cs(conf, "Failed compiling regular expressions: %s", fr_strerror());
+		}
+		return -1;
+	}
+
+	return 0;
+#else
+	cf_log_err_cs(conf, "Server was built without regular expression support");
+
+	return -1;
+#endif
+}
+
+extern module_t rlm_regex;
+module_t rlm_regex = {
+	.magic		= RLM_MODULE_INIT,
+	.name		= "regex",
+	.inst_size	= sizeof(rlm_regex_t),
+	.config		= module_config,
+	.bootstrap	= mod_bootstrap,
+	.instantiate	= mod_instantiate
+};
@@ -25,8 +25,281 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
+#include <freeradius-devel/net.h>
+#include <freeradius-devel/udp.h>
+
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+#if defined(WITH_PROXY) && defined(HAVE_PTHREAD_H)
+/** A replicated packet, encoded and signed, waiting to be sent
+ *
+ */
+typedef struct replicate_entry_t {
+	struct replicate_entry_t *next;		//!< Next packet for the same socket.
+	fr_ipaddr_t		dst_ipaddr;	//!< Home server address.
+	uint16_t		dst_port;	//!< Home server port.
+	uint8_t			*data;		//!< Encoded packet.
+	size_t			data_len;	//!< Length of the encoded packet.
+} replicate_entry_t;
+
+/** Socket for sending replicated packets from one source address
+ *
+ */
+typedef struct replicate_socket_t {
+	struct replicate_socket_t *next;	//!< Next socket.
+	fr_ipaddr_t		src_ipaddr;	//!< Address the socket is bound to.
+	int			sockfd;		//!< The socket.
+	replicate_entry_t	*head;		//!< First packet waiting to be sent.
+	replicate_entry_t	*tail;		//!< Last packet waiting to be sent.
+#ifdef HAVE_SENDMMSG
+	udp_send_batch_t	*batch;		//!< Packets sent together with sendmmsg().
+#endif
+} replicate_socket_t;
+#endif
+
+typedef struct rlm_replicate_t {
+	char const		*name;		//!< Instance name.
+	uint32_t		max_queued;	//!< Maximum number of packets waiting to be sent.
+						//!< 0 means the worker sends the packets itself.
+	uint32_t		batch;		//!< Maximum number of packets per sendmmsg().
+
+#if defined(WITH_PROXY) && defined(HAVE_PTHREAD_H)
+	replicate_socket_t	*sockets;	//!< Sockets, one per source address.
+	uint32_t		num_queued;	//!< Number of packets waiting to be sent.
+	uint64_t		dropped;	//!< Packets discarded because the queue was full.
+
+	bool			started;	//!< Whether the sender thread is running.
+	bool			stop;		//!< Tell the sender thread to exit.
+	pthread_t		thread;		//!< Sends queued packets.
+	pthread_mutex_t		mutex;		//!< Protects the sockets and their queues.
+	pthread_cond_t		cond;		//!< Signalled when packets are queued.
+#endif
+} rlm_replicate_t;
+
+static const CONF_PARSER module_config[] = {
+	{ FR_CONF_OFFSET("max_queued", PW_TYPE_INTEGER, rlm_replicate_t, max_queued), .dflt = "4096" },
+	{ FR_CONF_OFFSET("batch", PW_TYPE_INTEGER, rlm_replicate_t, batch), .dflt = "64" },
+	CONF_PARSER_TERMINATOR
+};
 
 #ifdef WITH_PROXY
+/** A packet encoded and signed with one secret
+ *
+ */
+typedef struct replicate_encoded_t {
+	char const		*secret;	//!< The secret used to sign the packet.
+	uint8_t			*data;		//!< Encoded packet.
+	size_t			data_len;	//!< Length of the encoded packet.
+} replicate_encoded_t;
+
+#ifdef HAVE_PTHREAD_H
+/** Open a socket for replicating packets from a source address
+ *
+ * Must be called with the instance mutex held.
+ */
+static replicate_socket_t *replicate_socket_alloc(rlm_replicate_t *inst, fr_ipaddr_t const *src_ipaddr)
+{
+	replicate_socket_t *sock;
+
+	sock = talloc_zero(NULL, replicate_socket_t);
+	if (!sock) return NULL;
+
+	sock->src_ipaddr = *src_ipaddr;
+	sock->sockfd = fr_socket(&sock->src_ipaddr, 0);
+	if (sock->sockfd < 0) {
+		talloc_free(sock);
+		return NULL;
+	}
+
+#ifdef HAVE_SENDMMSG
+	/*
+	 *	If this fails, we send one packet at a time.
+	 */
+	if (inst->batch > 1) sock->batch = udp_send_batch_alloc(sock, inst->batch, MAX_RADIUS_LEN);
+#endif
+
+	sock->next = inst->sockets;
+	inst->sockets = sock;
+
+	return sock;
+}
+
+/** Queue an encoded packet for the sender thread
+ *
+ * The data is copied, so the caller may free it immediately.
+ *
+ * @param[in] inst	of this module.
+ * @param[in] request	The current request.
+ * @param[in] home	server to send the packet to.
+ * @param[in] encoded	packet to send.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the packet was discarded.
+ */
+static int replicate_queue(rlm_replicate_t *inst, REQUEST *request, home_server_t *home,
+			   replicate_encoded_t const *encoded)
+{
+	replicate_socket_t	*sock;
+	replicate_entry_t	*entry;
+
+	/*
+	 *	Allocated outside of the request, as the sender
+	 *	thread frees it.
+	 */
+	entry = talloc_zero(NULL, replicate_entry_t);
+	if (!entry) return -1;
+
+	entry->data = talloc_memdup(entry, encoded->data, encoded->data_len);
+	if (!entry->data) {
+		talloc_free(entry);
+		return -1;
+	}
+	entry->data_len = encoded->data_len;
+	entry->dst_ipaddr = home->ipaddr;
+	entry->dst_port = home->port;
+
+	pthread_mutex_lock(&inst->mutex);
+	if (inst->num_queued >= inst->max_queued) {
+		inst->dropped++;
+		pthread_mutex_unlock(&inst->mutex);
+		talloc_free(entry);
+
+		RATE_LIMIT(RWARN("Replication queue is full, discarding packet for home server %s", home->log_name));
+		return -1;
+	}
+
+	for (sock = inst->sockets; sock; sock = sock->next) {
+		if (fr_ipaddr_cmp(&sock->src_ipaddr, &home->src_ipaddr) == 0) break;
+	}
+
+	if (!sock) {
+		sock = replicate_socket_alloc(inst, &home->src_ipaddr);
+		if (!sock) {
+			pthread_mutex_unlock(&inst->mutex);
+			talloc_free(entry);
+
+			REDEBUG("Failed opening socket: %s", fr_strerror());
+			return -1;
+		}
+	}
+
+	if (sock->tail) {
+		sock->tail->next = entry;
+	} else {
+		sock->head = entry;
+	}
+	sock->tail = entry;
+
+	inst->num_queued++;
+	pthread_cond_signal(&inst->cond);
+	pthread_mutex_unlock(&inst->mutex);
+
+	return 0;
+}
+
+/** Send (or add to the current batch) one queued packet
+ *
+ */
+static void replicate_send(rlm_replicate_t *inst, replicate_socket_t *sock, replicate_entry_t *entry)
+{
+	fr_ipaddr_t src_ipaddr;
+
+	/*
+	 *	The socket is already bound to the source address.
+	 */
+	memset(&src_ipaddr, 0, sizeof(src_ipaddr));
+
+#ifdef HAVE_SENDMMSG
+	if (sock->batch) {
+		if (udp_send_batch_add(sock->sockfd, sock->batch, entry->data, entry->data_len,
+				       &src_ipaddr, 0, 0, &entry->dst_ipaddr, entry->dst_port) < 0) {
+			RATE_LIMIT(ERROR("rlm_replicate (%s): Failed replicating packet: %s",
+					 inst->name, fr_strerror()));
+		}
+		return;
+	}
+#endif
+
+	if (udp_send(sock->sockfd, entry->data, entry->data_len, UDP_FLAGS_NONE,
+		     &src_ipaddr, 0, 0, &entry->dst_ipaddr, entry->dst_port) < 0) {
+		RATE_LIMIT(ERROR("rlm_replicate (%s): Failed replicating packet: %s",
+				 inst->name, fr_syserror(errno)));
+	}
+}
+
+/** Send the packets batched by replicate_send()
+ *
+ */
+static void replicate_flush(rlm_replicate_t *inst, replicate_socket_t *sock)
+{
+#ifdef HAVE_SENDMMSG
+	if (sock->batch && udp_send_batch_pending(sock->batch) &&
+	    (udp_send_batch_flush(sock->batch) < 0)) {
+		RATE_LIMIT(ERROR("rlm_replicate (%s): Failed replicating packets: %s",
+				 inst->name, fr_strerror()));
+	}
+#else
+	(void) inst;
+	(void) sock;
+#endif
+}
+
+/** Send queued packets
+ *
+ * Workers only queue packets, so a slow or unreachable home server never
+ * delays the request being replicated.  Each pass takes everything queued
+ * for a socket, and sends it in as few system calls as possible.
+ */
+static void *replicate_sender(void *arg)
+{
+	rlm_replicate_t *inst = arg;
+
+	pthread_mutex_lock(&inst->mutex);
+	while (true) {
+		replicate_socket_t	*sock;
+		bool			sent = false;
+
+		for (sock = inst->sockets; sock; sock = sock->next) {
+			replicate_entry_t	*entry, *next;
+			uint32_t		num = 0;
+
+			if (!sock->head) continue;
+
+			entry = sock->head;
+			sock->head = sock->tail = NULL;
+			pthread_mutex_unlock(&inst->mutex);
+
+			for (; entry; entry = next) {
+				next = entry->next;
+
+				replicate_send(inst, sock, entry);
+				talloc_free(entry);
+				num++;
+			}
+			replicate_flush(inst, sock);
+
+			pthread_mutex_lock(&inst->mutex);
+			inst->num_queued -= num;
+			sent = true;
+		}
+
+		/*
+		 *	More packets may have been queued while
+		 *	we weren't holding the mutex.
+		 */
+		if (sent) continue;
+
+		if (inst->stop) break;
+
+		pthread_cond_wait(&inst->cond, &inst->mutex);
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	return NULL;
+}
+#endif
 
 /** Allocate a request packet
  *
@@ -93,6 +366,11 @@ error:
  * defined by the presence of the Replicate-To-Realm VP in the control
  * list of the current request.
  *
+ * The packet is encoded and signed once for each distinct secret, and
+ * the same data is sent to every home server which shares that secret.
+ * If max_queued is set, the packets are queued for the sender thread,
+ * otherwise they're sent by the worker.
+ *
  * This is pretty hacky and is 100% fire and forget. If you're looking
  * to forward authentication requests to multiple realms and process
  * the responses, this function will not allow you to do that.
@@ -107,20 +385,27 @@ error:
  *	- #RLM_MODULE_NOOP if no replications succeeded.
  *	- #RLM_MODULE_OK if successful.
  */
-static rlm_rcode_t replicate_packet(UNUSED void *instance, REQUEST *request, pair_lists_t list, PW_CODE code)
+static rlm_rcode_t replicate_packet(void *instance, REQUEST *request, pair_lists_t list, PW_CODE code)
 {
+	rlm_replicate_t *inst = instance;
 	int rcode;
-	bool pass1 = true;
+	int sockfd = -1;
 
 	vp_cursor_t cursor;
 	VALUE_PAIR *vp;
 
 	RADIUS_PACKET *packet = NULL;
+	replicate_encoded_t *encoded = NULL;
+	unsigned int i, num_encoded = 0;
 
 	rcode = rlm_replicate_alloc(&packet, request, list, code);
 	if (rcode != RLM_MODULE_OK) return rcode;
 
-	packet->sockfd = -1;
+	/*
+	 *	The packets are never matched to replies, so the
+	 *	same ID is used for every destination.
+	 */
+	packet->id = fr_rand() & 0xff;
 
 	/*
 	 *	Send as many packets as necessary to different destinations.
@@ -177,46 +462,76 @@ static rlm_rcode_t replicate_packet(UNUSED void *instance, REQUEST *request, pai
 		}
 
 		/*
-		 *	For replication to multiple servers we re-use the packet
-		 *	we built here.
+		 *	Encode and sign the packet, unless we've
+		 *	already done so with this secret.
 		 */
-		if (pass1) {
-			packet->id = fr_rand() & 0xff;
-			packet->sockfd = fr_socket(&home->src_ipaddr, 0);
-			if (packet->sockfd < 0) {
-				REDEBUG("Failed opening socket: %s", fr_strerror());
+		for (i = 0; i < num_encoded; i++) {
+			if (strcmp(encoded[i].secret, home->secret) == 0) break;
+		}
+
+		if (i == num_encoded) {
+			if (num_encoded) fr_rand_fill(packet->vector, sizeof(packet->vector));
+
+			packet->data = NULL;
+			packet->data_len = 0;
+
+			if ((fr_radius_encode(packet, NULL, home->secret) < 0) ||
+			    (fr_radius_sign(packet, NULL, home->secret) < 0)) {
+				REDEBUG("Failed encoding packet: %s", fr_strerror());
 				rcode = RLM_MODULE_FAIL;
 				goto done;
 			}
-			pass1 = false;
-		} else {
-			size_t i;
 
-			for (i = 0; i < sizeof(packet->vector); i++) {
-				packet->vector[i] = fr_rand() & 0xff;
+			encoded = talloc_realloc(packet, encoded, replicate_encoded_t, num_encoded + 1);
+			if (!encoded) {
+				rcode = RLM_MODULE_FAIL;
+				goto done;
 			}
 
-			packet->id++;
-			TALLOC_FREE(packet->data);
-			packet->data_len = 0;
+			/*
+			 *	The data stays parented by the packet.
+			 */
+			encoded[i].secret = home->secret;
+			encoded[i].data = packet->data;
+			encoded[i].data_len = packet->data_len;
+			num_encoded++;
 		}
 
-		/*
-		 *	(Re)-Write these.
-		 */
-		packet->dst_ipaddr = home->ipaddr;
-		packet->dst_port = home->port;
-		memset(&packet->src_ipaddr, 0, sizeof(packet->src_ipaddr));
-		packet->src_port = 0;
+		RDEBUG("Replicating %s list to Realm \"%s\"", fr_int2str(pair_lists, list, "<INVALID>"), realm->name);
+
+#ifdef HAVE_PTHREAD_H
+		if (inst->started) {
+			if (replicate_queue(inst, request, home, &encoded[i]) < 0) continue;
+
+			rcode = RLM_MODULE_OK;
+			continue;
+		}
+#endif
 
 		/*
-		 *	Encode, sign and then send the packet.
+		 *	For replication to multiple servers we re-use the socket
+		 *	we opened for the first one.
 		 */
-		RDEBUG("Replicating %s list to Realm \"%s\"", fr_int2str(pair_lists, list, "<INVALID>"), realm->name);
-		if (fr_radius_send(packet, NULL, home->secret) < 0) {
-			REDEBUG("Failed replicating packet: %s", fr_strerror());
-			rcode = RLM_MODULE_FAIL;
-			goto done;
+		if (sockfd < 0) {
+			sockfd = fr_socket(&home->src_ipaddr, 0);
+			if (sockfd < 0) {
+				REDEBUG("Failed opening socket: %s", fr_strerror());
+				rcode = RLM_MODULE_FAIL;
+				goto done;
+			}
+		}
+
+		{
+			fr_ipaddr_t src_ipaddr;
+
+			memset(&src_ipaddr, 0, sizeof(src_ipaddr));
+
+			if (udp_send(sockfd, encoded[i].data, encoded[i].data_len, UDP_FLAGS_NONE,
+				     &src_ipaddr, 0, 0, &home->ipaddr, home->port) < 0) {
+				REDEBUG("Failed replicating packet: %s", fr_syserror(errno));
+				rcode = RLM_MODULE_FAIL;
+				goto done;
+			}
 		}
 
 		/*
@@ -226,12 +541,11 @@ static rlm_rcode_t replicate_packet(UNUSED void *instance, REQUEST *request, pai
 	}
 
 done:
-	if (packet) {
-		if ((packet->sockfd >= 0) && (close(packet->sockfd) < 0)) {
-			RWARN("Error closing socket (we may leak file descriptors): %s", fr_syserror(errno));
-		}
-		talloc_free(packet);
+	if ((sockfd >= 0) && (close(sockfd) < 0)) {
+		RWARN("Error closing socket (we may leak file descriptors): %s", fr_syserror(errno));
 	}
+	talloc_free(packet);
+
 	return rcode;
 }
 #else
@@ -245,6 +559,80 @@ static rlm_rcode_t replicate_packet(UNUSED void *instance,
 }
 #endif
 
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_replicate_t *inst = instance;
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	FR_INTEGER_BOUND_CHECK("max_queued", inst->max_queued, <=, 1048576);
+	FR_INTEGER_BOUND_CHECK("batch", inst->batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("batch", inst->batch, <=, 1024);
+
+#if defined(WITH_PROXY) && defined(HAVE_PTHREAD_H)
+	pthread_mutex_init(&inst->mutex, NULL);
+	pthread_cond_init(&inst->cond, NULL);
+
+	if (!inst->max_queued) return 0;
+
+	if (pthread_create(&inst->thread, NULL, replicate_sender, inst) != 0) {
+		ERROR("rlm_replicate (%s): Failed starting sender thread: %s", inst->name, fr_syserror(errno));
+		return -1;
+	}
+	inst->started = true;
+#else
+	if (inst->max_queued) {
+		WARN("rlm_replicate (%s): Setting 'max_queued' requires thread support.  Disabling 'max_queued'",
+		     inst->name);
+		inst->max_queued = 0;
+	}
+#endif
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_replicate_t *inst = instance;
+
+#if defined(WITH_PROXY) && defined(HAVE_PTHREAD_H)
+	replicate_socket_t *sock, *next;
+
+	/*
+	 *	The sender thread sends everything which is
+	 *	still queued before it exits.
+	 */
+	if (inst->started) {
+		pthread_mutex_lock(&inst->mutex);
+		inst->stop = true;
+		pthread_cond_signal(&inst->cond);
+		pthread_mutex_unlock(&inst->mutex);
+
+		pthread_join(inst->thread, NULL);
+	}
+
+	if (inst->dropped) {
+		WARN("rlm_replicate (%s): Discarded %" PRIu64 " packets because the queue was full",
+		     inst->name, inst->dropped);
+	}
+
+	for (sock = inst->sockets; sock; sock = next) {
+		next = sock->next;
+
+		close(sock->sockfd);
+		talloc_free(sock);
+	}
+
+	pthread_mutex_destroy(&inst->mutex);
+	pthread_cond_destroy(&inst->cond);
+#else
+	(void) inst;
+#endif
+
+	return 0;
+}
+
 static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *request)
 {
 	return replicate_packet(instance, request, PAIR_LIST_REQUEST, request->packet->code);
@@ -288,6 +676,10 @@ module_t rlm_replicate = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "replicate",
 	.type		= RLM_TYPE_THREAD_SAFE,
+	.inst_size	= sizeof(rlm_replicate_t),
+	.config		= module_config,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 		[MOD_ACCOUNTING]	= mod_accounting,
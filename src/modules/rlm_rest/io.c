@@ -0,0 +1,487 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Run transfers from many threads on a single curl multi handle.
+ * @file io.c
+ *
+ * Transfers are added to a curl multi handle, which is driven by an
+ * #fr_event_list_t serviced by a dedicated thread.  All transfers share
+ * the multi handle's connection cache, so connections are kept alive
+ * between requests, and with HTTP/2 concurrent transfers to the same
+ * server are multiplexed over a single connection.
+ *
+ * Modules can't yet suspend a request whilst waiting on I/O, so the thread
+ * submitting a transfer still waits for it to complete.  If the request is
+ * running on a fiber, only the fiber waits, and the thread processes other
+ * requests in the meantime.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/event.h>
+
+#include <poll.h>
+
+#include "io.h"
+
+#ifdef HAVE_PTHREAD_H
+#define REST_IO_WRITE_RETRY	1000		//!< How long to wait (in microseconds) before
+						//!< checking whether a socket is writable again.
+
+/** A transfer submitted by a worker thread
+ *
+ * Lives on the stack of the thread waiting for it to complete.
+ */
+typedef struct rest_io_transfer {
+	CURL			*candle;	//!< Easy handle to perform.
+	CURLcode		result;		//!< Result of the transfer.
+	bool			done;		//!< Whether the transfer has completed.
+	pthread_cond_t		cond;		//!< Signalled when done is set.
+#ifdef WITH_FIBERS
+	fr_fiber_t		*fiber;		//!< Woken instead, if the request is running on one.
+#endif
+
+	struct rest_io_transfer	*next;		//!< Next transfer waiting to be added.
+} rest_io_transfer_t;
+
+struct rest_io {
+	char const		*name;		//!< Instance name, for log messages.
+
+	CURLM			*multi;		//!< Multi handle all transfers are added to.
+	fr_event_list_t		*el;		//!< Event list driving the multi handle.
+	fr_event_t		*timeout_ev;	//!< Timer requested by libcurl.
+
+	int			wake[2];	//!< Pipe used to tell the I/O thread about new transfers.
+	pthread_t		thread;		//!< Thread servicing el.
+	bool			started;	//!< Whether the thread was started.
+
+	pthread_mutex_t		mutex;		//!< Protects queue, stop and transfer completion.
+	rest_io_transfer_t	*queue;		//!< Transfers waiting to be added to the multi handle.
+	bool			stop;		//!< Tell the I/O thread to exit.
+};
+
+/** A socket libcurl wants us to watch
+ *
+ * The event list only signals read readiness, so while libcurl wants to
+ * write we poll the socket from a timer.
+ */
+typedef struct rest_io_socket {
+	rest_io_t		*io;		//!< Engine the socket belongs to.
+	curl_socket_t		fd;		//!< Socket being watched.
+	bool			reading;	//!< Whether fd is in the event list.
+	bool			writing;	//!< Whether libcurl wants to write.
+	fr_event_t		*write_ev;	//!< Timer used to check for write readiness.
+} rest_io_socket_t;
+
+static void rest_io_write_schedule(rest_io_socket_t *sock, struct timeval const *now, suseconds_t delay);
+
+/** Tell the thread waiting on a transfer that it has completed
+ *
+ * Once done is set, the waiting thread may return, and transfer is
+ * no longer valid.
+ */
+static void rest_io_transfer_done(rest_io_t *io, rest_io_transfer_t *transfer, CURLcode result)
+{
+	pthread_mutex_lock(&io->mutex);
+	transfer->result = result;
+	transfer->done = true;
+#ifdef WITH_FIBERS
+	if (transfer->fiber) {
+		fr_fiber_wake(transfer->fiber);
+	} else
+#endif
+	pthread_cond_signal(&transfer->cond);
+	pthread_mutex_unlock(&io->mutex);
+}
+
+/** Signal the threads waiting on transfers which have completed
+ *
+ */
+static void rest_io_check_done(rest_io_t *io)
+{
+	CURLMsg			*msg;
+	int			remaining;
+	rest_io_transfer_t	*transfer;
+
+	while ((msg = curl_multi_info_read(io->multi, &remaining))) {
+		if (msg->msg != CURLMSG_DONE) continue;
+
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&transfer);
+		curl_multi_remove_handle(io->multi, msg->easy_handle);
+
+		rest_io_transfer_done(io, transfer, msg->data.result);
+	}
+}
+
+static void rest_io_socket_action(rest_io_t *io, curl_socket_t fd, int mask)
+{
+	int		running;
+	CURLMcode	ret;
+
+	ret = curl_multi_socket_action(io->multi, fd, mask, &running);
+	if (ret != CURLM_OK) ERROR("rlm_rest (%s): Failed servicing transfers: %s", io->name, curl_multi_strerror(ret));
+
+	rest_io_check_done(io);
+}
+
+static void _rest_io_read(UNUSED fr_event_list_t *el, int fd, void *ctx)
+{
+	rest_io_socket_t *sock = ctx;
+
+	rest_io_socket_action(sock->io, fd, CURL_CSELECT_IN);	/* May free sock */
+}
+
+static void _rest_io_write(void *ctx, struct timeval *now)
+{
+	rest_io_socket_t	*sock = ctx;
+	rest_io_t		*io = sock->io;
+	struct pollfd		pfd;
+
+	/*
+	 *	Check again shortly, unless libcurl tells us it's
+	 *	done writing.  This must be done before calling
+	 *	libcurl, as it may free sock.
+	 */
+	rest_io_write_schedule(sock, now, REST_IO_WRITE_RETRY);
+
+	pfd.fd = sock->fd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) == 0) return;
+
+	rest_io_socket_action(io, sock->fd, CURL_CSELECT_OUT);
+}
+
+static void rest_io_write_schedule(rest_io_socket_t *sock, struct timeval const *now, suseconds_t delay)
+{
+	struct timeval when, offset = { .tv_sec = 0, .tv_usec = delay };
+
+	if (now) {
+		when = *now;
+	} else {
+		gettimeofday(&when, NULL);
+	}
+	timeradd(&when, &offset, &when);
+
+	if (!fr_event_insert(sock->io->el, _rest_io_write, sock, &when, &sock->write_ev)) {
+		ERROR("rlm_rest (%s): Failed scheduling write: %s", sock->io->name, fr_strerror());
+	}
+}
+
+static int _rest_io_socket_free(rest_io_socket_t *sock)
+{
+	if (sock->reading) fr_event_fd_delete(sock->io->el, 0, sock->fd);
+	fr_event_delete(sock->io->el, &sock->write_ev);
+
+	return 0;
+}
+
+/** Called by libcurl to tell us which events it's interested in for a socket
+ *
+ */
+static int _rest_io_socket(UNUSED CURL *candle, curl_socket_t fd, int what, void *uctx, void *socketp)
+{
+	rest_io_t		*io = uctx;
+	rest_io_socket_t	*sock = socketp;
+
+	if (what == CURL_POLL_REMOVE) {
+		talloc_free(sock);
+		return 0;
+	}
+
+	if (!sock) {
+		sock = talloc_zero(io, rest_io_socket_t);
+		if (!sock) return -1;
+		sock->io = io;
+		sock->fd = fd;
+		talloc_set_destructor(sock, _rest_io_socket_free);
+		curl_multi_assign(io->multi, fd, sock);
+	}
+
+	if ((what & CURL_POLL_IN) && !sock->reading) {
+		if (!fr_event_fd_insert(io->el, 0, fd, _rest_io_read, sock)) {
+			ERROR("rlm_rest (%s): Failed adding socket to event list: %s", io->name, fr_strerror());
+			return -1;
+		}
+		sock->reading = true;
+	} else if (!(what & CURL_POLL_IN) && sock->reading) {
+		fr_event_fd_delete(io->el, 0, fd);
+		sock->reading = false;
+	}
+
+	sock->writing = (what & CURL_POLL_OUT) != 0;
+	if (sock->writing && !sock->write_ev) {
+		rest_io_write_schedule(sock, NULL, 0);
+	} else if (!sock->writing) {
+		fr_event_delete(io->el, &sock->write_ev);
+	}
+
+	return 0;
+}
+
+static void _rest_io_timeout(void *ctx, UNUSED struct timeval *now)
+{
+	rest_io_t *io = ctx;
+
+	rest_io_socket_action(io, CURL_SOCKET_TIMEOUT, 0);
+}
+
+/** Called by libcurl to tell us when it next needs to be called
+ *
+ */
+static int _rest_io_timer(UNUSED CURLM *multi, long timeout_ms, void *uctx)
+{
+	rest_io_t	*io = uctx;
+	struct timeval	when, offset;
+
+	fr_event_delete(io->el, &io->timeout_ev);
+	if (timeout_ms < 0) return 0;
+
+	offset.tv_sec = timeout_ms / 1000;
+	offset.tv_usec = (timeout_ms % 1000) * 1000;
+	gettimeofday(&when, NULL);
+	timeradd(&when, &offset, &when);
+
+	if (!fr_event_insert(io->el, _rest_io_timeout, io, &when, &io->timeout_ev)) {
+		ERROR("rlm_rest (%s): Failed scheduling timeout: %s", io->name, fr_strerror());
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Add transfers submitted by worker threads to the multi handle
+ *
+ */
+static void _rest_io_wake(fr_event_list_t *el, int fd, void *ctx)
+{
+	rest_io_t		*io = ctx;
+	rest_io_transfer_t	*queue, *transfer, *next;
+	uint8_t			buff[64];
+	bool			stop;
+
+	while (read(fd, buff, sizeof(buff)) > 0);
+
+	pthread_mutex_lock(&io->mutex);
+	queue = io->queue;
+	io->queue = NULL;
+	stop = io->stop;
+	pthread_mutex_unlock(&io->mutex);
+
+	if (stop) {
+		fr_event_loop_exit(el, 0);
+		return;
+	}
+
+	for (transfer = queue; transfer; transfer = next) {
+		CURLMcode ret;
+
+		next = transfer->next;
+
+		ret = curl_multi_add_handle(io->multi, transfer->candle);
+		if (ret != CURLM_OK) {
+			ERROR("rlm_rest (%s): Failed adding transfer: %s", io->name, curl_multi_strerror(ret));
+
+			rest_io_transfer_done(io, transfer, CURLE_FAILED_INIT);
+		}
+	}
+}
+
+static void *rest_io_thread(void *arg)
+{
+	rest_io_t *io = arg;
+
+	fr_event_loop(io->el);
+
+	return NULL;
+}
+
+static int _rest_io_free(rest_io_t *io)
+{
+	if (io->started) {
+		pthread_mutex_lock(&io->mutex);
+		io->stop = true;
+		pthread_mutex_unlock(&io->mutex);
+
+		if (write(io->wake[1], "s", 1) < 0) {
+			ERROR("rlm_rest (%s): Failed stopping I/O thread: %s", io->name, fr_syserror(errno));
+		}
+		pthread_join(io->thread, NULL);
+	}
+
+	/*
+	 *	Frees any sockets still being watched.
+	 */
+	if (io->multi) curl_multi_cleanup(io->multi);
+	if (io->el) {
+		fr_event_delete(io->el, &io->timeout_ev);
+		fr_event_fd_delete(io->el, 0, io->wake[0]);
+	}
+	if (io->wake[0] >= 0) close(io->wake[0]);
+	if (io->wake[1] >= 0) close(io->wake[1]);
+
+	pthread_mutex_destroy(&io->mutex);
+
+	return 0;
+}
+
+/** Allocate a curl multi engine, and start the thread servicing it
+ *
+ * @param[in] ctx to allocate engine in.  Freeing the engine stops the thread.
+ * @param[in] name of the module instance, for log messages.
+ * @param[in] max_host_connections Maximum connections to any single host.  0 for no limit.
+ * @param[in] multiplex Whether concurrent HTTP/2 transfers should share a connection.
+ * @return
+ *	- A new engine.
+ *	- NULL on error.
+ */
+rest_io_t *rest_io_alloc(TALLOC_CTX *ctx, char const *name, uint32_t max_host_connections, bool multiplex)
+{
+	rest_io_t *io;
+
+	io = talloc_zero(ctx, rest_io_t);
+	if (!io) return NULL;
+
+	io->name = name;
+	io->wake[0] = io->wake[1] = -1;
+	pthread_mutex_init(&io->mutex, NULL);
+	talloc_set_destructor(io, _rest_io_free);
+
+	io->multi = curl_multi_init();
+	if (!io->multi) {
+		ERROR("rlm_rest (%s): Failed creating multi handle", name);
+	error:
+		talloc_free(io);
+		return NULL;
+	}
+
+	curl_multi_setopt(io->multi, CURLMOPT_SOCKETFUNCTION, _rest_io_socket);
+	curl_multi_setopt(io->multi, CURLMOPT_SOCKETDATA, io);
+	curl_multi_setopt(io->multi, CURLMOPT_TIMERFUNCTION, _rest_io_timer);
+	curl_multi_setopt(io->multi, CURLMOPT_TIMERDATA, io);
+#if LIBCURL_VERSION_NUM >= 0x071e00
+	if (max_host_connections > 0) curl_multi_setopt(io->multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+							(long)max_host_connections);
+#endif
+#ifdef CURLPIPE_MULTIPLEX
+	if (multiplex) curl_multi_setopt(io->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#else
+	if (multiplex) WARN("rlm_rest (%s): libcurl is too old to multiplex transfers", name);
+#endif
+
+	io->el = fr_event_list_create(io, NULL);
+	if (!io->el) {
+		ERROR("rlm_rest (%s): Failed creating event list", name);
+		goto error;
+	}
+
+	if (pipe(io->wake) < 0) {
+		ERROR("rlm_rest (%s): Failed creating pipe: %s", name, fr_syserror(errno));
+		goto error;
+	}
+	if ((fr_nonblock(io->wake[0]) < 0) || (fr_nonblock(io->wake[1]) < 0)) {
+		ERROR("rlm_rest (%s): Failed setting pipe to non-blocking: %s", name, fr_syserror(errno));
+		goto error;
+	}
+
+	if (!fr_event_fd_insert(io->el, 0, io->wake[0], _rest_io_wake, io)) {
+		ERROR("rlm_rest (%s): Failed adding pipe to event list: %s", name, fr_strerror());
+		goto error;
+	}
+
+	if (pthread_create(&io->thread, NULL, rest_io_thread, io) != 0) {
+		ERROR("rlm_rest (%s): Failed starting I/O thread: %s", name, fr_syserror(errno));
+		goto error;
+	}
+	io->started = true;
+
+	return io;
+}
+
+/** Perform a transfer on the shared multi handle, waiting for it to complete
+ *
+ * @param[in] io engine to perform transfer with.
+ * @param[in] request The current request.
+ * @param[in] candle configured easy handle.  Must not be used by the caller
+ *	until this function returns.
+ * @return The result of the transfer.
+ */
+CURLcode rest_io_perform(rest_io_t *io, REQUEST *request, CURL *candle)
+{
+	rest_io_transfer_t transfer = {
+		.candle = candle,
+		.result = CURLE_OK,
+#ifdef WITH_FIBERS
+		.fiber = fr_fiber_current()
+#endif
+	};
+
+	pthread_cond_init(&transfer.cond, NULL);
+	curl_easy_setopt(candle, CURLOPT_PRIVATE, &transfer);
+
+	pthread_mutex_lock(&io->mutex);
+	transfer.next = io->queue;
+	io->queue = &transfer;
+	pthread_mutex_unlock(&io->mutex);
+
+	/*
+	 *	A full pipe means the I/O thread already
+	 *	has a wakeup pending, so EAGAIN is fine.
+	 */
+	if ((write(io->wake[1], "t", 1) < 0) && (errno != EAGAIN)) {
+		RERROR("Failed waking I/O thread: %s", fr_syserror(errno));
+	}
+
+	RDEBUG3("Waiting for transfer to complete");
+
+	pthread_mutex_lock(&io->mutex);
+	while (!transfer.done) {
+#ifdef WITH_FIBERS
+		if (transfer.fiber) {
+			pthread_mutex_unlock(&io->mutex);
+			fr_fiber_suspend();
+			pthread_mutex_lock(&io->mutex);
+			continue;
+		}
+#endif
+		pthread_cond_wait(&transfer.cond, &io->mutex);
+	}
+	pthread_mutex_unlock(&io->mutex);
+
+	pthread_cond_destroy(&transfer.cond);
+
+	return transfer.result;
+}
+#else
+rest_io_t *rest_io_alloc(UNUSED TALLOC_CTX *ctx, char const *name,
+			 UNUSED uint32_t max_host_connections, UNUSED bool multiplex)
+{
+	ERROR("rlm_rest (%s): Shared transfers require thread support", name);
+
+	return NULL;
+}
+
+CURLcode rest_io_perform(UNUSED rest_io_t *io, UNUSED REQUEST *request, CURL *candle)
+{
+	return curl_easy_perform(candle);
+}
+#endif
@@ -0,0 +1,34 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Function prototypes and datatypes for the shared curl multi engine.
+ * @file io.h
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSIDH(io_h, "$Id$")
+
+#define CURL_NO_OLDIES 1
+#include <curl/curl.h>
+
+typedef struct rest_io rest_io_t;
+
+rest_io_t	*rest_io_alloc(TALLOC_CTX *ctx, char const *name, uint32_t max_host_connections, bool multiplex);
+
+CURLcode	rest_io_perform(rest_io_t *io, REQUEST *request, CURL *candle);
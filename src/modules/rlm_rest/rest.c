@@ -312,6 +312,22 @@ static int _mod_conn_free(rlm_rest_handle_t *randle)
 	return 0;
 }
 
+/** Abort a transfer which is in progress
+ *
+ * Called by the main thread when the request the transfer is for times
+ * out.  The transfer is aborted the next time libcurl calls
+ * #rest_progress.
+ *
+ * @param[in] instance configuration data.
+ * @param[in] handle the transfer is using.
+ */
+void mod_conn_cancel(UNUSED void *instance, void *handle)
+{
+	rlm_rest_handle_t *randle = handle;
+
+	randle->cancelled = true;
+}
+
 /** Creates a new connection handle for use by the FR connection API.
  *
  * Matches the fr_connection_create_t function prototype, is passed to
@@ -1169,10 +1185,7 @@ static int rest_decode_post(UNUSED rlm_rest_t const *instance, UNUSED rlm_rest_s
 }
 
 #ifdef HAVE_JSON
-/** Converts JSON "value" key into VALUE_PAIR.
- *
- * If leaf is not in fact a leaf node, but contains JSON data, the data will
- * written to the attribute in JSON string format.
+/** Converts the string form of a JSON value into a VALUE_PAIR.
  *
  * @param[in] instance configuration data.
  * @param[in] section configuration data.
@@ -1181,39 +1194,21 @@ static int rest_decode_post(UNUSED rlm_rest_t const *instance, UNUSED rlm_rest_s
  * @param[in] da Attribute to create.
  * @param[in] flags containing the operator other flags controlling value
  *	expansion.
- * @param[in] leaf object containing the VALUE_PAIR value.
+ * @param[in] value to parse, expanded first if flags->do_xlat is set.
  * @return
  *	- #VALUE_PAIR just created.
  *	- NULL on error.
  */
-static VALUE_PAIR *json_pair_make_leaf(UNUSED rlm_rest_t const *instance, UNUSED rlm_rest_section_t *section,
-				      TALLOC_CTX *ctx, REQUEST *request, fr_dict_attr_t const *da,
-				      json_flags_t *flags, json_object *leaf)
+static VALUE_PAIR *json_pair_make_value(UNUSED rlm_rest_t const *instance, UNUSED rlm_rest_section_t *section,
+				       TALLOC_CTX *ctx, REQUEST *request, fr_dict_attr_t const *da,
+				       json_flags_t *flags, char const *value)
 {
-	char const *value, *to_parse;
+	char const *to_parse;
 	char *expanded = NULL;
 	int ret;
 
 	VALUE_PAIR *vp;
 
-	if (fr_json_object_is_type(leaf, json_type_null)) {
-		RDEBUG3("Got null value for attribute \"%s\", skipping...", da->name);
-
-		return NULL;
-	}
-
-	/*
-	 *	Should encode any nested JSON structures into JSON strings.
-	 *
-	 *	"I knew you liked JSON so I put JSON in your JSON!"
-	 */
-	value = json_object_get_string(leaf);
-	if (!value) {
-		RWDEBUG("Failed getting string value for attribute \"%s\", skipping...", da->name);
-
-		return NULL;
-	}
-
 	RINDENT();
 	RDEBUG3("Type   : %s", fr_int2str(dict_attr_types, da->type, "<INVALID>"));
 	RDEBUG3("Length : %zu", strlen(value));
@@ -1252,6 +1247,88 @@ static VALUE_PAIR *json_pair_make_leaf(UNUSED rlm_rest_t const *instance, UNUSED
 	return vp;
 }
 
+/** Converts JSON "value" key into VALUE_PAIR.
+ *
+ * If leaf is not in fact a leaf node, but contains JSON data, the data will
+ * written to the attribute in JSON string format.
+ *
+ * @param[in] instance configuration data.
+ * @param[in] section configuration data.
+ * @param[in] ctx to allocate new VALUE_PAIRs in.
+ * @param[in] request Current request.
+ * @param[in] da Attribute to create.
+ * @param[in] flags containing the operator other flags controlling value
+ *	expansion.
+ * @param[in] leaf object containing the VALUE_PAIR value.
+ * @return
+ *	- #VALUE_PAIR just created.
+ *	- NULL on error.
+ */
+static VALUE_PAIR *json_pair_make_leaf(rlm_rest_t const *instance, rlm_rest_section_t *section,
+				      TALLOC_CTX *ctx, REQUEST *request, fr_dict_attr_t const *da,
+				      json_flags_t *flags, json_object *leaf)
+{
+	char const *value;
+
+	if (fr_json_object_is_type(leaf, json_type_null)) {
+		RDEBUG3("Got null value for attribute \"%s\", skipping...", da->name);
+
+		return NULL;
+	}
+
+	/*
+	 *	Should encode any nested JSON structures into JSON strings.
+	 *
+	 *	"I knew you liked JSON so I put JSON in your JSON!"
+	 */
+	value = json_object_get_string(leaf);
+	if (!value) {
+		RWDEBUG("Failed getting string value for attribute \"%s\", skipping...", da->name);
+
+		return NULL;
+	}
+
+	return json_pair_make_value(instance, section, ctx, request, da, flags, value);
+}
+
+/** Resolve an attribute name from a JSON response to a dictionary attribute and list
+ *
+ * @param[out] dst Where to write the parsed attribute reference.
+ * @param[out] current Request the list belongs to.
+ * @param[out] vps List new VALUE_PAIRs should be moved into.
+ * @param[out] ctx to allocate new VALUE_PAIRs in.
+ * @param[in] request Current request.
+ * @param[in] name of the attribute, may include request and list qualifiers.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the attribute should be skipped.
+ */
+static int json_pair_dst(vp_tmpl_t *dst, REQUEST **current, VALUE_PAIR ***vps, TALLOC_CTX **ctx,
+			 REQUEST *request, char const *name)
+{
+	memset(dst, 0, sizeof(*dst));
+
+	if (tmpl_from_attr_str(dst, name, REQUEST_CURRENT, PAIR_LIST_REPLY, false, false) <= 0) {
+		RWDEBUG("Failed parsing attribute: %s, skipping...", fr_strerror());
+		return -1;
+	}
+
+	*current = request;
+	if (radius_request(current, dst->tmpl_request) < 0) {
+		RWDEBUG("Attribute name refers to outer request but not in a tunnel, skipping...");
+		return -1;
+	}
+
+	*vps = radius_list(*current, dst->tmpl_list);
+	if (!*vps) {
+		RWDEBUG("List not valid in this context, skipping...");
+		return -1;
+	}
+	*ctx = radius_list_ctx(*current, dst->tmpl_list);
+
+	return 0;
+}
+
 /** Processes JSON response and converts it into multiple VALUE_PAIRs
  *
  * Processes JSON attribute declarations in the format below. Will recurse when
@@ -1336,32 +1413,15 @@ static int json_pair_make(rlm_rest_t const *instance, rlm_rest_section_t *sectio
 		};
 
 		vp_tmpl_t dst;
-		REQUEST *current = request;
+		REQUEST *current;
 		VALUE_PAIR **vps, *vp = NULL;
 
-		memset(&dst, 0, sizeof(dst));
-
 		/*
 		 *  Resolve attribute name to a dictionary entry and pairlist.
 		 */
 		RDEBUG2("Parsing attribute \"%s\"", name);
 
-		if (tmpl_from_attr_str(&dst, name, REQUEST_CURRENT, PAIR_LIST_REPLY, false, false) <= 0) {
-			RWDEBUG("Failed parsing attribute: %s, skipping...", fr_strerror());
-			continue;
-		}
-
-		if (radius_request(&current, dst.tmpl_request) < 0) {
-			RWDEBUG("Attribute name refers to outer request but not in a tunnel, skipping...");
-			continue;
-		}
-
-		vps = radius_list(current, dst.tmpl_list);
-		if (!vps) {
-			RWDEBUG("List not valid in this context, skipping...");
-			continue;
-		}
-		ctx = radius_list_ctx(current, dst.tmpl_list);
+		if (json_pair_dst(&dst, &current, &vps, &ctx, request, name) < 0) continue;
 
 		/*
 		 *  Alternative JSON structure which allows operator,
@@ -1524,136 +1584,1044 @@ static int rest_decode_json(rlm_rest_t const *instance, rlm_rest_section_t *sect
 
 	return ret;
 }
-#endif
 
-/** Processes incoming HTTP header data from libcurl.
+/*
+ *	Streaming JSON decoder
  *
- * Processes the status line, and Content-Type headers from the incoming HTTP
- * response.
+ *	Tokenises the response body as it's received from libcurl, and stages
+ *	each attribute declaration as soon as it's complete. Neither the raw
+ *	body nor a json-c object tree are kept in memory.
  *
- * Matches prototype for CURLOPT_HEADERFUNCTION, and will be called directly
- * by libcurl.
+ *	Staged declarations are converted to VALUE_PAIRs by rest_decode_json_stream,
+ *	once the caller has checked the status code, so do_xlat expansions are
+ *	performed in the thread processing the request, and attributes aren't
+ *	added if the transfer fails part way through.
+ */
+#define JSON_STREAM_MAX_DEPTH	32
+
+/** States for the streaming JSON tokeniser
  *
- * @param[in] in Char buffer where inbound header data is written.
- * @param[in] size Multiply by nmemb to get the length of ptr.
- * @param[in] nmemb Multiply by size to get the length of ptr.
- * @param[in] userdata rlm_rest_response_t to keep parsing state between calls.
- * @return
- *	- Length of data processed.
- *	- 0 on error.
  */
-static size_t rest_response_header(void *in, size_t size, size_t nmemb, void *userdata)
-{
-	rlm_rest_response_t *ctx = userdata;
-	REQUEST *request = ctx->request; /* Used by RDEBUG */
+typedef enum {
+	JSON_STREAM_STATE_VALUE = 0,			//!< Expecting a value.
+	JSON_STREAM_STATE_VALUE_OR_END,			//!< Expecting a value or ']'.
+	JSON_STREAM_STATE_KEY,				//!< Expecting an object key.
+	JSON_STREAM_STATE_KEY_OR_END,			//!< Expecting an object key or '}'.
+	JSON_STREAM_STATE_COLON,			//!< Expecting the ':' after an object key.
+	JSON_STREAM_STATE_NEXT,				//!< Expecting ',' or the end of the container.
+	JSON_STREAM_STATE_STRING,			//!< Inside a string.
+	JSON_STREAM_STATE_STRING_ESCAPE,		//!< After a '\' in a string.
+	JSON_STREAM_STATE_STRING_UNICODE,		//!< Inside a \\uXXXX escape sequence.
+	JSON_STREAM_STATE_NUMBER,			//!< Inside a number.
+	JSON_STREAM_STATE_LITERAL,			//!< Inside true, false or null.
+	JSON_STREAM_STATE_DONE,				//!< Top level object complete.
+	JSON_STREAM_STATE_ERROR				//!< Malformed data, everything else is discarded.
+} json_stream_state_t;
+
+/** Events passed from the tokeniser to json_stream_event
+ *
+ */
+typedef enum {
+	JSON_STREAM_EVENT_OBJECT_START = 0,
+	JSON_STREAM_EVENT_OBJECT_END,
+	JSON_STREAM_EVENT_ARRAY_START,
+	JSON_STREAM_EVENT_ARRAY_END,
+	JSON_STREAM_EVENT_KEY,
+	JSON_STREAM_EVENT_SCALAR
+} json_stream_event_t;
 
-	char const *p = in, *q;
+/** Keys recognised in the expanded attribute syntax
+ *
+ */
+typedef enum {
+	JSON_STREAM_FIELD_OTHER = 0,
+	JSON_STREAM_FIELD_OP,
+	JSON_STREAM_FIELD_DO_XLAT,
+	JSON_STREAM_FIELD_IS_JSON,
+	JSON_STREAM_FIELD_VALUE
+} json_stream_field_t;
 
-	size_t const t = (size * nmemb);
-	size_t s = t;
-	size_t len;
+/** Raw JSON text which needs to be extracted once the current byte has been captured
+ *
+ */
+typedef enum {
+	JSON_STREAM_CAPTURE_NONE = 0,
+	JSON_STREAM_CAPTURE_ELEMENT,			//!< A compound element of an array value.
+	JSON_STREAM_CAPTURE_VALUE			//!< A compound value.
+} json_stream_capture_t;
+
+static const FR_NAME_NUMBER json_stream_field_table[] = {
+	{ "op",		JSON_STREAM_FIELD_OP },
+	{ "do_xlat",	JSON_STREAM_FIELD_DO_XLAT },
+	{ "is_json",	JSON_STREAM_FIELD_IS_JSON },
+	{ "value",	JSON_STREAM_FIELD_VALUE },
+	{  NULL , -1 }
+};
 
-	http_body_type_t type;
+/** A single value staged by the streaming decoder
+ *
+ */
+typedef struct json_stream_value {
+	enum json_type		type;			//!< JSON type of the value.
+	char			*value;			//!< String form of the value, or JSON text
+							//!< for compound values.
+} json_stream_value_t;
 
-	/*
-	 *  Curl seems to throw these (\r\n) in before the next set of headers when
-	 *  looks like it's just a body separator and safe to ignore after we
-	 *  receive a 100 Continue.
-	 */
-	if (t == 2 && ((p[0] == '\r') && (p[1] == '\n'))) return t;
+typedef struct json_stream_member json_stream_member_t;
 
-	switch (ctx->state) {
-	case WRITE_STATE_INIT:
-		RDEBUG2("Processing response header");
+/** An attribute declaration staged by the streaming decoder
+ *
+ */
+struct json_stream_member {
+	char			*name;			//!< Attribute name.
+	bool			expanded;		//!< Declared using the expanded syntax.
+	char			*op;			//!< Operator from the expanded syntax.
+	int			do_xlat;		//!< Value of the "do_xlat" key.
+	int			is_json;		//!< Value of the "is_json" key.
+	bool			has_value;		//!< Whether we found a value.
+
+	enum json_type		type;			//!< Type of the value.
+	json_stream_value_t	*values;		//!< The scalar value, or elements of an array.
+	int			num_values;		//!< Number of entries in values.
+	char			*raw;			//!< JSON text of a compound value.
+
+	json_stream_member_t	*next;			//!< Next declaration in the response.
+};
 
-		/*
-		 *  HTTP/<version> <reason_code>[ <reason_phrase>]\r\n
-		 *
-		 *  "HTTP/1.1 " (8) + "100 " (4) + "\r\n" (2) = 14
-		 */
-		if (s < 14) {
-			REDEBUG("Malformed HTTP header: Status line too short");
-			goto malformed;
-		}
-		/*
-		 *  Check start of header matches...
-		 */
-		if (strncasecmp("HTTP/", p, 5) != 0) {
-			REDEBUG("Malformed HTTP header: Missing HTTP version");
-			goto malformed;
-		}
-		p += 5;
-		s -= 5;
+/** Streaming JSON decoder state, stored in rlm_rest_response_t.decoder
+ *
+ */
+typedef struct rest_json_stream {
+	REQUEST			*request;		//!< Current request, used for logging.
+	json_stream_state_t	state;			//!< Tokeniser state.
+	size_t			offset;			//!< Number of bytes processed.
+
+	char			stack[JSON_STREAM_MAX_DEPTH];	//!< Open containers, '{' or '['.
+	int			depth;			//!< Number of open containers.
+
+	char			*tok;			//!< Current token (unescaped).
+	size_t			tok_len;		//!< Length of the current token.
+	enum json_type		tok_type;		//!< Type of the current scalar.
+	bool			is_key;			//!< Whether the current string is an object key.
+	uint32_t		unicode;		//!< Code unit being read from a \\uXXXX escape.
+	int			unicode_len;		//!< Number of hex digits read.
+	uint32_t		surrogate;		//!< High surrogate waiting for its pair.
+
+	json_stream_member_t	*member;		//!< Declaration currently being parsed.
+	json_stream_field_t	field;			//!< Key of the expanded syntax we're in.
+	json_stream_member_t	*head;			//!< First complete declaration.
+	json_stream_member_t	**tail;			//!< Where to link the next complete declaration.
+	int			count;			//!< Number of values staged.
+
+	bool			capturing;		//!< Whether bytes are being copied to capture.
+	char			*capture;		//!< JSON text of the current compound value.
+	size_t			capture_len;		//!< Length of the captured text.
+	size_t			capture_start;		//!< Where the current compound element starts.
+	enum json_type		capture_type;		//!< Type of the current compound element.
+	json_stream_capture_t	capture_pending;	//!< What to extract after the current byte.
+} rest_json_stream_t;
+
+/** Append data to a talloced buffer, keeping it \0 terminated
+ *
+ * @param[in] ctx to allocate the buffer in.
+ * @param[in,out] buff to append to.
+ * @param[in,out] len of the data in the buffer.
+ * @param[in] in data to append.
+ * @param[in] inlen length of data to append.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int json_stream_append(TALLOC_CTX *ctx, char **buff, size_t *len, char const *in, size_t inlen)
+{
+	size_t alloc = talloc_array_length(*buff);
 
-		/*
-		 *  Skip the version field, next space should mark start of reason_code.
-		 */
-		q = memchr(p, ' ', s);
-		if (!q) {
-			RDEBUG("Malformed HTTP header: Missing reason code");
-			goto malformed;
-		}
+	if ((*len + inlen + 1) > alloc) {
+		char *tmp;
 
-		s -= (q - p);
-		p  = q;
+		alloc = ((*len + inlen + 1) > (alloc * 2)) ? (*len + inlen + 1) : (alloc * 2);
+		tmp = talloc_realloc(ctx, *buff, char, alloc);
+		if (!tmp) return -1;
+		*buff = tmp;
+	}
 
-		/*
-		 *  Process reason_code.
-		 *
-		 *  " 100" (4) + "\r\n" (2) = 6
-		 */
-		if (s < 6) {
-			REDEBUG("Malformed HTTP header: Reason code too short");
-			goto malformed;
-		}
-		p++;
-		s--;
+	memcpy(*buff + *len, in, inlen);
+	*len += inlen;
+	(*buff)[*len] = '\0';
 
-		/*  Char after reason code must be a space, or \r */
-		if (!((p[3] == ' ') || (p[3] == '\r'))) goto malformed;
+	return 0;
+}
 
-		ctx->code = atoi(p);
+/** Append a unicode code point to the current token as UTF-8
+ *
+ * @param[in] js decoder state.
+ * @param[in] cp code point to encode.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int json_stream_tok_unicode(rest_json_stream_t *js, uint32_t cp)
+{
+	char	buff[4];
+	size_t	len;
+
+	if (cp < 0x80) {
+		buff[0] = cp;
+		len = 1;
+	} else if (cp < 0x800) {
+		buff[0] = 0xc0 | (cp >> 6);
+		buff[1] = 0x80 | (cp & 0x3f);
+		len = 2;
+	} else if (cp < 0x10000) {
+		buff[0] = 0xe0 | (cp >> 12);
+		buff[1] = 0x80 | ((cp >> 6) & 0x3f);
+		buff[2] = 0x80 | (cp & 0x3f);
+		len = 3;
+	} else {
+		buff[0] = 0xf0 | (cp >> 18);
+		buff[1] = 0x80 | ((cp >> 12) & 0x3f);
+		buff[2] = 0x80 | ((cp >> 6) & 0x3f);
+		buff[3] = 0x80 | (cp & 0x3f);
+		len = 4;
+	}
 
-		/*
-		 *  Process reason_phrase (if present).
-		 */
-		RINDENT();
-		if (p[3] == ' ') {
-			p += 4;
-			s -= 4;
+	return json_stream_append(js, &js->tok, &js->tok_len, buff, len);
+}
 
-			q = memchr(p, '\r', s);
-			if (!q) goto malformed;
+/** Return the boolean value of the current scalar, using the same rules as json_object_get_boolean
+ *
+ */
+static int json_stream_tok_boolean(rest_json_stream_t *js)
+{
+	switch (js->tok_type) {
+	case json_type_boolean:
+		return (js->tok[0] == 't');
 
-			len = (q - p);
+	case json_type_int:
+	case json_type_double:
+		return (strtod(js->tok, NULL) != 0);
 
-			RDEBUG2("Status : %i (%.*s)", ctx->code, (int) len, p);
-		} else {
-			RDEBUG2("Status : %i", ctx->code);
-		}
-		REXDENT();
+	case json_type_string:
+		return (js->tok_len > 0);
 
-		ctx->state = WRITE_STATE_PARSE_HEADERS;
+	default:
+		return 0;
+	}
+}
 
-		break;
+/** Add a value to the declaration currently being parsed
+ *
+ * @param[in] js decoder state.
+ * @param[in] type of the value.
+ * @param[in] value string form of the value.
+ * @param[in] len of value.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int json_stream_member_value(rest_json_stream_t *js, enum json_type type, char const *value, size_t len)
+{
+	json_stream_member_t	*member = js->member;
+	json_stream_value_t	*values;
 
-	case WRITE_STATE_PARSE_HEADERS:
-		if ((s >= 14) &&
-		    (strncasecmp("Content-Type: ", p, 14) == 0)) {
-			p += 14;
-			s -= 14;
+	/*
+	 *	Stage one more value than we're allowed to create
+	 *	so rest_decode_json_stream notices the limit.
+	 */
+	if (js->count++ > REST_BODY_MAX_ATTRS) return 0;
 
-			/*
-			 *  Check to see if there's a parameter separator.
-			 */
-			q = memchr(p, ';', s);
+	values = talloc_realloc(member, member->values, json_stream_value_t, member->num_values + 1);
+	if (!values) return -1;
+	member->values = values;
 
-			/*
-			 *  If there's not, find the end of this header.
-			 */
-			if (!q) q = memchr(p, '\r', s);
+	values[member->num_values].type = type;
+	values[member->num_values].value = (type == json_type_null) ? NULL : talloc_bstrndup(values, value, len);
+	member->num_values++;
 
-			len = !q ? s : (size_t) (q - p);
+	return 0;
+}
+
+/** Link the declaration currently being parsed into the list of staged declarations
+ *
+ */
+static int json_stream_member_done(rest_json_stream_t *js)
+{
+	*js->tail = js->member;
+	js->tail = &js->member->next;
+	js->member = NULL;
+
+	return 0;
+}
+
+/** Process a token from the tokeniser
+ *
+ * The depth of the decoder is the number of containers open around the token.
+ * For container start and end events, it's the number of containers open
+ * around the container.
+ *
+ * @param[in] js decoder state.
+ * @param[in] event to process.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int json_stream_event(rest_json_stream_t *js, json_stream_event_t event)
+{
+	REQUEST			*request = js->request;
+	json_stream_member_t	*member = js->member;
+	int			vdepth;
+
+	/*
+	 *	VP container
+	 */
+	if (js->depth == 0) {
+		if ((event == JSON_STREAM_EVENT_OBJECT_START) || (event == JSON_STREAM_EVENT_OBJECT_END)) return 0;
+
+		REDEBUG("Can't process VP container, expected JSON object, skipping...");
+		return -1;
+	}
+
+	/*
+	 *	Attribute names, and the start and end of the expanded syntax
+	 */
+	if (js->depth == 1) switch (event) {
+	case JSON_STREAM_EVENT_KEY:
+		member = talloc_zero(js, json_stream_member_t);
+		if (!member) return -1;
+
+		member->name = talloc_bstrndup(member, js->tok, js->tok_len);
+		member->do_xlat = 1;
+		js->member = member;
+		js->field = JSON_STREAM_FIELD_OTHER;
+		return 0;
+
+	case JSON_STREAM_EVENT_OBJECT_START:
+		member->expanded = true;
+		return 0;
+
+	case JSON_STREAM_EVENT_OBJECT_END:
+		return json_stream_member_done(js);
+
+	default:
+		break;
+	}
+
+	/*
+	 *	Keys of the expanded syntax.  Anything other than
+	 *	the value itself must be a scalar.
+	 */
+	if (member->expanded) {
+		if (js->depth == 2) {
+			if (event == JSON_STREAM_EVENT_KEY) {
+				js->field = fr_str2int(json_stream_field_table, js->tok, JSON_STREAM_FIELD_OTHER);
+				if (js->field == JSON_STREAM_FIELD_VALUE) {
+					TALLOC_FREE(member->values);
+					TALLOC_FREE(member->raw);
+					member->num_values = 0;
+				}
+				return 0;
+			}
+
+			if (event == JSON_STREAM_EVENT_SCALAR) switch (js->field) {
+			case JSON_STREAM_FIELD_OP:
+				talloc_free(member->op);
+				member->op = talloc_bstrndup(member, js->tok, js->tok_len);
+				return 0;
+
+			case JSON_STREAM_FIELD_DO_XLAT:
+				member->do_xlat = json_stream_tok_boolean(js);
+				return 0;
+
+			case JSON_STREAM_FIELD_IS_JSON:
+				member->is_json = json_stream_tok_boolean(js);
+				return 0;
+
+			default:
+				break;
+			}
+		}
+
+		if (js->field != JSON_STREAM_FIELD_VALUE) return 0;
+		vdepth = 2;
+	} else {
+		vdepth = 1;
+	}
+
+	/*
+	 *	The value, compound values are captured as JSON text
+	 *	in case is_json is set.
+	 */
+	if (js->depth == vdepth) switch (event) {
+	case JSON_STREAM_EVENT_SCALAR:
+		member->type = js->tok_type;
+		member->has_value = true;
+		if (json_stream_member_value(js, js->tok_type, js->tok, js->tok_len) < 0) return -1;
+
+		return member->expanded ? 0 : json_stream_member_done(js);
+
+	case JSON_STREAM_EVENT_ARRAY_START:
+	case JSON_STREAM_EVENT_OBJECT_START:
+		member->type = (event == JSON_STREAM_EVENT_ARRAY_START) ? json_type_array : json_type_object;
+		member->has_value = true;
+		js->capturing = true;
+		js->capture_len = 0;
+		return 0;
+
+	case JSON_STREAM_EVENT_ARRAY_END:
+	case JSON_STREAM_EVENT_OBJECT_END:
+		js->capture_pending = JSON_STREAM_CAPTURE_VALUE;
+		return 0;
+
+	default:
+		return 0;
+	}
+
+	/*
+	 *	Elements of a multivalued attribute
+	 */
+	if ((js->depth == (vdepth + 1)) && (member->type == json_type_array)) switch (event) {
+	case JSON_STREAM_EVENT_SCALAR:
+		return json_stream_member_value(js, js->tok_type, js->tok, js->tok_len);
+
+	case JSON_STREAM_EVENT_ARRAY_START:
+	case JSON_STREAM_EVENT_OBJECT_START:
+		js->capture_start = js->capture_len;
+		js->capture_type = (event == JSON_STREAM_EVENT_ARRAY_START) ? json_type_array : json_type_object;
+		return 0;
+
+	case JSON_STREAM_EVENT_ARRAY_END:
+	case JSON_STREAM_EVENT_OBJECT_END:
+		js->capture_pending = JSON_STREAM_CAPTURE_ELEMENT;
+		return 0;
+
+	default:
+		return 0;
+	}
+
+	return 0;
+}
+
+/** Extract captured JSON text once the byte closing a compound value has been captured
+ *
+ */
+static int json_stream_capture_done(rest_json_stream_t *js)
+{
+	json_stream_member_t	*member = js->member;
+	json_stream_capture_t	pending = js->capture_pending;
+
+	js->capture_pending = JSON_STREAM_CAPTURE_NONE;
+
+	switch (pending) {
+	case JSON_STREAM_CAPTURE_ELEMENT:
+		return json_stream_member_value(js, js->capture_type, js->capture + js->capture_start,
+						js->capture_len - js->capture_start);
+
+	case JSON_STREAM_CAPTURE_VALUE:
+		js->capturing = false;
+		member->raw = talloc_bstrndup(member, js->capture, js->capture_len);
+		if (!member->raw) return -1;
+
+		return member->expanded ? 0 : json_stream_member_done(js);
+
+	default:
+		return 0;
+	}
+}
+
+/** Signal the end of a scalar value to json_stream_event
+ *
+ */
+static int json_stream_scalar(rest_json_stream_t *js, enum json_type type)
+{
+	js->tok_type = type;
+	js->state = js->depth ? JSON_STREAM_STATE_NEXT : JSON_STREAM_STATE_DONE;
+
+	return json_stream_event(js, JSON_STREAM_EVENT_SCALAR);
+}
+
+/** Open an object or array
+ *
+ */
+static int json_stream_open(rest_json_stream_t *js, char c)
+{
+	REQUEST *request = js->request;
+
+	if (js->depth >= JSON_STREAM_MAX_DEPTH) {
+		REDEBUG("Malformed JSON data at offset %zu: Nesting exceeds %i levels",
+			js->offset, JSON_STREAM_MAX_DEPTH);
+		return -1;
+	}
+
+	if (json_stream_event(js, (c == '{') ? JSON_STREAM_EVENT_OBJECT_START : JSON_STREAM_EVENT_ARRAY_START) < 0) {
+		return -1;
+	}
+
+	js->stack[js->depth++] = c;
+	js->state = (c == '{') ? JSON_STREAM_STATE_KEY_OR_END : JSON_STREAM_STATE_VALUE_OR_END;
+
+	return 0;
+}
+
+/** Close an object or array
+ *
+ */
+static int json_stream_close(rest_json_stream_t *js, char c)
+{
+	REQUEST *request = js->request;
+
+	if (js->stack[js->depth - 1] != ((c == '}') ? '{' : '[')) {
+		REDEBUG("Malformed JSON data at offset %zu: Unexpected '%c'", js->offset, c);
+		return -1;
+	}
+
+	js->depth--;
+	js->state = js->depth ? JSON_STREAM_STATE_NEXT : JSON_STREAM_STATE_DONE;
+
+	return json_stream_event(js, (c == '}') ? JSON_STREAM_EVENT_OBJECT_END : JSON_STREAM_EVENT_ARRAY_END);
+}
+
+/** Feed a single byte of JSON data to the tokeniser
+ *
+ * @param[in] js decoder state.
+ * @param[in] c byte to process.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int json_stream_byte(rest_json_stream_t *js, char c)
+{
+	REQUEST *request = js->request;
+
+again:
+	switch (js->state) {
+	case JSON_STREAM_STATE_VALUE_OR_END:
+		if (c == ']') return json_stream_close(js, c);
+		/* FALL-THROUGH */
+
+	case JSON_STREAM_STATE_VALUE:
+		if (isspace((uint8_t) c)) return 0;
+
+		js->tok_len = 0;
+		js->tok[0] = '\0';
+		switch (c) {
+		case '{':
+		case '[':
+			return json_stream_open(js, c);
+
+		case '"':
+			js->is_key = false;
+			js->state = JSON_STREAM_STATE_STRING;
+			return 0;
+
+		default:
+			break;
+		}
+
+		if ((c == '-') || isdigit((uint8_t) c)) {
+			js->state = JSON_STREAM_STATE_NUMBER;
+		} else if (islower((uint8_t) c)) {
+			js->state = JSON_STREAM_STATE_LITERAL;
+		} else {
+			REDEBUG("Malformed JSON data at offset %zu: Expected value", js->offset);
+			return -1;
+		}
+		return json_stream_append(js, &js->tok, &js->tok_len, &c, 1);
+
+	case JSON_STREAM_STATE_KEY_OR_END:
+		if (c == '}') return json_stream_close(js, c);
+		/* FALL-THROUGH */
+
+	case JSON_STREAM_STATE_KEY:
+		if (isspace((uint8_t) c)) return 0;
+
+		if (c != '"') {
+			REDEBUG("Malformed JSON data at offset %zu: Expected key", js->offset);
+			return -1;
+		}
+		js->tok_len = 0;
+		js->tok[0] = '\0';
+		js->is_key = true;
+		js->state = JSON_STREAM_STATE_STRING;
+		return 0;
+
+	case JSON_STREAM_STATE_COLON:
+		if (isspace((uint8_t) c)) return 0;
+
+		if (c != ':') {
+			REDEBUG("Malformed JSON data at offset %zu: Expected ':'", js->offset);
+			return -1;
+		}
+		js->state = JSON_STREAM_STATE_VALUE;
+		return 0;
+
+	case JSON_STREAM_STATE_NEXT:
+		if (isspace((uint8_t) c)) return 0;
+
+		switch (c) {
+		case ',':
+			js->state = (js->stack[js->depth - 1] == '{') ? JSON_STREAM_STATE_KEY : JSON_STREAM_STATE_VALUE;
+			return 0;
+
+		case '}':
+		case ']':
+			return json_stream_close(js, c);
+
+		default:
+			REDEBUG("Malformed JSON data at offset %zu: Expected ',' or end of container", js->offset);
+			return -1;
+		}
+
+	case JSON_STREAM_STATE_STRING:
+		if (js->surrogate && (c != '\\')) goto bad_unicode;
+
+		switch (c) {
+		case '"':
+			if (js->is_key) {
+				js->state = JSON_STREAM_STATE_COLON;
+				return json_stream_event(js, JSON_STREAM_EVENT_KEY);
+			}
+			return json_stream_scalar(js, json_type_string);
+
+		case '\\':
+			js->state = JSON_STREAM_STATE_STRING_ESCAPE;
+			return 0;
+
+		default:
+			return json_stream_append(js, &js->tok, &js->tok_len, &c, 1);
+		}
+
+	case JSON_STREAM_STATE_STRING_ESCAPE:
+		if (js->surrogate && (c != 'u')) goto bad_unicode;
+
+		js->state = JSON_STREAM_STATE_STRING;
+		switch (c) {
+		case '"':
+		case '\\':
+		case '/':
+			break;
+
+		case 'b':
+			c = '\b';
+			break;
+
+		case 'f':
+			c = '\f';
+			break;
+
+		case 'n':
+			c = '\n';
+			break;
+
+		case 'r':
+			c = '\r';
+			break;
+
+		case 't':
+			c = '\t';
+			break;
+
+		case 'u':
+			js->unicode = 0;
+			js->unicode_len = 0;
+			js->state = JSON_STREAM_STATE_STRING_UNICODE;
+			return 0;
+
+		default:
+			REDEBUG("Malformed JSON data at offset %zu: Invalid escape sequence", js->offset);
+			return -1;
+		}
+		return json_stream_append(js, &js->tok, &js->tok_len, &c, 1);
+
+	case JSON_STREAM_STATE_STRING_UNICODE:
+		if (!isxdigit((uint8_t) c)) goto bad_unicode;
+
+		js->unicode = (js->unicode << 4) | (isdigit((uint8_t) c) ? (c - '0') : ((tolower((uint8_t) c) - 'a') + 10));
+		if (++js->unicode_len < 4) return 0;
+
+		js->state = JSON_STREAM_STATE_STRING;
+		if (js->surrogate) {
+			uint32_t cp;
+
+			if ((js->unicode < 0xdc00) || (js->unicode > 0xdfff)) goto bad_unicode;
+
+			cp = 0x10000 + ((js->surrogate - 0xd800) << 10) + (js->unicode - 0xdc00);
+			js->surrogate = 0;
+
+			return json_stream_tok_unicode(js, cp);
+		}
+
+		if ((js->unicode >= 0xd800) && (js->unicode <= 0xdbff)) {
+			js->surrogate = js->unicode;
+			return 0;
+		}
+		if ((js->unicode >= 0xdc00) && (js->unicode <= 0xdfff)) goto bad_unicode;
+
+		return json_stream_tok_unicode(js, js->unicode);
+
+	case JSON_STREAM_STATE_NUMBER:
+		if (isdigit((uint8_t) c) || (c == '.') || (c == 'e') || (c == 'E') || (c == '+') || (c == '-')) {
+			return json_stream_append(js, &js->tok, &js->tok_len, &c, 1);
+		}
+
+		{
+			char *q;
+
+			(void) strtod(js->tok, &q);
+			if (*q != '\0') {
+				REDEBUG("Malformed JSON data at offset %zu: Invalid number \"%s\"", js->offset, js->tok);
+				return -1;
+			}
+		}
+
+		if (json_stream_scalar(js, strpbrk(js->tok, ".eE") ? json_type_double : json_type_int) < 0) return -1;
+		goto again;
+
+	case JSON_STREAM_STATE_LITERAL:
+		if (islower((uint8_t) c)) return json_stream_append(js, &js->tok, &js->tok_len, &c, 1);
+
+		if ((strcmp(js->tok, "true") == 0) || (strcmp(js->tok, "false") == 0)) {
+			if (json_stream_scalar(js, json_type_boolean) < 0) return -1;
+		} else if (strcmp(js->tok, "null") == 0) {
+			if (json_stream_scalar(js, json_type_null) < 0) return -1;
+		} else {
+			REDEBUG("Malformed JSON data at offset %zu: Invalid literal \"%s\"", js->offset, js->tok);
+			return -1;
+		}
+		goto again;
+
+	case JSON_STREAM_STATE_DONE:
+		if (isspace((uint8_t) c)) return 0;
+
+		REDEBUG("Malformed JSON data at offset %zu: Trailing data after VP container", js->offset);
+		return -1;
+
+	case JSON_STREAM_STATE_ERROR:
+		return -1;
+	}
+
+	return 0;
+
+bad_unicode:
+	REDEBUG("Malformed JSON data at offset %zu: Invalid unicode escape sequence", js->offset);
+	return -1;
+}
+
+/** Allocate a streaming JSON decoder
+ *
+ * @param[in] request Current request.
+ * @return
+ *	- New decoder.
+ *	- NULL on error.
+ */
+static rest_json_stream_t *rest_json_stream_alloc(REQUEST *request)
+{
+	rest_json_stream_t *js;
+
+	js = talloc_zero(request, rest_json_stream_t);
+	if (!js) return NULL;
+
+	js->request = request;
+	js->tail = &js->head;
+	js->tok = talloc_array(js, char, REST_BODY_INIT);
+	if (!js->tok) {
+		talloc_free(js);
+		return NULL;
+	}
+
+	return js;
+}
+
+/** Feed incoming body data to a streaming JSON decoder
+ *
+ * Once malformed data has been found, all subsequent data is discarded, and
+ * rest_decode_json_stream will return an error.
+ *
+ * @param[in] js decoder state.
+ * @param[in] in data received from libcurl.
+ * @param[in] inlen length of data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on malformed data.
+ */
+static int rest_json_stream_write(rest_json_stream_t *js, char const *in, size_t inlen)
+{
+	char const *p, *end = in + inlen;
+
+	if (js->state == JSON_STREAM_STATE_ERROR) return -1;
+
+	for (p = in; p < end; p++, js->offset++) {
+		if (json_stream_byte(js, *p) < 0) goto error;
+
+		if (js->capturing &&
+		    (json_stream_append(js, &js->capture, &js->capture_len, p, 1) < 0)) goto error;
+
+		if (js->capture_pending && (json_stream_capture_done(js) < 0)) goto error;
+	}
+
+	return 0;
+
+error:
+	js->state = JSON_STREAM_STATE_ERROR;
+	return -1;
+}
+
+/** Converts attribute declarations staged by the streaming decoder into VALUE_PAIRs
+ *
+ * Follows the same rules as json_pair_make.
+ *
+ * @see json_pair_make
+ *
+ * @param[in] instance configuration data.
+ * @param[in] section configuration data.
+ * @param[in,out] request Current request.
+ * @param[in] js decoder state.
+ * @return
+ *	- The number of #VALUE_PAIR processed.
+ *	- -1 on unrecoverable error.
+ */
+static int rest_decode_json_stream(rlm_rest_t const *instance, rlm_rest_section_t *section,
+				   REQUEST *request, rest_json_stream_t *js)
+{
+	int			max = REST_BODY_MAX_ATTRS, max_attrs = max;
+	json_stream_member_t	*member;
+
+	switch (js->state) {
+	case JSON_STREAM_STATE_DONE:
+		break;
+
+	case JSON_STREAM_STATE_ERROR:
+		return -1;
+
+	/*
+	 *  Empty response?
+	 */
+	case JSON_STREAM_STATE_VALUE:
+		if (js->depth == 0) return 0;
+		/* FALL-THROUGH */
+
+	default:
+		REDEBUG("Malformed JSON data: Truncated after %zu bytes", js->offset);
+		return -1;
+	}
+
+	for (member = js->head; member; member = member->next) {
+		int			i, elements;
+		json_stream_value_t	*values, compound;
+		TALLOC_CTX		*ctx;
+
+		json_flags_t flags = {
+			.op = T_OP_SET,
+			.do_xlat = member->do_xlat,
+			.is_json = member->is_json
+		};
+
+		vp_tmpl_t		dst;
+		REQUEST			*current;
+		VALUE_PAIR		**vps, *vp;
+
+		RDEBUG2("Parsing attribute \"%s\"", member->name);
+
+		if (json_pair_dst(&dst, &current, &vps, &ctx, request, member->name) < 0) continue;
+
+		if (member->expanded) {
+			if (member->op) {
+				flags.op = fr_str2int(fr_tokens_table, member->op, 0);
+				if (!flags.op) {
+					RWDEBUG("Invalid operator value \"%s\", skipping...", member->op);
+					continue;
+				}
+			}
+
+			if (!member->has_value) {
+				RWDEBUG("Value key missing, skipping...");
+				continue;
+			}
+		}
+
+		/*
+		 *  Compound values are either inserted as JSON text,
+		 *  split into multiple values, or skipped.
+		 */
+		if (member->raw && (flags.is_json || (member->type == json_type_object))) {
+			compound.type = flags.is_json ? json_type_string : json_type_object;
+			compound.value = member->raw;
+			values = &compound;
+			elements = 1;
+		} else {
+			if ((member->type == json_type_array) && !member->num_values) {
+				RWDEBUG("Zero length value array, skipping...");
+				continue;
+			}
+			values = member->values;
+			elements = member->num_values;
+		}
+
+		for (i = 0; i < elements; i++) {
+			if (max_attrs-- <= 0) {
+				RWDEBUG("At maximum attribute limit");
+				return max;
+			}
+
+			/*
+			 *  Automagically switch the op for multivalued attributes.
+			 */
+			if (((flags.op == T_OP_SET) || (flags.op == T_OP_EQ)) && (i >= 1)) {
+				flags.op = T_OP_ADD;
+			}
+
+			switch (values[i].type) {
+			case json_type_object:
+				RWDEBUG("Found nested VP, these are not yet supported, skipping...");
+				continue;
+
+			case json_type_null:
+				RDEBUG3("Got null value for attribute \"%s\", skipping...", dst.tmpl_da->name);
+				continue;
+
+			default:
+				break;
+			}
+
+			vp = json_pair_make_value(instance, section, ctx, request, dst.tmpl_da, &flags, values[i].value);
+			if (!vp) continue;
+
+			rdebug_pair(2, request, vp, NULL);
+			radius_pairmove(current, vps, vp, false);
+		}
+	}
+
+	return max - max_attrs;
+}
+#endif
+
+/** Processes incoming HTTP header data from libcurl.
+ *
+ * Processes the status line, and Content-Type headers from the incoming HTTP
+ * response.
+ *
+ * Matches prototype for CURLOPT_HEADERFUNCTION, and will be called directly
+ * by libcurl.
+ *
+ * @param[in] in Char buffer where inbound header data is written.
+ * @param[in] size Multiply by nmemb to get the length of ptr.
+ * @param[in] nmemb Multiply by size to get the length of ptr.
+ * @param[in] userdata rlm_rest_response_t to keep parsing state between calls.
+ * @return
+ *	- Length of data processed.
+ *	- 0 on error.
+ */
+static size_t rest_response_header(void *in, size_t size, size_t nmemb, void *userdata)
+{
+	rlm_rest_response_t *ctx = userdata;
+	REQUEST *request = ctx->request; /* Used by RDEBUG */
+
+	char const *p = in, *q;
+
+	size_t const t = (size * nmemb);
+	size_t s = t;
+	size_t len;
+
+	http_body_type_t type;
+
+	/*
+	 *  Curl seems to throw these (\r\n) in before the next set of headers when
+	 *  looks like it's just a body separator and safe to ignore after we
+	 *  receive a 100 Continue.
+	 */
+	if (t == 2 && ((p[0] == '\r') && (p[1] == '\n'))) return t;
+
+	switch (ctx->state) {
+	case WRITE_STATE_INIT:
+		RDEBUG2("Processing response header");
+
+		/*
+		 *  HTTP/<version> <reason_code>[ <reason_phrase>]\r\n
+		 *
+		 *  "HTTP/1.1 " (8) + "100 " (4) + "\r\n" (2) = 14
+		 */
+		if (s < 14) {
+			REDEBUG("Malformed HTTP header: Status line too short");
+			goto malformed;
+		}
+		/*
+		 *  Check start of header matches...
+		 */
+		if (strncasecmp("HTTP/", p, 5) != 0) {
+			REDEBUG("Malformed HTTP header: Missing HTTP version");
+			goto malformed;
+		}
+		p += 5;
+		s -= 5;
+
+		/*
+		 *  Skip the version field, next space should mark start of reason_code.
+		 */
+		q = memchr(p, ' ', s);
+		if (!q) {
+			RDEBUG("Malformed HTTP header: Missing reason code");
+			goto malformed;
+		}
+
+		s -= (q - p);
+		p  = q;
+
+		/*
+		 *  Process reason_code.
+		 *
+		 *  " 100" (4) + "\r\n" (2) = 6
+		 */
+		if (s < 6) {
+			REDEBUG("Malformed HTTP header: Reason code too short");
+			goto malformed;
+		}
+		p++;
+		s--;
+
+		/*  Char after reason code must be a space, or \r */
+		if (!((p[3] == ' ') || (p[3] == '\r'))) goto malformed;
+
+		ctx->code = atoi(p);
+
+		/*
+		 *  Process reason_phrase (if present).
+		 */
+		RINDENT();
+		if (p[3] == ' ') {
+			p += 4;
+			s -= 4;
+
+			q = memchr(p, '\r', s);
+			if (!q) goto malformed;
+
+			len = (q - p);
+
+			RDEBUG2("Status : %i (%.*s)", ctx->code, (int) len, p);
+		} else {
+			RDEBUG2("Status : %i", ctx->code);
+		}
+		REXDENT();
+
+		ctx->state = WRITE_STATE_PARSE_HEADERS;
+
+		break;
+
+	case WRITE_STATE_PARSE_HEADERS:
+		if ((s >= 14) &&
+		    (strncasecmp("Content-Type: ", p, 14) == 0)) {
+			p += 14;
+			s -= 14;
+
+			/*
+			 *  Check to see if there's a parameter separator.
+			 */
+			q = memchr(p, ';', s);
+
+			/*
+			 *  If there's not, find the end of this header.
+			 */
+			if (!q) q = memchr(p, '\r', s);
+
+			len = !q ? s : (size_t) (q - p);
 			type = fr_substr2int(http_content_type_table, p, HTTP_BODY_UNKNOWN, len);
 
 			RINDENT();
@@ -1736,7 +2704,8 @@ malformed:
 /** Processes incoming HTTP body data from libcurl.
  *
  * Writes incoming body data to an intermediary buffer for later parsing by
- * one of the decode functions.
+ * one of the decode functions, or if streaming is enabled, passes JSON data
+ * to the streaming decoder as it arrives.
  *
  * @param[in] ptr Char buffer where inbound header data is written
  * @param[in] size Multiply by nmemb to get the length of ptr.
@@ -1763,7 +2732,26 @@ static size_t rest_response_body(void *ptr, size_t size, size_t nmemb, void *use
 	 */
 	if (ctx->state == WRITE_STATE_PARSE_HEADERS) {
 		ctx->state = WRITE_STATE_PARSE_CONTENT;
+
+#ifdef HAVE_JSON
+		/*
+		 *  Only successful responses are decoded, anything
+		 *  else is buffered so it can be printed as an error.
+		 */
+		if (ctx->stream && (ctx->type == HTTP_BODY_JSON) &&
+		    (ctx->code >= 200) && (ctx->code < 300) && (ctx->code != 204)) {
+			RDEBUG3("Decoding JSON response as it's received");
+			ctx->decoder = rest_json_stream_alloc(request);
+		}
+#endif
+	}
+
+#ifdef HAVE_JSON
+	if (ctx->decoder) {
+		(void) rest_json_stream_write(ctx->decoder, p, t);
+		return t;
 	}
+#endif
 
 	switch (ctx->type) {
 	case HTTP_BODY_UNSUPPORTED:
@@ -1827,6 +2815,12 @@ void rest_response_error(REQUEST *request, rlm_rest_handle_t *handle)
 
 	len = rest_get_handle_data(&p, handle);
 	if (len == 0) {
+		/*
+		 *  Body was consumed by the streaming decoder,
+		 *  which will already have logged any errors.
+		 */
+		if (handle->ctx->response.decoder) return;
+
 		RERROR("Server returned no data");
 		return;
 	}
@@ -1948,6 +2942,29 @@ error:
 	return -1;
 }
 
+/** Aborts the transfer if the request has timed out
+ *
+ * Matches CURL's CURLOPT_XFERINFOFUNCTION prototype, or
+ * CURLOPT_PROGRESSFUNCTION for older versions of libcurl.
+ *
+ * @param[in] userdata the rlm_rest_handle_t of the transfer.
+ * @return
+ *	- 0 to continue the transfer.
+ *	- 1 to abort it.
+ */
+#if LIBCURL_VERSION_NUM >= 0x072000
+static int rest_progress(void *userdata, UNUSED curl_off_t dltotal, UNUSED curl_off_t dlnow,
+			 UNUSED curl_off_t ultotal, UNUSED curl_off_t ulnow)
+#else
+static int rest_progress(void *userdata, UNUSED double dltotal, UNUSED double dlnow,
+			 UNUSED double ultotal, UNUSED double ulnow)
+#endif
+{
+	rlm_rest_handle_t *randle = userdata;
+
+	return randle->cancelled ? 1 : 0;
+}
+
 /** Configures request curlopts.
  *
  * Configures libcurl handle setting various curlopts for things like local
@@ -2026,6 +3043,33 @@ int rest_request_config(rlm_rest_t const *instance, rlm_rest_section_t *section,
 	SET_OPTION(CURLOPT_PROTOCOLS, (CURLPROTO_HTTP | CURLPROTO_HTTPS));
 #endif
 
+	/*
+	 *	Allow the transfer to be aborted if the request
+	 *	times out.  libcurl calls the progress callback
+	 *	at least once a second, even if nothing's happening.
+	 */
+	randle->cancelled = false;
+	SET_OPTION(CURLOPT_NOPROGRESS, 0);
+#if LIBCURL_VERSION_NUM >= 0x072000
+	SET_OPTION(CURLOPT_XFERINFOFUNCTION, rest_progress);
+	SET_OPTION(CURLOPT_XFERINFODATA, randle);
+#else
+	SET_OPTION(CURLOPT_PROGRESSFUNCTION, rest_progress);
+	SET_OPTION(CURLOPT_PROGRESSDATA, randle);
+#endif
+
+#if LIBCURL_VERSION_NUM >= 0x072f00
+	if (instance->http2) SET_OPTION(CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072b00
+	/*
+	 *	Wait for an existing connection to the server, which
+	 *	we may be able to multiplex over, rather than opening
+	 *	another one.
+	 */
+	if (instance->io && instance->http2) SET_OPTION(CURLOPT_PIPEWAIT, 1);
+#endif
+
 	/*
 	 *	FreeRADIUS custom headers
 	 */
@@ -2196,6 +3240,7 @@ int rest_request_config(rlm_rest_t const *instance, rlm_rest_section_t *section,
 	 *  Force parsing the body text as a particular encoding.
 	 */
 	ctx->response.force_to = section->force_to;
+	ctx->response.stream = section->stream;
 
 	switch (method) {
 	case HTTP_METHOD_GET:
@@ -2334,14 +3379,27 @@ error_header:
  *	- 0 on success.
  *	- -1 on failure.
  */
-int rest_request_perform(UNUSED rlm_rest_t const *instance, UNUSED rlm_rest_section_t *section,
+int rest_request_perform(rlm_rest_t const *instance, UNUSED rlm_rest_section_t *section,
 			 REQUEST *request, void *handle)
 {
 	rlm_rest_handle_t	*randle = handle;
 	CURL			*candle = randle->handle;
 	CURLcode		ret;
 
-	ret = curl_easy_perform(candle);
+	fr_connection_cancel_watch(instance->pool, request, handle);
+	if (instance->io) {
+		ret = rest_io_perform(instance->io, request, candle);
+	} else {
+		ret = curl_easy_perform(candle);
+	}
+	request_cancel_clear(request);
+
+	if (randle->cancelled) {
+		REDEBUG("Request cancelled, request timed out");
+
+		return -1;
+	}
+
 	if (ret != CURLE_OK) {
 		REDEBUG("Request failed: %i - %s", ret, curl_easy_strerror(ret));
 
@@ -2372,6 +3430,10 @@ int rest_response_decode(rlm_rest_t const *instance, rlm_rest_section_t *section
 
 	int ret = -1;	/* -Wsometimes-uninitialized */
 
+#ifdef HAVE_JSON
+	if (ctx->response.decoder) return rest_decode_json_stream(instance, section, request, ctx->response.decoder);
+#endif
+
 	if (!ctx->response.buffer) {
 		RDEBUG2("Skipping attribute processing, no valid body data received");
 		return 0;
@@ -2477,23 +3539,52 @@ size_t rest_uri_escape(UNUSED REQUEST *request, char *out, size_t outlen, char c
 	return strlen(out);
 }
 
+/** Find the start of the path component of a URI
+ *
+ * All URLs must contain at least <scheme>://<server>/
+ *
+ * @param[out] path Where to write a pointer to the start of the path.
+ * @param[in] uri to split.
+ * @return
+ *	- Length of the scheme and host portion of the URI.
+ *	- -1 if the URI is malformed.
+ */
+ssize_t rest_uri_split(char const **path, char const *uri)
+{
+	char const *p;
+
+	p = strchr(uri, ':');
+	if (!p || (*++p != '/') || (*++p != '/')) return -1;
+
+	p = strchr(p + 1, '/');
+	if (!p) return -1;
+
+	*path = p;
+
+	return p - uri;
+}
+
 /** Builds URI; performs XLAT expansions and encoding.
  *
  * Splits the URI into "http://example.org" and "/%{xlat}/query/?bar=foo"
  * Both components are expanded, but values expanded for the second component
  * are also url encoded.
  *
+ * If the URI components were compiled when the module was instantiated, the
+ * pre-compiled expansions are used, otherwise the URI is split and expanded
+ * at runtime.
+ *
  * @param[out] out Where to write the pointer to the new buffer containing the escaped URI.
  * @param[in] instance configuration data.
- * @param[in] uri configuration data.
+ * @param[in] section configuration data.
  * @param[in] request Current request
  * @return
  *	- Length of data written to buffer (excluding NULL).
  *	- < 0 if an error occurred.
  */
-ssize_t rest_uri_build(char **out, UNUSED rlm_rest_t *instance, REQUEST *request, char const *uri)
+ssize_t rest_uri_build(char **out, UNUSED rlm_rest_t *instance, rlm_rest_section_t const *section, REQUEST *request)
 {
-	char const	*p;
+	char const	*uri = section->uri;
 	char		*path_exp = NULL;
 
 	char		*scheme;
@@ -2501,23 +3592,29 @@ ssize_t rest_uri_build(char **out, UNUSED rlm_rest_t *instance, REQUEST *request
 
 	ssize_t		len;
 
-	p = uri;
+	if (section->uri_host && section->uri_path) {
+		len = radius_axlat_struct(out, request, section->uri_host, NULL, NULL);
+		if (len < 0) {
+			TALLOC_FREE(*out);
 
-	/*
-	 *  All URLs must contain at least <scheme>://<server>/
-	 */
-	p = strchr(p, ':');
-	if (!p || (*++p != '/') || (*++p != '/')) {
-		malformed:
+			return 0;
+		}
+
+		len = radius_axlat_struct(&path_exp, request, section->uri_path, rest_uri_escape, NULL);
+		if (len < 0) {
+			TALLOC_FREE(*out);
+
+			return 0;
+		}
+
+		goto finish;
+	}
+
+	len = rest_uri_split(&path, uri);
+	if (len < 0) {
 		REDEBUG("Error URI is malformed, can't find start of path");
 		return -1;
 	}
-	p = strchr(p + 1, '/');
-	if (!p) {
-		goto malformed;
-	}
-
-	len = (p - uri);
 
 	/*
 	 *  Allocate a temporary buffer to hold the first part of the URI
@@ -2525,8 +3622,6 @@ ssize_t rest_uri_build(char **out, UNUSED rlm_rest_t *instance, REQUEST *request
 	scheme = talloc_array(request, char, len + 1);
 	strlcpy(scheme, uri, len + 1);
 
-	path = (uri + len);
-
 	len = radius_axlat(out, request, scheme, NULL, NULL);
 	talloc_free(scheme);
 	if (len < 0) {
@@ -2542,6 +3637,7 @@ ssize_t rest_uri_build(char **out, UNUSED rlm_rest_t *instance, REQUEST *request
 		return 0;
 	}
 
+finish:
 	MEM(*out = talloc_strdup_append(*out, path_exp));
 	talloc_free(path_exp);
 
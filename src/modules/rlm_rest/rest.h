@@ -31,6 +31,8 @@ RCSIDH(other_h, "$Id$")
 #define CURL_NO_OLDIES 1
 #include <curl/curl.h>
 
+#include "io.h"
+
 /*
  *	The common JSON library (also tells us if we have json-c)
  */
@@ -105,6 +107,8 @@ extern const FR_NAME_NUMBER http_content_type_table[];
 typedef struct rlm_rest_section_t {
 	char const		*name;		//!< Section name.
 	char const		*uri;		//!< URI to send HTTP request to.
+	xlat_exp_t		*uri_host;	//!< Pre-compiled scheme and host portion of the URI.
+	xlat_exp_t		*uri_path;	//!< Pre-compiled path portion of the URI.
 
 	char const		*proxy;		//!< Send request via this proxy.
 
@@ -138,6 +142,8 @@ typedef struct rlm_rest_section_t {
 	struct timeval		timeout_tv;	//!< Timeout timeval.
 	long			timeout;	//!< Timeout in ms.
 	uint32_t		chunk;		//!< Max chunk-size (mainly for testing the encoders)
+	bool			stream;		//!< Decode JSON responses as they're received, instead
+						//!< of buffering the entire body.
 } rlm_rest_section_t;
 
 /*
@@ -153,6 +159,12 @@ typedef struct rlm_rest_t {
 
 	fr_connection_pool_t	*pool;		//!< Pointer to the connection pool.
 
+	bool			shared_io;	//!< Perform transfers on a shared multi handle.
+	bool			http2;		//!< Negotiate HTTP/2 with the server.
+	uint32_t		max_host_connections;	//!< Maximum connections the shared multi
+						//!< handle opens to any one host.
+	rest_io_t		*io;		//!< Shared multi handle, or NULL if not enabled.
+
 	rlm_rest_section_t	authorize;	//!< Configuration specific to authorisation.
 	rlm_rest_section_t	authenticate;	//!< Configuration specific to authentication.
 	rlm_rest_section_t	accounting;	//!< Configuration specific to accounting.
@@ -213,6 +225,7 @@ typedef struct rlm_rest_response_t {
 	int		 	code;		//!< HTTP Status Code.
 	http_body_type_t	type;		//!< HTTP Content Type.
 	http_body_type_t	force_to;	//!< Force decoding the body type as a particular encoding.
+	bool			stream;		//!< Decode JSON bodies as they're received.
 
 	void			*decoder;	//!< Decoder specific data.
 } rlm_rest_response_t;
@@ -237,6 +250,8 @@ typedef struct rlm_rest_curl_context_t {
 typedef struct rlm_rest_handle_t {
 	void			*handle;	//!< Real Handle.
 	rlm_rest_curl_context_t	*ctx;		//!< Context.
+	bool volatile		cancelled;	//!< Set by the main thread if the request times out.
+						//!< Aborts the transfer from the progress callback.
 } rlm_rest_handle_t;
 
 /*
@@ -257,6 +272,8 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *tim
 
 int mod_conn_alive(void *instance, void *handle);
 
+void mod_conn_cancel(void *instance, void *handle);
+
 /*
  *	Request processing API
  */
@@ -289,6 +306,7 @@ size_t rest_get_handle_data(char const **out, rlm_rest_handle_t *handle);
  *	Helper functions
  */
 size_t rest_uri_escape(UNUSED REQUEST *request, char *out, size_t outlen, char const *raw, UNUSED void *arg);
-ssize_t rest_uri_build(char **out, rlm_rest_t *instance, REQUEST *request, char const *uri);
+ssize_t rest_uri_split(char const **path, char const *uri);
+ssize_t rest_uri_build(char **out, rlm_rest_t *instance, rlm_rest_section_t const *section, REQUEST *request);
 ssize_t rest_uri_host_unescape(char **out, UNUSED rlm_rest_t const *mod_inst, REQUEST *request,
 			       void *handle, char const *uri);
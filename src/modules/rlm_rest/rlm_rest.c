@@ -72,6 +72,7 @@ static const CONF_PARSER section_config[] = {
 	/* Transfer configuration */
 	{ FR_CONF_OFFSET("timeout", PW_TYPE_TIMEVAL, rlm_rest_section_t, timeout_tv), .dflt = "4.0" },
 	{ FR_CONF_OFFSET("chunk", PW_TYPE_INTEGER, rlm_rest_section_t, chunk), .dflt = "0" },
+	{ FR_CONF_OFFSET("stream", PW_TYPE_BOOLEAN, rlm_rest_section_t, stream), .dflt = "no" },
 
 	/* TLS Parameters */
 	{ FR_CONF_POINTER("tls", PW_TYPE_SUBSECTION, NULL), .dflt = (void const *) tls_config },
@@ -82,6 +83,9 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("connect_uri", PW_TYPE_STRING, rlm_rest_t, connect_uri) },
 	{ FR_CONF_DEPRECATED("connect_timeout", PW_TYPE_TIMEVAL, rlm_rest_t, connect_timeout) },
 	{ FR_CONF_OFFSET("connect_proxy", PW_TYPE_STRING, rlm_rest_t, connect_proxy) },
+	{ FR_CONF_OFFSET("shared_io", PW_TYPE_BOOLEAN, rlm_rest_t, shared_io), .dflt = "no" },
+	{ FR_CONF_OFFSET("http2", PW_TYPE_BOOLEAN, rlm_rest_t, http2), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_host_connections", PW_TYPE_INTEGER, rlm_rest_t, max_host_connections), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -99,7 +103,7 @@ static int rlm_rest_perform(rlm_rest_t *instance, rlm_rest_section_t *section, v
 	 *  Build xlat'd URI, this allows REST servers to be specified by
 	 *  request attributes.
 	 */
-	uri_len = rest_uri_build(&uri, instance, request, section->uri);
+	uri_len = rest_uri_build(&uri, instance, section, request);
 	if (uri_len <= 0) return -1;
 
 	RDEBUG("Sending HTTP %s to \"%s\"", fr_int2str(http_method_table, section->method, NULL), uri);
@@ -719,6 +723,36 @@ static int parse_sub_section(CONF_SECTION *parent, rlm_rest_section_t *config, r
 		return -1;
 	}
 
+	/*
+	 *  Pre-compile the host and path components of the URI so they don't
+	 *  need to be tokenized for every request.  If we can't find the
+	 *  start of the path here (the scheme and host may come from an
+	 *  expansion), the URI is split and expanded at runtime instead.
+	 */
+	if (config->uri && *config->uri) {
+		char const	*path;
+		char		*host;
+		char const	*error;
+		ssize_t		len;
+
+		len = rest_uri_split(&path, config->uri);
+		if (len > 0) {
+			host = talloc_strndup(cs, config->uri, len);
+
+			if (xlat_compile(cs, &config->uri_host, host, &error) < 0) {
+				cf_log_err_cs(cs, "Failed parsing 'uri' host: %s", error);
+				talloc_free(host);
+				return -1;
+			}
+			talloc_free(host);
+
+			if (xlat_compile(cs, &config->uri_path, path, &error) < 0) {
+				cf_log_err_cs(cs, "Failed parsing 'uri' path: %s", error);
+				return -1;
+			}
+		}
+	}
+
 	config->method = fr_str2int(http_method_table, config->method_str, HTTP_METHOD_CUSTOM);
 	config->timeout = ((config->timeout_tv.tv_usec * 1000) + (config->timeout_tv.tv_sec / 1000));
 
@@ -859,6 +893,16 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	if (rest_init(inst) < 0) return -1;
 	inst->pool = module_connection_pool_init(conf, inst, mod_conn_create, mod_conn_alive, NULL, NULL, NULL);
 	if (!inst->pool) return -1;
+	fr_connection_pool_cancel_func(inst->pool, mod_conn_cancel);
+
+	/*
+	 *	Transfers made with handles from the pool share
+	 *	the connections of a single multi handle.
+	 */
+	if (inst->shared_io) {
+		inst->io = rest_io_alloc(inst, inst->xlat_name, inst->max_host_connections, inst->http2);
+		if (!inst->io) return -1;
+	}
 
 	return 0;
 }
@@ -871,6 +915,12 @@ static int mod_detach(void *instance)
 {
 	rlm_rest_t *inst = instance;
 
+	/*
+	 *	Stop the I/O thread before the handles it
+	 *	may be using are freed.
+	 */
+	TALLOC_FREE(inst->io);
+
 	fr_connection_pool_free(inst->pool);
 
 	/* Free any memory used by libcurl */
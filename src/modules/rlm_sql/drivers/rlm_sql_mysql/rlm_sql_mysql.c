@@ -62,11 +62,30 @@ static const FR_NAME_NUMBER server_warnings_table[] = {
 	{ NULL, 0 }
 };
 
+/*
+ *	The non-blocking API is only provided by MariaDB's client libraries.
+ */
+#ifdef MYSQL_WAIT_READ
+#  define WITH_MYSQL_ASYNC
+typedef enum {
+	MYSQL_ASYNC_IDLE = 0,			//!< No query in progress.
+	MYSQL_ASYNC_QUERY,			//!< Waiting for the query to complete.
+	MYSQL_ASYNC_STORE,			//!< Waiting for the result set.
+	MYSQL_ASYNC_NEXT			//!< Waiting for the next result set.
+} rlm_sql_mysql_async_t;
+#endif
+
 typedef struct rlm_sql_mysql_conn {
 	MYSQL		db;
 	MYSQL		*sock;
 	MYSQL_RES	*result;
 	rlm_sql_row_t	row;
+
+#ifdef WITH_MYSQL_ASYNC
+	rlm_sql_mysql_async_t	async;		//!< Which stage the current query is at.
+	bool		async_select;		//!< Whether the current query returns rows.
+	int		async_ret;		//!< Result of mysql_real_query or mysql_next_result.
+#endif
 } rlm_sql_mysql_conn_t;
 
 typedef struct rlm_sql_mysql_config {
@@ -231,6 +250,10 @@ static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *c
 	}
 #endif
 
+#ifdef WITH_MYSQL_ASYNC
+	mysql_options(&(conn->db), MYSQL_OPT_NONBLOCK, 0);
+#endif
+
 #if (MYSQL_VERSION_ID >= 40100)
 	sql_flags = CLIENT_MULTI_RESULTS | CLIENT_FOUND_ROWS;
 #else
@@ -427,6 +450,193 @@ static sql_rcode_t sql_select_query(rlm_sql_handle_t *handle, rlm_sql_config_t *
 	return rcode;
 }
 
+#ifdef CLIENT_MULTI_STATEMENTS
+/** Send multiple statements in one round trip
+ *
+ * Statements are committed as they run, so if one fails, the ones before
+ * it are still reported as successful.
+ */
+static sql_rcode_t sql_query_batch(int affected[], rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				   char const *query[], int count)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	MYSQL_RES		*result;
+	char			*buff;
+	int			i, ret;
+
+	if (!conn->sock) {
+		ERROR("rlm_sql_mysql: Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	MEM(buff = talloc_strdup(conn, ""));
+	for (i = 0; i < count; i++) MEM(buff = talloc_asprintf_append_buffer(buff, "%s;", query[i]));
+
+	ret = mysql_real_query(conn->sock, buff, talloc_array_length(buff) - 1);
+	talloc_free(buff);
+	if (ret != 0) return (sql_check_error(conn->sock, 0) == RLM_SQL_RECONNECT) ? RLM_SQL_RECONNECT : RLM_SQL_OK;
+
+	i = 0;
+	do {
+		result = mysql_store_result(conn->sock);
+		if (result) {
+			if (i < count) affected[i] = mysql_num_rows(result);
+			mysql_free_result(result);
+		} else if (mysql_field_count(conn->sock) == 0) {
+			if (i < count) affected[i] = mysql_affected_rows(conn->sock);
+		} else {
+			break;
+		}
+		i++;
+	} while ((ret = mysql_next_result(conn->sock)) == 0);
+
+	/*
+	 *	Statement i failed, and the rest weren't run.
+	 */
+	if (ret > 0) {
+		if (i < count) affected[i] = -1;
+		if (sql_check_error(conn->sock, 0) == RLM_SQL_RECONNECT) return RLM_SQL_RECONNECT;
+	}
+
+	return RLM_SQL_OK;
+}
+#endif
+
+#ifdef WITH_MYSQL_ASYNC
+static int sql_socket_fd(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_mysql_conn_t *conn = handle->conn;
+
+	if (!conn->sock) return -1;
+
+	return mysql_get_socket(conn->sock);
+}
+
+/** Advance a non-blocking query until it needs to wait, or completes
+ *
+ * @param[out] events to wait for on the socket.
+ * @param[in] conn the query is running on.
+ * @param[in] status returned by the last mysql_*_start or mysql_*_cont call.
+ * @return
+ *	- #RLM_SQL_AGAIN if the query is still in progress.
+ *	- Another #sql_rcode_t when the query has completed.
+ */
+static sql_rcode_t sql_async_process(short *events, rlm_sql_mysql_conn_t *conn, int status)
+{
+	sql_rcode_t	rcode;
+	char const	*info;
+
+	while (status == 0) switch (conn->async) {
+	case MYSQL_ASYNC_QUERY:
+		rcode = sql_check_error(conn->sock, 0);
+		if (rcode != RLM_SQL_OK) goto finish;
+
+		if (!conn->async_select) {
+			/* Only returns non-null string for INSERTS */
+			info = mysql_info(conn->sock);
+			if (info) DEBUG2("rlm_sql_mysql: %s", info);
+			goto finish;
+		}
+
+		conn->async = MYSQL_ASYNC_STORE;
+		status = mysql_store_result_start(&conn->result, conn->sock);
+		break;
+
+	/*
+	 *	Same as sql_store_result, skip over statements
+	 *	which didn't produce a result set.
+	 */
+	case MYSQL_ASYNC_STORE:
+		rcode = RLM_SQL_OK;
+		if (conn->result) goto finish;
+
+		rcode = sql_check_error(conn->sock, 0);
+		if (rcode != RLM_SQL_OK) goto finish;
+
+		conn->async = MYSQL_ASYNC_NEXT;
+		status = mysql_next_result_start(&conn->async_ret, conn->sock);
+		break;
+
+	case MYSQL_ASYNC_NEXT:
+		rcode = RLM_SQL_OK;
+		if (conn->async_ret < 0) goto finish;	/* No more results */
+		if (conn->async_ret > 0) {
+			rcode = sql_check_error(NULL, conn->async_ret);
+			goto finish;
+		}
+
+		conn->async = MYSQL_ASYNC_STORE;
+		status = mysql_store_result_start(&conn->result, conn->sock);
+		break;
+
+	default:
+		rad_assert(0);
+		return RLM_SQL_ERROR;
+	}
+
+	*events = 0;
+	if (status & MYSQL_WAIT_READ) *events |= POLLIN;
+	if (status & MYSQL_WAIT_WRITE) *events |= POLLOUT;
+	if (status & MYSQL_WAIT_EXCEPT) *events |= POLLPRI;
+
+	return RLM_SQL_AGAIN;
+
+finish:
+	conn->async = MYSQL_ASYNC_IDLE;
+
+	return rcode;
+}
+
+static sql_rcode_t sql_query_resume(short *events, rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	int			ready = 0, status;
+
+	if (*events & (POLLIN | POLLERR | POLLHUP)) ready |= MYSQL_WAIT_READ;
+	if (*events & POLLOUT) ready |= MYSQL_WAIT_WRITE;
+	if (*events & POLLPRI) ready |= MYSQL_WAIT_EXCEPT;
+
+	switch (conn->async) {
+	case MYSQL_ASYNC_QUERY:
+		status = mysql_real_query_cont(&conn->async_ret, conn->sock, ready);
+		break;
+
+	case MYSQL_ASYNC_STORE:
+		status = mysql_store_result_cont(&conn->result, conn->sock, ready);
+		break;
+
+	case MYSQL_ASYNC_NEXT:
+		status = mysql_next_result_cont(&conn->async_ret, conn->sock, ready);
+		break;
+
+	default:
+		rad_assert(0);
+		return RLM_SQL_ERROR;
+	}
+
+	return sql_async_process(events, conn, status);
+}
+
+static sql_rcode_t sql_query_submit(short *out, rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				    char const *query, bool select)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	int			status;
+
+	if (!conn->sock) {
+		ERROR("rlm_sql_mysql: Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	conn->async = MYSQL_ASYNC_QUERY;
+	conn->async_select = select;
+
+	status = mysql_real_query_start(&conn->async_ret, conn->sock, query, strlen(query));
+
+	return sql_async_process(out, conn, status);
+}
+#endif
+
 static int sql_num_rows(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
@@ -755,5 +965,13 @@ rlm_sql_module_t rlm_sql_mysql = {
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
 	.sql_finish_select_query	= sql_finish_query,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+#ifdef CLIENT_MULTI_STATEMENTS
+	.sql_query_batch		= sql_query_batch,
+#endif
+#ifdef WITH_MYSQL_ASYNC
+	.sql_socket_fd			= sql_socket_fd,
+	.sql_query_submit		= sql_query_submit,
+	.sql_query_resume		= sql_query_resume
+#endif
 };
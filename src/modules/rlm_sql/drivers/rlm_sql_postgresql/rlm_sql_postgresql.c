@@ -67,6 +67,8 @@ typedef struct rlm_sql_postgres_conn {
 	int		num_fields;
 	int		affected_rows;
 	char		**row;
+	bool		*prepared;	//!< Which statements have been prepared on this connection,
+					//!< indexed by statement ID.
 } rlm_sql_postgres_conn_t;
 
 static CONF_PARSER driver_config[] = {
@@ -286,6 +288,17 @@ static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_co
 		return -1;
 	}
 
+	/*
+	 *  Queries sent with PQsendQuery must not block, PQexec
+	 *  ignores this.
+	 */
+	if (PQsetnonblocking(conn->db, 1) != 0) {
+		ERROR("rlm_sql_postgresql: Failed setting connection to non-blocking: %s", PQerrorMessage(conn->db));
+		PQfinish(conn->db);
+		conn->db = NULL;
+		return -1;
+	}
+
 	DEBUG2("Connected to database '%s' on '%s' server version %i, protocol version %i, backend PID %i ",
 	       PQdb(conn->db), PQhost(conn->db), PQserverVersion(conn->db), PQprotocolVersion(conn->db),
 	       PQbackendPID(conn->db));
@@ -293,12 +306,12 @@ static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_co
 	return 0;
 }
 
+static sql_rcode_t sql_result_status(rlm_sql_postgres_conn_t *conn);
+
 static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
 					      char const *query)
 {
 	rlm_sql_postgres_conn_t *conn = handle->conn;
-	ExecStatusType status;
-	int numfields = 0;
 
 	if (!conn->db) {
 		ERROR("rlm_sql_postgresql: Socket not connected");
@@ -315,6 +328,17 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED r
 	 */
 	conn->result = PQexec(conn->db, query);
 
+	return sql_result_status(conn);
+}
+
+/** Determine the outcome of a query from the result returned by libpq
+ *
+ */
+static sql_rcode_t sql_result_status(rlm_sql_postgres_conn_t *conn)
+{
+	ExecStatusType status;
+	int numfields = 0;
+
 	/*
 	 *  As this error COULD be a connection error OR an out-of-memory
 	 *  condition return value WILL be wrong SOME of the time
@@ -389,6 +413,221 @@ static sql_rcode_t sql_select_query(rlm_sql_handle_t * handle, rlm_sql_config_t
 	return sql_query(handle, config, query);
 }
 
+static int sql_socket_fd(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+
+	if (!conn->db) return -1;
+
+	return PQsocket(conn->db);
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_query_resume(short *events, rlm_sql_handle_t *handle,
+						     UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	PGresult		*result;
+
+	/*
+	 *  Finish sending the query
+	 */
+	switch (PQflush(conn->db)) {
+	case 0:
+		break;
+
+	case 1:
+		*events = POLLIN | POLLOUT;
+		return RLM_SQL_AGAIN;
+
+	default:
+		ERROR("rlm_sql_postgresql: Failed sending query: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (!PQconsumeInput(conn->db)) {
+		ERROR("rlm_sql_postgresql: Failed reading query result: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	/*
+	 *  Collect results the same way PQexec does.  The last
+	 *  result is kept, unless an earlier one was an error.
+	 */
+	while (!PQisBusy(conn->db)) {
+		ExecStatusType status;
+
+		result = PQgetResult(conn->db);
+		if (!result) return sql_result_status(conn);
+
+		if (conn->result && (PQresultStatus(conn->result) == PGRES_FATAL_ERROR)) {
+			PQclear(result);
+			continue;
+		}
+
+		if (conn->result) PQclear(conn->result);
+		conn->result = result;
+
+		/*
+		 *  No more results until the copy has finished.
+		 */
+		status = PQresultStatus(result);
+		switch (status) {
+#ifdef HAVE_PGRES_COPY_BOTH
+		case PGRES_COPY_BOTH:
+#endif
+		case PGRES_COPY_OUT:
+		case PGRES_COPY_IN:
+			return sql_result_status(conn);
+
+		default:
+			break;
+		}
+	}
+
+	*events = POLLIN;
+	return RLM_SQL_AGAIN;
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_query_submit(short *out, rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+						     char const *query, UNUSED bool select)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("rlm_sql_postgresql: Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (!PQsendQuery(conn->db, query)) {
+		ERROR("rlm_sql_postgresql: Failed sending query: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	return sql_query_resume(out, handle, config);
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_query_prepared(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+							sql_statement_t const *stmt, char const *values[],
+							UNUSED bool select)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	char			name[32];
+
+	if (!conn->db) {
+		ERROR("rlm_sql_postgresql: Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	snprintf(name, sizeof(name), "freeradius_%i", stmt->id);
+
+	if ((talloc_array_length(conn->prepared) <= (size_t)stmt->id) || !conn->prepared[stmt->id]) {
+		size_t		len = talloc_array_length(conn->prepared);
+		sql_rcode_t	rcode;
+
+		if (len <= (size_t)stmt->id) {
+			MEM(conn->prepared = talloc_realloc(conn, conn->prepared, bool, stmt->id + 1));
+			memset(conn->prepared + len, 0, ((stmt->id + 1) - len) * sizeof(bool));
+		}
+
+		DEBUG2("rlm_sql_postgresql: Preparing statement %s: %s", name, stmt->query);
+
+		conn->result = PQprepare(conn->db, name, stmt->query, stmt->num_params, NULL);
+		rcode = sql_result_status(conn);
+		if (conn->result) {
+			PQclear(conn->result);
+			conn->result = NULL;
+		}
+		if (rcode != RLM_SQL_OK) return rcode;
+
+		conn->prepared[stmt->id] = true;
+	}
+
+	conn->result = PQexecPrepared(conn->db, name, stmt->num_params, values, NULL, NULL, 0);
+
+	return sql_result_status(conn);
+}
+
+/** Send multiple statements in one round trip
+ *
+ * The statements run in a single implicit transaction, so if any of them fail,
+ * none of them are committed.
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_query_batch(int affected[], rlm_sql_handle_t *handle,
+						    UNUSED rlm_sql_config_t *config, char const *query[], int count)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	PGresult		*result;
+	char			*buff;
+	bool			failed = false;
+	int			i, ret;
+
+	if (!conn->db) {
+		ERROR("rlm_sql_postgresql: Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	MEM(buff = talloc_strdup(conn, ""));
+	for (i = 0; i < count; i++) MEM(buff = talloc_asprintf_append_buffer(buff, "%s;", query[i]));
+
+	ret = PQsendQuery(conn->db, buff);
+	talloc_free(buff);
+	if (!ret) {
+		ERROR("rlm_sql_postgresql: Failed sending batch: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	/*
+	 *  The connection is non-blocking, so the batch
+	 *  may not have been sent in one go.
+	 */
+	while ((ret = PQflush(conn->db)) == 1) {
+		struct pollfd pfd = { .fd = PQsocket(conn->db), .events = POLLIN | POLLOUT };
+
+		if ((fr_fiber_poll(&pfd, 1, -1) < 0) && (errno != EINTR)) break;
+		if ((pfd.revents & POLLIN) && !PQconsumeInput(conn->db)) break;
+	}
+	if (ret != 0) {
+		ERROR("rlm_sql_postgresql: Failed sending batch: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	i = 0;
+	while ((result = PQgetResult(conn->db))) {
+		switch (PQresultStatus(result)) {
+		case PGRES_COMMAND_OK:
+			if (i < count) affected[i] = affected_rows(result);
+			break;
+
+#ifdef HAVE_PGRES_SINGLE_TUPLE
+		case PGRES_SINGLE_TUPLE:
+#endif
+		case PGRES_TUPLES_OK:
+			if (i < count) affected[i] = PQntuples(result);
+			break;
+
+		default:
+			DEBUG("rlm_sql_postgresql: Batch statement %i failed: %s", i,
+			      PQresultErrorMessage(result));
+			failed = true;
+			break;
+		}
+		PQclear(result);
+		i++;
+	}
+
+	if (PQstatus(conn->db) != CONNECTION_OK) {
+		ERROR("rlm_sql_postgresql: Connection lost sending batch: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	/*
+	 *  Everything was rolled back.
+	 */
+	if (failed) for (i = 0; i < count; i++) affected[i] = -1;
+
+	return RLM_SQL_OK;
+}
+
 static sql_rcode_t sql_fields(char const **out[], rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_postgres_conn_t *conn = handle->conn;
@@ -542,5 +781,11 @@ rlm_sql_module_t rlm_sql_postgresql = {
 	.sql_finish_query		= sql_free_result,
 	.sql_finish_select_query	= sql_free_result,
 	.sql_affected_rows		= sql_affected_rows,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+	.sql_socket_fd			= sql_socket_fd,
+	.sql_query_submit		= sql_query_submit,
+	.sql_query_resume		= sql_query_resume,
+	.sql_query_batch		= sql_query_batch,
+	.sql_placeholder		= SQL_PLACEHOLDER_DOLLAR,
+	.sql_query_prepared		= sql_query_prepared
 };
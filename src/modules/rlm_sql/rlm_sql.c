@@ -63,6 +63,8 @@ static const CONF_PARSER type_config[] = {
 static const CONF_PARSER acct_config[] = {
 	{ FR_CONF_OFFSET("reference", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sql_config_t, accounting.reference), .dflt = ".query" },
 	{ FR_CONF_OFFSET("logfile", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sql_config_t, accounting.logfile) },
+	{ FR_CONF_OFFSET("batch_size", PW_TYPE_INTEGER, rlm_sql_config_t, accounting.batch_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("batch_timeout", PW_TYPE_TIMEVAL, rlm_sql_config_t, accounting.batch_timeout), .dflt = "0.01" },
 
 	{ FR_CONF_POINTER("type", PW_TYPE_SUBSECTION, NULL), .dflt = (void const *) type_config },
 	CONF_PARSER_TERMINATOR
@@ -71,11 +73,25 @@ static const CONF_PARSER acct_config[] = {
 static const CONF_PARSER postauth_config[] = {
 	{ FR_CONF_OFFSET("reference", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sql_config_t, postauth.reference), .dflt = ".query" },
 	{ FR_CONF_OFFSET("logfile", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sql_config_t, postauth.logfile) },
+	{ FR_CONF_OFFSET("batch_size", PW_TYPE_INTEGER, rlm_sql_config_t, postauth.batch_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("batch_timeout", PW_TYPE_TIMEVAL, rlm_sql_config_t, postauth.batch_timeout), .dflt = "0.01" },
 
 	{ FR_CONF_OFFSET("query", PW_TYPE_STRING | PW_TYPE_XLAT | PW_TYPE_MULTI, rlm_sql_config_t, postauth.query) },
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER replica_config[] = {
+	{ FR_CONF_OFFSET("server", PW_TYPE_STRING, rlm_sql_config_t, read.sql_server), .dflt = "" },
+	{ FR_CONF_OFFSET("port", PW_TYPE_INTEGER, rlm_sql_config_t, read.sql_port) },
+	{ FR_CONF_OFFSET("login", PW_TYPE_STRING, rlm_sql_config_t, read.sql_login) },
+	{ FR_CONF_OFFSET("password", PW_TYPE_STRING | PW_TYPE_SECRET, rlm_sql_config_t, read.sql_password) },
+	{ FR_CONF_OFFSET("radius_db", PW_TYPE_STRING, rlm_sql_config_t, read.sql_db) },
+	{ FR_CONF_OFFSET("lag_query", PW_TYPE_STRING, rlm_sql_config_t, read.lag_query) },
+	{ FR_CONF_OFFSET("max_lag", PW_TYPE_INTEGER, rlm_sql_config_t, read.max_lag), .dflt = "5" },
+	{ FR_CONF_OFFSET("lag_check_interval", PW_TYPE_INTEGER, rlm_sql_config_t, read.lag_check_interval), .dflt = "10" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("driver", PW_TYPE_STRING, rlm_sql_config_t, sql_driver_name), .dflt = "rlm_sql_null" },
 	{ FR_CONF_OFFSET("server", PW_TYPE_STRING, rlm_sql_config_t, sql_server), .dflt = "" },	/* Must be zero length so drivers can determine if it was set */
@@ -93,16 +109,18 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("default_user_profile", PW_TYPE_STRING, rlm_sql_config_t, default_profile), .dflt = "" },
 	{ FR_CONF_OFFSET("client_query", PW_TYPE_STRING, rlm_sql_config_t, client_query), .dflt = "SELECT id,nasname,shortname,type,secret FROM nas" },
 	{ FR_CONF_OFFSET("open_query", PW_TYPE_STRING, rlm_sql_config_t, connect_query) },
+	{ FR_CONF_OFFSET("health_check_query", PW_TYPE_STRING, rlm_sql_config_t, health_check_query) },
+	{ FR_CONF_OFFSET("prepared_statements", PW_TYPE_BOOLEAN, rlm_sql_config_t, prepared_statements), .dflt = "no" },
 
-	{ FR_CONF_OFFSET("authorize_check_query", PW_TYPE_STRING | PW_TYPE_XLAT | PW_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_check_query) },
-	{ FR_CONF_OFFSET("authorize_reply_query", PW_TYPE_STRING | PW_TYPE_XLAT | PW_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_reply_query) },
+	{ FR_CONF_OFFSET("authorize_check_query", PW_TYPE_TMPL | PW_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_check_query) },
+	{ FR_CONF_OFFSET("authorize_reply_query", PW_TYPE_TMPL | PW_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_reply_query) },
 
-	{ FR_CONF_OFFSET("authorize_group_check_query", PW_TYPE_STRING | PW_TYPE_XLAT | PW_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_group_check_query) },
-	{ FR_CONF_OFFSET("authorize_group_reply_query", PW_TYPE_STRING | PW_TYPE_XLAT | PW_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_group_reply_query) },
-	{ FR_CONF_OFFSET("group_membership_query", PW_TYPE_STRING | PW_TYPE_XLAT | PW_TYPE_NOT_EMPTY, rlm_sql_config_t, groupmemb_query) },
+	{ FR_CONF_OFFSET("authorize_group_check_query", PW_TYPE_TMPL | PW_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_group_check_query) },
+	{ FR_CONF_OFFSET("authorize_group_reply_query", PW_TYPE_TMPL | PW_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_group_reply_query) },
+	{ FR_CONF_OFFSET("group_membership_query", PW_TYPE_TMPL | PW_TYPE_NOT_EMPTY, rlm_sql_config_t, groupmemb_query) },
 #ifdef WITH_SESSION_MGMT
-	{ FR_CONF_OFFSET("simul_count_query", PW_TYPE_STRING | PW_TYPE_XLAT | PW_TYPE_NOT_EMPTY, rlm_sql_config_t, simul_count_query) },
-	{ FR_CONF_OFFSET("simul_verify_query", PW_TYPE_STRING | PW_TYPE_XLAT | PW_TYPE_NOT_EMPTY, rlm_sql_config_t, simul_verify_query) },
+	{ FR_CONF_OFFSET("simul_count_query", PW_TYPE_TMPL | PW_TYPE_NOT_EMPTY, rlm_sql_config_t, simul_count_query) },
+	{ FR_CONF_OFFSET("simul_verify_query", PW_TYPE_TMPL | PW_TYPE_NOT_EMPTY, rlm_sql_config_t, simul_verify_query) },
 #endif
 	{ FR_CONF_OFFSET("safe_characters", PW_TYPE_STRING, rlm_sql_config_t, allowed_chars), .dflt = "@abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-_: /" },
 
@@ -114,6 +132,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_POINTER("accounting", PW_TYPE_SUBSECTION, NULL), .dflt = (void const *) acct_config },
 
 	{ FR_CONF_POINTER("post-auth", PW_TYPE_SUBSECTION, NULL), .dflt = (void const *) postauth_config },
+
+	{ FR_CONF_POINTER("read", PW_TYPE_SUBSECTION, NULL), .dflt = (void const *) replica_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -149,6 +169,7 @@ static ssize_t sql_xlat(char **out, UNUSED size_t outlen,
 	rlm_sql_t const		*inst = mod_inst;
 	sql_rcode_t		rcode;
 	ssize_t			ret = 0;
+	bool			write;
 
 	/*
 	 *	Add SQL-User-Name attribute just in case it is needed
@@ -157,18 +178,21 @@ static ssize_t sql_xlat(char **out, UNUSED size_t outlen,
 	 */
 	sql_set_user(inst, request, NULL);
 
-	handle = fr_connection_get(inst->pool);	/* connection pool should produce error */
-	if (!handle) return 0;
-
-	rlm_sql_query_log(inst, request, NULL, fmt);
-
 	/*
 	 *	If the query starts with any of the following prefixes,
-	 *	then return the number of rows affected
+	 *	then return the number of rows affected.  Anything else
+	 *	can be answered by the read replica.
 	 */
-	if ((strncasecmp(fmt, "insert", 6) == 0) ||
-	    (strncasecmp(fmt, "update", 6) == 0) ||
-	    (strncasecmp(fmt, "delete", 6) == 0)) {
+	write = ((strncasecmp(fmt, "insert", 6) == 0) ||
+		 (strncasecmp(fmt, "update", 6) == 0) ||
+		 (strncasecmp(fmt, "delete", 6) == 0));
+
+	handle = write ? fr_connection_get(inst->pool) : rlm_sql_read_handle_get(inst, request);
+	if (!handle) return 0;	/* connection pool should produce error */
+
+	rlm_sql_query_log(inst, request, NULL, fmt);
+
+	if (write) {
 		int numaffected;
 
 		rcode = rlm_sql_query(inst, request, &handle, fmt);
@@ -226,7 +250,7 @@ static ssize_t sql_xlat(char **out, UNUSED size_t outlen,
 	(inst->module->sql_finish_select_query)(handle, inst->config);
 
 finish:
-	fr_connection_release(inst->pool, handle);
+	rlm_sql_handle_release(inst, handle);
 
 	return ret;
 }
@@ -317,7 +341,7 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 	 */
 	sql_set_user(inst, request, NULL);
 
-	handle = fr_connection_get(inst->pool);		/* connection pool should produce error */
+	handle = rlm_sql_read_handle_get(inst, request);		/* connection pool should produce error */
 	if (!handle) return 0;
 
 	rlm_sql_query_log(inst, request, NULL, query);
@@ -406,7 +430,7 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 
 finish:
 	talloc_free(fields);
-	fr_connection_release(inst->pool, handle);
+	rlm_sql_handle_release(inst, handle);
 
 	return rcode;
 }
@@ -507,9 +531,27 @@ static size_t sql_escape_func(UNUSED REQUEST *request, char *out, size_t outlen,
 	rlm_sql_handle_t	*handle = arg;
 	rlm_sql_t		*inst = handle->inst;
 	size_t			len = 0;
+	char const		*end = in + strlen(in);
 
 	while (in[0]) {
-		size_t utf8_len;
+		size_t utf8_len, safe;
+
+		/*
+		 *	Copy runs of allowed characters in one go.
+		 */
+		safe = fr_str_span(&inst->escape_set, (uint8_t const *) in, end - in);
+		if (safe) {
+			if (outlen <= 1) break;
+
+			if (safe >= outlen) safe = outlen - 1;
+			memcpy(out, in, safe);
+			in += safe;
+			out += safe;
+
+			outlen -= safe;
+			len += safe;
+			continue;
+		}
 
 		/*
 		 *	Allow all multi-byte UTF8 characters.
@@ -692,8 +734,8 @@ static int sql_get_grouplist(rlm_sql_t *inst, rlm_sql_handle_t **handle, REQUEST
 
 	entry = *phead = NULL;
 
-	if (!inst->config->groupmemb_query || !*inst->config->groupmemb_query) return 0;
-	if (radius_axlat(&expanded, request, inst->config->groupmemb_query, inst->sql_escape_func, *handle) < 0) return -1;
+	if (!inst->config->groupmemb_query) return 0;
+	if (tmpl_aexpand(request, &expanded, request, inst->config->groupmemb_query, inst->sql_escape_func, *handle) < 0) return -1;
 
 	ret = rlm_sql_select_query(inst, request, handle, expanded);
 	talloc_free(expanded);
@@ -772,7 +814,7 @@ static int sql_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req
 	/*
 	 *	Get a socket for this lookup
 	 */
-	handle = fr_connection_get(inst->pool);
+	handle = rlm_sql_read_handle_get(inst, request);
 	if (!handle) {
 		return 1;
 	}
@@ -782,7 +824,7 @@ static int sql_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req
 	 */
 	if (sql_get_grouplist(inst, &handle, request, &head) < 0) {
 		REDEBUG("Error getting group membership");
-		fr_connection_release(inst->pool, handle);
+		rlm_sql_handle_release(inst, handle);
 		return 1;
 	}
 
@@ -791,14 +833,14 @@ static int sql_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req
 			RDEBUG("sql_groupcmp finished: User is a member of group %s",
 			       check->vp_strvalue);
 			talloc_free(head);
-			fr_connection_release(inst->pool, handle);
+			rlm_sql_handle_release(inst, handle);
 			return 0;
 		}
 	}
 
 	/* Free the grouplist */
 	talloc_free(head);
-	fr_connection_release(inst->pool, handle);
+	rlm_sql_handle_release(inst, handle);
 
 	RDEBUG("sql_groupcmp finished: User is NOT a member of group %s", check->vp_strvalue);
 
@@ -813,6 +855,7 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm
 	rlm_sql_grouplist_t	*head = NULL, *entry = NULL;
 
 	char			*expanded = NULL;
+	sql_statement_t const	*stmt;
 	int			rows;
 
 	rad_assert(request->packet != NULL);
@@ -871,14 +914,15 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm
 			/*
 			 *	Expand the group query
 			 */
-			if (radius_axlat(&expanded, request, inst->config->authorize_group_check_query,
-					 inst->sql_escape_func, *handle) < 0) {
+			stmt = rlm_sql_statement(inst, inst->config->authorize_group_check_query->name);
+			if (!stmt && (tmpl_aexpand(request, &expanded, request, inst->config->authorize_group_check_query,
+						   inst->sql_escape_func, *handle) < 0)) {
 				REDEBUG("Error generating query");
 				rcode = RLM_MODULE_FAIL;
 				goto finish;
 			}
 
-			rows = sql_getvpdata(request, inst, request, handle, &check_tmp, expanded);
+			rows = sql_getvpdata(request, inst, request, handle, &check_tmp, stmt, expanded);
 			TALLOC_FREE(expanded);
 			if (rows < 0) {
 				REDEBUG("Error retrieving check pairs for group %s", entry->name);
@@ -921,14 +965,15 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm
 			/*
 			 *	Now get the reply pairs since the paircompare matched
 			 */
-			if (radius_axlat(&expanded, request, inst->config->authorize_group_reply_query,
-					 inst->sql_escape_func, *handle) < 0) {
+			stmt = rlm_sql_statement(inst, inst->config->authorize_group_reply_query->name);
+			if (!stmt && (tmpl_aexpand(request, &expanded, request, inst->config->authorize_group_reply_query,
+						   inst->sql_escape_func, *handle) < 0)) {
 				REDEBUG("Error generating query");
 				rcode = RLM_MODULE_FAIL;
 				goto finish;
 			}
 
-			rows = sql_getvpdata(request->reply, inst, request, handle, &reply_tmp, expanded);
+			rows = sql_getvpdata(request->reply, inst, request, handle, &reply_tmp, stmt, expanded);
 			TALLOC_FREE(expanded);
 			if (rows < 0) {
 				REDEBUG("Error retrieving reply pairs for group %s", entry->name);
@@ -968,6 +1013,7 @@ static int mod_detach(void *instance)
 {
 	rlm_sql_t *inst = instance;
 
+	if (inst->read_pool) fr_connection_pool_free(inst->read_pool);
 	if (inst->pool) fr_connection_pool_free(inst->pool);
 
 	/*
@@ -1023,7 +1069,11 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 	INFO("rlm_sql (%s): Driver %s (module %s) loaded and linked", inst->name,
 	     inst->config->sql_driver_name, inst->module->name);
 
-	if (inst->config->groupmemb_query) {
+	/*
+	 *	Templates aren't compiled until instantiation, so check
+	 *	the raw config item to see if group checks are enabled.
+	 */
+	if (cf_pair_find(conf, "group_membership_query")) {
 		char buffer[256];
 
 		char const *group_attribute;
@@ -1117,6 +1167,25 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	inst->config->postauth.cs = cf_section_sub_find(conf, "post-auth");
 	inst->config->postauth.reference_cp = (cf_pair_find(inst->config->postauth.cs, "reference") != NULL);
 
+	/*
+	 *	The replica shares everything with the primary except
+	 *	where to connect to, and who to connect as.
+	 */
+	inst->config->read.cs = cf_section_sub_find(conf, "read");
+	if (inst->config->read.sql_server[0] != '\0') {
+		rlm_sql_config_t *read_config;
+
+		MEM(read_config = talloc_memdup(inst, inst->config, sizeof(*read_config)));
+		read_config->sql_server = inst->config->read.sql_server;
+		if (inst->config->read.sql_port) read_config->sql_port = inst->config->read.sql_port;
+		if (inst->config->read.sql_login) read_config->sql_login = inst->config->read.sql_login;
+		if (inst->config->read.sql_password) read_config->sql_password = inst->config->read.sql_password;
+		if (inst->config->read.sql_db) read_config->sql_db = inst->config->read.sql_db;
+		read_config->driver = NULL;
+
+		inst->read_config = read_config;
+	}
+
 	/*
 	 *	Cache the SQL-User-Name fr_dict_attr_t, so we can be slightly
 	 *	more efficient about creating SQL-User-Name attributes.
@@ -1159,6 +1228,14 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		if (inst->module->mod_instantiate(cs, inst->config) < 0) {
 			return -1;
 		}
+
+		/*
+		 *	Drivers may precompute connection strings, so
+		 *	the replica needs its own driver configuration.
+		 */
+		if (inst->read_config && (inst->module->mod_instantiate(cs, inst->read_config) < 0)) {
+			return -1;
+		}
 	}
 
 	/*
@@ -1169,6 +1246,11 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 				inst->module->sql_escape_func :
 				sql_escape_func;
 
+	if (fr_str_set_table(inst, &inst->escape_set, inst->config->allowed_chars) < 0) {
+		cf_log_err_cs(conf, "Failed creating escape table");
+		return -1;
+	}
+
 	inst->ef = exfile_init(inst, 64, 30, true);
 	if (!inst->ef) {
 		cf_log_err_cs(conf, "Failed creating log file context");
@@ -1180,9 +1262,39 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	 */
 	INFO("rlm_sql (%s): Attempting to connect to database \"%s\"", inst->name, inst->config->sql_db);
 
-	inst->pool = module_connection_pool_init(inst->cs, inst, mod_conn_create, NULL, NULL, NULL, NULL);
+	inst->pool = module_connection_pool_init(inst->cs, inst, mod_conn_create,
+						 inst->config->health_check_query ? mod_conn_alive : NULL,
+						 NULL, NULL, NULL);
 	if (!inst->pool) return -1;
 
+	if (inst->read_config) {
+		char *log_prefix;
+
+		INFO("rlm_sql (%s): Attempting to connect to replica \"%s\" on \"%s\"",
+		     inst->name, inst->read_config->sql_db, inst->read_config->sql_server);
+
+		log_prefix = talloc_asprintf(inst, "rlm_sql (%s) read", inst->name);
+		inst->read_pool = module_connection_pool_init(inst->config->read.cs, inst, mod_read_conn_create,
+							      inst->config->health_check_query ? mod_conn_alive : NULL,
+							      log_prefix, "modules.sql.read.pool", NULL);
+		talloc_free(log_prefix);
+		if (!inst->read_pool) return -1;
+	}
+
+	/*
+	 *	Queries can be aborted if the request times out, as
+	 *	long as we can get at the driver's socket.
+	 */
+	if (inst->module->sql_socket_fd) {
+		fr_connection_pool_cancel_func(inst->pool, mod_conn_cancel);
+		if (inst->read_pool) fr_connection_pool_cancel_func(inst->read_pool, mod_conn_cancel);
+	}
+
+	if (rlm_sql_statement_init(inst) < 0) return -1;
+
+	if ((rlm_sql_batch_init(inst, &inst->config->accounting) < 0) ||
+	    (rlm_sql_batch_init(inst, &inst->config->postauth) < 0)) return -1;
+
 	if (inst->config->do_clients) {
 		if (generate_sql_clients(inst) == -1){
 			ERROR("Failed to load clients from SQL");
@@ -1212,6 +1324,7 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 	int	rows;
 
 	char	*expanded = NULL;
+	sql_statement_t const *stmt;
 
 	rad_assert(request->packet != NULL);
 	rad_assert(request->reply != NULL);
@@ -1236,7 +1349,7 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 	 *	After this point use goto error or goto release to cleanup socket temporary pairlists and
 	 *	temporary attributes.
 	 */
-	handle = fr_connection_get(inst->pool);
+	handle = rlm_sql_read_handle_get(inst, request);
 	if (!handle) {
 		rcode = RLM_MODULE_FAIL;
 		goto error;
@@ -1249,14 +1362,15 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 		vp_cursor_t cursor;
 		VALUE_PAIR *vp;
 
-		if (radius_axlat(&expanded, request, inst->config->authorize_check_query,
-				 inst->sql_escape_func, handle) < 0) {
+		stmt = rlm_sql_statement(inst, inst->config->authorize_check_query->name);
+		if (!stmt && (tmpl_aexpand(request, &expanded, request, inst->config->authorize_check_query,
+					   inst->sql_escape_func, handle) < 0)) {
 			REDEBUG("Error generating query");
 			rcode = RLM_MODULE_FAIL;
 			goto error;
 		}
 
-		rows = sql_getvpdata(request, inst, request, &handle, &check_tmp, expanded);
+		rows = sql_getvpdata(request, inst, request, &handle, &check_tmp, stmt, expanded);
 		TALLOC_FREE(expanded);
 		if (rows < 0) {
 			REDEBUG("Error getting check attributes");
@@ -1297,14 +1411,15 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 		/*
 		 *	Now get the reply pairs since the paircompare matched
 		 */
-		if (radius_axlat(&expanded, request, inst->config->authorize_reply_query,
-				 inst->sql_escape_func, handle) < 0) {
+		stmt = rlm_sql_statement(inst, inst->config->authorize_reply_query->name);
+		if (!stmt && (tmpl_aexpand(request, &expanded, request, inst->config->authorize_reply_query,
+					   inst->sql_escape_func, handle) < 0)) {
 			REDEBUG("Error generating query");
 			rcode = RLM_MODULE_FAIL;
 			goto error;
 		}
 
-		rows = sql_getvpdata(request->reply, inst, request, &handle, &reply_tmp, expanded);
+		rows = sql_getvpdata(request->reply, inst, request, &handle, &reply_tmp, stmt, expanded);
 		TALLOC_FREE(expanded);
 		if (rows < 0) {
 			REDEBUG("SQL query error getting reply attributes");
@@ -1429,7 +1544,7 @@ release:
 		rcode = RLM_MODULE_NOTFOUND;
 	}
 
-	fr_connection_release(inst->pool, handle);
+	rlm_sql_handle_release(inst, handle);
 	sql_unset_user(inst, request);
 
 	return rcode;
@@ -1439,7 +1554,7 @@ error:
 	fr_pair_list_free(&reply_tmp);
 	sql_unset_user(inst, request);
 
-	fr_connection_release(inst->pool, handle);
+	rlm_sql_handle_release(inst, handle);
 
 	return rcode;
 }
@@ -1470,6 +1585,8 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t
 	char			path[FR_MAX_STRING_LEN];
 	char			*p = path;
 	char			*expanded = NULL;
+	sql_statement_t const	*stmt;
+	bool			batch = (section->batch != NULL);
 
 	rad_assert(section);
 
@@ -1524,23 +1641,63 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t
 			goto finish;
 		}
 
-		if (radius_axlat(&expanded, request, value, inst->sql_escape_func, handle) < 0) {
-			rcode = RLM_MODULE_FAIL;
+		/*
+		 *  Logged queries need to be expanded in full.
+		 */
+		stmt = NULL;
+		if (!batch && !section->logfile && !inst->config->logfile) stmt = rlm_sql_statement(inst, value);
 
-			goto finish;
-		}
+		if (!stmt) {
+			if (radius_axlat(&expanded, request, value, inst->sql_escape_func, handle) < 0) {
+				rcode = RLM_MODULE_FAIL;
 
-		if (!*expanded) {
-			RDEBUG("Ignoring null query");
-			rcode = RLM_MODULE_NOOP;
-			talloc_free(expanded);
+				goto finish;
+			}
 
-			goto finish;
+			if (!*expanded) {
+				RDEBUG("Ignoring null query");
+				rcode = RLM_MODULE_NOOP;
+				talloc_free(expanded);
+
+				goto finish;
+			}
+
+			rlm_sql_query_log(inst, request, section, expanded);
 		}
 
-		rlm_sql_query_log(inst, request, section, expanded);
+		/*
+		 *  Only the first query is batched.  If it fails, or
+		 *  doesn't update anything, we continue as normal.
+		 */
+		if (batch) {
+			batch = false;
+
+			numaffected = rlm_sql_batch_query(inst, request, section, &handle, expanded);
+			if (numaffected > 0) {
+				RDEBUG("%i record(s) updated", numaffected);
+				break;
+			}
+
+			if (!handle) {
+				rcode = RLM_MODULE_FAIL;
+
+				goto finish;
+			}
+
+			/*
+			 *  Ran, but didn't update anything.
+			 */
+			if (numaffected == 0) {
+				TALLOC_FREE(expanded);
+				goto next;
+			}
+		}
 
-		sql_ret = rlm_sql_query(inst, request, &handle, expanded);
+		if (stmt) {
+			sql_ret = rlm_sql_statement_query(inst, request, &handle, stmt, false);
+		} else {
+			sql_ret = rlm_sql_query(inst, request, &handle, expanded);
+		}
 		TALLOC_FREE(expanded);
 		RDEBUG("SQL query returned: %s", fr_int2str(sql_rcode_table, sql_ret, "<INVALID>"));
 
@@ -1681,7 +1838,7 @@ static rlm_rcode_t mod_checksimul(void *instance, REQUEST * request)
 		return RLM_MODULE_FAIL;
 	}
 
-	if (radius_axlat(&expanded, request, inst->config->simul_count_query, inst->sql_escape_func, handle) < 0) {
+	if (tmpl_aexpand(request, &expanded, request, inst->config->simul_count_query, inst->sql_escape_func, handle) < 0) {
 		fr_connection_release(inst->pool, handle);
 		sql_unset_user(inst, request);
 		return RLM_MODULE_FAIL;
@@ -1722,7 +1879,7 @@ static rlm_rcode_t mod_checksimul(void *instance, REQUEST * request)
 		goto finish;
 	}
 
-	if (radius_axlat(&expanded, request, inst->config->simul_verify_query, inst->sql_escape_func, handle) < 0) {
+	if (tmpl_aexpand(request, &expanded, request, inst->config->simul_verify_query, inst->sql_escape_func, handle) < 0) {
 		rcode = RLM_MODULE_FAIL;
 
 		goto finish;
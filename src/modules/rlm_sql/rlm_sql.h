@@ -33,6 +33,9 @@ RCSIDH(rlm_sql_h, "$Id$")
 #include <freeradius-devel/connection.h>
 #include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/exfile.h>
+#include <freeradius-devel/str.h>
+
+#include <poll.h>
 
 #define MOD_PREFIX "rlm_sql"
 
@@ -46,7 +49,8 @@ typedef enum {
 	RLM_SQL_ERROR = -2,		//!< General connection/server error
 	RLM_SQL_OK = 0,			//!< Success
 	RLM_SQL_RECONNECT = 1,		//!< Stale connection, should reconnect
-	RLM_SQL_ALT_QUERY = 2		//!< Key constraint violation
+	RLM_SQL_ALT_QUERY = 2,		//!< Key constraint violation
+	RLM_SQL_AGAIN = 3		//!< Query in progress, wait for the socket
 } sql_rcode_t;
 
 typedef enum {
@@ -55,6 +59,11 @@ typedef enum {
 	FALL_THROUGH_NO
 } sql_fall_through_t;
 
+typedef enum {
+	SQL_PLACEHOLDER_QUESTION = 0,	//!< Parameters are "?", e.g. MySQL, SQLite, ODBC.
+	SQL_PLACEHOLDER_DOLLAR		//!< Parameters are numbered from 1, "$1", "$2" etc. e.g. PostgreSQL.
+} sql_placeholder_t;
+
 
 typedef char **rlm_sql_row_t;
 
@@ -63,6 +72,23 @@ typedef struct sql_log_entry {
 	char const	*msg;		//!< Log message.
 } sql_log_entry_t;
 
+typedef struct sql_batch sql_batch_t;
+typedef struct sql_statement_cache sql_statement_cache_t;
+
+/** A query template converted to a statement with parameters
+ *
+ */
+typedef struct sql_statement {
+	int			id;				//!< Unique within the instance.  Used by drivers
+								//!< to find the statement's handle on a connection.
+	char const		*fmt;				//!< Query template the statement was created from.
+	char const		*query;				//!< Query with placeholders for parameters.
+	char const		**param;			//!< xlat format of each parameter.
+	vp_tmpl_t		**param_vpt;			//!< Parameters which are a single attribute
+								//!< reference, or NULL.
+	int			num_params;			//!< Number of parameters.
+} sql_statement_t;
+
 /*
  * Sections where we dynamically resolve the config entry to use,
  * by xlating reference.
@@ -78,8 +104,31 @@ typedef struct sql_acct_section {
 	char const		*logfile;
 
 	char const		**query;			/* for xlat parsing */
+
+	uint32_t		batch_size;			//!< Maximum number of queries to send
+								//!< in one round trip.
+	struct timeval		batch_timeout;			//!< How long to wait for a batch to fill.
+	sql_batch_t		*batch;				//!< Queries waiting to be sent.
 } sql_acct_section_t;
 
+/*
+ *	Read replica which authorize and xlat SELECTs are sent to.
+ */
+typedef struct sql_read_section {
+	CONF_SECTION		*cs;				//!< The "read" subsection.
+
+	char const 		*sql_server;			//!< Replica to connect to, if empty
+								//!< all queries go to the primary.
+	uint32_t 		sql_port;			//!< Port to connect to.
+	char const 		*sql_login;			//!< Login credentials to use.
+	char const 		*sql_password;			//!< Login password to use.
+	char const 		*sql_db;			//!< Database to run queries against.
+
+	char const		*lag_query;			//!< Returns replication lag in seconds.
+	uint32_t		max_lag;			//!< Lag above which the primary is used instead.
+	uint32_t		lag_check_interval;		//!< How often to run lag_query on a connection.
+} sql_read_section_t;
+
 typedef struct sql_config {
 	char const 		*sql_driver_name;		//!< SQL driver module name e.g. rlm_sql_sqlite.
 	char const 		*sql_server;			//!< Server to connect to.
@@ -99,15 +148,15 @@ typedef struct sql_config {
 	char const		*client_query;			//!< Query used to get FreeRADIUS client
 								//!< definitions.
 
-	char const		*authorize_check_query;		//!< Query used get check VPs for a user.
-	char const 		*authorize_reply_query;		//!< Query used get reply VPs for a user.
-	char const		*authorize_group_check_query;	//!< Query used get check VPs for a group.
-	char const		*authorize_group_reply_query;	//!< Query used get reply VPs for a group.
-	char const		*simul_count_query;		//!< Query used get number of active sessions
+	vp_tmpl_t		*authorize_check_query;		//!< Query used get check VPs for a user.
+	vp_tmpl_t 		*authorize_reply_query;		//!< Query used get reply VPs for a user.
+	vp_tmpl_t		*authorize_group_check_query;	//!< Query used get check VPs for a group.
+	vp_tmpl_t		*authorize_group_reply_query;	//!< Query used get reply VPs for a group.
+	vp_tmpl_t		*simul_count_query;		//!< Query used get number of active sessions
 								//!< for a user (basic simultaneous use check).
-	char const		*simul_verify_query;		//!< Query to get active sessions for a user
+	vp_tmpl_t		*simul_verify_query;		//!< Query to get active sessions for a user
 								//!< the result is fed to session_zap.
-	char const 		*groupmemb_query;		//!< Query to determine group membership.
+	vp_tmpl_t 		*groupmemb_query;		//!< Query to determine group membership.
 
 	bool			do_clients;			//!< Read clients from SQL database.
 	bool			read_groups;			//!< Read user groups by default.
@@ -131,6 +180,10 @@ typedef struct sql_config {
 
 	char const		*connect_query;			//!< Query executed after establishing
 								//!< new connection.
+	char const		*health_check_query;		//!< Query executed to check idle connections.
+
+	bool			prepared_statements;		//!< Send queries as prepared statements where
+								//!< the driver supports them.
 
 	void			*driver;			//!< Where drivers should write a
 								//!< pointer to their configurations.
@@ -145,6 +198,8 @@ typedef struct sql_config {
 	 */
 	sql_acct_section_t	postauth;
 	sql_acct_section_t	accounting;
+
+	sql_read_section_t	read;
 } rlm_sql_config_t;
 
 typedef struct sql_inst rlm_sql_t;
@@ -155,6 +210,10 @@ typedef struct rlm_sql_handle {
 	rlm_sql_t		*inst;				//!< The rlm_sql instance this connection belongs to.
 	TALLOC_CTX		*log_ctx;			//!< Talloc pool used to avoid mallocing memory on
 								//!< when log strings need to be copied.
+
+	bool			replica;			//!< Connection belongs to the read pool.
+	bool			lagging;			//!< Replica was too far behind at the last check.
+	time_t			lag_checked;			//!< When replication lag was last checked.
 } rlm_sql_handle_t;
 
 extern const FR_NAME_NUMBER sql_rcode_table[];
@@ -187,6 +246,40 @@ extern const FR_NAME_NUMBER sql_rcode_table[];
 typedef size_t (*sql_error_t)(TALLOC_CTX *ctx, sql_log_entry_t out[], size_t outlen, rlm_sql_handle_t *handle,
 			      rlm_sql_config_t *config);
 
+/** Send a query to the server without waiting for the result
+ *
+ * If the query can't be completed immediately the driver returns #RLM_SQL_AGAIN, and
+ * the caller waits for the events in out on the socket returned by sql_socket_fd,
+ * before calling sql_query_resume.
+ *
+ * Any other return code is the result of the query, as if sql_query or sql_select_query
+ * had been called.
+ *
+ * @param[out] out poll events (POLLIN, POLLOUT) to wait for before resuming the query.
+ * @param[in] handle to send the query on.
+ * @param[in] config of the SQL instance.
+ * @param[in] query to send.
+ * @param[in] select if true, the query returns rows, and the result set should be available
+ *	to sql_fetch_row when the query completes.
+ * @return
+ *	- #RLM_SQL_AGAIN if the query is still in progress.
+ *	- Another #sql_rcode_t when the query has completed.
+ */
+typedef sql_rcode_t (*sql_query_submit_t)(short *out, rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					  char const *query, bool select);
+
+/** Continue a query started with sql_query_submit
+ *
+ * @param[in,out] events which were signalled on the socket, is overwritten with the
+ *	events to wait for if the query is still in progress.
+ * @param[in] handle the query is running on.
+ * @param[in] config of the SQL instance.
+ * @return
+ *	- #RLM_SQL_AGAIN if the query is still in progress.
+ *	- Another #sql_rcode_t when the query has completed.
+ */
+typedef sql_rcode_t (*sql_query_resume_t)(short *events, rlm_sql_handle_t *handle, rlm_sql_config_t *config);
+
 typedef struct rlm_sql_module_t {
 	char const	*name;
 	int		flags;
@@ -213,12 +306,40 @@ typedef struct rlm_sql_module_t {
 	sql_rcode_t (*sql_finish_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 
 	xlat_escape_t	sql_escape_func;
+
+	/*
+	 *	Optional non-blocking interface.  If provided, used in
+	 *	preference to sql_query and sql_select_query.
+	 */
+	int		(*sql_socket_fd)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
+	sql_query_submit_t	sql_query_submit;		//!< Start a query.
+	sql_query_resume_t	sql_query_resume;		//!< Continue a query when the socket is ready.
+
+	/*
+	 *	Optional, run multiple statements in one round trip.
+	 *	affected[i] must be set to the number of rows affected
+	 *	by query[i], or left at -1 if it failed, or was not
+	 *	committed.
+	 */
+	sql_rcode_t (*sql_query_batch)(int affected[], rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+				       char const *query[], int count);
+
+	/*
+	 *	Optional, execute a prepared statement.  The driver
+	 *	should prepare the statement the first time it sees
+	 *	it on a connection.
+	 */
+	sql_placeholder_t	sql_placeholder;		//!< How statement parameters are written.
+	sql_rcode_t (*sql_query_prepared)(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					  sql_statement_t const *stmt, char const *values[], bool select);
 } rlm_sql_module_t;
 
 struct sql_inst {
 	rlm_sql_config_t	myconfig; /* HACK */
 	fr_connection_pool_t	*pool;
+	fr_connection_pool_t	*read_pool;		//!< Connections to the read replica, may be NULL.
 	rlm_sql_config_t	*config;
+	rlm_sql_config_t	*read_config;		//!< Copy of config with the replica's connection details.
 	CONF_SECTION		*cs;
 
 	fr_dict_attr_t const		*sql_user;		//!< Cached pointer to SQL-User-Name
@@ -228,8 +349,11 @@ struct sql_inst {
 	void			*handle;
 	rlm_sql_module_t	*module;
 
+	sql_statement_cache_t	*statements;		//!< Prepared statements, by query template.
+
 	int (*sql_set_user)(rlm_sql_t const *inst, REQUEST *request, char const *username);
 	xlat_escape_t sql_escape_func;
+	fr_str_set_t		escape_set;		//!< Bytes sql_escape_func can't copy as-is.
 	sql_rcode_t (*sql_query)(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query);
 	sql_rcode_t (*sql_select_query)(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query);
 	sql_rcode_t (*sql_fetch_row)(rlm_sql_row_t *out, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle);
@@ -244,14 +368,27 @@ typedef struct sql_grouplist {
 } rlm_sql_grouplist_t;
 
 void		*mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout);
+void		*mod_read_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout);
+int		mod_conn_alive(void *instance, void *connection);
+void		mod_conn_cancel(void *instance, void *connection);
+rlm_sql_handle_t *rlm_sql_read_handle_get(rlm_sql_t const *inst, REQUEST *request);
+void		rlm_sql_handle_release(rlm_sql_t const *inst, rlm_sql_handle_t *handle);
 int		sql_fr_pair_list_afrom_str(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **first_pair, rlm_sql_row_t row);
 int		sql_read_realms(rlm_sql_handle_t *handle);
-int		sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, VALUE_PAIR **pair, char const *query);
+int		sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, VALUE_PAIR **pair,
+			      sql_statement_t const *stmt, char const *query);
 int		sql_read_clients(rlm_sql_handle_t *handle);
 int		sql_dict_init(rlm_sql_handle_t *handle);
 void 		rlm_sql_query_log(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section, char const *query) CC_HINT(nonnull (1, 2, 4));
 sql_rcode_t	rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
 sql_rcode_t	rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
+int		rlm_sql_statement_init(rlm_sql_t *inst);
+sql_statement_t const *rlm_sql_statement(rlm_sql_t const *inst, char const *fmt);
+sql_rcode_t	rlm_sql_statement_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+					sql_statement_t const *stmt, bool select) CC_HINT(nonnull);
+int		rlm_sql_batch_init(rlm_sql_t *inst, sql_acct_section_t *section);
+int		rlm_sql_batch_query(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section,
+				    rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull);
 int		rlm_sql_fetch_row(rlm_sql_row_t *out, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle);
 void		rlm_sql_print_error(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle, bool force_debug);
 int		sql_set_user(rlm_sql_t const *inst, REQUEST *request, char const *username);
@@ -36,6 +36,14 @@ RCSID("$Id$")
 
 #include	"rlm_sql.h"
 
+#ifdef HAVE_PTHREAD_H
+#  define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#  define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#  define PTHREAD_MUTEX_LOCK(_x)
+#  define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
 #ifdef HAVE_PTHREAD_H
 #endif
 
@@ -49,13 +57,22 @@ const FR_NAME_NUMBER sql_rcode_table[] = {
 	{ "server error",	RLM_SQL_ERROR		},
 	{ "query invalid",	RLM_SQL_QUERY_INVALID	},
 	{ "no connection",	RLM_SQL_RECONNECT	},
+	{ "in progress",	RLM_SQL_AGAIN		},
 	{ NULL, 0 }
 };
 
-void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout)
+/** Return the pool a handle was reserved from
+ *
+ */
+static inline fr_connection_pool_t *sql_handle_pool(rlm_sql_t const *inst, rlm_sql_handle_t const *handle)
+{
+	return handle->replica ? inst->read_pool : inst->pool;
+}
+
+static void *sql_conn_create(TALLOC_CTX *ctx, rlm_sql_t *inst, rlm_sql_config_t *config, bool replica,
+			     struct timeval const *timeout)
 {
 	int rcode;
-	rlm_sql_t *inst = instance;
 	rlm_sql_handle_t *handle;
 
 	/*
@@ -76,8 +93,9 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *tim
 	 *	destructor has access to the module configuration.
 	 */
 	handle->inst = inst;
+	handle->replica = replica;
 
-	rcode = (inst->module->sql_socket_init)(handle, inst->config, timeout);
+	rcode = (inst->module->sql_socket_init)(handle, config, timeout);
 	if (rcode != 0) {
 	fail:
 		/*
@@ -95,6 +113,128 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *tim
 	return handle;
 }
 
+void *mod_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout)
+{
+	rlm_sql_t *inst = instance;
+
+	return sql_conn_create(ctx, inst, inst->config, false, timeout);
+}
+
+/** Create a connection to the read replica
+ *
+ * The replica's server, port, login, password and database are taken from
+ * the "read" section, everything else is shared with the primary.
+ */
+void *mod_read_conn_create(TALLOC_CTX *ctx, void *instance, struct timeval const *timeout)
+{
+	rlm_sql_t *inst = instance;
+
+	return sql_conn_create(ctx, inst, inst->read_config, true, timeout);
+}
+
+/** Check whether the replica a handle is connected to is too far behind the primary
+ *
+ * @param inst rlm_sql instance.
+ * @param request Current request.
+ * @param handle to check, may be replaced on reconnect, or set to NULL.
+ * @return
+ *	- true if the replica is lagging or the lag could not be determined.
+ *	- false if the replica is within max_lag.
+ */
+static bool sql_replica_lagging(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle)
+{
+	rlm_sql_row_t	row;
+	unsigned long	lag;
+	char		*end;
+	bool		lagging = true;
+
+	if (rlm_sql_select_query(inst, request, handle, inst->config->read.lag_query) != RLM_SQL_OK) {
+		RWARN("Failed checking replication lag, using primary");
+		return true;
+	}
+
+	if ((rlm_sql_fetch_row(&row, inst, request, handle) != RLM_SQL_OK) || !row || !row[0]) {
+		RWARN("Lag query returned no rows, using primary");
+		goto finish;
+	}
+
+	lag = strtoul(row[0], &end, 10);
+	if ((end == row[0]) || ((*end != '\0') && !isspace((int) *end))) {
+		RWARN("Lag query returned non-integer value \"%s\", using primary", row[0]);
+		goto finish;
+	}
+
+	if (lag > inst->config->read.max_lag) {
+		RWARN("Replica is %lu seconds behind (max_lag = %u), using primary", lag, inst->config->read.max_lag);
+		goto finish;
+	}
+
+	RDEBUG3("Replica is %lu seconds behind", lag);
+	lagging = false;
+
+finish:
+	if (*handle) (inst->module->sql_finish_select_query)(*handle, inst->config);
+
+	return lagging;
+}
+
+/** Reserve a handle for a read only query
+ *
+ * Uses a connection to the read replica if one is configured, and the replica
+ * is within max_lag of the primary.  Otherwise falls back to the primary, so
+ * authorization keeps working when the replica goes away.
+ *
+ * @param inst rlm_sql instance.
+ * @param request Current request.
+ * @return a handle which must be released with #rlm_sql_handle_release, or NULL.
+ */
+rlm_sql_handle_t *rlm_sql_read_handle_get(rlm_sql_t const *inst, REQUEST *request)
+{
+	rlm_sql_handle_t	*handle;
+	time_t			now;
+
+	if (!inst->read_pool) return fr_connection_get(inst->pool);
+
+	handle = fr_connection_get(inst->read_pool);
+	if (!handle) {
+		RWDEBUG("No replica connections available, using primary");
+		return fr_connection_get(inst->pool);
+	}
+
+	if (!inst->config->read.lag_query || !*inst->config->read.lag_query) return handle;
+
+	/*
+	 *	Lag is tracked per connection, as a load balancer
+	 *	in front of the replicas may hand each connection
+	 *	a different server.
+	 */
+	now = time(NULL);
+	if ((now - handle->lag_checked) >= (time_t)inst->config->read.lag_check_interval) {
+		handle->lagging = sql_replica_lagging(inst, request, &handle);
+		if (!handle) return fr_connection_get(inst->pool);
+		handle->lag_checked = now;
+	}
+
+	if (handle->lagging) {
+		fr_connection_release(inst->read_pool, handle);
+		return fr_connection_get(inst->pool);
+	}
+
+	return handle;
+}
+
+/** Release a handle back to the pool it was reserved from
+ *
+ * @param inst rlm_sql instance.
+ * @param handle to release, may be NULL.
+ */
+void rlm_sql_handle_release(rlm_sql_t const *inst, rlm_sql_handle_t *handle)
+{
+	if (!handle) return;
+
+	fr_connection_release(sql_handle_pool(inst, handle), handle);
+}
+
 /*************************************************************************
  *
  *	Function: sql_fr_pair_list_afrom_str
@@ -295,6 +435,162 @@ void rlm_sql_print_error(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle
 	talloc_free_children(handle->log_ctx);
 }
 
+/** Run a query using the driver's non-blocking interface
+ *
+ * Waits on the connection's socket for the query to complete, for at most
+ * query_timeout seconds.  If the request is running on a fiber, the thread
+ * processes other requests while it waits.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle to run the query on.
+ * @param query to execute.
+ * @param select if true, the query returns rows.
+ * @return the #sql_rcode_t of the query.  #RLM_SQL_RECONNECT if the query timed out.
+ */
+static sql_rcode_t sql_query_async(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle,
+				   char const *query, bool select)
+{
+	struct pollfd	pfd;
+	struct timeval	now, when;
+	sql_rcode_t	rcode;
+	int		timeout = -1;
+
+	if (inst->config->query_timeout) {
+		gettimeofday(&when, NULL);
+		when.tv_sec += inst->config->query_timeout;
+	}
+
+	rcode = (inst->module->sql_query_submit)(&pfd.events, handle, inst->config, query, select);
+	while (rcode == RLM_SQL_AGAIN) {
+		int ret;
+
+		pfd.fd = (inst->module->sql_socket_fd)(handle, inst->config);
+		if (pfd.fd < 0) {
+			MOD_ROPTIONAL(RERROR, ERROR, "Connection has no socket");
+			return RLM_SQL_RECONNECT;
+		}
+		pfd.revents = 0;
+
+		if (inst->config->query_timeout) {
+			gettimeofday(&now, NULL);
+			timeout = ((when.tv_sec - now.tv_sec) * 1000) + ((when.tv_usec - now.tv_usec) / 1000);
+			if (timeout < 0) timeout = 0;
+		}
+
+		ret = fr_fiber_poll(&pfd, 1, timeout);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+
+			MOD_ROPTIONAL(RERROR, ERROR, "Failed waiting for query result: %s", fr_syserror(errno));
+			return RLM_SQL_RECONNECT;
+		}
+
+		/*
+		 *	The connection is in an unknown state,
+		 *	so it's closed.
+		 */
+		if (ret == 0) {
+			MOD_ROPTIONAL(RERROR, ERROR, "Query timed out after %u seconds",
+				      inst->config->query_timeout);
+			return RLM_SQL_RECONNECT;
+		}
+
+		pfd.events = pfd.revents;
+		rcode = (inst->module->sql_query_resume)(&pfd.events, handle, inst->config);
+	}
+
+	return rcode;
+}
+
+/** Call the driver's query method
+ *
+ * If the request is being profiled, the time the query took is added
+ * to the profile.
+ */
+static sql_rcode_t sql_driver_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle,
+				    char const *query, sql_statement_t const *stmt, char const **values, bool select)
+{
+	sql_rcode_t	rcode;
+	struct timeval	start;
+
+	if (request && request->profile) gettimeofday(&start, NULL);
+
+	fr_connection_cancel_watch(sql_handle_pool(inst, handle), request, handle);
+
+	if (stmt) {
+		rcode = (inst->module->sql_query_prepared)(handle, inst->config, stmt, values, select);
+	} else if (inst->module->sql_query_submit) {
+		rcode = sql_query_async(inst, request, handle, query, select);
+	} else if (select) {
+		rcode = (inst->module->sql_select_query)(handle, inst->config, query);
+	} else {
+		rcode = (inst->module->sql_query)(handle, inst->config, query);
+	}
+
+	/*
+	 *	Whatever the driver says, the connection is unusable
+	 *	if the query was cancelled.
+	 */
+	if (request) {
+		request_cancel_clear(request);
+		if (request_cancelled(request)) rcode = RLM_SQL_RECONNECT;
+	}
+
+	if (request && request->profile) fr_profile_sql(request, inst->name, stmt ? stmt->query : query, &start);
+
+	return rcode;
+}
+
+/** Abort a query which is blocking on a connection
+ *
+ * Called by the main thread when the request the query is for times out.
+ * Shutting down the socket wakes the thread waiting on it, and the query
+ * fails with a connection error, so the connection is closed.
+ *
+ * Only used with drivers which expose their socket.
+ *
+ * @param instance rlm_sql instance.
+ * @param connection the query is running on.
+ */
+void mod_conn_cancel(void *instance, void *connection)
+{
+	rlm_sql_t		*inst = instance;
+	rlm_sql_handle_t	*handle = connection;
+	int			fd;
+
+	fd = (inst->module->sql_socket_fd)(handle, inst->config);
+	if (fd >= 0) shutdown(fd, SHUT_RDWR);
+}
+
+/** Check an idle connection is still usable
+ *
+ * Runs the health_check_query.  Called by the connection pool's manager
+ * thread, outside of any request, so no attempt is made to reconnect.
+ *
+ * @param instance rlm_sql instance.
+ * @param connection handle to check.
+ * @return
+ *	- 0 if the query succeeded.
+ *	- -1 if it failed, and the connection should be closed.
+ */
+int mod_conn_alive(void *instance, void *connection)
+{
+	rlm_sql_t		*inst = instance;
+	rlm_sql_handle_t	*handle = connection;
+	sql_rcode_t		rcode;
+
+	rcode = sql_driver_query(inst, NULL, handle, inst->config->health_check_query, NULL, NULL, true);
+	if (rcode != RLM_SQL_OK) {
+		ERROR("rlm_sql (%s): Health check failed: %s", inst->name,
+		      fr_int2str(sql_rcode_table, rcode, "<INVALID>"));
+		return -1;
+	}
+	(inst->module->sql_finish_select_query)(handle, inst->config);
+
+	return 0;
+}
+
 /** Call the driver's sql_query method, reconnecting if necessary.
  *
  * @note Caller must call ``(inst->module->sql_finish_query)(handle, inst->config);``
@@ -305,16 +601,20 @@ void rlm_sql_print_error(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle
  * @param request Current request.
  * @param inst #rlm_sql_t instance data.
  * @param query to execute. Should not be zero length.
+ * @param stmt prepared statement to execute instead of query.  May be NULL.
+ * @param values of the statement's parameters.
  * @return
  *	- #RLM_SQL_OK on success.
  *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
  *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
  *	- #RLM_SQL_ALT_QUERY on constraints violation.
  */
-sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query)
+static sql_rcode_t sql_query_internal(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				      char const *query, sql_statement_t const *stmt, char const **values)
 {
 	int ret = RLM_SQL_ERROR;
 	int i, count;
+	fr_connection_pool_t *pool;
 
 	/* Caller should check they have a valid handle */
 	rad_assert(*handle);
@@ -326,9 +626,10 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handl
 	}
 
 	/*
-	 *  inst->pool may be NULL is this function is called by mod_conn_create.
+	 *  The pool may be NULL is this function is called by mod_conn_create.
 	 */
-	count = inst->pool ? fr_connection_pool_state(inst->pool)->num : 0;
+	pool = sql_handle_pool(inst, *handle);
+	count = pool ? fr_connection_pool_state(pool)->num : 0;
 
 	/*
 	 *  Here we try with each of the existing connections, then try to create
@@ -337,7 +638,7 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handl
 	for (i = 0; i < (count + 1); i++) {
 		MOD_ROPTIONAL(RDEBUG2, DEBUG2, "Executing query: %s", query);
 
-		ret = (inst->module->sql_query)(*handle, inst->config, query);
+		ret = sql_driver_query(inst, request, *handle, query, stmt, values, false);
 		switch (ret) {
 		case RLM_SQL_OK:
 			break;
@@ -347,7 +648,18 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handl
 		 *	sockets in the pool and fail to establish a *new* connection.
 		 */
 		case RLM_SQL_RECONNECT:
-			*handle = fr_connection_reconnect(inst->pool, *handle);
+			/*
+			 *	The request timed out, and the query
+			 *	was cancelled.  Don't retry it.
+			 */
+			if (request && request_cancelled(request)) {
+				REDEBUG("Query cancelled, request timed out");
+				fr_connection_close(pool, *handle);
+				*handle = NULL;
+				return RLM_SQL_RECONNECT;
+			}
+
+			*handle = fr_connection_reconnect(pool, *handle);
 			/* Reconnection failed */
 			if (!*handle) return RLM_SQL_RECONNECT;
 			/* Reconnection succeeded, try again with the new handle */
@@ -407,15 +719,19 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handl
  * @param handle to query the database with. *handle should not be NULL, as this indicates
  *	  previous reconnection attempt has failed.
  * @param query to execute. Should not be zero length.
+ * @param stmt prepared statement to execute instead of query.  May be NULL.
+ * @param values of the statement's parameters.
  * @return
  *	- #RLM_SQL_OK on success.
  *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
  *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
  */
-sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,  char const *query)
+static sql_rcode_t sql_select_query_internal(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+					     char const *query, sql_statement_t const *stmt, char const **values)
 {
 	int ret = RLM_SQL_ERROR;
 	int i, count;
+	fr_connection_pool_t *pool;
 
 	/* Caller should check they have a valid handle */
 	rad_assert(*handle);
@@ -428,9 +744,10 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 	}
 
 	/*
-	 *  inst->pool may be NULL is this function is called by mod_conn_create.
+	 *  The pool may be NULL is this function is called by mod_conn_create.
 	 */
-	count = inst->pool ? fr_connection_pool_state(inst->pool)->num : 0;
+	pool = sql_handle_pool(inst, *handle);
+	count = pool ? fr_connection_pool_state(pool)->num : 0;
 
 	/*
 	 *  For sanity, for when no connections are viable, and we can't make a new one
@@ -438,7 +755,7 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 	for (i = 0; i < (count + 1); i++) {
 		MOD_ROPTIONAL(RDEBUG2, DEBUG2, "Executing select query: %s", query);
 
-		ret = (inst->module->sql_select_query)(*handle, inst->config, query);
+		ret = sql_driver_query(inst, request, *handle, query, stmt, values, true);
 		switch (ret) {
 		case RLM_SQL_OK:
 			break;
@@ -448,7 +765,18 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 		 *	sockets in the pool and fail to establish a *new* connection.
 		 */
 		case RLM_SQL_RECONNECT:
-			*handle = fr_connection_reconnect(inst->pool, *handle);
+			/*
+			 *	The request timed out, and the query
+			 *	was cancelled.  Don't retry it.
+			 */
+			if (request && request_cancelled(request)) {
+				REDEBUG("Query cancelled, request timed out");
+				fr_connection_close(pool, *handle);
+				*handle = NULL;
+				return RLM_SQL_RECONNECT;
+			}
+
+			*handle = fr_connection_reconnect(pool, *handle);
 			/* Reconnection failed */
 			if (!*handle) return RLM_SQL_RECONNECT;
 			/* Reconnection succeeded, try again with the new handle */
@@ -471,6 +799,532 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 }
 
 
+/** Call the driver's sql_query method, reconnecting if necessary
+ *
+ * @see sql_query_internal
+ */
+sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query)
+{
+	return sql_query_internal(inst, request, handle, query, NULL, NULL);
+}
+
+/** Call the driver's sql_select_query method, reconnecting if necessary
+ *
+ * @see sql_select_query_internal
+ */
+sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query)
+{
+	return sql_select_query_internal(inst, request, handle, query, NULL, NULL);
+}
+
+struct sql_statement_cache {
+	rbtree_t		*tree;			//!< Statements, by template.
+	int			next_id;		//!< ID to give the next statement.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+#endif
+};
+
+static int sql_statement_cmp(void const *one, void const *two)
+{
+	sql_statement_t const *a = one, *b = two;
+
+	return strcmp(a->fmt, b->fmt);
+}
+
+#ifdef HAVE_PTHREAD_H
+static int _sql_statement_cache_free(sql_statement_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+#endif
+
+/** Setup the prepared statement cache
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @return
+ *	- 0 on success, or if prepared statements aren't enabled.
+ *	- -1 on error.
+ */
+int rlm_sql_statement_init(rlm_sql_t *inst)
+{
+	sql_statement_cache_t *cache;
+
+	if (!inst->config->prepared_statements) return 0;
+
+	if (!inst->module->sql_query_prepared) {
+		WARN("rlm_sql (%s): Ignoring \"prepared_statements\", driver %s does not support them",
+		     inst->name, inst->module->name);
+		return 0;
+	}
+
+	MEM(cache = talloc_zero(inst, sql_statement_cache_t));
+	cache->tree = rbtree_create(cache, sql_statement_cmp, NULL, RBTREE_FLAG_NONE);
+	if (!cache->tree) {
+		talloc_free(cache);
+		return -1;
+	}
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+		ERROR("rlm_sql (%s): Failed initialising statement mutex: %s", inst->name, fr_syserror(errno));
+		talloc_free(cache);
+		return -1;
+	}
+	talloc_set_destructor(cache, _sql_statement_cache_free);
+#endif
+
+	inst->statements = cache;
+
+	return 0;
+}
+
+#define SQL_STATEMENT_MAX_SCALARS	(16)	//!< Parameter values printed on the stack, per query.
+#define SQL_STATEMENT_SCALAR_LEN	(128)	//!< Enough for any printed integer, date or address.
+
+/** Convert a parameter which is just %{Attribute-Name} to an attribute reference
+ *
+ * The value can then be taken straight from the attribute, without expanding the parameter.
+ *
+ * @param ctx to allocate the template in.
+ * @param param xlat format of the parameter.
+ * @return
+ *	- An attribute reference.
+ *	- NULL if the parameter is anything else.
+ */
+static vp_tmpl_t *sql_statement_param_attr(TALLOC_CTX *ctx, char const *param)
+{
+	vp_tmpl_t	*vpt = NULL;
+	xlat_exp_t	*head;
+	char		*fmt;
+	char const	*error;
+
+	MEM(fmt = talloc_typed_strdup(NULL, param));
+	if (xlat_tokenize(fmt, fmt, &head, &error) > 0) vpt = xlat_to_tmpl_attr(ctx, head);
+	talloc_free(fmt);
+
+	/*
+	 *	Virtual attributes have to be expanded.
+	 */
+	if (vpt && vpt->tmpl_da->flags.virtual) TALLOC_FREE(vpt);
+
+	return vpt;
+}
+
+/** Turn a query template into a statement with parameters
+ *
+ * Each string literal containing an expansion becomes a parameter, whose value is the
+ * expanded contents of the literal.  Templates with expansions outside of string literals,
+ * or in literals containing escape sequences, can't be converted.
+ *
+ * @param ctx to allocate the statement in.
+ * @param inst #rlm_sql_t instance data.
+ * @param fmt query template.
+ * @return a new statement.  stmt->query is NULL if the template can't be converted.
+ */
+static sql_statement_t *sql_statement_compile(TALLOC_CTX *ctx, rlm_sql_t const *inst, char const *fmt)
+{
+	sql_statement_t	*stmt;
+	char const	*p, *q;
+	char		*query;
+
+	MEM(stmt = talloc_zero(ctx, sql_statement_t));
+	MEM(stmt->fmt = talloc_typed_strdup(stmt, fmt));
+	MEM(query = talloc_strdup(stmt, ""));
+	MEM(stmt->param = talloc_array(stmt, char const *, 0));
+	MEM(stmt->param_vpt = talloc_array(stmt, vp_tmpl_t *, 0));
+
+	p = fmt;
+	while (*p) {
+		switch (*p) {
+		case '%':
+			goto fail;
+
+		/*
+		 *	Identifiers are copied as-is
+		 */
+		case '"':
+			q = strchr(p + 1, '"');
+			if (!q || memchr(p, '%', q - p)) goto fail;
+
+			MEM(query = talloc_strndup_append_buffer(query, p, (q - p) + 1));
+			p = q + 1;
+			continue;
+
+		case '\'':
+			q = strchr(p + 1, '\'');
+			if (!q) goto fail;
+
+			if (q[1] == '\'') goto fail;	/* Escaped quote */
+
+			if (!memchr(p, '%', q - p)) {
+				MEM(query = talloc_strndup_append_buffer(query, p, (q - p) + 1));
+				p = q + 1;
+				continue;
+			}
+
+			if (memchr(p, '\\', q - p)) goto fail;
+
+			MEM(stmt->param = talloc_realloc(stmt, stmt->param, char const *, stmt->num_params + 1));
+			MEM(stmt->param[stmt->num_params] = talloc_strndup(stmt->param, p + 1, (q - p) - 1));
+			MEM(stmt->param_vpt = talloc_realloc(stmt, stmt->param_vpt, vp_tmpl_t *, stmt->num_params + 1));
+			stmt->param_vpt[stmt->num_params] = sql_statement_param_attr(stmt, stmt->param[stmt->num_params]);
+			stmt->num_params++;
+
+			switch (inst->module->sql_placeholder) {
+			case SQL_PLACEHOLDER_QUESTION:
+				MEM(query = talloc_strdup_append_buffer(query, "?"));
+				break;
+
+			case SQL_PLACEHOLDER_DOLLAR:
+				MEM(query = talloc_asprintf_append_buffer(query, "$%i", stmt->num_params));
+				break;
+			}
+			p = q + 1;
+			continue;
+
+		default:
+			break;
+		}
+
+		q = p + strcspn(p, "%\"'");
+		MEM(query = talloc_strndup_append_buffer(query, p, q - p));
+		p = q;
+	}
+
+	/*
+	 *	Nothing to gain.
+	 */
+	if (stmt->num_params == 0) goto fail;
+
+	stmt->query = query;
+
+	return stmt;
+
+fail:
+	talloc_free(query);
+	stmt->query = NULL;
+
+	return stmt;
+}
+
+/** Find or create the prepared statement for a query template
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param fmt query template.
+ * @return
+ *	- The statement.
+ *	- NULL if prepared statements aren't enabled, or the template can't be converted.
+ */
+sql_statement_t const *rlm_sql_statement(rlm_sql_t const *inst, char const *fmt)
+{
+	sql_statement_cache_t	*cache = inst->statements;
+	sql_statement_t		find, *stmt;
+
+	if (!cache) return NULL;
+
+	memcpy(&find.fmt, &fmt, sizeof(find.fmt));
+
+	PTHREAD_MUTEX_LOCK(&cache->mutex);
+	stmt = rbtree_finddata(cache->tree, &find);
+	if (!stmt) {
+		stmt = sql_statement_compile(cache, inst, fmt);
+		if (stmt->query) {
+			stmt->id = cache->next_id++;
+			DEBUG3("rlm_sql (%s): Created statement %i: %s", inst->name, stmt->id, stmt->query);
+		}
+		rbtree_insert(cache->tree, stmt);
+	}
+	PTHREAD_MUTEX_UNLOCK(&cache->mutex);
+
+	if (!stmt->query) return NULL;
+
+	return stmt;
+}
+
+/** Expand the parameters of a prepared statement, and execute it, reconnecting if necessary
+ *
+ * @note Caller must call the driver's finish function, as for #rlm_sql_query and #rlm_sql_select_query.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle to query the database with.
+ * @param stmt to execute.
+ * @param select whether the statement returns rows.
+ * @return as #rlm_sql_query or #rlm_sql_select_query.
+ */
+sql_rcode_t rlm_sql_statement_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				    sql_statement_t const *stmt, bool select)
+{
+	char const	**values;
+	char		*value;
+	char		scalars[SQL_STATEMENT_MAX_SCALARS][SQL_STATEMENT_SCALAR_LEN];
+	int		num_scalars = 0;
+	sql_rcode_t	rcode;
+	int		i;
+
+	MEM(values = talloc_zero_array(request, char const *, stmt->num_params));
+	for (i = 0; i < stmt->num_params; i++) {
+		/*
+		 *	Attribute references are read directly.  Strings
+		 *	are used in place, and everything else is printed
+		 *	to the stack, as the expansion would have done.
+		 */
+		if (stmt->param_vpt[i]) {
+			value_data_t	data;
+			PW_TYPE		type;
+			ssize_t		slen;
+
+			slen = tmpl_expand_value(&data, &type, NULL, 0, request, stmt->param_vpt[i], NULL, NULL);
+			if (slen == -2) {
+				values[i] = "";
+			} else if (slen < 0) {
+				talloc_free(values);
+				return RLM_SQL_ERROR;
+			} else if (type == PW_TYPE_STRING) {
+				values[i] = data.strvalue;
+			} else if ((type != PW_TYPE_OCTETS) && (num_scalars < SQL_STATEMENT_MAX_SCALARS) &&
+				   !is_truncated(value_data_snprint(scalars[num_scalars], sizeof(scalars[num_scalars]),
+								    type, stmt->param_vpt[i]->tmpl_da, &data, '\0'),
+						 sizeof(scalars[num_scalars]))) {
+				values[i] = scalars[num_scalars++];
+			}
+
+			if (values[i]) {
+				RDEBUG3("Parameter %i: \"%s\"", i + 1, values[i]);
+				continue;
+			}
+		}
+
+		if (radius_axlat(&value, request, stmt->param[i], NULL, NULL) < 0) {
+			talloc_free(values);
+			return RLM_SQL_ERROR;
+		}
+		talloc_steal(values, value);
+		values[i] = value;
+
+		RDEBUG3("Parameter %i: \"%s\"", i + 1, value);
+	}
+
+	if (select) {
+		rcode = sql_select_query_internal(inst, request, handle, stmt->query, stmt, values);
+	} else {
+		rcode = sql_query_internal(inst, request, handle, stmt->query, stmt, values);
+	}
+	talloc_free(values);
+
+	return rcode;
+}
+
+#ifdef HAVE_PTHREAD_H
+typedef struct sql_batch_entry sql_batch_entry_t;
+
+/** A query waiting to be sent as part of a batch
+ *
+ */
+struct sql_batch_entry {
+	char const		*query;
+	int			numaffected;		//!< Rows affected, or -1 if the query must be
+							//!< run on its own.
+	bool			done;			//!< Batch has been sent.
+	sql_batch_entry_t	*next;
+};
+
+struct sql_batch {
+	pthread_mutex_t		mutex;
+	fr_fiber_cond_t		cond;			//!< Signalled when the batch is full, or
+							//!< has been sent.
+	sql_batch_entry_t	*head;
+	sql_batch_entry_t	**tail;
+	uint32_t		count;
+	bool			collecting;		//!< A thread is collecting queries, and will
+							//!< send the batch.
+};
+
+static int _sql_batch_free(sql_batch_t *batch)
+{
+	pthread_mutex_destroy(&batch->mutex);
+	fr_fiber_cond_destroy(&batch->cond);
+
+	return 0;
+}
+#endif
+
+/** Setup batching for an accounting section
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param section to batch queries for.
+ * @return
+ *	- 0 on success, or if batching isn't enabled.
+ *	- -1 on error.
+ */
+int rlm_sql_batch_init(rlm_sql_t *inst, sql_acct_section_t *section)
+{
+#ifdef HAVE_PTHREAD_H
+	sql_batch_t *batch;
+#endif
+
+	if (section->batch_size <= 1) return 0;
+
+	if (!inst->module->sql_query_batch) {
+		WARN("rlm_sql (%s): Ignoring \"batch_size\", driver %s does not support batching",
+		     inst->name, inst->module->name);
+		return 0;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	batch = talloc_zero(inst, sql_batch_t);
+	if (!batch) return -1;
+
+	if (pthread_mutex_init(&batch->mutex, NULL) != 0) {
+		ERROR("rlm_sql (%s): Failed initialising batch mutex: %s", inst->name, fr_syserror(errno));
+		talloc_free(batch);
+		return -1;
+	}
+	if (fr_fiber_cond_init(&batch->cond) != 0) {
+		ERROR("rlm_sql (%s): Failed initialising batch condition: %s", inst->name, fr_syserror(errno));
+		pthread_mutex_destroy(&batch->mutex);
+		talloc_free(batch);
+		return -1;
+	}
+	talloc_set_destructor(batch, _sql_batch_free);
+
+	batch->tail = &batch->head;
+	section->batch = batch;
+#else
+	WARN("rlm_sql (%s): Ignoring \"batch_size\", server was built without threads", inst->name);
+#endif
+
+	return 0;
+}
+
+/** Send a query as part of a batch
+ *
+ * The first thread to add a query to an empty batch waits for up to batch_timeout
+ * for batch_size queries to be added, then sends them all in one round trip.
+ * Other threads release their connection, and wait for the batch to be sent.
+ * With fibers, the other "threads" may be fibers on the same thread.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param section the query belongs to.
+ * @param handle to send the batch with.  Is set to NULL if the query was sent by another
+ *	thread and succeeded, or if a new connection is needed and none is available.
+ * @param query to add to the batch.  Must be a single statement.
+ * @return
+ *	- The number of rows affected by the query.
+ *	- -1 if the query failed, or was not committed, and should be run on its own with *handle.
+ */
+int rlm_sql_batch_query(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section,
+			rlm_sql_handle_t **handle, char const *query)
+{
+#ifdef HAVE_PTHREAD_H
+	sql_batch_t		*batch = section->batch;
+	sql_batch_entry_t	entry = { .query = query, .numaffected = -1 };
+	sql_batch_entry_t	*head, *this, *next;
+	char const		**queries;
+	int			*affected;
+	int			count, i;
+	sql_rcode_t		rcode;
+	struct timeval		now;
+	struct timespec		when;
+
+	rad_assert(batch);
+
+	pthread_mutex_lock(&batch->mutex);
+	*batch->tail = &entry;
+	batch->tail = &entry.next;
+	batch->count++;
+
+	/*
+	 *	Another thread will send the batch.
+	 */
+	if (batch->collecting) {
+		if (batch->count >= section->batch_size) fr_fiber_cond_broadcast(&batch->cond);
+
+		fr_connection_release(inst->pool, *handle);
+		*handle = NULL;
+
+		RDEBUG2("Waiting for batch to be sent");
+		while (!entry.done) (void) fr_fiber_cond_timedwait(&batch->cond, &batch->mutex, NULL);
+		pthread_mutex_unlock(&batch->mutex);
+
+		/*
+		 *	Caller needs a connection to run any
+		 *	alternative queries.
+		 */
+		if (entry.numaffected <= 0) *handle = fr_connection_get(inst->pool);
+
+		return entry.numaffected;
+	}
+
+	batch->collecting = true;
+
+	gettimeofday(&now, NULL);
+	when.tv_sec = now.tv_sec + section->batch_timeout.tv_sec;
+	when.tv_nsec = (now.tv_usec + section->batch_timeout.tv_usec) * 1000;
+	if (when.tv_nsec >= 1000000000) {
+		when.tv_sec++;
+		when.tv_nsec -= 1000000000;
+	}
+
+	/*
+	 *	The queries may be coming from other fibers on this
+	 *	thread, so they have to be allowed to run.
+	 */
+	while (batch->count < section->batch_size) {
+		if (fr_fiber_cond_timedwait(&batch->cond, &batch->mutex, &when) == ETIMEDOUT) break;
+	}
+
+	head = batch->head;
+	count = batch->count;
+
+	batch->head = NULL;
+	batch->tail = &batch->head;
+	batch->count = 0;
+	batch->collecting = false;
+	pthread_mutex_unlock(&batch->mutex);
+
+	/*
+	 *	Nothing to batch with, run it normally.
+	 */
+	if (count == 1) return -1;
+
+	MEM(queries = talloc_array(request, char const *, count));
+	MEM(affected = talloc_array(request, int, count));
+	for (this = head, i = 0; this; this = this->next, i++) {
+		queries[i] = this->query;
+		affected[i] = -1;
+	}
+
+	RDEBUG2("Sending batch of %i queries", count);
+
+	rcode = (inst->module->sql_query_batch)(affected, *handle, inst->config, queries, count);
+	if (rcode == RLM_SQL_RECONNECT) *handle = fr_connection_reconnect(inst->pool, *handle);
+
+	/*
+	 *	Entries belong to the threads waiting on them, so
+	 *	mustn't be touched after they're marked as done.
+	 */
+	pthread_mutex_lock(&batch->mutex);
+	for (this = head, i = 0; this; this = next, i++) {
+		next = this->next;
+		this->numaffected = affected[i];
+		this->done = true;
+	}
+	fr_fiber_cond_broadcast(&batch->cond);
+	pthread_mutex_unlock(&batch->mutex);
+
+	talloc_free(queries);
+	talloc_free(affected);
+
+	return entry.numaffected;
+#else
+	return -1;
+#endif
+}
+
 /*************************************************************************
  *
  *	Function: sql_getvpdata
@@ -479,7 +1333,7 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
  *
  *************************************************************************/
 int sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
-		  VALUE_PAIR **pair, char const *query)
+		  VALUE_PAIR **pair, sql_statement_t const *stmt, char const *query)
 {
 	rlm_sql_row_t	row;
 	int		rows = 0;
@@ -487,7 +1341,11 @@ int sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_
 
 	rad_assert(request);
 
-	rcode = rlm_sql_select_query(inst, request, handle, query);
+	if (stmt) {
+		rcode = rlm_sql_statement_query(inst, request, handle, stmt, true);
+	} else {
+		rcode = rlm_sql_select_query(inst, request, handle, query);
+	}
 	if (rcode != RLM_SQL_OK) return -1; /* error handled by rlm_sql_select_query */
 
 	while (rlm_sql_fetch_row(&row, inst, request, handle) == 0) {
@@ -50,6 +50,54 @@ RCSID("$Id$")
  *	Reset Time.
  */
 
+/*
+ *	Counter cache.
+ *
+ *	Running the SQL query for every authentication is expensive,
+ *	so the result can be cached per key.  The cached value is
+ *	then kept up to date from the accounting packets this
+ *	instance sees, and re-read from SQL every cache_reconcile
+ *	seconds to correct any drift (e.g. sessions accounted by
+ *	another server).
+ */
+typedef struct sqlcounter_session sqlcounter_session_t;
+struct sqlcounter_session {
+	sqlcounter_session_t	*next;
+	char const		*id;		//!< Acct-Unique-Session-Id, or Acct-Session-Id.
+	uint64_t		last;		//!< Last value of the increment attribute.
+};
+
+typedef struct sqlcounter_entry sqlcounter_entry_t;
+struct sqlcounter_entry {
+	sqlcounter_entry_t	*prev;
+	sqlcounter_entry_t	*next;
+
+	char const		*key;
+	uint64_t		counter;
+	time_t			last_reset;	//!< Start of the period the counter is for.
+	time_t			fetched;	//!< When the counter was read from SQL.
+
+	sqlcounter_session_t	*sessions;	//!< Sessions updated since the counter was fetched.
+};
+
+typedef struct sqlcounter_cache {
+	fr_hash_table_t		*ht;
+	sqlcounter_entry_t	*head;		//!< Least recently fetched.
+	sqlcounter_entry_t	*tail;		//!< Most recently fetched.
+	uint32_t		num_entries;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+#endif
+} sqlcounter_cache_t;
+
+#ifdef HAVE_PTHREAD_H
+#  define CACHE_LOCK(_c)	pthread_mutex_lock(&(_c)->mutex)
+#  define CACHE_UNLOCK(_c)	pthread_mutex_unlock(&(_c)->mutex)
+#else
+#  define CACHE_LOCK(_c)
+#  define CACHE_UNLOCK(_c)
+#endif
+
 /*
  *	Define a structure for our module configuration.
  *
@@ -67,8 +115,15 @@ typedef struct rlm_sqlcounter_t {
 	char const	*query;		//!< SQL query to retrieve current session time.
 	char const	*reset;  	//!< Daily, weekly, monthly, never or user defined.
 
+	bool		cache_enable;	//!< Cache counters in memory.
+	uint32_t	cache_max_entries;
+	uint32_t	cache_reconcile;	//!< How often to re-read cached counters from SQL.
+	vp_tmpl_t	*cache_increment;	//!< Accounting attribute the counter sums, usually Acct-Session-Time.
+
 	time_t		reset_time;
 	time_t		last_reset;
+
+	sqlcounter_cache_t *cache;
 } rlm_sqlcounter_t;
 
 /*
@@ -95,9 +150,214 @@ static const CONF_PARSER module_config[] = {
 
 	/* Attribute to write remaining session to */
 	{ FR_CONF_OFFSET("reply_name", PW_TYPE_TMPL | PW_TYPE_ATTRIBUTE, rlm_sqlcounter_t, reply_attr) },
+
+	{ FR_CONF_OFFSET("cache", PW_TYPE_BOOLEAN, rlm_sqlcounter_t, cache_enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("cache_max_entries", PW_TYPE_INTEGER, rlm_sqlcounter_t, cache_max_entries), .dflt = "16384" },
+	{ FR_CONF_OFFSET("cache_reconcile", PW_TYPE_INTEGER, rlm_sqlcounter_t, cache_reconcile), .dflt = "300" },
+	{ FR_CONF_OFFSET("cache_increment", PW_TYPE_TMPL | PW_TYPE_ATTRIBUTE, rlm_sqlcounter_t, cache_increment), .dflt = "&request:Acct-Session-Time", .quote = T_BARE_WORD },
 	CONF_PARSER_TERMINATOR
 };
 
+static uint32_t sqlcounter_entry_hash(void const *data)
+{
+	sqlcounter_entry_t const *entry = data;
+
+	return fr_hash_string(entry->key);
+}
+
+static int sqlcounter_entry_cmp(void const *one, void const *two)
+{
+	sqlcounter_entry_t const *a = one, *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+static void sqlcounter_entry_unlink(sqlcounter_cache_t *cache, sqlcounter_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+	entry->prev = entry->next = NULL;
+}
+
+static void sqlcounter_entry_link(sqlcounter_cache_t *cache, sqlcounter_entry_t *entry)
+{
+	entry->prev = cache->tail;
+	entry->next = NULL;
+	if (cache->tail) {
+		cache->tail->next = entry;
+	} else {
+		cache->head = entry;
+	}
+	cache->tail = entry;
+}
+
+static void sqlcounter_entry_free(sqlcounter_cache_t *cache, sqlcounter_entry_t *entry)
+{
+	sqlcounter_entry_unlink(cache, entry);
+	fr_hash_table_delete(cache->ht, entry);
+	cache->num_entries--;
+	talloc_free(entry);
+}
+
+static int _sqlcounter_cache_free(sqlcounter_cache_t *cache)
+{
+	/*
+	 *	Entries are parented by the cache, so they're
+	 *	freed along with it.
+	 */
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&cache->mutex);
+#endif
+	return 0;
+}
+
+/** Find the cached counter for a key
+ *
+ * Entries from a previous reset period, or which are due to be
+ * reconciled with SQL, are discarded.
+ *
+ * @param[in] inst of rlm_sqlcounter.
+ * @param[in] key to find.
+ * @param[in] now the current time.
+ * @param[out] counter the cached value.
+ * @return true if a usable entry was found.
+ */
+static bool sqlcounter_cache_find(rlm_sqlcounter_t *inst, char const *key, time_t now, uint64_t *counter)
+{
+	sqlcounter_cache_t	*cache = inst->cache;
+	sqlcounter_entry_t	find, *entry;
+	bool			found = false;
+
+	memset(&find, 0, sizeof(find));
+	find.key = key;
+
+	CACHE_LOCK(cache);
+	entry = fr_hash_table_finddata(cache->ht, &find);
+	if (entry) {
+		if ((entry->last_reset != inst->last_reset) ||
+		    (inst->cache_reconcile && (now >= (entry->fetched + (time_t) inst->cache_reconcile)))) {
+			sqlcounter_entry_free(cache, entry);
+		} else {
+			*counter = entry->counter;
+			found = true;
+		}
+	}
+	CACHE_UNLOCK(cache);
+
+	return found;
+}
+
+/** Cache a counter read from SQL
+ *
+ */
+static void sqlcounter_cache_insert(rlm_sqlcounter_t *inst, char const *key, time_t now, uint64_t counter)
+{
+	sqlcounter_cache_t	*cache = inst->cache;
+	sqlcounter_entry_t	*entry, *old;
+
+	CACHE_LOCK(cache);
+	entry = talloc_zero(cache, sqlcounter_entry_t);
+	if (!entry) {
+		CACHE_UNLOCK(cache);
+		return;
+	}
+	entry->key = talloc_typed_strdup(entry, key);
+	entry->counter = counter;
+	entry->last_reset = inst->last_reset;
+	entry->fetched = now;
+
+	old = fr_hash_table_finddata(cache->ht, entry);
+	if (old) sqlcounter_entry_free(cache, old);
+
+	if (inst->cache_max_entries && (cache->num_entries >= inst->cache_max_entries)) {
+		sqlcounter_entry_free(cache, cache->head);
+	}
+
+	if (!fr_hash_table_insert(cache->ht, entry)) {
+		talloc_free(entry);
+		CACHE_UNLOCK(cache);
+		return;
+	}
+	sqlcounter_entry_link(cache, entry);
+	cache->num_entries++;
+	CACHE_UNLOCK(cache);
+}
+
+/** Add the usage from an accounting packet to a cached counter
+ *
+ * The increment attribute (e.g. Acct-Session-Time) is a running
+ * total for the session, so we remember the last value seen for
+ * each session, and add the difference.
+ *
+ * For sessions we haven't seen since the counter was read from SQL,
+ * we don't know how much of the session SQL had already counted.
+ * We assume all of the usage since the counter was fetched is new,
+ * which is exact for sessions whose previous update was written
+ * before the fetch, and is corrected by reconciliation otherwise.
+ */
+static void sqlcounter_cache_update(rlm_sqlcounter_t *inst, REQUEST *request, char const *key,
+				    char const *session_id, uint64_t value, bool stop)
+{
+	sqlcounter_cache_t	*cache = inst->cache;
+	sqlcounter_entry_t	find, *entry;
+	sqlcounter_session_t	*session, **last;
+	uint64_t		delta;
+
+	memset(&find, 0, sizeof(find));
+	find.key = key;
+
+	CACHE_LOCK(cache);
+	entry = fr_hash_table_finddata(cache->ht, &find);
+	if (!entry || (entry->last_reset != inst->last_reset)) {
+		CACHE_UNLOCK(cache);
+		return;
+	}
+
+	for (last = &entry->sessions, session = entry->sessions;
+	     session;
+	     last = &session->next, session = session->next) {
+		if (strcmp(session->id, session_id) == 0) break;
+	}
+
+	if (session) {
+		delta = (value > session->last) ? value - session->last : 0;
+	} else {
+		uint64_t since = (request->timestamp.tv_sec > entry->fetched) ?
+				 (uint64_t)(request->timestamp.tv_sec - entry->fetched) : 0;
+
+		delta = (value < since) ? value : since;
+	}
+	entry->counter += delta;
+
+	RDEBUG2("Added %" PRIu64 " to cached counter for %s, now %" PRIu64, delta, key, entry->counter);
+
+	if (stop) {
+		if (session) {
+			*last = session->next;
+			talloc_free(session);
+		}
+	} else if (session) {
+		session->last = value;
+	} else {
+		session = talloc_zero(entry, sqlcounter_session_t);
+		if (session) {
+			session->id = talloc_typed_strdup(session, session_id);
+			session->last = value;
+			session->next = entry->sessions;
+			entry->sessions = session;
+		}
+	}
+	CACHE_UNLOCK(cache);
+}
+
 static int find_next_reset(rlm_sqlcounter_t *inst, time_t timeval)
 {
 	int		ret = 0;
@@ -337,43 +597,88 @@ static size_t sqlcounter_expand(char *out, int outlen, rlm_sqlcounter_t *inst, R
 
 
 /*
- *	See if the counter matches.
+ *	Find the key attribute.  User-Name is special.  It means
+ *	the REAL username, after stripping.
  */
-static int counter_cmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req , VALUE_PAIR *check,
-			  UNUSED VALUE_PAIR *check_pairs, UNUSED VALUE_PAIR **reply_pairs)
+static VALUE_PAIR *sqlcounter_key(rlm_sqlcounter_t *inst, REQUEST *request)
 {
-	rlm_sqlcounter_t *inst = instance;
-	uint64_t counter;
+	VALUE_PAIR *key_vp;
+
+	if ((inst->key_attr->tmpl_list == PAIR_LIST_REQUEST) &&
+	    (inst->key_attr->tmpl_da->vendor == 0) && (inst->key_attr->tmpl_da->attr == PW_USER_NAME)) {
+		return request->username;
+	}
+
+	if (tmpl_find_vp(&key_vp, request, inst->key_attr) < 0) return NULL;
+
+	return key_vp;
+}
 
+/*
+ *	Get the current value of the counter, from the cache if
+ *	possible, otherwise by running the SQL query.
+ */
+static int sqlcounter_get(rlm_sqlcounter_t *inst, REQUEST *request, VALUE_PAIR *key_vp, uint64_t *counter)
+{
 	char query[MAX_QUERY_LEN], subst[MAX_QUERY_LEN];
+	char key[MAX_QUERY_LEN];
 	char *expanded = NULL;
 	size_t len;
 
+	if (inst->cache && key_vp) {
+		fr_pair_value_snprint(key, sizeof(key), key_vp, '\0');
+
+		if (sqlcounter_cache_find(inst, key, request->timestamp.tv_sec, counter)) {
+			RDEBUG2("Using cached counter value %" PRIu64 " for %s", *counter, key);
+			return 0;
+		}
+	}
+
 	/* First, expand %k, %b and %e in query */
 	if (sqlcounter_expand(subst, sizeof(subst), inst, request, inst->query) <= 0) {
 		REDEBUG("Insufficient query buffer space");
 
-		return RLM_MODULE_FAIL;
+		return -1;
 	}
 
 	/* Then combine that with the name of the module were using to do the query */
 	len = snprintf(query, sizeof(query), "%%{%s:%s}", inst->sqlmod_inst, subst);
-	if (len >= sizeof(query) - 1) {
+	if (len >= (sizeof(query) - 1)) {
 		REDEBUG("Insufficient query buffer space");
 
-		return RLM_MODULE_FAIL;
+		return -1;
 	}
 
 	/* Finally, xlat resulting SQL query */
 	if (radius_axlat(&expanded, request, query, NULL, NULL) < 0) {
-		return RLM_MODULE_FAIL;
+		return -1;
 	}
 
-	if (sscanf(expanded, "%" PRIu64, &counter) != 1) {
-		RDEBUG2("No integer found in string \"%s\"", expanded);
+	if (sscanf(expanded, "%" PRIu64, counter) != 1) {
+		RDEBUG2("No integer found in result string \"%s\".  May be first session, setting counter to 0",
+			expanded);
+		*counter = 0;
 	}
 	talloc_free(expanded);
 
+	if (inst->cache && key_vp) sqlcounter_cache_insert(inst, key, request->timestamp.tv_sec, *counter);
+
+	return 0;
+}
+
+/*
+ *	See if the counter matches.
+ */
+static int counter_cmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req , VALUE_PAIR *check,
+			  UNUSED VALUE_PAIR *check_pairs, UNUSED VALUE_PAIR **reply_pairs)
+{
+	rlm_sqlcounter_t *inst = instance;
+	uint64_t counter;
+
+	if (sqlcounter_get(inst, request, sqlcounter_key(inst, request), &counter) < 0) {
+		return RLM_MODULE_FAIL;
+	}
+
 	if (counter < check->vp_integer64) return -1;
 	if (counter > check->vp_integer64) return 1;
 	return 0;
@@ -394,11 +699,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 	char			msg[128];
 	int			ret;
 
-	char query[MAX_QUERY_LEN], subst[MAX_QUERY_LEN];
-	char *expanded = NULL;
-
-	size_t len;
-
 	/*
 	 *	Before doing anything else, see if we have to reset
 	 *	the counters.
@@ -411,16 +711,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 		find_next_reset(inst,request->timestamp.tv_sec);
 	}
 
-	/*
-	 *      Look for the key.  User-Name is special.  It means
-	 *      The REAL username, after stripping.
-	 */
-	if ((inst->key_attr->tmpl_list == PAIR_LIST_REQUEST) &&
-	    (inst->key_attr->tmpl_da->vendor == 0) && (inst->key_attr->tmpl_da->attr == PW_USER_NAME)) {
-		key_vp = request->username;
-	} else {
-		tmpl_find_vp(&key_vp, request, inst->key_attr);
-	}
+	key_vp = sqlcounter_key(inst, request);
 	if (!key_vp) {
 		RWDEBUG2("Couldn't find key attribute, %s, doing nothing...", inst->key_attr->tmpl_da->name);
 		return RLM_MODULE_NOOP;
@@ -431,32 +722,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 		return RLM_MODULE_NOOP;
 	}
 
-	/* First, expand %k, %b and %e in query */
-	if (sqlcounter_expand(subst, sizeof(subst), inst, request, inst->query) <= 0) {
-		REDEBUG("Insufficient query buffer space");
-
-		return RLM_MODULE_FAIL;
-	}
-
-	/* Then combine that with the name of the module were using to do the query */
-	len = snprintf(query, sizeof(query), "%%{%s:%s}", inst->sqlmod_inst, subst);
-	if (len >= (sizeof(query) - 1)) {
-		REDEBUG("Insufficient query buffer space");
-
-		return RLM_MODULE_FAIL;
-	}
-
-	/* Finally, xlat resulting SQL query */
-	if (radius_axlat(&expanded, request, query, NULL, NULL) < 0) {
-		return RLM_MODULE_FAIL;
-	}
-	talloc_free(expanded);
-
-	if (sscanf(expanded, "%" PRIu64, &counter) != 1) {
-		RDEBUG2("No integer found in result string \"%s\".  May be first session, setting counter to 0",
-			expanded);
-		counter = 0;
-	}
+	if (sqlcounter_get(inst, request, key_vp, &counter) < 0) return RLM_MODULE_FAIL;
 
 	/*
 	 *	Check if check item > counter
@@ -532,6 +798,55 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 	return RLM_MODULE_OK;
 }
 
+/*
+ *	Keep cached counters up to date from accounting packets.
+ *
+ *	This module never writes to SQL, the SQL module is still
+ *	responsible for that.
+ */
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *request)
+{
+	rlm_sqlcounter_t	*inst = instance;
+	VALUE_PAIR		*key_vp, *status, *session_id, *increment;
+	char			key[MAX_QUERY_LEN];
+
+	if (!inst->cache) return RLM_MODULE_NOOP;
+
+	status = fr_pair_find_by_num(request->packet->vps, 0, PW_ACCT_STATUS_TYPE, TAG_ANY);
+	if (!status) return RLM_MODULE_NOOP;
+
+	switch (status->vp_integer) {
+	case PW_STATUS_START:
+	case PW_STATUS_ALIVE:
+	case PW_STATUS_STOP:
+		break;
+
+	default:
+		return RLM_MODULE_NOOP;
+	}
+
+	session_id = fr_pair_find_by_num(request->packet->vps, 0, PW_ACCT_UNIQUE_SESSION_ID, TAG_ANY);
+	if (!session_id) session_id = fr_pair_find_by_num(request->packet->vps, 0, PW_ACCT_SESSION_ID, TAG_ANY);
+	if (!session_id) return RLM_MODULE_NOOP;
+
+	key_vp = sqlcounter_key(inst, request);
+	if (!key_vp) return RLM_MODULE_NOOP;
+
+	if ((tmpl_find_vp(&increment, request, inst->cache_increment) < 0) ||
+	    ((increment->da->type != PW_TYPE_INTEGER) && (increment->da->type != PW_TYPE_INTEGER64))) {
+		if (status->vp_integer != PW_STATUS_START) return RLM_MODULE_NOOP;
+		increment = NULL;
+	}
+
+	fr_pair_value_snprint(key, sizeof(key), key_vp, '\0');
+	sqlcounter_cache_update(inst, request, key, session_id->vp_strvalue,
+				!increment ? 0 :
+				(increment->da->type == PW_TYPE_INTEGER64) ? increment->vp_integer64 : increment->vp_integer,
+				(status->vp_integer == PW_STATUS_STOP));
+
+	return RLM_MODULE_OK;
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -567,6 +882,21 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	if (inst->cache_enable) {
+		inst->cache = talloc_zero(inst, sqlcounter_cache_t);
+		if (!inst->cache) return -1;
+
+		inst->cache->ht = fr_hash_table_create(inst->cache, sqlcounter_entry_hash, sqlcounter_entry_cmp, NULL);
+		if (!inst->cache->ht) {
+			cf_log_err_cs(conf, "Failed creating counter cache");
+			return -1;
+		}
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_init(&inst->cache->mutex, NULL);
+#endif
+		talloc_set_destructor(inst->cache, _sqlcounter_cache_free);
+	}
+
 	return 0;
 }
 
@@ -634,7 +964,8 @@ module_t rlm_sqlcounter = {
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.methods = {
-		[MOD_AUTHORIZE]		= mod_authorize
+		[MOD_AUTHORIZE]		= mod_authorize,
+		[MOD_ACCOUNTING]	= mod_accounting
 	},
 };
 
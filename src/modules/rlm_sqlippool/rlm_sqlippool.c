@@ -34,6 +34,17 @@ RCSID("$Id$")
 
 #define MAX_QUERY_LEN 4096
 
+/*
+ *	Addresses claimed from the database ahead of time, so that
+ *	allocations don't contend on the same rows.
+ */
+typedef struct sqlippool_claimed {
+	char const	*pool_name;	//!< Pool-Name the addresses were claimed from.
+	char		**addrs;	//!< Claimed addresses, used from the end.
+	uint32_t	num;		//!< Number of addresses left.
+	time_t		claimed;	//!< When the addresses were claimed.
+} sqlippool_claimed_t;
+
 /*
  *	Define a structure for our module configuration.
  */
@@ -55,6 +66,17 @@ typedef struct rlm_sqlippool_t {
 	char const	*allocate_update;	//!< SQL query to mark an IP as used.
 	char const	*allocate_commit;	//!< SQL query to commit.
 
+	char const	*allocate_single;	//!< Query or procedure call which allocates an IP
+						//!< and returns it, in one round trip.
+
+	uint32_t	preclaim;		//!< How many addresses to claim at once.
+	uint32_t	preclaim_lifetime;	//!< How long claimed addresses may be used for.
+	char const	*allocate_preclaim;	//!< SQL query to claim a batch of IPs for this server.
+	fr_hash_table_t	*claimed;		//!< Claimed addresses, by Pool-Name.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	claimed_mutex;
+#endif
+
 	char const	*pool_check;		//!< Query to check for the existence of the pool.
 
 						/* Start sequence */
@@ -128,12 +150,20 @@ static CONF_PARSER module_config[] = {
 
 	{ FR_CONF_OFFSET("allocate_clear", PW_TYPE_STRING | PW_TYPE_XLAT , rlm_sqlippool_t, allocate_clear), .dflt = "" },
 
-	{ FR_CONF_OFFSET("allocate_find", PW_TYPE_STRING | PW_TYPE_XLAT | PW_TYPE_REQUIRED, rlm_sqlippool_t, allocate_find), .dflt = "" },
+	{ FR_CONF_OFFSET("allocate_find", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sqlippool_t, allocate_find), .dflt = "" },
 
 	{ FR_CONF_OFFSET("allocate_update", PW_TYPE_STRING | PW_TYPE_XLAT , rlm_sqlippool_t, allocate_update), .dflt = "" },
 
 	{ FR_CONF_OFFSET("allocate_commit", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sqlippool_t, allocate_commit), .dflt = "COMMIT" },
 
+	{ FR_CONF_OFFSET("allocate_single", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sqlippool_t, allocate_single), .dflt = "" },
+
+	{ FR_CONF_OFFSET("preclaim", PW_TYPE_INTEGER, rlm_sqlippool_t, preclaim), .dflt = "0" },
+
+	{ FR_CONF_OFFSET("preclaim_lifetime", PW_TYPE_INTEGER, rlm_sqlippool_t, preclaim_lifetime), .dflt = "30" },
+
+	{ FR_CONF_OFFSET("allocate_preclaim", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sqlippool_t, allocate_preclaim), .dflt = "" },
+
 
 	{ FR_CONF_OFFSET("pool_check", PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sqlippool_t, pool_check), .dflt = "" },
 
@@ -369,6 +399,155 @@ finish:
 	return retval;
 }
 
+/*
+ * Query the database expecting one address per row
+ *
+ * @return the number of addresses written to out, or -1 on error.
+ */
+static int sqlippool_query_rows(TALLOC_CTX *ctx, char ***out, char const *fmt,
+				rlm_sql_handle_t *handle, rlm_sqlippool_t *data, REQUEST *request)
+{
+	char query[MAX_QUERY_LEN];
+	char *expanded = NULL;
+	char **addrs;
+	int num = 0;
+
+	rlm_sql_row_t row;
+
+	*out = NULL;
+
+	sqlippool_expand(query, sizeof(query), fmt, data, NULL, 0);
+
+	if (radius_axlat(&expanded, request, query, data->sql_inst->sql_escape_func, handle) < 0) {
+		return -1;
+	}
+	if (data->sql_inst->sql_select_query(data->sql_inst, request, &handle, expanded) != 0) {
+		REDEBUG("database query error on '%s'", query);
+		talloc_free(expanded);
+		return -1;
+	}
+	talloc_free(expanded);
+
+	addrs = talloc_array(ctx, char *, data->preclaim);
+	if (!addrs) goto finish;
+
+	while ((num < (int) data->preclaim) &&
+	       (data->sql_inst->sql_fetch_row(&row, data->sql_inst, request, &handle) == 0) && row) {
+		if (!row[0]) continue;
+
+		addrs[num++] = talloc_typed_strdup(addrs, row[0]);
+	}
+
+finish:
+	(data->sql_inst->module->sql_finish_select_query)(handle, data->sql_inst->config);
+
+	*out = addrs;
+
+	return num;
+}
+
+static uint32_t sqlippool_claimed_hash(void const *data)
+{
+	sqlippool_claimed_t const *claimed = data;
+
+	return fr_hash_string(claimed->pool_name);
+}
+
+static int sqlippool_claimed_cmp(void const *one, void const *two)
+{
+	sqlippool_claimed_t const *a = one, *b = two;
+
+	return strcmp(a->pool_name, b->pool_name);
+}
+
+/** Take an address from the addresses this server has claimed
+ *
+ * If there are none left, or they are too old to use, claim another
+ * batch from the database.  Each batch is one query, after which
+ * allocations don't need a transaction, or any row locks.
+ *
+ * @return the length of the address written to out, or 0 if none are available.
+ */
+static int sqlippool_preclaimed(char *out, size_t outlen, rlm_sql_handle_t *handle,
+				rlm_sqlippool_t *inst, REQUEST *request, char const *pool_name)
+{
+	sqlippool_claimed_t	find, *claimed;
+	char			**addrs;
+	int			num, len = 0;
+	time_t			now = time(NULL);
+
+	find.pool_name = pool_name;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&inst->claimed_mutex);
+#endif
+	claimed = fr_hash_table_finddata(inst->claimed, &find);
+	if (claimed && claimed->num && ((claimed->claimed + (time_t) inst->preclaim_lifetime) > now)) goto pop;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&inst->claimed_mutex);
+#endif
+
+	/*
+	 *	Claim outside of the lock, so other pools
+	 *	aren't held up by the query.
+	 */
+	num = sqlippool_query_rows(NULL, &addrs, inst->allocate_preclaim, handle, inst, request);
+	if (num <= 0) {
+		talloc_free(addrs);
+		return 0;
+	}
+	RDEBUG2("Claimed %i addresses from pool %s", num, pool_name);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&inst->claimed_mutex);
+#endif
+	claimed = fr_hash_table_finddata(inst->claimed, &find);
+	if (!claimed) {
+		claimed = talloc_zero(inst->claimed, sqlippool_claimed_t);
+		if (!claimed) {
+			talloc_free(addrs);
+			goto done;
+		}
+		claimed->pool_name = talloc_typed_strdup(claimed, pool_name);
+		fr_hash_table_insert(inst->claimed, claimed);
+	}
+
+	/*
+	 *	Addresses which expired unused go back to the
+	 *	pool on their own, when their claim expires in
+	 *	the database.
+	 */
+	talloc_free(claimed->addrs);
+	claimed->addrs = talloc_steal(claimed, addrs);
+	claimed->num = num;
+	claimed->claimed = now;
+
+pop:
+	claimed->num--;
+	len = strlen(claimed->addrs[claimed->num]);
+	if ((size_t) len >= outlen) {
+		len = 0;
+	} else {
+		strcpy(out, claimed->addrs[claimed->num]);
+	}
+	TALLOC_FREE(claimed->addrs[claimed->num]);
+
+done:
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&inst->claimed_mutex);
+#endif
+
+	return len;
+}
+
+static int _sqlippool_claimed_free(rlm_sqlippool_t *inst)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&inst->claimed_mutex);
+#endif
+	return 0;
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -413,6 +592,32 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	}
 
 	inst->sql_inst = (rlm_sql_t *) sql_inst->insthandle;
+
+	if ((!inst->allocate_find || !*inst->allocate_find) &&
+	    (!inst->allocate_single || !*inst->allocate_single)) {
+		cf_log_err_cs(conf, "One of 'allocate_find' or 'allocate_single' must be set");
+		return -1;
+	}
+
+	if (inst->preclaim) {
+		if (!inst->allocate_preclaim || !*inst->allocate_preclaim) {
+			cf_log_err_cs(conf, "'preclaim' requires an 'allocate_preclaim' query");
+			return -1;
+		}
+
+		if (!inst->allocate_update || !*inst->allocate_update) {
+			cf_log_err_cs(conf, "'preclaim' requires an 'allocate_update' query");
+			return -1;
+		}
+
+		inst->claimed = fr_hash_table_create(inst, sqlippool_claimed_hash, sqlippool_claimed_cmp, NULL);
+		if (!inst->claimed) return -1;
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_init(&inst->claimed_mutex, NULL);
+#endif
+		talloc_set_destructor(inst, _sqlippool_claimed_free);
+	}
+
 	return 0;
 }
 
@@ -450,6 +655,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, REQUEST *reque
 	VALUE_PAIR *vp;
 	rlm_sql_handle_t *handle;
 	time_t now;
+	VALUE_PAIR *pool_name;
 
 	/*
 	 *	If there is a Framed-IP-Address attribute in the reply do nothing
@@ -460,7 +666,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, REQUEST *reque
 		return do_logging(request, inst->log_exists, RLM_MODULE_NOOP);
 	}
 
-	if (fr_pair_find_by_num(request->config, 0, PW_POOL_NAME, TAG_ANY) == NULL) {
+	pool_name = fr_pair_find_by_num(request->config, 0, PW_POOL_NAME, TAG_ANY);
+	if (!pool_name) {
 		RDEBUG("No Pool-Name defined");
 
 		return do_logging(request, inst->log_nopool, RLM_MODULE_NOOP);
@@ -492,6 +699,64 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, REQUEST *reque
 		DO(allocate_commit);
 	}
 
+	/*
+	 *	Use an address we've already claimed.  Marking it
+	 *	as used is a single UPDATE by address, so needs no
+	 *	transaction.
+	 */
+	if (inst->claimed) {
+		allocation_len = sqlippool_preclaimed(allocation, sizeof(allocation), handle,
+						      inst, request, pool_name->vp_strvalue);
+		if (allocation_len > 0) {
+			vp = fr_pair_afrom_num(request->reply, 0, inst->framed_ip_address);
+			if (fr_pair_value_from_str(vp, allocation, allocation_len) < 0) {
+				talloc_free(vp);
+				RDEBUG("Invalid IP number [%s] claimed from pool", allocation);
+				goto allocate;
+			}
+
+			if (sqlippool_command(inst->allocate_update, handle, inst, request,
+					      allocation, allocation_len) < 0) {
+				talloc_free(vp);
+				goto allocate;
+			}
+
+			RDEBUG("Allocated claimed IP %s", allocation);
+			fr_pair_add(&request->reply->vps, vp);
+
+			fr_connection_release(inst->sql_inst->pool, handle);
+
+			return do_logging(request, inst->log_success, RLM_MODULE_OK);
+		}
+	}
+
+allocate:
+	/*
+	 *	One query (usually a stored procedure) does the
+	 *	find and the update, and returns the address.
+	 */
+	if (inst->allocate_single && *inst->allocate_single) {
+		allocation_len = sqlippool_query1(allocation, sizeof(allocation),
+						  inst->allocate_single, handle,
+						  inst, request, (char *) NULL, 0);
+		if (allocation_len <= 0) goto not_found;
+
+		vp = fr_pair_afrom_num(request->reply, 0, inst->framed_ip_address);
+		if (fr_pair_value_from_str(vp, allocation, allocation_len) < 0) {
+			talloc_free(vp);
+			RDEBUG("Invalid IP number [%s] returned from instbase query.", allocation);
+			fr_connection_release(inst->sql_inst->pool, handle);
+			return do_logging(request, inst->log_failed, RLM_MODULE_NOOP);
+		}
+
+		RDEBUG("Allocated IP %s", allocation);
+		fr_pair_add(&request->reply->vps, vp);
+
+		fr_connection_release(inst->sql_inst->pool, handle);
+
+		return do_logging(request, inst->log_success, RLM_MODULE_OK);
+	}
+
 	DO(allocate_begin);
 
 	allocation_len = sqlippool_query1(allocation, sizeof(allocation),
@@ -504,6 +769,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, REQUEST *reque
 	if (allocation_len == 0) {
 		DO(allocate_commit);
 
+	not_found:
 		/*
 		 *Should we perform pool-check ?
 		 */
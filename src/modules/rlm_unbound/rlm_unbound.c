@@ -27,9 +27,58 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/log.h>
+#include <freeradius-devel/hash.h>
 #include <fcntl.h>
 #include <unbound.h>
 
+#include "config.h"
+
+#ifdef HAVE_PTHREAD_H
+#  define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#  define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#  define PTHREAD_MUTEX_LOCK(_x)
+#  define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+/*
+ *	The answer cache is split into shards, each with its own lock,
+ *	so that threads looking up different names rarely wait for
+ *	each other.
+ */
+#define UNBOUND_CACHE_SHARDS	(16)
+
+#define RR_TYPE_A		(1)
+#define RR_TYPE_PTR		(12)
+#define RR_TYPE_AAAA		(28)
+
+/** A cached answer for one xlat lookup
+ *
+ */
+typedef struct unbound_cache_entry_t {
+	uint16_t		rrtype;
+	char const		*name;		//!< What was looked up.
+	char const		*answer;	//!< What the xlat returned.
+
+	time_t			expires;	//!< When the answer's TTL runs out.
+	time_t			prefetch;	//!< When to refresh the answer if it's popular.
+	uint32_t		hits;		//!< Lookups since the answer was last refreshed.
+	bool			refreshing;	//!< A query to refresh the answer is outstanding.
+
+	struct unbound_cache_entry_t *prev;	//!< Used more recently.
+	struct unbound_cache_entry_t *next;	//!< Used less recently.
+} unbound_cache_entry_t;
+
+typedef struct unbound_cache_shard_t {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+#endif
+	fr_hash_table_t		*ht;
+	unbound_cache_entry_t	*head;		//!< Most recently used.
+	unbound_cache_entry_t	*tail;		//!< Least recently used, evicted first.
+	uint32_t		num_entries;
+} unbound_cache_shard_t;
+
 typedef struct rlm_unbound_t {
 	struct ub_ctx	*ub;   /* This must come first.  Do not move */
 	fr_event_list_t	*el; /* This must come second.  Do not move. */
@@ -43,6 +92,17 @@ typedef struct rlm_unbound_t {
 
 	char const	*filename;
 
+	uint32_t	cache_max_entries;	//!< 0 disables the answer cache.
+	uint32_t	cache_max_ttl;
+	uint32_t	cache_stale_ttl;	//!< How long an expired answer may be used, while
+						//!< it's being refreshed.
+	uint32_t	cache_prefetch_hits;	//!< How often an answer must have been used to be
+						//!< refreshed before it expires.
+	uint32_t	cache_prefetch_percent;	//!< How much of the TTL must be left for it to
+						//!< be refreshed.
+
+	unbound_cache_shard_t	*cache;
+
 	int		log_fd;
 	FILE		*log_stream;
 
@@ -51,12 +111,22 @@ typedef struct rlm_unbound_t {
 	bool		log_pipe_in_use;
 } rlm_unbound_t;
 
+static const CONF_PARSER cache_config[] = {
+	{ FR_CONF_OFFSET("max_entries", PW_TYPE_INTEGER, rlm_unbound_t, cache_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_ttl", PW_TYPE_INTEGER, rlm_unbound_t, cache_max_ttl), .dflt = "3600" },
+	{ FR_CONF_OFFSET("stale_ttl", PW_TYPE_INTEGER, rlm_unbound_t, cache_stale_ttl), .dflt = "30" },
+	{ FR_CONF_OFFSET("prefetch_hits", PW_TYPE_INTEGER, rlm_unbound_t, cache_prefetch_hits), .dflt = "3" },
+	{ FR_CONF_OFFSET("prefetch_percent", PW_TYPE_INTEGER, rlm_unbound_t, cache_prefetch_percent), .dflt = "10" },
+	CONF_PARSER_TERMINATOR
+};
+
 /*
  *	A mapping of configuration file names to internal variables.
  */
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", PW_TYPE_FILE_INPUT | PW_TYPE_REQUIRED, rlm_unbound_t, filename), .dflt = "${modconfdir}/unbound/default.conf" },
 	{ FR_CONF_OFFSET("timeout", PW_TYPE_INTEGER, rlm_unbound_t, timeout), .dflt = "3000" },
+	{ FR_CONF_POINTER("cache", PW_TYPE_SUBSECTION, NULL), .dflt = (void const *) cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -210,144 +280,393 @@ static int ub_common_fail(REQUEST *request, char const *tag, struct ub_result *u
 	return 0;
 }
 
-static ssize_t xlat_a(char **out, size_t outlen,
-		      void const *mod_inst, UNUSED void const *xlat_inst,
-		      REQUEST *request, char const *fmt)
+/*
+ *	Write the first record of a result as a string.
+ */
+static int ub_result_tostr(char *out, size_t outlen, int rrtype, struct ub_result *ub)
 {
-	rlm_unbound_t const *inst = mod_inst;
-	struct ub_result **ubres;
-	int async_id;
-	char *fmt2; /* For const warnings.  Keep till new libunbound ships. */
+	switch (rrtype) {
+	case RR_TYPE_A:
+		if (!inet_ntop(AF_INET, ub->data[0], out, outlen)) return -1;
+		return 0;
 
-	/* This has to be on the heap, because threads. */
-	ubres = talloc(inst, struct ub_result *);
+	case RR_TYPE_AAAA:
+		if (!inet_ntop(AF_INET6, ub->data[0], out, outlen)) return -1;
+		return 0;
 
-	/* Used and thus impossible value from heap to designate incomplete */
-	memcpy(ubres, &mod_inst, sizeof(*ubres));
+	case RR_TYPE_PTR:
+		if (rrlabels_tostr(out, ub->data[0], outlen) < 0) return -1;
+		return 0;
 
-	fmt2 = talloc_typed_strdup(inst, fmt);
-	ub_resolve_async(inst->ub, fmt2, 1, 1, ubres, link_ubres, &async_id);
-	talloc_free(fmt2);
+	default:
+		return -1;
+	}
+}
 
-	if (ub_common_wait(inst, request, inst->xlat_a_name, ubres, async_id)) {
-		goto error0;
+/*
+ *	How long to cache a result for.
+ */
+static uint32_t ub_result_ttl(rlm_unbound_t const *inst, struct ub_result *ub)
+{
+#ifdef HAVE_STRUCT_UB_RESULT_TTL
+	if ((ub->ttl >= 0) && ((uint32_t) ub->ttl < inst->cache_max_ttl)) return ub->ttl;
+#else
+	(void) ub;
+#endif
+	return inst->cache_max_ttl;
+}
+
+static uint32_t cache_entry_hash(void const *data)
+{
+	unbound_cache_entry_t const *entry = data;
+
+	return fr_hash_update(&entry->rrtype, sizeof(entry->rrtype), fr_hash_string(entry->name));
+}
+
+static int cache_entry_cmp(void const *one, void const *two)
+{
+	unbound_cache_entry_t const *a = one, *b = two;
+
+	if (a->rrtype != b->rrtype) return a->rrtype - b->rrtype;
+
+	return strcmp(a->name, b->name);
+}
+
+static unbound_cache_shard_t *cache_shard(rlm_unbound_t const *inst, unbound_cache_entry_t const *key)
+{
+	return &inst->cache[cache_entry_hash(key) % UNBOUND_CACHE_SHARDS];
+}
+
+static void cache_lru_unlink(unbound_cache_shard_t *shard, unbound_cache_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		shard->head = entry->next;
 	}
 
-	if (*ubres) {
-		if (ub_common_fail(request, inst->xlat_a_name, *ubres)) {
-			goto error1;
-		}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		shard->tail = entry->prev;
+	}
 
-		if (!inet_ntop(AF_INET, (*ubres)->data[0], *out, outlen)) {
-			goto error1;
-		};
+	entry->prev = entry->next = NULL;
+}
 
-		ub_resolve_free(*ubres);
-		talloc_free(ubres);
-		return strlen(*out);
+static void cache_lru_push(unbound_cache_shard_t *shard, unbound_cache_entry_t *entry)
+{
+	entry->prev = NULL;
+	entry->next = shard->head;
+	if (shard->head) shard->head->prev = entry;
+	shard->head = entry;
+	if (!shard->tail) shard->tail = entry;
+}
+
+/*
+ *	Must be called with the shard locked.
+ */
+static void cache_entry_delete(unbound_cache_shard_t *shard, unbound_cache_entry_t *entry)
+{
+	cache_lru_unlink(shard, entry);
+	fr_hash_table_yank(shard->ht, entry);
+	shard->num_entries--;
+	talloc_free(entry);
+}
+
+/*
+ *	Set the answer and the times for an entry.  Must be called with
+ *	the shard locked.
+ */
+static int cache_entry_set(rlm_unbound_t const *inst, unbound_cache_entry_t *entry,
+			   char const *answer, uint32_t ttl, time_t now)
+{
+	char const *copy;
+
+	copy = talloc_typed_strdup(entry, answer);
+	if (!copy) return -1;
+
+	rad_const_free(entry->answer);
+	entry->answer = copy;
+	entry->expires = now + ttl;
+	entry->prefetch = 0;
+	entry->hits = 0;
+
+	if (inst->cache_prefetch_percent) {
+		entry->prefetch = entry->expires - ((ttl * inst->cache_prefetch_percent) / 100);
 	}
 
-	RWDEBUG("rlm_unbound (%s): no result", inst->xlat_a_name);
+	return 0;
+}
 
- error1:
-	ub_resolve_free(*ubres); /* Handles NULL gracefully */
+/*
+ *	Add or update an answer.
+ */
+static void cache_insert(rlm_unbound_t const *inst, int rrtype, char const *name, char const *answer, uint32_t ttl)
+{
+	unbound_cache_shard_t	*shard;
+	unbound_cache_entry_t	my_entry, *entry;
+	time_t			now = time(NULL);
+
+	if (!inst->cache || !ttl) return;
+
+	memset(&my_entry, 0, sizeof(my_entry));
+	my_entry.rrtype = rrtype;
+	my_entry.name = name;
+	shard = cache_shard(inst, &my_entry);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = fr_hash_table_finddata(shard->ht, &my_entry);
+	if (entry) {
+		if (cache_entry_set(inst, entry, answer, ttl, now) < 0) cache_entry_delete(shard, entry);
+		goto done;
+	}
 
- error0:
-	talloc_free(ubres);
-	return -1;
+	/*
+	 *	Make room by evicting the least recently used answer.
+	 */
+	if (shard->tail && (shard->num_entries >= (inst->cache_max_entries / UNBOUND_CACHE_SHARDS))) {
+		cache_entry_delete(shard, shard->tail);
+	}
+
+	entry = talloc_zero(shard->ht, unbound_cache_entry_t);
+	if (!entry) goto done;
+
+	entry->rrtype = rrtype;
+	entry->name = talloc_typed_strdup(entry, name);
+	if (!entry->name || (cache_entry_set(inst, entry, answer, ttl, now) < 0) ||
+	    !fr_hash_table_insert(shard->ht, entry)) {
+		talloc_free(entry);
+		goto done;
+	}
+	cache_lru_push(shard, entry);
+	shard->num_entries++;
+
+done:
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 }
 
-static ssize_t xlat_aaaa(char **out, size_t outlen,
-			 void const *mod_inst, UNUSED void const *xlat_inst,
-			 REQUEST *request, char const *fmt)
+/** Context for a query refreshing a cached answer
+ *
+ */
+typedef struct unbound_cache_refresh_t {
+	rlm_unbound_t const	*inst;
+	int			rrtype;
+	char			*name;
+} unbound_cache_refresh_t;
+
+/*
+ *	Allow the answer to be refreshed again.
+ */
+static void cache_refresh_clear(rlm_unbound_t const *inst, int rrtype, char const *name)
 {
-	rlm_unbound_t const *inst = mod_inst;
-	struct ub_result **ubres;
-	int async_id;
-	char *fmt2; /* For const warnings.  Keep till new libunbound ships. */
+	unbound_cache_shard_t	*shard;
+	unbound_cache_entry_t	my_entry, *entry;
+
+	memset(&my_entry, 0, sizeof(my_entry));
+	my_entry.rrtype = rrtype;
+	my_entry.name = name;
+	shard = cache_shard(inst, &my_entry);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = fr_hash_table_finddata(shard->ht, &my_entry);
+	if (entry) entry->refreshing = false;
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+}
 
-	/* This has to be on the heap, because threads. */
-	ubres = talloc(inst, struct ub_result *);
+/*
+ *	Called by ub_process() when a refresh query completes.
+ */
+static void cache_refresh_done(void *my_arg, int err, struct ub_result *result)
+{
+	unbound_cache_refresh_t	*refresh = my_arg;
+	rlm_unbound_t const	*inst = refresh->inst;
+	char			answer[256];
 
-	/* Used and thus impossible value from heap to designate incomplete */
-	memcpy(ubres, &mod_inst, sizeof(*ubres));
+	/*
+	 *	On failure, the old answer is used until it's too stale,
+	 *	or until the next lookup tries again.
+	 */
+	if (!err && result && result->havedata && !result->bogus &&
+	    (ub_result_tostr(answer, sizeof(answer), refresh->rrtype, result) == 0)) {
+		cache_insert(inst, refresh->rrtype, refresh->name, answer, ub_result_ttl(inst, result));
+	}
+	cache_refresh_clear(inst, refresh->rrtype, refresh->name);
 
-	fmt2 = talloc_typed_strdup(inst, fmt);
-	ub_resolve_async(inst->ub, fmt2, 28, 1, ubres, link_ubres, &async_id);
-	talloc_free(fmt2);
+	ub_resolve_free(result);	/* Handles NULL gracefully */
+	talloc_free(refresh);
+}
 
-	if (ub_common_wait(inst, request, inst->xlat_aaaa_name, ubres, async_id)) {
-		goto error0;
+/*
+ *	Start a query to refresh a cached answer.  The result is
+ *	delivered by ub_process() in whichever thread next calls it,
+ *	normally the one servicing the instance's file descriptor.
+ */
+static void cache_refresh(rlm_unbound_t const *inst, int rrtype, char const *name)
+{
+	unbound_cache_refresh_t *refresh;
+
+	refresh = talloc_zero(NULL, unbound_cache_refresh_t);
+	if (!refresh) return;
+
+	refresh->inst = inst;
+	refresh->rrtype = rrtype;
+	refresh->name = talloc_typed_strdup(refresh, name);
+	if (!refresh->name ||
+	    (ub_resolve_async(inst->ub, refresh->name, rrtype, 1, refresh, cache_refresh_done, NULL) != 0)) {
+		talloc_free(refresh);
+		cache_refresh_clear(inst, rrtype, name);
 	}
+}
 
-	if (*ubres) {
-		if (ub_common_fail(request, inst->xlat_aaaa_name, *ubres)) {
-			goto error1;
+/*
+ *	Look for a cached answer.
+ *
+ *	Fresh answers are returned as-is.  Popular answers which are
+ *	about to expire, and expired answers which are still within
+ *	"stale_ttl", are returned too, and a query is started to
+ *	refresh them.  Nobody waits for DNS at the TTL boundary.
+ *
+ *	Returns the length of the answer, or -1 if there isn't one.
+ */
+static ssize_t cache_lookup(rlm_unbound_t const *inst, REQUEST *request, char const *tag,
+			    int rrtype, char const *name, char *out, size_t outlen)
+{
+	unbound_cache_shard_t	*shard;
+	unbound_cache_entry_t	my_entry, *entry;
+	time_t			now = time(NULL);
+	bool			refresh = false, stale = false;
+	ssize_t			slen = -1;
+
+	if (!inst->cache) return -1;
+
+	memset(&my_entry, 0, sizeof(my_entry));
+	my_entry.rrtype = rrtype;
+	my_entry.name = name;
+	shard = cache_shard(inst, &my_entry);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = fr_hash_table_finddata(shard->ht, &my_entry);
+	if (!entry) goto done;
+
+	if (now >= entry->expires) {
+		if (now >= (entry->expires + (time_t) inst->cache_stale_ttl)) {
+			cache_entry_delete(shard, entry);
+			goto done;
 		}
-		if (!inet_ntop(AF_INET6, (*ubres)->data[0], *out, outlen)) {
-			goto error1;
-		};
-		ub_resolve_free(*ubres);
-		talloc_free(ubres);
-		return strlen(*out);
+
+		stale = refresh = true;
+
+	} else if (entry->prefetch && (now >= entry->prefetch) &&
+		   (entry->hits >= inst->cache_prefetch_hits)) {
+		refresh = true;
 	}
 
-	RWDEBUG("rlm_unbound (%s): no result", inst->xlat_aaaa_name);
+	if (refresh) {
+		if (entry->refreshing) {
+			refresh = false;
+		} else {
+			entry->refreshing = true;
+		}
+	}
 
-error1:
-	ub_resolve_free(*ubres); /* Handles NULL gracefully */
+	entry->hits++;
+	cache_lru_unlink(shard, entry);
+	cache_lru_push(shard, entry);
 
-error0:
-	talloc_free(ubres);
-	return -1;
+	slen = strlcpy(out, entry->answer, outlen);
+	if ((size_t) slen >= outlen) slen = -1;
+
+done:
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	if (slen < 0) return -1;
+
+	RDEBUG2("rlm_unbound (%s): Using cached answer%s", tag, stale ? " (stale)" : "");
+
+	if (refresh) cache_refresh(inst, rrtype, name);
+
+	return slen;
 }
 
-static ssize_t xlat_ptr(char **out, size_t outlen,
-			void const *mod_inst, UNUSED void const *xlat_inst,
-			REQUEST *request, char const *fmt)
+static ssize_t xlat_resolve(rlm_unbound_t const *inst, REQUEST *request, char const *tag, int rrtype,
+			    char const *fmt, char *out, size_t outlen)
 {
-	rlm_unbound_t const *inst = mod_inst;
 	struct ub_result **ubres;
 	int async_id;
+	ssize_t slen;
 	char *fmt2; /* For const warnings.  Keep till new libunbound ships. */
 
+	slen = cache_lookup(inst, request, tag, rrtype, fmt, out, outlen);
+	if (slen >= 0) return slen;
+
 	/* This has to be on the heap, because threads. */
 	ubres = talloc(inst, struct ub_result *);
 
 	/* Used and thus impossible value from heap to designate incomplete */
-	memcpy(ubres, &mod_inst, sizeof(*ubres));;
+	memcpy(ubres, &inst, sizeof(*ubres));
 
 	fmt2 = talloc_typed_strdup(inst, fmt);
-	ub_resolve_async(inst->ub, fmt2, 12, 1, ubres, link_ubres, &async_id);
+	ub_resolve_async(inst->ub, fmt2, rrtype, 1, ubres, link_ubres, &async_id);
 	talloc_free(fmt2);
 
-	if (ub_common_wait(inst, request, inst->xlat_ptr_name,
-			   ubres, async_id)) {
+	if (ub_common_wait(inst, request, tag, ubres, async_id)) {
 		goto error0;
 	}
 
 	if (*ubres) {
-		if (ub_common_fail(request, inst->xlat_ptr_name, *ubres)) {
+		if (ub_common_fail(request, tag, *ubres)) {
 			goto error1;
 		}
-		if (rrlabels_tostr(*out, (*ubres)->data[0], outlen) < 0) {
+
+		if (ub_result_tostr(out, outlen, rrtype, *ubres) < 0) {
 			goto error1;
 		}
+
+		cache_insert(inst, rrtype, fmt, out, ub_result_ttl(inst, *ubres));
+
 		ub_resolve_free(*ubres);
 		talloc_free(ubres);
-		return strlen(*out);
+		return strlen(out);
 	}
 
-	RWDEBUG("rlm_unbound (%s): no result", inst->xlat_ptr_name);
+	RWDEBUG("rlm_unbound (%s): no result", tag);
 
-error1:
-	ub_resolve_free(*ubres);  /* Handles NULL gracefully */
+ error1:
+	ub_resolve_free(*ubres); /* Handles NULL gracefully */
 
-error0:
+ error0:
 	talloc_free(ubres);
 	return -1;
 }
 
+static ssize_t xlat_a(char **out, size_t outlen,
+		      void const *mod_inst, UNUSED void const *xlat_inst,
+		      REQUEST *request, char const *fmt)
+{
+	rlm_unbound_t const *inst = mod_inst;
+
+	return xlat_resolve(inst, request, inst->xlat_a_name, RR_TYPE_A, fmt, *out, outlen);
+}
+
+static ssize_t xlat_aaaa(char **out, size_t outlen,
+			 void const *mod_inst, UNUSED void const *xlat_inst,
+			 REQUEST *request, char const *fmt)
+{
+	rlm_unbound_t const *inst = mod_inst;
+
+	return xlat_resolve(inst, request, inst->xlat_aaaa_name, RR_TYPE_AAAA, fmt, *out, outlen);
+}
+
+static ssize_t xlat_ptr(char **out, size_t outlen,
+			void const *mod_inst, UNUSED void const *xlat_inst,
+			REQUEST *request, char const *fmt)
+{
+	rlm_unbound_t const *inst = mod_inst;
+
+	return xlat_resolve(inst, request, inst->xlat_ptr_name, RR_TYPE_PTR, fmt, *out, outlen);
+}
+
 /*
  *	Even when run in asyncronous mode, callbacks sent to libunbound still
  *	must be run in an application-side thread (via ub_process.)  This is
@@ -408,6 +727,12 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	if (inst->cache_max_entries) {
+		FR_INTEGER_BOUND_CHECK("cache.max_entries", inst->cache_max_entries, >=, UNBOUND_CACHE_SHARDS);
+		FR_INTEGER_BOUND_CHECK("cache.max_ttl", inst->cache_max_ttl, >=, 1);
+		FR_INTEGER_BOUND_CHECK("cache.prefetch_percent", inst->cache_prefetch_percent, <=, 50);
+	}
+
 	MEM(inst->xlat_a_name = talloc_typed_asprintf(inst, "%s-a", inst->name));
 	MEM(inst->xlat_aaaa_name = talloc_typed_asprintf(inst, "%s-aaaa", inst->name));
 	MEM(inst->xlat_ptr_name = talloc_typed_asprintf(inst, "%s-ptr", inst->name));
@@ -714,6 +1039,24 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 
 	}
 
+	if (inst->cache_max_entries) {
+		int i;
+
+		inst->cache = talloc_zero_array(inst, unbound_cache_shard_t, UNBOUND_CACHE_SHARDS);
+		if (!inst->cache) goto error_nores;
+
+		for (i = 0; i < UNBOUND_CACHE_SHARDS; i++) {
+			inst->cache[i].ht = fr_hash_table_create(inst->cache, cache_entry_hash, cache_entry_cmp, NULL);
+			if (!inst->cache[i].ht) {
+				cf_log_err_cs(conf, "Failed creating answer cache");
+				goto error_nores;
+			}
+#ifdef HAVE_PTHREAD_H
+			pthread_mutex_init(&inst->cache[i].mutex, NULL);
+#endif
+		}
+	}
+
 	return 0;
 
  error:
@@ -758,6 +1101,14 @@ static int mod_detach(UNUSED void *instance)
 		fclose(inst->log_stream);
 	}
 
+#ifdef HAVE_PTHREAD_H
+	if (inst->cache) {
+		int i;
+
+		for (i = 0; i < UNBOUND_CACHE_SHARDS; i++) pthread_mutex_destroy(&inst->cache[i].mutex);
+	}
+#endif
+
 	return 0;
 }
 
@@ -25,13 +25,13 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
+#include <freeradius-devel/str.h>
 
 /*
  *	Reject any non-UTF8 data.
  */
 static rlm_rcode_t CC_HINT(nonnull) mod_utf8_clean(UNUSED void *instance, REQUEST *request)
 {
-	size_t i, len;
 	VALUE_PAIR *vp;
 	vp_cursor_t cursor;
 
@@ -40,10 +40,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_utf8_clean(UNUSED void *instance, REQUES
 	     vp = fr_cursor_next(&cursor)) {
 		if (vp->da->type != PW_TYPE_STRING) continue;
 
-		for (i = 0; i < vp->vp_length; i += len) {
-			len = fr_utf8_char(&vp->vp_octets[i], -1);
-			if (len == 0) return RLM_MODULE_FAIL;
-		}
+		if (fr_str_utf8_valid(vp->vp_octets, vp->vp_length) < vp->vp_length) return RLM_MODULE_FAIL;
 	}
 
 	return RLM_MODULE_NOOP;
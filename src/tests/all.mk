@@ -1,4 +1,4 @@
-SUBMAKEFILES := rbmonkey.mk eapol_test/all.mk dict/all.mk unit/all.mk map/all.mk xlat/all.mk keywords/all.mk auth/all.mk modules/all.mk daemon/all.mk
+SUBMAKEFILES := rbmonkey.mk socket_filter.mk hash_rcu_test.mk hash_oa_test.mk atomic_queue_test.mk thread_channel_test.mk fiber_test.mk eapol_test/all.mk dict/all.mk unit/all.mk map/all.mk xlat/all.mk keywords/all.mk auth/all.mk modules/all.mk daemon/all.mk perf/all.mk
 
 #
 #  Include all of the autoconf definitions into the Make variable space
@@ -0,0 +1,340 @@
+/*
+ *	Tests for the SPSC and MPSC rings.
+ *
+ *	The boundaries are checked from one thread: empty, full, and
+ *	batches which straddle the end of the ring.  Then producer and
+ *	consumer threads run against small rings, so they keep hitting
+ *	those boundaries, and the consumer checks that every entry
+ *	arrives once, in order, and that batches aren't interleaved.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/atomic_queue.h>
+
+#ifdef HAVE_STDATOMIC_H
+static int fail = 0;
+
+#define CHECK(_x, _msg) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "FAIL %s:%i: %s\n", __FILE__, __LINE__, _msg); \
+		fail++; \
+	} \
+} while (0)
+
+#define RING_SIZE	(8)
+#define NUM_PRODUCERS	(4)
+#define NUM_ITEMS	(200000)	/* per producer */
+#define MAX_BATCH	(5)
+
+/*
+ *	What's passed through the rings.  "pos" is the item's
+ *	position in the batch it was pushed with.
+ */
+typedef struct {
+	int		producer;
+	int		seq;
+	int		pos;
+} item_t;
+
+static item_t	items[NUM_PRODUCERS][NUM_ITEMS];
+
+static void items_init(void)
+{
+	int i, j;
+
+	for (i = 0; i < NUM_PRODUCERS; i++) {
+		for (j = 0; j < NUM_ITEMS; j++) {
+			items[i][j].producer = i;
+			items[i][j].seq = j;
+		}
+	}
+}
+
+static void test_spsc_boundaries(void)
+{
+	fr_spsc_queue_t	*sq;
+	void		*in[RING_SIZE * 2], *out[RING_SIZE * 2], *p;
+	int		i, lap;
+
+	for (i = 0; i < RING_SIZE * 2; i++) in[i] = &items[0][i];
+
+	sq = fr_spsc_queue_create(NULL, RING_SIZE - 3);
+	if (!sq) {
+		fprintf(stderr, "Failed creating queue\n");
+		fail++;
+		return;
+	}
+	CHECK(fr_spsc_queue_size(sq) == RING_SIZE, "size wasn't rounded up to a power of 2");
+
+	CHECK(!fr_spsc_queue_pop(sq, &p), "popped from an empty queue");
+	CHECK(fr_spsc_queue_pop_batch(sq, out, RING_SIZE) == 0, "popped from an empty queue");
+	CHECK(fr_spsc_queue_num_elements(sq) == 0, "empty queue has elements");
+
+	for (i = 0; i < RING_SIZE; i++) CHECK(fr_spsc_queue_push(sq, in[i]), "push failed");
+	CHECK(!fr_spsc_queue_push(sq, in[RING_SIZE]), "pushed onto a full queue");
+	CHECK(fr_spsc_queue_push_batch(sq, in, 1) == 0, "pushed onto a full queue");
+	CHECK(fr_spsc_queue_num_elements(sq) == RING_SIZE, "full queue has the wrong number of elements");
+
+	for (i = 0; i < RING_SIZE; i++) {
+		CHECK(fr_spsc_queue_pop(sq, &p) && (p == in[i]), "popped the wrong entry");
+	}
+	CHECK(!fr_spsc_queue_pop(sq, &p), "popped from an empty queue");
+
+	/*
+	 *	Batches of 3 go round the ring of 8 several times, so
+	 *	most of them are split across the end.  Each push is
+	 *	limited by the room left.
+	 */
+	for (lap = 0; lap < 20; lap++) {
+		size_t pushed, popped;
+
+		pushed = fr_spsc_queue_push_batch(sq, in, 3);
+		CHECK(pushed == 3, "batch push failed");
+		pushed = fr_spsc_queue_push_batch(sq, in + 3, RING_SIZE);
+		CHECK(pushed == RING_SIZE - 3, "batch push wasn't limited to the room left");
+		CHECK(fr_spsc_queue_num_elements(sq) == RING_SIZE, "full queue has the wrong number of elements");
+
+		popped = fr_spsc_queue_pop_batch(sq, out, 3 + (lap % 3));
+		CHECK(popped == (size_t) (3 + (lap % 3)), "batch pop failed");
+		for (i = 0; i < (int) popped; i++) CHECK(out[i] == in[i], "popped the wrong entry");
+
+		popped += fr_spsc_queue_pop_batch(sq, out + popped, RING_SIZE * 2);
+		CHECK(popped == RING_SIZE, "batch pop didn't empty the queue");
+		for (i = 0; i < RING_SIZE; i++) CHECK(out[i] == in[i], "popped the wrong entry");
+
+		/*
+		 *	Leave the ring part full, so the next lap
+		 *	starts somewhere else.
+		 */
+		CHECK(fr_spsc_queue_push_batch(sq, in, 1 + (lap % 5)) == (size_t) (1 + (lap % 5)), "batch push failed");
+		CHECK(fr_spsc_queue_pop_batch(sq, out, RING_SIZE) == (size_t) (1 + (lap % 5)), "batch pop failed");
+	}
+
+	talloc_free(sq);
+}
+
+static void test_mpsc_boundaries(void)
+{
+	fr_mpsc_queue_t	*mq;
+	void		*in[RING_SIZE * 2], *out[RING_SIZE * 2], *p;
+	int		i, lap;
+
+	for (i = 0; i < RING_SIZE * 2; i++) in[i] = &items[0][i];
+
+	mq = fr_mpsc_queue_create(NULL, RING_SIZE);
+	if (!mq) {
+		fprintf(stderr, "Failed creating queue\n");
+		fail++;
+		return;
+	}
+	CHECK(fr_mpsc_queue_size(mq) == RING_SIZE, "wrong size");
+
+	CHECK(!fr_mpsc_queue_pop(mq, &p), "popped from an empty queue");
+	CHECK(fr_mpsc_queue_push_batch(mq, in, 0) == 0, "pushed an empty batch");
+
+	for (i = 0; i < RING_SIZE; i++) CHECK(fr_mpsc_queue_push(mq, in[i]), "push failed");
+	CHECK(!fr_mpsc_queue_push(mq, in[RING_SIZE]), "pushed onto a full queue");
+	CHECK(fr_mpsc_queue_num_elements(mq) == RING_SIZE, "full queue has the wrong number of elements");
+
+	for (i = 0; i < RING_SIZE; i++) {
+		CHECK(fr_mpsc_queue_pop(mq, &p) && (p == in[i]), "popped the wrong entry");
+	}
+	CHECK(!fr_mpsc_queue_pop(mq, &p), "popped from an empty queue");
+
+	for (lap = 0; lap < 20; lap++) {
+		size_t pushed, popped;
+
+		pushed = fr_mpsc_queue_push_batch(mq, in, 3);
+		CHECK(pushed == 3, "batch push failed");
+		pushed = fr_mpsc_queue_push_batch(mq, in + 3, RING_SIZE);
+		CHECK(pushed == RING_SIZE - 3, "batch push wasn't limited to the room left");
+		CHECK(fr_mpsc_queue_push_batch(mq, in, 1) == 0, "pushed onto a full queue");
+
+		popped = fr_mpsc_queue_pop_batch(mq, out, 3 + (lap % 3));
+		CHECK(popped == (size_t) (3 + (lap % 3)), "batch pop failed");
+
+		popped += fr_mpsc_queue_pop_batch(mq, out + popped, RING_SIZE * 2);
+		CHECK(popped == RING_SIZE, "batch pop didn't empty the queue");
+		for (i = 0; i < RING_SIZE; i++) CHECK(out[i] == in[i], "popped the wrong entry");
+
+		CHECK(fr_mpsc_queue_push_batch(mq, in, 1 + (lap % 5)) == (size_t) (1 + (lap % 5)), "batch push failed");
+		CHECK(fr_mpsc_queue_pop_batch(mq, out, RING_SIZE) == (size_t) (1 + (lap % 5)), "batch pop failed");
+	}
+
+	talloc_free(mq);
+}
+
+/*
+ *	Push all of a producer's items, in batches of varying sizes.
+ *	When only part of a batch fits, the rest is pushed as a new
+ *	batch.
+ */
+typedef size_t (*push_batch_t)(void *queue, void * const *data, size_t num);
+
+typedef struct {
+	void		*queue;
+	push_batch_t	push_batch;
+	int		producer;
+} producer_t;
+
+static void *producer(void *arg)
+{
+	producer_t	*p = arg;
+	void		*batch[MAX_BATCH];
+	uint32_t	seed = p->producer + 1;
+	int		seq = 0;
+
+	while (seq < NUM_ITEMS) {
+		size_t	num, pushed;
+		int	i;
+
+		seed = (seed * 1103515245) + 12345;
+		num = 1 + ((seed >> 8) % MAX_BATCH);
+		if (num > (size_t) (NUM_ITEMS - seq)) num = NUM_ITEMS - seq;
+
+		for (i = 0; i < (int) num; i++) {
+			items[p->producer][seq + i].pos = i;
+			batch[i] = &items[p->producer][seq + i];
+		}
+
+		pushed = p->push_batch(p->queue, batch, num);
+		if (!pushed) sched_yield();
+
+		seq += pushed;
+	}
+
+	return NULL;
+}
+
+/*
+ *	Pop everything, checking that each producer's items arrive in
+ *	order, and that each item other than the first in a batch
+ *	follows the previous one in that batch.
+ */
+typedef size_t (*pop_batch_t)(void *queue, void **out, size_t max);
+
+static void consume(void *queue, pop_batch_t pop_batch, int num_producers)
+{
+	int	next[NUM_PRODUCERS] = { 0 };
+	item_t	*last = NULL;
+	int	total = 0, errors = 0;
+
+	/*
+	 *	Always drain the queue, so the producers can finish.
+	 */
+	while (total < (num_producers * NUM_ITEMS)) {
+		void	*out[MAX_BATCH + 2];
+		size_t	popped, i;
+
+		popped = pop_batch(queue, out, 1 + (total % (MAX_BATCH + 2)));
+		if (!popped) {
+			sched_yield();
+			continue;
+		}
+
+		for (i = 0; i < popped; i++) {
+			item_t *item = out[i];
+
+			if ((item->seq != next[item->producer]) && (errors++ < 10)) {
+				fprintf(stderr, "FAIL: producer %i item %i arrived, expected %i\n",
+					item->producer, item->seq, next[item->producer]);
+			}
+			next[item->producer] = item->seq + 1;
+
+			if ((item->pos > 0) &&
+			    (!last || (last->producer != item->producer) || (last->seq != item->seq - 1)) &&
+			    (errors++ < 10)) {
+				fprintf(stderr, "FAIL: producer %i item %i was separated from its batch\n",
+					item->producer, item->seq);
+			}
+			last = item;
+			total++;
+		}
+	}
+
+	fail += errors;
+}
+
+static size_t spsc_push_batch(void *queue, void * const *data, size_t num)
+{
+	return fr_spsc_queue_push_batch(queue, data, num);
+}
+
+static size_t spsc_pop_batch(void *queue, void **out, size_t max)
+{
+	return fr_spsc_queue_pop_batch(queue, out, max);
+}
+
+static size_t mpsc_push_batch(void *queue, void * const *data, size_t num)
+{
+	return fr_mpsc_queue_push_batch(queue, data, num);
+}
+
+static size_t mpsc_pop_batch(void *queue, void **out, size_t max)
+{
+	return fr_mpsc_queue_pop_batch(queue, out, max);
+}
+
+static void test_concurrent(void *queue, push_batch_t push_batch, pop_batch_t pop_batch, int num_producers)
+{
+	pthread_t	threads[NUM_PRODUCERS];
+	producer_t	producers[NUM_PRODUCERS];
+	int		i;
+
+	for (i = 0; i < num_producers; i++) {
+		producers[i].queue = queue;
+		producers[i].push_batch = push_batch;
+		producers[i].producer = i;
+		pthread_create(&threads[i], NULL, producer, &producers[i]);
+	}
+
+	consume(queue, pop_batch, num_producers);
+
+	for (i = 0; i < num_producers; i++) pthread_join(threads[i], NULL);
+}
+
+int main(UNUSED int argc, UNUSED char *argv[])
+{
+	fr_spsc_queue_t	*sq;
+	fr_mpsc_queue_t	*mq;
+
+	items_init();
+
+	test_spsc_boundaries();
+	test_mpsc_boundaries();
+
+	sq = fr_spsc_queue_create(NULL, RING_SIZE);
+	mq = fr_mpsc_queue_create(NULL, RING_SIZE);
+	if (!sq || !mq) {
+		fprintf(stderr, "Failed creating queues\n");
+		return 1;
+	}
+
+	test_concurrent(sq, spsc_push_batch, spsc_pop_batch, 1);
+	CHECK(fr_spsc_queue_num_elements(sq) == 0, "queue not empty at the end");
+
+	test_concurrent(mq, mpsc_push_batch, mpsc_pop_batch, NUM_PRODUCERS);
+	CHECK(fr_mpsc_queue_num_elements(mq) == 0, "queue not empty at the end");
+
+	talloc_free(sq);
+	talloc_free(mq);
+
+	if (fail) {
+		fprintf(stderr, "%i checks failed\n", fail);
+		return 1;
+	}
+
+	return 0;
+}
+#else
+int main(UNUSED int argc, UNUSED char *argv[])
+{
+	fprintf(stderr, "No <stdatomic.h>, skipping tests\n");
+
+	return 0;
+}
+#endif
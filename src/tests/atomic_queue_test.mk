@@ -0,0 +1,6 @@
+TARGET := atomic_queue_test
+
+SOURCES := atomic_queue_test.c
+
+TGT_PREREQS	:= libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
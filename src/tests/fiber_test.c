@@ -0,0 +1,374 @@
+/*
+ *	Tests for fibers.
+ *
+ *	Checks that a fiber waiting in fr_fiber_poll() or on a
+ *	condition lets the others on its worker run, that conditions
+ *	wake fibers oldest first, and that timed waits give up.  Then
+ *	a worker thread's fibers, and a thread which isn't running
+ *	fibers, take tokens handed out by the main thread, through a
+ *	condition, and check that every one is taken once.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/fiber.h>
+
+#ifdef WITH_FIBERS
+static int fail = 0;
+
+#define CHECK(_x, _msg) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "FAIL %s:%i: %s\n", __FILE__, __LINE__, _msg); \
+		fail++; \
+	} \
+} while (0)
+
+#define NUM_FIBERS	(8)
+#define STACK_SIZE	(65536)
+#define NUM_TOKENS	(20000)
+
+#define USEC		(1000000)
+
+static pthread_mutex_t	mutex = PTHREAD_MUTEX_INITIALIZER;
+static fr_fiber_cond_t	cond;
+
+static int		order[NUM_FIBERS];
+static int		num_order;
+static int		go;
+
+static int		fds[2];
+static int		polled;
+static int		timed_out;
+
+static int64_t msec_since(struct timeval const *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (((now.tv_sec - start->tv_sec) * (int64_t) USEC) + (now.tv_usec - start->tv_usec)) / 1000;
+}
+
+static void abstime_in(struct timespec *abstime, int msec)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	now.tv_usec += msec * 1000;
+	abstime->tv_sec = now.tv_sec + (now.tv_usec / USEC);
+	abstime->tv_nsec = (now.tv_usec % USEC) * 1000;
+}
+
+/*
+ *	Let the other fibers run.
+ */
+static void yield(void)
+{
+	(void) fr_fiber_poll(NULL, 0, 0);
+}
+
+static void sched_run_all(fr_fiber_sched_t *sched)
+{
+	while (fr_fiber_sched_num(sched) > 0) {
+		if (fr_fiber_sched_run(sched, -1, -1) < 0) {
+			fprintf(stderr, "FAIL: running fibers: %s\n", fr_strerror());
+			fail++;
+			return;
+		}
+	}
+}
+
+/*
+ *	Wait for the pipe, which another fiber on the same worker
+ *	writes to.
+ */
+static void poll_reader(UNUSED void *uctx)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fds[0];
+	pfd.events = POLLIN;
+
+	polled = fr_fiber_poll(&pfd, 1, -1);
+}
+
+static void poll_writer(UNUSED void *uctx)
+{
+	if (write(fds[1], "x", 1) < 0) fail++;
+}
+
+static void poll_timeout(UNUSED void *uctx)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fds[0];
+	pfd.events = POLLIN;
+
+	if (fr_fiber_poll(&pfd, 1, 50) == 0) timed_out++;
+}
+
+static void test_poll(fr_fiber_sched_t *sched)
+{
+	struct timeval start;
+	char buff;
+
+	if (pipe(fds) < 0) {
+		fprintf(stderr, "Failed creating pipe\n");
+		fail++;
+		return;
+	}
+
+	CHECK(fr_fiber_start(sched, poll_reader, NULL) == 0, "start failed");
+	CHECK(fr_fiber_start(sched, poll_writer, NULL) == 0, "start failed");
+	sched_run_all(sched);
+	CHECK(polled == 1, "poll didn't see the write");
+
+	if (read(fds[0], &buff, 1) != 1) fail++;
+
+	gettimeofday(&start, NULL);
+	CHECK(fr_fiber_start(sched, poll_timeout, NULL) == 0, "start failed");
+	sched_run_all(sched);
+	CHECK(timed_out == 1, "poll didn't time out");
+	CHECK(msec_since(&start) >= 50, "poll timed out early");
+
+	close(fds[0]);
+	close(fds[1]);
+}
+
+/*
+ *	Wait for our turn.  Only one fiber is woken each time.
+ */
+static void cond_waiter(void *uctx)
+{
+	int id = (int)(intptr_t) uctx;
+
+	pthread_mutex_lock(&mutex);
+	while (!go) (void) fr_fiber_cond_timedwait(&cond, &mutex, NULL);
+	go--;
+	order[num_order++] = id;
+	pthread_mutex_unlock(&mutex);
+}
+
+/*
+ *	Runs once all the waiters are queued, and signals one at a
+ *	time, waiting for each to take its turn.
+ */
+static void cond_signaller(UNUSED void *uctx)
+{
+	int i;
+
+	for (i = 0; i < NUM_FIBERS - 1; i++) {
+		pthread_mutex_lock(&mutex);
+		go++;
+		fr_fiber_cond_signal(&cond);
+		pthread_mutex_unlock(&mutex);
+
+		yield();
+	}
+}
+
+static void test_cond_order(fr_fiber_sched_t *sched)
+{
+	int i;
+
+	for (i = 0; i < NUM_FIBERS - 1; i++) {
+		CHECK(fr_fiber_start(sched, cond_waiter, (void *)(intptr_t) i) == 0, "start failed");
+	}
+	CHECK(fr_fiber_start(sched, cond_signaller, NULL) == 0, "start failed");
+
+	sched_run_all(sched);
+
+	CHECK(num_order == NUM_FIBERS - 1, "not every waiter was woken");
+	for (i = 0; i < num_order; i++) CHECK(order[i] == i, "waiters weren't woken oldest first");
+	CHECK(cond.head == NULL, "waiters left on the condition");
+}
+
+static void cond_timeout(UNUSED void *uctx)
+{
+	struct timespec abstime;
+
+	abstime_in(&abstime, 50);
+
+	pthread_mutex_lock(&mutex);
+	if (fr_fiber_cond_timedwait(&cond, &mutex, &abstime) == ETIMEDOUT) timed_out++;
+	pthread_mutex_unlock(&mutex);
+}
+
+static void test_cond_timeout(fr_fiber_sched_t *sched)
+{
+	struct timeval start;
+
+	timed_out = 0;
+
+	gettimeofday(&start, NULL);
+	CHECK(fr_fiber_start(sched, cond_timeout, NULL) == 0, "start failed");
+	sched_run_all(sched);
+
+	CHECK(timed_out == 1, "wait didn't time out");
+	CHECK(msec_since(&start) >= 50, "wait timed out early");
+	CHECK(cond.head == NULL, "waiter left on the condition");
+}
+
+/*
+ *	Tokens are handed out by the main thread, and taken by the
+ *	worker's fibers, and by a thread which isn't running fibers.
+ */
+static pthread_cond_t	space = PTHREAD_COND_INITIALIZER;
+static int		available;
+static int		next_token;
+static bool		done;
+static uint8_t		taken[NUM_TOKENS];
+
+/*
+ *	Take tokens until there are no more.  Half the fibers use
+ *	short timeouts, so they're often taken off the condition from
+ *	the middle of the queue.
+ */
+static void take_tokens(void *uctx)
+{
+	int id = (int)(intptr_t) uctx;
+
+	pthread_mutex_lock(&mutex);
+	while (true) {
+		if (!available) {
+			struct timespec abstime;
+
+			if (done) break;
+
+			if (id & 0x01) {
+				abstime_in(&abstime, 2);
+				(void) fr_fiber_cond_timedwait(&cond, &mutex, &abstime);
+			} else {
+				(void) fr_fiber_cond_timedwait(&cond, &mutex, NULL);
+			}
+			continue;
+		}
+
+		available--;
+		taken[next_token++]++;
+		pthread_cond_signal(&space);
+
+		/*
+		 *	Give the others a turn.
+		 */
+		if ((next_token % 7) == 0) {
+			pthread_mutex_unlock(&mutex);
+			yield();
+			pthread_mutex_lock(&mutex);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+static void *worker(UNUSED void *arg)
+{
+	fr_fiber_sched_t	*sched;
+	int			i;
+
+	sched = fr_fiber_sched_alloc(NULL, NUM_FIBERS, STACK_SIZE);
+	if (!sched) {
+		fprintf(stderr, "FAIL: worker failed allocating fibers: %s\n", fr_strerror());
+		return (void *)(intptr_t) 1;
+	}
+
+	for (i = 0; i < NUM_FIBERS; i++) fr_fiber_start(sched, take_tokens, (void *)(intptr_t) i);
+	sched_run_all(sched);
+
+	talloc_free(sched);
+
+	return NULL;
+}
+
+static void *taker(UNUSED void *arg)
+{
+	take_tokens((void *)(intptr_t) 0);
+
+	return NULL;
+}
+
+static void test_cond_threads(void)
+{
+	pthread_t	threads[2];
+	void		*rcode;
+	int		i;
+
+	pthread_create(&threads[0], NULL, worker, NULL);
+	pthread_create(&threads[1], NULL, taker, NULL);
+
+	for (i = 0; i < NUM_TOKENS; i++) {
+		pthread_mutex_lock(&mutex);
+		while (available >= 4) pthread_cond_wait(&space, &mutex);
+		available++;
+		fr_fiber_cond_signal(&cond);
+		pthread_mutex_unlock(&mutex);
+	}
+
+	pthread_mutex_lock(&mutex);
+	done = true;
+	fr_fiber_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mutex);
+
+	pthread_join(threads[0], &rcode);
+	fail += (int)(intptr_t) rcode;
+	pthread_join(threads[1], NULL);
+
+	CHECK(next_token == NUM_TOKENS, "not every token was taken");
+	for (i = 0; i < NUM_TOKENS; i++) {
+		if (taken[i] != 1) {
+			fprintf(stderr, "FAIL: token %i taken %i times\n", i, taken[i]);
+			fail++;
+			break;
+		}
+	}
+	CHECK(cond.head == NULL, "waiters left on the condition");
+}
+
+int main(UNUSED int argc, UNUSED char *argv[])
+{
+	fr_fiber_sched_t *sched;
+
+	/*
+	 *	A lost wakeup leaves the threads blocked.
+	 */
+	alarm(60);
+
+	if (fr_fiber_cond_init(&cond) != 0) {
+		fprintf(stderr, "Failed initialising condition\n");
+		return 1;
+	}
+
+	sched = fr_fiber_sched_alloc(NULL, NUM_FIBERS, STACK_SIZE);
+	if (!sched) {
+		fprintf(stderr, "Failed allocating fibers: %s\n", fr_strerror());
+		return 1;
+	}
+
+	test_poll(sched);
+	test_cond_order(sched);
+	test_cond_timeout(sched);
+	talloc_free(sched);
+
+	test_cond_threads();
+
+	fr_fiber_cond_destroy(&cond);
+
+	if (fail) {
+		fprintf(stderr, "%i checks failed\n", fail);
+		return 1;
+	}
+
+	return 0;
+}
+#else
+int main(UNUSED int argc, UNUSED char *argv[])
+{
+	fprintf(stderr, "No fibers on this system, skipping tests\n");
+
+	return 0;
+}
+#endif
@@ -0,0 +1,6 @@
+TARGET := fiber_test
+
+SOURCES := fiber_test.c
+
+TGT_PREREQS	:= libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,384 @@
+/*
+ *	Tests for fr_hash_oa_t.
+ *
+ *	The hash function returns whatever hash the entry was given, so
+ *	entries can be put into particular groups.  A new table has 4
+ *	groups of 16 slots, which fr_hash_oa_walk() visits from the last
+ *	slot to the first, so the order of a walk shows which group each
+ *	entry ended up in.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <freeradius-devel/libradius.h>
+
+#define GROUP_SIZE	(16)
+#define NUM_GROUPS	(4)
+
+#define NUM_KEYS	(4096)
+#define NUM_OPS		(200000)
+
+typedef struct {
+	uint32_t	hash;
+	uint32_t	key;
+	bool		in_table;
+} entry_t;
+
+static int fail = 0;
+
+#define CHECK(_x, _msg) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "FAIL %s:%i: %s\n", __FILE__, __LINE__, _msg); \
+		fail++; \
+	} \
+} while (0)
+
+/*
+ *	Group in the high bits, control byte in the low 7.
+ */
+#define HASH(_group, _ctrl)	(((uint32_t)(_group) << 7) | ((_ctrl) & 0x7f))
+
+static uint32_t entry_hash(void const *data)
+{
+	entry_t const *e = data;
+
+	return e->hash;
+}
+
+static int entry_cmp(void const *one, void const *two)
+{
+	entry_t const *a = one, *b = two;
+
+	return (a->key > b->key) - (a->key < b->key);
+}
+
+static void entry_free(void *data)
+{
+	entry_t *e = data;
+
+	if (!e->in_table) {
+		fprintf(stderr, "FAIL: key %u freed, but it wasn't in the table\n", e->key);
+		fail++;
+	}
+	e->in_table = false;
+}
+
+static int insert(fr_hash_oa_t *ht, entry_t *e)
+{
+	if (!fr_hash_oa_insert(ht, e)) return 0;
+
+	e->in_table = true;
+	return 1;
+}
+
+static bool found(fr_hash_oa_t *ht, entry_t const *e)
+{
+	return fr_hash_oa_finddata(ht, e) == e;
+}
+
+/*
+ *	Record the order entries are visited in.
+ */
+typedef struct {
+	uint32_t	keys[GROUP_SIZE * NUM_GROUPS];
+	int		num;
+} walk_order_t;
+
+static int walk_order(void *ctx, void *data)
+{
+	walk_order_t	*order = ctx;
+	entry_t		*e = data;
+
+	if (order->num < (GROUP_SIZE * NUM_GROUPS)) order->keys[order->num] = e->key;
+	order->num++;
+
+	return 0;
+}
+
+static bool visited_in(walk_order_t const *order, uint32_t key, int start, int end)
+{
+	int i;
+
+	for (i = start; (i < end) && (i < order->num); i++) if (order->keys[i] == key) return true;
+
+	return false;
+}
+
+/*
+ *	Entries which don't fit in the last group wrap around to the
+ *	first, and deleting from a full group leaves a tombstone which
+ *	later lookups probe past, and later inserts reuse.
+ */
+static void test_wraparound(void)
+{
+	fr_hash_oa_t	*ht;
+	entry_t		entries[24], missing;
+	walk_order_t	order;
+	int		i;
+
+	memset(entries, 0, sizeof(entries));
+	for (i = 0; i < 24; i++) {
+		entries[i].key = i;
+		entries[i].hash = HASH(NUM_GROUPS - 1, i);
+	}
+
+	ht = fr_hash_oa_create(NULL, entry_hash, entry_cmp, entry_free);
+	if (!ht) {
+		fprintf(stderr, "Failed creating table\n");
+		fail++;
+		return;
+	}
+
+	/*
+	 *	16 fill the last group, and 4 wrap around.
+	 */
+	for (i = 0; i < 20; i++) CHECK(insert(ht, &entries[i]) == 1, "insert failed");
+	CHECK(fr_hash_oa_num_elements(ht) == 20, "wrong number of elements");
+	CHECK(fr_hash_oa_insert(ht, &entries[3]) == 0, "duplicate insert succeeded");
+
+	for (i = 0; i < 20; i++) CHECK(found(ht, &entries[i]), "entry not found");
+
+	missing.key = 100;
+	missing.hash = HASH(NUM_GROUPS - 1, 100);
+	CHECK(!fr_hash_oa_finddata(ht, &missing), "found an entry which was never inserted");
+
+	memset(&order, 0, sizeof(order));
+	fr_hash_oa_walk(ht, walk_order, &order);
+	CHECK(order.num == 20, "walk didn't visit every entry");
+	for (i = 0; i < 16; i++) CHECK(visited_in(&order, i, 0, 16), "entry not in the last group");
+	for (i = 16; i < 20; i++) CHECK(visited_in(&order, i, 16, 20), "entry didn't wrap to the first group");
+
+	/*
+	 *	The last group has no EMPTY slots, so a delete has to
+	 *	leave a tombstone.  If it didn't, lookups for the
+	 *	entries which wrapped around would stop there.
+	 */
+	CHECK(fr_hash_oa_delete(ht, &entries[5]) == 1, "delete failed");
+	CHECK(!entries[5].in_table, "deleted entry wasn't freed");
+	CHECK(!found(ht, &entries[5]), "deleted entry still found");
+	for (i = 16; i < 20; i++) CHECK(found(ht, &entries[i]), "lookup stopped at a tombstone");
+	CHECK(!fr_hash_oa_finddata(ht, &missing), "found an entry which was never inserted");
+
+	/*
+	 *	The next entry for the last group goes into the
+	 *	tombstone, not after the entries which wrapped.
+	 */
+	CHECK(insert(ht, &entries[20]) == 1, "insert failed");
+
+	memset(&order, 0, sizeof(order));
+	fr_hash_oa_walk(ht, walk_order, &order);
+	CHECK(order.num == 20, "walk didn't visit every entry");
+	CHECK(visited_in(&order, 20, 0, 16), "tombstone wasn't reused");
+
+	/*
+	 *	The first group has EMPTY slots, so deleting from it
+	 *	needs no tombstone, and everything else is still found.
+	 */
+	CHECK(fr_hash_oa_delete(ht, &entries[17]) == 1, "delete failed");
+	for (i = 0; i < 21; i++) {
+		if ((i == 5) || (i == 17)) continue;
+		CHECK(found(ht, &entries[i]), "entry not found");
+	}
+
+	/*
+	 *	Yank doesn't free.
+	 */
+	CHECK(fr_hash_oa_yank(ht, &entries[18]) == &entries[18], "yank failed");
+	CHECK(entries[18].in_table, "yanked entry was freed");
+	entries[18].in_table = false;
+
+	CHECK(fr_hash_oa_num_elements(ht) == 18, "wrong number of elements");
+
+	fr_hash_oa_free(ht);
+	for (i = 0; i < 24; i++) CHECK(!entries[i].in_table, "entry not freed with the table");
+}
+
+/*
+ *	Random inserts, replaces, and deletes, checked against a
+ *	simple array.  Pairs of keys share a hash, and there are only
+ *	4 distinct control bytes, so most control byte matches are
+ *	false positives.  There are enough keys to make the table
+ *	grow several times, and enough deletes for it to rebuild at
+ *	the same size.
+ */
+static entry_t	*current[NUM_KEYS];
+
+static void test_random(void)
+{
+	fr_hash_oa_t	*ht;
+	entry_t		*entries;
+	uint32_t	seed = 1;
+	int		i, num = 0;
+
+	entries = calloc(NUM_KEYS * 2, sizeof(*entries));
+	for (i = 0; i < NUM_KEYS * 2; i++) {
+		uint32_t key = i % NUM_KEYS;
+		uint32_t pair = key >> 1;
+
+		entries[i].key = key;
+		entries[i].hash = (fr_hash(&pair, sizeof(pair)) & ~0x7f) | (key & 0x03);
+	}
+
+	ht = fr_hash_oa_create(NULL, entry_hash, entry_cmp, entry_free);
+	if (!ht) {
+		fprintf(stderr, "Failed creating table\n");
+		fail++;
+		free(entries);
+		return;
+	}
+
+	for (i = 0; i < NUM_OPS; i++) {
+		uint32_t	key;
+		entry_t		*e;
+
+		seed = (seed * 1103515245) + 12345;
+		key = (seed >> 8) % NUM_KEYS;
+
+		/*
+		 *	Alternate between the two entries for each key,
+		 *	so replace has something to free.
+		 */
+		e = &entries[key + ((current[key] == &entries[key]) ? NUM_KEYS : 0)];
+
+		switch ((seed >> 4) & 0x03) {
+		case 0:
+			if (current[key]) {
+				CHECK(fr_hash_oa_insert(ht, e) == 0, "duplicate insert succeeded");
+				break;
+			}
+			CHECK(insert(ht, e) == 1, "insert failed");
+			current[key] = e;
+			num++;
+			break;
+
+		case 1:
+			CHECK(fr_hash_oa_replace(ht, e) == 1, "replace failed");
+			if (current[key]) {
+				CHECK(!current[key]->in_table, "replaced entry wasn't freed");
+			} else {
+				num++;
+			}
+			e->in_table = true;
+			current[key] = e;
+			break;
+
+		case 2:
+			if (!current[key]) {
+				CHECK(fr_hash_oa_delete(ht, e) == 0, "deleted an entry which wasn't there");
+				break;
+			}
+			CHECK(fr_hash_oa_delete(ht, e) == 1, "delete failed");
+			CHECK(!current[key]->in_table, "deleted entry wasn't freed");
+			current[key] = NULL;
+			num--;
+			break;
+
+		default:
+			CHECK(fr_hash_oa_finddata(ht, e) == current[key], "lookup returned the wrong entry");
+			break;
+		}
+
+		if (fail) break;
+
+		if ((i % 10000) == 0) {
+			int j, in_table = 0;
+
+			CHECK(fr_hash_oa_num_elements(ht) == num, "wrong number of elements");
+			for (j = 0; j < NUM_KEYS; j++) {
+				CHECK(fr_hash_oa_finddata(ht, &entries[j]) == current[j], "lookup returned the wrong entry");
+				if (current[j]) in_table++;
+			}
+			CHECK(in_table == num, "model is inconsistent");
+		}
+	}
+
+	fr_hash_oa_free(ht);
+	for (i = 0; i < NUM_KEYS * 2; i++) CHECK(!entries[i].in_table, "entry not freed with the table");
+
+	free(entries);
+}
+
+/*
+ *	Delete every other entry, and insert new ones, from inside a
+ *	walk.  Each of the original entries should be visited exactly
+ *	once, even though the inserts make the table grow.
+ */
+typedef struct {
+	fr_hash_oa_t	*ht;
+	entry_t		*extra;
+	int		num_extra;
+	int		visits[NUM_KEYS];
+} walk_modify_t;
+
+static int walk_modify(void *ctx, void *data)
+{
+	walk_modify_t	*w = ctx;
+	entry_t		*e = data;
+
+	w->visits[e->key]++;
+
+	if (e->key < 1024) {
+		if (e->key & 0x01) (void) fr_hash_oa_delete(w->ht, e);
+		if (w->num_extra < 1024) (void) insert(w->ht, &w->extra[w->num_extra++]);
+	}
+
+	return 0;
+}
+
+static void test_walk(void)
+{
+	walk_modify_t	*w;
+	entry_t		*entries;
+	int		i;
+
+	w = calloc(1, sizeof(*w));
+	entries = calloc(2048, sizeof(*entries));
+	for (i = 0; i < 2048; i++) {
+		entries[i].key = i;
+		entries[i].hash = fr_hash(&entries[i].key, sizeof(entries[i].key));
+	}
+	w->extra = &entries[1024];
+
+	w->ht = fr_hash_oa_create(NULL, entry_hash, entry_cmp, entry_free);
+	if (!w->ht) {
+		fprintf(stderr, "Failed creating table\n");
+		fail++;
+		goto done;
+	}
+
+	for (i = 0; i < 1024; i++) CHECK(insert(w->ht, &entries[i]) == 1, "insert failed");
+
+	fr_hash_oa_walk(w->ht, walk_modify, w);
+
+	for (i = 0; i < 1024; i++) {
+		if (w->visits[i] != 1) {
+			fprintf(stderr, "FAIL: key %i visited %i times\n", i, w->visits[i]);
+			fail++;
+		}
+	}
+	CHECK(fr_hash_oa_num_elements(w->ht) == 512 + w->num_extra, "wrong number of elements");
+
+	for (i = 0; i < 1024 + w->num_extra; i++) {
+		CHECK(found(w->ht, &entries[i]) == entries[i].in_table, "table doesn't match the walk");
+	}
+
+	fr_hash_oa_free(w->ht);
+
+done:
+	free(entries);
+	free(w);
+}
+
+int main(UNUSED int argc, UNUSED char *argv[])
+{
+	test_wraparound();
+	test_random();
+	test_walk();
+
+	if (fail) {
+		fprintf(stderr, "%i checks failed\n", fail);
+		return 1;
+	}
+
+	return 0;
+}
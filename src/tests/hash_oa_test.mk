@@ -0,0 +1,6 @@
+TARGET := hash_oa_test
+
+SOURCES := hash_oa_test.c
+
+TGT_PREREQS	:= libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,239 @@
+/*
+ *	Stress test for fr_hash_rcu_t.
+ *
+ *	Writers replace and delete entries while waves of short lived
+ *	readers look them up.  Entries are checked by the comparison
+ *	callback, which is the only place they're protected, so under
+ *	ASan a use after free shows up as an error.
+ *
+ *	There are more readers in total than the table has slots, so
+ *	once they've exited, a new thread only gets a slot if theirs
+ *	were released.  A thread without one stops anything from being
+ *	reclaimed while it's in the table, which is checked for by
+ *	parking a thread in a walk and deleting entries around it.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <freeradius-devel/libradius.h>
+
+#define NUM_KEYS	(1024)
+#define NUM_WRITERS	(4)
+#define NUM_READERS	(16)
+#define NUM_WAVES	(20)		/* 320 readers, against 128 slots */
+#define LOOKUPS		(20000)
+
+#define ENTRY_MAGIC	(0x5eed1e55)
+
+typedef struct {
+	uint32_t	magic;
+	uint32_t	key;
+} entry_t;
+
+static fr_hash_rcu_t	*ht;
+
+static atomic_uint	allocated;
+static atomic_uint	freed;
+static atomic_uint	bad;
+static atomic_bool	stop;
+
+static pthread_mutex_t	park_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	park_cond = PTHREAD_COND_INITIALIZER;
+static bool		parked;
+static bool		release;
+
+static uint32_t entry_hash(void const *data)
+{
+	entry_t const *e = data;
+
+	return fr_hash(&e->key, sizeof(e->key));
+}
+
+static int entry_cmp(void const *one, void const *two)
+{
+	entry_t const *a = one, *b = two;
+
+	if (b->magic != ENTRY_MAGIC) atomic_fetch_add(&bad, 1);
+
+	return (a->key > b->key) - (a->key < b->key);
+}
+
+static void entry_free(void *data)
+{
+	entry_t *e = data;
+
+	e->magic = 0;
+	free(e);
+	atomic_fetch_add(&freed, 1);
+}
+
+static entry_t *entry_alloc(uint32_t key)
+{
+	entry_t *e;
+
+	e = malloc(sizeof(*e));
+	e->magic = ENTRY_MAGIC;
+	e->key = key;
+	atomic_fetch_add(&allocated, 1);
+
+	return e;
+}
+
+static void *writer(void *arg)
+{
+	uint32_t seed = (uint32_t)(uintptr_t)arg;
+
+	while (!atomic_load(&stop)) {
+		entry_t find, *e;
+
+		seed = (seed * 1103515245) + 12345;
+		find.key = (seed >> 8) % NUM_KEYS;
+
+		if (seed & 0x10000) {
+			e = entry_alloc(find.key);
+			if (!fr_hash_rcu_replace(ht, e)) entry_free(e);
+		} else {
+			fr_hash_rcu_delete(ht, &find);
+		}
+	}
+
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	uint32_t seed = (uint32_t)(uintptr_t)arg;
+	int i;
+
+	for (i = 0; i < LOOKUPS; i++) {
+		entry_t find;
+
+		seed = (seed * 1103515245) + 12345;
+		find.key = (seed >> 8) % NUM_KEYS;
+
+		(void) fr_hash_rcu_finddata(ht, &find);
+	}
+
+	return NULL;
+}
+
+/*
+ *	Wait in the table until told to leave.
+ */
+static int park(UNUSED void *ctx, UNUSED void *data)
+{
+	pthread_mutex_lock(&park_mutex);
+	parked = true;
+	pthread_cond_broadcast(&park_cond);
+	while (!release) pthread_cond_wait(&park_cond, &park_mutex);
+	pthread_mutex_unlock(&park_mutex);
+
+	return 1;
+}
+
+static void *walker(UNUSED void *arg)
+{
+	fr_hash_rcu_walk(ht, park, NULL);
+
+	return NULL;
+}
+
+static void walker_start(pthread_t *thread)
+{
+	parked = release = false;
+	pthread_create(thread, NULL, walker, NULL);
+
+	pthread_mutex_lock(&park_mutex);
+	while (!parked) pthread_cond_wait(&park_cond, &park_mutex);
+	pthread_mutex_unlock(&park_mutex);
+}
+
+static void walker_stop(pthread_t thread)
+{
+	pthread_mutex_lock(&park_mutex);
+	release = true;
+	pthread_cond_broadcast(&park_cond);
+	pthread_mutex_unlock(&park_mutex);
+
+	pthread_join(thread, NULL);
+}
+
+/*
+ *	Delete an entry while one walker is in the table, so it stays
+ *	on the retired list, then another while a second walker is in
+ *	the table.  The first entry was retired before the second
+ *	walker entered, so it should be freed by the second delete.
+ */
+static bool reclaimed_around_walker(void)
+{
+	pthread_t	thread;
+	entry_t		find;
+	unsigned int	freed_before;
+
+	walker_start(&thread);
+	find.key = 0;
+	fr_hash_rcu_delete(ht, &find);
+	walker_stop(thread);
+
+	freed_before = atomic_load(&freed);
+
+	walker_start(&thread);
+	find.key = 1;
+	fr_hash_rcu_delete(ht, &find);
+	walker_stop(thread);
+
+	return atomic_load(&freed) > freed_before;
+}
+
+int main(UNUSED int argc, UNUSED char *argv[])
+{
+	pthread_t	writers[NUM_WRITERS], readers[NUM_READERS];
+	int		i, wave;
+
+	ht = fr_hash_rcu_create(NULL, entry_hash, entry_cmp, entry_free);
+	if (!ht) {
+		fprintf(stderr, "Failed creating table\n");
+		return 1;
+	}
+
+	for (i = 0; i < NUM_KEYS; i++) fr_hash_rcu_insert(ht, entry_alloc(i));
+
+	for (i = 0; i < NUM_WRITERS; i++) pthread_create(&writers[i], NULL, writer, (void *)(uintptr_t)(i + 1));
+
+	for (wave = 0; wave < NUM_WAVES; wave++) {
+		for (i = 0; i < NUM_READERS; i++) {
+			pthread_create(&readers[i], NULL, reader, (void *)(uintptr_t)((wave * NUM_READERS) + i));
+		}
+		for (i = 0; i < NUM_READERS; i++) pthread_join(readers[i], NULL);
+	}
+
+	atomic_store(&stop, true);
+	for (i = 0; i < NUM_WRITERS; i++) pthread_join(writers[i], NULL);
+
+	/*
+	 *	Make sure both keys exist, whatever the writers left.
+	 */
+	fr_hash_rcu_replace(ht, entry_alloc(0));
+	fr_hash_rcu_replace(ht, entry_alloc(1));
+
+	if (!reclaimed_around_walker()) {
+		fprintf(stderr, "Nothing was reclaimed while a new thread was in the table\n");
+		atomic_fetch_add(&bad, 1);
+	}
+
+	fr_hash_rcu_free(ht);
+
+	if (atomic_load(&allocated) != atomic_load(&freed)) {
+		fprintf(stderr, "Allocated %u entries, but freed %u\n", atomic_load(&allocated), atomic_load(&freed));
+		atomic_fetch_add(&bad, 1);
+	}
+
+	if (atomic_load(&bad)) {
+		fprintf(stderr, "%u checks failed\n", atomic_load(&bad));
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,6 @@
+TARGET := hash_rcu_test
+
+SOURCES := hash_rcu_test.c
+
+TGT_PREREQS	:= libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,7 @@
+#
+#  Test the "attr_filter" module
+#
+
+#  MODULE.test is the main target for this module.
+attr_filter.test:
+	@echo OK: attr_filter.test
@@ -0,0 +1,7 @@
+#
+#  Test the "memory_ippool" module
+#
+
+#  MODULE.test is the main target for this module.
+memory_ippool.test:
+	@echo OK: memory_ippool.test
@@ -0,0 +1,7 @@
+#
+#  Test the "regex" module
+#
+
+#  MODULE.test is the main target for this module.
+regex.test:
+	@echo OK: regex.test
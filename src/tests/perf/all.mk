@@ -0,0 +1,30 @@
+#
+#  Load tests.  These aren't part of "make test", as the results
+#  depend on the machine.  See perf.sh for what is measured, and for
+#  the variables which control it, e.g.
+#
+#	make perf
+#	make perf PERF_SCENARIOS="pap eap" PERF_PPS=5000
+#	make perf PERF_BASELINE=results-from-last-release.tsv
+#
+PERF_PATH := $(top_srcdir)/src/tests/perf
+PERF_OUTPUT := $(top_builddir)/$(BUILD_DIR)/tests/perf
+
+#
+#  Only the scenarios which this build can run.  LDAP needs a server,
+#  as for the module tests.
+#
+PERF_SCENARIOS ?= pap proxy \
+	$(if $(filter rlm_sql_sqlite.la,$(ALL_TGTS)),acct) \
+	$(if $(filter rlm_eap_md5.la,$(ALL_TGTS)),eap) \
+	$(if $(LDAP_TEST_SERVER),ldap)
+
+.PHONY: perf tests.perf
+tests.perf: $(TESTBINDIR)/radiusd $(TESTBINDIR)/radeapclient $(TESTBINDIR)/radmin
+	@echo PERF $(strip $(PERF_SCENARIOS))
+	@FR_LIBRARY_PATH=$(top_builddir)/$(BUILD_DIR)/lib/local/.libs/ \
+		RADIUSD="$(TESTBIN)/radiusd" RADEAPCLIENT="$(TESTBIN)/radeapclient" RADMIN="$(TESTBIN)/radmin" \
+		PERF_SCENARIOS="$(strip $(PERF_SCENARIOS))" PERF_SRC=$(PERF_PATH) PERF_DIR=$(PERF_OUTPUT) \
+		TOP=$(top_srcdir) $(PERF_PATH)/perf.sh
+
+perf: tests.perf
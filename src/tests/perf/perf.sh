@@ -0,0 +1,253 @@
+#!/bin/sh
+#
+#  This program is is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or (at
+#  your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program; if not, write to the Free Software
+#  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+#
+#  Copyright 2016 The FreeRADIUS server project
+#
+
+#
+#  Load tests.  Starts radiusd with the reference configuration in
+#  ./config, runs radeapclient against each scenario, and prints one
+#  tab separated line per scenario:
+#
+#	scenario, transactions, throughput (/s), p50, p99 and p99.9
+#	latency (ms), CPU time per transaction (us), talloc blocks and
+#	bytes left in requests per transaction.
+#
+#  Latency and throughput are measured by the client.  CPU time is
+#  that of the whole server, from /proc, so it's only available on
+#  Linux.  Allocations are measured in a second, shorter, run with
+#  "debug memory_accounting on", which would otherwise slow the first.
+#
+#  If PERF_BASELINE names a file of earlier results, any scenario
+#  whose throughput is more than PERF_TOLERANCE percent lower, or
+#  whose p99 is more than PERF_TOLERANCE percent higher, is reported,
+#  and the script exits with 1.
+#
+#  Usually run via "make perf".  The variables it needs are set there.
+#
+
+: ${PERF_SCENARIOS:=pap proxy}
+: ${PERF_COUNT:=20000}
+: ${PERF_PARALLEL:=64}
+: ${PERF_PPS:=0}
+: ${PERF_PORT:=12400}
+: ${PERF_TOLERANCE:=10}
+: ${PERF_SECRET:=testing123}
+
+for x in RADIUSD RADEAPCLIENT RADMIN PERF_SRC PERF_DIR TOP; do
+	eval "[ -n \"\$$x\" ]" || { echo "perf: $x must be set" >&2; exit 1; }
+done
+
+PERF_PORT_PAP=$PERF_PORT
+PERF_PORT_ACCT=`expr $PERF_PORT + 1`
+PERF_PORT_PROXY=`expr $PERF_PORT + 2`
+PERF_PORT_EAP=`expr $PERF_PORT + 3`
+PERF_PORT_LDAP=`expr $PERF_PORT + 4`
+export PERF_PORT_PAP PERF_PORT_ACCT PERF_PORT_PROXY PERF_PORT_EAP PERF_PORT_LDAP
+
+RESULTS=$PERF_DIR/results.tsv
+LOG=$PERF_DIR/radiusd.log
+PID=
+
+stop() {
+	if [ -n "$PID" ]; then
+		kill -TERM $PID 2>/dev/null
+		PID=
+	fi
+}
+
+die() {
+	echo "perf: $*" >&2
+	if [ -f "$LOG" ]; then
+		echo "Last entries in server log ($LOG):" >&2
+		tail -n 20 "$LOG" >&2
+	fi
+	stop
+	exit 1
+}
+
+radmin() {
+	$RADMIN -f $PERF_DIR/control.sock -e "$1" 2>/dev/null
+}
+
+#
+#  talloc blocks and bytes which the named virtual servers have left
+#  in requests, so far.
+#
+alloc_total() {
+	radmin "stats allocations server" | awk -v servers=" $* " '
+		index(servers, " " $1 " ") { blocks += $7; bytes += $5 }
+		END { printf "%d %d\n", blocks, bytes }'
+}
+
+cpu_ticks() {
+	if [ -r /proc/$PID/stat ]; then
+		sed 's/^.*) //' /proc/$PID/stat | awk '{ print $12 + $13 }'
+	fi
+}
+
+#
+#  Send $2 transactions from $1.txt, and print radeapclient's summary.
+#
+load() {
+	rate=
+	[ "$PERF_PPS" -gt 0 ] && rate="-n $PERF_PPS"
+
+	$RADEAPCLIENT -d $PERF_DIR -D $TOP/share -f $PERF_SRC/$1.txt -c $2 -p $PERF_PARALLEL $rate \
+		-t 5 -r 1 -s -q 127.0.0.1:$port $code $PERF_SECRET
+}
+
+summary() {
+	sed -n "s|^[[:space:]]*$1[[:space:]]*: ||p" | sed 's/[ ,].*//'
+}
+
+#
+#  The reference configuration, with only the scenarios being run.
+#
+mkdir -p $PERF_DIR || exit 1
+rm -rf $PERF_DIR/mods-enabled $PERF_DIR/sites-enabled $PERF_DIR/perf.db
+mkdir -p $PERF_DIR/mods-enabled $PERF_DIR/sites-enabled
+
+enable() {
+	for s in $1; do
+		ln -sf $PERF_SRC/config/sites-available/$s $PERF_DIR/sites-enabled/$s
+	done
+	for m in $2; do
+		ln -sf $PERF_SRC/config/mods-available/$m $PERF_DIR/mods-enabled/$m
+	done
+}
+
+for scenario in $PERF_SCENARIOS; do
+	case $scenario in
+	pap)	enable pap ;;
+	acct)	enable acct sql ;;
+	proxy)	enable "pap proxy" ;;
+	eap)	enable eap eap ;;
+	ldap)	enable ldap ldap ;;
+	*)	die "Unknown scenario $scenario.  Use pap, acct, proxy, eap or ldap" ;;
+	esac
+done
+
+cat > $PERF_DIR/perf.conf <<EOF
+# load test configuration.  Do not install.  Delete at any time.
+testdir = $PERF_SRC/config
+rundir = $PERF_DIR
+logdir = \${rundir}
+maindir = $TOP/raddb/
+modconfdir = \${maindir}mods-config
+certdir = \${maindir}certs
+cadir = \${maindir}certs
+pidfile = \${rundir}/radiusd.pid
+security {
+	allow_vulnerable_openssl = yes
+}
+\$INCLUDE \${testdir}/servers.conf
+EOF
+
+echo "# load test dictionary.  Delete at any time." > $PERF_DIR/dictionary
+
+rm -f $LOG $PERF_DIR/radiusd.pid
+if ! $RADIUSD -d $PERF_DIR -n perf -D $TOP/share -l $LOG; then
+	die "Failed starting radiusd"
+fi
+PID=`cat $PERF_DIR/radiusd.pid 2>/dev/null`
+[ -n "$PID" ] || die "radiusd didn't write its PID"
+trap stop EXIT INT TERM
+
+HZ=`getconf CLK_TCK 2>/dev/null`
+
+printf "# scenario\ttransactions\tthroughput\tp50_ms\tp99_ms\tp999_ms\tcpu_us\tallocs\tbytes\n" | tee $RESULTS
+
+for scenario in $PERF_SCENARIOS; do
+	code=auth
+	case $scenario in
+	pap)	port=$PERF_PORT_PAP;	servers="perf-pap" ;;
+	acct)	port=$PERF_PORT_ACCT;	servers="perf-acct";	code=acct ;;
+	proxy)	port=$PERF_PORT_PROXY;	servers="perf-proxy perf-pap" ;;
+	eap)	port=$PERF_PORT_EAP;	servers="perf-eap" ;;
+	ldap)	port=$PERF_PORT_LDAP;	servers="perf-ldap" ;;
+	esac
+
+	#
+	#  Warm up, so that thread and connection pools are full.
+	#
+	load $scenario `expr $PERF_PARALLEL \* 10` > /dev/null
+
+	cpu_before=`cpu_ticks`
+	out=`load $scenario $PERF_COUNT`
+	cpu_after=`cpu_ticks`
+
+	ok=`echo "$out" | summary Success`
+	lost=`echo "$out" | summary Lost`
+	[ -n "$ok" ] && [ "$ok" -gt 0 ] || die "$scenario: no transactions succeeded"
+	[ "$lost" = "0" ] || echo "perf: $scenario: $lost packets lost" >&2
+
+	latency=`echo "$out" | sed -n 's/^[[:space:]]*Latency (ms)[[:space:]]*: //p'`
+	p50=`echo "$latency" | sed 's/.*p50: \([0-9.]*\).*/\1/'`
+	p99=`echo "$latency" | sed 's/.*p99: \([0-9.]*\).*/\1/'`
+	p999=`echo "$latency" | sed 's/.*p99\.9: \([0-9.]*\).*/\1/'`
+	throughput=`echo "$out" | summary 'Throughput (/s)'`
+
+	cpu=-
+	if [ -n "$cpu_before" ] && [ -n "$cpu_after" ] && [ -n "$HZ" ]; then
+		cpu=`awk -v a=$cpu_after -v b=$cpu_before -v hz=$HZ -v n=$ok 'BEGIN { printf "%.1f", (a - b) * 1000000 / hz / n }'`
+	fi
+
+	#
+	#  Allocations, with accounting on.
+	#
+	allocs=-
+	bytes=-
+	count=`expr $PERF_COUNT / 10`
+	[ $count -lt 100 ] && count=100
+	if radmin "debug memory_accounting on" > /dev/null; then
+		before=`alloc_total $servers`
+		aout=`load $scenario $count`
+		after=`alloc_total $servers`
+		radmin "debug memory_accounting off" > /dev/null
+
+		aok=`echo "$aout" | summary Success`
+		if [ -n "$aok" ] && [ "$aok" -gt 0 ]; then
+			allocs=`echo "$before $after" | awk -v n=$aok '{ printf "%.1f", ($3 - $1) / n }'`
+			bytes=`echo "$before $after" | awk -v n=$aok '{ printf "%.0f", ($4 - $2) / n }'`
+		fi
+	fi
+
+	printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" $scenario $ok $throughput $p50 $p99 $p999 $cpu $allocs $bytes | tee -a $RESULTS
+done
+
+stop
+
+#
+#  Compare with the baseline.
+#
+if [ -n "$PERF_BASELINE" ]; then
+	[ -r "$PERF_BASELINE" ] || die "Can't read baseline $PERF_BASELINE"
+
+	awk -F'\t' -v tol=$PERF_TOLERANCE '
+		/^#/ { next }
+		FNR == NR { base_tput[$1] = $3; base_p99[$1] = $5; next }
+		!($1 in base_tput) { next }
+		$3 < base_tput[$1] * (1 - tol / 100) {
+			printf "REGRESSION %s: throughput %s/s, was %s/s\n", $1, $3, base_tput[$1]; fail = 1
+		}
+		$5 > base_p99[$1] * (1 + tol / 100) {
+			printf "REGRESSION %s: p99 %sms, was %sms\n", $1, $5, base_p99[$1]; fail = 1
+		}
+		END { exit fail }' "$PERF_BASELINE" $RESULTS || exit 1
+fi
+
+exit 0
@@ -4,25 +4,15 @@
 
 #include <freeradius-devel/libradius.h>
 
-/*
- *	We need knowlege of the internal structures.
- *	This needs to be kept in lockstep with rbtree.c
- */
-
-/* RED-BLACK tree description */
+/* RED-BLACK tree description, as used by rbtree.c */
 typedef enum {
 	BLACK,
 	RED
 } node_colour_t;
 
-struct rbnode_t {
-    rbnode_t		*left;		//!< left child
-    rbnode_t		*right;		//!< right child
-    rbnode_t		*parent;	//!< Parent
-    node_colour_t	colour;		//!< Node colour (BLACK, RED)
-    void		*data;		//!< data stored in node
-};
-
+/*
+ *	rbtree_t is private to rbtree.c, so mirror it here.
+ */
 struct rbtree_t {
 #ifndef NDEBUG
 	uint32_t		magic;
@@ -32,6 +22,8 @@ struct rbtree_t {
 	rb_comparator_t		compare;
 	rb_free_t		free;
 	bool			replace;
+	bool			intrusive;
+	size_t			offset;
 #ifdef HAVE_PTHREAD_H
 	bool			lock;
 	pthread_mutex_t		mutex;
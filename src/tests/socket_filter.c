@@ -0,0 +1,194 @@
+/*
+ *	Check that fr_socket_filter_sources() drops packets from unlisted
+ *	sources, and accepts packets from listed ones, using real sockets
+ *	on the loopback interface.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <poll.h>
+
+#include <freeradius-devel/libradius.h>
+
+static int fail = 0;
+
+/*
+ *	fr_inet_pton() only recognises IPv6 addresses by their ':', so
+ *	ones beginning with a hex letter are taken for hostnames.
+ */
+static int parse(fr_ipaddr_t *out, char const *addr, int af)
+{
+	if (af == AF_INET) return fr_inet_pton4(out, addr, -1, false, false, true);
+
+	return fr_inet_pton6(out, addr, -1, false, false, true);
+}
+
+#define CHECK(_x, _msg) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "FAIL %s:%i: %s\n", __FILE__, __LINE__, _msg); \
+		fail++; \
+	} \
+} while (0)
+
+/*
+ *	Open a UDP socket bound to an address, with an ephemeral port.
+ */
+static int udp_bind(char const *addr, int af, uint16_t *port)
+{
+	fr_ipaddr_t		ipaddr;
+	struct sockaddr_storage	ss;
+	socklen_t		sslen;
+	int			fd;
+
+	if (parse(&ipaddr, addr, af) < 0) return -1;
+
+	fd = socket(af, SOCK_DGRAM, 0);
+	if (fd < 0) return -1;
+
+	if (!fr_ipaddr_to_sockaddr(&ipaddr, 0, &ss, &sslen) ||
+	    (bind(fd, (struct sockaddr *)&ss, sslen) < 0)) {
+		close(fd);
+		return -1;
+	}
+
+	if (port) {
+		sslen = sizeof(ss);
+		if (getsockname(fd, (struct sockaddr *)&ss, &sslen) < 0) {
+			close(fd);
+			return -1;
+		}
+		fr_ipaddr_from_sockaddr(&ss, sslen, &ipaddr, port);
+	}
+
+	return fd;
+}
+
+/*
+ *	Send a packet from src to the receiver, and say whether it
+ *	arrived.
+ */
+static bool delivered(int rx, char const *rx_addr, uint16_t rx_port, char const *src, int af)
+{
+	fr_ipaddr_t		dst;
+	struct sockaddr_storage	ss;
+	socklen_t		sslen;
+	struct pollfd		pfd;
+	uint8_t			buffer[16];
+	int			tx;
+	bool			ok = false;
+
+	if (parse(&dst, rx_addr, af) < 0) return false;
+	if (!fr_ipaddr_to_sockaddr(&dst, rx_port, &ss, &sslen)) return false;
+
+	tx = udp_bind(src, af, NULL);
+	if (tx < 0) {
+		fprintf(stderr, "Failed binding to %s: %s\n", src, fr_syserror(errno));
+		return false;
+	}
+
+	if (sendto(tx, "test", 4, 0, (struct sockaddr *)&ss, sslen) == 4) {
+		pfd.fd = rx;
+		pfd.events = POLLIN;
+
+		if ((poll(&pfd, 1, 100) == 1) && (recv(rx, buffer, sizeof(buffer), 0) == 4)) ok = true;
+	}
+	close(tx);
+
+	return ok;
+}
+
+static int filter(int fd, char const **sources, int num, int af)
+{
+	fr_ipaddr_t	ipaddr[8];
+	int		i;
+
+	for (i = 0; i < num; i++) {
+		if (parse(&ipaddr[i], sources[i], af) < 0) return -1;
+	}
+
+	return fr_socket_filter_sources(fd, ipaddr, num);
+}
+
+static void test_ipv4(void)
+{
+	char const	*hosts[] = { "192.0.2.1", "127.0.0.1" };
+	char const	*network[] = { "127.0.0.0/30" };
+	fr_ipaddr_t	*many;
+	uint16_t	port;
+	int		rx, i;
+
+	rx = udp_bind("127.0.0.1", AF_INET, &port);
+	if (rx < 0) {
+		fprintf(stderr, "Failed binding to 127.0.0.1: %s\n", fr_syserror(errno));
+		fail++;
+		return;
+	}
+
+	CHECK(delivered(rx, "127.0.0.1", port, "127.0.0.2", AF_INET), "unfiltered socket dropped a packet");
+
+	CHECK(filter(rx, hosts, 2, AF_INET) == 0, "failed attaching host filter");
+	CHECK(!delivered(rx, "127.0.0.1", port, "127.0.0.2", AF_INET), "packet from unlisted source accepted");
+	CHECK(delivered(rx, "127.0.0.1", port, "127.0.0.1", AF_INET), "packet from listed source dropped");
+
+	/*
+	 *	Re-attaching replaces the filter.
+	 */
+	CHECK(filter(rx, network, 1, AF_INET) == 0, "failed attaching network filter");
+	CHECK(delivered(rx, "127.0.0.1", port, "127.0.0.2", AF_INET), "packet from listed network dropped");
+	CHECK(!delivered(rx, "127.0.0.1", port, "127.0.0.5", AF_INET), "packet from outside network accepted");
+
+	/*
+	 *	No sources means nothing gets through.
+	 */
+	CHECK(fr_socket_filter_sources(rx, NULL, 0) == 0, "failed attaching empty filter");
+	CHECK(!delivered(rx, "127.0.0.1", port, "127.0.0.1", AF_INET), "packet accepted by empty filter");
+
+	/*
+	 *	Too many sources to fit in a program means no filter.
+	 */
+	many = calloc(4096, sizeof(*many));
+	for (i = 0; i < 4096; i++) {
+		many[i].af = AF_INET;
+		many[i].prefix = 32;
+		many[i].ipaddr.ip4addr.s_addr = htonl(0xc6120000 + i);	/* 198.18.0.0/15 */
+	}
+	CHECK(fr_socket_filter_sources(rx, many, 4096) == 1, "oversized filter wasn't rejected");
+	CHECK(delivered(rx, "127.0.0.1", port, "127.0.0.2", AF_INET), "packet dropped after oversized filter");
+	free(many);
+
+	close(rx);
+}
+
+static void test_ipv6(void)
+{
+	char const	*others[] = { "fd00::/8" };
+	char const	*loopback[] = { "fd00::1", "::1" };
+	uint16_t	port;
+	int		rx;
+
+	rx = udp_bind("::1", AF_INET6, &port);
+	if (rx < 0) {
+		fprintf(stderr, "No IPv6 loopback, skipping IPv6 tests\n");
+		return;
+	}
+
+	CHECK(filter(rx, others, 1, AF_INET6) == 0, "failed attaching IPv6 filter");
+	CHECK(!delivered(rx, "::1", port, "::1", AF_INET6), "packet from unlisted IPv6 source accepted");
+
+	CHECK(filter(rx, loopback, 2, AF_INET6) == 0, "failed attaching IPv6 filter");
+	CHECK(delivered(rx, "::1", port, "::1", AF_INET6), "packet from listed IPv6 source dropped");
+
+	close(rx);
+}
+
+int main(UNUSED int argc, UNUSED char *argv[])
+{
+	test_ipv4();
+	test_ipv6();
+
+	if (fail) {
+		fprintf(stderr, "%i checks failed\n", fail);
+		return 1;
+	}
+
+	return 0;
+}
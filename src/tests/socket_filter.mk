@@ -0,0 +1,6 @@
+TARGET := socket_filter
+
+SOURCES := socket_filter.c
+
+TGT_PREREQS	:= libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,275 @@
+/*
+ *	Tests for fr_thread_channel_t.
+ *
+ *	From one thread, checks that sends are cut short when the
+ *	other side's ring is full, and that a side's descriptor is
+ *	only signalled once it has found its ring empty.  Then a
+ *	master and a worker thread echo messages through small rings,
+ *	blocking in fr_thread_channel_wait() whenever they run out,
+ *	and check that everything arrives once, in order.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/thread_channel.h>
+
+#ifdef HAVE_STDATOMIC_H
+static int fail = 0;
+
+#define CHECK(_x, _msg) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "FAIL %s:%i: %s\n", __FILE__, __LINE__, _msg); \
+		fail++; \
+	} \
+} while (0)
+
+#define RING_SIZE	(8)
+#define NUM_MESSAGES	(200000)
+#define MAX_BATCH	(5)
+
+static int	messages[NUM_MESSAGES];
+
+/*
+ *	Whether a side's descriptor has been signalled, without
+ *	clearing it.
+ */
+static bool signalled(fr_thread_channel_t *ch, fr_thread_channel_side_t side)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fr_thread_channel_fd(ch, side);
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	return (poll(&pfd, 1, 0) == 1);
+}
+
+/*
+ *	Send one message to the worker, once it's had time to block.
+ */
+static void *send_later(void *arg)
+{
+	fr_thread_channel_t	*ch = arg;
+	void			*msg = &messages[0];
+
+	usleep(100000);
+	(void) fr_thread_channel_send(ch, FR_THREAD_CHANNEL_MASTER, &msg, 1);
+
+	return NULL;
+}
+
+static void test_boundaries(void)
+{
+	fr_thread_channel_t	*ch;
+	pthread_t		thread;
+	void			*in[RING_SIZE * 2], *out[RING_SIZE * 2];
+	int			i;
+
+	for (i = 0; i < RING_SIZE * 2; i++) in[i] = &messages[i];
+
+	ch = fr_thread_channel_create(NULL, RING_SIZE);
+	if (!ch) {
+		fprintf(stderr, "Failed creating channel: %s\n", fr_strerror());
+		fail++;
+		return;
+	}
+
+	/*
+	 *	Full.  The sender sees the back-pressure directly.
+	 */
+	CHECK(fr_thread_channel_send(ch, FR_THREAD_CHANNEL_MASTER, in, RING_SIZE * 2) == RING_SIZE,
+	      "send wasn't limited to the room left");
+	CHECK(fr_thread_channel_send(ch, FR_THREAD_CHANNEL_MASTER, in, 1) == 0, "sent to a full ring");
+	CHECK(fr_thread_channel_num_elements(ch, FR_THREAD_CHANNEL_WORKER) == RING_SIZE, "wrong number of messages");
+
+	/*
+	 *	The two directions are independent.
+	 */
+	CHECK(fr_thread_channel_num_elements(ch, FR_THREAD_CHANNEL_MASTER) == 0, "message went the wrong way");
+	CHECK(fr_thread_channel_recv(ch, FR_THREAD_CHANNEL_MASTER, out, RING_SIZE) == 0, "message went the wrong way");
+
+	/*
+	 *	The worker hasn't found its ring empty, so it doesn't
+	 *	need waking.
+	 */
+	CHECK(!signalled(ch, FR_THREAD_CHANNEL_WORKER), "busy side was signalled");
+
+	CHECK(fr_thread_channel_recv(ch, FR_THREAD_CHANNEL_WORKER, out, 3) == 3, "recv failed");
+	CHECK(fr_thread_channel_send(ch, FR_THREAD_CHANNEL_MASTER, in + RING_SIZE, RING_SIZE) == 3,
+	      "send wasn't limited to the room left");
+	CHECK(!signalled(ch, FR_THREAD_CHANNEL_WORKER), "busy side was signalled");
+
+	CHECK(fr_thread_channel_recv(ch, FR_THREAD_CHANNEL_WORKER, out + 3, RING_SIZE * 2) == RING_SIZE,
+	      "recv didn't empty the ring");
+	for (i = 0; i < RING_SIZE + 3; i++) CHECK(out[i] == in[i], "received the wrong message");
+
+	/*
+	 *	Empty.  Now the worker wants waking, once.
+	 */
+	CHECK(fr_thread_channel_recv(ch, FR_THREAD_CHANNEL_WORKER, out, RING_SIZE) == 0, "received from an empty ring");
+	CHECK(!signalled(ch, FR_THREAD_CHANNEL_WORKER), "signalled without a send");
+
+	CHECK(fr_thread_channel_send(ch, FR_THREAD_CHANNEL_MASTER, in, 2) == 2, "send failed");
+	CHECK(signalled(ch, FR_THREAD_CHANNEL_WORKER), "waiting side wasn't signalled");
+	CHECK(fr_thread_channel_wait(ch, FR_THREAD_CHANNEL_WORKER) == 1, "wait didn't see the messages");
+
+	CHECK(fr_thread_channel_send(ch, FR_THREAD_CHANNEL_MASTER, in + 2, 2) == 2, "send failed");
+	CHECK(fr_thread_channel_recv(ch, FR_THREAD_CHANNEL_WORKER, out, RING_SIZE) == 4, "recv failed");
+
+	/*
+	 *	The signal for the first send is still pending, but it
+	 *	isn't a wake up with nothing to receive.  So wait has
+	 *	to block until there's something to receive.
+	 */
+	pthread_create(&thread, NULL, send_later, ch);
+	CHECK(fr_thread_channel_wait(ch, FR_THREAD_CHANNEL_WORKER) == 1, "wait returned on a stale signal");
+	pthread_join(thread, NULL);
+	CHECK(fr_thread_channel_recv(ch, FR_THREAD_CHANNEL_WORKER, out, RING_SIZE) == 1, "recv failed");
+
+	/*
+	 *	A signal without messages.
+	 */
+	fr_thread_channel_signal(ch, FR_THREAD_CHANNEL_WORKER);
+	CHECK(fr_thread_channel_wait(ch, FR_THREAD_CHANNEL_WORKER) == 0, "wait didn't return on a signal");
+
+	talloc_free(ch);
+}
+
+/*
+ *	Send everything to the master, as it arrives.  When the
+ *	master's ring is full, keep trying until it has room.
+ */
+static void *worker(void *arg)
+{
+	fr_thread_channel_t	*ch = arg;
+	int			done = 0, next = 0, errors = 0;
+
+	while (done < NUM_MESSAGES) {
+		void	*batch[MAX_BATCH + 2];
+		size_t	got, sent, i;
+
+		got = fr_thread_channel_recv(ch, FR_THREAD_CHANNEL_WORKER, batch, 1 + (done % (MAX_BATCH + 2)));
+		if (!got) {
+			if (fr_thread_channel_wait(ch, FR_THREAD_CHANNEL_WORKER) < 0) {
+				fprintf(stderr, "FAIL: worker wait failed: %s\n", fr_strerror());
+				errors++;
+				break;
+			}
+			continue;
+		}
+
+		for (i = 0; i < got; i++) {
+			if ((batch[i] != &messages[next]) && (errors++ < 10)) {
+				fprintf(stderr, "FAIL: worker expected message %i\n", next);
+			}
+			next = ((int *) batch[i] - messages) + 1;
+		}
+
+		for (sent = 0; sent < got; ) {
+			size_t num;
+
+			num = fr_thread_channel_send(ch, FR_THREAD_CHANNEL_WORKER, batch + sent, got - sent);
+			if (!num) sched_yield();
+			sent += num;
+		}
+
+		done += got;
+	}
+
+	return (void *)(intptr_t) errors;
+}
+
+/*
+ *	Send everything to the worker, and receive it back.  Block
+ *	when there's no room to send, and nothing to receive.
+ */
+static void test_echo(void)
+{
+	fr_thread_channel_t	*ch;
+	pthread_t		thread;
+	void			*rcode;
+	int			sent = 0, received = 0;
+	uint32_t		seed = 1;
+
+	ch = fr_thread_channel_create(NULL, RING_SIZE);
+	if (!ch) {
+		fprintf(stderr, "Failed creating channel: %s\n", fr_strerror());
+		fail++;
+		return;
+	}
+
+	pthread_create(&thread, NULL, worker, ch);
+
+	while (received < NUM_MESSAGES) {
+		void	*batch[MAX_BATCH + 2];
+		size_t	num, got, i;
+
+		num = 0;
+		if (sent < NUM_MESSAGES) {
+			seed = (seed * 1103515245) + 12345;
+			num = 1 + ((seed >> 8) % MAX_BATCH);
+			if (num > (size_t) (NUM_MESSAGES - sent)) num = NUM_MESSAGES - sent;
+
+			for (i = 0; i < num; i++) batch[i] = &messages[sent + i];
+
+			num = fr_thread_channel_send(ch, FR_THREAD_CHANNEL_MASTER, batch, num);
+			sent += num;
+		}
+
+		got = fr_thread_channel_recv(ch, FR_THREAD_CHANNEL_MASTER, batch, 1 + (received % (MAX_BATCH + 2)));
+		for (i = 0; i < got; i++) {
+			if (batch[i] != &messages[received]) {
+				fprintf(stderr, "FAIL: master expected message %i\n", received);
+				fail++;
+			}
+			received++;
+		}
+
+		if (num || got) continue;
+
+		if (fr_thread_channel_wait(ch, FR_THREAD_CHANNEL_MASTER) < 0) {
+			fprintf(stderr, "FAIL: master wait failed: %s\n", fr_strerror());
+			fail++;
+			break;
+		}
+	}
+
+	pthread_join(thread, &rcode);
+	fail += (int)(intptr_t) rcode;
+
+	CHECK(fr_thread_channel_num_elements(ch, FR_THREAD_CHANNEL_MASTER) == 0, "messages left for the master");
+	CHECK(fr_thread_channel_num_elements(ch, FR_THREAD_CHANNEL_WORKER) == 0, "messages left for the worker");
+
+	talloc_free(ch);
+}
+
+int main(UNUSED int argc, UNUSED char *argv[])
+{
+	/*
+	 *	A lost wakeup leaves both threads blocked.
+	 */
+	alarm(60);
+
+	test_boundaries();
+	test_echo();
+
+	if (fail) {
+		fprintf(stderr, "%i checks failed\n", fail);
+		return 1;
+	}
+
+	return 0;
+}
+#else
+int main(UNUSED int argc, UNUSED char *argv[])
+{
+	fprintf(stderr, "No <stdatomic.h>, skipping tests\n");
+
+	return 0;
+}
+#endif
@@ -0,0 +1,6 @@
+TARGET := thread_channel_test
+
+SOURCES := thread_channel_test.c
+
+TGT_PREREQS	:= libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)